@@ -16,18 +16,172 @@
 #include "qemu-common.h"
 #include "block/block.h"
 #include "qemu/queue.h"
+#include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    bool poll_ready;
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
+    QLIST_ENTRY(AioHandler) node_ready; /* only used in epoll mode */
 };
 
+typedef QLIST_HEAD(, AioHandler) AioHandlerList;
+
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* ppoll() is cheaper than epoll for a few file descriptors, because epoll
+ * needs a system call whenever a handler changes.  Switch to epoll once
+ * an aio_poll() call has this many file descriptors to register.
+ */
+#define EPOLL_ENABLE_THRESHOLD 64
+#define EPOLL_MAX_EVENTS 128
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static inline int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+/* Register @node with epoll, update its events, or unregister it if it
+ * does not wait for any event anymore.
+ */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event = {
+        .events = epoll_events_from_pfd(node->pfd.events),
+        .data.ptr = node,
+    };
+    int op;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl(ctx->epollfd, op, node->pfd.fd, &event)) {
+        /* e.g. a regular file, which epoll does not support */
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Register all handlers with epoll, so that the next aio_poll() calls do
+ * not have to build the pollfds array anymore.
+ */
+static void aio_epoll_try_enable(AioContext *ctx, unsigned nfds)
+{
+    AioHandler *node;
+
+    if (!ctx->epoll_available || nfds < EPOLL_ENABLE_THRESHOLD) {
+        return;
+    }
+    if (ctx->epollfd < 0) {
+        ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (ctx->epollfd < 0) {
+            aio_epoll_disable(ctx);
+            return;
+        }
+    }
+
+    ctx->epoll_enabled = true;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events) {
+            aio_epoll_update(ctx, node, true);
+        }
+    }
+}
+
+static inline bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+    ctx->epollfd = -1;
+    ctx->epoll_available = true;
+    ctx->epoll_enabled = false;
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+    }
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static void aio_epoll_try_enable(AioContext *ctx, unsigned nfds)
+{
+}
+
+static inline bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+#endif
+
+/* Add @node to the handlers that aio_poll() dispatches.  If a nested
+ * aio_poll() finds the handler ready again, it takes it from the list of
+ * the outer call.
+ */
+static void aio_add_ready_handler(AioHandlerList *ready_list,
+                                  AioHandler *node)
+{
+    if (node->node_ready.le_prev) {
+        QLIST_REMOVE(node, node_ready);
+    }
+    QLIST_INSERT_HEAD(ready_list, node, node_ready);
+}
+
+static void aio_remove_ready_handler(AioHandler *node)
+{
+    QLIST_REMOVE(node, node_ready);
+    node->node_ready.le_prev = NULL;
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -55,36 +209,53 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
                 node->pfd.revents = 0;
+                ctx->handlers_deleted = true;
             } else {
                 /* Otherwise, delete it for real.  We can't just mark it as
                  * deleted because deleted nodes are only cleaned up after
                  * releasing the walking_handlers lock.
                  */
+                assert(!node->node_ready.le_prev);
                 QLIST_REMOVE(node, node);
                 g_free(node);
             }
         }
     } else {
+        bool is_new = false;
+        int old_events;
+
         if (node == NULL) {
-            /* Alloc and insert if it's not already there */
+            /* Alloc and insert if it's not already there.  A concurrent
+             * run_poll_handlers() may be walking the list.
+             */
             node = g_new0(AioHandler, 1);
             node->pfd.fd = fd;
-            QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
+            QLIST_INSERT_HEAD_RCU(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
         node->io_write = io_write;
         node->opaque = opaque;
+        if (!io_read) {
+            node->io_poll = NULL;
+        }
 
+        old_events = node->pfd.events;
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        if (is_new || node->pfd.events != old_events) {
+            aio_epoll_update(ctx, node, is_new);
+        }
     }
 
     aio_notify(ctx);
@@ -98,6 +269,37 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    assert(node && node->io_read);
+    node->io_poll = io_poll;
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "AioContext polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -122,6 +324,54 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
+/* Run the handlers of @node for the events in node->pfd.revents */
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+{
+    bool progress = false;
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (!node->deleted &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+
+        /* aio_notify() does not count as progress */
+        if (node->opaque != &ctx->notifier) {
+            progress = true;
+        }
+    }
+    if (!node->deleted &&
+        (revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+        progress = true;
+    }
+
+    return progress;
+}
+
+/* Free the handlers that were deleted while the list was being walked */
+static void aio_free_deleted_handlers(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+
+    if (ctx->walking_handlers || !ctx->handlers_deleted) {
+        return;
+    }
+
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted) {
+            assert(!node->node_ready.le_prev);
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+    ctx->handlers_deleted = false;
+}
+
 bool aio_dispatch(AioContext *ctx)
 {
     AioHandler *node;
@@ -143,27 +393,10 @@ bool aio_dispatch(AioContext *ctx)
     node = QLIST_FIRST(&ctx->aio_handlers);
     while (node) {
         AioHandler *tmp;
-        int revents;
 
         ctx->walking_handlers++;
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
-
-        if (!node->deleted &&
-            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
-
-            /* aio_notify() does not count as progress */
-            if (node->opaque != &ctx->notifier) {
-                progress = true;
-            }
-        }
-        if (!node->deleted &&
-            (revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
+        if (aio_dispatch_handler(ctx, node)) {
             progress = true;
         }
 
@@ -208,6 +441,64 @@ static void pollfds_cleanup(Notifier *n, void *unused)
     nalloc = 0;
 }
 
+/* Call the poll functions of the handlers until one of them has work to
+ * do, someone calls aio_notify, or @max_ns nanoseconds have passed.
+ * Handlers that are ready are marked with poll_ready.
+ *
+ * This runs without the AioContext lock, but the caller's walking_handlers
+ * reference keeps the handlers from being freed.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    bool progress = false;
+    AioHandler *node;
+
+    do {
+        QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll &&
+                node->io_poll(node->opaque)) {
+                node->poll_ready = true;
+                progress = true;
+            }
+        }
+        if (atomic_read(&ctx->notified)) {
+            progress = true;
+        }
+    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+/* Adjust the polling window after aio_poll blocked for @block_ns
+ * nanoseconds, including the time spent polling.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling caught the event, keep the window as it is */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* The event took too long to be worth polling for, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* A longer window would have caught the event, poll more */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start with 4 microseconds */
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
 static void add_pollfd(AioHandler *node)
 {
     if (npfd == nalloc) {
@@ -230,15 +521,56 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+/* Wait for the epoll file descriptor and put the ready handlers in nodes[],
+ * with their events in pollfds[].
+ */
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int i, ret;
+
+    if (timeout > 0) {
+        /* epoll_wait() only has millisecond resolution */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN,
+        };
+
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+
+    ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                     timeout < 0 ? -1 : 0);
+    for (i = 0; i < ret; i++) {
+        add_pollfd(events[i].data.ptr);
+        pollfds[npfd - 1].revents = pfd_events_from_epoll(events[i].events);
+    }
+    return ret;
+}
+#else
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+#endif
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
+    AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
     int i, ret;
-    bool progress;
-    int64_t timeout;
+    bool progress, use_epoll, polled = false;
+    int64_t timeout, poll_timeout;
+    int64_t start = 0, wait_start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
+    atomic_set(&ctx->stats.iterations, ctx->stats.iterations + 1);
 
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -255,23 +587,58 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events) {
-            add_pollfd(node);
+    /* With epoll, the file descriptors are already registered and nodes[]
+     * only receives the ready handlers.
+     */
+    use_epoll = aio_epoll_enabled(ctx);
+    if (!use_epoll) {
+        /* fill pollfds */
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events) {
+                add_pollfd(node);
+            }
         }
+        aio_epoll_try_enable(ctx, npfd);
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    poll_timeout = timeout;
 
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
     }
-    ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+    if (timeout && ctx->poll_max_ns) {
+        /* Busy poll for a while before going to sleep.  If something is
+         * ready, still look at the file descriptors, but without blocking.
+         */
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns &&
+            run_poll_handlers(ctx, timeout < 0 ? ctx->poll_ns :
+                                   MIN(ctx->poll_ns, timeout))) {
+            poll_timeout = 0;
+            polled = true;
+            atomic_set(&ctx->stats.poll_hits, ctx->stats.poll_hits + 1);
+        }
+    }
+    if (poll_timeout) {
+        wait_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    if (use_epoll) {
+        ret = aio_epoll(ctx, poll_timeout);
+    } else {
+        ret = qemu_poll_ns((GPollFD *)pollfds, npfd, poll_timeout);
+    }
     if (blocking) {
         atomic_sub(&ctx->notify_me, 2);
     }
+    if (wait_start) {
+        atomic_set(&ctx->stats.wait_ns, ctx->stats.wait_ns +
+                   qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - wait_start);
+    }
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
     if (timeout) {
         aio_context_acquire(ctx);
     }
@@ -282,15 +649,48 @@ bool aio_poll(AioContext *ctx, bool blocking)
     if (ret > 0) {
         for (i = 0; i < npfd; i++) {
             nodes[i]->pfd.revents = pollfds[i].revents;
+            if (use_epoll) {
+                aio_add_ready_handler(&ready_list, nodes[i]);
+            }
+        }
+    }
+
+    /* handlers found ready by busy polling are dispatched like readable fds */
+    if (polled) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (node->poll_ready) {
+                node->pfd.revents |= G_IO_IN;
+                node->poll_ready = false;
+                if (use_epoll) {
+                    aio_add_ready_handler(&ready_list, node);
+                }
+            }
         }
     }
 
     npfd = 0;
-    ctx->walking_handlers--;
 
-    /* Run dispatch even if there were no readable fds to run timers */
-    if (aio_dispatch(ctx)) {
-        progress = true;
+    if (use_epoll) {
+        /* Same as aio_dispatch(), but only look at the ready handlers */
+        if (aio_bh_poll(ctx)) {
+            progress = true;
+        }
+        while ((node = QLIST_FIRST(&ready_list))) {
+            aio_remove_ready_handler(node);
+            if (aio_dispatch_handler(ctx, node)) {
+                progress = true;
+            }
+        }
+        ctx->walking_handlers--;
+        aio_free_deleted_handlers(ctx);
+        progress |= timerlistgroup_run_timers(&ctx->tlg);
+    } else {
+        ctx->walking_handlers--;
+
+        /* Run dispatch even if there were no readable fds to run timers */
+        if (aio_dispatch(ctx)) {
+            progress = true;
+        }
     }
 
     aio_context_release(ctx);
@@ -0,0 +1,263 @@
+/*
+ * Atomic helper templates
+ * Included from cputlb.c and user-exec.c.
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The includer defines DATA_SIZE and:
+ *
+ * ATOMIC_MMU_DECLS    declarations needed by the two macros below
+ * ATOMIC_MMU_LOOKUP   the host address of the DATA_SIZE bytes at @addr,
+ *                     or NULL if they can't be accessed with host atomic
+ *                     operations; in that case the operation is done with
+ *                     the softmmu load and store helpers instead
+ * ATOMIC_MMU_CLEANUP  run after a successful host atomic operation
+ */
+
+#if DATA_SIZE == 8
+#define SUFFIX     q
+#define LSUFFIX    q
+#define DATA_TYPE  uint64_t
+#define ABI_TYPE   uint64_t
+#define BSWAP      bswap64
+#elif DATA_SIZE == 4
+#define SUFFIX     l
+#define LSUFFIX    ul
+#define DATA_TYPE  uint32_t
+#define ABI_TYPE   uint32_t
+#define BSWAP      bswap32
+#elif DATA_SIZE == 2
+#define SUFFIX     w
+#define LSUFFIX    uw
+#define DATA_TYPE  uint16_t
+#define ABI_TYPE   uint32_t
+#define BSWAP      bswap16
+#elif DATA_SIZE == 1
+#define SUFFIX     b
+#define LSUFFIX    ub
+#define DATA_TYPE  uint8_t
+#define ABI_TYPE   uint32_t
+#define BSWAP
+#else
+#error unsupported data size
+#endif
+
+#define ATOMIC_NAME(X) HELPER(glue(glue(atomic_ ## X, SUFFIX), END_SUFFIX))
+
+/* First the operations in host byte order, which map directly to host
+   atomic operations.  */
+#if DATA_SIZE == 1
+#define END_SUFFIX
+#define SLOW_LD    glue(glue(helper_ret_ld, LSUFFIX), MMUSUFFIX)
+#define SLOW_ST    glue(glue(helper_ret_st, SUFFIX), MMUSUFFIX)
+#elif defined(HOST_WORDS_BIGENDIAN)
+#define END_SUFFIX _be
+#define SLOW_LD    glue(glue(helper_be_ld, LSUFFIX), MMUSUFFIX)
+#define SLOW_ST    glue(glue(helper_be_st, SUFFIX), MMUSUFFIX)
+#else
+#define END_SUFFIX _le
+#define SLOW_LD    glue(glue(helper_le_ld, LSUFFIX), MMUSUFFIX)
+#define SLOW_ST    glue(glue(helper_le_st, SUFFIX), MMUSUFFIX)
+#endif
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    ATOMIC_MMU_DECLS
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;
+    DATA_TYPE ret;
+
+#ifndef CONFIG_USER_ONLY
+    if (unlikely(!haddr)) {
+        ret = SLOW_LD(env, addr, oi, GETRA());
+        if (ret == (DATA_TYPE)cmpv) {
+            SLOW_ST(env, addr, newv, oi, GETRA());
+        }
+        return ret;
+    }
+#endif
+    ret = atomic_cmpxchg(haddr, (DATA_TYPE)cmpv, (DATA_TYPE)newv);
+    ATOMIC_MMU_CLEANUP;
+    return ret;
+}
+
+ABI_TYPE ATOMIC_NAME(xchg)(CPUArchState *env, target_ulong addr,
+                           ABI_TYPE val, uint32_t oi)
+{
+    ATOMIC_MMU_DECLS
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;
+    DATA_TYPE ret;
+
+#ifndef CONFIG_USER_ONLY
+    if (unlikely(!haddr)) {
+        ret = SLOW_LD(env, addr, oi, GETRA());
+        SLOW_ST(env, addr, val, oi, GETRA());
+        return ret;
+    }
+#endif
+    ret = atomic_xchg(haddr, (DATA_TYPE)val);
+    ATOMIC_MMU_CLEANUP;
+    return ret;
+}
+
+#ifdef CONFIG_USER_ONLY
+#define GEN_ATOMIC_SLOW(X, OP)
+#else
+#define GEN_ATOMIC_SLOW(X, OP)                                  \
+    if (unlikely(!haddr)) {                                     \
+        ret = SLOW_LD(env, addr, oi, GETRA());                  \
+        SLOW_ST(env, addr, ret OP val, oi, GETRA());            \
+        return ret;                                             \
+    }
+#endif
+
+#define GEN_ATOMIC_HELPER(X, OP)                                \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,  \
+                        ABI_TYPE val, uint32_t oi)              \
+{                                                               \
+    ATOMIC_MMU_DECLS                                            \
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;                       \
+    DATA_TYPE ret;                                              \
+                                                                \
+    GEN_ATOMIC_SLOW(X, OP)                                      \
+    ret = glue(atomic_, X)(haddr, (DATA_TYPE)val);              \
+    ATOMIC_MMU_CLEANUP;                                         \
+    return ret;                                                 \
+}
+
+GEN_ATOMIC_HELPER(fetch_add, +)
+GEN_ATOMIC_HELPER(fetch_and, &)
+GEN_ATOMIC_HELPER(fetch_or, |)
+GEN_ATOMIC_HELPER(fetch_xor, ^)
+
+#undef GEN_ATOMIC_HELPER
+#undef GEN_ATOMIC_SLOW
+#undef END_SUFFIX
+#undef SLOW_LD
+#undef SLOW_ST
+
+/* Then the operations in the opposite byte order, which swap the bytes
+   around host atomic operations.  Arithmetic can't be done on swapped
+   data, so it loops on a compare-and-swap.  */
+#if DATA_SIZE > 1
+
+#ifdef HOST_WORDS_BIGENDIAN
+#define END_SUFFIX _le
+#define SLOW_LD    glue(glue(helper_le_ld, LSUFFIX), MMUSUFFIX)
+#define SLOW_ST    glue(glue(helper_le_st, SUFFIX), MMUSUFFIX)
+#else
+#define END_SUFFIX _be
+#define SLOW_LD    glue(glue(helper_be_ld, LSUFFIX), MMUSUFFIX)
+#define SLOW_ST    glue(glue(helper_be_st, SUFFIX), MMUSUFFIX)
+#endif
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    ATOMIC_MMU_DECLS
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;
+    DATA_TYPE ret;
+
+#ifndef CONFIG_USER_ONLY
+    if (unlikely(!haddr)) {
+        ret = SLOW_LD(env, addr, oi, GETRA());
+        if (ret == (DATA_TYPE)cmpv) {
+            SLOW_ST(env, addr, newv, oi, GETRA());
+        }
+        return ret;
+    }
+#endif
+    ret = atomic_cmpxchg(haddr, BSWAP((DATA_TYPE)cmpv),
+                         BSWAP((DATA_TYPE)newv));
+    ATOMIC_MMU_CLEANUP;
+    return BSWAP(ret);
+}
+
+ABI_TYPE ATOMIC_NAME(xchg)(CPUArchState *env, target_ulong addr,
+                           ABI_TYPE val, uint32_t oi)
+{
+    ATOMIC_MMU_DECLS
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;
+    DATA_TYPE ret;
+
+#ifndef CONFIG_USER_ONLY
+    if (unlikely(!haddr)) {
+        ret = SLOW_LD(env, addr, oi, GETRA());
+        SLOW_ST(env, addr, val, oi, GETRA());
+        return ret;
+    }
+#endif
+    ret = atomic_xchg(haddr, BSWAP((DATA_TYPE)val));
+    ATOMIC_MMU_CLEANUP;
+    return BSWAP(ret);
+}
+
+#ifdef CONFIG_USER_ONLY
+#define GEN_ATOMIC_SLOW(X, OP)
+#else
+#define GEN_ATOMIC_SLOW(X, OP)                                  \
+    if (unlikely(!haddr)) {                                     \
+        ret = SLOW_LD(env, addr, oi, GETRA());                  \
+        SLOW_ST(env, addr, ret OP val, oi, GETRA());            \
+        return ret;                                             \
+    }
+#endif
+
+#define GEN_ATOMIC_HELPER(X, OP)                                \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,  \
+                        ABI_TYPE val, uint32_t oi)              \
+{                                                               \
+    ATOMIC_MMU_DECLS                                            \
+    DATA_TYPE *haddr = ATOMIC_MMU_LOOKUP;                       \
+    DATA_TYPE ldo, ldn, ret, sto;                               \
+                                                                \
+    GEN_ATOMIC_SLOW(X, OP)                                      \
+    ldo = atomic_read(haddr);                                   \
+    while (1) {                                                 \
+        ret = BSWAP(ldo);                                       \
+        sto = BSWAP((DATA_TYPE)(ret OP val));                   \
+        ldn = atomic_cmpxchg(haddr, ldo, sto);                  \
+        if (ldn == ldo) {                                       \
+            break;                                              \
+        }                                                       \
+        ldo = ldn;                                              \
+    }                                                           \
+    ATOMIC_MMU_CLEANUP;                                         \
+    return ret;                                                 \
+}
+
+GEN_ATOMIC_HELPER(fetch_add, +)
+GEN_ATOMIC_HELPER(fetch_and, &)
+GEN_ATOMIC_HELPER(fetch_or, |)
+GEN_ATOMIC_HELPER(fetch_xor, ^)
+
+#undef GEN_ATOMIC_HELPER
+#undef GEN_ATOMIC_SLOW
+#undef END_SUFFIX
+#undef SLOW_LD
+#undef SLOW_ST
+
+#endif /* DATA_SIZE > 1 */
+
+#undef ATOMIC_NAME
+#undef BSWAP
+#undef ABI_TYPE
+#undef DATA_TYPE
+#undef LSUFFIX
+#undef SUFFIX
+#undef DATA_SIZE
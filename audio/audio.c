@@ -26,6 +26,7 @@
 #include "monitor/monitor.h"
 #include "qemu/timer.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/stats.h"
 
 #define AUDIO_CAP "audio"
 #include "audio_int.h"
@@ -1124,6 +1125,50 @@ static void audio_timer (void *opaque)
     audio_reset_timer (opaque);
 }
 
+/*
+ * Statistics
+ */
+static uint64_t audio_frames_to_us (int frames, int freq)
+{
+    return freq > 0 ? muldiv64 (frames, 1000000, freq) : 0;
+}
+
+/*
+ * The latency is that of the samples QEMU holds, mixed but not yet taken
+ * by the backend or captured but not yet read by the device.  Buffering
+ * in the backend and in the host sound system comes on top.
+ */
+static void audio_stats_query (StatsSink *sink, void *opaque)
+{
+    HWVoiceOut *hwo = NULL;
+    HWVoiceIn *hwi = NULL;
+    SWVoiceOut *swo;
+    SWVoiceIn *swi;
+
+    while ((hwo = audio_pcm_hw_find_any_out (hwo))) {
+        for (swo = hwo->sw_head.lh_first; swo; swo = swo->entries.le_next) {
+            stats_add_instance (sink, "out:%s", SW_NAME (swo));
+            stats_add_counter (sink, "frames", swo->frames);
+            stats_add_counter (sink, "underruns", swo->underruns);
+            stats_add_counter (sink, "latency-us",
+                               audio_frames_to_us (swo->total_hw_samples_mixed,
+                                                   hwo->info.freq));
+        }
+    }
+    while ((hwi = audio_pcm_hw_find_any_in (hwi))) {
+        for (swi = hwi->sw_head.lh_first; swi; swi = swi->entries.le_next) {
+            int live = hwi->total_samples_captured -
+                       swi->total_hw_samples_acquired;
+
+            stats_add_instance (sink, "in:%s", SW_NAME (swi));
+            stats_add_counter (sink, "frames", swi->frames);
+            stats_add_counter (sink, "latency-us",
+                               audio_frames_to_us (MAX (live, 0),
+                                                   hwi->info.freq));
+        }
+    }
+}
+
 /*
  * Public API
  */
@@ -1142,6 +1187,7 @@ int AUD_write (SWVoiceOut *sw, void *buf, int size)
     }
 
     bytes = sw->hw->pcm_ops->write (sw, buf, size);
+    sw->frames += bytes >> sw->info.shift;
     return bytes;
 }
 
@@ -1160,6 +1206,7 @@ int AUD_read (SWVoiceIn *sw, void *buf, int size)
     }
 
     bytes = sw->hw->pcm_ops->read (sw, buf, size);
+    sw->frames += bytes >> sw->info.shift;
     return bytes;
 }
 
@@ -1380,6 +1427,7 @@ static void audio_run_out (AudioState *s)
         if (!live) {
             for (sw = hw->sw_head.lh_first; sw; sw = sw->entries.le_next) {
                 if (sw->active) {
+                    sw->underruns++;
                     free = audio_get_free (sw);
                     if (free > 0) {
                         sw->callback.fn (sw->callback.opaque, free);
@@ -1805,6 +1853,8 @@ static void audio_init (void)
     QLIST_INIT (&s->cap_head);
     atexit (audio_atexit);
 
+    stats_register_provider (STATS_PROVIDER_AUDIO, audio_stats_query, s);
+
     s->ts = timer_new_ns(QEMU_CLOCK_VIRTUAL, audio_timer, s);
     if (!s->ts) {
         hw_error("Could not create audio timer\n");
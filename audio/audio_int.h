@@ -121,6 +121,8 @@ struct SWVoiceOut {
     char *name;
     struct mixeng_volume vol;
     struct audio_callback callback;
+    uint64_t frames;
+    uint64_t underruns;
     QLIST_ENTRY (SWVoiceOut) entries;
 };
 
@@ -137,6 +139,7 @@ struct SWVoiceIn {
     char *name;
     struct mixeng_volume vol;
     struct audio_callback callback;
+    uint64_t frames;
     QLIST_ENTRY (SWVoiceIn) entries;
 };
 
@@ -353,6 +353,17 @@ void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
         return;
     }
 
+    /* Nominal volume, as set for every voice at creation */
+#ifdef FLOAT_MIXENG
+    if (vol->l == 1.0 && vol->r == 1.0) {
+        return;
+    }
+#else
+    if (vol->l == 1ULL << 32 && vol->r == 1ULL << 32) {
+        return;
+    }
+#endif
+
     while (len--) {
 #ifdef FLOAT_MIXENG
         buf->l = buf->l * vol->l;
@@ -0,0 +1,155 @@
+/*
+ * QEMU Host Memory Backend for memfd
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "sysemu/hostmem.h"
+#include "qom/object_interfaces.h"
+#include "qemu/memfd.h"
+
+/**
+ * @TYPE_MEMORY_BACKEND_MEMFD:
+ * name of backend that uses mmap on a memfd, which other processes can
+ * map as well without a hugetlbfs mount or a file name
+ */
+#define TYPE_MEMORY_BACKEND_MEMFD "memory-backend-memfd"
+
+#define MEMORY_BACKEND_MEMFD(obj) \
+    OBJECT_CHECK(HostMemoryBackendMemfd, (obj), TYPE_MEMORY_BACKEND_MEMFD)
+
+typedef struct HostMemoryBackendMemfd HostMemoryBackendMemfd;
+
+struct HostMemoryBackendMemfd {
+    HostMemoryBackend parent_obj;
+
+    bool share;
+    bool hugetlb;
+    bool seal;
+};
+
+static void
+memfd_backend_memory_alloc(HostMemoryBackend *backend, Error **errp)
+{
+    HostMemoryBackendMemfd *mb = MEMORY_BACKEND_MEMFD(backend);
+    Error *local_err = NULL;
+    char *name;
+    int fd;
+
+    if (!backend->size) {
+        error_setg(errp, "can't create backend with size 0");
+        return;
+    }
+    if (memory_region_size(&backend->mr)) {
+        return;
+    }
+
+    name = object_get_canonical_path_component(OBJECT(backend));
+    /* the size is fixed: the memory can be mapped, but never resized */
+    fd = qemu_memfd_create(name, backend->size, mb->hugetlb,
+                           mb->seal ?
+                           F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL : 0,
+                           errp);
+    if (fd < 0) {
+        g_free(name);
+        return;
+    }
+    memory_region_init_ram_from_fd(&backend->mr, OBJECT(backend), name,
+                                   backend->size, mb->share, fd, &local_err);
+    g_free(name);
+    if (local_err) {
+        close(fd);
+        error_propagate(errp, local_err);
+    }
+}
+
+static void
+memfd_backend_class_init(ObjectClass *oc, void *data)
+{
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(oc);
+
+    bc->alloc = memfd_backend_memory_alloc;
+}
+
+static bool memfd_backend_get_share(Object *o, Error **errp)
+{
+    return MEMORY_BACKEND_MEMFD(o)->share;
+}
+
+static void memfd_backend_set_share(Object *o, bool value, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(o);
+
+    if (memory_region_size(&backend->mr)) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+    MEMORY_BACKEND_MEMFD(o)->share = value;
+}
+
+static bool memfd_backend_get_hugetlb(Object *o, Error **errp)
+{
+    return MEMORY_BACKEND_MEMFD(o)->hugetlb;
+}
+
+static void memfd_backend_set_hugetlb(Object *o, bool value, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(o);
+
+    if (memory_region_size(&backend->mr)) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+    MEMORY_BACKEND_MEMFD(o)->hugetlb = value;
+}
+
+static bool memfd_backend_get_seal(Object *o, Error **errp)
+{
+    return MEMORY_BACKEND_MEMFD(o)->seal;
+}
+
+static void memfd_backend_set_seal(Object *o, bool value, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(o);
+
+    if (memory_region_size(&backend->mr)) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+    MEMORY_BACKEND_MEMFD(o)->seal = value;
+}
+
+static void
+memfd_backend_instance_init(Object *o)
+{
+    HostMemoryBackendMemfd *mb = MEMORY_BACKEND_MEMFD(o);
+
+    mb->share = true;
+    mb->seal = true;
+
+    object_property_add_bool(o, "share",
+                             memfd_backend_get_share,
+                             memfd_backend_set_share, NULL);
+    object_property_add_bool(o, "hugetlb",
+                             memfd_backend_get_hugetlb,
+                             memfd_backend_set_hugetlb, NULL);
+    object_property_add_bool(o, "seal",
+                             memfd_backend_get_seal,
+                             memfd_backend_set_seal, NULL);
+}
+
+static const TypeInfo memfd_backend_info = {
+    .name = TYPE_MEMORY_BACKEND_MEMFD,
+    .parent = TYPE_MEMORY_BACKEND,
+    .class_init = memfd_backend_class_init,
+    .instance_init = memfd_backend_instance_init,
+    .instance_size = sizeof(HostMemoryBackendMemfd),
+};
+
+static void register_types(void)
+{
+    type_register_static(&memfd_backend_info);
+}
+
+type_init(register_types);
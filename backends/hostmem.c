@@ -18,6 +18,7 @@
 #include "qom/object_interfaces.h"
 
 #ifdef CONFIG_NUMA
+#include <numa.h>
 #include <numaif.h>
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
@@ -185,6 +186,73 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v, void *opaque,
+                                         const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, &backend->prealloc_threads, name, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v, void *opaque,
+                                         const char *name, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    backend->prealloc_threads = value;
+}
+
+#ifdef CONFIG_NUMA
+/*
+ * Run the preallocation threads on the host nodes the memory is bound
+ * to, spread evenly if there are several: the pages are zeroed, and
+ * with the default policy allocated, locally.
+ */
+static void host_memory_backend_prealloc_thread_init(int index, void *opaque)
+{
+    HostMemoryBackend *backend = opaque;
+    unsigned long node, nr_nodes = 0;
+
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        nr_nodes++;
+    }
+    if (!nr_nodes || numa_available() < 0) {
+        return;
+    }
+
+    index %= nr_nodes;
+    node = find_first_bit(backend->host_nodes, MAX_NODES);
+    while (index--) {
+        node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1);
+    }
+    /* Only a matter of speed, the memory policy is in place already */
+    numa_run_on_node(node);
+}
+#endif
+
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         int fd, void *ptr, uint64_t sz)
+{
+    MemPreallocThreadInit *thread_init = NULL;
+
+#ifdef CONFIG_NUMA
+    thread_init = host_memory_backend_prealloc_thread_init;
+#endif
+    os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads,
+                    thread_init, backend);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -215,7 +283,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz);
+        host_memory_backend_prealloc(backend, fd, ptr, sz);
         backend->prealloc = true;
     }
 }
@@ -238,6 +306,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "uint32",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -323,7 +395,9 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            host_memory_backend_prealloc(backend,
+                                         memory_region_get_fd(&backend->mr),
+                                         ptr, sz);
         }
     }
 }
@@ -68,6 +68,8 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool persistent;            /* Stored by the format driver on flush */
+    HBitmap *meta;              /* Chunks changed since the last store */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -89,6 +91,7 @@ static int bdrv_open_inherit(BlockDriverState **pbs, const char *filename,
                              BlockDriver *drv, Error **errp);
 
 static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs);
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs);
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
@@ -261,8 +264,10 @@ BlockDriverState *bdrv_new(void)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_list_init(&bs->after_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    QSIMPLEQ_INIT(&bs->merge_queue);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -1924,6 +1929,7 @@ void bdrv_close(BlockDriverState *bs)
         bs->opaque = NULL;
         bs->drv = NULL;
         bs->copy_on_read = 0;
+        bdrv_release_bounce_buffers(bs);
         bs->backing_file[0] = '\0';
         bs->backing_format[0] = '\0';
         bs->total_sectors = 0;
@@ -1942,6 +1948,8 @@ void bdrv_close(BlockDriverState *bs)
         }
     }
 
+    bdrv_release_named_dirty_bitmaps(bs);
+
     if (bs->blk) {
         blk_dev_change_media_cb(bs->blk, false);
     }
@@ -2007,6 +2015,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     /* dev info */
     bs_dest->guest_block_size   = bs_src->guest_block_size;
     bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->merge_requests     = bs_src->merge_requests;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
@@ -2017,6 +2026,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->pending_reqs[1]    = bs_src->pending_reqs[1];
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
+    bs_dest->throttle_share     = bs_src->throttle_share;
     memcpy(&bs_dest->round_robin,
            &bs_src->round_robin,
            sizeof(bs_dest->round_robin));
@@ -2180,9 +2190,10 @@ static void bdrv_delete(BlockDriverState *bs)
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    block_acct_cleanup(&bs->stats);
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
@@ -2522,6 +2533,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     if (bs->read_only)
         return -EACCES;
 
+    bdrv_release_bounce_buffers(bs);
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
@@ -3016,6 +3028,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3186,6 +3207,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
     bs->open_flags &= ~BDRV_O_INCOMING;
+    bdrv_release_bounce_buffers(bs);
 
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
@@ -3417,6 +3439,7 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
     name = bitmap->name;
     bitmap->name = NULL;
     successor->name = name;
+    successor->persistent = bitmap->persistent;
     bitmap->successor = NULL;
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -3471,6 +3494,7 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
         if (bm == bitmap) {
             assert(!bdrv_dirty_bitmap_frozen(bm));
             QLIST_REMOVE(bitmap, list);
+            /* Also frees bitmap->meta */
             hbitmap_free(bitmap->bitmap);
             g_free(bitmap->name);
             g_free(bitmap);
@@ -3479,6 +3503,21 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     }
 }
 
+/**
+ * Release all named bitmaps of a BDS.  Bitmaps that the format driver keeps
+ * in the image have been stored by its close function at this point.
+ */
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name && !bdrv_dirty_bitmap_frozen(bm)) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
 void bdrv_disable_dirty_bitmap(BdrvDirtyBitmap *bitmap)
 {
     assert(!bdrv_dirty_bitmap_frozen(bitmap));
@@ -3505,6 +3544,7 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
         info->status = bdrv_dirty_bitmap_status(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -3522,6 +3562,32 @@ int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap, int64_t sector
     }
 }
 
+/**
+ * Return the first clean sector in [@sector, @sector + @nb_sectors), or -1.
+ */
+int64_t bdrv_dirty_bitmap_next_zero(BdrvDirtyBitmap *bitmap, int64_t sector,
+                                    int64_t nb_sectors)
+{
+    return hbitmap_next_zero(bitmap->bitmap, sector, nb_sectors);
+}
+
+/**
+ * Find the first dirty extent in [*@sector, *@sector + *@nb_sectors) and
+ * return it in @sector and @nb_sectors.  Return false if the range is clean.
+ */
+bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
+                                       int64_t *sector, int64_t *nb_sectors)
+{
+    uint64_t start = *sector, count = *nb_sectors;
+
+    if (!hbitmap_next_dirty_area(bitmap->bitmap, &start, &count)) {
+        return false;
+    }
+    *sector = start;
+    *nb_sectors = count;
+    return true;
+}
+
 /**
  * Chooses a default granularity based on the existing cluster size,
  * but clamped between [4K, 64K]. Defaults to 64K in the case that there
@@ -3572,6 +3638,186 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
     hbitmap_reset_all(bitmap->bitmap);
 }
 
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_size(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->size;
+}
+
+bool bdrv_dirty_bitmap_get_persistence(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
+                                       bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp)
+{
+    if (!bs->drv || !bs->drv->bdrv_can_store_dirty_bitmap) {
+        error_setg(errp, "Node '%s' cannot store persistent dirty bitmaps",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+    return bs->drv->bdrv_can_store_dirty_bitmap(bs, name, granularity, errp);
+}
+
+/* Convert a range of sectors to a range of granules of @hb, clamped to the
+ * size of the bitmap */
+static void dirty_bitmap_granules(HBitmap *hb, uint64_t start, uint64_t count,
+                                  uint64_t *first, uint64_t *nb)
+{
+    int g = hbitmap_granularity(hb);
+
+    *first = start >> g;
+    *nb = MIN(DIV_ROUND_UP(start + count, 1ULL << g), hbitmap_size(hb)) -
+          *first;
+}
+
+/**
+ * Store the bits for sectors [@start, @start + @count) into @buf, one bit per
+ * granule; @start must be a multiple of 64 granules.  The bits of a successor
+ * are included, so that a frozen bitmap is stored with the writes that
+ * happened while it was frozen.
+ */
+void bdrv_dirty_bitmap_serialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                      uint64_t start, uint64_t count)
+{
+    uint64_t first, nb;
+
+    dirty_bitmap_granules(bitmap->bitmap, start, count, &first, &nb);
+    hbitmap_serialize_part(bitmap->bitmap, buf, first, nb);
+
+    if (bitmap->successor) {
+        size_t i, bytes = DIV_ROUND_UP(nb, 8);
+        uint8_t *tmp = g_malloc(bytes);
+
+        hbitmap_serialize_part(bitmap->successor->bitmap, tmp, first, nb);
+        for (i = 0; i < bytes; i++) {
+            buf[i] |= tmp[i];
+        }
+        g_free(tmp);
+    }
+}
+
+/**
+ * Load the bits for sectors [@start, @start + @count) from @buf, in the
+ * format of bdrv_dirty_bitmap_serialize_part.  The bitmap may only be used
+ * once bdrv_dirty_bitmap_deserialize_finish has been called.
+ */
+void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
+                                        const uint8_t *buf,
+                                        uint64_t start, uint64_t count)
+{
+    uint64_t first, nb;
+
+    dirty_bitmap_granules(bitmap->bitmap, start, count, &first, &nb);
+    hbitmap_deserialize_part(bitmap->bitmap, buf, first, nb);
+}
+
+void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_deserialize_finish(bitmap->bitmap);
+}
+
+/**
+ * Start tracking which chunks of @chunk_sectors sectors of the bitmap change,
+ * with no chunk marked as changed.  A format driver calls this when it
+ * stores the whole bitmap, so that later stores only have to write the
+ * chunks found by bdrv_dirty_bitmap_next_change.
+ */
+void bdrv_dirty_bitmap_track_changes(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_sectors)
+{
+    int chunk_bits = ctz64(chunk_sectors) - hbitmap_granularity(bitmap->bitmap);
+
+    assert(chunk_bits >= 0 && !(chunk_sectors & (chunk_sectors - 1)));
+    if (bitmap->meta && hbitmap_granularity(bitmap->meta) != chunk_bits) {
+        hbitmap_free_meta(bitmap->bitmap);
+        bitmap->meta = NULL;
+    }
+    if (!bitmap->meta) {
+        bitmap->meta = hbitmap_create_meta(bitmap->bitmap, chunk_bits);
+    } else {
+        hbitmap_reset_all(bitmap->meta);
+    }
+}
+
+/**
+ * Return whether bdrv_dirty_bitmap_next_change can be used to find the parts
+ * of the bitmap that changed.  This is not the case while the bitmap has a
+ * successor, whose changes are not tracked.
+ */
+bool bdrv_dirty_bitmap_tracks_changes(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->meta && !bitmap->successor;
+}
+
+/**
+ * Stop tracking changes to the bitmap, undoing bdrv_dirty_bitmap_track_changes.
+ */
+void bdrv_dirty_bitmap_untrack_changes(BdrvDirtyBitmap *bitmap)
+{
+    if (bitmap->meta) {
+        hbitmap_free_meta(bitmap->bitmap);
+        bitmap->meta = NULL;
+    }
+}
+
+/**
+ * Return the first sector at or after @sector whose chunk changed, or -1.
+ */
+int64_t bdrv_dirty_bitmap_next_change(BdrvDirtyBitmap *bitmap, int64_t sector)
+{
+    int g = hbitmap_granularity(bitmap->bitmap);
+    HBitmapIter hbi;
+    int64_t next;
+
+    assert(bitmap->meta);
+    if (sector >= bitmap->size) {
+        return -1;
+    }
+    hbitmap_iter_init(&hbi, bitmap->meta, sector >> g);
+    next = hbitmap_iter_next(&hbi);
+    return next < 0 ? -1 : MAX(next << g, sector);
+}
+
+/**
+ * Mark the chunks of sectors [@start, @start + @count) as changed or not.
+ * Before storing a chunk, a format driver marks it as unchanged, so that
+ * writes which happen while the chunk is being stored mark it again.
+ */
+void bdrv_dirty_bitmap_set_changed(BdrvDirtyBitmap *bitmap, uint64_t start,
+                                   uint64_t count, bool changed)
+{
+    uint64_t first, nb;
+
+    assert(bitmap->meta);
+    dirty_bitmap_granules(bitmap->bitmap, start, count, &first, &nb);
+    if (!nb) {
+        return;
+    }
+    if (changed) {
+        hbitmap_set(bitmap->meta, first, nb);
+    } else {
+        hbitmap_reset(bitmap->meta, first, nb);
+    }
+}
+
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
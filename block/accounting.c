@@ -26,24 +26,97 @@
 #include "block/block_int.h"
 #include "qemu/timer.h"
 
+static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
+
+void block_acct_cleanup(BlockAcctStats *stats)
+{
+    BlockAcctTimedStats *s, *next;
+
+    QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
+        g_free(s);
+    }
+    QSLIST_INIT(&stats->intervals);
+    block_latency_histograms_clear(stats);
+}
+
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
+{
+    BlockAcctTimedStats *s;
+    unsigned i;
+
+    s = g_new0(BlockAcctTimedStats, 1);
+    s->interval_length = interval_length;
+    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        timed_average_init(&s->latency[i], clock_type,
+                           (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
+    }
+}
+
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s)
+{
+    if (s == NULL) {
+        return QSLIST_FIRST(&stats->intervals);
+    } else {
+        return QSLIST_NEXT(s, entries);
+    }
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
     assert(type < BLOCK_MAX_IOTYPE);
 
     cookie->bytes = bytes;
-    cookie->start_time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    cookie->start_time_ns = qemu_clock_get_ns(clock_type);
     cookie->type = type;
 }
 
+/* Find the bin of @latency_ns with a binary search over the boundaries */
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    uint64_t *pos;
+    int lo = 0, hi = hist->nbins - 1;
+
+    if (hist->bins == NULL) {
+        return;
+    }
+
+    pos = hist->boundaries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((uint64_t) latency_ns < pos[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    BlockAcctTimedStats *s;
+    int64_t time_ns = qemu_clock_get_ns(clock_type);
+    int64_t latency_ns = time_ns - cookie->start_time_ns;
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
     stats->nr_bytes[cookie->type] += cookie->bytes;
     stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    stats->total_time_ns[cookie->type] += latency_ns;
+
+    QSLIST_FOREACH(s, &stats->intervals, entries) {
+        timed_average_account_at(&s->latency[cookie->type], latency_ns,
+                                 time_ns);
+    }
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 
@@ -61,3 +134,81 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     assert(type < BLOCK_MAX_IOTYPE);
     stats->merged[type] += num_requests;
 }
+
+/* A request of @type had to be aligned to the request alignment of the BDS;
+ * for writes, that is a read-modify-write cycle */
+void block_acct_unaligned(BlockAcctStats *stats, enum BlockAcctType type)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+    stats->unaligned[type]++;
+}
+
+/* A read of a read-modify-write cycle was served from memory */
+void block_acct_rmw_avoided(BlockAcctStats *stats)
+{
+    stats->rmw_avoided++;
+}
+
+/* The average number of requests of @type in flight during the current
+ * window of @stats: the sum of their latencies divided by the time
+ * covered by the window.
+ */
+double block_acct_queue_depth(BlockAcctTimedStats *stats,
+                              enum BlockAcctType type)
+{
+    uint64_t sum, elapsed;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    sum = timed_average_sum(&stats->latency[type], &elapsed);
+    if (elapsed == 0) {
+        return 0;
+    }
+
+    return (double) sum / elapsed;
+}
+
+/* Set the bin boundaries of the latency histogram of @type, in
+ * nanoseconds.  The boundaries must be strictly increasing.  With
+ * @nboundaries == 0 the histogram is removed.  Any previous counts
+ * are discarded.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nboundaries)
+{
+    BlockLatencyHistogram *hist = &stats->latency_histogram[type];
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    for (i = 1; i < nboundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nbins = 0;
+
+    if (nboundaries == 0) {
+        return 0;
+    }
+
+    hist->nbins = nboundaries + 1;
+    hist->boundaries = g_memdup(boundaries, nboundaries * sizeof(uint64_t));
+    hist->bins = g_new0(uint64_t, hist->nbins);
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL, 0);
+    }
+}
@@ -26,6 +26,12 @@
 #define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
 #define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
 
+/* Clusters copied by a single request, and requests the job keeps in flight
+ * for sync=full and sync=top
+ */
+#define BACKUP_MAX_CLUSTERS 16
+#define BACKUP_MAX_IN_FLIGHT 8
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -46,10 +52,24 @@ typedef struct BackupBlockJob {
     BlockdevOnError on_target_error;
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
+    /* Copy data with bdrv_co_copy_range() until it fails once */
+    bool copy_range;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Copy requests started by backup_run_copy() */
+    int in_flight;
+    bool waiting;
+    bool retry;
+    int ret;
 } BackupBlockJob;
 
+typedef struct BackupCopyOp {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupCopyOp;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -97,8 +117,10 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
-    int64_t start, end;
-    int n;
+    int64_t start, end, status, next;
+    uint64_t run_start, run_count;
+    int n, run, pnum;
+    bool zero, copied;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -110,36 +132,73 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    while (start < end) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            next = hbitmap_next_zero(job->bitmap, start, end - start);
+            start = next < 0 ? end : next;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy the clusters that have not been copied yet together */
+        run_start = start;
+        run_count = MIN(end - start, BACKUP_MAX_CLUSTERS);
+        if (hbitmap_next_dirty_area(job->bitmap, &run_start, &run_count)) {
+            run = run_start - start;
+        } else {
+            run = run_count;
+        }
 
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
+        trace_backup_do_cow_process(job, start, run);
+
+        n = MIN(run * BACKUP_SECTORS_PER_CLUSTER,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * BACKUP_SECTORS_PER_CLUSTER);
 
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+        /* Data that is known to read as zero need not be read at all */
+        status = bdrv_get_block_status_above(bs, NULL,
+                                             start * BACKUP_SECTORS_PER_CLUSTER,
+                                             n, &pnum);
+        zero = status >= 0 && pnum == n && (status & BDRV_BLOCK_ZERO);
+
+        copied = false;
+        if (!zero && job->copy_range) {
+            ret = bdrv_co_copy_range(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                     job->target,
+                                     start * BACKUP_SECTORS_PER_CLUSTER, n);
+            copied = ret >= 0;
+            if (!copied) {
+                /* Use the bounce buffer from now on, starting with this
+                 * run, which reports any real error */
+                job->copy_range = false;
+            }
         }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
 
-        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
-                            &bounce_qiov);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        if (!zero && !copied) {
+            if (!bounce_buffer) {
+                bounce_buffer = qemu_blockalign(bs, MIN(end - start,
+                                                        BACKUP_MAX_CLUSTERS) *
+                                                    BACKUP_CLUSTER_SIZE);
             }
-            goto out;
+            iov.iov_base = bounce_buffer;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                &bounce_qiov);
+            if (ret < 0) {
+                trace_backup_do_cow_read_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
+            }
+            zero = buffer_is_zero(iov.iov_base, iov.iov_len);
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        if (copied) {
+            ret = 0;
+        } else if (zero) {
             ret = bdrv_co_write_zeroes(job->target,
                                        start * BACKUP_SECTORS_PER_CLUSTER,
                                        n, BDRV_REQ_MAY_UNMAP);
@@ -156,7 +215,8 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        hbitmap_set(job->bitmap, start, run);
+        start += run;
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -330,6 +390,136 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     return ret;
 }
 
+/* For sync=top, return the number of clusters from @cluster on that have
+ * no data in the topmost image; 0 if @cluster has some, or on error.
+ */
+static int64_t coroutine_fn backup_unallocated_clusters(BackupBlockJob *job,
+                                                        int64_t cluster)
+{
+    int64_t sector = cluster * BACKUP_SECTORS_PER_CLUSTER;
+    int64_t total = job->common.len / BDRV_SECTOR_SIZE;
+    int ret, n;
+
+    while (sector < total) {
+        n = MIN(total - sector, INT_MAX >> BDRV_SECTOR_BITS);
+        ret = bdrv_is_allocated(job->common.bs, sector, n, &n);
+        if (ret != 0 || n == 0) {
+            return sector / BACKUP_SECTORS_PER_CLUSTER - cluster;
+        }
+        sector += n;
+    }
+    return DIV_ROUND_UP(total, BACKUP_SECTORS_PER_CLUSTER) - cluster;
+}
+
+static void coroutine_fn backup_copy_worker(void *opaque)
+{
+    BackupCopyOp *op = opaque;
+    BackupBlockJob *job = op->job;
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs,
+                        op->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                        op->nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                        &error_is_read);
+    if (ret < 0) {
+        /* Depending on error action, fail the job or retry the clusters
+         * when the current pass is over
+         */
+        if (backup_error_action(job, error_is_read, -ret) ==
+            BLOCK_ERROR_ACTION_REPORT) {
+            if (job->ret >= 0) {
+                job->ret = ret;
+            }
+        } else {
+            job->retry = true;
+        }
+    }
+
+    g_free(op);
+    job->in_flight--;
+    if (job->waiting) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_wait_in_flight(BackupBlockJob *job, int max)
+{
+    while (job->in_flight > max) {
+        job->waiting = true;
+        qemu_coroutine_yield();
+        job->waiting = false;
+    }
+}
+
+/* Copy the whole device for sync=full, or what is allocated in the topmost
+ * image for sync=top, with up to BACKUP_MAX_IN_FLIGHT requests of up to
+ * BACKUP_MAX_CLUSTERS clusters each.  Clusters that fail to copy are
+ * retried in another pass unless the error is reported.
+ */
+static int coroutine_fn backup_run_copy(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t cluster, end, skip;
+    BackupCopyOp *op;
+    Coroutine *co;
+    int nb_clusters, n;
+
+    end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    job->ret = 0;
+
+    do {
+        job->retry = false;
+        for (cluster = 0; cluster < end && job->ret >= 0; ) {
+            if (hbitmap_get(job->bitmap, cluster)) {
+                skip = hbitmap_next_zero(job->bitmap, cluster, end - cluster);
+                cluster = skip < 0 ? end : skip;
+                continue; /* already copied */
+            }
+
+            if (yield_and_check(job)) {
+                break;
+            }
+            backup_wait_in_flight(job, BACKUP_MAX_IN_FLIGHT - 1);
+
+            nb_clusters = MIN(end - cluster, BACKUP_MAX_CLUSTERS);
+            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+                /* Skip whole unallocated extents at once, and copy at most
+                 * the allocated extent that starts at @cluster.  A cluster
+                 * is copied if any of its sectors is allocated.
+                 */
+                skip = backup_unallocated_clusters(job, cluster);
+                if (skip > 0) {
+                    cluster += skip;
+                    continue;
+                }
+                if (bdrv_is_allocated(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
+                                      nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                                      &n) == 1) {
+                    nb_clusters = MAX(DIV_ROUND_UP(n,
+                                                   BACKUP_SECTORS_PER_CLUSTER),
+                                      1);
+                } else {
+                    nb_clusters = 1;
+                }
+            }
+
+            op = g_new(BackupCopyOp, 1);
+            op->job = job;
+            op->cluster = cluster;
+            op->nb_clusters = nb_clusters;
+            job->in_flight++;
+            co = qemu_coroutine_create(backup_copy_worker);
+            qemu_coroutine_enter(co, op);
+
+            cluster += nb_clusters;
+        }
+        backup_wait_in_flight(job, 0);
+    } while (job->retry && job->ret >= 0 && !yield_and_check(job));
+
+    return job->ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -340,13 +530,12 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
 
     job->bitmap = hbitmap_alloc(end, 0);
@@ -369,58 +558,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_copy(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -535,6 +673,7 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->copy_range = true;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->common.len = len;
@@ -685,6 +685,28 @@ int blk_co_discard(BlockBackend *blk, int64_t sector_num, int nb_sectors)
     return bdrv_co_discard(blk->bs, sector_num, nb_sectors);
 }
 
+int coroutine_fn blk_co_readv(BlockBackend *blk, int64_t sector_num,
+                              int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_readv(blk->bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn blk_co_writev(BlockBackend *blk, int64_t sector_num,
+                               int nb_sectors, QEMUIOVector *qiov)
+{
+    int ret = blk_check_request(blk, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_writev(blk->bs, sector_num, nb_sectors, qiov);
+}
+
 int blk_co_flush(BlockBackend *blk)
 {
     return bdrv_co_flush(blk->bs);
@@ -872,6 +894,23 @@ int coroutine_fn blk_co_write_zeroes(BlockBackend *blk, int64_t sector_num,
     return bdrv_co_write_zeroes(blk->bs, sector_num, nb_sectors, flags);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t in_sector,
+                                   BlockBackend *blk_out, int64_t out_sector,
+                                   int nb_sectors)
+{
+    int ret = blk_check_request(blk_in, in_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_request(blk_out, out_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range(blk_in->bs, in_sector, blk_out->bs, out_sector,
+                              nb_sectors);
+}
+
 int blk_write_compressed(BlockBackend *blk, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors)
 {
@@ -65,6 +65,7 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define CURL_CACHE_SIZE_DEFAULT (16 * 1024 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -77,6 +78,7 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
 #define CURL_BLOCK_OPT_TIMEOUT "timeout"
 #define CURL_BLOCK_OPT_COOKIE    "cookie"
+#define CURL_BLOCK_OPT_CACHE_SIZE "cache-size"
 
 struct BDRVCURLState;
 
@@ -107,6 +109,14 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/* Data of a finished transfer, kept around for later reads */
+typedef struct CURLCacheEntry {
+    size_t start;
+    size_t len;
+    char *buf;
+    QTAILQ_ENTRY(CURLCacheEntry) next;
+} CURLCacheEntry;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     QEMUTimer timer;
@@ -114,6 +124,13 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+    /* Sequential reads grow the window up to the number of free states */
+    size_t readahead_window;
+    size_t seq_next;
+    /* Most recently used first */
+    QTAILQ_HEAD(CURLCacheHead, CURLCacheEntry) cache;
+    size_t cache_size;
+    size_t cache_used;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -223,12 +240,94 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+static void curl_cache_drop(BDRVCURLState *s, CURLCacheEntry *e)
+{
+    QTAILQ_REMOVE(&s->cache, e, next);
+    s->cache_used -= e->len;
+    g_free(e->buf);
+    g_free(e);
+}
+
+/* Take ownership of @buf, which holds @len bytes of the image at @start */
+static void curl_cache_insert(BDRVCURLState *s, size_t start, size_t len,
+                              char *buf)
+{
+    CURLCacheEntry *e, *next_e;
+
+    if (!len || len > s->cache_size) {
+        g_free(buf);
+        return;
+    }
+
+    /* The new data supersedes whatever it covers completely */
+    QTAILQ_FOREACH_SAFE(e, &s->cache, next, next_e) {
+        if (e->start >= start && e->start + e->len <= start + len) {
+            curl_cache_drop(s, e);
+        }
+    }
+    while (s->cache_used + len > s->cache_size) {
+        curl_cache_drop(s, QTAILQ_LAST(&s->cache, CURLCacheHead));
+    }
+
+    e = g_new(CURLCacheEntry, 1);
+    e->start = start;
+    e->len = len;
+    e->buf = buf;
+    QTAILQ_INSERT_HEAD(&s->cache, e, next);
+    s->cache_used += len;
+}
+
+/*
+ * The cache holds a few dozen entries at most and sequential reads find
+ * theirs at the head, so a list is good enough.
+ */
+static CURLCacheEntry *curl_cache_lookup(BDRVCURLState *s, size_t pos)
+{
+    CURLCacheEntry *e;
+
+    QTAILQ_FOREACH(e, &s->cache, next) {
+        if (pos >= e->start && pos < e->start + e->len) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Copy [start, start + len) to @qiov if the cache has all of it */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            QEMUIOVector *qiov)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        CURLCacheEntry *e = curl_cache_lookup(s, start + done);
+        size_t off, n;
+
+        if (!e) {
+            return false;
+        }
+        off = start + done - e->start;
+        n = MIN(len - done, e->len - off);
+        qemu_iovec_from_buf(qiov, done, e->buf + off, n);
+        done += n;
+
+        QTAILQ_REMOVE(&s->cache, e, next);
+        QTAILQ_INSERT_HEAD(&s->cache, e, next);
+    }
+    return true;
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
     int i;
     size_t end = start + len;
 
+    if (curl_cache_read(s, start, len, acb->qiov)) {
+        acb->common.cb(acb->common.opaque, 0);
+        return FIND_RET_OK;
+    }
+
     for (i=0; i<CURL_NUM_STATES; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
@@ -277,6 +376,18 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     return FIND_RET_NONE;
 }
 
+static bool curl_state_busy(CURLState *state)
+{
+    int i;
+
+    for (i = 0; i < CURL_NUM_ACB; i++) {
+        if (state->acb[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void curl_multi_check_completion(BDRVCURLState *s)
 {
     int msgs_in_queue;
@@ -322,6 +433,11 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                     qemu_aio_unref(acb);
                     state->acb[i] = NULL;
                 }
+            } else if (s->cache_size && !curl_state_busy(state)) {
+                curl_cache_insert(s, state->buf_start, state->buf_off,
+                                  state->orig_buf);
+                state->orig_buf = NULL;
+                state->buf_off = 0;
             }
 
             curl_clean_state(state);
@@ -372,32 +488,38 @@ static void curl_multi_timeout_do(void *arg)
 #endif
 }
 
-static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
+/* Grab a free state, or return NULL if all of them are transferring */
+static CURLState *curl_find_state(BDRVCURLState *s)
 {
-    CURLState *state = NULL;
-    int i, j;
+    int i;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
+            s->states[i].in_use = 1;
+            return &s->states[i];
         }
-        if (!state) {
-            aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    return NULL;
+}
+
+static int curl_free_states(BDRVCURLState *s)
+{
+    int i, n = 0;
+
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
+            n++;
         }
-    } while(!state);
+    }
+    return n;
+}
 
+static int curl_init_handle(BDRVCURLState *s, CURLState *state)
+{
     if (!state->curl) {
         state->curl = curl_easy_init();
         if (!state->curl) {
-            return NULL;
+            return -EIO;
         }
         curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
         curl_easy_setopt(state->curl, CURLOPT_SSL_VERIFYPEER,
@@ -427,6 +549,19 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
         curl_easy_setopt(state->curl, CURLOPT_REDIR_PROTOCOLS, PROTOCOLS);
 #endif
 
+#if LIBCURL_VERSION_NUM >= 0x071900
+        /* Keep the connection open while the guest is idle */
+        curl_easy_setopt(state->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#ifdef CURLPIPE_MULTIPLEX
+        /* Rather wait for a multiplexed stream than open a connection */
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+#endif
+
 #ifdef DEBUG_VERBOSE
         curl_easy_setopt(state->curl, CURLOPT_VERBOSE, 1);
 #endif
@@ -434,6 +569,21 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
 
     state->s = s;
 
+    return 0;
+}
+
+static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
+{
+    CURLState *state;
+
+    while (!(state = curl_find_state(s))) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    if (curl_init_handle(s, state) < 0) {
+        state->in_use = 0;
+        return NULL;
+    }
     return state;
 }
 
@@ -487,6 +637,10 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     s->multi = curl_multi_init();
     s->aio_context = new_context;
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+#ifdef CURLPIPE_MULTIPLEX
+    /* Run all transfers as streams of one HTTP/2 connection if possible */
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 #ifdef NEED_CURL_TIMER_CALLBACK
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
@@ -522,6 +676,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Pass the cookie or list of cookies with each request"
         },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Memory used to keep data that was read (0 to disable)"
+        },
         { /* end of list */ }
     },
 };
@@ -559,6 +718,14 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->readahead_window = s->readahead_size;
+    s->seq_next = 0;
+
+    s->cache_size = qemu_opt_get_size(opts, CURL_BLOCK_OPT_CACHE_SIZE,
+                                      CURL_CACHE_SIZE_DEFAULT);
+    QTAILQ_INIT(&s->cache);
+    s->cache_used = 0;
+
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
     if (s->timeout > CURL_TIMEOUT_MAX) {
@@ -637,34 +804,136 @@ static const AIOCBInfo curl_aiocb_info = {
 };
 
 
+/*
+ * Start fetching @len bytes at @start into @state, on behalf of @acb if it
+ * is not NULL.  On failure, @state is released.
+ */
+static int curl_start_fetch(BDRVCURLState *s, CURLState *state,
+                            size_t start, size_t len, CURLAIOCB *acb)
+{
+    size_t end;
+    int running;
+
+    state->buf_off = 0;
+    g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    end = MIN(start + state->buf_len, s->len) - 1;
+    state->orig_buf = g_try_malloc(state->buf_len);
+    if (state->buf_len && state->orig_buf == NULL) {
+        curl_clean_state(state);
+        return -ENOMEM;
+    }
+    state->acb[0] = acb;
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n",
+            len, start, state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+
+    /* Tell curl it needs to kick things off */
+    curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    return 0;
+}
+
+/* Return the end of the data at @pos that is cached or on its way */
+static size_t curl_covered_end(BDRVCURLState *s, size_t pos)
+{
+    CURLCacheEntry *e = curl_cache_lookup(s, pos);
+    int i;
+
+    if (e) {
+        return e->start + e->len;
+    }
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        CURLState *state = &s->states[i];
+        size_t end = state->buf_start +
+                     (state->in_use ? state->buf_len : state->buf_off);
+
+        if (state->orig_buf && pos >= state->buf_start && pos < end) {
+            return end;
+        }
+    }
+    return pos;
+}
+
+/*
+ * Fetch the readahead window after @pos with one range request per
+ * readahead_size chunk, so that the chunks arrive in parallel.  Only
+ * free states are used, and one is left for the next guest read.
+ */
+static void curl_readahead(BlockDriverState *bs, BDRVCURLState *s,
+                           size_t pos)
+{
+    size_t limit = MIN(pos + s->readahead_window, s->len);
+
+    while (pos < limit && curl_free_states(s) > 1) {
+        size_t covered = curl_covered_end(s, pos);
+        CURLState *state;
+        size_t len;
+
+        if (covered > pos) {
+            pos = covered;
+            continue;
+        }
+
+        state = curl_find_state(s);
+        if (curl_init_handle(s, state) < 0) {
+            state->in_use = 0;
+            return;
+        }
+        len = MIN(s->readahead_size, s->len - pos);
+        if (curl_start_fetch(s, state, pos, len, NULL) < 0) {
+            return;
+        }
+        pos += len;
+    }
+}
+
 static void curl_readv_bh_cb(void *p)
 {
     CURLState *state;
-    int running;
 
     CURLAIOCB *acb = p;
-    BDRVCURLState *s = acb->common.bs->opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVCURLState *s = bs->opaque;
 
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
 
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t max_window = (CURL_NUM_STATES - 1) * s->readahead_size;
+    bool sequential = start == s->seq_next;
+    int ret;
+
+    /* Grow the window while the guest reads sequentially */
+    if (sequential) {
+        s->readahead_window = MIN(s->readahead_window * 2, max_window);
+    } else {
+        s->readahead_window = s->readahead_size;
+    }
+    s->seq_next = start + len;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_unref(acb);
             // fall through
         case FIND_RET_WAIT:
+            if (sequential) {
+                curl_readahead(bs, s, start + len);
+            }
             return;
         default:
             break;
     }
 
     // No cache found, so let's start a new request
-    state = curl_init_state(acb->common.bs, s);
+    state = curl_init_state(bs, s);
     if (!state) {
         acb->common.cb(acb->common.opaque, -EIO);
         qemu_aio_unref(acb);
@@ -672,31 +941,18 @@ static void curl_readv_bh_cb(void *p)
     }
 
     acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    acb->end = len;
 
-    state->buf_off = 0;
-    g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_try_malloc(state->buf_len);
-    if (state->buf_len && state->orig_buf == NULL) {
-        curl_clean_state(state);
-        acb->common.cb(acb->common.opaque, -ENOMEM);
+    ret = curl_start_fetch(s, state, start, len + s->readahead_size, acb);
+    if (ret < 0) {
+        acb->common.cb(acb->common.opaque, ret);
         qemu_aio_unref(acb);
         return;
     }
-    state->acb[0] = acb;
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
-
-    /* Tell curl it needs to kick things off */
-    curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    if (sequential) {
+        curl_readahead(bs, s, start + len + s->readahead_size);
+    }
 }
 
 static BlockAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -723,6 +979,10 @@ static void curl_close(BlockDriverState *bs)
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
 
+    while (!QTAILQ_EMPTY(&s->cache)) {
+        curl_cache_drop(s, QTAILQ_FIRST(&s->cache));
+    }
+
     g_free(s->cookie);
     g_free(s->url);
 }
@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "block/throttle-groups.h"
 #include "qemu/error-report.h"
+#include "sysemu/replay.h"
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
@@ -149,6 +150,8 @@ void bdrv_refresh_limits(BlockDriverState *bs, Error **errp)
     Error *local_err = NULL;
 
     memset(&bs->bl, 0, sizeof(bs->bl));
+    /* The alignment of the buffers may change */
+    bdrv_release_bounce_buffers(bs);
 
     if (!drv) {
         return;
@@ -215,6 +218,8 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs)
 /* Check if any requests are in-flight (including throttled requests) */
 static bool bdrv_requests_pending(BlockDriverState *bs)
 {
+    BdrvChild *child;
+
     if (!QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
@@ -224,12 +229,21 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!qemu_co_queue_empty(&bs->throttled_reqs[1])) {
         return true;
     }
+    if (!QSIMPLEQ_EMPTY(&bs->merge_queue)) {
+        return true;
+    }
     if (bs->file && bdrv_requests_pending(bs->file)) {
         return true;
     }
     if (bs->backing_hd && bdrv_requests_pending(bs->backing_hd)) {
         return true;
     }
+    /* Drivers such as quorum may have I/O in flight on other children */
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (bdrv_requests_pending(child->bs)) {
+            return true;
+        }
+    }
     return false;
 }
 
@@ -905,6 +919,95 @@ out:
     return ret;
 }
 
+/*
+ * Unaligned requests take their head and tail buffers from a small pool
+ * of the BDS, instead of allocating two buffers for each request of a
+ * guest that uses a smaller block size than the host.
+ */
+static void *bdrv_bounce_get(BlockDriverState *bs, uint64_t align)
+{
+    if (bs->bounce_pool_len && bs->bounce_pool_align == align) {
+        return bs->bounce_pool[--bs->bounce_pool_len];
+    }
+    return qemu_blockalign(bs, align);
+}
+
+static void bdrv_bounce_put(BlockDriverState *bs, uint64_t align, void *buf)
+{
+    if (!buf) {
+        return;
+    }
+    if (bs->bounce_pool_align != align) {
+        while (bs->bounce_pool_len) {
+            qemu_vfree(bs->bounce_pool[--bs->bounce_pool_len]);
+        }
+        bs->bounce_pool_align = align;
+    }
+    if (bs->bounce_pool_len < BDRV_BOUNCE_POOL_SIZE) {
+        bs->bounce_pool[bs->bounce_pool_len++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+void bdrv_release_bounce_buffers(BlockDriverState *bs)
+{
+    while (bs->bounce_pool_len) {
+        qemu_vfree(bs->bounce_pool[--bs->bounce_pool_len]);
+    }
+    qemu_vfree(bs->rmw_cache_buf);
+    bs->rmw_cache_buf = NULL;
+    bs->rmw_cache_valid = false;
+}
+
+/*
+ * The last aligned block that a read-modify-write cycle wrote is kept, so
+ * that the next write into it doesn't need to read it again.  With a guest
+ * block size smaller than the host's, this is what the next sequential
+ * write needs.  Every other write into the block drops it.  The requests
+ * that use it are serialising, so no write into the block is in flight.
+ */
+static void bdrv_rmw_cache_invalidate(BlockDriverState *bs, int64_t offset,
+                                      int64_t bytes)
+{
+    if (bs->rmw_cache_valid &&
+        offset < bs->rmw_cache_offset + bs->rmw_cache_align &&
+        bs->rmw_cache_offset < offset + bytes) {
+        bs->rmw_cache_valid = false;
+    }
+}
+
+static void bdrv_rmw_cache_update(BlockDriverState *bs, int64_t offset,
+                                  uint64_t align, QEMUIOVector *qiov,
+                                  size_t qiov_offset)
+{
+    if (bs->rmw_cache_align != align) {
+        qemu_vfree(bs->rmw_cache_buf);
+        bs->rmw_cache_buf = NULL;
+        bs->rmw_cache_align = align;
+    }
+    if (!bs->rmw_cache_buf) {
+        bs->rmw_cache_buf = qemu_blockalign(bs, align);
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, bs->rmw_cache_buf, align);
+    bs->rmw_cache_offset = offset;
+    bs->rmw_cache_valid = true;
+}
+
+/* Read the aligned block at @offset for a read-modify-write cycle */
+static int coroutine_fn bdrv_rmw_read(BlockDriverState *bs,
+                                      BdrvTrackedRequest *req, int64_t offset,
+                                      uint64_t align, QEMUIOVector *qiov)
+{
+    if (bs->rmw_cache_valid && bs->rmw_cache_offset == offset &&
+        bs->rmw_cache_align == align) {
+        qemu_iovec_from_buf(qiov, 0, bs->rmw_cache_buf, align);
+        block_acct_rmw_avoided(&bs->stats);
+        return 0;
+    }
+    return bdrv_aligned_preadv(bs, req, offset, align, align, qiov, 0);
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -941,9 +1044,13 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         throttle_group_co_io_limits_intercept(bs, bytes, false);
     }
 
+    if ((offset | (offset + bytes)) & (align - 1)) {
+        block_acct_unaligned(&bs->stats, BLOCK_ACCT_READ);
+    }
+
     /* Align read if necessary by padding qiov */
     if (offset & (align - 1)) {
-        head_buf = qemu_blockalign(bs, align);
+        head_buf = bdrv_bounce_get(bs, align);
         qemu_iovec_init(&local_qiov, qiov->niov + 2);
         qemu_iovec_add(&local_qiov, head_buf, offset & (align - 1));
         qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
@@ -959,7 +1066,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
             qemu_iovec_concat(&local_qiov, qiov, 0, qiov->size);
             use_local_qiov = true;
         }
-        tail_buf = qemu_blockalign(bs, align);
+        tail_buf = bdrv_bounce_get(bs, align);
         qemu_iovec_add(&local_qiov, tail_buf,
                        align - ((offset + bytes) & (align - 1)));
 
@@ -974,8 +1081,8 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
-        qemu_vfree(head_buf);
-        qemu_vfree(tail_buf);
+        bdrv_bounce_put(bs, align, head_buf);
+        bdrv_bounce_put(bs, align, tail_buf);
     }
 
     return ret;
@@ -1113,6 +1220,9 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->qiov = qiov;
+    req->flags = flags;
+    bdrv_rmw_cache_invalidate(bs, offset, bytes);
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1141,6 +1251,9 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
 
+    req->ret = ret;
+    notifier_list_notify(&bs->after_write_notifiers, req);
+
     block_acct_highest_sector(&bs->stats, sector_num, nb_sectors);
 
     if (ret >= 0) {
@@ -1169,7 +1282,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
 
     assert(flags & BDRV_REQ_ZERO_WRITE);
     if (head_padding_bytes || tail_padding_bytes) {
-        buf = qemu_blockalign(bs, align);
+        buf = bdrv_bounce_get(bs, align);
         iov = (struct iovec) {
             .iov_base   = buf,
             .iov_len    = align,
@@ -1183,8 +1296,8 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
         mark_request_serialising(req, align);
         wait_serialising_requests(req);
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_HEAD);
-        ret = bdrv_aligned_preadv(bs, req, offset & ~(align - 1), align,
-                                  align, &local_qiov, 0);
+        ret = bdrv_rmw_read(bs, req, offset & ~(align - 1), align,
+                            &local_qiov);
         if (ret < 0) {
             goto fail;
         }
@@ -1221,8 +1334,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
         mark_request_serialising(req, align);
         wait_serialising_requests(req);
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_TAIL);
-        ret = bdrv_aligned_preadv(bs, req, offset, align,
-                                  align, &local_qiov, 0);
+        ret = bdrv_rmw_read(bs, req, offset, align, &local_qiov);
         if (ret < 0) {
             goto fail;
         }
@@ -1233,7 +1345,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
                                    &local_qiov, flags & ~BDRV_REQ_ZERO_WRITE);
     }
 fail:
-    qemu_vfree(buf);
+    bdrv_bounce_put(bs, align, buf);
     return ret;
 
 }
@@ -1278,6 +1390,10 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
      */
     tracked_request_begin(&req, bs, offset, bytes, true);
 
+    if ((offset | (offset + bytes)) & (align - 1)) {
+        block_acct_unaligned(&bs->stats, BLOCK_ACCT_WRITE);
+    }
+
     if (!qiov) {
         ret = bdrv_co_do_zero_pwritev(bs, offset, bytes, flags, &req);
         goto out;
@@ -1290,7 +1406,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         mark_request_serialising(&req, align);
         wait_serialising_requests(&req);
 
-        head_buf = qemu_blockalign(bs, align);
+        head_buf = bdrv_bounce_get(bs, align);
         head_iov = (struct iovec) {
             .iov_base   = head_buf,
             .iov_len    = align,
@@ -1298,8 +1414,8 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         qemu_iovec_init_external(&head_qiov, &head_iov, 1);
 
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_HEAD);
-        ret = bdrv_aligned_preadv(bs, &req, offset & ~(align - 1), align,
-                                  align, &head_qiov, 0);
+        ret = bdrv_rmw_read(bs, &req, offset & ~(align - 1), align,
+                            &head_qiov);
         if (ret < 0) {
             goto fail;
         }
@@ -1324,7 +1440,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         waited = wait_serialising_requests(&req);
         assert(!waited || !use_local_qiov);
 
-        tail_buf = qemu_blockalign(bs, align);
+        tail_buf = bdrv_bounce_get(bs, align);
         tail_iov = (struct iovec) {
             .iov_base   = tail_buf,
             .iov_len    = align,
@@ -1332,8 +1448,15 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         qemu_iovec_init_external(&tail_qiov, &tail_iov, 1);
 
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_TAIL);
-        ret = bdrv_aligned_preadv(bs, &req, (offset + bytes) & ~(align - 1), align,
-                                  align, &tail_qiov, 0);
+        if (head_buf && ((offset + bytes) & ~(align - 1)) == offset) {
+            /* Head and tail are in the same block, which is read already */
+            memcpy(tail_buf, head_buf, align);
+            block_acct_rmw_avoided(&bs->stats);
+            ret = 0;
+        } else {
+            ret = bdrv_rmw_read(bs, &req, (offset + bytes) & ~(align - 1),
+                                align, &tail_qiov);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1354,14 +1477,18 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
     ret = bdrv_aligned_pwritev(bs, &req, offset, bytes,
                                use_local_qiov ? &local_qiov : qiov,
                                flags);
+    if (ret >= 0 && tail_buf) {
+        bdrv_rmw_cache_update(bs, offset + bytes - align, align, &local_qiov,
+                              bytes - align);
+    }
 
 fail:
 
     if (use_local_qiov) {
         qemu_iovec_destroy(&local_qiov);
     }
-    qemu_vfree(head_buf);
-    qemu_vfree(tail_buf);
+    bdrv_bounce_put(bs, align, head_buf);
+    bdrv_bounce_put(bs, align, tail_buf);
 out:
     tracked_request_end(&req);
     return ret;
@@ -1401,6 +1528,116 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE | flags);
 }
 
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request(src, src_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Throttling and copy-on-read need the data to pass through here */
+    if (!src->drv->bdrv_co_copy_range_from || src->io_limits_enabled ||
+        src->copy_on_read) {
+        return -ENOTSUP;
+    }
+
+    /* Within one node, the driver may link the data to the destination
+     * without going through bdrv_co_copy_range_to(), so check the write
+     * here too */
+    if (src == dst) {
+        if (dst->read_only) {
+            return -EPERM;
+        }
+        ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!QLIST_EMPTY(&dst->before_write_notifiers.notifiers) ||
+            !QLIST_EMPTY(&dst->after_write_notifiers.notifiers)) {
+            return -ENOTSUP;
+        }
+    }
+
+    tracked_request_begin(&req, src, src_sector << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, false);
+    wait_serialising_requests(&req);
+    ret = src->drv->bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                            nb_sectors);
+    tracked_request_end(&req);
+
+    if (src == dst) {
+        if (ret == 0 && !dst->enable_write_cache) {
+            ret = bdrv_co_flush(dst);
+        }
+        bdrv_set_dirty(dst, dst_sector, nb_sectors);
+    }
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EPERM;
+    }
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Write notifiers (backup, mirror, write threshold) may want to look at
+     * the data or to copy the old one first, so leave them the slow path */
+    if (!dst->drv->bdrv_co_copy_range_to || dst->io_limits_enabled ||
+        !QLIST_EMPTY(&dst->before_write_notifiers.notifiers) ||
+        !QLIST_EMPTY(&dst->after_write_notifiers.notifiers)) {
+        return -ENOTSUP;
+    }
+
+    tracked_request_begin(&req, dst, dst_sector << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, true);
+    wait_serialising_requests(&req);
+    ret = dst->drv->bdrv_co_copy_range_to(src, src_sector, dst, dst_sector,
+                                          nb_sectors);
+    if (ret == 0 && !dst->enable_write_cache) {
+        ret = bdrv_co_flush(dst);
+    }
+
+    /* Even a failed copy may have written part of the range */
+    bdrv_set_dirty(dst, dst_sector, nb_sectors);
+    block_acct_highest_sector(&dst->stats, dst_sector, nb_sectors);
+    if (ret >= 0) {
+        dst->total_sectors = MAX(dst->total_sectors, dst_sector + nb_sectors);
+    }
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors)
+{
+    trace_bdrv_co_copy_range(src, src_sector, dst, dst_sector, nb_sectors);
+
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors);
+}
+
 int bdrv_flush_all(void)
 {
     BlockDriverState *bs = NULL;
@@ -1961,6 +2198,10 @@ void bdrv_aio_cancel(BlockAIOCB *acb)
     qemu_aio_ref(acb);
     bdrv_aio_cancel_async(acb);
     while (acb->refcnt > 1) {
+        /* A completed request may wait for a record/replay checkpoint */
+        if (acb->replay_id && replay_block_cancel(acb->replay_id)) {
+            continue;
+        }
         if (acb->aiocb_info->get_aio_context) {
             aio_poll(acb->aiocb_info->get_aio_context(acb), true);
         } else if (acb->bs) {
@@ -2066,17 +2307,37 @@ typedef struct BlockAIOCBCoroutine {
     bool need_bh;
     bool *done;
     QEMUBH* bh;
+
+    /* Request merging */
+    Coroutine *co;
+    QSIMPLEQ_ENTRY(BlockAIOCBCoroutine) merge_entry;
+    /* -1 while queued, or if another request submitted this one.  For
+     * the first request of a run, the number of requests that follow. */
+    int num_merged;
+    struct BlockAIOCBCoroutine **merged;
 } BlockAIOCBCoroutine;
 
 static const AIOCBInfo bdrv_em_co_aiocb_info = {
     .aiocb_size         = sizeof(BlockAIOCBCoroutine),
 };
 
+static void bdrv_co_complete_cb(void *opaque)
+{
+    BlockAIOCBCoroutine *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, acb->req.error);
+    qemu_aio_unref(acb);
+}
+
 static void bdrv_co_complete(BlockAIOCBCoroutine *acb)
 {
     if (!acb->need_bh) {
-        acb->common.cb(acb->common.opaque, acb->req.error);
-        qemu_aio_unref(acb);
+        if (acb->common.replay_id && replay_mode != REPLAY_MODE_NONE) {
+            replay_block_event(acb->common.replay_id, bdrv_co_complete_cb,
+                               acb);
+        } else {
+            bdrv_co_complete_cb(acb);
+        }
     }
 }
 
@@ -2100,13 +2361,182 @@ static void bdrv_co_maybe_schedule_bh(BlockAIOCBCoroutine *acb)
     }
 }
 
+/*
+ * Guest requests on a device with merge-requests=on wait in
+ * bs->merge_queue until the current event loop iteration is done, that is
+ * until the device model has submitted all the requests of its batch.
+ * Then they are sorted and each run of adjacent requests in the same
+ * direction is submitted by the coroutine of its first request, as a
+ * single request whose result completes all of them.
+ */
+static bool bdrv_merge_ok(BlockDriverState *bs, BlockAIOCBCoroutine *acb,
+                          BlockAIOCBCoroutine *next, int niov,
+                          int nb_sectors)
+{
+    if (next->is_write != acb->is_write ||
+        next->req.sector != acb->req.sector + nb_sectors ||
+        next->req.qiov->size != next->req.nb_sectors << BDRV_SECTOR_BITS) {
+        return false;
+    }
+    if (niov + next->req.qiov->niov > IOV_MAX) {
+        return false;
+    }
+    nb_sectors += next->req.nb_sectors;
+    if (nb_sectors > BDRV_REQUEST_MAX_SECTORS ||
+        (bs->bl.max_transfer_length &&
+         nb_sectors > bs->bl.max_transfer_length)) {
+        return false;
+    }
+    return true;
+}
+
+static int bdrv_merge_compare(const void *a, const void *b)
+{
+    const BlockAIOCBCoroutine *acb1 = *(BlockAIOCBCoroutine * const *)a;
+    const BlockAIOCBCoroutine *acb2 = *(BlockAIOCBCoroutine * const *)b;
+
+    if (acb1->is_write != acb2->is_write) {
+        return acb1->is_write - acb2->is_write;
+    }
+    if (acb1->req.sector > acb2->req.sector) {
+        return 1;
+    } else if (acb1->req.sector < acb2->req.sector) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/* Submit the requests in the merge queue */
+static void bdrv_merge_flush(BlockDriverState *bs)
+{
+    BlockAIOCBCoroutine **reqs, *acb;
+    int num_reqs = 0, num_runs = 0;
+    int i, j;
+
+    if (QSIMPLEQ_EMPTY(&bs->merge_queue)) {
+        return;
+    }
+    qemu_bh_delete(bs->merge_bh);
+    bs->merge_bh = NULL;
+
+    QSIMPLEQ_FOREACH(acb, &bs->merge_queue, merge_entry) {
+        num_reqs++;
+    }
+    reqs = g_new(BlockAIOCBCoroutine *, num_reqs);
+    i = 0;
+    QSIMPLEQ_FOREACH(acb, &bs->merge_queue, merge_entry) {
+        reqs[i++] = acb;
+    }
+    QSIMPLEQ_INIT(&bs->merge_queue);
+
+    qsort(reqs, num_reqs, sizeof(*reqs), &bdrv_merge_compare);
+
+    /* Runs are found before any request is submitted, because requests
+     * can complete, and be freed, as soon as their first one is entered.
+     */
+    for (i = 0; i < num_reqs; i = j) {
+        int niov, nb_sectors;
+
+        acb = reqs[i];
+        niov = acb->req.qiov->niov;
+        nb_sectors = acb->req.nb_sectors;
+        j = i + 1;
+        if (acb->req.qiov->size == nb_sectors << BDRV_SECTOR_BITS) {
+            while (j < num_reqs &&
+                   bdrv_merge_ok(bs, acb, reqs[j], niov, nb_sectors)) {
+                niov += reqs[j]->req.qiov->niov;
+                nb_sectors += reqs[j]->req.nb_sectors;
+                j++;
+            }
+        }
+
+        acb->num_merged = j - i - 1;
+        if (acb->num_merged) {
+            acb->merged = g_memdup(&reqs[i + 1],
+                                   acb->num_merged * sizeof(*reqs));
+            block_acct_merge_done(&bs->stats,
+                                  acb->is_write ? BLOCK_ACCT_WRITE
+                                                : BLOCK_ACCT_READ,
+                                  acb->num_merged);
+        }
+        reqs[num_runs++] = acb;
+    }
+
+    for (i = 0; i < num_runs; i++) {
+        qemu_coroutine_enter(reqs[i]->co, NULL);
+    }
+    g_free(reqs);
+}
+
+static void bdrv_merge_bh(void *opaque)
+{
+    bdrv_merge_flush(opaque);
+}
+
+static int coroutine_fn bdrv_co_merge_rw(BlockAIOCBCoroutine *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    QEMUIOVector qiov;
+    int nb_sectors, i, ret;
+
+    acb->co = qemu_coroutine_self();
+    acb->num_merged = -1;
+    acb->merged = NULL;
+    if (QSIMPLEQ_EMPTY(&bs->merge_queue)) {
+        bs->merge_bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_merge_bh, bs);
+        qemu_bh_schedule(bs->merge_bh);
+    }
+    QSIMPLEQ_INSERT_TAIL(&bs->merge_queue, acb, merge_entry);
+    qemu_coroutine_yield();
+
+    if (acb->num_merged < 0) {
+        /* Submitted as part of the run of another request */
+        return acb->req.error;
+    }
+    if (acb->num_merged == 0) {
+        if (acb->is_write) {
+            return bdrv_co_do_writev(bs, acb->req.sector, acb->req.nb_sectors,
+                                     acb->req.qiov, 0);
+        }
+        return bdrv_co_do_readv(bs, acb->req.sector, acb->req.nb_sectors,
+                                acb->req.qiov, 0);
+    }
+
+    nb_sectors = acb->req.nb_sectors;
+    qemu_iovec_init(&qiov, acb->req.qiov->niov);
+    qemu_iovec_concat(&qiov, acb->req.qiov, 0, acb->req.qiov->size);
+    for (i = 0; i < acb->num_merged; i++) {
+        QEMUIOVector *next = acb->merged[i]->req.qiov;
+
+        qemu_iovec_concat(&qiov, next, 0, next->size);
+        nb_sectors += acb->merged[i]->req.nb_sectors;
+    }
+
+    if (acb->is_write) {
+        ret = bdrv_co_do_writev(bs, acb->req.sector, nb_sectors, &qiov, 0);
+    } else {
+        ret = bdrv_co_do_readv(bs, acb->req.sector, nb_sectors, &qiov, 0);
+    }
+    qemu_iovec_destroy(&qiov);
+
+    for (i = 0; i < acb->num_merged; i++) {
+        acb->merged[i]->req.error = ret;
+        qemu_coroutine_enter(acb->merged[i]->co, NULL);
+    }
+    g_free(acb->merged);
+    return ret;
+}
+
 /* Invoke bdrv_co_do_readv/bdrv_co_do_writev */
 static void coroutine_fn bdrv_co_do_rw(void *opaque)
 {
     BlockAIOCBCoroutine *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
 
-    if (!acb->is_write) {
+    if (bs->merge_requests && !acb->req.flags) {
+        acb->req.error = bdrv_co_merge_rw(acb);
+    } else if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
             acb->req.nb_sectors, acb->req.qiov, acb->req.flags);
     } else {
@@ -2132,6 +2562,9 @@ static BlockAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
+    if (replay_mode != REPLAY_MODE_NONE) {
+        acb->common.replay_id = replay_block_id();
+    }
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
@@ -2165,6 +2598,9 @@ BlockAIOCB *bdrv_aio_flush(BlockDriverState *bs,
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
+    if (replay_mode != REPLAY_MODE_NONE) {
+        acb->common.replay_id = replay_block_id();
+    }
 
     co = qemu_coroutine_create(bdrv_aio_flush_co_entry);
     qemu_coroutine_enter(co, acb);
@@ -2194,6 +2630,9 @@ BlockAIOCB *bdrv_aio_discard(BlockDriverState *bs,
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
+    if (replay_mode != REPLAY_MODE_NONE) {
+        acb->common.replay_id = replay_block_id();
+    }
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
     co = qemu_coroutine_create(bdrv_aio_discard_co_entry);
@@ -2214,6 +2653,7 @@ void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
     acb->cb = cb;
     acb->opaque = opaque;
     acb->refcnt = 1;
+    acb->replay_id = 0;
     return acb;
 }
 
@@ -2422,6 +2862,8 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     }
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_rmw_cache_invalidate(bs, sector_num << BDRV_SECTOR_BITS,
+                              (int64_t)nb_sectors << BDRV_SECTOR_BITS);
 
     max_discard = MIN_NON_ZERO(bs->bl.max_discard, BDRV_REQUEST_MAX_SECTORS);
     while (nb_sectors > 0) {
@@ -2578,6 +3020,11 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier)
+{
+    notifier_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
@@ -2591,6 +3038,10 @@ void bdrv_io_plug(BlockDriverState *bs)
 void bdrv_io_unplug(BlockDriverState *bs)
 {
     BlockDriver *drv = bs->drv;
+
+    /* The batch is complete, there is no need to wait for more requests */
+    bdrv_merge_flush(bs);
+
     if (drv && drv->bdrv_io_unplug) {
         drv->bdrv_io_unplug(bs);
     } else if (bs->file) {
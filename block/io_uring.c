@@ -0,0 +1,365 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (C) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/block.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+
+#include <liburing.h>
+
+/* Number of submission queue entries (per-device) */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    struct LuringState *s;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;      /* prepared but not yet submitted */
+    unsigned int in_flight;     /* submitted to the kernel */
+    bool blocked;
+
+    /* requests that did not find a free submission queue entry */
+    QSIMPLEQ_HEAD(, LuringAIOCB) overflow;
+} LuringQueue;
+
+typedef struct LuringState {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* resubmits when the kernel refused requests and none are in flight */
+    QEMUBH *submit_bh;
+} LuringState;
+
+static void ioq_submit(LuringState *s);
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    int ret;
+
+    ret = acb->ret;
+    if (acb->type == QEMU_AIO_FLUSH) {
+        ret = ret < 0 ? ret : 0;
+    } else if (ret == acb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (acb->type == QEMU_AIO_READ) {
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+    acb->common.cb(acb->common.opaque, ret);
+
+    qemu_aio_unref(acb);
+}
+
+/* Fill a submission queue entry for @acb, return false if the ring is full */
+static bool luring_prep_sqe(LuringState *s, LuringAIOCB *acb)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+    if (!sqe) {
+        return false;
+    }
+
+    switch (acb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, acb->fd, acb->qiov->iov, acb->qiov->niov,
+                             acb->offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, acb->fd, acb->qiov->iov, acb->qiov->niov,
+                            acb->offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, acb->fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_data(sqe, acb);
+
+    s->io_q.in_queue++;
+    return true;
+}
+
+/* The completion BH reaps completed requests from the completion queue and
+ * invokes their callbacks.  Like the linux-aio one, it reschedules itself as
+ * long as there may be completions left, so that nested event loops started
+ * from a callback see them too.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    if (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *acb = io_uring_cqe_get_data(cqe);
+
+        acb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        if (acb->ret == -EINTR || acb->ret == -EAGAIN) {
+            /* Transient failure, submit the request again */
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.overflow, acb, next);
+            continue;
+        }
+
+        luring_process_completion(s, acb);
+    }
+
+    /* Completions made room in the ring */
+    if (!s->io_q.plugged &&
+        (s->io_q.in_queue || !QSIMPLEQ_EMPTY(&s->io_q.overflow))) {
+        ioq_submit(s);
+    }
+}
+
+static bool luring_completions_pending(LuringState *s)
+{
+    return io_uring_cq_ready(&s->ring) > 0;
+}
+
+/* Check the completion queue in userspace, without a system call */
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    return luring_completions_pending(s);
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    /* Busy polling may run this before the kernel signals the notifier */
+    if (event_notifier_test_and_clear(&s->e) ||
+        luring_completions_pending(s)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static void luring_submit_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!s->io_q.blocked &&
+        (s->io_q.in_queue || !QSIMPLEQ_EMPTY(&s->io_q.overflow))) {
+        ioq_submit(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->overflow);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    int ret;
+
+    do {
+        /* Move requests that did not fit earlier into the ring */
+        while (!QSIMPLEQ_EMPTY(&s->io_q.overflow)) {
+            LuringAIOCB *acb = QSIMPLEQ_FIRST(&s->io_q.overflow);
+
+            if (!luring_prep_sqe(s, acb)) {
+                break;
+            }
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.overflow, next);
+        }
+
+        if (!s->io_q.in_queue) {
+            break;
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EAGAIN || ret == -EBUSY) {
+            /* Retry once some requests have completed */
+            break;
+        }
+        if (ret < 0) {
+            abort();
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue -= ret;
+    } while (ret > 0 && !QSIMPLEQ_EMPTY(&s->io_q.overflow));
+
+    /* A completion retries the submission; without any in flight, none
+     * would come, so retry from a bottom half instead.
+     */
+    s->io_q.blocked = s->io_q.in_queue > 0 && s->io_q.in_flight > 0;
+    if (s->io_q.in_queue > 0 && !s->io_q.in_flight) {
+        qemu_bh_schedule_idle(s->submit_bh);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked &&
+        (s->io_q.in_queue || !QSIMPLEQ_EMPTY(&s->io_q.overflow))) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->fd = fd;
+    acb->type = type;
+    acb->offset = sector_num * BDRV_SECTOR_SIZE;
+    acb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->qiov = qiov;
+    acb->ret = -EINPROGRESS;
+
+    if (!QSIMPLEQ_EMPTY(&s->io_q.overflow) || !luring_prep_sqe(s, acb)) {
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.overflow, acb, next);
+    }
+
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &acb->common;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    LuringState *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+    qemu_bh_delete(s->completion_bh);
+    qemu_bh_delete(s->submit_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    LuringState *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    s->submit_bh = aio_bh_new(new_context, luring_submit_bh, s);
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+void *luring_init(void)
+{
+    LuringState *s;
+    int ret;
+
+    s = g_new0(LuringState, 1);
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (ret < 0) {
+        errno = -ret;
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        errno = -ret;
+        goto out_exit_ring;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    LuringState *s = s_;
+
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
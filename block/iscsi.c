@@ -48,14 +48,29 @@
 #include <block/scsi.h>
 #endif
 
+/* One login to the target, with a TCP connection of its own */
+typedef struct IscsiSession {
+    struct iscsi_context *iscsi;
+    struct IscsiLun *iscsilun;
+    int events;
+    bool request_timed_out;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* The first session; commands outside of the data path use it */
     struct iscsi_context *iscsi;
+    /* Reads, writes and the like are spread over all sessions in turn */
+    IscsiSession *sessions;
+    int nb_sessions;
+    int next_session;
+    /* Commands in flight per session before new ones wait, 0 for no limit */
+    int queue_depth;
+    CoQueue session_queue;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -70,7 +85,8 @@ typedef struct IscsiLun {
     bool dpofua;
     bool has_write_same;
     bool force_next_flush;
-    bool request_timed_out;
+    /* Names the LUN as source or destination of EXTENDED COPY */
+    struct scsi_inquiry_device_designator *dd;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -82,6 +98,7 @@ typedef struct IscsiTask {
     Coroutine *co;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     QEMUTimer retry_timer;
     bool force_next_flush;
 } IscsiTask;
@@ -105,6 +122,7 @@ typedef struct IscsiAIOCB {
 #define EVENT_INTERVAL 1000
 #define NOP_INTERVAL 5000
 #define MAX_NOP_FAILURES 3
+#define ISCSI_MAX_SESSIONS 16
 #define ISCSI_CMD_RETRIES ARRAY_SIZE(iscsi_retry_times)
 static const unsigned iscsi_retry_times[] = {8, 32, 128, 512, 2048, 8192, 32768};
 
@@ -117,6 +135,13 @@ static const unsigned iscsi_retry_times[] = {8, 32, 128, 512, 2048, 8192, 32768}
  * unallocated. */
 #define ISCSI_CHECKALLOC_THRES 64
 
+/* EXTENDED COPY (LID1) parameter list: a header, two CSCD descriptors
+ * naming the LUNs and a block to block segment descriptor */
+#define XCOPY_HEADER_LEN    16
+#define XCOPY_CSCD_LEN      32
+#define XCOPY_SEGMENT_LEN   28
+#define XCOPY_MAX_BLOCKS    0xffff
+
 static void
 iscsi_bh_cb(void *p)
 {
@@ -211,7 +236,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
                     /* make sure the request is rescheduled AFTER the
                      * reconnect is initiated */
                     retry_time = EVENT_INTERVAL * 2;
-                    iTask->iscsilun->request_timed_out = true;
+                    iTask->session->request_timed_out = true;
                 }
                 error_report("iSCSI Busy/TaskSetFull/TimeOut"
                              " (retry #%u in %u ms): %s",
@@ -241,11 +266,38 @@ out:
     }
 }
 
-static void iscsi_co_init_iscsitask(IscsiLun *iscsilun, struct IscsiTask *iTask)
+/* Return the next session in turn that has room for another command */
+static IscsiSession *iscsi_next_session(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[iscsilun->next_session];
+
+        iscsilun->next_session = (iscsilun->next_session + 1) %
+                                 iscsilun->nb_sessions;
+        if (!iscsilun->queue_depth ||
+            iscsi_queue_length(session->iscsi) < iscsilun->queue_depth) {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+/* Waits until a session can take the command; it is retried there, too */
+static void coroutine_fn iscsi_co_init_iscsitask(IscsiLun *iscsilun,
+                                                 struct IscsiTask *iTask)
 {
+    IscsiSession *session;
+
+    while (!(session = iscsi_next_session(iscsilun))) {
+        qemu_co_queue_wait(&iscsilun->session_queue);
+    }
+
     *iTask = (struct IscsiTask) {
         .co         = qemu_coroutine_self(),
         .iscsilun   = iscsilun,
+        .session    = session,
     };
 }
 
@@ -285,36 +337,61 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context,
+    if (ev != session->events) {
+        aio_set_fd_handler(session->iscsilun->aio_context,
                            iscsi_get_fd(iscsi),
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           session);
+        session->events = ev;
+    }
+}
+
+/* Hand sessions that completed commands to the requests waiting for one */
+static void iscsi_restart_waiting(IscsiLun *iscsilun)
+{
+    int i;
+
+    while (!qemu_co_queue_empty(&iscsilun->session_queue)) {
+        for (i = 0; i < iscsilun->nb_sessions; i++) {
+            if (iscsi_queue_length(iscsilun->sessions[i].iscsi) <
+                iscsilun->queue_depth) {
+                break;
+            }
+        }
+        if (i == iscsilun->nb_sessions) {
+            break;
+        }
+        qemu_co_enter_next(&iscsilun->session_queue);
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    if (iscsilun->request_timed_out) {
-        iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+        /* check for timed out requests */
+        iscsi_service(session->iscsi, 0);
 
-    /* newer versions of libiscsi may return zero events. Ensure we are able
-     * to return to service once this situation changes. */
-    iscsi_set_events(iscsilun);
+        if (session->request_timed_out) {
+            session->request_timed_out = false;
+            iscsi_reconnect(session->iscsi);
+        }
+
+        /* newer versions of libiscsi may return zero events. Ensure we are
+         * able to return to service once this situation changes. */
+        iscsi_set_events(session);
+    }
+    iscsi_restart_waiting(iscsilun);
 
     timer_mod(iscsilun->event_timer,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
@@ -323,21 +400,22 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
+    iscsi_restart_waiting(session->iscsilun);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -424,13 +502,15 @@ retry:
     fua = iscsilun->dpofua && !bs->enable_write_cache;
     iTask.force_next_flush = !fua;
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write16_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write10_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     }
@@ -440,7 +520,7 @@ retry:
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -504,7 +584,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     }
 
 retry:
-    if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
+    if (iscsi_get_lba_status_task(iTask.session->iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
                                   8 + 16, iscsi_co_generic_cb,
                                   &iTask) == NULL) {
@@ -513,7 +593,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -612,12 +692,12 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(iTask.session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(iTask.session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
@@ -629,7 +709,7 @@ retry:
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -662,13 +742,14 @@ static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_synchronizecache10_task(iscsilun->iscsi, iscsilun->lun, 0, 0, 0,
-                                      0, iscsi_co_generic_cb, &iTask) == NULL) {
+    if (iscsi_synchronizecache10_task(iTask.session->iscsi, iscsilun->lun,
+                                      0, 0, 0, 0, iscsi_co_generic_cb,
+                                      &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -804,7 +885,7 @@ static BlockAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(&iscsilun->sessions[0]);
 
     return &acb->common;
 }
@@ -877,13 +958,13 @@ coroutine_fn iscsi_co_discard(BlockDriverState *bs, int64_t sector_num,
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_unmap_task(iscsilun->iscsi, iscsilun->lun, 0, 0, &list, 1,
+    if (iscsi_unmap_task(iTask.session->iscsi, iscsilun->lun, 0, 0, &list, 1,
                      iscsi_co_generic_cb, &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -959,12 +1040,14 @@ coroutine_fn iscsi_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
     iTask.force_next_flush = true;
 retry:
     if (use_16_for_ws) {
-        iTask.task = iscsi_writesame16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame16_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_writesame10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame10_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
@@ -974,7 +1057,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1146,17 +1229,26 @@ static int parse_timeout(const char *target)
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
-
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (iscsi_get_nops_in_flight(session->iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            session->request_timed_out = true;
+        } else if (iscsi_nop_out_async(session->iscsi, NULL, NULL, 0,
+                                       NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 }
 
 static void iscsi_readcapacity_sync(IscsiLun *iscsilun, Error **errp)
@@ -1230,6 +1322,16 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "URL to the iscsi image",
         },
+        {
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to the target (default 1)",
+        },
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Commands in flight per session (default 0 = no limit)",
+        },
         { /* end of list */ }
     },
 };
@@ -1275,11 +1377,14 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context,
-                       iscsi_get_fd(iscsilun->iscsi),
-                       NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        aio_set_fd_handler(iscsilun->aio_context,
+                           iscsi_get_fd(iscsilun->sessions[i].iscsi),
+                           NULL, NULL, NULL);
+        iscsilun->sessions[i].events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1297,9 +1402,12 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
     iscsilun->aio_context = new_context;
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
@@ -1317,6 +1425,31 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
 }
 
+/* Keep the logical unit designator that EXTENDED COPY understands best */
+static void iscsi_save_designator(IscsiLun *iscsilun,
+                                  struct scsi_inquiry_device_identification *di)
+{
+    struct scsi_inquiry_device_designator *d, *best = NULL;
+
+    for (d = di->designators; d; d = d->next) {
+        if (d->association != SCSI_ASSOCIATION_LOGICAL_UNIT ||
+            d->designator_type > SCSI_DESIGNATOR_TYPE_NAA) {
+            continue;
+        }
+        /* NAA beats EUI-64 beats the T10 vendor ID */
+        if (!best || d->designator_type > best->designator_type) {
+            best = d;
+        }
+    }
+    if (best) {
+        iscsilun->dd = g_new(struct scsi_inquiry_device_designator, 1);
+        *iscsilun->dd = *best;
+        iscsilun->dd->next = NULL;
+        iscsilun->dd->designator = g_memdup(best->designator,
+                                            best->designator_length);
+    }
+}
+
 static void iscsi_modesense_sync(IscsiLun *iscsilun)
 {
     struct scsi_task *task;
@@ -1352,57 +1485,25 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+/* Create a context to the LUN of @iscsi_url and log in with it */
+static int iscsi_session_connect(struct iscsi_url *iscsi_url,
+                                 const char *initiator_name,
+                                 struct iscsi_context **piscsi, Error **errp)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
+    struct iscsi_context *iscsi;
     Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    int ret, timeout;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1411,7 +1512,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1420,13 +1521,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1436,7 +1537,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     /* timeout handling is broken in libiscsi before 1.15.0 */
@@ -1453,10 +1554,103 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+static void iscsi_destroy_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_is_logged_in(iscsi)) {
+            iscsi_logout_sync(iscsi);
+        }
+        iscsi_destroy_context(iscsi);
+    }
+    g_free(iscsilun->sessions);
+    iscsilun->sessions = NULL;
+    iscsilun->nb_sessions = 0;
+    iscsilun->iscsi = NULL;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, nb_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    nb_sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (nb_sessions < 1 || nb_sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
+        goto out;
+    }
+    iscsilun->queue_depth = qemu_opt_get_number(opts, "queue-depth", 0);
+    if (iscsilun->queue_depth < 0) {
+        error_setg(errp, "iSCSI: queue-depth must not be negative");
+        ret = -EINVAL;
         goto out;
     }
+    iscsilun->sessions = g_new0(IscsiSession, nb_sessions);
+    qemu_co_queue_init(&iscsilun->session_queue);
 
-    iscsilun->iscsi = iscsi;
+    /* libiscsi gives every context a random ISID, so the target sees
+     * separate sessions rather than a reinstatement of the first one */
+    initiator_name = parse_initiator_name(iscsi_url->target);
+    for (i = 0; i < nb_sessions; i++) {
+        ret = iscsi_session_connect(iscsi_url, initiator_name, &iscsi, errp);
+        if (ret < 0) {
+            goto out;
+        }
+        iscsilun->sessions[i].iscsi = iscsi;
+        iscsilun->sessions[i].iscsilun = iscsilun;
+        iscsilun->nb_sessions++;
+    }
+
+    iscsilun->iscsi = iscsilun->sessions[0].iscsi;
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
     iscsilun->has_write_same = true;
@@ -1509,6 +1703,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         struct scsi_task *inq_task;
         struct scsi_inquiry_logical_block_provisioning *inq_lbp;
         struct scsi_inquiry_block_limits *inq_bl;
+        struct scsi_inquiry_device_identification *inq_di;
         switch (inq_vpd->pages[i]) {
         case SCSI_INQUIRY_PAGECODE_LOGICAL_BLOCK_PROVISIONING:
             inq_task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 1,
@@ -1534,6 +1729,16 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
                    sizeof(struct scsi_inquiry_block_limits));
             scsi_free_scsi_task(inq_task);
             break;
+        case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
+            /* Only needed for copy offload, so don't fail without it */
+            inq_task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 1,
+                                    SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+                                    (void **) &inq_di, NULL);
+            if (inq_task != NULL) {
+                iscsi_save_designator(iscsilun, inq_di);
+                scsi_free_scsi_task(inq_task);
+            }
+            break;
         default:
             break;
         }
@@ -1569,11 +1774,10 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            if (iscsi_is_logged_in(iscsi)) {
-                iscsi_logout_sync(iscsi);
-            }
-            iscsi_destroy_context(iscsi);
+        iscsi_destroy_sessions(iscsilun);
+        if (iscsilun->dd) {
+            g_free(iscsilun->dd->designator);
+            g_free(iscsilun->dd);
         }
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
@@ -1583,15 +1787,15 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
-    }
-    iscsi_destroy_context(iscsi);
+    iscsi_destroy_sessions(iscsilun);
     g_free(iscsilun->zeroblock);
     g_free(iscsilun->allocationmap);
+    if (iscsilun->dd) {
+        g_free(iscsilun->dd->designator);
+        g_free(iscsilun->dd);
+    }
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -1676,6 +1880,143 @@ static int iscsi_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+static void iscsi_xcopy_put_cscd(uint8_t *desc, IscsiLun *iscsilun)
+{
+    struct scsi_inquiry_device_designator *dd = iscsilun->dd;
+
+    memset(desc, 0, XCOPY_CSCD_LEN);
+    desc[0] = 0xe4;                     /* identification descriptor */
+    desc[1] = iscsilun->type & 0x1f;
+    desc[4] = dd->code_set & 0x0f;
+    desc[5] = ((dd->association & 3) << 4) | (dd->designator_type & 0x0f);
+    desc[7] = MIN(dd->designator_length, 20);
+    memcpy(&desc[8], dd->designator, desc[7]);
+    /* block device type specific parameters: the block size */
+    desc[29] = (iscsilun->block_size >> 16) & 0xff;
+    desc[30] = (iscsilun->block_size >> 8) & 0xff;
+    desc[31] = iscsilun->block_size & 0xff;
+}
+
+static void iscsi_xcopy_put_segment(uint8_t *desc, uint16_t nb_blocks,
+                                    uint64_t src_lba, uint64_t dst_lba)
+{
+    memset(desc, 0, XCOPY_SEGMENT_LEN);
+    desc[0] = 0x02;                     /* block device to block device */
+    stw_be_p(&desc[2], XCOPY_SEGMENT_LEN - 4);
+    stw_be_p(&desc[4], 0);              /* source: first CSCD descriptor */
+    stw_be_p(&desc[6], 1);              /* destination: the second one */
+    stw_be_p(&desc[10], nb_blocks);
+    stq_be_p(&desc[12], src_lba);
+    stq_be_p(&desc[20], dst_lba);
+}
+
+/* Only another iSCSI LUN can be the source, and it must be one that the
+ * target of the destination can reach itself */
+static int coroutine_fn iscsi_co_copy_range_to(BlockDriverState *src,
+                                               int64_t src_sector,
+                                               BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    IscsiLun *src_lun;
+    struct IscsiTask iTask;
+    struct iscsi_data data;
+    struct scsi_task *task;
+    uint8_t buf[XCOPY_HEADER_LEN + 2 * XCOPY_CSCD_LEN + XCOPY_SEGMENT_LEN];
+    uint64_t src_lba, dst_lba, nb_blocks;
+    int ret = 0;
+
+    if (src->drv->bdrv_co_copy_range_to != iscsi_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    src_lun = src->opaque;
+    if (!iscsilun->dd || !src_lun->dd ||
+        src_lun->block_size != iscsilun->block_size) {
+        return -ENOTSUP;
+    }
+    if (!is_request_lun_aligned(src_sector, nb_sectors, src_lun) ||
+        !is_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
+        return -ENOTSUP;
+    }
+
+    src_lba = sector_qemu2lun(src_sector, src_lun);
+    dst_lba = sector_qemu2lun(sector_num, iscsilun);
+    nb_blocks = sector_qemu2lun(nb_sectors, iscsilun);
+
+    memset(buf, 0, XCOPY_HEADER_LEN);
+    /* List ID usage 11b: no list identifier, nothing to keep for later
+     * RECEIVE COPY RESULTS */
+    buf[1] = 3 << 3;
+    stw_be_p(&buf[2], 2 * XCOPY_CSCD_LEN);
+    stl_be_p(&buf[8], XCOPY_SEGMENT_LEN);
+    iscsi_xcopy_put_cscd(&buf[XCOPY_HEADER_LEN], src_lun);
+    iscsi_xcopy_put_cscd(&buf[XCOPY_HEADER_LEN + XCOPY_CSCD_LEN], iscsilun);
+
+    while (nb_blocks > 0 && ret == 0) {
+        uint16_t n = MIN(nb_blocks, XCOPY_MAX_BLOCKS);
+
+        iscsi_xcopy_put_segment(&buf[XCOPY_HEADER_LEN + 2 * XCOPY_CSCD_LEN],
+                                n, src_lba, dst_lba);
+        data.data = buf;
+        data.size = sizeof(buf);
+
+        iscsi_co_init_iscsitask(iscsilun, &iTask);
+        iTask.force_next_flush = true;
+retry:
+        task = g_new0(struct scsi_task, 1);
+        task->cdb[0] = 0x83;                /* EXTENDED COPY (LID1) */
+        stl_be_p(&task->cdb[10], sizeof(buf));
+        task->cdb_size = 16;
+        task->xfer_dir = SCSI_XFER_WRITE;
+        task->expxferlen = sizeof(buf);
+
+        if (iscsi_scsi_command_async(iTask.session->iscsi, iscsilun->lun, task,
+                                     iscsi_co_generic_cb, &data,
+                                     &iTask) != 0) {
+            scsi_free_scsi_task(task);
+            return -ENOMEM;
+        }
+
+        while (!iTask.complete) {
+            iscsi_set_events(iTask.session);
+            qemu_coroutine_yield();
+        }
+
+        if (iTask.status == SCSI_STATUS_CHECK_CONDITION &&
+            iTask.task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST) {
+            /* Not supported, or the source is out of the target's reach */
+            ret = -ENOTSUP;
+        } else if (iTask.do_retry) {
+            scsi_free_scsi_task(iTask.task);
+            iTask.complete = 0;
+            goto retry;
+        } else if (iTask.status != SCSI_STATUS_GOOD) {
+            ret = -EIO;
+        }
+        scsi_free_scsi_task(iTask.task);
+
+        src_lba += n;
+        dst_lba += n;
+        nb_blocks -= n;
+    }
+
+    if (ret == 0) {
+        iscsi_allocationmap_set(iscsilun, sector_num, nb_sectors);
+    }
+    return ret;
+}
+
+/* The data is on this LUN: hand the copy to the destination */
+static int coroutine_fn iscsi_co_copy_range_from(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 BlockDriverState *dst,
+                                                 int64_t dst_sector,
+                                                 int nb_sectors)
+{
+    return bdrv_co_copy_range_to(bs, sector_num, dst, dst_sector, nb_sectors);
+}
+
 static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 {
     int ret = 0;
@@ -1712,9 +2053,7 @@ static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_destroy_sessions(iscsilun);
     g_free(bs->opaque);
     bs->opaque = NULL;
     bdrv_unref(bs);
@@ -1763,6 +2102,8 @@ static BlockDriver bdrv_iscsi = {
     .bdrv_co_get_block_status = iscsi_co_get_block_status,
     .bdrv_co_discard      = iscsi_co_discard,
     .bdrv_co_write_zeroes = iscsi_co_write_zeroes,
+    .bdrv_co_copy_range_from = iscsi_co_copy_range_from,
+    .bdrv_co_copy_range_to = iscsi_co_copy_range_to,
     .bdrv_co_readv         = iscsi_co_readv,
     .bdrv_co_writev        = iscsi_co_writev,
     .bdrv_co_flush_to_disk = iscsi_co_flush,
@@ -143,11 +143,53 @@ static void qemu_laio_completion_bh(void *opaque)
     }
 }
 
+/*
+ * The completion ring that the kernel maps into the process, see
+ * fs/aio.c.  io_context_t points to it.
+ */
+struct aio_ring {
+    unsigned id;    /* kernel internal index number */
+    unsigned nr;    /* number of io_events */
+    unsigned head;
+    unsigned tail;
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;  /* size of aio_ring */
+
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Check in userspace whether there are completions to fetch */
+static bool qemu_laio_completions_pending(struct qemu_laio_state *s)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    return qemu_laio_completions_pending(s);
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
-    if (event_notifier_test_and_clear(&s->e)) {
+    /* Busy polling may run this before the kernel signals the notifier */
+    if (event_notifier_test_and_clear(&s->e) ||
+        qemu_laio_completions_pending(s)) {
         qemu_bh_schedule(s->completion_bh);
     }
 }
@@ -297,6 +339,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
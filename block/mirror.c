@@ -19,7 +19,8 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define DEFAULT_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
@@ -29,6 +30,20 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+/* A guest write that is being copied to the target in write-blocking mode.
+ * head_clean and tail_clean tell whether its first and last chunk were
+ * clean when it started; those chunks are still in sync after the copy
+ * even if the write covers them only in part.
+ */
+typedef struct MirrorActiveWrite {
+    BdrvTrackedRequest *req;
+    int64_t first_chunk;
+    int64_t last_chunk;
+    bool head_clean;
+    bool tail_clean;
+    QLIST_ENTRY(MirrorActiveWrite) next;
+} MirrorActiveWrite;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -60,6 +75,35 @@ typedef struct MirrorBlockJob {
     int sectors_in_flight;
     int ret;
     bool unmap;
+    /* Copy data with bdrv_co_copy_range() until it fails once */
+    bool copy_range;
+
+    /* The queue depth is tuned once per slice by hill climbing on the
+     * copy rate: max_in_flight keeps moving by in_flight_step as long as
+     * the rate improves, and turns around when it gets worse.  Only the
+     * slices in which the queue was full are used.  Each operation is
+     * at most a max_in_flight-th of the buffer.
+     */
+    int max_in_flight;
+    int in_flight_step;
+    bool slice_full;
+    int64_t slice_start_ns;
+    uint64_t slice_bytes;
+    uint64_t last_rate;
+
+    /* In write-blocking mode guest writes are copied to the target before
+     * they complete.  The notifiers mark the chunks of each write as in
+     * flight while it runs, so that it is serialized against the copy
+     * loop and against other guest writes to the same chunks.
+     */
+    MirrorCopyMode copy_mode;
+    bool active;
+    NotifierWithReturn before_write;
+    Notifier after_write;
+    QLIST_HEAD(, MirrorActiveWrite) active_writes;
+    CoQueue chunk_wait;
+    int chunk_waiters;
+    bool waiting_for_chunks;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -67,6 +111,8 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    QEMUBH *bh;
+    int ret;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -82,6 +128,18 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Restart the guest writes that are waiting for in-flight chunks.  Those
+ * that still conflict queue up again behind the ones counted here.
+ */
+static void mirror_wake_chunk_waiters(MirrorBlockJob *s)
+{
+    int n = s->chunk_waiters;
+
+    while (n-- > 0 && qemu_co_enter_next(&s->chunk_wait)) {
+        /* nothing */
+    }
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -109,11 +167,14 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        s->slice_bytes += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
     }
 
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
+    mirror_wake_chunk_waiters(s);
+
     /* Enter coroutine when it is not sleeping.  The coroutine sleeps to
      * rate-limit itself.  The coroutine will eventually resume since there is
      * a sleep timeout so don't wake it early.
@@ -159,10 +220,43 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+static void mirror_copy_range_bh(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    qemu_bh_delete(op->bh);
+    op->bh = NULL;
+
+    if (op->ret < 0) {
+        /* Copy through the buffers from now on, starting with this chunk */
+        s->copy_range = false;
+        bdrv_aio_readv(s->common.bs, op->sector_num, &op->qiov,
+                       op->nb_sectors, mirror_read_complete, op);
+        return;
+    }
+    mirror_iteration_done(op, 0);
+}
+
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    op->ret = bdrv_co_copy_range(s->common.bs, op->sector_num,
+                                 s->target, op->sector_num, op->nb_sectors);
+
+    /* Complete from a BH like the AIO callbacks do, so that the job
+     * coroutine is never entered from here */
+    op->bh = aio_bh_new(bdrv_get_aio_context(s->common.bs),
+                        mirror_copy_range_bh, op);
+    qemu_bh_schedule(op->bh);
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, max_sectors;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
     uint64_t delay_ns = 0;
     MirrorOp *op;
@@ -181,6 +275,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     sector_num = s->sector_num;
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     end = s->bdev_length / BDRV_SECTOR_SIZE;
+    max_sectors = MAX(s->buf_size / s->max_in_flight / s->granularity, 1) *
+                  sectors_per_chunk;
 
     /* Extend the QEMUIOVector to include all adjacent blocks that will
      * be copied in this operation.
@@ -200,10 +296,19 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     next_sector = sector_num;
     next_chunk = sector_num / sectors_per_chunk;
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
+    /* Wait for I/O to this cluster (from a previous iteration or from a
+     * guest write in write-blocking mode) to be done.
+     */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
+        s->waiting_for_chunks = true;
         qemu_coroutine_yield();
+        s->waiting_for_chunks = false;
+    }
+
+    /* A guest write may have copied the chunk in the meantime.  */
+    if (!bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+        return 0;
     }
 
     do {
@@ -245,6 +350,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
             break;
         }
+        if (nb_sectors > 0 && nb_sectors + added_sectors > max_sectors) {
+            break;
+        }
 
         /* We have enough free space to copy these sectors.  */
         bitmap_set(s->in_flight_bitmap, next_chunk, added_chunks);
@@ -299,8 +407,13 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
                                       nb_sectors, &pnum);
     if (ret < 0 || pnum < nb_sectors ||
             (ret & BDRV_BLOCK_DATA && !(ret & BDRV_BLOCK_ZERO))) {
-        bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                       mirror_read_complete, op);
+        if (s->copy_range) {
+            Coroutine *co = qemu_coroutine_create(mirror_co_copy_range);
+            qemu_coroutine_enter(co, op);
+        } else {
+            bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                           mirror_read_complete, op);
+        }
     } else if (ret & BDRV_BLOCK_ZERO) {
         bdrv_aio_write_zeroes(s->target, sector_num, op->nb_sectors,
                               s->unmap ? BDRV_REQ_MAY_UNMAP : 0,
@@ -330,6 +443,216 @@ static void mirror_free_init(MirrorBlockJob *s)
     }
 }
 
+/* Called at the end of each slice to retune the queue depth */
+static void mirror_adapt_in_flight(MirrorBlockJob *s, int64_t now)
+{
+    uint64_t rate;
+
+    if (s->slice_full) {
+        rate = s->slice_bytes * 1000000000ULL / (now - s->slice_start_ns);
+        if (rate < s->last_rate) {
+            s->in_flight_step = -s->in_flight_step;
+        }
+        s->max_in_flight = MIN(MAX(s->max_in_flight + s->in_flight_step, 1),
+                               MAX_IN_FLIGHT);
+        s->last_rate = rate;
+        trace_mirror_adapt_in_flight(s, rate, s->max_in_flight);
+    }
+
+    s->slice_full = false;
+    s->slice_start_ns = now;
+    s->slice_bytes = 0;
+}
+
+/* Write zeroes to [sector_num, sector_num + nb_sectors) of the target
+ * instead of copying it chunk by chunk.  On failure the range is marked
+ * dirty and copied normally, which also reports the error.
+ */
+static void coroutine_fn mirror_zero_range(MirrorBlockJob *s,
+                                           int64_t sector_num,
+                                           int64_t nb_sectors)
+{
+    if (nb_sectors == 0) {
+        return;
+    }
+
+    trace_mirror_zero_range(s, sector_num, nb_sectors);
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, BDRV_REQUEST_MAX_SECTORS);
+        int ret;
+
+        ret = bdrv_co_write_zeroes(s->target, sector_num, n,
+                                   s->unmap ? BDRV_REQ_MAY_UNMAP : 0);
+        if (ret < 0) {
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
+        } else {
+            s->common.offset += (uint64_t)n * BDRV_SECTOR_SIZE;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+}
+
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int64_t end = (req->offset + req->bytes) >> BDRV_SECTOR_BITS;
+    MirrorActiveWrite *w;
+
+    assert(req->bs == s->common.bs);
+    if (req->bytes == 0) {
+        return 0;
+    }
+
+    w = g_new0(MirrorActiveWrite, 1);
+    w->req = req;
+    w->first_chunk = sector_num / sectors_per_chunk;
+    w->last_chunk = (end - 1) / sectors_per_chunk;
+
+    while (find_next_bit(s->in_flight_bitmap, w->last_chunk + 1,
+                         w->first_chunk) <= w->last_chunk) {
+        trace_mirror_yield_active_write(s, sector_num, end - sector_num);
+        s->chunk_waiters++;
+        qemu_co_queue_wait(&s->chunk_wait);
+        s->chunk_waiters--;
+    }
+
+    bitmap_set(s->in_flight_bitmap, w->first_chunk,
+               w->last_chunk - w->first_chunk + 1);
+    w->head_clean = !bdrv_get_dirty(s->common.bs, s->dirty_bitmap,
+                                    w->first_chunk * sectors_per_chunk);
+    w->tail_clean = !bdrv_get_dirty(s->common.bs, s->dirty_bitmap,
+                                    w->last_chunk * sectors_per_chunk);
+    QLIST_INSERT_HEAD(&s->active_writes, w, next);
+    return 0;
+}
+
+/* Copy a guest write that has just completed on the source to the target.
+ * The chunks it leaves in sync are cleaned before the copy, and dirtied
+ * again if it fails.
+ */
+static void coroutine_fn mirror_write_through(MirrorBlockJob *s,
+                                              MirrorActiveWrite *w)
+{
+    BdrvTrackedRequest *req = w->req;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int64_t chunk_start = w->first_chunk * sectors_per_chunk;
+    int64_t chunk_end = MIN((w->last_chunk + 1) * sectors_per_chunk,
+                            s->bdev_length >> BDRV_SECTOR_BITS);
+    int64_t clean_start, clean_end;
+    int ret;
+
+    clean_start = chunk_start;
+    if (!w->head_clean && sector_num != chunk_start) {
+        clean_start += sectors_per_chunk;
+    }
+    clean_end = chunk_end;
+    if (!w->tail_clean && sector_num + nb_sectors != chunk_end) {
+        clean_end = w->last_chunk * sectors_per_chunk;
+    }
+    if (clean_end > clean_start) {
+        bdrv_reset_dirty_bitmap(s->dirty_bitmap, clean_start,
+                                clean_end - clean_start);
+    }
+
+    trace_mirror_write_through(s, sector_num, nb_sectors);
+    if (req->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   s->unmap ? req->flags & BDRV_REQ_MAY_UNMAP
+                                            : 0);
+    } else {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+    }
+
+    if (ret < 0) {
+        BlockErrorAction action;
+
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        action = mirror_error_action(s, false, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        s->common.offset += (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    }
+}
+
+static void coroutine_fn mirror_after_write_notify(Notifier *notifier,
+                                                   void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    MirrorActiveWrite *w;
+
+    QLIST_FOREACH(w, &s->active_writes, next) {
+        if (w->req == req) {
+            break;
+        }
+    }
+    if (!w) {
+        return;
+    }
+
+    /* If the write failed, the source is left dirty and the copy loop
+     * takes care of it.
+     */
+    if (req->ret >= 0) {
+        mirror_write_through(s, w);
+    }
+
+    QLIST_REMOVE(w, next);
+    bitmap_clear(s->in_flight_bitmap, w->first_chunk,
+                 w->last_chunk - w->first_chunk + 1);
+    g_free(w);
+
+    mirror_wake_chunk_waiters(s);
+    if (s->waiting_for_chunks) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Switch to write-blocking mode.  It is not used if the target cannot do
+ * COW itself, because copying only the written sectors would leave the
+ * rest of its clusters unallocated.
+ */
+static void mirror_start_active(MirrorBlockJob *s)
+{
+    if (s->copy_mode != MIRROR_COPY_MODE_WRITE_BLOCKING || s->cow_bitmap) {
+        return;
+    }
+
+    s->active = true;
+    QLIST_INIT(&s->active_writes);
+    qemu_co_queue_init(&s->chunk_wait);
+    s->before_write.notify = mirror_before_write_notify;
+    bdrv_add_before_write_notifier(s->common.bs, &s->before_write);
+    s->after_write.notify = mirror_after_write_notify;
+    bdrv_add_after_write_notifier(s->common.bs, &s->after_write);
+}
+
+/* Stop intercepting guest writes and wait for those already intercepted */
+static void mirror_stop_active(MirrorBlockJob *s)
+{
+    if (!s->active) {
+        return;
+    }
+
+    notifier_with_return_remove(&s->before_write);
+    while (!QLIST_EMPTY(&s->active_writes) || s->chunk_waiters > 0) {
+        s->waiting_for_chunks = true;
+        qemu_coroutine_yield();
+        s->waiting_for_chunks = false;
+    }
+    notifier_remove(&s->after_write);
+    s->active = false;
+}
+
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
@@ -446,8 +769,13 @@ static void coroutine_fn mirror_run(void *opaque)
 
     last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
-        /* First part, loop on the sectors and initialize the dirty bitmap.  */
+        /* First part, loop on the sectors and initialize the dirty bitmap.
+         * Allocated extents that read as zero are zeroed on the target in
+         * bulk, unless the target cannot do COW itself.
+         */
         BlockDriverState *base = s->base;
+        int64_t zero_start = 0, zero_sectors = 0;
+
         for (sector_num = 0; sector_num < end; ) {
             /* Just to make sure we are not exceeding int limit. */
             int nb_sectors = MIN(INT_MAX >> BDRV_SECTOR_BITS,
@@ -470,17 +798,43 @@ static void coroutine_fn mirror_run(void *opaque)
             }
 
             assert(n > 0);
+            if (ret == 1 && !s->cow_bitmap) {
+                int64_t status;
+                int zn;
+
+                status = bdrv_get_block_status_above(bs, base, sector_num, n,
+                                                     &zn);
+                if (status >= 0 && zn > 0) {
+                    n = zn;
+                    if (status & BDRV_BLOCK_ZERO) {
+                        if (zero_start + zero_sectors != sector_num) {
+                            mirror_zero_range(s, zero_start, zero_sectors);
+                            zero_start = sector_num;
+                            zero_sectors = 0;
+                        }
+                        zero_sectors += n;
+                        ret = 0;
+                    }
+                }
+            }
             if (ret == 1) {
                 bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
             }
             sector_num += n;
         }
+        mirror_zero_range(s, zero_start, zero_sectors);
     }
 
+    mirror_start_active(s);
+
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
+    s->in_flight_step = 1;
+    s->slice_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
         uint64_t delay_ns = 0;
-        int64_t cnt;
+        int64_t cnt, now;
         bool should_complete;
 
         if (s->ret < 0) {
@@ -501,10 +855,17 @@ static void coroutine_fn mirror_run(void *opaque)
          * We do so every SLICE_TIME nanoseconds, or when there is an error,
          * or when the source is clean, whichever comes first.
          */
-        if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (now - s->slice_start_ns >= SLICE_TIME) {
+            mirror_adapt_in_flight(s, now);
+        }
+        if (now - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
+                if (cnt != 0 && !s->common.speed) {
+                    s->slice_full = true;
+                }
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 qemu_coroutine_yield();
                 continue;
@@ -583,6 +944,7 @@ immediate_exit:
         assert(ret < 0 || (!s->synced && block_job_is_cancelled(&s->common)));
         mirror_drain(s);
     }
+    mirror_stop_active(s);
 
     assert(s->in_flight == 0);
     qemu_vfree(s->buf);
@@ -679,7 +1041,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              int64_t buf_size,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -723,6 +1085,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_range = true;
+    s->copy_mode = copy_mode;
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -743,7 +1107,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -758,8 +1122,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
     mirror_start_job(bs, target, replaces,
                      speed, granularity, buf_size,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp, &mirror_job_driver, is_none_mode, base);
 }
 
 void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
@@ -806,7 +1170,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 
     bdrv_ref(base);
     mirror_start_job(bs, base, NULL, speed, 0, 0,
-                     on_error, on_error, false, cb, opaque, &local_err,
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -29,10 +29,10 @@
 #include "nbd-client.h"
 #include "qemu/sockets.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(s, handle) ((handle) ^ ((uint64_t)(intptr_t)s))
+#define INDEX_TO_HANDLE(s, index)  ((index)  ^ ((uint64_t)(intptr_t)s))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
     int i;
 
@@ -43,23 +43,21 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdConnection *s)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
     /* finish any pending coroutines */
-    shutdown(client->sock, 2);
-    nbd_recv_coroutines_enter_all(client);
+    shutdown(s->sock, 2);
+    nbd_recv_coroutines_enter_all(s);
 
-    nbd_client_detach_aio_context(bs);
-    closesocket(client->sock);
-    client->sock = -1;
+    aio_set_fd_handler(bdrv_get_aio_context(s->bs), s->sock,
+                       NULL, NULL, NULL);
+    closesocket(s->sock);
+    s->sock = -1;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -92,21 +90,21 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_get_client_session(s->bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -122,12 +120,12 @@ static int nbd_co_send_request(BlockDriverState *bs,
     assert(i < MAX_NBD_REQUESTS);
     request->handle = INDEX_TO_HANDLE(s, i);
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sock,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
-        if (!s->is_unix) {
+        if (!client->is_unix) {
             socket_set_cork(s->sock, 1);
         }
         rc = nbd_send_request(s->sock, request);
@@ -138,21 +136,158 @@ static int nbd_co_send_request(BlockDriverState *bs,
                 rc = -EIO;
             }
         }
-        if (!s->is_unix) {
+        if (!client->is_unix) {
             socket_set_cork(s->sock, 0);
         }
     } else {
         rc = nbd_send_request(s->sock, request);
     }
-    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, bs);
+    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_drop(NbdConnection *s, uint32_t len)
+{
+    uint8_t buf[256];
+
+    while (len) {
+        uint32_t n = MIN(len, sizeof(buf));
+
+        if (qemu_co_recv(s->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Check that the @len bytes at @from are part of @request */
+static bool nbd_chunk_in_request(struct nbd_request *request,
+                                 uint64_t from, uint32_t len)
+{
+    return from >= request->from && len <= request->len &&
+           from - request->from <= request->len - len;
+}
+
+/* Read the payload of the structured reply chunk whose header is in
+ * s->reply.  An error chunk sets *error; a negative return value means
+ * that the reply could not be parsed.
+ */
+static int nbd_co_receive_chunk(NbdConnection *s,
+                                struct nbd_request *request,
+                                QEMUIOVector *qiov, int offset,
+                                NBDExtent *extent, int *error)
+{
+    struct nbd_reply *chunk = &s->reply;
+    uint8_t buf[8 + 4];
+    uint64_t from;
+    uint32_t len, id;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return chunk->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length < 8 ||
+            qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = chunk->length - 8;
+        if (!nbd_chunk_in_request(request, from, len) ||
+            qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                          offset + from - request->from, len) != len) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != 8 + 4 ||
+            qemu_co_recv(s->sock, buf, 8 + 4) != 8 + 4) {
+            return -EIO;
+        }
+        from = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, from, len)) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + from - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* Only the first extent is used, as NBD_CMD_FLAG_REQ_ONE asks */
+        if (!extent || chunk->length < sizeof(id) + sizeof(*extent) ||
+            qemu_co_recv(s->sock, &id, sizeof(id)) != sizeof(id) ||
+            qemu_co_recv(s->sock, extent, sizeof(*extent)) !=
+            sizeof(*extent)) {
+            return -EIO;
+        }
+        if (be32_to_cpu(id) != s->info.context_id) {
+            return -EIO;
+        }
+        extent->length = be32_to_cpu(extent->length);
+        extent->flags = be32_to_cpu(extent->flags);
+        return nbd_co_drop(s, chunk->length - sizeof(id) - sizeof(*extent));
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(chunk->type)) {
+            /* Unknown informational chunk */
+            return nbd_co_drop(s, chunk->length);
+        }
+        /* error, message length, then the message and maybe an offset */
+        if (chunk->length < 4 + 2 ||
+            qemu_co_recv(s->sock, buf, 4 + 2) != 4 + 2) {
+            return -EIO;
+        }
+        *error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (!*error) {
+            *error = EIO;
+        }
+        return nbd_co_drop(s, chunk->length - 4 - 2);
+    }
+}
+
+/* Receive all the chunks of a structured reply, starting with the one
+ * whose header is in s->reply.  Returns the error to complete the
+ * request with.
+ */
+static int nbd_co_receive_chunks(NbdConnection *s,
+                                 struct nbd_request *request,
+                                 QEMUIOVector *qiov, int offset,
+                                 NBDExtent *extent)
+{
+    int error = 0;
+    bool done;
+
+    while (1) {
+        if (nbd_co_receive_chunk(s, request, qiov, offset, extent,
+                                 &error) < 0) {
+            error = EIO;
+            done = true;
+        } else {
+            done = s->reply.flags & NBD_REPLY_FLAG_DONE;
+        }
+
+        /* Tell the read handler to read another header.  */
+        s->reply.handle = 0;
+        if (done) {
+            return error;
+        }
+
+        /* Wait for the next chunk */
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle ||
+            s->reply.magic != NBD_STRUCTURED_REPLY_MAGIC) {
+            return EIO;
+        }
+    }
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NBDExtent *extent)
 {
     int ret;
 
@@ -162,6 +297,8 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     *reply = s->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
+    } else if (reply->magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        reply->error = nbd_co_receive_chunks(s, request, qiov, offset, extent);
     } else {
         if (qiov && reply->error == 0) {
             ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
@@ -176,7 +313,7 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     }
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdConnection *s,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
@@ -190,7 +327,7 @@ static void nbd_coroutine_start(NbdClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *s,
     struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -200,28 +337,62 @@ static void nbd_coroutine_end(NbdClientSession *s,
     }
 }
 
-static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
-                          int nb_sectors, QEMUIOVector *qiov,
-                          int offset)
+/* Pick the connection with the fewest requests in flight, going round
+ * the connections to break ties.  Returns NULL if all of them failed.
+ */
+static NbdConnection *nbd_pick_connection(NbdClientSession *client)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-    struct nbd_request request = { .type = NBD_CMD_READ };
+    NbdConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NbdConnection *s = &client->conn[(client->next_conn + i) %
+                                         client->num_conns];
+        if (s->sock != -1 && (!best || s->in_flight < best->in_flight)) {
+            best = s;
+        }
+    }
+    client->next_conn = (client->next_conn + 1) % client->num_conns;
+    return best;
+}
+
+/* Send @request on one of the connections and wait for its reply.  The
+ * data of a write is taken from @qiov, that of a read is stored there.
+ */
+static int nbd_co_request(BlockDriverState *bs, struct nbd_request *request,
+                          QEMUIOVector *qiov, int offset, NBDExtent *extent)
+{
+    NbdConnection *s = nbd_pick_connection(nbd_get_client_session(bs));
+    bool is_write = (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
     struct nbd_reply reply;
     ssize_t ret;
 
-    request.from = sector_num * 512;
-    request.len = nb_sectors * 512;
+    if (!s) {
+        return -EIO;
+    }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    nbd_coroutine_start(s, request);
+    ret = nbd_co_send_request(s, request, is_write ? qiov : NULL, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(s, request, &reply, is_write ? NULL : qiov,
+                             offset, extent);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(s, request);
     return -reply.error;
+}
 
+static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, QEMUIOVector *qiov,
+                          int offset)
+{
+    struct nbd_request request = { .type = NBD_CMD_READ };
+
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    return nbd_co_request(bs, &request, qiov, offset, NULL);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -230,8 +401,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_WRITE };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!bdrv_enable_write_cache(bs) &&
         (client->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -241,61 +410,120 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, offset, NULL);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
-int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
-                        int nb_sectors, QEMUIOVector *qiov)
-{
-    int offset = 0;
+/* Requests of each connection that a striped read or write keeps in
+ * flight.
+ */
+#define NBD_STRIPE_DEPTH 4
+
+/* A read or write larger than NBD_MAX_SECTORS, split into pieces that
+ * several worker coroutines send in parallel over all the connections.
+ */
+typedef struct NbdStripe {
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    bool is_write;
+
+    /* The next piece to send */
+    int64_t sector_num;
+    int nb_sectors;
+    int offset;
+
+    Coroutine *co;
+    int workers;
+    bool waiting;
     int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
+} NbdStripe;
+
+static void coroutine_fn nbd_co_stripe_entry(void *opaque)
+{
+    NbdStripe *st = opaque;
+
+    while (st->nb_sectors > 0 && st->ret == 0) {
+        int64_t sector_num = st->sector_num;
+        int nb_sectors = MIN(st->nb_sectors, NBD_MAX_SECTORS);
+        int offset = st->offset;
+        int ret;
+
+        st->sector_num += nb_sectors;
+        st->nb_sectors -= nb_sectors;
+        st->offset += nb_sectors * 512;
+
+        if (st->is_write) {
+            ret = nbd_co_writev_1(st->bs, sector_num, nb_sectors,
+                                  st->qiov, offset);
+        } else {
+            ret = nbd_co_readv_1(st->bs, sector_num, nb_sectors,
+                                 st->qiov, offset);
+        }
+        if (ret < 0 && st->ret == 0) {
+            st->ret = ret;
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    if (--st->workers == 0 && st->waiting) {
+        qemu_coroutine_enter(st->co, NULL);
+    }
 }
 
-int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
-                         int nb_sectors, QEMUIOVector *qiov)
+static int nbd_co_rwv(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, QEMUIOVector *qiov, bool is_write)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdStripe st = {
+        .bs         = bs,
+        .qiov       = qiov,
+        .is_write   = is_write,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .co         = qemu_coroutine_self(),
+    };
+    int i;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        if (is_write) {
+            return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0);
         }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+        return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
+    }
+
+    st.workers = MIN(DIV_ROUND_UP(nb_sectors, NBD_MAX_SECTORS),
+                     client->num_conns * NBD_STRIPE_DEPTH);
+    for (i = st.workers; i > 0; i--) {
+        Coroutine *co = qemu_coroutine_create(nbd_co_stripe_entry);
+        qemu_coroutine_enter(co, &st);
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+
+    /* The last worker to finish wakes us up */
+    if (st.workers > 0) {
+        st.waiting = true;
+        qemu_coroutine_yield();
+    }
+    return st.ret;
+}
+
+int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rwv(bs, sector_num, nb_sectors, qiov, false);
+}
+
+int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rwv(bs, sector_num, nb_sectors, qiov, true);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -308,15 +536,10 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    /* With NBD_FLAG_CAN_MULTI_CONN, the server flushes the writes that
+     * were completed on any connection.
+     */
+    return nbd_co_request(bs, &request, NULL, 0, NULL);
 }
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -324,8 +547,6 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_TRIM };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -333,29 +554,76 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    return nbd_co_request(bs, &request, NULL, 0, NULL);
+}
+
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    NBDExtent extent = { 0 };
+    int ret;
+
+    /* All connections negotiated the same options */
+    if (!client->conn[0].info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num * BDRV_SECTOR_SIZE);
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX / BDRV_SECTOR_SIZE);
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
+
+    ret = nbd_co_request(bs, &request, NULL, 0, &extent);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        return ret;
+    }
+    if (extent.length == 0 || extent.length > request.len) {
+        return -EIO;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
 
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Smaller than a sector: the sector may contain data */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num * BDRV_SECTOR_SIZE);
+    }
+    *pnum = extent.length / BDRV_SECTOR_SIZE;
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+           BDRV_BLOCK_OFFSET_VALID | (sector_num * BDRV_SECTOR_SIZE);
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conn[i].sock != -1) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conn[i].sock, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conn[i].sock != -1) {
+            aio_set_fd_handler(new_context, client->conn[i].sock,
+                               nbd_reply_ready, NULL, &client->conn[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -366,42 +634,99 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NbdConnection *s = &client->conn[i];
 
-    nbd_send_request(client->sock, &request);
+        if (s->sock == -1) {
+            continue;
+        }
+
+        nbd_send_request(s->sock, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(s);
+    }
+    client->num_conns = 0;
 }
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
-                    Error **errp)
+static int nbd_connection_init(BlockDriverState *bs, NbdConnection *s,
+                               int sock, const char *export,
+                               uint32_t *nbdflags, off_t *size,
+                               Error **errp)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qemu_set_block(sock);
-    ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
+    ret = nbd_receive_negotiate(sock, export, nbdflags, size,
+                                &s->info, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sock = sock;
+    s->bs = bs;
+    s->sock = sock;
+    qemu_co_mutex_init(&s->send_mutex);
+    qemu_co_mutex_init(&s->free_sema);
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sock,
+                       nbd_reply_ready, NULL, s);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
+                    Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int ret;
+
+    ret = nbd_connection_init(bs, &client->conn[0], sock, export,
+                              &client->nbdflags, &client->size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    client->num_conns = 1;
+    client->next_conn = 0;
+    return 0;
+}
+
+/* Open one more connection to the export of nbd_client_init().  The
+ * caller checks that the server sets NBD_FLAG_CAN_MULTI_CONN.
+ */
+int nbd_client_add_connection(BlockDriverState *bs, int sock,
+                              const char *export, Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *s = &client->conn[client->num_conns];
+    uint32_t nbdflags;
+    off_t size;
+    int ret;
+
+    assert(client->num_conns > 0 && client->num_conns < MAX_NBD_CONNECTIONS);
+    ret = nbd_connection_init(bs, s, sock, export, &nbdflags, &size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    client->num_conns++;
+
+    /* Requests go to any connection, so they must all see the same
+     * export with the same options.
+     */
+    if (nbdflags != client->nbdflags || size != client->size ||
+        s->info.structured_reply != client->conn[0].info.structured_reply ||
+        s->info.base_allocation != client->conn[0].info.base_allocation) {
+        error_setg(errp, "NBD server sent different parameters for "
+                   "another connection to the same export");
+        return -EINVAL;
+    }
+    return 0;
+}
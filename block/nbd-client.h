@@ -15,11 +15,15 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
-typedef struct NbdClientSession {
+/* One socket to the server.  Each has its own requests in flight and
+ * its own reply reader.
+ */
+typedef struct NbdConnection {
+    BlockDriverState *bs;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
+    NBDExportInfo info;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -28,6 +32,18 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdConnection;
+
+typedef struct NbdClientSession {
+    uint32_t nbdflags;
+    off_t size;
+
+    /* Requests are spread over the connections; there is more than one
+     * only if the server sets NBD_FLAG_CAN_MULTI_CONN.
+     */
+    NbdConnection conn[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    int next_conn;
 
     bool is_unix;
 } NbdClientSession;
@@ -36,6 +52,8 @@ NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs, int sock, const char *export_name,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs, int sock,
+                              const char *export_name, Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -45,6 +63,9 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
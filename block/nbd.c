@@ -31,6 +31,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
+#include "qemu/error-report.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qint.h"
@@ -44,8 +45,22 @@
 typedef struct BDRVNBDState {
     NbdClientSession client;
     QemuOpts *socket_opts;
+    int connections;
 } BDRVNBDState;
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server (default 1)",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -194,6 +209,7 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                        Error **errp)
 {
     Error *local_err = NULL;
+    QemuOpts *opts;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
         if (qdict_haskey(options, "path")) {
@@ -223,6 +239,20 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
     if (*export) {
         qdict_del(options, "export");
     }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return;
+    }
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+    if (s->connections < 1 || s->connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+    }
 }
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
@@ -259,7 +289,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int result, sock, i;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
@@ -280,6 +310,31 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* NBD handshake */
     result = nbd_client_init(bs, sock, export, errp);
+    if (result < 0) {
+        goto out;
+    }
+
+    /* Further connections to the same export, if the server allows */
+    if (s->connections > 1 &&
+        !(s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_report("NBD server does not support multiple connections, "
+                     "using only one");
+        s->connections = 1;
+    }
+    for (i = 1; i < s->connections; i++) {
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            result = sock;
+        } else {
+            result = nbd_client_add_connection(bs, sock, export, errp);
+        }
+        if (result < 0) {
+            nbd_client_close(bs);
+            goto out;
+        }
+    }
+
+out:
     g_free(export);
     return result;
 }
@@ -313,6 +368,13 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     return nbd_client_co_discard(bs, sector_num, nb_sectors);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -346,6 +408,7 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     const char *host   = qdict_get_try_str(bs->options, "host");
     const char *port   = qdict_get_try_str(bs->options, "port");
     const char *export = qdict_get_try_str(bs->options, "export");
+    const char *connections = qdict_get_try_str(bs->options, "connections");
 
     qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("nbd")));
 
@@ -380,6 +443,10 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     if (export) {
         qdict_put_obj(opts, "export", QOBJECT(qstring_from_str(export)));
     }
+    if (connections) {
+        qdict_put_obj(opts, "connections",
+                      QOBJECT(qstring_from_str(connections)));
+    }
 
     bs->full_open_options = opts;
 }
@@ -395,6 +462,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -413,6 +481,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -431,6 +500,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -96,6 +96,13 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(bs));
+
+        info->has_weight = true;
+        info->weight = cfg.weight;
+        info->has_iops_reserved = cfg.iops_reserved;
+        info->iops_reserved = cfg.iops_reserved;
+        info->has_tick_us = cfg.tick;
+        info->tick_us = cfg.tick / SCALE_US;
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -326,10 +333,43 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **p_boundaries, **p_bins;
+    int i;
+
+    if (hist->bins == NULL) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    p_boundaries = &info->boundaries;
+    p_bins = &info->bins;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *p_boundaries = g_new0(uint64List, 1);
+            (*p_boundaries)->value = hist->boundaries[i];
+            p_boundaries = &(*p_boundaries)->next;
+        }
+        *p_bins = g_new0(uint64List, 1);
+        (*p_bins)->value = hist->bins[i];
+        p_bins = &(*p_bins)->next;
+    }
+
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
+    BlockAcctTimedStats *ts = NULL;
+    BlockDeviceTimedStatsList **p_ts;
+    BlockLatencyHistogram *lh = bs->stats.latency_histogram;
+    BlockLatencyHistogramInfo *hist;
 
     s = g_malloc0(sizeof(*s));
 
@@ -350,6 +390,9 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->wr_operations = bs->stats.nr_ops[BLOCK_ACCT_WRITE];
     s->stats->rd_merged = bs->stats.merged[BLOCK_ACCT_READ];
     s->stats->wr_merged = bs->stats.merged[BLOCK_ACCT_WRITE];
+    s->stats->rd_unaligned = bs->stats.unaligned[BLOCK_ACCT_READ];
+    s->stats->wr_rmw = bs->stats.unaligned[BLOCK_ACCT_WRITE];
+    s->stats->wr_rmw_avoided = bs->stats.rmw_avoided;
     s->stats->wr_highest_offset =
         bs->stats.wr_highest_sector * BDRV_SECTOR_SIZE;
     s->stats->flush_operations = bs->stats.nr_ops[BLOCK_ACCT_FLUSH];
@@ -357,6 +400,52 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    p_ts = &s->stats->timed_stats;
+    while ((ts = block_acct_interval_next(&bs->stats, ts))) {
+        BlockDeviceTimedStatsList *timed_stats;
+        BlockDeviceTimedStats *dev_stats = g_new0(BlockDeviceTimedStats, 1);
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+
+        dev_stats->interval_length = ts->interval_length;
+
+        dev_stats->min_rd_latency_ns = timed_average_min(rd);
+        dev_stats->max_rd_latency_ns = timed_average_max(rd);
+        dev_stats->avg_rd_latency_ns = timed_average_avg(rd);
+
+        dev_stats->min_wr_latency_ns = timed_average_min(wr);
+        dev_stats->max_wr_latency_ns = timed_average_max(wr);
+        dev_stats->avg_wr_latency_ns = timed_average_avg(wr);
+
+        dev_stats->min_flush_latency_ns = timed_average_min(fl);
+        dev_stats->max_flush_latency_ns = timed_average_max(fl);
+        dev_stats->avg_flush_latency_ns = timed_average_avg(fl);
+
+        dev_stats->avg_rd_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_READ);
+        dev_stats->avg_wr_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+
+        timed_stats = g_new0(BlockDeviceTimedStatsList, 1);
+        timed_stats->value = dev_stats;
+        *p_ts = timed_stats;
+        p_ts = &timed_stats->next;
+    }
+
+    hist = bdrv_latency_histogram_info(&lh[BLOCK_ACCT_READ]);
+    s->stats->has_rd_latency_histogram = hist != NULL;
+    s->stats->rd_latency_histogram = hist;
+    hist = bdrv_latency_histogram_info(&lh[BLOCK_ACCT_WRITE]);
+    s->stats->has_wr_latency_histogram = hist != NULL;
+    s->stats->wr_latency_histogram = hist;
+    hist = bdrv_latency_histogram_info(&lh[BLOCK_ACCT_FLUSH]);
+    s->stats->has_flush_latency_histogram = hist != NULL;
+    s->stats->flush_latency_histogram = hist;
+
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
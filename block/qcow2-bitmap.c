@@ -0,0 +1,975 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The bitmaps are described by a directory, which the bitmaps header
+ * extension points to.  Each directory entry points to a bitmap table, whose
+ * entries point to the clusters holding the bits of the bitmap; a table
+ * entry without a cluster means that its part of the bitmap is all zeros or,
+ * with BME_TABLE_ENTRY_ALL_ONES, all ones.  See docs/specs/qcow2.txt.
+ *
+ * While the image is open read-write the bitmaps are marked in use.  They are
+ * stored when the image is flushed; only the clusters of the bitmap that
+ * changed since the last store are written, and the directory is only
+ * rewritten when bitmaps are added or removed or their tables move.  Closing
+ * the image stores the bitmaps one last time and clears the in-use flag, so a
+ * bitmap that is still in use when the image is opened was not stored after
+ * its last change and has to be considered fully dirty.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+#define BME_TABLE_ENTRY_OFFSET_MASK   0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_ALL_ONES      1ULL
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows */
+    /* name follows */
+} Qcow2BitmapDirEntry;
+
+typedef struct Qcow2BitmapExtent {
+    int64_t offset;
+    int64_t size;
+} Qcow2BitmapExtent;
+
+/* Clusters that are still referenced by the bitmap metadata on disk and can
+ * only be freed once the new metadata has been written */
+typedef struct Qcow2BitmapFreeList {
+    Qcow2BitmapExtent *extents;
+    int nb_extents;
+} Qcow2BitmapFreeList;
+
+static void free_list_add(Qcow2BitmapFreeList *list, int64_t offset,
+                          int64_t size)
+{
+    if (!offset || !size) {
+        return;
+    }
+    list->extents = g_renew(Qcow2BitmapExtent, list->extents,
+                            list->nb_extents + 1);
+    list->extents[list->nb_extents].offset = offset;
+    list->extents[list->nb_extents].size = size;
+    list->nb_extents++;
+}
+
+static void free_list_add_bitmap(BlockDriverState *bs,
+                                 Qcow2BitmapFreeList *list, Qcow2Bitmap *qb)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < qb->table_size; i++) {
+        free_list_add(list, qb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK,
+                      s->cluster_size);
+    }
+    free_list_add(list, qb->table_offset,
+                  (int64_t)qb->table_size * sizeof(uint64_t));
+}
+
+static void free_list_release(BlockDriverState *bs, Qcow2BitmapFreeList *list)
+{
+    int i;
+
+    for (i = 0; i < list->nb_extents; i++) {
+        qcow2_free_clusters(bs, list->extents[i].offset, list->extents[i].size,
+                            QCOW2_DISCARD_OTHER);
+    }
+    g_free(list->extents);
+    list->extents = NULL;
+    list->nb_extents = 0;
+}
+
+/* Number of sectors covered by one cluster of the bitmap */
+static uint64_t bitmap_sectors_per_cluster(BDRVQcowState *s,
+                                           int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+uint64_t qcow2_bitmap_table_size(BlockDriverState *bs, int granularity_bits)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return DIV_ROUND_UP(bs->total_sectors,
+                        bitmap_sectors_per_cluster(s, granularity_bits));
+}
+
+static Qcow2Bitmap *find_bitmap(BDRVQcowState *s, const char *name)
+{
+    Qcow2Bitmap *qb;
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        if (!strcmp(qb->name, name)) {
+            return qb;
+        }
+    }
+    return NULL;
+}
+
+static void free_bitmap(Qcow2Bitmap *qb)
+{
+    g_free(qb->name);
+    g_free(qb->table);
+    g_free(qb);
+}
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *qb;
+
+    while ((qb = QSIMPLEQ_FIRST(&s->bitmaps)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->bitmaps, next);
+        free_bitmap(qb);
+    }
+    s->store_bitmaps = false;
+}
+
+static int read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *qb,
+                             Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint32_t i;
+    int ret;
+
+    if (!qb->table_size) {
+        return 0;
+    }
+
+    qb->table = g_try_new(uint64_t, qb->table_size);
+    if (!qb->table) {
+        error_setg(errp, "Could not allocate the table of bitmap '%s'",
+                   qb->name);
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, qb->table_offset, qb->table,
+                     qb->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the table of bitmap '%s'",
+                         qb->name);
+        return ret;
+    }
+
+    for (i = 0; i < qb->table_size; i++) {
+        uint64_t entry = be64_to_cpu(qb->table[i]);
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if ((entry & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            (offset && (entry & BME_TABLE_ENTRY_ALL_ONES)) ||
+            offset_into_cluster(s, offset))
+        {
+            error_setg(errp, "Invalid table entry in bitmap '%s'", qb->name);
+            return -EINVAL;
+        }
+        qb->table[i] = entry;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the bitmap directory and the bitmap tables that the bitmaps header
+ * extension points to.  This does not create any BdrvDirtyBitmap yet, see
+ * qcow2_load_bitmaps().
+ */
+int qcow2_read_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *dir, *p, *end;
+    uint32_t i;
+    int ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (!dir) {
+        error_setg(errp, "Could not allocate the bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the bitmap directory");
+        goto fail;
+    }
+
+    p = dir;
+    end = dir + s->bitmap_directory_size;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry e;
+        Qcow2Bitmap *qb;
+
+        if (end - p < sizeof(e)) {
+            goto invalid;
+        }
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        if (e.type != BT_DIRTY_TRACKING_BITMAP || e.extra_data_size) {
+            error_setg(errp, "Unsupported bitmap type or extra data");
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (e.flags & ~QCOW2_BITMAP_FLAGS_MASK) {
+            error_setg(errp, "Unsupported bitmap flags 0x%" PRIx32,
+                       e.flags & ~QCOW2_BITMAP_FLAGS_MASK);
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (!e.name_size || e.name_size > QCOW2_MAX_BITMAP_NAME_SIZE ||
+            e.name_size > end - p ||
+            e.granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+            e.granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS ||
+            offset_into_cluster(s, e.bitmap_table_offset) ||
+            (!e.bitmap_table_offset && e.bitmap_table_size) ||
+            e.bitmap_table_size !=
+                qcow2_bitmap_table_size(bs, e.granularity_bits))
+        {
+            goto invalid;
+        }
+
+        qb = g_new0(Qcow2Bitmap, 1);
+        qb->name = g_strndup((char *)p, e.name_size);
+        qb->flags = e.flags;
+        qb->granularity_bits = e.granularity_bits;
+        qb->table_offset = e.bitmap_table_offset;
+        qb->table_size = e.bitmap_table_size;
+
+        if (find_bitmap(s, qb->name)) {
+            free_bitmap(qb);
+            goto invalid;
+        }
+        QSIMPLEQ_INSERT_TAIL(&s->bitmaps, qb, next);
+
+        /* Entries are padded to a multiple of 8 bytes */
+        p += e.name_size;
+        p = dir + ROUND_UP(p - dir, 8);
+        if (p > end) {
+            goto invalid;
+        }
+
+        ret = read_bitmap_table(bs, qb, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (p != end) {
+        goto invalid;
+    }
+
+    g_free(dir);
+    return 0;
+
+invalid:
+    error_setg(errp, "Invalid bitmap directory");
+    ret = -EINVAL;
+fail:
+    g_free(dir);
+    qcow2_free_bitmaps(bs);
+    return ret;
+}
+
+static int load_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *qb,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        bitmap_sectors_per_cluster(s, qb->granularity_bits);
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    buf = qemu_try_blockalign(bs->file, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < qb->table_size; i++) {
+        uint64_t entry = qb->table[i];
+        uint64_t start = i * sectors_per_cluster;
+
+        if (entry & BME_TABLE_ENTRY_OFFSET_MASK) {
+            ret = bdrv_pread(bs->file, entry & BME_TABLE_ENTRY_OFFSET_MASK,
+                             buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+        } else if (entry & BME_TABLE_ENTRY_ALL_ONES) {
+            memset(buf, 0xff, s->cluster_size);
+        } else {
+            continue;
+        }
+
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start,
+                                           MIN(sectors_per_cluster,
+                                               size - start));
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void release_loaded_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *qb;
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, qb->name);
+
+        if (bitmap && bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+}
+
+/*
+ * Creates a persistent BdrvDirtyBitmap for each bitmap in the image and, if
+ * the image is writable, marks them in use.
+ *
+ * Bitmaps that are already marked in use were not stored when the image was
+ * last closed and are made fully dirty, unless @trust_in_use is set: on
+ * incoming migration the source has stored them on its last flush and still
+ * has them marked in use.
+ */
+int qcow2_load_bitmaps(BlockDriverState *bs, bool trust_in_use, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *qb;
+    int ret;
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        BdrvDirtyBitmap *bitmap;
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << qb->granularity_bits,
+                                          qb->name, errp);
+        if (!bitmap) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+
+        if ((qb->flags & QCOW2_BITMAP_IN_USE) && !trust_in_use) {
+            error_report("warning: persistent dirty bitmap '%s' was not "
+                         "stored when the image was closed, marking all of "
+                         "it dirty", qb->name);
+            bdrv_set_dirty_bitmap(bitmap, 0, bdrv_dirty_bitmap_size(bitmap));
+        } else {
+            ret = load_bitmap_data(bs, qb, bitmap);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                                 qb->name);
+                goto fail;
+            }
+            /* What is in memory now matches the image */
+            bdrv_dirty_bitmap_track_changes(bitmap,
+                bitmap_sectors_per_cluster(s, qb->granularity_bits));
+        }
+
+        if (!(qb->flags & QCOW2_BITMAP_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+    }
+
+    s->store_bitmaps = true;
+    ret = qcow2_store_bitmaps(bs, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not mark the persistent dirty "
+                         "bitmaps in use");
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    s->store_bitmaps = false;
+    release_loaded_bitmaps(bs);
+    return ret;
+}
+
+static int flush_refcounts(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_apply_refcount_deltas(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
+}
+
+static bool buffer_is_all_ones(const uint8_t *buf, size_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(*p); i++) {
+        if (p[i] != UINT64_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int write_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *qb)
+{
+    size_t size = qb->table_size * sizeof(uint64_t);
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    table = g_try_malloc(size);
+    if (!table) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < qb->table_size; i++) {
+        table[i] = cpu_to_be64(qb->table[i]);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, qb->table_offset, size);
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file, qb->table_offset, table, size);
+    }
+    g_free(table);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Writes the clusters of @bitmap that changed since it was last stored, or
+ * all of them if changes are not tracked, and then the bitmap table if any
+ * of its entries changed.  Clusters that are no longer used are added to
+ * @old.  Sets *@dir_changed if the table moved.
+ */
+static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *qb,
+                        BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                        Qcow2BitmapFreeList *old, bool *dir_changed)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        bitmap_sectors_per_cluster(s, qb->granularity_bits);
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t table_size = DIV_ROUND_UP(size, sectors_per_cluster);
+    bool full = !bdrv_dirty_bitmap_tracks_changes(bitmap);
+    bool table_changed = false;
+    bool allocated = false;
+    uint64_t i;
+    int ret;
+
+    if (table_size > QCOW2_MAX_BITMAP_TABLE_SIZE) {
+        return -EFBIG;
+    }
+
+    if (table_size != qb->table_size) {
+        uint64_t *table = g_try_new0(uint64_t, table_size);
+
+        if (table_size && !table) {
+            return -ENOMEM;
+        }
+        for (i = 0; i < qb->table_size; i++) {
+            if (i < table_size) {
+                table[i] = qb->table[i];
+            } else {
+                free_list_add(old, qb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK,
+                              s->cluster_size);
+            }
+        }
+        /* The table is written to new clusters below */
+        free_list_add(old, qb->table_offset,
+                      (int64_t)qb->table_size * sizeof(uint64_t));
+        qb->table_offset = 0;
+
+        g_free(qb->table);
+        qb->table = table;
+        qb->table_size = table_size;
+        table_changed = true;
+        full = true;
+    }
+
+    if (full) {
+        bdrv_dirty_bitmap_track_changes(bitmap, sectors_per_cluster);
+    }
+
+    for (i = 0; i < table_size; i++) {
+        uint64_t start, count, entry, offset;
+        int64_t next;
+
+        if (!full) {
+            next = bdrv_dirty_bitmap_next_change(bitmap,
+                                                 i * sectors_per_cluster);
+            if (next < 0) {
+                break;
+            }
+            i = next / sectors_per_cluster;
+        }
+        start = i * sectors_per_cluster;
+        count = MIN(sectors_per_cluster, size - start);
+
+        /* Writes from now on mark the cluster changed again */
+        bdrv_dirty_bitmap_set_changed(bitmap, start, count, false);
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+
+        offset = qb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            entry = 0;
+        } else if (count == sectors_per_cluster &&
+                   buffer_is_all_ones(buf, s->cluster_size)) {
+            entry = BME_TABLE_ENTRY_ALL_ONES;
+        } else {
+            /* The bitmap is in use, so the cluster can be overwritten */
+            if (!offset) {
+                int64_t new_offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                if (new_offset < 0) {
+                    ret = new_offset;
+                    goto fail;
+                }
+                offset = new_offset;
+                allocated = true;
+            }
+            entry = offset;
+
+            ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                s->cluster_size);
+            if (ret < 0) {
+                goto fail;
+            }
+            ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        if (entry != qb->table[i]) {
+            if (!(entry & BME_TABLE_ENTRY_OFFSET_MASK)) {
+                free_list_add(old, offset, s->cluster_size);
+            }
+            qb->table[i] = entry;
+            table_changed = true;
+        }
+    }
+
+    if (!table_changed) {
+        return 0;
+    }
+
+    if (!qb->table_offset && table_size) {
+        int64_t table_offset = qcow2_alloc_clusters(bs,
+                                                    table_size *
+                                                    sizeof(uint64_t));
+        if (table_offset < 0) {
+            ret = table_offset;
+            goto fail;
+        }
+        qb->table_offset = table_offset;
+        allocated = true;
+        *dir_changed = true;
+    } else if (!table_size) {
+        *dir_changed = true;
+    }
+
+    /* Clusters must be allocated on disk before anything points to them */
+    if (allocated) {
+        ret = flush_refcounts(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (table_size) {
+        ret = write_bitmap_table(bs, qb);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    trace_qcow2_store_bitmap(bs, qb->name, full, table_changed);
+    return 0;
+
+fail:
+    bdrv_dirty_bitmap_set_changed(bitmap, 0, size, true);
+    return ret;
+}
+
+static size_t bitmap_directory_size(BDRVQcowState *s)
+{
+    Qcow2Bitmap *qb;
+    size_t size = 0;
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        size += ROUND_UP(sizeof(Qcow2BitmapDirEntry) + strlen(qb->name), 8);
+    }
+    return size;
+}
+
+static int write_bitmap_directory(BlockDriverState *bs, int64_t offset,
+                                  size_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *qb;
+    uint8_t *dir, *p;
+    int ret;
+
+    dir = g_try_malloc0(size);
+    if (!dir) {
+        return -ENOMEM;
+    }
+
+    p = dir;
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        size_t name_size = strlen(qb->name);
+        Qcow2BitmapDirEntry e = {
+            .bitmap_table_offset = cpu_to_be64(qb->table_offset),
+            .bitmap_table_size   = cpu_to_be32(qb->table_size),
+            .flags               = cpu_to_be32(qb->flags),
+            .type                = BT_DIRTY_TRACKING_BITMAP,
+            .granularity_bits    = qb->granularity_bits,
+            .name_size           = cpu_to_be16(name_size),
+            .extra_data_size     = 0,
+        };
+
+        memcpy(p, &e, sizeof(e));
+        memcpy(p + sizeof(e), qb->name, name_size);
+        p += ROUND_UP(sizeof(e) + name_size, 8);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret >= 0) {
+        ret = bdrv_pwrite(bs->file, offset, dir, size);
+    }
+    g_free(dir);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Writes the bitmap directory to new clusters and points the header to it.
+ * The old directory is added to @old.
+ */
+static int update_bitmap_directory(BlockDriverState *bs,
+                                   Qcow2BitmapFreeList *old)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint64_t old_autoclear = s->autoclear_features;
+    size_t size = bitmap_directory_size(s);
+    int64_t offset = 0;
+    int ret;
+
+    if (size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EFBIG;
+    }
+
+    if (size) {
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            return offset;
+        }
+        ret = flush_refcounts(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = write_bitmap_directory(bs, offset, size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* Everything the new directory points to must be stable first */
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmap_directory_offset = offset;
+    s->bitmap_directory_size = size;
+    if (s->nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmap_directory_offset = old_offset;
+        s->bitmap_directory_size = old_size;
+        s->autoclear_features = old_autoclear;
+        goto fail;
+    }
+
+    free_list_add(old, old_offset, old_size);
+    return 0;
+
+fail:
+    if (offset > 0) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    return ret;
+}
+
+/*
+ * Stores all persistent dirty bitmaps of @bs in the image.  Bitmaps that were
+ * removed since the last call are removed from the image.  With @closing set,
+ * the bitmaps are marked as no longer in use.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs, bool closing)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *qb, *next_qb;
+    Qcow2BitmapFreeList old = { 0 };
+    bool dir_changed = false;
+    bool flags_changed = false;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    if (!s->store_bitmaps || bs->read_only ||
+        (bs->open_flags & BDRV_O_INCOMING))
+    {
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        qb->stored = false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        int granularity_bits;
+        uint32_t flags;
+
+        if (!name || !bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+
+        granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        qb = find_bitmap(s, name);
+        if (qb && qb->granularity_bits != granularity_bits) {
+            /* Removed and added again with a different granularity */
+            free_list_add_bitmap(bs, &old, qb);
+            g_free(qb->table);
+            qb->table = NULL;
+            qb->table_offset = 0;
+            qb->table_size = 0;
+            qb->granularity_bits = granularity_bits;
+            dir_changed = true;
+        } else if (!qb) {
+            qb = g_new0(Qcow2Bitmap, 1);
+            qb->name = g_strdup(name);
+            qb->granularity_bits = granularity_bits;
+            QSIMPLEQ_INSERT_TAIL(&s->bitmaps, qb, next);
+            s->nb_bitmaps++;
+            dir_changed = true;
+        }
+        qb->stored = true;
+
+        flags = closing ? 0 : QCOW2_BITMAP_IN_USE;
+        if (bdrv_dirty_bitmap_status(bitmap) != DIRTY_BITMAP_STATUS_DISABLED) {
+            flags |= QCOW2_BITMAP_AUTO;
+        }
+        if (flags != qb->flags) {
+            qb->flags = flags;
+            flags_changed = true;
+        }
+
+        if (!buf) {
+            buf = qemu_try_blockalign(bs->file, s->cluster_size);
+            if (!buf) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+        }
+        ret = store_bitmap(bs, qb, bitmap, buf, &old, &dir_changed);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(qb, &s->bitmaps, next, next_qb) {
+        if (!qb->stored) {
+            free_list_add_bitmap(bs, &old, qb);
+            QSIMPLEQ_REMOVE(&s->bitmaps, qb, Qcow2Bitmap, next);
+            free_bitmap(qb);
+            s->nb_bitmaps--;
+            dir_changed = true;
+        }
+    }
+
+    if (dir_changed || s->bitmap_directory_dirty) {
+        ret = update_bitmap_directory(bs, &old);
+    } else if (flags_changed) {
+        /* Only the flags changed, so the directory keeps its layout and can
+         * be updated in place; the bitmaps must be stable before they are
+         * marked as not in use */
+        ret = closing ? bdrv_flush(bs->file) : 0;
+        if (ret >= 0) {
+            ret = write_bitmap_directory(bs, s->bitmap_directory_offset,
+                                         s->bitmap_directory_size);
+        }
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+    s->bitmap_directory_dirty = false;
+
+    free_list_release(bs, &old);
+    qemu_vfree(buf);
+    return 0;
+
+fail:
+    /* The clusters in old may still be in use on disk, so they leak */
+    g_free(old.extents);
+    qemu_vfree(buf);
+    s->bitmap_directory_dirty = true;
+    return ret;
+}
+
+/*
+ * Removes all bitmaps from the image, for example before downgrading it to a
+ * version that cannot store them.  The BdrvDirtyBitmaps are kept, but are no
+ * longer persistent.
+ */
+int qcow2_remove_all_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapFreeList old = { 0 };
+    Qcow2Bitmap *qb;
+    int ret;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        bdrv_dirty_bitmap_set_persistence(bitmap, false);
+    }
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        free_list_add_bitmap(bs, &old, qb);
+    }
+    qcow2_free_bitmaps(bs);
+    s->nb_bitmaps = 0;
+
+    ret = update_bitmap_directory(bs, &old);
+    if (ret < 0) {
+        g_free(old.extents);
+        return ret;
+    }
+    free_list_release(bs, &old);
+    return 0;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    int granularity_bits = ctz32(granularity);
+    BdrvDirtyBitmap *bitmap;
+    uint32_t nb_bitmaps = 0;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image "
+                   "with at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Persistent dirty bitmaps cannot be added to a "
+                   "read-only image");
+        return false;
+    }
+    if (!s->store_bitmaps) {
+        error_setg(errp, "Persistent dirty bitmaps cannot be added during "
+                   "incoming migration");
+        return false;
+    }
+    if (strlen(name) > QCOW2_MAX_BITMAP_NAME_SIZE) {
+        error_setg(errp, "Bitmap names are limited to %d bytes",
+                   QCOW2_MAX_BITMAP_NAME_SIZE);
+        return false;
+    }
+    if (granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+        granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity of persistent dirty bitmaps must be "
+                   "between %d and %d bytes",
+                   1 << QCOW2_MIN_BITMAP_GRANULARITY_BITS,
+                   1U << QCOW2_MAX_BITMAP_GRANULARITY_BITS);
+        return false;
+    }
+    if (qcow2_bitmap_table_size(bs, granularity_bits) >
+        QCOW2_MAX_BITMAP_TABLE_SIZE) {
+        error_setg(errp, "Granularity too small for the size of the image");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        nb_bitmaps += bdrv_dirty_bitmap_get_persistence(bitmap);
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent dirty bitmaps");
+        return false;
+    }
+
+    return true;
+}
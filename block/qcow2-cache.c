@@ -22,16 +22,44 @@
  * THE SOFTWARE.
  */
 
+/* Needed for CONFIG_MADVISE */
+#include "config-host.h"
+
+#if defined(CONFIG_MADVISE) || defined(CONFIG_POSIX_MADVISE)
+#include <sys/mman.h>
+#endif
+
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/atomic.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table indexed by their offset in
+ * the image.  The tables that are not in use (ref == 0) are kept in a list,
+ * least recently used first, from which the tables to replace on a miss
+ * are taken; unused entries (offset == 0) are kept in a list of their own.
+ *
+ * Lookups and replacements therefore don't scan the whole cache, and an
+ * entry that is referenced can't be replaced, so that a request that waits
+ * for I/O doesn't need to keep other requests out of the cache.
+ *
+ * The memory of unused entries is given back to the host, so a cache only
+ * takes as much memory as it holds tables.  qcow2_cache_clean_unused()
+ * drops the tables that have not been used since its previous call, and
+ * once the tables of all caches take up qcow2_cache_budget bytes, a miss
+ * replaces a cached table instead of filling an unused entry.
+ */
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     bool     dirty;
-    uint64_t lru_counter;
     int      ref;
+    /* value of lru_counter of the cache when the table was last released */
+    uint64_t lru_counter;
+    /* next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,9 +68,23 @@ struct Qcow2Cache {
     int                     size;
     bool                    depends_on_flush;
     void                   *table_array;
+    /* heads of the hash chains, nb_buckets is a power of 2 */
+    int                    *buckets;
+    int                     nb_buckets;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+    QTAILQ_HEAD(, Qcow2CachedTable) free_list;
+    int                     nb_used;
     uint64_t                lru_counter;
+    uint64_t                cache_clean_lru_counter;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+size_t qcow2_cache_budget;
+
+/* Memory taken by the tables in all caches of the process */
+static size_t qcow2_cache_used_bytes;
+
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
@@ -60,6 +102,159 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
+static inline int qcow2_cache_bucket(BlockDriverState *bs, Qcow2Cache *c,
+                                     uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    return (offset >> s->cluster_bits) & (c->nb_buckets - 1);
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(bs, c, offset)]; i != -1;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c,
+                                    int i)
+{
+    int *head = &c->buckets[qcow2_cache_bucket(bs, c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *head;
+    *head = i;
+}
+
+static void qcow2_cache_hash_remove(BlockDriverState *bs, Qcow2Cache *c,
+                                    int i)
+{
+    int *p = &c->buckets[qcow2_cache_bucket(bs, c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p != -1);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Give the memory of num_tables tables from table i on back to the host */
+static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
+                                      int i, int num_tables)
+{
+/* Only Linux is known to drop the pages for good, i.e. to take them back */
+#ifdef CONFIG_LINUX
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *t = qcow2_cache_get_table_addr(bs, c, i);
+    size_t align = getpagesize();
+    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
+    size_t length;
+
+    if (mem_size <= offset) {
+        return;
+    }
+    length = QEMU_ALIGN_DOWN(mem_size - offset, align);
+    if (length > 0) {
+        qemu_madvise(t + offset, length, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
+/* Account for num_tables entries starting (> 0) or ceasing to hold tables */
+static void qcow2_cache_account(BlockDriverState *bs, Qcow2Cache *c,
+                                int num_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    c->nb_used += num_tables;
+    if (num_tables > 0) {
+        atomic_add(&qcow2_cache_used_bytes,
+                   (size_t) num_tables * s->cluster_size);
+    } else if (num_tables < 0) {
+        atomic_sub(&qcow2_cache_used_bytes,
+                   (size_t) -num_tables * s->cluster_size);
+    }
+}
+
+static bool qcow2_cache_over_budget(void)
+{
+    return qcow2_cache_budget &&
+           atomic_read(&qcow2_cache_used_bytes) >= qcow2_cache_budget;
+}
+
+/* Forget all tables; none of them may be in use */
+static void qcow2_cache_reset(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    QTAILQ_INIT(&c->lru_list);
+    QTAILQ_INIT(&c->free_list);
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+        c->entries[i].offset = 0;
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->free_list, &c->entries[i], lru_entry);
+    }
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
+    qcow2_cache_account(bs, c, -c->nb_used);
+    qcow2_cache_table_release(bs, c, 0, c->size);
+}
+
+/*
+ * Drop the tables that have not been used since the previous call and give
+ * their memory back.  Dirty tables and tables in use are kept.
+ */
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
+{
+    Qcow2CachedTable *t, *next;
+    int i, first = -1, dropped = 0;
+
+    QTAILQ_FOREACH_SAFE(t, &c->lru_list, lru_entry, next) {
+        if (t->lru_counter > c->cache_clean_lru_counter) {
+            /* The rest of the list has been used more recently */
+            break;
+        }
+        if (t->dirty) {
+            continue;
+        }
+        qcow2_cache_hash_remove(bs, c, t - c->entries);
+        t->offset = 0;
+        QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+        QTAILQ_INSERT_TAIL(&c->free_list, t, lru_entry);
+        dropped++;
+    }
+    qcow2_cache_account(bs, c, -dropped);
+    c->cache_clean_lru_counter = c->lru_counter;
+
+    if (!dropped) {
+        return;
+    }
+
+    /* Release runs of unused entries, which may be smaller than a page */
+    for (i = 0; i <= c->size; i++) {
+        bool unused = i < c->size && c->entries[i].offset == 0 &&
+                      c->entries[i].ref == 0;
+
+        if (unused && first < 0) {
+            first = i;
+        } else if (!unused && first >= 0) {
+            qcow2_cache_table_release(bs, c, first, i - first);
+            first = -1;
+        }
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -67,17 +262,22 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->nb_buckets = pow2ceil(num_tables);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, c->nb_buckets);
     c->table_array = qemu_try_blockalign(bs->file,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(bs, c);
+
     return c;
 }
 
@@ -88,14 +288,22 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
+    qcow2_cache_account(bs, c, -c->nb_used);
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -224,20 +432,14 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
-    }
-
-    c->lru_counter = 0;
+    qcow2_cache_reset(bs, c);
 
     return 0;
 }
@@ -246,39 +448,40 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i != -1) {
+        c->hits++;
+        t = &c->entries[i];
+        if (t->ref == 0) {
+            QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
         }
-    } while (i != lookup_index);
+        t->ref++;
+        goto found;
+    }
+    c->misses++;
 
-    if (min_lru_index == -1) {
+    /* Don't add to the memory of the caches once they have reached their
+     * budget, unless there is no table that could be replaced */
+    t = QTAILQ_FIRST(&c->free_list);
+    if (!t || (qcow2_cache_over_budget() && !QTAILQ_EMPTY(&c->lru_list))) {
+        t = QTAILQ_FIRST(&c->lru_list);
+    }
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -289,7 +492,17 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        qcow2_cache_hash_remove(bs, c, i);
+        t->offset = 0;
+        QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    } else {
+        QTAILQ_REMOVE(&c->free_list, t, lru_entry);
+        qcow2_cache_account(bs, c, 1);
+    }
+
+    /* Keep the entry for us while it is being read */
+    t->ref++;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -298,15 +511,18 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(bs, c, i),
                          s->cluster_size);
         if (ret < 0) {
+            t->ref--;
+            QTAILQ_INSERT_HEAD(&c->free_list, t, lru_entry);
+            qcow2_cache_account(bs, c, -1);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -336,6 +552,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
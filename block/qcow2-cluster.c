@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
 
 #include "qemu-common.h"
 #include "block/block_int.h"
@@ -215,7 +214,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -238,7 +237,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->cluster_size);
     } else {
         uint64_t* old_table;
 
@@ -269,6 +268,10 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    qcow2_metadata_map_remove(bs, QCOW2_OL_ACTIVE_L2,
+                              old_l2_offset & L1E_OFFSET_MASK,
+                              s->cluster_size);
+    qcow2_metadata_map_add(bs, QCOW2_OL_ACTIVE_L2, l2_offset, s->cluster_size);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -283,9 +286,16 @@ fail:
     if (l2_table != NULL) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
     }
-    s->l1_table[l1_index] = old_l2_offset;
+    if (s->l1_table[l1_index] != old_l2_offset) {
+        s->l1_table[l1_index] = old_l2_offset;
+        qcow2_metadata_map_remove(bs, QCOW2_OL_ACTIVE_L2, l2_offset,
+                                  s->cluster_size);
+        qcow2_metadata_map_add(bs, QCOW2_OL_ACTIVE_L2,
+                               old_l2_offset & L1E_OFFSET_MASK,
+                               s->cluster_size);
+    }
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -298,12 +308,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -312,8 +322,8 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -321,12 +331,15 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+                                          uint64_t nb_clusters,
+                                          uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -336,6 +349,58 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * For images with extended L2 entries: counts the subclusters, starting at
+ * subcluster sc_index of the cluster at l2_index, that read from the same
+ * place as the first one (its type is stored in *type).  Data subclusters
+ * must also be contiguous in the image file, and compressed clusters are
+ * processed one by one.
+ *
+ * Returns the number of subclusters (at least 1), or -EIO if the first L2
+ * entry is invalid.
+ */
+static int count_contiguous_subclusters(BDRVQcowState *s, int nb_clusters,
+                                        int sc_index, uint64_t *l2_table,
+                                        int l2_index, int *type)
+{
+    uint64_t first_offset = 0;
+    int i, j, count = 0;
+
+    *type = -EIO;
+    for (i = 0; i < nb_clusters; i++, sc_index = 0) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+        if (i == 0) {
+            first_offset = l2_entry & L2E_OFFSET_MASK;
+        } else if (*type == QCOW2_CLUSTER_NORMAL &&
+                   (l2_entry & L2E_OFFSET_MASK) !=
+                   first_offset + (uint64_t) i * s->cluster_size) {
+            break;
+        }
+
+        for (j = sc_index; j < s->subclusters_per_cluster; j++) {
+            int t = qcow2_get_subcluster_type(l2_entry, l2_bitmap, j);
+
+            if (count == 0) {
+                if (t < 0) {
+                    return t;
+                }
+                *type = t;
+            } else if (t != *type) {
+                return count;
+            }
+            count++;
+        }
+
+        if (*type == QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+    }
+
+    return count;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -472,7 +537,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset, *l2_table;
-    int l1_bits, c;
+    int l1_bits, c, sc_index = 0;
     unsigned int index_in_cluster, nb_clusters;
     uint64_t nb_available, nb_needed;
     int ret;
@@ -529,10 +594,25 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
-    ret = qcow2_get_cluster_type(*cluster_offset);
+    if (has_subclusters(s)) {
+        /* With extended L2 entries the type is given per subcluster */
+        sc_index = offset_to_sc_index(s, offset);
+        c = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                         l2_table, l2_index, &ret);
+        if (c < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry "
+                                    "found (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+    } else {
+        ret = qcow2_get_cluster_type(*cluster_offset);
+    }
+
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
@@ -547,19 +627,26 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_ZERO);
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_free_clusters(s, nb_clusters, l2_table,
+                                               l2_index);
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        if (!has_subclusters(s)) {
+            c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_ZERO);
+        }
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -576,7 +663,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
-    nb_available = (c * s->cluster_sectors);
+    if (has_subclusters(s) && ret != QCOW2_CLUSTER_COMPRESSED) {
+        nb_available = (sc_index + c) * s->subcluster_sectors;
+    } else {
+        nb_available = (c * s->cluster_sectors);
+    }
 
 out:
     if (nb_available > nb_needed)
@@ -648,7 +739,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -693,7 +784,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -717,7 +808,11 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* compressed clusters have no subcluster bitmap */
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -796,17 +891,43 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     assert(l2_index + m->nb_clusters <= s->l2_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t new_offset = cluster_offset + (i << s->cluster_bits);
+
         /* if two concurrent writes happen to the same unallocated cluster
 	 * each write allocates separate cluster and writes data concurrently.
 	 * The first one to complete updates l2 table with pointer to its
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        if (old_entry != 0 && (old_entry & L2E_OFFSET_MASK) != new_offset) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        if (has_subclusters(s)) {
+            /* Only the subclusters covered by the write and its COW areas
+             * become allocated, the others keep reading from where they
+             * did before */
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+            uint64_t start = MAX(l2meta_cow_start(m) - m->offset,
+                                 cluster_start) - cluster_start;
+            uint64_t end = MIN(l2meta_cow_end(m) - m->offset - cluster_start,
+                               s->cluster_size);
+            int first_sc = start >> s->subcluster_bits;
+            int last_sc = DIV_ROUND_UP(end, s->subcluster_size);
+
+            if ((old_entry & L2E_OFFSET_MASK) != new_offset) {
+                l2_bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+            }
+            l2_bitmap &= ~(QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc) |
+                           QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc));
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+            set_l2_bitmap(s, l2_table, l2_index + i, l2_bitmap);
+        }
+
+        set_l2_entry(s, l2_table, l2_index + i,
+                     new_offset | QCOW_OFLAG_COPIED);
      }
 
 
@@ -821,7 +942,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -843,7 +964,7 @@ static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -894,6 +1015,14 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /* With subclusters, the COW areas don't necessarily extend to the
+         * cluster boundaries.  Still, two requests must not allocate the same
+         * cluster at the same time. */
+        if (has_subclusters(s)) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -986,7 +1115,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1013,14 +1142,37 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
-        *bytes = MIN(*bytes,
-                 keep_clusters * s->cluster_size
-                 - offset_into_cluster(s, guest_offset));
+        if (has_subclusters(s)) {
+            /* ...but only their allocated subclusters */
+            int sc_index = offset_to_sc_index(s, guest_offset);
+            int type;
+            int nb_sc = count_contiguous_subclusters(s, keep_clusters,
+                                                     sc_index, l2_table,
+                                                     l2_index, &type);
+            if (nb_sc < 0) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster "
+                                        "entry found (guest offset: %#"
+                                        PRIx64 ")", guest_offset);
+                ret = -EIO;
+                goto out;
+            }
+            if (type != QCOW2_CLUSTER_NORMAL) {
+                ret = 0;
+                goto out;
+            }
+
+            *bytes = MIN(*bytes,
+                     (uint64_t) (sc_index + nb_sc) * s->subcluster_size
+                     - offset_into_cluster(s, guest_offset));
+        } else {
+            *bytes = MIN(*bytes,
+                     keep_clusters * s->cluster_size
+                     - offset_into_cluster(s, guest_offset));
+        }
 
         ret = 1;
     } else {
@@ -1116,6 +1268,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     unsigned int nb_clusters;
+    bool reuse_cluster = false;
+    bool sc_cow_start = false, sc_cow_end = false;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1140,10 +1294,18 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (has_subclusters(s) &&
+        qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+        (entry & QCOW_OFLAG_COPIED))
+    {
+        /* The cluster is ours already, only the subclusters that we write to
+         * aren't allocated yet. Fill them in place. */
+        reuse_cluster = true;
+        nb_clusters = 1;
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
@@ -1154,20 +1316,41 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    /* With subclusters, the COW only has to cover the partially written
+     * subclusters, unless the old data lives in another host cluster whose
+     * content must be copied as a whole. */
+    if (has_subclusters(s)) {
+        uint64_t last = get_l2_entry(s, l2_table, l2_index + nb_clusters - 1);
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+        sc_cow_start = reuse_cluster ||
+            !(entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED));
+        sc_cow_end = reuse_cluster ||
+            !(last & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED));
     }
 
-    /* Can't extend contiguous allocation */
-    if (nb_clusters == 0) {
-        *bytes = 0;
-        return 0;
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    if (reuse_cluster) {
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        if (*host_offset != 0 &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset) {
+            *bytes = 0;
+            return 0;
+        }
+    } else {
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /* Can't extend contiguous allocation */
+        if (nb_clusters == 0) {
+            *bytes = 0;
+            return 0;
+        }
     }
 
     /* !*host_offset would overwrite the image header and is reserved for "no
@@ -1203,8 +1386,18 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sector = 0;
+    int cow_end_sector = avail_sectors;
     QCowL2Meta *old_m = *m;
 
+    if (sc_cow_start) {
+        cow_start_sector = alloc_n_start & ~(s->subcluster_sectors - 1);
+    }
+    if (sc_cow_end) {
+        cow_end_sector = MIN(ROUND_UP(nb_sectors, s->subcluster_sectors),
+                             avail_sectors);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1216,12 +1409,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_available   = nb_sectors,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sector * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sector,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sector - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1368,33 +1561,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1411,8 +1577,8 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+        if (qcow2_decompress(bs, s->cluster_cache, s->cluster_size,
+                             s->cluster_data + sector_offset, csize) < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
@@ -1445,7 +1611,26 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t new_bitmap = full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES;
+
+            /* Same as below, but the zero flags live in the bitmap */
+            if (!(old_l2_entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) &&
+                (old_bitmap == new_bitmap ||
+                 (!full_discard && !bs->backing_hd)))
+            {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i, new_bitmap);
+            qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+            continue;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1484,9 +1669,9 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1564,15 +1749,26 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            /* The host cluster is kept (if any), but none of its subclusters
+             * is used any more */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1615,6 +1811,97 @@ fail:
     return ret;
 }
 
+/*
+ * Makes the guest cluster at @dst_offset refer to the same host cluster as
+ * the one at @src_offset, whose refcount is increased.  Neither entry keeps
+ * QCOW_OFLAG_COPIED, so a later write to either of them allocates a new
+ * cluster.  Both offsets are cluster aligned.
+ *
+ * -ENOTSUP is returned if the clusters cannot be shared: @src_offset is not
+ * a normal cluster, @dst_offset is allocated already, or the refcount is at
+ * its maximum.  The caller has to copy the data then.
+ */
+int qcow2_share_cluster(BlockDriverState *bs, uint64_t src_offset,
+                        uint64_t dst_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t host_offset, refcount, entry;
+    int l2_index, num = s->cluster_sectors;
+    int ret;
+
+    assert(offset_into_cluster(s, src_offset) == 0);
+    assert(offset_into_cluster(s, dst_offset) == 0);
+
+    if (has_subclusters(s) || src_offset == dst_offset) {
+        return -ENOTSUP;
+    }
+
+    ret = qcow2_get_cluster_offset(bs, src_offset, &num, &host_offset);
+    if (ret < 0) {
+        return ret;
+    } else if (ret != QCOW2_CLUSTER_NORMAL) {
+        return -ENOTSUP;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    } else if (refcount >= s->refcount_max) {
+        return -ENOTSUP;
+    }
+
+    ret = get_cluster_table(bs, dst_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    entry = get_l2_entry(s, l2_table, l2_index);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    if (entry != 0 && entry != QCOW_OFLAG_ZERO) {
+        return -ENOTSUP;
+    }
+
+    /* The source entry must lose QCOW_OFLAG_COPIED before the refcount
+     * goes up, or the cluster could be overwritten in place */
+    ret = get_cluster_table(bs, src_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    entry = get_l2_entry(s, l2_table, l2_index);
+    if (entry & QCOW_OFLAG_COPIED) {
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+        set_l2_entry(s, l2_table, l2_index, entry & ~QCOW_OFLAG_COPIED);
+    }
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The new reference must not be on disk before the refcount is */
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, dst_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                      1, true, QCOW2_DISCARD_NEVER);
+        return ret;
+    }
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    set_l2_entry(s, l2_table, l2_index, host_offset);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    return 0;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
@@ -1685,7 +1972,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             int64_t offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
             bool preallocated = offset != 0;
@@ -1698,7 +1985,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 if (!bs->backing_hd) {
                     /* not backed; therefore we can simply deallocate the
                      * cluster */
-                    l2_table[j] = 0;
+                    set_l2_entry(s, l2_table, j, 0);
                     l2_dirty = true;
                     continue;
                 }
@@ -1757,9 +2044,9 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                set_l2_entry(s, l2_table, j, offset | QCOW_OFLAG_COPIED);
             } else {
-                l2_table[j] = cpu_to_be64(offset);
+                set_l2_entry(s, l2_table, j, offset);
             }
             l2_dirty = true;
         }
@@ -28,6 +28,7 @@
 #include "qemu/range.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
+static void prealloc_claim(BlockDriverState *bs, int64_t offset, int64_t end);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int64_t offset, int64_t length, uint64_t addend,
                             bool decrease, enum qcow2_discard_type type);
@@ -109,6 +110,9 @@ int qcow2_refcount_init(BlockDriverState *bs)
         for(i = 0; i < s->refcount_table_size; i++)
             be64_to_cpus(&s->refcount_table[i]);
     }
+
+    s->refcount_deltas = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               NULL, g_free);
     return 0;
  fail:
     return ret;
@@ -118,6 +122,11 @@ void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     g_free(s->refcount_table);
+    qcow2_metadata_map_invalidate(bs);
+    if (s->refcount_deltas) {
+        g_hash_table_destroy(s->refcount_deltas);
+        s->refcount_deltas = NULL;
+    }
 }
 
 
@@ -225,11 +234,29 @@ static int load_refcount_block(BlockDriverState *bs,
 }
 
 /*
- * Retrieves the refcount of the cluster given by its index and stores it in
- * *refcount. Returns 0 on success and -errno on failure.
+ * A refcount change that hasn't been written to the refcount blocks yet (see
+ * update_refcount_deferred())
  */
-int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
-                       uint64_t *refcount)
+typedef struct Qcow2RefcountDelta {
+    int64_t cluster_index;
+    int64_t delta;
+} Qcow2RefcountDelta;
+
+static Qcow2RefcountDelta *find_refcount_delta(BDRVQcowState *s,
+                                               int64_t cluster_index)
+{
+    if (!s->refcount_deltas) {
+        return NULL;
+    }
+    return g_hash_table_lookup(s->refcount_deltas, &cluster_index);
+}
+
+/*
+ * Retrieves the refcount of the cluster given by its index as stored in the
+ * refcount block, i.e. without any deferred updates.
+ */
+static int get_stored_refcount(BlockDriverState *bs, int64_t cluster_index,
+                               uint64_t *refcount)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t refcount_table_index, block_index;
@@ -270,6 +297,30 @@ int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
     return 0;
 }
 
+/*
+ * Retrieves the refcount of the cluster given by its index and stores it in
+ * *refcount. Returns 0 on success and -errno on failure.
+ */
+int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
+                       uint64_t *refcount)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountDelta *d;
+    int ret;
+
+    ret = get_stored_refcount(bs, cluster_index, refcount);
+    if (ret < 0) {
+        return ret;
+    }
+
+    d = find_refcount_delta(s, cluster_index);
+    if (d) {
+        *refcount += d->delta;
+    }
+
+    return 0;
+}
+
 /*
  * Rounds the refcount table size up to avoid growing the table for each single
  * refcount block that is allocated.
@@ -439,6 +490,8 @@ static int alloc_refcount_block(BlockDriverState *bs,
         }
 
         s->refcount_table[refcount_table_index] = new_block;
+        qcow2_metadata_map_add(bs, QCOW2_OL_REFCOUNT_BLOCK, new_block,
+                               s->cluster_size);
 
         /* The new refcount block may be where the caller intended to put its
          * data, so let it restart the search. */
@@ -533,6 +586,9 @@ static int alloc_refcount_block(BlockDriverState *bs,
         s->set_refcount(new_blocks, block++, 1);
     }
 
+    prealloc_claim(bs, meta_offset,
+                   table_offset + table_clusters * s->cluster_size);
+
     /* Write refcount blocks to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE_BLOCKS);
     ret = bdrv_pwrite_sync(bs->file, meta_offset, new_blocks,
@@ -578,6 +634,7 @@ static int alloc_refcount_block(BlockDriverState *bs,
     s->refcount_table = new_table;
     s->refcount_table_size = table_size;
     s->refcount_table_offset = table_offset;
+    qcow2_metadata_map_invalidate(bs);
 
     /* Free old table. */
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t),
@@ -672,6 +729,163 @@ found:
     }
 }
 
+/*
+ * Deferred variant of update_refcount(): the changes are only recorded in
+ * s->refcount_deltas, where changes to the same cluster cancel each other
+ * out, and are written to the refcount blocks by
+ * qcow2_apply_refcount_deltas().  This requires lazy refcounts, so the image
+ * is marked dirty first and gets repaired if we crash in between.
+ */
+static int update_refcount_deferred(BlockDriverState *bs,
+                                    int64_t offset, int64_t length,
+                                    uint64_t addend, bool decrease,
+                                    enum qcow2_discard_type type)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t start, last, cluster_offset;
+    int ret;
+
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    start = start_of_cluster(s, offset);
+    last = start_of_cluster(s, offset + length - 1);
+    for (cluster_offset = start; cluster_offset <= last;
+         cluster_offset += s->cluster_size)
+    {
+        int64_t cluster_index = cluster_offset >> s->cluster_bits;
+        Qcow2RefcountDelta *d;
+        uint64_t refcount;
+
+        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (decrease ? (refcount - addend > refcount)
+                     : (refcount + addend < refcount ||
+                        refcount + addend > s->refcount_max))
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        d = find_refcount_delta(s, cluster_index);
+        if (!d) {
+            d = g_new(Qcow2RefcountDelta, 1);
+            *d = (Qcow2RefcountDelta) {
+                .cluster_index  = cluster_index,
+                .delta          = 0,
+            };
+            g_hash_table_insert(s->refcount_deltas, &d->cluster_index, d);
+        }
+        d->delta += decrease ? -(int64_t)addend : (int64_t)addend;
+        if (d->delta == 0) {
+            g_hash_table_remove(s->refcount_deltas, &cluster_index);
+        }
+
+        if (decrease && refcount == addend) {
+            if (cluster_index < s->free_cluster_index) {
+                s->free_cluster_index = cluster_index;
+            }
+            if (s->discard_passthrough[type]) {
+                update_refcount_discard(bs, cluster_offset, s->cluster_size);
+            }
+        }
+    }
+
+    ret = 0;
+fail:
+    if (!s->cache_discards) {
+        qcow2_process_discards(bs, ret);
+    }
+
+    if (ret < 0) {
+        int dummy;
+        dummy = update_refcount(bs, offset, cluster_offset - offset, addend,
+                                !decrease, QCOW2_DISCARD_NEVER);
+        (void)dummy;
+        return ret;
+    }
+
+    /* Don't let the journal grow without bounds between two flushes */
+    if (g_hash_table_size(s->refcount_deltas) > QCOW2_MAX_REFCOUNT_DELTAS) {
+        return qcow2_apply_refcount_deltas(bs);
+    }
+
+    return 0;
+}
+
+static gint compare_refcount_deltas(gconstpointer a, gconstpointer b)
+{
+    const Qcow2RefcountDelta *da = a;
+    const Qcow2RefcountDelta *db = b;
+
+    if (da->cluster_index < db->cluster_index) {
+        return -1;
+    }
+    return da->cluster_index > db->cluster_index;
+}
+
+/*
+ * Writes all deferred refcount changes to the refcount blocks (that is, to
+ * the refcount block cache).
+ *
+ * Returns 0 on success and -errno on failure, in which case the changes that
+ * couldn't be applied are kept.
+ */
+int qcow2_apply_refcount_deltas(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    GList *deltas, *l, *next;
+    int ret = 0;
+
+    if (!s->refcount_deltas || !g_hash_table_size(s->refcount_deltas)) {
+        return 0;
+    }
+
+    /* In cluster order, every refcount block is loaded once and runs of
+     * clusters with the same change can be updated at once */
+    deltas = g_list_sort(g_hash_table_get_values(s->refcount_deltas),
+                         compare_refcount_deltas);
+
+    s->applying_refcount_deltas = true;
+    for (l = deltas; l != NULL; l = next) {
+        Qcow2RefcountDelta *d = l->data;
+        int64_t first = d->cluster_index;
+        int64_t delta = d->delta;
+        int64_t nb_clusters = 1;
+
+        for (next = l->next; next != NULL; next = next->next) {
+            Qcow2RefcountDelta *e = next->data;
+            if (e->cluster_index != first + nb_clusters || e->delta != delta) {
+                break;
+            }
+            nb_clusters++;
+        }
+
+        do {
+            ret = update_refcount(bs, first << s->cluster_bits,
+                                  nb_clusters << s->cluster_bits,
+                                  delta < 0 ? -delta : delta, delta < 0,
+                                  QCOW2_DISCARD_NEVER);
+        } while (ret == -EAGAIN);
+        if (ret < 0) {
+            break;
+        }
+
+        for (; l != next; l = l->next) {
+            d = l->data;
+            g_hash_table_remove(s->refcount_deltas, &d->cluster_index);
+        }
+    }
+    s->applying_refcount_deltas = false;
+
+    g_list_free(deltas);
+    return ret;
+}
+
 /* XXX: cache several refcount block clusters ? */
 /* @addend is the absolute value of the addend; if @decrease is set, @addend
  * will be subtracted from the current refcount, otherwise it will be added */
@@ -699,6 +913,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    if (s->use_deferred_refcounts && !s->applying_refcount_deltas) {
+        return update_refcount_deferred(bs, offset, length, addend, decrease,
+                                        type);
+    }
+
     if (decrease) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
@@ -810,7 +1029,83 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 /*********************************************************/
 /* cluster allocation functions */
 
+static void coroutine_fn prealloc_co_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    int ret;
 
+    while (s->prealloc_size &&
+           s->prealloc_end - s->data_end < s->prealloc_watermark)
+    {
+        /* Never touch clusters that are already in use; writing zeroes may
+         * well punch a hole into the file or overwrite it */
+        s->prealloc_start = MAX(s->prealloc_end, s->data_end);
+        ret = bdrv_co_write_zeroes(bs->file,
+                                   s->prealloc_start >> BDRV_SECTOR_BITS,
+                                   s->prealloc_size >> BDRV_SECTOR_BITS, 0);
+        if (ret < 0) {
+            /* Allocations still work without preallocation, just slower */
+            fprintf(stderr, "qcow2: Preallocation failed, disabling it: %s\n",
+                    strerror(-ret));
+            s->prealloc_size = 0;
+        } else {
+            s->prealloc_end = s->prealloc_start + s->prealloc_size;
+        }
+        qemu_co_queue_restart_all(&s->prealloc_queue);
+    }
+
+    s->prealloc_busy = false;
+    qemu_co_queue_restart_all(&s->prealloc_queue);
+}
+
+static bool prealloc_overlaps(BDRVQcowState *s, int64_t offset, int64_t end)
+{
+    return s->prealloc_busy && s->prealloc_size &&
+           offset < s->prealloc_start + s->prealloc_size &&
+           end > s->prealloc_start;
+}
+
+/*
+ * Must be called for every range of the image file that is about to be used
+ * for new clusters. Waits until no preallocation is in flight for the range
+ * and starts preallocating ahead of it when the pool runs low.
+ */
+static void prealloc_claim(BlockDriverState *bs, int64_t offset, int64_t end)
+{
+    BDRVQcowState *s = bs->opaque;
+    Coroutine *co;
+
+    s->data_end = MAX(s->data_end, end);
+    if (!s->prealloc_size) {
+        return;
+    }
+
+    while (prealloc_overlaps(s, offset, end)) {
+        if (qemu_in_coroutine()) {
+            qemu_co_queue_wait(&s->prealloc_queue);
+        } else {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+
+    if (!s->prealloc_busy &&
+        s->prealloc_end - s->data_end < s->prealloc_watermark)
+    {
+        s->prealloc_busy = true;
+        co = qemu_coroutine_create(prealloc_co_entry);
+        qemu_coroutine_enter(co, bs);
+    }
+}
+
+void qcow2_prealloc_drain(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    while (s->prealloc_busy) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
 
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
@@ -850,6 +1145,8 @@ retry:
             size,
             (s->free_cluster_index - nb_clusters) << s->cluster_bits);
 #endif
+    prealloc_claim(bs, (s->free_cluster_index - nb_clusters) << s->cluster_bits,
+                   s->free_cluster_index << s->cluster_bits);
     return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
 }
 
@@ -901,6 +1198,7 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         }
 
         /* And then allocate them */
+        prealloc_claim(bs, offset, offset + (i << s->cluster_bits));
         ret = update_refcount(bs, offset, i << s->cluster_bits, 1, false,
                               QCOW2_DISCARD_NEVER);
     } while (ret == -EAGAIN);
@@ -1033,6 +1331,31 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 
 
 /* update the refcounts of snapshots and the copied flag */
+/*
+ * Takes one more reference to the @nb_clusters clusters starting at
+ * @cluster_index; used to batch the data clusters that follow each other in
+ * the image file when a snapshot is created.
+ */
+static int snapshot_ref_cluster_run(BlockDriverState *bs,
+                                    int64_t cluster_index, int64_t nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return update_refcount(bs, cluster_index << s->cluster_bits,
+                           nb_clusters << s->cluster_bits, 1, false,
+                           QCOW2_DISCARD_SNAPSHOT);
+}
+
+/*
+ * Adds @addend to the refcount of every cluster the L1 table at
+ * @l1_table_offset refers to, and sets QCOW_OFLAG_COPIED where the refcount
+ * ends up as 1.
+ *
+ * Taking references (@addend == 1) is what makes creating a snapshot slow on
+ * large images.  Afterwards every refcount is at least 2, so the refcounts
+ * don't need to be read back, and contiguous data clusters are updated as one
+ * range instead of one by one.
+ */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
@@ -1040,6 +1363,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
+    int64_t run_start = 0, run_len = 0;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
@@ -1098,7 +1422,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -1138,6 +1462,23 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             refcount = 0;
                             break;
                         }
+                        if (addend > 0) {
+                            if (run_len &&
+                                cluster_index != run_start + run_len) {
+                                ret = snapshot_ref_cluster_run(bs, run_start,
+                                                               run_len);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                                run_len = 0;
+                            }
+                            if (!run_len) {
+                                run_start = cluster_index;
+                            }
+                            run_len++;
+                            refcount = 2;
+                            break;
+                        }
                         if (addend != 0) {
                             ret = qcow2_update_cluster_refcount(bs,
                                     cluster_index, abs(addend), addend < 0,
@@ -1169,12 +1510,20 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
                                                  l2_table);
                 }
             }
 
+            if (run_len) {
+                ret = snapshot_ref_cluster_run(bs, run_start, run_len);
+                if (ret < 0) {
+                    goto fail;
+                }
+                run_len = 0;
+            }
+
             qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
             if (addend != 0) {
@@ -1186,11 +1535,16 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                     goto fail;
                 }
             }
-            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                     &refcount);
-            if (ret < 0) {
-                goto fail;
-            } else if (refcount == 1) {
+            if (addend > 0) {
+                refcount = 2;
+            } else {
+                ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
+                                         &refcount);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            if (refcount == 1) {
                 l2_offset |= QCOW_OFLAG_COPIED;
             }
             if (l2_offset != old_l2_offset) {
@@ -1363,7 +1717,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->cluster_size;
     l2_table = g_malloc(l2_size);
 
     ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
@@ -1375,7 +1729,22 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+            int j;
+
+            for (j = 0; j < s->subclusters_per_cluster; j++) {
+                if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, j) < 0) {
+                    fprintf(stderr, "ERROR: L2 entry %d of table at %#"
+                            PRIx64 " has an invalid subcluster bitmap "
+                            "(%#" PRIx64 ")\n", i, l2_offset, l2_bitmap);
+                    res->corruptions++;
+                    break;
+                }
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1596,8 +1965,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1606,7 +1974,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1626,9 +1994,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1772,6 +2140,50 @@ resize_fail:
 /*
  * Calculates an in-memory refcount table.
  */
+/*
+ * Increases the refcount for the bitmap directory, the bitmap tables and the
+ * clusters they point to.
+ */
+static int check_refcounts_bitmaps(BlockDriverState *bs, BdrvCheckResult *res,
+                                   void **refcount_table,
+                                   int64_t *refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *qb;
+    uint32_t i;
+    int ret;
+
+    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                        s->bitmap_directory_offset, s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    QSIMPLEQ_FOREACH(qb, &s->bitmaps, next) {
+        ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                            qb->table_offset,
+                            qb->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (i = 0; i < qb->table_size; i++) {
+            uint64_t offset = qb->table[i] & L1E_OFFSET_MASK;
+
+            if (offset) {
+                ret = inc_refcounts(bs, res, refcount_table,
+                                    refcount_table_size, offset,
+                                    s->cluster_size);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
 static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                BdrvCheckMode fix, bool *rebuild,
                                void **refcount_table, int64_t *nb_clusters)
@@ -1828,6 +2240,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* persistent dirty bitmaps */
+    ret = check_refcounts_bitmaps(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2157,6 +2575,7 @@ write_refblocks:
     s->refcount_table = on_disk_reftable;
     s->refcount_table_offset = reftable_offset;
     s->refcount_table_size = reftable_size;
+    qcow2_metadata_map_invalidate(bs);
 
     return 0;
 
@@ -2181,6 +2600,13 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     bool rebuild = false;
     int ret;
 
+    /* Compare against (and possibly rebuild) the complete refcounts */
+    ret = qcow2_apply_refcount_deltas(bs);
+    if (ret < 0) {
+        res->check_errors++;
+        return ret;
+    }
+
     size = bdrv_getlength(bs->file);
     if (size < 0) {
         res->check_errors++;
@@ -2291,6 +2717,212 @@ fail:
     return ret;
 }
 
+/*
+ * The metadata map records, for each host cluster holding an active or
+ * inactive L2 table, a refcount block or part of an inactive L1 table, which
+ * of these it is.  It is a balanced tree keyed by the cluster index, so that
+ * qcow2_check_metadata_overlap() finds overlaps in O(log n) instead of
+ * walking the L1 and refcount tables (and reading the snapshot L1 tables)
+ * on every write.
+ *
+ * The map is built on the first check and then kept up to date when L2
+ * tables and refcount blocks are allocated.  Operations that rewrite whole
+ * tables (snapshots, refcount table growth, repair) throw it away, and the
+ * next check builds it again.  A cluster may be recorded several times for
+ * one type, e.g. an L2 table shared by several snapshots, so each type has a
+ * reference count.
+ */
+
+#define QCOW2_OL_MAPPED \
+    (QCOW2_OL_ACTIVE_L2 | QCOW2_OL_REFCOUNT_BLOCK | QCOW2_OL_INACTIVE_L1 | \
+     QCOW2_OL_INACTIVE_L2)
+
+typedef struct Qcow2MetadataCluster {
+    uint64_t index;
+    int types;
+    uint32_t refs[QCOW2_OL_MAX_BITNR];
+} Qcow2MetadataCluster;
+
+typedef struct Qcow2MetadataRange {
+    uint64_t start;
+    uint64_t end;
+} Qcow2MetadataRange;
+
+static gint metadata_cluster_cmp(gconstpointer a, gconstpointer b,
+                                 gpointer opaque)
+{
+    uint64_t ia = *(const uint64_t *)a;
+    uint64_t ib = *(const uint64_t *)b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+static gint metadata_range_search(gconstpointer key, gconstpointer data)
+{
+    uint64_t index = *(const uint64_t *)key;
+    const Qcow2MetadataRange *range = data;
+
+    if (index >= range->end) {
+        return -1;
+    }
+    return index < range->start;
+}
+
+static void metadata_map_update(BlockDriverState *bs, int type,
+                                uint64_t offset, uint64_t size, bool add)
+{
+    BDRVQcowState *s = bs->opaque;
+    int bitnr = ctz32(type);
+    uint64_t index, end;
+
+    if (!s->metadata_map || !size) {
+        return;
+    }
+    assert(type & QCOW2_OL_MAPPED);
+
+    end = (offset + size + s->cluster_size - 1) >> s->cluster_bits;
+    for (index = offset >> s->cluster_bits; index < end; index++) {
+        Qcow2MetadataCluster *c = g_tree_lookup(s->metadata_map, &index);
+
+        if (add) {
+            if (!c) {
+                c = g_new0(Qcow2MetadataCluster, 1);
+                c->index = index;
+                g_tree_insert(s->metadata_map, &c->index, c);
+            }
+            c->refs[bitnr]++;
+            c->types |= type;
+        } else if (c && c->refs[bitnr]) {
+            if (--c->refs[bitnr] == 0) {
+                c->types &= ~type;
+                if (!c->types) {
+                    g_tree_remove(s->metadata_map, &index);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Record that [offset, offset + size) holds metadata of the given
+ * QCow2MetadataOverlap type.  A zero offset means there is no table.
+ */
+void qcow2_metadata_map_add(BlockDriverState *bs, int type, uint64_t offset,
+                            uint64_t size)
+{
+    if (offset) {
+        metadata_map_update(bs, type, offset, size, true);
+    }
+}
+
+void qcow2_metadata_map_remove(BlockDriverState *bs, int type,
+                               uint64_t offset, uint64_t size)
+{
+    if (offset) {
+        metadata_map_update(bs, type, offset, size, false);
+    }
+}
+
+/* Drop the metadata map; the next overlap check builds it again. */
+void qcow2_metadata_map_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->metadata_map) {
+        g_tree_destroy(s->metadata_map);
+        s->metadata_map = NULL;
+    }
+}
+
+static int metadata_map_build(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, j;
+
+    s->metadata_map = g_tree_new_full(metadata_cluster_cmp, NULL, NULL,
+                                      g_free);
+
+    for (i = 0; i < s->l1_size; i++) {
+        qcow2_metadata_map_add(bs, QCOW2_OL_ACTIVE_L2,
+                               s->l1_table[i] & L1E_OFFSET_MASK,
+                               s->cluster_size);
+    }
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        qcow2_metadata_map_add(bs, QCOW2_OL_REFCOUNT_BLOCK,
+                               s->refcount_table[i] & REFT_OFFSET_MASK,
+                               s->cluster_size);
+    }
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
+        uint32_t l1_sz  = s->snapshots[i].l1_size;
+        uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
+        uint64_t *l1;
+        int ret;
+
+        qcow2_metadata_map_add(bs, QCOW2_OL_INACTIVE_L1, l1_ofs, l1_sz2);
+
+        /* Only read the snapshot L1 tables if they are going to be used */
+        if (!(s->overlap_check & QCOW2_OL_INACTIVE_L2) || !l1_sz) {
+            continue;
+        }
+
+        l1 = g_try_malloc(l1_sz2);
+        if (l1 == NULL) {
+            qcow2_metadata_map_invalidate(bs);
+            return -ENOMEM;
+        }
+
+        ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+        if (ret < 0) {
+            g_free(l1);
+            qcow2_metadata_map_invalidate(bs);
+            return ret;
+        }
+
+        for (j = 0; j < l1_sz; j++) {
+            qcow2_metadata_map_add(bs, QCOW2_OL_INACTIVE_L2,
+                                   be64_to_cpu(l1[j]) & L1E_OFFSET_MASK,
+                                   s->cluster_size);
+        }
+
+        g_free(l1);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the types in chk of a metadata cluster in [start, end), or 0 if
+ * there is none.  Clusters of other types are stepped over.
+ */
+static int metadata_map_lookup(GTree *map, int chk, uint64_t start,
+                               uint64_t end)
+{
+    while (start < end) {
+        Qcow2MetadataRange range = { .start = start, .end = end };
+        Qcow2MetadataCluster *c;
+        int ret;
+
+        c = g_tree_search(map, metadata_range_search, &range);
+        if (!c) {
+            return 0;
+        }
+        if (c->types & chk) {
+            return c->types & chk;
+        }
+
+        ret = metadata_map_lookup(map, chk, start, c->index);
+        if (ret) {
+            return ret;
+        }
+        start = c->index + 1;
+    }
+
+    return 0;
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
@@ -2306,14 +2938,13 @@ fail:
  * - 0 if writing to this offset will not affect the mentioned metadata
  * - a positive QCow2MetadataOverlap value indicating one overlapping section
  * - a negative value (-errno) indicating an error while performing a check,
- *   e.g. when bdrv_read failed on QCOW2_OL_INACTIVE_L2
+ *   e.g. when reading a snapshot L1 table for the metadata map failed
  */
 int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
                                  int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     int chk = s->overlap_check & ~ign;
-    int i, j;
 
     if (!size) {
         return 0;
@@ -2348,63 +2979,21 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
-    if ((chk & QCOW2_OL_INACTIVE_L1) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            if (s->snapshots[i].l1_size &&
-                overlaps_with(s->snapshots[i].l1_table_offset,
-                s->snapshots[i].l1_size * sizeof(uint64_t))) {
-                return QCOW2_OL_INACTIVE_L1;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_ACTIVE_L2) && s->l1_table) {
-        for (i = 0; i < s->l1_size; i++) {
-            if ((s->l1_table[i] & L1E_OFFSET_MASK) &&
-                overlaps_with(s->l1_table[i] & L1E_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_ACTIVE_L2;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_REFCOUNT_BLOCK) && s->refcount_table) {
-        for (i = 0; i < s->refcount_table_size; i++) {
-            if ((s->refcount_table[i] & REFT_OFFSET_MASK) &&
-                overlaps_with(s->refcount_table[i] & REFT_OFFSET_MASK,
-                s->cluster_size)) {
-                return QCOW2_OL_REFCOUNT_BLOCK;
-            }
-        }
-    }
-
-    if ((chk & QCOW2_OL_INACTIVE_L2) && s->snapshots) {
-        for (i = 0; i < s->nb_snapshots; i++) {
-            uint64_t l1_ofs = s->snapshots[i].l1_table_offset;
-            uint32_t l1_sz  = s->snapshots[i].l1_size;
-            uint64_t l1_sz2 = l1_sz * sizeof(uint64_t);
-            uint64_t *l1 = g_try_malloc(l1_sz2);
-            int ret;
-
-            if (l1_sz2 && l1 == NULL) {
-                return -ENOMEM;
-            }
+    if (chk & QCOW2_OL_MAPPED) {
+        int ret;
 
-            ret = bdrv_pread(bs->file, l1_ofs, l1, l1_sz2);
+        if (!s->metadata_map) {
+            ret = metadata_map_build(bs);
             if (ret < 0) {
-                g_free(l1);
                 return ret;
             }
+        }
 
-            for (j = 0; j < l1_sz; j++) {
-                uint64_t l2_ofs = be64_to_cpu(l1[j]) & L1E_OFFSET_MASK;
-                if (l2_ofs && overlaps_with(l2_ofs, s->cluster_size)) {
-                    g_free(l1);
-                    return QCOW2_OL_INACTIVE_L2;
-                }
-            }
-
-            g_free(l1);
+        ret = metadata_map_lookup(s->metadata_map, chk & QCOW2_OL_MAPPED,
+                                  offset >> s->cluster_bits,
+                                  (offset + size) >> s->cluster_bits);
+        if (ret) {
+            return 1 << ctz32(ret);
         }
     }
 
@@ -39,6 +39,7 @@ void qcow2_free_snapshots(BlockDriverState *bs)
     g_free(s->snapshots);
     s->snapshots = NULL;
     s->nb_snapshots = 0;
+    qcow2_metadata_map_invalidate(bs);
 }
 
 int qcow2_read_snapshots(BlockDriverState *bs)
@@ -424,12 +425,14 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     }
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
+    qcow2_metadata_map_invalidate(bs);
 
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
         s->nb_snapshots--;
+        qcow2_metadata_map_invalidate(bs);
         goto fail;
     }
 
@@ -552,6 +555,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_metadata_map_invalidate(bs);
 
     if (ret < 0) {
         goto fail;
@@ -604,6 +608,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
             s->snapshots + snapshot_index + 1,
             (s->nb_snapshots - snapshot_index - 1) * sizeof(sn));
     s->nb_snapshots--;
+    qcow2_metadata_map_invalidate(bs);
     ret = qcow2_write_snapshots(bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
@@ -729,6 +734,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_metadata_map_invalidate(bs);
 
     return 0;
 }
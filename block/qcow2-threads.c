@@ -0,0 +1,301 @@
+/*
+ * Compression for the QCOW2 format, offloaded to worker threads
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+/*
+ * All compression functions return the size of the compressed data, -ENOMEM
+ * if it doesn't fit into dest_size bytes and -EIO on other errors.
+ */
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOMEM : -EIO);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+/*
+ * Decompression functions fill exactly dest_size bytes. The compressed data
+ * may be followed by padding in src. Return 0 on success and -EIO on errors.
+ */
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, 1);
+    if (ZSTD_isError(ret)) {
+        /* In practice, this means that the output buffer is too small */
+        return -ENOMEM;
+    }
+
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DStream *zds;
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ssize_t ret = 0;
+
+    zds = ZSTD_createDStream();
+    if (!zds || ZSTD_isError(ZSTD_initDStream(zds))) {
+        ret = -EIO;
+        goto out;
+    }
+
+    /* Stop as soon as the cluster is complete, the rest of src is padding */
+    while (output.pos < output.size) {
+        size_t in_pos = input.pos;
+        size_t out_pos = output.pos;
+
+        if (ZSTD_isError(ZSTD_decompressStream(zds, &output, &input)) ||
+            (input.pos == in_pos && output.pos == out_pos))
+        {
+            ret = -EIO;
+            break;
+        }
+    }
+
+out:
+    ZSTD_freeDStream(zds);
+    return ret;
+}
+#endif
+
+#ifdef CONFIG_LZ4
+/*
+ * An LZ4 block can only be decoded if its exact size is known, so it is
+ * stored behind a 32 bit big endian length field.
+ */
+static ssize_t qcow2_lz4_compress(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size)
+{
+    int ret;
+
+    if (dest_size <= sizeof(uint32_t)) {
+        return -ENOMEM;
+    }
+
+    ret = LZ4_compress_default(src, (char *)dest + sizeof(uint32_t),
+                               src_size, dest_size - sizeof(uint32_t));
+    if (ret <= 0) {
+        return -ENOMEM;
+    }
+
+    stl_be_p(dest, ret);
+    return ret + sizeof(uint32_t);
+}
+
+static ssize_t qcow2_lz4_decompress(void *dest, size_t dest_size,
+                                    const void *src, size_t src_size)
+{
+    uint32_t len;
+
+    if (src_size < sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    len = ldl_be_p(src);
+    if (len > src_size - sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    if (LZ4_decompress_safe((const char *)src + sizeof(uint32_t), dest,
+                            len, dest_size) != dest_size) {
+        return -EIO;
+    }
+
+    return 0;
+}
+#endif
+
+static Qcow2CompressFunc *qcow2_compress_func(BDRVQcowState *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_compress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_compress;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return qcow2_lz4_compress;
+#endif
+    default:
+        abort();
+    }
+}
+
+static Qcow2CompressFunc *qcow2_decompress_func(BDRVQcowState *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return qcow2_lz4_decompress;
+#endif
+    default:
+        abort();
+    }
+}
+
+bool qcow2_compression_type_supported(int compression_type)
+{
+    switch (compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+typedef struct Qcow2CompressData {
+    Qcow2CompressFunc *func;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Compress src_size bytes from src into dest in a worker thread, so that
+ * several clusters can be compressed in parallel while the coroutine waits.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData data = {
+        .func       = qcow2_compress_func(s),
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    return data.ret;
+}
+
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return qcow2_decompress_func(s)(dest, dest_size, src, src_size);
+}
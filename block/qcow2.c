@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -60,6 +59,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -159,6 +159,50 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            /* Bitmaps that were modified by a program that doesn't know
+             * about them are stale, and the extension is dropped */
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_bitmaps: "
+                                 "Could not read ext_bitmaps");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be32_to_cpus(&bitmaps_ext.reserved32);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 || !bitmaps_ext.nb_bitmaps ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS ||
+                bitmaps_ext.bitmap_directory_size >
+                    QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+                offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset))
+            {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid bitmaps "
+                           "extension");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -383,6 +427,23 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Postpone refcount updates",
         },
+        {
+            .name = QCOW2_OPT_DEFERRED_REFCOUNTS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Collect refcount changes in memory and write them on "
+                    "flush (requires lazy refcounts)",
+        },
+        {
+            .name = QCOW2_OPT_PREALLOC_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Extend the image file in chunks of this size ahead of "
+                    "cluster allocations (0 = off)",
+        },
+        {
+            .name = QCOW2_OPT_PREALLOC_WATERMARK,
+            .type = QEMU_OPT_SIZE,
+            .help = "Preallocate the next chunk when less than this is left",
+        },
         {
             .name = QCOW2_OPT_DISCARD_REQUEST,
             .type = QEMU_OPT_BOOL,
@@ -467,6 +528,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Clean unused cache entries after this time (in seconds)",
+        },
         { /* end of list */ }
     },
 };
@@ -482,6 +548,52 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_clean_unused(bs, s->l2_table_cache);
+    qcow2_cache_clean_unused(bs, s->refcount_block_cache);
+    timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->cache_clean_interval * 1000);
+}
+
+static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = aio_timer_new(context, QEMU_CLOCK_VIRTUAL,
+                                             SCALE_MS, cache_clean_timer_cb,
+                                             bs);
+        timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->cache_clean_interval * 1000);
+    }
+}
+
+static void cache_clean_timer_del(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_timer) {
+        timer_del(s->cache_clean_timer);
+        timer_free(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+}
+
+static void qcow2_detach_aio_context(BlockDriverState *bs)
+{
+    cache_clean_timer_del(bs);
+}
+
+static void qcow2_attach_aio_context(BlockDriverState *bs,
+                                     AioContext *new_context)
+{
+    cache_clean_timer_init(bs, new_context);
+}
+
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
                              uint64_t *refcount_cache_size, Error **errp)
@@ -526,10 +638,20 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
         }
     } else {
         if (!l2_cache_size_set && !refcount_cache_size_set) {
-            *l2_cache_size = MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
-                                 (uint64_t)DEFAULT_L2_CACHE_CLUSTERS
-                                 * s->cluster_size);
-            *refcount_cache_size = *l2_cache_size
+            uint64_t min_l2_cache_size, full_l2_cache_size;
+
+            min_l2_cache_size = MAX(DEFAULT_L2_CACHE_BYTE_SIZE,
+                                    (uint64_t)DEFAULT_L2_CACHE_CLUSTERS
+                                    * s->cluster_size);
+            /* Enough to cover the whole image, if that isn't too much */
+            full_l2_cache_size = DIV_ROUND_UP(bs->total_sectors
+                                              * BDRV_SECTOR_SIZE,
+                                              s->cluster_size)
+                                 * l2_entry_size(s);
+            *l2_cache_size = MAX(min_l2_cache_size,
+                                 MIN(full_l2_cache_size,
+                                     DEFAULT_L2_CACHE_MAX_SIZE));
+            *refcount_cache_size = min_l2_cache_size
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         } else if (!l2_cache_size_set) {
             *l2_cache_size = *refcount_cache_size
@@ -555,6 +677,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t cache_clean_interval;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -708,7 +831,45 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = 1;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    /* The compression type field only exists in longer headers */
+    if (header.header_length > offsetof(QCowHeader, compression_type)) {
+        s->compression_type = header.compression_type;
+    } else {
+        s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    }
+
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB))
+    {
+        error_setg(errp, "qcow2: Compression type bit and compression type "
+                   "field don't match");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (!qcow2_compression_type_supported(s->compression_type)) {
+        error_setg(errp, "Unsupported compression type: %d",
+                   s->compression_type);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_EXTL2) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries need a cluster size of at "
+                       "least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    } else {
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+    s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -848,6 +1009,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Under a memory budget, idle images must give their tables back for
+     * the others to grow */
+    cache_clean_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+                            qcow2_cache_budget ?
+                            DEFAULT_CACHE_CLEAN_INTERVAL : 0);
+    if (cache_clean_interval > UINT_MAX / 1000) {
+        error_setg(errp, "Cache clean interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cache_clean_interval = cache_clean_interval;
+    cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
+
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
@@ -869,6 +1044,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    QSIMPLEQ_INIT(&s->bitmaps);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -907,9 +1083,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Persistent dirty bitmaps */
+    ret = qcow2_read_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    if (!s->nb_bitmaps) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -919,6 +1106,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->prealloc_queue);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
@@ -935,6 +1123,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     /* Enable lazy_refcounts according to image and command line options */
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
+    s->use_deferred_refcounts = qemu_opt_get_bool(opts,
+                                                  QCOW2_OPT_DEFERRED_REFCOUNTS,
+                                                  false);
+
+    s->prealloc_size = qemu_opt_get_size(opts, QCOW2_OPT_PREALLOC_SIZE, 0);
+    s->prealloc_watermark =
+        qemu_opt_get_size(opts, QCOW2_OPT_PREALLOC_WATERMARK,
+                          s->prealloc_size / DEFAULT_PREALLOC_WATERMARK_RATIO);
 
     s->discard_passthrough[QCOW2_DISCARD_NEVER] = false;
     s->discard_passthrough[QCOW2_DISCARD_ALWAYS] = true;
@@ -996,6 +1192,43 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    if (s->use_deferred_refcounts && !s->use_lazy_refcounts) {
+        error_setg(errp, "Deferred refcount updates require lazy refcounts");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (s->prealloc_size > QCOW2_MAX_PREALLOC_SIZE) {
+        error_setg(errp, QCOW2_OPT_PREALLOC_SIZE " may not exceed %d MB",
+                   QCOW2_MAX_PREALLOC_SIZE / 1048576);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->prealloc_size = ROUND_UP(s->prealloc_size, s->cluster_size);
+    s->prealloc_watermark = MIN(s->prealloc_watermark, INT64_MAX / 2);
+
+    if (bs->read_only || (flags & BDRV_O_INCOMING)) {
+        s->prealloc_size = 0;
+    } else if (s->prealloc_size) {
+        s->prealloc_file_end = bdrv_getlength(bs->file);
+        if (s->prealloc_file_end < 0) {
+            ret = s->prealloc_file_end;
+            error_setg_errno(errp, -ret, "Could not get image file length");
+            goto fail;
+        }
+        s->prealloc_end = s->prealloc_file_end;
+    }
+
+    /* On incoming migration, the bitmaps are loaded by
+     * qcow2_invalidate_cache() once the source has stored them */
+    if (!(flags & BDRV_O_INCOMING) && s->qcow_version >= 3) {
+        ret = qcow2_load_bitmaps(bs, false, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1006,9 +1239,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
  fail:
     qemu_opts_del(opts);
+    cache_clean_timer_del(bs);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -1074,6 +1309,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     int ret;
 
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_prealloc_drain(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             return ret;
@@ -1444,6 +1681,257 @@ fail:
     return ret;
 }
 
+static coroutine_fn int qcow2_co_copy_range_from(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 BlockDriverState *dst,
+                                                 int64_t dst_sector,
+                                                 int remaining_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n1;
+    int ret, type;
+    int cur_nr_sectors; /* number of sectors in current iteration */
+    uint64_t cluster_offset = 0;
+    int64_t backing_sectors;
+
+    if (bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (remaining_sectors != 0) {
+        cur_nr_sectors = remaining_sectors;
+        type = qcow2_get_cluster_offset(bs, sector_num << 9,
+                                        &cur_nr_sectors, &cluster_offset);
+        if (type < 0) {
+            ret = type;
+            goto fail;
+        }
+
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+
+        /* Within the image, whole clusters are shared instead of copied */
+        if (dst == bs && type == QCOW2_CLUSTER_NORMAL &&
+            index_in_cluster == 0 &&
+            (dst_sector & (s->cluster_sectors - 1)) == 0 &&
+            cur_nr_sectors >= s->cluster_sectors) {
+            ret = qcow2_share_cluster(bs, sector_num << BDRV_SECTOR_BITS,
+                                      dst_sector << BDRV_SECTOR_BITS);
+            if (ret == 0) {
+                cur_nr_sectors = s->cluster_sectors;
+                goto next;
+            } else if (ret != -ENOTSUP) {
+                goto fail;
+            }
+        }
+
+        qemu_co_mutex_unlock(&s->lock);
+        switch (type) {
+        case QCOW2_CLUSTER_UNALLOCATED:
+            ret = 0;
+            n1 = 0;
+            if (bs->backing_hd) {
+                backing_sectors = bdrv_nb_sectors(bs->backing_hd);
+                if (backing_sectors < 0) {
+                    ret = backing_sectors;
+                    break;
+                }
+                n1 = MAX(0, MIN(cur_nr_sectors, backing_sectors - sector_num));
+            }
+            if (n1 > 0) {
+                ret = bdrv_co_copy_range_from(bs->backing_hd, sector_num,
+                                              dst, dst_sector, n1);
+            }
+            if (ret >= 0 && n1 < cur_nr_sectors) {
+                ret = bdrv_co_write_zeroes(dst, dst_sector + n1,
+                                           cur_nr_sectors - n1, 0);
+            }
+            break;
+
+        case QCOW2_CLUSTER_ZERO:
+            ret = bdrv_co_write_zeroes(dst, dst_sector, cur_nr_sectors, 0);
+            break;
+
+        case QCOW2_CLUSTER_COMPRESSED:
+            ret = -ENOTSUP;
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+            if ((cluster_offset & 511) != 0) {
+                ret = -EIO;
+                break;
+            }
+            ret = bdrv_co_copy_range_from(bs->file,
+                                          (cluster_offset >> 9) +
+                                          index_in_cluster,
+                                          dst, dst_sector, cur_nr_sectors);
+            break;
+
+        default:
+            g_assert_not_reached();
+            ret = -EIO;
+            break;
+        }
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            goto fail;
+        }
+
+next:
+        remaining_sectors -= cur_nr_sectors;
+        sector_num += cur_nr_sectors;
+        dst_sector += cur_nr_sectors;
+    }
+    ret = 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+/* Copy through a buffer, for clusters that are allocated already */
+static coroutine_fn int qcow2_copy_range_bounce(BlockDriverState *src,
+                                                int64_t src_sector,
+                                                BlockDriverState *dst,
+                                                int64_t dst_sector,
+                                                int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret = 0;
+
+    iov.iov_len = MIN(nb_sectors, 2048) * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_try_blockalign(dst, iov.iov_len);
+    if (iov.iov_base == NULL) {
+        return -ENOMEM;
+    }
+
+    while (nb_sectors > 0 && ret >= 0) {
+        int n = MIN(nb_sectors, 2048);
+
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(src, src_sector, n, &qiov);
+        if (ret >= 0) {
+            ret = bdrv_co_writev(dst, dst_sector, n, &qiov);
+        }
+        src_sector += n;
+        dst_sector += n;
+        nb_sectors -= n;
+    }
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static coroutine_fn int qcow2_co_copy_range_to(BlockDriverState *src,
+                                               int64_t src_sector,
+                                               BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               int remaining_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster;
+    int ret;
+    int cur_nr_sectors; /* number of sectors in current iteration */
+    uint64_t cluster_offset;
+    QCowL2Meta *l2meta = NULL;
+    bool unsupported = false;
+
+    if (bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    s->cluster_cache_offset = -1; /* disable compressed cache */
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (remaining_sectors != 0 && !unsupported) {
+
+        l2meta = NULL;
+
+        index_in_cluster = sector_num & (s->cluster_sectors - 1);
+        cur_nr_sectors = remaining_sectors;
+
+        ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
+            &cur_nr_sectors, &cluster_offset, &l2meta);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        assert((cluster_offset & 511) == 0);
+
+        ret = qcow2_pre_write_overlap_check(bs, 0,
+                cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                cur_nr_sectors * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_co_copy_range_to(src, src_sector, bs->file,
+                                    (cluster_offset >> 9) + index_in_cluster,
+                                    cur_nr_sectors);
+        if (ret == -ENOTSUP) {
+            /* The clusters must hold the data before they are linked.  Copy
+             * this part through a buffer and let the caller do the rest. */
+            unsupported = true;
+            ret = qcow2_copy_range_bounce(src, src_sector, bs->file,
+                                          (cluster_offset >> 9) +
+                                          index_in_cluster,
+                                          cur_nr_sectors);
+        }
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        while (l2meta != NULL) {
+            QCowL2Meta *next;
+
+            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            /* Take the request off the list of running requests */
+            if (l2meta->nb_clusters != 0) {
+                QLIST_REMOVE(l2meta, next_in_flight);
+            }
+
+            qemu_co_queue_restart_all(&l2meta->dependent_requests);
+
+            next = l2meta->next;
+            g_free(l2meta);
+            l2meta = next;
+        }
+
+        remaining_sectors -= cur_nr_sectors;
+        sector_num += cur_nr_sectors;
+        src_sector += cur_nr_sectors;
+    }
+    ret = unsupported ? -ENOTSUP : 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+
+    while (l2meta != NULL) {
+        QCowL2Meta *next;
+
+        if (l2meta->nb_clusters != 0) {
+            QLIST_REMOVE(l2meta, next_in_flight);
+        }
+        qemu_co_queue_restart_all(&l2meta->dependent_requests);
+
+        next = l2meta->next;
+        g_free(l2meta);
+        l2meta = next;
+    }
+
+    return ret;
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1454,8 +1942,32 @@ static void qcow2_close(BlockDriverState *bs)
     if (!(bs->open_flags & BDRV_O_INCOMING)) {
         int ret1, ret2;
 
+        qcow2_prealloc_drain(bs);
+
+        ret1 = qcow2_store_bitmaps(bs, true);
+        if (ret1 < 0) {
+            error_report("Failed to store persistent dirty bitmaps: %s",
+                         strerror(-ret1));
+        }
+
+        if (!bs->read_only &&
+            s->prealloc_end > MAX(s->prealloc_file_end, s->data_end) &&
+            bdrv_getlength(bs->file) == s->prealloc_end)
+        {
+            /* Give back the preallocated space that wasn't used */
+            ret1 = bdrv_truncate(bs->file,
+                                 MAX(s->prealloc_file_end, s->data_end));
+            if (ret1 < 0) {
+                error_report("Failed to truncate preallocated space: %s",
+                             strerror(-ret1));
+            }
+        }
+
+        ret2 = qcow2_apply_refcount_deltas(bs);
         ret1 = qcow2_cache_flush(bs, s->l2_table_cache);
-        ret2 = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (!ret2) {
+            ret2 = qcow2_cache_flush(bs, s->refcount_block_cache);
+        }
 
         if (ret1) {
             error_report("Failed to flush the L2 table cache: %s",
@@ -1471,6 +1983,7 @@ static void qcow2_close(BlockDriverState *bs)
         }
     }
 
+    cache_clean_timer_del(bs);
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -1487,6 +2000,7 @@ static void qcow2_close(BlockDriverState *bs)
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
@@ -1530,6 +2044,15 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     s->cipher = cipher;
+
+    /* The source stored the bitmaps when it flushed the image for the last
+     * time, but left them marked in use */
+    if (s->qcow_version >= 3) {
+        ret = qcow2_load_bitmaps(bs, true, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+        }
+    }
 }
 
 static size_t header_ext_add(char *buf, uint32_t magic, const void *s,
@@ -1581,7 +2104,14 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
+    /* With the default compression type, the compression type field can be
+     * left out as long as no unknown fields follow it */
+    if (s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !s->unknown_header_fields_size) {
+        header_length = offsetof(QCowHeader, compression_type);
+    } else {
+        header_length = sizeof(*header) + s->unknown_header_fields_size;
+    }
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -1607,6 +2137,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -1615,7 +2146,7 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        ret = header_length - s->unknown_header_fields_size;
         break;
     default:
         ret = -EINVAL;
@@ -1652,6 +2183,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Persistent dirty bitmaps */
+    if (s->nb_bitmaps && s->qcow_version >= 3) {
+        Qcow2BitmapHeaderExt bitmaps_ext = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS, &bitmaps_ext,
+                             sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1664,11 +2214,26 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+            .name = "compression type",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1810,7 +2375,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         int compression_type, Error **errp)
 {
     /* Calculate cluster_bits */
     int cluster_bits;
@@ -1931,7 +2496,8 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         .refcount_table_offset      = cpu_to_be64(cluster_size),
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
-        .header_length              = cpu_to_be32(sizeof(*header)),
+        .header_length              = cpu_to_be32(offsetof(QCowHeader,
+                                                           compression_type)),
     };
 
     if (flags & BLOCK_FLAG_ENCRYPT) {
@@ -1945,6 +2511,17 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+        header->compression_type = compression_type;
+        header->header_length = cpu_to_be32(sizeof(*header));
+    }
+
     ret = bdrv_pwrite(bs, 0, header, cluster_size);
     g_free(header);
     if (ret < 0) {
@@ -2051,6 +2628,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    int compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2091,6 +2669,35 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
 
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false)) {
+        flags |= BLOCK_FLAG_EXTL2;
+    }
+
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE_MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+    if (!qcow2_compression_type_supported(compression_type)) {
+        error_setg(errp, "Compression type '%s' is not supported by this "
+                   "build", buf);
+        ret = -ENOTSUP;
+        goto finish;
+    }
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib are only "
+                   "supported with compatibility level 1.1 and above (use "
+                   "compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
                    "the same time");
@@ -2105,6 +2712,22 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 "
+                       "or greater)");
+            ret = -EINVAL;
+            goto finish;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries need a cluster size of at "
+                       "least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+            ret = -EINVAL;
+            goto finish;
+        }
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2126,7 +2749,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2214,14 +2837,16 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
+    int ret;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2239,50 +2864,35 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    out_buf = g_malloc(s->cluster_size);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    /* Compression runs in a worker thread without s->lock, so that callers
+     * with several requests in flight compress them in parallel */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
+        /* The clusters are allocated one after another */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
@@ -2290,11 +2900,13 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
             goto fail;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -2306,6 +2918,46 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} Qcow2WriteCompressedCo;
+
+static void coroutine_fn qcow2_write_compressed_entry(void *opaque)
+{
+    Qcow2WriteCompressedCo *data = opaque;
+
+    data->ret = qcow2_co_write_compressed(data->bs, data->sector_num,
+                                          data->buf, data->nb_sectors);
+}
+
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    Qcow2WriteCompressedCo data = {
+        .bs         = bs,
+        .sector_num = sector_num,
+        .buf        = buf,
+        .nb_sectors = nb_sectors,
+        .ret        = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        qcow2_write_compressed_entry(&data);
+    } else {
+        co = qemu_coroutine_create(qcow2_write_compressed_entry);
+        qemu_coroutine_enter(co, &data);
+        while (data.ret == -EINPROGRESS) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    return data.ret;
+}
+
 static int make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -2319,6 +2971,11 @@ static int make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    ret = qcow2_apply_refcount_deltas(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -2349,6 +3006,7 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     memset(s->l1_table, 0, l1_size2);
+    qcow2_metadata_map_invalidate(bs);
 
     BLKDBG_EVENT(bs->file, BLKDBG_EMPTY_IMAGE_PREPARE);
 
@@ -2397,6 +3055,7 @@ static int make_completely_empty(BlockDriverState *bs)
     g_free(s->refcount_table);
     s->refcount_table = new_reftable;
     new_reftable = NULL;
+    qcow2_metadata_map_invalidate(bs);
 
     /* Now the in-memory refcount information again corresponds to the on-disk
      * information (reftable is empty and no refblocks (the refblock cache is
@@ -2414,6 +3073,8 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     s->refcount_table[0] = 2 * s->cluster_size;
+    qcow2_metadata_map_add(bs, QCOW2_OL_REFCOUNT_BLOCK, 2 * s->cluster_size,
+                           s->cluster_size);
 
     s->free_cluster_index = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
@@ -2463,13 +3124,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
+    if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or
+         * bitmaps (because it completely empties the image). Furthermore, the
+         * L1 table and three additional clusters (image header, refcount
+         * table, one refcount block) have to fit inside one refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2501,13 +3162,25 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_store_bitmaps(bs, false);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    ret = qcow2_apply_refcount_deltas(bs);
+    if (ret < 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         return ret;
     }
 
-    if (qcow2_need_accurate_refcounts(s)) {
+    if (qcow2_need_accurate_refcounts(s) || s->use_deferred_refcounts) {
         ret = qcow2_cache_flush(bs, s->refcount_block_cache);
         if (ret < 0) {
             qemu_co_mutex_unlock(&s->lock);
@@ -2526,6 +3199,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->can_write_zeroes_with_unmap = (s->qcow_version >= 3);
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->parallel_compressed_writes = true;
     return 0;
 }
 
@@ -2555,12 +3229,39 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
+            .compression_type   = s->compression_type,
+            .has_compression_type =
+                s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB,
         };
     }
 
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificQCow2 *qcow2 = g_new0(BlockStatsSpecificQCow2, 1);
+
+    qcow2_cache_get_stats(s->l2_table_cache, &qcow2->l2_cache_hits,
+                          &qcow2->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          &qcow2->refcount_cache_hits,
+                          &qcow2->refcount_cache_misses);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        {
+            .qcow2 = qcow2,
+        },
+    };
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2669,6 +3370,12 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* persistent dirty bitmaps can't be kept, though */
+    ret = qcow2_remove_all_bitmaps(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -2751,6 +3458,19 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             error_report("Cannot change refcount entry width");
             return -ENOTSUP;
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s))
+                != has_subclusters(s)) {
+                error_report("Changing the L2 entry format is not supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            const char *cur = Qcow2CompressionType_lookup[s->compression_type];
+            if (type && strcmp(type, cur)) {
+                error_report("Changing the compression type is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2814,6 +3534,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                 return ret;
             }
             s->use_lazy_refcounts = false;
+            s->use_deferred_refcounts = false;
         }
     }
 
@@ -2931,6 +3652,17 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Use extended L2 entries (32 subclusters per cluster)",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method for compressed clusters (zlib, "
+                    "zstd, lz4)",
+        },
         { /* end of list */ }
     }
 };
@@ -2953,6 +3685,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
+    .bdrv_co_copy_range_from = qcow2_co_copy_range_from,
+    .bdrv_co_copy_range_to  = qcow2_co_copy_range_to,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
@@ -2964,6 +3698,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -2972,11 +3707,15 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
+    .bdrv_detach_aio_context    = qcow2_detach_aio_context,
+    .bdrv_attach_aio_context    = qcow2_attach_aio_context,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
+
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
 };
 
 static void bdrv_qcow2_init(void)
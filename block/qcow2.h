@@ -52,6 +52,16 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Persistent dirty bitmaps; the directory has room for the longest names */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_NAME_SIZE 1023
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+/* 512 MB bitmap tables are enough for 2 EB images at 64k granularity and
+ * cluster size */
+#define QCOW2_MAX_BITMAP_TABLE_SIZE 0x4000000
+#define QCOW2_MIN_BITMAP_GRANULARITY_BITS 9
+#define QCOW2_MAX_BITMAP_GRANULARITY_BITS 31
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -59,7 +69,29 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/*
+ * With extended L2 entries, each cluster is divided into 32 subclusters and
+ * the second half of its L2 entry is a bitmap: bit X tells that subcluster X
+ * is allocated in the image file, bit 32 + X that it reads as zeros.  If
+ * neither is set, the subcluster reads from the backing file.
+ */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters X to Y - 1 */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC  (QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32))
+#define QCOW_L2_BITMAP_ALL_ZEROES (QCOW_OFLAG_SUB_ZERO_RANGE(0, 32))
+
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
 #define MIN_CLUSTER_BITS 9
+/* Subclusters must be at least one sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
@@ -72,14 +104,33 @@
 #define DEFAULT_L2_CACHE_CLUSTERS 8 /* clusters */
 #define DEFAULT_L2_CACHE_BYTE_SIZE 1048576 /* bytes */
 
+/* Unless the size is set, the L2 cache grows with the image up to this */
+#define DEFAULT_L2_CACHE_MAX_SIZE (32 * 1048576) /* bytes */
+
+/* Unless set, the cache clean interval in seconds under a cache budget */
+#define DEFAULT_CACHE_CLEAN_INTERVAL 60
+
 /* The refblock cache needs only a fourth of the L2 cache size to cover as many
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of clusters with a pending refcount change after which the deferred
+ * refcount updates are written to the refcount blocks even without a flush */
+#define QCOW2_MAX_REFCOUNT_DELTAS 16384
+
+/* Unless set, the preallocation watermark is the chunk size divided by this */
+#define DEFAULT_PREALLOC_WATERMARK_RATIO 2
+
+/* Must fit into a single write_zeroes request */
+#define QCOW2_MAX_PREALLOC_SIZE (1024 * 1048576)
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
+#define QCOW2_OPT_DEFERRED_REFCOUNTS "deferred-refcounts"
+#define QCOW2_OPT_PREALLOC_SIZE "prealloc-size"
+#define QCOW2_OPT_PREALLOC_WATERMARK "prealloc-watermark"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
@@ -96,6 +147,7 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -119,6 +171,11 @@ typedef struct QCowHeader {
 
     uint32_t refcount_order;
     uint32_t header_length;
+
+    /* Only present if the compression type bit is set, in which case the
+     * header is at least 112 bytes long */
+    uint8_t compression_type;
+    uint8_t padding[7];
 } QEMU_PACKED QCowHeader;
 
 typedef struct QEMU_PACKED QCowSnapshotHeader {
@@ -162,6 +219,30 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+/* Bitmap directory entry flags */
+#define QCOW2_BITMAP_IN_USE     (1U << 0)
+#define QCOW2_BITMAP_AUTO       (1U << 1)
+#define QCOW2_BITMAP_FLAGS_MASK (QCOW2_BITMAP_IN_USE | QCOW2_BITMAP_AUTO)
+
+/* A persistent dirty bitmap, as it is stored in the image */
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint32_t flags;
+    int granularity_bits;
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint64_t *table;            /* host byte order */
+    bool stored;                /* used while storing the bitmaps */
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) next;
+} Qcow2Bitmap;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -179,11 +260,26 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION
+                                 | QCOW2_INCOMPAT_EXTL2,
+};
+
+
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
 };
 
 /* Compatible feature bits */
@@ -225,6 +321,10 @@ typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subclusters_per_cluster;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
     int l2_bits;
     int l2_size;
     int l1_size;
@@ -239,6 +339,8 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    QEMUTimer *cache_clean_timer;
+    unsigned cache_clean_interval;
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -255,14 +357,44 @@ typedef struct BDRVQcowState {
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
     uint32_t crypt_method_header;
+    /* Qcow2CompressionType, whose values are those of the header field */
+    int compression_type;
     uint64_t snapshots_offset;
     int snapshots_size;
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Persistent dirty bitmaps.  store_bitmaps is set once the bitmaps are
+     * loaded into BdrvDirtyBitmaps, from then on these are written back to
+     * the image on flush and close. */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    QSIMPLEQ_HEAD(, Qcow2Bitmap) bitmaps;
+    bool store_bitmaps;
+    bool bitmap_directory_dirty;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
+    /* if set, refcount changes are kept in refcount_deltas (cluster index ->
+     * Qcow2RefcountDelta) and applied to the refcount blocks on flush */
+    bool use_deferred_refcounts;
+    bool applying_refcount_deltas;
+    GHashTable *refcount_deltas;
+
+    /* if prealloc_size is set, the image file is extended in chunks of that
+     * size by a background coroutine whenever less than prealloc_watermark
+     * bytes are left between data_end (the end of the last cluster allocated
+     * since open) and prealloc_end */
+    uint64_t prealloc_size;
+    uint64_t prealloc_watermark;
+    int64_t prealloc_start;   /* first byte of the chunk in flight */
+    int64_t prealloc_end;
+    int64_t prealloc_file_end; /* length of the image file on open */
+    int64_t data_end;
+    bool prealloc_busy;
+    CoQueue prealloc_queue;
     int refcount_order;
     int refcount_bits;
     uint64_t refcount_max;
@@ -273,6 +405,7 @@ typedef struct BDRVQcowState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
 
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
+    GTree *metadata_map; /* metadata clusters for overlap checks, or NULL */
     bool signaled_corruption;
 
     uint64_t incompatible_features;
@@ -378,7 +511,7 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_SNAPSHOT_TABLE = (1 << QCOW2_OL_SNAPSHOT_TABLE_BITNR),
     QCOW2_OL_INACTIVE_L1    = (1 << QCOW2_OL_INACTIVE_L1_BITNR),
     /* NOTE: Checking overlaps with inactive L2 tables will result in bdrv
-     * reads. */
+     * reads whenever the metadata map has to be built. */
     QCOW2_OL_INACTIVE_L2    = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
 } QCow2MetadataOverlap;
 
@@ -457,6 +590,77 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcowState *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_table[idx]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_table[idx] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    assert(has_subclusters(s));
+    return be64_to_cpu(l2_table[idx * 2 + 1]);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[idx * 2 + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+/*
+ * Returns what subcluster @sc_index of a cluster with an extended L2 entry
+ * reads from, as one of the QCOW2_CLUSTER_* types, or -EIO if the entry is
+ * invalid.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    bool alloc = l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index);
+    bool zero = l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index);
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return l2_bitmap ? -EIO : QCOW2_CLUSTER_COMPRESSED;
+    } else if (!(l2_entry & L2E_OFFSET_MASK)) {
+        /* Only zero bits make sense without a host cluster */
+        if (alloc) {
+            return -EIO;
+        }
+        return zero ? QCOW2_CLUSTER_ZERO : QCOW2_CLUSTER_UNALLOCATED;
+    } else if (alloc && zero) {
+        return -EIO;
+    } else if (alloc) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return zero ? QCOW2_CLUSTER_ZERO : QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -522,7 +726,14 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
 
 void qcow2_process_discards(BlockDriverState *bs, int ret);
-
+int qcow2_apply_refcount_deltas(BlockDriverState *bs);
+void qcow2_prealloc_drain(BlockDriverState *bs);
+
+void qcow2_metadata_map_add(BlockDriverState *bs, int type, uint64_t offset,
+                            uint64_t size);
+void qcow2_metadata_map_remove(BlockDriverState *bs, int type,
+                               uint64_t offset, uint64_t size);
+void qcow2_metadata_map_invalidate(BlockDriverState *bs);
 int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
                                  int64_t size);
 int qcow2_pre_write_overlap_check(BlockDriverState *bs, int ign, int64_t offset,
@@ -550,6 +761,8 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_share_cluster(BlockDriverState *bs, uint64_t src_offset,
+                        uint64_t dst_offset);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb);
@@ -570,6 +783,16 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmaps(BlockDriverState *bs, Error **errp);
+void qcow2_free_bitmaps(BlockDriverState *bs);
+int qcow2_load_bitmaps(BlockDriverState *bs, bool trust_in_use, Error **errp);
+int qcow2_store_bitmaps(BlockDriverState *bs, bool closing);
+int qcow2_remove_all_bitmaps(BlockDriverState *bs);
+uint64_t qcow2_bitmap_table_size(BlockDriverState *bs, int granularity_bits);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -588,5 +811,15 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c);
+
+/* qcow2-threads.c functions */
+bool qcow2_compression_type_supported(int compression_type);
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size);
 
 #endif
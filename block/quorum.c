@@ -22,19 +22,22 @@
 #include "qapi/qmp/qlist.h"
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
-#include "crypto/hash.h"
-
-#define HASH_LENGTH 32
+#include "qemu/timer.h"
 
 #define QUORUM_OPT_VOTE_THRESHOLD "vote-threshold"
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
 
-/* This union holds a vote hash value */
+/* With read-pattern=latency, one read in this many goes round robin */
+#define QUORUM_LATENCY_PROBE_INTERVAL 64
+/* Added to the latency sample of a failed read */
+#define QUORUM_LATENCY_ERROR_NS       (100 * SCALE_MS)
+
+/* This union holds a vote value */
 typedef union QuorumVoteValue {
-    uint8_t h[HASH_LENGTH];    /* SHA-256 hash */
-    int64_t l;                 /* simpler 64 bits hash */
+    QEMUIOVector *qiov;        /* data read by the first child of a version */
+    int64_t l;                 /* error code */
 } QuorumVoteValue;
 
 /* A vote item */
@@ -82,6 +85,11 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+
+    int64_t *read_latency; /* moving average of each child's read latency
+                            * in ns, for read-pattern=latency
+                            */
+    uint64_t read_count;
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -96,6 +104,7 @@ typedef struct QuorumChildRequest {
     QEMUIOVector qiov;
     uint8_t *buf;
     int ret;
+    int64_t start_ns;
     QuorumAIOCB *parent;
 } QuorumChildRequest;
 
@@ -124,8 +133,13 @@ struct QuorumAIOCB {
     QuorumVotes votes;
 
     bool is_read;
+    bool completed;             /* the caller already got the data of the
+                                 * first good read in fastest pattern
+                                 */
     int vote_ret;
-    int child_iter;             /* which child to read in fifo pattern */
+    int child_iter;             /* which child to read in fifo and latency
+                                 * patterns
+                                 */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -157,13 +171,19 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
         ret = acb->vote_ret;
     }
 
-    acb->common.cb(acb->common.opaque, ret);
+    if (!acb->completed) {
+        acb->common.cb(acb->common.opaque, ret);
+    }
 
     if (acb->is_read) {
-        /* on the quorum case acb->child_iter == s->num_children - 1 */
-        for (i = 0; i <= acb->child_iter; i++) {
-            qemu_vfree(acb->qcrs[i].buf);
-            qemu_iovec_destroy(&acb->qcrs[i].qiov);
+        BDRVQuorumState *s = acb->common.bs->opaque;
+
+        /* only the children that were read have a buffer */
+        for (i = 0; i < s->num_children; i++) {
+            if (acb->qcrs[i].buf) {
+                qemu_vfree(acb->qcrs[i].buf);
+                qemu_iovec_destroy(&acb->qcrs[i].qiov);
+            }
         }
     }
 
@@ -171,11 +191,6 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
     qemu_aio_unref(acb);
 }
 
-static bool quorum_sha256_compare(QuorumVoteValue *a, QuorumVoteValue *b)
-{
-    return !memcmp(a->h, b->h, HASH_LENGTH);
-}
-
 static bool quorum_64bits_compare(QuorumVoteValue *a, QuorumVoteValue *b)
 {
     return a->l == b->l;
@@ -200,9 +215,9 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     acb->count = 0;
     acb->success_count = 0;
     acb->rewrite_count = 0;
-    acb->votes.compare = quorum_sha256_compare;
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
+    acb->completed = false;
     acb->vote_ret = 0;
 
     for (i = 0; i < s->num_children; i++) {
@@ -261,7 +276,7 @@ static void quorum_rewrite_aio_cb(void *opaque, int ret)
     quorum_aio_finalize(acb);
 }
 
-static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb);
+static BlockAIOCB *read_single_child(QuorumAIOCB *acb);
 
 static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
 {
@@ -276,6 +291,41 @@ static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
     }
 }
 
+static void quorum_account_read(BDRVQuorumState *s, QuorumChildRequest *sacb,
+                                int ret)
+{
+    int64_t *latency = &s->read_latency[sacb - sacb->parent->qcrs];
+    int64_t sample = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - sacb->start_ns;
+
+    if (ret < 0) {
+        sample += QUORUM_LATENCY_ERROR_NS;
+    }
+    *latency = *latency ? (*latency * 7 + sample) / 8 : sample;
+}
+
+/*
+ * Pick the child to read next in fifo and latency patterns, among those
+ * that were not tried yet for this request.  Returns -1 if there is none.
+ */
+static int quorum_next_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i, best = -1;
+
+    for (i = 0; i < s->num_children; i++) {
+        if (acb->qcrs[i].buf) {
+            continue;
+        }
+        if (s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
+            return i;
+        }
+        if (best < 0 || s->read_latency[i] < s->read_latency[best]) {
+            best = i;
+        }
+    }
+    return best;
+}
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
@@ -283,14 +333,25 @@ static void quorum_aio_cb(void *opaque, int ret)
     BDRVQuorumState *s = acb->common.bs->opaque;
     bool rewrite = false;
 
-    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
-        /* We try to read next child in FIFO order if we fail to read */
-        if (ret < 0 && ++acb->child_iter < s->num_children) {
-            read_fifo_child(acb);
-            return;
-        }
+    /* the child AIOCB goes away after this, quorum_aio_cancel must skip it */
+    sacb->aiocb = NULL;
+
+    if (acb->is_read) {
+        quorum_account_read(s, sacb, ret);
+    }
 
-        if (ret == 0) {
+    if (acb->is_read && (s->read_pattern == QUORUM_READ_PATTERN_FIFO ||
+                         s->read_pattern == QUORUM_READ_PATTERN_LATENCY)) {
+        /* We try to read the next child if we fail to read */
+        if (ret < 0) {
+            int next = quorum_next_child(acb);
+
+            if (next >= 0) {
+                acb->child_iter = next;
+                read_single_child(acb);
+                return;
+            }
+        } else {
             quorum_copy_qiov(acb->qiov, &acb->qcrs[acb->child_iter].qiov);
         }
         acb->vote_ret = ret;
@@ -303,10 +364,19 @@ static void quorum_aio_cb(void *opaque, int ret)
     if (ret == 0) {
         acb->success_count++;
     } else {
-        quorum_report_bad(acb, sacb->aiocb->bs->node_name, ret);
+        quorum_report_bad(acb, s->bs[sacb - acb->qcrs]->node_name, ret);
     }
     assert(acb->count <= s->num_children);
     assert(acb->success_count <= s->num_children);
+
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FASTEST &&
+        ret == 0 && !acb->completed) {
+        /* Complete with the first good read, the vote checks it later */
+        quorum_copy_qiov(acb->qiov, &sacb->qiov);
+        acb->completed = true;
+        acb->common.cb(acb->common.opaque, 0);
+    }
+
     if (acb->count < s->num_children) {
         return;
     }
@@ -363,13 +433,15 @@ static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
     /* quorum_rewrite_aio_cb will count down this to zero */
     acb->rewrite_count = count;
 
-    /* now fire the correcting rewrites */
+    /* now fire the correcting rewrites, from the winner's buffer: in
+     * fastest pattern the caller's one may be gone already
+     */
     QLIST_FOREACH(version, &acb->votes.vote_list, next) {
         if (acb->votes.compare(&version->value, value)) {
             continue;
         }
         QLIST_FOREACH(item, &version->items, next) {
-            bdrv_aio_writev(s->bs[item->index], acb->sector_num, acb->qiov,
+            bdrv_aio_writev(s->bs[item->index], acb->sector_num, value->qiov,
                             acb->nb_sectors, quorum_rewrite_aio_cb, acb);
         }
     }
@@ -425,25 +497,6 @@ static void quorum_free_vote_list(QuorumVotes *votes)
     }
 }
 
-static int quorum_compute_hash(QuorumAIOCB *acb, int i, QuorumVoteValue *hash)
-{
-    QEMUIOVector *qiov = &acb->qcrs[i].qiov;
-    size_t len = sizeof(hash->h);
-    uint8_t *data = hash->h;
-
-    /* XXX - would be nice if we could pass in the Error **
-     * and propagate that back, but this quorum code is
-     * restricted to just errno values currently */
-    if (qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256,
-                            qiov->iov, qiov->niov,
-                            &data, &len,
-                            NULL) < 0) {
-        return -EINVAL;
-    }
-
-    return 0;
-}
-
 static QuorumVoteVersion *quorum_get_vote_winner(QuorumVotes *votes)
 {
     int max = 0;
@@ -484,6 +537,12 @@ static bool quorum_iovec_compare(QEMUIOVector *a, QEMUIOVector *b)
     return true;
 }
 
+/* Child reads are the same version if their data is identical */
+static bool quorum_qiov_compare(QuorumVoteValue *a, QuorumVoteValue *b)
+{
+    return a->qiov == b->qiov || quorum_iovec_compare(a->qiov, b->qiov);
+}
+
 static void GCC_FMT_ATTR(2, 3) quorum_err(QuorumAIOCB *acb,
                                           const char *fmt, ...)
 {
@@ -555,8 +614,8 @@ static bool quorum_vote(QuorumAIOCB *acb)
 {
     bool quorum = true;
     bool rewrite = false;
-    int i, j, ret;
-    QuorumVoteValue hash;
+    int i, j;
+    QuorumVoteValue value;
     BDRVQuorumState *s = acb->common.bs->opaque;
     QuorumVoteVersion *winner;
 
@@ -588,22 +647,22 @@ static bool quorum_vote(QuorumAIOCB *acb)
 
     /* Every successful read agrees */
     if (quorum) {
-        quorum_copy_qiov(acb->qiov, &acb->qcrs[i].qiov);
+        if (!acb->completed) {
+            quorum_copy_qiov(acb->qiov, &acb->qcrs[i].qiov);
+        }
         return false;
     }
 
-    /* compute hashes for each successful read, also store indexes */
+    /* sort the successful reads into versions of identical data; there are
+     * few children, so comparing the data directly beats hashing it
+     */
+    acb->votes.compare = quorum_qiov_compare;
     for (i = 0; i < s->num_children; i++) {
         if (acb->qcrs[i].ret) {
             continue;
         }
-        ret = quorum_compute_hash(acb, i, &hash);
-        /* if ever the hash computation failed */
-        if (ret < 0) {
-            acb->vote_ret = ret;
-            goto free_exit;
-        }
-        quorum_count_vote(&acb->votes, &hash, i);
+        value.qiov = &acb->qcrs[i].qiov;
+        quorum_count_vote(&acb->votes, &value, i);
     }
 
     /* vote to select the most represented version */
@@ -616,8 +675,12 @@ static bool quorum_vote(QuorumAIOCB *acb)
         goto free_exit;
     }
 
-    /* we have a winner: copy it */
-    quorum_copy_qiov(acb->qiov, &acb->qcrs[winner->index].qiov);
+    /* we have a winner: copy it, unless the caller was handed the first
+     * good read already; if that one lost, it is reported below
+     */
+    if (!acb->completed) {
+        quorum_copy_qiov(acb->qiov, &acb->qcrs[winner->index].qiov);
+    }
 
     /* some versions are bad print them */
     quorum_report_bad_versions(s, acb, &winner->value);
@@ -645,25 +708,28 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     }
 
     for (i = 0; i < s->num_children; i++) {
-        bdrv_aio_readv(s->bs[i], acb->sector_num, &acb->qcrs[i].qiov,
-                       acb->nb_sectors, quorum_aio_cb, &acb->qcrs[i]);
+        acb->qcrs[i].start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        acb->qcrs[i].aiocb = bdrv_aio_readv(s->bs[i], acb->sector_num,
+                                            &acb->qcrs[i].qiov,
+                                            acb->nb_sectors, quorum_aio_cb,
+                                            &acb->qcrs[i]);
     }
 
     return &acb->common;
 }
 
-static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
+static BlockAIOCB *read_single_child(QuorumAIOCB *acb)
 {
     BDRVQuorumState *s = acb->common.bs->opaque;
+    QuorumChildRequest *sacb = &acb->qcrs[acb->child_iter];
 
-    acb->qcrs[acb->child_iter].buf = qemu_blockalign(s->bs[acb->child_iter],
-                                                     acb->qiov->size);
-    qemu_iovec_init(&acb->qcrs[acb->child_iter].qiov, acb->qiov->niov);
-    qemu_iovec_clone(&acb->qcrs[acb->child_iter].qiov, acb->qiov,
-                     acb->qcrs[acb->child_iter].buf);
-    bdrv_aio_readv(s->bs[acb->child_iter], acb->sector_num,
-                   &acb->qcrs[acb->child_iter].qiov, acb->nb_sectors,
-                   quorum_aio_cb, &acb->qcrs[acb->child_iter]);
+    sacb->buf = qemu_blockalign(s->bs[acb->child_iter], acb->qiov->size);
+    qemu_iovec_init(&sacb->qiov, acb->qiov->niov);
+    qemu_iovec_clone(&sacb->qiov, acb->qiov, sacb->buf);
+    sacb->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    sacb->aiocb = bdrv_aio_readv(s->bs[acb->child_iter], acb->sector_num,
+                                 &sacb->qiov, acb->nb_sectors, quorum_aio_cb,
+                                 sacb);
 
     return &acb->common;
 }
@@ -680,13 +746,25 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
                                       nb_sectors, cb, opaque);
     acb->is_read = true;
 
-    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
+    switch (s->read_pattern) {
+    case QUORUM_READ_PATTERN_QUORUM:
+    case QUORUM_READ_PATTERN_FASTEST:
         acb->child_iter = s->num_children - 1;
         return read_quorum_children(acb);
+    case QUORUM_READ_PATTERN_LATENCY:
+        /* Now and then read another child to keep its latency current */
+        if (++s->read_count % QUORUM_LATENCY_PROBE_INTERVAL == 0) {
+            acb->child_iter = (s->read_count / QUORUM_LATENCY_PROBE_INTERVAL) %
+                              s->num_children;
+            return read_single_child(acb);
+        }
+        break;
+    default:
+        break;
     }
 
-    acb->child_iter = 0;
-    return read_fifo_child(acb);
+    acb->child_iter = quorum_next_child(acb);
+    return read_single_child(acb);
 }
 
 static BlockAIOCB *quorum_aio_writev(BlockDriverState *bs,
@@ -831,7 +909,8 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, fastest, latency. "
+                    "Quorum is default",
         },
         { /* end of list */ }
     },
@@ -891,12 +970,14 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
     s->threshold = qemu_opt_get_number(opts, QUORUM_OPT_VOTE_THRESHOLD, 0);
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err, "Please set read-pattern as quorum, fifo, "
+                   "fastest or latency");
         goto exit;
     }
     s->read_pattern = ret;
 
-    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
+    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM ||
+        s->read_pattern == QUORUM_READ_PATTERN_FASTEST) {
         /* and validate it against s->num_children */
         ret = quorum_valid_threshold(s->threshold, s->num_children, &local_err);
         if (ret < 0) {
@@ -905,6 +986,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
         /* is the driver in blkverify mode */
         if (qemu_opt_get_bool(opts, QUORUM_OPT_BLKVERIFY, false) &&
+            s->read_pattern == QUORUM_READ_PATTERN_QUORUM &&
             s->num_children == 2 && s->threshold == 2) {
             s->is_blkverify = true;
         } else if (qemu_opt_get_bool(opts, QUORUM_OPT_BLKVERIFY, false)) {
@@ -924,6 +1006,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children BlockDriverState array */
     s->bs = g_new0(BlockDriverState *, s->num_children);
+    s->read_latency = g_new0(int64_t, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -952,6 +1035,7 @@ close_exit:
         bdrv_unref(s->bs[i]);
     }
     g_free(s->bs);
+    g_free(s->read_latency);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -972,6 +1056,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->bs);
+    g_free(s->read_latency);
 }
 
 static void quorum_detach_aio_context(BlockDriverState *bs)
@@ -1055,10 +1140,6 @@ static BlockDriver bdrv_quorum = {
 
 static void bdrv_quorum_init(void)
 {
-    if (!qcrypto_hash_supports(QCRYPTO_HASH_ALG_SHA256)) {
-        /* SHA256 hash support is required for quorum device */
-        return;
-    }
     bdrv_register(&bdrv_quorum);
 }
 
@@ -22,9 +22,10 @@
 #define QEMU_AIO_FLUSH        0x0008
 #define QEMU_AIO_DISCARD      0x0010
 #define QEMU_AIO_WRITE_ZEROES 0x0020
+#define QEMU_AIO_COPY_RANGE   0x0040
 #define QEMU_AIO_TYPE_MASK \
         (QEMU_AIO_READ|QEMU_AIO_WRITE|QEMU_AIO_IOCTL|QEMU_AIO_FLUSH| \
-         QEMU_AIO_DISCARD|QEMU_AIO_WRITE_ZEROES)
+         QEMU_AIO_DISCARD|QEMU_AIO_WRITE_ZEROES|QEMU_AIO_COPY_RANGE)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
@@ -44,6 +45,19 @@ void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
 void laio_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug);
 #endif
 
+/* io_uring.c - Linux io_uring implementation */
+#ifdef CONFIG_LINUX_IO_URING
+void *luring_init(void);
+void luring_cleanup(void *s);
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type);
+void luring_detach_aio_context(void *s, AioContext *old_context);
+void luring_attach_aio_context(void *s, AioContext *new_context);
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx);
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug);
+#endif
+
 #ifdef _WIN32
 typedef struct QEMUWin32AIOState QEMUWin32AIOState;
 QEMUWin32AIOState *win32_aio_init(void);
@@ -55,6 +55,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
@@ -135,6 +136,15 @@ do { \
 
 #define MAX_BLOCKSIZE	4096
 
+/* Number of extents remembered by raw_co_get_block_status() */
+#define RAW_BSC_ENTRIES 4
+
+typedef struct RawExtent {
+    int64_t start;
+    int64_t end;            /* exclusive; an entry with end == start is empty */
+    bool data;
+} RawExtent;
+
 typedef struct BDRVRawState {
     int fd;
     int type;
@@ -152,6 +162,10 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
@@ -160,6 +174,10 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool has_fallocate;
     bool needs_alignment;
+
+    /* Block status cache, see raw_bsc_lookup() */
+    RawExtent bsc[RAW_BSC_ENTRIES];
+    int bsc_next;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -168,6 +186,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -185,6 +206,9 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    /* Destination of QEMU_AIO_COPY_RANGE, the source is the above */
+    int aio_fd2;
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -387,25 +411,39 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -440,6 +478,28 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(void **io_uring_ctx, int *use_io_uring,
+                            int bdrv_flags)
+{
+    /* Unlike Linux AIO, io_uring also works without O_DIRECT */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*io_uring_ctx == NULL) {
+            *io_uring_ctx = luring_init();
+            if (!*io_uring_ctx) {
+                return -1;
+            }
+        }
+        *use_io_uring = 1;
+    } else {
+        *use_io_uring = 0;
+    }
+
+    return 0;
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -520,6 +580,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
                      bs->filename);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(&s->io_uring_ctx, &s->use_io_uring, bdrv_flags)) {
+        qemu_close(fd);
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not set up io_uring");
+        goto fail;
+    }
+#endif
 
     s->has_discard = true;
     s->has_write_zeroes = true;
@@ -625,6 +693,16 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         return -1;
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_io_uring = s->use_io_uring;
+
+    /* As with aio_ctx above, s->io_uring_ctx can be shared with raw_s */
+    if (raw_set_io_uring(&s->io_uring_ctx, &raw_s->use_io_uring,
+                         state->flags)) {
+        error_setg(errp, "Could not set up io_uring");
+        return -1;
+    }
+#endif
 
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
@@ -705,6 +783,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1082,6 +1163,70 @@ static int do_fallocate(int fd, int mode, off_t offset, off_t len)
 }
 #endif
 
+#ifdef __linux__
+/* Not every libc has a wrapper yet */
+static ssize_t qemu_copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                                    off_t *out_off, size_t len,
+                                    unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd, out_off,
+                   len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+#ifdef __linux__
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+    ssize_t ret;
+
+#ifdef FICLONERANGE
+    /* Sharing the extents is cheaper than copying them, if the filesystem
+     * can do reflinks and the range is aligned to its blocks */
+    struct file_clone_range range = {
+        .src_fd = aiocb->aio_fildes,
+        .src_offset = in_off,
+        .src_length = bytes,
+        .dest_offset = out_off,
+    };
+
+    if (ioctl(aiocb->aio_fd2, FICLONERANGE, &range) == 0) {
+        return 0;
+    }
+#endif
+
+    while (bytes > 0) {
+        ret = qemu_copy_file_range(aiocb->aio_fildes, &in_off,
+                                   aiocb->aio_fd2, &out_off, bytes, 0);
+        if (ret == 0) {
+            /* The file ends within the last sector, which must read as
+             * zeroes: leave that to the caller */
+            return -ENOTSUP;
+        } else if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EXDEV || errno == EINVAL || errno == EBADF) {
+                /* Different filesystems, or not regular files */
+                return -ENOTSUP;
+            }
+            return translate_err(-errno);
+        }
+        bytes -= ret;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static ssize_t handle_aiocb_write_zeroes_block(RawPosixAIOData *aiocb)
 {
     int ret = -ENOTSUP;
@@ -1247,6 +1392,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1307,6 +1455,86 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+/*
+ * Block status cache
+ *
+ * Every SEEK_DATA/SEEK_HOLE pair finds a whole extent, but callers walk
+ * the image in steps of their own choosing and would repeat the lseek()s
+ * for every step.  The last few extents found are remembered here.
+ *
+ * Requests that change the allocation through this BDS drop the extents
+ * they overlap when they are submitted.  A hole is not remembered while
+ * a write is in flight, since lseek() may have seen the file from before
+ * the write landed.  A data extent that becomes a hole behind the cache
+ * (like after a discard) merely makes the result less precise.
+ */
+static void raw_bsc_invalidate(BDRVRawState *s, int64_t offset,
+                               int64_t bytes)
+{
+    int i;
+
+    for (i = 0; i < RAW_BSC_ENTRIES; i++) {
+        RawExtent *e = &s->bsc[i];
+
+        if (e->start < offset + bytes && offset < e->end) {
+            e->end = e->start;
+        }
+    }
+}
+
+static void raw_bsc_clear(BDRVRawState *s)
+{
+    memset(s->bsc, 0, sizeof(s->bsc));
+}
+
+/*
+ * If @start is in a remembered extent, fill in @data and @hole like
+ * find_allocation() does and return true.
+ */
+static bool raw_bsc_lookup(BDRVRawState *s, int64_t start,
+                           off_t *data, off_t *hole)
+{
+    int i;
+
+    for (i = 0; i < RAW_BSC_ENTRIES; i++) {
+        RawExtent *e = &s->bsc[i];
+
+        if (e->start <= start && start < e->end) {
+            if (e->data) {
+                *data = start;
+                *hole = e->end;
+            } else {
+                *hole = start;
+                *data = e->end;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void raw_bsc_insert(BlockDriverState *bs, int64_t start, int64_t end,
+                           bool data)
+{
+    BDRVRawState *s = bs->opaque;
+    BdrvTrackedRequest *req;
+    RawExtent *e;
+
+    if (!data) {
+        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (req->is_write) {
+                return;
+            }
+        }
+    }
+
+    e = &s->bsc[s->bsc_next];
+    s->bsc_next = (s->bsc_next + 1) % RAW_BSC_ENTRIES;
+    e->start = start;
+    e->end = end;
+    e->data = data;
+}
+
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1316,6 +1544,11 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (type & QEMU_AIO_WRITE) {
+        raw_bsc_invalidate(s, sector_num * BDRV_SECTOR_SIZE,
+                           (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+    }
+
     /*
      * Check if the underlying device requires requests to be aligned,
      * and if the request we are trying to submit is aligned or not.
@@ -1333,38 +1566,66 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_plug(bs, s->io_uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, false);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -1391,6 +1652,13 @@ static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1404,6 +1672,11 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_cleanup(s->io_uring_ctx);
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1420,6 +1693,7 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
         return -errno;
     }
 
+    raw_bsc_clear(s);
     if (S_ISREG(st.st_mode)) {
         if (ftruncate(s->fd, offset) < 0) {
             return -errno;
@@ -1829,6 +2103,7 @@ static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
                                                     int64_t sector_num,
                                                     int nb_sectors, int *pnum)
 {
+    BDRVRawState *s = bs->opaque;
     off_t start, data = 0, hole = 0;
     int64_t total_size;
     int ret;
@@ -1849,7 +2124,16 @@ static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
         nb_sectors = DIV_ROUND_UP(total_size - start, BDRV_SECTOR_SIZE);
     }
 
-    ret = find_allocation(bs, start, &data, &hole);
+    if (raw_bsc_lookup(s, start, &data, &hole)) {
+        trace_raw_bsc_hit(bs, start, data == start);
+        ret = 0;
+    } else {
+        ret = find_allocation(bs, start, &data, &hole);
+        if (ret == 0) {
+            raw_bsc_insert(bs, start, MAX(data, hole), data == start);
+        }
+    }
+
     if (ret == -ENXIO) {
         /* Trailing hole */
         *pnum = nb_sectors;
@@ -1878,6 +2162,8 @@ static coroutine_fn BlockAIOCB *raw_aio_discard(BlockDriverState *bs,
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_bsc_invalidate(s, sector_num * BDRV_SECTOR_SIZE,
+                       (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
     return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
@@ -1888,6 +2174,8 @@ static int coroutine_fn raw_co_write_zeroes(
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_bsc_invalidate(s, sector_num * BDRV_SECTOR_SIZE,
+                       (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
         return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
                               QEMU_AIO_WRITE_ZEROES);
@@ -1898,6 +2186,55 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+/* The data is in this file: hand the copy to the destination */
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+    int64_t sector_num, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors)
+{
+    return bdrv_co_copy_range_to(bs, sector_num, dst, dst_sector, nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+    int ret;
+
+    /* Only a file descriptor of ours can be the source */
+    if (src->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    src_s = src->opaque;
+
+    ret = fd_open(src);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    raw_bsc_invalidate(s, sector_num * BDRV_SECTOR_SIZE,
+                       (int64_t)nb_sectors * BDRV_SECTOR_SIZE);
+
+    acb = g_slice_new(RawPosixAIOData);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = sector_num * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(sector_num, nb_sectors, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1946,6 +2283,8 @@ BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -2356,6 +2695,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_create         = hdev_create,
     .create_opts         = &raw_create_opts,
     .bdrv_co_write_zeroes = hdev_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
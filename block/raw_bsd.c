@@ -128,6 +128,26 @@ static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
     return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_from(bs->file, sector_num, dst, dst_sector,
+                                   nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *src,
+                                             int64_t src_sector,
+                                             BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    return bdrv_co_copy_range_to(src, src_sector, bs->file, sector_num,
+                                 nb_sectors);
+}
+
 static int coroutine_fn raw_co_discard(BlockDriverState *bs,
                                        int64_t sector_num, int nb_sectors)
 {
@@ -256,6 +276,8 @@ BlockDriver bdrv_raw = {
     .bdrv_co_writev       = &raw_co_writev,
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = &raw_co_copy_range_to,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
@@ -42,6 +42,9 @@
  *
  * Configuration values containing :, @, or = can be escaped with a
  * leading "\".
+ *
+ * The librbd cache and readahead can also be tuned with the block
+ * options in rbd_tunables[], which override the Ceph configuration.
  */
 
 /* rbd_aio_discard added in 0.1.2 */
@@ -51,6 +54,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/*
+ * LIBRBD_SUPPORTS_IOVEC (rbd_aio_readv/writev) and
+ * LIBRBD_SUPPORTS_WRITE_ZEROES (rbd_aio_write_zeroes) are defined by
+ * librbd.h itself.  Without vectored calls, requests go through a bounce
+ * buffer.
+ */
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -64,7 +74,8 @@ typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
     RBD_AIO_DISCARD,
-    RBD_AIO_FLUSH
+    RBD_AIO_FLUSH,
+    RBD_AIO_WRITE_ZEROES
 } RBDAIOCmd;
 
 typedef struct RBDAIOCB {
@@ -369,6 +380,18 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
     return ret;
 }
 
+/* Clear the data of a read request from @offs on */
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    RBDAIOCB *acb = rcb->acb;
+
+    if (acb->bounce) {
+        memset(rcb->buf + offs, 0, rcb->size - offs);
+    } else {
+        qemu_iovec_memset(acb->qiov, offs, 0, rcb->size - offs);
+    }
+}
+
 /*
  * This aio completion is being called from rbd_finish_bh() and runs in qemu
  * BH context.
@@ -389,11 +412,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -404,7 +427,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -423,10 +446,80 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Specification of the rbd image",
         },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the librbd cache",
+        },
+        {
+            .name = "cache-max-dirty",
+            .type = QEMU_OPT_SIZE,
+            .help = "Dirty data in the librbd cache that triggers writeback",
+        },
+        {
+            .name = "readahead-max-bytes",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of a librbd readahead request",
+        },
+        {
+            .name = "readahead-trigger-requests",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Sequential reads that start the librbd readahead",
+        },
+        {
+            .name = "readahead-disable-after-bytes",
+            .type = QEMU_OPT_SIZE,
+            .help = "Stop the librbd readahead after this much has been read",
+        },
         { /* end of list */ }
     },
 };
 
+/* Block options that set a librbd tunable of the same meaning */
+static const struct {
+    const char *name;
+    const char *conf;
+    bool size;
+} rbd_tunables[] = {
+    { "cache-size",                    "rbd_cache_size",             true },
+    { "cache-max-dirty",               "rbd_cache_max_dirty",        true },
+    { "readahead-max-bytes",           "rbd_readahead_max_bytes",    true },
+    { "readahead-trigger-requests",    "rbd_readahead_trigger_requests",
+      false },
+    { "readahead-disable-after-bytes", "rbd_readahead_disable_after_bytes",
+      true },
+};
+
+static int qemu_rbd_set_tunables(rados_t cluster, QemuOpts *opts,
+                                 Error **errp)
+{
+    char value[32];
+    uint64_t v;
+    int i, r;
+
+    for (i = 0; i < ARRAY_SIZE(rbd_tunables); i++) {
+        const char *name = rbd_tunables[i].name;
+
+        if (!qemu_opt_get(opts, name)) {
+            continue;
+        }
+        if (rbd_tunables[i].size) {
+            v = qemu_opt_get_size(opts, name, 0);
+        } else {
+            v = qemu_opt_get_number(opts, name, 0);
+        }
+        snprintf(value, sizeof(value), "%" PRIu64, v);
+
+        r = rados_conf_set(cluster, rbd_tunables[i].conf, value);
+        if (r < 0) {
+            error_setg_errno(errp, -r, "cannot set %s to %s",
+                             rbd_tunables[i].conf, value);
+            return r;
+        }
+    }
+    return 0;
+}
+
 static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
@@ -501,6 +594,11 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
         rados_conf_set(s->cluster, "rbd_cache", "true");
     }
 
+    r = qemu_rbd_set_tunables(s->cluster, opts, errp);
+    if (r < 0) {
+        goto failed_shutdown;
+    }
+
     r = rados_connect(s->cluster);
     if (r < 0) {
         error_setg(errp, "error connecting");
@@ -587,6 +685,19 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+static int rbd_aio_write_zeroes_wrapper(rbd_image_t image,
+                                        uint64_t off,
+                                        uint64_t len,
+                                        rbd_completion_t comp,
+                                        int zero_flags)
+{
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    return rbd_aio_write_zeroes(image, off, len, comp, zero_flags, 0);
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int rbd_aio_flush_wrapper(rbd_image_t image,
                                  rbd_completion_t comp)
 {
@@ -597,13 +708,15 @@ static int rbd_aio_flush_wrapper(rbd_image_t image,
 #endif
 }
 
+/* @zero_flags are librbd's flags for RBD_AIO_WRITE_ZEROES */
 static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
                                  int64_t sector_num,
                                  QEMUIOVector *qiov,
                                  int nb_sectors,
                                  BlockCompletionFunc *cb,
                                  void *opaque,
-                                 RBDAIOCmd cmd)
+                                 RBDAIOCmd cmd,
+                                 int zero_flags)
 {
     RBDAIOCB *acb;
     RADOSCB *rcb = NULL;
@@ -617,20 +730,21 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    if (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
         }
     }
+#endif
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
     acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (cmd == RBD_AIO_WRITE && acb->bounce) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -651,14 +765,25 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
         break;
+    case RBD_AIO_WRITE_ZEROES:
+        r = rbd_aio_write_zeroes_wrapper(s->image, off, size, c, zero_flags);
+        break;
     case RBD_AIO_FLUSH:
         r = rbd_aio_flush_wrapper(s->image, c);
         break;
@@ -689,7 +814,7 @@ static BlockAIOCB *qemu_rbd_aio_readv(BlockDriverState *bs,
                                       void *opaque)
 {
     return rbd_start_aio(bs, sector_num, qiov, nb_sectors, cb, opaque,
-                         RBD_AIO_READ);
+                         RBD_AIO_READ, 0);
 }
 
 static BlockAIOCB *qemu_rbd_aio_writev(BlockDriverState *bs,
@@ -700,7 +825,7 @@ static BlockAIOCB *qemu_rbd_aio_writev(BlockDriverState *bs,
                                        void *opaque)
 {
     return rbd_start_aio(bs, sector_num, qiov, nb_sectors, cb, opaque,
-                         RBD_AIO_WRITE);
+                         RBD_AIO_WRITE, 0);
 }
 
 #ifdef LIBRBD_SUPPORTS_AIO_FLUSH
@@ -708,7 +833,7 @@ static BlockAIOCB *qemu_rbd_aio_flush(BlockDriverState *bs,
                                       BlockCompletionFunc *cb,
                                       void *opaque)
 {
-    return rbd_start_aio(bs, 0, NULL, 0, cb, opaque, RBD_AIO_FLUSH);
+    return rbd_start_aio(bs, 0, NULL, 0, cb, opaque, RBD_AIO_FLUSH, 0);
 }
 
 #else
@@ -737,6 +862,9 @@ static int qemu_rbd_getinfo(BlockDriverState *bs, BlockDriverInfo *bdi)
     }
 
     bdi->cluster_size = info.obj_size;
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    bdi->can_write_zeroes_with_unmap = true;
+#endif
     return 0;
 }
 
@@ -889,7 +1017,49 @@ static BlockAIOCB* qemu_rbd_aio_discard(BlockDriverState *bs,
                                         void *opaque)
 {
     return rbd_start_aio(bs, sector_num, NULL, nb_sectors, cb, opaque,
-                         RBD_AIO_DISCARD);
+                         RBD_AIO_DISCARD, 0);
+}
+#endif
+
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+typedef struct RBDCoData {
+    Coroutine *co;
+    int ret;
+} RBDCoData;
+
+static void qemu_rbd_co_cb(void *opaque, int ret)
+{
+    RBDCoData *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co, NULL);
+}
+
+static int coroutine_fn qemu_rbd_co_write_zeroes(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 BdrvRequestFlags flags)
+{
+    RBDCoData data = {
+        .co = qemu_coroutine_self(),
+    };
+    int zero_flags = 0;
+
+    /* librbd deallocates zeroed objects unless told otherwise */
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+#ifdef RBD_WRITE_ZEROES_FLAG_THICK_PROVISION
+        zero_flags = RBD_WRITE_ZEROES_FLAG_THICK_PROVISION;
+#else
+        return -ENOTSUP;
+#endif
+    }
+
+    if (!rbd_start_aio(bs, sector_num, NULL, nb_sectors, qemu_rbd_co_cb,
+                       &data, RBD_AIO_WRITE_ZEROES, zero_flags)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return data.ret;
 }
 #endif
 
@@ -949,6 +1119,9 @@ static BlockDriver bdrv_rbd = {
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_discard       = qemu_rbd_aio_discard,
 #endif
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    .bdrv_co_write_zeroes   = qemu_rbd_co_write_zeroes,
+#endif
 
     .bdrv_snapshot_create   = qemu_rbd_snap_create,
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
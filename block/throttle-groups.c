@@ -51,15 +51,32 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * Groups can be nested: a group named "host/tenant" is enclosed in the
+ * group "host", which is created along with it.  A request must then
+ * fit within the limits of its own group and of all the enclosing
+ * ones, and it is accounted in all of them.  The lock of an enclosing
+ * group is always taken after the lock of an enclosed one.
+ *
+ * Within a group, the members share its capacity according to their
+ * ThrottleShare: a member with pending requests that is within its
+ * reservation is served first; otherwise the member with the lowest
+ * virtual time goes next.  A request advances the virtual time of its
+ * member by its cost divided by the member's weight, so that the
+ * members get a share proportional to their weight of whatever
+ * capacity is not used by the reservations.  Idle members are skipped,
+ * so their share goes to the busy ones.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
+    struct ThrottleGroup *parent; /* The enclosing group, also constant */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockDriverState) head;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
+    uint64_t vtime[2]; /* virtual time of the last scheduled request */
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -70,42 +87,80 @@ static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
 
-/* Increments the reference count of a ThrottleGroup given its name.
+/* The clock used by all throttle groups */
+static QEMUClockType throttle_group_clock_type(void)
+{
+    if (qtest_enabled()) {
+        /* For testing block IO throttling only */
+        return QEMU_CLOCK_VIRTUAL;
+    }
+    return QEMU_CLOCK_REALTIME;
+}
+
+/* Look for a ThrottleGroup given its name.
  *
- * If no ThrottleGroup is found with the given name a new one is
- * created.
+ * This assumes that throttle_groups_lock is held.
  *
  * @name: the name of the ThrottleGroup
- * @ret:  the ThrottleGroup
+ * @ret:  the ThrottleGroup, or NULL if there is none with that name
  */
-static ThrottleGroup *throttle_group_incref(const char *name)
+static ThrottleGroup *throttle_group_find(const char *name)
 {
-    ThrottleGroup *tg = NULL;
     ThrottleGroup *iter;
 
-    qemu_mutex_lock(&throttle_groups_lock);
-
-    /* Look for an existing group with that name */
     QTAILQ_FOREACH(iter, &throttle_groups, list) {
         if (!strcmp(name, iter->name)) {
-            tg = iter;
-            break;
+            return iter;
         }
     }
 
+    return NULL;
+}
+
+/* Increments the reference count of a ThrottleGroup given its name.
+ *
+ * If no ThrottleGroup is found with the given name a new one is
+ * created, together with its enclosing groups.
+ *
+ * This assumes that throttle_groups_lock is held.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup
+ */
+static ThrottleGroup *throttle_group_incref_locked(const char *name)
+{
+    ThrottleGroup *tg = throttle_group_find(name);
+
     /* Create a new one if not found */
     if (!tg) {
+        const char *sep = strrchr(name, '/');
+
         tg = g_new0(ThrottleGroup, 1);
         tg->name = g_strdup(name);
         qemu_mutex_init(&tg->lock);
         throttle_init(&tg->ts);
         QLIST_INIT(&tg->head);
 
+        if (sep && sep != name) {
+            char *parent_name = g_strndup(name, sep - name);
+            tg->parent = throttle_group_incref_locked(parent_name);
+            g_free(parent_name);
+        }
+
         QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     }
 
     tg->refcount++;
 
+    return tg;
+}
+
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+    tg = throttle_group_incref_locked(name);
     qemu_mutex_unlock(&throttle_groups_lock);
 
     return tg;
@@ -114,19 +169,29 @@ static ThrottleGroup *throttle_group_incref(const char *name)
 /* Decrease the reference count of a ThrottleGroup.
  *
  * When the reference count reaches zero the ThrottleGroup is
- * destroyed.
+ * destroyed, and its reference to the enclosing group dropped.
+ *
+ * This assumes that throttle_groups_lock is held.
  *
  * @tg:  The ThrottleGroup to unref
  */
-static void throttle_group_unref(ThrottleGroup *tg)
+static void throttle_group_unref_locked(ThrottleGroup *tg)
 {
-    qemu_mutex_lock(&throttle_groups_lock);
     if (--tg->refcount == 0) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
+        if (tg->parent) {
+            throttle_group_unref_locked(tg->parent);
+        }
         qemu_mutex_destroy(&tg->lock);
         g_free(tg->name);
         g_free(tg);
     }
+}
+
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    qemu_mutex_lock(&throttle_groups_lock);
+    throttle_group_unref_locked(tg);
     qemu_mutex_unlock(&throttle_groups_lock);
 }
 
@@ -164,8 +229,50 @@ static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
     return next;
 }
 
-/* Return the next BlockDriverState in the round-robin sequence with
- * pending I/O requests.
+/* Compare two virtual times, which are allowed to wrap around */
+static inline bool vtime_before(uint64_t a, uint64_t b)
+{
+    return (int64_t) (a - b) < 0;
+}
+
+/* Make the reservation bucket of a member of a group leak.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @share: the ThrottleShare of the member
+ * @now:   the current time in ns
+ */
+static void throttle_share_leak(ThrottleShare *share, int64_t now)
+{
+    if (now > share->previous_leak) {
+        throttle_leak_bucket(&share->reserve, now - share->previous_leak);
+        share->previous_leak = now;
+    }
+}
+
+/* Check if a member of a group is within its reservation.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @share: the ThrottleShare of the member
+ * @now:   the current time in ns
+ * @ret:   true if the member has a reservation that it has not used up
+ */
+static bool throttle_share_reserved(ThrottleShare *share, int64_t now)
+{
+    if (!share->reserve.avg) {
+        return false;
+    }
+
+    throttle_share_leak(share, now);
+    return throttle_compute_wait(&share->reserve) == 0;
+}
+
+/* Return the next BlockDriverState with pending I/O requests.
+ *
+ * The members are visited in round-robin order starting after the
+ * current token.  The first one that is within its reservation is
+ * returned; failing that, the first one with the lowest virtual time.
  *
  * This assumes that tg->lock is held.
  *
@@ -178,25 +285,114 @@ static BlockDriverState *next_throttle_token(BlockDriverState *bs,
                                              bool is_write)
 {
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
-    BlockDriverState *token, *start;
+    BlockDriverState *token, *start, *best = NULL;
+    int64_t now = qemu_clock_get_ns(throttle_group_clock_type());
 
     start = token = tg->tokens[is_write];
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_bs(token);
-    while (token != start && !token->pending_reqs[is_write]) {
+    do {
         token = throttle_group_next_bs(token);
-    }
+        if (!token->pending_reqs[is_write]) {
+            continue;
+        }
+        if (throttle_share_reserved(&token->throttle_share, now)) {
+            return token;
+        }
+        if (!best || vtime_before(token->throttle_share.vtime[is_write],
+                                  best->throttle_share.vtime[is_write])) {
+            best = token;
+        }
+    } while (token != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling on any member then decide the
+     * token is the current bs because chances are the current bs get
+     * the current request queued.
      */
-    if (token == start && !token->pending_reqs[is_write]) {
-        token = bs;
+    return best ? best : bs;
+}
+
+/* Check the limits of the groups enclosing a group, arming a timer if
+ * any of them requires to wait.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:        the ThrottleGroup
+ * @tt:        the timers of the member that would do the I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the I/O request needs to be throttled or not
+ */
+static bool throttle_group_parents_schedule_timer(ThrottleGroup *tg,
+                                                  ThrottleTimers *tt,
+                                                  bool is_write)
+{
+    int64_t now = qemu_clock_get_ns(tt->clock_type);
+    int64_t next_timestamp, latest = now;
+    ThrottleGroup *parent;
+
+    for (parent = tg->parent; parent; parent = parent->parent) {
+        qemu_mutex_lock(&parent->lock);
+        if (throttle_compute_timer(&parent->ts, is_write, now,
+                                   &next_timestamp)) {
+            latest = MAX(latest, next_timestamp);
+        }
+        qemu_mutex_unlock(&parent->lock);
+    }
+
+    if (latest == now) {
+        return false;
+    }
+
+    if (!timer_pending(tt->timers[is_write])) {
+        timer_mod(tt->timers[is_write], latest);
+    }
+    return true;
+}
+
+/* Account an I/O request that is about to be executed in the share of
+ * its member and in the enclosing groups.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the BlockDriverState doing the I/O
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_account(BlockDriverState *bs, unsigned int bytes,
+                                   bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    ThrottleShare *share = &bs->throttle_share;
+    ThrottleConfig *cfg = &tg->ts.cfg;
+    ThrottleGroup *parent;
+    uint64_t cost;
+
+    /* Share bandwidth if the group limits it, operations otherwise */
+    if (cfg->buckets[THROTTLE_BPS_TOTAL].avg ||
+        cfg->buckets[THROTTLE_BPS_READ].avg ||
+        cfg->buckets[THROTTLE_BPS_WRITE].avg) {
+        cost = bytes;
+    } else if (cfg->op_size && bytes > cfg->op_size) {
+        cost = (uint64_t) bytes * 4096 / cfg->op_size;
+    } else {
+        cost = 4096;
+    }
+
+    if (vtime_before(tg->vtime[is_write], share->vtime[is_write])) {
+        tg->vtime[is_write] = share->vtime[is_write];
+    }
+    share->vtime[is_write] += cost * THROTTLE_WEIGHT_MAX / share->weight;
+
+    if (share->reserve.avg) {
+        throttle_share_leak(share,
+                            qemu_clock_get_ns(throttle_group_clock_type()));
+        share->reserve.level += 1;
     }
 
-    return token;
+    for (parent = tg->parent; parent; parent = parent->parent) {
+        qemu_mutex_lock(&parent->lock);
+        throttle_account(&parent->ts, is_write, bytes);
+        qemu_mutex_unlock(&parent->lock);
+    }
 }
 
 /* Check if the next I/O request for a BlockDriverState needs to be
@@ -223,6 +419,9 @@ static bool throttle_group_schedule_timer(BlockDriverState *bs,
     }
 
     must_wait = throttle_schedule_timer(ts, tt, is_write);
+    if (!must_wait && tg->parent) {
+        must_wait = throttle_group_parents_schedule_timer(tg, tt, is_write);
+    }
 
     /* If a timer just got armed, set bs as the current token */
     if (must_wait) {
@@ -285,10 +484,18 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 {
     bool must_wait;
     BlockDriverState *token;
+    ThrottleShare *share = &bs->throttle_share;
 
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
 
+    /* A member that has been idle restarts from the virtual time of the
+     * group, instead of using up the share it didn't use in a burst */
+    if (!bs->pending_reqs[is_write] &&
+        vtime_before(share->vtime[is_write], tg->vtime[is_write])) {
+        share->vtime[is_write] = tg->vtime[is_write];
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(bs, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -304,6 +511,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(bs->throttle_state, is_write, bytes);
+    throttle_group_account(bs, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
@@ -311,9 +519,29 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight and reservation of a member of a group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @share: the ThrottleShare of the member
+ * @cfg:   the configuration to take them from
+ */
+static void throttle_share_config(ThrottleShare *share, ThrottleConfig *cfg)
+{
+    share->weight = cfg->weight ? cfg->weight : THROTTLE_WEIGHT_DEFAULT;
+
+    /* Allow a burst of 100ms worth of the reservation, like
+     * throttle_config() does for the limits */
+    share->reserve.avg = cfg->iops_reserved;
+    share->reserve.max = MAX(cfg->iops_reserved / 10, 1);
+    share->reserve.level = 0;
+    share->previous_leak = qemu_clock_get_ns(throttle_group_clock_type());
+}
+
 /* Update the throttle configuration for a particular group. Similar
  * to throttle_config(), but guarantees atomicity within the
- * throttling group.
+ * throttling group.  The weight and the reservation are set for @bs
+ * only.
  *
  * @bs:  a BlockDriverState that is member of the group
  * @cfg: the configuration to set
@@ -323,6 +551,11 @@ void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
     ThrottleTimers *tt = &bs->throttle_timers;
     ThrottleState *ts = bs->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleConfig group_cfg = *cfg;
+
+    group_cfg.weight = 0;
+    group_cfg.iops_reserved = 0;
+
     qemu_mutex_lock(&tg->lock);
     /* throttle_config() cancels the timers */
     if (timer_pending(tt->timers[0])) {
@@ -331,13 +564,44 @@ void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
     if (timer_pending(tt->timers[1])) {
         tg->any_timer_armed[1] = false;
     }
-    throttle_config(ts, tt, cfg);
+    throttle_config(ts, tt, &group_cfg);
+    throttle_share_config(&bs->throttle_share, cfg);
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Update the throttle configuration of a group given its name.  This
+ * is meant for the groups enclosing others, which may have no members
+ * of their own.  The timers of the members are left alone: requests
+ * that are already waiting keep their deadline.
+ *
+ * @name: the name of the group
+ * @cfg:  the configuration to set; weight and reservation are ignored
+ * @ret:  false if there is no group with that name
+ */
+bool throttle_group_config_by_name(const char *name, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg;
+    ThrottleConfig group_cfg = *cfg;
+
+    group_cfg.weight = 0;
+    group_cfg.iops_reserved = 0;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+    tg = throttle_group_find(name);
+    if (tg) {
+        qemu_mutex_lock(&tg->lock);
+        throttle_config_buckets(&tg->ts, throttle_group_clock_type(),
+                                &group_cfg);
+        qemu_mutex_unlock(&tg->lock);
+    }
+    qemu_mutex_unlock(&throttle_groups_lock);
+
+    return tg != NULL;
+}
+
 /* Get the throttle configuration from a particular group. Similar to
  * throttle_get_config(), but guarantees atomicity within the
- * throttling group.
+ * throttling group.  The weight and the reservation are those of @bs.
  *
  * @bs:  a BlockDriverState that is member of the group
  * @cfg: the configuration will be written here
@@ -346,8 +610,12 @@ void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
 {
     ThrottleState *ts = bs->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleShare *share = &bs->throttle_share;
+
     qemu_mutex_lock(&tg->lock);
     throttle_get_config(ts, cfg);
+    cfg->weight = share->weight;
+    cfg->iops_reserved = share->reserve.avg;
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -402,12 +670,7 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
 {
     int i;
     ThrottleGroup *tg = throttle_group_incref(groupname);
-    int clock_type = QEMU_CLOCK_REALTIME;
-
-    if (qtest_enabled()) {
-        /* For testing block IO throttling only */
-        clock_type = QEMU_CLOCK_VIRTUAL;
-    }
+    ThrottleShare *share = &bs->throttle_share;
 
     bs->throttle_state = &tg->ts;
 
@@ -417,13 +680,19 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
         if (!tg->tokens[i]) {
             tg->tokens[i] = bs;
         }
+        /* Start at the current virtual time of the group */
+        share->vtime[i] = tg->vtime[i];
     }
 
+    /* Default share until throttle_group_config() sets one */
+    share->weight = THROTTLE_WEIGHT_DEFAULT;
+    share->reserve.avg = 0;
+
     QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
 
     throttle_timers_init(&bs->throttle_timers,
                          bdrv_get_aio_context(bs),
-                         clock_type,
+                         throttle_group_clock_type(),
                          read_timer_cb,
                          write_timer_cb,
                          bs);
@@ -904,6 +904,7 @@ static int vhdx_open(BlockDriverState *bs, QDict *options, int flags,
 
     qemu_co_mutex_init(&s->lock);
     QLIST_INIT(&s->regions);
+    QLIST_INIT(&s->allocations);
 
     /* validate the file signature */
     ret = bdrv_pread(bs->file, 0, &signature, sizeof(uint64_t));
@@ -1080,6 +1081,36 @@ static int vhdx_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 }
 
 
+/*
+ * A newly allocated payload block is marked present in the BAT before its
+ * data is written, and s->lock is dropped for the write.  Requests to the
+ * block wait for that write to complete; requests to other blocks go on.
+ *
+ * Returns true if the caller had to wait; s->lock was dropped meanwhile,
+ * so the block must be looked up again.
+ */
+static bool coroutine_fn vhdx_wait_for_allocation(BDRVVHDXState *s,
+                                                  uint32_t bat_idx)
+{
+    VHDXAllocation *alloc;
+
+    QLIST_FOREACH(alloc, &s->allocations, entries) {
+        if (alloc->bat_idx == bat_idx) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&alloc->waiters);
+            qemu_co_mutex_lock(&s->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void coroutine_fn vhdx_allocation_done(VHDXAllocation *alloc)
+{
+    QLIST_REMOVE(alloc, entries);
+    qemu_co_queue_restart_all(&alloc->waiters);
+}
+
 static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, QEMUIOVector *qiov)
 {
@@ -1102,6 +1133,9 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto exit;
         } else {
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
+            if (vhdx_wait_for_allocation(s, sinfo.bat_idx)) {
+                continue;
+            }
 
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_concat(&hd_qiov, qiov,  bytes_done, sinfo.bytes_avail);
@@ -1222,6 +1256,7 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    VHDXAllocation alloc;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -1241,6 +1276,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             goto exit;
         } else {
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
+            if (vhdx_wait_for_allocation(s, sinfo.bat_idx)) {
+                continue;
+            }
             sectors_to_write = sinfo.sectors_avail;
 
             qemu_iovec_reset(&hd_qiov);
@@ -1306,6 +1344,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                             &bat_entry_offset,
                                             PAYLOAD_BLOCK_FULLY_PRESENT);
                 bat_update = true;
+                alloc.bat_idx = sinfo.bat_idx;
+                qemu_co_queue_init(&alloc.waiters);
+                QLIST_INSERT_HEAD(&s->allocations, &alloc, entries);
                 /* since we just allocated a block, file_offset is the
                  * beginning of the payload block. It needs to be the
                  * write address, which includes the offset into the block */
@@ -1350,6 +1391,8 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
                                                 sizeof(VHDXBatEntry),
                                                 bat_entry_offset);
+                vhdx_allocation_done(&alloc);
+                bat_update = false;
                 if (ret < 0) {
                     goto exit;
                 }
@@ -1371,6 +1414,7 @@ error_bat_restore:
         sinfo.file_offset = bat_prior_offset;
         vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
                                     &bat_entry_offset, bat_state);
+        vhdx_allocation_done(&alloc);
     }
 exit:
     qemu_vfree(iov1.iov_base);
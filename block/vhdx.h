@@ -355,6 +355,13 @@ typedef struct VHDXRegionEntry {
     QLIST_ENTRY(VHDXRegionEntry) entries;
 } VHDXRegionEntry;
 
+/* A payload block whose data is being written for the first time */
+typedef struct VHDXAllocation {
+    uint32_t bat_idx;
+    CoQueue waiters;
+    QLIST_ENTRY(VHDXAllocation) entries;
+} VHDXAllocation;
+
 typedef struct BDRVVHDXState {
     CoMutex lock;
 
@@ -399,6 +406,7 @@ typedef struct BDRVVHDXState {
     bool log_replayed_on_open;
 
     QLIST_HEAD(VHDXRegionHead, VHDXRegionEntry) regions;
+    QLIST_HEAD(VHDXAllocationHead, VHDXAllocation) allocations;
 } BDRVVHDXState;
 
 void vhdx_guid_generate(MSGUID *guid);
@@ -84,7 +84,9 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
+/* Default number of grain tables cached per extent */
 #define L2_CACHE_SIZE 16
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -104,9 +106,10 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;     /* in grain tables */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
 
     int64_t cluster_sectors;
     int64_t next_cluster_sector;
@@ -114,7 +117,13 @@ typedef struct VmdkExtent {
 } VmdkExtent;
 
 typedef struct BDRVVmdkState {
+    /*
+     * Protects the grain directories and tables, their cache and cluster
+     * allocation.  It is dropped while data is read or written to grains
+     * that are already allocated.
+     */
     CoMutex lock;
+    uint64_t l2_cache_bytes;        /* per extent, 0 for the default */
     uint64_t desc_offset;
     bool cid_updated;
     bool cid_checked;
@@ -132,6 +141,7 @@ typedef struct VmdkMetaData {
     unsigned int l2_index;
     unsigned int l2_offset;
     int valid;
+    bool new_allocation;
     uint32_t *l2_cache_entry;
 } VmdkMetaData;
 
@@ -219,6 +229,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_counts);
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -428,6 +440,7 @@ static int vmdk_add_extent(BlockDriverState *bs,
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
                             Error **errp)
 {
+    BDRVVmdkState *s = bs->opaque;
     int ret;
     size_t l1_size;
     int i;
@@ -474,8 +487,22 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_new(uint32_t, extent->l2_size * L2_CACHE_SIZE);
+    extent->l2_cache_size = L2_CACHE_SIZE;
+    if (s->l2_cache_bytes) {
+        uint64_t tables = s->l2_cache_bytes /
+                          (extent->l2_size * sizeof(uint32_t));
+
+        /* There is no point in caching more tables than the extent has */
+        extent->l2_cache_size = MAX(MIN(tables, extent->l1_size), 1);
+    }
+    extent->l2_cache = g_try_new(uint32_t,
+                                 extent->l2_size * extent->l2_cache_size);
+    if (!extent->l2_cache) {
+        ret = -ENOMEM;
+        goto fail_l1b;
+    }
+    extent->l2_cache_offsets = g_new0(uint32_t, extent->l2_cache_size);
+    extent->l2_cache_counts = g_new0(uint32_t, extent->l2_cache_size);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -910,6 +937,19 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum grain table cache size of each extent",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -917,6 +957,18 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
     int ret;
     BDRVVmdkState *s = bs->opaque;
     uint32_t magic;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create(&vmdk_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->l2_cache_bytes = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE, 0);
+    qemu_opts_del(opts);
 
     buf = vmdk_read_desc(bs->file, 0, errp);
     if (!buf) {
@@ -1128,6 +1180,7 @@ static int get_cluster_offset(BlockDriverState *bs,
 
     if (m_data) {
         m_data->valid = 0;
+        m_data->new_allocation = false;
     }
     if (extent->flat) {
         *cluster_offset = extent->flat_start_offset;
@@ -1143,11 +1196,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (l2_offset == extent->l2_cache_offsets[i]) {
             /* increment the hit count */
             if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
+                for (j = 0; j < extent->l2_cache_size; j++) {
                     extent->l2_cache_counts[j] >>= 1;
                 }
             }
@@ -1158,13 +1211,15 @@ static int get_cluster_offset(BlockDriverState *bs,
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (extent->l2_cache_counts[i] < min_count) {
             min_count = extent->l2_cache_counts[i];
             min_index = i;
         }
     }
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    /* The slot no longer holds the table it used to, even if reading fails */
+    extent->l2_cache_offsets[min_index] = 0;
     if (bdrv_pread(
                 extent->file,
                 (int64_t)l2_offset * 512,
@@ -1198,6 +1253,9 @@ static int get_cluster_offset(BlockDriverState *bs,
 
         cluster_sector = extent->next_cluster_sector;
         extent->next_cluster_sector += extent->cluster_sectors;
+        if (m_data) {
+            m_data->new_allocation = true;
+        }
 
         /* First of all we write grain itself, to avoid race condition
          * that may to corrupt the image.
@@ -1403,8 +1461,9 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* Called with s->lock held, which is dropped while data is read */
+static int coroutine_fn vmdk_read(BlockDriverState *bs, int64_t sector_num,
+                                  uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1431,7 +1490,9 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 if (!vmdk_is_cid_valid(bs)) {
                     return -EINVAL;
                 }
+                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1439,9 +1500,12 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else {
+            /* Allocated grains never move, so the lock is not needed */
+            qemu_co_mutex_unlock(&s->lock);
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
                 return ret;
             }
@@ -1472,6 +1536,10 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
  *                with each cluster. By dry run we can find if the zero write
  *                is possible without modifying image data.
  *
+ * Called with s->lock held if in coroutine context.  New grains are
+ * allocated, filled and entered in the grain table under the lock;
+ * only writes to grains that already exist run without it.
+ *
  * Returns: error code with 0 for success.
  */
 static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
@@ -1538,13 +1606,22 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 return -ENOTSUP;
             }
         } else {
+            /* Compressed grains are always new */
+            bool unlocked = !m_data.new_allocation;
+
+            if (unlocked) {
+                qemu_co_mutex_unlock(&s->lock);
+            }
             ret = vmdk_write_extent(extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n, sector_num);
+            if (unlocked) {
+                qemu_co_mutex_lock(&s->lock);
+            }
             if (ret) {
                 return ret;
             }
-            if (m_data.valid) {
+            if (m_data.new_allocation) {
                 /* update L2 tables */
                 if (vmdk_L2update(extent, &m_data,
                                   cluster_offset >> BDRV_SECTOR_BITS)
@@ -49,6 +49,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "sysemu/arch_init.h"
+#include "sysemu/stats.h"
 
 static const char *const if_name[IF_COUNT] = {
     [IF_NONE] = "none",
@@ -199,11 +200,25 @@ QemuOpts *drive_add(BlockInterfaceType type, int index, const char *file,
     return opts;
 }
 
+/*
+ * Drives whose image is still being opened.  drive_new() runs in a
+ * coroutine during startup, so other drives may be created while one
+ * waits for its image; they must see its bus and unit as taken.
+ */
+static QTAILQ_HEAD(, DriveInfo) drives_opening =
+    QTAILQ_HEAD_INITIALIZER(drives_opening);
+
 DriveInfo *drive_get(BlockInterfaceType type, int bus, int unit)
 {
     BlockBackend *blk;
     DriveInfo *dinfo;
 
+    QTAILQ_FOREACH(dinfo, &drives_opening, next) {
+        if (dinfo->type == type && dinfo->bus == bus && dinfo->unit == unit) {
+            return dinfo;
+        }
+    }
+
     for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
         dinfo = blk_legacy_dinfo(blk);
         if (dinfo && dinfo->type == type
@@ -215,6 +230,38 @@ DriveInfo *drive_get(BlockInterfaceType type, int bus, int unit)
     return NULL;
 }
 
+static void blockdev_stats_query(StatsSink *sink, void *opaque)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+
+    for (blk = blk_next(NULL); blk; blk = blk_next(blk)) {
+        stats = blk_get_stats(blk);
+        stats_add_instance(sink, "%s", blk_name(blk));
+        stats_add_counter(sink, "rd-bytes", stats->nr_bytes[BLOCK_ACCT_READ]);
+        stats_add_counter(sink, "wr-bytes", stats->nr_bytes[BLOCK_ACCT_WRITE]);
+        stats_add_counter(sink, "rd-operations",
+                          stats->nr_ops[BLOCK_ACCT_READ]);
+        stats_add_counter(sink, "wr-operations",
+                          stats->nr_ops[BLOCK_ACCT_WRITE]);
+        stats_add_counter(sink, "flush-operations",
+                          stats->nr_ops[BLOCK_ACCT_FLUSH]);
+        stats_add_counter(sink, "rd-total-time-ns",
+                          stats->total_time_ns[BLOCK_ACCT_READ]);
+        stats_add_counter(sink, "wr-total-time-ns",
+                          stats->total_time_ns[BLOCK_ACCT_WRITE]);
+        stats_add_counter(sink, "flush-total-time-ns",
+                          stats->total_time_ns[BLOCK_ACCT_FLUSH]);
+        stats_add_counter(sink, "rd-merged", stats->merged[BLOCK_ACCT_READ]);
+        stats_add_counter(sink, "wr-merged", stats->merged[BLOCK_ACCT_WRITE]);
+    }
+}
+
+void blockdev_stats_init(void)
+{
+    stats_register_provider(STATS_PROVIDER_BLOCK, blockdev_stats_query, NULL);
+}
+
 bool drive_check_orphaned(void)
 {
     BlockBackend *blk;
@@ -332,6 +379,18 @@ static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
         return false;
     }
 
+    if (cfg->weight > THROTTLE_WEIGHT_MAX) {
+        error_setg(errp, "weight must be between 1 and %d (0 for the default)",
+                   THROTTLE_WEIGHT_MAX);
+        return false;
+    }
+
+    if (cfg->tick > THROTTLE_TICK_MAX) {
+        error_setg(errp, "tick must be at most %lld microseconds",
+                   THROTTLE_TICK_MAX / SCALE_US);
+        return false;
+    }
+
     if (!throttle_is_valid(cfg)) {
         error_setg(errp, "bps/iops/maxs values must be 0 or greater");
         return false;
@@ -355,12 +414,16 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    bool merge_requests;
     Error *error = NULL;
     QemuOpts *opts;
     const char *id;
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
     const char *throttling_group;
+    const char *stats_intervals;
+    char **intervals = NULL;
+    int i;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -387,6 +450,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "read-only", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
+    merge_requests = qemu_opt_get_bool(opts, "merge-requests", false);
+    stats_intervals = qemu_opt_get(opts, "stats-intervals");
 
     if ((buf = qemu_opt_get(opts, "discard")) != NULL) {
         if (bdrv_parse_discard_flags(buf, &bdrv_flags) != 0) {
@@ -405,10 +470,14 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
         if (!strcmp(buf, "native")) {
             bdrv_flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else if (!strcmp(buf, "threads")) {
             /* this is the default */
         } else {
@@ -462,6 +531,11 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         qemu_opt_get_number(opts, "throttling.iops-write-max", 0);
 
     cfg.op_size = qemu_opt_get_number(opts, "throttling.iops-size", 0);
+    cfg.tick = qemu_opt_get_number(opts, "throttling.tick-us", 0) * SCALE_US;
+
+    cfg.weight = qemu_opt_get_number(opts, "throttling.weight", 0);
+    cfg.iops_reserved =
+        qemu_opt_get_number(opts, "throttling.iops-reserved", 0);
 
     throttling_group = qemu_opt_get(opts, "throttling.group");
 
@@ -506,6 +580,19 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    if (stats_intervals) {
+        intervals = g_strsplit(stats_intervals, ":", 0);
+        for (i = 0; intervals[i]; i++) {
+            unsigned long long length;
+            if (parse_uint_full(intervals[i], &length, 10) < 0 ||
+                length == 0 || length > UINT_MAX) {
+                error_setg(errp, "Invalid interval length: '%s'",
+                           intervals[i]);
+                goto early_err;
+            }
+        }
+    }
+
     /* init */
     if ((!file || !*file) && !has_driver_specific_opts) {
         blk = blk_new_with_bs(qemu_opts_id(opts), errp);
@@ -548,9 +635,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     }
 
     bs->detect_zeroes = detect_zeroes;
+    bs->merge_requests = merge_requests;
 
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
+    for (i = 0; intervals && intervals[i]; i++) {
+        block_acct_add_interval(bdrv_get_stats(bs),
+                                strtoul(intervals[i], NULL, 10));
+    }
+
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
         if (!throttling_group) {
@@ -566,10 +659,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
 err_no_bs_opts:
     qemu_opts_del(opts);
+    g_strfreev(intervals);
     return blk;
 
 early_err:
     qemu_opts_del(opts);
+    g_strfreev(intervals);
 err_no_opts:
     QDECREF(bs_opts);
     return NULL;
@@ -695,6 +790,7 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     const char *serial;
     const char *filename;
     Error *local_err = NULL;
+    Location loc;
     int i;
 
     /* Change legacy command line options into QMP ones */
@@ -978,18 +1074,6 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         qdict_put(bs_opts, "rerror", qstring_from_str(rerror));
     }
 
-    /* Actual block device init: Functionality shared with blockdev-add */
-    blk = blockdev_init(filename, bs_opts, &local_err);
-    bs_opts = NULL;
-    if (!blk) {
-        if (local_err) {
-            error_report_err(local_err);
-        }
-        goto fail;
-    } else {
-        assert(!local_err);
-    }
-
     /* Create legacy DriveInfo */
     dinfo = g_malloc0(sizeof(*dinfo));
     dinfo->opts = all_opts;
@@ -1005,8 +1089,6 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     dinfo->devaddr = devaddr;
     dinfo->serial = g_strdup(serial);
 
-    blk_set_legacy_dinfo(blk, dinfo);
-
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -1018,6 +1100,29 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         break;
     }
 
+    /* Actual block device init: Functionality shared with blockdev-add */
+    QTAILQ_INSERT_TAIL(&drives_opening, dinfo, next);
+    blk = blockdev_init(filename, bs_opts, &local_err);
+    bs_opts = NULL;
+    QTAILQ_REMOVE(&drives_opening, dinfo, next);
+    if (!blk) {
+        if (local_err) {
+            /* Other drives may have been set up in the meantime */
+            loc_push_none(&loc);
+            qemu_opts_loc_restore(all_opts);
+            error_report_err(local_err);
+            loc_pop(&loc);
+        }
+        g_free(dinfo->serial);
+        g_free(dinfo);
+        dinfo = NULL;
+        goto fail;
+    } else {
+        assert(!local_err);
+    }
+
+    blk_set_legacy_dinfo(blk, dinfo);
+
 fail:
     qemu_opts_del(legacy_opts);
     QDECREF(bs_opts);
@@ -1948,6 +2053,16 @@ out:
     aio_context_release(aio_context);
 }
 
+/* Convert a tick from QMP, letting check_throttle_config() reject the
+ * values that are out of range */
+static uint64_t throttle_tick_from_us(int64_t tick_us)
+{
+    if (tick_us < 0 || tick_us > THROTTLE_TICK_MAX / SCALE_US) {
+        return THROTTLE_TICK_MAX + 1;
+    }
+    return tick_us * SCALE_US;
+}
+
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr,
@@ -1969,7 +2084,13 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_size,
                                int64_t iops_size,
                                bool has_group,
-                               const char *group, Error **errp)
+                               const char *group,
+                               bool has_weight,
+                               int64_t weight,
+                               bool has_iops_reserved,
+                               int64_t iops_reserved,
+                               bool has_tick_us,
+                               int64_t tick_us, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -2016,6 +2137,16 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         cfg.op_size = iops_size;
     }
 
+    if (has_weight) {
+        cfg.weight = weight;
+    }
+    if (has_iops_reserved) {
+        cfg.iops_reserved = iops_reserved;
+    }
+    if (has_tick_us) {
+        cfg.tick = throttle_tick_from_us(tick_us);
+    }
+
     if (!check_throttle_config(&cfg, errp)) {
         return;
     }
@@ -2041,12 +2172,169 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     aio_context_release(aio_context);
 }
 
+void qmp_throttle_group_set_limits(const char *group, int64_t bps,
+                                   int64_t bps_rd, int64_t bps_wr,
+                                   int64_t iops, int64_t iops_rd,
+                                   int64_t iops_wr,
+                                   bool has_bps_max, int64_t bps_max,
+                                   bool has_bps_rd_max, int64_t bps_rd_max,
+                                   bool has_bps_wr_max, int64_t bps_wr_max,
+                                   bool has_iops_max, int64_t iops_max,
+                                   bool has_iops_rd_max, int64_t iops_rd_max,
+                                   bool has_iops_wr_max, int64_t iops_wr_max,
+                                   bool has_iops_size, int64_t iops_size,
+                                   bool has_tick_us, int64_t tick_us,
+                                   Error **errp)
+{
+    ThrottleConfig cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps;
+    cfg.buckets[THROTTLE_BPS_READ].avg  = bps_rd;
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = bps_wr;
+
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops;
+    cfg.buckets[THROTTLE_OPS_READ].avg  = iops_rd;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = iops_wr;
+
+    if (has_bps_max) {
+        cfg.buckets[THROTTLE_BPS_TOTAL].max = bps_max;
+    }
+    if (has_bps_rd_max) {
+        cfg.buckets[THROTTLE_BPS_READ].max = bps_rd_max;
+    }
+    if (has_bps_wr_max) {
+        cfg.buckets[THROTTLE_BPS_WRITE].max = bps_wr_max;
+    }
+    if (has_iops_max) {
+        cfg.buckets[THROTTLE_OPS_TOTAL].max = iops_max;
+    }
+    if (has_iops_rd_max) {
+        cfg.buckets[THROTTLE_OPS_READ].max = iops_rd_max;
+    }
+    if (has_iops_wr_max) {
+        cfg.buckets[THROTTLE_OPS_WRITE].max = iops_wr_max;
+    }
+
+    if (has_iops_size) {
+        cfg.op_size = iops_size;
+    }
+
+    if (has_tick_us) {
+        cfg.tick = throttle_tick_from_us(tick_us);
+    }
+
+    if (!check_throttle_config(&cfg, errp)) {
+        return;
+    }
+
+    if (!throttle_group_config_by_name(group, &cfg)) {
+        error_setg(errp, "Throttle group '%s' not found", group);
+    }
+}
+
+/* Convert a QAPI list of histogram boundaries to an array, checking that
+ * they are positive and strictly increasing.  Returns the number of
+ * boundaries, or -1 on error.
+ */
+static int latency_histogram_boundaries(uint64List *list, uint64_t **array,
+                                        const char *name, Error **errp)
+{
+    uint64List *e;
+    int n = 0;
+
+    for (e = list; e; e = e->next) {
+        n++;
+    }
+
+    *array = g_new(uint64_t, n);
+    for (n = 0, e = list; e; e = e->next, n++) {
+        if (e->value == 0 || (n > 0 && e->value <= (*array)[n - 1])) {
+            error_setg(errp, "'%s' must be a list of positive, strictly "
+                       "increasing values", name);
+            g_free(*array);
+            *array = NULL;
+            return -1;
+        }
+        (*array)[n] = e->value;
+    }
+
+    return n;
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    static const char *names[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = "boundaries-read",
+        [BLOCK_ACCT_WRITE] = "boundaries-write",
+        [BLOCK_ACCT_FLUSH] = "boundaries-flush",
+    };
+    uint64List *lists[BLOCK_MAX_IOTYPE];
+    uint64_t *arrays[BLOCK_MAX_IOTYPE] = { NULL };
+    int counts[BLOCK_MAX_IOTYPE];
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    int i;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    lists[BLOCK_ACCT_READ] = has_boundaries_read ? boundaries_read
+                                                 : boundaries;
+    lists[BLOCK_ACCT_WRITE] = has_boundaries_write ? boundaries_write
+                                                   : boundaries;
+    lists[BLOCK_ACCT_FLUSH] = has_boundaries_flush ? boundaries_flush
+                                                   : boundaries;
+
+    /* Validate everything first, so that an error changes nothing */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        const char *name = lists[i] == boundaries ? "boundaries" : names[i];
+        counts[i] = latency_histogram_boundaries(lists[i], &arrays[i],
+                                                 name, errp);
+        if (counts[i] < 0) {
+            goto out;
+        }
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        int ret = block_latency_histogram_set(stats, i, arrays[i], counts[i]);
+        assert(ret == 0);
+    }
+
+    aio_context_release(aio_context);
+
+out:
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        g_free(arrays[i]);
+    }
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2072,7 +2360,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2651,6 +2947,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       bool has_unmap, bool unmap,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2685,6 +2982,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -2826,7 +3126,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync,
                  on_source_error, on_target_error,
-                 unmap,
+                 unmap, copy_mode,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -3215,10 +3515,22 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.tick-us",
+            .type = QEMU_OPT_NUMBER,
+            .help = "granularity of the throttling timers in microseconds",
         },{
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group (1 to 1000)",
+        },{
+            .name = "throttling.iops-reserved",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations per second guaranteed within the group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -3227,6 +3539,15 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "merge-requests",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit adjacent guest requests together",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
@@ -27,7 +27,9 @@
 #include "exec/address-spaces.h"
 #include "exec/memory-internal.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
+#include "exec/helper-proto.h"
 
 /* -icount align implementation. */
 
@@ -240,45 +242,47 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     /* tb_gen_code can flush our orig_tb, invalidate it now */
     tb_phys_invalidate(orig_tb, -1);
     tb = tb_gen_code(cpu, pc, cs_base, flags,
                      max_cycles | CF_NOCACHE);
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
-static TranslationBlock *tb_find_slow(CPUState *cpu,
-                                      target_ulong pc,
-                                      target_ulong cs_base,
-                                      uint64_t flags)
+/* Look up a TB in the physical hash table.  This does not take tb_lock;
+   the caller must be in an RCU read-side critical section.  */
+static TranslationBlock *tb_find_physical(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
+    TBPhysHash *table;
+    TranslationBlock *tb, **ptb;
     tb_page_addr_t phys_pc, phys_page1;
     target_ulong virt_page2;
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
+    table = atomic_rcu_read(&tcg_ctx.tb_ctx.tb_phys_hash);
+    ptb = tb_phys_hash_bucket(table, tb_hash_func(phys_pc, pc, flags, cs_base));
+    for (tb = atomic_rcu_read(ptb); tb != NULL; tb = atomic_rcu_read(ptb)) {
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
-            tb->flags == flags) {
+            tb->flags == flags &&
+            !atomic_read(&tb->invalid)) {
             /* check next page if needed */
             if (tb->page_addr[1] != -1) {
                 tb_page_addr_t phys_page2;
@@ -286,27 +290,42 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
                 virt_page2 = (pc & TARGET_PAGE_MASK) +
                     TARGET_PAGE_SIZE;
                 phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
+                if (tb->page_addr[1] == phys_page2) {
+                    return tb;
+                }
             } else {
-                goto found;
+                return tb;
             }
         }
-        ptb1 = &tb->phys_hash_next;
+        ptb = &tb->phys_hash_next[table->link];
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+    return NULL;
+}
+
+static TranslationBlock *tb_find_slow(CPUState *cpu,
+                                      target_ulong pc,
+                                      target_ulong cs_base,
+                                      uint64_t flags)
+{
+    TranslationBlock *tb;
+
+    tb = tb_find_physical(cpu, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock();
+        /* A lock-free lookup can miss a TB that is being moved around
+           by a concurrent update, and another vCPU may have translated
+           the block in the meantime, so look again with the lock held.  */
+        tb = tb_find_physical(cpu, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        }
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
@@ -321,7 +340,7 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
@@ -329,6 +348,33 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
     return tb;
 }
 
+/* Called at the end of TBs that jump to a computed address, see
+   tcg_gen_lookup_and_goto_ptr.  Only the jump cache is searched: on a
+   miss, the epilogue returns to cpu_exec, which does the full lookup,
+   translates the code if needed and refills the cache.  */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    /* cold TBs, throwaway TBs and -d exec need to go through the main
+       loop */
+    if (unlikely(tb_trace_threshold && !(tb->cflags & CF_TRACE)) ||
+        unlikely(tb->cflags & CF_SMC_SLOW) ||
+        qemu_loglevel_mask(CPU_LOG_EXEC)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -343,6 +389,39 @@ static void cpu_handle_debug_exception(CPUState *cpu)
     cc->debug_excp_handler(cpu);
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* In multi-threaded TCG mode guest code runs outside the global mutex;
+   take it around the target hooks that deliver interrupts and exceptions,
+   since those poke at device state.  Returns true if the caller has to
+   drop the lock again.  */
+static inline bool cpu_exec_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+/* Undo any locking of the global mutex that was interrupted by a
+   longjmp back to cpu_exec().  */
+static inline void cpu_exec_unlock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#else
+static inline bool cpu_exec_lock_iothread(void)
+{
+    return false;
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+}
+#endif
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -359,9 +438,7 @@ int cpu_exec(CPUState *cpu)
     uint8_t *tc_ptr;
     uintptr_t next_tb;
     SyncClocks sc;
-
-    /* This must be volatile so it is not trashed by longjmp() */
-    volatile bool have_tb_lock = false;
+    int64_t ti = 0;
 
     if (cpu->halted) {
         if (!cpu_has_work(cpu)) {
@@ -371,6 +448,10 @@ int cpu_exec(CPUState *cpu)
         cpu->halted = 0;
     }
 
+    if (tb_profile_enabled) {
+        ti = get_clock();
+    }
+
     current_cpu = cpu;
 
     /* As long as current_cpu is null, up to the assignment just above,
@@ -421,8 +502,13 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = -1;
                     break;
 #else
+                    bool locked = cpu_exec_lock_iothread();
+
                     cc->do_interrupt(cpu);
                     cpu->exception_index = -1;
+                    if (locked) {
+                        qemu_mutex_unlock_iothread();
+                    }
 #endif
                 }
             }
@@ -431,6 +517,8 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    bool locked = cpu_exec_lock_iothread();
+
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -473,15 +561,29 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    if (locked) {
+                        qemu_mutex_unlock_iothread();
+                    }
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
                 tb = tb_find_fast(cpu);
+                if (unlikely(tb_trace_threshold) &&
+                    !(tb->cflags & CF_TRACE)) {
+                    if (++tb_counters(tb)->exec_count >= tb_trace_threshold) {
+                        tb = tb_gen_trace(cpu, tb);
+                    }
+                    /* do not chain to cold TBs, so that we see them again */
+                    next_tb = 0;
+                }
+                if (unlikely(tb->cflags & CF_SMC_SLOW)) {
+                    /* nor to TBs that are thrown away below */
+                    next_tb = 0;
+                }
+                tb_lock();
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
@@ -497,13 +599,17 @@ int cpu_exec(CPUState *cpu)
                 }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump.  The TBs may also have been invalidated by
+                   another vCPU since we looked them up.  */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb;
+
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    if (!tb->invalid && !last_tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
                 }
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_unlock();
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -555,6 +661,17 @@ int cpu_exec(CPUState *cpu)
                     }
                 }
                 cpu->current_tb = NULL;
+                if (unlikely(tb->cflags & CF_SMC_SLOW)) {
+                    /* The page of this TB is rewritten too often to keep
+                       its code, see tb_smc_limit.  The TB is not freed,
+                       as another vCPU may still be running it.  */
+                    tb_lock();
+                    if (!tb->invalid) {
+                        tb_phys_invalidate(tb, -1);
+                    }
+                    tb_unlock();
+                    next_tb = 0;
+                }
                 /* Try to align the host and virtual clocks
                    if the guest is in advance */
                 align_clocks(&sc, cpu);
@@ -571,10 +688,8 @@ int cpu_exec(CPUState *cpu)
             x86_cpu = X86_CPU(cpu);
             env = &x86_cpu->env;
 #endif
-            if (have_tb_lock) {
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = false;
-            }
+            tb_lock_reset();
+            cpu_exec_unlock_iothread();
         }
     } /* for(;;) */
 
@@ -583,5 +698,9 @@ int cpu_exec(CPUState *cpu)
 
     /* fail safe : never use current_cpu outside cpu_exec() */
     current_cpu = NULL;
+
+    if (ti) {
+        cpu->tb_profile_exec_time += get_clock() - ti;
+    }
     return ret;
 }
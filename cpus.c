@@ -36,12 +36,15 @@
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
+#include "sysemu/numa.h"
 #include "sysemu/qtest.h"
+#include "sysemu/replay.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
 #include "qapi-event.h"
 #include "hw/nmi.h"
+#include "hw/boards.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -174,6 +177,19 @@ int64_t cpu_get_icount(void)
     return icount;
 }
 
+/* Record/replay saves and restores the bias at its checkpoints */
+int64_t cpu_get_icount_bias(void)
+{
+    return timers_state.qemu_icount_bias;
+}
+
+void cpu_set_icount_bias(int64_t bias)
+{
+    seqlock_write_lock(&timers_state.vm_clock_seqlock);
+    timers_state.qemu_icount_bias = bias;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock);
+}
+
 int64_t cpu_icount_to_ns(int64_t icount)
 {
     return icount << icount_time_shift;
@@ -326,6 +342,15 @@ static int64_t qemu_icount_round(int64_t count)
     return (count + (1 << icount_time_shift) - 1) >> icount_time_shift;
 }
 
+static void icount_notify_virtual(void)
+{
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    if (replay_mode != REPLAY_MODE_NONE) {
+        /* The timers run in the TCG thread, which may be idle */
+        qemu_cond_broadcast(first_cpu->halt_cond);
+    }
+}
+
 static void icount_warp_rt(void *opaque)
 {
     /* The icount_warp_timer is rescheduled soon after vm_clock_warp_start
@@ -356,7 +381,7 @@ static void icount_warp_rt(void *opaque)
     seqlock_write_unlock(&timers_state.vm_clock_seqlock);
 
     if (qemu_clock_expired(QEMU_CLOCK_VIRTUAL)) {
-        qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+        icount_notify_virtual();
     }
 }
 
@@ -395,6 +420,11 @@ void qemu_clock_warp(QEMUClockType type)
         return;
     }
 
+    /* On replay, the bias comes from the log */
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        return;
+    }
+
     if (icount_sleep) {
         /*
          * If the CPUs have been sleeping, advance QEMU_CLOCK_VIRTUAL timer now.
@@ -447,7 +477,7 @@ void qemu_clock_warp(QEMUClockType type)
             seqlock_write_lock(&timers_state.vm_clock_seqlock);
             timers_state.qemu_icount_bias += deadline;
             seqlock_write_unlock(&timers_state.vm_clock_seqlock);
-            qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+            icount_notify_virtual();
         } else {
             /*
              * We do stop VCPUs and only advance QEMU_CLOCK_VIRTUAL after some
@@ -505,10 +535,121 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+/* vCPU throttling: every CPU_THROTTLE_TIMESLICE_NS of run time, each vCPU
+ * sleeps for long enough to spend throttle_percentage of its time asleep.
+ */
+static QEMUTimer *throttle_timer;
+static unsigned int throttle_percentage;
+
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    double pct;
+    double throttle_ratio;
+    long sleeptime_ns;
+
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    throttle_ratio = pct / (1 - pct);
+    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock_iothread();
+    atomic_set(&cpu->throttle_thread_scheduled, 0);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock_iothread();
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *cpu;
+    double pct;
+
+    /* Stop the timer if needed */
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        /* A vCPU that has not slept since the last tick is not queued
+         * twice, so that the sleeps do not pile up.
+         */
+        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                              CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    atomic_set(&throttle_percentage, new_throttle_pct);
+
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                              CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    atomic_set(&throttle_percentage, 0);
+}
+
+bool cpu_throttle_active(void)
+{
+    return (cpu_throttle_get_percentage() != 0);
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return atomic_read(&throttle_percentage);
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock, NULL);
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
+    throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                  cpu_throttle_timer_tick, NULL);
+}
+
+static void icount_configure_replay(QemuOpts *opts, Error **errp)
+{
+    const char *rr = qemu_opt_get(opts, "rr");
+    const char *rrfile = qemu_opt_get(opts, "rrfile");
+    ReplayMode mode;
+
+    if (!rr) {
+        if (rrfile) {
+            error_setg(errp, "rrfile requires the rr option");
+        }
+        return;
+    }
+    if (!strcmp(rr, "record")) {
+        mode = REPLAY_MODE_RECORD;
+    } else if (!strcmp(rr, "replay")) {
+        mode = REPLAY_MODE_PLAY;
+    } else {
+        error_setg(errp, "Invalid rr mode '%s', expected 'record' or "
+                   "'replay'", rr);
+        return;
+    }
+    if (!rrfile) {
+        error_setg(errp, "rr=%s requires the rrfile option", rr);
+        return;
+    }
+    replay_configure(mode, rrfile, icount_time_shift, errp);
 }
 
 void configure_icount(QemuOpts *opts, Error **errp)
@@ -520,6 +661,8 @@ void configure_icount(QemuOpts *opts, Error **errp)
     if (!option) {
         if (qemu_opt_get(opts, "align") != NULL) {
             error_setg(errp, "Please specify shift option when using align");
+        } else if (qemu_opt_get(opts, "rr") != NULL) {
+            error_setg(errp, "Please specify shift option when using rr");
         }
         return;
     }
@@ -534,15 +677,20 @@ void configure_icount(QemuOpts *opts, Error **errp)
 
     if (icount_align_option && !icount_sleep) {
         error_setg(errp, "align=on and sleep=no are incompatible");
+        return;
     }
     if (strcmp(option, "auto") != 0) {
         errno = 0;
         icount_time_shift = strtol(option, &rem_str, 0);
         if (errno != 0 || *rem_str != '\0' || !strlen(option)) {
             error_setg(errp, "icount: Invalid shift value");
+            return;
         }
         use_icount = 1;
+        icount_configure_replay(opts, errp);
         return;
+    } else if (qemu_opt_get(opts, "rr") != NULL) {
+        error_setg(errp, "shift=auto and rr are incompatible");
     } else if (icount_align_option) {
         error_setg(errp, "shift=auto and align=on are incompatible");
     } else if (!icount_sleep) {
@@ -571,6 +719,22 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    get_ticks_per_sec() / 10);
 }
 
+void qemu_tcg_configure(const char *mode, Error **errp)
+{
+    if (!strcmp(mode, "single")) {
+        mttcg_enabled = false;
+    } else if (!strcmp(mode, "multi")) {
+#ifndef TARGET_SUPPORTS_MTTCG
+        error_report("warning: guest atomics and memory ordering are not "
+                     "yet safe for multi-threaded TCG on this target");
+#endif
+        mttcg_enabled = true;
+    } else {
+        error_setg(errp, "Invalid TCG thread mode '%s', "
+                   "expected 'single' or 'multi'", mode);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -815,6 +979,18 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/* Multi-threaded TCG: each vCPU runs guest code on its own thread and
+ * outside the global mutex.  tcg_running_cpus counts the vCPUs that are
+ * currently inside cpu_exec(); tcg_exclusive_pending is set while one of
+ * them waits for the others to leave so that it can run safe work.  Both
+ * are protected by the global mutex.
+ */
+bool mttcg_enabled;
+static int tcg_running_cpus;
+static bool tcg_exclusive_pending;
+static QemuCond qemu_exclusive_cond;
+static QemuCond qemu_exclusive_resume;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -828,6 +1004,8 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
+    qemu_cond_init(&qemu_exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
@@ -863,6 +1041,31 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     }
 }
 
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    /* vCPU threads in multi-threaded TCG mode get here without the
+     * global mutex, which protects the work list.
+     */
+    bool unlocked = !qemu_mutex_iothread_locked();
+
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(cpu);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item *wi;
@@ -876,16 +1079,56 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->func = func;
     wi->data = data;
     wi->free = true;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
+    queue_work_on_cpu(cpu, wi);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    /* With a single TCG thread, queued work never runs concurrently
+     * with translated code.
+     */
+    if (!qemu_tcg_mttcg_enabled()) {
+        async_run_on_cpu(cpu, func, data);
+        return;
     }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
 
-    qemu_cpu_kick(cpu);
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+    queue_work_on_cpu(cpu, wi);
+}
+
+/* Wait until no other vCPU executes translated code.  Called with the
+ * global mutex held, from a vCPU thread that is outside cpu_exec().
+ */
+static void tcg_start_exclusive(void)
+{
+    CPUState *other;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
+    }
+    tcg_exclusive_pending = true;
+
+    CPU_FOREACH(other) {
+        if (other->running) {
+            cpu_exit(other);
+        }
+    }
+    while (tcg_running_cpus > 0) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+static void tcg_end_exclusive(void)
+{
+    tcg_exclusive_pending = false;
+    qemu_cond_broadcast(&qemu_exclusive_resume);
 }
 
 static void flush_queued_work(CPUState *cpu)
@@ -898,7 +1141,13 @@ static void flush_queued_work(CPUState *cpu)
 
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
-        wi->func(wi->data);
+        if (wi->exclusive) {
+            tcg_start_exclusive();
+            wi->func(wi->data);
+            tcg_end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
         wi->done = true;
         if (wi->free) {
             g_free(wi);
@@ -923,10 +1172,13 @@ static void qemu_tcg_wait_io_event(void)
 {
     CPUState *cpu;
 
-    while (all_cpu_threads_idle()) {
+    while (all_cpu_threads_idle() && !replay_has_work()) {
        /* Start accounting real time to the virtual clock if the CPUs
           are idle.  */
         qemu_clock_warp(QEMU_CLOCK_VIRTUAL);
+        if (replay_has_work()) {
+            break;
+        }
         qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
     }
 
@@ -939,12 +1191,93 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu) || tcg_exclusive_pending) {
+        if (tcg_exclusive_pending) {
+            qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
+        } else {
+            qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        }
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+/* Poll for up to cpu->halt_poll_ns nanoseconds for the halted @cpu to
+ * have work, with the iothread lock released so that whoever raises the
+ * interrupt can take it.
+ */
+static void qemu_kvm_halt_poll(CPUState *cpu)
+{
+    int64_t start = get_clock();
+    int64_t end = start + cpu->halt_poll_ns;
+    bool woken = false;
+
+    atomic_set(&cpu->halt_poll_attempted, cpu->halt_poll_attempted + 1);
+    qemu_mutex_unlock_iothread();
+    do {
+        /* Only reads, the result is checked again under the lock */
+        if (!cpu_thread_is_idle(cpu)) {
+            woken = true;
+            break;
+        }
+    } while (get_clock() < end);
+    qemu_mutex_lock_iothread();
+
+    atomic_set(&cpu->halt_poll_time_ns,
+               cpu->halt_poll_time_ns + get_clock() - start);
+    if (woken && !cpu_thread_is_idle(cpu)) {
+        atomic_set(&cpu->halt_poll_successful,
+                   cpu->halt_poll_successful + 1);
+    }
+}
+
+/* Adjust the polling window of @cpu after it was halted for @block_ns
+ * nanoseconds, including the time spent polling.
+ */
+static void qemu_kvm_adjust_halt_poll_ns(CPUState *cpu, int64_t block_ns,
+                                         int64_t max_ns)
+{
+    if (block_ns <= cpu->halt_poll_ns) {
+        /* Polling caught the wakeup, keep the window as it is */
+    } else if (block_ns > max_ns) {
+        /* The wakeup took too long to be worth polling for, poll less */
+        cpu->halt_poll_ns /= 2;
+    } else if (cpu->halt_poll_ns < max_ns) {
+        /* A longer window would have caught the wakeup, poll more */
+        if (cpu->halt_poll_ns) {
+            cpu->halt_poll_ns *= 2;
+        } else {
+            cpu->halt_poll_ns = 10000; /* start with 10 microseconds */
+        }
+        cpu->halt_poll_ns = MIN(cpu->halt_poll_ns, max_ns);
+    }
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
+    int64_t max_ns = 0;
+    int64_t start = 0;
+
+    /* Only halts are polled for, not a stopped VM */
+    if (current_machine && cpu_thread_is_idle(cpu) && !cpu_is_stopped(cpu)) {
+        max_ns = machine_kvm_halt_poll_ns(current_machine);
+        start = get_clock();
+        cpu->halt_poll_ns = MIN(cpu->halt_poll_ns, max_ns);
+        if (cpu->halt_poll_ns) {
+            qemu_kvm_halt_poll(cpu);
+        }
+    }
+
     while (cpu_thread_is_idle(cpu)) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
 
+    if (max_ns) {
+        qemu_kvm_adjust_halt_poll_ns(cpu, get_clock() - start, max_ns);
+    }
+
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
 }
@@ -960,6 +1293,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
+    numa_cpu_thread_init(cpu);
     current_cpu = cpu;
 
     r = kvm_init_vcpu(cpu);
@@ -1003,6 +1337,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
+    numa_cpu_thread_init(cpu);
 
     sigemptyset(&waitset);
     sigaddset(&waitset, SIG_IPI);
@@ -1033,6 +1368,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static int tcg_cpu_exec(CPUState *cpu);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
@@ -1080,6 +1416,52 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Thread function for one vCPU in multi-threaded TCG mode */
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->can_do_io = 1;
+    numa_cpu_thread_init(cpu);
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        /* Processing pending work first makes sure that e.g. TLB flushes
+         * requested while the vCPU was stopped are done before it runs.
+         */
+        qemu_tcg_mt_wait_io_event(cpu);
+        if (!cpu_can_run(cpu)) {
+            continue;
+        }
+
+        cpu->running = true;
+        tcg_running_cpus++;
+        qemu_mutex_unlock_iothread();
+        r = tcg_cpu_exec(cpu);
+        qemu_mutex_lock_iothread();
+        cpu->running = false;
+        if (--tcg_running_cpus == 0 && tcg_exclusive_pending) {
+            qemu_cond_broadcast(&qemu_exclusive_cond);
+        }
+
+        if (r == EXCP_DEBUG) {
+            cpu_handle_guest_debug(cpu);
+        }
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1122,7 +1504,12 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        /* Nobody waits for the global mutex held by a TCG vCPU, so just
+         * ask it to leave the execution loop.
+         */
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1165,8 +1552,8 @@ void qemu_mutex_lock_iothread(void)
     /* In the simple case there is no need to bump the VCPU thread out of
      * TCG code execution.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
-        !first_cpu || !first_cpu->thread) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() ||
+        qemu_in_vcpu_thread() || !first_cpu || !first_cpu->thread) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1186,6 +1573,11 @@ void qemu_mutex_unlock_iothread(void)
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+void qemu_cond_wait_iothread(QemuCond *cond)
+{
+    qemu_cond_wait(cond, &qemu_global_mutex);
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1211,7 +1603,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1254,6 +1646,24 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mt_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1393,6 +1803,7 @@ static int tcg_cpu_exec(CPUState *cpu)
         }
 
         count = qemu_icount_round(deadline);
+        count = replay_icount_budget(timers_state.qemu_icount, count);
         timers_state.qemu_icount += count;
         decr = (count > 0xffff) ? 0xffff : count;
         count -= decr;
@@ -1420,6 +1831,7 @@ static void tcg_exec_all(void)
 
     /* Account partial waits to QEMU_CLOCK_VIRTUAL.  */
     qemu_clock_warp(QEMU_CLOCK_VIRTUAL);
+    replay_checkpoint();
 
     if (next_cpu == NULL) {
         next_cpu = first_cpu;
@@ -1515,6 +1927,54 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+TbProfileInfo *qmp_query_tb_profile(bool has_count, int64_t count,
+                                    Error **errp)
+{
+    TbProfileInfo *info;
+    TbProfileBlockList **tail;
+    TBProfileStats stats;
+    TBProfileEntry *e;
+    int i, n;
+
+    if (!has_count) {
+        count = 20;
+    } else if (count < 0 || count > INT_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "count",
+                   "a non-negative number");
+        return NULL;
+    }
+
+    info = g_new0(TbProfileInfo, 1);
+    info->enabled = tb_profile_enabled;
+    if (!tb_profile_enabled) {
+        return info;
+    }
+
+    tb_profile_get_stats(&stats);
+    info->translations = stats.translate_count;
+    info->translation_time = stats.translate_time;
+    info->execution_time = stats.exec_time - stats.translate_time;
+
+    tail = &info->blocks;
+    n = tb_profile_get_hot(&e, count);
+    for (i = 0; i < n; i++) {
+        TbProfileBlockList *entry = g_new0(TbProfileBlockList, 1);
+
+        entry->value = g_new0(TbProfileBlock, 1);
+        entry->value->pc = e[i].pc;
+        entry->value->size = e[i].size;
+        entry->value->icount = e[i].icount;
+        entry->value->host_addr = (uintptr_t)e[i].tc_ptr;
+        entry->value->host_size = e[i].tc_size;
+        entry->value->count = e[i].exec_count;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    g_free(e);
+
+    return info;
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
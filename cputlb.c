@@ -29,6 +29,10 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "exec/helper-proto.h"
+#include "translate-all.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -36,6 +40,244 @@
 /* statistics */
 int tlb_flush_count;
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* A TLB is only shrunk if it was little used for this long */
+#define TLB_WINDOW_NS (100 * 1000 * 1000)
+
+static CPUTLBTable *tlb_table_new(size_t n_entries)
+{
+    CPUTLBTable *t;
+
+    t = g_malloc(sizeof(*t) + n_entries * sizeof(CPUTLBEntry));
+    t->n_entries = n_entries;
+    return t;
+}
+
+static void tlb_table_free(CPUTLBTable *t)
+{
+    g_free(t);
+}
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+/* Smallest power of two that is at least @n */
+static size_t tlb_pow2ceil(size_t n)
+{
+    return n <= 1 ? 1 : (size_t)1 << (64 - clz64(n - 1));
+}
+
+/*
+ * Pick the size of the TLB of an MMU mode for the time until the next
+ * flush, from the largest number of entries it had in use at a flush
+ * during the current window:
+ *
+ * - above 70% of the entries, the TLB is doubled right away, since the
+ *   guest most likely touches more pages than the TLB can hold;
+ *
+ * - below 30% for a whole window, the TLB is shrunk to the smallest power
+ *   of two that keeps the use below 70%, so that flushes (which clear the
+ *   whole table) stay cheap.  Waiting for the window to expire keeps a
+ *   guest that flushes often from shrinking a TLB it refills right away.
+ */
+static void tlb_mmu_resize(CPUTLBDesc *desc)
+{
+    size_t old_size = desc->table->n_entries;
+    size_t new_size = old_size;
+    int64_t now = get_clock_realtime();
+    bool window_expired = now > desc->window_begin_ns + TLB_WINDOW_NS;
+    size_t rate;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, (size_t)1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = tlb_pow2ceil(desc->window_max_entries);
+
+        if (desc->window_max_entries * 100 / ceil > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, (size_t)1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    /* The old table may still be walked by cpu_tlb_reset_dirty_all() */
+    call_rcu(desc->table, tlb_table_free, rcu);
+    atomic_rcu_set(&desc->table, tlb_table_new(new_size));
+    g_free(desc->iotlb);
+    desc->iotlb = g_new(CPUIOTLBEntry, new_size);
+    tlb_window_reset(desc, now, 0);
+}
+
+/* Empty the TLB of an MMU mode, and make the fast path use its table */
+static void tlb_mmu_flush(CPUArchState *env, CPUTLBDesc *desc, int mmu_idx)
+{
+    size_t n = desc->table->n_entries;
+
+    memset(desc->table->entries, -1, n * sizeof(CPUTLBEntry));
+    desc->n_used_entries = 0;
+
+    env->tlb_mask[mmu_idx] = (n - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = desc->table->entries;
+    env->iotlb[mmu_idx] = desc->iotlb;
+}
+#endif
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+/* Keep track of the number of used entries, to size the TLB on flushes */
+static inline void tlb_n_used_entries_inc(CPUState *cpu, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    cpu->tlb_d[mmu_idx].n_used_entries++;
+#endif
+}
+
+static inline void tlb_n_used_entries_dec(CPUState *cpu, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    cpu->tlb_d[mmu_idx].n_used_entries--;
+#endif
+}
+
+void tlb_init(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = get_clock_realtime();
+    size_t n = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+    int i;
+
+    cpu->tlb_d = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        CPUTLBDesc *desc = &cpu->tlb_d[i];
+
+        tlb_window_reset(desc, now, 0);
+        desc->table = tlb_table_new(n);
+        desc->iotlb = g_new(CPUIOTLBEntry, n);
+        tlb_mmu_flush(env, desc, i);
+    }
+#endif
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int i;
+
+    if (!cpu->tlb_d) {
+        return;
+    }
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        call_rcu(cpu->tlb_d[i].table, tlb_table_free, rcu);
+        g_free(cpu->tlb_d[i].iotlb);
+    }
+    g_free(cpu->tlb_d);
+    cpu->tlb_d = NULL;
+#endif
+}
+
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
+
+typedef struct TLBFlushWork {
+    CPUState *cpu;
+    target_ulong addr;
+    uint16_t idxmap;
+} TLBFlushWork;
+
+/* In multi-threaded TCG mode the TLB of a vCPU may only be modified by
+ * the thread running that vCPU, flushes requested by other threads are
+ * queued for it.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_async_work(void *data)
+{
+    CPUState *cpu = data;
+    uint16_t idxmap = atomic_xchg(&cpu->tlb_flush_pending, 0);
+
+    if (idxmap == ALL_MMUIDX_BITS) {
+        tlb_flush(cpu, 1);
+    } else if (idxmap) {
+        tlb_flush_by_mmuidx(cpu, idxmap);
+    }
+}
+
+/* Whole-mode flushes requested while one is already queued are merged
+ * into it, so a vCPU flooded with invalidations from its peers flushes
+ * each of its MMU modes at most once before running again.
+ */
+static void tlb_flush_queue(CPUState *cpu, uint16_t idxmap)
+{
+    if (atomic_fetch_or(&cpu->tlb_flush_pending, idxmap) == 0) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+    }
+}
+
+static void tlb_flush_page_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_page_by_mmuidx(work->cpu, work->addr, work->idxmap);
+    g_free(work);
+}
+
+static void tlb_flush_page_queue(CPUState *cpu, target_ulong addr,
+                                 uint16_t idxmap)
+{
+    TLBFlushWork *work;
+
+    work = g_new(TLBFlushWork, 1);
+    work->cpu = cpu;
+    work->addr = addr;
+    work->idxmap = idxmap;
+    async_run_on_cpu(cpu, tlb_flush_page_async_work, work);
+}
+
+static void tlb_large_page_reset(CPUTLBLargePage *lp)
+{
+    lp->addr = -1;
+    lp->mask = 0;
+}
+
+static void tlb_flush_one_mmuidx(CPUState *cpu, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize(&cpu->tlb_d[mmu_idx]);
+    tlb_mmu_flush(env, &cpu->tlb_d[mmu_idx], mmu_idx);
+#else
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+#endif
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        tlb_large_page_reset(&env->tlb_large_page[mmu_idx][i]);
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -51,6 +293,12 @@ int tlb_flush_count;
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue(cpu, ALL_MMUIDX_BITS);
+        return;
+    }
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -59,17 +307,52 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(cpu, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Flush the MMU modes whose bit is set in idxmap, and leave the TLBs of
+ * the other modes alone.  This is what the guest asked for when it
+ * invalidates the translations of one translation regime only.
+ */
+void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
+{
+    int mmu_idx;
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue(cpu, idxmap);
+        return;
+    }
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_by_mmuidx: %" PRIx16 "\n", idxmap);
+#endif
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (idxmap & (1 << mmu_idx)) {
+            tlb_flush_one_mmuidx(cpu, mmu_idx);
+        }
+    }
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+}
+
+void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        tlb_flush_by_mmuidx(cpu, idxmap);
+    }
+}
+
+/* Returns true if the entry mapped addr and was flushed */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,47 +361,123 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static inline bool tlb_addr_in_region(target_ulong tlb_addr,
+                                      const CPUTLBLargePage *lp)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) && (tlb_addr & lp->mask) == lp->addr;
+}
+
+static bool tlb_flush_entry_region(CPUTLBEntry *tlb_entry,
+                                   const CPUTLBLargePage *lp)
+{
+    if (tlb_addr_in_region(tlb_entry->addr_read, lp) ||
+        tlb_addr_in_region(tlb_entry->addr_write, lp) ||
+        tlb_addr_in_region(tlb_entry->addr_code, lp)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+/* Drop the entries of mmu_idx that map a page of the large page region
+ * lp, and stop tracking it.  Scanning the table is bounded by the size
+ * of the TLB whatever the size of the region, and unlike a full flush
+ * it keeps the entries of the rest of the address space.
+ */
+static void tlb_flush_large_page(CPUState *cpu, int mmu_idx,
+                                 CPUTLBLargePage *lp)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
-    int mmu_idx;
+    size_t i, n = tlb_n_entries(env, mmu_idx);
+    int k;
 
 #if defined(DEBUG_TLB)
-    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
-#endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+    printf("tlb_flush_page: large page " TARGET_FMT_lx "/" TARGET_FMT_lx
+           " mmu_idx %d\n", lp->addr, lp->mask, mmu_idx);
 #endif
-        tlb_flush(cpu, 1);
+    for (i = 0; i < n; i++) {
+        if (tlb_flush_entry_region(&env->tlb_table[mmu_idx][i], lp)) {
+            tlb_n_used_entries_dec(cpu, mmu_idx);
+        }
+    }
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry_region(&env->tlb_v_table[mmu_idx][k], lp);
+    }
+    tlb_large_page_reset(lp);
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                              uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    bool large_page = false;
+    int mmu_idx;
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_page_queue(cpu, addr, idxmap);
         return;
     }
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page: " TARGET_FMT_lx " mmu_idx %" PRIx16 "\n",
+           addr, idxmap);
+#endif
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
-
-    /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
+
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+        if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+            tlb_n_used_entries_dec(cpu, mmu_idx);
+        }
+        /* check whether there are entries that need to be flushed in
+           the vtlb */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
+
+        /* Check if we need to flush due to large pages.  */
+        for (k = 0; k < CPU_TLB_LARGE_PAGES; k++) {
+            CPUTLBLargePage *lp = &env->tlb_large_page[mmu_idx][k];
+
+            if ((addr & lp->mask) == lp->addr) {
+                tlb_flush_large_page(cpu, mmu_idx, lp);
+                large_page = true;
+            }
+        }
     }
 
-    tb_flush_jmp_cache(cpu, addr);
+    if (large_page) {
+        /* Cheaper than tb_flush_jmp_cache() on every page of a region */
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    } else {
+        tb_flush_jmp_cache(cpu, addr);
+    }
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    tlb_flush_page_by_mmuidx(cpu, addr, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr, uint16_t idxmap)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        tlb_flush_page_by_mmuidx(cpu, addr, idxmap);
+    }
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -170,17 +529,26 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
     CPUState *cpu;
     CPUArchState *env;
 
+    rcu_read_lock();
     CPU_FOREACH(cpu) {
         int mmu_idx;
 
         env = cpu->env_ptr;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             unsigned int i;
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+            /* The vCPU may be resizing its TLB concurrently */
+            CPUTLBTable *t = atomic_rcu_read(&cpu->tlb_d[mmu_idx].table);
 
+            for (i = 0; i < t->n_entries; i++) {
+                tlb_reset_dirty_range(&t->entries[i], start1, length);
+            }
+#else
             for (i = 0; i < CPU_TLB_SIZE; i++) {
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+#endif
 
             for (i = 0; i < CPU_VTLB_SIZE; i++) {
                 tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
@@ -188,6 +556,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
             }
         }
     }
+    rcu_read_unlock();
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -201,13 +570,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 {
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -219,26 +586,46 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
-                               target_ulong size)
+   large pages and flush all of it if one of its pages is invalidated.  */
+static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
+                               target_ulong vaddr, target_ulong size)
 {
+    CPUTLBLargePage *lp = env->tlb_large_page[mmu_idx];
+    CPUTLBLargePage *best = NULL;
     target_ulong mask = ~(size - 1);
+    target_ulong best_mask = 0;
+    int i;
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
-        return;
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        /* Already covered by a region at least as large */
+        if (!(lp[i].mask & ~mask) && (vaddr & lp[i].mask) == lp[i].addr) {
+            return;
+        }
     }
-    /* Extend the existing region to include the new page.
-       This is a compromise between unnecessary flushes and the cost
-       of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
-        mask <<= 1;
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        if (lp[i].addr == (target_ulong)-1) {
+            lp[i].addr = vaddr & mask;
+            lp[i].mask = mask;
+            return;
+        }
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+
+    /* All regions are in use: extend the one that grows the least to
+       include the new page.  This is a compromise between unnecessary
+       flushes and the cost of maintaining a full variable size TLB.  */
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        target_ulong m = mask & lp[i].mask;
+
+        while (((lp[i].addr ^ vaddr) & m) != 0) {
+            m <<= 1;
+        }
+        if (!best || m > best_mask) {
+            best = &lp[i];
+            best_mask = m;
+        }
+    }
+    best->addr &= best_mask;
+    best->mask = best_mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -264,7 +651,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+        tlb_add_large_page(env, mmu_idx, vaddr, size);
     }
 
     sz = size;
@@ -292,12 +679,15 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        tlb_n_used_entries_inc(cpu, mmu_idx);
+    }
 
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
@@ -354,8 +744,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
@@ -389,6 +779,107 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 
 #define SHIFT 3
 #include "softmmu_template.h"
+
+/* Probe the TLB for an atomic read-modify-write access and return the host
+ * address of the data, or NULL if the access can't be done with host atomic
+ * operations because it is not to RAM or not aligned.
+ *
+ * Writes to clean RAM pages are handled here like notdirty_mem_write does:
+ * translated code on the page is invalidated now, and *NOTDIRTY tells the
+ * caller to mark the page dirty once the data has been written.
+ */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, int size, bool *notdirty,
+                               uintptr_t retaddr)
+{
+    unsigned mmu_idx = get_mmuidx(oi);
+    int index = tlb_index(env, mmu_idx, addr);
+    target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    void *haddr;
+
+    /* Adjust the given return address.  */
+    retaddr -= GETPC_ADJ;
+    *notdirty = false;
+
+    if ((addr & (size - 1)) != 0) {
+        if ((get_memop(oi) & MO_AMASK) == MO_ALIGN) {
+            cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
+                                 mmu_idx, retaddr);
+        }
+        return NULL;
+    }
+
+    /* Like the store helpers, only check for write permission.  */
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        index = tlb_index(env, mmu_idx, addr);
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+
+    /* MMIO, watchpoints and ROM go through the load and store helpers. */
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_NOTDIRTY))) {
+        return NULL;
+    }
+
+    haddr = (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
+    if (unlikely(tlb_addr & TLB_NOTDIRTY)) {
+        ram_addr_t ram_addr = qemu_ram_addr_from_host_nofail(haddr);
+
+        if (!cpu_physical_memory_get_dirty_flag(ram_addr,
+                                                DIRTY_MEMORY_CODE)) {
+            CPUState *cpu = ENV_GET_CPU(env);
+
+            cpu->mem_io_pc = retaddr;
+            cpu->mem_io_vaddr = addr;
+            tb_lock();
+            tb_invalidate_phys_page_fast(ram_addr, size);
+            tb_unlock();
+        }
+        *notdirty = true;
+    }
+    return haddr;
+}
+
+static void atomic_mmu_set_dirty(CPUArchState *env, void *haddr,
+                                 target_ulong addr, int size)
+{
+    ram_addr_t ram_addr = qemu_ram_addr_from_host_nofail(haddr);
+
+    cpu_physical_memory_set_dirty_range(ram_addr, size,
+                                        DIRTY_CLIENTS_NOCODE);
+    if (!cpu_physical_memory_is_clean(ram_addr)) {
+        tlb_set_dirty(env, addr);
+    }
+}
+
+#define ATOMIC_MMU_DECLS    bool notdirty;
+#define ATOMIC_MMU_LOOKUP \
+    atomic_mmu_lookup(env, addr, oi, DATA_SIZE, &notdirty, GETRA())
+#define ATOMIC_MMU_CLEANUP                                      \
+    do {                                                        \
+        if (unlikely(notdirty)) {                               \
+            atomic_mmu_set_dirty(env, haddr, addr, DATA_SIZE);  \
+        }                                                       \
+    } while (0)
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#ifdef CONFIG_ATOMIC64
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#endif
+
+#undef ATOMIC_MMU_DECLS
+#undef ATOMIC_MMU_LOOKUP
+#undef ATOMIC_MMU_CLEANUP
 #undef MMUSUFFIX
 
 #define MMUSUFFIX _cmmu
@@ -24,37 +24,33 @@
 /* Disassemble TCI bytecode. */
 int print_insn_tci(bfd_vma addr, disassemble_info *info)
 {
-    int length;
-    uint8_t byte;
+    TCIInsn insn;
+    unsigned op;
     int status;
-    TCGOpcode op;
+    int i;
 
-    status = info->read_memory_func(addr, &byte, 1, info);
+    status = info->read_memory_func(addr, (bfd_byte *)&insn, sizeof(insn),
+                                    info);
     if (status != 0) {
         info->memory_error_func(status, addr, info);
         return -1;
     }
-    op = byte;
-
-    addr++;
-    status = info->read_memory_func(addr, &byte, 1, info);
-    if (status != 0) {
-        info->memory_error_func(status, addr, info);
-        return -1;
-    }
-    length = byte;
+    op = insn.opc & ~TCI_OPC_IMM;
 
     if (op >= tcg_op_defs_max) {
-        info->fprintf_func(info->stream, "illegal opcode %d", op);
+        info->fprintf_func(info->stream, "illegal opcode %d", insn.opc);
     } else {
         const TCGOpDef *def = &tcg_op_defs[op];
-        int nb_oargs = def->nb_oargs;
-        int nb_iargs = def->nb_iargs;
-        int nb_cargs = def->nb_cargs;
+
         /* TODO: Improve disassembler output. */
-        info->fprintf_func(info->stream, "%s\to=%d i=%d c=%d",
-                           def->name, nb_oargs, nb_iargs, nb_cargs);
+        info->fprintf_func(info->stream, "%s%s\t", def->name,
+                           insn.opc & TCI_OPC_IMM ? "i" : "");
+        for (i = 0; i < ARRAY_SIZE(insn.r); i++) {
+            info->fprintf_func(info->stream, "%s%u", i ? "," : "",
+                               insn.r[i]);
+        }
+        info->fprintf_func(info->stream, " 0x%" PRIxPTR, insn.i);
     }
 
-    return length;
+    return sizeof(insn);
 }
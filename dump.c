@@ -25,6 +25,8 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -37,6 +39,13 @@
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
 
+/* Pages handed to a compression thread at a time */
+#define DUMP_BATCH_PAGES        256
+#define DUMP_MAX_THREADS        16
+/* Data queued to the writer thread before the dump waits for it */
+#define DUMP_WRITER_MAX_QUEUED  (64 * 1024 * 1024)
+#define DUMP_WRITER_BUF_SIZE    (1024 * 1024)
+
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val)
 {
     if (s->dump_info.d_endian == ELFDATA2LSB) {
@@ -101,6 +110,130 @@ static int fd_write_vmcore(const void *buf, size_t size, void *opaque)
     return 0;
 }
 
+/*
+ * The guest is stopped while it is dumped, so its memory can be written
+ * and compressed by other threads without copying it first.  The writer
+ * thread performs the writes in the order they are queued.
+ */
+typedef struct DumpWriteReq {
+    off_t offset;
+    const void *buf;
+    size_t size;
+    bool free_buf;
+    QSIMPLEQ_ENTRY(DumpWriteReq) next;
+} DumpWriteReq;
+
+typedef struct DumpWriter {
+    int fd;
+    bool flat;              /* kdump flattened format, see write_buffer() */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, DumpWriteReq) queue;
+    size_t queued;
+    bool stop;
+    int ret;
+} DumpWriter;
+
+static int write_buffer(int fd, off_t offset, const void *buf, size_t size);
+
+static void *dump_writer_thread(void *opaque)
+{
+    DumpWriter *w = opaque;
+    DumpWriteReq *req;
+    int ret = 0;
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&w->queue) && !w->stop) {
+            qemu_cond_wait(&w->cond, &w->lock);
+        }
+        req = QSIMPLEQ_FIRST(&w->queue);
+        if (!req) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&w->queue, next);
+        qemu_mutex_unlock(&w->lock);
+
+        /* After a failure, only drain the queue */
+        if (ret == 0) {
+            if (w->flat) {
+                ret = write_buffer(w->fd, req->offset, req->buf, req->size);
+            } else if (qemu_write_full(w->fd, req->buf,
+                                       req->size) != req->size) {
+                ret = -1;
+            }
+        }
+        if (req->free_buf) {
+            g_free((void *)req->buf);
+        }
+
+        qemu_mutex_lock(&w->lock);
+        w->ret = ret;
+        w->queued -= req->size;
+        g_free(req);
+        qemu_cond_broadcast(&w->cond);
+    }
+    qemu_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void dump_writer_start(DumpWriter *w, int fd, bool flat)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->flat = flat;
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->cond);
+    QSIMPLEQ_INIT(&w->queue);
+    qemu_thread_create(&w->thread, "dump writer", dump_writer_thread, w,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Queue @size bytes at @buf to be written at @offset (flattened format
+ * only).  With @free_buf, the writer thread frees @buf once written.
+ * Returns -1 if an earlier write failed.
+ */
+static int dump_writer_queue(DumpWriter *w, off_t offset, const void *buf,
+                             size_t size, bool free_buf)
+{
+    DumpWriteReq *req = g_new(DumpWriteReq, 1);
+    int ret;
+
+    req->offset = offset;
+    req->buf = buf;
+    req->size = size;
+    req->free_buf = free_buf;
+
+    qemu_mutex_lock(&w->lock);
+    while (w->queued > DUMP_WRITER_MAX_QUEUED && !w->ret) {
+        qemu_cond_wait(&w->cond, &w->lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&w->queue, req, next);
+    w->queued += size;
+    ret = w->ret;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+
+    return ret;
+}
+
+/* Wait for the queued writes and stop the writer thread */
+static int dump_writer_finish(DumpWriter *w)
+{
+    qemu_mutex_lock(&w->lock);
+    w->stop = true;
+    qemu_cond_broadcast(&w->cond);
+    qemu_mutex_unlock(&w->lock);
+
+    qemu_thread_join(&w->thread);
+    qemu_cond_destroy(&w->cond);
+    qemu_mutex_destroy(&w->lock);
+
+    return w->ret;
+}
+
 static void write_elf64_header(DumpState *s, Error **errp)
 {
     Elf64_Ehdr elf_header;
@@ -330,40 +463,21 @@ static void write_elf_section(DumpState *s, int type, Error **errp)
     }
 }
 
-static void write_data(DumpState *s, void *buf, int length, Error **errp)
-{
-    int ret;
-
-    ret = fd_write_vmcore(buf, length, s);
-    if (ret < 0) {
-        dump_error(s, "dump: failed to save memory", errp);
-    }
-}
-
-/* write the memory to vmcore. 1 page per I/O. */
-static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
-                         int64_t size, Error **errp)
+/* write the memory to vmcore. DUMP_WRITER_BUF_SIZE bytes per I/O. */
+static int write_memory(DumpWriter *w, GuestPhysBlock *block,
+                        ram_addr_t start, int64_t size)
 {
-    int64_t i;
-    Error *local_err = NULL;
+    int64_t done, len;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                   TARGET_PAGE_SIZE, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_WRITER_BUF_SIZE);
+        if (dump_writer_queue(w, 0, block->host_addr + start + done, len,
+                              false) < 0) {
+            return -1;
         }
     }
 
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                   size % TARGET_PAGE_SIZE, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
-        }
-    }
+    return 0;
 }
 
 /* get the memory's offset and size in the vmcore */
@@ -605,8 +719,10 @@ static void dump_iterate(DumpState *s, Error **errp)
 {
     GuestPhysBlock *block;
     int64_t size;
-    Error *local_err = NULL;
+    DumpWriter writer;
+    int ret;
 
+    dump_writer_start(&writer, s->fd, false);
     do {
         block = s->next_block;
 
@@ -617,14 +733,17 @@ static void dump_iterate(DumpState *s, Error **errp)
                 size -= block->target_end - (s->begin + s->length);
             }
         }
-        write_memory(s, block, s->start, size, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
+        ret = write_memory(&writer, block, s->start, size);
+        if (ret < 0) {
+            break;
         }
 
     } while (!get_next_block(s, block));
 
+    if (dump_writer_finish(&writer) < 0 || ret < 0) {
+        dump_error(s, "dump: failed to save memory", errp);
+        return;
+    }
     dump_completed(s);
 }
 
@@ -1094,18 +1213,21 @@ out:
 }
 
 static void prepare_data_cache(DataCache *data_cache, DumpState *s,
-                               off_t offset)
+                               off_t offset, DumpWriter *writer)
 {
     data_cache->fd = s->fd;
+    data_cache->writer = writer;
     data_cache->data_size = 0;
-    data_cache->buf_size = BUFSIZE_DATA_CACHE;
-    data_cache->buf = g_malloc0(BUFSIZE_DATA_CACHE);
+    data_cache->buf_size = writer ? DUMP_WRITER_BUF_SIZE : BUFSIZE_DATA_CACHE;
+    data_cache->buf = g_malloc0(data_cache->buf_size);
     data_cache->offset = offset;
 }
 
 static int write_cache(DataCache *dc, const void *buf, size_t size,
                        bool flag_sync)
 {
+    int ret;
+
     /*
      * dc->buf_size should not be less than size, otherwise dc will never be
      * enough
@@ -1119,7 +1241,15 @@ static int write_cache(DataCache *dc, const void *buf, size_t size,
      */
     if ((!flag_sync && dc->data_size + size > dc->buf_size) ||
         (flag_sync && dc->data_size > 0)) {
-        if (write_buffer(dc->fd, dc->offset, dc->buf, dc->data_size) < 0) {
+        if (dc->writer) {
+            /* the writer thread frees the buffer */
+            ret = dump_writer_queue(dc->writer, dc->offset, dc->buf,
+                                    dc->data_size, true);
+            dc->buf = g_malloc(dc->buf_size);
+        } else {
+            ret = write_buffer(dc->fd, dc->offset, dc->buf, dc->data_size);
+        }
+        if (ret < 0) {
             return -1;
         }
 
@@ -1170,37 +1300,206 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Pages are compressed in batches of DUMP_BATCH_PAGES by a pool of threads,
+ * then written back in order by write_dump_pages().
+ */
+typedef struct DumpCompressJob {
+    uint8_t *pages[DUMP_BATCH_PAGES];   /* guest pages */
+    uint8_t *data[DUMP_BATCH_PAGES];    /* data to write, NULL if zero */
+    uint32_t size[DUMP_BATCH_PAGES];
+    uint32_t flags[DUMP_BATCH_PAGES];
+    uint8_t *buf_out;                   /* compressed pages */
+    int nr_pages;
+    bool done;
+    QSIMPLEQ_ENTRY(DumpCompressJob) next;
+} DumpCompressJob;
+
+typedef struct DumpCompressor {
+    uint32_t flag_compress;
+    size_t len_buf_out;
+    QemuThread threads[DUMP_MAX_THREADS];
+    int nr_threads;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, DumpCompressJob) pending;
+    bool stop;
+} DumpCompressor;
+
+/*
+ * only one compression format will be used here, for s->flag_compress is
+ * set. But when compression fails to work, we fall back to save in
+ * plaintext.
+ */
+static void dump_compress_page(DumpCompressor *c, DumpCompressJob *job,
+                               int i, void *wrkmem)
+{
+    uint8_t *buf = job->pages[i];
+    uint8_t *buf_out = job->buf_out + i * c->len_buf_out;
+    size_t size_out = c->len_buf_out;
+
+    if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
+        job->data[i] = NULL;
+        return;
+    }
+
+    if ((c->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)&size_out, buf, TARGET_PAGE_SIZE,
+                   Z_BEST_SPEED) == Z_OK) &&
+        (size_out < TARGET_PAGE_SIZE)) {
+        job->flags[i] = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((c->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+               (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
+                                 (lzo_uint *)&size_out,
+                                 wrkmem) == LZO_E_OK) &&
+               (size_out < TARGET_PAGE_SIZE)) {
+        job->flags[i] = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((c->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+               (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
+                                (char *)buf_out, &size_out) == SNAPPY_OK) &&
+               (size_out < TARGET_PAGE_SIZE)) {
+        job->flags[i] = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        job->flags[i] = 0;
+        job->data[i] = buf;
+        job->size[i] = TARGET_PAGE_SIZE;
+        return;
+    }
+
+    job->data[i] = buf_out;
+    job->size[i] = size_out;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressor *c = opaque;
+    DumpCompressJob *job;
+    void *wrkmem = NULL;
+    int i;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&c->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&c->pending) && !c->stop) {
+            qemu_cond_wait(&c->cond, &c->lock);
+        }
+        job = QSIMPLEQ_FIRST(&c->pending);
+        if (!job) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&c->pending, next);
+        qemu_mutex_unlock(&c->lock);
+
+        for (i = 0; i < job->nr_pages; i++) {
+            dump_compress_page(c, job, i, wrkmem);
+        }
+
+        qemu_mutex_lock(&c->lock);
+        job->done = true;
+        qemu_cond_broadcast(&c->cond);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_compressor_start(DumpCompressor *c, uint32_t flag_compress)
+{
+    int i;
+
+    memset(c, 0, sizeof(*c));
+    c->flag_compress = flag_compress;
+    c->len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, flag_compress);
+    assert(c->len_buf_out != 0);
+    qemu_mutex_init(&c->lock);
+    qemu_cond_init(&c->cond);
+    QSIMPLEQ_INIT(&c->pending);
+
+    c->nr_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    c->nr_threads = MAX(MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                            DUMP_MAX_THREADS), 1);
+#endif
+    for (i = 0; i < c->nr_threads; i++) {
+        qemu_thread_create(&c->threads[i], "dump compress",
+                           dump_compress_thread, c, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compressor_submit(DumpCompressor *c, DumpCompressJob *job)
+{
+    job->done = false;
+    qemu_mutex_lock(&c->lock);
+    QSIMPLEQ_INSERT_TAIL(&c->pending, job, next);
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->lock);
+}
+
+static void dump_compressor_wait(DumpCompressor *c, DumpCompressJob *job)
+{
+    qemu_mutex_lock(&c->lock);
+    while (!job->done) {
+        qemu_cond_wait(&c->cond, &c->lock);
+    }
+    qemu_mutex_unlock(&c->lock);
+}
+
+/* Let the threads complete the submitted jobs and stop them */
+static void dump_compressor_finish(DumpCompressor *c)
+{
+    int i;
+
+    qemu_mutex_lock(&c->lock);
+    c->stop = true;
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->lock);
+
+    for (i = 0; i < c->nr_threads; i++) {
+        qemu_thread_join(&c->threads[i]);
+    }
+    qemu_cond_destroy(&c->cond);
+    qemu_mutex_destroy(&c->lock);
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpWriter writer;
+    DumpCompressor comp;
+    DumpCompressJob *jobs, *job;
+    int nr_jobs, head = 0, tail = 0, i;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more = true;
+    const char *err = NULL;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
     offset_data = offset_desc + sizeof(PageDescriptor) * s->num_dumpable;
 
-    prepare_data_cache(&page_desc, s, offset_desc);
-    prepare_data_cache(&page_data, s, offset_data);
-
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
+    dump_writer_start(&writer, s->fd, true);
+    prepare_data_cache(&page_desc, s, offset_desc, &writer);
+    prepare_data_cache(&page_data, s, offset_data, &writer);
 
-    buf_out = g_malloc(len_buf_out);
+    /* keep every thread busy while the oldest batch is being written */
+    dump_compressor_start(&comp, s->flag_compress);
+    nr_jobs = comp.nr_threads * 2;
+    jobs = g_new0(DumpCompressJob, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].buf_out = g_malloc(DUMP_BATCH_PAGES * comp.len_buf_out);
+    }
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1214,127 +1513,96 @@ static void write_dump_pages(DumpState *s, Error **errp)
     ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
     g_free(buf);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write page data (zero page)", errp);
+        err = "dump: failed to write page data (zero page)";
         goto out;
     }
 
     offset_data += TARGET_PAGE_SIZE;
 
     /*
-     * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * dump memory to vmcore batch by batch, in the order of the pages. zero
+     * page will all be resided in the first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc", errp);
-                goto out;
+    for (;;) {
+        while (more && tail - head < nr_jobs) {
+            job = &jobs[tail % nr_jobs];
+            job->nr_pages = 0;
+            while (job->nr_pages < DUMP_BATCH_PAGES &&
+                   (more = get_next_page(&block_iter, &pfn_iter, &buf, s))) {
+                job->pages[job->nr_pages++] = buf;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned TARGET_PAGE_SIZE
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = TARGET_PAGE_SIZE;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
+            if (!job->nr_pages) {
+                break;
+            }
+            dump_compressor_submit(&comp, job);
+            tail++;
+        }
+        if (head == tail) {
+            break;
+        }
+
+        job = &jobs[head % nr_jobs];
+        dump_compressor_wait(&comp, job);
+        for (i = 0; i < job->nr_pages; i++) {
+            if (!job->data[i]) {
+                ret = write_cache(&page_desc, &pd_zero,
+                                  sizeof(PageDescriptor), false);
                 if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
+                    err = "dump: failed to write page desc";
                     goto out;
                 }
+                continue;
+            }
+
+            ret = write_cache(&page_data, job->data[i], job->size[i], false);
+            if (ret < 0) {
+                err = "dump: failed to write page data";
+                goto out;
             }
 
             /* get and write page desc here */
+            pd.flags = cpu_to_dump32(s, job->flags[i]);
+            pd.size = cpu_to_dump32(s, job->size[i]);
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += job->size[i];
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc", errp);
+                err = "dump: failed to write page desc";
                 goto out;
             }
         }
+        head++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_desc", errp);
+        err = "dump: failed to sync cache for page_desc";
         goto out;
     }
     ret = write_cache(&page_data, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_data", errp);
+        err = "dump: failed to sync cache for page_data";
         goto out;
     }
 
 out:
+    dump_compressor_finish(&comp);
+    if (dump_writer_finish(&writer) < 0 && !err) {
+        err = "dump: failed to write page data";
+    }
+
+    for (i = 0; i < nr_jobs; i++) {
+        g_free(jobs[i].buf_out);
+    }
+    g_free(jobs);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
+    if (err) {
+        dump_error(s, err, errp);
+    }
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -85,6 +85,9 @@ static MemoryRegion io_mem_unassigned;
  */
 #define RAM_RESIZEABLE (1 << 2)
 
+/* RAM is mmap-ed from a file descriptor without a name, such as a memfd */
+#define RAM_ANON_FD    (1 << 3)
+
 #endif
 
 struct CPUTailQ cpus = QTAILQ_HEAD_INITIALIZER(cpus);
@@ -98,45 +101,38 @@ int use_icount;
 
 #if !defined(CONFIG_USER_ONLY)
 
-typedef struct PhysPageEntry PhysPageEntry;
-
-struct PhysPageEntry {
-    /* How many bits skip to next level (in units of L2_SIZE). 0 for a leaf. */
-    uint32_t skip : 6;
-     /* index into phys_sections (!skip) or phys_map_nodes (skip) */
-    uint32_t ptr : 26;
-};
-
-#define PHYS_MAP_NODE_NIL (((uint32_t)~0) >> 6)
-
-/* Size of the L2 (and L3, etc) page tables.  */
-#define ADDR_SPACE_BITS 64
-
-#define P_L2_BITS 9
-#define P_L2_SIZE (1 << P_L2_BITS)
-
-#define P_L2_LEVELS (((ADDR_SPACE_BITS - TARGET_PAGE_BITS - 1) / P_L2_BITS) + 1)
-
-typedef PhysPageEntry Node[P_L2_SIZE];
+/* A run of pages of the address space that map to the same section */
+typedef struct PhysPageRange {
+    /* first page and page after the last one, in TARGET_PAGE_SIZE units */
+    hwaddr start;
+    hwaddr end;
+    uint16_t section;
+} PhysPageRange;
 
 typedef struct PhysPageMap {
     struct rcu_head rcu;
 
     unsigned sections_nb;
     unsigned sections_nb_alloc;
-    unsigned nodes_nb;
-    unsigned nodes_nb_alloc;
-    Node *nodes;
+    unsigned ranges_nb;
+    unsigned ranges_nb_alloc;
+    /* sorted by address and disjoint; holes map to PHYS_SECTION_UNASSIGNED */
+    PhysPageRange *ranges;
     MemoryRegionSection *sections;
+    /* ranges were not added in address order and must be sorted */
+    bool ranges_unsorted;
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
     struct rcu_head rcu;
+    /* number of address spaces using this map, see mem_commit() */
+    unsigned ref;
 
-    /* This is a multi-level map on the physical address space.
-     * The bottom level has pointers to MemoryRegionSections.
+    /* The section most recently found by a lookup.  Accesses tend to hit
+     * the same section over and over, so it is checked before searching
+     * the map.
      */
-    PhysPageEntry phys_map;
+    MemoryRegionSection *mru_section;
     PhysPageMap map;
     AddressSpace *as;
 };
@@ -163,152 +159,100 @@ static MemoryRegion io_mem_watch;
 
 #if !defined(CONFIG_USER_ONLY)
 
-static void phys_map_node_reserve(PhysPageMap *map, unsigned nodes)
-{
-    if (map->nodes_nb + nodes > map->nodes_nb_alloc) {
-        map->nodes_nb_alloc = MAX(map->nodes_nb_alloc * 2, 16);
-        map->nodes_nb_alloc = MAX(map->nodes_nb_alloc, map->nodes_nb + nodes);
-        map->nodes = g_renew(Node, map->nodes, map->nodes_nb_alloc);
-    }
-}
-
-static uint32_t phys_map_node_alloc(PhysPageMap *map, bool leaf)
-{
-    unsigned i;
-    uint32_t ret;
-    PhysPageEntry e;
-    PhysPageEntry *p;
-
-    ret = map->nodes_nb++;
-    p = map->nodes[ret];
-    assert(ret != PHYS_MAP_NODE_NIL);
-    assert(ret != map->nodes_nb_alloc);
-
-    e.skip = leaf ? 0 : 1;
-    e.ptr = leaf ? PHYS_SECTION_UNASSIGNED : PHYS_MAP_NODE_NIL;
-    for (i = 0; i < P_L2_SIZE; ++i) {
-        memcpy(&p[i], &e, sizeof(e));
-    }
-    return ret;
-}
-
-static void phys_page_set_level(PhysPageMap *map, PhysPageEntry *lp,
-                                hwaddr *index, hwaddr *nb, uint16_t leaf,
-                                int level)
-{
-    PhysPageEntry *p;
-    hwaddr step = (hwaddr)1 << (level * P_L2_BITS);
-
-    if (lp->skip && lp->ptr == PHYS_MAP_NODE_NIL) {
-        lp->ptr = phys_map_node_alloc(map, level == 0);
-    }
-    p = map->nodes[lp->ptr];
-    lp = &p[(*index >> (level * P_L2_BITS)) & (P_L2_SIZE - 1)];
-
-    while (*nb && lp < &p[P_L2_SIZE]) {
-        if ((*index & (step - 1)) == 0 && *nb >= step) {
-            lp->skip = 0;
-            lp->ptr = leaf;
-            *index += step;
-            *nb -= step;
-        } else {
-            phys_page_set_level(map, lp, index, nb, leaf, level - 1);
-        }
-        ++lp;
-    }
-}
-
 static void phys_page_set(AddressSpaceDispatch *d,
                           hwaddr index, hwaddr nb,
                           uint16_t leaf)
 {
-    /* Wildly overreserve - it doesn't matter much. */
-    phys_map_node_reserve(&d->map, 3 * P_L2_LEVELS);
+    PhysPageMap *map = &d->map;
+    PhysPageRange *last;
 
-    phys_page_set_level(&d->map, &d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
-}
-
-/* Compact a non leaf page entry. Simply detect that the entry has a single child,
- * and update our entry so we can skip it and go directly to the destination.
- */
-static void phys_page_compact(PhysPageEntry *lp, Node *nodes, unsigned long *compacted)
-{
-    unsigned valid_ptr = P_L2_SIZE;
-    int valid = 0;
-    PhysPageEntry *p;
-    int i;
-
-    if (lp->ptr == PHYS_MAP_NODE_NIL) {
-        return;
-    }
-
-    p = nodes[lp->ptr];
-    for (i = 0; i < P_L2_SIZE; i++) {
-        if (p[i].ptr == PHYS_MAP_NODE_NIL) {
-            continue;
+    if (map->ranges_nb) {
+        last = &map->ranges[map->ranges_nb - 1];
+        if (last->end == index && last->section == leaf) {
+            last->end += nb;
+            return;
         }
-
-        valid_ptr = i;
-        valid++;
-        if (p[i].skip) {
-            phys_page_compact(&p[i], nodes, compacted);
+        /* The FlatView is walked in address order, so this is rare */
+        if (last->end > index) {
+            map->ranges_unsorted = true;
         }
     }
 
-    /* We can only compress if there's only one child. */
-    if (valid != 1) {
-        return;
+    if (map->ranges_nb == map->ranges_nb_alloc) {
+        map->ranges_nb_alloc = MAX(map->ranges_nb_alloc * 2, 16);
+        map->ranges = g_renew(PhysPageRange, map->ranges,
+                              map->ranges_nb_alloc);
     }
+    map->ranges[map->ranges_nb++] = (PhysPageRange) {
+        .start = index,
+        .end = index + nb,
+        .section = leaf,
+    };
+}
 
-    assert(valid_ptr < P_L2_SIZE);
-
-    /* Don't compress if it won't fit in the # of bits we have. */
-    if (lp->skip + p[valid_ptr].skip >= (1 << 3)) {
-        return;
-    }
+static int phys_page_range_cmp(const void *a, const void *b)
+{
+    const PhysPageRange *ra = a, *rb = b;
 
-    lp->ptr = p[valid_ptr].ptr;
-    if (!p[valid_ptr].skip) {
-        /* If our only child is a leaf, make this a leaf. */
-        /* By design, we should have made this node a leaf to begin with so we
-         * should never reach here.
-         * But since it's so simple to handle this, let's do it just in case we
-         * change this rule.
-         */
-        lp->skip = 0;
-    } else {
-        lp->skip += p[valid_ptr].skip;
+    if (ra->start < rb->start) {
+        return -1;
     }
+    return ra->start > rb->start;
 }
 
-static void phys_page_compact_all(AddressSpaceDispatch *d, int nodes_nb)
+static void phys_page_compact_all(AddressSpaceDispatch *d)
 {
-    DECLARE_BITMAP(compacted, nodes_nb);
+    PhysPageMap *map = &d->map;
 
-    if (d->phys_map.skip) {
-        phys_page_compact(&d->phys_map, d->map.nodes, compacted);
+    if (map->ranges_unsorted) {
+        qsort(map->ranges, map->ranges_nb, sizeof(PhysPageRange),
+              phys_page_range_cmp);
+        map->ranges_unsorted = false;
     }
 }
 
-static MemoryRegionSection *phys_page_find(PhysPageEntry lp, hwaddr addr,
-                                           Node *nodes, MemoryRegionSection *sections)
+static bool section_covers_addr(const MemoryRegionSection *section,
+                                hwaddr addr)
+{
+    return section->size.hi ||
+           range_covers_byte(section->offset_within_address_space,
+                             section->size.lo, addr);
+}
+
+static MemoryRegionSection *phys_page_find(PhysPageMap *map, hwaddr addr)
 {
-    PhysPageEntry *p;
     hwaddr index = addr >> TARGET_PAGE_BITS;
-    int i;
+    MemoryRegionSection *sections = map->sections;
+    PhysPageRange *r = NULL;
+    unsigned lo = 0, hi = map->ranges_nb;
+
+    if (map->ranges_unsorted) {
+        /* Only while the map is being built */
+        for (lo = 0; lo < map->ranges_nb; lo++) {
+            if (index >= map->ranges[lo].start &&
+                index < map->ranges[lo].end) {
+                r = &map->ranges[lo];
+                break;
+            }
+        }
+    } else {
+        /* Find the last range that starts at or before index */
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
 
-    for (i = P_L2_LEVELS; lp.skip && (i -= lp.skip) >= 0;) {
-        if (lp.ptr == PHYS_MAP_NODE_NIL) {
-            return &sections[PHYS_SECTION_UNASSIGNED];
+            if (map->ranges[mid].start <= index) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo && index < map->ranges[lo - 1].end) {
+            r = &map->ranges[lo - 1];
         }
-        p = nodes[lp.ptr];
-        lp = p[(index >> (i * P_L2_BITS)) & (P_L2_SIZE - 1)];
     }
 
-    if (sections[lp.ptr].size.hi ||
-        range_covers_byte(sections[lp.ptr].offset_within_address_space,
-                          sections[lp.ptr].size.lo, addr)) {
-        return &sections[lp.ptr];
+    if (r && section_covers_addr(&sections[r->section], addr)) {
+        return &sections[r->section];
     } else {
         return &sections[PHYS_SECTION_UNASSIGNED];
     }
@@ -325,10 +269,14 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section;
+    MemoryRegionSection *section = atomic_read(&d->mru_section);
     subpage_t *subpage;
 
-    section = phys_page_find(d->phys_map, addr, d->map.nodes, d->map.sections);
+    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
+        !section_covers_addr(section, addr)) {
+        section = phys_page_find(&d->map, addr);
+        atomic_set(&d->mru_section, section);
+    }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -552,6 +500,7 @@ void cpu_exec_exit(CPUState *cpu)
 
     bitmap_clear(cpu_index_map, cpu->cpu_index, 1);
     cpu->cpu_index = -1;
+    tlb_destroy(cpu);
 }
 #else
 
@@ -581,6 +530,7 @@ void cpu_exec_init(CPUState *cpu, Error **errp)
     cpu->as = &address_space_memory;
     cpu->thread_id = qemu_get_thread_id();
     cpu_reload_memory_map(cpu);
+    tlb_init(cpu);
 #endif
 
 #if defined(CONFIG_USER_ONLY)
@@ -853,42 +803,107 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 }
 
 #if !defined(CONFIG_USER_ONLY)
-/* Called from RCU critical section */
-static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+typedef struct RAMBlockIndex {
+    struct rcu_head rcu;
+    unsigned nr;
+    RAMBlock *blocks[];
+} RAMBlockIndex;
+
+/* The most recently used block of this thread, valid as long as
+ * ram_list.version has not changed.  Removing a block bumps the version
+ * before call_rcu, so a thread that still reads the old version from
+ * within an RCU critical section knows that the block has not been freed.
+ * Keeping the cache per thread avoids bouncing its cache line between
+ * vCPUs that work on different blocks.
+ */
+static __thread RAMBlock *ram_mru_block;
+static __thread uint32_t ram_mru_version;
+
+static int ram_block_index_cmp(const void *a, const void *b)
 {
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+/* Called with the ramlist lock held, after ram_list.blocks has changed
+ * and before ram_list.version is incremented.
+ */
+static void ram_block_index_update(void)
+{
+    RAMBlockIndex *old = ram_list.index;
+    RAMBlockIndex *index;
     RAMBlock *block;
+    unsigned nr = 0;
 
-    block = atomic_rcu_read(&ram_list.mru_block);
-    if (block && addr - block->offset < block->max_length) {
-        goto found;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr++;
     }
+    index = g_malloc(sizeof(*index) + nr * sizeof(index->blocks[0]));
+    index->nr = 0;
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->max_length) {
-            goto found;
+        index->blocks[index->nr++] = block;
+    }
+    qsort(index->blocks, index->nr, sizeof(index->blocks[0]),
+          ram_block_index_cmp);
+
+    atomic_rcu_set(&ram_list.index, index);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+/* Called from RCU critical section */
+static RAMBlock *ram_block_index_find(ram_addr_t addr)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_list.index);
+    unsigned lo = 0, hi;
+
+    if (!index) {
+        return NULL;
+    }
+    hi = index->nr;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        RAMBlock *block = index->blocks[mid];
+
+        if (addr < block->offset) {
+            hi = mid;
+        } else if (addr - block->offset >= block->max_length) {
+            lo = mid + 1;
+        } else {
+            return block;
         }
     }
+    return NULL;
+}
 
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
+/* Called from RCU critical section */
+static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+{
+    uint32_t version = atomic_read(&ram_list.version);
+    RAMBlock *block;
 
-found:
-    /* It is safe to write mru_block outside the iothread lock.  This
-     * is what happens:
-     *
-     *     mru_block = xxx
-     *     rcu_read_unlock()
-     *                                        xxx removed from list
-     *                  rcu_read_lock()
-     *                  read mru_block
-     *                                        mru_block = NULL;
-     *                                        call_rcu(reclaim_ramblock, xxx);
-     *                  rcu_read_unlock()
-     *
-     * atomic_rcu_set is not needed here.  The block was already published
-     * when it was placed into the list.  Here we're just making an extra
-     * copy of the pointer.
+    /* Read the version before the index, pairs with smp_wmb() in the
+     * writers.  If the block we find is removed concurrently, the version
+     * changes and invalidates the cached pointer.
      */
-    ram_list.mru_block = block;
+    smp_rmb();
+    block = ram_mru_block;
+    if (block && ram_mru_version == version &&
+        addr - block->offset < block->max_length) {
+        return block;
+    }
+
+    block = ram_block_index_find(addr);
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
+    }
+
+    ram_mru_block = block;
+    ram_mru_version = version;
     return block;
 }
 
@@ -933,6 +948,88 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;
+    ram_addr_t end;
+    unsigned long dirty[];
+};
+
+/*
+ * Move the dirty bits of a range into a private copy in one go, so that
+ * the caller can test as many subranges as it wants and the pages it
+ * finds dirty are clean again for the next round, without the per-test
+ * atomics of cpu_physical_memory_test_and_clear_dirty().
+ *
+ * Note: start and end must be within the same ram block.
+ */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+     (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    unsigned long *src = ram_list.dirty_memory[client];
+    DirtyBitmapSnapshot *snap;
+    unsigned long first, last, page, nr;
+    bool dirty = false;
+
+    first = start >> TARGET_PAGE_BITS;
+    last = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+
+    snap = g_malloc0(sizeof(*snap) +
+                     BITS_TO_LONGS(last - first) * sizeof(unsigned long));
+    snap->start = first << TARGET_PAGE_BITS;
+    snap->end = last << TARGET_PAGE_BITS;
+
+    for (page = first; page < last; page += nr) {
+        unsigned long *p = src + BIT_WORD(page);
+        unsigned long shift = page % BITS_PER_LONG;
+        unsigned long mask, bits, bit;
+
+        nr = MIN(BITS_PER_LONG - shift, last - page);
+        mask = BITMAP_LAST_WORD_MASK(nr) << shift;
+        if (!(*p & mask)) {
+            continue;
+        }
+        /* whole words are swapped out, the ends are masked */
+        if (mask == ~0UL) {
+            bits = atomic_xchg(p, 0);
+        } else {
+            bits = atomic_fetch_and(p, ~mask) & mask;
+        }
+        bits >>= shift;
+        dirty = true;
+        for (bit = 0; bit < nr; bit++) {
+            if (bits & (1UL << bit)) {
+                set_bit(page - first + bit, snap->dirty);
+            }
+        }
+    }
+
+    if (dirty && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return snap;
+}
+
+/*
+ * Ranges that the snapshot does not cover are reported dirty: whoever
+ * asks for them draws them again rather than miss an update.
+ */
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    if (start < snap->start || start + length > snap->end) {
+        return true;
+    }
+
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+    end = (TARGET_PAGE_ALIGN(start + length) - snap->start) >> TARGET_PAGE_BITS;
+
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
 /* Called from RCU critical section */
 hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        MemoryRegionSection *section,
@@ -1034,7 +1131,7 @@ static void phys_sections_free(PhysPageMap *map)
         phys_section_destroy(section->mr);
     }
     g_free(map->sections);
-    g_free(map->nodes);
+    g_free(map->ranges);
 }
 
 static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *section)
@@ -1042,8 +1139,7 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     subpage_t *subpage;
     hwaddr base = section->offset_within_address_space
         & TARGET_PAGE_MASK;
-    MemoryRegionSection *existing = phys_page_find(d->phys_map, base,
-                                                   d->map.nodes, d->map.sections);
+    MemoryRegionSection *existing = phys_page_find(&d->map, base);
     MemoryRegionSection subsection = {
         .offset_within_address_space = base,
         .size = int128_make64(TARGET_PAGE_SIZE),
@@ -1087,6 +1183,11 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (as->dispatch_owner) {
+        /* The map of the owner is built from the same FlatView */
+        return;
+    }
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1156,6 +1257,27 @@ static long gethugepagesize(const char *path, Error **errp)
     return fs.f_bsize;
 }
 
+/*
+ * Open @path, which is kept so that it outlives QEMU, for instance as the RAM
+ * image of a VM template.  A private mapping never writes to the file, so a
+ * read-only file is good enough for it.
+ */
+static int file_ram_open(RAMBlock *block, const char *path, Error **errp)
+{
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 && !(block->flags & RAM_SHARED) &&
+        (errno == EACCES || errno == EROFS)) {
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "unable to open backing store %s",
+                         path);
+    }
+    return fd;
+}
+
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
                             const char *path,
@@ -1165,16 +1287,25 @@ static void *file_ram_alloc(RAMBlock *block,
     char *sanitized_name;
     char *c;
     void *area = NULL;
-    int fd;
+    int fd = -1;
     uint64_t hpagesize;
+    struct stat st;
     Error *local_err = NULL;
 
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fd = file_ram_open(block, path, errp);
+        if (fd < 0) {
+            goto error;
+        }
+    }
+
     hpagesize = gethugepagesize(path, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error;
     }
     block->mr->align = hpagesize;
+    block->page_size = hpagesize;
 
     if (memory < hpagesize) {
         error_setg(errp, "memory size 0x" RAM_ADDR_FMT " must be equal to "
@@ -1189,26 +1320,29 @@ static void *file_ram_alloc(RAMBlock *block,
         goto error;
     }
 
-    /* Make name safe to use with mkstemp by replacing '/' with '_'. */
-    sanitized_name = g_strdup(memory_region_name(block->mr));
-    for (c = sanitized_name; *c != '\0'; c++) {
-        if (*c == '/')
-            *c = '_';
-    }
+    if (fd < 0) {
+        /* Make name safe to use with mkstemp by replacing '/' with '_'. */
+        sanitized_name = g_strdup(memory_region_name(block->mr));
+        for (c = sanitized_name; *c != '\0'; c++) {
+            if (*c == '/') {
+                *c = '_';
+            }
+        }
 
-    filename = g_strdup_printf("%s/qemu_back_mem.%s.XXXXXX", path,
-                               sanitized_name);
-    g_free(sanitized_name);
+        filename = g_strdup_printf("%s/qemu_back_mem.%s.XXXXXX", path,
+                                   sanitized_name);
+        g_free(sanitized_name);
 
-    fd = mkstemp(filename);
-    if (fd < 0) {
-        error_setg_errno(errp, errno,
-                         "unable to create backing store for hugepages");
+        fd = mkstemp(filename);
+        if (fd < 0) {
+            error_setg_errno(errp, errno,
+                             "unable to create backing store for hugepages");
+            g_free(filename);
+            goto error;
+        }
+        unlink(filename);
         g_free(filename);
-        goto error;
     }
-    unlink(filename);
-    g_free(filename);
 
     memory = (memory+hpagesize-1) & ~(hpagesize-1);
 
@@ -1216,10 +1350,13 @@ static void *file_ram_alloc(RAMBlock *block,
      * ftruncate is not supported by hugetlbfs in older
      * hosts, so don't bother bailing out on errors.
      * If anything goes wrong with it under other filesystems,
-     * mmap will fail.
+     * mmap will fail.  A file that already holds the memory, such
+     * as a template, is not truncated.
      */
-    if (ftruncate(fd, memory)) {
-        perror("ftruncate");
+    if (fstat(fd, &st) < 0 || st.st_size < memory) {
+        if (ftruncate(fd, memory)) {
+            perror("ftruncate");
+        }
     }
 
     area = mmap(0, memory, PROT_READ | PROT_WRITE,
@@ -1228,24 +1365,73 @@ static void *file_ram_alloc(RAMBlock *block,
     if (area == MAP_FAILED) {
         error_setg_errno(errp, errno,
                          "unable to map backing store for hugepages");
-        close(fd);
         goto error;
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, 0, NULL, NULL);
     }
 
     block->fd = fd;
     return area;
 
 error:
+    if (fd >= 0) {
+        close(fd);
+    }
     if (mem_prealloc) {
         error_report("%s", error_get_pretty(*errp));
         exit(1);
     }
     return NULL;
 }
+
+/*
+ * Map @fd, which already holds @memory bytes, e.g. a memfd.  The block
+ * takes @fd over on success.
+ */
+static void *fd_ram_alloc(RAMBlock *block, ram_addr_t memory, int fd,
+                          Error **errp)
+{
+    struct statfs fs;
+    uint64_t pagesize;
+    void *area;
+    int ret;
+
+    do {
+        ret = fstatfs(fd, &fs);
+    } while (ret != 0 && errno == EINTR);
+    if (ret != 0) {
+        error_setg_errno(errp, errno, "failed to get page size of memory");
+        return NULL;
+    }
+    pagesize = fs.f_type == HUGETLBFS_MAGIC ? fs.f_bsize : getpagesize();
+    block->mr->align = pagesize;
+    block->page_size = pagesize;
+
+    if (memory & (pagesize - 1)) {
+        error_setg(errp, "memory size 0x" RAM_ADDR_FMT " must be a multiple "
+                   "of the page size 0x%" PRIx64, memory, pagesize);
+        return NULL;
+    }
+
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        error_setg(errp, "host lacks kvm mmu notifiers, "
+                   "fd-backed memory unsupported");
+        return NULL;
+    }
+
+    area = mmap(0, memory, PROT_READ | PROT_WRITE,
+                (block->flags & RAM_SHARED ? MAP_SHARED : MAP_PRIVATE),
+                fd, 0);
+    if (area == MAP_FAILED) {
+        error_setg_errno(errp, errno, "unable to map memory");
+        return NULL;
+    }
+
+    block->fd = fd;
+    return area;
+}
 #endif
 
 /* Called with the ramlist lock held.  */
@@ -1483,7 +1669,7 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
     } else { /* list is empty */
         QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
-    ram_list.mru_block = NULL;
+    ram_block_index_update();
 
     /* Write list before version */
     smp_wmb();
@@ -1564,6 +1750,46 @@ ram_addr_t qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
     }
     return addr;
 }
+
+ram_addr_t qemu_ram_alloc_from_fd(ram_addr_t size, MemoryRegion *mr,
+                                  bool share, int fd, Error **errp)
+{
+    RAMBlock *new_block;
+    ram_addr_t addr;
+    Error *local_err = NULL;
+
+    if (xen_enabled()) {
+        error_setg(errp, "fd-backed memory not supported with Xen");
+        return -1;
+    }
+
+    if (phys_mem_alloc != qemu_anon_ram_alloc) {
+        error_setg(errp,
+                   "fd-backed memory not supported with this accelerator");
+        return -1;
+    }
+
+    size = TARGET_PAGE_ALIGN(size);
+    new_block = g_malloc0(sizeof(*new_block));
+    new_block->mr = mr;
+    new_block->used_length = size;
+    new_block->max_length = size;
+    new_block->flags = RAM_ANON_FD | (share ? RAM_SHARED : 0);
+    new_block->host = fd_ram_alloc(new_block, size, fd, errp);
+    if (!new_block->host) {
+        g_free(new_block);
+        return -1;
+    }
+
+    addr = ram_block_add(new_block, &local_err);
+    if (local_err) {
+        munmap(new_block->host, size);
+        g_free(new_block);
+        error_propagate(errp, local_err);
+        return -1;
+    }
+    return addr;
+}
 #endif
 
 static
@@ -1587,6 +1813,7 @@ ram_addr_t qemu_ram_alloc_internal(ram_addr_t size, ram_addr_t max_size,
     new_block->max_length = max_size;
     assert(max_size >= size);
     new_block->fd = -1;
+    new_block->page_size = getpagesize();
     new_block->host = host;
     if (host) {
         new_block->flags |= RAM_PREALLOC;
@@ -1631,7 +1858,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE_RCU(block, next);
-            ram_list.mru_block = NULL;
+            ram_block_index_update();
             /* Write list before version */
             smp_wmb();
             ram_list.version++;
@@ -1667,11 +1894,13 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE_RCU(block, next);
-            ram_list.mru_block = NULL;
+            ram_block_index_update();
             /* Write list before version */
             smp_wmb();
             ram_list.version++;
             call_rcu(block, reclaim_ramblock, rcu);
+            /* Give the guest RAM back to the host soon */
+            call_rcu_expedite();
             break;
         }
     }
@@ -1725,8 +1954,67 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the memory of a shared file-backed block, in place, with the
+ * file open as @fd, which carries the guest RAM of another process.
+ * @fd is owned by the block on success.
+ */
+int qemu_ram_adopt_fd(RAMBlock *block, int fd, Error **errp)
+{
+    ram_addr_t length = ROUND_UP(block->max_length, block->page_size);
+    struct stat st;
+    void *area;
+
+    if (!(block->flags & RAM_SHARED) || block->fd < 0) {
+        error_setg(errp, "RAM block '%s' is not backed by a shared file",
+                   block->idstr);
+        return -EINVAL;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Can't stat the file of RAM block '%s'",
+                         block->idstr);
+        return -errno;
+    }
+    if (st.st_size < length) {
+        error_setg(errp, "The file of RAM block '%s' is too small",
+                   block->idstr);
+        return -EINVAL;
+    }
+
+    area = mmap(block->host, length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    if (area == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Can't map the file of RAM block '%s'",
+                         block->idstr);
+        return -errno;
+    }
+    assert(area == block->host);
+    memory_try_enable_merging(area, length);
+    qemu_ram_setup_dump(area, length);
+
+    close(block->fd);
+    block->fd = fd;
+    return 0;
+}
+#else
+int qemu_ram_adopt_fd(RAMBlock *block, int fd, Error **errp)
+{
+    error_setg(errp, "Sharing RAM is not supported on this host");
+    return -ENOTSUP;
+}
 #endif /* !_WIN32 */
 
+bool qemu_ram_is_shared(RAMBlock *block)
+{
+    return block->flags & RAM_SHARED;
+}
+
+bool qemu_ram_is_anon_fd(RAMBlock *block)
+{
+    return block->flags & RAM_ANON_FD;
+}
+
 int qemu_get_ram_fd(ram_addr_t addr)
 {
     RAMBlock *block;
@@ -1739,6 +2027,18 @@ int qemu_get_ram_fd(ram_addr_t addr)
     return fd;
 }
 
+size_t qemu_ram_pagesize(ram_addr_t addr)
+{
+    RAMBlock *block;
+    size_t page_size;
+
+    rcu_read_lock();
+    block = qemu_get_ram_block(addr);
+    page_size = block->page_size;
+    rcu_read_unlock();
+    return page_size;
+}
+
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
@@ -1808,19 +2108,15 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
         return xen_map_cache(addr, *size, 1);
     } else {
         RAMBlock *block;
+
         rcu_read_lock();
-        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->max_length) {
-                if (addr - block->offset + *size > block->max_length)
-                    *size = block->max_length - addr + block->offset;
-                ptr = ramblock_ptr(block, addr - block->offset);
-                rcu_read_unlock();
-                return ptr;
-            }
+        block = qemu_get_ram_block(addr);
+        if (addr - block->offset + *size > block->max_length) {
+            *size = block->max_length - addr + block->offset;
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        ptr = ramblock_ptr(block, addr - block->offset);
+        rcu_read_unlock();
+        return ptr;
     }
 }
 
@@ -1848,8 +2144,9 @@ MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     }
 
     rcu_read_lock();
-    block = atomic_rcu_read(&ram_list.mru_block);
-    if (block && block->host && host - block->host < block->max_length) {
+    block = ram_mru_block;
+    if (block && ram_mru_version == atomic_read(&ram_list.version) &&
+        block->host && host - block->host < block->max_length) {
         goto found;
     }
 
@@ -1877,7 +2174,9 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
     }
     switch (size) {
     case 1:
@@ -1947,6 +2246,9 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
             wp->hitattrs = attrs;
             if (!cpu->watchpoint_hit) {
                 cpu->watchpoint_hit = wp;
+
+                /* The TB lock is dropped by cpu_exec() after the longjmp */
+                tb_lock();
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2195,7 +2497,7 @@ static void mem_begin(MemoryListener *listener)
     n = dummy_section(&d->map, as, &io_mem_watch);
     assert(n == PHYS_SECTION_WATCH);
 
-    d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
+    d->ref = 1;
     d->as = as;
     as->next_dispatch = d;
 }
@@ -2206,17 +2508,36 @@ static void address_space_dispatch_free(AddressSpaceDispatch *d)
     g_free(d);
 }
 
+/* Called with the iothread lock held */
+static void address_space_dispatch_unref(AddressSpaceDispatch *d)
+{
+    if (--d->ref == 0) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    if (as->dispatch_owner) {
+        /* Share the map of an address space with the same FlatView.  Its
+         * subpages forward accesses to the owner, which sees the same
+         * topology.
+         */
+        address_space_dispatch_free(next);
+        next = as->dispatch_owner->next_dispatch;
+        next->ref++;
+        as->next_dispatch = next;
+    }
+    /* Sort before publishing, a sharer may commit before the owner */
+    phys_page_compact_all(next);
 
     atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(cur);
     }
 }
 
@@ -2261,7 +2582,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
 
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(d);
     }
 }
 
@@ -2346,7 +2667,9 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
             cpu_physical_memory_range_includes_clean(addr, length, dirty_log_mask);
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
+        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -2600,53 +2923,52 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* A bounce buffer, followed by the data handed out by address_space_map() */
+typedef struct BounceBuffer {
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
+    size_t len;
+    QLIST_ENTRY(BounceBuffer) link;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
+typedef struct AddressSpaceMapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_map_client_free(AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+/* Called with as->bounce_lock held */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_map_client_free(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /* A bounce buffer may have been released since the caller's
+     * address_space_map() failed.
+     */
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -2654,28 +2976,76 @@ void cpu_exec_init_all(void)
     qemu_mutex_init(&ram_list.mutex);
     memory_map_init();
     io_mem_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_map_client_free(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-static void cpu_notify_map_clients(void)
+/* Allocate a bounce buffer for up to @len bytes out of the pool of @as,
+ * or return NULL if the pool is exhausted.
+ */
+static BounceBuffer *address_space_alloc_bounce(AddressSpace *as, hwaddr len)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    BounceBuffer *bounce;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    len = MIN(len, as->max_bounce_buffer_size - as->bounce_buffer_size);
+    if (len == 0) {
+        qemu_mutex_unlock(&as->bounce_lock);
+        return NULL;
+    }
+    as->bounce_buffer_size += len;
+    bounce = g_malloc(sizeof(*bounce) + len);
+    bounce->len = len;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+/* Return the bounce buffer of @as whose data is @buffer, removing it from
+ * the pool, or NULL if @buffer points into guest RAM.
+ */
+static BounceBuffer *address_space_get_bounce(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    /* This is also called for every unmap of guest RAM, keep it cheap when
+     * no bounce buffer is in use.  A bounce buffer that is being unmapped
+     * was allocated before, so its size is visible here.
+     */
+    if (atomic_read(&as->bounce_buffer_size) == 0) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            QLIST_REMOVE(bounce, link);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+static void address_space_free_bounce(AddressSpace *as, BounceBuffer *bounce)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    as->bounce_buffer_size -= bounce->len;
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2705,8 +3075,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2728,26 +3098,27 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        bounce = address_space_alloc_bounce(as, l);
+        if (!bounce) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = bounce->len;
+        bounce->addr = addr;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2781,7 +3152,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_get_bounce(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2797,14 +3170,11 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    memory_region_unref(bounce->mr);
+    address_space_free_bounce(as, bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -88,6 +88,9 @@ this code that are retained.
 
 /* We only need stdlib for abort() */
 #include <stdlib.h>
+/* and the host FPU for the hardfloat fast paths */
+#include <float.h>
+#include <math.h>
 
 /*----------------------------------------------------------------------------
 | Primitive arithmetic functions, including multi-word arithmetic, and
@@ -2159,7 +2162,7 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2182,7 +2185,7 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2205,7 +2208,7 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -2270,7 +2273,7 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -2447,8 +2450,8 @@ float32 float32_rem(float32 a, float32 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
-                       float_status *status)
+static float32 soft_float32_muladd(float32 a, float32 b, float32 c, int flags,
+                                  float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int_fast16_t aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -2668,7 +2671,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int_fast16_t aExp, zExp;
@@ -3945,7 +3948,7 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3968,7 +3971,7 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3991,7 +3994,7 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -4054,7 +4057,7 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int_fast16_t aExp, bExp, zExp;
@@ -4225,8 +4228,8 @@ float64 float64_rem(float64 a, float64 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
-                       float_status *status)
+static float64 soft_float64_muladd(float64 a, float64 b, float64 c, int flags,
+                                  float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int_fast16_t aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -4467,7 +4470,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int_fast16_t aExp, zExp;
@@ -7720,3 +7723,263 @@ float128 float128_scalbn(float128 a, int n, float_status *status)
                                          , status);
 
 }
+
+/*----------------------------------------------------------------------------
+| Hardfloat fast paths for the basic arithmetic operations.
+|
+| When the inexact flag is already raised and the rounding mode is
+| round-to-nearest-even, an operation on zero or normal inputs gives the
+| same result on the host FPU as in softfloat, and the only flag it could
+| raise is inexact.  The exceptions are results that overflow, underflow
+| or are subnormal, which are recomputed in softfloat so that the flags,
+| tininess detection and flush-to-zero behave as the target expects.
+|
+| PowerPC needs to know, for each operation, whether it was inexact, so it
+| always uses softfloat.  Hosts that evaluate float expressions with
+| excess precision (x87) are excluded too.
+*----------------------------------------------------------------------------*/
+
+#if defined(TARGET_PPC) || defined(__FAST_MATH__) || \
+    !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD != 0
+#define QEMU_NO_HARDFLOAT 1
+#else
+#define QEMU_NO_HARDFLOAT 0
+#endif
+
+typedef union {
+    uint32_t i;
+    float h;
+} HardFloat32;
+
+typedef union {
+    uint64_t i;
+    double h;
+} HardFloat64;
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely((s->float_exception_flags & float_flag_inexact) &&
+                  s->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    uint32_t exp = extractFloat32Exp(a);
+
+    return exp != 0xff && (exp != 0 || extractFloat32Frac(a) == 0);
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    uint64_t exp = extractFloat64Exp(a);
+
+    return exp != 0x7ff && (exp != 0 || extractFloat64Frac(a) == 0);
+}
+
+static inline float float32_to_host(float32 a)
+{
+    HardFloat32 u = { .i = float32_val(a) };
+
+    return u.h;
+}
+
+static inline double float64_to_host(float64 a)
+{
+    HardFloat64 u = { .i = float64_val(a) };
+
+    return u.h;
+}
+
+/* Return true and store the host result in *r if it needs no fixup */
+static inline bool float32_hard_result(float h, float32 *r)
+{
+    HardFloat32 u;
+
+    if (unlikely(!(fabsf(h) > FLT_MIN) || isinf(h))) {
+        return false;
+    }
+    u.h = h;
+    *r = make_float32(u.i);
+    return true;
+}
+
+static inline bool float64_hard_result(double h, float64 *r)
+{
+    HardFloat64 u;
+
+    if (unlikely(!(fabs(h) > DBL_MIN) || isinf(h))) {
+        return false;
+    }
+    u.h = h;
+    *r = make_float64(u.i);
+    return true;
+}
+
+static inline float hard_float_add(float a, float b)
+{
+    return a + b;
+}
+
+static inline float hard_float_sub(float a, float b)
+{
+    return a - b;
+}
+
+static inline float hard_float_mul(float a, float b)
+{
+    return a * b;
+}
+
+static inline double hard_double_add(double a, double b)
+{
+    return a + b;
+}
+
+static inline double hard_double_sub(double a, double b)
+{
+    return a - b;
+}
+
+static inline double hard_double_mul(double a, double b)
+{
+    return a * b;
+}
+
+#define HARDFLOAT_2OP(bits, type, name)                                 \
+float##bits float##bits##_##name(float##bits a, float##bits b,          \
+                                 float_status *status)                  \
+{                                                                       \
+    float##bits r;                                                      \
+                                                                        \
+    if (can_use_fpu(status)) {                                          \
+        a = float##bits##_squash_input_denormal(a, status);             \
+        b = float##bits##_squash_input_denormal(b, status);             \
+        if (likely(float##bits##_is_zero_or_normal(a) &&                \
+                   float##bits##_is_zero_or_normal(b)) &&               \
+            float##bits##_hard_result(                                  \
+                hard_##type##_##name(float##bits##_to_host(a),          \
+                                     float##bits##_to_host(b)), &r)) {  \
+            return r;                                                   \
+        }                                                               \
+    }                                                                   \
+    return soft_float##bits##_##name(a, b, status);                     \
+}
+
+HARDFLOAT_2OP(32, float, add)
+HARDFLOAT_2OP(32, float, sub)
+HARDFLOAT_2OP(32, float, mul)
+HARDFLOAT_2OP(64, double, add)
+HARDFLOAT_2OP(64, double, sub)
+HARDFLOAT_2OP(64, double, mul)
+
+/* Division by zero raises divbyzero, leave it to softfloat */
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    float32 r;
+
+    if (can_use_fpu(status)) {
+        a = float32_squash_input_denormal(a, status);
+        b = float32_squash_input_denormal(b, status);
+        if (likely(float32_is_zero_or_normal(a) &&
+                   float32_is_zero_or_normal(b) && !float32_is_zero(b)) &&
+            float32_hard_result(float32_to_host(a) / float32_to_host(b), &r)) {
+            return r;
+        }
+    }
+    return soft_float32_div(a, b, status);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    float64 r;
+
+    if (can_use_fpu(status)) {
+        a = float64_squash_input_denormal(a, status);
+        b = float64_squash_input_denormal(b, status);
+        if (likely(float64_is_zero_or_normal(a) &&
+                   float64_is_zero_or_normal(b) && !float64_is_zero(b)) &&
+            float64_hard_result(float64_to_host(a) / float64_to_host(b), &r)) {
+            return r;
+        }
+    }
+    return soft_float64_div(a, b, status);
+}
+
+/* The square root of a positive normal number is always normal */
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    float32 r;
+
+    if (can_use_fpu(status)) {
+        a = float32_squash_input_denormal(a, status);
+        if (likely(float32_is_zero_or_normal(a) && !float32_is_neg(a)) &&
+            float32_hard_result(sqrtf(float32_to_host(a)), &r)) {
+            return r;
+        }
+    }
+    return soft_float32_sqrt(a, status);
+}
+
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    float64 r;
+
+    if (can_use_fpu(status)) {
+        a = float64_squash_input_denormal(a, status);
+        if (likely(float64_is_zero_or_normal(a) && !float64_is_neg(a)) &&
+            float64_hard_result(sqrt(float64_to_host(a)), &r)) {
+            return r;
+        }
+    }
+    return soft_float64_sqrt(a, status);
+}
+
+/* fma() is only worth calling when the host implements it in hardware;
+ * the negation and halving variants are left to softfloat.
+ */
+float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
+                       float_status *status)
+{
+#ifdef FP_FAST_FMAF
+    float32 r;
+
+    if (can_use_fpu(status) && flags == 0) {
+        a = float32_squash_input_denormal(a, status);
+        b = float32_squash_input_denormal(b, status);
+        c = float32_squash_input_denormal(c, status);
+        if (likely(float32_is_zero_or_normal(a) &&
+                   float32_is_zero_or_normal(b) &&
+                   float32_is_zero_or_normal(c)) &&
+            float32_hard_result(fmaf(float32_to_host(a), float32_to_host(b),
+                                     float32_to_host(c)), &r)) {
+            return r;
+        }
+    }
+#endif
+    return soft_float32_muladd(a, b, c, flags, status);
+}
+
+float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
+                       float_status *status)
+{
+#ifdef FP_FAST_FMA
+    float64 r;
+
+    if (can_use_fpu(status) && flags == 0) {
+        a = float64_squash_input_denormal(a, status);
+        b = float64_squash_input_denormal(b, status);
+        c = float64_squash_input_denormal(c, status);
+        if (likely(float64_is_zero_or_normal(a) &&
+                   float64_is_zero_or_normal(b) &&
+                   float64_is_zero_or_normal(c)) &&
+            float64_hard_result(fma(float64_to_host(a), float64_to_host(b),
+                                    float64_to_host(c)), &r)) {
+            return r;
+        }
+    }
+#endif
+    return soft_float64_muladd(a, b, c, flags, status);
+}
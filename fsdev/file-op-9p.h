@@ -75,6 +75,9 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    /* local driver metadata cache: lifetime in ms (0 = off), entries */
+    uint32_t stat_cache_ttl;
+    uint32_t stat_cache_size;
     FileOperations *ops;
 } FsDriverEntry;
 
@@ -85,6 +88,11 @@ typedef struct FsContext
     int export_flags;
     struct xattr_operations **xops;
     struct extended_ops exops;
+    uint32_t stat_cache_ttl;
+    uint32_t stat_cache_size;
+    /* lstat results served from or missed in the fs driver's cache */
+    uint64_t stat_cache_hits;
+    uint64_t stat_cache_misses;
     /* fs driver specific data */
     void *private;
 } FsContext;
@@ -36,6 +36,12 @@ static QemuOptsList qemu_fsdev_opts = {
         }, {
             .name = "sock_fd",
             .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_ttl",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_size",
+            .type = QEMU_OPT_NUMBER,
         },
 
         { /*End of list */ }
@@ -71,6 +77,12 @@ static QemuOptsList qemu_virtfs_opts = {
         }, {
             .name = "sock_fd",
             .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_ttl",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_size",
+            .type = QEMU_OPT_NUMBER,
         },
 
         { /*End of list */ }
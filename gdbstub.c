@@ -33,9 +33,10 @@
 #include "sysemu/char.h"
 #include "sysemu/sysemu.h"
 #include "exec/gdbstub.h"
+#include "hw/hw.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 16384
 
 #include "cpu.h"
 #include "qemu/sockets.h"
@@ -293,6 +294,16 @@ enum RSState {
     RS_CHKSUM1,
     RS_CHKSUM2,
 };
+#ifndef CONFIG_USER_ONLY
+/* Page translations of g_cpu, while the guest is stopped */
+#define GDB_TLB_SIZE 64
+
+typedef struct GDBTLBEntry {
+    target_ulong page;
+    hwaddr phys;
+} GDBTLBEntry;
+#endif
+
 typedef struct GDBState {
     CPUState *c_cpu; /* current CPU for step/continue ops */
     CPUState *g_cpu; /* current CPU for other ops */
@@ -310,6 +321,8 @@ typedef struct GDBState {
 #else
     CharDriverState *chr;
     CharDriverState *mon_chr;
+    CPUState *tlb_cpu; /* NULL if the translations are invalid */
+    GDBTLBEntry tlb[GDB_TLB_SIZE];
 #endif
     char syscall_buf[256];
     gdb_syscall_complete_cb current_syscall_cb;
@@ -433,17 +446,56 @@ static inline int tohex(int v)
 
 static void memtohex(char *buf, const uint8_t *mem, int len)
 {
+    static const char hex[] = "0123456789abcdef";
     int i, c;
     char *q;
     q = buf;
     for(i = 0; i < len; i++) {
         c = mem[i];
-        *q++ = tohex(c >> 4);
-        *q++ = tohex(c & 0xf);
+        *q++ = hex[c >> 4];
+        *q++ = hex[c & 0xf];
     }
     *q = '\0';
 }
 
+/* Escape binary data for a packet; returns the length of the result */
+static int memtobin(char *buf, const uint8_t *mem, int len)
+{
+    int i;
+    char *q = buf;
+
+    for (i = 0; i < len; i++) {
+        switch (mem[i]) {
+        case '#':
+        case '$':
+        case '}':
+        case '*':
+            *q++ = '}';
+            *q++ = mem[i] ^ 0x20;
+            break;
+        default:
+            *q++ = mem[i];
+            break;
+        }
+    }
+    return q - buf;
+}
+
+/* Unescape the binary data of a packet; returns the length of the result */
+static int bintomem(uint8_t *mem, const char *buf, int len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '}' && i + 1 < len) {
+            mem[n++] = buf[++i] ^ 0x20;
+        } else {
+            mem[n++] = buf[i];
+        }
+    }
+    return n;
+}
+
 static void hextomem(uint8_t *mem, const char *buf, int len)
 {
     int i;
@@ -499,6 +551,87 @@ static int put_packet(GDBState *s, const char *buf)
     return put_packet_binary(s, buf, strlen(buf));
 }
 
+#ifndef CONFIG_USER_ONLY
+static void gdb_tlb_flush(GDBState *s)
+{
+    s->tlb_cpu = NULL;
+}
+
+static void gdb_tlb_reset(void *opaque)
+{
+    if (gdbserver_state) {
+        gdb_tlb_flush(gdbserver_state);
+    }
+}
+
+/*
+ * Debuggers read memory in many packets that hit the same few pages, and
+ * the guest does not run in between.  So the page table walks are cached
+ * until it runs again, is reset, or the debugger writes to it.
+ */
+static hwaddr gdb_tlb_lookup(GDBState *s, target_ulong page)
+{
+    GDBTLBEntry *e;
+    int i;
+
+    if (s->tlb_cpu != s->g_cpu) {
+        for (i = 0; i < GDB_TLB_SIZE; i++) {
+            s->tlb[i].page = -1;
+        }
+        s->tlb_cpu = s->g_cpu;
+    }
+    e = &s->tlb[(page >> TARGET_PAGE_BITS) & (GDB_TLB_SIZE - 1)];
+    if (e->page != page) {
+        e->page = page;
+        e->phys = cpu_get_phys_page_debug(s->g_cpu, page);
+    }
+    return e->phys;
+}
+#endif
+
+/* Access the memory of g_cpu, for the m, M, x and X packets */
+static int gdb_memory_rw(GDBState *s, target_ulong addr, uint8_t *buf,
+                         int len, bool is_write)
+{
+#ifndef CONFIG_USER_ONLY
+    CPUClass *cc = CPU_GET_CLASS(s->g_cpu);
+    target_ulong page;
+    hwaddr phys;
+    int l, ret = 0;
+
+    if (!cc->memory_rw_debug && !runstate_is_running()) {
+        while (len > 0) {
+            page = addr & TARGET_PAGE_MASK;
+            phys = gdb_tlb_lookup(s, page);
+            if (phys == -1) {
+                ret = -1;
+                break;
+            }
+            l = (page + TARGET_PAGE_SIZE) - addr;
+            if (l > len) {
+                l = len;
+            }
+            phys += addr & ~TARGET_PAGE_MASK;
+            if (is_write) {
+                cpu_physical_memory_write_rom(s->g_cpu->as, phys, buf, l);
+            } else {
+                address_space_rw(s->g_cpu->as, phys, MEMTXATTRS_UNSPECIFIED,
+                                 buf, l, false);
+            }
+            len -= l;
+            buf += l;
+            addr += l;
+        }
+        if (is_write) {
+            /* The page tables may have been written */
+            gdb_tlb_flush(s);
+        }
+        return ret;
+    }
+#endif
+    return target_memory_rw_debug(s->g_cpu, addr, buf, len, is_write);
+}
+
 /* Encode data using the encoding for 'x' packets.  */
 static int memtox(char *buf, const char *mem, int len)
 {
@@ -780,7 +913,7 @@ static int is_query_packet(const char *p, const char *query, char separator)
         (p[query_len] == '\0' || p[query_len] == separator);
 }
 
-static int gdb_handle_packet(GDBState *s, const char *line_buf)
+static int gdb_handle_packet(GDBState *s, const char *line_buf, int line_len)
 {
     CPUState *cpu;
     CPUClass *cc;
@@ -949,6 +1082,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             len -= reg_size;
             registers += reg_size;
         }
+#ifndef CONFIG_USER_ONLY
+        gdb_tlb_flush(s);
+#endif
         put_packet(s, "OK");
         break;
     case 'm':
@@ -956,13 +1092,33 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
-        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
+        if (len > (MAX_PACKET_LENGTH - 1) / 2) {
+            put_packet(s, "E22");
+            break;
+        }
+        if (gdb_memory_rw(s, addr, mem_buf, len, false) != 0) {
             put_packet (s, "E14");
         } else {
             memtohex(buf, mem_buf, len);
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* Like m, with binary data after a 'b' in the reply */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',') {
+            p++;
+        }
+        len = strtoull(p, NULL, 16);
+        /* Every byte may need escaping; send less if it does not fit */
+        len = MIN(len, (MAX_PACKET_LENGTH - 1) / 2);
+        if (gdb_memory_rw(s, addr, mem_buf, len, false) != 0) {
+            put_packet(s, "E14");
+        } else {
+            buf[0] = 'b';
+            put_packet_binary(s, buf, memtobin(buf + 1, mem_buf, len) + 1);
+        }
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -970,9 +1126,32 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > strlen(p) / 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
-        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len,
-                                   true) != 0) {
+        if (gdb_memory_rw(s, addr, mem_buf, len, true) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
+    case 'X':
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',') {
+            p++;
+        }
+        len = strtoull(p, (char **)&p, 16);
+        if (*p == ':') {
+            p++;
+        }
+        if (bintomem(mem_buf, p, line_buf + line_len - p) != len) {
+            put_packet(s, "E22");
+            break;
+        }
+        /* A zero length write probes whether X is supported */
+        if (len && gdb_memory_rw(s, addr, mem_buf, len, true) != 0) {
             put_packet(s, "E14");
         } else {
             put_packet(s, "OK");
@@ -1002,6 +1181,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         reg_size = strlen(p) / 2;
         hextomem(mem_buf, p, reg_size);
         gdb_write_register(s->g_cpu, mem_buf, addr);
+#ifndef CONFIG_USER_ONLY
+        gdb_tlb_flush(s);
+#endif
         put_packet(s, "OK");
         break;
     case 'Z':
@@ -1140,12 +1322,15 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             len = len / 2;
             mem_buf[len++] = 0;
             qemu_chr_be_write(s->mon_chr, mem_buf, len);
+            /* The command may have changed the guest */
+            gdb_tlb_flush(s);
             put_packet(s, "OK");
             break;
         }
 #endif /* !CONFIG_USER_ONLY */
         if (is_query_packet(p, "Supported", ':')) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, sizeof(buf), "PacketSize=%x;binary-upload+",
+                     MAX_PACKET_LENGTH);
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file != NULL) {
                 pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
@@ -1228,6 +1413,7 @@ static void gdb_vm_state_change(void *opaque, int running, RunState state)
     const char *type;
     int ret;
 
+    gdb_tlb_flush(s);
     if (running || s->state == RS_INACTIVE) {
         return;
     }
@@ -1433,7 +1619,8 @@ static void gdb_read_byte(GDBState *s, int ch)
             } else {
                 reply = '+';
                 put_buffer(s, &reply, 1);
-                s->state = gdb_handle_packet(s, s->line_buf);
+                s->state = gdb_handle_packet(s, s->line_buf,
+                                             s->line_buf_index);
             }
             break;
         default:
@@ -1736,6 +1923,7 @@ int gdbserver_start(const char *device)
             return -1;
 
         qemu_chr_fe_claim_no_fail(chr);
+        chr->no_replay = true;
         qemu_chr_add_handlers(chr, gdb_chr_can_receive, gdb_chr_receive,
                               gdb_chr_event, NULL);
     }
@@ -1746,6 +1934,7 @@ int gdbserver_start(const char *device)
         gdbserver_state = s;
 
         qemu_add_vm_change_state_handler(gdb_vm_state_change, NULL);
+        qemu_register_reset(gdb_tlb_reset, NULL);
 
         /* Initialize a monitor terminal for gdb */
         mon_chr = qemu_chr_alloc();
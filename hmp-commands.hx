@@ -307,23 +307,46 @@ STEXI
 @item log @var{item1}[,...]
 @findex log
 Activate logging of the specified items.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "op:s",
+        .params     = "on|off|reset",
+        .help       = "count the executions of translated blocks",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb-profile on|off|reset
+@findex tb-profile
+Start or stop counting how many times each translated block is executed,
+or clear the counts.  Switching profiling on or off flushes the
+translation buffer.  The results are shown by @code{info tb-profile}.
 ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save RAM while the guest keeps running",
         .mhandler.cmd = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the snapshot is taken in the background: RAM is saved
+while the guest keeps running, like in a live migration, and the guest
+is only stopped for the RAM it dirtied in the meantime (within the
+migration downtime limit), the device state and the disk snapshots.  The
+snapshot is of that moment.  Its progress is shown by @code{info savevm}.
 ETEXI
 
     {
@@ -1003,6 +1026,21 @@ STEXI
 @item migrate_set_parameter @var{parameter} @var{value}
 @findex migrate_set_parameter
 Set the parameter @var{parameter} for migration.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "calc-time:i",
+        .params     = "calc-time",
+        .help       = "measure the guest dirty rate for calc-time seconds",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{calc-time}
+@findex calc_dirty_rate
+Measure how fast the guest dirties its RAM for @var{calc-time} seconds,
+without migrating it.  The result is shown by @code{info dirty_rate}.
 ETEXI
 
     {
@@ -1740,6 +1778,12 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tb-profile [@var{count}]
+show the translated blocks that were executed most often (see
+@option{-tb-profile}), and the time spent translating and executing code
+@item info rcu
+show how many RCU grace periods have elapsed and how long they took, and
+how many @code{call_rcu} callbacks were run or are still pending
 @item info numa
 show NUMA information
 @item info kvm
@@ -1754,6 +1798,8 @@ show profiling information
 show information about active capturing
 @item info snapshots
 show list of VM snapshots
+@item info savevm
+show the progress or the result of the last live snapshot (@code{savevm -l})
 @item info status
 show the current VM status (running|paused)
 @item info mice
@@ -1774,6 +1820,8 @@ show migration status
 show current migration capabilities
 @item info migrate_parameters
 show current migration parameters
+@item info dirty_rate
+show the result of the last dirty rate measurement
 @item info migrate_cache_size
 show current migration XBZRLE cache size
 @item info balloon
@@ -1790,6 +1838,8 @@ show roms
 show the TPM device
 @item info memory-devices
 show the memory devices
+@item info xen-mapcache
+show the Xen mapcache statistics
 @end table
 ETEXI
 
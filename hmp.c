@@ -228,10 +228,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_x_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->x_cpu_throttle_percentage);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -272,12 +281,74 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
             params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS],
+            params->x_postcopy_rounds);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL],
+            params->x_cpu_throttle_initial);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
+            params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_QPS],
+            params->x_rdma_qps);
         monitor_printf(mon, "\n");
     }
 
     qapi_free_MigrationParameters(params);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    RamBlockDirtyRateList *b;
+    Error *err = NULL;
+
+    info = qmp_query_dirty_rate(false, 0, false, 0, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->has_calc_time) {
+        monitor_printf(mon, "calc time: %" PRId64 " seconds\n",
+                       info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " kbytes/s\n",
+                       info->dirty_rate >> 10);
+        monitor_printf(mon, "working set: %" PRId64 " kbytes\n",
+                       info->working_set >> 10);
+        for (b = info->blocks; b; b = b->next) {
+            monitor_printf(mon, "  %s: %" PRId64 " kbytes/s, working set %"
+                           PRId64 " of %" PRId64 " kbytes\n",
+                           b->value->id, b->value->dirty_rate >> 10,
+                           b->value->working_set >> 10, b->value->size >> 10);
+        }
+    }
+    if (info->has_prediction) {
+        MigrationPrediction *p = info->prediction;
+
+        monitor_printf(mon, "at %" PRId64 " kbytes/s and %" PRId64
+                       " ms downtime limit:\n",
+                       p->bandwidth >> 10, p->downtime_limit);
+        monitor_printf(mon, "  converges: %s\n", p->converges ? "yes" : "no");
+        monitor_printf(mon, "  iterations: %" PRId64 "\n", p->iterations);
+        monitor_printf(mon, "  total time: %" PRId64 " milliseconds\n",
+                       p->total_time);
+        monitor_printf(mon, "  expected downtime: %" PRId64
+                       " milliseconds\n", p->expected_downtime);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -521,6 +592,21 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->flush_total_time_ns,
                        stats->value->stats->rd_merged,
                        stats->value->stats->wr_merged);
+
+        if (stats->value->has_driver_specific &&
+            stats->value->driver_specific->kind ==
+            BLOCK_STATS_SPECIFIC_KIND_QCOW2) {
+            BlockStatsSpecificQCow2 *qcow2 =
+                stats->value->driver_specific->qcow2;
+
+            monitor_printf(mon, "    qcow2: l2_cache_hits=%" PRIu64
+                           " l2_cache_misses=%" PRIu64
+                           " refcount_cache_hits=%" PRIu64
+                           " refcount_cache_misses=%" PRIu64 "\n",
+                           qcow2->l2_cache_hits, qcow2->l2_cache_misses,
+                           qcow2->refcount_cache_hits,
+                           qcow2->refcount_cache_misses);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -566,6 +652,12 @@ void hmp_info_vnc(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "    username: %s\n",
                            client->value->has_sasl_username ?
                            client->value->sasl_username : "none");
+            if (client->value->has_encode_time) {
+                monitor_printf(mon, " encode time: %" PRIu64 " us"
+                               " (%" PRIu64 " updates)\n",
+                               client->value->encode_time,
+                               client->value->encoded_updates);
+            }
         }
     }
 
@@ -577,6 +669,7 @@ out:
 void hmp_info_spice(Monitor *mon, const QDict *qdict)
 {
     SpiceChannelList *chan;
+    SpiceDisplayInfoList *dpy;
     SpiceInfo *info;
     const char *channel_name;
     const char * const channel_names[] = {
@@ -645,6 +738,17 @@ void hmp_info_spice(Monitor *mon, const QDict *qdict)
         }
     }
 
+    for (dpy = info->has_displays ? info->displays : NULL; dpy;
+         dpy = dpy->next) {
+        monitor_printf(mon, "Display %" PRId64 ":\n", dpy->value->id);
+        monitor_printf(mon, "      frames: %" PRId64 " (%.1f fps)\n",
+                       dpy->value->frames, dpy->value->fps);
+        monitor_printf(mon, "     updates: %" PRId64 "\n",
+                       dpy->value->updates);
+        monitor_printf(mon, " update time: %" PRId64 " us\n",
+                       dpy->value->update_time);
+    }
+
 out:
     qapi_free_SpiceInfo(info);
 }
@@ -1061,7 +1165,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
                      false, NULL, false, NULL,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, false, true, &err);
+                     false, 0, false, 0, false, true, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1221,6 +1325,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
+    bool has_multifd_channels = false;
+    bool has_x_postcopy_rounds = false;
+    bool has_x_cpu_throttle_initial = false;
+    bool has_x_cpu_throttle_increment = false;
+    bool has_x_rdma_qps = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
@@ -1235,10 +1344,30 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_DECOMPRESS_THREADS:
                 has_decompress_threads = true;
                 break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                has_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS:
+                has_x_postcopy_rounds = true;
+                break;
+            case MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL:
+                has_x_cpu_throttle_initial = true;
+                break;
+            case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
+                has_x_cpu_throttle_increment = true;
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_QPS:
+                has_x_rdma_qps = true;
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
+                                       has_multifd_channels, value,
+                                       has_x_postcopy_rounds, value,
+                                       has_x_cpu_throttle_initial, value,
+                                       has_x_cpu_throttle_increment, value,
+                                       has_x_rdma_qps, value,
                                        &err);
             break;
         }
@@ -1255,6 +1384,15 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "calc-time");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_client_migrate_info(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1362,7 +1500,13 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false, /* No default I/O size */
                               0,
                               false,
-                              NULL, &err);
+                              NULL,
+                              false, /* Default share of the group */
+                              0,
+                              false,
+                              0,
+                              false, /* No timer granularity */
+                              0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1963,6 +2107,31 @@ void hmp_info_memory_devices(Monitor *mon, const QDict *qdict)
     qapi_free_MemoryDeviceInfoList(info_list);
 }
 
+void hmp_info_xen_mapcache(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    XenMapCacheInfo *info = qmp_query_xen_mapcache(&err);
+
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "bucket size: %" PRId64 " kbytes\n",
+                   info->bucket_size >> 10);
+    monitor_printf(mon, "mapped: %" PRId64 " of %" PRId64 " kbytes"
+                   " in %" PRId64 " entries, %" PRId64 " locked\n",
+                   info->mapped_size >> 10, info->max_size >> 10,
+                   info->entries, info->locked);
+    monitor_printf(mon, "hits: %" PRId64 "\n", info->hits);
+    monitor_printf(mon, "remaps: %" PRId64 "\n", info->remaps);
+    monitor_printf(mon, "evictions: %" PRId64 "\n", info->evictions);
+    monitor_printf(mon, "invalidations: %" PRId64 "\n", info->invalidations);
+
+    qapi_free_XenMapCacheInfo(info);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
@@ -39,6 +39,44 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Read up to @max entries from directory position @offset on in a single
+ * trip to the worker threads.  Returns the number of entries read.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset,
+                         struct dirent *dents, int max)
+{
+    int err;
+    int n = 0;
+    V9fsState *s = pdu->s;
+
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            struct dirent *result;
+
+            if (offset == 0) {
+                s->ops->rewinddir(&s->ctx, &fidp->fs);
+            } else {
+                s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+            }
+            err = 0;
+            while (n < max) {
+                errno = 0;
+                s->ops->readdir_r(&s->ctx, &fidp->fs, &dents[n], &result);
+                if (!result) {
+                    err = -errno;
+                    break;
+                }
+                n++;
+            }
+        });
+    /* Entries read before an error are still good */
+    return n ? n : err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -14,6 +14,7 @@
 
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qemu/event_notifier.h"
 #include "block/coroutine.h"
 #include "virtio-9p-coth.h"
@@ -32,6 +33,8 @@ static void v9fs_qemu_process_req_done(EventNotifier *e)
     Coroutine *co;
 
     event_notifier_test_and_clear(e);
+    /* Workers completing from now on must notify again */
+    atomic_mb_set(&v9fs_pool.notified, false);
 
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
@@ -46,7 +49,13 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
 
     g_async_queue_push(v9fs_pool.completed, co);
 
-    event_notifier_set(&v9fs_pool.e);
+    /*
+     * Only the first completion since the main loop last drained the
+     * queue needs to wake it up; the others are picked in the same round.
+     */
+    if (!atomic_xchg(&v9fs_pool.notified, true)) {
+        event_notifier_set(&v9fs_pool.e);
+    }
 }
 
 int v9fs_init_worker_threads(void)
@@ -25,6 +25,8 @@ typedef struct V9fsThPool {
 
     GThreadPool *pool;
     GAsyncQueue *completed;
+    /* set while the event notifier is pending, so it fires once per batch */
+    bool notified;
 } V9fsThPool;
 
 /*
@@ -59,6 +61,8 @@ extern int v9fs_init_worker_threads(void);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
                            struct dirent *, struct dirent **result);
+extern int v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *, off_t,
+                                struct dirent *, int);
 extern off_t v9fs_co_telldir(V9fsPDU *, V9fsFidState *);
 extern void v9fs_co_seekdir(V9fsPDU *, V9fsFidState *, off_t);
 extern void v9fs_co_rewinddir(V9fsPDU *, V9fsFidState *);
@@ -86,6 +86,8 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
     s->ctx.export_flags = fse->export_flags;
     s->ctx.fs_root = g_strdup(fse->path);
     s->ctx.exops.get_st_gen = NULL;
+    s->ctx.stat_cache_ttl = fse->stat_cache_ttl;
+    s->ctx.stat_cache_size = fse->stat_cache_size;
     len = strlen(s->fsconf.tag);
     if (len > MAX_TAG_LEN - 1) {
         error_setg(errp, "mount tag '%s' (%d bytes) is longer than "
@@ -146,6 +148,16 @@ static Property virtio_9p_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static void virtio_9p_instance_init(Object *obj)
+{
+    V9fsState *s = VIRTIO_9P(obj);
+
+    object_property_add_uint64_ptr(obj, "stat-cache-hits",
+                                   &s->ctx.stat_cache_hits, NULL);
+    object_property_add_uint64_ptr(obj, "stat-cache-misses",
+                                   &s->ctx.stat_cache_misses, NULL);
+}
+
 static void virtio_9p_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -162,6 +174,7 @@ static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_9P,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(V9fsState),
+    .instance_init = virtio_9p_instance_init,
     .class_init = virtio_9p_class_init,
 };
 
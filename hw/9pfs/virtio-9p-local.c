@@ -27,6 +27,9 @@
 #include <linux/magic.h>
 #endif
 #include <sys/ioctl.h>
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/queue.h"
 
 #ifndef XFS_SUPER_MAGIC
 #define XFS_SUPER_MAGIC  0x58465342
@@ -43,6 +46,204 @@
 
 #define VIRTFS_META_DIR ".virtfs_metadata"
 
+#define LOCAL_STAT_CACHE_SIZE 4096
+
+/*
+ * Cache of local_lstat() results, including the credentials that the
+ * mapped security models keep in xattrs or in the metadata files.
+ *
+ * Entries expire after ctx->stat_cache_ttl ms, which bounds how long a
+ * change made on the host behind our back goes unnoticed.  Changes made
+ * through this driver drop the entries they affect right away.  The
+ * cache is accessed from the worker threads, hence the lock.
+ */
+typedef struct LocalStatEntry {
+    char *path;
+    struct stat stbuf;
+    int64_t expires;
+    QTAILQ_ENTRY(LocalStatEntry) next;
+} LocalStatEntry;
+
+typedef struct LocalStatCache {
+    QemuMutex lock;
+    GHashTable *entries;
+    /* oldest first, for eviction */
+    QTAILQ_HEAD(, LocalStatEntry) lru;
+    /* bumped by every invalidation, so that racing lookups don't fill */
+    uint64_t generation;
+} LocalStatCache;
+
+static void local_stat_entry_free(gpointer data)
+{
+    LocalStatEntry *e = data;
+
+    g_free(e->path);
+    g_free(e);
+}
+
+/* Called with cache->lock held */
+static void local_stat_cache_remove(LocalStatCache *cache, LocalStatEntry *e)
+{
+    QTAILQ_REMOVE(&cache->lru, e, next);
+    g_hash_table_remove(cache->entries, e->path);
+}
+
+static bool local_stat_cache_get(FsContext *ctx, const char *path,
+                                 struct stat *stbuf, uint64_t *generation)
+{
+    LocalStatCache *cache = ctx->private;
+    LocalStatEntry *e;
+    bool hit = false;
+
+    if (!cache) {
+        return false;
+    }
+    qemu_mutex_lock(&cache->lock);
+    e = g_hash_table_lookup(cache->entries, path);
+    if (e && e->expires <= qemu_clock_get_ms(QEMU_CLOCK_REALTIME)) {
+        local_stat_cache_remove(cache, e);
+        e = NULL;
+    }
+    if (e) {
+        *stbuf = e->stbuf;
+        ctx->stat_cache_hits++;
+        hit = true;
+    } else {
+        ctx->stat_cache_misses++;
+    }
+    *generation = cache->generation;
+    qemu_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+static void local_stat_cache_put(FsContext *ctx, const char *path,
+                                 const struct stat *stbuf, uint64_t generation)
+{
+    LocalStatCache *cache = ctx->private;
+    LocalStatEntry *e;
+
+    qemu_mutex_lock(&cache->lock);
+    /* Something changed while we were looking, don't cache stale data */
+    if (cache->generation != generation) {
+        goto out;
+    }
+    e = g_hash_table_lookup(cache->entries, path);
+    if (e) {
+        local_stat_cache_remove(cache, e);
+    } else if (g_hash_table_size(cache->entries) >= ctx->stat_cache_size) {
+        local_stat_cache_remove(cache, QTAILQ_FIRST(&cache->lru));
+    }
+    e = g_new(LocalStatEntry, 1);
+    e->path = g_strdup(path);
+    e->stbuf = *stbuf;
+    e->expires = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + ctx->stat_cache_ttl;
+    g_hash_table_insert(cache->entries, e->path, e);
+    QTAILQ_INSERT_TAIL(&cache->lru, e, next);
+out:
+    qemu_mutex_unlock(&cache->lock);
+}
+
+static gboolean local_stat_entry_unlink(gpointer key, gpointer value,
+                                        gpointer opaque)
+{
+    LocalStatCache *cache = opaque;
+    LocalStatEntry *e = value;
+
+    QTAILQ_REMOVE(&cache->lru, e, next);
+    return TRUE;
+}
+
+/*
+ * Drop the entries of the inode @stbuf describes, whatever name they were
+ * looked up by.  Called with cache->lock held.
+ */
+static void local_stat_cache_drop_inode(LocalStatCache *cache,
+                                        const struct stat *stbuf)
+{
+    LocalStatEntry *e, *next_e;
+
+    QTAILQ_FOREACH_SAFE(e, &cache->lru, next, next_e) {
+        if (e->stbuf.st_dev == stbuf->st_dev &&
+            e->stbuf.st_ino == stbuf->st_ino) {
+            local_stat_cache_remove(cache, e);
+        }
+    }
+}
+
+/*
+ * @path was modified: drop it, the other names of the same file and its
+ * parent directory, whose size, link count and times may have changed too.
+ */
+static void local_stat_cache_drop(FsContext *ctx, const char *path)
+{
+    LocalStatCache *cache = ctx->private;
+    LocalStatEntry *e;
+    const char *slash;
+    int saved_errno = errno;
+
+    if (!cache) {
+        return;
+    }
+    qemu_mutex_lock(&cache->lock);
+    cache->generation++;
+    e = g_hash_table_lookup(cache->entries, path);
+    if (e) {
+        struct stat stbuf = e->stbuf;
+
+        local_stat_cache_remove(cache, e);
+        if (!S_ISDIR(stbuf.st_mode) && stbuf.st_nlink > 1) {
+            local_stat_cache_drop_inode(cache, &stbuf);
+        }
+    }
+    slash = strrchr(path, '/');
+    if (slash && slash != path) {
+        char *parent = g_strndup(path, slash - path);
+
+        e = g_hash_table_lookup(cache->entries, parent);
+        if (e) {
+            local_stat_cache_remove(cache, e);
+        }
+        g_free(parent);
+    }
+    qemu_mutex_unlock(&cache->lock);
+    /* Callers still have to report why the operation failed */
+    errno = saved_errno;
+}
+
+static void local_stat_cache_drop_fd(FsContext *ctx, int fd)
+{
+    LocalStatCache *cache = ctx->private;
+    struct stat stbuf;
+    int saved_errno = errno;
+
+    if (!cache || fstat(fd, &stbuf) < 0) {
+        errno = saved_errno;
+        return;
+    }
+    qemu_mutex_lock(&cache->lock);
+    cache->generation++;
+    local_stat_cache_drop_inode(cache, &stbuf);
+    qemu_mutex_unlock(&cache->lock);
+    errno = saved_errno;
+}
+
+/* A rename moves whole subtrees, just start over */
+static void local_stat_cache_flush(FsContext *ctx)
+{
+    LocalStatCache *cache = ctx->private;
+    int saved_errno = errno;
+
+    if (!cache) {
+        return;
+    }
+    qemu_mutex_lock(&cache->lock);
+    cache->generation++;
+    g_hash_table_foreach_remove(cache->entries, local_stat_entry_unlink,
+                                cache);
+    qemu_mutex_unlock(&cache->lock);
+    errno = saved_errno;
+}
+
 static char *local_mapped_attr_path(FsContext *ctx, const char *path)
 {
     int dirlen;
@@ -120,6 +321,11 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     int err;
     char *buffer;
     char *path = fs_path->data;
+    uint64_t generation = 0;
+
+    if (local_stat_cache_get(fs_ctx, path, stbuf, &generation)) {
+        return 0;
+    }
 
     buffer = rpath(fs_ctx, path);
     err =  lstat(buffer, stbuf);
@@ -148,6 +354,9 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         local_mapped_file_attr(fs_ctx, path, stbuf);
     }
+    if (fs_ctx->private) {
+        local_stat_cache_put(fs_ctx, path, stbuf, generation);
+    }
 
 err_out:
     g_free(buffer);
@@ -358,6 +567,9 @@ static int local_open(FsContext *ctx, V9fsPath *fs_path,
     buffer = rpath(ctx, path);
     fs->fd = open(buffer, flags | O_NOFOLLOW);
     g_free(buffer);
+    if (flags & O_TRUNC) {
+        local_stat_cache_drop(ctx, path);
+    }
     return fs->fd;
 }
 
@@ -455,6 +667,9 @@ static ssize_t local_pwritev(FsContext *ctx, V9fsFidOpenState *fs,
                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
     }
 #endif
+    if (ret > 0) {
+        local_stat_cache_drop_fd(ctx, fs->fd);
+    }
     return ret;
 }
 
@@ -469,13 +684,14 @@ static int local_chmod(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
         ret = local_set_xattr(buffer, credp);
         g_free(buffer);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        ret = local_set_mapped_file_attr(fs_ctx, path, credp);
     } else if ((fs_ctx->export_flags & V9FS_SM_PASSTHROUGH) ||
                (fs_ctx->export_flags & V9FS_SM_NONE)) {
         buffer = rpath(fs_ctx, path);
         ret = chmod(buffer, credp->fc_mode);
         g_free(buffer);
     }
+    local_stat_cache_drop(fs_ctx, path);
     return ret;
 }
 
@@ -536,6 +752,7 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    local_stat_cache_drop(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -598,6 +815,7 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    local_stat_cache_drop(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -715,6 +933,7 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    local_stat_cache_drop(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -819,6 +1038,7 @@ err_end:
     errno = serrno;
 out:
     g_free(buffer);
+    local_stat_cache_drop(fs_ctx, fullname.data);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -856,6 +1076,8 @@ static int local_link(FsContext *ctx, V9fsPath *oldpath,
         }
     }
 err_out:
+    local_stat_cache_drop(ctx, oldpath->data);
+    local_stat_cache_drop(ctx, newpath.data);
     v9fs_string_free(&newpath);
     return ret;
 }
@@ -869,6 +1091,7 @@ static int local_truncate(FsContext *ctx, V9fsPath *fs_path, off_t size)
     buffer = rpath(ctx, path);
     ret = truncate(buffer, size);
     g_free(buffer);
+    local_stat_cache_drop(ctx, path);
     return ret;
 }
 
@@ -899,6 +1122,7 @@ static int local_rename(FsContext *ctx, const char *oldpath,
     err = rename(buffer, buffer1);
     g_free(buffer);
     g_free(buffer1);
+    local_stat_cache_flush(ctx);
     return err;
 }
 
@@ -919,8 +1143,9 @@ static int local_chown(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
         ret = local_set_xattr(buffer, credp);
         g_free(buffer);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        ret = local_set_mapped_file_attr(fs_ctx, path, credp);
     }
+    local_stat_cache_drop(fs_ctx, path);
     return ret;
 }
 
@@ -934,6 +1159,7 @@ static int local_utimensat(FsContext *s, V9fsPath *fs_path,
     buffer = rpath(s, path);
     ret = qemu_utimens(buffer, buf);
     g_free(buffer);
+    local_stat_cache_drop(s, path);
     return ret;
 }
 
@@ -987,6 +1213,7 @@ static int local_remove(FsContext *ctx, const char *path)
     err = remove(buffer);
     g_free(buffer);
 err_out:
+    local_stat_cache_drop(ctx, path);
     return err;
 }
 
@@ -1040,16 +1267,22 @@ static int local_lsetxattr(FsContext *ctx, V9fsPath *fs_path, const char *name,
                            void *value, size_t size, int flags)
 {
     char *path = fs_path->data;
+    int ret;
 
-    return v9fs_set_xattr(ctx, path, name, value, size, flags);
+    ret = v9fs_set_xattr(ctx, path, name, value, size, flags);
+    local_stat_cache_drop(ctx, path);
+    return ret;
 }
 
 static int local_lremovexattr(FsContext *ctx, V9fsPath *fs_path,
                               const char *name)
 {
     char *path = fs_path->data;
+    int ret;
 
-    return v9fs_remove_xattr(ctx, path, name);
+    ret = v9fs_remove_xattr(ctx, path, name);
+    local_stat_cache_drop(ctx, path);
+    return ret;
 }
 
 static int local_name_to_path(FsContext *ctx, V9fsPath *dir_path,
@@ -1134,6 +1367,7 @@ static int local_unlinkat(FsContext *ctx, V9fsPath *dir,
     g_free(buffer);
 
 err_out:
+    local_stat_cache_drop(ctx, fullname.data);
     v9fs_string_free(&fullname);
     return ret;
 }
@@ -1185,6 +1419,15 @@ static int local_init(FsContext *ctx)
         ctx->xops = passthrough_xattr_ops;
     }
     ctx->export_flags |= V9FS_PATHNAME_FSCONTEXT;
+    if (ctx->stat_cache_ttl) {
+        LocalStatCache *cache = g_new0(LocalStatCache, 1);
+
+        qemu_mutex_init(&cache->lock);
+        cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                               local_stat_entry_free);
+        QTAILQ_INIT(&cache->lru);
+        ctx->private = cache;
+    }
 #ifdef FS_IOC_GETVERSION
     /*
      * use ioc_getversion only if the iocl is definied
@@ -1238,6 +1481,14 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
     }
     fse->path = g_strdup(path);
 
+    fse->stat_cache_ttl = qemu_opt_get_number(opts, "stat_cache_ttl", 0);
+    fse->stat_cache_size = qemu_opt_get_number(opts, "stat_cache_size",
+                                               LOCAL_STAT_CACHE_SIZE);
+    if (!fse->stat_cache_size) {
+        fprintf(stderr, "fsdev: stat_cache_size must be at least 1.\n");
+        return -1;
+    }
+
     return 0;
 }
 
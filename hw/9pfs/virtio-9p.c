@@ -321,6 +321,7 @@ static int free_fid(V9fsPDU *pdu, V9fsFidState *fidp)
     } else if (fidp->fid_type == P9_FID_XATTR) {
         retval = v9fs_xattr_fid_clunk(pdu, fidp);
     }
+    g_free(fidp->dir_cache.dents);
     v9fs_path_free(&fidp->path);
     g_free(fidp);
     return retval;
@@ -628,7 +629,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    virtqueue_free_element(pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(VIRTIO_DEVICE(s), s->vq);
@@ -913,6 +916,17 @@ static void v9fs_version(void *opaque)
     }
     trace_v9fs_version(pdu->tag, pdu->id, s->msize, version.data);
 
+    /* The server may lower the msize the client proposed */
+    if ((uint32_t)s->msize > P9_MAX_MSIZE) {
+        s->msize = P9_MAX_MSIZE;
+    }
+    if (s->msize < P9_MIN_MSIZE) {
+        error_report("9pfs: client requested an msize of %d, the minimum "
+                     "is %d", s->msize, P9_MIN_MSIZE);
+        offset = -EMSGSIZE;
+        goto out;
+    }
+
     virtfs_reset(pdu);
 
     if (!strcmp(version.data, "9P2000.u")) {
@@ -1577,7 +1591,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1668,11 +1682,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -1773,38 +1787,66 @@ static size_t v9fs_readdir_data_size(V9fsString *name)
     return 24 + v9fs_string_size(name);
 }
 
-static int v9fs_do_readdir(V9fsPDU *pdu,
-                           V9fsFidState *fidp, int32_t max_count)
+/*
+ * Index of the cached entry found at directory position @offset, or -1 if
+ * the cache does not cover it.  One past the last entry means the cache
+ * ended right before @offset.
+ */
+static int v9fs_dir_cache_find(V9fsDirCache *cache, off_t offset)
+{
+    int i;
+
+    if (cache->count && cache->offset == offset) {
+        return 0;
+    }
+    for (i = 1; i <= cache->count; i++) {
+        if (cache->dents[i - 1].d_off == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int v9fs_do_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
+                           off_t offset, int32_t max_count)
 {
+    V9fsDirCache *cache = &fidp->dir_cache;
     size_t size;
     V9fsQID qid;
     V9fsString name;
-    int len, err = 0;
+    int i, len;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent, *result;
+    struct dirent *dent;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    if (!cache->dents) {
+        cache->dents = g_new(struct dirent, V9FS_DIR_CACHE_SIZE);
     }
-
-    dent = g_malloc(sizeof(struct dirent));
+    /* A listing from the start always sees the directory afresh */
+    i = offset ? v9fs_dir_cache_find(cache, offset) : -1;
 
     while (1) {
-        err = v9fs_co_readdir_r(pdu, fidp, dent, &result);
-        if (err || !result) {
-            break;
+        if (i < 0 || i == cache->count) {
+            len = v9fs_co_readdir_many(pdu, fidp, offset, cache->dents,
+                                       V9FS_DIR_CACHE_SIZE);
+            if (len < 0) {
+                cache->count = 0;
+                return len;
+            }
+            cache->count = len;
+            cache->offset = offset;
+            i = 0;
+            if (!len) {
+                break;
+            }
         }
+        dent = &cache->dents[i];
+
         v9fs_string_init(&name);
         v9fs_string_sprintf(&name, "%s", dent->d_name);
         if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
+            /* Ran out of buffer, the rest stays cached for the next call */
             v9fs_string_free(&name);
-            g_free(dent);
-            return count;
+            break;
         }
         /*
          * Fill up just the path field of qid because the client uses
@@ -1821,19 +1863,13 @@ static int v9fs_do_readdir(V9fsPDU *pdu,
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
                           &qid, dent->d_off,
                           dent->d_type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            g_free(dent);
             return len;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
-    }
-    g_free(dent);
-    if (err < 0) {
-        return err;
+        offset = dent->d_off;
+        i++;
     }
     return count;
 }
@@ -1866,12 +1902,7 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
-    }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_do_readdir(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -3258,10 +3289,9 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+            (pdu->elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         struct {
             uint32_t size_le;
             uint8_t id;
@@ -3270,10 +3300,10 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
         int len;
 
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
         QEMU_BUILD_BUG_ON(sizeof out != 7);
 
-        len = iov_to_buf(pdu->elem.out_sg, pdu->elem.out_num, 0,
+        len = iov_to_buf(pdu->elem->out_sg, pdu->elem->out_num, 0,
                          &out, sizeof out);
         BUG_ON(len != sizeof out);
 
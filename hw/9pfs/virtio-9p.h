@@ -122,6 +122,14 @@ static inline char *rpath(FsContext *ctx, const char *path)
  */
 #define P9_IOHDRSZ 24
 
+/*
+ * Replies are written straight into the guest buffers, so the server has
+ * no limit of its own on msize; the upper bound only keeps the iounit
+ * arithmetic within int32_t.
+ */
+#define P9_MIN_MSIZE (4 * 1024)
+#define P9_MAX_MSIZE (1024 * 1024 * 1024)
+
 typedef struct V9fsPDU V9fsPDU;
 struct V9fsState;
 
@@ -132,7 +140,7 @@ struct V9fsPDU
     uint8_t id;
     uint8_t cancelled;
     CoQueue complete;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct V9fsState *s;
     QLIST_ENTRY(V9fsPDU) next;
 };
@@ -144,6 +152,8 @@ struct V9fsPDU
 
 #define MAX_REQ         128
 #define MAX_TAG_LEN     32
+/* Directory entries fetched per worker round trip by Treaddir */
+#define V9FS_DIR_CACHE_SIZE 64
 
 #define BUG_ON(cond) assert(!(cond))
 
@@ -181,6 +191,16 @@ union V9fsFidOpenState {
     void *private;
 };
 
+/*
+ * Entries read in a row from a directory fid, starting at the directory
+ * position @offset.  Entry i is found at the d_off of entry i - 1.
+ */
+typedef struct V9fsDirCache {
+    struct dirent *dents;
+    int count;
+    off_t offset;
+} V9fsDirCache;
+
 struct V9fsFidState
 {
     int fid_type;
@@ -188,6 +208,7 @@ struct V9fsFidState
     V9fsPath path;
     V9fsFidOpenState fs;
     V9fsFidOpenState fs_reclaim;
+    V9fsDirCache dir_cache;
     int flags;
     int open_flags;
     uid_t uid;
@@ -383,9 +404,10 @@ extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
 
 #define pdu_marshal(pdu, offset, fmt, args...)  \
-    v9fs_marshal(pdu->elem.in_sg, pdu->elem.in_num, offset, 1, fmt, ##args)
+    v9fs_marshal(pdu->elem->in_sg, pdu->elem->in_num, offset, 1, fmt, ##args)
 #define pdu_unmarshal(pdu, offset, fmt, args...)  \
-    v9fs_unmarshal(pdu->elem.out_sg, pdu->elem.out_num, offset, 1, fmt, ##args)
+    v9fs_unmarshal(pdu->elem->out_sg, pdu->elem->out_num, offset, 1, \
+                   fmt, ##args)
 
 #define TYPE_VIRTIO_9P "virtio-9p-device"
 #define VIRTIO_9P(obj) \
@@ -26,6 +26,21 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* Per-virtqueue state; all queues are serviced by the same IOThread */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    QEMUBH *bh;                     /* bh for guest notification */
+
+    /* Note that this EventNotifier is assigned by value.  This is fine as
+     * long as you do not call event_notifier_cleanup on it (because you
+     * don't own the file descriptor or handle; you just use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
@@ -35,19 +50,12 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *conf;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
-     */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -56,28 +64,31 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
 
-    notify_guest(s);
+    notify_guest(q);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneQueue *q;
+
+    q = &s->queues[virtio_get_queue_index(req->vq)];
     stb_p(&req->in->status, status);
 
-    vring_push(s->vdev, &req->dev->dataplane->vring, &req->elem, req->in_len);
+    vring_push(s->vdev, &q->vring, &req->elem, req->in_len);
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
@@ -85,32 +96,32 @@ static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(q->bh);
 }
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
     blk_io_plug(s->conf->conf.blk);
     for (;;) {
         MultiReqBuffer mrb = {};
-        int ret;
 
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
-            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
+            VirtIOBlockReq *req = vring_pop(s->vdev, &q->vring,
+                                            sizeof(VirtIOBlockReq));
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
-            if (ret < 0) {
-                virtio_blk_free_request(req);
+            if (!req) {
                 break; /* no more requests */
             }
+            virtio_blk_init_request(vblk, q->vq, req);
 
             trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
                                                         req->elem.in_num,
@@ -123,11 +134,11 @@ static void handle_notify(EventNotifier *e)
             virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
         }
 
-        if (likely(ret == -EAGAIN)) { /* vring emptied */
+        if (likely(!q->vring.broken)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &q->vring)) {
                 break;
             }
         } else { /* fatal error */
@@ -137,6 +148,16 @@ static void handle_notify(EventNotifier *e)
     blk_io_unplug(s->conf->conf.blk);
 }
 
+/* Look for new requests without waiting for the guest's kick */
+static bool handle_notify_poll(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(opaque,
+                                                VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+
+    return !q->vring.broken && vring_more_avail(q->s->vdev, &q->vring);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -146,6 +167,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
@@ -191,7 +213,16 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = &s->internal_iothread_obj;
     }
     s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    s->num_queues = conf->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->vq = virtio_get_queue(vdev, i);
+        q->bh = aio_bh_new(s->ctx, notify_guest_bh, q);
+    }
 
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(conf->conf.blk, s->blocker);
@@ -216,6 +247,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
@@ -223,7 +256,10 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     blk_op_unblock_all(s->conf->conf.blk, s->blocker);
     error_free(s->blocker);
-    qemu_bh_delete(s->bh);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_bh_delete(s->queues[i].bh);
+    }
+    g_free(s->queues);
     object_unref(OBJECT(s->iothread));
     g_free(s);
 }
@@ -234,7 +270,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    unsigned i, j;
     int r;
 
     if (s->started || s->disabled) {
@@ -247,27 +283,33 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        goto fail_vring;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            goto fail_vring;
+        }
     }
 
-    /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, s->num_queues, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (j = 0; j < s->num_queues; j++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[j];
+
+        r = k->set_host_notifier(qbus->parent, j, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            goto fail_host_notifier;
+        }
+        q->guest_notifier = virtio_queue_get_guest_notifier(q->vq);
+        q->host_notifier = *virtio_queue_get_host_notifier(q->vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -279,20 +321,32 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(s->queues[i].vq));
+    }
 
     /* Get this show started by hooking up our callbacks */
     aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->queues[i].host_notifier,
+                               handle_notify);
+        aio_set_event_notifier_poll(s->ctx, &s->queues[i].host_notifier,
+                                    handle_notify_poll);
+    }
     aio_context_release(s->ctx);
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    while (j-- > 0) {
+        k->set_host_notifier(qbus->parent, j, false);
+    }
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
   fail_guest_notifiers:
-    vring_teardown(&s->vring, s->vdev, 0);
     s->disabled = true;
   fail_vring:
+    while (i-- > 0) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->starting = false;
 }
 
@@ -302,7 +356,7 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-
+    unsigned i;
 
     /* Better luck next time. */
     if (s->disabled) {
@@ -319,7 +373,9 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     aio_context_acquire(s->ctx);
 
     /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+    for (i = 0; i < s->num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->queues[i].host_notifier, NULL);
+    }
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
@@ -329,12 +385,13 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     /* Sync vring state back to virtqueue so that non-dataplane request
      * processing can continue when we disable the host notifier below.
      */
-    vring_teardown(&s->vring, s->vdev, 0);
-
-    k->set_host_notifier(qbus->parent, 0, false);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
@@ -18,6 +18,10 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * The queues may be processed in an iothread, and their number set:
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,...,iothread=<iothread_id>,num_queues=<n[optional]>
  */
 
 #include <hw/block/block.h>
@@ -27,10 +31,29 @@
 #include "sysemu/sysemu.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_post_cqes(void *opaque);
+
+/* Queue timers fire in the AioContext the queues are processed in */
+static QEMUTimer *nvme_timer_new(NvmeCtrl *n, QEMUTimerCB *cb, void *opaque)
+{
+    if (n->iothread) {
+        return aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, cb, opaque);
+    }
+    return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
+}
+
+static void nvme_kick(QEMUTimer *timer)
+{
+    timer_mod(timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+}
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -66,34 +89,227 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+/* Called with the QEMU global mutex held */
+static void nvme_irq_notify(NvmeCtrl *n, uint32_t vector)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+/* Raise the interrupts that the iothread asked for */
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    for (i = 0; i < n->num_queues; i++) {
+        if (atomic_xchg(&n->irq_pending[i], false)) {
+            nvme_irq_notify(n, i);
+        }
+    }
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
-    if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
-        } else {
-            pci_irq_pulse(&n->parent_obj);
+    if (!cq->irq_enabled) {
+        return;
+    }
+    if (n->iothread) {
+        if (msix_enabled(&n->parent_obj) &&
+            msix_notify_irqfd(&n->parent_obj, cq->vector)) {
+            return;
+        }
+        /*
+         * Otherwise interrupts need the global mutex, which the iothread
+         * can't take
+         */
+        atomic_set(&n->irq_pending[cq->vector], true);
+        qemu_bh_schedule(n->irq_bh);
+    } else {
+        nvme_irq_notify(n, cq->vector);
+    }
+}
+
+/*
+ * Interrupt coalescing applies to I/O completion queues whose vector
+ * does not have it disabled.
+ */
+static bool nvme_cq_coalescing(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    return cq->cqid && NVME_INTC_THR(intc) && NVME_INTC_TIME(intc) &&
+           !NVME_INTVC_CD(n->features.int_vector_config[cq->vector]);
+}
+
+/* Signal @posted new entries of @cq, unless they can wait for more */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (!nvme_cq_coalescing(n, cq)) {
+        nvme_isr_notify(n, cq);
+        return;
+    }
+
+    /* The aggregation threshold is 0's based, the time in 100us units */
+    cq->coalesced += posted;
+    if (cq->coalesced > NVME_INTC_THR(intc)) {
+        timer_del(cq->coalesce_timer);
+        cq->coalesced = 0;
+        nvme_isr_notify(n, cq);
+    } else if (cq->coalesced && !timer_pending(cq->coalesce_timer)) {
+        timer_mod(cq->coalesce_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NVME_INTC_TIME(intc) * 100 * SCALE_US);
+    }
+}
+
+static void nvme_coalesce_timer_cb(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->coalesced = 0;
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/*
+ * Shadow doorbells: with the doorbell buffer configured, the guest
+ * writes new doorbell values to memory and only rings the MMIO doorbell
+ * when the value passes the event index the controller last published.
+ */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+/*
+ * Data pointers are mapped straight into the iovec of the request, so
+ * that queueing I/O allocates nothing.  Guest-contiguous segments are
+ * mapped in one go.  When guest memory cannot be mapped (MMIO, or the
+ * bounce buffer is busy) or the iovec is full, the request is mapped
+ * again into a QEMUSGList and goes through dma-helpers instead.
+ */
+
+/* Internal status: retry the mapping with a QEMUSGList */
+#define NVME_MAP_FALLBACK       0xfffe
+
+/* Bound the work a looping SGL can make us do */
+#define NVME_SGL_MAX_DESCRS     8192
+#define NVME_SGL_CHUNK          32
+
+static void nvme_req_unmap(NvmeCtrl *n, NvmeRequest *req)
+{
+    int i;
+
+    for (i = 0; i < req->niov; i++) {
+        pci_dma_unmap(&n->parent_obj, req->iov[i].iov_base,
+                      req->iov[i].iov_len, req->dir, req->iov[i].iov_len);
+    }
+    req->niov = 0;
+    if (req->has_sg) {
+        qemu_sglist_destroy(&req->qsg);
+        req->has_sg = false;
+    }
+}
+
+static bool nvme_req_map_seg(NvmeCtrl *n, NvmeRequest *req)
+{
+    dma_addr_t addr = req->seg_addr;
+    dma_addr_t len = req->seg_len;
+
+    req->seg_len = 0;
+    while (len) {
+        dma_addr_t plen = len;
+        void *p;
+
+        if (req->niov == NVME_REQ_MAX_IOV) {
+            return false;
         }
+        p = pci_dma_map(&n->parent_obj, addr, &plen, req->dir);
+        if (!p) {
+            return false;
+        }
+        req->iov[req->niov].iov_base = p;
+        req->iov[req->niov].iov_len = plen;
+        req->niov++;
+        addr += plen;
+        len -= plen;
+    }
+    return true;
+}
+
+static uint16_t nvme_req_add(NvmeCtrl *n, NvmeRequest *req, dma_addr_t addr,
+    dma_addr_t len)
+{
+    if (req->has_sg) {
+        qemu_sglist_add(&req->qsg, addr, len);
+        return NVME_SUCCESS;
+    }
+    if (req->seg_len && req->seg_addr + req->seg_len == addr) {
+        req->seg_len += len;
+        return NVME_SUCCESS;
     }
+    if (req->seg_len && !nvme_req_map_seg(n, req)) {
+        return NVME_MAP_FALLBACK;
+    }
+    req->seg_addr = addr;
+    req->seg_len = len;
+    return NVME_SUCCESS;
 }
 
-static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
-    uint32_t len, NvmeCtrl *n)
+static uint16_t nvme_map_prp(NvmeCtrl *n, uint64_t prp1, uint64_t prp2,
+    uint32_t len, NvmeRequest *req)
 {
     hwaddr trans_len = n->page_size - (prp1 % n->page_size);
-    trans_len = MIN(len, trans_len);
-    int num_prps = (len >> n->page_bits) + 1;
+    uint16_t status;
 
+    trans_len = MIN(len, trans_len);
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
 
-    pci_dma_sglist_init(qsg, &n->parent_obj, num_prps);
-    qemu_sglist_add(qsg, prp1, trans_len);
+    status = nvme_req_add(n, req, prp1, trans_len);
+    if (status) {
+        return status;
+    }
     len -= trans_len;
     if (len) {
         if (!prp2) {
-            goto unmap;
+            return NVME_INVALID_FIELD | NVME_DNR;
         }
         if (len > n->page_size) {
             uint64_t prp_list[n->max_prp_ents];
@@ -108,7 +324,7 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
 
                 if (i == n->max_prp_ents - 1 && len > n->page_size) {
                     if (!prp_ent || prp_ent & (n->page_size - 1)) {
-                        goto unmap;
+                        return NVME_INVALID_FIELD | NVME_DNR;
                     }
 
                     i = 0;
@@ -120,41 +336,182 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
                 }
 
                 if (!prp_ent || prp_ent & (n->page_size - 1)) {
-                    goto unmap;
+                    return NVME_INVALID_FIELD | NVME_DNR;
                 }
 
                 trans_len = MIN(len, n->page_size);
-                qemu_sglist_add(qsg, prp_ent, trans_len);
+                status = nvme_req_add(n, req, prp_ent, trans_len);
+                if (status) {
+                    return status;
+                }
                 len -= trans_len;
                 i++;
             }
         } else {
             if (prp2 & (n->page_size - 1)) {
-                goto unmap;
+                return NVME_INVALID_FIELD | NVME_DNR;
             }
-            qemu_sglist_add(qsg, prp2, len);
+            return nvme_req_add(n, req, prp2, len);
         }
     }
     return NVME_SUCCESS;
+}
 
- unmap:
-    qemu_sglist_destroy(qsg);
-    return NVME_INVALID_FIELD | NVME_DNR;
+static uint16_t nvme_map_sgl_data(NvmeCtrl *n, NvmeSglDescriptor *desc,
+    uint32_t *len, NvmeRequest *req)
+{
+    uint32_t dlen = le32_to_cpu(desc->len);
+
+    if (NVME_SGL_TYPE(desc->type) != NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+        return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+    }
+    if (dlen > *len) {
+        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+    if (!dlen) {
+        return NVME_SUCCESS;
+    }
+    *len -= dlen;
+    return nvme_req_add(n, req, le64_to_cpu(desc->addr), dlen);
 }
 
-static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
-    uint64_t prp1, uint64_t prp2)
+/*
+ * Walk an SGL.  The last descriptor of a Segment links to the next
+ * segment; a Last Segment holds data descriptors only.
+ */
+static uint16_t nvme_map_sgl(NvmeCtrl *n, NvmeSglDescriptor *sgl,
+    uint32_t len, NvmeRequest *req)
 {
-    QEMUSGList qsg;
+    NvmeSglDescriptor chunk[NVME_SGL_CHUNK];
+    NvmeSglDescriptor desc = *sgl;
+    uint32_t ndescs = 0;
+    uint16_t status;
 
-    if (nvme_map_prp(&qsg, prp1, prp2, len, n)) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+    for (;;) {
+        uint8_t type = NVME_SGL_TYPE(desc.type);
+        bool last = type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        uint64_t addr = le64_to_cpu(desc.addr);
+        uint32_t seg_len = le32_to_cpu(desc.len);
+        uint32_t nents = seg_len / sizeof(NvmeSglDescriptor);
+
+        if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+            status = nvme_map_sgl_data(n, &desc, &len, req);
+            if (status) {
+                return status;
+            }
+            break;
+        }
+        if (type != NVME_SGL_DESCR_TYPE_SEGMENT && !last) {
+            return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        }
+        if (!nents || seg_len % sizeof(NvmeSglDescriptor)) {
+            return NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+        }
+        ndescs += nents;
+        if (ndescs > NVME_SGL_MAX_DESCRS) {
+            return NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+        }
+
+        while (nents) {
+            uint32_t count = MIN(nents, NVME_SGL_CHUNK);
+            uint32_t i;
+
+            pci_dma_read(&n->parent_obj, addr, chunk, count * sizeof(chunk[0]));
+            addr += count * sizeof(chunk[0]);
+            nents -= count;
+            for (i = 0; i < count; i++) {
+                if (!last && !nents && i == count - 1) {
+                    desc = chunk[i];
+                    break;
+                }
+                status = nvme_map_sgl_data(n, &chunk[i], &len, req);
+                if (status) {
+                    return status;
+                }
+            }
+        }
+        if (last) {
+            break;
+        }
+
+        type = NVME_SGL_TYPE(desc.type);
+        if (type != NVME_SGL_DESCR_TYPE_SEGMENT &&
+            type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+            return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        }
+    }
+
+    if (len) {
+        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
     }
-    if (dma_buf_read(ptr, len, &qsg)) {
-        qemu_sglist_destroy(&qsg);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_map_dptr(NvmeCtrl *n, NvmeCmd *cmd, uint32_t len,
+    NvmeRequest *req)
+{
+    NvmeSglDescriptor sgl;
+    uint16_t status;
+
+    switch (NVME_CMD_FLAGS_PSDT(cmd->fuse)) {
+    case NVME_PSDT_PRP:
+        status = nvme_map_prp(n, le64_to_cpu(cmd->prp1),
+                              le64_to_cpu(cmd->prp2), len, req);
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+    case NVME_PSDT_SGL_MPTR_SGL:
+        /* There is no metadata, so MPTR is unused */
+        memcpy(&sgl, &cmd->prp1, sizeof(sgl));
+        status = nvme_map_sgl(n, &sgl, len, req);
+        break;
+    default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    qemu_sglist_destroy(&qsg);
+
+    if (!status && req->seg_len && !nvme_req_map_seg(n, req)) {
+        status = NVME_MAP_FALLBACK;
+    }
+    return status;
+}
+
+static uint16_t nvme_map(NvmeCtrl *n, NvmeCmd *cmd, uint32_t len,
+    DMADirection dir, NvmeRequest *req)
+{
+    uint16_t status;
+
+    req->dir = dir;
+    req->niov = 0;
+    req->seg_len = 0;
+    req->has_sg = false;
+
+    status = nvme_map_dptr(n, cmd, len, req);
+    if (status == NVME_MAP_FALLBACK) {
+        nvme_req_unmap(n, req);
+        pci_dma_sglist_init(&req->qsg, &n->parent_obj, NVME_REQ_MAX_IOV);
+        req->has_sg = true;
+        status = nvme_map_dptr(n, cmd, len, req);
+    }
+    if (status) {
+        nvme_req_unmap(n, req);
+    }
+    return status;
+}
+
+static uint16_t nvme_dma_read(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
+    NvmeCmd *cmd, NvmeRequest *req)
+{
+    uint16_t status;
+
+    status = nvme_map(n, cmd, len, DMA_DIRECTION_FROM_DEVICE, req);
+    if (status) {
+        return status;
+    }
+    if (req->has_sg) {
+        dma_buf_read(ptr, len, &req->qsg);
+    } else {
+        iov_from_buf(req->iov, req->niov, 0, ptr, len);
+    }
+    nvme_req_unmap(n, req);
     return NVME_SUCCESS;
 }
 
@@ -163,11 +520,22 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    NvmeSQueue *sq;
+    uint32_t posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-        NvmeSQueue *sq;
         hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->db_addr) {
+            /* Ask for a doorbell once the guest frees an entry */
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -182,8 +550,23 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
+    }
+
+    if (!posted) {
+        return;
+    }
+    nvme_cq_notify(n, cq, posted);
+
+    /*
+     * Requests were freed.  A queue that ran out of them, or whose guest
+     * no longer rings the doorbell, may have entries waiting.
+     */
+    QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+        if (sq->db_addr || !nvme_sq_empty(sq)) {
+            nvme_kick(sq->timer);
+        }
     }
-    nvme_isr_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -191,7 +574,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    nvme_kick(cq->timer);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -207,9 +590,7 @@ static void nvme_rw_cb(void *opaque, int ret)
     } else {
         req->status = NVME_INTERNAL_DEV_ERROR;
     }
-    if (req->has_sg) {
-        qemu_sglist_destroy(&req->qsg);
-    }
+    nvme_req_unmap(n, req);
     nvme_enqueue_req_completion(cq, req);
 }
 
@@ -217,6 +598,7 @@ static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     req->has_sg = false;
+    req->niov = 0;
     block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
          BLOCK_ACCT_FLUSH);
     req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
@@ -230,29 +612,42 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
     uint64_t data_size = (uint64_t)nlb << data_shift;
     uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
+    uint16_t status;
 
     if ((slba + nlb) > ns->id_ns.nsze) {
         return NVME_LBA_RANGE | NVME_DNR;
     }
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
-        return NVME_INVALID_FIELD | NVME_DNR;
+    status = nvme_map(n, cmd, data_size, is_write ? DMA_DIRECTION_TO_DEVICE :
+                      DMA_DIRECTION_FROM_DEVICE, req);
+    if (status) {
+        return status;
+    }
+
+    if (req->has_sg) {
+        assert(data_size == req->qsg.size);
+        dma_acct_start(n->conf.blk, &req->acct, &req->qsg,
+                       is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+        req->aiocb = is_write ?
+            dma_blk_write(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
+            dma_blk_read(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req);
+        return NVME_NO_COMPLETE;
     }
-    assert((nlb << data_shift) == req->qsg.size);
 
-    req->has_sg = true;
-    dma_acct_start(n->conf.blk, &req->acct, &req->qsg,
-                   is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+    qemu_iovec_init_external(&req->qiov, req->iov, req->niov);
+    assert(data_size == req->qiov.size);
+    block_acct_start(blk_get_stats(n->conf.blk), &req->acct, data_size,
+                     is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
     req->aiocb = is_write ?
-        dma_blk_write(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
-        dma_blk_read(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req);
+        blk_aio_writev(n->conf.blk, aio_slba, &req->qiov,
+                       data_size >> BDRV_SECTOR_BITS, nvme_rw_cb, req) :
+        blk_aio_readv(n->conf.blk, aio_slba, &req->qiov,
+                      data_size >> BDRV_SECTOR_BITS, nvme_rw_cb, req);
 
     return NVME_NO_COMPLETE;
 }
@@ -336,6 +731,11 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
+    if (n->dbbuf_enabled && sqid) {
+        sq->db_addr = n->dbbuf_dbs + 2 * sqid * 4;
+        sq->ei_addr = n->dbbuf_eis + 2 * sqid * 4;
+    }
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -344,7 +744,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->timer = nvme_timer_new(n, nvme_process_sq, sq);
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -388,6 +788,8 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    timer_del(cq->coalesce_timer);
+    timer_free(cq->coalesce_timer);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -423,11 +825,18 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->coalesced = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    if (n->dbbuf_enabled && cqid) {
+        cq->db_addr = n->dbbuf_dbs + (2 * cqid + 1) * 4;
+        cq->ei_addr = n->dbbuf_eis + (2 * cqid + 1) * 4;
+    }
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->timer = nvme_timer_new(n, nvme_post_cqes, cq);
+    cq->coalesce_timer = nvme_timer_new(n, nvme_coalesce_timer_cb, cq);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -449,7 +858,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -462,31 +871,67 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
+static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     NvmeNamespace *ns;
     NvmeIdentify *c = (NvmeIdentify *)cmd;
     uint32_t cns  = le32_to_cpu(c->cns);
     uint32_t nsid = le32_to_cpu(c->nsid);
-    uint64_t prp1 = le64_to_cpu(c->prp1);
-    uint64_t prp2 = le64_to_cpu(c->prp2);
 
     if (cns) {
-        return nvme_dma_read_prp(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
-            prp1, prp2);
+        return nvme_dma_read(n, (uint8_t *)&n->id_ctrl, sizeof(n->id_ctrl),
+            cmd, req);
     }
     if (nsid == 0 || nsid > n->num_namespaces) {
         return NVME_INVALID_NSID | NVME_DNR;
     }
 
     ns = &n->namespaces[nsid - 1];
-    return nvme_dma_read_prp(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
-        prp1, prp2);
+    return nvme_dma_read(n, (uint8_t *)&ns->id_ns, sizeof(ns->id_ns),
+        cmd, req);
+}
+
+/*
+ * Set up the shadow doorbell and event index buffers of the I/O queues.
+ * The admin queues keep using the MMIO doorbells.
+ */
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr || dbs_addr & (n->page_size - 1) ||
+        eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq) {
+            sq->db_addr = dbs_addr + 2 * i * 4;
+            sq->ei_addr = eis_addr + 2 * i * 4;
+            nvme_update_sq_eventidx(sq);
+        }
+        if (cq) {
+            cq->db_addr = dbs_addr + (2 * i + 1) * 4;
+            cq->ei_addr = eis_addr + (2 * i + 1) * 4;
+            nvme_update_cq_eventidx(cq);
+        }
+    }
+    return NVME_SUCCESS;
 }
 
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
 
     switch (dw10) {
@@ -496,6 +941,16 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(
+            n->features.int_vector_config[NVME_INTVC_IV(dw11)]);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -517,6 +972,15 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[NVME_INTVC_IV(dw11)] = dw11 & 0x1ffff;
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -535,11 +999,13 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_ADM_CMD_CREATE_CQ:
         return nvme_create_cq(n, cmd);
     case NVME_ADM_CMD_IDENTIFY:
-        return nvme_identify(n, cmd);
+        return nvme_identify(n, cmd, req);
     case NVME_ADM_CMD_SET_FEATURES:
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -556,6 +1022,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -573,6 +1043,13 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            /* Publish how far we got, then look for entries added since */
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
@@ -593,6 +1070,13 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->features.int_coalescing = 0;
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -725,9 +1209,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                nvme_kick(sq->timer);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            nvme_kick(cq->timer);
         }
 
         if (cq->tail != cq->head) {
@@ -748,7 +1232,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        nvme_kick(sq->timer);
     }
 }
 
@@ -756,11 +1240,15 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    /* The queues belong to the iothread, if there is one */
+    aio_context_acquire(n->ctx);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    aio_context_release(n->ctx);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -797,6 +1285,40 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    if (n->num_queues < 2 || n->num_queues > 2048) {
+        error_report("nvme: num_queues must be between 2 and 2048");
+        return -1;
+    }
+
+    if (n->iothread) {
+        Error *local_err = NULL;
+
+        if (blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE,
+                              &local_err)) {
+            error_report("nvme: cannot use an iothread: %s",
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+        n->ctx = iothread_get_aio_context(n->iothread);
+        n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+
+        error_setg(&n->blocker, "block device is in use by an nvme iothread");
+        blk_op_block_all(n->conf.blk, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_RESIZE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_DRIVE_DEL, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_BACKUP_SOURCE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_MIRROR, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT,
+                       n->blocker);
+
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -804,13 +1326,17 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = 1 << qemu_fls(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->irq_pending = g_new0(bool, n->num_queues);
+    n->features.int_vector_config = g_new(uint32_t, n->num_queues);
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -828,12 +1354,13 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -873,7 +1400,20 @@ static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
 
+    aio_context_acquire(n->ctx);
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    aio_context_release(n->ctx);
+
+    if (n->iothread) {
+        qemu_bh_delete(n->irq_bh);
+        blk_op_unblock_all(n->conf.blk, n->blocker);
+        error_free(n->blocker);
+    }
+    g_free(n->features.int_vector_config);
+    g_free(n->irq_pending);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -883,6 +1423,7 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -945,6 +1486,12 @@ out:
 
 static void nvme_instance_init(Object *obj)
 {
+    NvmeCtrl *n = NVME(obj);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     object_property_add(obj, "bootindex", "int32",
                         nvme_get_bootindex,
                         nvme_set_bootindex, NULL, NULL, NULL);
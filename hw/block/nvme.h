@@ -154,6 +154,31 @@ typedef struct NvmeCmd {
     uint32_t    cdw15;
 } NvmeCmd;
 
+#define NVME_CMD_FLAGS_FUSE(flags)  ((flags) & 0x3)
+#define NVME_CMD_FLAGS_PSDT(flags)  (((flags) >> 6) & 0x3)
+
+enum NvmePsdt {
+    NVME_PSDT_PRP                   = 0x0,
+    NVME_PSDT_SGL_MPTR_CONTIGUOUS   = 0x1,
+    NVME_PSDT_SGL_MPTR_SGL          = 0x2,
+};
+
+typedef struct NvmeSglDescriptor {
+    uint64_t    addr;
+    uint32_t    len;
+    uint8_t     rsvd[3];
+    uint8_t     type;
+} NvmeSglDescriptor;
+
+#define NVME_SGL_TYPE(type)     (((type) >> 4) & 0xf)
+
+enum NvmeSglDescriptorType {
+    NVME_SGL_DESCR_TYPE_DATA_BLOCK      = 0x0,
+    NVME_SGL_DESCR_TYPE_BIT_BUCKET      = 0x1,
+    NVME_SGL_DESCR_TYPE_SEGMENT         = 0x2,
+    NVME_SGL_DESCR_TYPE_LAST_SEGMENT    = 0x3,
+};
+
 enum NvmeAdminCommands {
     NVME_ADM_CMD_DELETE_SQ      = 0x00,
     NVME_ADM_CMD_CREATE_SQ      = 0x01,
@@ -167,6 +192,7 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_ASYNC_EV_REQ   = 0x0c,
     NVME_ADM_CMD_ACTIVATE_FW    = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW    = 0x11,
+    NVME_ADM_CMD_DBBUF_CONFIG   = 0x7c,
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
@@ -358,6 +384,10 @@ enum NvmeStatusCodes {
     NVME_CMD_ABORT_MISSING_FUSE = 0x000a,
     NVME_INVALID_NSID           = 0x000b,
     NVME_CMD_SEQ_ERROR          = 0x000c,
+    NVME_INVALID_NUM_SGL_DESCRS = 0x000e,
+    NVME_DATA_SGL_LEN_INVALID   = 0x000f,
+    NVME_MD_SGL_LEN_INVALID     = 0x0010,
+    NVME_SGL_DESCR_TYPE_INVALID = 0x0011,
     NVME_LBA_RANGE              = 0x0080,
     NVME_CAP_EXCEEDED           = 0x0081,
     NVME_NS_NOT_READY           = 0x0082,
@@ -493,7 +523,12 @@ typedef struct NvmeIdCtrl {
     uint8_t     vwc;
     uint16_t    awun;
     uint16_t    awupf;
-    uint8_t     rsvd703[174];
+    uint8_t     nvscc;
+    uint8_t     rsvd531;
+    uint16_t    acwu;
+    uint16_t    rsvd535;
+    uint32_t    sgls;
+    uint8_t     rsvd703[164];
     uint8_t     rsvd2047[1344];
     NvmePSD     psd[32];
     uint8_t     vs[1024];
@@ -503,6 +538,7 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_SECURITY  = 1 << 0,
     NVME_OACS_FORMAT    = 1 << 1,
     NVME_OACS_FW        = 1 << 2,
+    NVME_OACS_DBBUF     = 1 << 8,
 };
 
 enum NvmeIdCtrlOncs {
@@ -514,6 +550,10 @@ enum NvmeIdCtrlOncs {
     NVME_ONCS_RESRVATIONS   = 1 << 5,
 };
 
+enum NvmeIdCtrlSgls {
+    NVME_SGLS_SUPPORTED     = 1 << 0,
+};
+
 #define NVME_CTRL_SQES_MIN(sqes) ((sqes) & 0xf)
 #define NVME_CTRL_SQES_MAX(sqes) (((sqes) >> 4) & 0xf)
 #define NVME_CTRL_CQES_MIN(cqes) ((cqes) & 0xf)
@@ -541,6 +581,9 @@ typedef struct NvmeFeatureVal {
 #define NVME_INTC_THR(intc)     (intc & 0xff)
 #define NVME_INTC_TIME(intc)    ((intc >> 8) & 0xff)
 
+#define NVME_INTVC_IV(ivc)      (ivc & 0xffff)
+#define NVME_INTVC_CD(ivc)      ((ivc >> 16) & 0x1)
+
 enum NvmeFeatureIds {
     NVME_ARBITRATION                = 0x1,
     NVME_POWER_MANAGEMENT           = 0x2,
@@ -615,6 +658,7 @@ static inline void _nvme_check_size(void)
     QEMU_BUILD_BUG_ON(sizeof(NvmeCqe) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDsmRange) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCmd) != 64);
+    QEMU_BUILD_BUG_ON(sizeof(NvmeSglDescriptor) != 16);
     QEMU_BUILD_BUG_ON(sizeof(NvmeDeleteQ) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCreateCq) != 64);
     QEMU_BUILD_BUG_ON(sizeof(NvmeCreateSq) != 64);
@@ -634,6 +678,9 @@ typedef struct NvmeAsyncEvent {
     NvmeAerResult result;
 } NvmeAsyncEvent;
 
+/* Guest memory mapped directly by a request; larger ones use qsg */
+#define NVME_REQ_MAX_IOV    32
+
 typedef struct NvmeRequest {
     struct NvmeSQueue       *sq;
     BlockAIOCB              *aiocb;
@@ -642,6 +689,12 @@ typedef struct NvmeRequest {
     NvmeCqe                 cqe;
     BlockAcctCookie         acct;
     QEMUSGList              qsg;
+    DMADirection            dir;
+    dma_addr_t              seg_addr;   /* guest range not mapped yet */
+    dma_addr_t              seg_len;
+    int                     niov;
+    struct iovec            iov[NVME_REQ_MAX_IOV];
+    QEMUIOVector            qiov;
     QTAILQ_ENTRY(NvmeRequest)entry;
 } NvmeRequest;
 
@@ -653,6 +706,8 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;        /* shadow doorbell, 0 if not in use */
+    uint64_t    ei_addr;        /* event index */
     QEMUTimer   *timer;
     NvmeRequest *io_req;
     QTAILQ_HEAD(sq_req_list, NvmeRequest) req_list;
@@ -669,8 +724,12 @@ typedef struct NvmeCQueue {
     uint32_t    tail;
     uint32_t    vector;
     uint32_t    size;
+    uint32_t    coalesced;      /* entries posted since the last interrupt */
     uint64_t    dma_addr;
+    uint64_t    db_addr;        /* shadow doorbell, 0 if not in use */
+    uint64_t    ei_addr;        /* event index */
     QEMUTimer   *timer;
+    QEMUTimer   *coalesce_timer;
     QTAILQ_HEAD(sq_list, NvmeSQueue) sq_list;
     QTAILQ_HEAD(cq_req_list, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -699,6 +758,16 @@ typedef struct NvmeCtrl {
     uint32_t    num_queues;
     uint32_t    max_q_ents;
     uint64_t    ns_size;
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
+    bool        dbbuf_enabled;
+
+    /* Queues are processed in @ctx, which is the iothread's if one is set */
+    IOThread        *iothread;
+    AioContext      *ctx;
+    Error           *blocker;
+    QEMUBH          *irq_bh;
+    bool            *irq_pending;
 
     char            *serial;
     NvmeNamespace   *namespaces;
@@ -707,6 +776,7 @@ typedef struct NvmeCtrl {
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
+    NvmeFeatureVal  features;
 } NvmeCtrl;
 
 #endif /* HW_NVME_H */
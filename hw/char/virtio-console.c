@@ -12,6 +12,7 @@
 
 #include "sysemu/char.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "trace.h"
 #include "hw/virtio/virtio-serial.h"
 #include "qapi-event.h"
@@ -42,10 +43,11 @@ static gboolean chr_write_unblocked(GIOChannel *chan, GIOCondition cond,
 }
 
 /* Callback function that's called when the guest sends us data */
-static ssize_t flush_buf(VirtIOSerialPort *port,
-                         const uint8_t *buf, ssize_t len)
+static ssize_t flush_iov(VirtIOSerialPort *port,
+                         const struct iovec *iov, int iovcnt)
 {
     VirtConsole *vcon = VIRTIO_CONSOLE(port);
+    ssize_t len = iov_size(iov, iovcnt);
     ssize_t ret;
 
     if (!vcon->chr) {
@@ -53,7 +55,7 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
         return len;
     }
 
-    ret = qemu_chr_fe_write(vcon->chr, buf, len);
+    ret = qemu_chr_fe_writev(vcon->chr, iov, iovcnt);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < len) {
@@ -79,6 +81,17 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
     return ret;
 }
 
+static ssize_t flush_buf(VirtIOSerialPort *port,
+                         const uint8_t *buf, ssize_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return flush_iov(port, &iov, 1);
+}
+
 /* Callback function that's called when the guest opens/closes the port */
 static void set_guest_connected(VirtIOSerialPort *port, int guest_connected)
 {
@@ -196,6 +209,7 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     k->realize = virtconsole_realize;
     k->unrealize = virtconsole_unrealize;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->set_guest_connected = set_guest_connected;
     k->guest_writable = guest_writable;
     dc->props = virtserialport_properties;
@@ -82,7 +82,7 @@ static bool use_multiport(VirtIOSerial *vser)
 static size_t write_to_port(VirtIOSerialPort *port,
                             const uint8_t *buf, size_t size)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     size_t offset;
 
@@ -95,15 +95,17 @@ static size_t write_to_port(VirtIOSerialPort *port,
     while (offset < size) {
         size_t len;
 
-        if (!virtqueue_pop(vq, &elem)) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
             break;
         }
 
-        len = iov_from_buf(elem.in_sg, elem.in_num, 0,
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
                            buf + offset, size - offset);
         offset += len;
 
-        virtqueue_push(vq, &elem, len);
+        virtqueue_push(vq, elem, len);
+        virtqueue_free_element(elem);
     }
 
     virtio_notify(VIRTIO_DEVICE(port->vser), vq);
@@ -112,17 +114,111 @@ static size_t write_to_port(VirtIOSerialPort *port,
 
 static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     if (!virtio_queue_ready(vq)) {
         return;
     }
-    while (virtqueue_pop(vq, &elem)) {
-        virtqueue_push(vq, &elem, 0);
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        virtqueue_push(vq, elem, 0);
+        virtqueue_free_element(elem);
     }
     virtio_notify(vdev, vq);
 }
 
+/* Most elements popped at once for have_data_iov */
+#define VIRTIO_SERIAL_FLUSH_BATCH 64
+
+/*
+ * Hand the buffers of up to VIRTIO_SERIAL_FLUSH_BATCH elements to the port
+ * in one call.  If the port throttles, the element it stopped in is kept
+ * in port->elem as with have_data, and those after it are given back to
+ * the virtqueue.
+ */
+static void do_flush_queued_data_iov(VirtIOSerialPort *port, VirtQueue *vq)
+{
+    VirtIOSerialPortClass *vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
+    VirtQueueElement *elems[VIRTIO_SERIAL_FLUSH_BATCH];
+    struct iovec iov[IOV_MAX];
+
+    while (!port->throttled) {
+        VirtQueueElement *elem;
+        unsigned int first_idx = 0;
+        size_t first_offset = 0, done;
+        int nelems = 0, niov = 0;
+        ssize_t ret;
+        int i;
+
+        /* Resume the element left off mid-way first */
+        if (port->elem) {
+            elem = port->elem;
+            port->elem = NULL;
+            first_idx = port->iov_idx;
+            first_offset = port->iov_offset;
+            niov = iov_copy(iov, IOV_MAX, elem->out_sg, elem->out_num,
+                            iov_size(elem->out_sg, first_idx) + first_offset,
+                            SIZE_MAX);
+            elems[nelems++] = elem;
+        }
+        while (nelems < VIRTIO_SERIAL_FLUSH_BATCH) {
+            elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!elem) {
+                break;
+            }
+            if (niov + elem->out_num > IOV_MAX) {
+                virtqueue_discard(vq, elem, 0);
+                virtqueue_free_element(elem);
+                break;
+            }
+            memcpy(iov + niov, elem->out_sg, elem->out_num * sizeof(*iov));
+            niov += elem->out_num;
+            elems[nelems++] = elem;
+        }
+        if (!nelems) {
+            break;
+        }
+
+        ret = vsc->have_data_iov(port, iov, niov);
+        done = ret > 0 ? ret : 0;
+
+        for (i = 0; i < nelems; i++) {
+            size_t len = iov_size(elems[i]->out_sg, elems[i]->out_num);
+
+            if (i == 0) {
+                len -= iov_size(elems[i]->out_sg, first_idx) + first_offset;
+            }
+            /* Unless throttled, the port consumed everything */
+            if (port->throttled && done < len) {
+                break;
+            }
+            done -= MIN(done, len);
+            virtqueue_push(vq, elems[i], 0);
+            virtqueue_free_element(elems[i]);
+        }
+        if (i == nelems) {
+            continue;
+        }
+
+        /* Find where in elems[i] the port stopped */
+        elem = elems[i];
+        if (i == 0) {
+            done += iov_size(elem->out_sg, first_idx) + first_offset;
+        }
+        port->elem = elem;
+        port->iov_idx = 0;
+        while (done >= elem->out_sg[port->iov_idx].iov_len) {
+            done -= elem->out_sg[port->iov_idx].iov_len;
+            port->iov_idx++;
+        }
+        port->iov_offset = done;
+
+        while (--nelems > i) {
+            virtqueue_discard(vq, elems[nelems], 0);
+            virtqueue_free_element(elems[nelems]);
+        }
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -133,25 +229,32 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
 
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
+    if (vsc->have_data_iov) {
+        do_flush_queued_data_iov(port, vq);
+        virtio_notify(vdev, vq);
+        return;
+    }
+
     while (!port->throttled) {
         unsigned int i;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
-            if (!virtqueue_pop(vq, &port->elem)) {
+        if (!port->elem) {
+            port->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+            if (!port->elem) {
                 break;
             }
             port->iov_idx = 0;
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
+        for (i = port->iov_idx; i < port->elem->out_num; i++) {
             size_t buf_size;
             ssize_t ret;
 
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
+            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
             ret = vsc->have_data(port,
-                                  port->elem.out_sg[i].iov_base
+                                  port->elem->out_sg[i].iov_base
                                   + port->iov_offset,
                                   buf_size);
             if (port->throttled) {
@@ -166,8 +269,9 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, &port->elem, 0);
-        port->elem.out_num = 0;
+        virtqueue_push(vq, port->elem, 0);
+        virtqueue_free_element(port->elem);
+        port->elem = NULL;
     }
     virtio_notify(vdev, vq);
 }
@@ -184,21 +288,23 @@ static void flush_queued_data(VirtIOSerialPort *port)
 
 static size_t send_control_msg(VirtIOSerial *vser, void *buf, size_t len)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
 
     vq = vser->c_ivq;
     if (!virtio_queue_ready(vq)) {
         return 0;
     }
-    if (!virtqueue_pop(vq, &elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         return 0;
     }
 
     /* TODO: detect a buffer that's too short, set NEEDS_RESET */
-    iov_from_buf(elem.in_sg, elem.in_num, 0, buf, len);
+    iov_from_buf(elem->in_sg, elem->in_num, 0, buf, len);
 
-    virtqueue_push(vq, &elem, len);
+    virtqueue_push(vq, elem, len);
+    virtqueue_free_element(elem);
     virtio_notify(VIRTIO_DEVICE(vser), vq);
     return len;
 }
@@ -413,7 +519,7 @@ static void control_in(VirtIODevice *vdev, VirtQueue *vq)
 
 static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtIOSerial *vser;
     uint8_t *buf;
     size_t len;
@@ -422,10 +528,10 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 
     len = 0;
     buf = NULL;
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         size_t cur_len;
 
-        cur_len = iov_size(elem.out_sg, elem.out_num);
+        cur_len = iov_size(elem->out_sg, elem->out_num);
         /*
          * Allocate a new buf only if we didn't have one previously or
          * if the size of the buf differs
@@ -436,10 +542,11 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
             buf = g_malloc(cur_len);
             len = cur_len;
         }
-        iov_to_buf(elem.out_sg, elem.out_num, 0, buf, cur_len);
+        iov_to_buf(elem->out_sg, elem->out_num, 0, buf, cur_len);
 
         handle_control_message(vser, buf, cur_len);
-        virtqueue_push(vq, &elem, 0);
+        virtqueue_push(vq, elem, 0);
+        virtqueue_free_element(elem);
     }
     g_free(buf);
     virtio_notify(vdev, vq);
@@ -619,7 +726,7 @@ static void virtio_serial_save_device(VirtIODevice *vdev, QEMUFile *f)
         qemu_put_byte(f, port->host_connected);
 
 	elem_popped = 0;
-        if (port->elem.out_num) {
+        if (port->elem) {
             elem_popped = 1;
         }
         qemu_put_be32s(f, &elem_popped);
@@ -627,8 +734,7 @@ static void virtio_serial_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
 
-            qemu_put_buffer(f, (unsigned char *)&port->elem,
-                            sizeof(port->elem));
+            qemu_put_virtqueue_element(f, port->elem);
         }
     }
 }
@@ -703,12 +809,8 @@ static int fetch_active_ports_list(QEMUFile *f, int version_id,
                 qemu_get_be32s(f, &port->iov_idx);
                 qemu_get_be64s(f, &port->iov_offset);
 
-                qemu_get_buffer(f, (unsigned char *)&port->elem,
-                                sizeof(port->elem));
-                virtqueue_map_sg(port->elem.in_sg, port->elem.in_addr,
-                                 port->elem.in_num, 1);
-                virtqueue_map_sg(port->elem.out_sg, port->elem.out_addr,
-                                 port->elem.out_num, 1);
+                port->elem =
+                    qemu_get_virtqueue_element(f, sizeof(VirtQueueElement));
 
                 /*
                  *  Port was throttled on source machine.  Let's
@@ -930,7 +1032,7 @@ static void virtser_port_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    port->elem.out_num = 0;
+    port->elem = NULL;
 }
 
 static void virtser_port_device_plug(HotplugHandler *hotplug_dev,
@@ -956,6 +1058,8 @@ static void virtser_port_device_unrealize(DeviceState *dev, Error **errp)
 
     qemu_bh_delete(port->bh);
     remove_port(port->vser, port->id);
+    virtqueue_free_element(port->elem);
+    port->elem = NULL;
 
     QTAILQ_REMOVE(&vser->ports, port, next);
 
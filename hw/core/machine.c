@@ -66,6 +66,34 @@ static void machine_set_kvm_shadow_mem(Object *obj, Visitor *v,
     ms->kvm_shadow_mem = value;
 }
 
+static void machine_get_kvm_halt_poll_ns(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint32_t value = ms->kvm_halt_poll_ns;
+
+    visit_type_uint32(v, &value, name, errp);
+}
+
+static void machine_set_kvm_halt_poll_ns(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+
+    /* vCPUs pick the new limit up the next time they halt */
+    ms->kvm_halt_poll_ns = value;
+}
+
 static char *machine_get_kernel(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -330,6 +358,14 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "kvm-shadow-mem",
                                     "KVM shadow MMU size",
                                     NULL);
+    object_property_add(obj, "kvm-halt-poll-ns", "uint32",
+                        machine_get_kvm_halt_poll_ns,
+                        machine_set_kvm_halt_poll_ns,
+                        NULL, NULL, NULL);
+    object_property_set_description(obj, "kvm-halt-poll-ns",
+                                    "Maximum time a halted KVM vCPU polls "
+                                    "for work in QEMU before sleeping",
+                                    NULL);
     object_property_add_str(obj, "kernel",
                             machine_get_kernel, machine_set_kernel, NULL);
     object_property_set_description(obj, "kernel",
@@ -451,6 +487,11 @@ int machine_kvm_shadow_mem(MachineState *machine)
     return machine->kvm_shadow_mem;
 }
 
+uint32_t machine_kvm_halt_poll_ns(MachineState *machine)
+{
+    return machine->kvm_halt_poll_ns;
+}
+
 int machine_phandle_start(MachineState *machine)
 {
     return machine->phandle_start;
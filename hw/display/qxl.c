@@ -425,6 +425,29 @@ static void qxl_ring_set_dirty(PCIQXLDevice *qxl)
     qxl_set_dirty(&qxl->vga.vram, addr, end);
 }
 
+/*
+ * Commands are taken from the ring in batches: the ring header is marked
+ * dirty once per QXL_CMD_BATCH commands instead of for every one, and
+ * when the ring runs empty, when spice asks to be notified and when the
+ * VM stops, before migration sends the RAM for the last time.
+ */
+#define QXL_CMD_BATCH 32
+
+static void qxl_cmd_batch_flush(PCIQXLDevice *qxl)
+{
+    if (atomic_xchg(&qxl->cmd_batch, 0)) {
+        qxl_ring_set_dirty(qxl);
+    }
+}
+
+/* called from spice server thread context only */
+static void qxl_cmd_batch_add(PCIQXLDevice *qxl)
+{
+    if (atomic_fetch_inc(&qxl->cmd_batch) + 1 >= QXL_CMD_BATCH) {
+        qxl_cmd_batch_flush(qxl);
+    }
+}
+
 /*
  * keep track of some command state, for savevm/loadvm.
  * called from spice server thread context only
@@ -616,6 +639,7 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
     case QXL_MODE_UNDEFINED:
         ring = &qxl->ram->cmd_ring;
         if (qxl->guest_bug || SPICE_RING_IS_EMPTY(ring)) {
+            qxl_cmd_batch_flush(qxl);
             return false;
         }
         SPICE_RING_CONS_ITEM(qxl, ring, cmd);
@@ -626,7 +650,7 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        qxl_cmd_batch_add(qxl);
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
@@ -652,6 +676,7 @@ static int interface_req_cmd_notification(QXLInstance *sin)
     case QXL_MODE_NATIVE:
     case QXL_MODE_UNDEFINED:
         SPICE_RING_CONS_WAIT(&qxl->ram->cmd_ring, wait);
+        atomic_set(&qxl->cmd_batch, 0);
         qxl_ring_set_dirty(qxl);
         break;
     default:
@@ -1838,6 +1863,7 @@ static void qxl_vm_change_state_handler(void *opaque, int running,
     } else {
         /* make sure surfaces are saved before migration */
         qxl_dirty_surfaces(qxl);
+        qxl_cmd_batch_flush(qxl);
     }
 }
 
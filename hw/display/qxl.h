@@ -43,6 +43,7 @@ typedef struct PCIQXLDevice {
 
     enum qxl_mode      mode;
     uint32_t           cmdflags;
+    uint32_t           cmd_batch;
     int                generation;
     uint32_t           revision;
 
@@ -1425,17 +1425,59 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+/*
+ * Narrow the pixels [*x0, *x1) of a dirty line at @addr down to the ones
+ * in dirty pages.  Only for modes with whole bytes per pixel.
+ */
+static void vga_dirty_span(VGACommonState *s, DirtyBitmapSnapshot *snap,
+                           ram_addr_t addr, int bwidth, int src_bpp,
+                           int *x0, int *x1)
+{
+    ram_addr_t start = addr, end = addr + bwidth, page;
+
+    while (start < end) {
+        page = MIN((start | ~TARGET_PAGE_MASK) + 1, end);
+        if (memory_region_snapshot_get_dirty(&s->vram, snap, start,
+                                             page - start)) {
+            break;
+        }
+        start = page;
+    }
+    while (end > start) {
+        page = MAX((end - 1) & TARGET_PAGE_MASK, start);
+        if (memory_region_snapshot_get_dirty(&s->vram, snap, page,
+                                             end - page)) {
+            break;
+        }
+        end = page;
+    }
+    *x0 = (start - addr) / src_bpp;
+    *x1 = MIN(DIV_ROUND_UP(end - addr, src_bpp), *x1);
+}
+
+static void vga_flush_update(VGACommonState *s, int y, int h, int disp_width,
+                             int x_min, int x_max, bool partial)
+{
+    if (!partial || x_max <= x_min) {
+        x_min = 0;
+        x_max = disp_width;
+    }
+    dpy_gfx_update(s->con, x_min, y, x_max - x_min, h);
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     DisplaySurface *surface = qemu_console_surface(s->con);
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
     int width, height, shift_control, line_offset, bwidth, bits;
-    ram_addr_t page0, page1, page_min, page_max;
     int disp_width, multi_scan, multi_run;
+    int x0, x1, x_min, x_max, src_bpp, dst_bpp;
     uint8_t *d;
     uint32_t v, addr1, addr;
+    ram_addr_t region_start, region_end;
     vga_draw_line_func *vga_draw_line = NULL;
-    bool share_surface;
+    DirtyBitmapSnapshot *snap;
+    bool share_surface, partial;
     pixman_format_code_t format;
 #ifdef HOST_WORDS_BIGENDIAN
     bool byteswap = !s->big_endian_fb;
@@ -1598,11 +1640,38 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
     y_start = -1;
-    page_min = -1;
-    page_max = 0;
     d = surface_data(surface);
     linesize = surface_stride(surface);
     y1 = 0;
+
+    /*
+     * Take the dirty bits of everything that can be displayed at once,
+     * so that writes done while the frame is drawn are seen next time.
+     * Split screen and CGA addressing can show any part of the first
+     * 64K, for the others the lines follow each other from addr1.
+     */
+    region_start = addr1;
+    region_end = addr1 + (ram_addr_t)line_offset * height + bwidth;
+    if (s->line_compare < height || (s->cr[VGA_CRTC_MODE] & 3) != 3) {
+        region_start = 0;
+        region_end = MAX(region_end, 0x10000);
+    }
+    region_end = MIN(region_end, s->vram_size);
+    region_start = MIN(region_start, region_end);
+    snap = memory_region_snapshot_and_clear_dirty(&s->vram, region_start,
+                                                  region_end - region_start,
+                                                  DIRTY_MEMORY_VGA);
+
+    /*
+     * With a shadow surface and whole bytes per pixel, only the pages of
+     * a line that changed are converted and sent to the display.
+     */
+    src_bpp = bits / 8;
+    dst_bpp = surface_bytes_per_pixel(surface);
+    partial = !is_buffer_shared(surface) && bits >= 8 && !full_update;
+    x_min = disp_width;
+    x_max = 0;
+
     for(y = 0; y < height; y++) {
         addr = addr1;
         if (!(s->cr[VGA_CRTC_MODE] & 1)) {
@@ -1614,31 +1683,39 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         if (!(s->cr[VGA_CRTC_MODE] & 2)) {
             addr = (addr & ~0x8000) | ((y1 & 2) << 14);
         }
-        update = full_update;
-        page0 = addr;
-        page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
+        x0 = 0;
+        x1 = width;
+        if (full_update) {
+            update = 1;
+        } else {
+            update = memory_region_snapshot_get_dirty(&s->vram, snap,
+                                                      addr, bwidth);
+        }
         /* explicit invalidation for the hardware cursor */
-        update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
+        if ((s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1) {
+            update = 1;
+        } else if (update && partial) {
+            vga_dirty_span(s, snap, addr, bwidth, src_bpp, &x0, &x1);
+        }
         if (update) {
             if (y_start < 0)
                 y_start = y;
-            if (page0 < page_min)
-                page_min = page0;
-            if (page1 > page_max)
-                page_max = page1;
+            x_min = MIN(x_min, x0);
+            x_max = MAX(x_max, x1);
             if (!(is_buffer_shared(surface))) {
-                vga_draw_line(s, d, s->vram_ptr + addr, width);
+                vga_draw_line(s, d + x0 * dst_bpp,
+                              s->vram_ptr + addr + x0 * src_bpp, x1 - x0);
                 if (s->cursor_draw_line)
                     s->cursor_draw_line(s, d, y);
             }
         } else {
             if (y_start >= 0) {
                 /* flush to display */
-                dpy_gfx_update(s->con, 0, y_start,
-                               disp_width, y - y_start);
+                vga_flush_update(s, y_start, y - y_start, disp_width,
+                                 x_min, x_max, partial);
                 y_start = -1;
+                x_min = disp_width;
+                x_max = 0;
             }
         }
         if (!multi_run) {
@@ -1657,16 +1734,10 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
     if (y_start >= 0) {
         /* flush to display */
-        dpy_gfx_update(s->con, 0, y_start,
-                       disp_width, y - y_start);
-    }
-    /* reset modified pages */
-    if (page_max >= page_min) {
-        memory_region_reset_dirty(&s->vram,
-                                  page_min,
-                                  page_max - page_min,
-                                  DIRTY_MEMORY_VGA);
+        vga_flush_update(s, y_start, y - y_start, disp_width,
+                         x_min, x_max, partial);
     }
+    g_free(snap);
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
 }
 
@@ -47,6 +47,7 @@ do { \
 static void check_cmd(AHCIState *s, int port);
 static int handle_cmd(AHCIState *s, int port, uint8_t slot);
 static void ahci_reset_port(AHCIState *s, int port);
+static void ahci_check_cmd_bh(void *opaque);
 static void ahci_write_fis_d2h(AHCIDevice *ad, uint8_t *cmd_fis);
 static void ahci_init_d2h(AHCIDevice *ad);
 static int ahci_dma_prepare_buf(IDEDMA *dma, int32_t limit);
@@ -148,6 +149,16 @@ static void ahci_irq_lower(AHCIState *s, AHCIDevice *dev)
     }
 }
 
+/* Port interrupts that are coalesced on ports covered by HOST_CCC_PORTS */
+#define AHCI_CCC_IRQ_MASK (PORT_IRQ_D2H_REG_FIS | PORT_IRQ_PIOS_FIS | \
+                           PORT_IRQ_DMAS_FIS | PORT_IRQ_SDB_FIS)
+
+static bool ahci_ccc_enabled(AHCIState *s, int port)
+{
+    return (s->control_regs.ccc_ctl & HOST_CCC_CTL_EN) &&
+           (s->control_regs.ccc_ports & (1U << port));
+}
+
 static void ahci_check_irq(AHCIState *s)
 {
     int i;
@@ -157,10 +168,19 @@ static void ahci_check_irq(AHCIState *s)
     s->control_regs.irqstatus = 0;
     for (i = 0; i < s->ports; i++) {
         AHCIPortRegs *pr = &s->dev[i].port_regs;
-        if (pr->irq_stat & pr->irq_mask) {
+        uint32_t irq_mask = pr->irq_mask;
+
+        /* Completions on coalesced ports only raise the CCC interrupt */
+        if (ahci_ccc_enabled(s, i)) {
+            irq_mask &= ~AHCI_CCC_IRQ_MASK;
+        }
+        if (pr->irq_stat & irq_mask) {
             s->control_regs.irqstatus |= (1 << i);
         }
     }
+    if (s->ccc_pending) {
+        s->control_regs.irqstatus |= 1U << s->ports;
+    }
 
     if (s->control_regs.irqstatus &&
         (s->control_regs.ghc & HOST_CTL_IRQ_EN)) {
@@ -180,6 +200,85 @@ static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
     ahci_check_irq(s);
 }
 
+static void ahci_ccc_fire(AHCIState *s)
+{
+    s->ccc_count = 0;
+    s->ccc_pending = true;
+    timer_del(s->ccc_timer);
+    ahci_check_irq(s);
+}
+
+static void ahci_ccc_timer_cb(void *opaque)
+{
+    ahci_ccc_fire(opaque);
+}
+
+/*
+ * AHCI 1.3 section 11: count @n command completions on a coalesced port.
+ * The CCC interrupt is raised once CC completions have been counted, or
+ * TV milliseconds after the first completion that did not raise it.
+ */
+static void ahci_ccc_complete(AHCIDevice *ad, int n)
+{
+    AHCIState *s = ad->hba;
+    uint32_t ctl = s->control_regs.ccc_ctl;
+    uint32_t cc = (ctl & HOST_CCC_CTL_CC_MASK) >> HOST_CCC_CTL_CC_SHIFT;
+    uint32_t tv = (ctl & HOST_CCC_CTL_TV_MASK) >> HOST_CCC_CTL_TV_SHIFT;
+
+    if (!n || !ahci_ccc_enabled(s, ad->port_no)) {
+        return;
+    }
+
+    s->ccc_count += n;
+    if (cc && s->ccc_count >= cc) {
+        ahci_ccc_fire(s);
+    } else if (tv && !timer_pending(s->ccc_timer)) {
+        timer_mod(s->ccc_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + tv);
+    }
+}
+
+static void ahci_ccc_reset(AHCIState *s)
+{
+    s->control_regs.ccc_ctl = (1 << HOST_CCC_CTL_TV_SHIFT) |
+                              (1 << HOST_CCC_CTL_CC_SHIFT) |
+                              (s->ports << HOST_CCC_CTL_INT_SHIFT);
+    s->control_regs.ccc_ports = 0;
+    s->ccc_count = 0;
+    s->ccc_pending = false;
+    if (s->ccc_timer) {
+        timer_del(s->ccc_timer);
+    }
+}
+
+static void ahci_ccc_write_ctl(AHCIState *s, uint32_t val)
+{
+    uint32_t ctl = s->control_regs.ccc_ctl;
+
+    /* CC and TV may only be changed while coalescing is disabled */
+    if (!(ctl & HOST_CCC_CTL_EN)) {
+        ctl &= ~(HOST_CCC_CTL_CC_MASK | HOST_CCC_CTL_TV_MASK);
+        ctl |= val & (HOST_CCC_CTL_CC_MASK | HOST_CCC_CTL_TV_MASK);
+    }
+    ctl = (ctl & ~HOST_CCC_CTL_EN) | (val & HOST_CCC_CTL_EN);
+    s->control_regs.ccc_ctl = ctl;
+
+    if (!(ctl & HOST_CCC_CTL_EN)) {
+        s->ccc_count = 0;
+        timer_del(s->ccc_timer);
+    }
+    ahci_check_irq(s);
+}
+
+/* Defer command list processing to the main loop, batching PxCI writes */
+static void ahci_schedule_check_cmd(AHCIDevice *ad)
+{
+    if (!ad->check_bh) {
+        ad->check_bh = qemu_bh_new(ahci_check_cmd_bh, ad);
+        qemu_bh_schedule(ad->check_bh);
+    }
+}
+
 static void map_page(AddressSpace *as, uint8_t **ptr, uint64_t addr,
                      uint32_t wanted)
 {
@@ -327,7 +426,7 @@ static void  ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
             break;
         case PORT_CMD_ISSUE:
             pr->cmd_issue |= val;
-            check_cmd(s, port);
+            ahci_schedule_check_cmd(&s->dev[port]);
             break;
         default:
             break;
@@ -356,6 +455,14 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
         case HOST_VERSION:
             val = s->control_regs.version;
             break;
+        case HOST_CCC_CTL:
+            if (s->control_regs.cap & HOST_CAP_CCC) {
+                val = s->control_regs.ccc_ctl;
+            }
+            break;
+        case HOST_CCC_PORTS:
+            val = s->control_regs.ccc_ports;
+            break;
         }
 
         DPRINTF(-1, "(addr 0x%08X), val 0x%08X\n", (unsigned) addr, val);
@@ -424,6 +531,9 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
                 }
                 break;
             case HOST_IRQ_STAT: /* R/WC, RO */
+                if (val & (1ULL << s->ports)) {
+                    s->ccc_pending = false;
+                }
                 s->control_regs.irqstatus &= ~val;
                 ahci_check_irq(s);
                 break;
@@ -433,6 +543,17 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             case HOST_VERSION: /* RO */
                 /* FIXME report write? */
                 break;
+            case HOST_CCC_CTL: /* R/W */
+                if (s->control_regs.cap & HOST_CAP_CCC) {
+                    ahci_ccc_write_ctl(s, val);
+                }
+                break;
+            case HOST_CCC_PORTS: /* R/W */
+                if (s->control_regs.cap & HOST_CAP_CCC) {
+                    s->control_regs.ccc_ports = val & s->control_regs.impl;
+                    ahci_check_irq(s);
+                }
+                break;
             default:
                 DPRINTF(-1, "write to unknown register 0x%x\n", (unsigned)addr);
         }
@@ -496,6 +617,10 @@ static void ahci_reg_init(AHCIState *s)
                           (AHCI_NUM_COMMAND_SLOTS << 8) |
                           (AHCI_SUPPORTED_SPEED_GEN1 << AHCI_SUPPORTED_SPEED) |
                           HOST_CAP_NCQ | HOST_CAP_AHCI;
+    /* The CCC interrupt takes the bit after the last port in irqstatus */
+    if (s->ccc && s->ports < AHCI_MAX_PORTS) {
+        s->control_regs.cap |= HOST_CAP_CCC;
+    }
 
     s->control_regs.impl = (1 << s->ports) - 1;
 
@@ -675,6 +800,7 @@ static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
     AHCIPortRegs *pr = &ad->port_regs;
     IDEState *ide_state;
     SDBFIS *sdb_fis;
+    int completed;
 
     if (!ad->res_fis ||
         !(pr->cmd & PORT_CMD_FIS_RX)) {
@@ -697,12 +823,14 @@ static void ahci_write_fis_sdb(AHCIState *s, NCQTransferState *ncq_tfs)
         (ad->port.ifs[0].status & 0x77) |
         (pr->tfdata & 0x88);
     pr->scr_act &= ~ad->finished;
+    completed = ctpop32(ad->finished);
     ad->finished = 0;
 
     /* Trigger IRQ if interrupt bit is set (which currently, it always is) */
     if (sdb_fis->flags & 0x40) {
         ahci_trigger_irq(s, ad, PORT_IRQ_SDB_FIS);
     }
+    ahci_ccc_complete(ad, completed);
 }
 
 static void ahci_write_fis_pio(AHCIDevice *ad, uint16_t len)
@@ -1406,12 +1534,10 @@ static void ahci_cmd_done(IDEDMA *dma)
 
     /* update d2h status */
     ahci_write_fis_d2h(ad, NULL);
+    ahci_ccc_complete(ad, 1);
 
-    if (!ad->check_bh) {
-        /* maybe we still have something to process, check later */
-        ad->check_bh = qemu_bh_new(ahci_check_cmd_bh, ad);
-        qemu_bh_schedule(ad->check_bh);
-    }
+    /* maybe we still have something to process, check later */
+    ahci_schedule_check_cmd(ad);
 }
 
 static void ahci_irq_set(void *opaque, int n, int level)
@@ -1444,6 +1570,8 @@ void ahci_init(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
     memory_region_init_io(&s->idp, OBJECT(qdev), &ahci_idp_ops, s,
                           "ahci-idp", 32);
 
+    s->ccc_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, ahci_ccc_timer_cb, s);
+
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
 
     for (i = 0; i < s->ports; i++) {
@@ -1462,6 +1590,7 @@ void ahci_init(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
 
 void ahci_uninit(AHCIState *s)
 {
+    timer_free(s->ccc_timer);
     g_free(s->dev);
 }
 
@@ -1480,6 +1609,7 @@ void ahci_reset(AHCIState *s)
      * We set HOST_CAP_AHCI so we must enable AHCI at reset.
      */
     s->control_regs.ghc = HOST_CTL_AHCI_EN;
+    ahci_ccc_reset(s);
 
     for (i = 0; i < s->ports; i++) {
         pr = &s->dev[i].port_regs;
@@ -1607,6 +1737,28 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool ahci_ccc_needed(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    return s->control_regs.cap & HOST_CAP_CCC;
+}
+
+static const VMStateDescription vmstate_ahci_ccc = {
+    .name = "ahci/ccc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ahci_ccc_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(control_regs.ccc_ctl, AHCIState),
+        VMSTATE_UINT32(control_regs.ccc_ports, AHCIState),
+        VMSTATE_UINT32(ccc_count, AHCIState),
+        VMSTATE_BOOL(ccc_pending, AHCIState),
+        VMSTATE_TIMER_PTR(ccc_timer, AHCIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
@@ -1623,6 +1775,10 @@ const VMStateDescription vmstate_ahci = {
         VMSTATE_INT32_EQUAL(ports, AHCIState),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ahci_ccc,
+        NULL
+    }
 };
 
 #define TYPE_SYSBUS_AHCI "sysbus-ahci"
@@ -1665,6 +1821,7 @@ static void sysbus_ahci_realize(DeviceState *dev, Error **errp)
 
 static Property sysbus_ahci_properties[] = {
     DEFINE_PROP_UINT32("num-ports", SysbusAHCIState, num_ports, 1),
+    DEFINE_PROP_BOOL("ccc", SysbusAHCIState, ahci.ccc, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
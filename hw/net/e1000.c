@@ -29,6 +29,8 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
+#include "net/tap.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
@@ -68,6 +70,8 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 
 #define MAXIMUM_ETHERNET_HDR_LEN (14+4)
 
+#define E1000_RX_DESC_PREFETCH 16  /* RX descriptors fetched by one DMA */
+
 /*
  * HW models:
  *  E1000_DEV_ID_82540EM works with Windows, Linux, and OS X <= 10.8
@@ -115,6 +119,7 @@ typedef struct E1000State_st {
         int8_t ip;
         int8_t tcp;
         char cptse;     // current packet tse bit
+        bool gso;       /* TSO frame gathered whole for the backend */
     } tx;
 
     struct {
@@ -130,14 +135,32 @@ typedef struct E1000State_st {
     QEMUTimer *mit_timer;      /* Mitigation timer. */
     bool mit_timer_on;         /* Mitigation timer is running. */
     bool mit_irq_level;        /* Tracks interrupt pin level. */
-    uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
+
+    /* RXT0 and TXDW held back by the interrupt delay timers */
+    QEMUTimer *delay_timer;
+    uint32_t delayed_causes;
+    int64_t rx_pkt_deadline;   /* RDTR */
+    int64_t rx_abs_deadline;   /* RADV */
+    int64_t tx_pkt_deadline;   /* TIDV */
+    int64_t tx_abs_deadline;   /* TADV */
+
+    /* RX descriptors fetched ahead, starting at ring index rx_desc_next */
+    struct e1000_rx_desc rx_desc[E1000_RX_DESC_PREFETCH];
+    uint32_t rx_desc_next;
+    unsigned int rx_desc_pos;
+    unsigned int rx_desc_count;
 
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
 #define E1000_FLAG_MIT_BIT 1
+#define E1000_FLAG_GSO_BIT 2
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
 #define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+#define E1000_FLAG_GSO (1 << E1000_FLAG_GSO_BIT)
     uint32_t compat_flags;
+
+    /* The peer takes a virtio-net header with every packet */
+    bool has_vnet_hdr;
 } E1000State;
 
 typedef struct E1000BaseClass {
@@ -168,7 +191,7 @@ enum {
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
     defreg(VET),        defreg(RDTR),   defreg(RADV),   defreg(TADV),
-    defreg(ITR),
+    defreg(ITR),        defreg(TIDV),
 };
 
 static void
@@ -277,21 +300,11 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
-/* Helper function, *curr == 0 means the value is not set */
-static inline void
-mit_update_delay(uint32_t *curr, uint32_t value)
-{
-    if (value && (*curr == 0 || value < *curr)) {
-        *curr = value;
-    }
-}
-
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
     PCIDevice *d = PCI_DEVICE(s);
     uint32_t pending_ints;
-    uint32_t mit_delay;
 
     s->mac_reg[ICR] = val;
 
@@ -310,37 +323,17 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
         /*
          * Here we detect a potential raising edge. We postpone raising the
          * interrupt line if we are inside the mitigation delay window
-         * (s->mit_timer_on == 1).
-         * We provide a partial implementation of interrupt mitigation,
-         * emulating only RADV, TADV and ITR (lower 16 bits, 1024ns units for
-         * RADV and TADV, 256ns units for ITR). RDTR is only used to enable
-         * RADV; relative timers based on TIDV and RDTR are not implemented.
+         * (s->mit_timer_on == 1), which ITR opens after every interrupt
+         * (lower 16 bits, 256ns units).  RDTR, RADV, TIDV and TADV delay
+         * the causes themselves, see e1000_delay_cause().
          */
         if (s->mit_timer_on) {
             return;
         }
-        if (s->compat_flags & E1000_FLAG_MIT) {
-            /* Compute the next mitigation delay according to pending
-             * interrupts and the current values of RADV (provided
-             * RDTR!=0), TADV and ITR.
-             * Then rearm the timer.
-             */
-            mit_delay = 0;
-            if (s->mit_ide &&
-                    (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
-                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
-            }
-            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
-                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
-            }
-            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
-
-            if (mit_delay) {
-                s->mit_timer_on = 1;
-                timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
-                          mit_delay * 256);
-            }
-            s->mit_ide = 0;
+        if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[ITR]) {
+            s->mit_timer_on = 1;
+            timer_mod(s->mit_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      s->mac_reg[ITR] * 256);
         }
     }
 
@@ -363,9 +356,95 @@ set_ics(E1000State *s, int index, uint32_t val)
 {
     DBGOUT(INTERRUPT, "set_ics %x, ICR %x, IMR %x\n", val, s->mac_reg[ICR],
         s->mac_reg[IMS]);
+    /* An interrupt for any cause reports the delayed ones as well */
+    if (s->delayed_causes && (val & s->mac_reg[IMS])) {
+        val |= s->delayed_causes;
+        s->delayed_causes = 0;
+        timer_del(s->delay_timer);
+    }
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+static void
+e1000_delay_rearm(E1000State *s)
+{
+    int64_t deadline = INT64_MAX;
+
+    if (s->delayed_causes & E1000_ICR_RXT0) {
+        deadline = MIN(deadline, s->rx_pkt_deadline);
+        deadline = MIN(deadline, s->rx_abs_deadline);
+    }
+    if (s->delayed_causes & E1000_ICR_TXDW) {
+        deadline = MIN(deadline, s->tx_pkt_deadline);
+        deadline = MIN(deadline, s->tx_abs_deadline);
+    }
+    if (deadline == INT64_MAX) {
+        timer_del(s->delay_timer);
+    } else {
+        timer_mod(s->delay_timer, deadline);
+    }
+}
+
+/*
+ * Post RXT0, or TXDW for descriptors with IDE set, through the interrupt
+ * delay timers.  The packet timer (RDTR, TIDV) restarts with every packet
+ * and the absolute timer (RADV, TADV) runs from the first packet that was
+ * held back; the cause is posted when either of them expires.  A zero
+ * packet timer posts at once.  Both count in 1.024us units.
+ */
+static void
+e1000_delay_cause(E1000State *s, uint32_t cause)
+{
+    bool rx = cause == E1000_ICR_RXT0;
+    uint32_t pkt_delay = s->mac_reg[rx ? RDTR : TIDV] & E1000_DELAY_MASK;
+    uint32_t abs_delay = s->mac_reg[rx ? RADV : TADV];
+    int64_t *pkt_deadline = rx ? &s->rx_pkt_deadline : &s->tx_pkt_deadline;
+    int64_t *abs_deadline = rx ? &s->rx_abs_deadline : &s->tx_abs_deadline;
+    int64_t now;
+
+    if (!(s->compat_flags & E1000_FLAG_MIT) || !pkt_delay) {
+        set_ics(s, 0, cause);
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    *pkt_deadline = now + pkt_delay * 1024;
+    if (!(s->delayed_causes & cause)) {
+        *abs_deadline = abs_delay ? now + abs_delay * 1024 : INT64_MAX;
+        s->delayed_causes |= cause;
+    }
+    e1000_delay_rearm(s);
+}
+
+/* Post the delayed causes in @mask now */
+static void
+e1000_delay_flush(E1000State *s, uint32_t mask)
+{
+    uint32_t causes = s->delayed_causes & mask;
+
+    if (causes) {
+        s->delayed_causes &= ~causes;
+        e1000_delay_rearm(s);
+        set_ics(s, 0, causes);
+    }
+}
+
+static void
+e1000_delay_timer(void *opaque)
+{
+    E1000State *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t expired = 0;
+
+    if (MIN(s->rx_pkt_deadline, s->rx_abs_deadline) <= now) {
+        expired |= E1000_ICR_RXT0;
+    }
+    if (MIN(s->tx_pkt_deadline, s->tx_abs_deadline) <= now) {
+        expired |= E1000_ICR_TXDW;
+    }
+    e1000_delay_flush(s, expired);
+}
+
 static void
 e1000_autoneg_timer(void *opaque)
 {
@@ -402,6 +481,13 @@ rxbufsize(uint32_t v)
     return 2048;
 }
 
+/* Forget the descriptors fetched ahead, after the ring was changed */
+static void
+e1000_rx_desc_flush(E1000State *s)
+{
+    s->rx_desc_pos = s->rx_desc_count = 0;
+}
+
 static void e1000_reset(void *opaque)
 {
     E1000State *d = opaque;
@@ -413,7 +499,9 @@ static void e1000_reset(void *opaque)
     timer_del(d->mit_timer);
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
-    d->mit_ide = 0;
+    timer_del(d->delay_timer);
+    d->delayed_causes = 0;
+    e1000_rx_desc_flush(d);
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     d->phy_reg[PHY_ID2] = edc->phy_id2;
@@ -446,6 +534,7 @@ set_ctrl(E1000State *s, int index, uint32_t val)
 static void
 set_rx_control(E1000State *s, int index, uint32_t val)
 {
+    e1000_rx_desc_flush(s);
     s->mac_reg[RCTL] = val;
     s->rxbuf_size = rxbufsize(val);
     s->rxbuf_min_shift = ((val / E1000_RCTL_RDMTS_QUAT) & 3) + 1;
@@ -599,14 +688,190 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static ssize_t
+e1000_do_receive_iov(E1000State *s, const struct iovec *iov, int iovcnt);
+
+#define E1000_SEND_MAX_IOV 2
+
+/* @hdr describes the offloads for the peer; NULL if there are none */
 static void
-e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+e1000_sendv_packet(E1000State *s, struct virtio_net_hdr *hdr,
+                   const struct iovec *iov, int iovcnt)
 {
+    static struct virtio_net_hdr no_offloads;
     NetClientState *nc = qemu_get_queue(s->nic);
+    struct iovec vec[E1000_SEND_MAX_IOV + 1];
+
+    assert(iovcnt <= E1000_SEND_MAX_IOV);
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+        e1000_do_receive_iov(s, iov, iovcnt);
+    } else if (s->has_vnet_hdr) {
+        vec[0].iov_base = hdr ? hdr : &no_offloads;
+        vec[0].iov_len = sizeof(struct virtio_net_hdr);
+        memcpy(&vec[1], iov, iovcnt * sizeof(*iov));
+        qemu_sendv_packet(nc, vec, iovcnt + 1);
     } else {
-        qemu_send_packet(nc, buf, size);
+        qemu_sendv_packet(nc, iov, iovcnt);
+    }
+}
+
+static void
+e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
+{
+    struct iovec iov = { .iov_base = (uint8_t *)buf, .iov_len = size };
+
+    e1000_sendv_packet(s, NULL, &iov, 1);
+}
+
+/*
+ * Whether the TSO frame that starts now can be gathered whole: it must be
+ * TCP, fit in tx.data, and ask for the TCP checksum.  Other frames are
+ * still segmented while their descriptors are fetched.
+ */
+static bool
+e1000_tx_can_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+
+    return tp->tcp && tp->mss &&
+        (tp->sum_needed & E1000_TXD_POPTS_TXSM) &&
+        tp->ipcss + sizeof(struct ip_header) <= tp->tucss &&
+        tp->tucss + sizeof(struct tcp_hdr) <= tp->hdr_len &&
+        tp->tucso + 2 <= tp->hdr_len &&
+        tp->hdr_len + tp->paylen <= sizeof(tp->data);
+}
+
+/*
+ * Segment a gathered TSO frame for a peer that cannot take it whole.
+ * Only the headers are copied, the payload of every segment is sent from
+ * where it lies in tx.data.
+ */
+static void
+xmit_gso_segments(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    uint8_t buf[4 + sizeof(tp->header)];
+    uint8_t *hdr = buf + 4;
+    unsigned int css = tp->ipcss, tucss = tp->tucss, hdr_len = tp->hdr_len;
+    unsigned int paylen = tp->size - hdr_len, off = 0, seg_len, n;
+    uint32_t seq = ldl_be_p(tp->data + tucss + 4), sum;
+    uint16_t ip_id = lduw_be_p(tp->data + css + 4);
+    uint16_t phsum = lduw_be_p(tp->data + tp->tucso);
+    struct iovec iov[2];
+
+    do {
+        seg_len = MIN(tp->mss, paylen - off);
+        memcpy(hdr, tp->data, hdr_len);
+        if (tp->ip) {
+            stw_be_p(hdr + css + 2, hdr_len + seg_len - css);
+            stw_be_p(hdr + css + 4, ip_id + off / tp->mss);
+        } else {
+            stw_be_p(hdr + css + 4, hdr_len + seg_len - css - 40);
+        }
+        stl_be_p(hdr + tucss + 4, seq + off);
+        if (off) {
+            hdr[tucss + 13] &= ~TH_CWR;
+        }
+        if (off + seg_len < paylen) {
+            hdr[tucss + 13] &= ~(TH_FIN | TH_PUSH);
+        }
+
+        /* Complete the pseudo-header sum, then sum the whole segment */
+        sum = phsum + hdr_len + seg_len - tucss;
+        stw_be_p(hdr + tp->tucso, (sum >> 16) + (sum & 0xffff));
+        sum = net_checksum_add(hdr_len - tucss, hdr + tucss);
+        sum += net_checksum_add_cont(seg_len, tp->data + hdr_len + off,
+                                     hdr_len - tucss);
+        stw_be_p(hdr + tp->tucso, net_checksum_finish(sum));
+        if (tp->sum_needed & E1000_TXD_POPTS_IXSM) {
+            putsum(hdr, hdr_len, tp->ipcso, tp->ipcss, tp->ipcse);
+        }
+
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = hdr_len;
+        if (tp->vlan_needed) {
+            memmove(buf, hdr, 12);
+            memcpy(buf + 12, tp->vlan_header, 4);
+            iov[0].iov_base = buf;
+            iov[0].iov_len += 4;
+        }
+        iov[1].iov_base = tp->data + hdr_len + off;
+        iov[1].iov_len = seg_len;
+        e1000_sendv_packet(s, NULL, iov, 2);
+
+        s->mac_reg[TPT]++;
+        s->mac_reg[GPTC]++;
+        n = s->mac_reg[TOTL];
+        s->mac_reg[TOTL] += hdr_len + seg_len;
+        if (s->mac_reg[TOTL] < n) {
+            s->mac_reg[TOTH]++;
+        }
+        off += seg_len;
+    } while (off < paylen);
+}
+
+/* Send a gathered TSO frame whole, for the backend to segment */
+static void
+xmit_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    struct virtio_net_hdr hdr = {};
+    unsigned int css = tp->ipcss, len, frames, n;
+    uint32_t phsum;
+    struct iovec iov;
+
+    if (!s->has_vnet_hdr || (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK)) {
+        xmit_gso_segments(s);
+        return;
+    }
+
+    iov.iov_base = tp->data;
+    iov.iov_len = tp->size;
+
+    if (tp->ip) {
+        stw_be_p(tp->data + css + 2, tp->size - css);
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    } else {
+        stw_be_p(tp->data + css + 4, tp->size - css - 40);
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+    if (tp->data[tp->tucss + 13] & TH_CWR) {
+        hdr.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+    }
+
+    /* The guest left the pseudo-header sum without the length there */
+    len = tp->size - tp->tucss;
+    phsum = lduw_be_p(tp->data + tp->tucso) + len;
+    phsum = (phsum >> 16) + (phsum & 0xffff);
+    stw_be_p(tp->data + tp->tucso, phsum);
+    if (tp->sum_needed & E1000_TXD_POPTS_IXSM) {
+        putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
+    }
+
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.hdr_len = tp->hdr_len;
+    hdr.gso_size = tp->mss;
+    hdr.csum_start = tp->tucss;
+    hdr.csum_offset = tp->tucso - tp->tucss;
+    if (tp->vlan_needed) {
+        memmove(tp->vlan, tp->data, 4);
+        memmove(tp->data, tp->data + 4, 8);
+        memcpy(tp->data + 8, tp->vlan_header, 4);
+        iov.iov_base = tp->vlan;
+        iov.iov_len += 4;
+        hdr.hdr_len += 4;
+        hdr.csum_start += 4;
+    }
+    e1000_sendv_packet(s, &hdr, &iov, 1);
+
+    /* Account for the frames that the hardware would have sent */
+    frames = MAX(DIV_ROUND_UP(tp->size - tp->hdr_len, tp->mss), 1);
+    s->mac_reg[TPT] += frames;
+    s->mac_reg[GPTC] += frames;
+    n = s->mac_reg[TOTL];
+    s->mac_reg[TOTL] += tp->size + (frames - 1) * tp->hdr_len;
+    if (s->mac_reg[TOTL] < n) {
+        s->mac_reg[TOTH]++;
     }
 }
 
@@ -617,6 +882,13 @@ xmit_seg(E1000State *s)
     unsigned int frames = s->tx.tso_frames, css, sofar, n;
     struct e1000_tx *tp = &s->tx;
 
+    if (tp->gso) {
+        if (tp->size >= tp->hdr_len) {
+            xmit_gso(s);
+        }
+        return;
+    }
+
     if (tp->tse && tp->cptse) {
         css = tp->ipcss;
         DBGOUT(TXSUM, "frames %d size %d ipcss %d\n",
@@ -678,7 +950,6 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     struct e1000_context_desc *xp = (struct e1000_context_desc *)dp;
     struct e1000_tx *tp = &s->tx;
 
-    s->mit_ide |= (txd_lower & E1000_TXD_CMD_IDE);
     if (dtype == E1000_TXD_CMD_DEXT) {	// context descriptor
         op = le32_to_cpu(xp->cmd_and_length);
         tp->ipcss = xp->lower_setup.ip_fields.ipcss;
@@ -720,7 +991,15 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && tp->size == 0) {
+        tp->gso = e1000_tx_can_gso(s);
+    }
+    if (tp->gso) {
+        /* Gather the whole frame; the backend segments it */
+        split_size = MIN(sizeof(tp->data) - tp->size, split_size);
+        pci_dma_read(d, addr, tp->data + tp->size, split_size);
+        tp->size += split_size;
+    } else if (tp->tse && tp->cptse) {
         msh = tp->hdr_len + tp->mss;
         do {
             bytes = split_size;
@@ -760,6 +1039,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->vlan_needed = 0;
     tp->size = 0;
     tp->cptse = 0;
+    tp->gso = false;
 }
 
 static uint32_t
@@ -793,6 +1073,7 @@ start_xmit(E1000State *s)
     dma_addr_t base;
     struct e1000_tx_desc desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    uint32_t delayed = 0, n;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -809,7 +1090,12 @@ start_xmit(E1000State *s)
                desc.upper.data);
 
         process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+        n = txdesc_writeback(s, base, &desc);
+        if (le32_to_cpu(desc.lower.data) & E1000_TXD_CMD_IDE) {
+            delayed |= n;
+        } else {
+            cause |= n;
+        }
 
         if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
             s->mac_reg[TDH] = 0;
@@ -824,6 +1110,9 @@ start_xmit(E1000State *s)
             break;
         }
     }
+    if (delayed) {
+        e1000_delay_cause(s, E1000_ICR_TXDW);
+    }
     set_ics(s, 0, cause);
 }
 
@@ -940,10 +1229,33 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/*
+ * Read the RX descriptor at RDH.  The descriptors from RDH up to RDT
+ * belong to the hardware, so up to E1000_RX_DESC_PREFETCH of them are
+ * fetched with one DMA and handed out by the following calls.
+ */
+static void
+e1000_rx_desc_fetch(E1000State *s, struct e1000_rx_desc *desc)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+    uint32_t ring = s->mac_reg[RDLEN] / sizeof(*desc);
+    uint32_t end;
+
+    if (s->rx_desc_pos == s->rx_desc_count || s->rx_desc_next != rdh) {
+        end = MIN(s->mac_reg[RDT] > rdh ? s->mac_reg[RDT] : ring, ring);
+        s->rx_desc_count = end > rdh ?
+                           MIN(end - rdh, E1000_RX_DESC_PREFETCH) : 1;
+        s->rx_desc_pos = 0;
+        pci_dma_read(PCI_DEVICE(s), rx_desc_base(s) + sizeof(*desc) * rdh,
+                     s->rx_desc, sizeof(*desc) * s->rx_desc_count);
+    }
+    *desc = s->rx_desc[s->rx_desc_pos++];
+    s->rx_desc_next = rdh + 1;
+}
+
 static ssize_t
-e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+e1000_do_receive_iov(E1000State *s, const struct iovec *iov, int iovcnt)
 {
-    E1000State *s = qemu_get_nic_opaque(nc);
     PCIDevice *d = PCI_DEVICE(s);
     struct e1000_rx_desc desc;
     dma_addr_t base;
@@ -1024,7 +1336,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
             desc_size = s->rxbuf_size;
         }
         base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(d, base, &desc, sizeof(desc));
+        e1000_rx_desc_fetch(s, &desc);
         desc.special = vlan_special;
         desc.status |= (vlan_status | E1000_RXD_STAT_DD);
         if (desc.buffer_addr) {
@@ -1083,18 +1395,60 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->mac_reg[TORH]++;
     s->mac_reg[TORL] = n;
 
-    n = E1000_ICS_RXT0;
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
         rdt += s->mac_reg[RDLEN] / sizeof(desc);
     if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
-        s->rxbuf_min_shift)
-        n |= E1000_ICS_RXDMT0;
-
-    set_ics(s, 0, n);
+        s->rxbuf_min_shift) {
+        /* Running out of buffers is never delayed */
+        set_ics(s, 0, E1000_ICS_RXT0 | E1000_ICS_RXDMT0);
+    } else {
+        e1000_delay_cause(s, E1000_ICR_RXT0);
+    }
 
     return size;
 }
 
+static ssize_t
+e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    const size_t hdr_len = sizeof(struct virtio_net_hdr);
+    struct virtio_net_hdr hdr;
+    struct iovec *vec, one;
+    size_t size;
+    ssize_t ret;
+    int n;
+
+    if (!s->has_vnet_hdr) {
+        return e1000_do_receive_iov(s, iov, iovcnt);
+    }
+
+    /*
+     * No receive offloads are enabled on the peer, so the header has
+     * nothing for us; checksums arrive complete.  Anything that still
+     * claims to be a GSO packet cannot be received by the card.
+     */
+    size = iov_size(iov, iovcnt);
+    if (size < hdr_len) {
+        return size;
+    }
+    iov_to_buf(iov, iovcnt, 0, &hdr, hdr_len);
+    if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        return size;
+    }
+
+    if (iovcnt == 1) {
+        one.iov_base = (uint8_t *)iov->iov_base + hdr_len;
+        one.iov_len = iov->iov_len - hdr_len;
+        return e1000_do_receive_iov(s, &one, 1);
+    }
+    vec = g_new(struct iovec, iovcnt);
+    n = iov_copy(vec, iovcnt, iov, iovcnt, hdr_len, size - hdr_len);
+    ret = e1000_do_receive_iov(s, vec, n);
+    g_free(vec);
+    return ret;
+}
+
 static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -1176,6 +1530,28 @@ set_dlen(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xfff80;
 }
 
+static void
+set_rx_ring(E1000State *s, int index, uint32_t val)
+{
+    e1000_rx_desc_flush(s);
+    if (index == RDLEN) {
+        set_dlen(s, index, val);
+    } else if (index == RDH) {
+        set_16bit(s, index, val);
+    } else {
+        s->mac_reg[index] = val;
+    }
+}
+
+static void
+set_delay(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_DELAY_MASK;
+    if (val & E1000_DELAY_FPD) {
+        e1000_delay_flush(s, index == RDTR ? E1000_ICR_RXT0 : E1000_ICR_TXDW);
+    }
+}
+
 static void
 set_tctl(E1000State *s, int index, uint32_t val)
 {
@@ -1214,7 +1590,7 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
     getreg(TDLEN),      getreg(RDLEN),  getreg(RDTR),   getreg(RADV),
-    getreg(TADV),       getreg(ITR),
+    getreg(TADV),       getreg(ITR),    getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1229,15 +1605,16 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)	[x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),	putreg(EERD),	putreg(SWSM),	putreg(WUFC),
-    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(RDBAH),
-    putreg(RDBAL),	putreg(LEDCTL), putreg(VET),
-    [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
+    putreg(TDBAL),      putreg(TDBAH),  putreg(TXDCTL), putreg(LEDCTL),
+    putreg(VET),
+    [RDBAL] = set_rx_ring, [RDBAH] = set_rx_ring, [RDLEN] = set_rx_ring,
+    [TDLEN] = set_dlen, [TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
-    [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [TDH] = set_16bit,  [RDH] = set_rx_ring,    [RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
-    [RDTR] = set_16bit, [RADV] = set_16bit,     [TADV] = set_16bit,
-    [ITR] = set_16bit,
+    [RDTR] = set_delay, [RADV] = set_16bit,     [TADV] = set_16bit,
+    [ITR] = set_16bit,  [TIDV] = set_delay,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1319,7 +1696,9 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
-    /* If the mitigation timer is active, emulate a timeout now. */
+    /* Post the delayed causes, and if the mitigation timer is active,
+     * emulate a timeout now. */
+    e1000_delay_flush(s, ~0);
     if (s->mit_timer_on) {
         e1000_mit_timer(s);
     }
@@ -1341,11 +1720,12 @@ static int e1000_post_load(void *opaque, int version_id)
 
     if (!(s->compat_flags & E1000_FLAG_MIT)) {
         s->mac_reg[ITR] = s->mac_reg[RDTR] = s->mac_reg[RADV] =
-            s->mac_reg[TADV] = 0;
+            s->mac_reg[TADV] = s->mac_reg[TIDV] = 0;
         s->mit_irq_level = false;
     }
-    s->mit_ide = 0;
     s->mit_timer_on = false;
+    s->delayed_causes = 0;
+    e1000_rx_desc_flush(s);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS].
@@ -1384,6 +1764,42 @@ static const VMStateDescription vmstate_e1000_mit_state = {
     }
 };
 
+static bool e1000_tidv_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->mac_reg[TIDV] != 0;
+}
+
+static const VMStateDescription vmstate_e1000_tidv = {
+    .name = "e1000/tidv",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = e1000_tidv_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool e1000_tx_gso_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->tx.gso;
+}
+
+static const VMStateDescription vmstate_e1000_tx_gso = {
+    .name = "e1000/tx_gso",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = e1000_tx_gso_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(tx.gso, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1463,6 +1879,8 @@ static const VMStateDescription vmstate_e1000 = {
     },
     .subsections = (const VMStateDescription*[]) {
         &vmstate_e1000_mit_state,
+        &vmstate_e1000_tx_gso,
+        &vmstate_e1000_tidv,
         NULL
     }
 };
@@ -1511,6 +1929,8 @@ pci_e1000_uninit(PCIDevice *dev)
     timer_free(d->autoneg_timer);
     timer_del(d->mit_timer);
     timer_free(d->mit_timer);
+    timer_del(d->delay_timer);
+    timer_free(d->delay_timer);
     qemu_del_nic(d->nic);
 }
 
@@ -1542,6 +1962,7 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
     DeviceState *dev = DEVICE(pci_dev);
     E1000State *d = E1000(pci_dev);
     PCIDeviceClass *pdc = PCI_DEVICE_GET_CLASS(pci_dev);
+    NetClientState *nc;
     uint8_t *pci_conf;
     uint16_t checksum = 0;
     int i;
@@ -1576,11 +1997,19 @@ static void pci_e1000_realize(PCIDevice *pci_dev, Error **errp)
 
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           object_get_typename(OBJECT(d)), dev->id, d);
+    nc = qemu_get_queue(d->nic);
 
-    qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
+    if ((d->compat_flags & E1000_FLAG_GSO) && qemu_has_vnet_hdr(nc->peer)) {
+        d->has_vnet_hdr = true;
+        qemu_set_vnet_hdr_len(nc->peer, sizeof(struct virtio_net_hdr));
+        qemu_using_vnet_hdr(nc->peer, true);
+    }
+
+    qemu_format_nic_info_str(nc, macaddr);
 
     d->autoneg_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, e1000_autoneg_timer, d);
     d->mit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_mit_timer, d);
+    d->delay_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000_delay_timer, d);
 }
 
 static void qdev_e1000_reset(DeviceState *dev)
@@ -1595,6 +2024,8 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_AUTONEG_BIT, true),
     DEFINE_PROP_BIT("mitigation", E1000State,
                     compat_flags, E1000_FLAG_MIT_BIT, true),
+    DEFINE_PROP_BIT("gso", E1000State,
+                    compat_flags, E1000_FLAG_GSO_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
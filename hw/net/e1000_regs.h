@@ -629,6 +629,10 @@
 #define E1000_STATUS_SERDES0_DIS  0x10000000 /* SERDES disabled on port 0 */
 #define E1000_STATUS_SERDES1_DIS  0x20000000 /* SERDES disabled on port 1 */
 
+/* Interrupt Delay Timers (RDTR, TIDV) */
+#define E1000_DELAY_MASK     0x0000FFFF /* Delay, in 1.024 usec units */
+#define E1000_DELAY_FPD      0x80000000 /* Flush Partial Descriptor block */
+
 /* EEPROM/Flash Control */
 #define E1000_EECD_SK        0x00000001 /* EEPROM Clock */
 #define E1000_EECD_CS        0x00000002 /* EEPROM Chip Select */
@@ -160,6 +160,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = net->nc->queue_index * net->dev.nvqs;
 
     r = vhost_dev_init(&net->dev, options->opaque,
                        options->backend_type);
@@ -332,6 +333,15 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         if (r < 0) {
             goto err_start;
         }
+
+        /* A restarted backend begins with all rings disabled */
+        if (ncs[i].peer->vring_enable) {
+            r = vhost_set_vring_enable(ncs[i].peer, 1);
+            if (r < 0) {
+                vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
+                goto err_start;
+            }
+        }
     }
 
     return 0;
@@ -390,6 +400,36 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
     vhost_virtqueue_mask(&net->dev, dev, idx, mask);
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return net->dev.acked_features;
+}
+
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return net->dev.max_queues;
+}
+
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout)
+{
+    return vhost_dev_set_busyloop_timeout(&net->dev, timeout);
+}
+
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net)
+{
+    return net->dev.busyloop_timeout;
+}
+
+bool vhost_net_is_started(VHostNetState *net)
+{
+    return net->dev.started;
+}
+
+VhostBackendType vhost_net_get_backend_type(VHostNetState *net)
+{
+    return net->dev.vhost_ops->backend_type;
+}
+
 VHostNetState *get_vhost_net(NetClientState *nc)
 {
     VHostNetState *vhost_net = 0;
@@ -411,6 +451,28 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 
     return vhost_net;
 }
+
+/* Enable or disable the rings of a multiqueue peer.  The state is kept in
+ * @nc, so that it can be restored when the backend is started again.
+ */
+int vhost_set_vring_enable(NetClientState *nc, int enable)
+{
+    VHostNetState *net = get_vhost_net(nc);
+    const VhostOps *vhost_ops;
+
+    nc->vring_enable = enable;
+
+    if (!net) {
+        return 0;
+    }
+
+    vhost_ops = net->dev.vhost_ops;
+    if (vhost_ops->vhost_backend_set_vring_enable) {
+        return vhost_ops->vhost_backend_set_vring_enable(&net->dev, enable);
+    }
+
+    return 0;
+}
 #else
 struct vhost_net *vhost_net_init(VhostNetOptions *options)
 {
@@ -452,8 +514,43 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
 {
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return 0;
+}
+
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return 1;
+}
+
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout)
+{
+    return -ENOSYS;
+}
+
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net)
+{
+    return 0;
+}
+
+bool vhost_net_is_started(VHostNetState *net)
+{
+    return false;
+}
+
+VhostBackendType vhost_net_get_backend_type(VHostNetState *net)
+{
+    return VHOST_BACKEND_TYPE_NONE;
+}
+
 VHostNetState *get_vhost_net(NetClientState *nc)
 {
     return 0;
 }
+
+int vhost_set_vring_enable(NetClientState *nc, int enable)
+{
+    return 0;
+}
 #endif
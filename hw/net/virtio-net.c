@@ -15,6 +15,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -38,17 +39,19 @@
     (offsetof(container, field) + sizeof(((container *)0)->field))
 
 typedef struct VirtIOFeature {
-    uint32_t flags;
+    uint64_t flags;
     size_t end;
 } VirtIOFeature;
 
 static VirtIOFeature feature_sizes[] = {
-    {.flags = 1 << VIRTIO_NET_F_MAC,
+    {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
-    {.flags = 1 << VIRTIO_NET_F_STATUS,
+    {.flags = 1ULL << VIRTIO_NET_F_STATUS,
      .end = endof(struct virtio_net_config, status)},
-    {.flags = 1 << VIRTIO_NET_F_MQ,
+    {.flags = 1ULL << VIRTIO_NET_F_MQ,
      .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -71,11 +74,16 @@ static int vq2q(int queue_index)
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg;
+    struct virtio_net_config netcfg = {};
 
     virtio_stw_p(vdev, &netcfg.status, n->status);
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -344,6 +352,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    memset(&n->rss_data, 0, sizeof(n->rss_data));
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -372,28 +381,35 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
+    size_t peer_hdr_len;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
             sizeof(struct virtio_net_hdr);
     }
 
+    /* The hash fields are filled in by us, never by the peer */
+    peer_hdr_len = MIN(n->guest_hdr_len,
+                       sizeof(struct virtio_net_hdr_mrg_rxbuf));
+
     for (i = 0; i < n->max_queues; i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
-            qemu_has_vnet_hdr_len(nc->peer, n->guest_hdr_len)) {
-            qemu_set_vnet_hdr_len(nc->peer, n->guest_hdr_len);
-            n->host_hdr_len = n->guest_hdr_len;
+            qemu_has_vnet_hdr_len(nc->peer, peer_hdr_len)) {
+            qemu_set_vnet_hdr_len(nc->peer, peer_hdr_len);
+            n->host_hdr_len = peer_hdr_len;
         }
     }
 }
@@ -406,6 +422,10 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return vhost_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -421,6 +441,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return vhost_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -474,6 +498,15 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* Steering and hashing are done by virtio_net_receive(), which vhost
+     * bypasses; both are configured through the control queue.
+     */
+    if (get_vhost_net(nc->peer) ||
+        !__virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
@@ -535,7 +568,14 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                __virtio_has_feature(features,
                                                     VIRTIO_NET_F_MRG_RXBUF),
                                __virtio_has_feature(features,
-                                                    VIRTIO_F_VERSION_1));
+                                                    VIRTIO_F_VERSION_1),
+                               __virtio_has_feature(features,
+                                                    VIRTIO_NET_F_HASH_REPORT));
+
+    if (!__virtio_has_feature(features, VIRTIO_NET_F_RSS) &&
+        !__virtio_has_feature(features, VIRTIO_NET_F_HASH_REPORT)) {
+        memset(&n->rss_data, 0, sizeof(n->rss_data));
+    }
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -771,6 +811,94 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse a virtio_net_rss_config, or with !@do_rss the virtio_net_hash_config
+ * that shares its layout.  Returns the number of queue pairs the
+ * configuration needs, or 0 if it is invalid.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData rss = {};
+    struct {
+        uint32_t hash_types;
+        uint16_t indirection_table_mask;
+        uint16_t unclassified_queue;
+    } QEMU_PACKED head;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t s, offset = 0;
+    uint16_t queues;
+    int i;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &head, sizeof(head));
+    if (s != sizeof(head)) {
+        return 0;
+    }
+    offset += s;
+    rss.hash_types = virtio_ldl_p(vdev, &head.hash_types);
+    if (rss.hash_types & ~VIRTIO_NET_RSS_SUPPORTED_HASHES) {
+        return 0;
+    }
+
+    if (do_rss) {
+        rss.indirections_len =
+            virtio_lduw_p(vdev, &head.indirection_table_mask) + 1;
+        rss.default_queue = virtio_lduw_p(vdev, &head.unclassified_queue);
+    } else {
+        /* The reserved fields stand for a table with one entry */
+        rss.indirections_len = 1;
+    }
+    if (rss.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(rss.indirections_len)) {
+        return 0;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, rss.indirections_table,
+                   rss.indirections_len * sizeof(uint16_t));
+    if (s != rss.indirections_len * sizeof(uint16_t)) {
+        return 0;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail) || tail.hash_key_length > sizeof(rss.key)) {
+        return 0;
+    }
+    offset += s;
+    s = iov_to_buf(iov, iov_cnt, offset, rss.key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        return 0;
+    }
+
+    if (!do_rss) {
+        rss.indirections_table[0] = 0;
+        rss.populate_hash = rss.hash_types != 0;
+        n->rss_data = rss;
+        return n->curr_queues;
+    }
+
+    /* Every receive queue the guest steers to must be in use */
+    queues = MAX(virtio_lduw_p(vdev, &tail.max_tx_vq), rss.default_queue + 1);
+    for (i = 0; i < rss.indirections_len; i++) {
+        rss.indirections_table[i] =
+            virtio_lduw_p(vdev, &rss.indirections_table[i]);
+        queues = MAX(queues, rss.indirections_table[i] + 1);
+    }
+    if (queues > (n->multiqueue ? n->max_queues : 1)) {
+        return 0;
+    }
+
+    rss.enabled = true;
+    rss.populate_hash = virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT) &&
+                        rss.hash_types != 0;
+    n->rss_data = rss;
+    return queues;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -779,21 +907,37 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        if (!virtio_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        if (!virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+            queues > n->max_queues ||
+            !n->multiqueue) {
+            return VIRTIO_NET_ERR;
+        }
+        /* Automatic receive steering again */
+        n->rss_data.enabled = false;
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
-    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
-        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
-        queues > n->max_queues ||
-        !n->multiqueue) {
+    if (!queues) {
         return VIRTIO_NET_ERR;
     }
 
@@ -810,20 +954,21 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov_cnt = elem.out_num;
-        iov2 = iov = g_memdup(elem.out_sg, sizeof(struct iovec) * elem.out_num);
+        iov_cnt = elem->out_num;
+        iov2 = iov = g_memdup(elem->out_sg,
+                              sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
@@ -842,12 +987,14 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status,
+                         sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
+        virtqueue_free_element(elem);
     }
 }
 
@@ -857,8 +1004,17 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    if (!n->rss_data.enabled) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+        return;
+    }
+
+    /* Packets steered to this queue may wait in the queue of any peer */
+    for (i = 0; i < n->peer_queues; i++) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1011,20 +1167,124 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/*
+ * Gather the fields the enabled hash types cover from the Ethernet frame
+ * @buf into @input.  Returns the VIRTIO_NET_HASH_REPORT_* type of the hash,
+ * or VIRTIO_NET_HASH_REPORT_NONE if the packet has none.
+ */
+static uint16_t virtio_net_rss_input(VirtIONet *n, const uint8_t *buf,
+                                     size_t size, uint8_t *input, size_t *len)
+{
+    uint32_t types = n->rss_data.hash_types;
+    size_t l3 = sizeof(struct eth_header);
+    size_t l4;
+    uint16_t proto, report;
+    uint8_t l4proto;
+    bool fragment = false;
+
+    if (size < l3) {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+    proto = lduw_be_p(buf + 12);
+    if (proto == ETH_P_VLAN && size >= l3 + sizeof(struct vlan_header)) {
+        proto = lduw_be_p(buf + 16);
+        l3 += sizeof(struct vlan_header);
+    }
+
+    /* The IPv6 hash types and reports follow those of IPv4 */
+    if (proto == ETH_P_IP && size >= l3 + sizeof(struct ip_header) &&
+        (buf[l3] >> 4) == IP_HEADER_VERSION_4 &&
+        IP_HDR_GET_LEN(buf + l3) >= sizeof(struct ip_header)) {
+        report = VIRTIO_NET_HASH_REPORT_IPv4;
+        memcpy(input, buf + l3 + offsetof(struct ip_header, ip_src), 8);
+        *len = 8;
+        l4 = l3 + IP_HDR_GET_LEN(buf + l3);
+        l4proto = buf[l3 + offsetof(struct ip_header, ip_p)];
+        fragment = lduw_be_p(buf + l3 + offsetof(struct ip_header, ip_off)) &
+                   (IP_MF | IP_OFFMASK);
+    } else if (proto == ETH_P_IPV6 && size >= l3 + sizeof(struct ip6_header) &&
+               (buf[l3] >> 4) == IP_HEADER_VERSION_6) {
+        report = VIRTIO_NET_HASH_REPORT_IPv6;
+        types >>= 3;
+        memcpy(input, buf + l3 + offsetof(struct ip6_header, ip6_src), 32);
+        *len = 32;
+        l4 = l3 + sizeof(struct ip6_header);
+        l4proto = ((struct ip6_header *)(buf + l3))->ip6_nxt;
+    } else {
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    /* The ports come first in TCP and UDP headers alike */
+    if (!fragment && size >= l4 + 4) {
+        if ((l4proto == IP_PROTO_TCP && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4))
+            || (l4proto == IP_PROTO_UDP &&
+                (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4))) {
+            memcpy(input + *len, buf + l4, 4);
+            *len += 4;
+            return report + (l4proto == IP_PROTO_TCP ? 1 : 2);
+        }
+    }
+    if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+        return report;
+    }
+    return VIRTIO_NET_HASH_REPORT_NONE;
+}
+
+/* Hash the frame @buf; returns the receive queue RSS steers it to */
+static int virtio_net_process_rss(VirtIONet *n, const uint8_t *buf,
+                                  size_t size, uint32_t *hash_value,
+                                  uint16_t *hash_report)
+{
+    VirtioNetRssData *rss = &n->rss_data;
+    uint8_t input[36];
+    size_t len;
+
+    *hash_report = virtio_net_rss_input(n, buf, size, input, &len);
+    if (*hash_report == VIRTIO_NET_HASH_REPORT_NONE) {
+        *hash_value = 0;
+        return rss->default_queue;
+    }
+
+    *hash_value = net_toeplitz_hash(rss->key, input, len);
+    return rss->indirections_table[*hash_value & (rss->indirections_len - 1)];
+}
+
+/* Sets q->rx_notify if the packet was placed in the rx ring of queue q */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetQueue *q;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    uint32_t hash_value = 0;
+    uint16_t hash_report = VIRTIO_NET_HASH_REPORT_NONE;
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
     }
 
+    if (n->rss_data.enabled || n->rss_data.populate_hash) {
+        int index = virtio_net_process_rss(n, buf + n->host_hdr_len,
+                                           size - n->host_hdr_len,
+                                           &hash_value, &hash_report);
+
+        if (n->rss_data.enabled && index != nc->queue_index) {
+            nc = qemu_get_subqueue(n->nic, index);
+            if (!virtio_net_can_receive(nc)) {
+                return -1;
+            }
+        }
+        if (!n->rss_data.populate_hash) {
+            hash_report = VIRTIO_NET_HASH_REPORT_NONE;
+            hash_value = 0;
+        }
+    }
+    q = virtio_net_get_subqueue(nc);
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1036,13 +1296,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1055,21 +1316,33 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size);
+            if (virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+                struct virtio_net_hdr_v1_hash hdr;
+
+                virtio_stl_p(vdev, &hdr.hash_value, hash_value);
+                virtio_stw_p(vdev, &hdr.hash_report, hash_report);
+                hdr.padding = 0;
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(typeof(hdr), hash_value),
+                             &hdr.hash_value,
+                             sizeof(hdr) - offsetof(typeof(hdr), hash_value));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1078,7 +1351,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -1093,11 +1366,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            virtqueue_discard(q->rx_vq, elem, total);
+            virtqueue_free_element(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_free_element(elem);
     }
 
     if (mhdr_cnt) {
@@ -1108,11 +1384,55 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_notify = true;
 
     return size;
 }
 
+/* Interrupt the guest for the queues virtio_net_do_receive() filled */
+static void virtio_net_rx_notify(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int i = n->rss_data.enabled ? 0 : nc->queue_index;
+    int end = n->rss_data.enabled ? n->curr_queues : nc->queue_index + 1;
+
+    for (; i < end; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify) {
+            q->rx_notify = false;
+            virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+        }
+    }
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size);
+    virtio_net_rx_notify(nc);
+    return ret;
+}
+
+/* Like virtio_net_receive(), but interrupt the guest once per batch */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (virtio_net_do_receive(nc, pkts[i].iov_base,
+                                  pkts[i].iov_len) == 0) {
+            break;
+        }
+    }
+
+    virtio_net_rx_notify(nc);
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1121,10 +1441,12 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    virtqueue_free_element(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
@@ -1135,24 +1457,42 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, num = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    for (i = 0; num_packets < n->tx_burst; i++) {
+        VirtQueueElement *elem;
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num;
+        struct iovec *out_sg;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1];
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+        struct virtio_net_hdr_mrg_rxbuf *mhdr = &q->tx_hdr;
+
+        if (i == num) {
+            /* Fetch the next batch, without going above the burst size */
+            num = virtqueue_pop_batch(q->tx_vq, (void **)elems,
+                                      sizeof(VirtQueueElement),
+                                      MIN(VIRTIO_NET_TX_BATCH,
+                                          n->tx_burst - num_packets));
+            if (!num) {
+                break;
+            }
+            i = 0;
+        }
+
+        elem = elems[i];
+        out_num = elem->out_num;
+        out_sg = &elem->out_sg[0];
 
         if (out_num < 1) {
             error_report("virtio-net header not in first element");
@@ -1160,14 +1500,14 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         }
 
         if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            if (iov_to_buf(out_sg, out_num, 0, mhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
                 error_report("virtio-net header incorrect");
                 exit(1);
             }
             if (virtio_needs_swap(vdev)) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
+                virtio_net_hdr_swap(vdev, (void *) mhdr);
+                sg2[0].iov_base = mhdr;
                 sg2[0].iov_len = n->guest_hdr_len;
                 out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                    out_sg, out_num,
@@ -1198,23 +1538,46 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        if (queue_index >= n->peer_queues) {
+            /* Not our own peer, so no completion callback: a packet that
+             * has to wait is copied into the queue.
+             */
+            qemu_sendv_packet(qemu_get_subqueue(n->nic,
+                                                queue_index % n->peer_queues),
+                              out_sg, out_num);
+            goto drop;
+        }
+
+        /* The element keeps the guest buffers mapped until it is pushed in
+         * virtio_net_tx_complete(), so a queued packet can point to them.
+         */
+        if (n->net_conf.tx_zerocopy) {
+            ret = qemu_sendv_packet_zerocopy(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        } else {
+            ret = qemu_sendv_packet_async(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        }
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
+            /* Hand the rest of the batch back, newest first */
+            while (--num > i) {
+                virtqueue_discard(q->tx_vq, elems[num], 0);
+                virtqueue_free_element(elems[num]);
+            }
             return -EBUSY;
         }
 
         len += ret;
 drop:
-        virtqueue_push(q->tx_vq, &elem, 0);
+        virtqueue_push(q->tx_vq, elem, 0);
         virtio_notify(vdev, q->tx_vq);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+        virtqueue_free_element(elem);
+        num_packets++;
     }
     return num_packets;
 }
@@ -1364,6 +1727,8 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     } else {
         qemu_bh_delete(q->tx_bh);
     }
+    virtqueue_free_element(q->async_tx.elem);
+    q->async_tx.elem = NULL;
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
@@ -1456,6 +1821,19 @@ static void virtio_net_save_device(VirtIODevice *vdev, QEMUFile *f)
     if (virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         qemu_put_be64(f, n->curr_guest_offloads);
     }
+
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_RSS) ||
+        virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        qemu_put_byte(f, n->rss_data.enabled);
+        qemu_put_byte(f, n->rss_data.populate_hash);
+        qemu_put_be32(f, n->rss_data.hash_types);
+        qemu_put_buffer(f, n->rss_data.key, sizeof(n->rss_data.key));
+        qemu_put_be16(f, n->rss_data.indirections_len);
+        for (i = 0; i < n->rss_data.indirections_len; i++) {
+            qemu_put_be16(f, n->rss_data.indirections_table[i]);
+        }
+        qemu_put_be16(f, n->rss_data.default_queue);
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -1479,7 +1857,9 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
     n->vqs[0].tx_waiting = qemu_get_be32(f);
 
     virtio_net_set_mrg_rx_bufs(n, qemu_get_be32(f),
-                               virtio_has_feature(vdev, VIRTIO_F_VERSION_1));
+                               virtio_has_feature(vdev, VIRTIO_F_VERSION_1),
+                               virtio_has_feature(vdev,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (version_id >= 3)
         n->status = qemu_get_be16(f);
@@ -1568,6 +1948,38 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
         n->curr_guest_offloads = virtio_net_supported_guest_offloads(n);
     }
 
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_RSS) ||
+        virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        VirtioNetRssData *rss = &n->rss_data;
+
+        rss->enabled = qemu_get_byte(f);
+        rss->populate_hash = qemu_get_byte(f);
+        rss->hash_types = qemu_get_be32(f);
+        qemu_get_buffer(f, rss->key, sizeof(rss->key));
+        rss->indirections_len = qemu_get_be16(f);
+        if (rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+            (rss->indirections_len && !is_power_of_2(rss->indirections_len)) ||
+            (rss->enabled && !rss->indirections_len)) {
+            error_report("virtio-net: invalid RSS indirection table "
+                         "length %u", rss->indirections_len);
+            return -1;
+        }
+        for (i = 0; i < rss->indirections_len; i++) {
+            rss->indirections_table[i] = qemu_get_be16(f);
+            if (rss->indirections_table[i] >= n->max_queues) {
+                error_report("virtio-net: RSS queue %u >= max_queues %u",
+                             rss->indirections_table[i], n->max_queues);
+                return -1;
+            }
+        }
+        rss->default_queue = qemu_get_be16(f);
+        if (rss->default_queue >= n->max_queues) {
+            error_report("virtio-net: RSS queue %u >= max_queues %u",
+                         rss->default_queue, n->max_queues);
+            return -1;
+        }
+    }
+
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
     }
@@ -1603,6 +2015,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1661,7 +2074,21 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    n->peer_queues = MAX(n->nic_conf.peers.queues, 1);
+    if (n->net_conf.queues && n->net_conf.queues < n->peer_queues) {
+        error_setg(errp, "virtio-net needs at least as many queues as its "
+                   "netdev, which has %d", n->peer_queues);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->max_queues = MAX(n->net_conf.queues, n->peer_queues);
+    if (n->max_queues > n->peer_queues &&
+        get_vhost_net(n->nic_conf.peers.ncs[0])) {
+        error_setg(errp, "vhost needs a netdev queue for each virtio-net "
+                   "queue");
+        virtio_cleanup(vdev);
+        return;
+    }
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
                    "must be a positive integer less than %d.",
@@ -1692,6 +2119,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->announce_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
                                      virtio_net_announce_timer, n);
 
+    /* The queues beyond those of the netdev get subqueues without a peer */
+    n->nic_conf.peers.queues = n->max_queues;
     if (n->netclient_type) {
         /*
          * Happen when virtio_net_set_netclient_name has been called.
@@ -1717,7 +2146,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -1778,50 +2207,57 @@ static void virtio_net_instance_init(Object *obj)
 }
 
 static Property virtio_net_properties[] = {
-    DEFINE_PROP_BIT("csum", VirtIONet, host_features, VIRTIO_NET_F_CSUM, true),
-    DEFINE_PROP_BIT("guest_csum", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_CSUM, true),
-    DEFINE_PROP_BIT("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
-    DEFINE_PROP_BIT("guest_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO4, true),
-    DEFINE_PROP_BIT("guest_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO6, true),
-    DEFINE_PROP_BIT("guest_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ECN, true),
-    DEFINE_PROP_BIT("guest_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_UFO, true),
-    DEFINE_PROP_BIT("guest_announce", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ANNOUNCE, true),
-    DEFINE_PROP_BIT("host_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO4, true),
-    DEFINE_PROP_BIT("host_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO6, true),
-    DEFINE_PROP_BIT("host_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_ECN, true),
-    DEFINE_PROP_BIT("host_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_UFO, true),
-    DEFINE_PROP_BIT("mrg_rxbuf", VirtIONet, host_features,
-                    VIRTIO_NET_F_MRG_RXBUF, true),
-    DEFINE_PROP_BIT("status", VirtIONet, host_features,
-                    VIRTIO_NET_F_STATUS, true),
-    DEFINE_PROP_BIT("ctrl_vq", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VQ, true),
-    DEFINE_PROP_BIT("ctrl_rx", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX, true),
-    DEFINE_PROP_BIT("ctrl_vlan", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VLAN, true),
-    DEFINE_PROP_BIT("ctrl_rx_extra", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX_EXTRA, true),
-    DEFINE_PROP_BIT("ctrl_mac_addr", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_MAC_ADDR, true),
-    DEFINE_PROP_BIT("ctrl_guest_offloads", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
-    DEFINE_PROP_BIT("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_CSUM, true),
+    DEFINE_PROP_BIT64("guest_csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_CSUM, true),
+    DEFINE_PROP_BIT64("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
+    DEFINE_PROP_BIT64("guest_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO4, true),
+    DEFINE_PROP_BIT64("guest_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO6, true),
+    DEFINE_PROP_BIT64("guest_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ECN, true),
+    DEFINE_PROP_BIT64("guest_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_UFO, true),
+    DEFINE_PROP_BIT64("guest_announce", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ANNOUNCE, true),
+    DEFINE_PROP_BIT64("host_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO4, true),
+    DEFINE_PROP_BIT64("host_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO6, true),
+    DEFINE_PROP_BIT64("host_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_ECN, true),
+    DEFINE_PROP_BIT64("host_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_UFO, true),
+    DEFINE_PROP_BIT64("mrg_rxbuf", VirtIONet, host_features,
+                      VIRTIO_NET_F_MRG_RXBUF, true),
+    DEFINE_PROP_BIT64("status", VirtIONet, host_features,
+                      VIRTIO_NET_F_STATUS, true),
+    DEFINE_PROP_BIT64("ctrl_vq", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VQ, true),
+    DEFINE_PROP_BIT64("ctrl_rx", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX, true),
+    DEFINE_PROP_BIT64("ctrl_vlan", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VLAN, true),
+    DEFINE_PROP_BIT64("ctrl_rx_extra", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX_EXTRA, true),
+    DEFINE_PROP_BIT64("ctrl_mac_addr", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_MAC_ADDR, true),
+    DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
+    DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("x-tx-zerocopy", VirtIONet, net_conf.tx_zerocopy, true),
+    DEFINE_PROP_UINT16("queues", VirtIONet, net_conf.queues, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -447,15 +447,23 @@ enum {
     VMXNET_TX_PKT_FRAGMENT_HEADER_NUM
 };
 
+/* TCP segments also carry a copy of the TCP header */
+enum {
+    VMXNET_TX_PKT_SEGMENT_L4_HDR_POS = VMXNET_TX_PKT_FRAGMENT_HEADER_NUM,
+    VMXNET_TX_PKT_SEGMENT_HEADER_NUM
+};
+
 #define VMXNET_MAX_FRAG_SG_LIST (64)
 
+/* Point dst[hdr_num...] at up to gso_size bytes of payload, without copying */
 static size_t vmxnet_tx_pkt_fetch_fragment(struct VmxnetTxPkt *pkt,
-    int *src_idx, size_t *src_offset, struct iovec *dst, int *dst_idx)
+    int *src_idx, size_t *src_offset, struct iovec *dst, int *dst_idx,
+    int hdr_num)
 {
     size_t fetched = 0;
     struct iovec *src = pkt->vec;
 
-    *dst_idx = VMXNET_TX_PKT_FRAGMENT_HEADER_NUM;
+    *dst_idx = hdr_num;
 
     while (fetched < pkt->virt_hdr.gso_size) {
 
@@ -517,7 +525,7 @@ static bool vmxnet_tx_pkt_do_sw_fragmentation(struct VmxnetTxPkt *pkt,
     /* Put as much data as possible and send */
     do {
         fragment_len = vmxnet_tx_pkt_fetch_fragment(pkt, &src_idx, &src_offset,
-            fragment, &dst_idx);
+            fragment, &dst_idx, VMXNET_TX_PKT_FRAGMENT_HEADER_NUM);
 
         more_frags = (fragment_offset + fragment_len < pkt->payload_len);
 
@@ -535,12 +543,118 @@ static bool vmxnet_tx_pkt_do_sw_fragmentation(struct VmxnetTxPkt *pkt,
     return true;
 }
 
+/*
+ * Split a TCP GSO packet into MSS-sized segments.  Each segment is sent
+ * as an iovec of the L2 and L3 headers, a copy of the TCP header, and
+ * the payload where the guest left it.
+ */
+static bool vmxnet_tx_pkt_do_sw_segmentation(struct VmxnetTxPkt *pkt,
+    NetClientState *nc)
+{
+    struct iovec segment[VMXNET_MAX_FRAG_SG_LIST];
+    uint8_t l4hdr[ETH_MAX_TCP_HDR_LEN];
+    struct tcp_hdr *th = (struct tcp_hdr *)l4hdr;
+    size_t l4hdr_len = pkt->virt_hdr.hdr_len - pkt->hdr_len;
+    size_t payload_len, segment_len, segment_offset = 0;
+    bool more_segs;
+    uint32_t seq, csum_cntr;
+    uint16_t ip_id = 0;
+    uint8_t flags;
+    int src_idx = VMXNET_TX_PKT_PL_START_FRAG, dst_idx;
+    size_t src_offset = 0;
+    void *l3_iov_base = pkt->vec[VMXNET_TX_PKT_L3HDR_FRAG].iov_base;
+    size_t l3_iov_len = pkt->vec[VMXNET_TX_PKT_L3HDR_FRAG].iov_len;
+    bool is_ip4 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                  VIRTIO_NET_HDR_GSO_TCPV4;
+
+    if (l4hdr_len < sizeof(struct tcp_hdr) || l4hdr_len > sizeof(l4hdr) ||
+        l4hdr_len > pkt->payload_len || !pkt->virt_hdr.gso_size ||
+        iov_to_buf(&pkt->vec[VMXNET_TX_PKT_PL_START_FRAG], pkt->payload_frags,
+                   0, l4hdr, l4hdr_len) < l4hdr_len) {
+        return false;
+    }
+    payload_len = pkt->payload_len - l4hdr_len;
+    seq = be32_to_cpu(th->th_seq);
+    flags = th->th_flags;
+    if (is_ip4) {
+        ip_id = be16_to_cpu(((struct ip_header *)l3_iov_base)->ip_id);
+    }
+
+    /* Skip the TCP header in the payload */
+    src_offset = l4hdr_len;
+    while (src_idx < pkt->payload_frags + VMXNET_TX_PKT_PL_START_FRAG &&
+           src_offset >= pkt->vec[src_idx].iov_len) {
+        src_offset -= pkt->vec[src_idx].iov_len;
+        src_idx++;
+    }
+
+    segment[VMXNET_TX_PKT_FRAGMENT_L2_HDR_POS] =
+        pkt->vec[VMXNET_TX_PKT_L2HDR_FRAG];
+    segment[VMXNET_TX_PKT_FRAGMENT_L3_HDR_POS] =
+        pkt->vec[VMXNET_TX_PKT_L3HDR_FRAG];
+    segment[VMXNET_TX_PKT_SEGMENT_L4_HDR_POS].iov_base = l4hdr;
+    segment[VMXNET_TX_PKT_SEGMENT_L4_HDR_POS].iov_len = l4hdr_len;
+
+    do {
+        segment_len = vmxnet_tx_pkt_fetch_fragment(pkt, &src_idx, &src_offset,
+            segment, &dst_idx, VMXNET_TX_PKT_SEGMENT_HEADER_NUM);
+        more_segs = (segment_offset + segment_len < payload_len);
+
+        th->th_seq = cpu_to_be32(seq + segment_offset);
+        th->th_flags = flags;
+        if (more_segs) {
+            th->th_flags &= ~(TH_FIN | TH_PUSH);
+        }
+        if (segment_offset) {
+            th->th_flags &= ~TH_CWR;
+        }
+        th->th_sum = 0;
+        csum_cntr = net_checksum_add_iov(
+            &segment[VMXNET_TX_PKT_SEGMENT_L4_HDR_POS],
+            dst_idx - VMXNET_TX_PKT_SEGMENT_L4_HDR_POS, 0,
+            l4hdr_len + segment_len);
+
+        if (is_ip4) {
+            struct ip_header *iphdr = l3_iov_base;
+
+            iphdr->ip_len = cpu_to_be16(l3_iov_len + l4hdr_len + segment_len);
+            iphdr->ip_id = cpu_to_be16(ip_id++);
+            eth_fix_ip4_checksum(l3_iov_base, l3_iov_len);
+            csum_cntr += eth_calc_pseudo_hdr_csum(iphdr,
+                                                  l4hdr_len + segment_len);
+        } else {
+            struct ip6_header *ip6hdr = l3_iov_base;
+
+            ip6hdr->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3_iov_len - sizeof(*ip6hdr) +
+                            l4hdr_len + segment_len);
+            csum_cntr += eth_calc_ip6_pseudo_hdr_csum(ip6hdr,
+                                                      l4hdr_len + segment_len,
+                                                      IP_PROTO_TCP);
+        }
+        th->th_sum = cpu_to_be16(net_checksum_finish(csum_cntr));
+
+        qemu_sendv_packet(nc, segment, dst_idx);
+
+        segment_offset += segment_len;
+    } while (more_segs && segment_len);
+
+    return true;
+}
+
 bool vmxnet_tx_pkt_send(struct VmxnetTxPkt *pkt, NetClientState *nc)
 {
+    uint8_t gso_type;
+
     assert(pkt);
 
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+    /* Software TCP segmentation computes the checksum of every segment */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        gso_type != VIRTIO_NET_HDR_GSO_TCPV4 &&
+        gso_type != VIRTIO_NET_HDR_GSO_TCPV6) {
         vmxnet_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -563,5 +677,9 @@ bool vmxnet_tx_pkt_send(struct VmxnetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+        gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        return vmxnet_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
     return vmxnet_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
@@ -20,6 +20,7 @@
 
 #include "hw/pci/msi.h"
 #include "qemu/range.h"
+#include "sysemu/kvm.h"
 
 /* PCI_MSI_ADDRESS_LO */
 #define PCI_MSI_ADDRESS_LO_MASK         (~0x3)
@@ -287,7 +288,24 @@ void msi_notify(PCIDevice *dev, unsigned int vector)
                    "notify vector 0x%x"
                    " address: 0x%"PRIx64" data: 0x%"PRIx32"\n",
                    vector, msg.address, msg.data);
-    msi_send_message(dev, msg);
+    if (!msi_send_message_irqfd(dev, msg)) {
+        msi_send_message(dev, msg);
+    }
+}
+
+/*
+ * Inject @msg with KVM through an irqfd of its cached route, instead of
+ * writing it to the bus master address space.  Unlike msi_send_message(),
+ * this may be called without the BQL; it returns false if @msg could not
+ * be sent this way.
+ */
+bool msi_send_message_irqfd(PCIDevice *dev, MSIMessage msg)
+{
+    if (!kvm_msi_via_irqfd_enabled() ||
+        !(pci_get_word(dev->config + PCI_COMMAND) & PCI_COMMAND_MASTER)) {
+        return false;
+    }
+    return kvm_irqchip_send_msi_irqfd(kvm_state, msg) == 0;
 }
 
 void msi_send_message(PCIDevice *dev, MSIMessage msg)
@@ -19,6 +19,9 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
 #include "qemu/range.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "sysemu/kvm.h"
 
 #define MSIX_CAP_LENGTH 12
 
@@ -157,24 +160,53 @@ void msix_write_config(PCIDevice *dev, uint32_t addr,
     }
 }
 
+/* The table region is accessed without the BQL.  Guests read the table
+ * back after each mask update to flush the write, and those reads need no
+ * lock; msix_uninit() frees the table only after an RCU grace period.
+ */
 static uint64_t msix_table_mmio_read(void *opaque, hwaddr addr,
                                      unsigned size)
 {
     PCIDevice *dev = opaque;
+    uint8_t *table = atomic_rcu_read(&dev->msix_table);
 
-    return pci_get_long(dev->msix_table + addr);
+    return table ? pci_get_long(table + addr) : 0;
 }
 
+/* Updating an entry can fire a pending vector and call the device's
+ * vector notifiers, so writes are done under the BQL.
+ */
 static void msix_table_mmio_write(void *opaque, hwaddr addr,
                                   uint64_t val, unsigned size)
 {
     PCIDevice *dev = opaque;
     int vector = addr / PCI_MSIX_ENTRY_SIZE;
+    bool locked = qemu_mutex_iothread_locked();
     bool was_masked;
 
-    was_masked = msix_is_masked(dev, vector);
-    pci_set_long(dev->msix_table + addr, val);
-    msix_handle_mask_update(dev, vector, was_masked);
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* The device may have been unplugged while we waited for the lock */
+    if (dev->msix_table) {
+        was_masked = msix_is_masked(dev, vector);
+        pci_set_long(dev->msix_table + addr, val);
+        msix_handle_mask_update(dev, vector, was_masked);
+    }
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+typedef struct MSIXTableRCU {
+    struct rcu_head rcu;
+    uint8_t *table;
+} MSIXTableRCU;
+
+static void msix_table_free_rcu(MSIXTableRCU *t)
+{
+    g_free(t->table);
+    g_free(t);
 }
 
 static const MemoryRegionOps msix_table_mmio_ops = {
@@ -282,6 +314,7 @@ int msix_init(struct PCIDevice *dev, unsigned short nentries,
 
     memory_region_init_io(&dev->msix_table_mmio, OBJECT(dev), &msix_table_mmio_ops, dev,
                           "msix-table", table_size);
+    memory_region_clear_global_locking(&dev->msix_table_mmio);
     memory_region_add_subregion(table_bar, table_offset, &dev->msix_table_mmio);
     memory_region_init_io(&dev->msix_pba_mmio, OBJECT(dev), &msix_pba_mmio_ops, dev,
                           "msix-pba", pba_size);
@@ -358,6 +391,8 @@ static void msix_clear_all_vectors(PCIDevice *dev)
 /* Clean up resources for the device. */
 void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
 {
+    MSIXTableRCU *t;
+
     if (!msix_present(dev)) {
         return;
     }
@@ -369,8 +404,10 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     g_free(dev->msix_pba);
     dev->msix_pba = NULL;
     memory_region_del_subregion(table_bar, &dev->msix_table_mmio);
-    g_free(dev->msix_table);
-    dev->msix_table = NULL;
+    t = g_new(MSIXTableRCU, 1);
+    t->table = dev->msix_table;
+    atomic_rcu_set(&dev->msix_table, NULL);
+    call_rcu(t, msix_table_free_rcu, rcu);
     g_free(dev->msix_entry_used);
     dev->msix_entry_used = NULL;
     dev->cap_present &= ~QEMU_PCI_CAP_MSIX;
@@ -443,7 +480,33 @@ void msix_notify(PCIDevice *dev, unsigned vector)
 
     msg = msix_get_message(dev, vector);
 
-    msi_send_message(dev, msg);
+    if (!msi_send_message_irqfd(dev, msg)) {
+        msi_send_message(dev, msg);
+    }
+}
+
+/*
+ * Send an MSI-X message without the BQL, e.g. from an IOThread.  Returns
+ * false, having done nothing, if the vector is masked or has no irqfd yet;
+ * the caller must then use msix_notify() with the BQL held.
+ */
+bool msix_notify_irqfd(PCIDevice *dev, unsigned vector)
+{
+    bool sent = false;
+
+    if (!kvm_msi_via_irqfd_enabled()) {
+        return false;
+    }
+
+    rcu_read_lock();
+    if (atomic_rcu_read(&dev->msix_table) &&
+        vector < dev->msix_entries_nr && dev->msix_entry_used[vector] &&
+        !msix_is_masked(dev, vector)) {
+        sent = msi_send_message_irqfd(dev, msix_get_message(dev, vector));
+    }
+    rcu_read_unlock();
+
+    return sent;
 }
 
 void msix_reset(PCIDevice *dev)
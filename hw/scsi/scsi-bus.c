@@ -98,7 +98,9 @@ static void scsi_dma_restart_bh(void *opaque)
 {
     SCSIDevice *s = opaque;
     SCSIRequest *req, *next;
+    AioContext *ctx = blk_get_aio_context(s->conf.blk);
 
+    aio_context_acquire(ctx);
     qemu_bh_delete(s->bh);
     s->bh = NULL;
 
@@ -119,6 +121,7 @@ static void scsi_dma_restart_bh(void *opaque)
         }
         scsi_req_unref(req);
     }
+    aio_context_release(ctx);
 }
 
 void scsi_req_retry(SCSIRequest *req)
@@ -135,8 +138,10 @@ static void scsi_dma_restart_cb(void *opaque, int running, RunState state)
     if (!running) {
         return;
     }
+    /* The requests belong to the AioContext of the device */
     if (!s->bh) {
-        s->bh = qemu_bh_new(scsi_dma_restart_bh, s);
+        s->bh = aio_bh_new(blk_get_aio_context(s->conf.blk),
+                           scsi_dma_restart_bh, s);
         qemu_bh_schedule(s->bh);
     }
 }
@@ -1839,11 +1844,14 @@ void scsi_device_set_ua(SCSIDevice *sdev, SCSISense sense)
 void scsi_device_purge_requests(SCSIDevice *sdev, SCSISense sense)
 {
     SCSIRequest *req;
+    AioContext *ctx = blk_get_aio_context(sdev->conf.blk);
 
+    aio_context_acquire(ctx);
     while (!QTAILQ_EMPTY(&sdev->requests)) {
         req = QTAILQ_FIRST(&sdev->requests);
         scsi_req_cancel(req);
     }
+    aio_context_release(ctx);
 
     scsi_device_set_ua(sdev, sense);
 }
@@ -1551,20 +1551,190 @@ static inline bool check_lba_range(SCSIDiskState *s,
             sector_num + nb_sectors <= s->qdev.max_lba + 1);
 }
 
-typedef struct UnmapCBData {
-    SCSIDiskReq *r;
-    uint8_t *inbuf;
-    int count;
-} UnmapCBData;
+/*
+ * UNMAP and WRITE SAME can cover a large part of the disk.  They are
+ * split into requests that the block layer accepts, and up to
+ * SCSI_DISK_BATCH_DEPTH of them are in flight at a time.  The batch is
+ * an AIOCB of its own, so that it can be cancelled like any request.
+ */
+#define SCSI_DISK_BATCH_DEPTH       8
+
+typedef struct SCSIDiskRange {
+    int64_t sector;
+    int64_t nb_sectors;
+} SCSIDiskRange;
+
+typedef enum {
+    SCSI_DISK_BATCH_DISCARD,
+    SCSI_DISK_BATCH_WRITE_ZEROES,
+    SCSI_DISK_BATCH_WRITE,
+} SCSIDiskBatchOp;
+
+typedef struct SCSIDiskBatch SCSIDiskBatch;
+
+typedef struct SCSIDiskBatchSlot {
+    SCSIDiskBatch *batch;
+    BlockAIOCB *aiocb;
+    QEMUIOVector qiov;
+    struct iovec iov;
+} SCSIDiskBatchSlot;
+
+struct SCSIDiskBatch {
+    BlockAIOCB common;
+    BlockBackend *blk;
+    QEMUBH *bh;
+    SCSIDiskBatchOp op;
+    int flags;                  /* for SCSI_DISK_BATCH_WRITE_ZEROES */
+    void *buf;                  /* data of SCSI_DISK_BATCH_WRITE */
+    int max_sectors;            /* per request */
+    SCSIDiskRange *ranges;
+    int nb_ranges;
+    int next;                   /* first range not completely submitted */
+    int64_t submitted;          /* sectors of ranges[next] submitted */
+    int inflight;
+    int ret;
+    SCSIDiskBatchSlot slots[SCSI_DISK_BATCH_DEPTH];
+};
+
+static void scsi_disk_batch_cancel(BlockAIOCB *acb)
+{
+    SCSIDiskBatch *b = container_of(acb, SCSIDiskBatch, common);
+    int i;
+
+    if (!b->ret) {
+        b->ret = -ECANCELED;
+    }
+    for (i = 0; i < SCSI_DISK_BATCH_DEPTH; i++) {
+        if (b->slots[i].aiocb) {
+            blk_aio_cancel_async(b->slots[i].aiocb);
+        }
+    }
+}
+
+static const AIOCBInfo scsi_disk_batch_aiocb_info = {
+    .aiocb_size         = sizeof(SCSIDiskBatch),
+    .cancel_async       = scsi_disk_batch_cancel,
+};
+
+static void scsi_disk_batch_bh(void *opaque)
+{
+    SCSIDiskBatch *b = opaque;
+
+    qemu_bh_delete(b->bh);
+    b->common.cb(b->common.opaque, b->ret);
+    qemu_vfree(b->buf);
+    g_free(b->ranges);
+    qemu_aio_unref(b);
+}
+
+static void scsi_disk_batch_submit(SCSIDiskBatch *b);
+
+static void scsi_disk_batch_cb(void *opaque, int ret)
+{
+    SCSIDiskBatchSlot *slot = opaque;
+    SCSIDiskBatch *b = slot->batch;
+
+    slot->aiocb = NULL;
+    b->inflight--;
+    if (ret < 0 && !b->ret) {
+        b->ret = ret;
+    }
+    scsi_disk_batch_submit(b);
+}
+
+/* Fill the free slots; complete the batch once nothing is left to do */
+static void scsi_disk_batch_submit(SCSIDiskBatch *b)
+{
+    int i;
+
+    for (i = 0; i < SCSI_DISK_BATCH_DEPTH; i++) {
+        SCSIDiskBatchSlot *slot = &b->slots[i];
+        SCSIDiskRange *range;
+        int64_t sector;
+        int nb_sectors;
+
+        if (b->ret || b->next == b->nb_ranges) {
+            break;
+        }
+        if (slot->aiocb) {
+            continue;
+        }
+
+        range = &b->ranges[b->next];
+        sector = range->sector + b->submitted;
+        nb_sectors = MIN(range->nb_sectors - b->submitted, b->max_sectors);
+        b->submitted += nb_sectors;
+        if (b->submitted == range->nb_sectors) {
+            b->next++;
+            b->submitted = 0;
+        }
+
+        b->inflight++;
+        switch (b->op) {
+        case SCSI_DISK_BATCH_DISCARD:
+            slot->aiocb = blk_aio_discard(b->blk, sector, nb_sectors,
+                                          scsi_disk_batch_cb, slot);
+            break;
+        case SCSI_DISK_BATCH_WRITE_ZEROES:
+            slot->aiocb = blk_aio_write_zeroes(b->blk, sector, nb_sectors,
+                                               b->flags, scsi_disk_batch_cb,
+                                               slot);
+            break;
+        case SCSI_DISK_BATCH_WRITE:
+            slot->iov.iov_base = b->buf;
+            slot->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&slot->qiov, &slot->iov, 1);
+            slot->aiocb = blk_aio_writev(b->blk, sector, &slot->qiov,
+                                         nb_sectors, scsi_disk_batch_cb, slot);
+            break;
+        }
+    }
+
+    if (!b->inflight) {
+        qemu_bh_schedule(b->bh);
+    }
+}
+
+static SCSIDiskBatch *scsi_disk_batch_new(SCSIDiskState *s,
+                                          SCSIDiskBatchOp op,
+                                          BlockCompletionFunc *cb,
+                                          SCSIDiskReq *r)
+{
+    BlockBackend *blk = s->qdev.conf.blk;
+    int sectors_per_block = s->qdev.blocksize / BDRV_SECTOR_SIZE;
+    SCSIDiskBatch *b;
+    int i;
+
+    b = blk_aio_get(&scsi_disk_batch_aiocb_info, blk, cb, r);
+    b->blk = blk;
+    b->bh = aio_bh_new(blk_get_aio_context(blk), scsi_disk_batch_bh, b);
+    b->op = op;
+    b->flags = 0;
+    b->buf = NULL;
+    if (op == SCSI_DISK_BATCH_WRITE) {
+        b->max_sectors = SCSI_WRITE_SAME_MAX / BDRV_SECTOR_SIZE;
+    } else {
+        b->max_sectors = BDRV_REQUEST_MAX_SECTORS / sectors_per_block *
+                         sectors_per_block;
+    }
+    b->ranges = NULL;
+    b->nb_ranges = 0;
+    b->next = 0;
+    b->submitted = 0;
+    b->inflight = 0;
+    b->ret = 0;
+    for (i = 0; i < SCSI_DISK_BATCH_DEPTH; i++) {
+        b->slots[i].batch = b;
+        b->slots[i].aiocb = NULL;
+    }
+    return b;
+}
 
 static void scsi_unmap_complete(void *opaque, int ret)
 {
-    UnmapCBData *data = opaque;
-    SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-    uint64_t sector_num;
-    uint32_t nb_sectors;
+    SCSIDiskReq *r = opaque;
 
+    assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -1577,36 +1747,28 @@ static void scsi_unmap_complete(void *opaque, int ret)
         }
     }
 
-    if (data->count > 0) {
-        sector_num = ldq_be_p(&data->inbuf[0]);
-        nb_sectors = ldl_be_p(&data->inbuf[8]) & 0xffffffffULL;
-        if (!check_lba_range(s, sector_num, nb_sectors)) {
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
-        }
-
-        r->req.aiocb = blk_aio_discard(s->qdev.conf.blk,
-                                       sector_num * (s->qdev.blocksize / 512),
-                                       nb_sectors * (s->qdev.blocksize / 512),
-                                       scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
-        return;
-    }
-
     scsi_req_complete(&r->req, GOOD);
 
 done:
     scsi_req_unref(&r->req);
-    g_free(data);
+}
+
+static int scsi_disk_range_cmp(const void *a, const void *b)
+{
+    const SCSIDiskRange *ra = a, *rb = b;
+
+    return ra->sector < rb->sector ? -1 : ra->sector > rb->sector;
 }
 
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    int sectors_per_block = s->qdev.blocksize / BDRV_SECTOR_SIZE;
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
-    UnmapCBData *data;
+    SCSIDiskRange *ranges;
+    SCSIDiskBatch *b;
+    int count, nb_ranges, i, j;
 
     /* Reject ANCHOR=1.  */
     if (r->req.cmd.buf[1] & 0x1) {
@@ -1631,14 +1793,53 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
-    data = g_new0(UnmapCBData, 1);
-    data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    /* Check all descriptors before unmapping anything */
+    count = lduw_be_p(&p[2]) >> 4;
+    ranges = g_new(SCSIDiskRange, MAX(count, 1));
+    nb_ranges = 0;
+    for (i = 0; i < count; i++) {
+        uint8_t *desc = &p[8 + i * 16];
+        uint64_t sector_num = ldq_be_p(&desc[0]);
+        uint32_t nb_sectors = ldl_be_p(&desc[8]);
+
+        if (!check_lba_range(s, sector_num, nb_sectors)) {
+            g_free(ranges);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        if (nb_sectors) {
+            ranges[nb_ranges].sector = sector_num * sectors_per_block;
+            ranges[nb_ranges].nb_sectors =
+                (int64_t)nb_sectors * sectors_per_block;
+            nb_ranges++;
+        }
+    }
+
+    /* Merge overlapping and adjacent descriptors */
+    qsort(ranges, nb_ranges, sizeof(ranges[0]), scsi_disk_range_cmp);
+    for (i = 0, j = 1; j < nb_ranges; j++) {
+        int64_t end = ranges[i].sector + ranges[i].nb_sectors;
 
-    /* The matching unref is in scsi_unmap_complete, before data is freed.  */
+        if (ranges[j].sector <= end) {
+            int64_t new_end = ranges[j].sector + ranges[j].nb_sectors;
+
+            ranges[i].nb_sectors = MAX(end, new_end) - ranges[i].sector;
+        } else {
+            ranges[++i] = ranges[j];
+        }
+    }
+    if (nb_ranges) {
+        nb_ranges = i + 1;
+    }
+
+    b = scsi_disk_batch_new(s, SCSI_DISK_BATCH_DISCARD, scsi_unmap_complete, r);
+    b->ranges = ranges;
+    b->nb_ranges = nb_ranges;
+
+    /* The matching unref is in scsi_unmap_complete.  */
     scsi_req_ref(&r->req);
-    scsi_unmap_complete(data, 0);
+    r->req.aiocb = &b->common;
+    scsi_disk_batch_submit(b);
     return;
 
 invalid_param_len:
@@ -1649,60 +1850,14 @@ invalid_field:
     scsi_check_condition(r, SENSE_CODE(INVALID_FIELD));
 }
 
-typedef struct WriteSameCBData {
-    SCSIDiskReq *r;
-    int64_t sector;
-    int nb_sectors;
-    QEMUIOVector qiov;
-    struct iovec iov;
-} WriteSameCBData;
-
-static void scsi_write_same_complete(void *opaque, int ret)
-{
-    WriteSameCBData *data = opaque;
-    SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-
-    assert(r->req.aiocb != NULL);
-    r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
-    if (r->req.io_canceled) {
-        scsi_req_cancel_complete(&r->req);
-        goto done;
-    }
-
-    if (ret < 0) {
-        if (scsi_handle_rw_error(r, -ret)) {
-            goto done;
-        }
-    }
-
-    data->nb_sectors -= data->iov.iov_len / 512;
-    data->sector += data->iov.iov_len / 512;
-    data->iov.iov_len = MIN(data->nb_sectors * 512, data->iov.iov_len);
-    if (data->iov.iov_len) {
-        block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                         data->iov.iov_len, BLOCK_ACCT_WRITE);
-        r->req.aiocb = blk_aio_writev(s->qdev.conf.blk, data->sector,
-                                      &data->qiov, data->iov.iov_len / 512,
-                                      scsi_write_same_complete, data);
-        return;
-    }
-
-    scsi_req_complete(&r->req, GOOD);
-
-done:
-    scsi_req_unref(&r->req);
-    qemu_vfree(data->iov.iov_base);
-    g_free(data);
-}
-
 static void scsi_disk_emulate_write_same(SCSIDiskReq *r, uint8_t *inbuf)
 {
     SCSIRequest *req = &r->req;
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, req->dev);
     uint32_t nb_sectors = scsi_data_cdb_xfer(r->req.cmd.buf);
-    WriteSameCBData *data;
+    int sectors_per_block = s->qdev.blocksize / BDRV_SECTOR_SIZE;
+    uint64_t bytes = (uint64_t)nb_sectors * s->qdev.blocksize;
+    SCSIDiskBatch *b;
     uint8_t *buf;
     int i;
 
@@ -1722,39 +1877,32 @@ static void scsi_disk_emulate_write_same(SCSIDiskReq *r, uint8_t *inbuf)
     }
 
     if (buffer_is_zero(inbuf, s->qdev.blocksize)) {
-        int flags = (req->cmd.buf[1] & 0x8) ? BDRV_REQ_MAY_UNMAP : 0;
-
-        /* The request is used as the AIO opaque value, so add a ref.  */
-        scsi_req_ref(&r->req);
-        block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                         nb_sectors * s->qdev.blocksize,
-                        BLOCK_ACCT_WRITE);
-        r->req.aiocb = blk_aio_write_zeroes(s->qdev.conf.blk,
-                                r->req.cmd.lba * (s->qdev.blocksize / 512),
-                                nb_sectors * (s->qdev.blocksize / 512),
-                                flags, scsi_aio_complete, r);
-        return;
-    }
-
-    data = g_new0(WriteSameCBData, 1);
-    data->r = r;
-    data->sector = r->req.cmd.lba * (s->qdev.blocksize / 512);
-    data->nb_sectors = nb_sectors * (s->qdev.blocksize / 512);
-    data->iov.iov_len = MIN(data->nb_sectors * 512, SCSI_WRITE_SAME_MAX);
-    data->iov.iov_base = buf = blk_blockalign(s->qdev.conf.blk,
-                                              data->iov.iov_len);
-    qemu_iovec_init_external(&data->qiov, &data->iov, 1);
+        /* Zeroes, and unmapping if UNMAP=1, need no data at all */
+        b = scsi_disk_batch_new(s, SCSI_DISK_BATCH_WRITE_ZEROES,
+                                scsi_aio_complete, r);
+        b->flags = (req->cmd.buf[1] & 0x8) ? BDRV_REQ_MAY_UNMAP : 0;
+    } else {
+        /* All requests write the same buffer */
+        size_t len = MIN(bytes, SCSI_WRITE_SAME_MAX);
 
-    for (i = 0; i < data->iov.iov_len; i += s->qdev.blocksize) {
-        memcpy(&buf[i], inbuf, s->qdev.blocksize);
+        b = scsi_disk_batch_new(s, SCSI_DISK_BATCH_WRITE,
+                                scsi_aio_complete, r);
+        b->buf = buf = blk_blockalign(s->qdev.conf.blk, len);
+        for (i = 0; i < len; i += s->qdev.blocksize) {
+            memcpy(&buf[i], inbuf, s->qdev.blocksize);
+        }
     }
+    b->ranges = g_new(SCSIDiskRange, 1);
+    b->ranges[0].sector = r->req.cmd.lba * sectors_per_block;
+    b->ranges[0].nb_sectors = (int64_t)nb_sectors * sectors_per_block;
+    b->nb_ranges = 1;
 
+    /* The request is used as the AIO opaque value, so add a ref.  */
     scsi_req_ref(&r->req);
-    block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                     data->iov.iov_len, BLOCK_ACCT_WRITE);
-    r->req.aiocb = blk_aio_writev(s->qdev.conf.blk, data->sector,
-                                  &data->qiov, data->iov.iov_len / 512,
-                                  scsi_write_same_complete, data);
+    block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct, bytes,
+                     BLOCK_ACCT_WRITE);
+    r->req.aiocb = &b->common;
+    scsi_disk_batch_submit(b);
 }
 
 static void scsi_disk_emulate_write_data(SCSIRequest *req)
@@ -13,6 +13,7 @@
 
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "sysemu/block-backend.h"
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
@@ -20,12 +21,33 @@
 #include "hw/virtio/virtio-access.h"
 #include "stdio.h"
 
+static void virtio_scsi_forward_bh(void *opaque);
+
+static void virtio_scsi_add_cmd_ctx(VirtIOSCSI *s, IOThread *iothread)
+{
+    VirtIOSCSIContext *c;
+
+    s->cmd_ctxs = g_renew(VirtIOSCSIContext, s->cmd_ctxs,
+                          s->num_cmd_ctxs + 1);
+    c = &s->cmd_ctxs[s->num_cmd_ctxs++];
+    c->parent = s;
+    c->iothread = iothread;
+    object_ref(OBJECT(iothread));
+    c->ctx = iothread_get_aio_context(iothread);
+    c->bh = aio_bh_new(c->ctx, virtio_scsi_forward_bh, c);
+    qemu_mutex_init(&c->lock);
+    QTAILQ_INIT(&c->reqs);
+}
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    char **ids;
+    int i;
 
     assert(!s->ctx);
     s->ctx = iothread_get_aio_context(vs->conf.iothread);
@@ -36,10 +58,63 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
                    "(transport does not support notifiers)");
         exit(1);
     }
+
+    if (!vs->conf.cmd_iothreads) {
+        virtio_scsi_add_cmd_ctx(s, iothread);
+        return;
+    }
+
+    ids = g_strsplit(vs->conf.cmd_iothreads, ":", -1);
+    for (i = 0; ids[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "cmd_iothreads: '%s' is not an iothread", ids[i]);
+            g_strfreev(ids);
+            return;
+        }
+        virtio_scsi_add_cmd_ctx(s, IOTHREAD(obj));
+    }
+    g_strfreev(ids);
+    if (!s->num_cmd_ctxs) {
+        error_setg(errp, "cmd_iothreads: no iothread given");
+    }
+}
+
+/* Context: QEMU global mutex held, dataplane stopped */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_cmd_ctxs; i++) {
+        VirtIOSCSIContext *c = &s->cmd_ctxs[i];
+
+        assert(QTAILQ_EMPTY(&c->reqs));
+        qemu_bh_delete(c->bh);
+        qemu_mutex_destroy(&c->lock);
+        object_unref(OBJECT(c->iothread));
+    }
+    g_free(s->cmd_ctxs);
+    s->cmd_ctxs = NULL;
+    s->num_cmd_ctxs = 0;
+}
+
+static VirtIOSCSIContext *virtio_scsi_target_context(VirtIOSCSI *s,
+                                                     int target)
+{
+    return &s->cmd_ctxs[target % s->num_cmd_ctxs];
+}
+
+/* The context that serves the LUNs of @target */
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target)
+{
+    return virtio_scsi_target_context(s, target)->ctx;
 }
 
 static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
                                                VirtQueue *vq,
+                                               AioContext *ctx,
                                                EventNotifierHandler *handler,
                                                int n)
 {
@@ -60,47 +135,123 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     r = g_slice_new(VirtIOSCSIVring);
     r->host_notifier = *virtio_queue_get_host_notifier(vq);
     r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
-    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
-
     r->parent = s;
+    r->ctx = ctx;
+    qemu_mutex_init(&r->lock);
 
     if (!vring_setup(&r->vring, VIRTIO_DEVICE(s), n)) {
         fprintf(stderr, "virtio-scsi: VRing setup failed\n");
         goto fail_vring;
     }
+
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &r->host_notifier, handler);
+    aio_context_release(ctx);
     return r;
 
 fail_vring:
-    aio_set_event_notifier(s->ctx, &r->host_notifier, NULL);
     k->set_host_notifier(qbus->parent, n, false);
+    qemu_mutex_destroy(&r->lock);
     g_slice_free(VirtIOSCSIVring, r);
     return NULL;
 }
 
+static void virtio_scsi_vring_free(VirtIOSCSIVring *r)
+{
+    qemu_mutex_destroy(&r->lock);
+    g_slice_free(VirtIOSCSIVring, r);
+}
+
 VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
                                          VirtIOSCSIVring *vring)
 {
-    VirtIOSCSIReq *req = virtio_scsi_init_req(s, NULL);
-    int r;
+    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    VirtIOSCSIReq *req;
 
-    req->vring = vring;
-    r = vring_pop((VirtIODevice *)s, &vring->vring, &req->elem);
-    if (r < 0) {
-        virtio_scsi_free_req(req);
-        req = NULL;
+    qemu_mutex_lock(&vring->lock);
+    req = vring_pop((VirtIODevice *)s, &vring->vring,
+                    sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    qemu_mutex_unlock(&vring->lock);
+    if (!req) {
+        return NULL;
     }
+    virtio_scsi_init_req(s, NULL, req);
+    req->vring = vring;
     return req;
 }
 
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req)
 {
-    VirtIODevice *vdev = VIRTIO_DEVICE(req->vring->parent);
+    VirtIOSCSIVring *vring = req->vring;
+    VirtIODevice *vdev = VIRTIO_DEVICE(vring->parent);
+    bool notify;
 
-    vring_push(vdev, &req->vring->vring, &req->elem,
+    qemu_mutex_lock(&vring->lock);
+    vring_push(vdev, &vring->vring, &req->elem,
                req->qsgl.size + req->resp_iov.size);
+    notify = vring_should_notify(vdev, &vring->vring);
+    qemu_mutex_unlock(&vring->lock);
+
+    if (notify) {
+        event_notifier_set(&vring->guest_notifier);
+    }
+}
+
+/*
+ * Return the context that must run @req: the one of the target that
+ * @lun, at @offset in the request header, addresses.
+ */
+static VirtIOSCSIContext *virtio_scsi_req_context(VirtIOSCSI *s,
+                                                  VirtIOSCSIReq *req,
+                                                  size_t offset)
+{
+    uint8_t lun[8];
+
+    if (s->num_cmd_ctxs == 1 ||
+        iov_to_buf(req->elem.out_sg, req->elem.out_num, offset,
+                   lun, sizeof(lun)) < sizeof(lun)) {
+        /* Let the context that popped it fail it */
+        return NULL;
+    }
+    return virtio_scsi_target_context(s, lun[1]);
+}
+
+/* Context: the AioContext of the vring that popped @req */
+static void virtio_scsi_forward_req(VirtIOSCSIContext *c, VirtIOSCSIReq *req)
+{
+    qemu_mutex_lock(&c->lock);
+    QTAILQ_INSERT_TAIL(&c->reqs, req, next);
+    qemu_mutex_unlock(&c->lock);
+    qemu_bh_schedule(c->bh);
+}
+
+/* Context: c->ctx held */
+static void virtio_scsi_forward_bh(void *opaque)
+{
+    VirtIOSCSIContext *c = opaque;
+    VirtIOSCSI *s = c->parent;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    QTAILQ_HEAD(, VirtIOSCSIReq) cmds = QTAILQ_HEAD_INITIALIZER(cmds);
+
+    qemu_mutex_lock(&c->lock);
+    while ((req = QTAILQ_FIRST(&c->reqs))) {
+        QTAILQ_REMOVE(&c->reqs, req, next);
+        QTAILQ_INSERT_TAIL(&reqs, req, next);
+    }
+    qemu_mutex_unlock(&c->lock);
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        QTAILQ_REMOVE(&reqs, req, next);
+        if (req->vring == s->ctrl_vring) {
+            virtio_scsi_handle_ctrl_req(s, req);
+        } else if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+            QTAILQ_INSERT_TAIL(&cmds, req, next);
+        }
+    }
 
-    if (vring_should_notify(vdev, &req->vring->vring)) {
-        event_notifier_set(&req->vring->guest_notifier);
+    QTAILQ_FOREACH_SAFE(req, &cmds, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
     }
 }
 
@@ -113,7 +264,21 @@ static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
 
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
-        virtio_scsi_handle_ctrl_req(s, req);
+        VirtIOSCSIContext *c = NULL;
+        uint32_t type;
+
+        /* Task management functions run where the LUN is */
+        if (iov_to_buf(req->elem.out_sg, req->elem.out_num, 0,
+                       &type, sizeof(type)) == sizeof(type) &&
+            virtio_tswap32(VIRTIO_DEVICE(s), type) == VIRTIO_SCSI_T_TMF) {
+            c = virtio_scsi_req_context(s, req,
+                                        offsetof(VirtIOSCSICtrlTMFReq, lun));
+        }
+        if (c && c->ctx != vring->ctx) {
+            virtio_scsi_forward_req(c, req);
+        } else {
+            virtio_scsi_handle_ctrl_req(s, req);
+        }
     }
 }
 
@@ -145,7 +310,12 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
 
     event_notifier_test_and_clear(notifier);
     while ((req = virtio_scsi_pop_req_vring(s, vring))) {
-        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+        VirtIOSCSIContext *c;
+
+        c = virtio_scsi_req_context(s, req, offsetof(VirtIOSCSICmdReq, lun));
+        if (c && c->ctx != vring->ctx) {
+            virtio_scsi_forward_req(c, req);
+        } else if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
             QTAILQ_INSERT_TAIL(&reqs, req, next);
         }
     }
@@ -155,23 +325,42 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
     }
 }
 
-/* assumes s->ctx held */
+static void virtio_scsi_vring_clear_aio(VirtIOSCSIVring *r)
+{
+    aio_context_acquire(r->ctx);
+    aio_set_event_notifier(r->ctx, &r->host_notifier, NULL);
+    aio_context_release(r->ctx);
+}
+
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
     if (s->ctrl_vring) {
-        aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->ctrl_vring);
     }
     if (s->event_vring) {
-        aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->event_vring);
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
-            aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+            virtio_scsi_vring_clear_aio(s->cmd_vrings[i]);
         }
     }
+
+    /*
+     * No vring handler runs anymore; submit what they handed over
+     * before the caller drains the block devices.
+     */
+    for (i = 0; i < s->num_cmd_ctxs; i++) {
+        VirtIOSCSIContext *c = &s->cmd_ctxs[i];
+
+        aio_context_acquire(c->ctx);
+        qemu_bh_cancel(c->bh);
+        virtio_scsi_forward_bh(c);
+        aio_context_release(c->ctx);
+    }
 }
 
 static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
@@ -182,21 +371,21 @@ static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
 
     if (s->ctrl_vring) {
         vring_teardown(&s->ctrl_vring->vring, vdev, 0);
-        g_slice_free(VirtIOSCSIVring, s->ctrl_vring);
+        virtio_scsi_vring_free(s->ctrl_vring);
         s->ctrl_vring = NULL;
     }
     if (s->event_vring) {
         vring_teardown(&s->event_vring->vring, vdev, 1);
-        g_slice_free(VirtIOSCSIVring, s->event_vring);
+        virtio_scsi_vring_free(s->event_vring);
         s->event_vring = NULL;
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
             vring_teardown(&s->cmd_vrings[i]->vring, vdev, 2 + i);
-            g_slice_free(VirtIOSCSIVring, s->cmd_vrings[i]);
+            virtio_scsi_vring_free(s->cmd_vrings[i]);
             s->cmd_vrings[i] = NULL;
         }
-        free(s->cmd_vrings);
+        g_free(s->cmd_vrings);
         s->cmd_vrings = NULL;
     }
 }
@@ -228,23 +417,24 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
-    s->ctrl_vring = virtio_scsi_vring_init(s, vs->ctrl_vq,
+    s->ctrl_vring = virtio_scsi_vring_init(s, vs->ctrl_vq, s->ctx,
                                            virtio_scsi_iothread_handle_ctrl,
                                            0);
     if (!s->ctrl_vring) {
         goto fail_vrings;
     }
-    s->event_vring = virtio_scsi_vring_init(s, vs->event_vq,
+    s->event_vring = virtio_scsi_vring_init(s, vs->event_vq, s->ctx,
                                             virtio_scsi_iothread_handle_event,
                                             1);
     if (!s->event_vring) {
         goto fail_vrings;
     }
-    s->cmd_vrings = g_new(VirtIOSCSIVring *, vs->conf.num_queues);
+    /* Request queues are spread round robin over cmd_iothreads */
+    s->cmd_vrings = g_new0(VirtIOSCSIVring *, vs->conf.num_queues);
     for (i = 0; i < vs->conf.num_queues; i++) {
         s->cmd_vrings[i] =
             virtio_scsi_vring_init(s, vs->cmd_vqs[i],
+                                   s->cmd_ctxs[i % s->num_cmd_ctxs].ctx,
                                    virtio_scsi_iothread_handle_cmd,
                                    i + 2);
         if (!s->cmd_vrings[i]) {
@@ -254,12 +444,10 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
-    aio_context_release(s->ctx);
     virtio_scsi_vring_teardown(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
@@ -288,18 +476,10 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
-
-    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
-    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
-    for (i = 0; i < vs->conf.num_queues; i++) {
-        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
-    }
+    virtio_scsi_clear_aio(s);
 
     blk_drain_all(); /* ensure there are no in-flight requests */
 
-    aio_context_release(s->ctx);
-
     /* Sync vring state back to virtqueue so that non-dataplane request
      * processing can continue when we disable the host notifier below.
      */
@@ -59,6 +59,9 @@ typedef struct HPETTimer {  /* timers */
     uint8_t wrap_flag;      /* timer pop will indicate wrap for one-shot 32-bit
                              * mode. Next pop will be actual timer expiration.
                              */
+    bool parked;            /* periodic level-triggered timer left unarmed
+                             * until the guest clears its interrupt
+                             */
 } HPETTimer;
 
 typedef struct HPETState {
@@ -224,12 +227,20 @@ static void update_irq(struct HPETTimer *timer, int set)
     }
 }
 
+static void hpet_timer_unpark(HPETTimer *t);
+
 static void hpet_pre_save(void *opaque)
 {
     HPETState *s = opaque;
+    int i;
 
     /* save current counter value */
     s->hpet_counter = hpet_get_ticks(s);
+
+    /* parking is not migrated, the destination expects armed timers */
+    for (i = 0; i < s->num_timers; i++) {
+        hpet_timer_unpark(&s->timer[i]);
+    }
 }
 
 static int hpet_pre_load(void *opaque)
@@ -330,6 +341,20 @@ static const VMStateDescription vmstate_hpet = {
     }
 };
 
+/* move the comparator of a periodic timer past @cur_tick */
+static void hpet_advance_cmp(HPETTimer *t, uint64_t cur_tick)
+{
+    if (t->config & HPET_TN_32BIT) {
+        while (hpet_time_after(cur_tick, t->cmp)) {
+            t->cmp = (uint32_t)(t->cmp + t->period);
+        }
+    } else {
+        while (hpet_time_after64(cur_tick, t->cmp)) {
+            t->cmp += t->period;
+        }
+    }
+}
+
 /*
  * timer expiration callback
  */
@@ -342,14 +367,16 @@ static void hpet_timer(void *opaque)
     uint64_t cur_tick = hpet_get_ticks(t->state);
 
     if (timer_is_periodic(t) && period != 0) {
-        if (t->config & HPET_TN_32BIT) {
-            while (hpet_time_after(cur_tick, t->cmp)) {
-                t->cmp = (uint32_t)(t->cmp + t->period);
-            }
-        } else {
-            while (hpet_time_after64(cur_tick, t->cmp)) {
-                t->cmp += period;
-            }
+        hpet_advance_cmp(t, cur_tick);
+        /*
+         * A level-triggered interrupt that is still pending from the last
+         * period cannot be raised again.  Stop ticking until the guest
+         * clears it, instead of waking up every period for nothing.
+         */
+        if ((t->config & HPET_TN_TYPE_LEVEL) && !timer_fsb_route(t) &&
+            (t->state->isr & (1 << t->tn))) {
+            t->parked = true;
+            return;
         }
         diff = hpet_calculate_diff(t, cur_tick);
         timer_mod(t->qemu_timer,
@@ -373,6 +400,7 @@ static void hpet_set_timer(HPETTimer *t)
 
     /* whenever new timer is being set up, make sure wrap_flag is 0 */
     t->wrap_flag = 0;
+    t->parked = false;
     diff = hpet_calculate_diff(t, cur_tick);
 
     /* hpet spec says in one-shot 32-bit mode, generate an interrupt when
@@ -392,9 +420,19 @@ static void hpet_set_timer(HPETTimer *t)
 static void hpet_del_timer(HPETTimer *t)
 {
     timer_del(t->qemu_timer);
+    t->parked = false;
     update_irq(t, 0);
 }
 
+/* catch up with the periods a parked timer skipped and arm it again */
+static void hpet_timer_unpark(HPETTimer *t)
+{
+    if (t->parked) {
+        hpet_advance_cmp(t, hpet_get_ticks(t->state));
+        hpet_set_timer(t);
+    }
+}
+
 #ifdef HPET_DEBUG
 static uint32_t hpet_ram_readb(void *opaque, hwaddr addr)
 {
@@ -433,8 +471,14 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
         case HPET_TN_CFG + 4: // Interrupt capabilities
             return timer->config >> 32;
         case HPET_TN_CMP: // comparator register
+            if (timer->parked) {
+                hpet_advance_cmp(timer, hpet_get_ticks(s));
+            }
             return timer->cmp;
         case HPET_TN_CMP + 4:
+            if (timer->parked) {
+                hpet_advance_cmp(timer, hpet_get_ticks(s));
+            }
             return timer->cmp >> 32;
         case HPET_TN_ROUTE:
             return timer->fsb;
@@ -520,6 +564,9 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                 hpet_set_timer(timer);
             } else if (deactivating_bit(old_val, new_val, HPET_TN_ENABLE)) {
                 hpet_del_timer(timer);
+            } else {
+                /* the timer may no longer be level-triggered */
+                hpet_timer_unpark(timer);
             }
             break;
         case HPET_TN_CFG + 4: // Interrupt capabilities
@@ -621,6 +668,7 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             for (i = 0; i < s->num_timers; i++) {
                 if (val & (1 << i)) {
                     update_irq(&s->timer[i], 0);
+                    hpet_timer_unpark(&s->timer[i]);
                 }
             }
             break;
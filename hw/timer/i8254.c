@@ -248,6 +248,24 @@ static uint64_t pit_ioport_read(void *opaque, hwaddr addr,
     return ret;
 }
 
+/*
+ * In modes 2 and 3 only the rising edges of OUT, at the end of each period,
+ * interrupt the (edge-triggered) IRQ0 input.  Wake up for those alone and
+ * let pit_irq_timer() emit the falling edge immediately before.
+ */
+static int64_t pit_get_next_rising_edge_time(PITChannelState *s,
+                                             int64_t current_time)
+{
+    uint64_t d, next_time;
+
+    d = muldiv64(current_time - s->count_load_time, PIT_FREQ,
+                 get_ticks_per_sec());
+    next_time = (d / s->count + 1) * s->count;
+    /* round up, so that pit_get_out() sees exactly next_time ticks */
+    return s->count_load_time + muldiv64(next_time, get_ticks_per_sec(),
+                                         PIT_FREQ) + 1;
+}
+
 static void pit_irq_timer_update(PITChannelState *s, int64_t current_time)
 {
     int64_t expire_time;
@@ -256,7 +274,11 @@ static void pit_irq_timer_update(PITChannelState *s, int64_t current_time)
     if (!s->irq_timer || s->irq_disabled) {
         return;
     }
-    expire_time = pit_get_next_transition_time(s, current_time);
+    if (s->mode == 2 || s->mode == 3) {
+        expire_time = pit_get_next_rising_edge_time(s, current_time);
+    } else {
+        expire_time = pit_get_next_transition_time(s, current_time);
+    }
     irq_level = pit_get_out(s, current_time);
     qemu_set_irq(s->irq, irq_level);
 #ifdef DEBUG_PIT
@@ -275,6 +297,9 @@ static void pit_irq_timer(void *opaque)
 {
     PITChannelState *s = opaque;
 
+    if (s->mode == 2 || s->mode == 3) {
+        qemu_irq_lower(s->irq);
+    }
     pit_irq_timer_update(s, s->next_transition_time);
 }
 
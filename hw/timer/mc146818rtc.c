@@ -64,6 +64,7 @@ typedef struct RTCState {
     ISADevice parent_obj;
 
     MemoryRegion io;
+    MemoryRegion coalesced_io;
     uint8_t cmos_data[128];
     uint8_t cmos_index;
     int32_t base_year;
@@ -78,6 +79,8 @@ typedef struct RTCState {
     /* update-ended timer */
     QEMUTimer *update_timer;
     uint64_t next_alarm_time;
+    /* when rtc_update_timer() is due, even if update_timer is not armed */
+    int64_t next_update_time;
     uint16_t irq_reinject_on_ack_count;
     uint32_t irq_coalesced;
     uint32_t period;
@@ -211,6 +214,8 @@ static void check_update_timer(RTCState *s)
     uint64_t guest_nsec;
     int next_alarm_sec;
 
+    s->next_update_time = INT64_MAX;
+
     /* From the data sheet: "Holding the dividers in reset prevents
      * interrupts from operating, while setting the SET bit allows"
      * them to occur.  However, it will prevent an alarm interrupt
@@ -248,6 +253,20 @@ static void check_update_timer(RTCState *s)
          * the alarm time.  */
         next_update_time = s->next_alarm_time;
     }
+    s->next_update_time = next_update_time;
+
+    /* The timer only runs for the flags that raise an interrupt or wake
+     * up the guest.  The others are set by rtc_update_flags() when the
+     * guest can see them, so that an idle guest does not cost a wakeup
+     * every second.
+     */
+    if (!(s->cmos_data[RTC_REG_B] & (REG_B_UIE | REG_B_AIE))) {
+        timer_del(s->update_timer);
+        return;
+    }
+    if (!(s->cmos_data[RTC_REG_B] & REG_B_UIE)) {
+        next_update_time = s->next_alarm_time;
+    }
     if (next_update_time != timer_expire_time_ns(s->update_timer)) {
         timer_mod(s->update_timer, next_update_time);
     }
@@ -383,6 +402,14 @@ static void rtc_update_timer(void *opaque)
     check_update_timer(s);
 }
 
+/* Run the update cycles that were due while update_timer was not armed */
+static void rtc_update_flags(RTCState *s)
+{
+    if (qemu_clock_get_ns(rtc_clock) >= s->next_update_time) {
+        rtc_update_timer(s);
+    }
+}
+
 static void cmos_ioport_write(void *opaque, hwaddr addr,
                               uint64_t data, unsigned size)
 {
@@ -391,6 +418,7 @@ static void cmos_ioport_write(void *opaque, hwaddr addr,
     if ((addr & 1) == 0) {
         s->cmos_index = data & 0x7f;
     } else {
+        rtc_update_flags(s);
         CMOS_DPRINTF("cmos: write index=0x%02x val=0x%02" PRIx64 "\n",
                      s->cmos_index, data);
         switch(s->cmos_index) {
@@ -652,6 +680,7 @@ static uint64_t cmos_ioport_read(void *opaque, hwaddr addr,
             ret = s->cmos_data[s->cmos_index];
             break;
         case RTC_REG_C:
+            rtc_update_flags(s);
             ret = s->cmos_data[s->cmos_index];
             qemu_irq_lower(s->irq);
             s->cmos_data[RTC_REG_C] = 0x00;
@@ -722,6 +751,10 @@ static int rtc_post_load(void *opaque, int version_id)
         rtc_set_time(s);
         s->offset = 0;
         check_update_timer(s);
+    } else if (timer_pending(s->update_timer)) {
+        s->next_update_time = timer_expire_time_ns(s->update_timer);
+    } else {
+        s->next_update_time = INT64_MAX;
     }
 
     uint64_t now = qemu_clock_get_ns(rtc_clock);
@@ -740,6 +773,19 @@ static int rtc_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static void rtc_pre_save(void *opaque)
+{
+    RTCState *s = opaque;
+
+    /* Send update_timer as it would be armed without the lazy flags, which
+     * is what the destination expects.
+     */
+    rtc_update_flags(s);
+    if (s->next_update_time != INT64_MAX) {
+        timer_mod(s->update_timer, s->next_update_time);
+    }
+}
+
 static bool rtc_irq_reinject_on_ack_count_needed(void *opaque)
 {
     RTCState *s = (RTCState *)opaque;
@@ -761,6 +807,7 @@ static const VMStateDescription vmstate_rtc = {
     .name = "mc146818rtc",
     .version_id = 3,
     .minimum_version_id = 1,
+    .pre_save = rtc_pre_save,
     .post_load = rtc_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_BUFFER(cmos_data, RTCState),
@@ -896,6 +943,16 @@ static void rtc_realizefn(DeviceState *dev, Error **errp)
     memory_region_init_io(&s->io, OBJECT(s), &cmos_ops, s, "rtc", 2);
     isa_register_ioport(isadev, &s->io, base);
 
+    /*
+     * Index writes only take effect on the next data port access, which
+     * flushes them first: they need not exit to QEMU.
+     */
+    memory_region_set_flush_coalesced(&s->io);
+    memory_region_init_io(&s->coalesced_io, OBJECT(s), &cmos_ops,
+                          s, "rtc-index", 1);
+    memory_region_add_subregion(&s->io, 0, &s->coalesced_io);
+    memory_region_add_coalescing(&s->coalesced_io, 0, 1);
+
     qdev_set_legacy_instance_id(dev, base, 3);
     qemu_register_reset(rtc_reset, s);
 
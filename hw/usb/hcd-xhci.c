@@ -137,6 +137,8 @@
 
 #define ERDP_EHB        (1<<3)
 
+#define IMOD_IMODI_MASK 0xffff
+
 #define TRB_SIZE 16
 typedef struct XHCITRB {
     uint64_t parameter;
@@ -439,6 +441,9 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    XHCIState *xhci;
+    QEMUTimer *imod_timer;
+    int64_t imod_last;
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -502,6 +507,7 @@ enum xhci_flags {
     XHCI_FLAG_SS_FIRST,
     XHCI_FLAG_FORCE_PCIE_ENDCAP,
     XHCI_FLAG_ENABLE_STREAMS,
+    XHCI_FLAG_MODERATION,
 };
 
 static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
@@ -782,14 +788,10 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_notify(XHCIState *xhci, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
 
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
-
     if (!(xhci->intr[v].iman & IMAN_IE)) {
         return;
     }
@@ -816,6 +818,76 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    bool busy = intr->erdp_low & ERDP_EHB;
+    int64_t now, next;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    if (!xhci_get_flag(xhci, XHCI_FLAG_MODERATION)) {
+        xhci_intr_notify(xhci, v);
+        return;
+    }
+
+    /*
+     * While EHB is set the guest is still handling the previous interrupt,
+     * and picks up the new events before it writes ERDP (spec 4.17.2).
+     */
+    if (busy) {
+        return;
+    }
+
+    /* IMODI is in units of 250ns */
+    if (intr->imod & IMOD_IMODI_MASK) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        next = intr->imod_last + (intr->imod & IMOD_IMODI_MASK) * 250;
+        if (now < next) {
+            timer_mod(intr->imod_timer, next);
+            return;
+        }
+        intr->imod_last = now;
+    }
+    xhci_intr_notify(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    /* Nothing to signal if the guest has consumed the events meanwhile */
+    if (intr->erdp_low & ERDP_EHB) {
+        intr->imod_last = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        xhci_intr_notify(xhci, intr - xhci->intr);
+    }
+}
+
+/*
+ * The guest cleared EHB: interrupt again if events were written past the
+ * dequeue pointer it reported.
+ */
+static void xhci_intr_check_pending(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    dma_addr_t erdp = xhci_addr64(intr->erdp_low, intr->erdp_high);
+
+    if (!xhci_get_flag(xhci, XHCI_FLAG_MODERATION) ||
+        (intr->erdp_low & ERDP_EHB)) {
+        return;
+    }
+    if (erdp < intr->er_start ||
+        erdp >= (intr->er_start + TRB_SIZE * intr->er_size)) {
+        return;
+    }
+    if ((erdp - intr->er_start) / TRB_SIZE != intr->er_ep_idx) {
+        xhci_intr_raise(xhci, v);
+    }
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -2941,6 +3013,9 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+
+        timer_del(xhci->intr[i].imod_timer);
+        xhci->intr[i].imod_last = 0;
     }
 
     xhci->mfindex_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -3316,6 +3391,9 @@ static void xhci_runtime_write(void *ptr, hwaddr reg,
             intr->erdp_low &= ~ERDP_EHB;
         }
         intr->erdp_low = (val & ~ERDP_EHB) | (intr->erdp_low & ERDP_EHB);
+        if (val & ERDP_EHB) {
+            xhci_intr_check_pending(xhci, v);
+        }
         break;
     case 0x1c: /* ERDP high */
         intr->erdp_high = val;
@@ -3609,6 +3687,12 @@ static void usb_xhci_realize(struct PCIDevice *dev, Error **errp)
     }
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                xhci_imod_timer,
+                                                &xhci->intr[i]);
+    }
 
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
@@ -3671,6 +3755,11 @@ static void usb_xhci_exit(PCIDevice *dev)
         timer_free(xhci->mfwrap_timer);
         xhci->mfwrap_timer = NULL;
     }
+    for (i = 0; i < xhci->numintrs; i++) {
+        timer_del(xhci->intr[i].imod_timer);
+        timer_free(xhci->intr[i].imod_timer);
+        xhci->intr[i].imod_timer = NULL;
+    }
 
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
@@ -3746,6 +3835,12 @@ static int usb_xhci_post_load(void *opaque, int version_id)
         } else {
             msix_vector_unuse(pci_dev, intr);
         }
+        /* A moderated interrupt may have been pending on the source */
+        if (xhci_get_flag(xhci, XHCI_FLAG_MODERATION) &&
+            (xhci->intr[intr].erdp_low & ERDP_EHB)) {
+            timer_mod(xhci->intr[intr].imod_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        }
     }
 
     return 0;
@@ -3876,6 +3971,8 @@ static Property xhci_properties[] = {
                     XHCI_FLAG_FORCE_PCIE_ENDCAP, false),
     DEFINE_PROP_BIT("streams", XHCIState, flags,
                     XHCI_FLAG_ENABLE_STREAMS, true),
+    DEFINE_PROP_BIT("moderation", XHCIState, flags,
+                    XHCI_FLAG_MODERATION, true),
     DEFINE_PROP_UINT32("intrs", XHCIState, numintrs, MAXINTRS),
     DEFINE_PROP_UINT32("slots", XHCIState, numslots, MAXSLOTS),
     DEFINE_PROP_UINT32("p2",    XHCIState, numports_2, 4),
@@ -102,6 +102,10 @@ struct USBHostDevice {
     /* request queues */
     QTAILQ_HEAD(, USBHostRequest)    requests;
     QTAILQ_HEAD(, USBHostIsoRing)    isorings;
+
+    /* completed requests, kept with their transfer and buffer for reuse */
+    QTAILQ_HEAD(, USBHostRequest)    free_requests;
+    unsigned int                     nr_free_requests;
 };
 
 struct USBHostRequest {
@@ -110,6 +114,7 @@ struct USBHostRequest {
     bool                             in;
     struct libusb_transfer           *xfer;
     unsigned char                    *buffer;
+    size_t                           bufsize;
     unsigned char                    *cbuf;
     unsigned int                     clen;
     bool                             usb3ep0quirk;
@@ -306,32 +311,90 @@ static bool usb_host_use_combining(USBEndpoint *ep)
 
 /* ------------------------------------------------------------------------ */
 
+/*
+ * Requests are recycled per device rather than allocated per packet.
+ * Buffers larger than USB_HOST_POOL_BUFSIZE are not kept.
+ */
+#define USB_HOST_POOL_SIZE      32
+#define USB_HOST_POOL_BUFSIZE   (64 * 1024)
+
 static USBHostRequest *usb_host_req_alloc(USBHostDevice *s, USBPacket *p,
                                           bool in, size_t bufsize)
 {
-    USBHostRequest *r = g_new0(USBHostRequest, 1);
+    USBHostRequest *r = QTAILQ_FIRST(&s->free_requests);
+    struct libusb_transfer *xfer;
+    unsigned char *buffer;
+    size_t size;
+
+    if (r) {
+        QTAILQ_REMOVE(&s->free_requests, r, next);
+        s->nr_free_requests--;
+        xfer = r->xfer;
+        buffer = r->buffer;
+        size = r->bufsize;
+        memset(r, 0, sizeof(*r));
+        r->xfer = xfer;
+        r->buffer = buffer;
+        r->bufsize = size;
+    } else {
+        r = g_new0(USBHostRequest, 1);
+        r->xfer = libusb_alloc_transfer(0);
+    }
 
     r->host = s;
     r->p = p;
     r->in = in;
-    r->xfer = libusb_alloc_transfer(0);
-    if (bufsize) {
+    if (bufsize > r->bufsize) {
+        g_free(r->buffer);
         r->buffer = g_malloc(bufsize);
+        r->bufsize = bufsize;
     }
     QTAILQ_INSERT_TAIL(&s->requests, r, next);
     return r;
 }
 
-static void usb_host_req_free(USBHostRequest *r)
+static void usb_host_req_release(USBHostRequest *r)
 {
-    if (r->host) {
-        QTAILQ_REMOVE(&r->host->requests, r, next);
-    }
     libusb_free_transfer(r->xfer);
     g_free(r->buffer);
     g_free(r);
 }
 
+static void usb_host_req_free(USBHostRequest *r)
+{
+    USBHostDevice *s = r->host;
+
+    /* Aborted requests are detached from the device, which may be gone */
+    if (!s) {
+        usb_host_req_release(r);
+        return;
+    }
+
+    QTAILQ_REMOVE(&s->requests, r, next);
+    if (s->nr_free_requests >= USB_HOST_POOL_SIZE) {
+        usb_host_req_release(r);
+        return;
+    }
+    if (r->bufsize > USB_HOST_POOL_BUFSIZE) {
+        g_free(r->buffer);
+        r->buffer = NULL;
+        r->bufsize = 0;
+    }
+    QTAILQ_INSERT_HEAD(&s->free_requests, r, next);
+    s->nr_free_requests++;
+}
+
+static void usb_host_req_pool_free(USBHostDevice *s)
+{
+    USBHostRequest *r;
+
+    while ((r = QTAILQ_FIRST(&s->free_requests)) != NULL) {
+        QTAILQ_REMOVE(&s->free_requests, r, next);
+        usb_host_req_release(r);
+    }
+    s->nr_free_requests = 0;
+}
+
 static USBHostRequest *usb_host_req_find(USBHostDevice *s, USBPacket *p)
 {
     USBHostRequest *r;
@@ -920,6 +983,7 @@ static int usb_host_close(USBHostDevice *s)
 
     usb_host_abort_xfers(s);
     usb_host_iso_free_all(s);
+    usb_host_req_pool_free(s);
 
     if (udev->attached) {
         usb_device_detach(udev);
@@ -982,6 +1046,7 @@ static void usb_host_realize(USBDevice *udev, Error **errp)
     udev->auto_attach = 0;
     QTAILQ_INIT(&s->requests);
     QTAILQ_INIT(&s->isorings);
+    QTAILQ_INIT(&s->free_requests);
 
     s->exit.notify = usb_host_exit_notifier;
     qemu_add_exit_notifier(&s->exit);
@@ -28,7 +28,9 @@
 #include "exec/memory.h"
 #include "hw/hw.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
 #include "trace.h"
 
 struct vfio_group_head vfio_group_list =
@@ -47,6 +49,9 @@ struct vfio_as_head vfio_address_spaces =
 static int vfio_kvm_device_fd = -1;
 #endif
 
+/* Containers only map guest RAM once the machine is fully built */
+static bool vfio_machine_ready;
+
 /*
  * Common VFIO interrupt disable
  */
@@ -238,6 +243,233 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * Guest RAM is not mapped section by section.  The sections added during
+ * a memory transaction are collected in the container, merging those
+ * adjacent in both IOVA and host address space, and mapped with a single
+ * VFIO_IOMMU_MAP_DMA each when the transaction commits.
+ */
+static void vfio_dma_add(VFIOContainer *container, hwaddr iova,
+                         ram_addr_t size, void *vaddr, bool readonly)
+{
+    VFIODMAMapping *m, *n;
+
+    QLIST_FOREACH(m, &container->iommu_data.type1.mappings, next) {
+        if (m->mapped || m->readonly != readonly) {
+            continue;
+        }
+        if (m->iova + m->size == iova && m->vaddr + m->size == vaddr) {
+            m->size += size;
+            goto merged;
+        }
+        if (iova + size == m->iova && vaddr + size == m->vaddr) {
+            m->iova = iova;
+            m->vaddr = vaddr;
+            m->size += size;
+            goto merged;
+        }
+    }
+
+    m = g_new0(VFIODMAMapping, 1);
+    m->iova = iova;
+    m->size = size;
+    m->vaddr = vaddr;
+    m->readonly = readonly;
+    QLIST_INSERT_HEAD(&container->iommu_data.type1.mappings, m, next);
+    return;
+
+merged:
+    /* The new section may bridge the gap to another pending mapping */
+    QLIST_FOREACH(n, &container->iommu_data.type1.mappings, next) {
+        if (n == m || n->mapped || n->readonly != readonly) {
+            continue;
+        }
+        if (m->iova + m->size == n->iova && m->vaddr + m->size == n->vaddr) {
+            m->size += n->size;
+        } else if (n->iova + n->size == m->iova &&
+                   n->vaddr + n->size == m->vaddr) {
+            m->iova = n->iova;
+            m->vaddr = n->vaddr;
+            m->size += n->size;
+        } else {
+            continue;
+        }
+        QLIST_REMOVE(n, next);
+        g_free(n);
+        break;
+    }
+}
+
+/*
+ * Remove [iova, end) from the mappings.  The type1v2 IOMMU doesn't let us
+ * unmap part of a mapping, so a mapping that extends past the range is
+ * unmapped as a whole and what is left of it is mapped again on the next
+ * flush.
+ */
+static int vfio_dma_del(VFIOContainer *container, hwaddr iova, hwaddr end)
+{
+    VFIODMAMapping *m, *tmp;
+    int ret = 0;
+
+    QLIST_FOREACH_SAFE(m, &container->iommu_data.type1.mappings, next, tmp) {
+        hwaddr m_end = m->iova + m->size;
+
+        if (m_end <= iova || m->iova >= end) {
+            continue;
+        }
+
+        if (m->mapped) {
+            if (m->iova < iova || m_end > end) {
+                trace_vfio_dma_split(m->iova, m_end - 1, iova, end - 1);
+            }
+            ret = vfio_dma_unmap(container, m->iova, m->size);
+            m->mapped = false;
+        }
+
+        if (m->iova < iova && m_end > end) {
+            VFIODMAMapping *hi = g_new0(VFIODMAMapping, 1);
+
+            hi->iova = end;
+            hi->size = m_end - end;
+            hi->vaddr = m->vaddr + (end - m->iova);
+            hi->readonly = m->readonly;
+            QLIST_INSERT_HEAD(&container->iommu_data.type1.mappings, hi, next);
+            m->size = iova - m->iova;
+        } else if (m->iova < iova) {
+            m->size = iova - m->iova;
+        } else if (m_end > end) {
+            m->vaddr += end - m->iova;
+            m->size = m_end - end;
+            m->iova = end;
+        } else {
+            QLIST_REMOVE(m, next);
+            g_free(m);
+        }
+    }
+
+    return ret;
+}
+
+/* Map whatever is not mapped yet, return the first error */
+static int vfio_dma_flush(VFIOContainer *container)
+{
+    VFIODMAMapping *m;
+    uint64_t size = 0;
+    int nr = 0, ret = 0;
+
+    QLIST_FOREACH(m, &container->iommu_data.type1.mappings, next) {
+        int err;
+
+        if (m->mapped) {
+            continue;
+        }
+
+        err = vfio_dma_map(container, m->iova, m->size, m->vaddr,
+                           m->readonly);
+        if (err) {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
+                         container, m->iova, (hwaddr)m->size, m->vaddr, err);
+            ret = ret ? ret : err;
+            continue;
+        }
+        m->mapped = true;
+        size += m->size;
+        nr++;
+    }
+
+    if (nr) {
+        trace_vfio_dma_flush(container->fd, nr, size);
+    }
+    return ret;
+}
+
+/*
+ * Make the mappings collected since the container was created, unless
+ * the machine is still being built or all of its devices are lazy.
+ */
+static int vfio_dma_start(VFIOContainer *container)
+{
+    VFIOType1 *type1 = &container->iommu_data.type1;
+    int ret;
+
+    if (!type1->deferred || type1->lazy || !vfio_machine_ready) {
+        return 0;
+    }
+
+    type1->deferred = false;
+    ret = vfio_dma_flush(container);
+    if (ret) {
+        type1->deferred = true;
+    }
+    return ret;
+}
+
+static void *vfio_dma_start_thread(void *opaque)
+{
+    VFIOContainer *container = opaque;
+
+    container->iommu_data.type1.error = vfio_dma_start(container);
+    return NULL;
+}
+
+/*
+ * Pinning guest RAM is what makes starting a VM with assigned devices
+ * slow.  The containers created on the command line are started together,
+ * each one from its own thread.
+ */
+static void vfio_machine_done(Notifier *notifier, void *data)
+{
+    VFIOAddressSpace *space;
+    VFIOContainer *container;
+    QemuThread *threads;
+    VFIOContainer **started;
+    int i, nr = 0;
+
+    vfio_machine_ready = true;
+
+    QLIST_FOREACH(space, &vfio_address_spaces, list) {
+        QLIST_FOREACH(container, &space->containers, next) {
+            nr++;
+        }
+    }
+    threads = g_new0(QemuThread, nr);
+    started = g_new0(VFIOContainer *, nr);
+
+    nr = 0;
+    QLIST_FOREACH(space, &vfio_address_spaces, list) {
+        QLIST_FOREACH(container, &space->containers, next) {
+            if (!container->iommu_data.type1.deferred ||
+                container->iommu_data.type1.lazy) {
+                continue;
+            }
+            container->iommu_data.type1.error = 0;
+            qemu_thread_create(&threads[nr], "vfio-dma",
+                               vfio_dma_start_thread, container,
+                               QEMU_THREAD_JOINABLE);
+            started[nr++] = container;
+        }
+    }
+
+    for (i = 0; i < nr; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    for (i = 0; i < nr; i++) {
+        if (started[i]->iommu_data.type1.error) {
+            error_report("vfio: DMA mapping failed, unable to continue");
+            exit(1);
+        }
+    }
+
+    g_free(threads);
+    g_free(started);
+}
+
+static Notifier vfio_machine_done_notifier = {
+    .notify = vfio_machine_done,
+};
+static bool vfio_machine_done_registered;
+
 static bool vfio_listener_skipped_section(MemoryRegionSection *section)
 {
     return (!memory_region_is_ram(section->mr) &&
@@ -320,7 +552,6 @@ static void vfio_listener_region_add(MemoryListener *listener,
     hwaddr iova, end;
     Int128 llend;
     void *vaddr;
-    int ret;
 
     if (vfio_listener_skipped_section(section)) {
         trace_vfio_listener_region_add_skip(
@@ -395,25 +626,7 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     trace_vfio_listener_region_add_ram(iova, end - 1, vaddr);
 
-    ret = vfio_dma_map(container, iova, end - iova, vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                     container, iova, end - iova, vaddr, ret);
-
-        /*
-         * On the initfn path, store the first error in the container so we
-         * can gracefully fail.  Runtime, there's not much we can do other
-         * than throw a hardware error.
-         */
-        if (!container->iommu_data.type1.initialized) {
-            if (!container->iommu_data.type1.error) {
-                container->iommu_data.type1.error = ret;
-            }
-        } else {
-            hw_error("vfio: DMA mapping failed, unable to continue");
-        }
-    }
+    vfio_dma_add(container, iova, end - iova, vaddr, section->readonly);
 }
 
 static void vfio_listener_region_del(MemoryListener *listener,
@@ -469,7 +682,11 @@ static void vfio_listener_region_del(MemoryListener *listener,
 
     trace_vfio_listener_region_del(iova, end - 1);
 
-    ret = vfio_dma_unmap(container, iova, end - iova);
+    if (memory_region_is_iommu(section->mr)) {
+        ret = vfio_dma_unmap(container, iova, end - iova);
+    } else {
+        ret = vfio_dma_del(container, iova, end);
+    }
     memory_region_unref(section->mr);
     if (ret) {
         error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
@@ -478,14 +695,41 @@ static void vfio_listener_region_del(MemoryListener *listener,
     }
 }
 
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            iommu_data.type1.listener);
+
+    if (container->iommu_data.type1.deferred) {
+        return;
+    }
+
+    /*
+     * Runtime, there's not much we can do other than throw a hardware
+     * error.
+     */
+    if (vfio_dma_flush(container)) {
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
 static const MemoryListener vfio_memory_listener = {
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
+    .commit = vfio_listener_commit,
 };
 
 static void vfio_listener_release(VFIOContainer *container)
 {
+    VFIODMAMapping *m, *tmp;
+
     memory_listener_unregister(&container->iommu_data.type1.listener);
+
+    /* Closing the container fd removes the mappings themselves */
+    QLIST_FOREACH_SAFE(m, &container->iommu_data.type1.mappings, next, tmp) {
+        QLIST_REMOVE(m, next);
+        g_free(m);
+    }
 }
 
 int vfio_mmap_region(Object *obj, VFIORegion *region,
@@ -530,6 +774,57 @@ empty_region:
     return ret;
 }
 
+/*
+ * Get the info of region @index, with its capability chain, into *@info.
+ * The caller frees it with g_free().
+ */
+int vfio_get_region_info(VFIODevice *vbasedev, int index,
+                         struct vfio_region_info **info)
+{
+    size_t argsz = sizeof(struct vfio_region_info);
+    int ret;
+
+    *info = g_malloc0(argsz);
+    (*info)->index = index;
+retry:
+    (*info)->argsz = argsz;
+
+    if (ioctl(vbasedev->fd, VFIO_DEVICE_GET_REGION_INFO, *info)) {
+        ret = -errno;
+        g_free(*info);
+        *info = NULL;
+        return ret;
+    }
+
+    /* The capabilities did not fit, ask again with enough room */
+    if ((*info)->argsz > argsz) {
+        argsz = (*info)->argsz;
+        *info = g_realloc(*info, argsz);
+        goto retry;
+    }
+
+    return 0;
+}
+
+struct vfio_info_cap_header *
+vfio_get_region_info_cap(struct vfio_region_info *info, uint16_t id)
+{
+    struct vfio_info_cap_header *hdr;
+    void *ptr = info;
+
+    if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS)) {
+        return NULL;
+    }
+
+    for (hdr = ptr + info->cap_offset; hdr != ptr; hdr = ptr + hdr->next) {
+        if (hdr->id == id) {
+            return hdr;
+        }
+    }
+
+    return NULL;
+}
+
 void vfio_reset_handler(void *opaque)
 {
     VFIOGroup *group;
@@ -665,6 +960,13 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
     container = g_malloc0(sizeof(*container));
     container->space = space;
     container->fd = fd;
+    /*
+     * Guest RAM is mapped once the first device that doesn't ask for lazy
+     * mapping is attached, see vfio_get_device().
+     */
+    QLIST_INIT(&container->iommu_data.type1.mappings);
+    container->iommu_data.type1.deferred = true;
+    container->iommu_data.type1.lazy = true;
     if (ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU) ||
         ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1v2_IOMMU)) {
         bool v2 = !!ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1v2_IOMMU);
@@ -690,14 +992,6 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
         memory_listener_register(&container->iommu_data.type1.listener,
                                  container->space->as);
 
-        if (container->iommu_data.type1.error) {
-            ret = container->iommu_data.type1.error;
-            error_report("vfio: memory listener initialization failed for container");
-            goto listener_release_exit;
-        }
-
-        container->iommu_data.type1.initialized = true;
-
     } else if (ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_SPAPR_TCE_IOMMU)) {
         ret = ioctl(group->fd, VFIO_GROUP_SET_CONTAINER, &fd);
         if (ret) {
@@ -742,9 +1036,12 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
     group->container = container;
     QLIST_INSERT_HEAD(&container->group_list, group, container_next);
 
+    if (!vfio_machine_done_registered) {
+        vfio_machine_done_registered = true;
+        qemu_add_machine_init_done_notifier(&vfio_machine_done_notifier);
+    }
+
     return 0;
-listener_release_exit:
-    vfio_listener_release(container);
 
 free_container_exit:
     g_free(container);
@@ -912,6 +1209,18 @@ int vfio_get_device(VFIOGroup *group, const char *name,
                           dev_info.num_irqs);
 
     vbasedev->reset_works = !!(dev_info.flags & VFIO_DEVICE_FLAGS_RESET);
+
+    if (!vbasedev->lazy_dma_map) {
+        group->container->iommu_data.type1.lazy = false;
+    }
+    ret = vfio_dma_start(group->container);
+    if (ret) {
+        error_report("vfio: failed to map guest RAM for device %s", name);
+        QLIST_REMOVE(vbasedev, next);
+        vbasedev->group = NULL;
+        close(fd);
+        return ret;
+    }
     return 0;
 }
 
@@ -926,6 +1235,25 @@ void vfio_put_base_device(VFIODevice *vbasedev)
     close(vbasedev->fd);
 }
 
+/*
+ * The guest may make @vbasedev do DMA from now on: map guest RAM if it
+ * was waiting for that.
+ */
+void vfio_device_dma_activate(VFIODevice *vbasedev)
+{
+    VFIOContainer *container = vbasedev->group->container;
+
+    if (!container->iommu_data.type1.lazy) {
+        return;
+    }
+
+    trace_vfio_device_dma_activate(vbasedev->name);
+    container->iommu_data.type1.lazy = false;
+    if (vfio_dma_start(container)) {
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
 static int vfio_container_do_ioctl(AddressSpace *as, int32_t groupid,
                                    int req, void *param)
 {
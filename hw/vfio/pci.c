@@ -72,6 +72,7 @@ typedef struct VFIOBAR {
     VFIORegion region;
     bool ioport;
     bool mem64;
+    bool msix_mappable; /* the kernel lets us mmap the MSI-X table */
     QLIST_HEAD(, VFIOQuirk) quirks;
 } VFIOBAR;
 
@@ -132,6 +133,9 @@ typedef struct VFIOMSIXInfo {
     uint32_t pba_offset;
     MemoryRegion mmap_mem;
     void *mmap;
+    int reloc_bar; /* BAR exposing the emulated table and PBA, or -1 */
+    uint32_t reloc_pba_offset;
+    MemoryRegion reloc_mem;
 } VFIOMSIXInfo;
 
 typedef struct VFIOPCIDevice {
@@ -168,6 +172,7 @@ typedef struct VFIOPCIDevice {
     bool has_flr;
     bool has_pm_reset;
     bool rom_read_failed;
+    bool msix_relocation;
 } VFIOPCIDevice;
 
 typedef struct VFIORomBlacklistEntry {
@@ -772,10 +777,13 @@ static void vfio_enable_msix(VFIOPCIDevice *vdev)
     vfio_msix_vector_do_use(&vdev->pdev, 0, NULL, NULL);
     vfio_msix_vector_release(&vdev->pdev, 0);
 
+    /* Commit the routes of the vectors already unmasked at once */
+    kvm_irqchip_begin_route_changes(kvm_state);
     if (msix_set_vector_notifiers(&vdev->pdev, vfio_msix_vector_use,
                                   vfio_msix_vector_release, NULL)) {
         error_report("vfio: msix_set_vector_notifiers failed");
     }
+    kvm_irqchip_commit_route_changes(kvm_state);
 
     trace_vfio_enable_msix(vdev->vbasedev.name);
 }
@@ -790,6 +798,7 @@ static void vfio_enable_msi(VFIOPCIDevice *vdev)
 retry:
     vdev->msi_vectors = g_malloc0(vdev->nr_vectors * sizeof(VFIOMSIVector));
 
+    kvm_irqchip_begin_route_changes(kvm_state);
     for (i = 0; i < vdev->nr_vectors; i++) {
         VFIOMSIVector *vector = &vdev->msi_vectors[i];
         MSIMessage msg = msi_get_message(&vdev->pdev, i);
@@ -811,6 +820,7 @@ retry:
          */
         vfio_add_kvm_msi_virq(vector, &msg, false);
     }
+    kvm_irqchip_commit_route_changes(kvm_state);
 
     /* Set interrupt type prior to possible interrupts */
     vdev->interrupt = VFIO_INT_MSI;
@@ -2149,6 +2159,11 @@ static void vfio_pci_write_config(PCIDevice *pdev, uint32_t addr,
     } else {
         /* Write everything to QEMU to keep emulated bits correct */
         pci_default_write_config(pdev, addr, val, len);
+
+        if (ranges_overlap(addr, len, PCI_COMMAND, 2) &&
+            (pci_get_word(pdev->config + PCI_COMMAND) & PCI_COMMAND_MASTER)) {
+            vfio_device_dma_activate(&vdev->vbasedev);
+        }
     }
 }
 
@@ -2249,6 +2264,7 @@ static int vfio_early_setup_msix(VFIOPCIDevice *vdev)
     vdev->msix->pba_bar = pba & PCI_MSIX_FLAGS_BIRMASK;
     vdev->msix->pba_offset = pba & ~PCI_MSIX_FLAGS_BIRMASK;
     vdev->msix->entries = (ctrl & PCI_MSIX_FLAGS_QSIZE) + 1;
+    vdev->msix->reloc_bar = -1;
 
     /*
      * Test the size of the pba_offset variable and catch if it extends outside
@@ -2285,15 +2301,88 @@ static int vfio_early_setup_msix(VFIOPCIDevice *vdev)
     return 0;
 }
 
+/*
+ * Move the emulated MSI-X table and PBA to a BAR of their own, which the
+ * device does not implement.  The physical BAR that holds the table is
+ * then directly mapped in full, including the host page shared with the
+ * table, provided the kernel lets us mmap the table.
+ */
+static int vfio_pci_relocate_msix(VFIOPCIDevice *vdev)
+{
+    VFIOMSIXInfo *msix = vdev->msix;
+    uint64_t table_size = msix->entries * PCI_MSIX_ENTRY_SIZE;
+    uint64_t pba_size = QEMU_ALIGN_UP(msix->entries, 64) / 8;
+    uint64_t size;
+    char name[64];
+    int i;
+
+    for (i = 0; i < PCI_ROM_SLOT; i++) {
+        uint32_t pci_bar;
+
+        if (vdev->bars[i].region.size) {
+            continue;
+        }
+
+        /* The upper half of a 64bit BAR has no size of its own either */
+        if (i > 0 && vdev->bars[i - 1].region.size) {
+            if (pread(vdev->vbasedev.fd, &pci_bar, sizeof(pci_bar),
+                      vdev->config_offset + PCI_BASE_ADDRESS_0 +
+                      (4 * (i - 1))) != sizeof(pci_bar)) {
+                return -errno;
+            }
+            pci_bar = le32_to_cpu(pci_bar);
+            if (!(pci_bar & PCI_BASE_ADDRESS_SPACE_IO) &&
+                (pci_bar & PCI_BASE_ADDRESS_MEM_TYPE_64)) {
+                continue;
+            }
+        }
+        break;
+    }
+
+    if (i == PCI_ROM_SLOT) {
+        error_report("vfio: %s: No free BAR to relocate the MSI-X table to",
+                     vdev->vbasedev.name);
+        return -ENOSPC;
+    }
+
+    msix->reloc_bar = i;
+    msix->reloc_pba_offset = REAL_HOST_PAGE_ALIGN(table_size);
+    size = MAX(msix->reloc_pba_offset + pba_size, qemu_real_host_page_size);
+    size = pow2ceil(size);
+
+    snprintf(name, sizeof(name), "VFIO %04x:%02x:%02x.%x MSI-X BAR %d",
+             vdev->host.domain, vdev->host.bus, vdev->host.slot,
+             vdev->host.function, i);
+    memory_region_init(&msix->reloc_mem, OBJECT(vdev), name, size);
+    pci_register_bar(&vdev->pdev, i, PCI_BASE_ADDRESS_SPACE_MEMORY,
+                     &msix->reloc_mem);
+
+    /* The device knows nothing of this BAR, emulate it entirely */
+    memset(vdev->emulated_config_bits + PCI_BASE_ADDRESS_0 + (4 * i),
+           0xff, 4);
+
+    trace_vfio_pci_relocate_msix(vdev->vbasedev.name, i, size);
+
+    return 0;
+}
+
 static int vfio_setup_msix(VFIOPCIDevice *vdev, int pos)
 {
+    VFIOMSIXInfo *msix = vdev->msix;
     int ret;
 
-    ret = msix_init(&vdev->pdev, vdev->msix->entries,
-                    &vdev->bars[vdev->msix->table_bar].region.mem,
-                    vdev->msix->table_bar, vdev->msix->table_offset,
-                    &vdev->bars[vdev->msix->pba_bar].region.mem,
-                    vdev->msix->pba_bar, vdev->msix->pba_offset, pos);
+    if (msix->reloc_bar >= 0) {
+        ret = msix_init(&vdev->pdev, msix->entries,
+                        &msix->reloc_mem, msix->reloc_bar, 0,
+                        &msix->reloc_mem, msix->reloc_bar,
+                        msix->reloc_pba_offset, pos);
+    } else {
+        ret = msix_init(&vdev->pdev, msix->entries,
+                        &vdev->bars[msix->table_bar].region.mem,
+                        msix->table_bar, msix->table_offset,
+                        &vdev->bars[msix->pba_bar].region.mem,
+                        msix->pba_bar, msix->pba_offset, pos);
+    }
     if (ret < 0) {
         if (ret == -ENOTSUP) {
             return 0;
@@ -2309,7 +2398,10 @@ static void vfio_teardown_msi(VFIOPCIDevice *vdev)
 {
     msi_uninit(&vdev->pdev);
 
-    if (vdev->msix) {
+    if (vdev->msix && vdev->msix->reloc_bar >= 0) {
+        msix_uninit(&vdev->pdev, &vdev->msix->reloc_mem,
+                    &vdev->msix->reloc_mem);
+    } else if (vdev->msix) {
         msix_uninit(&vdev->pdev,
                     &vdev->bars[vdev->msix->table_bar].region.mem,
                     &vdev->bars[vdev->msix->pba_bar].region.mem);
@@ -2409,10 +2501,11 @@ static void vfio_map_bar(VFIOPCIDevice *vdev, int nr)
     pci_register_bar(&vdev->pdev, nr, type, &bar->region.mem);
 
     /*
-     * We can't mmap areas overlapping the MSIX vector table, so we
-     * potentially insert a direct-mapped subregion before and after it.
+     * Unless the kernel allows it, we can't mmap areas overlapping the
+     * MSIX vector table, so we potentially insert a direct-mapped
+     * subregion before and after it.
      */
-    if (vdev->msix && vdev->msix->table_bar == nr) {
+    if (vdev->msix && vdev->msix->table_bar == nr && !bar->msix_mappable) {
         size = vdev->msix->table_offset & qemu_real_host_page_mask;
     }
 
@@ -2423,7 +2516,22 @@ static void vfio_map_bar(VFIOPCIDevice *vdev, int nr)
         error_report("%s unsupported. Performance may be slow", name);
     }
 
-    if (vdev->msix && vdev->msix->table_bar == nr) {
+    if (vdev->msix && vdev->msix->table_bar == nr && bar->msix_mappable) {
+        /*
+         * The whole BAR is mapped; let the emulated table and PBA that
+         * msix_init() may add on top of it take precedence.
+         */
+        memory_region_del_subregion(&bar->region.mem, &bar->region.mmap_mem);
+        memory_region_add_subregion_overlap(&bar->region.mem, 0,
+                                            &bar->region.mmap_mem, -1);
+
+        /* Nothing left for the msix-hi mapping, keep it empty */
+        strncat(name, " msix-hi", sizeof(name) - strlen(name) - 1);
+        vfio_mmap_region(OBJECT(vdev), &bar->region, &bar->region.mem,
+                         &vdev->msix->mmap_mem, &vdev->msix->mmap, 0, 0,
+                         name);
+        trace_vfio_map_bar_msix_mappable(vdev->vbasedev.name, nr);
+    } else if (vdev->msix && vdev->msix->table_bar == nr) {
         uint64_t start;
 
         start = REAL_HOST_PAGE_ALIGN((uint64_t)vdev->msix->table_offset +
@@ -3045,25 +3153,29 @@ static int vfio_populate_device(VFIOPCIDevice *vdev)
     }
 
     for (i = VFIO_PCI_BAR0_REGION_INDEX; i < VFIO_PCI_ROM_REGION_INDEX; i++) {
-        reg_info.index = i;
+        struct vfio_region_info *bar_info;
 
-        ret = ioctl(vbasedev->fd, VFIO_DEVICE_GET_REGION_INFO, &reg_info);
+        ret = vfio_get_region_info(vbasedev, i, &bar_info);
         if (ret) {
-            error_report("vfio: Error getting region %d info: %m", i);
+            error_report("vfio: Error getting region %d info: %s", i,
+                         strerror(-ret));
             goto error;
         }
 
         trace_vfio_populate_device_region(vbasedev->name, i,
-                                          (unsigned long)reg_info.size,
-                                          (unsigned long)reg_info.offset,
-                                          (unsigned long)reg_info.flags);
+                                          (unsigned long)bar_info->size,
+                                          (unsigned long)bar_info->offset,
+                                          (unsigned long)bar_info->flags);
 
         vdev->bars[i].region.vbasedev = vbasedev;
-        vdev->bars[i].region.flags = reg_info.flags;
-        vdev->bars[i].region.size = reg_info.size;
-        vdev->bars[i].region.fd_offset = reg_info.offset;
+        vdev->bars[i].region.flags = bar_info->flags;
+        vdev->bars[i].region.size = bar_info->size;
+        vdev->bars[i].region.fd_offset = bar_info->offset;
         vdev->bars[i].region.nr = i;
+        vdev->bars[i].msix_mappable = vfio_get_region_info_cap(bar_info,
+                                    VFIO_REGION_INFO_CAP_MSIX_MAPPABLE) != NULL;
         QLIST_INIT(&vdev->bars[i].quirks);
+        g_free(bar_info);
     }
 
     reg_info.index = VFIO_PCI_CONFIG_REGION_INDEX;
@@ -3150,6 +3262,9 @@ static void vfio_put_device(VFIOPCIDevice *vdev)
     g_free(vdev->vbasedev.name);
     if (vdev->msix) {
         object_unparent(OBJECT(&vdev->msix->mmap_mem));
+        if (vdev->msix->reloc_bar >= 0) {
+            object_unparent(OBJECT(&vdev->msix->reloc_mem));
+        }
         g_free(vdev->msix);
         vdev->msix = NULL;
     }
@@ -3626,6 +3741,13 @@ static int vfio_initfn(PCIDevice *pdev)
         return ret;
     }
 
+    if (vdev->msix && vdev->msix_relocation) {
+        ret = vfio_pci_relocate_msix(vdev);
+        if (ret) {
+            return ret;
+        }
+    }
+
     vfio_map_bars(vdev);
 
     ret = vfio_add_capabilities(vdev);
@@ -3750,6 +3872,10 @@ static Property vfio_pci_dev_properties[] = {
     DEFINE_PROP_BIT("x-req", VFIOPCIDevice, features,
                     VFIO_FEATURE_ENABLE_REQ_BIT, true),
     DEFINE_PROP_BOOL("x-mmap", VFIOPCIDevice, vbasedev.allow_mmap, true),
+    DEFINE_PROP_BOOL("x-lazy-dma-map", VFIOPCIDevice, vbasedev.lazy_dma_map,
+                     false),
+    DEFINE_PROP_BOOL("x-msix-relocation", VFIOPCIDevice, msix_relocation,
+                     false),
     /*
      * TODO - support passed fds... is this necessary?
      * DEFINE_PROP_STRING("vfiofd", VFIOPCIDevice, vfiofd_name),
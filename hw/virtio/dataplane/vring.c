@@ -158,22 +158,30 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 }
 
 
-static int get_desc(Vring *vring, VirtQueueElement *elem,
+/* The descriptors of the element being popped, collected before the
+ * element is allocated with the right size.  The output descriptors come
+ * first, followed by the input descriptors.
+ */
+typedef struct VringCurrentElement {
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+} VringCurrentElement;
+
+static int get_desc(Vring *vring, VringCurrentElement *elem,
                     struct vring_desc *desc)
 {
     unsigned *num;
     struct iovec *iov;
     hwaddr *addr;
     MemoryRegion *mr;
+    unsigned int idx;
 
     if (desc->flags & VRING_DESC_F_WRITE) {
         num = &elem->in_num;
-        iov = &elem->in_sg[*num];
-        addr = &elem->in_addr[*num];
     } else {
         num = &elem->out_num;
-        iov = &elem->out_sg[*num];
-        addr = &elem->out_addr[*num];
 
         /* If it's an output descriptor, they're all supposed
          * to come before any input descriptors. */
@@ -184,10 +192,13 @@ static int get_desc(Vring *vring, VirtQueueElement *elem,
     }
 
     /* Stop for now if there are not enough iovecs available. */
-    if (*num >= VIRTQUEUE_MAX_SIZE) {
-        error_report("Invalid SG num: %u", *num);
+    idx = elem->out_num + elem->in_num;
+    if (idx >= VIRTQUEUE_MAX_SIZE) {
+        error_report("Invalid SG num: %u", idx);
         return -EFAULT;
     }
+    iov = &elem->iov[idx];
+    addr = &elem->addr[idx];
 
     /* TODO handle non-contiguous memory across region boundaries */
     iov->iov_base = vring_map(&mr, desc->addr, desc->len,
@@ -218,7 +229,8 @@ static void copy_in_vring_desc(VirtIODevice *vdev,
 
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(VirtIODevice *vdev, Vring *vring,
-                        VirtQueueElement *elem, struct vring_desc *indirect)
+                        VringCurrentElement *elem,
+                        struct vring_desc *indirect)
 {
     struct vring_desc desc;
     unsigned int i = 0, count, found = 0;
@@ -287,6 +299,19 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
     return 0;
 }
 
+static void vring_unmap_current_element(VringCurrentElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->out_num; i++) {
+        vring_unmap(elem->iov[i].iov_base, false);
+    }
+
+    for (i = elem->out_num; i < elem->out_num + elem->in_num; i++) {
+        vring_unmap(elem->iov[i].iov_base, true);
+    }
+}
+
 static void vring_unmap_element(VirtQueueElement *elem)
 {
     int i;
@@ -309,22 +334,22 @@ static void vring_unmap_element(VirtQueueElement *elem)
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * This function returns an element of @sz bytes, or NULL if none was found.
+ * vring->broken is set if the ring is in an invalid state.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VringCurrentElement cur_elem;
+    VirtQueueElement *elem;
     int ret;
 
     /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
+    cur_elem.in_num = cur_elem.out_num = 0;
 
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
@@ -357,8 +382,6 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring_get_avail_ring(vdev, vring, last_avail_idx % num);
 
-    elem->index = head;
-
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
         error_report("Guest says index %u > %u is available", head, num);
@@ -385,14 +408,14 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vdev, vring, elem, &desc);
+            ret = get_indirect(vdev, vring, &cur_elem, &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, &cur_elem, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -407,15 +430,27 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
             virtio_tswap16(vdev, vring->last_avail_idx);
     }
 
-    return head;
+    /* Now copy what we have collected into a right-sized element */
+    elem = virtqueue_alloc_element(sz, cur_elem.out_num, cur_elem.in_num);
+    elem->index = head;
+    for (i = 0; i < cur_elem.out_num; i++) {
+        elem->out_addr[i] = cur_elem.addr[i];
+        elem->out_sg[i] = cur_elem.iov[i];
+    }
+    for (i = 0; i < cur_elem.in_num; i++) {
+        elem->in_addr[i] = cur_elem.addr[cur_elem.out_num + i];
+        elem->in_sg[i] = cur_elem.iov[cur_elem.out_num + i];
+    }
+
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
-    vring_unmap_element(elem);
-    return ret;
+    vring_unmap_current_element(&cur_elem);
+    return NULL;
 }
 
 /* After we've used one of their buffers, we tell them about it.
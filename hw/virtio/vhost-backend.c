@@ -13,6 +13,7 @@
 #include "qemu/error-report.h"
 
 #include <sys/ioctl.h>
+#include <linux/vhost.h>
 
 static int vhost_kernel_call(struct vhost_dev *dev, unsigned long int request,
                              void *arg)
@@ -42,11 +43,32 @@ static int vhost_kernel_cleanup(struct vhost_dev *dev)
     return close(fd);
 }
 
+/* Each vhost device has its own file descriptor and numbers its rings from 0 */
+static int vhost_kernel_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    return idx - dev->vq_index;
+}
+
+static int vhost_kernel_set_busyloop_timeout(struct vhost_dev *dev,
+                                            struct vhost_vring_state *state)
+{
+    if (vhost_kernel_call(dev, VHOST_SET_VRING_BUSYLOOP_TIMEOUT, state) < 0) {
+        /* Kernels before 4.6 do not busy poll */
+        return errno == ENOTTY ? -ENOSYS : -errno;
+    }
+    return 0;
+}
+
 static const VhostOps kernel_ops = {
         .backend_type = VHOST_BACKEND_TYPE_KERNEL,
         .vhost_call = vhost_kernel_call,
         .vhost_backend_init = vhost_kernel_init,
-        .vhost_backend_cleanup = vhost_kernel_cleanup
+        .vhost_backend_cleanup = vhost_kernel_cleanup,
+        .vhost_backend_get_vq_index = vhost_kernel_get_vq_index,
+        .vhost_backend_set_busyloop_timeout =
+            vhost_kernel_set_busyloop_timeout,
 };
 
 int vhost_set_backend_type(struct vhost_dev *dev, VhostBackendType backend_type)
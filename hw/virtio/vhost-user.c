@@ -24,6 +24,13 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ    0
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +48,12 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -57,6 +70,17 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+#define VHOST_USER_CONFIG_HDR_SIZE offsetof(VhostUserConfig, region)
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -71,6 +95,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserConfig config;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -180,6 +205,63 @@ static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
             0 : -1;
 }
 
+/* All queue pairs share the socket; these are only sent for the first one */
+static bool vhost_user_one_time_request(VhostUserRequest request)
+{
+    switch (request) {
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_MEM_TABLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .u64 = u64,
+        .size = sizeof(m.u64),
+    };
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
 static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         void *arg)
 {
@@ -194,6 +276,10 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     msg_request = vhost_user_request_translate(request);
+    if (vhost_user_one_time_request(msg_request) && dev->vq_index != 0) {
+        return 0;
+    }
+
     msg.request = msg_request;
     msg.flags = VHOST_USER_VERSION;
     msg.size = 0;
@@ -285,13 +371,16 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
     }
 
+    /* Requests without a reply are lost along with the connection, but
+     * the caller needs to know when a reply can't be had.
+     */
     if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
-        return 0;
+        return need_reply ? -1 : 0;
     }
 
     if (need_reply) {
         if (vhost_user_read(dev, &msg) < 0) {
-            return 0;
+            return -1;
         }
 
         if (msg_request != msg.request) {
@@ -327,9 +416,45 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
 
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    uint64_t features;
+    int err;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     dev->opaque = opaque;
+    dev->protocol_features = 0;
+    dev->max_queues = 1;
+
+    err = vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features);
+    if (err < 0) {
+        return err;
+    }
+
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+
+        err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                 &features);
+        if (err < 0) {
+            return err;
+        }
+
+        dev->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+        err = vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                                 dev->protocol_features);
+        if (err < 0) {
+            return err;
+        }
+
+        if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                                     &features);
+            if (err < 0) {
+                return err;
+            }
+            dev->max_queues = features;
+        }
+    }
 
     return 0;
 }
@@ -343,9 +468,118 @@ static int vhost_user_cleanup(struct vhost_dev *dev)
     return 0;
 }
 
+/* The rings of all queue pairs are numbered across the shared socket */
+static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    return idx;
+}
+
+static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
+{
+    int i;
+
+    /* Without protocol features the rings are enabled when started */
+    if (!(dev->acked_features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->nvqs; ++i) {
+        VhostUserMsg msg = {
+            .request = VHOST_USER_SET_VRING_ENABLE,
+            .flags = VHOST_USER_VERSION,
+            .size = sizeof(m.state),
+        };
+
+        msg.state.index = dev->vq_index + i;
+        msg.state.num = enable;
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_get_config(struct vhost_dev *dev, uint8_t *config,
+                                 uint32_t config_len)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_CONFIG,
+        .flags = VHOST_USER_VERSION,
+        .size = VHOST_USER_CONFIG_HDR_SIZE + config_len,
+    };
+
+    if (!(dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+        return -ENOTSUP;
+    }
+
+    if (config_len > VHOST_USER_MAX_CONFIG_SIZE) {
+        return -EINVAL;
+    }
+
+    msg.config.offset = 0;
+    msg.config.size = config_len;
+    msg.config.flags = 0;
+    memset(msg.config.region, 0, config_len);
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -EIO;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -EIO;
+    }
+
+    if (msg.request != VHOST_USER_GET_CONFIG) {
+        error_report("Received unexpected msg type. Expected %d received %d",
+                     VHOST_USER_GET_CONFIG, msg.request);
+        return -EIO;
+    }
+
+    if (msg.size != VHOST_USER_CONFIG_HDR_SIZE + config_len ||
+        msg.config.size != config_len) {
+        error_report("Received bad msg size.");
+        return -EIO;
+    }
+
+    memcpy(config, msg.config.region, config_len);
+    return 0;
+}
+
+static int vhost_user_set_config(struct vhost_dev *dev, const uint8_t *data,
+                                 uint32_t offset, uint32_t size,
+                                 uint32_t flags)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_CONFIG,
+        .flags = VHOST_USER_VERSION,
+        .size = VHOST_USER_CONFIG_HDR_SIZE + size,
+    };
+
+    if (!(dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+        return -ENOTSUP;
+    }
+
+    if (size > VHOST_USER_MAX_CONFIG_SIZE) {
+        return -EINVAL;
+    }
+
+    msg.config.offset = offset;
+    msg.config.size = size;
+    msg.config.flags = flags;
+    memcpy(msg.config.region, data, size);
+
+    return vhost_user_write(dev, &msg, NULL, 0) < 0 ? -EIO : 0;
+}
+
 const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_get_vq_index = vhost_user_get_vq_index,
+        .vhost_backend_set_vring_enable = vhost_user_set_vring_enable,
+        .vhost_backend_get_config = vhost_user_get_config,
+        .vhost_backend_set_config = vhost_user_set_config,
         };
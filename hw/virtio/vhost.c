@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/migration.h"
+#include "exec/ram_addr.h"
 
 static struct vhost_log *vhost_log;
 
@@ -38,6 +39,11 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     vhost_log_chunk_t *from = log + start / VHOST_LOG_CHUNK;
     vhost_log_chunk_t *to = log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = (start / VHOST_LOG_CHUNK) * VHOST_LOG_CHUNK;
+    /* ram address of guest physical address 0, as seen by this section */
+    ram_addr_t ram_base = memory_region_get_ram_addr(section->mr) +
+                          section->offset_within_region -
+                          section->offset_within_address_space;
+    uint8_t clients = memory_region_get_dirty_log_mask(section->mr);
 
     if (end < start) {
         return;
@@ -47,6 +53,21 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
 
     for (;from < to; ++from) {
         vhost_log_chunk_t log;
+        size_t len = (to - from) * sizeof(*from);
+
+        /* Skip clean parts of the log a vector block at a time */
+        len -= len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                      sizeof(VECTYPE));
+        if (len && can_use_buffer_find_nonzero_offset(from, len)) {
+            size_t skip = buffer_find_nonzero_offset(from, len) / sizeof(*from);
+
+            from += skip;
+            addr += skip * VHOST_LOG_CHUNK;
+            if (from == to) {
+                break;
+            }
+        }
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
@@ -56,6 +77,16 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
         /* Data must be read atomically. We don't really need barrier semantics
          * but it's easier to use atomic_* than roll our own. */
         log = atomic_xchg(from, 0);
+
+        /* Whole chunks map to one word of the dirty bitmaps */
+        if (TARGET_PAGE_SIZE == VHOST_LOG_PAGE &&
+            addr >= start && addr + VHOST_LOG_CHUNK - 1 <= end &&
+            ((ram_base + addr) & (VHOST_LOG_CHUNK - 1)) == 0) {
+            cpu_physical_memory_set_dirty_word(ram_base + addr, log, clients);
+            addr += VHOST_LOG_CHUNK;
+            continue;
+        }
+
         while (log) {
             int bit = ctzl(log);
             hwaddr page_addr;
@@ -601,13 +632,15 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
 
 static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
 {
-    int r, t, i;
+    int r, t, i, idx;
     r = vhost_dev_set_features(dev, enable_log);
     if (r < 0) {
         goto err_features;
     }
     for (i = 0; i < dev->nvqs; ++i) {
-        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                         dev->vq_index + i);
+        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      enable_log);
         if (r < 0) {
             goto err_vq;
@@ -616,7 +649,9 @@ static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
     return 0;
 err_vq:
     for (; i >= 0; --i) {
-        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                         dev->vq_index + i);
+        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      dev->log_enabled);
         assert(t >= 0);
     }
@@ -719,7 +754,7 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 {
     hwaddr s, l, a;
     int r;
-    int vhost_vq_index = idx - dev->vq_index;
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_file file = {
         .index = vhost_vq_index
     };
@@ -822,7 +857,7 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
                                     struct vhost_virtqueue *vq,
                                     unsigned idx)
 {
-    int vhost_vq_index = idx - dev->vq_index;
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_state state = {
         .index = vhost_vq_index,
     };
@@ -830,10 +865,14 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
     r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
+        /* Connection to the backend lost, assume it completed in order */
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+        r = 0;
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
 
     /* In the cross-endian case, we need to reset the vring endianness to
@@ -875,8 +914,9 @@ static void vhost_eventfd_del(MemoryListener *listener,
 static int vhost_virtqueue_init(struct vhost_dev *dev,
                                 struct vhost_virtqueue *vq, int n)
 {
+    int vhost_vq_index = dev->vhost_ops->vhost_backend_get_vq_index(dev, n);
     struct vhost_vring_file file = {
-        .index = n,
+        .index = vhost_vq_index,
     };
     int r = event_notifier_init(&vq->masked_notifier, 0);
     if (r < 0) {
@@ -912,8 +952,12 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     if (hdev->vhost_ops->vhost_backend_init(hdev, opaque) < 0) {
-        close((uintptr_t)opaque);
-        return -errno;
+        r = -errno;
+        /* vhost-user passes its chardev, which stays with the caller */
+        if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+            close((uintptr_t)opaque);
+        }
+        return r ? r : -EIO;
     }
 
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
@@ -927,7 +971,7 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vhost_virtqueue_init(hdev, hdev->vqs + i, i);
+        r = vhost_virtqueue_init(hdev, hdev->vqs + i, hdev->vq_index + i);
         if (r < 0) {
             goto fail_vq;
         }
@@ -1070,7 +1114,7 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     assert(n >= hdev->vq_index && n < hdev->vq_index + hdev->nvqs);
 
     struct vhost_vring_file file = {
-        .index = index
+        .index = hdev->vhost_ops->vhost_backend_get_vq_index(hdev, n),
     };
     if (mask) {
         file.fd = event_notifier_get_fd(&hdev->vqs[index].masked_notifier);
@@ -1108,6 +1152,59 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
     }
 }
 
+/* Make the backend busy poll the rings for up to @timeout microseconds
+ * before it waits for a kick, 0 disables busy polling.  The backend keeps
+ * the setting across starts and stops of the device.
+ */
+int vhost_dev_set_busyloop_timeout(struct vhost_dev *hdev, uint32_t timeout)
+{
+    int i, r;
+
+    if (!hdev->vhost_ops->vhost_backend_set_busyloop_timeout) {
+        return -ENOSYS;
+    }
+
+    for (i = 0; i < hdev->nvqs; ++i) {
+        struct vhost_vring_state state = {
+            .index = hdev->vhost_ops->vhost_backend_get_vq_index(
+                         hdev, hdev->vq_index + i),
+            .num = timeout,
+        };
+
+        r = hdev->vhost_ops->vhost_backend_set_busyloop_timeout(hdev, &state);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    hdev->busyloop_timeout = timeout;
+    return 0;
+}
+
+/* Read @config_len bytes of the device config space from the backend */
+int vhost_dev_get_config(struct vhost_dev *hdev, uint8_t *config,
+                         uint32_t config_len)
+{
+    if (!hdev->vhost_ops->vhost_backend_get_config) {
+        return -ENOSYS;
+    }
+
+    return hdev->vhost_ops->vhost_backend_get_config(hdev, config,
+                                                     config_len);
+}
+
+/* Write @size bytes at @offset of the device config space to the backend */
+int vhost_dev_set_config(struct vhost_dev *hdev, const uint8_t *data,
+                         uint32_t offset, uint32_t size, uint32_t flags)
+{
+    if (!hdev->vhost_ops->vhost_backend_set_config) {
+        return -ENOSYS;
+    }
+
+    return hdev->vhost_ops->vhost_backend_set_config(hdev, data, offset,
+                                                     size, flags);
+}
+
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
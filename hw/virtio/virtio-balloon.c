@@ -23,9 +23,11 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
+#include "migration/migration.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -34,13 +36,81 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-static void balloon_page(void *addr, int deflate)
+/*
+ * Host memory that is about to be ballooned or deflated.  Consecutive
+ * pages are merged so that a whole run costs a single madvise().
+ */
+typedef struct BalloonRun {
+    void *start;
+    size_t len;
+    bool deflate;
+} BalloonRun;
+
+static void balloon_run_flush(BalloonRun *run)
 {
 #if defined(__linux__)
-    if (!kvm_enabled() || kvm_has_sync_mmu())
-        qemu_madvise(addr, TARGET_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    if (run->len && (!kvm_enabled() || kvm_has_sync_mmu())) {
+        qemu_madvise(run->start, run->len,
+                     run->deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    }
 #endif
+    run->len = 0;
+}
+
+static void balloon_run_add(BalloonRun *run, void *addr, size_t len)
+{
+    if (run->len && addr == run->start + run->len) {
+        run->len += len;
+    } else if (run->len && addr + len == run->start) {
+        /* Guests often hand out pages in descending address order */
+        run->start = addr;
+        run->len += len;
+    } else {
+        balloon_run_flush(run);
+        run->start = addr;
+        run->len = len;
+    }
+}
+
+static void balloon_pbp_reset(PartiallyBalloonedPage *pbp)
+{
+    g_free(pbp->bitmap);
+    pbp->bitmap = NULL;
+}
+
+/*
+ * Inflate the target page at @addr, which is @ram_addr in the RAM block,
+ * backed by host pages of @page_size bytes.  When those are larger than
+ * a target page, release a host page only once the guest has ballooned
+ * all of it.  Only one host page is tracked at a time: the parts of a
+ * previous one are forgotten, like the Linux driver does with pages that
+ * it could not balloon together.
+ */
+static void balloon_inflate_page(VirtIOBalloon *s, BalloonRun *run,
+                                 void *addr, ram_addr_t ram_addr,
+                                 size_t page_size)
+{
+    PartiallyBalloonedPage *pbp = &s->pbp;
+    size_t subpages = page_size / TARGET_PAGE_SIZE;
+    ram_addr_t base = ram_addr & ~(ram_addr_t)(page_size - 1);
+
+    if (subpages <= 1) {
+        balloon_run_add(run, addr, TARGET_PAGE_SIZE);
+        return;
+    }
+
+    if (pbp->bitmap && pbp->base != base) {
+        balloon_pbp_reset(pbp);
+    }
+    if (!pbp->bitmap) {
+        pbp->base = base;
+        pbp->bitmap = bitmap_new(subpages);
+    }
+    set_bit((ram_addr - base) / TARGET_PAGE_SIZE, pbp->bitmap);
+    if (find_first_zero_bit(pbp->bitmap, subpages) == subpages) {
+        balloon_run_add(run, addr - (ram_addr - base), page_size);
+        balloon_pbp_reset(pbp);
+    }
 }
 
 static const char *balloon_stat_names[] = {
@@ -98,14 +168,16 @@ static void balloon_stats_poll_cb(void *opaque)
     VirtIOBalloon *s = opaque;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
-    if (!balloon_stats_supported(s)) {
+    if (s->stats_vq_elem == NULL || !balloon_stats_supported(s)) {
         /* re-schedule */
         balloon_stats_change_timer(s, s->stats_poll_interval);
         return;
     }
 
-    virtqueue_push(s->svq, &s->stats_vq_elem, s->stats_vq_offset);
+    virtqueue_push(s->svq, s->stats_vq_elem, s->stats_vq_offset);
     virtio_notify(vdev, s->svq);
+    virtqueue_free_element(s->stats_vq_elem);
+    s->stats_vq_elem = NULL;
 }
 
 static void balloon_stats_get_all(Object *obj, struct Visitor *v,
@@ -203,16 +275,19 @@ static void balloon_stats_set_poll_interval(Object *obj, struct Visitor *v,
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     MemoryRegionSection section;
+    BalloonRun run = { .deflate = vq == s->dvq };
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         size_t offset = 0;
         uint32_t pfn;
 
-        while (iov_to_buf(elem.out_sg, elem.out_num, offset, &pfn, 4) == 4) {
+        while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
             ram_addr_t pa;
-            ram_addr_t addr;
+            ram_addr_t addr, ram_addr;
+            size_t page_size;
+            void *host;
             int p = virtio_ldl_p(vdev, &pfn);
 
             pa = (ram_addr_t) p << VIRTIO_BALLOON_PFN_SHIFT;
@@ -220,36 +295,165 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
             /* FIXME: remove get_system_memory(), but how? */
             section = memory_region_find(get_system_memory(), pa, 1);
-            if (!int128_nz(section.size) || !memory_region_is_ram(section.mr))
+            if (!int128_nz(section.size) ||
+                !memory_region_is_ram(section.mr)) {
                 continue;
+            }
 
             trace_virtio_balloon_handle_output(memory_region_name(section.mr),
                                                pa);
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
                should be OK because we only want a single page.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            host = memory_region_get_ram_ptr(section.mr) + addr;
+            ram_addr = memory_region_get_ram_addr(section.mr) + addr;
+            page_size = qemu_ram_pagesize(ram_addr);
+            if (!run.deflate) {
+                balloon_inflate_page(s, &run, host, ram_addr, page_size);
+            } else {
+                /* The host page won't be ballooned as a whole anymore */
+                if (s->pbp.bitmap &&
+                    s->pbp.base == (ram_addr & ~(ram_addr_t)(page_size - 1))) {
+                    balloon_pbp_reset(&s->pbp);
+                }
+                balloon_run_add(&run, host, TARGET_PAGE_SIZE);
+            }
             memory_region_unref(section.mr);
         }
+        balloon_run_flush(&run);
 
-        virtqueue_push(vq, &elem, offset);
+        virtqueue_push(vq, elem, offset);
         virtio_notify(vdev, vq);
+        virtqueue_free_element(elem);
+    }
+}
+
+static bool virtio_balloon_free_page_support(VirtIOBalloon *s)
+{
+    return virtio_has_feature(VIRTIO_DEVICE(s),
+                              VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+/*
+ * The guest answers a request for free page hints by sending the id of
+ * the request, then free memory as device-writable buffers, and it sends
+ * another id when it is done.  Hints are only taken while a request is
+ * in progress: buffers queued before migration stopped or restarted
+ * hinting around a bitmap sync must be dropped.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    unsigned int i;
+    uint32_t id;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        if (elem->out_num) {
+            if (iov_to_buf(elem->out_sg, elem->out_num, 0, &id,
+                           sizeof(id)) == sizeof(id)) {
+                id = virtio_ldl_p(vdev, &id);
+                if (id == s->free_page_report_cmd_id) {
+                    s->free_page_report_status = FREE_PAGE_REPORT_S_START;
+                } else if (s->free_page_report_status ==
+                           FREE_PAGE_REPORT_S_START) {
+                    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+                }
+            }
+        }
+        if (s->free_page_report_status == FREE_PAGE_REPORT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+        virtqueue_push(vq, elem, 0);
+        virtqueue_free_element(elem);
+    }
+    virtio_notify(vdev, vq);
+}
+
+/* Ask the guest for a new round of free page hints */
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    if (s->free_page_report_cmd_id == UINT_MAX) {
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+    } else {
+        s->free_page_report_cmd_id++;
+    }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_REQUESTED;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_stop(VirtIOBalloon *s)
+{
+    if (s->free_page_report_status != FREE_PAGE_REPORT_S_STOP &&
+        s->free_page_report_status != FREE_PAGE_REPORT_S_DONE) {
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+/* The guest may reuse the memory it hinted */
+static void virtio_balloon_free_page_done(VirtIOBalloon *s)
+{
+    s->free_page_report_status = FREE_PAGE_REPORT_S_DONE;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_report_notify(Notifier *n, void *data)
+{
+    VirtIOBalloon *s = container_of(n, VirtIOBalloon,
+                                    free_page_report_notify);
+    PrecopyNotifyReason *reason = data;
+
+    if (!virtio_balloon_free_page_support(s)) {
+        return;
+    }
+
+    switch (*reason) {
+    case PRECOPY_NOTIFY_SETUP:
+        precopy_enable_free_page_optimization();
+        break;
+    case PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC:
+        /* hints made before the sync could hide what it is about to find */
+        virtio_balloon_free_page_stop(s);
+        break;
+    case PRECOPY_NOTIFY_AFTER_BITMAP_SYNC:
+        if (runstate_is_running()) {
+            virtio_balloon_free_page_start(s);
+        } else {
+            virtio_balloon_free_page_done(s);
+        }
+        break;
+    case PRECOPY_NOTIFY_CLEANUP:
+        virtio_balloon_free_page_done(s);
+        break;
     }
 }
 
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
-    VirtQueueElement *elem = &s->stats_vq_elem;
+    VirtQueueElement *elem;
     VirtIOBalloonStat stat;
     size_t offset = 0;
     qemu_timeval tv;
 
-    if (!virtqueue_pop(vq, elem)) {
+    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+    if (!elem) {
         goto out;
     }
 
+    if (s->stats_vq_elem != NULL) {
+        /* This should never happen if the driver follows the spec. */
+        virtqueue_push(vq, s->stats_vq_elem, 0);
+        virtio_notify(vdev, vq);
+        virtqueue_free_element(s->stats_vq_elem);
+    }
+    s->stats_vq_elem = elem;
+
     /* Initialize the stats to get rid of any stale values.  This is only
      * needed to handle the case where a guest supports fewer stats than it
      * used to (ie. it has booted into an old kernel).
@@ -280,6 +484,14 @@ out:
     }
 }
 
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return sizeof(struct virtio_balloon_config);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_report_cmd_id);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
@@ -287,9 +499,19 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    if (dev->free_page_report_status == FREE_PAGE_REPORT_S_REQUESTED) {
+        config.free_page_report_cmd_id =
+            cpu_to_le32(dev->free_page_report_cmd_id);
+    } else if (dev->free_page_report_status == FREE_PAGE_REPORT_S_STOP) {
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+    } else {
+        config.free_page_report_cmd_id =
+            cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+    }
 
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -300,7 +522,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -353,6 +575,9 @@ static void virtio_balloon_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     qemu_put_be32(f, s->num_pages);
     qemu_put_be32(f, s->actual);
+    if (virtio_balloon_free_page_support(s)) {
+        qemu_put_be32(f, s->free_page_report_cmd_id);
+    }
 }
 
 static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
@@ -370,6 +595,11 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+    if (virtio_balloon_free_page_support(s)) {
+        /* The next request must not be mistaken for one of ours */
+        s->free_page_report_cmd_id = qemu_get_be32(f);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_DONE;
+    }
     return 0;
 }
 
@@ -380,7 +610,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -394,6 +624,15 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, VIRTQUEUE_MAX_SIZE,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+        s->free_page_report_notify.notify =
+            virtio_balloon_free_page_report_notify;
+        precopy_add_notifier(&s->free_page_report_notify);
+    }
 
     reset_stats(s);
 
@@ -406,7 +645,13 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        precopy_remove_notifier(&s->free_page_report_notify);
+    }
+    balloon_pbp_reset(&s->pbp);
     balloon_stats_destroy_timer(s);
+    virtqueue_free_element(s->stats_vq_elem);
+    s->stats_vq_elem = NULL;
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
@@ -428,6 +673,8 @@ static void virtio_balloon_instance_init(Object *obj)
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -36,6 +36,7 @@
 #include "qemu/range.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/visitor.h"
+#include "qemu/main-loop.h"
 
 #define VIRTIO_PCI_REGION_SIZE(dev)     VIRTIO_PCI_CONFIG_OFF(msix_present(dev))
 
@@ -138,6 +139,18 @@ static int virtio_pci_load_queue(DeviceState *d, int n, QEMUFile *f)
 
 #define QEMU_VIRTIO_PCI_QUEUE_MEM_MULT 0x1000
 
+static void virtio_pci_set_notify_kick(VirtIOPCIProxy *proxy, int n,
+                                       bool kick)
+{
+    qemu_mutex_lock(&proxy->notify_lock);
+    if (kick) {
+        set_bit(n, proxy->notify_kick);
+    } else {
+        clear_bit(n, proxy->notify_kick);
+    }
+    qemu_mutex_unlock(&proxy->notify_lock);
+}
+
 static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
                                                  int n, bool assign, bool set_handler)
 {
@@ -169,7 +182,9 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
             memory_region_add_eventfd(legacy_mr, legacy_addr, 2,
                                       true, n, notifier);
         }
+        virtio_pci_set_notify_kick(proxy, n, true);
     } else {
+        virtio_pci_set_notify_kick(proxy, n, false);
         if (modern) {
             memory_region_del_eventfd(modern_mr, modern_addr, 2,
                                       true, n, notifier);
@@ -934,8 +949,11 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
             proxy->vector_irqfd =
                 g_malloc0(sizeof(*proxy->vector_irqfd) *
                           msix_nr_vectors_allocated(&proxy->pci_dev));
+            /* Commit the routes of all queues at once */
+            kvm_irqchip_begin_route_changes(kvm_state);
             r = kvm_virtio_pci_vector_use(proxy, nvqs);
             if (r < 0) {
+                kvm_irqchip_commit_route_changes(kvm_state);
                 goto assign_error;
             }
         }
@@ -943,6 +961,9 @@ static int virtio_pci_set_guest_notifiers(DeviceState *d, int nvqs, bool assign)
                                       virtio_pci_vector_unmask,
                                       virtio_pci_vector_mask,
                                       virtio_pci_vector_poll);
+        if (with_irqfd) {
+            kvm_irqchip_commit_route_changes(kvm_state);
+        }
         if (r < 0) {
             goto notifiers_error;
         }
@@ -1269,15 +1290,46 @@ static uint64_t virtio_pci_notify_read(void *opaque, hwaddr addr,
     return 0;
 }
 
+/* Doorbell writes come here outside the BQL.  A queue with a host
+ * notifier is kicked through it, as KVM does for writes that match the
+ * ioeventfd; the thread that polls the notifier does the rest.  Other
+ * queues are processed under the BQL as usual.
+ */
 static void virtio_pci_notify_write(void *opaque, hwaddr addr,
                                     uint64_t val, unsigned size)
 {
-    VirtIODevice *vdev = opaque;
+    VirtIOPCIProxy *proxy = opaque;
     unsigned queue = addr / QEMU_VIRTIO_PCI_QUEUE_MEM_MULT;
+    VirtIODevice *vdev;
+    bool locked;
 
-    if (queue < VIRTIO_QUEUE_MAX) {
+    if (queue >= VIRTIO_QUEUE_MAX) {
+        return;
+    }
+
+    qemu_mutex_lock(&proxy->notify_lock);
+    if (test_bit(queue, proxy->notify_kick)) {
+        /* The notifier is only cleaned up after its bit is cleared */
+        vdev = virtio_bus_get_device(&proxy->bus);
+        event_notifier_set(
+            virtio_queue_get_host_notifier(virtio_get_queue(vdev, queue)));
+        qemu_mutex_unlock(&proxy->notify_lock);
+        return;
+    }
+    qemu_mutex_unlock(&proxy->notify_lock);
+
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* The device may have been unplugged while we waited for the lock */
+    vdev = virtio_bus_get_device(&proxy->bus);
+    if (vdev) {
         virtio_queue_notify(vdev, queue);
     }
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr,
@@ -1394,9 +1446,10 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
 
     memory_region_init_io(&proxy->notify.mr, OBJECT(proxy),
                           &notify_ops,
-                          virtio_bus_get_device(&proxy->bus),
+                          proxy,
                           "virtio-pci-notify",
                           proxy->notify.size);
+    memory_region_clear_global_locking(&proxy->notify.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
@@ -1635,10 +1688,27 @@ static void virtio_pci_class_init(ObjectClass *klass, void *data)
     dc->reset = virtio_pci_reset;
 }
 
+static void virtio_pci_instance_init(Object *obj)
+{
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(obj);
+
+    qemu_mutex_init(&proxy->notify_lock);
+}
+
+/* Only now is no vCPU thread inside virtio_pci_notify_write() anymore */
+static void virtio_pci_instance_finalize(Object *obj)
+{
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(obj);
+
+    qemu_mutex_destroy(&proxy->notify_lock);
+}
+
 static const TypeInfo virtio_pci_info = {
     .name          = TYPE_VIRTIO_PCI,
     .parent        = TYPE_PCI_DEVICE,
     .instance_size = sizeof(VirtIOPCIProxy),
+    .instance_init = virtio_pci_instance_init,
+    .instance_finalize = virtio_pci_instance_finalize,
     .class_init    = virtio_pci_class_init,
     .class_size    = sizeof(VirtioPCIClass),
     .abstract      = true,
@@ -1823,6 +1893,64 @@ static const TypeInfo vhost_scsi_pci_info = {
 };
 #endif
 
+/* vhost-user-blk-pci */
+
+#ifdef CONFIG_LINUX
+static Property vhost_user_blk_pci_properties[] = {
+    DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
+                    VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_blk_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
+{
+    VHostUserBlkPCI *dev = VHOST_USER_BLK_PCI(vpci_dev);
+    DeviceState *vdev = DEVICE(&dev->vdev);
+
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        vpci_dev->nvectors = dev->vdev.num_queues + 1;
+    }
+
+    qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
+    object_property_set_bool(OBJECT(vdev), true, "realized", errp);
+}
+
+static void vhost_user_blk_pci_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioPCIClass *k = VIRTIO_PCI_CLASS(klass);
+    PCIDeviceClass *pcidev_k = PCI_DEVICE_CLASS(klass);
+
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->props = vhost_user_blk_pci_properties;
+    k->realize = vhost_user_blk_pci_realize;
+    pcidev_k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    pcidev_k->device_id = PCI_DEVICE_ID_VIRTIO_BLOCK;
+    pcidev_k->revision = VIRTIO_PCI_ABI_VERSION;
+    pcidev_k->class_id = PCI_CLASS_STORAGE_SCSI;
+}
+
+static void vhost_user_blk_pci_instance_init(Object *obj)
+{
+    VHostUserBlkPCI *dev = VHOST_USER_BLK_PCI(obj);
+
+    virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev),
+                                TYPE_VHOST_USER_BLK);
+    object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
+                              "bootindex", &error_abort);
+}
+
+static const TypeInfo vhost_user_blk_pci_info = {
+    .name          = TYPE_VHOST_USER_BLK_PCI,
+    .parent        = TYPE_VIRTIO_PCI,
+    .instance_size = sizeof(VHostUserBlkPCI),
+    .instance_init = vhost_user_blk_pci_instance_init,
+    .class_init    = vhost_user_blk_pci_class_init,
+};
+#endif
+
 /* virtio-balloon-pci */
 
 static Property virtio_balloon_pci_properties[] = {
@@ -2249,6 +2377,9 @@ static void virtio_pci_register_types(void)
 #ifdef CONFIG_VHOST_SCSI
     type_register_static(&vhost_scsi_pci_info);
 #endif
+#ifdef CONFIG_LINUX
+    type_register_static(&vhost_user_blk_pci_info);
+#endif
 }
 
 type_init(virtio_pci_register_types)
@@ -16,6 +16,8 @@
 #define QEMU_VIRTIO_PCI_H
 
 #include "hw/pci/msi.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
 #include "hw/virtio/virtio-blk.h"
 #include "hw/virtio/virtio-net.h"
 #include "hw/virtio/virtio-rng.h"
@@ -32,6 +34,9 @@
 #ifdef CONFIG_VHOST_SCSI
 #include "hw/virtio/vhost-scsi.h"
 #endif
+#ifdef CONFIG_LINUX
+#include "hw/virtio/vhost-user-blk.h"
+#endif
 
 typedef struct VirtIOPCIProxy VirtIOPCIProxy;
 typedef struct VirtIOBlkPCI VirtIOBlkPCI;
@@ -40,6 +45,7 @@ typedef struct VirtIOBalloonPCI VirtIOBalloonPCI;
 typedef struct VirtIOSerialPCI VirtIOSerialPCI;
 typedef struct VirtIONetPCI VirtIONetPCI;
 typedef struct VHostSCSIPCI VHostSCSIPCI;
+typedef struct VHostUserBlkPCI VHostUserBlkPCI;
 typedef struct VirtIORngPCI VirtIORngPCI;
 typedef struct VirtIOInputPCI VirtIOInputPCI;
 typedef struct VirtIOInputHIDPCI VirtIOInputHIDPCI;
@@ -134,6 +140,11 @@ struct VirtIOPCIProxy {
 
     bool ioeventfd_disabled;
     bool ioeventfd_started;
+    /* Queues whose host notifier is assigned, so that the notify region,
+     * which is accessed without the BQL, can kick them directly.
+     */
+    QemuMutex notify_lock;
+    DECLARE_BITMAP(notify_kick, VIRTIO_QUEUE_MAX);
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
     VirtioBusState bus;
@@ -166,6 +177,20 @@ struct VHostSCSIPCI {
 };
 #endif
 
+#ifdef CONFIG_LINUX
+/*
+ * vhost-user-blk-pci: This extends VirtioPCIProxy.
+ */
+#define TYPE_VHOST_USER_BLK_PCI "vhost-user-blk-pci"
+#define VHOST_USER_BLK_PCI(obj) \
+        OBJECT_CHECK(VHostUserBlkPCI, (obj), TYPE_VHOST_USER_BLK_PCI)
+
+struct VHostUserBlkPCI {
+    VirtIOPCIProxy parent_obj;
+    VHostUserBlk vdev;
+};
+#endif
+
 /*
  * virtio-blk-pci: This extends VirtioPCIProxy.
  */
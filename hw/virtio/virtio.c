@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "sysemu/stats.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -66,9 +67,22 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* Host mapping of one of the rings, used instead of address_space accesses
+ * when the ring lies in a single RAM region.
+ */
+typedef struct VRingCache {
+    hwaddr pa;
+    void *ptr;
+    MemoryRegion *mr;
+    hwaddr offset;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
     uint16_t last_avail_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -89,8 +103,120 @@ struct VirtQueue
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Reported by query-stats */
+    uint64_t kicks;
+    uint64_t elements;
+    uint64_t interrupts;
 };
 
+static void vring_cache_unmap(VRingCache *cache)
+{
+    memory_region_unref(cache->mr);
+    cache->mr = NULL;
+    cache->ptr = NULL;
+}
+
+static void vring_cache_map(VRingCache *cache, hwaddr pa, hwaddr len,
+                            bool is_write)
+{
+    MemoryRegionSection section;
+
+    vring_cache_unmap(cache);
+    cache->pa = pa;
+    if (!pa) {
+        return;
+    }
+
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr || int128_get64(section.size) < len ||
+        (is_write && section.readonly) || !memory_region_is_ram(section.mr)) {
+        /* Fall back to address_space accesses */
+        memory_region_unref(section.mr);
+        return;
+    }
+
+    cache->mr = section.mr;
+    cache->offset = section.offset_within_region;
+    cache->ptr = memory_region_get_ram_ptr(section.mr) + cache->offset;
+}
+
+/* Map the rings of queue @n, or drop the mappings if it is not set up */
+static void virtio_queue_update_cache(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    unsigned int num = vq->vring.num;
+
+    if (!num || !vq->vring.desc) {
+        vring_cache_unmap(&vq->desc_cache);
+        vring_cache_unmap(&vq->avail_cache);
+        vring_cache_unmap(&vq->used_cache);
+        return;
+    }
+
+    /* The event index fields follow the rings */
+    vring_cache_map(&vq->desc_cache, vq->vring.desc,
+                    num * sizeof(VRingDesc), false);
+    vring_cache_map(&vq->avail_cache, vq->vring.avail,
+                    offsetof(VRingAvail, ring[num]) + sizeof(uint16_t), false);
+    vring_cache_map(&vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[num]) + sizeof(uint16_t), true);
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtio_queue_update_cache(vdev, i);
+        }
+    }
+}
+
+static inline uint16_t vring_cache_lduw(VirtQueue *vq, VRingCache *cache,
+                                        hwaddr off)
+{
+    if (cache->ptr) {
+        return virtio_lduw_p(vq->vdev, cache->ptr + off);
+    }
+    return virtio_lduw_phys(vq->vdev, cache->pa + off);
+}
+
+static inline void vring_cache_stw(VirtQueue *vq, VRingCache *cache,
+                                   hwaddr off, uint16_t val)
+{
+    if (cache->ptr) {
+        virtio_stw_p(vq->vdev, cache->ptr + off, val);
+        memory_region_set_dirty(cache->mr, cache->offset + off, sizeof(val));
+        return;
+    }
+    virtio_stw_phys(vq->vdev, cache->pa + off, val);
+}
+
+static inline void vring_cache_stl(VirtQueue *vq, VRingCache *cache,
+                                   hwaddr off, uint32_t val)
+{
+    if (cache->ptr) {
+        virtio_stl_p(vq->vdev, cache->ptr + off, val);
+        memory_region_set_dirty(cache->mr, cache->offset + off, sizeof(val));
+        return;
+    }
+    virtio_stl_phys(vq->vdev, cache->pa + off, val);
+}
+
+static void vring_cache_read(VRingCache *cache, hwaddr off, void *buf,
+                             hwaddr len)
+{
+    if (cache->ptr) {
+        memcpy(buf, cache->ptr + off, len);
+        return;
+    }
+    address_space_read(&address_space_memory, cache->pa + off,
+                       MEMTXATTRS_UNSPECIFIED, buf, len);
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -98,64 +224,72 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 
     if (!vring->desc) {
         /* not yet setup -> nothing to do */
+        virtio_queue_update_cache(vdev, n);
         return;
     }
     vring->avail = vring->desc + vring->num * sizeof(VRingDesc);
     vring->used = vring_align(vring->avail +
                               offsetof(VRingAvail, ring[vring->num]),
                               vring->align);
+    virtio_queue_update_cache(vdev, n);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
-{
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
-}
-
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+/* Read a whole descriptor, from the descriptor table mapping if @cache is
+ * not NULL and from an indirect table at @desc_pa otherwise.
+ */
+static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+                            VRingCache *cache, hwaddr desc_pa, int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    if (cache) {
+        vring_cache_read(cache, i * sizeof(VRingDesc), desc,
+                         sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    return vring_cache_lduw(vq, &vq->avail_cache,
+                            offsetof(VRingAvail, flags));
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    return vring_cache_lduw(vq, &vq->avail_cache, offsetof(VRingAvail, idx));
 }
 
-static inline uint16_t vring_avail_flags(VirtQueue *vq)
+static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_cache_lduw(vq, &vq->avail_cache,
+                            offsetof(VRingAvail, ring[i]));
 }
 
-static inline uint16_t vring_avail_idx(VirtQueue *vq)
+/* Read @n consecutive avail ring entries starting at @idx */
+static void vring_avail_ring_read(VirtQueue *vq, uint16_t *heads,
+                                  unsigned int idx, unsigned int n)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
-}
+    unsigned int start = idx % vq->vring.num;
+    unsigned int first = MIN(n, vq->vring.num - start);
+    unsigned int i;
 
-static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
-{
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    vring_cache_read(&vq->avail_cache, offsetof(VRingAvail, ring[start]),
+                     heads, first * sizeof(uint16_t));
+    if (n > first) {
+        /* the entries wrap around the end of the ring */
+        vring_cache_read(&vq->avail_cache, offsetof(VRingAvail, ring[0]),
+                         heads + first, (n - first) * sizeof(uint16_t));
+    }
+    for (i = 0; i < n; i++) {
+        virtio_tswap16s(vq->vdev, &heads[i]);
+    }
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -165,56 +299,49 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_cache_stl(vq, &vq->used_cache, offsetof(VRingUsed, ring[i].id),
+                    val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_cache_stl(vq, &vq->used_cache, offsetof(VRingUsed, ring[i].len),
+                    val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_cache_lduw(vq, &vq->used_cache, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_cache_stw(vq, &vq->used_cache, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_cache_stw(vq, &vq->used_cache, off,
+                    vring_cache_lduw(vq, &vq->used_cache, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_cache_stw(vq, &vq->used_cache, off,
+                    vring_cache_lduw(vq, &vq->used_cache, off) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_cache_stw(vq, &vq->used_cache,
+                    offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -243,14 +370,12 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
+                               unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -266,6 +391,25 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give back an element that was popped but not used.  Elements must be
+ * discarded in the reverse order of popping.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    vq->last_avail_idx--;
+    vq->inuse--;
+    virtqueue_unmap_sg(vq, elem, len);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -314,6 +458,15 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
     return num_heads;
 }
 
+static void virtqueue_check_head(VirtQueue *vq, unsigned int head)
+{
+    /* If their number is silly, that's a fatal mistake. */
+    if (head >= vq->vring.num) {
+        error_report("Guest says index %u is available", head);
+        exit(1);
+    }
+}
+
 static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 {
     unsigned int head;
@@ -321,28 +474,25 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     /* Grab the next descriptor number they're advertising, and increment
      * the index we've seen. */
     head = vring_avail_ring(vq, idx % vq->vring.num);
-
-    /* If their number is silly, that's a fatal mistake. */
-    if (head >= vq->vring.num) {
-        error_report("Guest says index %u is available", head);
-        exit(1);
-    }
+    virtqueue_check_head(vq, head);
 
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Move on to the next descriptor of a chain and read it into @desc */
+static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+                                         VRingCache *cache, hwaddr desc_pa,
+                                         unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -351,6 +501,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vdev, desc, cache, desc_pa, next);
     return next;
 }
 
@@ -367,6 +518,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingCache *cache = &vq->desc_cache;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -374,9 +527,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vdev, &desc, cache, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -389,9 +543,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            cache = NULL;
             num_bufs = i = 0;
+            vring_desc_read(vdev, &desc, cache, desc_pa, i);
         }
 
         do {
@@ -401,15 +557,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, cache, desc_pa,
+                                               max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -456,76 +613,230 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
 {
-    unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
-    /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_slice_alloc(out_sg_end);
+    elem->size = out_sg_end;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
 
-    max = vq->vring.num;
+void virtqueue_free_element(void *opaque)
+{
+    VirtQueueElement *elem = opaque;
 
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
+    if (elem) {
+        g_slice_free1(elem->size, elem);
     }
+}
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+/* Collect and map the descriptor chain starting at @head into a new element
+ * of @sz bytes.
+ */
+static void *virtqueue_read_elem(VirtQueue *vq, unsigned int head, size_t sz)
+{
+    unsigned int i = head, max = vq->vring.num;
+    unsigned int out_num = 0, in_num = 0;
+    VRingCache *cache = &vq->desc_cache;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    size_t len[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+
+    vring_desc_read(vdev, &desc, cache, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        cache = NULL;
         i = 0;
+        vring_desc_read(vdev, &desc, cache, desc_pa, i);
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors, the device-readable ones come first */
     do {
-        struct iovec *sg;
+        unsigned int n = out_num + in_num;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+        if (n >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Too many descriptors in indirect table");
+            exit(1);
+        }
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            out_num++;
         }
-
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        addr[n] = desc.addr;
+        len[n] = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, cache, desc_pa,
+                                           max)) != max);
+
+    /* Now copy what we have collected into a right-sized element and map it */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i].iov_len = len[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i].iov_len = len[out_num + i];
+    }
 
-    /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Pop up to @max elements of @sz bytes each.  The avail index and the avail
+ * ring entries are read once for the whole batch instead of once per element.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, void **elems, size_t sz,
+                                 unsigned int max)
+{
+    uint16_t heads[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, n;
+
+    n = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    if (!n) {
+        return 0;
+    }
+
+    vring_avail_ring_read(vq, heads, vq->last_avail_idx, n);
+    vq->last_avail_idx += n;
+    vq->elements += n;
+    if (virtio_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    for (i = 0; i < n; i++) {
+        virtqueue_check_head(vq, heads[i]);
+        elems[i] = virtqueue_read_elem(vq, heads[i], sz);
+    }
+
+    return n;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    if (!virtqueue_pop_batch(vq, &elem, sz, 1)) {
+        return NULL;
+    }
+
+    return elem;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what QEMU has always done by mistake.  We can change it sooner
+ * or later by bumping the version number of the affected vm states.
+ * In the meanwhile, since the in-memory layout of VirtQueueElement
+ * has changed, we need to marshal to and from the layout that was
+ * used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElement *elem;
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    int i;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    if (data->in_num > VIRTQUEUE_MAX_SIZE ||
+        data->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream");
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+        /* Base is overwritten by virtqueue_map_sg */
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+        /* Base is overwritten by virtqueue_map_sg */
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+
+    g_free(data);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+    int i;
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data->in_addr[i] = elem->in_addr[i];
+        data->in_sg[i].iov_len = elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        data->out_addr[i] = elem->out_addr[i];
+        data->out_sg[i].iov_len = elem->out_sg[i].iov_len;
+    }
+
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    g_free(data);
 }
 
 /* virtio device */
@@ -628,6 +939,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        virtio_queue_update_cache(vdev, i);
         vdev->vq[i].last_avail_idx = 0;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
@@ -842,6 +1154,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_update_cache(vdev, n);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -855,6 +1168,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_queue_update_cache(vdev, n);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -918,6 +1232,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
         VirtIODevice *vdev = vq->vdev;
 
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        vq->kicks++;
         vq->handle_output(vdev, vq);
     }
 }
@@ -977,11 +1292,13 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtio_queue_update_cache(vdev, n);
 }
 
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
+    vq->interrupts++;
     vq->vdev->isr |= 0x01;
     virtio_notify_vector(vq->vdev, vq->vector);
 }
@@ -1016,6 +1333,7 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     trace_virtio_notify(vdev, vq);
+    vq->interrupts++;
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -1336,6 +1654,8 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
+        /* The subsections may have moved the rings of virtio-1 devices */
+        virtio_queue_update_cache(vdev, i);
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
@@ -1485,6 +1805,18 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+/* Resume after the last buffer the guest saw completed; used when the vhost
+ * backend went away without reporting its position in the ring.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (vq->vring.desc) {
+        vq->last_avail_idx = vring_used_idx(vq);
+    }
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1564,6 +1896,26 @@ void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
     vdev->bus_name = g_strdup(bus_name);
 }
 
+static void virtio_device_stats_query(StatsSink *sink, void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+    char *path = object_get_canonical_path(OBJECT(vdev));
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (vq->vring.num == 0) {
+            continue;
+        }
+        stats_add_instance(sink, "%s/queue%d", path, i);
+        stats_add_counter(sink, "kicks", vq->kicks);
+        stats_add_counter(sink, "elements", vq->elements);
+        stats_add_counter(sink, "interrupts", vq->interrupts);
+    }
+    g_free(path);
+}
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1583,6 +1935,15 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    /* Remap the rings whenever the guest memory map changes */
+    vdev->listener = (MemoryListener) {
+        .commit = virtio_memory_listener_commit,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
+
+    stats_register_provider(STATS_PROVIDER_VIRTIO, virtio_device_stats_query,
+                            vdev);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1590,9 +1951,18 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
+    int i;
 
+    stats_unregister_provider(virtio_device_stats_query, vdev);
+    memory_listener_unregister(&vdev->listener);
     virtio_bus_device_unplugged(vdev);
 
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_cache_unmap(&vdev->vq[i].desc_cache);
+        vring_cache_unmap(&vdev->vq[i].avail_cache);
+        vring_cache_unmap(&vdev->vq[i].used_cache);
+    }
+
     if (vdc->unrealize != NULL) {
         vdc->unrealize(dev, &err);
         if (err != NULL) {
@@ -27,6 +27,10 @@
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
+#include "qemu/queue.h"
+#include "qemu/timed-average.h"
+
+typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -35,12 +39,34 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+struct BlockAcctTimedStats {
+    TimedAverage latency[BLOCK_MAX_IOTYPE];
+    unsigned interval_length; /* in seconds */
+    QSLIST_ENTRY(BlockAcctTimedStats) entries;
+};
+
+/* A latency histogram with nbins bins.  Bin i counts the requests
+ * whose latency in nanoseconds lies in [boundaries[i - 1],
+ * boundaries[i]), the first bin starting at 0 and the last one being
+ * unbounded.  For example boundaries = {10, 50, 100} gives the four
+ * bins [0, 10), [10, 50), [50, 100) and [100, +inf).
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries; /* nbins - 1 increasing values */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t unaligned[BLOCK_MAX_IOTYPE];
+    uint64_t rmw_avoided;
     uint64_t wr_highest_sector;
+    QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 } BlockAcctStats;
 
 typedef struct BlockAcctCookie {
@@ -49,6 +75,10 @@ typedef struct BlockAcctCookie {
     enum BlockAcctType type;
 } BlockAcctCookie;
 
+void block_acct_cleanup(BlockAcctStats *stats);
+void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length);
+BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
+                                              BlockAcctTimedStats *s);
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
@@ -56,5 +86,13 @@ void block_acct_highest_sector(BlockAcctStats *stats, int64_t sector_num,
                                unsigned int nb_sectors);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_unaligned(BlockAcctStats *stats, enum BlockAcctType type);
+void block_acct_rmw_avoided(BlockAcctStats *stats);
+double block_acct_queue_depth(BlockAcctTimedStats *stats,
+                              enum BlockAcctType type);
+
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                const uint64_t *boundaries, int nboundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
 
 #endif
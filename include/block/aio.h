@@ -37,6 +37,8 @@ struct BlockAIOCB {
     BlockCompletionFunc *cb;
     void *opaque;
     int refcnt;
+    /* Request number for record/replay, 0 if not replayed */
+    uint64_t replay_id;
 };
 
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
@@ -47,6 +49,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -63,6 +66,9 @@ struct AioContext {
      */
     int walking_handlers;
 
+    /* Set when a handler is deleted while walking_handlers is non-zero */
+    bool handlers_deleted;
+
     /* Used to avoid unnecessary event_notifier_set calls in aio_notify;
      * accessed with atomic primitives.  If this field is 0, everything
      * (file descriptors, bottom halves, timers) will be re-evaluated
@@ -122,6 +128,35 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive busy polling before blocking in aio_poll.  poll_ns is the
+     * current polling window; it is grown by poll_grow and shrunk by
+     * poll_shrink, but never exceeds poll_max_ns.  A poll_max_ns of zero
+     * disables polling.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Event loop counters, reported by query-stats.  Only the thread
+     * running aio_poll() writes them.
+     */
+    struct {
+        uint64_t iterations;    /* calls to aio_poll() */
+        uint64_t poll_hits;     /* busy polling found something ready */
+        uint64_t wait_ns;       /* time spent waiting for events */
+    } stats;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* aio_poll() switches from ppoll() to epoll once enough file
+     * descriptors are registered; the handlers stay registered with
+     * epollfd from then on.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /**
@@ -262,6 +297,23 @@ void qemu_bh_delete(QEMUBH *bh);
  */
 bool aio_prepare(AioContext *ctx);
 
+/**
+ * aio_context_setup:
+ * @ctx: the aio context
+ *
+ * Initialize the parts of the aio context that depend on the poll
+ * implementation of the host.
+ */
+void aio_context_setup(AioContext *ctx);
+
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Free what aio_context_setup() allocated.
+ */
+void aio_context_destroy(AioContext *ctx);
+
 /* Return whether there are any pending callbacks from the GSource
  * attached to the AioContext, after g_poll is invoked.
  *
@@ -314,6 +366,34 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Set a function that checks in userspace whether the read handler of a
+ * registered event notifier has work to do, without waiting for the
+ * notifier to be signalled.  It gets the notifier as its argument and it
+ * is called repeatedly while aio_poll busy polls, so it must be cheap and
+ * must not have side effects; when it returns true, the read handler is
+ * run as if the notifier had fired.
+ * Pass NULL to remove it.  The poll function goes away together with the
+ * read handler.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, at most, in nanoseconds
+ * @grow: factor by which to increase the polling window (0 means 2)
+ * @shrink: factor by which to decrease the polling window (0 means to stop
+ *          polling altogether)
+ *
+ * Busy polling is only worthwhile when events are expected shortly, so the
+ * polling window adapts itself to how long aio_poll ends up blocking.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -41,6 +41,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if compressed writes may be issued concurrently; the driver then
+     * compresses them in parallel and serializes the cluster allocation
+     */
+    bool parallel_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -89,6 +94,7 @@ typedef struct HDGeometry {
 #define BDRV_O_PROTOCOL    0x8000  /* if no block driver is explicitly given:
                                       select an appropriate protocol driver,
                                       ignoring the format layer */
+#define BDRV_O_IO_URING    0x10000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -263,6 +269,20 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, BdrvRequestFlags flags);
+/*
+ * Copy a region from one image to another without reading it into QEMU,
+ * e.g. with copy_file_range() when both are files on the same host.  On
+ * -ENOTSUP, the destination may have been written in part, and the region
+ * must be copied by other means.
+ */
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors);
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors);
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -362,6 +382,10 @@ BlockAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
 void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp);
 void bdrv_invalidate_cache_all(Error **errp);
 
+/* Memory in bytes that the qcow2 metadata caches of all images may take
+ * together, 0 for no limit */
+extern size_t qcow2_cache_budget;
+
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs);
@@ -425,6 +449,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs);
 void bdrv_round_to_clusters(BlockDriverState *bs,
                             int64_t sector_num, int nb_sectors,
                             int64_t *cluster_sector_num,
@@ -499,6 +524,10 @@ bool bdrv_dirty_bitmap_enabled(BdrvDirtyBitmap *bitmap);
 bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap);
 DirtyBitmapStatus bdrv_dirty_bitmap_status(BdrvDirtyBitmap *bitmap);
 int bdrv_get_dirty(BlockDriverState *bs, BdrvDirtyBitmap *bitmap, int64_t sector);
+int64_t bdrv_dirty_bitmap_next_zero(BdrvDirtyBitmap *bitmap, int64_t sector,
+                                    int64_t nb_sectors);
+bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
+                                       int64_t *sector, int64_t *nb_sectors);
 void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                            int64_t cur_sector, int nr_sectors);
 void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
@@ -507,6 +536,28 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap);
 void bdrv_dirty_iter_init(BdrvDirtyBitmap *bitmap, struct HBitmapIter *hbi);
 void bdrv_set_dirty_iter(struct HBitmapIter *hbi, int64_t offset);
 int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap);
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap);
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap);
+int64_t bdrv_dirty_bitmap_size(BdrvDirtyBitmap *bitmap);
+bool bdrv_dirty_bitmap_get_persistence(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
+                                       bool persistent);
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp);
+void bdrv_dirty_bitmap_serialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                      uint64_t start, uint64_t count);
+void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
+                                        const uint8_t *buf,
+                                        uint64_t start, uint64_t count);
+void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_track_changes(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_sectors);
+bool bdrv_dirty_bitmap_tracks_changes(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_untrack_changes(BdrvDirtyBitmap *bitmap);
+int64_t bdrv_dirty_bitmap_next_change(BdrvDirtyBitmap *bitmap, int64_t sector);
+void bdrv_dirty_bitmap_set_changed(BdrvDirtyBitmap *bitmap, uint64_t start,
+                                   uint64_t count, bool changed);
 
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
 void bdrv_disable_copy_on_read(BlockDriverState *bs);
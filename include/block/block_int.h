@@ -39,6 +39,7 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -56,15 +57,28 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
+/* Number of head and tail buffers for unaligned requests kept per BDS */
+#define BDRV_BOUNCE_POOL_SIZE       8
+
 typedef struct BdrvTrackedRequest {
     BlockDriverState *bs;
     int64_t offset;
     unsigned int bytes;
     bool is_write;
 
+    /* For the write notifiers: the data of a write request (NULL for
+     * zero writes), its flags and, in the after write notifiers, its
+     * return value
+     */
+    QEMUIOVector *qiov;
+    int flags;
+    int ret;
+
     bool serialising;
     int64_t overlap_offset;
     unsigned int overlap_bytes;
@@ -156,6 +170,19 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
+    /*
+     * Copy a region without passing the data through QEMU.  The source
+     * driver maps it to the node that stores it, and ends up calling
+     * bdrv_co_copy_range_to(); the destination driver then does the same
+     * until both ends are nodes of a driver that can copy between them.
+     * Either may return -ENOTSUP, and both may be NULL.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        int64_t sector_num, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *src,
+        int64_t src_sector, BlockDriverState *bs, int64_t sector_num,
+        int nb_sectors);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
 
@@ -203,6 +230,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -237,6 +265,15 @@ struct BlockDriver {
     int (*bdrv_amend_options)(BlockDriverState *bs, QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb);
 
+    /*
+     * Returns whether a dirty bitmap with the given name and granularity (in
+     * bytes) can be made persistent, that is stored in the image whenever it
+     * is flushed or closed and loaded again when it is opened.
+     */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs,
+                                        const char *name,
+                                        uint32_t granularity, Error **errp);
+
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
     /* TODO Better pass a option string/QDict/QemuOpts to add any rule? */
@@ -387,9 +424,18 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request is processed */
+    NotifierList after_write_notifiers;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
+    /* Request merging: guest requests wait in merge_queue until merge_bh
+     * runs, and adjacent ones are then submitted together */
+    bool merge_requests;
+    QSIMPLEQ_HEAD(, BlockAIOCBCoroutine) merge_queue;
+    QEMUBH *merge_bh;
+
     /* I/O throttling */
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
@@ -398,6 +444,7 @@ struct BlockDriverState {
     ThrottleState *throttle_state;
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
+    ThrottleShare  throttle_share;
     QLIST_ENTRY(BlockDriverState) round_robin;
 
     /* I/O stats (display with "info blockstats"). */
@@ -412,6 +459,19 @@ struct BlockDriverState {
     /* Alignment requirement for offset/length of I/O requests */
     unsigned int request_alignment;
 
+    /* Free head and tail buffers of bounce_pool_align bytes for unaligned
+     * requests */
+    void *bounce_pool[BDRV_BOUNCE_POOL_SIZE];
+    int bounce_pool_len;
+    unsigned int bounce_pool_align;
+
+    /* Contents of the aligned block that the last read-modify-write cycle
+     * wrote, if rmw_cache_valid */
+    void *rmw_cache_buf;
+    int64_t rmw_cache_offset;
+    unsigned int rmw_cache_align;
+    bool rmw_cache_valid;
+
     /* the block size for which the guest device expects atomicity */
     int guest_block_size;
 
@@ -491,6 +551,15 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked after write requests are processed,
+ * whether they succeeded or not, while they are still tracked.  The request
+ * is passed as the notifier data and its result is in the @ret field.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -614,6 +683,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: Whether guest writes are copied to @target before they
+ *             complete.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -628,7 +699,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -664,4 +735,7 @@ void blk_dev_resize_cb(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 
+/* Free the buffers that unaligned requests keep in @bs */
+void bdrv_release_bounce_buffers(BlockDriverState *bs);
+
 #endif /* BLOCK_INT_H */
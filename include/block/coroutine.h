@@ -96,6 +96,28 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Coroutine pool statistics of one thread
+ *
+ * The pool of a thread grows with the number of coroutines it had to
+ * allocate, up to a limit, so that it can hold as many coroutines as the
+ * thread needs at its busiest.
+ */
+typedef struct CoroutinePoolStats {
+    uint64_t hits;          /* coroutines created from the pool */
+    uint64_t misses;        /* coroutines that had to be allocated */
+    unsigned int size;      /* coroutines currently in the pool */
+    unsigned int max_size;  /* current limit of the pool */
+} CoroutinePoolStats;
+
+/**
+ * Get the coroutine pool statistics of the calling thread
+ *
+ * The result stays valid as long as the thread runs, so it can be handed to
+ * other threads for reporting.  They should read it with atomic_read().
+ */
+const CoroutinePoolStats *qemu_coroutine_pool_stats(void);
+
 
 
 /**
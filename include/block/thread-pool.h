@@ -34,4 +34,11 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/* Run the workers of @pool on the host CPUs set in @host_cpus; an empty
+ * bitmap stops changing their affinity.  Busy workers move when they
+ * next pick a request, idle ones within a few seconds.
+ */
+void thread_pool_set_affinity(ThreadPool *pool, const unsigned long *host_cpus,
+                              unsigned long nbits);
+
 #endif
@@ -286,6 +286,8 @@ struct RAMBlock {
     ram_addr_t max_length;
     void (*resized)(const char*, uint64_t length, void *host);
     uint32_t flags;
+    /* Page size of the host memory backing the block */
+    size_t page_size;
     /* Protected by iothread lock.  */
     char idstr[256];
     /* RCU-enabled, writes protected by the ramlist lock */
@@ -304,9 +306,12 @@ typedef struct RAMList {
     QemuMutex mutex;
     /* Protected by the iothread lock.  */
     unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
-    RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
+    /* The same blocks sorted by offset, for lookups by ram_addr_t.
+     * RCU-enabled, rebuilt under the ramlist lock whenever the list changes.
+     */
+    struct RAMBlockIndex *index;
     uint32_t version;
 } RAMList;
 extern RAMList ram_list;
@@ -321,13 +326,14 @@ extern RAMList ram_list;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
 
-void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf);
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
 #endif /* !CONFIG_USER_ONLY */
 
+void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+
 int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
 
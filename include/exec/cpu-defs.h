@@ -30,6 +30,7 @@
 #include "tcg-target.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "qemu/rcu.h"
 #endif
 #include "exec/memattrs.h"
 
@@ -98,6 +99,22 @@ typedef uint64_t target_ulong;
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* With a TCG backend that loads the size of the TLB at run time, each MMU
+ * mode has its own TLB, resized by tlb_flush() between these bounds
+ * depending on how many of its entries were used since the last flushes.
+ */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+
+#if HOST_LONG_BITS == 32
+/* Make sure we do not require a double-word shift for the TLB load */
+#define CPU_TLB_DYN_MAX_BITS (32 - TARGET_PAGE_BITS)
+#else
+#define CPU_TLB_DYN_MAX_BITS MIN(22, TARGET_LONG_BITS - TARGET_PAGE_BITS)
+#endif
+#endif
+
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
        bit TARGET_PAGE_BITS-1..4  : Nonzero for accesses that should not
@@ -130,16 +147,68 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* The TLB only maps TARGET_PAGE_SIZE pages, so the regions covered by
+ * larger guest pages are remembered: invalidating any page of one of
+ * them has to drop the entries of the whole region.  Each MMU mode
+ * tracks up to CPU_TLB_LARGE_PAGES regions, an unused one has an
+ * address of -1 and a mask of 0.
+ */
+#define CPU_TLB_LARGE_PAGES 4
+
+typedef struct CPUTLBLargePage {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargePage;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The TLB of an MMU mode.  It is freed after an RCU grace period, because
+ * cpu_tlb_reset_dirty_all() walks the TLBs of other vCPUs.
+ */
+typedef struct CPUTLBTable {
+    struct rcu_head rcu;
+    size_t n_entries;
+    CPUTLBEntry entries[];
+} CPUTLBTable;
+
+/* Sizing state of the TLB of an MMU mode, kept in CPUState because the
+ * CPU_COMMON fields of most targets are cleared on reset.
+ */
+typedef struct CPUTLBDesc {
+    CPUTLBTable *table;
+    CPUIOTLBEntry *iotlb;
+    int64_t window_begin_ns;
+    /* the largest number of used entries seen in the current window */
+    size_t window_max_entries;
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+/* tlb_mask is the size of the TLB minus one, shifted by CPU_TLB_ENTRY_BITS,
+ * so that the TCG fast path can use it on the address directly.
+ * The tables are published here by tlb_flush().
+ */
+#define CPU_COMMON_TLB \
+    /* The meaning of the MMU modes is defined in the target code. */   \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];                                 \
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUTLBLargePage tlb_large_page[NB_MMU_MODES][CPU_TLB_LARGE_PAGES];  \
+    target_ulong vtlb_index;                                            \
+
+#else
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;                                        \
+    CPUTLBLargePage tlb_large_page[NB_MMU_MODES][CPU_TLB_LARGE_PAGES];  \
     target_ulong vtlb_index;                                            \
 
+#endif
+
 #else
 
 #define CPU_COMMON_TLB
@@ -132,6 +132,29 @@ uint16_t helper_ldw_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint32_t helper_ldl_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 uint64_t helper_ldq_cmmu(CPUArchState *env, target_ulong addr, int mmu_idx);
 
+/* Number of entries in the TLB of @mmu_idx */
+static inline size_t tlb_n_entries(CPUArchState *env, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    return (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS) + 1;
+#else
+    return CPU_TLB_SIZE;
+#endif
+}
+
+/* Index of the TLB entry of @mmu_idx that maps @addr */
+static inline uintptr_t tlb_index(CPUArchState *env, int mmu_idx,
+                                  target_ulong addr)
+{
+    return (addr >> TARGET_PAGE_BITS) & (tlb_n_entries(env, mmu_idx) - 1);
+}
+
+static inline CPUTLBEntry *tlb_entry(CPUArchState *env, int mmu_idx,
+                                     target_ulong addr)
+{
+    return &env->tlb_table[mmu_idx][tlb_index(env, mmu_idx, addr)];
+}
+
 #ifdef MMU_MODE0_SUFFIX
 #define CPU_MMU_INDEX 0
 #define MEMSUFFIX MMU_MODE0_SUFFIX
@@ -422,8 +445,7 @@ static inline void *tlb_vaddr_to_host(CPUArchState *env, target_ulong addr,
 #if defined(CONFIG_USER_ONLY)
     return g2h(vaddr);
 #else
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    CPUTLBEntry *tlbentry = &env->tlb_table[mmu_idx][index];
+    CPUTLBEntry *tlbentry = tlb_entry(env, mmu_idx, addr);
     target_ulong tlb_addr;
     uintptr_t haddr;
 
@@ -452,7 +474,7 @@ static inline void *tlb_vaddr_to_host(CPUArchState *env, target_ulong addr,
         return NULL;
     }
 
-    haddr = addr + env->tlb_table[mmu_idx][index].addend;
+    haddr = addr + tlbentry->addend;
     return (void *)haddr;
 #endif /* defined(CONFIG_USER_ONLY) */
 }
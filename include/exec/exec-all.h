@@ -96,8 +96,18 @@ bool qemu_in_vcpu_thread(void);
 void cpu_reload_memory_map(CPUState *cpu);
 void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as);
 /* cputlb.c */
+void tlb_init(CPUState *cpu);
+void tlb_destroy(CPUState *cpu);
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
 void tlb_flush(CPUState *cpu, int flush_global);
+/* The idxmap arguments have one bit set for each MMU mode to flush.
+ * Flushes of another vCPU's TLB may complete after these return.
+ */
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                              uint16_t idxmap);
+void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap);
+void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr, uint16_t idxmap);
+void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -115,12 +125,38 @@ static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 static inline void tlb_flush(CPUState *cpu, int flush_global)
 {
 }
+
+static inline void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                            uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_by_mmuidx(CPUState *cpu, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_page_by_mmuidx_all_cpus(target_ulong addr,
+                                                     uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_by_mmuidx_all_cpus(uint16_t idxmap)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial and maximum size of the physical PC hash table; the table grows
+   from the minimum up to one bucket per TB that fits in code_gen_buffer */
+#define CODE_GEN_PHYS_HASH_MIN_BITS 12
+#define CODE_GEN_PHYS_HASH_MAX_BITS 24
+
+/* The translation buffer is split into regions that are filled in turn.
+   When the last one is full, the oldest region is evicted instead of
+   flushing the whole buffer.  Small buffers use fewer regions.  */
+#define CODE_GEN_MAX_REGIONS        8
+#define CODE_GEN_MIN_REGION_SIZE    (2 * 1024 * 1024)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -139,26 +175,38 @@ static inline void tlb_flush(CPUState *cpu, int flush_global)
 #define USE_DIRECT_JUMP
 #endif
 
+/* TranslationBlocks are aligned on cache lines.  Everything that
+   tb_find_physical() reads while it walks a hash chain comes first and
+   fits in the first line on 64-bit hosts, so that each TB of the chain
+   costs one cache miss.  */
+#define TB_ALIGN 64
+
 struct TranslationBlock {
     target_ulong pc;   /* simulated PC corresponding to this block (EIP + CS base) */
     target_ulong cs_base; /* CS base for this block */
     uint64_t flags; /* flags defining in which context the code was generated */
-    uint16_t size;      /* size of target code for this block (1 <=
-                           size <= TARGET_PAGE_SIZE) */
-    uint16_t icount;
     uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
+#define CF_TRACE       0x40000 /* Hot block, may follow direct jumps */
+#define CF_SMC_SLOW    0x80000 /* Page rewritten too often, run once */
 
-    void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
-    /* first and second physical page containing code. The lower bit
-       of the pointer tells the index in page_next[] */
-    struct TranslationBlock *page_next[2];
+    /* set when the TB is removed from the physical hash table */
+    bool invalid;
+    /* first and second physical page containing code */
     tb_page_addr_t page_addr[2];
+    /* next matching tb for physical address.  There are two links so
+       that the hash table can be resized while readers walk the old
+       table, see TBPhysHash. */
+    struct TranslationBlock *phys_hash_next[2];
+
+    void *tc_ptr;    /* pointer to the translated code */
+    uint32_t tc_size; /* size of the translated code */
+    uint16_t size;      /* size of target code for this block (1 <=
+                           size <= TARGET_PAGE_SIZE) */
+    uint16_t icount;
 
     /* the following data are used to directly call another TB from
        the code of this one. */
@@ -174,30 +222,115 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
-};
+
+    /* next TBs with code in page_addr[0] and page_addr[1]. The lower bit
+       of the pointer tells the index in page_next[] */
+    struct TranslationBlock *page_next[2];
+} __attribute__((aligned(TB_ALIGN)));
+
+/* Profiling counters of a TB.  They are kept in TBContext.tb_counters,
+   indexed like tbs, so that the TBs that update them do not keep
+   dirtying the cache lines that other vCPUs read to look TBs up.  */
+typedef struct TBCounters {
+    /* number of times the TB was executed, incremented by the TB itself
+       when it was translated with tb_profile_enabled set */
+    uint64_t prof_count;
+    /* number of times the TB was entered from cpu_exec(), counted only
+       when tb_trace_threshold is set */
+    unsigned int exec_count;
+} TBCounters;
 
 #include "exec/spinlock.h"
+#include "qemu/thread.h"
+
+#include "qemu/rcu.h"
 
 typedef struct TBContext TBContext;
 
+typedef struct TBRegion {
+    void *code_start;
+    /* translation of a new TB must start below this */
+    void *code_max;
+    /* end of the generated code, valid when this is not cur_region */
+    void *code_end;
+    /* this region's TBs are tbs[first_tb] to tbs[first_tb + nb_tbs - 1] */
+    int first_tb;
+    int nb_tbs;
+} TBRegion;
+
+/* Hash table of the TBs indexed by physical PC.  Lookups are lock-free
+   and must be done within an RCU critical section; updates are done
+   with tb_lock held.  Each bucket is a list chained through
+   phys_hash_next[link].  When the table is resized, the new table uses
+   the other link so that the old chains stay intact until all readers
+   have left it.  */
+typedef struct TBPhysHash {
+    struct rcu_head rcu;
+    unsigned int bits;
+    unsigned int link;
+    TranslationBlock *buckets[];
+} TBPhysHash;
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    TBCounters *tb_counters;
+    TBPhysHash *tb_phys_hash;
+    /* size limit of tb_phys_hash, computed from code_gen_max_blocks */
+    unsigned int tb_phys_hash_max_bits;
+    /* set until the table replaced by the last resize has been freed */
+    bool tb_phys_hash_resizing;
     int nb_tbs;
+    TBRegion regions[CODE_GEN_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    size_t region_size;
+    int region_max_tbs;
     /* any access to the tbs or the page table must use this lock */
-    spinlock_t tb_lock;
+    QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_evict_count;
+    int tb_trace_count;
     int tb_phys_invalidate_count;
+    int tb_smc_slow_count;
+
+    /* TB profiling, see tb_profile_set() */
+    uint64_t prof_translate_count;
+    int64_t prof_translate_time;
 
     int tb_invalidated_flag;
 };
 
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+TranslationBlock *tb_gen_trace(CPUState *cpu, TranslationBlock *tb);
+
+typedef struct TBProfileEntry {
+    target_ulong pc;
+    void *tc_ptr;
+    uint32_t tc_size;
+    uint16_t size;
+    uint16_t icount;
+    uint64_t exec_count;
+} TBProfileEntry;
+
+typedef struct TBProfileStats {
+    uint64_t translate_count;
+    int64_t translate_time;     /* ns spent in tb_gen_code() */
+    int64_t exec_time;          /* ns spent in cpu_exec(), all vCPUs */
+} TBProfileStats;
+
+void tb_profile_set(bool enable);
+void tb_profile_reset(void);
+void tb_profile_get_stats(TBProfileStats *stats);
+int tb_profile_get_hot(TBProfileEntry **entries, int max);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -294,7 +427,7 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 /* GETRA is the true target of the return instruction that we'll execute,
    defined here for simplicity of defining the follow-up macros.  */
 #if defined(CONFIG_TCG_INTERPRETER)
-extern uintptr_t tci_tb_ptr;
+extern __thread uintptr_t tci_tb_ptr;
 # define GETRA() tci_tb_ptr
 #else
 # define GETRA() \
@@ -14,12 +14,29 @@ static inline void gen_tb_start(TranslationBlock *tb)
     TCGv_i32 count, flag, imm;
     int i;
 
-    exitreq_label = gen_new_label();
-    flag = tcg_temp_new_i32();
-    tcg_gen_ld_i32(flag, cpu_env,
-                   offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
-    tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
-    tcg_temp_free_i32(flag);
+    /*
+     * With icount, an exit request sets the high half of icount_decr, so
+     * the decrement below catches it with the same compare and branch.
+     */
+    if (!(tb->cflags & CF_USE_ICOUNT)) {
+        exitreq_label = gen_new_label();
+        flag = tcg_temp_new_i32();
+        tcg_gen_ld_i32(flag, cpu_env,
+                       offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
+        tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
+        tcg_temp_free_i32(flag);
+    }
+
+    if (tb_profile_enabled) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb_counters(tb)->prof_count);
+        TCGv_i64 n = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(n, ptr, 0);
+        tcg_gen_addi_i64(n, n, 1);
+        tcg_gen_st_i64(n, ptr, 0);
+        tcg_temp_free_i64(n);
+        tcg_temp_free_ptr(ptr);
+    }
 
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
@@ -49,13 +66,13 @@ static inline void gen_tb_start(TranslationBlock *tb)
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
-    gen_set_label(exitreq_label);
-    tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
-
     if (tb->cflags & CF_USE_ICOUNT) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
         tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_ICOUNT_EXPIRED);
+    } else {
+        gen_set_label(exitreq_label);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
     }
 
     /* Terminate the linked list.  */
@@ -35,6 +35,8 @@ typedef struct MemTxAttrs {
     unsigned int secure:1;
     /* Memory access is usermode (unprivileged) */
     unsigned int user:1;
+    /* Write replayed from the KVM coalesced MMIO/PIO ring */
+    unsigned int coalesced:1;
     /* Stream ID (for MSI for example) */
     unsigned int stream_id:16;
 } MemTxAttrs;
@@ -193,6 +193,9 @@ struct MemoryRegion {
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
     NotifierList iommu_notify;
+    /* Accesses to a region with coalesced ranges, for query-stats */
+    uint64_t coalesced_writes;
+    uint64_t exits;
 };
 
 /**
@@ -212,6 +215,16 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /* If set, used instead of log_sync by address_space_sync_dirty_bitmap()
+     * to sync the whole address space at once.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+    /* Re-arm dirty logging for a section whose dirty pages have been
+     * consumed, for listeners that do not do it when syncing.  Called
+     * without the iothread lock; only for listeners that are registered
+     * with an address space filter.
+     */
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -231,6 +244,9 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+/* Default limit of the memory used by the bounce buffers of an address space */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 struct AddressSpace {
     /* All fields are private. */
     struct rcu_head rcu;
@@ -244,8 +260,24 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
+    /* During a topology update, an earlier address space with the same
+     * FlatView whose dispatch map this one reuses instead of building its
+     * own.
+     */
+    struct AddressSpace *dispatch_owner;
     MemoryListener dispatch_listener;
 
+    /* Bounce buffers of address_space_map() for non-direct accesses.
+     * bounce_buffer_size bytes are in use, at most max_bounce_buffer_size.
+     * The list of buffers, their size and the map clients waiting for them
+     * are protected by bounce_lock.
+     */
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    QemuMutex bounce_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
+
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -395,6 +427,27 @@ void memory_region_init_ram_from_file(MemoryRegion *mr,
                                       bool share,
                                       const char *path,
                                       Error **errp);
+
+/**
+ * memory_region_init_ram_from_fd:  Initialize RAM memory region with a
+ *                                  mmap-ed file descriptor.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @owner: the object that tracks the region's reference count
+ * @name: the name of the region.
+ * @size: size of the region.
+ * @share: %true if memory must be mmaped with the MAP_SHARED flag
+ * @fd: a file descriptor of at least @size bytes, which the region takes
+ *      over on success.
+ * @errp: pointer to Error*, to store an error if it happens.
+ */
+void memory_region_init_ram_from_fd(MemoryRegion *mr,
+                                    struct Object *owner,
+                                    const char *name,
+                                    uint64_t size,
+                                    bool share,
+                                    int fd,
+                                    Error **errp);
 #endif
 
 /**
@@ -712,6 +765,42 @@ void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
  */
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client);
+
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
+ *                                         bitmap and clear it.
+ *
+ * Creates a snapshot of the dirty bitmap of a range, clears the range's
+ * dirty bits and returns the snapshot.  The snapshot can then be queried
+ * with memory_region_snapshot_get_dirty() as often as needed, which is
+ * cheaper than calling memory_region_get_dirty() for every subrange and
+ * memory_region_reset_dirty() afterwards, and does not lose the writes
+ * done in between.  Free it with g_free().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; typically %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
+ *                                   in the specified dirty bitmap snapshot.
+ *
+ * Ranges outside of the snapshot read as dirty.
+ *
+ * @mr: the memory region being queried.
+ * @snap: the dirty bitmap snapshot
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -723,6 +812,25 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty logging in accelerators
+ *                                   for a range of a region
+ *
+ * Accelerators that support it leave dirty logging disarmed
+ * for the pages reported by memory_region_sync_dirty_bitmap() or
+ * address_space_sync_dirty_bitmap(), so that writes to them cost
+ * nothing until they are cleared.  This must be called before the
+ * contents of the pages are used, so that later writes are seen by the
+ * next sync.  Can be called without the iothread lock, from within an
+ * RCU critical section that keeps @mr alive.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the subrange, relative to the region.
+ * @len: the size of the subrange.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -825,6 +933,17 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_register_stats: Report the accesses to regions that have
+ *                               MMIO coalescing enabled in query-stats.
+ *
+ * Each such region is an instance of the "mmio" provider, counting the
+ * writes replayed from the coalesced ring (MemTxAttrs.coalesced) apart
+ * from the accesses that caused an exit.  Called by accelerators that
+ * implement coalescing.
+ */
+void memory_region_register_stats(void);
+
 /**
  * memory_region_set_global_locking: Declares the access processing requires
  *                                   QEMU's global lock.
@@ -1309,8 +1428,12 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
+ *
+ * Accesses that do not go directly to RAM use bounce buffers.  Each address
+ * space has its own pool of them, limited to max_bounce_buffer_size bytes,
+ * so several devices can map MMIO or ROM at the same time.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1334,6 +1457,24 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: ask to be notified when a bounce buffer
+ * of @as is released
+ *
+ * @bh is scheduled once, right away if no bounce buffer is in use.
+ *
+ * @as: #AddressSpace whose address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel a notification requested
+ * with address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 #endif
 
@@ -25,6 +25,8 @@
 ram_addr_t qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
                                     bool share, const char *mem_path,
                                     Error **errp);
+ram_addr_t qemu_ram_alloc_from_fd(ram_addr_t size, MemoryRegion *mr,
+                                  bool share, int fd, Error **errp);
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr, Error **errp);
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr, Error **errp);
@@ -34,12 +36,16 @@ ram_addr_t qemu_ram_alloc_resizeable(ram_addr_t size, ram_addr_t max_size,
                                                      void *host),
                                      MemoryRegion *mr, Error **errp);
 int qemu_get_ram_fd(ram_addr_t addr);
+size_t qemu_ram_pagesize(ram_addr_t addr);
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
 int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp);
+bool qemu_ram_is_shared(RAMBlock *block);
+bool qemu_ram_is_anon_fd(RAMBlock *block);
+int qemu_ram_adopt_fd(RAMBlock *block, int fd, Error **errp);
 
 #define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
 #define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
@@ -138,6 +144,29 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     xen_modified_memory(start, length);
 }
 
+/*
+ * Mark dirty the pages whose bits are set in @bits, one word of a bitmap in
+ * host byte order such as a vhost log chunk.  @start must be aligned to
+ * BITS_PER_LONG target pages.
+ */
+static inline void cpu_physical_memory_set_dirty_word(ram_addr_t start,
+                                                      unsigned long bits,
+                                                      uint8_t mask)
+{
+    unsigned long **d = ram_list.dirty_memory;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    int i;
+
+    assert(BIT_WORD(page) * BITS_PER_LONG == page);
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (mask & (1 << i)) {
+            atomic_or(&d[i][BIT_WORD(page)], bits);
+        }
+    }
+    xen_modified_memory(start, BITS_PER_LONG * TARGET_PAGE_SIZE);
+}
+
 #if !defined(_WIN32)
 static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                                                           ram_addr_t start,
@@ -198,6 +227,13 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client);
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
+
 static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length)
 {
@@ -207,8 +243,15 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/*
+ * Move the migration dirty bits of a range into @dest and return how many
+ * of them were new.  If @clear is not NULL, the bit of every
+ * 2^@clear_shift page chunk that had dirty pages is set in it.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               unsigned long *clear,
+                                               unsigned int clear_shift,
                                                ram_addr_t start,
                                                ram_addr_t length)
 {
@@ -230,6 +273,10 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                if (clear && bits) {
+                    set_bit(((ram_addr_t)k * BITS_PER_LONG) >> clear_shift,
+                            clear);
+                }
             }
         }
     } else {
@@ -242,6 +289,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                if (clear) {
+                    set_bit(k >> clear_shift, clear);
+                }
             }
         }
     }
@@ -43,9 +43,22 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
            | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Hash the fields that identify a TB.  The top bits of the result are
+   the ones that are best mixed, so the bucket index is taken from them.  */
+static inline uint64_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = ((uint64_t)phys_pc >> 2) ^ ((uint64_t)pc << 17) ^ flags
+        ^ ((uint64_t)cs_base << 37);
+    return h * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline TranslationBlock **tb_phys_hash_bucket(TBPhysHash *table,
+                                                     uint64_t h)
+{
+    return &table->buckets[h >> (64 - table->bits)];
 }
 
 #endif
@@ -57,6 +57,7 @@ bool machine_iommu(MachineState *machine);
 bool machine_kernel_irqchip_allowed(MachineState *machine);
 bool machine_kernel_irqchip_required(MachineState *machine);
 int machine_kvm_shadow_mem(MachineState *machine);
+uint32_t machine_kvm_halt_poll_ns(MachineState *machine);
 int machine_phandle_start(MachineState *machine);
 bool machine_dump_guest_core(MachineState *machine);
 bool machine_mem_merge(MachineState *machine);
@@ -128,6 +129,7 @@ struct MachineState {
     bool kernel_irqchip_allowed;
     bool kernel_irqchip_required;
     int kvm_shadow_mem;
+    uint32_t kvm_halt_poll_ns;
     char *dtb;
     char *dumpdtb;
     int phandle_start;
@@ -35,6 +35,7 @@ void msix_vector_unuse(PCIDevice *dev, unsigned vector);
 void msix_unuse_all_vectors(PCIDevice *dev);
 
 void msix_notify(PCIDevice *dev, unsigned vector);
+bool msix_notify_irqfd(PCIDevice *dev, unsigned vector);
 
 void msix_reset(PCIDevice *dev);
 
@@ -300,6 +300,9 @@ struct PCIDevice {
     MemoryRegion rom;
     uint32_t rom_bar;
 
+    /* Limit of the bounce buffers used to map non-RAM memory for DMA */
+    uint64_t max_bounce_buffer_size;
+
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
 
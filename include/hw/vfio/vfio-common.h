@@ -64,10 +64,22 @@ typedef struct VFIOAddressSpace {
 
 struct VFIOGroup;
 
+/* A range of guest RAM mapped, or to be mapped, with one VFIO_IOMMU_MAP_DMA */
+typedef struct VFIODMAMapping {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    bool mapped;
+    QLIST_ENTRY(VFIODMAMapping) next;
+} VFIODMAMapping;
+
 typedef struct VFIOType1 {
     MemoryListener listener;
     int error;
-    bool initialized;
+    QLIST_HEAD(, VFIODMAMapping) mappings;
+    bool deferred; /* mappings are collected but not made yet */
+    bool lazy; /* ...until a device enables DMA, even after machine init */
 } VFIOType1;
 
 typedef struct VFIOContainer {
@@ -103,6 +115,7 @@ typedef struct VFIODevice {
     bool reset_works;
     bool needs_reset;
     bool allow_mmap;
+    bool lazy_dma_map;
     VFIODeviceOps *ops;
     unsigned int num_irqs;
     unsigned int num_regions;
@@ -125,6 +138,7 @@ typedef struct VFIOGroup {
 } VFIOGroup;
 
 void vfio_put_base_device(VFIODevice *vbasedev);
+void vfio_device_dma_activate(VFIODevice *vbasedev);
 void vfio_disable_irqindex(VFIODevice *vbasedev, int index);
 void vfio_unmask_single_irqindex(VFIODevice *vbasedev, int index);
 void vfio_mask_single_irqindex(VFIODevice *vbasedev, int index);
@@ -136,6 +150,10 @@ int vfio_mmap_region(Object *vdev, VFIORegion *region,
                      MemoryRegion *mem, MemoryRegion *submem,
                      void **map, size_t size, off_t offset,
                      const char *name);
+int vfio_get_region_info(VFIODevice *vbasedev, int index,
+                         struct vfio_region_info **info);
+struct vfio_info_cap_header *
+vfio_get_region_info_cap(struct vfio_region_info *info, uint16_t id);
 void vfio_reset_handler(void *opaque);
 VFIOGroup *vfio_get_group(int groupid, AddressSpace *as);
 void vfio_put_group(VFIOGroup *group);
@@ -18,18 +18,39 @@ typedef enum VhostBackendType {
     VHOST_BACKEND_TYPE_MAX = 3,
 } VhostBackendType;
 
+typedef enum VhostSetConfigType {
+    VHOST_SET_CONFIG_TYPE_MASTER = 0,
+    VHOST_SET_CONFIG_TYPE_MIGRATION = 1,
+} VhostSetConfigType;
+
 struct vhost_dev;
+struct vhost_vring_state;
 
 typedef int (*vhost_call)(struct vhost_dev *dev, unsigned long int request,
              void *arg);
 typedef int (*vhost_backend_init)(struct vhost_dev *dev, void *opaque);
 typedef int (*vhost_backend_cleanup)(struct vhost_dev *dev);
+typedef int (*vhost_backend_get_vq_index)(struct vhost_dev *dev, int idx);
+typedef int (*vhost_backend_set_vring_enable)(struct vhost_dev *dev,
+                                              int enable);
+typedef int (*vhost_backend_set_busyloop_timeout)(struct vhost_dev *dev,
+                                       struct vhost_vring_state *state);
+typedef int (*vhost_backend_get_config)(struct vhost_dev *dev,
+                                        uint8_t *config, uint32_t config_len);
+typedef int (*vhost_backend_set_config)(struct vhost_dev *dev,
+                                        const uint8_t *data, uint32_t offset,
+                                        uint32_t size, uint32_t flags);
 
 typedef struct VhostOps {
     VhostBackendType backend_type;
     vhost_call vhost_call;
     vhost_backend_init vhost_backend_init;
     vhost_backend_cleanup vhost_backend_cleanup;
+    vhost_backend_get_vq_index vhost_backend_get_vq_index;
+    vhost_backend_set_vring_enable vhost_backend_set_vring_enable;
+    vhost_backend_set_busyloop_timeout vhost_backend_set_busyloop_timeout;
+    vhost_backend_get_config vhost_backend_get_config;
+    vhost_backend_set_config vhost_backend_set_config;
 } VhostOps;
 
 extern const VhostOps user_ops;
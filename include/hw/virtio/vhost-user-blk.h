@@ -0,0 +1,38 @@
+/*
+ * vhost-user-blk host device
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "qemu-common.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "hw/qdev.h"
+#include "hw/block/block.h"
+#include "sysemu/char.h"
+#include "hw/virtio/vhost.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+    CharDriverState *chardev;
+    int32_t bootindex;
+    /* config space as read from the backend at realize time */
+    struct virtio_blk_config blkcfg;
+    uint16_t num_queues;
+    uint32_t queue_size;
+    uint32_t config_wce;
+    struct vhost_dev dev;
+    Error *migration_blocker;
+} VHostUserBlk;
+
+#endif
@@ -31,18 +31,38 @@ typedef struct virtio_balloon_stat_modern {
        uint64_t val;
 } VirtIOBalloonStatModern;
 
+/*
+ * Parts of a host huge page that the guest has ballooned so far; the
+ * host page is only released once all of them are.
+ */
+typedef struct PartiallyBalloonedPage {
+    ram_addr_t base;
+    unsigned long *bitmap;
+} PartiallyBalloonedPage;
+
+enum virtio_balloon_free_page_report_status {
+    FREE_PAGE_REPORT_S_STOP = 0,
+    FREE_PAGE_REPORT_S_REQUESTED = 1,
+    FREE_PAGE_REPORT_S_START = 2,
+    FREE_PAGE_REPORT_S_DONE = 3,
+};
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
-    VirtQueueElement stats_vq_elem;
+    VirtQueueElement *stats_vq_elem;
     size_t stats_vq_offset;
     QEMUTimer *stats_timer;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    PartiallyBalloonedPage pbp;
+    uint32_t free_page_report_cmd_id;
+    uint32_t free_page_report_status;
+    Notifier free_page_report_notify;
 } VirtIOBalloon;
 
 #endif
@@ -35,11 +35,36 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    bool tx_zerocopy;
+    uint16_t queues;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Maximum number of packets popped from the tx virtqueue in one go */
+#define VIRTIO_NET_TX_BATCH 8
+
+/* Limits of the receive-side scaling state the guest configures */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6)
+
+typedef struct VirtioNetRssData {
+    bool enabled;               /* steer packets with the indirection table */
+    bool populate_hash;         /* report the hash in the virtio header */
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;     /* for packets that have no hash */
+} VirtioNetRssData;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -47,9 +72,15 @@ typedef struct VirtIONetQueue {
     QEMUBH *tx_bh;
     int tx_waiting;
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
+    /* Byte swapped header of the packet being sent, which may be queued
+     * by reference.
+     */
+    struct virtio_net_hdr_mrg_rxbuf tx_hdr;
+    /* Packets were placed in rx_vq since the guest was last notified */
+    bool rx_notify;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -65,7 +96,7 @@ typedef struct VirtIONet {
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
-    uint32_t host_features;
+    uint64_t host_features;
     uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
@@ -88,6 +119,10 @@ typedef struct VirtIONet {
     DeviceState *qdev;
     int multiqueue;
     uint16_t max_queues;
+    /* Queue pairs from peer_queues on have no peer and transmit through
+     * the peer of queue pair (index % peer_queues)
+     */
+    uint16_t peer_queues;
     uint16_t curr_queues;
     size_t config_size;
     char *netclient_name;
@@ -95,6 +130,7 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    VirtioNetRssData rss_data;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -22,6 +22,7 @@
 #include "hw/pci/pci.h"
 #include "hw/scsi/scsi.h"
 #include "sysemu/iothread.h"
+#include "qemu/thread.h"
 #include "hw/virtio/dataplane/vring.h"
 
 #define TYPE_VIRTIO_SCSI_COMMON "virtio-scsi-common"
@@ -54,17 +55,36 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *cmd_iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
 
 typedef struct {
     struct VirtIOSCSI *parent;
+    AioContext *ctx;
+    /* Requests of a vring can complete in another context */
+    QemuMutex lock;
     Vring vring;
     EventNotifier host_notifier;
     EventNotifier guest_notifier;
 } VirtIOSCSIVring;
 
+/*
+ * An iothread serving request queues.  Each target, with all its LUNs,
+ * belongs to one of them; requests that arrive on the queue of another
+ * iothread are handed over through @reqs.
+ */
+typedef struct {
+    struct VirtIOSCSI *parent;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;
+    QemuMutex lock;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs;
+} VirtIOSCSIContext;
+
 typedef struct VirtIOSCSICommon {
     VirtIODevice parent_obj;
     VirtIOSCSIConf conf;
@@ -84,7 +104,9 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* control and event queues */
+    VirtIOSCSIContext *cmd_ctxs;
+    int num_cmd_ctxs;
 
     /* Vring is used instead of vq in dataplane code, because of the underlying
      * memory layer thread safety */
@@ -102,18 +124,18 @@ typedef struct VirtIOSCSI {
 } VirtIOSCSI;
 
 typedef struct VirtIOSCSIReq {
+    /* Note:
+     * - elem is filled in by virtqueue_pop;
+     * - fields up to resp_iov are initialized by virtio_scsi_init_req;
+     * - fields after resp_iov are zeroed by virtio_scsi_init_req.
+     * */
+    VirtQueueElement elem;
+
     VirtIOSCSI *dev;
     VirtQueue *vq;
     QEMUSGList qsgl;
     QEMUIOVector resp_iov;
 
-    /* Note:
-     * - fields before elem are initialized by virtio_scsi_init_req;
-     * - elem is uninitialized at the time of allocation.
-     * - fields after elem are zeroed by virtio_scsi_init_req.
-     * */
-
-    VirtQueueElement elem;
     /* Set by dataplane code. */
     VirtIOSCSIVring *vring;
 
@@ -151,12 +173,15 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req);
-VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq);
+void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+AioContext *virtio_scsi_target_ctx(VirtIOSCSI *s, int target);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req);
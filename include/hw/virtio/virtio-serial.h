@@ -78,6 +78,13 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+
+    /*
+     * Optional: like have_data, but with the buffers of several
+     * elements at once, so that the app can write them together.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port,
+                             const struct iovec *iov, int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -122,7 +129,7 @@ struct VirtIOSerialPort {
      * element popped and continue consuming it once the backend
      * becomes writable again.
      */
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     /*
      * The index and the offset into the iov buffer that was popped in
@@ -17,6 +17,7 @@
 #include "hw/hw.h"
 #include "net/net.h"
 #include "hw/qdev.h"
+#include "exec/memory.h"
 #include "sysemu/sysemu.h"
 #include "qemu/event_notifier.h"
 #include "standard-headers/linux/virtio_config.h"
@@ -41,15 +42,21 @@ typedef struct VirtQueue VirtQueue;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
+/* Elements are allocated by virtqueue_pop() together with the structure that
+ * embeds them, which must start with the VirtQueueElement, and with scatter
+ * lists sized for the descriptor chain.  Free them with
+ * virtqueue_free_element().
+ */
 typedef struct VirtQueueElement
 {
     unsigned int index;
     unsigned int out_num;
     unsigned int in_num;
-    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
-    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
-    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
-    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+    size_t size;
+    hwaddr *in_addr;
+    hwaddr *out_addr;
+    struct iovec *in_sg;
+    struct iovec *out_sg;
 } VirtQueueElement;
 
 #define VIRTIO_QUEUE_MAX 1024
@@ -91,6 +98,7 @@ struct VirtIODevice
     char *bus_name;
     uint8_t device_endian;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -148,10 +156,18 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len);
 
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num);
+void virtqueue_free_element(void *elem);
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+void *virtqueue_pop(VirtQueue *vq, size_t sz);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, void **elems, size_t sz,
+                                 unsigned int max);
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz);
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
@@ -234,6 +250,7 @@ hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
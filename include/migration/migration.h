@@ -35,6 +35,7 @@
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
+#define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -44,14 +45,70 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+
+    MIG_RP_MSG_MAX
+};
+
 typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
 
+/* The current postcopy state is read/set by postcopy_state_get/set
+ * which update it atomically.
+ * The state is updated as postcopy messages are received, and
+ * in general only one thread should be writing to the state at any one
+ * time, initially the main thread and then the listen thread;
+ * Corner cases are where either thread finishes early and/or errors.
+ * The state is checked as messages are received to ensure that
+ * the source is sending us messages in the correct order.
+ * The state is also used by the RAM reception code to know if it
+ * has to place pages atomically, and the cleanup code at the end of
+ * the main thread to know if it has to delay cleanup until the end
+ * of postcopy.
+ */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_DISCARD,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyState;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *file;
 
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
+
+    /* Set by the postcopy listen thread while it owns the stream */
+    QemuThread listen_thread;
+    bool have_listen_thread;
+    /* Set once the main thread has finished loading the device state */
+    QemuEvent main_thread_load_event;
+    /* Starts the guest once the device state has been loaded */
+    QEMUBH *bh;
+
+    /* Thread reading faults from userfault_fd and requesting pages */
+    QemuThread fault_thread;
+    QemuSemaphore fault_thread_sem;
+    bool have_fault_thread;
+
+    /* For the kernel to send us notifications */
+    int userfault_fd;
+    /* To tell the fault_thread to quit */
+    int userfault_quit_fd[2];
+
+    /* Return path to the source, protected by rp_mutex */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
+    void *postcopy_tmp_page;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -67,6 +124,8 @@ struct MigrationState
     QEMUBH *cleanup_bh;
     QEMUFile *file;
     int parameters[MIGRATION_PARAMETER_MAX];
+    /* address the multifd channels connect to */
+    char *multifd_host_port;
 
     int state;
     MigrationParams params;
@@ -80,9 +139,17 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* State related to return path */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool error;
+    } rp_state;
 };
 
 void process_incoming_migration(QEMUFile *f);
+void migration_incoming_finish(MigrationIncomingState *mis, int ret);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -116,18 +183,42 @@ int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
+
+/*
+ * Points of a precopy migration of RAM that devices can hook.  The
+ * notifiers get a pointer to the PrecopyNotifyReason, and run in the
+ * migration thread with the iothread lock held.
+ */
+typedef enum PrecopyNotifyReason {
+    PRECOPY_NOTIFY_SETUP,       /* dirty logging is about to start */
+    PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC,
+    PRECOPY_NOTIFY_AFTER_BITMAP_SYNC,
+    PRECOPY_NOTIFY_CLEANUP,     /* migration completed or was cancelled */
+} PrecopyNotifyReason;
+
+void precopy_add_notifier(Notifier *n);
+void precopy_remove_notifier(Notifier *n);
+/* Make the bulk stage honour pages cleared by qemu_guest_free_page_hint() */
+void precopy_enable_free_page_optimization(void);
+void qemu_guest_free_page_hint(void *addr, size_t len);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_send_shutdown(void);
+void multifd_send_threads_join(void);
+void multifd_recv_set_listener(int fd);
+void multifd_recv_threads_join(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+bool dirty_rate_measuring(void);
 void free_xbzrle_decoded_buf(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
@@ -142,6 +233,8 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_cache_evictions(void);
 double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
@@ -167,6 +260,7 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool xbzrle_set_accel(const char *name);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -177,8 +271,31 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_rdma_qps(void);
+bool migrate_postcopy_ram(void);
+bool migrate_dirty_bitmaps(void);
+bool migrate_page_batch(void);
+bool migrate_local_shared_ram(void);
+bool migrate_ignore_shared(void);
+int migrate_postcopy_rounds(void);
 bool migrate_use_events(void);
 
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
+
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len);
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length);
+
+PostcopyState postcopy_state_get(void);
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
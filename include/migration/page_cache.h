@@ -15,7 +15,11 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H
 
-/* Page cache for storing guest pages */
+/*
+ * Page cache for storing guest pages.  The cache is set associative: a page
+ * can be stored in any of a small number of slots, and the least recently
+ * used page of these is replaced when they are all in use.
+ */
 typedef struct PageCache PageCache;
 
 /**
@@ -39,14 +43,14 @@ void cache_fini(PageCache *cache);
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
- * Returns %true if page is cached
+ * Returns %true if page is cached; a cached page is marked as the most
+ * recently used one
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -62,7 +66,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
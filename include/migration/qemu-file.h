@@ -96,6 +96,24 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
+
+/*
+ * Pass a file descriptor to the other side, attached to one byte of
+ * stream data.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileSendFDFunc)(void *opaque, int fd);
+
+/*
+ * Take the oldest file descriptor received from the other side.
+ * Returns the descriptor, or -err if none was received
+ */
+typedef int (QEMUFileRecvFDFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -107,6 +125,9 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMURetPathFunc *get_return_path;
+    QEMUFileSendFDFunc *send_fd;
+    QEMUFileRecvFDFunc *recv_fd;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -175,6 +196,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_credit_transfer(QEMUFile *f, size_t size);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -194,6 +216,10 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
+bool qemu_file_can_pass_fd(QEMUFile *f);
+int qemu_file_send_fd(QEMUFile *f, int fd);
+int qemu_file_recv_fd(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
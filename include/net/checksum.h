@@ -18,9 +18,24 @@
 #ifndef QEMU_NET_CHECKSUM_H
 #define QEMU_NET_CHECKSUM_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 struct iovec;
 
+/**
+ * net_checksum_add_cont: add up a buffer for the Internet checksum
+ *
+ * Returns the partial ones' complement sum of the buffer, for
+ * net_checksum_finish(); it is at most 0xffff, so that partial sums can
+ * be added together
+ *
+ * @len: length of @buf
+ * @buf: data
+ * @seq: offset of @buf in the checksummed data; only its parity matters
+ *
+ * SSE2, AVX2 or NEON are used if the host has them.
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
@@ -51,4 +66,26 @@ uint32_t net_checksum_add_iov(const struct iovec *iov,
                               const unsigned int iov_cnt,
                               uint32_t iov_off, uint32_t size);
 
+/**
+ * net_toeplitz_hash: Toeplitz hash, as used by receive-side scaling
+ *
+ * Returns the 32-bit hash of @input
+ *
+ * @key: secret key, at least @len + 4 bytes long
+ * @input: the header fields to hash, in network byte order
+ * @len: length of @input
+ */
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *input,
+                           size_t len);
+
+/**
+ * net_checksum_set_accel: Select the implementation of the checksum
+ *
+ * Returns %false if @name is not available on this host
+ *
+ * @name: "int64", "sse2", "avx2", "neon", or "auto" for the best one; this
+ * is meant for tests, which check that all implementations agree
+ */
+bool net_checksum_set_accel(const char *name);
+
 #endif /* QEMU_NET_CHECKSUM_H */
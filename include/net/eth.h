@@ -145,6 +145,8 @@ struct tcp_hdr {
 #define TH_PUSH 0x08
 #define TH_ACK  0x10
 #define TH_URG  0x20
+#define TH_ECE  0x40
+#define TH_CWR  0x80
     u_short th_win;      /* window */
     u_short th_sum;      /* checksum */
     u_short th_urp;      /* urgent pointer */
@@ -194,6 +196,7 @@ struct tcp_hdr {
     (sizeof(struct eth_header) + 2 * sizeof(struct vlan_header))
 
 #define ETH_MAX_IP4_HDR_LEN   (60)
+#define ETH_MAX_TCP_HDR_LEN   (60)
 #define ETH_MAX_IP_DGRAM_LEN  (0xFFFF)
 
 #define IP_FRAG_UNIT_SIZE     (8)
@@ -339,6 +342,10 @@ eth_fix_ip4_checksum(void *l3hdr, size_t l3hdr_len);
 uint32_t
 eth_calc_pseudo_hdr_csum(struct ip_header *iphdr, uint16_t csl);
 
+uint32_t
+eth_calc_ip6_pseudo_hdr_csum(struct ip6_header *ip6hdr, uint16_t csl,
+                             uint8_t l4proto);
+
 bool
 eth_parse_ipv6_hdr(struct iovec *pkt, int pkt_frags,
                    size_t ip6hdr_off, uint8_t *l4proto,
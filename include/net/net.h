@@ -45,6 +45,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -64,6 +65,11 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Receives a batch of packets, each described by one iovec.  Returns the
+     * number of packets consumed; if that is less than the batch size, the
+     * rest is queued until the client calls qemu_flush_queued_packets().
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -92,6 +98,10 @@ struct NetClientState {
     NetClientDestructor *destructor;
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
+    int vring_enable;
+    /* Packets delivered to this client, reported by query-stats */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
 };
 
 typedef struct NICState {
@@ -129,10 +139,14 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *nc, const struct iovec *iov,
+                                   int iovcnt, NetPacketSent *sent_cb);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_send_packet_batch_async(NetClientState *nc, const struct iovec *pkts,
+                                 int count, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -161,6 +175,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              void *opaque);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void hmp_info_network(Monitor *mon, const QDict *qdict);
@@ -33,6 +33,8 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The packet data stays valid until the sent callback is invoked */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
@@ -52,6 +54,13 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -22,9 +22,17 @@ void vhost_net_cleanup(VHostNetState *net);
 
 uint64_t vhost_net_get_features(VHostNetState *net, uint64_t features);
 void vhost_net_ack_features(VHostNetState *net, uint64_t features);
+uint64_t vhost_net_get_acked_features(VHostNetState *net);
+uint64_t vhost_net_get_max_queues(VHostNetState *net);
+int vhost_net_set_busyloop_timeout(VHostNetState *net, uint32_t timeout);
+uint32_t vhost_net_get_busyloop_timeout(VHostNetState *net);
+bool vhost_net_is_started(VHostNetState *net);
+VhostBackendType vhost_net_get_backend_type(VHostNetState *net);
 
 bool vhost_net_virtqueue_pending(VHostNetState *net, int n);
 void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask);
 VHostNetState *get_vhost_net(NetClientState *nc);
+
+int vhost_set_vring_enable(NetClientState *nc, int enable);
 #endif
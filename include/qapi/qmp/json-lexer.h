@@ -14,8 +14,7 @@
 #ifndef QEMU_JSON_LEXER_H
 #define QEMU_JSON_LEXER_H
 
-#include "qapi/qmp/qstring.h"
-#include "qapi/qmp/qlist.h"
+#include <glib.h>
 
 typedef enum json_token_type {
     JSON_OPERATOR = 100,
@@ -30,13 +29,15 @@ typedef enum json_token_type {
 
 typedef struct JSONLexer JSONLexer;
 
-typedef void (JSONLexerEmitter)(JSONLexer *, QString *, JSONTokenType, int x, int y);
+/* The token is only valid during the call, the lexer reuses its buffer */
+typedef void (JSONLexerEmitter)(JSONLexer *, GString *, JSONTokenType,
+                                int x, int y);
 
 struct JSONLexer
 {
     JSONLexerEmitter *emit;
     int state;
-    QString *token;
+    GString *token;
     int x, y;
 };
 
@@ -107,6 +107,7 @@ void cpu_ticks_init(void);
 
 /* icount */
 void configure_icount(QemuOpts *opts, Error **errp);
+void qemu_tcg_configure(const char *mode, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 /* drift information for info jit command */
@@ -382,6 +383,23 @@ typedef struct PCIHostDeviceAddress {
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
 
+/* If nonzero, TBs that cpu_exec() enters this many times are translated
+   again with CF_TRACE.  Until then they are not chained, so that every
+   execution is counted.  */
+extern unsigned int tb_trace_threshold;
+
+/* If set, TBs are translated with code that counts their executions, and
+   the time spent translating and executing code is measured.  */
+extern bool tb_profile_enabled;
+
+/* If nonzero, code in pages whose TBs were invalidated this many times by
+   guest writes is no longer cached, but translated again every time it
+   runs, one instruction at a time.  */
+extern unsigned int tb_smc_limit;
+
+/* Start writing the perf map of the translated code */
+int perfmap_init(void);
+
 void cpu_exec_init_all(void);
 
 /* CPU save/load.  */
@@ -400,6 +418,7 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool exclusive;
 };
 
 
@@ -426,11 +445,15 @@ ssize_t qemu_co_send_recv(int sockfd, void *buf, size_t bytes, bool do_send);
 #define qemu_co_send(sockfd, buf, bytes) \
   qemu_co_send_recv(sockfd, buf, bytes, true)
 
+/* Vectors initialized for up to this many elements need no allocation */
+#define QEMU_IOVEC_LOCAL_NIOV 2
+
 typedef struct QEMUIOVector {
     struct iovec *iov;
     int niov;
     int nalloc;
     size_t size;
+    struct iovec local_iov[QEMU_IOVEC_LOCAL_NIOV];
 } QEMUIOVector;
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
@@ -591,6 +614,7 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool buffer_find_nonzero_offset_set_accel(const char *name);
 
 /*
  * helper to parse debug environment variables
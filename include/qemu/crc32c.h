@@ -30,6 +30,28 @@
 
 #include "qemu-common.h"
 
+/**
+ * crc32c: Compute the CRC32C (Castagnoli) checksum of a buffer
+ *
+ * Returns the checksum, inverted
+ *
+ * @crc: initial value, 0xffffffff for a new checksum; to extend a checksum,
+ * pass the inverse of the value returned for the previous part
+ * @data: buffer
+ * @length: number of bytes in @data
+ *
+ * The SSE4.2 or ARMv8 CRC32 instructions are used if the host has them.
+ */
 uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 
+/**
+ * crc32c_set_accel: Select the implementation of crc32c()
+ *
+ * Returns %false if @name is not available on this host
+ *
+ * @name: "table", "sse4.2", "armv8", or "auto" for the best one; this is
+ * meant for tests, which check that all implementations agree
+ */
+bool crc32c_set_accel(const char *name);
+
 #endif
@@ -148,6 +148,36 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @count: Number of bits to look at.
+ *
+ * Return the first bit in [@start, @start + @count) that is not set, or -1
+ * if there is none before the end of the range or of the bitmap.  The
+ * result is a multiple of the granularity, unless it is @start.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: First bit of the range to look at; on success, first bit of the
+ * area that was found.
+ * @count: Number of bits in the range; on success, number of bits in the
+ * area that was found.
+ *
+ * Find the first run of set bits that starts in the given range, and store
+ * its extent, limited to the range, into @start and @count.  Return false,
+ * leaving @start and @count unchanged, if no bit is set in the range.
+ *
+ * Unlike hbitmap_iter_next, this returns a whole run of set bits at once;
+ * runs that are many words long are found with one scan of the last level.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -156,6 +186,72 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of granules in the HBitmap, i.e. its size in bits
+ * after applying the granularity.
+ */
+uint64_t hbitmap_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of at least DIV_ROUND_UP(@count, 8) bytes.
+ * @start: First granule to store, a multiple of 64.
+ * @count: Number of granules to store.
+ *
+ * Store granules [@start, @start + @count) of the HBitmap into @buf, one
+ * bit per granule: granule @start + i is bit i % 8 of byte i / 8.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer in the format of hbitmap_serialize_part.
+ * @start: First granule to load, a multiple of 64.
+ * @count: Number of granules to load.
+ *
+ * Load granules [@start, @start + @count) of the HBitmap from @buf.  The
+ * HBitmap must not be used, except for more calls to this function, until
+ * hbitmap_deserialize_finish is called.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the upper levels and the count of the HBitmap after it was
+ * loaded with hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
+/**
+ * hbitmap_create_meta:
+ * @hb: HBitmap to operate on.
+ * @chunk_bits: Base 2 logarithm of the number of granules in a chunk.
+ *
+ * Start recording which chunks of the HBitmap change, for example to
+ * save only those parts of it that were modified.  The recording is done
+ * in a new HBitmap, which is returned: its elements are the granules of
+ * @hb, with a granularity of @chunk_bits.  The meta bitmap belongs to @hb
+ * and is freed together with it or by hbitmap_free_meta.
+ */
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_bits);
+
+/**
+ * hbitmap_free_meta:
+ * @hb: HBitmap to operate on.
+ *
+ * Stop recording changes to the HBitmap and free its meta bitmap.
+ */
+void hbitmap_free_meta(HBitmap *hb);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
@@ -0,0 +1,22 @@
+/*
+ * Runtime detection of the host's x86 vector extensions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_HOST_CPUID_H
+#define QEMU_HOST_CPUID_H
+
+#include <stdbool.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * These check both the CPUID feature bit and that the OS saves the
+ * extended register state (XCR0), so the instructions can be used.
+ */
+bool host_cpuid_has_avx2(void);
+bool host_cpuid_has_avx512f(void);
+#endif
+
+#endif
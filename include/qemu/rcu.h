@@ -63,6 +63,21 @@ extern unsigned long rcu_gp_ctr;
 
 extern QemuEvent rcu_gp_event;
 
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/* Multi-producer, single-consumer queue of callbacks.  */
+struct rcu_call_queue {
+    struct rcu_head *head;
+    struct rcu_head **tail;
+    struct rcu_head dummy;
+};
+
 struct rcu_reader_data {
     /* Data used by both reader and synchronize_rcu() */
     unsigned long ctr;
@@ -70,9 +85,19 @@ struct rcu_reader_data {
 
     /* Data used by reader only */
     unsigned depth;
+    bool registered;
 
     /* Data used for registry, protected by rcu_gp_lock */
     QLIST_ENTRY(rcu_reader_data) node;
+
+    /* Callbacks queued by call_rcu1() in this thread.  cb_queued is
+     * written by the reader only, cb_taken and cb_batch by the call_rcu
+     * thread with rcu_gp_lock held.
+     */
+    struct rcu_call_queue cbs;
+    unsigned long cb_queued;
+    unsigned long cb_taken;
+    unsigned long cb_batch;
 };
 
 extern __thread struct rcu_reader_data rcu_reader;
@@ -119,16 +144,29 @@ extern void rcu_register_thread(void);
 extern void rcu_unregister_thread(void);
 extern void rcu_after_fork(void);
 
-struct rcu_head;
-typedef void RCUCBFunc(struct rcu_head *head);
-
-struct rcu_head {
-    struct rcu_head *next;
-    RCUCBFunc *func;
-};
-
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 
+/*
+ * Start the next grace period for the pending callbacks right away,
+ * instead of waiting for more of them to pile up.  Useful when the
+ * callbacks free a lot of memory.
+ */
+extern void call_rcu_expedite(void);
+
+typedef struct RCUStats {
+    uint64_t grace_periods;
+    uint64_t gp_time_last_ns;
+    uint64_t gp_time_max_ns;
+    uint64_t gp_time_total_ns;
+    uint64_t batches;
+    uint64_t expedited_batches;
+    uint64_t max_batch;
+    uint64_t callbacks;
+    uint64_t pending;
+} RCUStats;
+
+extern void rcu_get_stats(RCUStats *stats);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
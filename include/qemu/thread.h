@@ -55,6 +55,11 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits);
+int qemu_host_node_get_cpus(unsigned long node, unsigned long *host_cpus,
+                            unsigned long nbits);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
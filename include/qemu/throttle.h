@@ -60,13 +60,37 @@ typedef struct LeakyBucket {
 typedef struct ThrottleConfig {
     LeakyBucket buckets[BUCKETS_COUNT]; /* leaky buckets */
     uint64_t op_size;         /* size of an operation in bytes */
+    uint64_t tick;            /* granularity of the timers in ns, 0 = none */
+
+    /* The following two only apply to the member of a throttle group
+     * that is being configured, not to the whole group */
+    uint64_t weight;          /* relative share of the group's capacity,
+                               * 0 means THROTTLE_WEIGHT_DEFAULT */
+    double iops_reserved;     /* guaranteed operations per second */
 } ThrottleConfig;
 
+#define THROTTLE_WEIGHT_DEFAULT 100
+#define THROTTLE_WEIGHT_MAX     1000
+
+#define THROTTLE_TICK_MAX       NANOSECONDS_PER_SECOND
+
 typedef struct ThrottleState {
     ThrottleConfig cfg;       /* configuration */
     int64_t previous_leak;    /* timestamp of the last leak done */
 } ThrottleState;
 
+/* The share of a throttle group's capacity that one member gets: the
+ * members with pending requests that are within their reservation go
+ * first, the others are served in order of virtual time, which
+ * advances more slowly for members with a larger weight.
+ */
+typedef struct ThrottleShare {
+    unsigned weight;          /* 1 to THROTTLE_WEIGHT_MAX */
+    LeakyBucket reserve;      /* avg is the reservation in ops per second */
+    int64_t previous_leak;    /* timestamp of the last leak of reserve */
+    uint64_t vtime[2];        /* virtual time of reads and writes */
+} ThrottleShare;
+
 typedef struct ThrottleTimers {
     QEMUTimer *timers[2];     /* timers used to do the throttling */
     QEMUClockType clock_type; /* the clock used */
@@ -118,6 +142,10 @@ void throttle_config(ThrottleState *ts,
                      ThrottleTimers *tt,
                      ThrottleConfig *cfg);
 
+void throttle_config_buckets(ThrottleState *ts,
+                             QEMUClockType clock_type,
+                             ThrottleConfig *cfg);
+
 void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
 
 /* usage */
@@ -69,7 +69,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    size_t heap_index;          /* position in the timer list's heap */
+    uint64_t seq;               /* orders timers with equal expire_time */
     int scale;
 };
 
@@ -849,6 +850,8 @@ static inline int64_t get_clock(void)
 int64_t cpu_get_icount_raw(void);
 int64_t cpu_get_icount(void);
 int64_t cpu_get_clock(void);
+int64_t cpu_get_icount_bias(void);
+void cpu_set_icount_bias(int64_t bias);
 int64_t cpu_icount_to_ns(int64_t icount);
 
 /*******************************************/
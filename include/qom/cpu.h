@@ -224,16 +224,25 @@ struct kvm_run;
  * @halted: Nonzero if the CPU is in suspended state.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_thread_scheduled: Set while a throttling sleep is queued for
+ *           the CPU.
  * @tcg_exit_req: Set to force TCG to stop executing linked TBs for this
- *           CPU and return to its top level loop.
+ *           CPU and return to its top level loop.  With icount, TBs test
+ *           icount_decr.u16.high instead.
  * @singlestep_enabled: Flags for single-stepping.
  * @icount_extra: Instructions until next timer event.
+ * @tb_profile_exec_time: Nanoseconds spent in cpu_exec() while TB
+ * profiling was enabled.
  * @icount_decr: Number of cycles left, with interrupt flag in high bit.
  * This allows a single read-compare-cbranch-write sequence to test
  * for both decrementer underflow and exceptions.
  * @can_do_io: Nonzero if memory-mapped IO is safe.
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tlb_d: Sizing state of the softmmu TLB of each MMU mode, if the TLB
+ * is resized at run time.
+ * @tlb_flush_pending: MMU modes whose flush was requested by other vCPUs
+ * and has not been done yet.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -242,6 +251,12 @@ struct kvm_run;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_exit_count: KVM_RUN exits by exit reason, reported by query-stats.
+ * @halt_poll_ns: Current window for which a halted KVM vCPU polls for
+ * work before it sleeps, see -machine kvm-halt-poll-ns.
+ * @halt_poll_attempted: Halts that polled, reported by query-stats.
+ * @halt_poll_successful: Halts that found work while polling.
+ * @halt_poll_time_ns: Time spent polling.
  *
  * State of one CPU core or thread.
  */
@@ -267,10 +282,12 @@ struct CPUState {
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_thread_scheduled;
     volatile sig_atomic_t exit_request;
     uint32_t interrupt_request;
     int singlestep_enabled;
     int64_t icount_extra;
+    int64_t tb_profile_exec_time;
     sigjmp_buf jmp_env;
 
     AddressSpace *as;
@@ -280,6 +297,8 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct CPUTLBDesc *tlb_d;
+    uint16_t tlb_flush_pending;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -303,6 +322,11 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    uint64_t *kvm_exit_count;
+    int64_t halt_poll_ns;
+    uint64_t halt_poll_attempted;
+    uint64_t halt_poll_successful;
+    uint64_t halt_poll_time_ns;
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
@@ -539,6 +563,66 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * cpu_throttle_set:
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Throttles all vcpus by forcing them to sleep for the given percentage of
+ * time. A throttle_percentage of 25 corresponds to a 75% duty cycle
+ * (example: 10ms sleep for every 30ms awake).
+ *
+ * cpu_throttle_set can be called as needed to adjust new_throttle_pct.
+ * Once the throttling starts, it will remain in effect until
+ * cpu_throttle_stop is called.
+ */
+void cpu_throttle_set(int new_throttle_pct);
+
+/**
+ * cpu_throttle_stop:
+ *
+ * Stops the vcpu throttling started by cpu_throttle_set.
+ */
+void cpu_throttle_stop(void);
+
+/**
+ * cpu_throttle_active:
+ *
+ * Returns: %true if the vcpus are currently being throttled, %false
+ * otherwise.
+ */
+bool cpu_throttle_active(void);
+
+/**
+ * cpu_throttle_get_percentage:
+ *
+ * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ *
+ * Returns: The throttle percentage in range 1 to 99.
+ */
+int cpu_throttle_get_percentage(void);
+
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * at a point where no other vCPU is executing translated code.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
+/**
+ * qemu_tcg_mttcg_enabled:
+ *
+ * Check whether TCG runs each vCPU on its own host thread.
+ *
+ * Returns: %true in multi-threaded TCG mode, %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
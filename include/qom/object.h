@@ -365,7 +365,12 @@ typedef void (ObjectUnparent)(Object *obj);
  */
 typedef void (ObjectFree)(void *obj);
 
-#define OBJECT_CLASS_CAST_CACHE 4
+#define OBJECT_CLASS_CAST_CACHE 16
+
+typedef struct ObjectClassCastEntry {
+    const char *typename;
+    ObjectClass *klass;
+} ObjectClassCastEntry;
 
 /**
  * ObjectClass:
@@ -379,8 +384,9 @@ struct ObjectClass
     Type type;
     GSList *interfaces;
 
-    const char *object_cast_cache[OBJECT_CLASS_CAST_CACHE];
-    const char *class_cast_cache[OBJECT_CLASS_CAST_CACHE];
+    /* Results of the QOM cast macros for this class */
+    ObjectClassCastEntry cast_cache[OBJECT_CLASS_CAST_CACHE];
+    int cast_cache_used;
 
     ObjectUnparent *unparent;
 };
@@ -406,6 +412,7 @@ struct Object
     ObjectClass *class;
     ObjectFree *free;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    GHashTable *property_table;     /* the properties, by name */
     uint32_t ref;
     Object *parent;
 };
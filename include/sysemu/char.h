@@ -57,6 +57,8 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -83,6 +85,8 @@ struct CharDriverState {
     int explicit_be_open;
     int avail_connections;
     int is_mux;
+    /* Input that is not guest input, for record/replay */
+    bool no_replay;
     guint fd_in_tag;
     QemuOpts *opts;
     QTAILQ_ENTRY(CharDriverState) next;
@@ -188,6 +192,22 @@ int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Write a scatter/gather list to a character backend from the front end,
+ * with a single system call for backends that support it.  Like
+ * @qemu_chr_fe_write, it stops at the first short write.  This function
+ * is thread-safe.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed, or -1 if none could be
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
@@ -320,6 +340,14 @@ int qemu_chr_be_can_write(CharDriverState *s);
  */
 void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_be_write_impl:
+ *
+ * Implementation of back end writing, used by record/replay to deliver
+ * the input it has held back.
+ */
+void qemu_chr_be_write_impl(CharDriverState *s, uint8_t *buf, int len);
+
 
 /**
  * @qemu_chr_be_event:
@@ -142,6 +142,7 @@ typedef struct QEMU_PACKED KdumpSubHeader64 {
 
 typedef struct DataCache {
     int fd;             /* fd of the file where to write the cached data */
+    struct DumpWriter *writer;  /* if set, the data is written through it */
     uint8_t *buf;       /* buffer for cached data */
     size_t buf_size;    /* size of the buf */
     size_t data_size;   /* size of cached data in buf */
@@ -15,10 +15,15 @@
 #define IOTHREAD_H
 
 #include "block/aio.h"
+#include "block/coroutine.h"
 #include "qemu/thread.h"
+#include "qemu/bitmap.h"
+#include "sysemu/sysemu.h" /* for MAX_NODES */
 
 #define TYPE_IOTHREAD "iothread"
 
+#define IOTHREAD_POOL_MAX_CPUS 1024
+
 typedef struct {
     Object parent_obj;
 
@@ -28,6 +33,21 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+    /* Set by the thread itself before init_done_cond is signalled */
+    const CoroutinePoolStats *co_pool_stats;
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Host CPUs and NUMA nodes the thread pool workers run on */
+    DECLARE_BITMAP(pool_cpus, IOTHREAD_POOL_MAX_CPUS);
+    DECLARE_BITMAP(pool_host_nodes, MAX_NODES);
+
+    /* Guest NUMA node whose host nodes the thread runs on, or -1 */
+    int64_t numa_node;
+    Notifier numa_notifier;
 } IOThread;
 
 #define IOTHREAD(obj) \
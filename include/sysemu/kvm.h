@@ -414,6 +414,9 @@ static inline void cpu_clean_state(CPUState *cpu)
 
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg);
 int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg);
+int kvm_irqchip_send_msi_irqfd(KVMState *s, MSIMessage msg);
+void kvm_irqchip_begin_route_changes(KVMState *s);
+void kvm_irqchip_commit_route_changes(KVMState *s);
 void kvm_irqchip_release_virq(KVMState *s, int virq);
 
 int kvm_irqchip_add_adapter_route(KVMState *s, AdapterInfo *adapter);
@@ -20,6 +20,10 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Pages reported by the last sync that are not re-armed yet, only
+     * used with KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2
+     */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
@@ -20,6 +20,7 @@ typedef struct node_info {
     uint64_t node_mem;
     DECLARE_BITMAP(node_cpu, MAX_CPUMASK_BITS);
     struct HostMemoryBackend *node_memdev;
+    DECLARE_BITMAP(host_nodes, MAX_NODES); /* where its threads run */
     bool present;
     QLIST_HEAD(, numa_addr_range) addr; /* List to store address ranges */
 } NodeInfo;
@@ -33,4 +34,10 @@ void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
 
+#define NUMA_MAX_HOST_CPUS 1024
+
+int numa_node_get_host_cpus(int nodeid, unsigned long *host_cpus,
+                            unsigned long nbits, Error **errp);
+void numa_cpu_thread_init(CPUState *cpu);
+
 #endif
@@ -0,0 +1,75 @@
+/*
+ * Deterministic record/replay of TCG execution
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef SYSEMU_REPLAY_H
+#define SYSEMU_REPLAY_H
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+typedef enum ReplayMode {
+    REPLAY_MODE_NONE,
+    REPLAY_MODE_RECORD,
+    REPLAY_MODE_PLAY,
+} ReplayMode;
+
+extern ReplayMode replay_mode;
+
+/*
+ * Start recording to, or replaying from, @filename.  @shift is the fixed
+ * icount shift, which the log records.
+ */
+void replay_configure(ReplayMode mode, const char *filename, int shift,
+                      Error **errp);
+
+/*
+ * Called by the TCG thread with the iothread lock held, before each round
+ * of execution.  Runs the expired QEMU_CLOCK_VIRTUAL timers and the queued
+ * (record) or logged (replay) asynchronous events.
+ */
+void replay_checkpoint(void);
+
+/* Whether the idle TCG thread has a checkpoint to process */
+bool replay_has_work(void);
+
+/*
+ * Clamp @count, the number of instructions the TCG thread is about to
+ * execute from @icount on, so that it stops at the next logged checkpoint.
+ */
+int64_t replay_icount_budget(int64_t icount, int64_t count);
+
+/* Record or replay a read of a clock other than QEMU_CLOCK_VIRTUAL */
+int64_t replay_read_clock(QEMUClockType type, int64_t now);
+
+static inline int64_t replay_clock(QEMUClockType type, int64_t now)
+{
+    if (replay_mode != REPLAY_MODE_NONE) {
+        return replay_read_clock(type, now);
+    }
+    return now;
+}
+
+/*
+ * Input of the character device backend @chr.  Returns true if it was
+ * taken over: queued for the next checkpoint (record) or dropped in favour
+ * of the logged input (replay).
+ */
+bool replay_char_write(CharDriverState *chr, const uint8_t *buf, int len);
+
+/*
+ * Block requests are numbered when they are submitted, and their
+ * completion callback @cb runs at a checkpoint.  replay_block_cancel()
+ * runs the callback of request @id at once if it has completed, for
+ * synchronous cancellation.
+ */
+uint64_t replay_block_id(void);
+void replay_block_event(uint64_t id, void (*cb)(void *opaque), void *opaque);
+bool replay_block_cancel(uint64_t id);
+
+#endif
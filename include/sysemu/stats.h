@@ -0,0 +1,38 @@
+/*
+ * Subsystem counters for query-stats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef SYSEMU_STATS_H
+#define SYSEMU_STATS_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+typedef struct StatsSink StatsSink;
+
+/*
+ * Report the counters of a provider with stats_add_instance() and
+ * stats_add_counter().  Called with the iothread lock held; counters that
+ * other threads update should be read with atomic_read().
+ */
+typedef void StatsProviderFunc(StatsSink *sink, void *opaque);
+
+/*
+ * Register @func to report counters for @provider.  A provider may be
+ * registered once per instance or once for all of its instances.
+ * Called with the iothread lock held.
+ */
+void stats_register_provider(StatsProvider provider, StatsProviderFunc *func,
+                             void *opaque);
+void stats_unregister_provider(StatsProviderFunc *func, void *opaque);
+
+/* Start an instance, to which the counters added next belong */
+void stats_add_instance(StatsSink *sink, const char *fmt, ...)
+    GCC_FMT_ATTR(2, 3);
+void stats_add_counter(StatsSink *sink, const char *name, uint64_t value);
+
+#endif
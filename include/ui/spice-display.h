@@ -19,6 +19,7 @@
 #include <spice/enums.h>
 #include <spice/qxl_dev.h>
 
+#include "qapi-types.h"
 #include "qemu/thread.h"
 #include "ui/qemu-pixman.h"
 #include "ui/console.h"
@@ -86,6 +87,15 @@ struct SimpleSpiceDisplay {
     QXLRect dirty;
     int notify;
 
+    /* statistics of the updates created by qemu, iothread only */
+    uint64_t frames;
+    uint64_t nr_updates;
+    uint64_t update_time;       /* ns */
+    int64_t fps_start;
+    uint64_t fps_frames;
+    double fps;
+    QTAILQ_ENTRY(SimpleSpiceDisplay) link;
+
     /*
      * All struct members below this comment can be accessed from
      * both spice server and qemu (iothread) context and any access
@@ -136,6 +146,8 @@ void qemu_spice_display_update(SimpleSpiceDisplay *ssd,
 void qemu_spice_display_switch(SimpleSpiceDisplay *ssd,
                                DisplaySurface *surface);
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd);
+void qemu_spice_display_set_update_threads(int nr_threads);
+SpiceDisplayInfoList *qemu_spice_query_displays(void);
 void qemu_spice_cursor_refresh_bh(void *opaque);
 
 void qemu_spice_add_memslot(SimpleSpiceDisplay *ssd, QXLDevMemSlot *memslot,
@@ -15,10 +15,15 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
+#include "sysemu/numa.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
+#include "sysemu/stats.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -27,6 +32,11 @@ typedef ObjectClass IOThreadClass;
 #define IOTHREAD_CLASS(klass) \
    OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
 
+/* On fast NVMe drives, most completions arrive within a few tens of
+ * microseconds, so poll for at most 32 microseconds by default.
+ */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -36,6 +46,7 @@ static void *iothread_run(void *opaque)
 
     qemu_mutex_lock(&iothread->init_done_lock);
     iothread->thread_id = qemu_get_thread_id();
+    iothread->co_pool_stats = qemu_coroutine_pool_stats();
     qemu_cond_signal(&iothread->init_done_cond);
     qemu_mutex_unlock(&iothread->init_done_lock);
 
@@ -53,6 +64,27 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_stats_query(StatsSink *sink, void *opaque)
+{
+    IOThread *iothread = opaque;
+    AioContext *ctx = iothread->ctx;
+    char *id = iothread_get_id(iothread);
+
+    stats_add_instance(sink, "%s", id);
+    stats_add_counter(sink, "iterations", atomic_read(&ctx->stats.iterations));
+    stats_add_counter(sink, "poll-hits", atomic_read(&ctx->stats.poll_hits));
+    stats_add_counter(sink, "wait-ns", atomic_read(&ctx->stats.wait_ns));
+    if (iothread->co_pool_stats) {
+        const CoroutinePoolStats *stats = iothread->co_pool_stats;
+
+        stats_add_counter(sink, "coroutine-pool-hits",
+                          atomic_read(&stats->hits));
+        stats_add_counter(sink, "coroutine-pool-misses",
+                          atomic_read(&stats->misses));
+    }
+    g_free(id);
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -60,6 +92,10 @@ static void iothread_instance_finalize(Object *obj)
     if (!iothread->ctx) {
         return;
     }
+    stats_unregister_provider(iothread_stats_query, iothread);
+    if (iothread->numa_notifier.notify) {
+        notifier_remove(&iothread->numa_notifier);
+    }
     iothread->stopping = true;
     aio_notify(iothread->ctx);
     qemu_thread_join(&iothread->thread);
@@ -68,6 +104,92 @@ static void iothread_instance_finalize(Object *obj)
     aio_context_unref(iothread->ctx);
 }
 
+static int iothread_add_node_cpus(unsigned long *cpus, unsigned long node,
+                                  Error **errp)
+{
+    int ret = qemu_host_node_get_cpus(node, cpus, IOTHREAD_POOL_MAX_CPUS);
+
+    if (ret == -ENOSYS) {
+        error_setg(errp, "Host NUMA nodes are not supported on this host");
+        return -1;
+    } else if (ret < 0) {
+        error_setg(errp, "Cannot find the CPUs of host NUMA node %lu", node);
+        return -1;
+    }
+    return 0;
+}
+
+/* Pin the thread pool workers to pool-cpus and the CPUs of pool-host-nodes */
+static void iothread_update_pool_affinity(IOThread *iothread, Error **errp)
+{
+    unsigned long *cpus = bitmap_new(IOTHREAD_POOL_MAX_CPUS);
+    unsigned long node;
+
+    bitmap_copy(cpus, iothread->pool_cpus, IOTHREAD_POOL_MAX_CPUS);
+    for (node = find_first_bit(iothread->pool_host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(iothread->pool_host_nodes, MAX_NODES,
+                              node + 1)) {
+        if (iothread_add_node_cpus(cpus, node, errp) < 0) {
+            goto out;
+        }
+    }
+
+    aio_context_acquire(iothread->ctx);
+    thread_pool_set_affinity(aio_get_thread_pool(iothread->ctx), cpus,
+                             IOTHREAD_POOL_MAX_CPUS);
+    aio_context_release(iothread->ctx);
+
+out:
+    g_free(cpus);
+}
+
+/*
+ * Run the thread, and the thread pool workers unless they are placed with
+ * pool-cpus or pool-host-nodes, on the host nodes of guest node numa-node
+ */
+static void iothread_update_numa_affinity(IOThread *iothread, Error **errp)
+{
+    unsigned long *cpus = bitmap_new(IOTHREAD_POOL_MAX_CPUS);
+    int ret;
+
+    ret = numa_node_get_host_cpus(iothread->numa_node, cpus,
+                                  IOTHREAD_POOL_MAX_CPUS, errp);
+    if (ret <= 0) {
+        goto out;
+    }
+
+    ret = qemu_thread_set_affinity(&iothread->thread, cpus,
+                                   IOTHREAD_POOL_MAX_CPUS);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set the affinity of the iothread");
+        goto out;
+    }
+
+    if (bitmap_empty(iothread->pool_cpus, IOTHREAD_POOL_MAX_CPUS) &&
+        bitmap_empty(iothread->pool_host_nodes, MAX_NODES)) {
+        aio_context_acquire(iothread->ctx);
+        thread_pool_set_affinity(aio_get_thread_pool(iothread->ctx), cpus,
+                                 IOTHREAD_POOL_MAX_CPUS);
+        aio_context_release(iothread->ctx);
+    }
+
+out:
+    g_free(cpus);
+}
+
+/* The guest NUMA nodes are only known once the machine is created */
+static void iothread_machine_init_done(Notifier *notifier, void *data)
+{
+    IOThread *iothread = container_of(notifier, IOThread, numa_notifier);
+    Error *local_err = NULL;
+
+    iothread_update_numa_affinity(iothread, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+}
+
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     Error *local_error = NULL;
@@ -81,6 +203,21 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink,
+                                &local_error);
+    if (!local_error &&
+        (!bitmap_empty(iothread->pool_cpus, IOTHREAD_POOL_MAX_CPUS) ||
+         !bitmap_empty(iothread->pool_host_nodes, MAX_NODES))) {
+        iothread_update_pool_affinity(iothread, &local_error);
+    }
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
@@ -97,6 +234,177 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    stats_register_provider(STATS_PROVIDER_IOTHREAD, iothread_stats_query,
+                            iothread);
+
+    if (iothread->numa_node >= 0) {
+        iothread->numa_notifier.notify = iothread_machine_init_done;
+        qemu_add_machine_init_done_notifier(&iothread->numa_notifier);
+    }
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} PollParamInfo;
+
+static PollParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static PollParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static PollParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+
+static void iothread_get_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, field, name, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx,
+                                    iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink,
+                                    &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* bitmap's byte offset in IOThread struct */
+    unsigned long nbits;
+} PoolAffinityInfo;
+
+static PoolAffinityInfo pool_cpus_info = {
+    "pool-cpus", offsetof(IOThread, pool_cpus), IOTHREAD_POOL_MAX_CPUS,
+};
+static PoolAffinityInfo pool_host_nodes_info = {
+    "pool-host-nodes", offsetof(IOThread, pool_host_nodes), MAX_NODES,
+};
+
+static void iothread_get_pool_affinity(Object *obj, Visitor *v, void *opaque,
+                                       const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PoolAffinityInfo *info = opaque;
+    unsigned long *bitmap = (void *)iothread + info->offset;
+    uint16List *list = NULL, **tail = &list;
+    unsigned long value;
+
+    for (value = find_first_bit(bitmap, info->nbits); value < info->nbits;
+         value = find_next_bit(bitmap, info->nbits, value + 1)) {
+        *tail = g_new0(uint16List, 1);
+        (*tail)->value = value;
+        tail = &(*tail)->next;
+    }
+
+    visit_type_uint16List(v, &list, name, errp);
+    qapi_free_uint16List(list);
+}
+
+static void iothread_set_pool_affinity(Object *obj, Visitor *v, void *opaque,
+                                       const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PoolAffinityInfo *info = opaque;
+    unsigned long *bitmap = (void *)iothread + info->offset;
+    uint16List *list = NULL, *l;
+    Error *local_err = NULL;
+
+    visit_type_uint16List(v, &list, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    for (l = list; l; l = l->next) {
+        if (l->value >= info->nbits) {
+            error_setg(&local_err, "%s value must be in range [0, %lu]",
+                       info->name, info->nbits - 1);
+            goto out;
+        }
+    }
+
+    bitmap_zero(bitmap, info->nbits);
+    for (l = list; l; l = l->next) {
+        set_bit(l->value, bitmap);
+    }
+
+    if (iothread->ctx) {
+        iothread_update_pool_affinity(iothread, &local_err);
+    }
+
+out:
+    qapi_free_uint16List(list);
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_numa_node(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, &iothread->numa_node, name, errp);
+}
+
+static void iothread_set_numa_node(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    if (iothread->ctx) {
+        error_setg(&local_err, "cannot change property value");
+        goto out;
+    }
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value < 0 || value >= MAX_NODES) {
+        error_setg(&local_err, "numa-node value must be in range [0, %d]",
+                   MAX_NODES - 1);
+        goto out;
+    }
+    iothread->numa_node = value;
+
+out:
+    error_propagate(errp, local_err);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
@@ -105,11 +413,45 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
     ucc->complete = iothread_complete;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->numa_node = -1;
+
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_param,
+                        iothread_set_poll_param,
+                        NULL, &poll_max_ns_info, &error_abort);
+    object_property_add(obj, "poll-grow", "int",
+                        iothread_get_poll_param,
+                        iothread_set_poll_param,
+                        NULL, &poll_grow_info, &error_abort);
+    object_property_add(obj, "poll-shrink", "int",
+                        iothread_get_poll_param,
+                        iothread_set_poll_param,
+                        NULL, &poll_shrink_info, &error_abort);
+    object_property_add(obj, "pool-cpus", "int",
+                        iothread_get_pool_affinity,
+                        iothread_set_pool_affinity,
+                        NULL, &pool_cpus_info, &error_abort);
+    object_property_add(obj, "pool-host-nodes", "int",
+                        iothread_get_pool_affinity,
+                        iothread_set_pool_affinity,
+                        NULL, &pool_host_nodes_info, &error_abort);
+    object_property_add(obj, "numa-node", "int",
+                        iothread_get_numa_node,
+                        iothread_set_numa_node,
+                        NULL, NULL, &error_abort);
+}
+
 static const TypeInfo iothread_info = {
     .name = TYPE_IOTHREAD,
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -149,6 +491,14 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    if (iothread->co_pool_stats) {
+        const CoroutinePoolStats *stats = iothread->co_pool_stats;
+
+        info->coroutine_pool_hits = atomic_read(&stats->hits);
+        info->coroutine_pool_misses = atomic_read(&stats->misses);
+        info->coroutine_pool_size = atomic_read(&stats->size);
+        info->coroutine_pool_max_size = atomic_read(&stats->max_size);
+    }
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
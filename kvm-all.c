@@ -22,6 +22,8 @@
 
 #include "qemu-common.h"
 #include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/bitmap.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "hw/hw.h"
@@ -36,6 +38,7 @@
 #include "qemu/event_notifier.h"
 #include "trace.h"
 #include "hw/irq.h"
+#include "sysemu/stats.h"
 
 #include "hw/boards.h"
 
@@ -58,6 +61,8 @@
 #endif
 
 #define KVM_MSI_HASHTAB_SIZE    256
+/* Most MSI routes cached, so that some GSIs are left for device routes */
+#define KVM_MSI_CACHE_SIZE      256
 
 struct KVMState
 {
@@ -67,6 +72,7 @@ struct KVMState
     int fd;
     int vmfd;
     int coalesced_mmio;
+    bool coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -92,8 +98,25 @@ struct KVMState
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    QTAILQ_HEAD(msi_lru, KVMMSIRoute) msi_lru; /* least recently used first */
+    unsigned int nr_msi_routes;
+    /*
+     * Protects the route cache against kvm_irqchip_send_msi_irqfd() callers
+     * without the BQL.  Changing the cache also needs the BQL.
+     */
+    QemuMutex msi_lock;
     bool direct_msi;
+    int route_change_depth; /* see kvm_irqchip_begin_route_changes() */
+    bool routes_dirty;
 #endif
+    /* KVM_GET_DIRTY_LOG leaves the dirty pages writable until they are
+     * cleared by KVM_CLEAR_DIRTY_LOG.
+     */
+    bool manual_dirty_log_protect;
+    /* Protects the slots of the memory listeners and their dirty_bmap.
+     * kvm_log_clear() runs in the migration thread without the BQL.
+     */
+    QemuMutex slots_lock;
     KVMMemoryListener memory_listener;
 };
 
@@ -235,6 +258,61 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+static const char *const kvm_exit_names[] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+};
+
+/* Exits the kernel handles itself never reach QEMU and are not counted */
+static void kvm_vcpu_stats_query(StatsSink *sink, void *opaque)
+{
+    CPUState *cpu = opaque;
+    int i;
+
+    stats_add_instance(sink, "cpu%d", cpu->cpu_index);
+    for (i = 0; i < ARRAY_SIZE(kvm_exit_names); i++) {
+        uint64_t count = atomic_read(&cpu->kvm_exit_count[i]);
+
+        if (count) {
+            stats_add_counter(sink, kvm_exit_names[i], count);
+        }
+    }
+
+    /* Userspace halt polling, see -machine kvm-halt-poll-ns */
+    if (atomic_read(&cpu->halt_poll_attempted)) {
+        stats_add_counter(sink, "halt-poll-attempted",
+                          atomic_read(&cpu->halt_poll_attempted));
+        stats_add_counter(sink, "halt-poll-successful",
+                          atomic_read(&cpu->halt_poll_successful));
+        stats_add_counter(sink, "halt-poll-time-ns",
+                          atomic_read(&cpu->halt_poll_time_ns));
+    }
+}
+
 int kvm_init_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -274,6 +352,10 @@ int kvm_init_vcpu(CPUState *cpu)
     }
 
     ret = kvm_arch_init_vcpu(cpu);
+    if (ret == 0) {
+        cpu->kvm_exit_count = g_new0(uint64_t, ARRAY_SIZE(kvm_exit_names));
+        stats_register_provider(STATS_PROVIDER_KVM, kvm_vcpu_stats_query, cpu);
+    }
 err:
     return ret;
 }
@@ -309,6 +391,11 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
         return 0;
     }
 
+    if (!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
+    }
+
     return kvm_set_user_memory_region(kml, mem);
 }
 
@@ -337,7 +424,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -354,7 +443,9 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -373,6 +464,28 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/*
+ * Re-arm dirty logging for @num pages of @mem starting at @first, whose
+ * dirty bits are the first @num bits of @bitmap.  @first must be a
+ * multiple of 64 and so must @num unless the range ends the slot.
+ */
+static int kvm_slot_clear_dirty_log(KVMMemoryListener *kml, KVMSlot *mem,
+                                    unsigned long *bitmap, uint64_t first,
+                                    uint32_t num)
+{
+    struct kvm_clear_dirty_log d = {};
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    d.first_page = first;
+    d.num_pages = num;
+    d.dirty_bitmap = bitmap;
+    if (kvm_vm_ioctl(kvm_state, KVM_CLEAR_DIRTY_LOG, &d) == -1) {
+        DPRINTF("ioctl failed %d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
@@ -430,6 +543,19 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+
+        /* Nobody clears what is synced here, re-arm the slot right away */
+        if (s->manual_dirty_log_protect) {
+            if (kvm_slot_clear_dirty_log(kml, mem, d.dirty_bitmap, 0,
+                                         mem->memory_size >>
+                                         TARGET_PAGE_BITS) < 0) {
+                ret = -1;
+                break;
+            }
+            if (mem->dirty_bmap) {
+                memset(mem->dirty_bmap, 0, size);
+            }
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
     g_free(d.dirty_bitmap);
@@ -437,6 +563,194 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     return ret;
 }
 
+/* Threads used to sync the dirty log of all slots at once */
+#define KVM_DIRTY_SYNC_MAX_THREADS  8
+
+/* Smaller address spaces are synced without help from other threads */
+#define KVM_DIRTY_SYNC_MIN_PAGES    (1 << 20)
+
+/* Host pages merged at once; a multiple of 64 so that every job starts at
+ * a word boundary of the bitmap and of ram_list.dirty_memory.
+ */
+#define KVM_DIRTY_SYNC_CHUNK_PAGES  (1 << 18)
+
+typedef struct KVMDirtySyncSlot {
+    uint32_t slot;
+    ram_addr_t ram_addr;
+    ram_addr_t pages;
+    unsigned long *bitmap;
+    int ret;
+} KVMDirtySyncSlot;
+
+typedef struct KVMDirtySyncJob {
+    KVMDirtySyncSlot *slot;
+    ram_addr_t first;
+    ram_addr_t pages;
+} KVMDirtySyncJob;
+
+typedef struct KVMDirtySync {
+    KVMDirtySyncSlot *slots;
+    KVMDirtySyncJob *jobs;
+    int nr_slots;
+    int nr_jobs;
+
+    /* the work of the current phase, handed out to the threads */
+    void (*fn)(struct KVMDirtySync *sync, int i);
+    int count;
+    int next;
+} KVMDirtySync;
+
+static void kvm_dirty_sync_fetch(KVMDirtySync *sync, int i)
+{
+    KVMDirtySyncSlot *ds = &sync->slots[i];
+    struct kvm_dirty_log d = {};
+
+    d.slot = ds->slot;
+    d.dirty_bitmap = ds->bitmap;
+    if (kvm_vm_ioctl(kvm_state, KVM_GET_DIRTY_LOG, &d) == -1) {
+        DPRINTF("ioctl failed %d\n", errno);
+        ds->ret = -1;
+    }
+}
+
+static void kvm_dirty_sync_merge(KVMDirtySync *sync, int i)
+{
+    KVMDirtySyncJob *job = &sync->jobs[i];
+    KVMDirtySyncSlot *ds = job->slot;
+
+    if (ds->ret < 0) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_lebitmap(ds->bitmap +
+                                           job->first / BITS_PER_LONG,
+                                           ds->ram_addr +
+                                           job->first * getpagesize(),
+                                           job->pages);
+}
+
+static void *kvm_dirty_sync_thread(void *opaque)
+{
+    KVMDirtySync *sync = opaque;
+    int i;
+
+    while ((i = atomic_fetch_inc(&sync->next)) < sync->count) {
+        sync->fn(sync, i);
+    }
+    return NULL;
+}
+
+static void kvm_dirty_sync_run(KVMDirtySync *sync, int nr_threads,
+                               void (*fn)(KVMDirtySync *sync, int i),
+                               int count)
+{
+    QemuThread threads[KVM_DIRTY_SYNC_MAX_THREADS];
+    int i;
+
+    sync->fn = fn;
+    sync->count = count;
+    sync->next = 0;
+    nr_threads = MIN(nr_threads, count);
+
+    /* The calling thread does its share of the work too */
+    for (i = 1; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i], "kvm/dirty-sync",
+                           kvm_dirty_sync_thread, sync, QEMU_THREAD_JOINABLE);
+    }
+    kvm_dirty_sync_thread(sync);
+    for (i = 1; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+/**
+ * kvm_physical_sync_all_dirty_bitmaps - Grab all dirty bitmaps from the kernel
+ *
+ * The KVM_GET_DIRTY_LOG calls and the merges into ram_list.dirty_memory
+ * are spread over several threads for large guests.  They do not take the
+ * BQL, the merges are done with atomic operations; the BQL and slots_lock
+ * held by the caller keep the slots and RAM blocks from changing under
+ * them.
+ *
+ * With KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 the dirty pages are left
+ * writable, and kept in the slot's dirty_bmap until kvm_log_clear()
+ * re-arms them.
+ */
+static int kvm_physical_sync_all_dirty_bitmaps(KVMMemoryListener *kml)
+{
+    KVMState *s = kvm_state;
+    KVMDirtySync sync = {};
+    ram_addr_t total = 0, first;
+    long nr_threads;
+    int i, j, ret = 0;
+
+    sync.slots = g_new0(KVMDirtySyncSlot, s->nr_slots);
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *mem = &kml->slots[i];
+        KVMDirtySyncSlot *ds = &sync.slots[sync.nr_slots];
+
+        if (!mem->memory_size || !(mem->flags & KVM_MEM_LOG_DIRTY_PAGES) ||
+            !qemu_ram_addr_from_host(mem->ram, &ds->ram_addr)) {
+            continue;
+        }
+
+        /* See kvm_physical_sync_dirty_bitmap about the alignment */
+        if (!s->manual_dirty_log_protect) {
+            ds->bitmap = g_malloc0(ALIGN(mem->memory_size >> TARGET_PAGE_BITS,
+                                         64) / 8);
+        } else {
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap =
+                    g_malloc0(ALIGN(mem->memory_size >> TARGET_PAGE_BITS,
+                                    64) / 8);
+            }
+            ds->bitmap = mem->dirty_bmap;
+        }
+        ds->slot = mem->slot | (kml->as_id << 16);
+        ds->pages = mem->memory_size / getpagesize();
+        sync.nr_jobs += DIV_ROUND_UP(ds->pages, KVM_DIRTY_SYNC_CHUNK_PAGES);
+        total += ds->pages;
+        sync.nr_slots++;
+    }
+
+    sync.jobs = g_new(KVMDirtySyncJob, sync.nr_jobs);
+    for (i = 0, j = 0; i < sync.nr_slots; i++) {
+        KVMDirtySyncSlot *ds = &sync.slots[i];
+
+        for (first = 0; first < ds->pages;
+             first += KVM_DIRTY_SYNC_CHUNK_PAGES) {
+            sync.jobs[j].slot = ds;
+            sync.jobs[j].first = first;
+            sync.jobs[j].pages = MIN(ds->pages - first,
+                                     KVM_DIRTY_SYNC_CHUNK_PAGES);
+            j++;
+        }
+    }
+
+    nr_threads = 1;
+    if (total >= KVM_DIRTY_SYNC_MIN_PAGES) {
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_threads = MAX(MIN(nr_threads, KVM_DIRTY_SYNC_MAX_THREADS), 1);
+    }
+
+    kvm_dirty_sync_run(&sync, nr_threads, kvm_dirty_sync_fetch,
+                       sync.nr_slots);
+    kvm_dirty_sync_run(&sync, nr_threads, kvm_dirty_sync_merge,
+                       sync.nr_jobs);
+
+    for (i = 0; i < sync.nr_slots; i++) {
+        if (sync.slots[i].ret < 0) {
+            ret = -1;
+        }
+        if (!s->manual_dirty_log_protect) {
+            g_free(sync.slots[i].bitmap);
+        }
+    }
+    g_free(sync.jobs);
+    g_free(sync.slots);
+
+    return ret;
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -471,6 +785,40 @@ static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+static void kvm_coalesce_pio_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_coalesce_pio_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -688,6 +1036,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -792,7 +1142,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -800,7 +1152,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -810,12 +1164,77 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener,
+                                          listener);
+    int r;
+
+    qemu_mutex_lock(&kvm_state->slots_lock);
+    r = kvm_physical_sync_all_dirty_bitmaps(kml);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
+    if (r < 0) {
+        abort();
+    }
+}
+
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener,
+                                          listener);
+    KVMState *s = kvm_state;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    uint64_t first, last, pages;
+    int i;
+
+    if (!s->manual_dirty_log_protect) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->slots_lock);
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *mem = &kml->slots[i];
+        hwaddr sec_start, sec_end;
+
+        if (!mem->memory_size || !mem->dirty_bmap) {
+            continue;
+        }
+        sec_start = MAX(start, mem->start_addr);
+        sec_end = MIN(end, mem->start_addr + mem->memory_size);
+        if (sec_start >= sec_end) {
+            continue;
+        }
+
+        /* Re-arming more than asked for is fine, the pages were synced */
+        pages = mem->memory_size >> TARGET_PAGE_BITS;
+        first = ((sec_start - mem->start_addr) >> TARGET_PAGE_BITS) &
+                ~(uint64_t)63;
+        last = MIN(ALIGN((sec_end - mem->start_addr + TARGET_PAGE_SIZE - 1) >>
+                         TARGET_PAGE_BITS, 64), pages);
+        if (find_next_bit(mem->dirty_bmap, last, first) >= last) {
+            continue;
+        }
+
+        if (kvm_slot_clear_dirty_log(kml, mem,
+                                     mem->dirty_bmap + first / BITS_PER_LONG,
+                                     first, last - first) < 0) {
+            abort();
+        }
+        bitmap_clear(mem->dirty_bmap, first, last - first);
+    }
+    qemu_mutex_unlock(&s->slots_lock);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -902,6 +1321,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_sync_global = kvm_log_sync_global;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -910,6 +1331,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_mmio_add = kvm_coalesce_pio_add,
+    .coalesced_mmio_del = kvm_coalesce_pio_del,
     .priority = 10,
 };
 
@@ -943,7 +1366,11 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 #ifdef KVM_CAP_IRQ_ROUTING
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
+    MSIMessage msg; /* the cache key */
+    EventNotifier notifier; /* bound to the route when has_irqfd */
+    bool has_irqfd;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -978,22 +1405,57 @@ void kvm_init_irq_routing(KVMState *s)
     s->irq_routes = g_malloc0(sizeof(*s->irq_routes));
     s->nr_allocated_irq_routes = 0;
 
-    if (!s->direct_msi) {
-        for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
-            QTAILQ_INIT(&s->msi_hashtab[i]);
-        }
+    for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
+        QTAILQ_INIT(&s->msi_hashtab[i]);
     }
+    QTAILQ_INIT(&s->msi_lru);
+    qemu_mutex_init(&s->msi_lock);
 
     kvm_arch_init_irq_routing(s);
 }
 
-void kvm_irqchip_commit_routes(KVMState *s)
+static void kvm_irqchip_set_gsi_routing(KVMState *s)
 {
     int ret;
 
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->routes_dirty = false;
+}
+
+void kvm_irqchip_commit_routes(KVMState *s)
+{
+    if (s->route_change_depth) {
+        s->routes_dirty = true;
+        return;
+    }
+    kvm_irqchip_set_gsi_routing(s);
+}
+
+/*
+ * KVM_SET_GSI_ROUTING passes the whole table, so changing many routes one
+ * commit at a time is quadratic.  Between these two calls, which nest, the
+ * routes changed are committed once, at the end.  irqfds bound to a new
+ * route only take it from then on.
+ */
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+    if (!kvm_gsi_routing_enabled()) {
+        return;
+    }
+    s->route_change_depth++;
+}
+
+void kvm_irqchip_commit_route_changes(KVMState *s)
+{
+    if (!kvm_gsi_routing_enabled()) {
+        return;
+    }
+    assert(s->route_change_depth > 0);
+    if (--s->route_change_depth == 0 && s->routes_dirty) {
+        kvm_irqchip_set_gsi_routing(s);
+    }
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -1086,18 +1548,35 @@ static unsigned int kvm_hash_msi(uint32_t data)
     return data & 0xff;
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/*
+ * The MSI route cache keeps a route for each message sent recently with
+ * kvm_irqchip_send_msi(), when KVM can't inject MSIs directly, or with
+ * kvm_irqchip_send_msi_irqfd().  Routes stay until the GSIs or the cache
+ * run out, and then the least recently used one goes.
+ */
+static bool kvm_evict_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route;
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
+    qemu_mutex_lock(&s->msi_lock);
+    route = QTAILQ_FIRST(&s->msi_lru);
+    if (route) {
+        if (route->has_irqfd) {
+            kvm_irqchip_remove_irqfd_notifier_gsi(s, &route->notifier,
+                                                  route->kroute.gsi);
+            event_notifier_cleanup(&route->notifier);
         }
+        kvm_irqchip_release_virq(s, route->kroute.gsi);
+        QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(route->msg.data)],
+                      route, entry);
+        QTAILQ_REMOVE(&s->msi_lru, route, lru);
+        s->nr_msi_routes--;
+        trace_kvm_evict_msi_route(route->kroute.gsi);
+        g_free(route);
     }
+    qemu_mutex_unlock(&s->msi_lock);
+
+    return route != NULL;
 }
 
 static int kvm_irqchip_get_virq(KVMState *s)
@@ -1110,40 +1589,118 @@ static int kvm_irqchip_get_virq(KVMState *s)
      * PIC and IOAPIC share the first 16 GSI numbers, thus the available
      * GSI numbers are more than the number of IRQ route. Allocating a GSI
      * number can succeed even though a new route entry cannot be added.
-     * When this happens, flush dynamic MSI entries to free IRQ route entries.
+     * When this happens, evict a cached MSI route to free an IRQ route entry.
      */
-    if (!s->direct_msi && s->irq_routes->nr == s->gsi_count) {
-        kvm_flush_dynamic_msi_routes(s);
+    if (s->irq_routes->nr == s->gsi_count) {
+        kvm_evict_msi_route(s);
     }
 
-    /* Return the lowest unused GSI in the bitmap */
-    for (i = 0; i < max_words; i++) {
-        zeroes = ctz32(~word[i]);
-        if (zeroes == 32) {
-            continue;
+    do {
+        /* Return the lowest unused GSI in the bitmap */
+        for (i = 0; i < max_words; i++) {
+            zeroes = ctz32(~word[i]);
+            if (zeroes == 32) {
+                continue;
+            }
+
+            return zeroes + i * 32;
         }
+    } while (kvm_evict_msi_route(s));
 
-        return zeroes + i * 32;
-    }
     return -ENOSPC;
-
 }
 
+/* Called with msi_lock held; a hit becomes the most recently used route */
 static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
 {
     unsigned int hash = kvm_hash_msi(msg.data);
     KVMMSIRoute *route;
 
     QTAILQ_FOREACH(route, &s->msi_hashtab[hash], entry) {
-        if (route->kroute.u.msi.address_lo == (uint32_t)msg.address &&
-            route->kroute.u.msi.address_hi == (msg.address >> 32) &&
-            route->kroute.u.msi.data == le32_to_cpu(msg.data)) {
+        if (route->msg.address == msg.address &&
+            route->msg.data == msg.data) {
+            QTAILQ_REMOVE(&s->msi_lru, route, lru);
+            QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
             return route;
         }
     }
     return NULL;
 }
 
+/* Bind an irqfd to a cached route, called with msi_lock held */
+static void kvm_msi_route_add_irqfd(KVMState *s, KVMMSIRoute *route)
+{
+    if (event_notifier_init(&route->notifier, 0) < 0) {
+        return;
+    }
+    if (kvm_irqchip_add_irqfd_notifier_gsi(s, &route->notifier, NULL,
+                                           route->kroute.gsi) < 0) {
+        event_notifier_cleanup(&route->notifier);
+        return;
+    }
+    route->has_irqfd = true;
+}
+
+/*
+ * Look up the cached route for @msg, add it if there is none.  With
+ * @irqfd, make sure it has an irqfd.  Called with the BQL held.
+ */
+static KVMMSIRoute *kvm_get_msi_route(KVMState *s, MSIMessage msg,
+                                      bool irqfd)
+{
+    KVMMSIRoute *route;
+    int virq;
+
+    qemu_mutex_lock(&s->msi_lock);
+    route = kvm_lookup_msi_route(s, msg);
+    if (route && irqfd && !route->has_irqfd) {
+        kvm_msi_route_add_irqfd(s, route);
+    }
+    qemu_mutex_unlock(&s->msi_lock);
+    if (route) {
+        return route;
+    }
+
+    if (s->nr_msi_routes >= KVM_MSI_CACHE_SIZE) {
+        kvm_evict_msi_route(s);
+    }
+    virq = kvm_irqchip_get_virq(s);
+    if (virq < 0) {
+        return NULL;
+    }
+
+    route = g_malloc0(sizeof(KVMMSIRoute));
+    route->msg = msg;
+    route->kroute.gsi = virq;
+    route->kroute.type = KVM_IRQ_ROUTING_MSI;
+    route->kroute.flags = 0;
+    route->kroute.u.msi.address_lo = (uint32_t)msg.address;
+    route->kroute.u.msi.address_hi = msg.address >> 32;
+    route->kroute.u.msi.data = le32_to_cpu(msg.data);
+    if (kvm_arch_fixup_msi_route(&route->kroute, msg.address, msg.data)) {
+        clear_gsi(s, virq);
+        g_free(route);
+        return NULL;
+    }
+
+    /* The route is used right away, even in the middle of route changes */
+    kvm_add_routing_entry(s, &route->kroute);
+    kvm_irqchip_set_gsi_routing(s);
+    trace_kvm_add_msi_route(virq, msg.address, msg.data);
+
+    qemu_mutex_lock(&s->msi_lock);
+    if (irqfd) {
+        kvm_msi_route_add_irqfd(s, route);
+    }
+    QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
+                       entry);
+    QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
+    s->nr_msi_routes++;
+    qemu_mutex_unlock(&s->msi_lock);
+
+    return route;
+}
+
 int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
 {
     struct kvm_msi msi;
@@ -1159,33 +1716,54 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         return kvm_vm_ioctl(s, KVM_SIGNAL_MSI, &msi);
     }
 
-    route = kvm_lookup_msi_route(s, msg);
+    route = kvm_get_msi_route(s, msg, false);
     if (!route) {
-        int virq;
+        return -ENOSPC;
+    }
 
-        virq = kvm_irqchip_get_virq(s);
-        if (virq < 0) {
-            return virq;
-        }
+    assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
 
-        route = g_malloc0(sizeof(KVMMSIRoute));
-        route->kroute.gsi = virq;
-        route->kroute.type = KVM_IRQ_ROUTING_MSI;
-        route->kroute.flags = 0;
-        route->kroute.u.msi.address_lo = (uint32_t)msg.address;
-        route->kroute.u.msi.address_hi = msg.address >> 32;
-        route->kroute.u.msi.data = le32_to_cpu(msg.data);
+    return kvm_set_irq(s, route->kroute.gsi, 1);
+}
 
-        kvm_add_routing_entry(s, &route->kroute);
-        kvm_irqchip_commit_routes(s);
+/*
+ * Inject @msg through the irqfd of its cached route.  This can be done
+ * without the BQL, e.g. from an IOThread, as long as the route exists:
+ * without the BQL a miss returns -EAGAIN and the caller must send the
+ * message once more with the BQL held, which adds the route.
+ */
+int kvm_irqchip_send_msi_irqfd(KVMState *s, MSIMessage msg)
+{
+    KVMMSIRoute *route;
 
-        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
-                           entry);
+    if (!kvm_irqfds_enabled() || !kvm_gsi_routing_enabled() ||
+        kvm_gsi_direct_mapping()) {
+        return -ENOSYS;
     }
 
-    assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
+    qemu_mutex_lock(&s->msi_lock);
+    route = kvm_lookup_msi_route(s, msg);
+    if (route && route->has_irqfd) {
+        event_notifier_set(&route->notifier);
+        qemu_mutex_unlock(&s->msi_lock);
+        return 0;
+    }
+    qemu_mutex_unlock(&s->msi_lock);
 
-    return kvm_set_irq(s, route->kroute.gsi, 1);
+    if (!qemu_mutex_iothread_locked()) {
+        return -EAGAIN;
+    }
+
+    /* With the BQL held, the route can't be evicted under our feet */
+    route = kvm_get_msi_route(s, msg, true);
+    if (!route) {
+        return -ENOSPC;
+    }
+    if (!route->has_irqfd) {
+        return -ENOSYS;
+    }
+    event_notifier_set(&route->notifier);
+    return 0;
 }
 
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
@@ -1313,6 +1891,19 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     abort();
 }
 
+int kvm_irqchip_send_msi_irqfd(KVMState *s, MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_commit_route_changes(KVMState *s)
+{
+}
+
 int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
 {
     return -ENOSYS;
@@ -1454,6 +2045,7 @@ static int kvm_init(MachineState *ms)
     const char *kvm_type;
 
     s = KVM_STATE(ms->accelerator);
+    qemu_mutex_init(&s->slots_lock);
 
     /*
      * On systems where the kernel can support different base page
@@ -1567,6 +2159,11 @@ static int kvm_init(MachineState *ms)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
+    if (s->coalesced_mmio) {
+        memory_region_register_stats();
+    }
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1581,6 +2178,13 @@ static int kvm_init(MachineState *ms)
     s->robust_singlestep =
         kvm_check_extension(s, KVM_CAP_X86_ROBUST_SINGLESTEP);
 
+    ret = kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+    if (ret & KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+        s->manual_dirty_log_protect = (ret == 0);
+    }
+
 #ifdef KVM_CAP_DEBUGREGS
     s->debugregs = kvm_check_extension(s, KVM_CAP_DEBUGREGS);
 #endif
@@ -1722,15 +2326,26 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
     if (s->coalesced_mmio_ring) {
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+        /*
+         * Each entry is translated again: a replayed write, e.g. to a VGA
+         * register, may remap the regions the next entries go to.
+         */
+        rcu_read_lock();
         while (ring->first != ring->last) {
             struct kvm_coalesced_mmio *ent;
+            AddressSpace *as;
 
             ent = &ring->coalesced_mmio[ring->first];
+            as = ent->pio == 1 ? &address_space_io : &address_space_memory;
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            address_space_write(as, ent->phys_addr,
+                                (MemTxAttrs) { .coalesced = 1 },
+                                ent->data, ent->len);
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+        rcu_read_unlock();
     }
 
     s->coalesced_flush_in_progress = false;
@@ -1842,6 +2457,10 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        if (run->exit_reason < ARRAY_SIZE(kvm_exit_names)) {
+            atomic_set(&cpu->kvm_exit_count[run->exit_reason],
+                       cpu->kvm_exit_count[run->exit_reason] + 1);
+        }
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
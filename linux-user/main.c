@@ -42,6 +42,9 @@ const char *argv0;
 int gdbstub_port;
 envlist_t *envlist;
 static const char *cpu_model;
+static const char *tb_cache_dir;
+static int tb_profile_count;
+static bool jit_stats_enabled;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -107,7 +110,7 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
-    pthread_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    tb_lock();
     pthread_mutex_lock(&exclusive_lock);
     mmap_fork_start();
 }
@@ -129,11 +132,11 @@ void fork_end(int child)
         pthread_mutex_init(&cpu_list_mutex, NULL);
         pthread_cond_init(&exclusive_cond, NULL);
         pthread_cond_init(&exclusive_resume, NULL);
-        pthread_mutex_init(&tcg_ctx.tb_ctx.tb_lock, NULL);
+        tb_lock_reset();
         gdbserver_fork(thread_cpu);
     } else {
         pthread_mutex_unlock(&exclusive_lock);
-        pthread_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+        tb_unlock();
     }
 }
 
@@ -580,90 +583,6 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
-/* Store exclusive handling for AArch32 */
-static int do_strex(CPUARMState *env)
-{
-    uint64_t val;
-    int size;
-    int rc = 1;
-    int segv = 0;
-    uint32_t addr;
-    start_exclusive();
-    if (env->exclusive_addr != env->exclusive_test) {
-        goto fail;
-    }
-    /* We know we're always AArch32 so the address is in uint32_t range
-     * unless it was the -1 exclusive-monitor-lost value (which won't
-     * match exclusive_test above).
-     */
-    assert(extract64(env->exclusive_addr, 32, 32) == 0);
-    addr = env->exclusive_addr;
-    size = env->exclusive_info & 0xf;
-    switch (size) {
-    case 0:
-        segv = get_user_u8(val, addr);
-        break;
-    case 1:
-        segv = get_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = get_user_u32(val, addr);
-        break;
-    default:
-        abort();
-    }
-    if (segv) {
-        env->exception.vaddress = addr;
-        goto done;
-    }
-    if (size == 3) {
-        uint32_t valhi;
-        segv = get_user_u32(valhi, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-        val = deposit64(val, 32, 32, valhi);
-    }
-    if (val != env->exclusive_val) {
-        goto fail;
-    }
-
-    val = env->regs[(env->exclusive_info >> 8) & 0xf];
-    switch (size) {
-    case 0:
-        segv = put_user_u8(val, addr);
-        break;
-    case 1:
-        segv = put_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = put_user_u32(val, addr);
-        break;
-    }
-    if (segv) {
-        env->exception.vaddress = addr;
-        goto done;
-    }
-    if (size == 3) {
-        val = env->regs[(env->exclusive_info >> 12) & 0xf];
-        segv = put_user_u32(val, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-    }
-    rc = 0;
-fail:
-    env->regs[15] += 4;
-    env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
-done:
-    end_exclusive();
-    return segv;
-}
-
 void cpu_loop(CPUARMState *env)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -829,11 +748,6 @@ void cpu_loop(CPUARMState *env)
         case EXCP_INTERRUPT:
             /* just indicate that signals should be handled asap */
             break;
-        case EXCP_STREX:
-            if (!do_strex(env)) {
-                break;
-            }
-            /* fall through for segv */
         case EXCP_PREFETCH_ABORT:
         case EXCP_DATA_ABORT:
             addr = env->exception.vaddress;
@@ -3572,6 +3486,11 @@ static void handle_arg_uname(const char *arg)
     qemu_uname_release = strdup(arg);
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_dir = strdup(arg);
+}
+
 static void handle_arg_cpu(const char *arg)
 {
     cpu_model = strdup(arg);
@@ -3633,6 +3552,40 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tb_profile(const char *arg)
+{
+    tb_profile_count = atoi(arg);
+    tb_profile_enabled = true;
+}
+
+static void handle_arg_tb_smc_limit(const char *arg)
+{
+    tb_smc_limit = strtoul(arg, NULL, 0);
+}
+
+static void handle_arg_jit_stats(const char *arg)
+{
+    jit_stats_enabled = true;
+}
+
+static void handle_arg_perfmap(const char *arg)
+{
+    if (perfmap_init() < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Called when the guest exits */
+void tb_profile_report(void)
+{
+    if (tb_profile_enabled) {
+        dump_tb_profile(stderr, fprintf, tb_profile_count);
+    }
+    if (jit_stats_enabled) {
+        dump_exec_info(stderr, fprintf);
+    }
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3686,6 +3639,16 @@ static const struct qemu_argument arg_table[] = {
      "logfile",     "write logs to 'logfile' (default stderr)"},
     {"p",          "QEMU_PAGESIZE",    true,  handle_arg_pagesize,
      "pagesize",   "set the host page size to 'pagesize'"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "dir",        "keep translated code in 'dir' for later runs"},
+    {"tb-profile", "QEMU_TB_PROFILE",  true,  handle_arg_tb_profile,
+     "count",      "print the 'count' most executed blocks at exit"},
+    {"tb-smc-limit", "QEMU_TB_SMC_LIMIT", true, handle_arg_tb_smc_limit,
+     "count",      "stop caching code in pages rewritten 'count' times"},
+    {"jit-stats",  "QEMU_JIT_STATS",   false, handle_arg_jit_stats,
+     "",           "print translation statistics at exit"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write a perf map of the translated code"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
@@ -4079,6 +4042,10 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(&tcg_ctx);
 #endif
 
+    if (tb_cache_dir) {
+        tb_cache_init(tb_cache_dir, filename);
+    }
+
 #if defined(TARGET_I386)
     env->cr[0] = CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK;
     env->hflags |= HF_PE_MASK | HF_CPL_MASK;
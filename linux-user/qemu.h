@@ -271,6 +271,14 @@ void mmap_fork_end(int child);
 
 /* main.c */
 extern unsigned long guest_stack_size;
+void tb_profile_report(void);
+
+/* tbcache.c */
+void tb_cache_init(const char *dir, const char *exec_path);
+TranslationBlock *tb_cache_lookup(target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags, int cflags);
+void tb_cache_record(TranslationBlock *tb, int code_size);
+void tb_cache_save(void);
 
 /* user access */
 
@@ -5570,6 +5570,64 @@ static target_timer_t get_timer_id(abi_long arg)
     return timerid;
 }
 
+/* Guest struct timespec and struct timeval are the host ones when the
+   guest long has the size and byte order of the host long.  */
+#if HOST_LONG_BITS == TARGET_ABI_BITS && \
+    defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+#define FAST_SYSCALL_TIME
+#endif
+
+#define FAST_ARGS0 ()
+#define FAST_ARGS1 (arg1)
+#define FAST_ARGS3 (arg1, arg2, arg3)
+
+/* Handle the system calls that need no argument conversion, without
+   going through the big switch in do_syscall() and its large stack
+   frame.  Return false if @num is not one of them.  */
+static bool do_fast_syscall(int num, abi_long arg1, abi_long arg2,
+                            abi_long arg3, abi_long *ret)
+{
+    switch (num) {
+#define FAST_SYSCALL(name, nargs)                                       \
+    case TARGET_NR_##name:                                              \
+        *ret = get_errno(name FAST_ARGS##nargs);                        \
+        return true;
+#define FAST_SYSCALL_BUF(name, access)                                  \
+    case TARGET_NR_##name:                                              \
+        if (!access_ok(access, arg2, arg3)) {                           \
+            *ret = -TARGET_EFAULT;                                      \
+        } else {                                                        \
+            *ret = get_errno(name(arg1, g2h(arg2), arg3));              \
+        }                                                               \
+        return true;
+#include "syscall_fast.h"
+#undef FAST_SYSCALL
+#undef FAST_SYSCALL_BUF
+#ifdef FAST_SYSCALL_TIME
+    case TARGET_NR_clock_gettime:
+        QEMU_BUILD_BUG_ON(sizeof(struct target_timespec) !=
+                          sizeof(struct timespec));
+        if (!access_ok(VERIFY_WRITE, arg2, sizeof(struct timespec))) {
+            *ret = -TARGET_EFAULT;
+        } else {
+            *ret = get_errno(clock_gettime(arg1, g2h(arg2)));
+        }
+        return true;
+    case TARGET_NR_gettimeofday:
+        QEMU_BUILD_BUG_ON(sizeof(struct target_timeval) !=
+                          sizeof(struct timeval));
+        if (!access_ok(VERIFY_WRITE, arg1, sizeof(struct timeval))) {
+            *ret = -TARGET_EFAULT;
+        } else {
+            *ret = get_errno(gettimeofday(g2h(arg1), NULL));
+        }
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5590,6 +5648,10 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
 
+    if (do_fast_syscall(num, arg1, arg2, arg3, &ret)) {
+        goto fail;
+    }
+
     switch(num) {
     case TARGET_NR_exit:
         /* In old applications this may be used to implement _exit(2).
@@ -5620,6 +5682,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
+        tb_profile_report();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -7481,6 +7545,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
+        tb_profile_report();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -0,0 +1,28 @@
+     /* System calls handled by do_fast_syscall().  Their arguments are
+        passed to the host unchanged, and buffers are accessed in place.
+
+        FAST_SYSCALL(name, nargs)          integer arguments only
+        FAST_SYSCALL_BUF(name, access)     (fd, buffer, length), the buffer
+                                           is checked with access_ok()  */
+
+#ifdef TARGET_NR_getpid
+     FAST_SYSCALL(getpid, 0)
+#endif
+#ifdef TARGET_NR_getppid
+     FAST_SYSCALL(getppid, 0)
+#endif
+#ifdef TARGET_NR_getpgrp
+     FAST_SYSCALL(getpgrp, 0)
+#endif
+     FAST_SYSCALL(gettid, 0)
+     FAST_SYSCALL(sched_yield, 0)
+     FAST_SYSCALL(close, 1)
+     FAST_SYSCALL(dup, 1)
+     FAST_SYSCALL(fsync, 1)
+#ifdef TARGET_NR_fdatasync
+     FAST_SYSCALL(fdatasync, 1)
+#endif
+     FAST_SYSCALL(lseek, 3)
+
+     FAST_SYSCALL_BUF(read, VERIFY_WRITE)
+     FAST_SYSCALL_BUF(write, VERIFY_READ)
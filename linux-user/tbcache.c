@@ -0,0 +1,497 @@
+/*
+ *  Persistent translation cache for linux-user
+ *
+ *  Copyright (c) 2015 QEMU contributors
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When a cache directory is given with -tb-cache, the TBs that are still
+ * valid when the guest exits are written to a file named after the guest
+ * executable.  The next run of the same executable loads the file, and
+ * tb_gen_code() copies code from it instead of translating, provided
+ * that the guest code bytes are still identical.  That check also covers
+ * libraries that changed on disk since the cache was written.
+ *
+ * Generated code is only reused by the very same QEMU binary loaded at
+ * the same address (so in practice a non-PIE build), because helpers are
+ * called directly.  The parts of the code that depend on where the TB is
+ * placed are recorded by the TCG backend, see tcg_record_code_reloc().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "qemu.h"
+#include "tcg.h"
+#include "translate-all.h"
+#include "qemu/bswap.h"
+
+#if defined(TARGET_HAS_TB_CACHE) && defined(TCG_TARGET_HAS_CODE_RELOCS) && \
+    defined(USE_DIRECT_JUMP)
+#define TB_CACHE_SUPPORTED
+#endif
+
+#ifdef TB_CACHE_SUPPORTED
+
+#define TB_CACHE_MAGIC   0x43425451 /* "QTBC" */
+#define TB_CACHE_VERSION 1
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    /* identity of the QEMU binary and of its placement */
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t exe_ino;
+    uint64_t image_addr;
+    uint64_t guest_base;
+    uint32_t nb_entries;
+    uint32_t reserved;
+} TBCacheHeader;
+
+/* Each entry is followed by the guest code, the host code and the
+   relocations.  */
+typedef struct TBCacheEntryHeader {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cflags;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint32_t code_size;
+    uint32_t nb_relocs;
+} TBCacheEntryHeader;
+
+typedef struct TBCacheEntry {
+    const TBCacheEntryHeader *h;
+    const uint8_t *guest_code;
+    const uint8_t *host_code;
+    const TCGCodeReloc *relocs;
+} TBCacheEntry;
+
+/* host code size and relocations of the TB at the same index in
+   tcg_ctx.tb_ctx.tbs */
+typedef struct TBCacheRecord {
+    uint32_t code_size;
+    int nb_relocs;
+    TCGCodeReloc relocs[];
+} TBCacheRecord;
+
+static char *tb_cache_path;
+static TBCacheRecord **tb_cache_records;
+static TCGCodeReloc tb_cache_relocs[TCG_MAX_CODE_RELOCS];
+/* loaded entries, a GSList of TBCacheEntry for each guest pc */
+static GHashTable *tb_cache_entries;
+static gchar *tb_cache_data;
+
+static uint64_t tb_cache_hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void tb_cache_init_header(TBCacheHeader *hdr)
+{
+    struct stat st;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = TB_CACHE_MAGIC;
+    hdr->version = TB_CACHE_VERSION;
+    if (stat("/proc/self/exe", &st) == 0) {
+        hdr->exe_size = st.st_size;
+        hdr->exe_mtime = st.st_mtime;
+        hdr->exe_ino = st.st_ino;
+    }
+    hdr->image_addr = (uintptr_t)tb_cache_init;
+    hdr->guest_base = GUEST_BASE;
+}
+
+static void tb_cache_load(void)
+{
+    TBCacheHeader hdr, *file_hdr;
+    gsize len, pos;
+    uint32_t i;
+
+    if (!g_file_get_contents(tb_cache_path, &tb_cache_data, &len, NULL)) {
+        return;
+    }
+    tb_cache_init_header(&hdr);
+    file_hdr = (TBCacheHeader *)tb_cache_data;
+    if (len < sizeof(hdr) || memcmp(file_hdr, &hdr,
+                                    offsetof(TBCacheHeader, nb_entries))) {
+        /* written by another QEMU, or for another guest_base */
+        g_free(tb_cache_data);
+        tb_cache_data = NULL;
+        return;
+    }
+
+    pos = sizeof(hdr);
+    for (i = 0; i < file_hdr->nb_entries; i++) {
+        TBCacheEntry *e;
+        const TBCacheEntryHeader *h;
+        gsize entry_len;
+
+        if (len - pos < sizeof(*h)) {
+            break;
+        }
+        h = (const TBCacheEntryHeader *)(tb_cache_data + pos);
+        entry_len = sizeof(*h) + ROUND_UP(h->size + h->code_size, 8) +
+            h->nb_relocs * sizeof(TCGCodeReloc);
+        if (len - pos < entry_len) {
+            break;
+        }
+
+        e = g_new(TBCacheEntry, 1);
+        e->h = h;
+        e->guest_code = (const uint8_t *)(h + 1);
+        e->host_code = e->guest_code + h->size;
+        e->relocs = (const TCGCodeReloc *)(e->guest_code +
+                                           ROUND_UP(h->size + h->code_size, 8));
+        g_hash_table_insert(tb_cache_entries, (gpointer)&h->pc,
+                            g_slist_prepend(g_hash_table_lookup(
+                                tb_cache_entries, &h->pc), e));
+        pos += entry_len;
+    }
+}
+
+void tb_cache_init(const char *dir, const char *exec_path)
+{
+    struct stat st;
+    char *path;
+    uint64_t key = 0xcbf29ce484222325ULL;
+
+    path = realpath(exec_path, NULL);
+    if (!path || stat(path, &st) < 0) {
+        free(path);
+        return;
+    }
+    key = tb_cache_hash(key, path, strlen(path));
+    key = tb_cache_hash(key, &st.st_size, sizeof(st.st_size));
+    key = tb_cache_hash(key, &st.st_mtime, sizeof(st.st_mtime));
+    key = tb_cache_hash(key, &st.st_ino, sizeof(st.st_ino));
+    free(path);
+
+    tb_cache_path = g_strdup_printf("%s/%016" PRIx64 ".tbc", dir, key);
+    tb_cache_records = g_new0(TBCacheRecord *,
+                              tcg_ctx.code_gen_max_blocks);
+    tb_cache_entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    tcg_ctx.code_relocs = tb_cache_relocs;
+    tb_cache_load();
+}
+
+static bool tb_cache_guest_code_matches(const TBCacheEntry *e)
+{
+    target_ulong pc = e->h->pc;
+    target_ulong addr;
+
+    for (addr = pc & TARGET_PAGE_MASK; addr < pc + e->h->size;
+         addr += TARGET_PAGE_SIZE) {
+        if ((page_get_flags(addr) & (PAGE_VALID | PAGE_READ)) !=
+            (PAGE_VALID | PAGE_READ)) {
+            return false;
+        }
+    }
+    return memcmp(g2h(pc), e->guest_code, e->h->size) == 0;
+}
+
+/* Copy the host code of e to tb->tc_ptr, and fix it up for its new
+   place.  */
+static bool tb_cache_place(TranslationBlock *tb, const TBCacheEntry *e)
+{
+    uint8_t *code = tb->tc_ptr;
+    uint32_t i;
+
+    memcpy(code, e->host_code, e->h->code_size);
+    for (i = 0; i < e->h->nb_relocs; i++) {
+        const TCGCodeReloc *r = &e->relocs[i];
+        uintptr_t val;
+        intptr_t disp;
+
+        if (r->offset + (r->kind == TCG_CODE_RELOC_TB_PTR ? sizeof(val) : 4)
+            > e->h->code_size) {
+            return false;
+        }
+        switch (r->kind) {
+        case TCG_CODE_RELOC_PCREL32:
+        case TCG_CODE_RELOC_EPILOGUE:
+            val = r->value;
+            if (r->kind == TCG_CODE_RELOC_EPILOGUE) {
+                val += (uintptr_t)tcg_ctx.code_gen_prologue;
+            }
+            disp = val - (uintptr_t)(code + r->offset + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            stl_he_p(code + r->offset, disp);
+            break;
+        case TCG_CODE_RELOC_TB_PTR:
+            val = (uintptr_t)tb + r->value;
+            memcpy(code + r->offset, &val, sizeof(val));
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_record_relocs(TranslationBlock *tb, uint32_t code_size,
+                                   const TCGCodeReloc *relocs, int n)
+{
+    TBCacheRecord **rec = &tb_cache_records[tb - tcg_ctx.tb_ctx.tbs];
+
+    g_free(*rec);
+    *rec = g_malloc(sizeof(TBCacheRecord) + n * sizeof(TCGCodeReloc));
+    (*rec)->code_size = code_size;
+    (*rec)->nb_relocs = n;
+    memcpy((*rec)->relocs, relocs, n * sizeof(TCGCodeReloc));
+}
+
+/* Called with tb_lock held by tb_gen_code() before translating a block.
+   Returns a TB made from the cache, or NULL.  */
+TranslationBlock *tb_cache_lookup(target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags, int cflags)
+{
+    uint64_t key = pc;
+    GSList *list, *l;
+    TranslationBlock *tb;
+
+    if (!tb_cache_entries) {
+        return NULL;
+    }
+    list = g_hash_table_lookup(tb_cache_entries, &key);
+    for (l = list; l; l = l->next) {
+        TBCacheEntry *e = l->data;
+        target_ulong virt_page2;
+        tb_page_addr_t phys_page2;
+
+        if (e->h->cs_base != cs_base || e->h->flags != flags ||
+            e->h->cflags != cflags || !tb_cache_guest_code_matches(e)) {
+            continue;
+        }
+        tb = tb_alloc(pc);
+        if (!tb) {
+            return NULL;
+        }
+        tb->tc_ptr = tcg_ctx.code_gen_ptr;
+        if (!tb_cache_place(tb, e)) {
+            tb_free(tb);
+            continue;
+        }
+        tb->cs_base = cs_base;
+        tb->flags = flags;
+        tb->cflags = cflags;
+        tb->size = e->h->size;
+        tb->icount = e->h->icount;
+        tb->tc_size = e->h->code_size;
+        memcpy(tb->tb_next_offset, e->h->tb_next_offset,
+               sizeof(tb->tb_next_offset));
+        memcpy(tb->tb_jmp_offset, e->h->tb_jmp_offset,
+               sizeof(tb->tb_jmp_offset));
+        flush_icache_range((uintptr_t)tb->tc_ptr,
+                           (uintptr_t)tb->tc_ptr + e->h->code_size);
+        tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
+                e->h->code_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+        tb_cache_record_relocs(tb, e->h->code_size, e->relocs,
+                               e->h->nb_relocs);
+
+        virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+        phys_page2 = -1;
+        if ((pc & TARGET_PAGE_MASK) != virt_page2) {
+            phys_page2 = virt_page2;
+        }
+        tb_link_page(tb, pc, phys_page2);
+
+        /* each entry is only used once per run */
+        list = g_slist_delete_link(list, l);
+        if (list) {
+            g_hash_table_insert(tb_cache_entries, (gpointer)&e->h->pc, list);
+        } else {
+            g_hash_table_remove(tb_cache_entries, &key);
+        }
+        g_free(e);
+        return tb;
+    }
+    return NULL;
+}
+
+/* Called by tb_gen_code() once the code for tb has been generated.  */
+void tb_cache_record(TranslationBlock *tb, int code_size)
+{
+    TBCacheRecord **rec = &tb_cache_records[tb - tcg_ctx.tb_ctx.tbs];
+    int i, n = tcg_ctx.nb_code_relocs;
+
+    if (n < 0) {
+        /* too many relocations, do not keep this TB */
+        g_free(*rec);
+        *rec = NULL;
+        return;
+    }
+    /* make the values independent of this process */
+    for (i = 0; i < n; i++) {
+        TCGCodeReloc *r = &tb_cache_relocs[i];
+
+        if (r->kind == TCG_CODE_RELOC_EPILOGUE) {
+            r->value -= (uintptr_t)tcg_ctx.code_gen_prologue;
+        } else if (r->kind == TCG_CODE_RELOC_TB_PTR) {
+            r->value -= (uintptr_t)tb;
+        }
+    }
+    tb_cache_record_relocs(tb, code_size, tb_cache_relocs, n);
+}
+
+/* Whether the TB's code can be relocated into another process */
+static bool tb_cache_can_save(TBCacheRecord *rec)
+{
+    int i;
+
+    for (i = 0; i < rec->nb_relocs; i++) {
+        if (rec->relocs[i].kind == TCG_CODE_RELOC_TB_PTR &&
+            rec->relocs[i].value > TB_EXIT_MASK) {
+            /* not a pointer to this TB */
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns false on a write error */
+static bool tb_cache_write_tb(FILE *f, TranslationBlock *tb,
+                              TBCacheRecord *rec)
+{
+    TBCacheEntryHeader h;
+    static const uint8_t pad[8];
+    size_t code_size = rec->code_size;
+
+    memset(&h, 0, sizeof(h));
+    h.pc = tb->pc;
+    h.cs_base = tb->cs_base;
+    h.flags = tb->flags;
+    h.cflags = tb->cflags;
+    h.size = tb->size;
+    h.icount = tb->icount;
+    memcpy(h.tb_next_offset, tb->tb_next_offset, sizeof(h.tb_next_offset));
+    memcpy(h.tb_jmp_offset, tb->tb_jmp_offset, sizeof(h.tb_jmp_offset));
+    h.code_size = code_size;
+    h.nb_relocs = rec->nb_relocs;
+
+    return fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fwrite(g2h(tb->pc), tb->size, 1, f) == 1 &&
+        fwrite(tb->tc_ptr, code_size, 1, f) == 1 &&
+        fwrite(pad, ROUND_UP(tb->size + code_size, 8) - tb->size - code_size,
+               1, f) <= 1 &&
+        fwrite(rec->relocs, sizeof(TCGCodeReloc), rec->nb_relocs, f) ==
+            rec->nb_relocs;
+}
+
+/* Write the valid TBs to the cache; called when the guest exits.  The data
+ * goes to a temporary file that only replaces the cache once it is
+ * complete, and is removed on any write error.
+ */
+void tb_cache_save(void)
+{
+    TBCacheHeader hdr;
+    char *tmp;
+    FILE *f;
+    int i, j;
+
+    if (!tb_cache_path) {
+        return;
+    }
+
+    tmp = g_strdup_printf("%s.%d", tb_cache_path, getpid());
+    f = fopen(tmp, "wb");
+    if (!f) {
+        g_free(tmp);
+        return;
+    }
+
+    tb_lock();
+    tb_cache_init_header(&hdr);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        goto fail;
+    }
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        for (j = r->first_tb; j < r->first_tb + r->nb_tbs; j++) {
+            TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[j];
+            TBCacheRecord *rec = tb_cache_records[j];
+
+            if (!rec || tb->invalid || (tb->cflags & CF_NOCACHE) ||
+                !tb_cache_can_save(rec)) {
+                continue;
+            }
+            if (!tb_cache_write_tb(f, tb, rec)) {
+                goto fail;
+            }
+            hdr.nb_entries++;
+        }
+    }
+    if (fseek(f, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        goto fail;
+    }
+    tb_unlock();
+    if (fclose(f) == 0 && rename(tmp, tb_cache_path) == 0) {
+        g_free(tmp);
+        return;
+    }
+    unlink(tmp);
+    g_free(tmp);
+    return;
+
+fail:
+    tb_unlock();
+    fclose(f);
+    unlink(tmp);
+    g_free(tmp);
+}
+
+#else
+
+void tb_cache_init(const char *dir, const char *exec_path)
+{
+    fprintf(stderr, "qemu: warning: the translation cache is not supported "
+            "for this target or host\n");
+}
+
+TranslationBlock *tb_cache_lookup(target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags, int cflags)
+{
+    return NULL;
+}
+
+void tb_cache_record(TranslationBlock *tb, int code_size)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+#endif
@@ -18,6 +18,7 @@
 #include "exec/ioport.h"
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 #include "trace.h"
 #include <assert.h>
@@ -25,6 +26,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/stats.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -38,6 +40,17 @@ static bool global_dirty_log = false;
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
+/* Taken together with the iothread lock to add or remove listeners, so
+ * that memory_region_clear_dirty_bitmap() can walk them without the
+ * iothread lock.
+ */
+static QemuMutex memory_listeners_lock;
+
+static void __attribute__((constructor)) memory_listeners_lock_init(void)
+{
+    qemu_mutex_init(&memory_listeners_lock);
+}
+
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
@@ -292,10 +305,32 @@ static void flatview_ref(FlatView *view)
     atomic_inc(&view->ref);
 }
 
+/* Take a reference to a view read under RCU, which may already be on its
+ * way to destruction if its last reference was dropped concurrently.
+ */
+static bool flatview_tryref(FlatView *view)
+{
+    unsigned ref = atomic_read(&view->ref);
+
+    while (ref) {
+        unsigned old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
+}
+
+/* A view can be shared by several address spaces, and RCU readers may
+ * still walk it without holding a reference: free it only once a grace
+ * period has passed after the last reference is gone.
+ */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
     }
 }
 
@@ -612,6 +647,21 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Skip the aliases at the root of an address space that map all of their
+ * target at the same address, because they render exactly like it.  The
+ * bus master address spaces of PCI devices are such aliases of the same
+ * few regions, and can then share their views.
+ */
+static MemoryRegion *memory_region_unalias_entire(MemoryRegion *mr)
+{
+    while (mr && mr->enabled && mr->alias && !mr->alias_offset &&
+           !mr->readonly && mr->addr == mr->alias->addr &&
+           int128_ge(mr->size, mr->alias->size)) {
+        mr = mr->alias;
+    }
+    return mr;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -683,8 +733,9 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     FlatView *view;
 
     rcu_read_lock();
-    view = atomic_rcu_read(&as->current_map);
-    flatview_ref(view);
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_tryref(view));
     rcu_read_unlock();
     return view;
 }
@@ -791,17 +842,57 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* A view rendered during the current commit, and the first address space
+ * that uses it.
+ */
+typedef struct RenderedView {
+    FlatView *view;
+    AddressSpace *as;
+} RenderedView;
+
+static void rendered_view_free(gpointer data)
+{
+    RenderedView *rv = data;
+
+    flatview_unref(rv->view);
+    g_free(rv);
+}
+
+/* Return a new reference to the view of @as.  Within a commit, each
+ * distinct root is only rendered once and its view is shared by all the
+ * address spaces that use it; @views caches the views rendered so far.
+ * The address spaces after the first one also share its dispatch map.
+ */
+static FlatView *address_space_render(GHashTable *views, AddressSpace *as)
+{
+    MemoryRegion *root = memory_region_unalias_entire(as->root);
+    RenderedView *rv = g_hash_table_lookup(views, root);
+
+    if (rv) {
+        as->dispatch_owner = rv->as;
+    } else {
+        rv = g_new(RenderedView, 1);
+        rv->view = generate_memory_topology(root);
+        rv->as = as;
+        g_hash_table_insert(views, root, rv);
+        as->dispatch_owner = NULL;
+    }
+    flatview_ref(rv->view);
+    return rv->view;
+}
+
+static void address_space_update_topology(AddressSpace *as,
+                                          GHashTable *views)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = address_space_render(views, as);
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    flatview_unref(old_view);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -834,13 +925,21 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            GHashTable *views;
+
+            views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                          rendered_view_free);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->dispatch_owner = NULL;
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1136,6 +1235,9 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (unlikely(!QTAILQ_EMPTY(&mr->coalesced))) {
+        mr->exits++;
+    }
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
     adjust_endianness(mr, pval, size);
     return r;
@@ -1152,6 +1254,13 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (unlikely(!QTAILQ_EMPTY(&mr->coalesced))) {
+        if (attrs.coalesced) {
+            mr->coalesced_writes++;
+        } else {
+            mr->exits++;
+        }
+    }
     adjust_endianness(mr, &data, size);
 
     if (mr->ops->write) {
@@ -1235,6 +1344,22 @@ void memory_region_init_ram_from_file(MemoryRegion *mr,
     mr->ram_addr = qemu_ram_alloc_from_file(size, mr, share, path, errp);
     mr->dirty_log_mask = tcg_enabled() ? (1 << DIRTY_MEMORY_CODE) : 0;
 }
+
+void memory_region_init_ram_from_fd(MemoryRegion *mr,
+                                    struct Object *owner,
+                                    const char *name,
+                                    uint64_t size,
+                                    bool share,
+                                    int fd,
+                                    Error **errp)
+{
+    memory_region_init(mr, owner, name, size);
+    mr->ram = true;
+    mr->terminates = true;
+    mr->destructor = memory_region_destructor_ram;
+    mr->ram_addr = qemu_ram_alloc_from_fd(size, mr, share, fd, errp);
+    mr->dirty_log_mask = tcg_enabled() ? (1 << DIRTY_MEMORY_CODE) : 0;
+}
 #endif
 
 void memory_region_init_ram_ptr(MemoryRegion *mr,
@@ -1464,6 +1589,25 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                                     size, client);
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->ram_addr != RAM_ADDR_INVALID);
+    return cpu_physical_memory_snapshot_and_clear_dirty(mr->ram_addr + addr,
+                                                        size, client);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->ram_addr != RAM_ADDR_INVALID);
+    return cpu_physical_memory_snapshot_get_dirty(snap,
+                                                  mr->ram_addr + addr, size);
+}
+
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
@@ -1481,6 +1625,56 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatRange *fr;
+
+    /* The address space of a listener outlives its registration, and
+     * the flat view is taken under RCU.
+     */
+    qemu_mutex_lock(&memory_listeners_lock);
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        FlatView *view;
+
+        if (!listener->log_clear) {
+            continue;
+        }
+        as = listener->address_space_filter;
+        view = address_space_get_flatview(as);
+
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            hwaddr sec_start, sec_end;
+            MemoryRegionSection section;
+
+            if (fr->mr != mr || !fr->dirty_log_mask) {
+                continue;
+            }
+            sec_start = MAX(fr->offset_in_region, start);
+            sec_end = MIN(fr->offset_in_region + int128_get64(fr->addr.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+
+            section = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = sec_start,
+                .size = int128_make64(sec_end - sec_start),
+                .offset_within_address_space = int128_get64(fr->addr.start) +
+                    sec_start - fr->offset_in_region,
+                .readonly = fr->readonly,
+            };
+            listener->log_clear(listener, &section);
+        }
+        flatview_unref(view);
+    }
+    qemu_mutex_unlock(&memory_listeners_lock);
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1635,6 +1829,38 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+static void memory_stats_query(StatsSink *sink, void *opaque)
+{
+    GHashTable *seen = g_hash_table_new(NULL, NULL);
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegion *mr = fr->mr;
+
+            if (QTAILQ_EMPTY(&mr->coalesced) ||
+                g_hash_table_lookup(seen, mr)) {
+                continue;
+            }
+            g_hash_table_insert(seen, mr, mr);
+            stats_add_instance(sink, "%s", memory_region_name(mr));
+            stats_add_counter(sink, "coalesced-writes",
+                              atomic_read(&mr->coalesced_writes));
+            stats_add_counter(sink, "exits", atomic_read(&mr->exits));
+        }
+        flatview_unref(view);
+    }
+    g_hash_table_destroy(seen);
+}
+
+void memory_region_register_stats(void)
+{
+    stats_register_provider(STATS_PROVIDER_MMIO, memory_stats_query, NULL);
+}
+
 void memory_region_set_global_locking(MemoryRegion *mr)
 {
     mr->global_locking = true;
@@ -1964,12 +2190,35 @@ bool memory_region_present(MemoryRegion *container, hwaddr addr)
 
 void address_space_sync_dirty_bitmap(AddressSpace *as)
 {
+    MemoryListener *listener;
     FlatView *view;
     FlatRange *fr;
 
     view = address_space_get_flatview(as);
-    FOR_EACH_FLAT_RANGE(fr, view) {
-        MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->address_space_filter &&
+            listener->address_space_filter != as) {
+            continue;
+        }
+        if (listener->log_sync_global) {
+            listener->log_sync_global(listener);
+            continue;
+        }
+        if (!listener->log_sync) {
+            continue;
+        }
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection section = {
+                .mr = fr->mr,
+                .address_space = as,
+                .offset_within_region = fr->offset_in_region,
+                .size = fr->addr.size,
+                .offset_within_address_space = int128_get64(fr->addr.start),
+                .readonly = fr->readonly,
+            };
+
+            listener->log_sync(listener, &section);
+        }
     }
     flatview_unref(view);
 }
@@ -2037,6 +2286,10 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
     MemoryListener *other = NULL;
     AddressSpace *as;
 
+    /* memory_region_clear_dirty_bitmap() does not walk the address spaces */
+    assert(!listener->log_clear || filter);
+
+    qemu_mutex_lock(&memory_listeners_lock);
     listener->address_space_filter = filter;
     if (QTAILQ_EMPTY(&memory_listeners)
         || listener->priority >= QTAILQ_LAST(&memory_listeners,
@@ -2054,11 +2307,14 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         listener_add_address_space(listener, as);
     }
+    qemu_mutex_unlock(&memory_listeners_lock);
 }
 
 void memory_listener_unregister(MemoryListener *listener)
 {
+    qemu_mutex_lock(&memory_listeners_lock);
     QTAILQ_REMOVE(&memory_listeners, listener, link);
+    qemu_mutex_unlock(&memory_listeners_lock);
 }
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
@@ -2070,6 +2326,11 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
@@ -2087,6 +2348,10 @@ static void do_address_space_destroy(AddressSpace *as)
         assert(listener->address_space_filter != as);
     }
 
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->bounce_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -0,0 +1,672 @@
+/*
+ * Live migration of block dirty bitmaps
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The named dirty bitmaps of all block nodes are sent in their own live
+ * section, so that an incremental backup chain survives live migration.
+ * Bitmaps that the format driver stores in the image (persistent bitmaps)
+ * are not sent; they reach the destination through the image.
+ *
+ * Setup sends a START record for each bitmap; the destination creates the
+ * bitmap and gives it a successor, which records guest writes until the
+ * bitmap is complete.  The bits go in BITS records of up to
+ * DIRTY_BITMAP_MIG_CHUNK_SIZE bytes, and a COMPLETE record merges the
+ * successor back into the bitmap.
+ *
+ * With x-postcopy-ram, the bits are only sent once the destination runs the
+ * guest, so they do not add to the downtime.  Without it, the bitmaps are
+ * sent once while the guest is running, and only the chunks that changed
+ * since then are sent again when the guest is stopped.
+ */
+
+#include "qemu-common.h"
+#include "block/block.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "hw/hw.h"
+#include "migration/block.h"
+#include "migration/migration.h"
+#include "trace.h"
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS       0x01
+#define DIRTY_BITMAP_MIG_FLAG_START     0x02
+#define DIRTY_BITMAP_MIG_FLAG_BITS      0x04
+#define DIRTY_BITMAP_MIG_FLAG_ZEROES    0x08
+#define DIRTY_BITMAP_MIG_FLAG_COMPLETE  0x10
+#define DIRTY_BITMAP_MIG_FLAG_REMOVED   0x20
+
+#define DIRTY_BITMAP_MIG_START_ENABLED  0x01
+
+/* Bytes of bitmap data in a BITS record */
+#define DIRTY_BITMAP_MIG_CHUNK_SIZE     (64 * 1024)
+
+typedef struct DirtyBitmapMigBitmap {
+    /* Written during setup phase.  */
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    char *node_name;
+    char *name;
+    uint32_t granularity;
+    int64_t total_sectors;
+    int64_t sectors_per_chunk;
+    QSIMPLEQ_ENTRY(DirtyBitmapMigBitmap) entry;
+
+    /* Only used by migration thread.  */
+    int64_t cur_sector;
+    bool bulk_completed;
+} DirtyBitmapMigBitmap;
+
+typedef struct DirtyBitmapMigState {
+    QSIMPLEQ_HEAD(dbms_list, DirtyBitmapMigBitmap) dbms_list;
+    uint32_t nb_bitmaps;
+    bool bulk_completed;
+
+    /* The bits are only sent after the destination started running */
+    bool postcopy;
+    uint8_t *buf;
+} DirtyBitmapMigState;
+
+typedef struct DirtyBitmapLoadBitmap {
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+} DirtyBitmapLoadBitmap;
+
+typedef struct DirtyBitmapLoadState {
+    DirtyBitmapLoadBitmap *bitmaps;
+    uint32_t nb_bitmaps;
+    uint8_t *buf;
+} DirtyBitmapLoadState;
+
+static DirtyBitmapMigState dirty_bitmap_mig_state;
+static DirtyBitmapLoadState dirty_bitmap_load_state;
+
+/* Number of bytes of serialized bitmap for @nr_sectors sectors */
+static size_t dirty_bitmap_chunk_bytes(uint32_t granularity,
+                                       int64_t nr_sectors)
+{
+    int64_t granules = DIV_ROUND_UP(nr_sectors,
+                                    granularity >> BDRV_SECTOR_BITS);
+
+    return DIV_ROUND_UP(granules, 8);
+}
+
+static void put_name(QEMUFile *f, const char *name)
+{
+    int len = strlen(name);
+
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (const uint8_t *)name, len);
+}
+
+static void get_name(QEMUFile *f, char *name)
+{
+    int len = qemu_get_byte(f);
+
+    qemu_get_buffer(f, (uint8_t *)name, len);
+    name[len] = '\0';
+}
+
+/* Called with iothread lock taken.  */
+
+static void add_bitmaps(BlockDriverState *bs)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    const char *node_name = bdrv_get_device_or_node_name(bs);
+    BdrvDirtyBitmap *bitmap;
+    DirtyBitmapMigBitmap *dbms;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (!bdrv_dirty_bitmap_name(bitmap) ||
+            bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+        if (strlen(node_name) > 255 ||
+            strlen(bdrv_dirty_bitmap_name(bitmap)) > 255) {
+            error_report("Dirty bitmap '%s' of '%s' is not migrated: "
+                         "the name is too long",
+                         bdrv_dirty_bitmap_name(bitmap), node_name);
+            continue;
+        }
+
+        dbms = g_new0(DirtyBitmapMigBitmap, 1);
+        dbms->bs = bs;
+        dbms->bitmap = bitmap;
+        dbms->node_name = g_strdup(node_name);
+        dbms->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        dbms->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+        dbms->total_sectors = bdrv_dirty_bitmap_size(bitmap);
+        dbms->sectors_per_chunk = (int64_t)DIRTY_BITMAP_MIG_CHUNK_SIZE * 8 *
+                                  (dbms->granularity >> BDRV_SECTOR_BITS);
+        bdrv_ref(bs);
+
+        QSIMPLEQ_INSERT_TAIL(&s->dbms_list, dbms, entry);
+        s->nb_bitmaps++;
+    }
+}
+
+static void init_dirty_bitmap_migration(void)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    BlockDriverState *bs;
+
+    s->nb_bitmaps = 0;
+    s->bulk_completed = false;
+    s->postcopy = migrate_postcopy_ram();
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        add_bitmaps(bs);
+    }
+    /* Nodes that are not attached to a device */
+    for (bs = bdrv_next_node(NULL); bs; bs = bdrv_next_node(bs)) {
+        if (!*bdrv_get_device_name(bs)) {
+            add_bitmaps(bs);
+        }
+    }
+
+    if (s->nb_bitmaps) {
+        s->buf = g_malloc(DIRTY_BITMAP_MIG_CHUNK_SIZE);
+    }
+}
+
+/* Called with iothread lock taken.  Return the bitmap that is to be sent
+ * for @dbms, or NULL if it went away or changed in a way that does not let
+ * it be migrated anymore.
+ */
+static BdrvDirtyBitmap *find_bitmap(DirtyBitmapMigBitmap *dbms)
+{
+    BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(dbms->bs, dbms->name);
+
+    if (!bitmap || bdrv_dirty_bitmap_get_persistence(bitmap) ||
+        bdrv_dirty_bitmap_granularity(bitmap) != dbms->granularity ||
+        bdrv_dirty_bitmap_size(bitmap) != dbms->total_sectors) {
+        return NULL;
+    }
+    return bitmap;
+}
+
+/* Called with iothread lock taken.  */
+
+static void dirty_bitmap_mig_cleanup(void)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmap *dbms;
+
+    while ((dbms = QSIMPLEQ_FIRST(&s->dbms_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->dbms_list, entry);
+        if (dbms->cur_sector && find_bitmap(dbms) == dbms->bitmap) {
+            bdrv_dirty_bitmap_untrack_changes(dbms->bitmap);
+        }
+        bdrv_unref(dbms->bs);
+        g_free(dbms->node_name);
+        g_free(dbms->name);
+        g_free(dbms);
+    }
+    s->nb_bitmaps = 0;
+    g_free(s->buf);
+    s->buf = NULL;
+}
+
+static void send_start(QEMUFile *f, DirtyBitmapMigBitmap *dbms)
+{
+    DirtyBitmapStatus status = bdrv_dirty_bitmap_status(dbms->bitmap);
+    uint8_t flags = 0;
+
+    if (status != DIRTY_BITMAP_STATUS_DISABLED) {
+        flags |= DIRTY_BITMAP_MIG_START_ENABLED;
+    }
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_START);
+    put_name(f, dbms->node_name);
+    put_name(f, dbms->name);
+    qemu_put_be64(f, dbms->total_sectors);
+    qemu_put_be32(f, dbms->granularity);
+    qemu_put_byte(f, flags);
+}
+
+/* Called with iothread lock taken.  Send the chunk of @bitmap that starts
+ * at @sector.  Chunks without any bit set are only sent if @send_zeroes.
+ */
+static void send_bits(QEMUFile *f, DirtyBitmapMigBitmap *dbms, uint32_t index,
+                      BdrvDirtyBitmap *bitmap, int64_t sector,
+                      bool send_zeroes)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    int64_t nr_sectors = MIN(dbms->sectors_per_chunk,
+                             dbms->total_sectors - sector);
+    size_t size = dirty_bitmap_chunk_bytes(dbms->granularity, nr_sectors);
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
+
+    /* Writes from now on mark the chunk again */
+    if (bdrv_dirty_bitmap_tracks_changes(bitmap)) {
+        bdrv_dirty_bitmap_set_changed(bitmap, sector, nr_sectors, false);
+    }
+    bdrv_dirty_bitmap_serialize_part(bitmap, s->buf, sector, nr_sectors);
+    if (buffer_is_zero(s->buf, size)) {
+        if (!send_zeroes) {
+            return;
+        }
+        flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    }
+
+    trace_dirty_bitmap_mig_send_bits(dbms->node_name, dbms->name, sector,
+                                     nr_sectors, flags);
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, index);
+    qemu_put_be64(f, sector);
+    qemu_put_be32(f, nr_sectors);
+    if (!(flags & DIRTY_BITMAP_MIG_FLAG_ZEROES)) {
+        qemu_put_be32(f, size);
+        qemu_put_buffer(f, s->buf, size);
+    }
+}
+
+/* Called with iothread lock taken.  Send the next chunk of the bulk phase
+ * for @dbms, skipping the clean parts of the bitmap.
+ */
+static void send_bulk_chunk(QEMUFile *f, DirtyBitmapMigBitmap *dbms,
+                            uint32_t index)
+{
+    BdrvDirtyBitmap *bitmap = find_bitmap(dbms);
+    int64_t sector = dbms->cur_sector;
+    int64_t count = dbms->total_sectors - sector;
+
+    if (bitmap != dbms->bitmap) {
+        /* Will be sent completely when the guest is stopped */
+        dbms->bulk_completed = true;
+        return;
+    }
+
+    if (sector == 0) {
+        bdrv_dirty_bitmap_track_changes(bitmap, dbms->sectors_per_chunk);
+    }
+
+    /* The successor of a frozen bitmap is not searched; serialize each
+     * chunk of it instead.
+     */
+    if (!bdrv_dirty_bitmap_frozen(bitmap)) {
+        if (!bdrv_dirty_bitmap_next_dirty_area(bitmap, &sector, &count)) {
+            dbms->cur_sector = dbms->total_sectors;
+            dbms->bulk_completed = true;
+            return;
+        }
+        sector -= sector % dbms->sectors_per_chunk;
+    }
+
+    send_bits(f, dbms, index, bitmap, sector, false);
+    dbms->cur_sector = MIN(sector + dbms->sectors_per_chunk,
+                           dbms->total_sectors);
+    if (dbms->cur_sector == dbms->total_sectors) {
+        dbms->bulk_completed = true;
+    }
+}
+
+/* Called with iothread lock taken.  Send what the destination does not have
+ * of @dbms yet, then complete the bitmap.
+ */
+static void send_bitmap_complete(QEMUFile *f, DirtyBitmapMigBitmap *dbms,
+                                 uint32_t index)
+{
+    BdrvDirtyBitmap *bitmap = find_bitmap(dbms);
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_COMPLETE;
+    int64_t sector;
+
+    if (!bitmap) {
+        error_report("Dirty bitmap '%s' of '%s' changed during migration "
+                     "and is not migrated", dbms->name, dbms->node_name);
+        flags |= DIRTY_BITMAP_MIG_FLAG_REMOVED;
+    } else if (dbms->bulk_completed && bitmap == dbms->bitmap &&
+               bdrv_dirty_bitmap_tracks_changes(bitmap)) {
+        /* Only the chunks that changed after they were sent */
+        sector = bdrv_dirty_bitmap_next_change(bitmap, 0);
+        while (sector >= 0) {
+            sector -= sector % dbms->sectors_per_chunk;
+            send_bits(f, dbms, index, bitmap, sector, true);
+            sector = bdrv_dirty_bitmap_next_change(bitmap,
+                                                   sector +
+                                                   dbms->sectors_per_chunk);
+        }
+    } else {
+        /* Chunks from the bulk phase may be stale, so send zeroes too */
+        for (sector = 0; sector < dbms->total_sectors;
+             sector += dbms->sectors_per_chunk) {
+            send_bits(f, dbms, index, bitmap, sector, dbms->cur_sector > 0);
+        }
+    }
+
+    trace_dirty_bitmap_mig_send_complete(dbms->node_name, dbms->name, flags);
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, index);
+}
+
+static void dirty_bitmap_migration_cancel(void *opaque)
+{
+    dirty_bitmap_mig_cleanup();
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmap *dbms;
+
+    qemu_mutex_lock_iothread();
+    init_dirty_bitmap_migration();
+    QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
+        send_start(f, dbms);
+    }
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static int dirty_bitmap_save_iterate(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmap *dbms;
+    uint32_t index;
+
+    while (!s->postcopy && !s->bulk_completed && !qemu_file_rate_limit(f)) {
+        index = 0;
+        QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
+            if (!dbms->bulk_completed) {
+                break;
+            }
+            index++;
+        }
+        if (!dbms) {
+            s->bulk_completed = true;
+            break;
+        }
+
+        qemu_mutex_lock_iothread();
+        send_bulk_chunk(f, dbms, index);
+        qemu_mutex_unlock_iothread();
+    }
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return s->postcopy || s->bulk_completed;
+}
+
+/* Called with iothread lock taken.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmap *dbms;
+    uint32_t index = 0;
+
+    QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
+        send_bitmap_complete(f, dbms, index++);
+    }
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    dirty_bitmap_mig_cleanup();
+    return 0;
+}
+
+static uint64_t dirty_bitmap_save_pending(QEMUFile *f, void *opaque,
+                                          uint64_t max_size)
+{
+    DirtyBitmapMigState *s = &dirty_bitmap_mig_state;
+    DirtyBitmapMigBitmap *dbms;
+    uint64_t pending = 0;
+
+    if (s->postcopy || s->bulk_completed) {
+        return 0;
+    }
+    QSIMPLEQ_FOREACH(dbms, &s->dbms_list, entry) {
+        if (!dbms->bulk_completed) {
+            pending += dirty_bitmap_chunk_bytes(dbms->granularity,
+                                                dbms->total_sectors -
+                                                dbms->cur_sector);
+        }
+    }
+    return pending;
+}
+
+static int dirty_bitmap_load_start(QEMUFile *f)
+{
+    DirtyBitmapLoadState *s = &dirty_bitmap_load_state;
+    DirtyBitmapLoadBitmap *b;
+    char node_name[256], name[256];
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    int64_t total_sectors;
+    uint32_t granularity;
+    uint8_t flags;
+
+    get_name(f, node_name);
+    get_name(f, name);
+    total_sectors = qemu_get_be64(f);
+    granularity = qemu_get_be32(f);
+    flags = qemu_get_byte(f);
+    trace_dirty_bitmap_mig_load_start(node_name, name, granularity, flags);
+
+    bs = bdrv_lookup_bs(node_name, node_name, &local_err);
+    if (!bs) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EINVAL;
+    }
+    if (granularity < BDRV_SECTOR_SIZE ||
+        (granularity & (granularity - 1))) {
+        error_report("Invalid granularity %" PRIu32 " of dirty bitmap '%s'",
+                     granularity, name);
+        return -EINVAL;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, &local_err);
+    if (!bitmap) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EINVAL;
+    }
+    if (bdrv_dirty_bitmap_size(bitmap) != total_sectors) {
+        error_report("Size of dirty bitmap '%s' of '%s' does not match",
+                     name, node_name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return -EINVAL;
+    }
+
+    /* Until the bitmap is complete, guest writes go to the successor */
+    if (flags & DIRTY_BITMAP_MIG_START_ENABLED) {
+        if (bdrv_dirty_bitmap_create_successor(bs, bitmap, &local_err) < 0) {
+            error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            return -EINVAL;
+        }
+    } else {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+
+    s->bitmaps = g_renew(DirtyBitmapLoadBitmap, s->bitmaps,
+                         s->nb_bitmaps + 1);
+    b = &s->bitmaps[s->nb_bitmaps++];
+    b->bs = bs;
+    b->bitmap = bitmap;
+    return 0;
+}
+
+static DirtyBitmapLoadBitmap *get_load_bitmap(QEMUFile *f)
+{
+    DirtyBitmapLoadState *s = &dirty_bitmap_load_state;
+    uint32_t index = qemu_get_be32(f);
+
+    if (index >= s->nb_bitmaps || !s->bitmaps[index].bitmap) {
+        error_report("Invalid dirty bitmap index %" PRIu32, index);
+        return NULL;
+    }
+    return &s->bitmaps[index];
+}
+
+static int dirty_bitmap_load_bits(QEMUFile *f, uint32_t flags)
+{
+    DirtyBitmapLoadState *s = &dirty_bitmap_load_state;
+    DirtyBitmapLoadBitmap *b = get_load_bitmap(f);
+    int64_t sector, nr_sectors, total_sectors;
+    uint32_t granularity;
+    size_t size, expected;
+
+    if (!b) {
+        return -EINVAL;
+    }
+    sector = qemu_get_be64(f);
+    nr_sectors = qemu_get_be32(f);
+
+    /* Chunks start at multiples of 64 granules */
+    granularity = bdrv_dirty_bitmap_granularity(b->bitmap);
+    total_sectors = bdrv_dirty_bitmap_size(b->bitmap);
+    expected = dirty_bitmap_chunk_bytes(granularity, nr_sectors);
+    if (sector < 0 || sector % ((granularity >> BDRV_SECTOR_BITS) * 64) ||
+        nr_sectors <= 0 || nr_sectors > total_sectors - sector ||
+        expected > DIRTY_BITMAP_MIG_CHUNK_SIZE) {
+        error_report("Invalid chunk of dirty bitmap '%s'",
+                     bdrv_dirty_bitmap_name(b->bitmap));
+        return -EINVAL;
+    }
+
+    if (!s->buf) {
+        s->buf = g_malloc(DIRTY_BITMAP_MIG_CHUNK_SIZE);
+    }
+    if (flags & DIRTY_BITMAP_MIG_FLAG_ZEROES) {
+        memset(s->buf, 0, expected);
+    } else {
+        size = qemu_get_be32(f);
+        if (size != expected) {
+            error_report("Invalid chunk size of dirty bitmap '%s'",
+                         bdrv_dirty_bitmap_name(b->bitmap));
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, s->buf, size);
+    }
+
+    /* The bitmap is frozen or disabled; the guest does not write to it */
+    bdrv_dirty_bitmap_deserialize_part(b->bitmap, s->buf, sector, nr_sectors);
+    return 0;
+}
+
+typedef struct DirtyBitmapLoadComplete {
+    QEMUBH *bh;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    bool removed;
+} DirtyBitmapLoadComplete;
+
+/* Called with iothread lock taken.  */
+
+static void dirty_bitmap_load_complete_bh(void *opaque)
+{
+    DirtyBitmapLoadComplete *c = opaque;
+    BdrvDirtyBitmap *bitmap = c->bitmap;
+
+    if (c->removed) {
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            bitmap = bdrv_dirty_bitmap_abdicate(c->bs, bitmap, &error_abort);
+        }
+        bdrv_release_dirty_bitmap(c->bs, bitmap);
+    } else {
+        bdrv_dirty_bitmap_deserialize_finish(bitmap);
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            bdrv_reclaim_dirty_bitmap(c->bs, bitmap, &error_abort);
+        }
+    }
+
+    if (c->bh) {
+        qemu_bh_delete(c->bh);
+    }
+    g_free(c);
+}
+
+static int dirty_bitmap_load_complete(QEMUFile *f, uint32_t flags)
+{
+    DirtyBitmapLoadBitmap *b = get_load_bitmap(f);
+    DirtyBitmapLoadComplete *c;
+
+    if (!b) {
+        return -EINVAL;
+    }
+    trace_dirty_bitmap_mig_load_complete(bdrv_dirty_bitmap_name(b->bitmap),
+                                         flags);
+
+    c = g_new0(DirtyBitmapLoadComplete, 1);
+    c->bs = b->bs;
+    c->bitmap = b->bitmap;
+    c->removed = flags & DIRTY_BITMAP_MIG_FLAG_REMOVED;
+    b->bitmap = NULL;
+
+    /* In postcopy the postcopy listen thread reads the bits without the
+     * iothread lock; the main loop finishes the bitmap.
+     */
+    if (qemu_mutex_iothread_locked()) {
+        dirty_bitmap_load_complete_bh(c);
+    } else {
+        c->bh = qemu_bh_new(dirty_bitmap_load_complete_bh, c);
+        qemu_bh_schedule(c->bh);
+    }
+    return 0;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    uint32_t flags;
+    int ret;
+
+    do {
+        flags = qemu_get_be32(f);
+
+        if (flags & DIRTY_BITMAP_MIG_FLAG_START) {
+            ret = dirty_bitmap_load_start(f);
+        } else if (flags & DIRTY_BITMAP_MIG_FLAG_BITS) {
+            ret = dirty_bitmap_load_bits(f, flags);
+        } else if (flags & DIRTY_BITMAP_MIG_FLAG_COMPLETE) {
+            ret = dirty_bitmap_load_complete(f, flags);
+        } else if (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS)) {
+            error_report("Unknown dirty bitmap migration flags: %#x", flags);
+            ret = -EINVAL;
+        } else {
+            ret = 0;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            return ret;
+        }
+    } while (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS));
+
+    return 0;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_iterate = dirty_bitmap_save_iterate,
+    .save_live_complete = dirty_bitmap_save_complete,
+    .save_live_pending = dirty_bitmap_save_pending,
+    .load_state = dirty_bitmap_load,
+    .cancel = dirty_bitmap_migration_cancel,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    QSIMPLEQ_INIT(&dirty_bitmap_mig_state.dbms_list);
+
+    register_savevm_live(NULL, "dirty-bitmaps", 0, 1,
+                         &savevm_dirty_bitmap_handlers,
+                         &dirty_bitmap_mig_state);
+}
@@ -97,6 +97,7 @@ typedef struct BlkMigState {
     int transferred;
     int prev_progress;
     int bulk_completed;
+    uint8_t *zero_buf;
 
     /* Lock must be taken _inside_ the iothread lock.  */
     QemuMutex lock;
@@ -118,9 +119,23 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlockDriverState *bs,
+                            int64_t sector, uint64_t flags)
 {
     int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
+                     | flags);
+
+    /* device name */
+    len = strlen(bdrv_get_device_name(bs));
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(bs), len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
@@ -128,14 +143,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(bdrv_get_device_name(blk->bmds->bs));
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(blk->bmds->bs), len);
+    blk_send_header(f, blk->bmds->bs, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -148,6 +156,23 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
+/* Send a chunk that is known to read as zeroes, without reading it */
+static void blk_send_zero(QEMUFile *f, BlkMigDevState *bmds, int64_t sector)
+{
+    if (block_mig_state.zero_blocks) {
+        blk_send_header(f, bmds->bs, sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+        return;
+    }
+
+    /* The destination doesn't know zero blocks, send the data */
+    if (!block_mig_state.zero_buf) {
+        block_mig_state.zero_buf = g_malloc0(BLOCK_SIZE);
+    }
+    blk_send_header(f, bmds->bs, sector, BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_buffer(f, block_mig_state.zero_buf, BLOCK_SIZE);
+}
+
 int blk_mig_active(void)
 {
     return !QSIMPLEQ_EMPTY(&block_mig_state.bmds_list);
@@ -250,6 +275,34 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
+/* Called with iothread lock taken.
+ *
+ * Returns the number of sectors from the chunk at @sector on that read as
+ * zeroes, in whole chunks except at the end of the device.
+ */
+
+static int64_t bulk_zero_sectors(BlkMigDevState *bmds, int64_t sector)
+{
+    int64_t total_sectors = bmds->total_sectors;
+    int64_t end = MIN(sector + MAX_IS_ALLOCATED_SEARCH, total_sectors);
+    int64_t cur = sector;
+    int nr_sectors;
+
+    while (cur < end) {
+        int64_t ret = bdrv_get_block_status(bmds->bs, cur, end - cur,
+                                            &nr_sectors);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || nr_sectors == 0) {
+            break;
+        }
+        cur += nr_sectors;
+    }
+
+    if (cur < total_sectors) {
+        cur &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+    }
+    return cur - sector;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -258,6 +311,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
+    int64_t zero_sectors;
     int nr_sectors;
 
     if (bmds->shared_base) {
@@ -279,6 +333,27 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
+    /* Chunks that read as zeroes are sent without reading them, so that
+     * sparse images take time in proportion to their allocated data */
+    qemu_mutex_lock_iothread();
+    zero_sectors = bulk_zero_sectors(bmds, cur_sector);
+    if (zero_sectors) {
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, zero_sectors);
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (zero_sectors) {
+        int64_t sector;
+
+        for (sector = cur_sector; sector < cur_sector + zero_sectors;
+             sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+            blk_send_zero(f, bmds, sector);
+        }
+        bmds->cur_sector = cur_sector + zero_sectors;
+        bmds->completed_sectors = bmds->cur_sector;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
     /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
@@ -403,18 +478,17 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
     int progress;
     int ret = 0;
 
+    /* Submit a chunk of each device, so that all of them are read at the
+     * same time */
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
             ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -454,6 +528,17 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int ret = -EIO;
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+        int64_t count = total_sectors - sector;
+
+        /* Skip all clean chunks at once instead of testing each of them */
+        if (!bdrv_dirty_bitmap_next_dirty_area(bmds->dirty_bitmap,
+                                               &sector, &count)) {
+            bmds->cur_dirty = total_sectors;
+            break;
+        }
+        sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+        bmds->cur_dirty = sector;
+
         blk_mig_lock();
         if (bmds_aio_inflight(bmds, sector)) {
             blk_mig_unlock();
@@ -616,6 +701,9 @@ static void blk_mig_cleanup(void)
         g_free(blk);
     }
     blk_mig_unlock();
+
+    g_free(block_mig_state.zero_buf);
+    block_mig_state.zero_buf = NULL;
 }
 
 static void block_migration_cancel(void *opaque)
@@ -666,11 +754,12 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /* control the rate of transfer; zero chunks are sent right away and
+     * only count against the file's own limit */
     blk_mig_lock();
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           qemu_file_get_rate_limit(f) && !qemu_file_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
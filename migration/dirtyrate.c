@@ -0,0 +1,333 @@
+/*
+ * Dirty rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Sample the dirty log of the accelerator for a few seconds, without
+ * migrating, to tell how fast the guest writes to its RAM and how a
+ * precopy migration of it would behave.
+ *
+ * The dirty log is synced once per period.  The pages dirtied in each
+ * period give the dirty rate; the pages dirtied in any period give the
+ * working set.  The measurement shares DIRTY_MEMORY_MIGRATION with RAM
+ * migration, so the two exclude each other.
+ */
+
+#include <glib.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/timer.h"
+#include "qemu/rcu_queue.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+#include "migration/migration.h"
+#include "sysemu/sysemu.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+#define DIRTY_RATE_PERIOD_MS    1000
+#define DIRTY_RATE_MAX_CALC_TIME 60
+/* Give up predicting after this many RAM passes */
+#define DIRTY_RATE_MAX_ITERATIONS 30
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint64_t dirty_pages;       /* sum over all periods */
+    uint64_t working_set;       /* pages dirtied in any period */
+} DirtyRateBlock;
+
+static struct {
+    DirtyRateStatus status;
+    QEMUTimer *timer;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t periods;
+    int64_t periods_done;
+    DirtyRateBlock *blocks;
+    int nr_blocks;
+    unsigned long *period_bitmap;
+    unsigned long *working_set_bitmap;
+    unsigned long nr_pages;
+} dirty_rate;
+
+bool dirty_rate_measuring(void)
+{
+    return dirty_rate.status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+/*
+ * Move the dirty bits of every block into period_bitmap and re-arm the
+ * dirty log of the accelerator.  With @count, account the pages to the
+ * blocks; otherwise just throw them away.
+ *
+ * Called with the iothread lock held.
+ */
+static void dirty_rate_sync(bool count)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+    int i;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    bitmap_zero(dirty_rate.period_bitmap, dirty_rate.nr_pages);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateBlock *b = NULL;
+        unsigned long first, last, page;
+        uint64_t pages;
+
+        for (i = 0; i < dirty_rate.nr_blocks; i++) {
+            if (dirty_rate.blocks[i].offset == block->offset &&
+                !strcmp(dirty_rate.blocks[i].idstr, block->idstr)) {
+                b = &dirty_rate.blocks[i];
+                break;
+            }
+        }
+        /* Blocks added since the start are not measured */
+        if (!b) {
+            continue;
+        }
+
+        pages = cpu_physical_memory_sync_dirty_bitmap(
+                    dirty_rate.period_bitmap, NULL, 0, b->offset, b->length);
+        if (!pages) {
+            continue;
+        }
+        memory_region_clear_dirty_bitmap(block->mr, 0, b->length);
+        if (!count) {
+            continue;
+        }
+
+        b->dirty_pages += pages;
+        total += pages;
+        first = b->offset >> TARGET_PAGE_BITS;
+        last = first + (b->length >> TARGET_PAGE_BITS);
+        for (page = find_next_bit(dirty_rate.period_bitmap, last, first);
+             page < last;
+             page = find_next_bit(dirty_rate.period_bitmap, last, page + 1)) {
+            if (!test_and_set_bit(page, dirty_rate.working_set_bitmap)) {
+                b->working_set++;
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    if (count) {
+        trace_dirty_rate_period(dirty_rate.periods_done, total);
+    }
+}
+
+static void dirty_rate_finish(void)
+{
+    memory_global_dirty_log_stop();
+
+    timer_free(dirty_rate.timer);
+    dirty_rate.timer = NULL;
+    g_free(dirty_rate.period_bitmap);
+    dirty_rate.period_bitmap = NULL;
+    g_free(dirty_rate.working_set_bitmap);
+    dirty_rate.working_set_bitmap = NULL;
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirty_rate_finish();
+}
+
+static void dirty_rate_tick(void *opaque)
+{
+    dirty_rate.periods_done++;
+    dirty_rate_sync(true);
+
+    if (dirty_rate.periods_done == dirty_rate.periods) {
+        dirty_rate_finish();
+        return;
+    }
+    timer_mod(dirty_rate.timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + DIRTY_RATE_PERIOD_MS);
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    RAMBlock *block;
+    int i;
+
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+        s->state == MIGRATION_STATUS_SETUP ||
+        s->state == MIGRATION_STATUS_CANCELLING) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Guest is waiting for an incoming migration");
+        return;
+    }
+    if (savevm_live_active()) {
+        error_setg(errp, "A live snapshot is in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+
+    g_free(dirty_rate.blocks);
+    dirty_rate.nr_blocks = 0;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        dirty_rate.nr_blocks++;
+    }
+    dirty_rate.blocks = g_new0(DirtyRateBlock, dirty_rate.nr_blocks);
+    i = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        pstrcpy(dirty_rate.blocks[i].idstr,
+                sizeof(dirty_rate.blocks[i].idstr), block->idstr);
+        dirty_rate.blocks[i].offset = block->offset;
+        dirty_rate.blocks[i].length = block->used_length;
+        i++;
+    }
+    rcu_read_unlock();
+
+    dirty_rate.nr_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    dirty_rate.period_bitmap = bitmap_new(dirty_rate.nr_pages);
+    dirty_rate.working_set_bitmap = bitmap_new(dirty_rate.nr_pages);
+    dirty_rate.start_time = time(NULL);
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.periods = calc_time * 1000 / DIRTY_RATE_PERIOD_MS;
+    dirty_rate.periods_done = 0;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    trace_dirty_rate_start(calc_time);
+
+    memory_global_dirty_log_start();
+    /* Drop whatever was dirtied before logging started */
+    dirty_rate_sync(false);
+
+    dirty_rate.timer = timer_new_ms(QEMU_CLOCK_REALTIME, dirty_rate_tick,
+                                    NULL);
+    timer_mod(dirty_rate.timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + DIRTY_RATE_PERIOD_MS);
+}
+
+/* Bytes dirtied per second, from pages dirtied over all periods */
+static int64_t dirty_rate_bytes_per_sec(uint64_t pages)
+{
+    return pages * TARGET_PAGE_SIZE * 1000 /
+           (dirty_rate.periods * DIRTY_RATE_PERIOD_MS);
+}
+
+/*
+ * The first pass sends all of RAM; every later one sends what was
+ * dirtied while the previous one ran, which is never more than all of
+ * RAM.  The migration completes once a pass fits in the downtime limit.
+ */
+static MigrationPrediction *dirty_rate_predict(uint64_t ram, double rate,
+                                               int64_t bandwidth,
+                                               int64_t downtime_ms)
+{
+    MigrationPrediction *p = g_new0(MigrationPrediction, 1);
+    double remaining = ram;
+    double total = 0, t = 0;
+    int i;
+
+    p->bandwidth = bandwidth;
+    p->downtime_limit = downtime_ms;
+
+    for (i = 1; i <= DIRTY_RATE_MAX_ITERATIONS; i++) {
+        t = remaining / bandwidth;
+        total += t;
+        if (t * 1000 <= downtime_ms) {
+            p->converges = true;
+            break;
+        }
+        remaining = MIN(rate * t, (double)ram);
+    }
+
+    p->iterations = MIN(i, DIRTY_RATE_MAX_ITERATIONS);
+    p->total_time = total * 1000;
+    p->expected_downtime = t * 1000;
+    return p;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(bool has_bandwidth, int64_t bandwidth,
+                                    bool has_downtime_limit,
+                                    int64_t downtime_limit, Error **errp)
+{
+    DirtyRateInfo *info;
+    RamBlockDirtyRateList *head = NULL, **tail = &head;
+    uint64_t dirty_pages = 0, working_set = 0, ram = 0;
+    int i;
+
+    if (!has_bandwidth) {
+        bandwidth = migrate_get_current()->bandwidth_limit;
+    }
+    if (bandwidth <= 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "bandwidth",
+                   "a positive integer");
+        return NULL;
+    }
+    if (!has_downtime_limit) {
+        downtime_limit = migrate_max_downtime() / 1000000;
+    }
+    if (downtime_limit < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "downtime-limit",
+                   "a non-negative integer");
+        return NULL;
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->status = dirty_rate.status;
+    if (dirty_rate.status == DIRTY_RATE_STATUS_UNSTARTED) {
+        return info;
+    }
+
+    info->has_start_time = true;
+    info->start_time = dirty_rate.start_time;
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        RamBlockDirtyRateList *entry = g_new0(RamBlockDirtyRateList, 1);
+
+        entry->value = g_new0(RamBlockDirtyRate, 1);
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->length;
+        entry->value->dirty_rate = dirty_rate_bytes_per_sec(b->dirty_pages);
+        entry->value->working_set = b->working_set * TARGET_PAGE_SIZE;
+        *tail = entry;
+        tail = &entry->next;
+
+        dirty_pages += b->dirty_pages;
+        working_set += b->working_set;
+        ram += b->length;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_bytes_per_sec(dirty_pages);
+    info->has_working_set = true;
+    info->working_set = working_set * TARGET_PAGE_SIZE;
+    info->has_blocks = true;
+    info->blocks = head;
+    info->has_prediction = true;
+    info->prediction = dirty_rate_predict(ram, info->dirty_rate, bandwidth,
+                                          downtime_limit);
+    return info;
+}
@@ -24,11 +24,13 @@
 #include "qemu/sockets.h"
 #include "qemu/rcu.h"
 #include "migration/block.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qapi/util.h"
 #include "qapi-event.h"
+#include "qom/cpu.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
@@ -44,6 +46,15 @@
 #define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
 /*0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Default number of connections used by multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default number of precopy passes over RAM before switching to postcopy */
+#define DEFAULT_MIGRATE_X_POSTCOPY_ROUNDS 5
+/* Define default autoconverge cpu throttle migration parameters */
+#define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
+#define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of queue pairs used by RDMA migration */
+#define DEFAULT_MIGRATE_X_RDMA_QPS 1
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -71,6 +82,16 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
         .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                 DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS] =
+                DEFAULT_MIGRATE_X_POSTCOPY_ROUNDS,
+        .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+                DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
+        .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+                DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_RDMA_QPS] =
+                DEFAULT_MIGRATE_X_RDMA_QPS,
     };
 
     return &current_migration;
@@ -89,6 +110,10 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     mis_current = g_malloc0(sizeof(MigrationIncomingState));
     mis_current->file = f;
     QLIST_INIT(&mis_current->loadvm_handlers);
+    mis_current->userfault_fd = -1;
+    qemu_mutex_init(&mis_current->rp_mutex);
+    qemu_event_init(&mis_current->main_thread_load_event, false);
+    postcopy_state_set(POSTCOPY_INCOMING_NONE);
 
     return mis_current;
 }
@@ -96,10 +121,86 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
 void migration_incoming_state_destroy(void)
 {
     loadvm_free_handlers(mis_current);
+    qemu_event_destroy(&mis_current->main_thread_load_event);
+    qemu_mutex_destroy(&mis_current->rp_mutex);
     g_free(mis_current);
     mis_current = NULL;
 }
 
+/* Incoming postcopy state, see PostcopyState in migration.h */
+static PostcopyState incoming_postcopy_state;
+
+PostcopyState postcopy_state_get(void)
+{
+    return atomic_mb_read(&incoming_postcopy_state);
+}
+
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state)
+{
+    return atomic_xchg(&incoming_postcopy_state, new_state);
+}
+
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/* Request a range of pages from the source VM at the given
+ * start address.
+ *   rbname: Name of the RAMBlock to request the page in, if NULL it's the same
+ *           as the last request (a name must have been given previously)
+ *   Start: Address offset within the RB
+ *   Len: Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname upto 256 */
+    size_t msglen = 12; /* start + len */
+    enum mig_rp_message_type msg_type = MIG_RP_MSG_REQ_PAGES;
+
+    stq_be_p(bufc, (uint64_t)start);
+    stl_be_p(bufc + 8, (uint32_t)len);
+
+    if (rbname) {
+        int rbname_len = strlen(rbname);
+        assert(rbname_len < 256);
+
+        bufc[msglen++] = rbname_len;
+        memcpy(bufc + msglen, rbname, rbname_len);
+        msglen += rbname_len;
+        msg_type = MIG_RP_MSG_REQ_PAGES_ID;
+    }
+    migrate_send_rp_message(mis, msg_type, msglen, bufc);
+}
+
 
 typedef struct {
     bool optional;
@@ -266,17 +367,18 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     }
 }
 
-static void process_incoming_migration_co(void *opaque)
+/*
+ * Close the incoming stream and free the incoming state; exits if the
+ * load failed.  Called with the BQL held, from the incoming coroutine or
+ * at the end of the postcopy listen thread.
+ */
+void migration_incoming_finish(MigrationIncomingState *mis, int ret)
 {
-    QEMUFile *f = opaque;
-    Error *local_err = NULL;
-    int ret;
-
-    migration_incoming_state_new(f);
-    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
-    ret = qemu_loadvm_state(f);
-
-    qemu_fclose(f);
+    qemu_fclose(mis->file);
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+    }
+    multifd_recv_threads_join();
     free_xbzrle_decoded_buf();
     migration_incoming_state_destroy();
 
@@ -287,6 +389,35 @@ static void process_incoming_migration_co(void *opaque)
         exit(EXIT_FAILURE);
     }
     migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+}
+
+static void process_incoming_migration_co(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis;
+    PostcopyState ps;
+    Error *local_err = NULL;
+    int ret;
+
+    mis = migration_incoming_state_new(f);
+    migrate_generate_event(MIGRATION_STATUS_ACTIVE);
+    ret = qemu_loadvm_state(f);
+
+    ps = postcopy_state_get();
+    if (ps >= POSTCOPY_INCOMING_LISTENING && ret >= 0) {
+        /*
+         * Postcopy was started; the listen thread owns the stream now and
+         * finishes the incoming migration once all of RAM has arrived.
+         */
+        qemu_event_set(&mis->main_thread_load_event);
+        return;
+    }
+    if (ps == POSTCOPY_INCOMING_ADVISE || ps == POSTCOPY_INCOMING_DISCARD) {
+        /* The source advised postcopy but completed in precopy */
+        postcopy_ram_incoming_cleanup(mis);
+    }
+
+    migration_incoming_finish(mis, ret);
     qemu_announce_self();
 
     /* Make sure all file formats flush their mutable metadata */
@@ -372,6 +503,15 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     params->decompress_threads =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    params->x_postcopy_rounds =
+            s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS];
+    params->x_cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    params->x_cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_rdma_qps = s->parameters[MIGRATION_PARAMETER_X_RDMA_QPS];
 
     return params;
 }
@@ -386,6 +526,8 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_eviction = xbzrle_mig_cache_evictions();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
@@ -404,6 +546,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_CANCELLING:
         info->has_status = true;
         info->has_total_time = true;
@@ -427,6 +570,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
 
+        if (cpu_throttle_active()) {
+            info->has_x_cpu_throttle_percentage = true;
+            info->x_cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
+
         if (blk_mig_active()) {
             info->has_disk = true;
             info->disk = g_malloc0(sizeof(*info->disk));
@@ -494,7 +642,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_compress_threads,
                                 int64_t compress_threads,
                                 bool has_decompress_threads,
-                                int64_t decompress_threads, Error **errp)
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels,
+                                bool has_x_postcopy_rounds,
+                                int64_t x_postcopy_rounds,
+                                bool has_x_cpu_throttle_initial,
+                                int64_t x_cpu_throttle_initial,
+                                bool has_x_cpu_throttle_increment,
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_rdma_qps,
+                                int64_t x_rdma_qps,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -517,6 +676,40 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "is invalid, it should be in the range of 1 to 255");
         return;
     }
+    if (has_multifd_channels &&
+            (multifd_channels < 1 || multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_postcopy_rounds &&
+            (x_postcopy_rounds < 1 || x_postcopy_rounds > 1000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_rounds",
+                   "is invalid, it should be in the range of 1 to 1000");
+        return;
+    }
+    if (has_x_cpu_throttle_initial &&
+            (x_cpu_throttle_initial < 1 || x_cpu_throttle_initial > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_cpu_throttle_initial",
+                   "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+    if (has_x_cpu_throttle_increment &&
+            (x_cpu_throttle_increment < 1 || x_cpu_throttle_increment > 99)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_cpu_throttle_increment",
+                   "is invalid, it should be in the range of 1 to 99");
+        return;
+    }
+    if (has_x_rdma_qps && (x_rdma_qps < 1 || x_rdma_qps > 16)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_rdma_qps",
+                   "is invalid, it should be in the range of 1 to 16");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -528,6 +721,25 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                                                     decompress_threads;
     }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                                                    multifd_channels;
+    }
+    if (has_x_postcopy_rounds) {
+        s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS] =
+                                                    x_postcopy_rounds;
+    }
+    if (has_x_cpu_throttle_initial) {
+        s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+                                                    x_cpu_throttle_initial;
+    }
+    if (has_x_cpu_throttle_increment) {
+        s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+                                                    x_cpu_throttle_increment;
+    }
+    if (has_x_rdma_qps) {
+        s->parameters[MIGRATION_PARAMETER_X_RDMA_QPS] = x_rdma_qps;
+    }
 }
 
 /* shared migration helpers */
@@ -554,11 +766,15 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_send_threads_join();
         qemu_fclose(s->file);
         s->file = NULL;
     }
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = NULL;
 
-    assert(s->state != MIGRATION_STATUS_ACTIVE);
+    assert(s->state != MIGRATION_STATUS_ACTIVE &&
+           s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -575,6 +791,8 @@ void migrate_fd_error(MigrationState *s)
 {
     trace_migrate_fd_error();
     assert(s->file == NULL);
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = NULL;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_FAILED);
     notifier_list_notify(&migration_state_notifiers, s);
 }
@@ -603,6 +821,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_send_shutdown();
     }
 }
 
@@ -632,6 +851,11 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIGRATION_STATUS_FAILED);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
@@ -643,6 +867,14 @@ static MigrationState *migrate_init(const MigrationParams *params)
             s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
     int decompress_thread_count =
             s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    int multifd_channels = s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    int x_postcopy_rounds =
+            s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS];
+    int x_cpu_throttle_initial =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    int x_cpu_throttle_increment =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int x_rdma_qps = s->parameters[MIGRATION_PARAMETER_X_RDMA_QPS];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -658,6 +890,13 @@ static MigrationState *migrate_init(const MigrationParams *params)
                compress_thread_count;
     s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
                decompress_thread_count;
+    s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS] = x_postcopy_rounds;
+    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
+               x_cpu_throttle_initial;
+    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
+               x_cpu_throttle_increment;
+    s->parameters[MIGRATION_PARAMETER_X_RDMA_QPS] = x_rdma_qps;
     s->bandwidth_limit = bandwidth_limit;
     migrate_set_state(s, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
@@ -713,11 +952,23 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP ||
         s->state == MIGRATION_STATUS_CANCELLING) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
+
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty rate measurement is in progress");
+        return;
+    }
+
+    if (savevm_live_active()) {
+        error_setg(errp, "A live snapshot is in progress");
+        return;
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
@@ -732,6 +983,49 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "x-multifd is only supported by tcp migration");
+        return;
+    }
+    if (migrate_use_multifd() && migrate_use_compression()) {
+        error_setg(errp, "x-multifd and compress can't be used together");
+        return;
+    }
+    if (migrate_postcopy_ram()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "x-postcopy-ram is only supported by tcp and "
+                       "unix migration");
+            return;
+        }
+        if (migrate_use_compression() || migrate_use_multifd()) {
+            error_setg(errp, "x-postcopy-ram can't be used together with "
+                       "compress or x-multifd");
+            return;
+        }
+        if (params.blk) {
+            error_setg(errp, "x-postcopy-ram does not support block "
+                       "migration");
+            return;
+        }
+    }
+    if (migrate_local_shared_ram()) {
+        if (!strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "x-local-shared-ram is only supported by unix "
+                       "migration");
+            return;
+        }
+        if (migrate_postcopy_ram()) {
+            error_setg(errp, "x-local-shared-ram and x-postcopy-ram can't "
+                       "be used together");
+            return;
+        }
+        if (migrate_ignore_shared()) {
+            error_setg(errp, "x-local-shared-ram and x-ignore-shared can't "
+                       "be used together");
+            return;
+        }
+    }
+
     /* We are starting a new migration, so we want to start in a clean
        state.  This change is only needed if previous migration
        failed/was cancelled.  We don't use migrate_set_state() because
@@ -886,6 +1180,87 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+int migrate_rdma_qps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_RDMA_QPS];
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRTY_BITMAPS];
+}
+
+bool migrate_page_batch(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_PAGE_BATCH];
+}
+
+bool migrate_local_shared_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LOCAL_SHARED_RAM];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+int migrate_postcopy_rounds(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_ROUNDS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -915,6 +1290,304 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+static struct rp_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} rp_cmd_args[] = {
+    [MIG_RP_MSG_INVALID]        = { .len = -1, .name = "INVALID" },
+    [MIG_RP_MSG_SHUT]           = { .len =  4, .name = "SHUT" },
+    [MIG_RP_MSG_REQ_PAGES]      = { .len = 12, .name = "REQ_PAGES" },
+    [MIG_RP_MSG_REQ_PAGES_ID]   = { .len = -1, .name = "REQ_PAGES_ID" },
+    [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
+};
+
+/*
+ * Something bad happened to the RP stream, mark an error
+ * The caller shall print or trace something to indicate why
+ */
+static void mark_source_rp_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+/*
+ * Process a request for pages received on the return path,
+ * We're allowed to send more than requested (e.g. to round to our page size)
+ * and we have to send at least what was requested.
+ */
+static void migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
+                                       ram_addr_t start, size_t len)
+{
+    long our_host_ps = getpagesize();
+
+    trace_migrate_handle_rp_req_pages(rbname, start, len);
+
+    /*
+     * Since we currently insist on matching page sizes, just sanity check
+     * we're being asked for whole host pages.
+     */
+    if ((start | len) & (our_host_ps - 1)) {
+        error_report("%s: Misaligned page request, start: " RAM_ADDR_FMT
+                     " len: %zd", __func__, start, len);
+        mark_source_rp_bad(ms);
+        return;
+    }
+
+    if (ram_save_queue_pages(ms, rbname, start, len)) {
+        mark_source_rp_bad(ms);
+    }
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ *
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t tmp32, sibling_error;
+    ram_addr_t start = 0; /* =0 to silence warning */
+    size_t  len = 0, expected_len;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_loop_top();
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                    header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        if ((rp_cmd_args[header_type].len != -1 &&
+            header_len != rp_cmd_args[header_type].len) ||
+            header_len > sizeof(buf)) {
+            error_report("RP: Received '%s' message (0x%04x) with"
+                    "incorrect length %d expecting %zu",
+                    rp_cmd_args[header_type].name, header_type, header_len,
+                    (size_t)rp_cmd_args[header_type].len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* We know we've got a valid header by this point */
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* OK, we have the message and the data */
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            sibling_error = ldl_be_p(buf);
+            trace_source_return_path_thread_shut(sibling_error);
+            if (sibling_error) {
+                error_report("RP: Sibling indicated error %d", sibling_error);
+                mark_source_rp_bad(ms);
+            }
+            /*
+             * We'll let the main thread deal with closing the RP
+             * we could do a shutdown(2) on it, but we're the only user
+             * anyway, so there's nothing gained.
+             */
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            start = ldq_be_p(buf);
+            len = ldl_be_p(buf + 8);
+            migrate_handle_rp_req_pages(ms, NULL, start, len);
+            break;
+
+        case MIG_RP_MSG_REQ_PAGES_ID:
+            expected_len = 12 + 1; /* header + termination */
+
+            if (header_len >= expected_len) {
+                start = ldq_be_p(buf);
+                len = ldl_be_p(buf + 8);
+                /* Now we expect an idstr */
+                tmp32 = buf[12]; /* Length of the following idstr */
+                buf[13 + tmp32] = '\0';
+                expected_len += tmp32;
+            }
+            if (header_len != expected_len) {
+                error_report("RP: Req_Page_id with length %d expecting %zd",
+                        header_len, expected_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            migrate_handle_rp_req_pages(ms, (char *)&buf[13], start, len);
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        mark_source_rp_bad(ms);
+    }
+
+    trace_source_return_path_thread_end();
+out:
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.from_dst_file) {
+        return -1;
+    }
+
+    trace_open_return_path_on_source();
+    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+
+    trace_open_return_path_on_source_continue();
+
+    return 0;
+}
+
+/* Returns 0 if the RP was ok, otherwise there was an error on the RP */
+static int await_return_path_close_on_source(MigrationState *ms)
+{
+    /*
+     * If this is a normal exit then the destination will send a SHUT and the
+     * rp_thread will exit, however if there's an error we need to cause
+     * it to exit.
+     */
+    if (qemu_file_get_error(ms->file) ||
+        !migration_in_postcopy(ms)) {
+        /*
+         * shutdown(2), if we have it, will cause it to unblock if it's stuck
+         * waiting for the destination.
+         */
+        qemu_file_shutdown(ms->rp_state.from_dst_file);
+        mark_source_rp_bad(ms);
+    }
+    trace_await_return_path_close_on_source_joining();
+    qemu_thread_join(&ms->rp_state.rp_thread);
+    trace_await_return_path_close_on_source_close();
+    qemu_fclose(ms->rp_state.from_dst_file);
+    ms->rp_state.from_dst_file = NULL;
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from normal iteration to postcopy
+ * Returns non-0 on an error that happened before the destination could
+ * have been told to run; the source can then be restarted.
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    int ret;
+    const QEMUSizedBuffer *qsb;
+    QEMUFile *fb;
+    int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    migrate_set_state(ms, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    trace_postcopy_start_set_run();
+
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret) {
+        ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The destination starts asking for pages as soon as it is running */
+    if (open_return_path_on_source(ms)) {
+        error_report("Unable to open return-path for postcopy");
+        goto fail;
+    }
+
+    /*
+     * Tell the destination to throw away the pages it already has that
+     * were dirtied again since they were sent.
+     */
+    if (ram_postcopy_send_discard_bitmap(ms)) {
+        error_report("postcopy send discard bitmap failed");
+        goto fail;
+    }
+
+    /*
+     * send rest of state - note things that are doing postcopy
+     * will notice we're in POSTCOPY_ACTIVE and not actually
+     * wrap their state up here
+     */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    /*
+     * While loading the device state we may trigger page transfer
+     * requests and the fd must be free to process those, and thus
+     * the destination must read the whole device state off the fd before
+     * it starts processing it.  Unfortunately the ad-hoc migration format
+     * doesn't allow the destination to know the size to read without fully
+     * parsing it through each devices load-state code (especially the open
+     * coded devices that use get/put).
+     * So we wrap the device state up in a package with a length at the start;
+     * to do this we use a qsb buffer.
+     */
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+        goto fail;
+    }
+
+    /*
+     * Make sure the receiver can get incoming pages before we send the rest
+     * of the state
+     */
+    qemu_savevm_send_postcopy_listen(fb);
+
+    qemu_savevm_state_save_devices(fb);
+    qemu_savevm_send_postcopy_run(fb);
+
+    /* <><> end of stuff going into the package */
+    qsb = qemu_buf_get(fb);
+
+    /* Now send that blob */
+    if (qemu_savevm_send_packaged(ms->file, qsb)) {
+        qemu_fclose(fb);
+        goto fail;
+    }
+    qemu_fclose(fb);
+    ms->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+
+    qemu_mutex_unlock_iothread();
+
+    /*
+     * From here on the destination may be running the guest, so even a
+     * stream error (caught by the caller) must not restart the source.
+     */
+    return 0;
+
+fail:
+    migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    qemu_mutex_unlock_iothread();
+    return -1;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -924,16 +1597,22 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
 
     rcu_register_thread();
 
     qemu_savevm_state_header(s->file);
+    if (migrate_postcopy_ram()) {
+        /* Now tell the dest that it should open its end so it can reply */
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_ACTIVE);
 
-    while (s->state == MIGRATION_STATUS_ACTIVE) {
+    while (s->state == MIGRATION_STATUS_ACTIVE ||
+           s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -941,7 +1620,33 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
+                /* Still a significant amount to transfer */
+                if (migrate_postcopy_ram() && !entered_postcopy &&
+                    s->dirty_sync_count >= migrate_postcopy_rounds()) {
+                    if (!postcopy_start(s, &old_vm_running)) {
+                        entered_postcopy = true;
+                    }
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
+            } else if (entered_postcopy) {
+                /*
+                 * The guest runs on the destination; send what is left and
+                 * wait for the destination to tell us it has all of it.
+                 */
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_complete_postcopy(s->file);
+                qemu_mutex_unlock_iothread();
+
+                if (!await_return_path_close_on_source(s) &&
+                    !qemu_file_get_error(s->file)) {
+                    migrate_set_state(s, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                                      MIGRATION_STATUS_COMPLETED);
+                } else {
+                    migrate_set_state(s, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                                      MIGRATION_STATUS_FAILED);
+                }
+                break;
             } else {
                 int ret;
 
@@ -974,8 +1679,10 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+        if (qemu_file_get_error(s->file) || s->rp_state.error) {
+            migrate_set_state(s, entered_postcopy ?
+                              MIGRATION_STATUS_POSTCOPY_ACTIVE :
+                              MIGRATION_STATUS_ACTIVE,
                               MIGRATION_STATUS_FAILED);
             break;
         }
@@ -1007,19 +1714,31 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    if (s->rp_state.from_dst_file) {
+        /* Postcopy failed before it could complete */
+        await_return_path_close_on_source(s);
+    }
+
     qemu_mutex_lock_iothread();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy) {
+            /* postcopy_start() measured the time the guest was stopped */
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /*
+         * Once postcopy has started the destination owns the guest: the
+         * source can't be restarted even if the migration failed.
+         */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
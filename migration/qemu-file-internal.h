@@ -29,7 +29,7 @@
 #include "qemu/iov.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+#define MAX_IOV_SIZE MIN(IOV_MAX, 256)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -28,9 +28,14 @@
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
 
+/* Descriptors received but not yet taken by qemu_file_recv_fd() */
+#define SOCKET_MAX_FDS 16
+
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    int fds[SOCKET_MAX_FDS];
+    int nr_fds;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -54,13 +59,108 @@ static int socket_get_fd(void *opaque)
     return s->fd;
 }
 
+#ifndef _WIN32
+static int socket_send_fd(void *opaque, int fd)
+{
+    QEMUFileSocket *s = opaque;
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    ssize_t len;
+
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+        len = sendmsg(s->fd, &msg, 0);
+    } while (len == -1 && errno == EINTR);
+
+    return len == 1 ? 0 : -errno;
+}
+
+static int socket_recv_fd(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int fd;
+
+    if (!s->nr_fds) {
+        return -EBADF;
+    }
+    fd = s->fds[0];
+    s->nr_fds--;
+    memmove(s->fds, s->fds + 1, s->nr_fds * sizeof(int));
+    return fd;
+}
+
+/*
+ * recv() that also keeps the descriptors passed with the data.  A unix
+ * stream socket never returns data past a message carrying descriptors,
+ * so they are queued by the time the byte they travel with is parsed.
+ */
+static ssize_t socket_recv(QEMUFileSocket *s, uint8_t *buf, int size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    ssize_t len;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(s->fd, &msg, 0);
+    if (len <= 0) {
+        return len;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        int i, n;
+
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (s->nr_fds == SOCKET_MAX_FDS) {
+                close(fd);
+                continue;
+            }
+            qemu_set_cloexec(fd);
+            s->fds[s->nr_fds++] = fd;
+        }
+    }
+    return len;
+}
+#endif
+
 static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileSocket *s = opaque;
     ssize_t len;
 
     for (;;) {
+#ifndef _WIN32
+        len = socket_recv(s, buf, size);
+#else
         len = qemu_recv(s->fd, buf, size, 0);
+#endif
         if (len != -1) {
             break;
         }
@@ -80,6 +180,10 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+    while (s->nr_fds) {
+        close(s->fds[--s->nr_fds]);
+    }
     closesocket(s->fd);
     g_free(s);
     return 0;
@@ -203,21 +307,62 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
     return s->file;
 }
 
-static const QEMUFileOps socket_read_ops = {
-    .get_fd     = socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close      = socket_close,
-    .shut_down  = socket_shutdown
+static QEMUFile *socket_get_return_path(void *opaque);
 
+static const QEMUFileOps socket_read_ops = {
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifndef _WIN32
+    .recv_fd         = socket_recv_fd,
+#endif
 };
 
 static const QEMUFileOps socket_write_ops = {
-    .get_fd        = socket_get_fd,
-    .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifndef _WIN32
+    .send_fd         = socket_send_fd,
+#endif
 };
 
+/*
+ * Give a QEMUFile* off the same socket but data in the opposite
+ * direction.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+    int fd;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    fd = dup(forward->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    reverse = g_malloc0(sizeof(QEMUFileSocket));
+    reverse->fd = fd;
+    if (qemu_file_is_writable(forward->file)) {
+        /* The forward file is writing, so the return path reads */
+        reverse->file = qemu_fopen_ops(reverse, &socket_read_ops);
+    } else {
+        qemu_set_block(fd);
+        reverse->file = qemu_fopen_ops(reverse, &socket_write_ops);
+    }
+    return reverse->file;
+}
+
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
     QEMUFileSocket *s;
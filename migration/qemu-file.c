@@ -44,6 +44,76 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
+bool qemu_file_can_pass_fd(QEMUFile *f)
+{
+    return f->ops->send_fd || f->ops->recv_fd;
+}
+
+/*
+ * Pass @fd to the other side at the current point of the stream; it is
+ * picked up there with qemu_file_recv_fd().  Only works over a unix
+ * socket.
+ *
+ * Returns 0 on success, -err on error
+ */
+int qemu_file_send_fd(QEMUFile *f, int fd)
+{
+    int ret;
+
+    if (!f->ops->send_fd) {
+        ret = -ENOTSUP;
+    } else {
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (!ret) {
+            ret = f->ops->send_fd(f->opaque, fd);
+        }
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    /* The descriptor travels with one byte of data */
+    f->pos++;
+    return 0;
+}
+
+/*
+ * Returns the file descriptor passed with qemu_file_send_fd() at this
+ * point of the stream, or -err on error
+ */
+int qemu_file_recv_fd(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->ops->recv_fd) {
+        ret = -ENOTSUP;
+    } else {
+        /* The descriptor came in with this byte */
+        qemu_get_byte(f);
+        ret = qemu_file_get_error(f);
+        if (!ret) {
+            ret = f->ops->recv_fd(f->opaque);
+        }
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -239,6 +309,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data that was sent on behalf of f through another channel,
+ * so that it is taken into account by rate limiting and qemu_ftell.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+    f->pos += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
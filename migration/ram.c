@@ -32,12 +32,17 @@
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "sysemu/sysemu.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/sockets.h"
+#include "block/coroutine.h"
+#include "migration/postcopy-ram.h"
+#include "qom/cpu.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -47,16 +52,15 @@
     do { } while (0)
 #endif
 
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
 
 static uint64_t bitmap_sync_count;
 
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* 0x01 was RAM_SAVE_FLAG_FULL, which is not sent since QEMU 0.13 */
+#define RAM_SAVE_FLAG_PAGE_BATCH 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -65,6 +69,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -149,6 +154,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
@@ -205,6 +212,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
@@ -222,10 +239,63 @@ static RAMBlock *last_seen_block;
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
+/* One bit per chunk of RAM whose dirty log in the accelerator has to be
+ * re-armed before any page of the chunk is sent.
+ */
+static unsigned long *migration_clear_bitmap;
 static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* The guest reports free pages, the bulk stage must look at the bitmap */
+static bool free_page_hinting;
+
+static NotifierList precopy_notifiers =
+    NOTIFIER_LIST_INITIALIZER(precopy_notifiers);
+
+void precopy_add_notifier(Notifier *n)
+{
+    notifier_list_add(&precopy_notifiers, n);
+}
+
+void precopy_remove_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
+static void precopy_notify(PrecopyNotifyReason reason)
+{
+    notifier_list_notify(&precopy_notifiers, &reason);
+}
+
+void precopy_enable_free_page_optimization(void)
+{
+    free_page_hinting = true;
+}
+
+/* Dirty logging is re-armed in chunks of 2^CLEAR_BITMAP_SHIFT target pages,
+ * so that the dirty log of a large guest is not cleared all at once at
+ * every sync, but a little before the pages are sent.
+ */
+#define CLEAR_BITMAP_SHIFT 18
+
+/* Pages the destination asked for while in postcopy */
+struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+};
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* Block of the last request, for requests that don't name one */
+static RAMBlock *last_req_rb;
+
+/* Maximum number of ranges in one POSTCOPY_RAM_DISCARD command */
+#define MAX_DISCARDS_PER_COMMAND 12
 
 struct CompressParam {
     bool start;
@@ -238,15 +308,20 @@ struct CompressParam {
 };
 typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
+/* A compressed page waiting for a decompression thread, or being
+ * decompressed by one, straight into guest RAM at @des
+ */
+typedef struct DecompressJob {
     void *des;
-    uint8 *compbuf;
+    uint8_t *compbuf;
     int len;
-};
-typedef struct DecompressParam DecompressParam;
+    QSIMPLEQ_ENTRY(DecompressJob) next;
+} DecompressJob;
+
+/* Jobs that can be queued per decompression thread, so that reading the
+ * stream goes on while every thread is busy
+ */
+#define DECOMPRESS_JOBS_PER_THREAD 4
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
@@ -261,10 +336,22 @@ static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
 static bool quit_comp_thread;
-static bool quit_decomp_thread;
-static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
-static uint8_t *compressed_data_buf;
+static DecompressJob *decomp_jobs;
+/* decomp_lock protects the job lists, decomp_busy and quit_decomp_thread.
+ * decomp_cond wakes up the decompression threads when a job is queued,
+ * decomp_done_cond wakes up ram_load when a job is finished.
+ */
+static QemuMutex decomp_lock;
+static QemuCond decomp_cond;
+static QemuCond decomp_done_cond;
+static QSIMPLEQ_HEAD(, DecompressJob) decomp_free =
+    QSIMPLEQ_HEAD_INITIALIZER(decomp_free);
+static QSIMPLEQ_HEAD(, DecompressJob) decomp_pending =
+    QSIMPLEQ_HEAD_INITIALIZER(decomp_pending);
+/* Number of jobs queued or being decompressed */
+static int decomp_busy;
+static bool quit_decomp_thread;
 
 static int do_compress_ram_page(CompressParam *param);
 
@@ -368,6 +455,741 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple fd's (multifd) support
+ *
+ * With the x-multifd capability, normal pages are not written to the main
+ * migration stream.  The migration thread batches them per RAMBlock and
+ * hands each batch to one of several sending threads, each of which owns
+ * its own TCP connection.  Zero pages, XBZRLE pages and everything else
+ * still go through the main stream.
+ *
+ * A page can be sent again after the dirty bitmap has been synced, possibly
+ * through a different channel, so all channels are synchronized at that
+ * point: every channel sends a SYNC packet, and RAM_SAVE_FLAG_MULTIFD_SYNC
+ * is written to the main stream.  When the destination reads that flag it
+ * waits until all channels have reached their SYNC packet.
+ *
+ * Each channel starts with a header (magic, version, channel id, channel
+ * count), followed by packets made of a be32 flags word, a be32 page
+ * count, and, for a non-empty packet, the block idstr, the be64 offsets
+ * and the page data.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+#define MULTIFD_PAGES_PER_PACKET 64
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+#define MULTIFD_FLAG_QUIT (1 << 1)
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    /* only touched by the channel thread while !done */
+    MultiFDPages pages;
+    uint32_t flags;
+    /* protected by multifd_send_state->done_lock */
+    bool done;
+} MultiFDSendParams;
+
+typedef struct MultiFDSendState {
+    MultiFDSendParams *params;
+    int count;
+    /* batch being filled by the migration thread */
+    MultiFDPages pages;
+    QemuMutex done_lock;
+    QemuCond done_cond;
+    /* first error seen by a channel */
+    int error;
+} MultiFDSendState;
+
+static MultiFDSendState *multifd_send_state;
+/* set by migration_bitmap_sync, pages may be sent again from now on */
+static bool multifd_sync_needed;
+
+static void multifd_send_packet(MultiFDSendParams *p)
+{
+    QEMUFile *f = p->file;
+    RAMBlock *block = p->pages.block;
+    uint8_t *host;
+    size_t len;
+    uint32_t i;
+
+    qemu_put_be32(f, p->flags);
+    qemu_put_be32(f, p->pages.num);
+    if (p->pages.num) {
+        len = strlen(block->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+        for (i = 0; i < p->pages.num; i++) {
+            qemu_put_be64(f, p->pages.offset[i]);
+        }
+        host = memory_region_get_ram_ptr(block->mr);
+        for (i = 0; i < p->pages.num; i++) {
+            qemu_put_buffer_async(f, host + p->pages.offset[i],
+                                  TARGET_PAGE_SIZE);
+        }
+    }
+    qemu_fflush(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    bool quit = false;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_be32(p->file, p->id);
+    qemu_put_be32(p->file, multifd_send_state->count);
+    qemu_fflush(p->file);
+
+    while (!quit) {
+        qemu_mutex_lock(&p->mutex);
+        while (!p->start && !p->quit) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        quit = p->quit;
+        p->start = false;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (!quit) {
+            multifd_send_packet(p);
+            /* the last packet does not need an answer */
+            quit = p->flags & MULTIFD_FLAG_QUIT;
+        }
+
+        ret = qemu_file_get_error(p->file);
+        qemu_mutex_lock(&multifd_send_state->done_lock);
+        if (ret && !multifd_send_state->error) {
+            multifd_send_state->error = ret;
+        }
+        p->done = true;
+        qemu_cond_broadcast(&multifd_send_state->done_cond);
+        qemu_mutex_unlock(&multifd_send_state->done_lock);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called from the migration thread, before the first page is sent */
+static int multifd_send_setup(void)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    int i, thread_count, fd;
+
+    if (!migrate_use_multifd() || !s->multifd_host_port) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_new0(MultiFDSendState, 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    qemu_mutex_init(&multifd_send_state->done_lock);
+    qemu_cond_init(&multifd_send_state->done_cond);
+    multifd_sync_needed = false;
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        fd = inet_connect(s->multifd_host_port, &local_err);
+        if (fd < 0) {
+            error_report("multifd: could not connect channel %d: %s", i,
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            goto err;
+        }
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "wb");
+        p->done = true;
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        multifd_send_state->count++;
+    }
+    /* the channel count goes in every header, so start the threads last */
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(&multifd_send_state->params[i].thread,
+                           "multifd_send", multifd_send_thread,
+                           &multifd_send_state->params[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+
+err:
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_fclose(p->file);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    qemu_mutex_destroy(&multifd_send_state->done_lock);
+    qemu_cond_destroy(&multifd_send_state->done_cond);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+    return -1;
+}
+
+/* Wait for a channel to be idle and start it on the given packet */
+static int multifd_send_start(int idx, MultiFDPages *pages, uint32_t flags)
+{
+    MultiFDSendParams *p;
+    int ret;
+
+    qemu_mutex_lock(&multifd_send_state->done_lock);
+    while (true) {
+        if (idx < 0) {
+            for (idx = 0; idx < multifd_send_state->count; idx++) {
+                if (multifd_send_state->params[idx].done) {
+                    break;
+                }
+            }
+            if (idx == multifd_send_state->count) {
+                idx = -1;
+            }
+        }
+        if (multifd_send_state->error ||
+            (idx >= 0 && multifd_send_state->params[idx].done)) {
+            break;
+        }
+        qemu_cond_wait(&multifd_send_state->done_cond,
+                       &multifd_send_state->done_lock);
+    }
+    ret = multifd_send_state->error;
+    if (!ret) {
+        multifd_send_state->params[idx].done = false;
+    }
+    qemu_mutex_unlock(&multifd_send_state->done_lock);
+    if (ret) {
+        return ret;
+    }
+
+    p = &multifd_send_state->params[idx];
+    if (pages) {
+        p->pages = *pages;
+    } else {
+        p->pages.num = 0;
+    }
+    p->flags = flags;
+    qemu_mutex_lock(&p->mutex);
+    p->start = true;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+/* Wait until all channels have written everything they were given */
+static int multifd_send_wait(void)
+{
+    int i, ret;
+
+    qemu_mutex_lock(&multifd_send_state->done_lock);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        while (!multifd_send_state->params[i].done &&
+               !multifd_send_state->error) {
+            qemu_cond_wait(&multifd_send_state->done_cond,
+                           &multifd_send_state->done_lock);
+        }
+    }
+    ret = multifd_send_state->error;
+    qemu_mutex_unlock(&multifd_send_state->done_lock);
+
+    return ret;
+}
+
+static void multifd_send_flush(QEMUFile *f)
+{
+    int ret;
+
+    if (!multifd_send_state->pages.num) {
+        return;
+    }
+    ret = multifd_send_start(-1, &multifd_send_state->pages, 0);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+    multifd_send_state->pages.num = 0;
+}
+
+static void multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset)
+{
+    MultiFDPages *pages = &multifd_send_state->pages;
+
+    if (pages->block != block) {
+        multifd_send_flush(f);
+        pages->block = block;
+    }
+    pages->offset[pages->num++] = offset;
+    /* the page data does not go through f, but f does the rate limiting */
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE + 8);
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        multifd_send_flush(f);
+    }
+}
+
+/* Make sure the channels are done with the block pointers they were given
+ * before the caller leaves its RCU critical section.
+ */
+static void multifd_send_drain(QEMUFile *f)
+{
+    int ret;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    multifd_send_flush(f);
+    ret = multifd_send_wait();
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/**
+ * multifd_send_sync: synchronize all channels with the main stream
+ *
+ * Every page queued so far reaches the destination before any page that
+ * is written to any stream afterwards.
+ *
+ * @f: main migration stream
+ * @last: this is the end of RAM migration, channels can quit afterwards
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static void multifd_send_sync(QEMUFile *f, bool last,
+                              uint64_t *bytes_transferred)
+{
+    uint32_t flags = MULTIFD_FLAG_SYNC | (last ? MULTIFD_FLAG_QUIT : 0);
+    int i, ret;
+
+    if (!multifd_send_state || (!multifd_sync_needed && !last)) {
+        return;
+    }
+    multifd_sync_needed = false;
+    multifd_send_flush(f);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        ret = multifd_send_start(i, NULL, flags);
+        if (ret) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+    ret = multifd_send_wait();
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+}
+
+/* Called from migrate_fd_cancel to unblock channels stuck in a write */
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_file_shutdown(multifd_send_state->params[i].file);
+    }
+}
+
+void multifd_send_threads_join(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (multifd_send_state->error) {
+            qemu_file_shutdown(p->file);
+        }
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    qemu_mutex_destroy(&multifd_send_state->done_lock);
+    qemu_cond_destroy(&multifd_send_state->done_cond);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+typedef struct MultiFDRecvParams {
+    QemuThread thread;
+    QEMUFile *file;
+    /* posted by the channel when it reaches a SYNC packet or fails */
+    QemuSemaphore synced;
+    /* posted by ram_load once all channels are synced */
+    QemuSemaphore resume;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    bool running;
+    bool quit;
+    int error;
+} MultiFDRecvParams;
+
+static MultiFDRecvParams *multifd_recv_params;
+static int multifd_recv_count;
+static int multifd_listen_fd = -1;
+
+/* Called by the tcp transport once the main connection is accepted */
+void multifd_recv_set_listener(int fd)
+{
+    multifd_listen_fd = fd;
+}
+
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t num)
+{
+    QEMUFile *f = p->file;
+    RAMBlock *block;
+    char id[256];
+    uint8_t *host;
+    uint8_t len;
+    uint32_t i;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    for (i = 0; i < num; i++) {
+        p->offset[i] = qemu_get_be64(f);
+    }
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        rcu_read_unlock();
+        error_report("multifd: can't find block %s", id);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        if (p->offset[i] >= block->used_length ||
+            (p->offset[i] & ~TARGET_PAGE_MASK)) {
+            rcu_read_unlock();
+            error_report("multifd: illegal RAM offset " RAM_ADDR_FMT
+                         " in block %s", p->offset[i], id);
+            return -EINVAL;
+        }
+    }
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, host + p->offset[i], TARGET_PAGE_SIZE);
+    }
+    rcu_read_unlock();
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t flags, num;
+    int ret = 0;
+
+    rcu_register_thread();
+
+    while (!ret) {
+        flags = qemu_get_be32(p->file);
+        num = qemu_get_be32(p->file);
+        ret = qemu_file_get_error(p->file);
+        if (ret) {
+            break;
+        }
+        if (num > MULTIFD_PAGES_PER_PACKET) {
+            error_report("multifd: invalid packet with %u pages", num);
+            ret = -EINVAL;
+            break;
+        }
+        if (num) {
+            ret = multifd_recv_packet(p, num);
+        }
+        if (!ret && (flags & MULTIFD_FLAG_SYNC)) {
+            qemu_sem_post(&p->synced);
+            if (flags & MULTIFD_FLAG_QUIT) {
+                break;
+            }
+            qemu_sem_wait(&p->resume);
+            if (atomic_read(&p->quit)) {
+                break;
+            }
+        }
+    }
+    if (ret) {
+        atomic_set(&p->error, ret);
+        qemu_sem_post(&p->synced);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* How long the destination waits for the source's channels */
+#define MULTIFD_RECV_TIMEOUT_MS 30000
+
+typedef struct MultiFDRecvWait {
+    Coroutine *co;
+    bool timed_out;
+} MultiFDRecvWait;
+
+static void multifd_recv_wait_ready(void *opaque)
+{
+    MultiFDRecvWait *w = opaque;
+
+    qemu_coroutine_enter(w->co, NULL);
+}
+
+static void multifd_recv_wait_timeout(void *opaque)
+{
+    MultiFDRecvWait *w = opaque;
+
+    w->timed_out = true;
+    qemu_coroutine_enter(w->co, NULL);
+}
+
+/* Yield to the main loop until @fd is readable or @deadline (in
+ * QEMU_CLOCK_REALTIME ms) has passed.
+ */
+static int coroutine_fn multifd_recv_wait(int fd, int64_t deadline)
+{
+    MultiFDRecvWait w = { .co = qemu_coroutine_self() };
+    QEMUTimer *timer;
+
+    timer = timer_new_ms(QEMU_CLOCK_REALTIME, multifd_recv_wait_timeout, &w);
+    timer_mod(timer, deadline);
+    qemu_set_fd_handler(fd, multifd_recv_wait_ready, NULL, &w);
+    qemu_coroutine_yield();
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    timer_del(timer);
+    timer_free(timer);
+
+    return w.timed_out ? -ETIMEDOUT : 0;
+}
+
+static int coroutine_fn multifd_recv_accept(int64_t deadline)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int c, err;
+
+    for (;;) {
+        addrlen = sizeof(addr);
+        c = qemu_accept(multifd_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+        if (c >= 0) {
+            return c;
+        }
+        err = socket_error();
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            err = -multifd_recv_wait(multifd_listen_fd, deadline);
+        }
+        if (err && err != EINTR && err != EAGAIN && err != EWOULDBLOCK) {
+            error_report("multifd: could not accept channel (%s)",
+                         strerror(err));
+            return -err;
+        }
+    }
+}
+
+static int coroutine_fn multifd_recv_header(int c, uint8_t *buf, size_t size,
+                                            int64_t deadline)
+{
+    size_t done = 0;
+    ssize_t len;
+    int err;
+
+    while (done < size) {
+        len = qemu_recv(c, buf + done, size - done, 0);
+        if (len > 0) {
+            done += len;
+            continue;
+        }
+        err = len ? socket_error() : ECONNRESET;
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            err = -multifd_recv_wait(c, deadline);
+        }
+        if (err && err != EINTR && err != EAGAIN && err != EWOULDBLOCK) {
+            error_report("multifd: could not read channel header (%s)",
+                         strerror(err));
+            return -err;
+        }
+    }
+
+    return 0;
+}
+
+/* Called from ram_load, in the incoming migration coroutine, when the
+ * source announces its RAM blocks.  The channels are accepted and their
+ * headers read without blocking the main loop; a source that does not
+ * connect them within MULTIFD_RECV_TIMEOUT_MS fails the migration.
+ */
+static int multifd_recv_setup(void)
+{
+    uint8_t header[16];
+    uint32_t magic, version, id, count;
+    int64_t deadline;
+    int i, c, ret;
+
+    if (multifd_recv_params) {
+        return 0;
+    }
+    if (multifd_listen_fd < 0 || !qemu_in_coroutine()) {
+        error_report("multifd is only supported by tcp incoming migration");
+        return -EINVAL;
+    }
+
+    deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+               MULTIFD_RECV_TIMEOUT_MS;
+    qemu_set_nonblock(multifd_listen_fd);
+
+    /* the channel count is only known once the first header is read */
+    for (i = 0; i == 0 || i < multifd_recv_count; i++) {
+        c = multifd_recv_accept(deadline);
+        if (c < 0) {
+            return c;
+        }
+        qemu_set_nonblock(c);
+        ret = multifd_recv_header(c, header, sizeof(header), deadline);
+        if (ret) {
+            closesocket(c);
+            return ret;
+        }
+
+        magic = ldl_be_p(header);
+        version = ldl_be_p(header + 4);
+        id = ldl_be_p(header + 8);
+        count = ldl_be_p(header + 12);
+        if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION ||
+            count == 0 || count > 255 || id >= count ||
+            (multifd_recv_params && count != multifd_recv_count)) {
+            error_report("multifd: invalid channel header");
+            closesocket(c);
+            return -EINVAL;
+        }
+        if (!multifd_recv_params) {
+            multifd_recv_count = count;
+            multifd_recv_params = g_new0(MultiFDRecvParams, count);
+        }
+        if (multifd_recv_params[id].file) {
+            error_report("multifd: channel %u connected twice", id);
+            closesocket(c);
+            return -EINVAL;
+        }
+        /* the channel threads do blocking reads */
+        qemu_set_block(c);
+        multifd_recv_params[id].file = qemu_fopen_socket(c, "rb");
+    }
+
+    closesocket(multifd_listen_fd);
+    multifd_listen_fd = -1;
+
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_params[i];
+
+        qemu_sem_init(&p->synced, 0);
+        qemu_sem_init(&p->resume, 0);
+        p->running = true;
+        qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+/* Handles RAM_SAVE_FLAG_MULTIFD_SYNC: wait for every channel to get to the
+ * same point as the main stream.
+ */
+static int multifd_recv_sync(void)
+{
+    int i, ret;
+
+    if (!multifd_recv_params) {
+        error_report("multifd: sync without channels");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_wait(&multifd_recv_params[i].synced);
+        ret = atomic_read(&multifd_recv_params[i].error);
+        if (ret) {
+            return ret;
+        }
+    }
+    /* channels that got the last SYNC packet have already quit */
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv_params[i].resume);
+    }
+
+    return 0;
+}
+
+void multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (multifd_listen_fd >= 0) {
+        closesocket(multifd_listen_fd);
+        multifd_listen_fd = -1;
+    }
+    if (!multifd_recv_params) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_params[i];
+
+        if (p->running) {
+            atomic_set(&p->quit, true);
+            qemu_sem_post(&p->resume);
+            qemu_file_shutdown(p->file);
+            qemu_thread_join(&p->thread);
+            qemu_sem_destroy(&p->synced);
+            qemu_sem_destroy(&p->resume);
+        }
+        if (p->file) {
+            qemu_fclose(p->file);
+        }
+    }
+    g_free(multifd_recv_params);
+    multifd_recv_params = NULL;
+    multifd_recv_count = 0;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -396,6 +1218,82 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
+/*
+ * With x-page-batch, runs of normal pages of one block are sent as a
+ * single RAM_SAVE_FLAG_PAGE_BATCH record:
+ *
+ *   be64 offset of the first page | flags, block idstr,
+ *   be32 number of pages, be64 offsets of the other pages,
+ *   then the data of all the pages
+ *
+ * The stream carries one header per batch instead of one per page, and
+ * the page data is queued with qemu_put_buffer_async after the header,
+ * so that consecutive pages are merged into a single iovec and go to the
+ * socket in a few large writes.  The pending batch is sent before any
+ * other record, so that the pages of the stream stay in order.
+ */
+#define PAGE_BATCH_MAX_PAGES 64
+
+typedef struct PageBatch {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[PAGE_BATCH_MAX_PAGES];
+} PageBatch;
+
+static PageBatch page_batch;
+
+/**
+ * page_batch_flush: Write the pending batch of pages to the stream
+ *
+ * Returns: Number of header bytes written, the page data is accounted
+ *          when the page is queued
+ *
+ * @f: QEMUFile where to send the data
+ */
+static size_t page_batch_flush(QEMUFile *f)
+{
+    uint32_t i, num = page_batch.num;
+    RAMBlock *block = page_batch.block;
+    uint8_t *host;
+    size_t size;
+
+    if (!num) {
+        return 0;
+    }
+    page_batch.num = 0;
+
+    /* the block name is always sent, the batch may follow other records */
+    size = save_page_header(f, block,
+                            page_batch.offset[0] | RAM_SAVE_FLAG_PAGE_BATCH);
+    qemu_put_be32(f, num);
+    size += 4;
+    for (i = 1; i < num; i++) {
+        qemu_put_be64(f, page_batch.offset[i]);
+        size += 8;
+    }
+
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < num; i++) {
+        qemu_put_buffer_async(f, host + page_batch.offset[i],
+                              TARGET_PAGE_SIZE);
+    }
+
+    return size;
+}
+
+static void page_batch_queue(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                             uint64_t *bytes_transferred)
+{
+    if (page_batch.block != block) {
+        *bytes_transferred += page_batch_flush(f);
+        page_batch.block = block;
+    }
+    page_batch.offset[page_batch.num++] = offset;
+    if (page_batch.num == PAGE_BATCH_MAX_PAGES) {
+        *bytes_transferred += page_batch_flush(f);
+    }
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -410,8 +1308,10 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
+                     bitmap_sync_count) == 1) {
+        acct_info.xbzrle_cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -442,17 +1342,22 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
+            int ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                                   bitmap_sync_count);
+
+            if (ret == -1) {
                 return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
             }
+            if (ret == 1) {
+                acct_info.xbzrle_cache_evictions++;
+            }
+            /* update *current_data when the page has been
+               inserted into cache */
+            *current_data = get_cached_data(XBZRLE.cache, current_addr);
         }
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -483,6 +1388,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     }
 
     /* Send XBZRLE based compressed page */
+    *bytes_transferred += page_batch_flush(f);
     bytes_xbzrle = save_page_header(f, block, offset | RAM_SAVE_FLAG_XBZRLE);
     qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
     qemu_put_be16(f, encoded_len);
@@ -509,29 +1415,126 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     unsigned long next;
 
     bitmap = atomic_rcu_read(&migration_bitmap);
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && nr > base && !free_page_hinting) {
         next = nr + 1;
     } else {
         next = find_next_bit(bitmap, size, nr);
     }
 
     if (next < size) {
-        clear_bit(next, bitmap);
-        migration_dirty_pages--;
+        /* Free page hints clear bits from the main thread */
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        if (test_and_clear_bit(next, bitmap)) {
+            migration_dirty_pages--;
+        }
+        qemu_mutex_unlock(&migration_bitmap_mutex);
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/*
+ * With x-local-shared-ram, shared file-backed blocks are handed to the
+ * destination as a file descriptor instead of being sent.  With
+ * x-ignore-shared, the destination finds them in the same file.
+ */
+static bool ram_block_is_passed(RAMBlock *block)
+{
+    if (!qemu_ram_is_shared(block) || block->fd < 0) {
+        return false;
+    }
+    /* a memfd cannot be opened again, its contents have to be sent */
+    return migrate_local_shared_ram() ||
+           (migrate_ignore_shared() && !qemu_ram_is_anon_fd(block));
+}
+
+/* Test and clear the dirty bit of a single page; returns true if it was set */
+static bool migration_bitmap_clear_dirty(ram_addr_t addr)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap);
+    bool ret;
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    ret = test_and_clear_bit(addr >> TARGET_PAGE_BITS, bitmap);
+    if (ret) {
+        migration_dirty_pages--;
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    return ret;
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
+    unsigned long *clear;
     bitmap = atomic_rcu_read(&migration_bitmap);
+    clear = atomic_rcu_read(&migration_clear_bitmap);
     migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+        cpu_physical_memory_sync_dirty_bitmap(bitmap, clear,
+                                              CLEAR_BITMAP_SHIFT,
+                                              start, length);
+}
+
+/*
+ * Re-arm the dirty log of the chunk that holds @offset in @block, if
+ * pages were reported dirty in it since that was last done.  This must
+ * be done before a page of the chunk is read for sending, so that the
+ * writes that follow are seen by the next sync; doing it early is
+ * harmless.
+ *
+ * Called with rcu_read_lock() to protect migration_clear_bitmap
+ */
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *block,
+                                                       ram_addr_t offset)
+{
+    unsigned long *clear = atomic_rcu_read(&migration_clear_bitmap);
+    unsigned long chunk;
+    ram_addr_t start, end;
+    RAMBlock *rb;
+
+    chunk = (block->offset + offset) >> (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT);
+    if (!clear || !test_and_clear_bit(chunk, clear)) {
+        return;
+    }
+
+    start = (ram_addr_t)chunk << (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT);
+    end = start + (1ULL << (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT));
+
+    /* Like the rest of RAM iteration, this runs without the iothread lock */
+    QLIST_FOREACH_RCU(rb, &ram_list.blocks, next) {
+        ram_addr_t s = MAX(start, rb->offset);
+        ram_addr_t e = MIN(end, rb->offset + rb->used_length);
+
+        if (s < e) {
+            memory_region_clear_dirty_bitmap(rb->mr, s - rb->offset, e - s);
+        }
+    }
 }
 
 
+/* Reduce amount of guest cpu execution to hopefully slow down memory writes.
+ * If guest dirty memory rate is reduced below the rate at which we can
+ * transfer pages to the destination then we should be able to complete
+ * migration. Some workloads dirty memory way too fast and will not
+ * effectively converge, even with auto-converge.
+ */
+static void mig_throttle_guest_down(void)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    uint64_t pct_increment =
+            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+
+    /* We have not started throttling yet. Let's start it. */
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(pct_initial);
+    } else {
+        /* Throttling already on, just increase the rate */
+        cpu_throttle_set(cpu_throttle_get_percentage() + pct_increment);
+    }
+}
+
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
 static int64_t bytes_xfer_prev;
@@ -558,6 +1561,7 @@ static void migration_bitmap_sync(void)
     int64_t bytes_xfer_now;
 
     bitmap_sync_count++;
+    multifd_sync_needed = true;
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -567,12 +1571,16 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
+    precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC);
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ram_block_is_passed(block)) {
+            continue;
+        }
         migration_bitmap_sync_range(block->mr->ram_addr, block->used_length);
     }
     rcu_read_unlock();
@@ -590,19 +1598,18 @@ static void migration_bitmap_sync(void)
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
                were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+               we turn on the throttle down logic, or throttle a bit more
+               if it is already on */
             bytes_xfer_now = ram_bytes_transferred();
             if (s->dirty_pages_rate &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
                (dirty_rate_high_cnt++ > 4)) {
                     trace_migration_throttle();
-                    mig_throttle_on = true;
                     dirty_rate_high_cnt = 0;
+                    mig_throttle_guest_down();
              }
              bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != acct_info.iterations) {
@@ -621,6 +1628,48 @@ static void migration_bitmap_sync(void)
         num_dirty_pages_period = 0;
     }
     s->dirty_sync_count = bitmap_sync_count;
+    precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC);
+}
+
+/*
+ * The guest says the pages in [@addr, @addr + @len) are free, so they
+ * need not be sent unless they are dirtied again.  Only hints that the
+ * guest made since the last bitmap sync may be applied: a page that was
+ * reused before the sync has its new contents recorded by the sync.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    unsigned long *bitmap;
+    MemoryRegion *mr;
+    ram_addr_t ram_addr, offset, size;
+    unsigned long page, end;
+
+    rcu_read_lock();
+    bitmap = atomic_rcu_read(&migration_bitmap);
+    mr = qemu_ram_addr_from_host(addr, &ram_addr);
+    if (!bitmap || !mr) {
+        goto out;
+    }
+
+    /* Only whole target pages inside the block can be skipped */
+    offset = ram_addr - memory_region_get_ram_addr(mr);
+    size = memory_region_size(mr);
+    if (offset >= size) {
+        goto out;
+    }
+    len = MIN(len, size - offset);
+    page = TARGET_PAGE_ALIGN(ram_addr) >> TARGET_PAGE_BITS;
+    end = (ram_addr + len) >> TARGET_PAGE_BITS;
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    for (; page < end; page++) {
+        if (test_and_clear_bit(page, bitmap)) {
+            migration_dirty_pages--;
+        }
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+out:
+    rcu_read_unlock();
 }
 
 /**
@@ -641,6 +1690,7 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 
     if (is_zero_range(p, TARGET_PAGE_SIZE)) {
         acct_info.dup_pages++;
+        *bytes_transferred += page_batch_flush(f);
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_COMPRESS);
         qemu_put_byte(f, 0);
@@ -688,7 +1738,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     current_addr = block->offset + offset;
 
-    if (block == last_sent_block) {
+    /* With multifd, the block of the previous page may not have been
+     * announced on the main stream.
+     */
+    if (block == last_sent_block && !multifd_send_state) {
         offset |= RAM_SAVE_FLAG_CONTINUE;
     }
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
@@ -706,7 +1759,9 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
+            /* The destination places whole pages once postcopy started */
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -719,7 +1774,22 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     }
 
     /* XBZRLE overflow or normal page */
-    if (pages == -1) {
+    if (pages == -1 && send_async && multifd_send_state) {
+        multifd_queue_page(f, block, offset & TARGET_PAGE_MASK);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    } else if (pages == -1 && send_async && migrate_page_batch() &&
+               ret == RAM_SAVE_CONTROL_NOT_SUPP &&
+               !migration_in_postcopy(migrate_get_current())) {
+        /* in postcopy, the destination may be waiting for this page */
+        page_batch_queue(f, block, offset & TARGET_PAGE_MASK,
+                         bytes_transferred);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    } else if (pages == -1) {
+        *bytes_transferred += page_batch_flush(f);
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_PAGE);
         if (send_async) {
@@ -764,14 +1834,6 @@ static inline void start_compression(CompressParam *param)
     qemu_mutex_unlock(&param->mutex);
 }
 
-static inline void start_decompression(DecompressParam *param)
-{
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
-}
-
 static uint64_t bytes_transferred;
 
 static void flush_compressed_data(QEMUFile *f)
@@ -781,6 +1843,7 @@ static void flush_compressed_data(QEMUFile *f)
     if (!migrate_use_compression()) {
         return;
     }
+    bytes_transferred += page_batch_flush(f);
     thread_count = migrate_compress_threads();
     for (idx = 0; idx < thread_count; idx++) {
         if (!comp_param[idx].done) {
@@ -830,79 +1893,278 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
             qemu_cond_wait(comp_done_cond, comp_done_lock);
         }
     }
-    qemu_mutex_unlock(comp_done_lock);
+    qemu_mutex_unlock(comp_done_lock);
+
+    return pages;
+}
+
+/**
+ * ram_save_compressed_page: compress the given page and send it to the stream
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, bool last_stage,
+                                    uint64_t *bytes_transferred)
+{
+    int pages = -1;
+    uint64_t bytes_xmit;
+    MemoryRegion *mr = block->mr;
+    uint8_t *p;
+    int ret;
+
+    p = memory_region_get_ram_ptr(mr) + offset;
+
+    /* Compressed pages are written by the compression threads */
+    *bytes_transferred += page_batch_flush(f);
+
+    bytes_xmit = 0;
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    }
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else {
+        /* When starting the process of a new block, the first page of
+         * the block should be sent out before other pages in the same
+         * block, and all the pages in last block should have been sent
+         * out, keeping this order is important, because the 'cont' flag
+         * is used to avoid resending the block name.
+         */
+        if (block != last_sent_block) {
+            flush_compressed_data(f);
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                set_compress_params(&comp_param[0], block, offset);
+                /* Use the qemu thread to compress the data to make sure the
+                 * first page is sent out before other pages
+                 */
+                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                acct_info.norm_pages++;
+                qemu_put_qemu_file(f, comp_param[0].file);
+                *bytes_transferred += bytes_xmit;
+                pages = 1;
+            }
+        } else {
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                pages = compress_page_with_multi_thread(f, block, offset,
+                                                        bytes_transferred);
+            }
+        }
+    }
+
+    return pages;
+}
+
+/*
+ * Queue the pages for transmission, e.g. a request from postcopy destination
+ *   ms: MigrationStatus in which the queue is held
+ *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
+ *   start: Offset from the start of the RAMBlock
+ *   len: Length (in bytes) to send
+ *   Return: 0 on success
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+    struct RAMSrcPageRequest *new_entry;
+
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        QLIST_FOREACH_RCU(ramblock, &ram_list.blocks, next) {
+            if (!strcmp(rbname, ramblock->idstr)) {
+                break;
+            }
+        }
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    new_entry = g_malloc0(sizeof(struct RAMSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+/* Drop the requests that are still queued at the end of a migration */
+static void flush_page_queue(void)
+{
+    struct RAMSrcPageRequest *e, *next;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_FOREACH_SAFE(e, &src_page_requests, next_req, next) {
+        memory_region_unref(e->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(e);
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+    last_req_rb = NULL;
+}
+
+/*
+ * Send the queued pages that are still dirty, i.e. that the destination
+ * doesn't have yet.  Called within an RCU critical section.
+ *
+ * Returns: The number of pages written, 0 if no request needed a page
+ */
+static int ram_save_queued_pages(QEMUFile *f, bool last_stage,
+                                 uint64_t *bytes_transferred)
+{
+    struct RAMSrcPageRequest *e;
+    ram_addr_t offset;
+    int pages = 0;
+
+    while (!pages) {
+        qemu_mutex_lock(&src_page_req_mutex);
+        e = QSIMPLEQ_FIRST(&src_page_requests);
+        if (e) {
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        }
+        qemu_mutex_unlock(&src_page_req_mutex);
+        if (!e) {
+            break;
+        }
+
+        for (offset = e->offset; offset < e->offset + e->len;
+             offset += TARGET_PAGE_SIZE) {
+            int tmppages;
+
+            if (!migration_bitmap_clear_dirty(e->rb->offset + offset)) {
+                /* Already sent since it was last dirtied */
+                continue;
+            }
+            migration_clear_memory_region_dirty_bitmap(e->rb, offset);
+            tmppages = ram_save_page(f, e->rb, offset, last_stage,
+                                     bytes_transferred);
+            if (tmppages > 0) {
+                pages += tmppages;
+                last_sent_block = e->rb;
+            }
+        }
+        memory_region_unref(e->rb->mr);
+        g_free(e);
+    }
 
     return pages;
 }
 
-/**
- * ram_save_compressed_page: compress the given page and send it to the stream
+/*
+ * Send one target page whose dirty bit has already been cleared.
+ * Called within an RCU critical section.
  *
  * Returns: Number of pages written.
- *
- * @f: QEMUFile where to send the data
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
  */
-static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
-                                    ram_addr_t offset, bool last_stage,
-                                    uint64_t *bytes_transferred)
+static int ram_save_target_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, bool last_stage,
+                                uint64_t *bytes_transferred)
 {
-    int pages = -1;
-    uint64_t bytes_xmit;
-    MemoryRegion *mr = block->mr;
-    uint8_t *p;
-    int ret;
+    migration_clear_memory_region_dirty_bitmap(block, offset);
+    if (compression_switch && migrate_use_compression()) {
+        return ram_save_compressed_page(f, block, offset, last_stage,
+                                        bytes_transferred);
+    }
+    return ram_save_page(f, block, offset, last_stage, bytes_transferred);
+}
 
-    p = memory_region_get_ram_ptr(mr) + offset;
+/*
+ * Send the target page at *@offset, whose dirty bit has already been
+ * cleared, and then the other dirty target pages of the same host page.
+ * For blocks backed by huge pages this keeps a host page together in
+ * the stream, so that its pages share batch headers, and saves
+ * searching the bitmap for each of them.  The rest of a host page is
+ * left for later once the rate limit is hit, as a 1GiB page would
+ * otherwise go out in one call.  *@offset is left at the last target
+ * page looked at.
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns: Number of pages written.
+ */
+static int ram_save_host_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t *offset, bool last_stage,
+                              uint64_t *bytes_transferred)
+{
+    ram_addr_t end = MIN(ROUND_UP(*offset + 1, block->page_size),
+                         block->used_length);
+    ram_addr_t addr;
+    int pages = 0;
+    int tmppages;
 
-    bytes_xmit = 0;
-    ret = ram_control_save_page(f, block->offset,
-                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
-    if (bytes_xmit) {
-        *bytes_transferred += bytes_xmit;
-        pages = 1;
-    }
-    if (block == last_sent_block) {
-        offset |= RAM_SAVE_FLAG_CONTINUE;
+    tmppages = ram_save_target_page(f, block, *offset, last_stage,
+                                    bytes_transferred);
+    if (tmppages > 0) {
+        pages += tmppages;
     }
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_xmit > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_xmit == 0) {
-                acct_info.dup_pages++;
-            }
+
+    for (addr = *offset + TARGET_PAGE_SIZE; addr < end;
+         addr += TARGET_PAGE_SIZE) {
+        if (!last_stage && qemu_file_rate_limit(f)) {
+            break;
         }
-    } else {
-        /* When starting the process of a new block, the first page of
-         * the block should be sent out before other pages in the same
-         * block, and all the pages in last block should have been sent
-         * out, keeping this order is important, because the 'cont' flag
-         * is used to avoid resending the block name.
-         */
-        if (block != last_sent_block) {
-            flush_compressed_data(f);
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
-                /* Use the qemu thread to compress the data to make sure the
-                 * first page is sent out before other pages
-                 */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
-                acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
-                *bytes_transferred += bytes_xmit;
-                pages = 1;
-            }
-        } else {
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            }
+        *offset = addr;
+        if (!migration_bitmap_clear_dirty(block->offset + addr)) {
+            continue;
+        }
+        tmppages = ram_save_target_page(f, block, addr, last_stage,
+                                        bytes_transferred);
+        if (tmppages > 0) {
+            pages += tmppages;
         }
     }
 
@@ -934,9 +2196,21 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     if (!block)
         block = QLIST_FIRST_RCU(&ram_list.blocks);
 
+    if (migration_in_postcopy(migrate_get_current())) {
+        /* Pages the destination is waiting for go first */
+        pages = ram_save_queued_pages(f, last_stage, bytes_transferred);
+        if (pages) {
+            return pages;
+        }
+    }
+
     while (true) {
         mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (ram_block_is_passed(block)) {
+            offset = block->used_length;
+        } else {
+            offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        }
         if (complete_round && block == last_seen_block &&
             offset >= last_offset) {
             break;
@@ -957,13 +2231,8 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 }
             }
         } else {
-            if (compression_switch && migrate_use_compression()) {
-                pages = ram_save_compressed_page(f, block, offset, last_stage,
-                                                 bytes_transferred);
-            } else {
-                pages = ram_save_page(f, block, offset, last_stage,
-                                      bytes_transferred);
-            }
+            pages = ram_save_host_page(f, block, &offset, last_stage,
+                                       bytes_transferred);
 
             /* if page is unmodified, continue to the next */
             if (pages > 0) {
@@ -1030,11 +2299,15 @@ static void migration_end(void)
      * no writing race against this migration_bitmap
      */
     unsigned long *bitmap = migration_bitmap;
+    unsigned long *clear = migration_clear_bitmap;
     atomic_rcu_set(&migration_bitmap, NULL);
+    atomic_rcu_set(&migration_clear_bitmap, NULL);
     if (bitmap) {
         memory_global_dirty_log_stop();
         synchronize_rcu();
         g_free(bitmap);
+        g_free(clear);
+        precopy_notify(PRECOPY_NOTIFY_CLEANUP);
     }
 
     XBZRLE_cache_lock();
@@ -1047,6 +2320,98 @@ static void migration_end(void)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    flush_page_queue();
+    cpu_throttle_stop();
+}
+
+/*
+ * Called by postcopy_start() with the source stopped: send the ranges of
+ * pages that are dirty, so that the destination drops any stale copy it
+ * received during precopy and faults them in from us instead.
+ *
+ * Returns: 0 on success, negative on a stream error
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    uint64_t starts[MAX_DISCARDS_PER_COMMAND];
+    uint64_t lengths[MAX_DISCARDS_PER_COMMAND];
+    unsigned long *bitmap;
+    RAMBlock *block;
+
+    rcu_read_lock();
+
+    /* This should be our last sync, the source is now paused */
+    migration_bitmap_sync();
+    bitmap = atomic_rcu_read(&migration_bitmap);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = (block->offset + block->used_length)
+                            >> TARGET_PAGE_BITS;
+        unsigned long run_start, run_end;
+        uint16_t n = 0;
+
+        run_start = find_next_bit(bitmap, end, first);
+        while (run_start < end) {
+            run_end = find_next_zero_bit(bitmap, end, run_start + 1);
+            starts[n] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+            lengths[n] = (uint64_t)(run_end - run_start) << TARGET_PAGE_BITS;
+            if (++n == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                      n, starts, lengths);
+                n = 0;
+            }
+            run_start = find_next_bit(bitmap, end, run_end + 1);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  n, starts, lengths);
+        }
+    }
+
+    rcu_read_unlock();
+
+    return qemu_file_get_error(ms->file);
+}
+
+/*
+ * Discard a range of pages the destination received during precopy that
+ * the source has dirtied since; called for POSTCOPY_RAM_DISCARD.
+ *
+ * Returns: 0 on success
+ */
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length)
+{
+    RAMBlock *rb;
+    int ret = -1;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(rb, &ram_list.blocks, next) {
+        if (!strcmp(block_name, rb->idstr)) {
+            break;
+        }
+    }
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    if (start + length > rb->used_length ||
+        (start | length) & ~TARGET_PAGE_MASK) {
+        error_report("ram_discard_range: Bad range %" PRIx64 "/%zx in '%s'",
+                     start, length, block_name);
+        goto err;
+    }
+
+    ret = postcopy_ram_discard_range(mis, rb->host + start, length);
+
+err:
+    rcu_read_unlock();
+
+    return ret;
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -1058,9 +2423,11 @@ static void reset_ram_globals(void)
 {
     last_seen_block = NULL;
     last_sent_block = NULL;
+    page_batch.num = 0;
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    free_page_hinting = false;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -1072,7 +2439,9 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
      */
     if (migration_bitmap) {
         unsigned long *old_bitmap = migration_bitmap, *bitmap;
+        unsigned long *old_clear = migration_clear_bitmap, *clear;
         bitmap = bitmap_new(new);
+        clear = bitmap_new(DIV_ROUND_UP(new, 1 << CLEAR_BITMAP_SHIFT));
 
         /* prevent migration_bitmap content from being set bit
          * by migration_bitmap_sync_range() at the same time.
@@ -1082,11 +2451,15 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         qemu_mutex_lock(&migration_bitmap_mutex);
         bitmap_copy(bitmap, old_bitmap, old);
         bitmap_set(bitmap, old, new - old);
+        bitmap_copy(clear, old_clear,
+                    DIV_ROUND_UP(old, 1 << CLEAR_BITMAP_SHIFT));
         atomic_rcu_set(&migration_bitmap, bitmap);
+        atomic_rcu_set(&migration_clear_bitmap, clear);
         qemu_mutex_unlock(&migration_bitmap_mutex);
         migration_dirty_pages += new - old;
         synchronize_rcu();
         g_free(old_bitmap);
+        g_free(old_clear);
     }
 }
 
@@ -1101,12 +2474,15 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (multifd_send_setup() < 0) {
+        return -1;
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -1147,6 +2523,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_clear_bitmap = bitmap_new(DIV_ROUND_UP(ram_bitmap_pages,
+                                                     1 << CLEAR_BITMAP_SHIFT));
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -1154,6 +2532,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    /* RAM handed over to the destination is never sent */
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ram_block_is_passed(block)) {
+            bitmap_clear(migration_bitmap, block->offset >> TARGET_PAGE_BITS,
+                         block->used_length >> TARGET_PAGE_BITS);
+            migration_dirty_pages -= block->used_length >> TARGET_PAGE_BITS;
+        }
+    }
+
+    precopy_notify(PRECOPY_NOTIFY_SETUP);
     memory_global_dirty_log_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
@@ -1165,6 +2553,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_local_shared_ram() || migrate_ignore_shared()) {
+            qemu_put_byte(f, ram_block_is_passed(block));
+            if (migrate_local_shared_ram() && ram_block_is_passed(block) &&
+                qemu_file_send_fd(f, block->fd) < 0) {
+                error_report("Failed to pass the memory of RAM block \"%s\"",
+                             block->idstr);
+                rcu_read_unlock();
+                return -EINVAL;
+            }
+        }
     }
 
     rcu_read_unlock();
@@ -1193,6 +2591,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     smp_rmb();
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    multifd_send_sync(f, false, &bytes_transferred);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
@@ -1206,7 +2605,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         pages_sent += pages;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -1223,6 +2621,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    bytes_transferred += page_batch_flush(f);
+    multifd_send_drain(f);
     rcu_read_unlock();
 
     /*
@@ -1250,6 +2650,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     migration_bitmap_sync();
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+    multifd_send_sync(f, false, &bytes_transferred);
 
     /* try transferring iterative blocks of memory */
 
@@ -1265,6 +2666,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    bytes_transferred += page_batch_flush(f);
+    multifd_send_sync(f, true, &bytes_transferred);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -1362,6 +2765,69 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* Must be called from within a rcu critical section.
+ * Loads a RAM_SAVE_FLAG_PAGE_BATCH record, @addr and @flags are those of
+ * the first page.
+ */
+static int load_page_batch(QEMUFile *f, ram_addr_t addr, int flags,
+                           bool postcopy_running)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *host[PAGE_BATCH_MAX_PAGES];
+    ram_addr_t offset;
+    uint32_t i, num;
+    int ret;
+
+    host[0] = host_from_stream_offset(f, addr, flags);
+    if (!host[0]) {
+        error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+        return -EINVAL;
+    }
+    num = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (num == 0 || num > PAGE_BATCH_MAX_PAGES) {
+        error_report("Invalid batch of %u pages", num);
+        return -EINVAL;
+    }
+    for (i = 1; i < num; i++) {
+        offset = qemu_get_be64(f);
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+        /* the other pages are in the block of the first one */
+        host[i] = NULL;
+        if (!(offset & ~TARGET_PAGE_MASK)) {
+            host[i] = host_from_stream_offset(f, offset,
+                                              RAM_SAVE_FLAG_CONTINUE);
+        }
+        if (!host[i]) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT, offset);
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        if (postcopy_running) {
+            void *page = postcopy_get_tmp_page(mis);
+
+            if (!page) {
+                return -ENOMEM;
+            }
+            qemu_get_buffer(f, page, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(mis, host[i], page);
+            if (ret) {
+                return ret;
+            }
+        } else {
+            qemu_get_buffer(f, host[i], TARGET_PAGE_SIZE);
+        }
+    }
+
+    return qemu_file_get_error(f);
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1375,46 +2841,62 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 
 static void *do_data_decompress(void *opaque)
 {
-    DecompressParam *param = opaque;
+    DecompressJob *job;
     unsigned long pagesize;
 
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
-            }
-            param->start = false;
+    qemu_mutex_lock(&decomp_lock);
+    while (true) {
+        while (QSIMPLEQ_EMPTY(&decomp_pending) && !quit_decomp_thread) {
+            qemu_cond_wait(&decomp_cond, &decomp_lock);
         }
-        qemu_mutex_unlock(&param->mutex);
+        if (quit_decomp_thread) {
+            break;
+        }
+        job = QSIMPLEQ_FIRST(&decomp_pending);
+        QSIMPLEQ_REMOVE_HEAD(&decomp_pending, next);
+        qemu_mutex_unlock(&decomp_lock);
+
+        pagesize = TARGET_PAGE_SIZE;
+        /* uncompress() will return failed in some case, especially
+         * when the page is dirted when doing the compression, it's
+         * not a problem because the dirty page will be retransferred
+         * and uncompress() won't break the data in other pages.
+         */
+        uncompress((Bytef *)job->des, &pagesize,
+                   (const Bytef *)job->compbuf, job->len);
+
+        qemu_mutex_lock(&decomp_lock);
+        QSIMPLEQ_INSERT_TAIL(&decomp_free, job, next);
+        decomp_busy--;
+        qemu_cond_signal(&decomp_done_cond);
     }
+    qemu_mutex_unlock(&decomp_lock);
 
     return NULL;
 }
 
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
+    int i, thread_count, job_count;
 
     thread_count = migrate_decompress_threads();
+    job_count = thread_count * DECOMPRESS_JOBS_PER_THREAD;
     decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    decomp_jobs = g_new0(DecompressJob, job_count);
+    qemu_mutex_init(&decomp_lock);
+    qemu_cond_init(&decomp_cond);
+    qemu_cond_init(&decomp_done_cond);
+    QSIMPLEQ_INIT(&decomp_free);
+    QSIMPLEQ_INIT(&decomp_pending);
+    decomp_busy = 0;
     quit_decomp_thread = false;
+    for (i = 0; i < job_count; i++) {
+        decomp_jobs[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        QSIMPLEQ_INSERT_TAIL(&decomp_free, &decomp_jobs[i], next);
+    }
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
         qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
+                           do_data_decompress, NULL,
                            QEMU_THREAD_JOINABLE);
     }
 }
@@ -1423,47 +2905,106 @@ void migrate_decompress_threads_join(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+    if (!decomp_jobs) {
+        return;
     }
+    thread_count = migrate_decompress_threads();
+    qemu_mutex_lock(&decomp_lock);
+    quit_decomp_thread = true;
+    qemu_cond_broadcast(&decomp_cond);
+    qemu_mutex_unlock(&decomp_lock);
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
     }
+    for (i = 0; i < thread_count * DECOMPRESS_JOBS_PER_THREAD; i++) {
+        g_free(decomp_jobs[i].compbuf);
+    }
+    qemu_mutex_destroy(&decomp_lock);
+    qemu_cond_destroy(&decomp_cond);
+    qemu_cond_destroy(&decomp_done_cond);
     g_free(decompress_threads);
-    g_free(decomp_param);
-    g_free(compressed_data_buf);
+    g_free(decomp_jobs);
     decompress_threads = NULL;
-    decomp_param = NULL;
-    compressed_data_buf = NULL;
+    decomp_jobs = NULL;
 }
 
-static void decompress_data_with_multi_threads(uint8_t *compbuf,
-                                               void *host, int len)
+/* Read @len bytes of compressed data from @f and queue them to be
+ * decompressed into @host.  Waits for a free job if all of them are busy.
+ */
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len)
 {
-    int idx, thread_count;
+    DecompressJob *job;
 
-    thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
-                break;
-            }
-        }
-        if (idx < thread_count) {
-            break;
-        }
+    qemu_mutex_lock(&decomp_lock);
+    while (QSIMPLEQ_EMPTY(&decomp_free)) {
+        qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+    }
+    job = QSIMPLEQ_FIRST(&decomp_free);
+    QSIMPLEQ_REMOVE_HEAD(&decomp_free, next);
+    decomp_busy++;
+    qemu_mutex_unlock(&decomp_lock);
+
+    /* The lock is not held here: reading may yield the coroutine */
+    qemu_get_buffer(f, job->compbuf, len);
+    job->des = host;
+    job->len = len;
+
+    qemu_mutex_lock(&decomp_lock);
+    QSIMPLEQ_INSERT_TAIL(&decomp_pending, job, next);
+    qemu_cond_signal(&decomp_cond);
+    qemu_mutex_unlock(&decomp_lock);
+}
+
+/* Wait until every queued page is in guest RAM */
+static void wait_for_decompress_done(void)
+{
+    if (!decomp_jobs) {
+        return;
     }
+    qemu_mutex_lock(&decomp_lock);
+    while (decomp_busy) {
+        qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+    }
+    qemu_mutex_unlock(&decomp_lock);
+}
+
+/*
+ * Map the memory of @block that the source passed as a file descriptor
+ * instead of the block's own.
+ */
+static int ram_load_passed_block(QEMUFile *f, RAMBlock *block)
+{
+    Error *local_err = NULL;
+    int fd;
+
+    fd = qemu_file_recv_fd(f);
+    if (fd < 0) {
+        error_report("Failed to receive the memory of RAM block \"%s\"",
+                     block->idstr);
+        return fd;
+    }
+    if (qemu_ram_adopt_fd(block, fd, &local_err) < 0) {
+        error_report_err(local_err);
+        close(fd);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * With x-ignore-shared, the memory of @block was left in its file, which
+ * must back the block here too.  A private mapping of the file makes a
+ * copy-on-write clone of the source's memory.
+ */
+static int ram_load_ignored_block(RAMBlock *block)
+{
+    if (block->fd < 0) {
+        error_report("RAM block \"%s\" was not sent, it must be backed by "
+                     "the file that backs it on the source", block->idstr);
+        return -EINVAL;
+    }
+    return 0;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -1471,6 +3012,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    /*
+     * Once postcopy is listening the guest may be running, so pages have to
+     * be placed atomically, which also wakes any vCPU waiting for them.
+     */
+    bool postcopy_running = postcopy_state_get() >=
+                            POSTCOPY_INCOMING_LISTENING;
 
     seq_iter++;
 
@@ -1517,6 +3065,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                                 error_report_err(local_err);
                             }
                         }
+                        if (!ret && (migrate_local_shared_ram() ||
+                                     migrate_ignore_shared()) &&
+                            qemu_get_byte(f)) {
+                            ret = migrate_local_shared_ram() ?
+                                  ram_load_passed_block(f, block) :
+                                  ram_load_ignored_block(block);
+                        }
                         ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                               block->idstr);
                         break;
@@ -1531,6 +3086,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_use_multifd()) {
+                ret = multifd_recv_setup();
+            }
             break;
         case RAM_SAVE_FLAG_COMPRESS:
             host = host_from_stream_offset(f, addr, flags);
@@ -1540,6 +3098,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             ch = qemu_get_byte(f);
+            if (postcopy_running) {
+                if (ch == 0) {
+                    ret = postcopy_place_page_zero(mis, host);
+                } else {
+                    void *page = postcopy_get_tmp_page(mis);
+
+                    if (!page) {
+                        ret = -ENOMEM;
+                        break;
+                    }
+                    memset(page, ch, TARGET_PAGE_SIZE);
+                    ret = postcopy_place_page(mis, host, page);
+                }
+                break;
+            }
             ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
             break;
         case RAM_SAVE_FLAG_PAGE:
@@ -1549,9 +3122,28 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            if (postcopy_running) {
+                void *page = postcopy_get_tmp_page(mis);
+
+                if (!page) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                qemu_get_buffer(f, page, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, page);
+                break;
+            }
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
+        case RAM_SAVE_FLAG_PAGE_BATCH:
+            ret = load_page_batch(f, addr, flags, postcopy_running);
+            break;
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            if (postcopy_running) {
+                error_report("Compressed page received during postcopy");
+                ret = -EINVAL;
+                break;
+            }
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 error_report("Invalid RAM offset " RAM_ADDR_FMT, addr);
@@ -1565,10 +3157,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            decompress_data_with_multi_threads(f, host, len);
             break;
         case RAM_SAVE_FLAG_XBZRLE:
+            if (postcopy_running) {
+                error_report("XBZRLE page received during postcopy");
+                ret = -EINVAL;
+                break;
+            }
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
@@ -1582,6 +3178,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1599,6 +3198,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    /* The pages must be in place before the device state is loaded, and
+     * the RAM blocks they go to are only protected by rcu_read_lock()
+     */
+    wait_for_decompress_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -1617,54 +3220,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
-{
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
-    }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
-}
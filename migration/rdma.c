@@ -48,6 +48,28 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * RAM can be written over up to this many queue pairs, each one its own
+ * RC connection to the destination.  The first one also carries the
+ * control channel.  All of them share one completion queue.
+ */
+#define RDMA_MAX_QPS 16
+
+/*
+ * Only one RDMA write in this many asks for a completion; it retires the
+ * unsignaled writes posted before it on the same queue pair.
+ */
+#define RDMA_SIGNAL_INTERVAL 16
+
+/*
+ * Writes in flight on one queue pair.  One slot of the send queue is left
+ * for the control channel, which never has more than one SEND posted.
+ */
+#define RDMA_QP_WRITES_MAX (RDMA_SIGNALED_SEND_MAX - 1)
+
+/* Chunks the destination is asked to register in one round trip */
+#define RDMA_REG_AHEAD 8
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -67,12 +89,16 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_MULTI_QP 0x02   /* extra queue pairs for RAM */
+#define RDMA_CAPABILITY_REG_AHEAD 0x04  /* several chunks per registration */
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_MULTI_QP |
+                                     RDMA_CAPABILITY_REG_AHEAD;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -193,18 +219,25 @@ typedef struct {
 typedef struct {
     uint32_t version;
     uint32_t flags;
+    /*
+     * With RDMA_CAPABILITY_MULTI_QP: the number of queue pairs on the
+     * first connection, and the index of the queue pair on the others.
+     */
+    uint32_t qps;
 } RDMACapabilities;
 
 static void caps_to_network(RDMACapabilities *cap)
 {
     cap->version = htonl(cap->version);
     cap->flags = htonl(cap->flags);
+    cap->qps = htonl(cap->qps);
 }
 
 static void network_to_caps(RDMACapabilities *cap)
 {
     cap->version = ntohl(cap->version);
     cap->flags = ntohl(cap->flags);
+    cap->qps = ntohl(cap->qps);
 }
 
 /*
@@ -288,6 +321,28 @@ typedef struct RDMALocalBlocks {
     RDMALocalBlock *block;
 } RDMALocalBlocks;
 
+/*
+ * An RDMA write that has been posted but not retired yet.  Writes to
+ * RDMA_WRID_NONE were posted without data, only to get a completion.
+ */
+typedef struct RDMAPostedWrite {
+    uint64_t wr_id;
+    bool signaled;
+} RDMAPostedWrite;
+
+/*
+ * A queue pair that RAM is written over.  Writes complete in order, so a
+ * signaled completion retires all the writes in 'posted' up to it.
+ */
+typedef struct RDMAQueuePair {
+    struct rdma_cm_id *cm_id;
+    struct ibv_qp *qp;
+    RDMAPostedWrite posted[RDMA_QP_WRITES_MAX];
+    int posted_first;
+    int nb_posted;
+    int nb_unsignaled;          /* writes since the last signaled one */
+} RDMAQueuePair;
+
 /*
  * Main data structure for RDMA state.
  * While there is only one copy of this structure being allocated right now,
@@ -341,6 +396,13 @@ typedef struct RDMAContext {
     struct ibv_pd *pd;                      /* protection domain */
     struct ibv_cq *cq;                      /* completion queue */
 
+    /* RAM is written over these, qps[0] is cm_id and qp above */
+    RDMAQueuePair qps[RDMA_MAX_QPS];
+    int nb_qps;
+
+    /* The destination registers several chunks per request */
+    bool reg_ahead;
+
     /*
      * If a previous write failed (perhaps because of a failed
      * memory registration, then do not attempt any future work
@@ -1053,9 +1115,10 @@ err_alloc_pd_cq:
 }
 
 /*
- * Create queue pairs.
+ * Create a queue pair on @cm_id.
  */
-static int qemu_rdma_alloc_qp(RDMAContext *rdma)
+static struct ibv_qp *qemu_rdma_create_qp(RDMAContext *rdma,
+                                          struct rdma_cm_id *cm_id)
 {
     struct ibv_qp_init_attr attr = { 0 };
     int ret;
@@ -1068,15 +1131,53 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     attr.recv_cq = rdma->cq;
     attr.qp_type = IBV_QPT_RC;
 
-    ret = rdma_create_qp(rdma->cm_id, rdma->pd, &attr);
+    ret = rdma_create_qp(cm_id, rdma->pd, &attr);
     if (ret) {
+        return NULL;
+    }
+
+    return cm_id->qp;
+}
+
+/*
+ * Create the queue pair of the control channel.
+ */
+static int qemu_rdma_alloc_qp(RDMAContext *rdma)
+{
+    rdma->qp = qemu_rdma_create_qp(rdma, rdma->cm_id);
+    if (!rdma->qp) {
         return -1;
     }
 
-    rdma->qp = rdma->cm_id->qp;
+    rdma->qps[0].cm_id = rdma->cm_id;
+    rdma->qps[0].qp = rdma->qp;
     return 0;
 }
 
+/*
+ * Wait for the next connection manager event, which must be @expected.
+ */
+static int qemu_rdma_wait_cm_event(RDMAContext *rdma,
+                                   enum rdma_cm_event_type expected)
+{
+    struct rdma_cm_event *cm_event;
+    int ret;
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        return ret;
+    }
+
+    if (cm_event->event != expected) {
+        error_report("rdma migration: expected %s, got %s",
+                     rdma_event_str(expected),
+                     rdma_event_str(cm_event->event));
+        ret = -EINVAL;
+    }
+    rdma_ack_cm_event(cm_event);
+    return ret;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
@@ -1375,6 +1476,79 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
     }
 }
 
+static RDMAQueuePair *qemu_rdma_qp_by_num(RDMAContext *rdma, uint32_t qp_num)
+{
+    int i;
+
+    for (i = 0; i < rdma->nb_qps; i++) {
+        if (rdma->qps[i].qp && rdma->qps[i].qp->qp_num == qp_num) {
+            return &rdma->qps[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The queue pair that writes of @chunk in block @index go to.  A chunk
+ * always uses the same one, so that its writes stay ordered.
+ */
+static RDMAQueuePair *qemu_rdma_qp_for_chunk(RDMAContext *rdma,
+                                             uint64_t index, uint64_t chunk)
+{
+    return &rdma->qps[(index + chunk) % rdma->nb_qps];
+}
+
+static void qemu_rdma_complete_write(RDMAContext *rdma, uint64_t wr_id)
+{
+    uint64_t chunk = (wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+    uint64_t index = (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
+
+    trace_qemu_rdma_poll_write(print_wrid(RDMA_WRID_RDMA_WRITE),
+                               RDMA_WRID_RDMA_WRITE, rdma->nb_sent,
+                               index, chunk, block->local_host_addr,
+                               (void *)(uintptr_t)block->remote_host_addr);
+
+    clear_bit(chunk, block->transit_bitmap);
+
+    if (rdma->nb_sent > 0) {
+        rdma->nb_sent--;
+    }
+
+    if (!rdma->pin_all) {
+        /*
+         * FYI: If one wanted to signal a specific chunk to be unregistered
+         * using LRU or workload-specific information, this is the function
+         * you would call to do so. That chunk would then get asynchronously
+         * unregistered later.
+         */
+#ifdef RDMA_UNREGISTRATION_EXAMPLE
+        qemu_rdma_signal_unregister(rdma, index, chunk, wr_id);
+#endif
+    }
+}
+
+/*
+ * A signaled write completed on @qp.  Writes complete in order, so it
+ * and every unsignaled write posted before it are done.
+ */
+static void qemu_rdma_retire_writes(RDMAContext *rdma, RDMAQueuePair *qp)
+{
+    while (qp->nb_posted) {
+        RDMAPostedWrite *w = &qp->posted[qp->posted_first];
+
+        qp->posted_first = (qp->posted_first + 1) % RDMA_QP_WRITES_MAX;
+        qp->nb_posted--;
+
+        if (w->wr_id != RDMA_WRID_NONE) {
+            qemu_rdma_complete_write(rdma, w->wr_id);
+        }
+        if (w->signaled) {
+            break;
+        }
+    }
+}
+
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1417,33 +1591,14 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
     }
 
     if (wr_id == RDMA_WRID_RDMA_WRITE) {
-        uint64_t chunk =
-            (wc.wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
-        uint64_t index =
-            (wc.wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
-        RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
-
-        trace_qemu_rdma_poll_write(print_wrid(wr_id), wr_id, rdma->nb_sent,
-                                   index, chunk, block->local_host_addr,
-                                   (void *)(uintptr_t)block->remote_host_addr);
-
-        clear_bit(chunk, block->transit_bitmap);
-
-        if (rdma->nb_sent > 0) {
-            rdma->nb_sent--;
-        }
+        RDMAQueuePair *qp = qemu_rdma_qp_by_num(rdma, wc.qp_num);
 
-        if (!rdma->pin_all) {
-            /*
-             * FYI: If one wanted to signal a specific chunk to be unregistered
-             * using LRU or workload-specific information, this is the function
-             * you would call to do so. That chunk would then get asynchronously
-             * unregistered later.
-             */
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-            qemu_rdma_signal_unregister(rdma, index, chunk, wc.wr_id);
-#endif
+        if (!qp) {
+            error_report("rdma migration: write completion on unknown QP %u",
+                         wc.qp_num);
+            return -1;
         }
+        qemu_rdma_retire_writes(rdma, qp);
     } else {
         trace_qemu_rdma_poll_other(print_wrid(wr_id), wr_id, rdma->nb_sent);
     }
@@ -1557,6 +1712,73 @@ err_block_for_wrid:
     return ret;
 }
 
+/*
+ * Post an RDMA write on @qp and remember it until it is retired.  Only
+ * every RDMA_SIGNAL_INTERVAL-th write asks for a completion, unless
+ * @signal; the last free slot always does, so that a full queue pair
+ * always has a completion coming.
+ *
+ * Returns ENOMEM if @qp has no free slot, like ibv_post_send().
+ */
+static int qemu_rdma_post_write(RDMAQueuePair *qp,
+                                struct ibv_send_wr *send_wr,
+                                uint64_t wr_id, bool signal)
+{
+    struct ibv_send_wr *bad_wr;
+    RDMAPostedWrite *w;
+    int ret;
+
+    if (qp->nb_posted == RDMA_QP_WRITES_MAX) {
+        return ENOMEM;
+    }
+
+    signal = signal || qp->nb_unsignaled + 1 >= RDMA_SIGNAL_INTERVAL ||
+             qp->nb_posted + 1 == RDMA_QP_WRITES_MAX;
+    send_wr->send_flags = signal ? IBV_SEND_SIGNALED : 0;
+
+    ret = ibv_post_send(qp->qp, send_wr, &bad_wr);
+    if (ret) {
+        return ret;
+    }
+
+    w = &qp->posted[(qp->posted_first + qp->nb_posted) % RDMA_QP_WRITES_MAX];
+    w->wr_id = wr_id;
+    w->signaled = signal;
+    qp->nb_posted++;
+    qp->nb_unsignaled = signal ? 0 : qp->nb_unsignaled + 1;
+    return 0;
+}
+
+/*
+ * Make sure that every write posted so far will complete: post a signaled
+ * write without data behind the unsignaled ones.  A zero length write has
+ * no remote key to check.
+ */
+static int qemu_rdma_signal_qps(RDMAContext *rdma)
+{
+    int i, ret;
+
+    for (i = 0; i < rdma->nb_qps; i++) {
+        RDMAQueuePair *qp = &rdma->qps[i];
+        struct ibv_send_wr send_wr = {
+            .wr_id = RDMA_WRID_RDMA_WRITE,
+            .opcode = IBV_WR_RDMA_WRITE,
+        };
+
+        if (!qp->nb_unsignaled) {
+            continue;
+        }
+
+        ret = qemu_rdma_post_write(qp, &send_wr, RDMA_WRID_NONE, true);
+        if (ret) {
+            error_report("rdma migration: cannot signal queue pair %d: %s",
+                         i, strerror(ret));
+            return -ret;
+        }
+    }
+    return 0;
+}
+
 /*
  * Post a SEND message work request for the control channel
  * containing some data and block until the post completes.
@@ -1843,11 +2065,39 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Pick up to @max chunks of @block after @chunk that the destination can
+ * register together with it: not registered yet and not zero, since zero
+ * chunks are sent without RDMA.
+ */
+static int qemu_rdma_find_reg_ahead(RDMALocalBlock *block, uint64_t chunk,
+                                    uint64_t *ahead, int max)
+{
+    uint64_t c;
+    int n = 0;
+
+    for (c = chunk + 1; c < block->nb_chunks && c <= chunk + max; c++) {
+        uint8_t *start = ram_chunk_start(block, c);
+        size_t len = ram_chunk_end(block, c) - start;
+
+        if (block->remote_keys[c] || test_bit(c, block->transit_bitmap)) {
+            continue;
+        }
+        if (!can_use_buffer_find_nonzero_offset(start, len) ||
+            buffer_find_nonzero_offset(start, len) == len) {
+            continue;
+        }
+        ahead[n++] = c;
+    }
+    return n;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
  * If we're using dynamic registration on the dest-side, we have to
- * send a registration command first.
+ * send a registration command first.  When the destination allows it,
+ * the chunks that follow are registered in the same round trip.
  */
 static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
                                int current_index, uint64_t current_addr,
@@ -1855,12 +2105,14 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
 {
     struct ibv_sge sge;
     struct ibv_send_wr send_wr = { 0 };
-    struct ibv_send_wr *bad_wr;
     int reg_result_idx, ret, count = 0;
+    int nb_regs, i;
     uint64_t chunk, chunks;
+    uint64_t ahead[RDMA_REG_AHEAD - 1];
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMAQueuePair *qp;
+    RDMARegister reg[RDMA_REG_AHEAD];
     RDMARegisterResult *reg_result;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
@@ -1896,6 +2148,7 @@ retry:
                                   (1UL << RDMA_REG_CHUNK_SHIFT) / 1024 / 1024);
 
     chunk_end = ram_chunk_end(block, chunk + chunks);
+    qp = qemu_rdma_qp_for_chunk(rdma, current_index, chunk);
 
     if (!rdma->pin_all) {
 #ifdef RDMA_UNREGISTRATION_EXAMPLE
@@ -1908,7 +2161,10 @@ retry:
         trace_qemu_rdma_write_one_block(count++, current_index, chunk,
                 sge.addr, length, rdma->nb_sent, block->nb_chunks);
 
-        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        ret = qemu_rdma_signal_qps(rdma);
+        if (ret == 0) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        }
 
         if (ret < 0) {
             error_report("Failed to Wait for previous write to complete "
@@ -1960,23 +2216,44 @@ retry:
             /*
              * Otherwise, tell other side to register.
              */
-            reg.current_index = current_index;
+            reg[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                reg[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                reg[0].key.chunk = chunk;
             }
-            reg.chunks = chunks;
+            reg[0].chunks = chunks;
+
+            nb_regs = 1;
+            if (rdma->reg_ahead && block->is_ram_block) {
+                nb_regs += qemu_rdma_find_reg_ahead(block, chunk + chunks,
+                                                    ahead, RDMA_REG_AHEAD - 1);
+            }
+            for (i = 1; i < nb_regs; i++) {
+                reg[i].current_index = current_index;
+                reg[i].key.current_addr = block->offset +
+                    (ahead[i - 1] << RDMA_REG_CHUNK_SHIFT);
+                reg[i].chunks = 0;
+            }
+            head.repeat = nb_regs;
+            head.len = nb_regs * sizeof(RDMARegister);
 
             trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
                                               current_addr);
 
-            register_to_network(rdma, &reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            for (i = 0; i < nb_regs; i++) {
+                register_to_network(rdma, &reg[i]);
+            }
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) reg,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
             }
+            if (resp.len < nb_regs * sizeof(RDMARegisterResult)) {
+                error_report("rdma migration: short registration result "
+                             "(%u bytes for %d chunks)", resp.len, nb_regs);
+                return -EIO;
+            }
 
             /* try to overlap this single registration with the one we sent. */
             if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
@@ -1989,13 +2266,18 @@ retry:
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            for (i = 0; i < nb_regs; i++) {
+                network_to_result(&reg_result[i]);
+            }
 
             trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
                                                  reg_result->rkey, chunk);
 
             block->remote_keys[chunk] = reg_result->rkey;
             block->remote_host_addr = reg_result->host_addr;
+            for (i = 1; i < nb_regs; i++) {
+                block->remote_keys[ahead[i - 1]] = reg_result[i].rkey;
+            }
         } else {
             /* already registered before */
             if (qemu_rdma_register_and_get_keys(rdma, block, sge.addr,
@@ -2028,7 +2310,6 @@ retry:
                                         current_index, chunk);
 
     send_wr.opcode = IBV_WR_RDMA_WRITE;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
     send_wr.sg_list = &sge;
     send_wr.num_sge = 1;
     send_wr.wr.rdma.remote_addr = block->remote_host_addr +
@@ -2041,7 +2322,7 @@ retry:
      * ibv_post_send() does not return negative error numbers,
      * per the specification they are positive - no idea why.
      */
-    ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
+    ret = qemu_rdma_post_write(qp, &send_wr, send_wr.wr_id, false);
 
     if (ret == ENOMEM) {
         trace_qemu_rdma_write_one_queue_full();
@@ -2216,9 +2497,25 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
             }
         }
         trace_qemu_rdma_cleanup_disconnect();
-        rdma->connected = false;
     }
 
+    for (idx = 1; idx < RDMA_MAX_QPS; idx++) {
+        RDMAQueuePair *qp = &rdma->qps[idx];
+
+        if (qp->qp) {
+            if (rdma->connected) {
+                rdma_disconnect(qp->cm_id);
+            }
+            rdma_destroy_qp(qp->cm_id);
+            qp->qp = NULL;
+        }
+        if (qp->cm_id) {
+            rdma_destroy_id(qp->cm_id);
+            qp->cm_id = NULL;
+        }
+    }
+    rdma->connected = false;
+
     g_free(rdma->dest_blocks);
     rdma->dest_blocks = NULL;
 
@@ -2330,11 +2627,78 @@ err_rdma_source_init:
     return -1;
 }
 
+/*
+ * Connect queue pair @idx to the destination, next to the connection of
+ * the control channel.  It shares the protection domain and completion
+ * queue with it, so it must be on the same device.
+ */
+static int qemu_rdma_connect_qp(RDMAContext *rdma, int idx, Error **errp)
+{
+    RDMAQueuePair *qp = &rdma->qps[idx];
+    RDMACapabilities cap = {
+                                .version = RDMA_CONTROL_VERSION_CURRENT,
+                                .flags = RDMA_CAPABILITY_MULTI_QP,
+                                .qps = idx,
+                           };
+    struct rdma_conn_param conn_param = { .initiator_depth = 2,
+                                          .retry_count = 5,
+                                          .private_data = &cap,
+                                          .private_data_len = sizeof(cap),
+                                        };
+    int ret;
+
+    caps_to_network(&cap);
+
+    ret = rdma_create_id(rdma->channel, &qp->cm_id, NULL, RDMA_PS_TCP);
+    if (ret) {
+        ERROR(errp, "could not create id for queue pair %d", idx);
+        return -1;
+    }
+
+    ret = rdma_resolve_addr(qp->cm_id, NULL, rdma_get_peer_addr(rdma->cm_id),
+                            RDMA_RESOLVE_TIMEOUT_MS);
+    if (!ret) {
+        ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ADDR_RESOLVED);
+    }
+    if (!ret) {
+        ret = rdma_resolve_route(qp->cm_id, RDMA_RESOLVE_TIMEOUT_MS);
+    }
+    if (!ret) {
+        ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ROUTE_RESOLVED);
+    }
+    if (ret) {
+        ERROR(errp, "could not resolve route for queue pair %d", idx);
+        return -1;
+    }
+
+    if (qp->cm_id->verbs != rdma->verbs) {
+        ERROR(errp, "queue pair %d resolved to another device", idx);
+        return -1;
+    }
+
+    qp->qp = qemu_rdma_create_qp(rdma, qp->cm_id);
+    if (!qp->qp) {
+        ERROR(errp, "could not create queue pair %d", idx);
+        return -1;
+    }
+
+    ret = rdma_connect(qp->cm_id, &conn_param);
+    if (!ret) {
+        ret = qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED);
+    }
+    if (ret) {
+        ERROR(errp, "connecting queue pair %d to destination", idx);
+        return -1;
+    }
+
+    return 0;
+}
+
 static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 {
     RDMACapabilities cap = {
                                 .version = RDMA_CONTROL_VERSION_CURRENT,
-                                .flags = 0,
+                                .flags = RDMA_CAPABILITY_REG_AHEAD,
                            };
     struct rdma_conn_param conn_param = { .initiator_depth = 2,
                                           .retry_count = 5,
@@ -2342,7 +2706,7 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
                                           .private_data_len = sizeof(cap),
                                         };
     struct rdma_cm_event *cm_event;
-    int ret;
+    int ret, i;
 
     /*
      * Only negotiate the capability with destination if the user
@@ -2352,6 +2716,10 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    if (rdma->nb_qps > 1) {
+        cap.flags |= RDMA_CAPABILITY_MULTI_QP;
+        cap.qps = rdma->nb_qps;
+    }
 
     caps_to_network(&cap);
 
@@ -2393,6 +2761,21 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
+    if (rdma->nb_qps > 1) {
+        if (cap.flags & RDMA_CAPABILITY_MULTI_QP) {
+            rdma->nb_qps = MIN(rdma->nb_qps, MAX(cap.qps, 1));
+        } else {
+            error_report("rdma migration: destination supports only one "
+                         "queue pair");
+            rdma->nb_qps = 1;
+        }
+    }
+    /* With pin-all, RAM blocks are registered up front anyway */
+    rdma->reg_ahead = !rdma->pin_all &&
+                      (cap.flags & RDMA_CAPABILITY_REG_AHEAD);
+
+    trace_qemu_rdma_connect_qps_outcome(rdma->nb_qps, rdma->reg_ahead);
+
     rdma_ack_cm_event(cm_event);
 
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
@@ -2401,6 +2784,12 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         goto err_rdma_source_connect;
     }
 
+    for (i = 1; i < rdma->nb_qps; i++) {
+        if (qemu_rdma_connect_qp(rdma, i, errp)) {
+            goto err_rdma_source_connect;
+        }
+    }
+
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
     return 0;
@@ -2497,6 +2886,7 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         rdma = g_malloc0(sizeof(RDMAContext));
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        rdma->nb_qps = 1;
 
         addr = inet_parse(host_port, NULL);
         if (addr != NULL) {
@@ -2633,6 +3023,10 @@ static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
         return -EIO;
     }
 
+    if (qemu_rdma_signal_qps(rdma) < 0) {
+        return -EIO;
+    }
+
     while (rdma->nb_sent) {
         ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
         if (ret < 0) {
@@ -2789,6 +3183,66 @@ err:
     return ret;
 }
 
+/*
+ * Accept the connection of queue pair @idx, which the source makes right
+ * after the one of the control channel.
+ */
+static int qemu_rdma_accept_qp(RDMAContext *rdma, int idx)
+{
+    RDMAQueuePair *qp = &rdma->qps[idx];
+    RDMACapabilities cap;
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    struct rdma_cm_event *cm_event;
+    int ret;
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        return ret;
+    }
+
+    if (cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+        error_report("rdma migration: expected connection of queue pair %d, "
+                     "got %s", idx, rdma_event_str(cm_event->event));
+        rdma_ack_cm_event(cm_event);
+        return -EINVAL;
+    }
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+    qp->cm_id = cm_event->id;
+    rdma_ack_cm_event(cm_event);
+
+    if (!(cap.flags & RDMA_CAPABILITY_MULTI_QP) || cap.qps != idx) {
+        error_report("rdma migration: unexpected connection for queue "
+                     "pair %d", idx);
+        return -EINVAL;
+    }
+    if (qp->cm_id->verbs != rdma->verbs) {
+        error_report("rdma migration: queue pair %d is on another device",
+                     idx);
+        return -EINVAL;
+    }
+
+    qp->qp = qemu_rdma_create_qp(rdma, qp->cm_id);
+    if (!qp->qp) {
+        error_report("rdma migration: error allocating queue pair %d", idx);
+        return -EINVAL;
+    }
+
+    caps_to_network(&cap);
+    ret = rdma_accept(qp->cm_id, &conn_param);
+    if (ret) {
+        error_report("rdma_accept of queue pair %d returns %d", idx, ret);
+        return ret;
+    }
+
+    return qemu_rdma_wait_cm_event(rdma, RDMA_CM_EVENT_ESTABLISHED);
+}
+
 static int qemu_rdma_accept(RDMAContext *rdma)
 {
     RDMACapabilities cap;
@@ -2835,6 +3289,10 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
+    if (cap.flags & RDMA_CAPABILITY_MULTI_QP) {
+        rdma->nb_qps = MIN(MAX(cap.qps, 1), RDMA_MAX_QPS);
+        cap.qps = rdma->nb_qps;
+    }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
@@ -2912,6 +3370,14 @@ static int qemu_rdma_accept(RDMAContext *rdma)
         goto err_rdma_dest_wait;
     }
 
+    trace_qemu_rdma_accept_qps(rdma->nb_qps);
+    for (idx = 1; idx < rdma->nb_qps; idx++) {
+        ret = qemu_rdma_accept_qp(rdma, idx);
+        if (ret) {
+            goto err_rdma_dest_wait;
+        }
+    }
+
     qemu_rdma_dump_gid("dest_connect", rdma->cm_id);
 
     return 0;
@@ -3073,6 +3539,7 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
             trace_qemu_rdma_registration_handle_register(head.repeat);
 
             reg_resp.repeat = head.repeat;
+            reg_resp.len = sizeof(RDMARegisterResult) * head.repeat;
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
@@ -3490,6 +3957,7 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    rdma->nb_qps = migrate_rdma_qps();
     ret = qemu_rdma_source_init(rdma, &local_err,
         s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]);
 
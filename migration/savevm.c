@@ -48,6 +48,7 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "migration/postcopy-ram.h"
 
 
 #ifndef ETH_P_RARP
@@ -59,6 +60,23 @@
 
 static bool skip_section_footers;
 
+static struct mig_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} mig_cmd_args[] = {
+    [MIG_CMD_INVALID]          = { .len = -1, .name = "INVALID" },
+    [MIG_CMD_POSTCOPY_ADVISE]  = { .len =  8, .name = "POSTCOPY_ADVISE" },
+    [MIG_CMD_POSTCOPY_LISTEN]  = { .len =  0, .name = "POSTCOPY_LISTEN" },
+    [MIG_CMD_POSTCOPY_RUN]     = { .len =  0, .name = "POSTCOPY_RUN" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
+                                   .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
+    [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
+};
+
+/* Returned by a command handler to stop loading the current stream */
+#define LOADVM_QUIT 1
+
 static int announce_self_create(uint8_t *buf,
                                 uint8_t *mac_addr)
 {
@@ -697,6 +715,130 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/* Send a 'QEMU_VM_COMMAND' type element with the command
+ * and associated data.
+ */
+static void qemu_savevm_command_send(QEMUFile *f,
+                                     enum qemu_vm_cmd command,
+                                     uint16_t len,
+                                     uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (unsigned int)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+/* Send prior to any postcopy transfer; carries our page size so that the
+ * destination can check it is able to place pages of that size.
+ */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t tmp = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    trace_qemu_savevm_send_postcopy_advise();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, sizeof(tmp),
+                             (uint8_t *)&tmp);
+}
+
+/* Sent prior to starting the destination running in postcopy, discard pages
+ * that have already been sent but redirtied on the source.
+ * CMD_POSTCOPY_RAM_DISCARD consist of:
+ *      byte   Length of name field (not including 0)
+ *  n x byte   RAM block name
+ *      be64   Start of range
+ *      be64   Length
+ *             ... more start/length pairs
+ *
+ * name:  RAMBlock name that these entries are part of
+ * len: Number of page entries
+ * start_list: 'len' addresses
+ * length_list: 'len' addresses
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_qemu_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(1 + name_len + len * 16);
+    buf[0] = name_len;
+    memcpy(buf + 1, name, name_len);
+    tmplen = 1 + name_len;
+
+    for (t = 0; t < len; t++) {
+        stq_be_p(buf + tmplen, start_list[t]);
+        tmplen += 8;
+        stq_be_p(buf + tmplen, length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    trace_qemu_savevm_send_postcopy_listen();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    trace_qemu_savevm_send_postcopy_run();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, so the command contains just the length of the
+ * extra buffer that we then send straight after it.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const QEMUSizedBuffer *qsb)
+{
+    size_t cur_iov;
+    size_t len = qsb_get_length(qsb);
+    uint32_t tmp;
+
+    if (len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %zu",
+                     __func__, len);
+        return -1;
+    }
+
+    tmp = cpu_to_be32(len);
+
+    trace_qemu_savevm_send_packaged();
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
+
+    /* all the data follows (concatenating the iov's) */
+    for (cur_iov = 0; cur_iov < qsb->n_iov; cur_iov++) {
+        /* The iov entries are partially filled */
+        size_t towrite = MIN(qsb->iov[cur_iov].iov_len, len);
+        len -= towrite;
+
+        if (!towrite) {
+            break;
+        }
+
+        qemu_put_buffer(f, qsb->iov[cur_iov].iov_base, towrite);
+    }
+
+    return 0;
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -809,17 +951,12 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/* Send the END sections of all the live (iterable) sections */
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -838,8 +975,67 @@ void qemu_savevm_state_complete(QEMUFile *f)
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finish the live sections once postcopy has sent the rest of the device
+ * state; there is no vmdescription since the devices were sent separately.
+ */
+void qemu_savevm_state_complete_postcopy(QEMUFile *f)
+{
+    trace_savevm_state_complete_postcopy();
+
+    if (qemu_savevm_state_complete_live(f)) {
+        return;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/*
+ * Save the state of all the non-iterable devices; used by postcopy to
+ * build the package the destination loads before it starts running.
+ */
+void qemu_savevm_state_save_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
+            continue;
+        }
+        if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+            trace_savevm_section_skip(se->idstr, se->section_id);
+            continue;
         }
+
+        trace_savevm_section_start(se->idstr, se->section_id);
+        save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        vmstate_save(f, se, NULL);
+        trace_savevm_section_end(se->idstr, se->section_id, 0);
+        save_section_footer(f, se);
+    }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f)) {
+        return;
     }
 
     vmdesc = qjson_new();
@@ -1046,62 +1242,362 @@ static bool check_section_footer(QEMUFile *f, LoadStateEntry *le)
     return true;
 }
 
-void loadvm_free_handlers(MigrationIncomingState *mis)
+/* Called with the BQL held from a bottom half once the device state that
+ * came with POSTCOPY_RUN has been loaded.
+ */
+static void loadvm_postcopy_handle_run_bh(void *opaque)
 {
-    LoadStateEntry *le, *new_le;
+    Error *local_err = NULL;
+    MigrationIncomingState *mis = opaque;
 
-    QLIST_FOREACH_SAFE(le, &mis->loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    cpu_synchronize_all_post_init();
+
+    qemu_announce_self();
+
+    /* Make sure all file formats flush their mutable metadata */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+
+    trace_loadvm_postcopy_handle_run_vmstart();
+
+    if (autostart) {
+        /* Hold onto your hats, starting the CPU */
+        vm_start();
+    } else {
+        /* leave it paused and let management decide when to start the CPU */
+        runstate_set(RUN_STATE_PAUSED);
     }
+
+    qemu_bh_delete(mis->bh);
+    mis->bh = NULL;
 }
 
-int qemu_loadvm_state(QEMUFile *f)
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_RUNNING);
+
+    trace_loadvm_postcopy_handle_run();
+    if (ps != POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    mis->bh = qemu_bh_new(loadvm_postcopy_handle_run_bh, mis);
+    qemu_bh_schedule(mis->bh);
+
+    /* We need to finish reading the stream from the package
+     * and also stop reading anything more from the stream that loaded the
+     * package (since it's now being read by the listener thread).
+     * LOADVM_QUIT will quit all the layers of nested loadvm loops.
+     */
+    return LOADVM_QUIT;
+}
+
+/*
+ * Triggered by a postcopy_listen command; this thread takes over reading
+ * the input stream, leaving the main thread free to carry on loading the rest
+ * of the device state (from RAM).
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
 {
+    QEMUFile *f = opaque;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    Error *local_err = NULL;
-    uint8_t section_type;
-    unsigned int v;
-    int ret;
-    int file_error_after_eof = -1;
+    int load_res;
 
-    if (qemu_savevm_state_blocked(&local_err)) {
-        error_report_err(local_err);
-        return -EINVAL;
+    rcu_register_thread();
+    trace_postcopy_ram_listen_thread_start();
+
+    /*
+     * Because we're a thread and not a coroutine we can't yield
+     * in qemu_file, and thus we must be blocking now.
+     */
+    qemu_set_block(qemu_get_fd(f));
+    load_res = qemu_loadvm_state_main(f, mis);
+    trace_postcopy_ram_listen_thread_exit();
+
+    if (load_res < 0) {
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        qemu_file_set_error(f, load_res);
+    } else {
+        /*
+         * This looks good, but it's possible that the device loading in the
+         * main thread hasn't finished yet, and so we might not be in 'RUN'
+         * state yet; wait for the end of the main thread.
+         */
+        qemu_event_wait(&mis->main_thread_load_event);
     }
+    postcopy_ram_incoming_cleanup(mis);
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+    migrate_send_rp_shut(mis, load_res < 0);
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        error_report("Not a migration stream");
-        return -EINVAL;
+    qemu_mutex_lock_iothread();
+    mis->have_listen_thread = false;
+    /* Does not return if the load failed */
+    migration_incoming_finish(mis, load_res);
+    migrate_decompress_threads_join();
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_LISTENING);
+
+    trace_loadvm_postcopy_handle_listen();
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)", ps);
+        return -1;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        error_report("SaveVM v2 format is obsolete and don't work anymore");
-        return -ENOTSUP;
+    /* The return path is how the fault thread asks for pages */
+    mis->to_src_file = qemu_file_get_return_path(mis->file);
+    if (!mis->to_src_file) {
+        error_report("CMD_POSTCOPY_LISTEN: Unable to open return path");
+        return -1;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        error_report("Unsupported migration stream version");
-        return -ENOTSUP;
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
     }
 
-    if (!savevm_state.skip_configuration) {
-        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
-            error_report("Configuration section missing");
-            return -EINVAL;
-        }
-        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+    mis->have_listen_thread = true;
+    /* Start up the listening thread and wait for it to signal ready */
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->file,
+                       QEMU_THREAD_DETACHED);
+
+    return 0;
+}
+
+/* Receive an advise that postcopy may be used, and check we can do it. */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    PostcopyState ps = postcopy_state_set(POSTCOPY_INCOMING_ADVISE);
+    uint64_t remote_tps;
+
+    trace_loadvm_postcopy_handle_advise();
+    if (ps != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)", ps);
+        return -1;
+    }
 
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    remote_tps = qemu_get_be64(f);
+    if (remote_tps != TARGET_PAGE_SIZE) {
+        error_report("Postcopy needs matching target page sizes (s=%d d=%d)",
+                     (int)remote_tps, TARGET_PAGE_SIZE);
+        return -1;
+    }
+
+    if (postcopy_ram_incoming_init(mis)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              QEMUFile *f, uint16_t len)
+{
+    int tmp;
+    char ramid[256];
+    PostcopyState ps = postcopy_state_get();
+
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    switch (ps) {
+    case POSTCOPY_INCOMING_ADVISE:
+        /* 1st discard */
+        postcopy_state_set(POSTCOPY_INCOMING_DISCARD);
+        break;
+
+    case POSTCOPY_INCOMING_DISCARD:
+        /* Expected state */
+        break;
+
+    default:
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     ps);
+        return -1;
+    }
+    /* We're expecting a
+     *    byte: RAM block name length
+     *    n x byte: RAM block name
+     *    (be64 start, be64 length) x n
+     */
+    if (len < 1) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    tmp = qemu_get_byte(f);
+    if (tmp + 1 > len) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid name length (%d)",
+                     tmp);
+        return -1;
+    }
+    qemu_get_buffer(f, (uint8_t *)ramid, tmp);
+    ramid[tmp] = '\0';
+    len -= 1 + tmp;
+
+    if (len % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    trace_loadvm_postcopy_ram_handle_discard_header(ramid, len);
+    while (len) {
+        uint64_t start_addr, block_length;
+        int ret;
+
+        start_addr = qemu_get_be64(f);
+        block_length = qemu_get_be64(f);
+
+        len -= 16;
+        ret = ram_discard_range(mis, ramid, start_addr, block_length);
         if (ret) {
             return ret;
         }
     }
+    trace_loadvm_postcopy_ram_handle_discard_end();
+
+    return 0;
+}
+
+/*
+ * Immediately following this command is a blob of data containing an embedded
+ * chunk of migration stream; read it and load it.
+ */
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis,
+                                      QEMUFile *f)
+{
+    int ret;
+    uint8_t *buffer;
+    uint32_t length;
+    QEMUSizedBuffer *qsb;
+    QEMUFile *packf;
+
+    length = qemu_get_be32(f);
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+    buffer = g_malloc0(length);
+    ret = qemu_get_buffer(f, buffer, (int)length);
+    if (ret != length) {
+        g_free(buffer);
+        error_report("CMD_PACKAGED: Buffer receive fail ret=%d length=%d",
+                     ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+    trace_loadvm_handle_cmd_packaged_received(ret);
+
+    /* Setup a dummy QEMUFile that actually reads from the buffer */
+    qsb = qsb_create(buffer, length);
+    g_free(buffer); /* Because qsb_create copies */
+    if (!qsb) {
+        error_report("Unable to create qsb");
+        return -ENOMEM;
+    }
+    packf = qemu_bufopen("r", qsb);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    trace_loadvm_handle_cmd_packaged_main(ret);
+    qemu_fclose(packf);
+    qsb_free(qsb);
+
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * 0           just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ * <0          Error
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint16_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+
+    trace_loadvm_process_command(cmd, len);
+    if (cmd >= MIG_CMD_MAX || cmd == MIG_CMD_INVALID) {
+        error_report("MIG_CMD 0x%x unknown (len 0x%x)", cmd, len);
+        return -EINVAL;
+    }
+
+    if (mig_cmd_args[cmd].len != -1 && mig_cmd_args[cmd].len != len) {
+        error_report("%s received with bad length - expecting %zu, got %d",
+                     mig_cmd_args[cmd].name,
+                     (size_t)mig_cmd_args[cmd].len, len);
+        return -ERANGE;
+    }
+
+    switch (cmd) {
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(mis, f);
+
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise(mis, f);
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen(mis);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, f, len);
+    }
+
+    return 0;
+}
+
+void loadvm_free_handlers(MigrationIncomingState *mis)
+{
+    LoadStateEntry *le, *new_le;
+
+    QLIST_FOREACH_SAFE(le, &mis->loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/*
+ * Load sections until QEMU_VM_EOF.  Returns 0 at the end of the stream,
+ * LOADVM_QUIT if a command asked to stop reading it, or a negative errno.
+ */
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    uint8_t section_type;
+    int ret = 0;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
-        LoadStateEntry *le;
+        LoadStateEntry *le, full_le;
         char idstr[256];
 
         trace_qemu_loadvm_state_section(section_type);
@@ -1125,35 +1621,41 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 error_report("Unknown savevm section or instance '%s' %d",
                              idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 error_report("savevm: unsupported version %d for '%s' v%d",
                              version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
-
+            /* Add entry.  Only START sections are looked up again, and
+             * they all arrive before postcopy starts; keeping FULL ones off
+             * the list means the postcopy listen thread can walk it while
+             * the main thread is still loading the device state.
+             */
+            if (section_type == QEMU_VM_SECTION_START) {
+                le = g_malloc0(sizeof(*le));
+            } else {
+                le = &full_le;
+            }
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            if (section_type == QEMU_VM_SECTION_START) {
+                QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
+            }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state for instance 0x%x of"
                              " device '%s'", instance_id, idstr);
-                goto out;
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -1168,34 +1670,94 @@ int qemu_loadvm_state(QEMUFile *f)
             }
             if (le == NULL) {
                 error_report("Unknown savevm section %d", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state section id %d(%s)",
                              section_id, le->se->idstr);
-                goto out;
+                return ret;
             }
             if (!check_section_footer(f, le)) {
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            trace_qemu_loadvm_state_section_command(ret);
+            if (ret) {
+                return ret;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    file_error_after_eof = qemu_file_get_error(f);
+    return 0;
+}
 
-    /*
-     * Try to read in the VMDESC section as well, so that dumping tools that
-     * intercept our migration stream have the chance to see it.
-     */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
+    uint8_t section_type;
+    unsigned int v;
+    int ret;
+    int file_error_after_eof = -1;
+
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        error_report("Not a migration stream");
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        error_report("SaveVM v2 format is obsolete and don't work anymore");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        error_report("Unsupported migration stream version");
+        return -ENOTSUP;
+    }
+
+    if (!savevm_state.skip_configuration) {
+        if (qemu_get_byte(f) != QEMU_VM_CONFIGURATION) {
+            error_report("Configuration section missing");
+            return -EINVAL;
+        }
+        ret = vmstate_load_state(f, &vmstate_configuration, &savevm_state, 0);
+
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret == LOADVM_QUIT) {
+        /* Postcopy: the listen thread reads the rest of the stream and the
+         * guest is started from the POSTCOPY_RUN bottom half.
+         */
+        return 0;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    file_error_after_eof = qemu_file_get_error(f);
+
+    /*
+     * Try to read in the VMDESC section as well, so that dumping tools that
+     * intercept our migration stream have the chance to see it.
+     */
 
     /* We've got to be careful; if we don't read the data and just shut the fd
      * then the sender can error if we close while it's still sending.
@@ -1229,15 +1791,8 @@ int qemu_loadvm_state(QEMUFile *f)
 
     cpu_synchronize_all_post_init();
 
-    ret = 0;
-
-out:
-    if (ret == 0) {
-        /* We may not have a VMDESC section, so ignore relative errors */
-        ret = file_error_after_eof;
-    }
-
-    return ret;
+    /* We may not have a VMDESC section, so ignore relative errors */
+    return file_error_after_eof;
 }
 
 static BlockDriverState *find_vmstate_bs(void)
@@ -1280,18 +1835,30 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void hmp_savevm(Monitor *mon, const QDict *qdict)
+/* Date the snapshot @sn; called once the guest is stopped */
+static void savevm_set_time(QEMUSnapshotInfo *sn)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/*
+ * Common part of savevm and savevm -l: check that a snapshot can be taken,
+ * pick the image for the VM state and fill in the name of the snapshot.
+ * Returns the image, or NULL after telling the user why not.
+ */
+static BlockDriverState *savevm_prepare(Monitor *mon, const char *name,
+                                        QEMUSnapshotInfo *sn)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
     qemu_timeval tv;
     struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
-    Error *local_err = NULL;
+    int ret;
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -1304,33 +1871,18 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         if (!bdrv_can_snapshot(bs)) {
             monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
                                bdrv_get_device_name(bs));
-            return;
+            return NULL;
         }
     }
 
     bs = find_vmstate_bs();
     if (!bs) {
         monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        return NULL;
     }
 
-    saved_vm_running = runstate_is_running();
-
-    ret = global_state_store();
-    if (ret) {
-        monitor_printf(mon, "Error saving global state\n");
-        return;
-    }
-    vm_stop(RUN_STATE_SAVE_VM);
-
     memset(sn, 0, sizeof(*sn));
 
-    /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
         if (ret >= 0) {
@@ -1340,11 +1892,368 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
             pstrcpy(sn->name, sizeof(sn->name), name);
         }
     } else {
+        qemu_gettimeofday(&tv);
         /* cast below needed for OpenBSD where tv_sec is still 'long' */
         localtime_r((const time_t *)&tv.tv_sec, &tm);
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
     }
 
+    return bs;
+}
+
+/*
+ * Create the snapshot @sn in every image that supports snapshots; @bs is
+ * the one that holds the VM state.  Returns the number of failures.
+ */
+static int savevm_create_snapshots(BlockDriverState *bs,
+                                   QEMUSnapshotInfo *sn,
+                                   uint64_t vm_state_size, Error **errp)
+{
+    BlockDriverState *bs1;
+    int failures = 0;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                if (!failures) {
+                    error_setg_errno(errp, -ret,
+                                     "Error while creating snapshot on '%s'",
+                                     bdrv_get_device_name(bs1));
+                }
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+/*
+ * Live snapshots: RAM is written to the VM state like in a precopy
+ * migration, while the guest keeps running, and the guest is only stopped
+ * once what it dirtied in the meantime can be written within the maximum
+ * downtime of migrations.  The snapshot is of that point in time, when the
+ * device state is saved and the images are snapshotted.
+ *
+ * This runs in its own thread.  All accesses to the image go through
+ * savevm_live_write_ops, which take the iothread lock.
+ */
+
+typedef enum SaveVMLiveStatus {
+    SAVEVM_LIVE_STATUS_NONE,
+    SAVEVM_LIVE_STATUS_ACTIVE,
+    SAVEVM_LIVE_STATUS_COMPLETED,
+    SAVEVM_LIVE_STATUS_FAILED,
+} SaveVMLiveStatus;
+
+/* Recompute the write bandwidth this often (ms) */
+#define SAVEVM_LIVE_BUFFER_DELAY 100
+/* Stop the guest anyway after this many passes over its dirty RAM */
+#define SAVEVM_LIVE_MAX_SYNCS 30
+
+typedef struct SaveVMLiveState {
+    QemuThread thread;
+    QEMUBH *cleanup_bh;
+    QEMUFile *file;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    SaveVMLiveStatus status;
+    Error *err;
+    int64_t start_time;
+    int64_t total_time;
+    int64_t downtime;
+    uint64_t vm_state_size;
+} SaveVMLiveState;
+
+static SaveVMLiveState savevm_live;
+
+bool savevm_live_active(void)
+{
+    return savevm_live.status == SAVEVM_LIVE_STATUS_ACTIVE;
+}
+
+static ssize_t savevm_live_writev_buffer(void *opaque, struct iovec *iov,
+                                         int iovcnt, int64_t pos)
+{
+    bool locked = qemu_mutex_iothread_locked();
+    ssize_t ret;
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    ret = block_writev_buffer(opaque, iov, iovcnt, pos);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+}
+
+static int savevm_live_put_buffer(void *opaque, const uint8_t *buf,
+                                  int64_t pos, int size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    bdrv_save_vmstate(opaque, buf, pos, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return size;
+}
+
+static const QEMUFileOps savevm_live_write_ops = {
+    .put_buffer     = savevm_live_put_buffer,
+    .writev_buffer  = savevm_live_writev_buffer,
+    .close          = bdrv_fclose
+};
+
+/* Stop the guest and finish the snapshot; called with the iothread lock */
+static int savevm_live_complete(SaveVMLiveState *s)
+{
+    QEMUSnapshotInfo *sn = &s->sn;
+    int64_t stop_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    bool was_running = runstate_is_running();
+    int ret;
+
+    ret = global_state_store();
+    if (ret) {
+        error_setg(&s->err, "Error saving global state");
+        return ret;
+    }
+    ret = vm_stop_force_state(RUN_STATE_SAVE_VM);
+    if (ret < 0) {
+        error_setg_errno(&s->err, -ret, "Cannot stop the guest");
+        return ret;
+    }
+
+    /* The snapshot is of now, not of when it was started */
+    savevm_set_time(sn);
+
+    qemu_savevm_state_complete(s->file);
+    ret = qemu_file_get_error(s->file);
+    s->vm_state_size = qemu_ftell(s->file);
+    if (!ret) {
+        ret = qemu_fclose(s->file);
+        s->file = NULL;
+    }
+    if (ret < 0) {
+        error_setg_errno(&s->err, -ret, "Error while writing VM state");
+    } else if (savevm_create_snapshots(s->bs, sn, s->vm_state_size,
+                                       &s->err)) {
+        ret = -EIO;
+    }
+
+    if (was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - stop_time;
+    return ret;
+}
+
+static void *savevm_live_thread(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    MigrationState *ms = migrate_get_current();
+    int64_t initial_time, initial_bytes = 0;
+    int64_t first_sync;
+    uint64_t max_size = 0, pending;
+    int ret;
+
+    rcu_register_thread();
+
+    qemu_savevm_state_header(s->file);
+    qemu_savevm_state_begin(s->file, &params);
+    first_sync = ms->dirty_sync_count;
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    while (qemu_file_get_error(s->file) == 0) {
+        int64_t current_time;
+
+        pending = qemu_savevm_state_pending(s->file, max_size);
+        trace_savevm_live_pending(pending, max_size);
+        if (max_size && (pending < max_size ||
+            ms->dirty_sync_count - first_sync >= SAVEVM_LIVE_MAX_SYNCS)) {
+            break;
+        }
+        qemu_savevm_state_iterate(s->file);
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + SAVEVM_LIVE_BUFFER_DELAY) {
+            int64_t written = qemu_ftell(s->file) - initial_bytes;
+            double bandwidth = (double)written /
+                               (current_time - initial_time);
+
+            /* At least one byte, so that a stalled disk still terminates */
+            max_size = MAX(bandwidth * migrate_max_downtime() / 1000000, 1);
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(s->file);
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        error_setg_errno(&s->err, -ret, "Error while writing VM state");
+    } else {
+        ret = savevm_live_complete(s);
+    }
+    if (ret) {
+        qemu_savevm_state_cancel();
+        s->status = SAVEVM_LIVE_STATUS_FAILED;
+    } else {
+        s->status = SAVEVM_LIVE_STATUS_COMPLETED;
+    }
+    if (s->file) {
+        qemu_fclose(s->file);
+        s->file = NULL;
+    }
+    s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->start_time;
+    trace_savevm_live_end(ret, s->total_time, s->downtime);
+    qemu_bh_schedule(s->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void savevm_live_cleanup(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->cleanup_bh);
+    s->cleanup_bh = NULL;
+}
+
+static void savevm_live_start(Monitor *mon, const char *name)
+{
+    SaveVMLiveState *s = &savevm_live;
+    MigrationState *ms = migrate_get_current();
+    BlockDriverState *bs;
+    Error *local_err = NULL;
+
+    if (s->status == SAVEVM_LIVE_STATUS_ACTIVE || s->cleanup_bh) {
+        monitor_printf(mon, "A live snapshot is already in progress\n");
+        return;
+    }
+    if (ms->state == MIGRATION_STATUS_ACTIVE ||
+        ms->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+        ms->state == MIGRATION_STATUS_SETUP ||
+        ms->state == MIGRATION_STATUS_CANCELLING) {
+        monitor_printf(mon, "A migration is in progress\n");
+        return;
+    }
+    if (dirty_rate_measuring()) {
+        monitor_printf(mon, "A dirty rate measurement is in progress\n");
+        return;
+    }
+    if (qemu_savevm_state_blocked(&local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    bs = savevm_prepare(mon, name, &s->sn);
+    if (!bs) {
+        return;
+    }
+    if (name && del_existing_snapshots(mon, name) < 0) {
+        return;
+    }
+
+    error_free(s->err);
+    s->err = NULL;
+    s->bs = bs;
+    s->file = qemu_fopen_ops(bs, &savevm_live_write_ops);
+    if (!s->file) {
+        monitor_printf(mon, "Could not open VM state file\n");
+        return;
+    }
+    s->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    s->total_time = 0;
+    s->downtime = 0;
+    s->vm_state_size = 0;
+    s->status = SAVEVM_LIVE_STATUS_ACTIVE;
+    s->cleanup_bh = qemu_bh_new(savevm_live_cleanup, s);
+    trace_savevm_live_start(s->sn.name);
+
+    qemu_thread_create(&s->thread, "savevm", savevm_live_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    monitor_printf(mon, "Live snapshot '%s' started\n", s->sn.name);
+}
+
+void hmp_info_savevm(Monitor *mon, const QDict *qdict)
+{
+    SaveVMLiveState *s = &savevm_live;
+
+    switch (s->status) {
+    case SAVEVM_LIVE_STATUS_NONE:
+        monitor_printf(mon, "No live snapshot was taken\n");
+        return;
+    case SAVEVM_LIVE_STATUS_ACTIVE:
+        monitor_printf(mon, "Live snapshot '%s': active, %" PRId64
+                       " ms, %" PRId64 " kbytes written\n", s->sn.name,
+                       qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->start_time,
+                       s->file ? qemu_ftell(s->file) >> 10 : 0);
+        return;
+    case SAVEVM_LIVE_STATUS_COMPLETED:
+        monitor_printf(mon, "Live snapshot '%s': completed in %" PRId64
+                       " ms, guest stopped for %" PRId64 " ms, "
+                       "%" PRIu64 " kbytes of VM state\n", s->sn.name,
+                       s->total_time, s->downtime, s->vm_state_size >> 10);
+        return;
+    case SAVEVM_LIVE_STATUS_FAILED:
+        monitor_printf(mon, "Live snapshot '%s': failed: %s\n", s->sn.name,
+                       s->err ? error_get_pretty(s->err) : "unknown error");
+        return;
+    }
+}
+
+void hmp_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+    Error *local_err = NULL;
+
+    if (qdict_get_try_bool(qdict, "live", false)) {
+        savevm_live_start(mon, name);
+        return;
+    }
+    if (savevm_live_active()) {
+        monitor_printf(mon, "A live snapshot is in progress\n");
+        return;
+    }
+
+    bs = savevm_prepare(mon, name, sn);
+    if (!bs) {
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+
+    ret = global_state_store();
+    if (ret) {
+        monitor_printf(mon, "Error saving global state\n");
+        return;
+    }
+    vm_stop(RUN_STATE_SAVE_VM);
+    savevm_set_time(sn);
+
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
         goto the_end;
@@ -1366,18 +2275,9 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
+    if (savevm_create_snapshots(bs, sn, vm_state_size, &local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
     }
 
  the_end:
@@ -1420,6 +2320,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live_active()) {
+        error_report("A live snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = find_vmstate_bs();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
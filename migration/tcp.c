@@ -50,6 +50,9 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    if (migrate_use_multifd()) {
+        s->multifd_host_port = g_strdup(host_port);
+    }
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -66,7 +69,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
+    if (c >= 0 && migrate_use_multifd()) {
+        /* the other channels are accepted by the RAM loading code */
+        multifd_recv_set_listener(s);
+    } else {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -70,11 +70,221 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * The fields of a VMStateDescription are compiled into a plan the first
+ * time it is saved or loaded.  Unconditional fields that are plain bytes or
+ * integers in big endian and that follow each other in the device state
+ * become one step, done with one buffer copy instead of a call through
+ * VMStateInfo for every element.  Anything else is a step of its own that
+ * interprets the field.
+ */
+typedef struct VMStateStep {
+    VMStateField *field;        /* first field */
+    int nb_fields;
+    int width;                  /* 0: interpret the field, 1: bytes, else
+                                   size of the big endian integers */
+    int version_id;             /* newest field of the step */
+    size_t offset;
+    size_t count;               /* elements of @width bytes */
+} VMStateStep;
+
+typedef struct VMStatePlan {
+    int nb_steps;
+    VMStateStep *steps;
+} VMStatePlan;
+
+/* VMStateDescription -> VMStatePlan, protected by the iothread lock */
+static GHashTable *vmstate_plans;
+
+/* Element size if @field can be part of a batched step, or 0 */
+static int vmstate_field_width(VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+
+    if (field->field_exists ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER))) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    } else if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        return field->size == 1 ? 1 : 0;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        return field->size == 2 ? 2 : 0;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        return field->size == 4 ? 4 : 0;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        return field->size == 8 ? 8 : 0;
+    }
+    return 0;
+}
+
+static VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+    VMStateStep *step = NULL;
+    VMStateField *field;
+    int nb_fields = 0;
+
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(NULL, NULL);
+    }
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (plan) {
+        return plan;
+    }
+
+    for (field = vmsd->fields; field->name; field++) {
+        nb_fields++;
+    }
+    plan = g_new0(VMStatePlan, 1);
+    plan->steps = g_new0(VMStateStep, nb_fields);
+
+    for (field = vmsd->fields; field->name; field++) {
+        int width = vmstate_field_width(field);
+        size_t count = 0;
+
+        if (width) {
+            count = (field->flags & VMS_ARRAY ? field->num : 1) *
+                    field->size / width;
+        }
+        if (step && width && step->width == width &&
+            step->offset + step->count * width == field->offset) {
+            step->nb_fields++;
+            step->count += count;
+            step->version_id = MAX(step->version_id, field->version_id);
+            continue;
+        }
+
+        step = &plan->steps[plan->nb_steps++];
+        step->field = field;
+        step->nb_fields = 1;
+        step->width = width;
+        step->version_id = field->version_id;
+        step->offset = field->offset;
+        step->count = count;
+    }
+
+    trace_vmstate_plan(vmsd->name, nb_fields, plan->nb_steps);
+    g_hash_table_insert(vmstate_plans, (void *)vmsd, plan);
+    return plan;
+}
+
+static void vmstate_save_step(QEMUFile *f, VMStateStep *step, void *opaque)
+{
+    uint8_t *p = opaque + step->offset;
+    uint64_t buf[64];
+    size_t done, n, i;
+
+    if (step->width == 1) {
+        qemu_put_buffer(f, p, step->count);
+        return;
+    }
+
+    for (done = 0; done < step->count; done += n) {
+        n = MIN(step->count - done, sizeof(buf) / step->width);
+        for (i = 0; i < n; i++) {
+            switch (step->width) {
+            case 2:
+                ((uint16_t *)buf)[i] = cpu_to_be16(((uint16_t *)p)[done + i]);
+                break;
+            case 4:
+                ((uint32_t *)buf)[i] = cpu_to_be32(((uint32_t *)p)[done + i]);
+                break;
+            default:
+                buf[i] = cpu_to_be64(((uint64_t *)p)[done + i]);
+                break;
+            }
+        }
+        qemu_put_buffer(f, (uint8_t *)buf, n * step->width);
+    }
+}
+
+static void vmstate_load_step(QEMUFile *f, VMStateStep *step, void *opaque)
+{
+    uint8_t *p = opaque + step->offset;
+    uint64_t buf[64];
+    size_t done, n, i;
+
+    if (step->width == 1) {
+        qemu_get_buffer(f, p, step->count);
+        return;
+    }
+
+    for (done = 0; done < step->count; done += n) {
+        n = MIN(step->count - done, sizeof(buf) / step->width);
+        if (qemu_get_buffer(f, (uint8_t *)buf, n * step->width) !=
+            n * step->width) {
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            switch (step->width) {
+            case 2:
+                ((uint16_t *)p)[done + i] = be16_to_cpu(((uint16_t *)buf)[i]);
+                break;
+            case 4:
+                ((uint32_t *)p)[done + i] = be32_to_cpu(((uint32_t *)buf)[i]);
+                break;
+            default:
+                ((uint64_t *)p)[done + i] = be64_to_cpu(buf[i]);
+                break;
+            }
+        }
+    }
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              VMStateField *field, void *opaque,
+                              int version_id)
+{
+    int ret = 0;
+
+    trace_vmstate_load_state_field(vmsd->name, field->name);
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, true);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, addr,
+                                         field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, addr, size);
+
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        error_report("Input validation failed: %s/%s",
+                     vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    VMStateField *field = vmsd->fields;
+    VMStatePlan *plan;
     int ret = 0;
+    int i, j;
 
     trace_vmstate_load_state(vmsd->name, version_id);
     if (version_id > vmsd->version_id) {
@@ -97,44 +307,28 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, true);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr,
-                                             field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
+    plan = vmstate_get_plan(vmsd);
+    for (i = 0; i < plan->nb_steps; i++) {
+        VMStateStep *step = &plan->steps[i];
+
+        if (step->width && step->version_id <= version_id) {
+            vmstate_load_step(f, step, opaque);
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                trace_vmstate_load_field_error(step->field->name, ret);
+                return ret;
+            }
+            continue;
+        }
 
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
+        /* Some fields of the step may be too new for this stream */
+        for (j = 0; j < step->nb_fields; j++) {
+            ret = vmstate_load_field(f, vmsd, step->field + j, opaque,
+                                     version_id);
+            if (ret < 0) {
+                return ret;
             }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            error_report("Input validation failed: %s/%s",
-                         vmsd->name, field->name);
-            return -1;
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -287,10 +481,55 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 }
 
 
+static void vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                               VMStateField *field, void *opaque,
+                               QJSON *vmdesc)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, vmsd->version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, false);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+        int64_t old_offset, written_bytes;
+        QJSON *vmdesc_loop = vmdesc;
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+            old_offset = qemu_ftell_fast(f);
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
+            } else {
+                field->info->put(f, addr, size);
+            }
+
+            written_bytes = qemu_ftell_fast(f) - old_offset;
+            vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+
+            /* Compressed arrays only care about the first element */
+            if (vmdesc_loop && vmsd_can_compress(field)) {
+                vmdesc_loop = NULL;
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            error_report("Output state validation failed: %s/%s",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+}
+
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
-    VMStateField *field = vmsd->fields;
+    VMStatePlan *plan = vmstate_get_plan(vmsd);
+    int i, j;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
@@ -302,46 +541,25 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
         json_start_array(vmdesc, "fields");
     }
 
-    while (field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, false);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-            int64_t old_offset, written_bytes;
-            QJSON *vmdesc_loop = vmdesc;
+    for (i = 0; i < plan->nb_steps; i++) {
+        VMStateStep *step = &plan->steps[i];
 
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
-                } else {
-                    field->info->put(f, addr, size);
-                }
+        if (!step->width) {
+            vmstate_save_field(f, vmsd, step->field, opaque, vmdesc);
+            continue;
+        }
 
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+        /* Describe the fields as if they had been saved one by one */
+        for (j = 0; vmdesc && j < step->nb_fields; j++) {
+            VMStateField *field = step->field + j;
+            int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
 
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
-                }
-            }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                error_report("Output state validation failed: %s/%s",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
+            if (n_elems) {
+                vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                vmsd_desc_field_end(vmsd, vmdesc, field, field->size, 0);
             }
         }
-        field++;
+        vmstate_save_step(f, step, opaque);
     }
 
     if (vmdesc) {
@@ -11,8 +11,261 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/host-cpuid.h"
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Run boundaries
+ *
+ * The encoder spends its time looking for the end of the current run:
+ * find_diff() returns the offset of the first byte at or after i where the
+ * two buffers differ, find_same() the offset of the first byte where they
+ * are equal.  Both return slen if there is no such byte.
+ *
+ * A generic version works a long at a time; vector versions are used when
+ * the host has them, and AVX2 is picked at runtime if the CPU supports it.
+ */
+typedef int (*XBZRLEFindFunc)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen);
+
+static inline int find_diff_bytes(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int find_same_bytes(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_diff_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    if (i % sizeof(long)) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+    return find_diff_bytes(old_buf, new_buf, i, slen);
+}
+
+static int find_same_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while (i < slen && i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    if (i % sizeof(long)) {
+        return i;
+    }
+
+    /* word at a time for speed, stop at the long holding a zero xor byte */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            break;
+        }
+        i += sizeof(long);
+    }
+    return find_same_bytes(old_buf, new_buf, i, slen);
+}
+
+#if defined(__SSE2__)
+static int find_diff_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+        i += 16;
+    }
+    return find_diff_bytes(old_buf, new_buf, i, slen);
+}
+
+static int find_same_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 16;
+    }
+    return find_same_bytes(old_buf, new_buf, i, slen);
+}
+
+static XBZRLEFindFunc find_diff = find_diff_sse2;
+static XBZRLEFindFunc find_same = find_same_sse2;
+#elif defined(__aarch64__)
+/* vmaxvq/vminvq are only available on AArch64 */
+static int find_diff_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 16 <= slen) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vminvq_u8(eq) != 0xff) {
+            return find_diff_bytes(old_buf, new_buf, i, i + 16);
+        }
+        i += 16;
+    }
+    return find_diff_bytes(old_buf, new_buf, i, slen);
+}
+
+static int find_same_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 16 <= slen) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vmaxvq_u8(eq)) {
+            return find_same_bytes(old_buf, new_buf, i, i + 16);
+        }
+        i += 16;
+    }
+    return find_same_bytes(old_buf, new_buf, i, slen);
+}
+
+static XBZRLEFindFunc find_diff = find_diff_neon;
+static XBZRLEFindFunc find_same = find_same_neon;
+#else
+static XBZRLEFindFunc find_diff = find_diff_long;
+static XBZRLEFindFunc find_same = find_same_long;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int find_diff_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+    return find_diff_bytes(old_buf, new_buf, i, slen);
+}
+
+static int find_same_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    return find_same_bytes(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    if (host_cpuid_has_avx2()) {
+        find_diff = find_diff_avx2;
+        find_same = find_same_avx2;
+    }
+}
+#endif
+
+/*
+ * Select the run boundary search; for the unit test, which checks that all
+ * the implementations give the same encoding.  Returns false if @name is
+ * not available on this host.
+ */
+bool xbzrle_set_accel(const char *name)
+{
+    if (!strcmp(name, "long")) {
+        find_diff = find_diff_long;
+        find_same = find_same_long;
+        return true;
+    }
+#if defined(__SSE2__)
+    if (!strcmp(name, "sse2")) {
+        find_diff = find_diff_sse2;
+        find_same = find_same_sse2;
+        return true;
+    }
+#elif defined(__aarch64__)
+    if (!strcmp(name, "neon")) {
+        find_diff = find_diff_neon;
+        find_same = find_same_neon;
+        return true;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (!strcmp(name, "avx2") && host_cpuid_has_avx2()) {
+        find_diff = find_diff_avx2;
+        find_same = find_same_avx2;
+        return true;
+    }
+#endif
+    if (!strcmp(name, "auto")) {
+#if defined(__SSE2__)
+        xbzrle_set_accel("sse2");
+#elif defined(__aarch64__)
+        xbzrle_set_accel("neon");
+#else
+        xbzrle_set_accel("long");
+#endif
+#ifdef CONFIG_AVX2_OPT
+        xbzrle_init_accel();
+#endif
+        return true;
+    }
+    return false;
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -28,8 +281,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    int next;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +292,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        next = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = next - i;
+        i = next;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,51 +308,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        next = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = next - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = next;
     }
 
     return d;
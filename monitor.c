@@ -381,8 +381,20 @@ static void monitor_json_emitter(Monitor *mon, const QObject *data)
 {
     QString *json;
 
-    json = mon->flags & MONITOR_USE_PRETTY ? qobject_to_json_pretty(data) :
-                                             qobject_to_json(data);
+    if (!(mon->flags & MONITOR_USE_PRETTY)) {
+        /*
+         * Compact JSON has no newline to translate, so serialize it
+         * straight into the output buffer.
+         */
+        qemu_mutex_lock(&mon->out_lock);
+        qstring_append_json(mon->outbuf, data);
+        qstring_append(mon->outbuf, "\r\n");
+        monitor_flush_locked(mon);
+        qemu_mutex_unlock(&mon->out_lock);
+        return;
+    }
+
+    json = qobject_to_json_pretty(data);
     assert(json != NULL);
 
     qstring_append_chr(json, '\n');
@@ -967,6 +979,48 @@ static void hmp_info_jit(Monitor *mon, const QDict *qdict)
     dump_drift_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_rcu(Monitor *mon, const QDict *qdict)
+{
+    RCUStats stats;
+
+    rcu_get_stats(&stats);
+    monitor_printf(mon, "grace periods: %" PRIu64 "\n", stats.grace_periods);
+    if (stats.grace_periods) {
+        monitor_printf(mon, "grace period time: last %" PRIu64
+                       " us, max %" PRIu64 " us, avg %" PRIu64 " us\n",
+                       stats.gp_time_last_ns / 1000,
+                       stats.gp_time_max_ns / 1000,
+                       stats.gp_time_total_ns / stats.grace_periods / 1000);
+    }
+    monitor_printf(mon, "callback batches: %" PRIu64 " (%" PRIu64
+                   " expedited), largest %" PRIu64 "\n",
+                   stats.batches, stats.expedited_batches, stats.max_batch);
+    monitor_printf(mon, "callbacks: %" PRIu64 " run, %" PRIu64 " pending\n",
+                   stats.callbacks, stats.pending);
+}
+
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf,
+                    qdict_get_try_int(qdict, "count", 20));
+}
+
+static void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_str(qdict, "op");
+
+    if (!strcmp(op, "on")) {
+        tb_profile_set(true);
+    } else if (!strcmp(op, "off")) {
+        tb_profile_set(false);
+    } else if (!strcmp(op, "reset")) {
+        tb_profile_reset();
+    } else {
+        monitor_printf(mon, "unexpected argument '%s', "
+                       "expected on, off or reset\n", op);
+    }
+}
+
 static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
@@ -2642,6 +2696,21 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = hmp_info_jit,
     },
+    {
+        .name       = "tb-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translated blocks "
+                      "(0 for all, default 20)",
+        .mhandler.cmd = hmp_info_tb_profile,
+    },
+    {
+        .name       = "rcu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show RCU grace period and callback statistics",
+        .mhandler.cmd = hmp_info_rcu,
+    },
     {
         .name       = "opcount",
         .args_type  = "",
@@ -2698,6 +2767,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the currently saved VM snapshots",
         .mhandler.cmd = hmp_info_snapshots,
     },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the last live snapshot",
+        .mhandler.cmd = hmp_info_savevm,
+    },
     {
         .name       = "status",
         .args_type  = "",
@@ -2779,6 +2855,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration parameters",
         .mhandler.cmd = hmp_info_migrate_parameters,
     },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
@@ -2849,6 +2932,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory devices",
         .mhandler.cmd = hmp_info_memory_devices,
     },
+    {
+        .name       = "xen-mapcache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the Xen mapcache statistics",
+        .mhandler.cmd = hmp_info_xen_mapcache,
+    },
     {
         .name       = "rocker",
         .args_type  = "name:s",
@@ -4979,7 +5069,7 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
     return input_dict;
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
     Error *local_err = NULL;
     QObject *obj, *data;
@@ -5245,6 +5335,7 @@ void monitor_init(CharDriverState *chr, int flags)
 
     mon->chr = chr;
     mon->flags = flags;
+    chr->no_replay = true;
     if (flags & MONITOR_USE_READLINE) {
         mon->rs = readline_init(monitor_readline_printf,
                                 monitor_readline_flush,
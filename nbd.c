@@ -64,6 +64,7 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
@@ -85,6 +86,17 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
+/* Longest option payload accepted by the server */
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* Context id the server gives to base:allocation */
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Most extents sent in reply to a single NBD_CMD_BLOCK_STATUS */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
 
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
@@ -120,7 +132,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -144,9 +156,10 @@ static int nbd_errno_to_system_errno(int err)
 typedef struct NBDRequest NBDRequest;
 
 struct NBDRequest {
-    QSIMPLEQ_ENTRY(NBDRequest) entry;
+    QSLIST_ENTRY(NBDRequest) next_free;
     NBDClient *client;
     uint8_t *data;
+    uint8_t *buffer;            /* NBD_POOL_BUFFER_SIZE bytes, kept for reuse */
 };
 
 struct NBDExport {
@@ -158,6 +171,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int queue_depth;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
@@ -180,9 +194,15 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;
+    bool base_allocation;       /* base:allocation meta context selected */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    /* Finished requests, with their buffers, ready to be reused */
+    QSLIST_HEAD(, NBDRequest) free_requests;
 };
 
 /* That's all folks */
@@ -303,10 +323,10 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +343,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +351,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -392,6 +417,132 @@ static int nbd_handle_list(NBDClient *client, uint32_t length)
     return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_LIST);
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_send_rep_meta_context(int csock, uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+    int rc;
+
+    rc = nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                          NBD_OPT_SET_META_CONTEXT, sizeof(id) + len);
+    if (rc < 0) {
+        return rc;
+    }
+    id = cpu_to_be32(id);
+    if (write_sync(csock, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (write_sync(csock, (char *)name, len) != len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Only the base:allocation context is known; it describes which parts of
+ * the export are holes and which read as zeroes.
+ */
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *query = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint8_t *buf, *p, *end;
+    uint32_t len, nb_queries;
+    bool found = false;
+    char *name;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           queries, each a 32-bit length and a string
+     */
+    if (length > NBD_MAX_OPTION_SIZE) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+
+    client->base_allocation = false;
+    p = buf;
+    end = buf + length;
+    if (!client->structured_reply || end - p < 4) {
+        goto invalid;
+    }
+    len = ldl_be_p(p);
+    p += 4;
+    if (len > end - p) {
+        goto invalid;
+    }
+    name = g_strndup((char *)p, len);
+    p += len;
+    if (!nbd_export_find(name)) {
+        LOG("export not found");
+        g_free(name);
+        goto invalid;
+    }
+    g_free(name);
+
+    if (end - p < 4) {
+        goto invalid;
+    }
+    nb_queries = ldl_be_p(p);
+    p += 4;
+    while (nb_queries--) {
+        if (end - p < 4) {
+            goto invalid;
+        }
+        len = ldl_be_p(p);
+        p += 4;
+        if (len > end - p) {
+            goto invalid;
+        }
+        if (len == strlen(query) && !memcmp(p, query, len)) {
+            found = true;
+        }
+        p += len;
+    }
+    g_free(buf);
+
+    if (found) {
+        if (nbd_send_rep_meta_context(csock, NBD_META_ID_BASE_ALLOCATION,
+                                      query) < 0) {
+            return -EINVAL;
+        }
+        client->base_allocation = true;
+    }
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT);
+
+invalid:
+    g_free(buf);
+    return nbd_send_rep(csock, NBD_REP_ERR_INVALID, NBD_OPT_SET_META_CONTEXT);
+}
+
 static int nbd_handle_export_name(NBDClient *client, uint32_t length)
 {
     int rc = -EINVAL, csock = client->sock;
@@ -495,11 +646,36 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (!(flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+                return -EINVAL;
+            }
+            /* Fixed newstyle clients can go on with other options */
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
         }
     }
 }
@@ -509,8 +685,13 @@ static int nbd_send_negotiate(NBDClient *client)
     int csock = client->sock;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All the clients of an export share its BlockBackend, so a flush
+     * on one connection covers the writes completed on the others and
+     * the export can be accessed through several connections at once.
+     */
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -579,8 +760,139 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, uint32_t len,
+                           void *data, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t tmp;
+
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -EINVAL;
+    }
+    tmp = cpu_to_be32(opt);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option number");
+        return -EINVAL;
+    }
+    tmp = cpu_to_be32(len);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option length");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Read the header of the server's reply to option @opt */
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len, Error **errp)
+{
+    uint64_t magic;
+    uint32_t tmp;
+
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+        read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp) ||
+        read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Bad option reply magic");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(tmp) != opt) {
+        error_setg(errp, "Reply to the wrong option");
+        return -EINVAL;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask for structured replies and the base:allocation meta context.  Servers
+ * that do not know these options just say so; @info records what was
+ * agreed on.
+ */
+static int nbd_negotiate_structured(int csock, const char *name,
+                                    NBDExportInfo *info, Error **errp)
+{
+    const char *query = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name), query_len = strlen(query);
+    uint32_t type, len, id;
+    uint8_t *buf, *p;
+    char reply_name[64];
+    int rc;
+
+    if (nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL, errp) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY,
+                                 &type, &len, errp) < 0) {
+        return -EINVAL;
+    }
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        TRACE("Server does not support structured replies");
+        return 0;
+    }
+    info->structured_reply = true;
+
+    /* export name, one query */
+    len = 4 + name_len + 4 + 4 + query_len;
+    buf = p = g_malloc(len);
+    stl_be_p(p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, query_len);
+    memcpy(p + 8, query, query_len);
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, len, buf, errp);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    while (1) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     &type, &len, errp) < 0) {
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            break;
+        }
+        if (len < sizeof(id) || len - sizeof(id) >= sizeof(reply_name)) {
+            error_setg(errp, "Bad meta context reply length");
+            return -EINVAL;
+        }
+        len -= sizeof(id);
+        if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, reply_name, len) != len) {
+            error_setg(errp, "Failed to read meta context reply");
+            return -EINVAL;
+        }
+        reply_name[len] = '\0';
+        if (!strcmp(reply_name, query)) {
+            info->base_allocation = true;
+            info->context_id = be32_to_cpu(id);
+        }
+    }
+
+    /* NBD_REP_ACK, or an error if the option is not supported */
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    return 0;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExportInfo *info, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -590,6 +902,9 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Receiving negotiation.");
 
     rc = -EINVAL;
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
 
     if (read_sync(csock, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -625,9 +940,10 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
+        bool haggle;
 
         TRACE("Checking magic (opts_magic)");
         if (magic != NBD_OPTS_MAGIC) {
@@ -643,10 +959,19 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            error_setg(errp, "Failed to read reserved field");
+        /* Options other than the export name need the fixed newstyle
+         * protocol, where the server replies to each of them.
+         */
+        haggle = info && (*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16));
+        if (haggle) {
+            client_flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            error_setg(errp, "Failed to send client flags");
+            goto fail;
+        }
+        if (haggle && nbd_negotiate_structured(csock, name, info, errp) < 0) {
             goto fail;
         }
         /* write the export name */
@@ -867,7 +1192,7 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    request->type  = be32_to_cpup((uint32_t*)(buf + 4));
+    request->type  = be32_to_cpup((uint32_t *)(buf + 4));
     request->handle = be64_to_cpup((uint64_t*)(buf + 8));
     request->from  = be64_to_cpup((uint64_t*)(buf + 16));
     request->len   = be32_to_cpup((uint32_t*)(buf + 24));
@@ -885,16 +1210,16 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -903,12 +1228,44 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_*)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The rest of the header is sent together with the start, so
+         * it is worth waiting for.
+         */
+        do {
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            sizeof(buf) - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        reply->error = 0;
+        reply->flags = lduw_be_p(buf + 4);
+        reply->type = lduw_be_p(buf + 6);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t *)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
 
     TRACE("Got reply: "
@@ -952,7 +1309,15 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+/* Requests up to this size use a buffer that is kept with the NBDRequest
+ * and reused by the next requests of the client.
+ */
+#define NBD_POOL_BUFFER_SIZE (1024 * 1024)
+
+static int nbd_client_queue_depth(NBDClient *client)
+{
+    return client->exp ? client->exp->queue_depth : NBD_DEFAULT_QUEUE_DEPTH;
+}
 
 void nbd_client_get(NBDClient *client)
 {
@@ -967,6 +1332,14 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
+        while (!QSLIST_EMPTY(&client->free_requests)) {
+            NBDRequest *req = QSLIST_FIRST(&client->free_requests);
+
+            QSLIST_REMOVE_HEAD(&client->free_requests, next_free);
+            qemu_vfree(req->buffer);
+            g_slice_free(NBDRequest, req);
+        }
+
         nbd_unset_handlers(client);
         close(client->sock);
         client->sock = -1;
@@ -1001,11 +1374,16 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= nbd_client_queue_depth(client) - 1);
     client->nb_requests++;
     nbd_update_can_read(client);
 
-    req = g_slice_new0(NBDRequest);
+    req = QSLIST_FIRST(&client->free_requests);
+    if (req) {
+        QSLIST_REMOVE_HEAD(&client->free_requests, next_free);
+    } else {
+        req = g_slice_new0(NBDRequest);
+    }
     nbd_client_get(client);
     req->client = client;
     return req;
@@ -1015,10 +1393,15 @@ static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
 
-    if (req->data) {
+    if (req->data != req->buffer) {
         qemu_vfree(req->data);
     }
-    g_slice_free(NBDRequest, req);
+    req->data = NULL;
+
+    /* At most one free request is kept for each request that was in
+     * flight at the same time, so the pool never exceeds the queue depth.
+     */
+    QSLIST_INSERT_HEAD(&client->free_requests, req, next_free);
 
     client->nb_requests--;
     nbd_update_can_read(client);
@@ -1063,6 +1446,7 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
         error_setg_errno(errp, -exp->size,
@@ -1100,6 +1484,13 @@ NBDExport *nbd_export_find(const char *name)
     return NULL;
 }
 
+/* Set how many requests of each client are processed in parallel */
+void nbd_export_set_queue_depth(NBDExport *exp, int queue_depth)
+{
+    assert(queue_depth >= 1 && queue_depth <= NBD_MAX_QUEUE_DEPTH);
+    exp->queue_depth = queue_depth;
+}
+
 void nbd_export_set_name(NBDExport *exp, const char *name)
 {
     if (exp->name == name) {
@@ -1182,7 +1573,9 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
-    ssize_t rc, ret;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
+    ssize_t rc;
 
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
@@ -1191,15 +1584,23 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     if (!len) {
         rc = nbd_send_reply(csock, reply);
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
+        /* Send the header and the data with a single writev, straight
+         * from the buffer that the block layer read into.
+         */
+        stl_be_p(buf, NBD_REPLY_MAGIC);
+        stl_be_p(buf + 4, system_errno_to_nbd_errno(reply->error));
+        stq_be_p(buf + 8, reply->handle);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = sizeof(buf);
+        iov[1].iov_base = req->data;
+        iov[1].iov_len = len;
+        TRACE("Sending response to client with %d byte(s)", len);
+        rc = 0;
+        if (qemu_co_sendv(csock, iov, 2, 0, sizeof(buf) + len) !=
+            sizeof(buf) + len) {
+            LOG("writing to socket failed");
+            rc = -EIO;
         }
-        socket_set_cork(csock, 0);
     }
 
     client->send_coroutine = NULL;
@@ -1208,6 +1609,201 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send a structured reply chunk whose payload is made of @niov buffers */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 struct iovec *iov, int niov)
+{
+    NBDClient *client = req->client;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec vec[3];
+    size_t len = 0;
+    ssize_t rc = 0;
+    int i;
+
+    assert(niov < ARRAY_SIZE(vec));
+    for (i = 0; i < niov; i++) {
+        vec[i + 1] = iov[i];
+        len += iov[i].iov_len;
+    }
+
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, len);
+    vec[0].iov_base = buf;
+    vec[0].iov_len = sizeof(buf);
+
+    TRACE("Sending chunk to client: "
+          "{ .flags = 0x%x, .type = %d, .length = %zu }", flags, type, len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    if (qemu_co_sendv(client->sock, vec, niov + 1, 0, sizeof(buf) + len) !=
+        sizeof(buf) + len) {
+        rc = -EIO;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];     /* error, message length (no message) */
+    struct iovec iov = { .iov_base = payload, .iov_len = sizeof(payload) };
+
+    stl_be_p(payload, system_errno_to_nbd_errno(error));
+    stw_be_p(payload + 4, 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, &iov, 1);
+}
+
+/* Reply to a read with data chunks, and with hole chunks for the ranges
+ * that the block layer knows to read as zeroes.  Block layer errors are
+ * reported to the client; only failures to send are returned.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    uint64_t offset = request->from + exp->dev_offset;
+    bool sparse = !((offset | request->len) & (BDRV_SECTOR_SIZE - 1));
+    uint32_t done = 0;
+    ssize_t ret;
+
+    while (done < request->len) {
+        uint32_t len = request->len - done;
+        int64_t sector_num = (offset + done) / BDRV_SECTOR_SIZE;
+        int64_t status = BDRV_BLOCK_DATA;
+        uint16_t flags;
+        uint8_t hdr[8 + 4];
+        struct iovec iov[2];
+        int pnum;
+
+        if (sparse) {
+            status = bdrv_get_block_status_above(blk_bs(exp->blk), NULL,
+                                                 sector_num,
+                                                 len / BDRV_SECTOR_SIZE,
+                                                 &pnum);
+            if (status < 0) {
+                return nbd_co_send_error_chunk(req, request->handle, -status);
+            }
+            if (pnum > 0) {
+                len = pnum * BDRV_SECTOR_SIZE;
+            } else {
+                status = BDRV_BLOCK_DATA;
+            }
+        }
+
+        flags = done + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(hdr, request->from + done);
+        iov[0].iov_base = hdr;
+        if (status & BDRV_BLOCK_ZERO) {
+            TRACE("Hole of %u byte(s)", len);
+            stl_be_p(hdr + 8, len);
+            iov[0].iov_len = 8 + 4;
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, iov, 1);
+        } else {
+            ret = blk_read(exp->blk, sector_num, req->data + done,
+                           len / BDRV_SECTOR_SIZE);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            TRACE("Read %u byte(s)", len);
+            iov[0].iov_len = 8;
+            iov[1].iov_base = req->data + done;
+            iov[1].iov_len = len;
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA, iov, 2);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the base:allocation context */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    uint64_t offset = request->from + exp->dev_offset;
+    unsigned int max = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                       1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    NBDExtent *extents = g_new(NBDExtent, max);
+    unsigned int i, n = 0;
+    uint32_t done = 0;
+    uint8_t id[4];
+    struct iovec iov[2];
+    ssize_t ret;
+
+    if ((offset | request->len) & (BDRV_SECTOR_SIZE - 1)) {
+        /* The block layer works on sectors; report everything as data */
+        extents[0].length = request->len;
+        extents[0].flags = 0;
+        n = 1;
+        done = request->len;
+    }
+
+    while (done < request->len && n < max) {
+        uint32_t flags, len;
+        int64_t status;
+        int pnum;
+
+        status = bdrv_get_block_status_above(blk_bs(exp->blk), NULL,
+                                             (offset + done) /
+                                             BDRV_SECTOR_SIZE,
+                                             (request->len - done) /
+                                             BDRV_SECTOR_SIZE,
+                                             &pnum);
+        if (status < 0) {
+            g_free(extents);
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+        if (pnum == 0) {
+            break;
+        }
+
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        len = pnum * BDRV_SECTOR_SIZE;
+        if (n && extents[n - 1].flags == flags) {
+            extents[n - 1].length += len;
+        } else {
+            extents[n].length = len;
+            extents[n].flags = flags;
+            n++;
+        }
+        done += len;
+    }
+
+    TRACE("Sending %u extent(s)", n);
+    for (i = 0; i < n; i++) {
+        extents[i].length = cpu_to_be32(extents[i].length);
+        extents[i].flags = cpu_to_be32(extents[i].flags);
+    }
+    stl_be_p(id, NBD_META_ID_BASE_ALLOCATION);
+    iov[0].iov_base = id;
+    iov[0].iov_len = sizeof(id);
+    iov[1].iov_base = extents;
+    iov[1].iov_len = n * sizeof(*extents);
+    ret = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, iov, 2);
+    g_free(extents);
+    return ret;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1226,7 +1822,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command != NBD_CMD_BLOCK_STATUS &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1242,9 +1840,16 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
-        req->data = blk_blockalign(client->exp->blk, request->len);
+        if (request->len <= NBD_POOL_BUFFER_SIZE) {
+            if (!req->buffer) {
+                req->buffer = blk_blockalign(client->exp->blk,
+                                             NBD_POOL_BUFFER_SIZE);
+            }
+            req->data = req->buffer;
+        } else {
+            req->data = blk_blockalign(client->exp->blk, request->len);
+        }
     }
     if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
@@ -1291,11 +1896,11 @@ static void nbd_trip(void *opaque)
     reply.handle = request.handle;
     reply.error = 0;
 
+    command = request.type & NBD_CMD_MASK_COMMAND;
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1318,6 +1923,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1393,12 +2005,28 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation || request.len == 0) {
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* Reads and block status queries get a structured reply */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_error_chunk(req, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1453,7 +2081,7 @@ static void nbd_unset_handlers(NBDClient *client)
 static void nbd_update_can_read(NBDClient *client)
 {
     bool can_read = client->recv_coroutine ||
-                    client->nb_requests < MAX_NBD_REQUESTS;
+                    client->nb_requests < nbd_client_queue_depth(client);
 
     if (can_read != client->can_read) {
         client->can_read = can_read;
@@ -1473,6 +2101,7 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
     client->exp = exp;
     client->sock = csock;
     client->can_read = true;
+    QSLIST_INIT(&client->free_requests);
     if (nbd_send_negotiate(client)) {
         g_free(client);
         return NULL;
@@ -0,0 +1,132 @@
+/*
+ * Batched datagram I/O
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "config-host.h"
+#include "batch.h"
+
+#ifdef CONFIG_SENDMMSG
+
+int net_dgram_recv_batch(int fd, struct iovec *iov, int iovcnt,
+                         size_t *lens, int count)
+{
+    struct mmsghdr msgs[NET_BATCH_MAX];
+    int i, ret;
+
+    count = MIN(count, NET_BATCH_MAX);
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_iov = iov + i * iovcnt;
+        msgs[i].msg_hdr.msg_iovlen = iovcnt;
+    }
+
+    do {
+        ret = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    for (i = 0; i < ret; i++) {
+        lens[i] = msgs[i].msg_len;
+    }
+    return ret;
+}
+
+int net_dgram_send_batch(int fd, const struct sockaddr *dst, socklen_t dstlen,
+                         const struct iovec *iov, int iovcnt, int count)
+{
+    struct mmsghdr msgs[NET_BATCH_MAX];
+    int i, ret;
+
+    count = MIN(count, NET_BATCH_MAX);
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = (void *)dst;
+        msgs[i].msg_hdr.msg_namelen = dst ? dstlen : 0;
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)iov + i * iovcnt;
+        msgs[i].msg_hdr.msg_iovlen = iovcnt;
+    }
+
+    do {
+        ret = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+#else
+
+static ssize_t net_dgram_recv_one(int fd, struct iovec *iov, int iovcnt)
+{
+#ifdef _WIN32
+    assert(iovcnt == 1);
+    return qemu_recv(fd, iov->iov_base, iov->iov_len, 0);
+#else
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    return recvmsg(fd, &msg, 0);
+#endif
+}
+
+static ssize_t net_dgram_send_one(int fd, const struct sockaddr *dst,
+                                  socklen_t dstlen,
+                                  const struct iovec *iov, int iovcnt)
+{
+#ifdef _WIN32
+    assert(iovcnt == 1);
+    return qemu_sendto(fd, iov->iov_base, iov->iov_len, 0, dst,
+                       dst ? dstlen : 0);
+#else
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)dst;
+    msg.msg_namelen = dst ? dstlen : 0;
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, 0);
+#endif
+}
+
+int net_dgram_recv_batch(int fd, struct iovec *iov, int iovcnt,
+                         size_t *lens, int count)
+{
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        do {
+            len = net_dgram_recv_one(fd, iov + i * iovcnt, iovcnt);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            break;
+        }
+        lens[i] = len;
+    }
+    return i ? i : -1;
+}
+
+int net_dgram_send_batch(int fd, const struct sockaddr *dst, socklen_t dstlen,
+                         const struct iovec *iov, int iovcnt, int count)
+{
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        do {
+            len = net_dgram_send_one(fd, dst, dstlen, iov + i * iovcnt,
+                                     iovcnt);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            break;
+        }
+    }
+    return i ? i : -1;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Batched datagram I/O
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_BATCH_H
+#define QEMU_NET_BATCH_H
+
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+
+/* Largest number of datagrams moved by one call */
+#define NET_BATCH_MAX 64
+
+/*
+ * Receive up to @count datagrams from the non-blocking socket @fd, the
+ * i-th one into the @iovcnt iovecs at @iov + i * @iovcnt, and store the
+ * length of each in @lens.  Returns the number of datagrams received, or
+ * -1 with errno set if there was none.
+ */
+int net_dgram_recv_batch(int fd, struct iovec *iov, int iovcnt,
+                         size_t *lens, int count);
+
+/*
+ * Send @count datagrams on the non-blocking socket @fd, to @dst or to the
+ * connected peer if @dst is NULL.  The i-th datagram is made of the
+ * @iovcnt iovecs at @iov + i * @iovcnt.  Returns the number of datagrams
+ * sent, or -1 with errno set if the first one could not be.
+ *
+ * Both use recvmmsg()/sendmmsg() where available, that is one system
+ * call per batch, and fall back to one call per datagram elsewhere.
+ */
+int net_dgram_send_batch(int fd, const struct sockaddr *dst, socklen_t dstlen,
+                         const struct iovec *iov, int iovcnt, int count);
+
+#endif /* QEMU_NET_BATCH_H */
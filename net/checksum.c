@@ -16,22 +16,235 @@
  */
 
 #include "qemu-common.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#define NET_CHECKSUM_AVX2
+#include "qemu/host-cpuid.h"
+#endif
+
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The ones' complement sum does not depend on the byte order, as long as
+ * the result is swapped back at the end (RFC 1071), so the implementations
+ * below add up @len bytes of @buf as 16-bit words in host order.  They
+ * return 64-bit sums, which are folded by net_checksum_add_cont().
+ *
+ * The vector versions keep 32-bit lanes, each of which grows by at most
+ * 2 * 0xffff per iteration; they are flushed to the 64-bit sum every
+ * NET_CHECKSUM_VEC_ITERS iterations, long before they can overflow.
+ */
+#define NET_CHECKSUM_VEC_ITERS 16384
+
+typedef uint64_t (*NetChecksumFunc)(const uint8_t *buf, size_t len);
+
+static uint64_t net_checksum_int64(const uint8_t *buf, size_t len)
 {
-    uint32_t sum = 0;
+    uint64_t sum = 0;
+    uint8_t last[2] = { 0, 0 };
+
+    /* Adding the two halves keeps every step below 2^33 */
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t w = ldq_he_p(buf);
+        sum += (w & 0xffffffff) + (w >> 32);
+    }
+    if (len >= 4) {
+        sum += (uint32_t)ldl_he_p(buf);
+        len -= 4;
+        buf += 4;
+    }
+    if (len >= 2) {
+        sum += (uint16_t)lduw_he_p(buf);
+        len -= 2;
+        buf += 2;
+    }
+    if (len) {
+        /* The last byte is the first one of a word padded with zero */
+        last[0] = *buf;
+        sum += (uint16_t)lduw_he_p(last);
+    }
+    return sum;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static uint64_t net_checksum_vec_sum32(const uint32_t *lanes, int n)
+{
+    uint64_t sum = 0;
     int i;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
+    for (i = 0; i < n; i++) {
+        sum += lanes[i];
+    }
+    return sum;
+}
+
+static uint64_t net_checksum_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    uint64_t sum = 0;
+
+    /* Two accumulators, so that the additions do not wait for each other */
+    while (len >= 32) {
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        uint32_t lanes[4];
+        int i;
+
+        for (i = 0; i < NET_CHECKSUM_VEC_ITERS && len >= 32; i++) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)buf);
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+            acc0 = _mm_add_epi32(acc0, _mm_and_si128(v0, mask));
+            acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v0, 16));
+            acc0 = _mm_add_epi32(acc0, _mm_and_si128(v1, mask));
+            acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v1, 16));
+            buf += 32;
+            len -= 32;
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc0);
+        sum += net_checksum_vec_sum32(lanes, 4);
+        _mm_storeu_si128((__m128i *)lanes, acc1);
+        sum += net_checksum_vec_sum32(lanes, 4);
+    }
+    return sum + net_checksum_int64(buf, len);
+}
+#endif
+
+#ifdef NET_CHECKSUM_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    uint64_t sum = 0;
+
+    while (len >= 64) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        uint32_t lanes[8];
+        int i;
+
+        for (i = 0; i < NET_CHECKSUM_VEC_ITERS && len >= 64; i++) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i *)buf);
+            __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+
+            acc0 = _mm256_add_epi32(acc0, _mm256_and_si256(v0, mask));
+            acc1 = _mm256_add_epi32(acc1, _mm256_srli_epi32(v0, 16));
+            acc0 = _mm256_add_epi32(acc0, _mm256_and_si256(v1, mask));
+            acc1 = _mm256_add_epi32(acc1, _mm256_srli_epi32(v1, 16));
+            buf += 64;
+            len -= 64;
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc0);
+        sum += net_checksum_vec_sum32(lanes, 8);
+        _mm256_storeu_si256((__m256i *)lanes, acc1);
+        sum += net_checksum_vec_sum32(lanes, 8);
+    }
+    /* Avoid the AVX to SSE transition penalty in the callers */
+    _mm256_zeroupper();
+    return sum + net_checksum_sse2(buf, len);
+}
+#pragma GCC pop_options
+
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+
+static uint64_t net_checksum_neon(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        uint64x2_t acc64;
+        int i;
+
+        for (i = 0; i < NET_CHECKSUM_VEC_ITERS && len >= 16; i++) {
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(buf)));
+            buf += 16;
+            len -= 16;
         }
+        acc64 = vpaddlq_u32(acc);
+        sum += vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1);
+    }
+    return sum + net_checksum_int64(buf, len);
+}
+#endif
+
+static NetChecksumFunc net_checksum_update = net_checksum_int64;
+
+static void __attribute__((constructor)) net_checksum_init_accel(void)
+{
+#ifdef __SSE2__
+    net_checksum_update = net_checksum_sse2;
+#endif
+#ifdef NET_CHECKSUM_AVX2
+    if (host_cpuid_has_avx2()) {
+        net_checksum_update = net_checksum_avx2;
+    }
+#endif
+#ifdef __ARM_NEON
+    net_checksum_update = net_checksum_neon;
+#endif
+}
+
+bool net_checksum_set_accel(const char *name)
+{
+    if (!strcmp(name, "int64")) {
+        net_checksum_update = net_checksum_int64;
+        return true;
+    }
+#ifdef __SSE2__
+    if (!strcmp(name, "sse2")) {
+        net_checksum_update = net_checksum_sse2;
+        return true;
+    }
+#endif
+#ifdef NET_CHECKSUM_AVX2
+    if (!strcmp(name, "avx2") && host_cpuid_has_avx2()) {
+        net_checksum_update = net_checksum_avx2;
+        return true;
+    }
+#endif
+#ifdef __ARM_NEON
+    if (!strcmp(name, "neon")) {
+        net_checksum_update = net_checksum_neon;
+        return true;
+    }
+#endif
+    if (!strcmp(name, "auto")) {
+        net_checksum_init_accel();
+        return true;
+    }
+    return false;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint64_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    sum = net_checksum_update(buf, len);
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+    /* A buffer that starts at an odd offset has its bytes swapped */
+    if (seq & 1) {
+        sum = bswap16(sum);
     }
     return sum;
 }
@@ -113,3 +326,24 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+uint32_t net_toeplitz_hash(const uint8_t *key, const uint8_t *input,
+                           size_t len)
+{
+    uint32_t hash = 0;
+    uint32_t window = ((uint32_t)key[0] << 24) | (key[1] << 16) |
+                      (key[2] << 8) | key[3];
+    size_t i;
+    int bit;
+
+    /* XOR in the 32 key bits starting at the position of each set bit */
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            if (input[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((key[i + 4] >> bit) & 1);
+        }
+    }
+    return hash;
+}
@@ -25,15 +25,59 @@
 #include "clients.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/log.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "net/eth.h"
 #include "hub.h"
 
+/*
+ * Packets are formatted into a ring buffer from the receive path and
+ * written out by a separate thread, so that a slow disk never stalls the
+ * sender.  The ring has a single producer (the net layer) and a single
+ * consumer (the writer thread); head and tail only ever grow and are
+ * masked to index the buffer.  When the ring is full, packets are dropped
+ * and counted rather than waited for.
+ */
+
+#define DUMP_DEFAULT_BUFFER (4 * 1024 * 1024)
+
+/* How many leading bytes of a packet the capture filter looks at */
+#define DUMP_FILTER_HDR_LEN 96
+
+typedef struct DumpFilter {
+    uint16_t ethertype;         /* 0 matches any */
+    uint8_t proto;              /* IP protocol, 0 matches any */
+    int port;                   /* TCP/UDP port, -1 matches any */
+} DumpFilter;
+
 typedef struct DumpState {
     NetClientState nc;
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+    bool pcapng;
+    DumpFilter filter;
+
+    /* Only used by the writer thread once it is started */
+    char *filename;
+    unsigned file_index;
+    uint64_t file_size;
+    int64_t file_start;
+    uint64_t rotate_size;
+    int64_t rotate_time;
+
+    uint8_t *ring;
+    size_t ring_size;
+    size_t head;
+    size_t tail;
+    uint64_t dropped;
+    bool failed;
+    bool quit;
+    QemuEvent event;
+    QemuThread thread;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -57,92 +101,553 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
-static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* pcapng, see https://github.com/pcapng/pcapng */
+#define PCAPNG_SHB_TYPE     0x0a0d0d0a
+#define PCAPNG_IDB_TYPE     0x00000001
+#define PCAPNG_ISB_TYPE     0x00000005
+#define PCAPNG_EPB_TYPE     0x00000006
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+#define PCAPNG_ISB_IFDROP   5
+
+struct pcapng_shb {
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t byte_order;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int64_t section_len;
+    uint32_t total_len2;
+} QEMU_PACKED;
+
+struct pcapng_idb {
+    uint32_t type;
+    uint32_t total_len;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint32_t total_len2;
+} QEMU_PACKED;
+
+struct pcapng_epb {
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t interface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t len;
+} QEMU_PACKED;
+
+struct pcapng_isb {
+    uint32_t type;
+    uint32_t total_len;
+    uint32_t interface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint16_t opt_code;
+    uint16_t opt_len;
+    uint64_t ifdrop;
+    uint32_t opt_end;
+    uint32_t total_len2;
+} QEMU_PACKED;
+
+static int dump_filter_parse(DumpFilter *f, const char *str, Error **errp)
+{
+    char **tokens = g_strsplit(str, " ", 0);
+    int i, ret = -1;
+
+    f->ethertype = 0;
+    f->proto = 0;
+    f->port = -1;
+
+    for (i = 0; tokens[i]; i++) {
+        uint16_t ethertype = 0;
+        uint8_t proto = 0;
+        char *end;
+
+        if (!*tokens[i]) {
+            continue;
+        }
+        if (!strcmp(tokens[i], "arp")) {
+            ethertype = 0x0806;
+        } else if (!strcmp(tokens[i], "ip")) {
+            ethertype = ETH_P_IP;
+        } else if (!strcmp(tokens[i], "ip6")) {
+            ethertype = ETH_P_IPV6;
+        } else if (!strcmp(tokens[i], "tcp")) {
+            proto = IP_PROTO_TCP;
+        } else if (!strcmp(tokens[i], "udp")) {
+            proto = IP_PROTO_UDP;
+        } else if (!strcmp(tokens[i], "icmp")) {
+            ethertype = ETH_P_IP;
+            proto = 1;
+        } else if (!strcmp(tokens[i], "icmp6")) {
+            ethertype = ETH_P_IPV6;
+            proto = 58;
+        } else if (!strcmp(tokens[i], "port")) {
+            unsigned long port;
+
+            if (!tokens[i + 1] || f->port >= 0) {
+                error_setg(errp, "-net dump: 'port' needs one port number");
+                goto out;
+            }
+            i++;
+            port = strtoul(tokens[i], &end, 0);
+            if (*end || port > 65535) {
+                error_setg(errp, "-net dump: invalid port '%s'", tokens[i]);
+                goto out;
+            }
+            f->port = port;
+            continue;
+        } else {
+            error_setg(errp, "-net dump: unknown filter primitive '%s'",
+                       tokens[i]);
+            goto out;
+        }
+
+        if ((ethertype && f->ethertype && ethertype != f->ethertype) ||
+            (proto && f->proto && proto != f->proto)) {
+            error_setg(errp, "-net dump: filter '%s' never matches", str);
+            goto out;
+        }
+        f->ethertype = ethertype ? ethertype : f->ethertype;
+        f->proto = proto ? proto : f->proto;
+    }
+
+    if (f->port >= 0 && f->proto &&
+        f->proto != IP_PROTO_TCP && f->proto != IP_PROTO_UDP) {
+        error_setg(errp, "-net dump: 'port' needs tcp or udp");
+        goto out;
+    }
+    if ((f->proto || f->port >= 0) && f->ethertype &&
+        f->ethertype != ETH_P_IP && f->ethertype != ETH_P_IPV6) {
+        error_setg(errp, "-net dump: filter '%s' never matches", str);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_strfreev(tokens);
+    return ret;
+}
+
+static bool dump_filter_match(const DumpFilter *f, const struct iovec *iov,
+                              int iovcnt)
+{
+    uint8_t buf[DUMP_FILTER_HDR_LEN];
+    size_t len, l3 = sizeof(struct eth_header), l4;
+    uint16_t ethertype;
+    uint8_t proto;
+
+    if (!f->ethertype && !f->proto && f->port < 0) {
+        return true;
+    }
+
+    len = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+    if (len < l3) {
+        return false;
+    }
+    ethertype = lduw_be_p(buf + 12);
+    if (ethertype == ETH_P_VLAN && len >= l3 + 4) {
+        ethertype = lduw_be_p(buf + l3 + 2);
+        l3 += 4;
+    }
+    if (f->ethertype && ethertype != f->ethertype) {
+        return false;
+    }
+    if (!f->proto && f->port < 0) {
+        return true;
+    }
+
+    if (ethertype == ETH_P_IP && len >= l3 + 20) {
+        /* Only the first fragment carries the ports */
+        if (f->port >= 0 && (lduw_be_p(buf + l3 + 6) & 0x1fff)) {
+            return false;
+        }
+        proto = buf[l3 + 9];
+        l4 = l3 + (buf[l3] & 0xf) * 4;
+    } else if (ethertype == ETH_P_IPV6 && len >= l3 + 40) {
+        proto = buf[l3 + 6];
+        l4 = l3 + 40;
+    } else {
+        return false;
+    }
+
+    if (f->proto && proto != f->proto) {
+        return false;
+    }
+    if (f->port < 0) {
+        return true;
+    }
+    if ((proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) || len < l4 + 4) {
+        return false;
+    }
+    return lduw_be_p(buf + l4) == f->port || lduw_be_p(buf + l4 + 2) == f->port;
+}
+
+/* Copy @len bytes at ring position @pos, wrapping around the end */
+static void dump_ring_put(DumpState *s, size_t pos, const void *data,
+                          size_t len)
+{
+    size_t off = pos & (s->ring_size - 1);
+    size_t chunk = MIN(len, s->ring_size - off);
+
+    memcpy(s->ring + off, data, chunk);
+    memcpy(s->ring, (const uint8_t *)data + chunk, len - chunk);
+}
+
+static void dump_ring_put_iov(DumpState *s, size_t pos,
+                              const struct iovec *iov, int iovcnt,
+                              size_t len)
+{
+    size_t off = pos & (s->ring_size - 1);
+    size_t chunk = MIN(len, s->ring_size - off);
+
+    iov_to_buf(iov, iovcnt, 0, s->ring + off, chunk);
+    iov_to_buf(iov, iovcnt, chunk, s->ring, len - chunk);
+}
+
+static ssize_t dump_receive_iov(NetClientState *nc, const struct iovec *iov,
+                                int iovcnt)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
-    struct pcap_sf_pkthdr hdr;
+    static const uint8_t zero[4];
+    size_t size = iov_size(iov, iovcnt);
+    size_t caplen, reclen, pad = 0;
+    size_t head = s->head;
     int64_t ts;
-    int caplen;
 
     /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    if (atomic_read(&s->failed)) {
+        return size;
+    }
+    if (!dump_filter_match(&s->filter, iov, iovcnt)) {
         return size;
     }
 
-    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000, get_ticks_per_sec());
-    caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    caplen = MIN(size, s->pcap_caplen);
+    if (s->pcapng) {
+        pad = ROUND_UP(caplen, 4) - caplen;
+        reclen = sizeof(struct pcapng_epb) + caplen + pad + 4;
+    } else {
+        reclen = sizeof(struct pcap_sf_pkthdr) + caplen;
+    }
+    if (reclen > s->ring_size - (head - atomic_mb_read(&s->tail))) {
+        s->dropped++;
+        return size;
+    }
 
-    hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
-    hdr.ts.tv_usec = ts % 1000000;
-    hdr.caplen = caplen;
-    hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000,
+                  get_ticks_per_sec()) + s->start_ts * 1000000;
+
+    if (s->pcapng) {
+        struct pcapng_epb epb = {
+            .type = PCAPNG_EPB_TYPE,
+            .total_len = reclen,
+            .interface = 0,
+            .ts_high = ts >> 32,
+            .ts_low = ts,
+            .caplen = caplen,
+            .len = size,
+        };
+        uint32_t total_len = reclen;
+
+        dump_ring_put(s, head, &epb, sizeof(epb));
+        head += sizeof(epb);
+        dump_ring_put_iov(s, head, iov, iovcnt, caplen);
+        head += caplen;
+        dump_ring_put(s, head, zero, pad);
+        head += pad;
+        dump_ring_put(s, head, &total_len, sizeof(total_len));
+        head += sizeof(total_len);
+    } else {
+        struct pcap_sf_pkthdr hdr;
+
+        hdr.ts.tv_sec = ts / 1000000;
+        hdr.ts.tv_usec = ts % 1000000;
+        hdr.caplen = caplen;
+        hdr.len = size;
+        dump_ring_put(s, head, &hdr, sizeof(hdr));
+        head += sizeof(hdr);
+        dump_ring_put_iov(s, head, iov, iovcnt, caplen);
+        head += caplen;
     }
 
+    /* Publish the record only once it is complete */
+    smp_wmb();
+    atomic_set(&s->head, head);
+    qemu_event_set(&s->event);
+
     return size;
 }
 
+static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return dump_receive_iov(nc, &iov, 1);
+}
+
+static int dump_write_header(DumpState *s, int fd)
+{
+    if (s->pcapng) {
+        struct {
+            struct pcapng_shb shb;
+            struct pcapng_idb idb;
+        } QEMU_PACKED hdr = {
+            .shb = {
+                .type = PCAPNG_SHB_TYPE,
+                .total_len = sizeof(struct pcapng_shb),
+                .byte_order = PCAPNG_BYTE_ORDER,
+                .version_major = 1,
+                .version_minor = 0,
+                .section_len = -1,
+                .total_len2 = sizeof(struct pcapng_shb),
+            },
+            .idb = {
+                .type = PCAPNG_IDB_TYPE,
+                .total_len = sizeof(struct pcapng_idb),
+                .linktype = 1,
+                .snaplen = s->pcap_caplen,
+                .total_len2 = sizeof(struct pcapng_idb),
+            },
+        };
+
+        return qemu_write_full(fd, &hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1;
+    } else {
+        struct pcap_file_hdr hdr;
+
+        hdr.magic = PCAP_MAGIC;
+        hdr.version_major = 2;
+        hdr.version_minor = 4;
+        hdr.thiszone = 0;
+        hdr.sigfigs = 0;
+        hdr.snaplen = s->pcap_caplen;
+        hdr.linktype = 1;
+
+        return qemu_write_full(fd, &hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1;
+    }
+}
+
+/* Record the packets dropped so far at the end of a pcapng file */
+static void dump_write_stats(DumpState *s)
+{
+    int64_t ts;
+    struct pcapng_isb isb;
+
+    if (!s->pcapng || s->fd < 0) {
+        return;
+    }
+
+    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000,
+                  get_ticks_per_sec()) + s->start_ts * 1000000;
+    memset(&isb, 0, sizeof(isb));
+    isb.type = PCAPNG_ISB_TYPE;
+    isb.total_len = sizeof(isb);
+    isb.ts_high = ts >> 32;
+    isb.ts_low = ts;
+    isb.opt_code = PCAPNG_ISB_IFDROP;
+    isb.opt_len = sizeof(isb.ifdrop);
+    isb.ifdrop = atomic_read(&s->dropped);
+    isb.total_len2 = sizeof(isb);
+    qemu_write_full(s->fd, &isb, sizeof(isb));
+}
+
+static int dump_open(DumpState *s, Error **errp)
+{
+    char *filename;
+    int fd;
+
+    if (s->file_index) {
+        filename = g_strdup_printf("%s.%u", s->filename, s->file_index);
+    } else {
+        filename = g_strdup(s->filename);
+    }
+
+    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "-net dump: can't open %s", filename);
+        g_free(filename);
+        return -1;
+    }
+    if (dump_write_header(s, fd) < 0) {
+        error_setg_errno(errp, errno, "-net dump write error");
+        close(fd);
+        g_free(filename);
+        return -1;
+    }
+    g_free(filename);
+
+    s->fd = fd;
+    s->file_size = 0;
+    s->file_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    return 0;
+}
+
+static int dump_rotate(DumpState *s)
+{
+    Error *local_err = NULL;
+
+    dump_write_stats(s);
+    close(s->fd);
+    s->fd = -1;
+
+    s->file_index++;
+    if (dump_open(s, &local_err) < 0) {
+        qemu_log("%s - stop dump\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return -1;
+    }
+    return 0;
+}
+
+static bool dump_rotate_due(DumpState *s)
+{
+    if (s->rotate_size && s->file_size >= s->rotate_size) {
+        return true;
+    }
+    return s->rotate_time &&
+           qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000 >=
+           s->file_start + s->rotate_time;
+}
+
+/*
+ * Write out everything the producer has published, in at most two
+ * write() calls per wakeup.  The ring only ever holds whole records, so
+ * files are rotated on record boundaries.
+ */
+static void *dump_writer_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    for (;;) {
+        size_t head, tail = s->tail;
+        size_t off, len, chunk;
+
+        qemu_event_reset(&s->event);
+        head = atomic_mb_read(&s->head);
+        if (head == tail) {
+            if (atomic_mb_read(&s->quit)) {
+                break;
+            }
+            qemu_event_wait(&s->event);
+            continue;
+        }
+
+        if (s->fd >= 0 && dump_rotate_due(s) && dump_rotate(s) < 0) {
+            atomic_set(&s->failed, true);
+        }
+
+        off = tail & (s->ring_size - 1);
+        len = head - tail;
+        chunk = MIN(len, s->ring_size - off);
+        if (s->fd >= 0 &&
+            (qemu_write_full(s->fd, s->ring + off, chunk) != chunk ||
+             qemu_write_full(s->fd, s->ring, len - chunk) != len - chunk)) {
+            qemu_log("-net dump write error - stop dump\n");
+            close(s->fd);
+            s->fd = -1;
+            atomic_set(&s->failed, true);
+        }
+        s->file_size += len;
+
+        atomic_mb_set(&s->tail, head);
+    }
+
+    return NULL;
+}
+
 static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
 
-    close(s->fd);
+    /* The writer thread only exists once the ring is allocated */
+    if (s->ring) {
+        atomic_mb_set(&s->quit, true);
+        qemu_event_set(&s->event);
+        qemu_thread_join(&s->thread);
+        qemu_event_destroy(&s->event);
+    }
+
+    dump_write_stats(s);
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    qemu_vfree(s->ring);
+    g_free(s->filename);
 }
 
 static NetClientInfo net_dump_info = {
     .type = NET_CLIENT_OPTIONS_KIND_DUMP,
     .size = sizeof(DumpState),
     .receive = dump_receive,
+    .receive_iov = dump_receive_iov,
     .cleanup = dump_cleanup,
 };
 
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len,
-                         Error **errp)
+                         const char *name, const NetdevDumpOptions *dump,
+                         const char *filename, int len, Error **errp)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
+    DumpFilter filter;
     struct tm tm;
-    int fd;
+    uint64_t buffer = DUMP_DEFAULT_BUFFER;
 
-    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
-    if (fd < 0) {
-        error_setg_errno(errp, errno, "-net dump: can't open %s", filename);
+    if (dump->has_filter &&
+        dump_filter_parse(&filter, dump->filter, errp) < 0) {
         return -1;
     }
+    if (dump->has_buffer) {
+        if (dump->buffer > (1ULL << 30)) {
+            error_setg(errp, "-net dump: buffer is larger than 1G");
+            return -1;
+        }
+        buffer = dump->buffer;
+    }
+    /* The ring must at least hold one record of the largest size */
+    buffer = pow2ceil(MAX(buffer, (uint64_t)len + 64));
 
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
+    nc = qemu_new_net_client(&net_dump_info, peer, device, name);
+    s = DO_UPCAST(DumpState, nc, nc);
 
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        error_setg_errno(errp, errno, "-net dump write error");
-        close(fd);
+    s->fd = -1;
+    s->pcap_caplen = len;
+    s->pcapng = dump->has_format && dump->format == NETDEV_DUMP_FORMAT_PCAPNG;
+    if (dump->has_filter) {
+        s->filter = filter;
+    } else {
+        s->filter.port = -1;
+    }
+    s->filename = g_strdup(filename);
+    s->rotate_size = dump->has_rotate_size ? dump->rotate_size : 0;
+    s->rotate_time = dump->has_rotate_time ? dump->rotate_time : 0;
+
+    if (dump_open(s, errp) < 0) {
+        qemu_del_net_client(nc);
         return -1;
     }
 
-    nc = qemu_new_net_client(&net_dump_info, peer, device, name);
+    s->ring_size = buffer;
+    s->ring = qemu_memalign(getpagesize(), s->ring_size);
 
     snprintf(nc->info_str, sizeof(nc->info_str),
-             "dump to %s (len=%d)", filename, len);
-
-    s = DO_UPCAST(DumpState, nc, nc);
-
-    s->fd = fd;
-    s->pcap_caplen = len;
+             "dump to %s (len=%d%s%s%s)", filename, len,
+             s->pcapng ? ",pcapng" : "",
+             dump->has_filter ? ",filter=" : "",
+             dump->has_filter ? dump->filter : "");
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    qemu_event_init(&s->event, false);
+    qemu_thread_create(&s->thread, "net-dump", dump_writer_thread, s,
+                       QEMU_THREAD_JOINABLE);
+
     return 0;
 }
 
@@ -182,5 +687,5 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len, errp);
+    return net_dump_init(peer, "dump", name, dump, file, len, errp);
 }
@@ -168,6 +168,17 @@ eth_calc_pseudo_hdr_csum(struct ip_header *iphdr, uint16_t csl)
     return net_checksum_add(sizeof(ipph), (uint8_t *) &ipph);
 }
 
+uint32_t
+eth_calc_ip6_pseudo_hdr_csum(struct ip6_header *ip6hdr, uint16_t csl,
+                             uint8_t l4proto)
+{
+    /* Source and destination addresses, then the 32-bit upper layer
+     * length and the next header, which fit in the low 16-bit words.
+     */
+    return net_checksum_add(2 * sizeof(struct in6_address),
+                            (uint8_t *) &ip6hdr->ip6_src) + csl + l4proto;
+}
+
 static bool
 eth_is_ip6_extension_header_type(uint8_t hdr_type)
 {
@@ -14,70 +14,209 @@
 
 #include "monitor/monitor.h"
 #include "net/net.h"
+#include "net/eth.h"
 #include "clients.h"
 #include "hub.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /*
  * A hub broadcasts incoming packets to all its ports except the source port.
  * Hubs can be used to provide independent network segments, also confusingly
  * named the QEMU 'vlan' feature.
+ *
+ * The hub learns which port each source MAC address is behind.  Unicast
+ * packets for a known address skip the ports that are not promiscuous.
+ *
+ * A packet for a port whose peer cannot take it right away is queued by
+ * reference.  One copy is shared by all the ports that queue it.  Each
+ * port queues at most NET_HUB_PORT_QUEUE_LEN packets and drops the rest,
+ * so a slow peer neither holds back the others nor grows without bound.
  */
 
+#define NET_HUB_PORT_QUEUE_LEN  256
+#define NET_HUB_MAC_TABLE_SIZE  256     /* direct mapped, power of two */
+#define NET_HUB_MAC_AGE_MS      (300 * 1000)
+
 typedef struct NetHub NetHub;
 
+typedef struct NetHubPacket {
+    int refcnt;
+    struct iovec iov;
+    uint8_t data[];
+} NetHubPacket;
+
 typedef struct NetHubPort {
     NetClientState nc;
     QLIST_ENTRY(NetHubPort) next;
     NetHub *hub;
     int id;
+    bool promiscuous;
+
+    /* Packets in the queue of the peer, in the order they were sent */
+    NetHubPacket *pending[NET_HUB_PORT_QUEUE_LEN];
+    unsigned int pending_head;
+    unsigned int pending_count;
 } NetHubPort;
 
+typedef struct NetHubMacEntry {
+    uint8_t mac[ETH_ALEN];
+    NetHubPort *port;
+    int64_t last_seen;
+} NetHubMacEntry;
+
 struct NetHub {
     int id;
     QLIST_ENTRY(NetHub) next;
     int num_ports;
     QLIST_HEAD(, NetHubPort) ports;
+    NetHubMacEntry macs[NET_HUB_MAC_TABLE_SIZE];
 };
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static NetHubPacket *net_hub_packet_new(const struct iovec *iov, int iovcnt,
+                                        size_t len)
 {
-    NetHubPort *port;
+    NetHubPacket *pkt = g_malloc(sizeof(*pkt) + len);
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
+    pkt->refcnt = 1;
+    pkt->iov.iov_base = pkt->data;
+    pkt->iov.iov_len = iov_to_buf(iov, iovcnt, 0, pkt->data, len);
+    return pkt;
+}
 
-        qemu_send_packet(&port->nc, buf, len);
+static void net_hub_packet_unref(NetHubPacket *pkt)
+{
+    if (--pkt->refcnt == 0) {
+        g_free(pkt);
     }
-    return len;
+}
+
+static void net_hub_port_sent(NetClientState *nc, ssize_t len)
+{
+    NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    NetHubPacket *pkt;
+
+    assert(port->pending_count);
+    pkt = port->pending[port->pending_head];
+    port->pending_head = (port->pending_head + 1) % NET_HUB_PORT_QUEUE_LEN;
+    port->pending_count--;
+    net_hub_packet_unref(pkt);
+}
+
+static void net_hub_port_queue(NetHubPort *port, NetHubPacket *pkt)
+{
+    unsigned int tail;
+
+    if (port->pending_count == NET_HUB_PORT_QUEUE_LEN) {
+        return;
+    }
+
+    tail = (port->pending_head + port->pending_count) %
+           NET_HUB_PORT_QUEUE_LEN;
+    port->pending[tail] = pkt;
+    port->pending_count++;
+    pkt->refcnt++;
+
+    /* Unless it was queued, the peer is done with the packet already */
+    if (qemu_sendv_packet_zerocopy(&port->nc, &pkt->iov, 1,
+                                   net_hub_port_sent) != 0) {
+        port->pending_count--;
+        net_hub_packet_unref(pkt);
+    }
+}
+
+static NetHubMacEntry *net_hub_mac_entry(NetHub *hub, const uint8_t *mac)
+{
+    unsigned int hash = (mac[3] * 31 + mac[4]) * 31 + mac[5];
+
+    return &hub->macs[hash & (NET_HUB_MAC_TABLE_SIZE - 1)];
+}
+
+/*
+ * Learn the port of the source address in @eth, the first 12 bytes of a
+ * packet.  Returns the port the destination is known to be behind, or
+ * NULL if the packet has to go everywhere.
+ */
+static NetHubPort *net_hub_learn(NetHub *hub, NetHubPort *source_port,
+                                 const uint8_t *eth)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    NetHubMacEntry *entry;
+
+    if (!(eth[ETH_ALEN] & 1)) {
+        entry = net_hub_mac_entry(hub, eth + ETH_ALEN);
+        memcpy(entry->mac, eth + ETH_ALEN, ETH_ALEN);
+        entry->port = source_port;
+        entry->last_seen = now;
+    }
+
+    if (eth[0] & 1) {
+        return NULL;
+    }
+    entry = net_hub_mac_entry(hub, eth);
+    if (entry->port && !memcmp(entry->mac, eth, ETH_ALEN) &&
+        now - entry->last_seen < NET_HUB_MAC_AGE_MS) {
+        return entry->port;
+    }
+    return NULL;
 }
 
 static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
                                    const struct iovec *iov, int iovcnt)
 {
-    NetHubPort *port;
+    NetHubPort *port, *dest = NULL;
+    NetHubPacket *pkt = NULL;
     ssize_t len = iov_size(iov, iovcnt);
+    uint8_t eth[2 * ETH_ALEN];
+
+    if (iov_to_buf(iov, iovcnt, 0, eth, sizeof(eth)) == sizeof(eth)) {
+        dest = net_hub_learn(hub, source_port, eth);
+    }
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
+        if (dest && port != dest && !port->promiscuous) {
+            continue;
+        }
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
+        if (qemu_can_send_packet(&port->nc)) {
+            qemu_sendv_packet(&port->nc, iov, iovcnt);
+            continue;
+        }
+
+        /* The peer is busy, queue a copy shared with the other busy ports */
+        if (!pkt) {
+            pkt = net_hub_packet_new(iov, iovcnt, len);
+        }
+        net_hub_port_queue(port, pkt);
+    }
+
+    if (pkt) {
+        net_hub_packet_unref(pkt);
     }
     return len;
 }
 
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
+{
+    const struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = len
+    };
+
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
+}
+
 static NetHub *net_hub_new(int id)
 {
     NetHub *hub;
 
-    hub = g_malloc(sizeof(*hub));
+    hub = g_malloc0(sizeof(*hub));
     hub->id = id;
     hub->num_ports = 0;
     QLIST_INIT(&hub->ports);
@@ -125,7 +264,17 @@ static ssize_t net_hub_port_receive_iov(NetClientState *nc,
 static void net_hub_port_cleanup(NetClientState *nc)
 {
     NetHubPort *port = DO_UPCAST(NetHubPort, nc, nc);
+    int i;
+
+    /* Drop our references from the queue of the peer */
+    qemu_purge_queued_packets(nc);
+    assert(port->pending_count == 0);
 
+    for (i = 0; i < NET_HUB_MAC_TABLE_SIZE; i++) {
+        if (port->hub->macs[i].port == port) {
+            port->hub->macs[i].port = NULL;
+        }
+    }
     QLIST_REMOVE(port, next);
 }
 
@@ -155,6 +304,7 @@ static NetHubPort *net_hub_port_new(NetHub *hub, const char *name)
     port = DO_UPCAST(NetHubPort, nc, nc);
     port->id = id;
     port->hub = hub;
+    port->promiscuous = true;
 
     QLIST_INSERT_HEAD(&hub->ports, port, next);
 
@@ -284,12 +434,16 @@ int net_init_hubport(const NetClientOptions *opts, const char *name,
                      NetClientState *peer, Error **errp)
 {
     const NetdevHubPortOptions *hubport;
+    NetClientState *nc;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_HUBPORT);
     assert(!peer);
     hubport = opts->hubport;
 
-    net_hub_add_port(hubport->hubid, name);
+    nc = net_hub_add_port(hubport->hubid, name);
+    if (hubport->has_promiscuous) {
+        DO_UPCAST(NetHubPort, nc, nc)->promiscuous = hubport->promiscuous;
+    }
     return 0;
 }
 
@@ -34,6 +34,7 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "batch.h"
 
 
 /* The buffer size needs to be investigated for optimum numbers and
@@ -69,6 +70,13 @@ typedef struct NetL2TPV3State {
     uint8_t *header_buf;
     struct iovec *vec;
 
+    /*
+     * these are used for batched xmit, one header per packet
+     */
+
+    uint8_t *tx_headers;
+    struct iovec *tx_vec;
+
     /*
      * these are used for receive - try to "eat" up to 32 packets at a time
      */
@@ -179,32 +187,32 @@ static void l2tpv3_poll(NetClientState *nc, bool enable)
     l2tpv3_read_poll(s, enable);
 }
 
-static void l2tpv3_form_header(NetL2TPV3State *s)
+static void l2tpv3_form_header(NetL2TPV3State *s, uint8_t *header_buf)
 {
     uint32_t *counter;
 
     if (s->udp) {
-        stl_be_p((uint32_t *) s->header_buf, L2TPV3_DATA_PACKET);
+        stl_be_p((uint32_t *) header_buf, L2TPV3_DATA_PACKET);
     }
     stl_be_p(
-            (uint32_t *) (s->header_buf + s->session_offset),
+            (uint32_t *) (header_buf + s->session_offset),
             s->tx_session
         );
     if (s->cookie) {
         if (s->cookie_is_64) {
             stq_be_p(
-                (uint64_t *)(s->header_buf + s->cookie_offset),
+                (uint64_t *)(header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         } else {
             stl_be_p(
-                (uint32_t *) (s->header_buf + s->cookie_offset),
+                (uint32_t *) (header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         }
     }
     if (s->has_counter) {
-        counter = (uint32_t *)(s->header_buf + s->counter_offset);
+        counter = (uint32_t *)(header_buf + s->counter_offset);
         if (s->pin_counter) {
             *counter = 0;
         } else {
@@ -229,7 +237,7 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
         );
         return -1;
     }
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     memcpy(s->vec + 1, iov, iovcnt * sizeof(struct iovec));
     s->vec->iov_base = s->header_buf;
     s->vec->iov_len = s->offset;
@@ -271,7 +279,7 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     vec = s->vec;
     vec->iov_base = s->header_buf;
     vec->iov_len = s->offset;
@@ -306,6 +314,48 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     return ret;
 }
 
+/*
+ * Send a batch with one header per packet and a single sendmmsg() call
+ * for up to MAX_L2TPV3_MSGCNT packets.  The counter advances only for the
+ * packets that went out, so queued ones do not leave gaps.
+ */
+static int net_l2tpv3_receive_dgram_batch(NetClientState *nc,
+                                          const struct iovec *pkts,
+                                          int count)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+    int i, n, ret, done = 0;
+
+    while (done < count) {
+        n = MIN(count - done, MAX_L2TPV3_MSGCNT);
+        for (i = 0; i < n; i++) {
+            uint8_t *header = s->tx_headers + i * s->offset;
+
+            l2tpv3_form_header(s, header);
+            s->tx_vec[i * IOVSIZE].iov_base = header;
+            s->tx_vec[i * IOVSIZE].iov_len = s->offset;
+            s->tx_vec[i * IOVSIZE + 1] = pkts[done + i];
+        }
+
+        ret = net_dgram_send_batch(s->fd, (struct sockaddr *)s->dgram_dst,
+                                   s->dst_size, s->tx_vec, IOVSIZE, n);
+        if (ret < 0) {
+            /* drop a packet the socket refuses, wait if it is full */
+            ret = (errno == EAGAIN || errno == ENOBUFS) ? 0 : 1;
+        }
+        if (s->has_counter && !s->pin_counter) {
+            s->counter -= n - ret;
+        }
+        done += ret;
+        if (ret == 0) {
+            /* signal upper layer that socket buffer is full */
+            l2tpv3_write_poll(s, true);
+            break;
+        }
+    }
+    return done;
+}
+
 static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 {
 
@@ -346,54 +396,40 @@ static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 
 static void net_l2tpv3_process_queue(NetL2TPV3State *s)
 {
-    int size = 0;
+    struct iovec pkts[MAX_L2TPV3_MSGCNT];
     struct iovec *vec;
-    bool bad_read;
-    int data_size;
+    int data_size, count = 0;
     struct mmsghdr *msgvec;
 
-    /* go into ring mode only if there is a "pending" tail */
-    if (s->queue_depth > 0) {
-        do {
-            msgvec = s->msgvec + s->queue_tail;
-            if (msgvec->msg_len > 0) {
-                data_size = msgvec->msg_len - s->header_size;
-                vec = msgvec->msg_hdr.msg_iov;
-                if ((data_size > 0) &&
-                    (l2tpv3_verify_header(s, vec->iov_base) == 0)) {
-                    vec++;
-                    /* Use the legacy delivery for now, we will
-                     * switch to using our own ring as a queueing mechanism
-                     * at a later date
-                     */
-                    size = qemu_send_packet_async(
-                            &s->nc,
-                            vec->iov_base,
-                            data_size,
-                            l2tpv3_send_completed
-                        );
-                    if (size == 0) {
-                        l2tpv3_read_poll(s, false);
-                    }
-                    bad_read = false;
-                } else {
-                    bad_read = true;
-                    if (!s->header_mismatch) {
-                        /* report error only once */
-                        error_report("l2tpv3 header verification failed");
-                        s->header_mismatch = true;
-                    }
-                }
-            } else {
-                bad_read = true;
+    /*
+     * Pass all the good packets up as one batch; whatever the peer
+     * cannot take right away is queued by the net layer, so the ring
+     * is always drained.
+     */
+    while (s->queue_depth > 0) {
+        msgvec = s->msgvec + s->queue_tail;
+        if (msgvec->msg_len > 0) {
+            data_size = msgvec->msg_len - s->header_size;
+            vec = msgvec->msg_hdr.msg_iov;
+            if ((data_size > 0) &&
+                (l2tpv3_verify_header(s, vec->iov_base) == 0)) {
+                vec++;
+                pkts[count].iov_base = vec->iov_base;
+                pkts[count].iov_len = data_size;
+                count++;
+            } else if (!s->header_mismatch) {
+                /* report error only once */
+                error_report("l2tpv3 header verification failed");
+                s->header_mismatch = true;
             }
-            s->queue_tail = (s->queue_tail + 1) % MAX_L2TPV3_MSGCNT;
-            s->queue_depth--;
-        } while (
-                (s->queue_depth > 0) &&
-                 qemu_can_send_packet(&s->nc) &&
-                ((size > 0) || bad_read)
-            );
+        }
+        s->queue_tail = (s->queue_tail + 1) % MAX_L2TPV3_MSGCNT;
+        s->queue_depth--;
+    }
+
+    if (count && qemu_send_packet_batch_async(&s->nc, pkts, count,
+                                              l2tpv3_send_completed) < count) {
+        l2tpv3_read_poll(s, false);
     }
 }
 
@@ -512,6 +548,8 @@ static void net_l2tpv3_cleanup(NetClientState *nc)
     destroy_vector(s->msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
     g_free(s->vec);
     g_free(s->header_buf);
+    g_free(s->tx_vec);
+    g_free(s->tx_headers);
     g_free(s->dgram_dst);
 }
 
@@ -520,16 +558,18 @@ static NetClientInfo net_l2tpv3_info = {
     .size = sizeof(NetL2TPV3State),
     .receive = net_l2tpv3_receive_dgram,
     .receive_iov = net_l2tpv3_receive_dgram_iov,
+    .receive_batch = net_l2tpv3_receive_dgram_batch,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
 };
 
-int net_init_l2tpv3(const NetClientOptions *opts,
-                    const char *name,
-                    NetClientState *peer, Error **errp)
+/* With @reuseport, several queues share the local address; the kernel
+ * spreads the incoming flows among their sockets.
+ */
+static int net_l2tpv3_init_one(const NetdevL2TPv3Options *l2tpv3,
+                               const char *name,
+                               NetClientState *peer, bool reuseport)
 {
-    /* FIXME error_setg(errp, ...) on failure */
-    const NetdevL2TPv3Options *l2tpv3;
     NetL2TPV3State *s;
     NetClientState *nc;
     int fd = -1, gairet;
@@ -545,9 +585,6 @@ int net_init_l2tpv3(const NetClientOptions *opts,
     s->queue_tail = 0;
     s->header_mismatch = false;
 
-    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_L2TPV3);
-    l2tpv3 = opts->l2tpv3;
-
     if (l2tpv3->has_ipv6 && l2tpv3->ipv6) {
         s->ipv6 = l2tpv3->ipv6;
     } else {
@@ -651,6 +688,15 @@ int net_init_l2tpv3(const NetClientOptions *opts,
         error_report("l2tpv3_open : socket creation failed, errno = %d", -fd);
         goto outerr;
     }
+    if (reuseport) {
+        int val = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+            error_report("l2tpv3_open : SO_REUSEPORT failed, errno = %d",
+                         errno);
+            goto outerr;
+        }
+    }
     if (bind(fd, (struct sockaddr *) result->ai_addr, result->ai_addrlen)) {
         error_report("l2tpv3_open :  could not bind socket err=%i", errno);
         goto outerr;
@@ -720,6 +766,8 @@ int net_init_l2tpv3(const NetClientOptions *opts,
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
     s->header_buf = g_malloc(s->header_size);
+    s->tx_vec = g_new(struct iovec, MAX_L2TPV3_MSGCNT * IOVSIZE);
+    s->tx_headers = g_malloc(MAX_L2TPV3_MSGCNT * s->offset);
 
     qemu_set_nonblock(fd);
 
@@ -742,3 +790,39 @@ outerr:
     return -1;
 }
 
+int net_init_l2tpv3(const NetClientOptions *opts,
+                    const char *name,
+                    NetClientState *peer, Error **errp)
+{
+    /* FIXME error_setg(errp, ...) on failure */
+    const NetdevL2TPv3Options *l2tpv3;
+    int queues, i;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_L2TPV3);
+    l2tpv3 = opts->l2tpv3;
+
+    queues = l2tpv3->has_queues ? l2tpv3->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("l2tpv3 number of queues must be in range [1, %d]",
+                     MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (queues > 1) {
+        /* every raw socket sees every packet, only UDP can be spread */
+        if (!(l2tpv3->has_udp && l2tpv3->udp)) {
+            error_report("l2tpv3_open : queues > 1 needs udp=on");
+            return -1;
+        }
+        if (peer) {
+            error_report("Multiqueue l2tpv3 cannot be used with hubs");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (net_l2tpv3_init_one(l2tpv3, name, peer, queues > 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
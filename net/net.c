@@ -28,6 +28,7 @@
 #include "hub.h"
 #include "net/slirp.h"
 #include "net/eth.h"
+#include "net/vhost_net.h"
 #include "util.h"
 
 #include "monitor/monitor.h"
@@ -44,6 +45,7 @@
 #include "qapi/opts-visitor.h"
 #include "qapi/dealloc-visitor.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/stats.h"
 
 /* Net bridge is currently not supported for W32. */
 #if !defined(_WIN32)
@@ -579,11 +581,59 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        nc->rx_packets++;
+        nc->rx_bytes += size;
     }
 
     return ret;
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (!(flags & QEMU_NET_PACKET_FLAG_RAW) && nc->info->receive_batch) {
+        i = nc->info->receive_batch(nc, pkts, count);
+    } else {
+        for (i = 0; i < count; i++) {
+            ssize_t ret;
+
+            if (flags & QEMU_NET_PACKET_FLAG_RAW && nc->info->receive_raw) {
+                ret = nc->info->receive_raw(nc, pkts[i].iov_base,
+                                            pkts[i].iov_len);
+            } else {
+                ret = nc->info->receive(nc, pkts[i].iov_base,
+                                        pkts[i].iov_len);
+            }
+            if (ret == 0) {
+                break;
+            }
+        }
+    }
+
+    if (i < count) {
+        nc->receive_disabled = 1;
+    }
+    nc->rx_packets += i;
+    nc->rx_bytes += iov_size(pkts, i);
+
+    return i;
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -648,6 +698,26 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Send @count packets, each of them described by a single iovec.  Returns
+ * the number of packets delivered right away; if it is less than @count,
+ * the others have been queued and @sent_cb is called once they are sent.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_batch(queue, sender, QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -695,14 +765,19 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        nc->rx_packets++;
+        nc->rx_bytes += iov_size(iov, iovcnt);
     }
 
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
 
@@ -712,11 +787,33 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/* Like qemu_sendv_packet_async(), but if the packet can't be delivered right
+ * away it is queued without copying the data.  The buffers (not the iovec
+ * array) must stay valid until @sent_cb is called.
+ */
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb)
+{
+    assert(sent_cb);
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1183,6 +1280,115 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+/* The queues of a multiqueue backend are the net clients sharing its name */
+VhostNetQueueInfoList *qmp_query_vhost_net(bool has_name, const char *name,
+                                           Error **errp)
+{
+    NetClientState *nc;
+    VhostNetQueueInfoList *head = NULL, **tail = &head;
+    bool found = false;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetClientState *ncs[MAX_QUEUE_NUM];
+        int queues, i;
+
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC ||
+            (has_name && strcmp(nc->name, name) != 0)) {
+            continue;
+        }
+        found = true;
+
+        queues = qemu_find_net_clients_except(nc->name, ncs,
+                                              NET_CLIENT_OPTIONS_KIND_NIC,
+                                              MAX_QUEUE_NUM);
+        /* list each backend once, starting from its first queue */
+        if (ncs[0] != nc) {
+            continue;
+        }
+
+        for (i = 0; i < queues; i++) {
+            VHostNetState *net = get_vhost_net(ncs[i]);
+            VhostNetQueueInfoList *entry;
+            VhostNetQueueInfo *info;
+
+            if (!net) {
+                continue;
+            }
+
+            info = g_new0(VhostNetQueueInfo, 1);
+            info->name = g_strdup(nc->name);
+            info->queue = i;
+            info->backend = g_strdup(vhost_net_get_backend_type(net) ==
+                                     VHOST_BACKEND_TYPE_USER ? "user" :
+                                     "kernel");
+            info->started = vhost_net_is_started(net);
+            info->poll_us = vhost_net_get_busyloop_timeout(net);
+
+            entry = g_new0(VhostNetQueueInfoList, 1);
+            entry->value = info;
+            *tail = entry;
+            tail = &entry->next;
+        }
+
+        if (has_name) {
+            break;
+        }
+    }
+
+    if (has_name && !found) {
+        error_setg(errp, "invalid net client name: %s", name);
+    } else if (has_name && !head) {
+        error_setg(errp, "net client(%s) doesn't use vhost", name);
+    }
+
+    return head;
+}
+
+void qmp_netdev_set_vhost_poll(const char *name, bool has_queue,
+                               int64_t queue, uint32_t poll_us, Error **errp)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i, r;
+
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", name);
+        return;
+    }
+    if (has_queue && (queue < 0 || queue >= queues)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "queue",
+                   "a valid queue index");
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VHostNetState *net;
+
+        if (has_queue && i != queue) {
+            continue;
+        }
+
+        net = get_vhost_net(ncs[i]);
+        if (!net) {
+            error_setg(errp, "net client(%s) doesn't use vhost", name);
+            return;
+        }
+        r = vhost_net_set_busyloop_timeout(net, poll_us);
+        if (r == -ENOSYS) {
+            error_setg(errp, "vhost of net client(%s) doesn't support"
+                       " busy polling", name);
+            return;
+        } else if (r < 0) {
+            error_setg_errno(errp, -r, "could not set busy polling of"
+                             " net client(%s)", name);
+            return;
+        }
+    }
+}
+
 void hmp_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -1363,6 +1569,21 @@ static int net_init_netdev(void *dummy, QemuOpts *opts, Error **errp)
     return ret;
 }
 
+static void net_stats_query(StatsSink *sink, void *opaque)
+{
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->queue_index) {
+            stats_add_instance(sink, "%s/queue%u", nc->name, nc->queue_index);
+        } else {
+            stats_add_instance(sink, "%s", nc->name);
+        }
+        stats_add_counter(sink, "rx-packets", nc->rx_packets);
+        stats_add_counter(sink, "rx-bytes", nc->rx_bytes);
+    }
+}
+
 int net_init_clients(void)
 {
     QemuOptsList *net = qemu_find_opts("net");
@@ -1379,6 +1600,7 @@ int net_init_clients(void)
         qemu_add_vm_change_state_handler(net_vm_change_state_handler, NULL);
 
     QTAILQ_INIT(&net_clients);
+    stats_register_provider(STATS_PROVIDER_NET, net_stats_query, NULL);
 
     if (qemu_opts_foreach(qemu_find_opts("netdev"),
                           net_init_netdev, NULL, NULL)) {
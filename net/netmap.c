@@ -39,14 +39,26 @@
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 
+/*
+ * With a single queue all the hardware rings of the port are used.  With
+ * queues=N, each queue gets a netmap file descriptor bound to one pair of
+ * rings, which maps them on the queues of a multiqueue virtio-net.
+ *
+ * Up to NETMAP_BATCH received packets are passed on to the peer at once.
+ * The netmap TX ring is only synced when it runs out of slots, or from a
+ * bottom half once the packets available from the peer have been put in.
+ */
+#define NETMAP_BATCH    32
+
 /* Private netmap device info. */
 typedef struct NetmapPriv {
     int                 fd;
     size_t              memsize;
     void                *mem;
     struct netmap_if    *nifp;
-    struct netmap_ring  *rx;
-    struct netmap_ring  *tx;
+    unsigned int        first_tx_ring, last_tx_ring;
+    unsigned int        first_rx_ring, last_rx_ring;
+    unsigned int        cur_tx_ring;
     char                fdname[PATH_MAX];        /* Normally "/dev/netmap". */
     char                ifname[IFNAMSIZ];
 } NetmapPriv;
@@ -56,6 +68,8 @@ typedef struct NetmapState {
     NetmapPriv          me;
     bool                read_poll;
     bool                write_poll;
+    QEMUBH              *tx_bh;
+    bool                tx_pending;    /* Slots to hand over with TXSYNC. */
     struct iovec        iov[IOV_MAX];
     int                 vnet_hdr_len;  /* Current virtio-net header length. */
 } NetmapState;
@@ -87,10 +101,10 @@ pkt_copy(const void *_src, void *_dst, int l)
 #endif /* __FreeBSD__ */
 
 /*
- * Open a netmap device. We assume there is only one queue
- * (which is the case for the VALE bridge).
+ * Open a netmap device.  With @queues > 1, bind it to the pair of rings
+ * @ring only; a VALE port is created with @queues ring pairs.
  */
-static int netmap_open(NetmapPriv *me)
+static int netmap_open(NetmapPriv *me, int ring, int queues, Error **errp)
 {
     int fd;
     int err;
@@ -99,32 +113,50 @@ static int netmap_open(NetmapPriv *me)
 
     me->fd = fd = open(me->fdname, O_RDWR);
     if (fd < 0) {
-        error_report("Unable to open netmap device '%s' (%s)",
-                        me->fdname, strerror(errno));
+        error_setg_errno(errp, errno, "Unable to open netmap device '%s'",
+                         me->fdname);
         return -1;
     }
     memset(&req, 0, sizeof(req));
     pstrcpy(req.nr_name, sizeof(req.nr_name), me->ifname);
     req.nr_ringid = NETMAP_NO_TX_POLL;
     req.nr_version = NETMAP_API;
+    if (queues > 1) {
+        req.nr_flags = NR_REG_ONE_NIC;
+        req.nr_ringid |= ring;
+        req.nr_tx_rings = req.nr_rx_rings = queues;
+    } else {
+        req.nr_flags = NR_REG_ALL_NIC;
+    }
     err = ioctl(fd, NIOCREGIF, &req);
     if (err) {
-        error_report("Unable to register %s: %s", me->ifname, strerror(errno));
+        error_setg_errno(errp, errno, "Unable to register %s", me->ifname);
+        goto error;
+    }
+    if (req.nr_tx_rings < queues || req.nr_rx_rings < queues) {
+        error_setg(errp, "%s has %u TX and %u RX rings, %d queues requested",
+                   me->ifname, req.nr_tx_rings, req.nr_rx_rings, queues);
         goto error;
     }
     l = me->memsize = req.nr_memsize;
 
     me->mem = mmap(0, l, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
     if (me->mem == MAP_FAILED) {
-        error_report("Unable to mmap netmap shared memory: %s",
-                        strerror(errno));
+        error_setg_errno(errp, errno, "Unable to mmap netmap shared memory");
         me->mem = NULL;
         goto error;
     }
 
     me->nifp = NETMAP_IF(me->mem, req.nr_offset);
-    me->tx = NETMAP_TXRING(me->nifp, 0);
-    me->rx = NETMAP_RXRING(me->nifp, 0);
+    if (queues > 1) {
+        me->first_tx_ring = me->last_tx_ring = ring;
+        me->first_rx_ring = me->last_rx_ring = ring;
+    } else {
+        me->first_tx_ring = me->first_rx_ring = 0;
+        me->last_tx_ring = req.nr_tx_rings - 1;
+        me->last_rx_ring = req.nr_rx_rings - 1;
+    }
+    me->cur_tx_ring = me->first_tx_ring;
     return 0;
 
 error:
@@ -186,69 +218,77 @@ static void netmap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t netmap_receive(NetClientState *nc,
-      const uint8_t *buf, size_t size)
+/* Hand the filled TX slots over to the kernel. */
+static void netmap_tx_sync(NetmapState *s)
 {
-    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
-    struct netmap_ring *ring = s->me.tx;
-    uint32_t i;
-    uint32_t idx;
-    uint8_t *dst;
-
-    if (unlikely(!ring)) {
-        /* Drop. */
-        return size;
-    }
+    s->tx_pending = false;
+    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+}
 
-    if (unlikely(size > ring->nr_buf_size)) {
-        RD(5, "[netmap_receive] drop packet of size %d > %d\n",
-                                    (int)size, ring->nr_buf_size);
-        return size;
-    }
+/* Sync once the peer has put in all the packets it had for us. */
+static void netmap_tx_bh(void *opaque)
+{
+    NetmapState *s = opaque;
 
-    if (nm_ring_empty(ring)) {
-        /* No available slots in the netmap TX ring. */
-        netmap_write_poll(s, true);
-        return 0;
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
     }
+}
 
-    i = ring->cur;
-    idx = ring->slot[i].buf_idx;
-    dst = (uint8_t *)NETMAP_BUF(ring, idx);
+/* Find a TX ring with @slots free slots, starting from the last one used. */
+static struct netmap_ring *netmap_tx_ring(NetmapPriv *me, unsigned int slots)
+{
+    unsigned int n;
 
-    ring->slot[i].len = size;
-    ring->slot[i].flags = 0;
-    pkt_copy(buf, dst, size);
-    ring->cur = ring->head = nm_ring_next(ring, i);
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    for (n = me->first_tx_ring; n <= me->last_tx_ring; n++) {
+        struct netmap_ring *ring = NETMAP_TXRING(me->nifp, me->cur_tx_ring);
 
-    return size;
+        if (nm_ring_space(ring) >= slots) {
+            return ring;
+        }
+        me->cur_tx_ring = me->cur_tx_ring == me->last_tx_ring ?
+                          me->first_tx_ring : me->cur_tx_ring + 1;
+    }
+    return NULL;
 }
 
 static ssize_t netmap_receive_iov(NetClientState *nc,
                     const struct iovec *iov, int iovcnt)
 {
     NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
-    struct netmap_ring *ring = s->me.tx;
+    struct netmap_ring *ring;
+    unsigned int buf_size, slots = 0;
     uint32_t last;
     uint32_t idx;
     uint8_t *dst;
     int j;
     uint32_t i;
 
-    if (unlikely(!ring)) {
+    if (unlikely(s->me.fd < 0)) {
         /* Drop the packet. */
         return iov_size(iov, iovcnt);
     }
 
-    last = i = ring->cur;
+    /* All the rings of a port have the same buffer size. */
+    buf_size = NETMAP_TXRING(s->me.nifp, s->me.first_tx_ring)->nr_buf_size;
+    for (j = 0; j < iovcnt; j++) {
+        slots += DIV_ROUND_UP(iov[j].iov_len, buf_size);
+    }
 
-    if (nm_ring_space(ring) < iovcnt) {
+    ring = netmap_tx_ring(&s->me, slots);
+    if (!ring) {
+        /* Reclaim the slots the NIC is done with before giving up. */
+        netmap_tx_sync(s);
+        ring = netmap_tx_ring(&s->me, slots);
+    }
+    if (!ring) {
         /* Not enough netmap slots. */
         netmap_write_poll(s, true);
         return 0;
     }
 
+    last = i = ring->cur;
+
     for (j = 0; j < iovcnt; j++) {
         int iov_frag_size = iov[j].iov_len;
         int offset = 0;
@@ -257,14 +297,7 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
         /* Split each iovec fragment over more netmap slots, if
            necessary. */
         while (iov_frag_size) {
-            nm_frag_size = MIN(iov_frag_size, ring->nr_buf_size);
-
-            if (unlikely(nm_ring_empty(ring))) {
-                /* We run out of netmap slots while splitting the
-                   iovec fragments. */
-                netmap_write_poll(s, true);
-                return 0;
-            }
+            nm_frag_size = MIN(iov_frag_size, buf_size);
 
             idx = ring->slot[i].buf_idx;
             dst = (uint8_t *)NETMAP_BUF(ring, idx);
@@ -286,11 +319,27 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
     /* Now update ring->cur and ring->head. */
     ring->cur = ring->head = i;
 
-    ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    if (nm_ring_empty(ring)) {
+        netmap_tx_sync(s);
+    } else if (!s->tx_pending) {
+        s->tx_pending = true;
+        qemu_bh_schedule(s->tx_bh);
+    }
 
     return iov_size(iov, iovcnt);
 }
 
+static ssize_t netmap_receive(NetClientState *nc,
+      const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return netmap_receive_iov(nc, &iov, 1);
+}
+
 /* Complete a previous send (backend --> guest) and enable the
    fd_read callback. */
 static void netmap_send_completed(NetClientState *nc, ssize_t len)
@@ -300,45 +349,77 @@ static void netmap_send_completed(NetClientState *nc, ssize_t len)
     netmap_read_poll(s, true);
 }
 
+/* Send a packet spread over several slots.  Returns false if it was
+   queued by the peer. */
+static bool netmap_send_frags(NetmapState *s, struct netmap_ring *ring)
+{
+    uint32_t i;
+    uint32_t idx;
+    bool morefrag;
+    int iovcnt = 0;
+
+    do {
+        i = ring->cur;
+        idx = ring->slot[i].buf_idx;
+        morefrag = (ring->slot[i].flags & NS_MOREFRAG);
+        s->iov[iovcnt].iov_base = (u_char *)NETMAP_BUF(ring, idx);
+        s->iov[iovcnt].iov_len = ring->slot[i].len;
+        iovcnt++;
+
+        ring->cur = ring->head = nm_ring_next(ring, i);
+    } while (!nm_ring_empty(ring) && morefrag && iovcnt < IOV_MAX);
+
+    if (unlikely(nm_ring_empty(ring) && morefrag)) {
+        RD(5, "[netmap_send] ran out of slots, with a pending"
+               "incomplete packet\n");
+    }
+
+    return qemu_sendv_packet_async(&s->nc, s->iov, iovcnt,
+                                   netmap_send_completed) != 0;
+}
+
 static void netmap_send(void *opaque)
 {
     NetmapState *s = opaque;
-    struct netmap_ring *ring = s->me.rx;
+    struct iovec pkts[NETMAP_BATCH];
+    unsigned int r;
 
     /* Keep sending while there are available packets into the netmap
-       RX ring and the forwarding path towards the peer is open. */
-    while (!nm_ring_empty(ring)) {
-        uint32_t i;
-        uint32_t idx;
-        bool morefrag;
-        int iovcnt = 0;
-        int iovsize;
-
-        do {
-            i = ring->cur;
-            idx = ring->slot[i].buf_idx;
-            morefrag = (ring->slot[i].flags & NS_MOREFRAG);
-            s->iov[iovcnt].iov_base = (u_char *)NETMAP_BUF(ring, idx);
-            s->iov[iovcnt].iov_len = ring->slot[i].len;
-            iovcnt++;
-
-            ring->cur = ring->head = nm_ring_next(ring, i);
-        } while (!nm_ring_empty(ring) && morefrag);
-
-        if (unlikely(nm_ring_empty(ring) && morefrag)) {
-            RD(5, "[netmap_send] ran out of slots, with a pending"
-                   "incomplete packet\n");
-        }
+       RX rings and the forwarding path towards the peer is open. */
+    for (r = s->me.first_rx_ring; r <= s->me.last_rx_ring; r++) {
+        struct netmap_ring *ring = NETMAP_RXRING(s->me.nifp, r);
+
+        while (!nm_ring_empty(ring)) {
+            int count = 0;
+            int sent;
+
+            /* Packets in a single slot go to the peer in batches. */
+            while (count < NETMAP_BATCH && !nm_ring_empty(ring) &&
+                   !(ring->slot[ring->cur].flags & NS_MOREFRAG)) {
+                uint32_t i = ring->cur;
+
+                pkts[count].iov_base = NETMAP_BUF(ring, ring->slot[i].buf_idx);
+                pkts[count].iov_len = ring->slot[i].len;
+                count++;
+                ring->cur = ring->head = nm_ring_next(ring, i);
+            }
 
-        iovsize = qemu_sendv_packet_async(&s->nc, s->iov, iovcnt,
-                                            netmap_send_completed);
+            if (count) {
+                sent = qemu_send_packet_batch_async(&s->nc, pkts, count,
+                                                    netmap_send_completed);
+            } else {
+                count = 1;
+                sent = netmap_send_frags(s, ring);
+            }
 
-        if (iovsize == 0) {
-            /* The peer does not receive anymore. Packet is queued, stop
-             * reading from the backend until netmap_send_completed()
-             */
-            netmap_read_poll(s, false);
-            break;
+            if (sent < count) {
+                /* The peer does not receive anymore. Packets are queued,
+                 * stop reading from the backend until
+                 * netmap_send_completed()
+                 */
+                netmap_read_poll(s, false);
+                return;
+            }
         }
     }
 }
@@ -351,6 +432,10 @@ static void netmap_cleanup(NetClientState *nc)
     qemu_purge_queued_packets(nc);
 
     netmap_poll(nc, false);
+    if (s->tx_pending) {
+        netmap_tx_sync(s);
+    }
+    qemu_bh_delete(s->tx_bh);
     munmap(s->me.mem, s->me.memsize);
     close(s->me.fd);
 
@@ -433,30 +518,45 @@ static NetClientInfo net_netmap_info = {
 
 /* The exported init function
  *
- * ... -net netmap,ifname="..."
+ * ... -net netmap,ifname="...",queues=N
  */
 int net_init_netmap(const NetClientOptions *opts,
                     const char *name, NetClientState *peer, Error **errp)
 {
-    /* FIXME error_setg(errp, ...) on failure */
     const NetdevNetmapOptions *netmap_opts = opts->netmap;
     NetClientState *nc;
     NetmapPriv me;
     NetmapState *s;
+    int queues, i;
+
+    queues = netmap_opts->has_queues ? netmap_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "netmap number of queues must be in range "
+                   "[1, %d]", MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (peer && queues > 1) {
+        error_setg(errp, "Multiqueue netmap cannot be used with hubs");
+        return -1;
+    }
 
     pstrcpy(me.fdname, sizeof(me.fdname),
         netmap_opts->has_devname ? netmap_opts->devname : "/dev/netmap");
     /* Set default name for the port if not supplied. */
     pstrcpy(me.ifname, sizeof(me.ifname), netmap_opts->ifname);
-    if (netmap_open(&me)) {
-        return -1;
+
+    for (i = 0; i < queues; i++) {
+        if (netmap_open(&me, i, queues, errp)) {
+            return -1;
+        }
+        /* Create the object. */
+        nc = qemu_new_net_client(&net_netmap_info, peer, "netmap", name);
+        s = DO_UPCAST(NetmapState, nc, nc);
+        s->me = me;
+        s->vnet_hdr_len = 0;
+        s->tx_bh = qemu_bh_new(netmap_tx_bh, s);
+        netmap_read_poll(s, true); /* Initially only poll for reads. */
     }
-    /* Create the object. */
-    nc = qemu_new_net_client(&net_netmap_info, peer, "netmap", name);
-    s = DO_UPCAST(NetmapState, nc, nc);
-    s->me = me;
-    s->vnet_hdr_len = 0;
-    netmap_read_poll(s, true); /* Initially only poll for reads. */
 
     return 0;
 }
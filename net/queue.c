@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -37,14 +38,34 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets sent with QEMU_NET_PACKET_FLAG_ZEROCOPY are queued by reference:
+ * only the iovec array is copied, and the sender must keep the buffers
+ * valid until the sent callback has been invoked.
+ */
+
+/* Packets of up to NET_QUEUE_SLOT_SIZE bytes (an MTU sized frame plus
+ * virtio-net header) are allocated with a fixed size, so that they can be
+ * recycled through the free list of the queue instead of going back to the
+ * allocator for every queued frame.
  */
+#define NET_QUEUE_SLOT_SIZE 2048
+#define NET_QUEUE_FREE_MAX  256
+
+#define NET_QUEUE_RING_INIT 64
+
+/* Maximum number of packets handed to qemu_deliver_packet_batch() at once */
+#define NET_QUEUE_BATCH     32
 
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
+    NetPacket *next_free;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    bool recycle;
+    int iovcnt;
+    struct iovec *iov;          /* zero-copy packets only */
     uint8_t data[0];
 };
 
@@ -53,7 +74,13 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    /* FIFO of queued packets; ring_size is a power of two */
+    NetPacket **ring;
+    uint32_t ring_size;
+    uint32_t head;
+
+    NetPacket *free_list;
+    uint32_t nfree;
 
     unsigned delivering : 1;
 };
@@ -68,22 +95,112 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
 
-    QTAILQ_INIT(&queue->packets);
+    queue->ring_size = NET_QUEUE_RING_INIT;
+    queue->ring = g_new(NetPacket *, queue->ring_size);
+    queue->head = 0;
+
+    queue->free_list = NULL;
+    queue->nfree = 0;
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size > NET_QUEUE_SLOT_SIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->recycle = false;
+    } else if (queue->free_list) {
+        packet = queue->free_list;
+        queue->free_list = packet->next_free;
+        queue->nfree--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + NET_QUEUE_SLOT_SIZE);
+        packet->recycle = true;
+    }
+    packet->iov = NULL;
+    packet->iovcnt = 0;
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->recycle && queue->nfree < NET_QUEUE_FREE_MAX) {
+        packet->next_free = queue->free_list;
+        queue->free_list = packet;
+        queue->nfree++;
+        return;
+    }
+    g_free(packet);
+}
+
+static inline NetPacket **qemu_net_queue_entry(NetQueue *queue, uint32_t i)
+{
+    return &queue->ring[(queue->head + i) & (queue->ring_size - 1)];
+}
+
+static void qemu_net_queue_grow(NetQueue *queue)
+{
+    NetPacket **ring;
+    uint32_t i;
+
+    ring = g_new(NetPacket *, queue->ring_size * 2);
+    for (i = 0; i < queue->nq_count; i++) {
+        ring[i] = *qemu_net_queue_entry(queue, i);
+    }
+    g_free(queue->ring);
+
+    queue->ring = ring;
+    queue->ring_size *= 2;
+    queue->head = 0;
+}
+
+static void qemu_net_queue_insert_tail(NetQueue *queue, NetPacket *packet)
+{
+    if (queue->nq_count == queue->ring_size) {
+        qemu_net_queue_grow(queue);
+    }
+    *qemu_net_queue_entry(queue, queue->nq_count) = packet;
+    queue->nq_count++;
+}
+
+static void qemu_net_queue_insert_head(NetQueue *queue, NetPacket *packet)
+{
+    if (queue->nq_count == queue->ring_size) {
+        qemu_net_queue_grow(queue);
+    }
+    queue->head = (queue->head - 1) & (queue->ring_size - 1);
+    queue->ring[queue->head] = packet;
+    queue->nq_count++;
+}
+
+static NetPacket *qemu_net_queue_remove_head(NetQueue *queue)
+{
+    NetPacket *packet = queue->ring[queue->head];
+
+    queue->head = (queue->head + 1) & (queue->ring_size - 1);
+    queue->nq_count--;
+    return packet;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    NetPacket *packet;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+    while (queue->nq_count) {
+        g_free(qemu_net_queue_remove_head(queue));
+    }
+    while (queue->free_list) {
+        packet = queue->free_list;
+        queue->free_list = packet->next_free;
         g_free(packet);
     }
 
+    g_free(queue->ring);
     g_free(queue);
 }
 
@@ -99,15 +216,14 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert_tail(queue, packet);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -124,11 +240,27 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    if (flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) {
+        assert(sent_cb);
+        packet = qemu_net_queue_alloc_packet(queue, iovcnt * sizeof(*iov));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = iov_size(iov, iovcnt);
+        packet->iov = (struct iovec *)packet->data;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+
+        qemu_net_queue_insert_tail(queue, packet);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -141,8 +273,7 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         packet->size += len;
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert_tail(queue, packet);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -175,6 +306,21 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const struct iovec *pkts,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(sender, flags, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -225,48 +371,126 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Each element of @pkts is a whole packet.  Returns the number of packets
+ * that were delivered; the others have been queued or dropped, and the
+ * caller must wait for @sent_cb before sending more if that number is
+ * smaller than @count.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int ret, i;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        ret = 0;
+    } else {
+        ret = qemu_net_queue_deliver_batch(queue, sender, flags, pkts, count);
+    }
+
+    for (i = ret; i < count; i++) {
+        qemu_net_queue_append(queue, sender, flags, pkts[i].iov_base,
+                              pkts[i].iov_len, sent_cb);
+    }
+
+    if (ret == count) {
+        qemu_net_queue_flush(queue);
+    }
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    NetPacket *packet, *purged = NULL, **tail = &purged;
+    uint32_t i, count = queue->nq_count;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
+    /* Compact the ring first, the callbacks may queue new packets */
+    queue->nq_count = 0;
+    for (i = 0; i < count; i++) {
+        packet = *qemu_net_queue_entry(queue, i);
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            if (packet->sent_cb) {
-                packet->sent_cb(packet->sender, 0);
-            }
-            g_free(packet);
+            packet->next_free = NULL;
+            *tail = packet;
+            tail = &packet->next_free;
+        } else {
+            *qemu_net_queue_entry(queue, queue->nq_count++) = packet;
+        }
+    }
+
+    while (purged) {
+        packet = purged;
+        purged = packet->next_free;
+        if (packet->sent_cb) {
+            packet->sent_cb(packet->sender, 0);
         }
+        qemu_net_queue_free_packet(queue, packet);
     }
 }
 
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
-
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+    while (queue->nq_count) {
+        NetPacket *batch[NET_QUEUE_BATCH];
+        struct iovec pkts[NET_QUEUE_BATCH];
+        int count, ret, i;
+
+        batch[0] = qemu_net_queue_remove_head(queue);
+        if (batch[0]->iov) {
+            ssize_t len;
+
+            len = qemu_net_queue_deliver_iov(queue,
+                                             batch[0]->sender,
+                                             batch[0]->flags,
+                                             batch[0]->iov,
+                                             batch[0]->iovcnt);
+            if (len == 0) {
+                qemu_net_queue_insert_head(queue, batch[0]);
+                return false;
+            }
+
+            batch[0]->sent_cb(batch[0]->sender, len);
+            qemu_net_queue_free_packet(queue, batch[0]);
+            continue;
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        /* Packets from the same sender with the same flags go out together */
+        for (count = 1; count < NET_QUEUE_BATCH && queue->nq_count; count++) {
+            NetPacket *next = *qemu_net_queue_entry(queue, 0);
+
+            if (next->sender != batch[0]->sender ||
+                next->flags != batch[0]->flags) {
+                break;
+            }
+            batch[count] = qemu_net_queue_remove_head(queue);
+        }
+        for (i = 0; i < count; i++) {
+            pkts[i].iov_base = batch[i]->data;
+            pkts[i].iov_len = batch[i]->size;
         }
 
-        g_free(packet);
+        ret = qemu_net_queue_deliver_batch(queue,
+                                           batch[0]->sender,
+                                           batch[0]->flags,
+                                           pkts, count);
+
+        for (i = count - 1; i >= ret; i--) {
+            qemu_net_queue_insert_head(queue, batch[i]);
+        }
+
+        for (i = 0; i < ret; i++) {
+            if (batch[i]->sent_cb) {
+                batch[i]->sent_cb(batch[i]->sender, batch[i]->size);
+            }
+            qemu_net_queue_free_packet(queue, batch[i]);
+        }
+
+        if (ret < count) {
+            return false;
+        }
     }
     return true;
 }
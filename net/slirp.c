@@ -138,7 +138,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          int tcp_sndbuf, int tcp_rcvbuf)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -244,7 +245,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     s = DO_UPCAST(SlirpState, nc, nc);
 
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
-                          tftp_export, bootfile, dhcp, dns, dnssearch, s);
+                          tftp_export, bootfile, dhcp, dns, dnssearch,
+                          tcp_sndbuf, tcp_rcvbuf, s);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
 
     for (config = slirp_configs; config; config = config->next) {
@@ -749,6 +751,21 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_USER);
     user = opts->user;
 
+    if (user->has_tcp_sndbuf &&
+        (user->tcp_sndbuf < SLIRP_TCP_BUF_MIN ||
+         user->tcp_sndbuf > SLIRP_TCP_BUF_MAX)) {
+        error_setg(errp, "tcp-sndbuf must be between %d and %d bytes",
+                   SLIRP_TCP_BUF_MIN, SLIRP_TCP_BUF_MAX);
+        return -1;
+    }
+    if (user->has_tcp_rcvbuf &&
+        (user->tcp_rcvbuf < SLIRP_TCP_BUF_MIN ||
+         user->tcp_rcvbuf > SLIRP_TCP_BUF_MAX)) {
+        error_setg(errp, "tcp-rcvbuf must be between %d and %d bytes",
+                   SLIRP_TCP_BUF_MIN, SLIRP_TCP_BUF_MAX);
+        return -1;
+    }
+
     vnet = user->has_net ? g_strdup(user->net) :
            user->has_ip  ? g_strdup_printf("%s/24", user->ip) :
            NULL;
@@ -763,7 +780,8 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch, user->tcp_sndbuf,
+                         user->tcp_rcvbuf);
 
     while (slirp_configs) {
         config = slirp_configs;
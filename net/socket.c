@@ -32,6 +32,12 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "batch.h"
+
+/* Datagrams received per net_socket_send_dgram() call.  Each gets a
+ * NET_BUFSIZE buffer, but only the pages that datagrams reach are touched.
+ */
+#define NET_SOCKET_BATCH 32
 
 typedef struct NetSocketState {
     NetClientState nc;
@@ -42,6 +48,7 @@ typedef struct NetSocketState {
     unsigned int packet_len;
     unsigned int send_index;      /* number of bytes sent (only SOCK_STREAM) */
     uint8_t buf[NET_BUFSIZE];
+    uint8_t *dgram_bufs;          /* NET_SOCKET_BATCH buffers (SOCK_DGRAM) */
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
@@ -133,6 +140,29 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+static int net_socket_receive_dgram_batch(NetClientState *nc,
+                                          const struct iovec *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    int i = 0, ret;
+
+    while (i < count) {
+        ret = net_dgram_send_batch(s->fd, (struct sockaddr *)&s->dgram_dst,
+                                   sizeof(s->dgram_dst), pkts + i, 1,
+                                   count - i);
+        if (ret > 0) {
+            i += ret;
+        } else if (errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            break;
+        } else {
+            /* Drop what the socket refuses, like net_socket_receive_dgram() */
+            i++;
+        }
+    }
+    return i;
+}
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -227,19 +257,30 @@ static void net_socket_send(void *opaque)
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
-    int size;
+    struct iovec pkts[NET_SOCKET_BATCH];
+    size_t lens[NET_SOCKET_BATCH];
+    int i, count;
+
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        pkts[i].iov_base = s->dgram_bufs + i * NET_BUFSIZE;
+        pkts[i].iov_len = NET_BUFSIZE;
+    }
 
-    size = qemu_recv(s->fd, s->buf, sizeof(s->buf), 0);
-    if (size < 0)
+    count = net_dgram_recv_batch(s->fd, pkts, 1, lens, NET_SOCKET_BATCH);
+    if (count < 0) {
         return;
-    if (size == 0) {
+    }
+    for (i = 0; i < count && lens[i]; i++) {
+        pkts[i].iov_len = lens[i];
+    }
+    if (i == 0) {
         /* end of connection */
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
         return;
     }
-    if (qemu_send_packet_async(&s->nc, s->buf, size,
-                               net_socket_send_completed) == 0) {
+    if (qemu_send_packet_batch_async(&s->nc, pkts, i,
+                                     net_socket_send_completed) < i) {
         net_socket_read_poll(s, false);
     }
 }
@@ -343,12 +384,14 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+    g_free(s->dgram_bufs);
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+    .receive_batch = net_socket_receive_dgram_batch,
     .cleanup = net_socket_cleanup,
 };
 
@@ -400,6 +443,7 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
 
     s->fd = fd;
     s->listen_fd = -1;
+    s->dgram_bufs = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
     s->send_fn = net_socket_send_dgram;
     net_socket_read_poll(s, true);
 
@@ -649,14 +693,18 @@ static int net_socket_mcast_init(NetClientState *peer,
 
 }
 
+/* With @queues > 1, that many sockets are bound to @lhost; the kernel
+ * spreads the incoming flows among them.
+ */
 static int net_socket_udp_init(NetClientState *peer,
                                  const char *model,
                                  const char *name,
                                  const char *rhost,
-                                 const char *lhost)
+                                 const char *lhost,
+                                 int queues)
 {
     NetSocketState *s;
-    int fd, ret;
+    int fd, ret, i;
     struct sockaddr_in laddr, raddr;
 
     if (parse_host_port(&laddr, lhost) < 0) {
@@ -667,35 +715,50 @@ static int net_socket_udp_init(NetClientState *peer,
         return -1;
     }
 
-    fd = qemu_socket(PF_INET, SOCK_DGRAM, 0);
-    if (fd < 0) {
-        perror("socket(PF_INET, SOCK_DGRAM)");
-        return -1;
-    }
+    for (i = 0; i < queues; i++) {
+        fd = qemu_socket(PF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            perror("socket(PF_INET, SOCK_DGRAM)");
+            return -1;
+        }
 
-    ret = socket_set_fast_reuse(fd);
-    if (ret < 0) {
-        closesocket(fd);
-        return -1;
-    }
-    ret = bind(fd, (struct sockaddr *)&laddr, sizeof(laddr));
-    if (ret < 0) {
-        perror("bind");
-        closesocket(fd);
-        return -1;
-    }
-    qemu_set_nonblock(fd);
+        ret = socket_set_fast_reuse(fd);
+        if (ret < 0) {
+            closesocket(fd);
+            return -1;
+        }
+#ifdef SO_REUSEPORT
+        if (queues > 1) {
+            int val = 1;
+
+            ret = qemu_setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                                  &val, sizeof(val));
+            if (ret < 0) {
+                perror("setsockopt(SOL_SOCKET, SO_REUSEPORT)");
+                closesocket(fd);
+                return -1;
+            }
+        }
+#endif
+        ret = bind(fd, (struct sockaddr *)&laddr, sizeof(laddr));
+        if (ret < 0) {
+            perror("bind");
+            closesocket(fd);
+            return -1;
+        }
+        qemu_set_nonblock(fd);
 
-    s = net_socket_fd_init(peer, model, name, fd, 0);
-    if (!s) {
-        return -1;
-    }
+        s = net_socket_fd_init(peer, model, name, fd, 0);
+        if (!s) {
+            return -1;
+        }
 
-    s->dgram_dst = raddr;
+        s->dgram_dst = raddr;
 
-    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-             "socket: udp=%s:%d",
-             inet_ntoa(raddr.sin_addr), ntohs(raddr.sin_port));
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "socket: udp=%s:%d",
+                 inet_ntoa(raddr.sin_addr), ntohs(raddr.sin_port));
+    }
     return 0;
 }
 
@@ -705,6 +768,7 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
     /* FIXME error_setg(errp, ...) on failure */
     Error *err = NULL;
     const NetdevSocketOptions *sock;
+    int queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_SOCKET);
     sock = opts->socket;
@@ -721,6 +785,27 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
         return -1;
     }
 
+    queues = sock->has_queues ? sock->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("socket number of queues must be in range [1, %d]",
+                     MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (queues > 1) {
+        if (!sock->has_udp) {
+            error_report("queues= is only valid with udp=");
+            return -1;
+        }
+        if (peer) {
+            error_report("Multiqueue socket cannot be used with hubs");
+            return -1;
+        }
+#ifndef SO_REUSEPORT
+        error_report("queues= is not supported on this host");
+        return -1;
+#endif
+    }
+
     if (sock->has_fd) {
         int fd;
 
@@ -766,8 +851,8 @@ int net_init_socket(const NetClientOptions *opts, const char *name,
         error_report("localaddr= is mandatory with udp=");
         return -1;
     }
-    if (net_socket_udp_init(peer, "socket", name, sock->udp, sock->localaddr) ==
-        -1) {
+    if (net_socket_udp_init(peer, "socket", name, sock->udp, sock->localaddr,
+                            queues) == -1) {
         return -1;
     }
     return 0;
@@ -44,12 +44,18 @@
 
 #include "net/vhost_net.h"
 
+/* tap_send() reads consecutive frames into one buffer and passes them on as
+ * a batch; a read is only attempted while a maximum sized frame still fits.
+ */
+#define TAP_BUFSIZE (2 * NET_BUFSIZE)
+#define TAP_BATCH   32
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -180,28 +186,45 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec pkts[TAP_BATCH];
+    int size, count, sent;
     int packets = 0;
+    bool empty = false;
 
-    while (true) {
-        uint8_t *buf = s->buf;
+    while (!empty) {
+        size_t offset = 0;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
+        for (count = 0; count < TAP_BATCH; count++) {
+            uint8_t *buf = s->buf + offset;
+
+            if (sizeof(s->buf) - offset < NET_BUFSIZE) {
+                break;
+            }
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                empty = true;
+                break;
+            }
+            offset += ROUND_UP(size, sizeof(uint64_t));
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+            pkts[count].iov_base = buf;
+            pkts[count].iov_len = size;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+        if (!count) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_send_packet_batch_async(&s->nc, pkts, count,
+                                            tap_send_completed);
+        if (sent < count) {
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
         }
 
         /*
@@ -210,7 +233,7 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
+        packets += count;
         if (packets >= 50) {
             break;
         }
@@ -685,8 +708,15 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
                        "vhost-net requested but could not be initialized");
             return;
         }
+        if (tap->has_poll_us &&
+            vhost_net_set_busyloop_timeout(s->vhost_net, tap->poll_us) < 0) {
+            error_setg(errp, "vhost-net does not support busy polling");
+            return;
+        }
     } else if (tap->has_vhostfd || tap->has_vhostfds) {
         error_setg(errp, "vhostfd= is not valid without vhost");
+    } else if (tap->has_poll_us) {
+        error_setg(errp, "poll-us= is not valid without vhost");
     }
 }
 
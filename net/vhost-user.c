@@ -19,6 +19,8 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* features acked by the guest, restored when the backend reconnects */
+    uint64_t acked_features;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -39,37 +41,78 @@ static int vhost_user_running(VhostUserState *s)
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static void vhost_user_stop(int queues, NetClientState *ncs[])
 {
-    VhostNetOptions options;
-
-    if (vhost_user_running(s)) {
-        return 0;
-    }
-
-    options.backend_type = VHOST_BACKEND_TYPE_USER;
-    options.net_backend = &s->nc;
-    options.opaque = s->chr;
+    VhostUserState *s;
+    int i;
 
-    s->vhost_net = vhost_net_init(&options);
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
 
-    return vhost_user_running(s) ? 0 : -1;
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            s->acked_features = vhost_net_get_acked_features(s->vhost_net);
+            vhost_net_cleanup(s->vhost_net);
+        }
+        s->vhost_net = 0;
+    }
 }
 
-static void vhost_user_stop(VhostUserState *s)
+/* One vhost device per queue pair, all of them talking over the chardev */
+static int vhost_user_start(int queues, NetClientState *ncs[])
 {
-    if (vhost_user_running(s)) {
-        vhost_net_cleanup(s->vhost_net);
+    VhostNetOptions options;
+    VhostUserState *s;
+    uint64_t max_queues;
+    int i;
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            continue;
+        }
+
+        options.net_backend = ncs[i];
+        options.opaque = s->chr;
+        s->vhost_net = vhost_net_init(&options);
+        if (!s->vhost_net) {
+            error_report("failed to init vhost_net for queue %d", i);
+            goto err;
+        }
+
+        if (i == 0) {
+            max_queues = vhost_net_get_max_queues(s->vhost_net);
+            if (queues > max_queues) {
+                error_report("vhost-user backend supports %" PRIu64
+                             " queue pairs, %d requested", max_queues, queues);
+                goto err;
+            }
+        }
+
+        if (s->acked_features) {
+            vhost_net_ack_features(s->vhost_net, s->acked_features);
+        }
     }
 
-    s->vhost_net = 0;
+    return 0;
+
+err:
+    vhost_user_stop(i + 1, ncs);
+    return -1;
 }
 
 static void vhost_user_cleanup(NetClientState *nc)
 {
     VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
 
-    vhost_user_stop(s);
+    if (vhost_user_running(s)) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = 0;
+    }
     qemu_purge_queued_packets(nc);
 }
 
@@ -112,42 +155,72 @@ static void net_vhost_link_down(VhostUserState *s, bool link_down)
     }
 }
 
+/*
+ * The backend may go away at any time, e.g. to be upgraded.  The link is
+ * reported down meanwhile, which stops vhost in the device, and everything
+ * (memory table, ring addresses and positions, acked features) is sent
+ * again when it comes back.
+ */
 static void net_vhost_user_event(void *opaque, int event)
 {
     VhostUserState *s = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues > 0);
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
+        if (vhost_user_start(queues, ncs) < 0) {
+            error_report("chardev \"%s\" went up, but vhost-user could not "
+                         "be started", s->chr->label);
+            break;
+        }
+        for (i = 0; i < queues; i++) {
+            net_vhost_link_down(DO_UPCAST(VhostUserState, nc, ncs[i]), false);
+        }
         error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
+        for (i = 0; i < queues; i++) {
+            net_vhost_link_down(DO_UPCAST(VhostUserState, nc, ncs[i]), true);
+        }
+        vhost_user_stop(queues, ncs);
         error_report("chardev \"%s\" went down", s->chr->label);
         break;
     }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
-                               const char *name, CharDriverState *chr)
+                               const char *name, CharDriverState *chr,
+                               int queues)
 {
     NetClientState *nc;
-    VhostUserState *s;
+    VhostUserState *s = NULL, *first = NULL;
+    int i;
 
-    nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
-    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
-             chr->label);
+        snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
+                 i, chr->label);
+        nc->queue_index = i;
 
-    s = DO_UPCAST(VhostUserState, nc, nc);
+        s = DO_UPCAST(VhostUserState, nc, nc);
 
-    /* We don't provide a receive callback */
-    s->nc.receive_disabled = 1;
-    s->chr = chr;
+        /* We don't provide a receive callback */
+        s->nc.receive_disabled = 1;
+        s->chr = chr;
+        if (!first) {
+            first = s;
+        }
+    }
 
-    qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
+    /* Once all queues exist, as this may start them right away */
+    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, first);
 
     return 0;
 }
@@ -164,6 +237,8 @@ static int net_vhost_chardev_opts(void *opaque,
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
         props->is_server = true;
+    } else if (strcmp(name, "reconnect") == 0) {
+        /* the client reconnects when the backend restarts */
     } else {
         error_setg(errp,
                    "vhost-user does not support a chardev with option %s=%s",
@@ -228,10 +303,18 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
 {
     const NetdevVhostUserOptions *vhost_user_opts;
     CharDriverState *chr;
+    int queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
     vhost_user_opts = opts->vhost_user;
 
+    queues = vhost_user_opts->has_queues ? vhost_user_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "vhost-user number of queues must be in range "
+                   "[1, %d]", MAX_QUEUE_NUM);
+        return -1;
+    }
+
     chr = net_vhost_parse_chardev(vhost_user_opts, errp);
     if (!chr) {
         return -1;
@@ -243,6 +326,5 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
         return -1;
     }
 
-
-    return net_vhost_user_init(peer, "vhost_user", name, chr);
+    return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
 }
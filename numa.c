@@ -143,6 +143,7 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
 {
     uint16_t nodenr;
     uint16List *cpus = NULL;
+    uint16List *host_nodes;
 
     if (node->has_nodeid) {
         nodenr = node->nodeid;
@@ -172,6 +173,16 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         bitmap_set(numa_info[nodenr].node_cpu, cpus->value, 1);
     }
 
+    for (host_nodes = node->host_nodes; host_nodes;
+         host_nodes = host_nodes->next) {
+        if (host_nodes->value >= MAX_NODES) {
+            error_setg(errp, "Host NUMA node (%" PRIu16 ") should be smaller"
+                       " than %d", host_nodes->value, MAX_NODES);
+            return;
+        }
+        set_bit(host_nodes->value, numa_info[nodenr].host_nodes);
+    }
+
     if (node->has_mem && node->has_memdev) {
         error_setg(errp, "qemu: cannot specify both mem= and memdev=");
         return;
@@ -206,6 +217,13 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         object_ref(o);
         numa_info[nodenr].node_mem = object_property_get_int(o, "size", NULL);
         numa_info[nodenr].node_memdev = MEMORY_BACKEND(o);
+
+        /* By default, run where the memory is */
+        if (!node->has_host_nodes &&
+            numa_info[nodenr].node_memdev->policy != HOST_MEM_POLICY_DEFAULT) {
+            bitmap_copy(numa_info[nodenr].host_nodes,
+                        numa_info[nodenr].node_memdev->host_nodes, MAX_NODES);
+        }
     }
     numa_info[nodenr].present = true;
     max_numa_nodeid = MAX(max_numa_nodeid, nodenr + 1);
@@ -409,6 +427,72 @@ void numa_post_machine_init(void)
     }
 }
 
+/*
+ * Add to @host_cpus the CPUs of the host nodes that the threads of guest
+ * node @nodeid run on.  Returns 1 if there were any, 0 if the node is not
+ * placed on host nodes, or -1 on error.
+ */
+int numa_node_get_host_cpus(int nodeid, unsigned long *host_cpus,
+                            unsigned long nbits, Error **errp)
+{
+    unsigned long *host_nodes;
+    unsigned long node;
+    int ret;
+
+    if (nodeid < 0 || nodeid >= nb_numa_nodes) {
+        error_setg(errp, "NUMA node %d does not exist", nodeid);
+        return -1;
+    }
+
+    host_nodes = numa_info[nodeid].host_nodes;
+    if (bitmap_empty(host_nodes, MAX_NODES)) {
+        return 0;
+    }
+    for (node = find_first_bit(host_nodes, MAX_NODES); node < MAX_NODES;
+         node = find_next_bit(host_nodes, MAX_NODES, node + 1)) {
+        ret = qemu_host_node_get_cpus(node, host_cpus, nbits);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Cannot find the CPUs of host NUMA "
+                             "node %lu", node);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Called by the thread of @cpu, before it runs the vCPU */
+void numa_cpu_thread_init(CPUState *cpu)
+{
+    unsigned long *host_cpus;
+    Error *err = NULL;
+    int i, ret;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(cpu->cpu_index, numa_info[i].node_cpu)) {
+            break;
+        }
+    }
+    if (i == nb_numa_nodes) {
+        return;
+    }
+
+    host_cpus = bitmap_new(NUMA_MAX_HOST_CPUS);
+    ret = numa_node_get_host_cpus(i, host_cpus, NUMA_MAX_HOST_CPUS, &err);
+    if (ret > 0) {
+        ret = qemu_thread_set_affinity(cpu->thread, host_cpus,
+                                       NUMA_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_setg_errno(&err, -ret, "Cannot set the affinity of CPU %d",
+                             cpu->cpu_index);
+        }
+    }
+    if (err) {
+        error_report("warning: %s", error_get_pretty(err));
+        error_free(err);
+    }
+    g_free(host_cpus);
+}
+
 static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
                                            const char *name,
                                            uint64_t ram_size)
@@ -33,23 +33,32 @@
     do { } while (0)
 #endif
 
-/* the page in cache will not be replaced in two cycles */
-#define CACHED_PAGE_LIFETIME 2
+/* Number of pages in each set; a page can be cached in any of them */
+#define PAGE_CACHE_WAYS 8
 
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* value of the cache's lru_clock at the last use of the page */
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set associative: a page hashes to a set of num_ways items,
+ * which are looked up one after the other, and the least recently used
+ * item of the set is replaced when it is full.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
-    uint64_t max_item_age;
+    int64_t num_sets;
+    unsigned int num_ways;
     int64_t num_items;
+    uint64_t lru_clock;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -76,10 +85,13 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+    cache->lru_clock = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -93,6 +105,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_lru = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -115,43 +128,70 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/*
+ * Returns the item to use for a page that isn't cached: a free one if the
+ * set has one, otherwise the least recently used one.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == -1) {
+            return &set[i];
+        }
+        if (set[i].it_lru < victim->it_lru) {
+            victim = &set[i];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and the LRU order when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
@@ -160,17 +200,18 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_addr != -1) {
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -184,9 +225,10 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -213,15 +255,15 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         DPRINTF("Error creating new cache\n");
         return -1;
     }
+    new_cache->lru_clock = cache->lru_clock;
 
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
+            /* if the set is full, keep its MRU pages */
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (new_it->it_data && new_it->it_lru >= old_it->it_lru) {
                 g_free(old_it->it_data);
             } else {
                 if (!new_it->it_data) {
@@ -230,14 +272,19 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 g_free(new_it->it_data);
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
+                new_it->it_lru = old_it->it_lru;
                 new_it->it_addr = old_it->it_addr;
             }
+        } else {
+            g_free(old_it->it_data);
         }
     }
 
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
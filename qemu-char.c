@@ -26,7 +26,9 @@
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/iov.h"
 #include "sysemu/char.h"
+#include "sysemu/replay.h"
 #include "hw/usb.h"
 #include "qmp-commands.h"
 #include "qapi/qmp-input-visitor.h"
@@ -223,6 +225,34 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return ret;
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov,
+                       int iovcnt)
+{
+    int ret = 0;
+    int i, res;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->chr_writev) {
+        ret = s->chr_writev(s, iov, iovcnt);
+    } else {
+        for (i = 0; i < iovcnt; i++) {
+            res = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+            if (res < 0) {
+                if (!ret) {
+                    ret = res;
+                }
+                break;
+            }
+            ret += res;
+            if (res < iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return ret;
+}
+
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
 {
     int offset = 0;
@@ -300,13 +330,21 @@ int qemu_chr_be_can_write(CharDriverState *s)
     return s->chr_can_read(s->handler_opaque);
 }
 
-void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len)
+void qemu_chr_be_write_impl(CharDriverState *s, uint8_t *buf, int len)
 {
     if (s->chr_read) {
         s->chr_read(s->handler_opaque, buf, len);
     }
 }
 
+void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len)
+{
+    if (replay_mode != REPLAY_MODE_NONE && replay_char_write(s, buf, len)) {
+        return;
+    }
+    qemu_chr_be_write_impl(s, buf, len);
+}
+
 int qemu_chr_fe_get_msgfd(CharDriverState *s)
 {
     int fd;
@@ -917,6 +955,20 @@ static GIOChannel *io_channel_from_fd(int fd)
 
     return chan;
 }
+
+/* The channel is unbuffered, so its fd can be written directly */
+static int io_channel_writev(GIOChannel *chan, const struct iovec *iov,
+                             int iovcnt)
+{
+    int fd = g_io_channel_unix_get_fd(chan);
+    ssize_t ret;
+
+    do {
+        ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
 #endif
 
 static GIOChannel *io_channel_from_socket(int fd)
@@ -985,6 +1037,15 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return io_channel_send(s->fd_out, buf, len);
 }
 
+/* Called with chr_write_lock held.  */
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+
+    return io_channel_writev(s->fd_out, iov, iovcnt);
+}
+
 static gboolean fd_chr_read(GIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -1073,6 +1134,7 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     chr->opaque = s;
     chr->chr_add_watch = fd_chr_add_watch;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -2621,6 +2683,24 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        return iov_size(iov, iovcnt);
+    }
+    if (s->is_unix && s->write_msgfds_num) {
+        /* The file descriptors go with the first buffer only */
+        return unix_send_msgfds(chr, iov[0].iov_base, iov[0].iov_len);
+    }
+    return io_channel_writev(s->chan, iov, iovcnt);
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -4159,6 +4239,9 @@ static CharDriverState *qmp_chardev_open_socket(ChardevSocket *sock,
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+#endif
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->get_msgfds = tcp_get_msgfds;
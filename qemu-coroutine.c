@@ -21,13 +21,18 @@
 
 enum {
     POOL_BATCH_SIZE = 64,
+    /* The most a thread's pool can grow to with its peak concurrency */
+    POOL_MAX_SIZE = 4096,
 };
 
 /** Free list to speed up creation */
 static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int release_pool_size;
 static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
-static __thread unsigned int alloc_pool_size;
+/* pool_stats.size is the size of alloc_pool */
+static __thread CoroutinePoolStats pool_stats = {
+    .max_size = POOL_BATCH_SIZE,
+};
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
 static void coroutine_pool_cleanup(Notifier *n, void *value)
@@ -39,6 +44,16 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
         QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
         qemu_coroutine_delete(co);
     }
+    pool_stats.size = 0;
+}
+
+/* Free this thread's pool when it exits */
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!coroutine_pool_cleanup_notifier.notify) {
+        coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+    }
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
@@ -50,27 +65,31 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
                 /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
+                coroutine_pool_register_cleanup();
 
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
                  * it is just a heuristic, it does not need to be perfect.
                  */
-                alloc_pool_size = atomic_xchg(&release_pool_size, 0);
+                pool_stats.size = atomic_xchg(&release_pool_size, 0);
                 QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
                 co = QSLIST_FIRST(&alloc_pool);
             }
         }
         if (co) {
             QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
-            alloc_pool_size--;
+            pool_stats.size--;
+        } else if (pool_stats.max_size < POOL_MAX_SIZE) {
+            /* More coroutines are alive than the pool would keep: make
+             * room for this one once it terminates */
+            pool_stats.max_size++;
         }
     }
 
-    if (!co) {
+    if (co) {
+        pool_stats.hits++;
+    } else {
+        pool_stats.misses++;
         co = qemu_coroutine_new();
     }
 
@@ -89,9 +108,10 @@ static void coroutine_delete(Coroutine *co)
             atomic_inc(&release_pool_size);
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (pool_stats.size < pool_stats.max_size) {
+            coroutine_pool_register_cleanup();
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
-            alloc_pool_size++;
+            pool_stats.size++;
             return;
         }
     }
@@ -99,6 +119,11 @@ static void coroutine_delete(Coroutine *co)
     qemu_coroutine_delete(co);
 }
 
+const CoroutinePoolStats *qemu_coroutine_pool_stats(void)
+{
+    return &pool_stats;
+}
+
 void qemu_coroutine_enter(Coroutine *co, void *opaque)
 {
     Coroutine *self = qemu_coroutine_self();
@@ -34,6 +34,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "qemu/crc32c.h"
 #include <getopt.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION QEMU_PKGVERSION \
@@ -129,6 +130,12 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' is the number of coroutines that copy in parallel (1 to 16,\n"
+           "       defaults to 8)\n"
+           "  '-W' allows the target to be written out of order\n"
+           "  '-C' copies data without reading it into qemu-img where possible\n"
+           "  '-D' stores clusters with identical contents only once where the output\n"
+           "       format supports it (qcow2)\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -146,7 +153,20 @@ static void QEMU_NORETURN help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of read/write requests (defaults to 75000)\n"
+           "  '-d' number of requests in flight (defaults to 64)\n"
+           "  '-m' percentage of writes among the requests (defaults to 0)\n"
+           "  '-n' uses native AIO\n"
+           "  '-o' offset of the first request in bytes\n"
+           "  '-r' uses random offsets instead of sequential ones\n"
+           "  '-s' size of each request in bytes (defaults to 4k)\n"
+           "  '-S' distance between sequential requests (defaults to the size)\n"
+           "  '-w' only writes, same as -m 100\n"
+           "  '--flush-interval' sends a flush after that many writes\n"
+           "  '--seed' seed of the random offsets and operations\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -1215,6 +1235,8 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
 enum ImgConvertBlockStatus {
     BLK_DATA,
     BLK_ZERO,
@@ -1237,15 +1259,37 @@ typedef struct ImgConvertState {
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    /* Copy data with bdrv_co_copy_range() until it fails once */
+    bool copy_range;
+    /* Clusters written so far, by content (see convert_co_dedup_write()) */
+    bool dedup;
+    GHashTable *dedup_index;
+
+    /* The copy is done by num_coroutines coroutines, each of which takes the
+     * next chunk at sector_num, reads it and writes it. Unless out of order
+     * writes are allowed, the writes are issued in order; wr_offs is where
+     * the next write must start and wait_sector_num[i] is the sector that
+     * coroutine co[i] is waiting to write, or -1. */
+    int num_coroutines;
+    int running_coroutines;
+    bool wr_in_order;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int64_t sector_num;
+    int64_t wr_offs;
+    int64_t allocated_done;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    assert(sector_num >= *src_cur_offset);
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1254,7 +1298,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1305,13 +1349,16 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf,
+                                        enum ImgConvertBlockStatus status)
 {
+    int src_cur = 0;
+    int64_t src_cur_offset = 0;
     int n;
     int ret;
 
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
+    if (status == BLK_ZERO || status == BLK_BACKING_FILE) {
         return 0;
     }
 
@@ -1319,16 +1366,22 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     while (nb_sectors > 0) {
         BlockBackend *blk;
         int64_t bs_sectors;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1341,15 +1394,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1383,7 +1439,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1395,7 +1455,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1410,11 +1470,294 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
 {
-    uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
+    int src_cur = 0;
+    int64_t src_cur_offset = 0;
+    int n;
+    int ret;
+
+    while (nb_sectors > 0) {
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(s->src[src_cur], sector_num - src_cur_offset,
+                                s->target, sector_num, n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * With -D, whole target clusters of data are looked up in dedup_index by a
+ * hash of their content.  The first cluster with a given hash is written
+ * and added to the index; for a later one, the indexed cluster is read back
+ * from the target and, if it has the same data, linked with
+ * bdrv_co_copy_range() within the target instead of written again.  For
+ * qcow2, this makes both guest clusters refer to a single host cluster.
+ * A hash collision only costs that read.
+ */
+typedef struct ConvertDedupEntry {
+    uint64_t hash;
+    int64_t sector_num;
+} ConvertDedupEntry;
+
+static guint convert_dedup_entry_hash(gconstpointer key)
+{
+    const ConvertDedupEntry *e = key;
+    return e->hash;
+}
+
+static gboolean convert_dedup_entry_equal(gconstpointer a, gconstpointer b)
+{
+    const ConvertDedupEntry *ea = a, *eb = b;
+    return ea->hash == eb->hash;
+}
+
+static uint64_t convert_dedup_hash(const uint8_t *buf, size_t len)
+{
+    return ((uint64_t)crc32c(0xffffffff, buf, len / 2) << 32) |
+           crc32c(0xffffffff, buf + len / 2, len - len / 2);
+}
+
+/*
+ * Returns 1 if the cluster at @sector_num has been linked to an earlier one
+ * with the same data, 0 if it must be written, or -errno.  @cmp_buf holds a
+ * cluster.
+ */
+static int coroutine_fn convert_co_dedup_cluster(ImgConvertState *s,
+                                                 int64_t sector_num,
+                                                 const uint8_t *buf,
+                                                 uint8_t *cmp_buf)
+{
+    size_t len = s->cluster_sectors * BDRV_SECTOR_SIZE;
+    ConvertDedupEntry key, *e;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    key.hash = convert_dedup_hash(buf, len);
+    e = g_hash_table_lookup(s->dedup_index, &key);
+    if (!e) {
+        e = g_new(ConvertDedupEntry, 1);
+        e->hash = key.hash;
+        e->sector_num = sector_num;
+        g_hash_table_insert(s->dedup_index, e, e);
+        return 0;
+    }
+
+    iov.iov_base = cmp_buf;
+    iov.iov_len = len;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = blk_co_readv(s->target, e->sector_num, s->cluster_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    if (memcmp(buf, cmp_buf, len)) {
+        return 0;
+    }
+
+    ret = blk_co_copy_range(s->target, e->sector_num, s->target, sector_num,
+                            s->cluster_sectors);
+    if (ret == -ENOTSUP) {
+        /* The target can't link nor copy within itself, stop trying */
+        s->dedup = false;
+    }
+    return ret < 0 ? 0 : 1;
+}
+
+static int coroutine_fn convert_co_dedup_write(ImgConvertState *s,
+                                               int64_t sector_num,
+                                               int nb_sectors, uint8_t *buf,
+                                               uint8_t *cmp_buf)
+{
+    int64_t end = sector_num + nb_sectors;
+    int64_t written = sector_num;
+    int64_t cluster;
     int ret;
+
+    for (cluster = QEMU_ALIGN_UP(sector_num, s->cluster_sectors);
+         s->dedup && cluster + s->cluster_sectors <= end;
+         cluster += s->cluster_sectors)
+    {
+        uint8_t *data = buf + (cluster - sector_num) * BDRV_SECTOR_SIZE;
+
+        /* Zero clusters are left sparse by convert_co_write() */
+        if (s->min_sparse &&
+            buffer_is_zero(data, s->cluster_sectors * BDRV_SECTOR_SIZE)) {
+            continue;
+        }
+
+        ret = convert_co_dedup_cluster(s, cluster, data, cmp_buf);
+        if (ret < 0) {
+            return ret;
+        } else if (ret == 0) {
+            continue;
+        }
+
+        if (written < cluster) {
+            ret = convert_co_write(s, written, cluster - written,
+                                   buf + (written - sector_num) *
+                                   BDRV_SECTOR_SIZE, BLK_DATA);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        written = cluster + s->cluster_sectors;
+    }
+
+    if (written < end) {
+        return convert_co_write(s, written, end - written,
+                                buf + (written - sector_num) *
+                                BDRV_SECTOR_SIZE, BLK_DATA);
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    uint8_t *cmp_buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->dedup) {
+        cmp_buf = blk_blockalign(s->target,
+                                 s->cluster_sectors * BDRV_SECTOR_SIZE);
+    }
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+        bool copy_range;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Let the other coroutines continue behind this chunk while it is
+         * being copied */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (!copy_range) {
+            ret = convert_co_read(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS && copy_range) {
+            ret = convert_co_copy_range(s, sector_num, n);
+            if (ret < 0) {
+                /* The images can't do it, or not for this chunk: copy it
+                 * and everything after it through the buffer */
+                s->copy_range = false;
+                copy_range = false;
+                ret = convert_co_read(s, sector_num, n, buf, status);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    s->ret = ret;
+                }
+            }
+        }
+
+        if (s->ret == -EINPROGRESS && !copy_range) {
+            if (s->dedup && status == BLK_DATA) {
+                ret = convert_co_dedup_write(s, sector_num, n, buf, cmp_buf);
+            } else {
+                ret = convert_co_write(s, sector_num, n, buf, status);
+            }
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        /* Only count data once it has been written, so that the progress
+         * follows the actual throughput */
+        if (status == BLK_DATA && s->ret == -EINPROGRESS) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+        }
+
+        if (s->wr_in_order) {
+            /* Wake up the coroutine that waits for this write to complete,
+             * or all waiting coroutines if the conversion failed. None of
+             * them can be running: a running coroutine isn't waiting. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (!s->co[i] || s->wait_sector_num[i] == -1) {
+                    continue;
+                }
+                if (s->ret != -EINPROGRESS) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                } else if (s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    qemu_vfree(cmp_buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* The last coroutine is done and nothing failed */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1441,7 +1784,6 @@ static int convert_do_copy(ImgConvertState *s)
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1463,36 +1805,26 @@ static int convert_do_copy(ImgConvertState *s)
     s->src_cur_offset = 0;
     s->sector_next_status = 0;
 
-    sector_num = 0;
-    allocated_done = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->running_coroutines = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
 
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    while (s->running_coroutines) {
+        aio_poll(blk_get_aio_context(s->target), true);
+    }
 
-        sector_num += n;
+    ret = s->ret;
+    if (ret < 0) {
+        goto fail;
     }
 
     if (s->compressed) {
@@ -1505,7 +1837,6 @@ static int convert_do_copy(ImgConvertState *s)
 
     ret = 0;
 fail:
-    qemu_vfree(buf);
     return ret;
 }
 
@@ -1532,6 +1863,10 @@ static int img_convert(int argc, char **argv)
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
+    bool wr_in_order = true;
+    bool copy_range = false;
+    bool dedup = false;
+    unsigned long long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1541,7 +1876,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:WCD");
         if (c == -1) {
             break;
         }
@@ -1632,6 +1967,24 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (parse_uint_full(optarg, &num_coroutines, 10) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
+        case 'C':
+            copy_range = true;
+            break;
+        case 'D':
+            dedup = true;
+            break;
         }
     }
 
@@ -1854,6 +2207,7 @@ static int img_convert(int argc, char **argv)
     }
 
     cluster_sectors = 0;
+    memset(&bdi, 0, sizeof(bdi));
     ret = bdrv_get_info(out_bs, &bdi);
     if (ret < 0) {
         if (compress) {
@@ -1865,6 +2219,40 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (compress && copy_range) {
+        error_report("Copy offloading can't be used with compression");
+        ret = -1;
+        goto out;
+    }
+
+    if (dedup) {
+        if (compress || copy_range) {
+            error_report("Deduplication can't be used with compression or "
+                         "copy offloading");
+            ret = -1;
+            goto out;
+        }
+        if (cluster_sectors <= 0 || cluster_sectors > bufsectors) {
+            error_report("Deduplication needs an output format with clusters");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (compress && !bdi.parallel_compressed_writes) {
+        if (!wr_in_order) {
+            error_report("Out of order writes can't be used with compression "
+                         "for this output format");
+            ret = -1;
+            goto out;
+        }
+    } else if (compress) {
+        /* Compressed clusters are packed in the order in which they are
+         * written anyway, and a strict order would serialize compressing
+         * them in the driver */
+        wr_in_order = false;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -1876,8 +2264,20 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+        .copy_range         = copy_range,
+        .dedup              = dedup,
     };
+    if (dedup) {
+        state.dedup_index = g_hash_table_new_full(convert_dedup_entry_hash,
+                                                  convert_dedup_entry_equal,
+                                                  g_free, NULL);
+    }
     ret = convert_do_copy(&state);
+    if (state.dedup_index) {
+        g_hash_table_destroy(state.dedup_index);
+    }
 
 out:
     if (!ret) {
@@ -3042,6 +3442,401 @@ out:
     return 0;
 }
 
+enum {
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_FLUSH,
+    BENCH_OP__MAX,
+};
+
+static const char *const bench_op_name[BENCH_OP__MAX] = {
+    [BENCH_READ]  = "read",
+    [BENCH_WRITE] = "write",
+    [BENCH_FLUSH] = "flush",
+};
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    int op;
+    int64_t start_ns;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    uint64_t bufsize;
+    uint64_t step;
+    uint64_t start_offset;
+    uint64_t offset;
+    bool random;
+    int write_pct;
+    int flush_interval;
+    int writes_since_flush;
+    GRand *rand;
+
+    /* Requests (without flushes) not submitted yet, and in flight */
+    int64_t n;
+    int in_flight;
+    int ret;
+
+    /* Latency in nanoseconds of every completed request, by operation */
+    int64_t *latency[BENCH_OP__MAX];
+    int64_t nr_done[BENCH_OP__MAX];
+};
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+    uint64_t offset;
+
+    b->in_flight++;
+    req->start_ns = get_clock();
+
+    if (b->flush_interval && b->writes_since_flush >= b->flush_interval) {
+        b->writes_since_flush = 0;
+        req->op = BENCH_FLUSH;
+        blk_aio_flush(b->blk, bench_cb, req);
+        return;
+    }
+
+    b->n--;
+    if (b->random) {
+        uint64_t slots = (b->image_size - b->start_offset - b->bufsize) /
+                         b->bufsize + 1;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+        offset = b->start_offset + r % slots * b->bufsize;
+    } else {
+        offset = b->offset;
+        b->offset += b->step;
+        if (b->offset + b->bufsize > b->image_size) {
+            b->offset = b->start_offset;
+        }
+    }
+
+    if (b->write_pct && g_rand_int_range(b->rand, 0, 100) < b->write_pct) {
+        req->op = BENCH_WRITE;
+        b->writes_since_flush++;
+        blk_aio_writev(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                       nb_sectors, bench_cb, req);
+    } else {
+        req->op = BENCH_READ;
+        blk_aio_readv(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                      nb_sectors, bench_cb, req);
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed %s request: %s", bench_op_name[req->op],
+                     strerror(-ret));
+        b->ret = ret;
+        b->n = 0;
+        return;
+    }
+    b->latency[req->op][b->nr_done[req->op]++] = get_clock() - req->start_ns;
+
+    if (b->n > 0) {
+        bench_submit(req);
+    }
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    int64_t la = *(const int64_t *)a, lb = *(const int64_t *)b;
+    return la < lb ? -1 : la > lb;
+}
+
+static void bench_print_latency(int op, int64_t *lat, int64_t n)
+{
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    int64_t sum = 0, i;
+    int j;
+
+    if (!n) {
+        return;
+    }
+    qsort(lat, n, sizeof(*lat), bench_cmp_latency);
+    for (i = 0; i < n; i++) {
+        sum += lat[i];
+    }
+
+    printf("%-6s %10" PRId64 " requests, latency (us): min %.1f, avg %.1f",
+           bench_op_name[op], n, lat[0] / 1000.0, sum / 1000.0 / n);
+    for (j = 0; j < ARRAY_SIZE(pct); j++) {
+        printf(", p%g %.1f", pct[j],
+               lat[MIN(n - 1, (int64_t)(n * pct[j] / 100))] / 1000.0);
+    }
+    printf(", max %.1f\n", lat[n - 1] / 1000.0);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    bool quiet = false;
+    bool native = false;
+    bool random = false;
+    unsigned long long count = 75000;
+    unsigned long long depth = 64;
+    unsigned long long write_pct = 0;
+    unsigned long long flush_interval = 0;
+    unsigned long long seed = 0;
+    int64_t offset = 0;
+    int64_t bufsize = 4096;
+    int64_t step = 0;
+    int64_t image_size, start_ns, elapsed_ns, nr_io;
+    int flags = BDRV_O_FLAGS;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    BenchRequest *reqs = NULL;
+    uint8_t *buf = NULL;
+    char *end;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"flush-interval", required_argument, 0, 'F'},
+            {"seed", required_argument, 0, 'R'},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:m:no:qrs:S:t:w",
+                        long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+            if (parse_uint_full(optarg, &count, 10) || count < 1 ||
+                count > INT64_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            if (parse_uint_full(optarg, &depth, 10) || depth < 1 ||
+                depth > 4096) {
+                error_report("Invalid queue depth specified, it must be "
+                             "between 1 and 4096");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'm':
+            if (parse_uint_full(optarg, &write_pct, 10) || write_pct > 100) {
+                error_report("Invalid write percentage specified, it must be "
+                             "between 0 and 100");
+                return 1;
+            }
+            break;
+        case 'n':
+            native = true;
+            break;
+        case 'o':
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+            bufsize = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (bufsize <= 0 || bufsize > INT_MAX / 2 || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            break;
+        case 'S':
+            step = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (step < 0 || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            write_pct = 100;
+            break;
+        case 'F':
+            if (parse_uint_full(optarg, &flush_interval, 10) ||
+                flush_interval > INT_MAX) {
+                error_report("Invalid flush interval specified");
+                return 1;
+            }
+            break;
+        case 'R':
+            if (parse_uint_full(optarg, &seed, 0) || seed > UINT32_MAX) {
+                error_report("Invalid seed specified");
+                return 1;
+            }
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (!step) {
+        step = bufsize;
+    }
+    if ((bufsize | offset | step) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Buffer size, offset and step size must be multiples "
+                     "of 512");
+        return 1;
+    }
+    if (flush_interval && !write_pct) {
+        error_report("--flush-interval is only available for write tests");
+        return 1;
+    }
+
+    if (write_pct) {
+        flags |= BDRV_O_RDWR;
+    }
+    if (native) {
+        flags |= BDRV_O_NATIVE_AIO;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache mode");
+        ret = -1;
+        goto out;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get the image size: %s",
+                     strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (offset + bufsize > image_size) {
+        error_report("The image is too small for a request at offset %" PRId64,
+                     offset);
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .bufsize        = bufsize,
+        .step           = step,
+        .start_offset   = offset,
+        .offset         = offset,
+        .random         = random,
+        .write_pct      = write_pct,
+        .flush_interval = flush_interval,
+        .rand           = g_rand_new_with_seed(seed),
+        .n              = count,
+    };
+    for (i = 0; i < BENCH_OP__MAX; i++) {
+        data.latency[i] = g_new(int64_t, count);
+    }
+
+    /* Nothing to wait for beyond the number of requests */
+    depth = MIN(depth, count);
+    buf = blk_blockalign(blk, depth * bufsize);
+    memset(buf, 0, depth * bufsize);
+    reqs = g_new0(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = &data;
+        reqs[i].iov.iov_base = buf + i * bufsize;
+        reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    if (!quiet) {
+        printf("Sending %llu requests, %" PRId64 " bytes each, %llu in "
+               "parallel, %llu%% writes (%s, starting at offset %" PRId64,
+               count, bufsize, depth, write_pct,
+               random ? "random" : "sequential", offset);
+        if (!random) {
+            printf(", step size %" PRId64, step);
+        }
+        if (flush_interval) {
+            printf(", flush every %llu writes", flush_interval);
+        }
+        printf(")\n");
+    }
+
+    start_ns = get_clock();
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (data.in_flight > 0) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    elapsed_ns = get_clock() - start_ns;
+
+    if (data.ret < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (!quiet) {
+        nr_io = data.nr_done[BENCH_READ] + data.nr_done[BENCH_WRITE];
+        printf("Run completed in %.3f seconds: %.0f IOPS, %.2f MB/s\n",
+               elapsed_ns / 1e9, nr_io * 1e9 / elapsed_ns,
+               nr_io * bufsize * 1e9 / elapsed_ns / (1024 * 1024));
+        for (i = 0; i < BENCH_OP__MAX; i++) {
+            bench_print_latency(i, data.latency[i], data.nr_done[i]);
+        }
+    }
+
+out:
+    for (i = 0; i < BENCH_OP__MAX; i++) {
+        g_free(data.latency[i]);
+    }
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    g_free(reqs);
+    qemu_vfree(buf);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
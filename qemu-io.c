@@ -441,7 +441,7 @@ int main(int argc, char **argv)
             }
             break;
         case 'T':
-            if (!trace_init_backends(optarg, NULL)) {
+            if (!trace_init_backends(optarg, NULL, false)) {
                 exit(1); /* error message will have been printed */
             }
             break;
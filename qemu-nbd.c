@@ -45,6 +45,7 @@
 #define QEMU_NBD_OPT_AIO           2
 #define QEMU_NBD_OPT_DISCARD       3
 #define QEMU_NBD_OPT_DETECT_ZEROES 4
+#define QEMU_NBD_OPT_QUEUE_DEPTH   5
 
 static NBDExport *exp;
 static int verbose;
@@ -53,6 +54,7 @@ static char *sockpath;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
+static int queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
 static int nb_fds;
 static int server_fd;
 
@@ -72,6 +74,8 @@ static void usage(const char *name)
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent          don't exit on the last connection\n"
+"      --queue-depth=NUM     process up to NUM requests of each client in\n"
+"                            parallel (default '%d')\n"
 "  -v, --verbose             display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -98,14 +102,14 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE            set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 #endif
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, discard)\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_QUEUE_DEPTH);
 }
 
 static void version(const char *name)
@@ -293,7 +297,7 @@ static void *nbd_client_thread(void *arg)
     }
 
     ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             fprintf(stderr, "%s\n", error_get_pretty(local_error));
@@ -429,12 +433,13 @@ int main(int argc, char **argv)
         { "load-snapshot", 1, NULL, 'l' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "detect-zeroes", 1, NULL, QEMU_NBD_OPT_DETECT_ZEROES },
         { "shared", 1, NULL, 'e' },
+        { "queue-depth", 1, NULL, QEMU_NBD_OPT_QUEUE_DEPTH },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
@@ -450,7 +455,7 @@ int main(int argc, char **argv)
     int fd;
     bool seen_cache = false;
     bool seen_discard = false;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     bool seen_aio = false;
 #endif
     pthread_t client_thread;
@@ -485,7 +490,7 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
@@ -493,6 +498,10 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
+#endif
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -594,6 +603,16 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case QEMU_NBD_OPT_QUEUE_DEPTH:
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid queue depth '%s'", optarg);
+            }
+            if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+                errx(EXIT_FAILURE, "Queue depth must be between 1 and %d",
+                     NBD_MAX_QUEUE_DEPTH);
+            }
+            break;
         case 'f':
             fmt = optarg;
             break;
@@ -752,6 +771,7 @@ int main(int argc, char **argv)
     if (!exp) {
         errx(EXIT_FAILURE, "%s", error_get_pretty(local_err));
     }
+    nbd_export_set_queue_depth(exp, queue_depth);
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
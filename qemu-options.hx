@@ -35,6 +35,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm-halt-poll-ns=ns polls halted vCPUs for up to ns nanoseconds (default: 0)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -61,6 +62,15 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-halt-poll-ns=@var{ns}
+When KVM leaves halted vCPUs to QEMU, i.e. without the in-kernel irqchip,
+a halted vCPU thread polls for an interrupt for a while before it goes to
+sleep, which shortens the wakeup of guests that idle for short periods at
+the cost of host CPU time.  The window adapts to how long the vCPU stays
+halted, up to @var{ns} nanoseconds.  The default of 0 disables polling.
+The limit can be changed at run time with @code{qom-set /machine
+kvm-halt-poll-ns}.  Polling is reported by @code{query-stats} for the kvm
+provider.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -114,11 +124,11 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,host-nodes=node[-node]]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,host-nodes=node[-node]]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-nodes=@var{hnode[-hnode]}]
+@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-nodes=@var{hnode[-hnode]}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -130,6 +140,13 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-nodes} runs the VCPU threads of the node, and the iothreads
+created with its @samp{numa-node}, on the CPUs of the given host NUMA
+nodes.  It defaults to the @samp{host-nodes} of the node's @samp{memdev},
+when the memory is bound to host nodes.  Memory that those threads
+allocate for themselves, such as coroutine stacks and virtqueue
+elements, is then allocated on the same host nodes.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -287,7 +304,8 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  The memory is touched by one
+thread per host CPU, up to 16.
 ETEXI
 
 DEF("k", HAS_ARG, QEMU_OPTION_k,
@@ -461,15 +479,18 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
+    "       [,merge-requests=on|off][,stats-intervals=i1[:i2...]]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
-    "       [[,group=g]]\n"
+    "       [[,group=g]][,throttling.weight=w][,throttling.iops-reserved=r]\n"
+    "       [,throttling.tick-us=t]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -504,7 +525,9 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO,
+io_uring does not require @option{cache=none}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -531,6 +554,18 @@ file sectors into the image file.
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item merge-requests=@var{merge-requests}
+@var{merge-requests} is "on" or "off" (the default).  When it is "on", the
+read and write requests that the guest device submits in a batch, for example
+in one virtqueue or NVMe submission queue notification or one AHCI command
+issue, are sorted and adjacent ones are submitted to the host as a single
+request.  This helps with guests that issue many small sequential requests.
+If a merged request fails, all the guest requests in it fail.
+@item stats-intervals=@var{i1}[:@var{i2}...]
+Collect the minimum, maximum and average latency and the average queue depth
+of the requests over sliding windows of @var{i1}, @var{i2}, ... seconds, and
+report them in the @code{timed_stats} field of @code{query-blockstats}.  Each
+interval costs a few integer operations per request.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -656,6 +691,24 @@ the raw disk image you use is not written back. You can however force
 the write back by pressing @key{C-a s} (@pxref{disk_images}).
 ETEXI
 
+DEF("qcow2-cache-budget", HAS_ARG, QEMU_OPTION_qcow2_cache_budget, \
+    "-qcow2-cache-budget size\n" \
+    "                limit the memory of all qcow2 metadata caches to 'size'\n" \
+    "                bytes (the default unit is MB)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -qcow2-cache-budget @var{size}
+@findex -qcow2-cache-budget
+Limit the memory that the L2 table and refcount block caches of all qcow2
+images take together to @var{size} bytes.  Optional suffixes "K", "M" and
+"G" are accepted; without one, @var{size} is in megabytes.  Each image
+still gets as many tables as its own cache size allows, but once the budget
+is used up, a cache replaces its own tables instead of growing.  The memory
+of tables that have not been used for @option{cache-clean-interval} seconds
+is given back to the host, which leaves it to the images that are in use.
+With a budget, @option{cache-clean-interval} defaults to 60 seconds.
+ETEXI
+
 DEF("hdachs", HAS_ARG, QEMU_OPTION_hdachs, \
     "-hdachs c,h,s[,t]\n" \
     "                force hard disk 0 physical geometry and the optional BIOS\n" \
@@ -673,12 +726,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    " [,stat_cache_ttl=ms][,stat_cache_size=n]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,stat_cache_ttl=@var{ms}][,stat_cache_size=@var{n}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -719,6 +773,15 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item stat_cache_ttl=@var{ms}
+Makes the local fs driver cache the attributes of files, including the
+credentials kept by the mapped security models, for @var{ms} milliseconds.
+Changes made by the guest are seen right away, but changes made directly
+on the host may take that long to show up.  By default there is no cache.
+The hits and misses are reported by the @code{stat-cache-hits} and
+@code{stat-cache-misses} properties of the virtio-9p device.
+@item stat_cache_size=@var{n}
+Caches the attributes of at most @var{n} files, 4096 by default.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -735,12 +798,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    "        [,stat_cache_ttl=ms][,stat_cache_size=n]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,stat_cache_ttl=@var{ms}][,stat_cache_size=@var{n}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -782,6 +846,15 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item stat_cache_ttl=@var{ms}
+Makes the local fs driver cache the attributes of files, including the
+credentials kept by the mapped security models, for @var{ms} milliseconds.
+Changes made by the guest are seen right away, but changes made directly
+on the host may take that long to show up.  By default there is no cache.
+The hits and misses are reported by the @code{stat-cache-hits} and
+@code{stat-cache-misses} properties of the virtio-9p device.
+@item stat_cache_size=@var{n}
+Caches the attributes of at most @var{n} files, 4096 by default.
 @end table
 ETEXI
 
@@ -992,6 +1065,7 @@ DEF("spice", HAS_ARG, QEMU_OPTION_spice,
     "       [,streaming-video=[off|all|filter]][,disable-copy-paste]\n"
     "       [,disable-agent-file-xfer][,agent-mouse=[on|off]]\n"
     "       [,playback-compression=[on|off]][,seamless-migration=[on|off]]\n"
+    "       [,update-threads=n]\n"
     "   enable spice\n"
     "   at least one of {port, tls-port} is mandatory\n",
     QEMU_ARCH_ALL)
@@ -1083,6 +1157,12 @@ Enable/disable audio stream compression (using celt 0.5.1).  Default is on.
 @item seamless-migration=[on|off]
 Enable/disable spice seamless migration. Default is off.
 
+@item update-threads=@var{n}
+Number of threads (1 to 16) that compare the screen of the displays QEMU
+renders itself and copy its changes into images for spice, so that large
+updates of multi-monitor guests take less time on the main loop.
+Default is 1, the main loop only.
+
 @end table
 ETEXI
 
@@ -1295,11 +1375,15 @@ achieved using the @code{acl} monitor command.
 
 @item lossy
 
-Enable lossy compression methods (gradient, JPEG, ...). If this
+Enable lossy compression methods (gradient, JPEG, H.264, ...). If this
 option is set, VNC client may receive lossy framebuffer updates
 depending on its encoding settings. Enabling this option can save
 a lot of bandwidth at the expense of quality.
 
+With lossy compression and adaptive encodings enabled, screen regions
+updated at video rates are sent as an H.264 stream to clients that
+support the Open H.264 encoding, if QEMU was built with libavcodec.
+
 @item non-adaptive
 
 Disable adaptive encodings. Adaptive encodings are enabled by default.
@@ -1309,6 +1393,18 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings restores the original static behavior of encodings
 like Tight.
 
+@item workers=@var{n}
+
+Encode framebuffer updates with up to @var{n} threads (1 to 16, default 1).
+The threads are shared by all VNC displays and encode for several clients
+at the same time; the updates of one client are always encoded in order,
+by one thread at a time.
+
+@item vaapi
+
+Encode the H.264 video streams with the GPU, through VAAPI, instead of in
+software.  QEMU fails to start if no VAAPI device or encoder is available.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1463,8 +1559,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,dnssearch=domain][,tftp=dir]\n"
     "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
 #ifndef _WIN32
-                                             "[,smb=dir[,smbserver=addr]]\n"
+                                             "[,smb=dir[,smbserver=addr]]"
 #endif
+    "\n         [,tcp-sndbuf=size][,tcp-rcvbuf=size]\n"
     "                configure a user mode network backend with ID 'str',\n"
     "                its DHCP server and optional services\n"
 #endif
@@ -1475,6 +1572,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
+    "         [,poll-us=n]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1494,6 +1592,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
     "                use 'vhostfds=x:y:...:z to connect to multiple already opened vhost net devices\n"
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
+    "                use 'poll-us=n' to let vhost busy poll the rings for up to n microseconds\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1503,7 +1602,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev l2tpv3,id=str,src=srcaddr,dst=dstaddr[,srcport=srcport][,dstport=dstport]\n"
     "         [,rxsession=rxsession],txsession=txsession[,ipv6=on/off][,udp=on/off]\n"
     "         [,cookie64=on/off][,counter][,pincounter][,txcookie=txcookie]\n"
-    "         [,rxcookie=rxcookie][,offset=offset]\n"
+    "         [,rxcookie=rxcookie][,offset=offset][,queues=n]\n"
     "                configure a network backend with ID 'str' connected to\n"
     "                an Ethernet over L2TPv3 pseudowire.\n"
     "                Linux kernel 3.3+ as well as most routers can talk\n"
@@ -1525,6 +1624,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'counter=off' to force a 'cut-down' L2TPv3 with no counter\n"
     "                use 'pincounter=on' to work around broken counter handling in peer\n"
     "                use 'offset=X' to add an extra offset between header and data\n"
+    "                use 'queues=n' to create n queues sharing the udp source port\n"
 #endif
     "-netdev socket,id=str[,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                configure a network backend to connect to another network\n"
@@ -1532,9 +1632,10 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev socket,id=str[,fd=h][,mcast=maddr:port[,localaddr=addr]]\n"
     "                configure a network backend to connect to a multicast maddr and port\n"
     "                use 'localaddr=addr' to specify the host address to send packets from\n"
-    "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port]\n"
+    "-netdev socket,id=str[,fd=h][,udp=host:port][,localaddr=host:port][,queues=n]\n"
     "                configure a network backend to connect to another network\n"
     "                using an UDP tunnel\n"
+    "                use 'queues=n' to create n queues sharing the local port\n"
 #ifdef CONFIG_VDE
     "-netdev vde,id=str[,sock=socketpath][,port=n][,group=groupname][,mode=octalmode]\n"
     "                configure a network backend to connect to port 'n' of a vde switch\n"
@@ -1543,21 +1644,29 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                ownership and permissions for communication port.\n"
 #endif
 #ifdef CONFIG_NETMAP
-    "-netdev netmap,id=str,ifname=name[,devname=nmname]\n"
+    "-netdev netmap,id=str,ifname=name[,devname=nmname][,queues=n]\n"
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+    "                use 'queues=n' to bind each of 'n' queue pairs to its own pair of\n"
+    "                netmap rings\n"
 #endif
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,queues=n]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
-    "-netdev hubport,id=str,hubid=n\n"
-    "                configure a hub port on QEMU VLAN 'n'\n", QEMU_ARCH_ALL)
+    "-netdev hubport,id=str,hubid=n[,promiscuous=on|off]\n"
+    "                configure a hub port on QEMU VLAN 'n'\n"
+    "                use 'promiscuous=off' to only get unicast packets for\n"
+    "                addresses the hub has not seen behind another port\n", QEMU_ARCH_ALL)
 DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net nic[,vlan=n][,macaddr=mac][,model=type][,name=str][,addr=str][,vectors=v]\n"
     "                old way to create a new NIC and connect it to VLAN 'n'\n"
     "                (use the '-device devtype,netdev=str' option if possible instead)\n"
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+    "-net dump[,vlan=n][,file=f][,len=n][,format=pcap|pcapng][,filter=expr]\n"
+    "         [,buffer=n][,rotate-size=n][,rotate-time=secs]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                use 'filter' to only dump matching packets, e.g. 'tcp port 80'\n"
+    "                use 'buffer' to size the buffer of packets waiting to be written\n"
+    "                use 'rotate-size' and 'rotate-time' to start new files 'f.N'\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n"
     "-net ["
@@ -1735,6 +1844,14 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item tcp-sndbuf=@var{size}
+@itemx tcp-rcvbuf=@var{size}
+Set how much data the user mode network stack buffers per TCP connection
+towards the guest (@option{tcp-sndbuf}) and from the guest
+(@option{tcp-rcvbuf}). These bound the TCP windows of the connection and
+with them the throughput over high latency host connections. Both default
+to 128k; window scaling is negotiated when the guest supports it.
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -1760,6 +1877,12 @@ helper executable is @file{/path/to/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+With @option{vhost=on}, @option{poll-us}=@var{n} makes vhost-net busy poll
+each ring for up to @var{n} microseconds before it waits for a notification,
+which lowers latency at the cost of host CPU time.  It needs a host kernel
+that supports busy polling (Linux 4.6 or newer) and can be changed at run
+time with the @code{netdev-set-vhost-poll} QMP command.
+
 Examples:
 
 @example
@@ -1880,7 +2003,22 @@ qemu-system-i386 linux.img \
                  -net socket,mcast=239.192.168.1:1102,localaddr=1.2.3.4
 @end example
 
-@item -netdev l2tpv3,id=@var{id},src=@var{srcaddr},dst=@var{dstaddr}[,srcport=@var{srcport}][,dstport=@var{dstport}],txsession=@var{txsession}[,rxsession=@var{rxsession}][,ipv6][,udp][,cookie64][,counter][,pincounter][,txcookie=@var{txcookie}][,rxcookie=@var{rxcookie}][,offset=@var{offset}]
+@item -netdev socket,id=@var{id}[,fd=@var{h}][,udp=@var{host}:@var{port}][,localaddr=@var{host}:@var{port}][,queues=@var{n}]
+@itemx -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,udp=@var{host}:@var{port}][,localaddr=@var{host}:@var{port}]
+
+Connect the VLAN @var{n} to another QEMU, or to any program speaking the
+same protocol, with one UDP datagram per Ethernet frame sent from
+@var{localaddr} to the @var{host}:@var{port} given with @option{udp}.
+
+Datagrams are received and sent in batches, with a single system call
+where the host supports @code{recvmmsg} and @code{sendmmsg}.
+
+With @option{queues=@var{n}}, @var{n} sockets are bound to the same local
+address, so that a multiqueue virtio-net device gets one per queue.  The
+host kernel spreads the incoming flows among them by source address and
+port.  This is only available with @option{-netdev}.
+
+@item -netdev l2tpv3,id=@var{id},src=@var{srcaddr},dst=@var{dstaddr}[,srcport=@var{srcport}][,dstport=@var{dstport}],txsession=@var{txsession}[,rxsession=@var{rxsession}][,ipv6][,udp][,cookie64][,counter][,pincounter][,txcookie=@var{txcookie}][,rxcookie=@var{rxcookie}][,offset=@var{offset}][,queues=@var{n}]
 @itemx -net l2tpv3[,vlan=@var{n}][,name=@var{name}],src=@var{srcaddr},dst=@var{dstaddr}[,srcport=@var{srcport}][,dstport=@var{dstport}],txsession=@var{txsession}[,rxsession=@var{rxsession}][,ipv6][,udp][,cookie64][,counter][,pincounter][,txcookie=@var{txcookie}][,rxcookie=@var{rxcookie}][,offset=@var{offset}]
 Connect VLAN @var{n} to L2TPv3 pseudowire. L2TPv3 (RFC3391) is a popular
 protocol to transport Ethernet (and other Layer 2) data frames between
@@ -1916,6 +2054,10 @@ draft-mkonstan-l2tpext-keyed-ipv6-tunnel-00
 networks which have packet reorder.
 @item offset=@var{offset}
     Add an extra offset between header and data
+@item queues=@var{n}
+    Create @var{n} queues for a multiqueue virtio-net device, each with its
+own socket bound to the same source port.  The host kernel spreads the
+incoming flows among them.  Only valid with @option{udp} and @option{-netdev}.
 
 For example, to attach a VM running on host 4.3.2.1 via L2TPv3 to the bridge br-lan
 on the remote Linux host 1.2.3.4:
@@ -1955,7 +2097,7 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
-@item -netdev hubport,id=@var{id},hubid=@var{hubid}
+@item -netdev hubport,id=@var{id},hubid=@var{hubid}[,promiscuous=on|off]
 
 Create a hub port on QEMU "vlan" @var{hubid}.
 
@@ -1963,13 +2105,27 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+The hub learns which port each source MAC address is behind.  A port with
+@option{promiscuous=off} does not get the unicast packets whose destination
+the hub knows to be behind another port; by default every port gets every
+packet.
+
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=@var{n}]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use @var{queues} to create multiqueue vhost-user, with
+@var{n} queue pairs; the backend must support at least as many.
+
+If the backend restarts, the link of the NIC goes down until it is connected
+again, and the device state is then sent to it again. Either use a server
+chardev, or a client one with the @option{reconnect} option.
+
+The guest RAM must be shared with the backend: back it with a
+memory-backend-file with @option{share=on}, or with a memory-backend-memfd,
+which needs no hugetlbfs mount.
 
 Example:
 @example
@@ -1980,10 +2136,33 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+Example with two queue pairs and a backend that may restart:
+@example
+qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,share=on \
+     -numa node,memdev=mem \
+     -chardev socket,id=chr0,path=/path/to/socket,reconnect=1 \
+     -netdev type=vhost-user,id=net0,chardev=chr0,queues=2 \
+     -device virtio-net-pci,netdev=net0,mq=on,vectors=6
+@end example
+
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,format=pcap|pcapng][,filter=@var{expr}][,buffer=@var{size}][,rotate-size=@var{size}][,rotate-time=@var{secs}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
-libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
+libpcap, or pcapng with @option{format=pcapng}, so it can be analyzed with tools
+such as tcpdump or Wireshark.
+
+Packets are written by a separate thread.  Up to @var{size} bytes (4M by default)
+of packets wait in a buffer to be written; when it is full, packets are dropped.
+In pcapng files, the number of dropped packets is recorded when the file is closed.
+
+@option{filter} only dumps the packets that match all of the primitives of
+@var{expr}: @code{arp}, @code{ip}, @code{ip6}, @code{tcp}, @code{udp}, @code{icmp},
+@code{icmp6} and @code{port @var{n}}.  For example, @option{filter=tcp port 80}
+dumps HTTP traffic only.
+
+With @option{rotate-size} or @option{rotate-time}, a new file is started once the
+current one has grown to @var{size} bytes or is @var{secs} seconds old.  The files
+after the first one are named @file{@var{file}.1}, @file{@var{file}.2} and so on.
 
 @item -net none
 Indicate that no network devices should be configured. It is used to
@@ -2298,6 +2477,19 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+A single session carries all commands over one TCP connection.  The
+@option{sessions} block option logs in up to 16 times to the same LUN, and
+commands are handed to the sessions in turn.  @option{queue-depth} limits
+the commands in flight on each session; a request that finds every
+session full waits for one to complete.  The default of 0 sets no limit.
+Commands for the device itself, like SCSI passthrough, always use the
+first session.
+
+Example (four sessions, at most 32 commands on each):
+@example
+qemu-system-x86_64 -drive file=iscsi://192.0.2.1/iqn.2001-04.com.example/1,file.sessions=4,file.queue-depth=32
+@end example
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2341,12 +2533,21 @@ Syntax for specifying a NBD device using TCP
 Syntax for specifying a NBD device using Unix Domain Sockets
 ``nbd:unix:<domain-socket>[:exportname=<export>]''
 
+The @option{connections} option opens several connections to the same
+export, up to 16, and spreads the requests over them.  This helps to fill
+high latency links.  It is only used if the server reports that the export
+can be accessed through several connections at once.
 
 Example for TCP
 @example
 qemu-system-i386 --drive file=nbd:192.0.2.1:30000
 @end example
 
+Example for TCP with four connections
+@example
+qemu-system-i386 --drive file=nbd:192.0.2.1:30000:exportname=disk,file.connections=4
+@end example
+
 Example for Unix Domain Sockets
 @example
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
@@ -2381,6 +2582,45 @@ qemu-system-i386 --drive file=sheepdog://192.0.2.1:30000/MyVirtualMachine
 
 See also @url{http://http://www.osrg.net/sheepdog/}.
 
+@item RBD
+RBD (RADOS Block Device) images are stored in a Ceph cluster.
+
+Syntax for specifying an RBD image
+@example
+rbd:pool/image[@@snapshot][:option=value[:option=value...]]
+@end example
+
+The options after the image name are Ceph configuration options, plus
+@option{id} for the user to authenticate as and @option{conf} for the
+Ceph configuration file to read.
+
+The librbd cache and readahead also take these options, which override
+the Ceph configuration:
+
+@table @option
+@item cache-size
+Size of the librbd cache (@code{rbd_cache_size}).  The cache itself is
+enabled unless @option{cache.direct} is set.
+@item cache-max-dirty
+Amount of dirty data in the cache that starts writeback
+(@code{rbd_cache_max_dirty}).
+@item readahead-max-bytes
+Maximum size of a readahead request, 0 disables the readahead
+(@code{rbd_readahead_max_bytes}).
+@item readahead-trigger-requests
+Number of sequential reads that start the readahead
+(@code{rbd_readahead_trigger_requests}).
+@item readahead-disable-after-bytes
+Stop the readahead after this much has been read, for example once the
+guest has booted and its own page cache takes over
+(@code{rbd_readahead_disable_after_bytes}).
+@end table
+
+Example
+@example
+qemu-system-x86_64 -drive file=rbd:rbd/vm1:id=qemu,file.readahead-max-bytes=4M
+@end example
+
 @item GlusterFS
 GlusterFS is an user space distributed file system.
 QEMU supports the use of GlusterFS volumes for hosting VM disk images using
@@ -2434,7 +2674,14 @@ The full URL when passing options to the driver explicitly.
 The amount of data to read ahead with each range request to the remote server.
 This value may optionally have the suffix 'T', 'G', 'M', 'K', 'k' or 'b'. If it
 does not have a suffix, it will be assumed to be in bytes. The value must be a
-multiple of 512 bytes. It defaults to 256k.
+multiple of 512 bytes. It defaults to 256k. While the guest reads sequentially,
+up to seven such chunks are requested in parallel ahead of it.
+
+@item cache-size
+The amount of memory used to keep data that was read from the remote server, so
+that reading it again does not need another request. The least recently used
+data is dropped first. It takes the same suffixes as @option{readahead}, and
+defaults to 16M. A value of 0 disables the cache.
 
 @item sslverify
 Whether to verify the remote server's certificate when connecting over SSL. It
@@ -3123,12 +3370,14 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=no]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=no][,rr=record|replay,rrfile=file]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
-    "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
+    "                or disable real time cpu sleeping\n" \
+    "                rr=record|replay records the execution to, or replays\n" \
+    "                it from, the log 'file'\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{file}]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3157,6 +3406,15 @@ Currently this option does not work when @option{shift} is @code{auto}.
 Note: The sync algorithm will work for those shift values for which
 the guest clock runs ahead of the host clock. Typically this happens
 when the shift value is high (how high depends on the host machine).
+
+@option{rr=record} writes the inputs of the guest to @var{file} as it
+runs: the timer interrupts, the input of its character devices, the
+completions of its block requests and the host clock values it reads.
+@option{rr=replay} runs the same execution again, instruction for
+instruction, from @var{file} and the same command line.  The disk
+images must be in the same state as when the recording started.  Record
+and replay need a fixed @option{shift} and a single CPU; see
+@file{docs/replay.txt} for what is not recorded.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3269,6 +3527,75 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-trace", HAS_ARG, QEMU_OPTION_tb_trace, \
+    "-tb-trace n     translate blocks executed n times again as traces\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-trace @var{n}
+@findex -tb-trace
+Count how many times each translated block is executed, and translate it
+again once it reaches @var{n} executions.  The second translation may
+follow direct jumps into the code after them, so that the TCG optimizer
+sees more than one guest basic block at a time.  Blocks are not chained
+to each other until they have been translated the second time.  The
+default, 0, disables this.
+ETEXI
+
+DEF("tb-profile", 0, QEMU_OPTION_tb_profile, \
+    "-tb-profile     count the executions of each translated block\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-profile
+@findex -tb-profile
+Translate guest code with counters of how many times each translated
+block is executed, and measure the time spent translating and executing
+guest code.  The results are shown by the @code{info tb-profile} monitor
+command and the @code{query-tb-profile} QMP command.  Profiling can also
+be switched on and off at run time with the @code{tb-profile} monitor
+command.  The counters slow down execution somewhat.
+ETEXI
+
+DEF("tb-smc-limit", HAS_ARG, QEMU_OPTION_tb_smc_limit, \
+    "-tb-smc-limit n\n" \
+    "                stop caching code in pages that the guest rewrites\n" \
+    "                n times\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-smc-limit @var{n}
+@findex -tb-smc-limit
+Stop caching the translated code of a page once guest writes have
+invalidated code in it @var{n} times, as JIT compilers that keep data
+next to their code do.  The code of such a page is translated one
+instruction at a time and thrown away after it ran, so that the page
+costs no more retranslations of whole blocks and, while none of its code
+is running, no more write faults.  The counts start again from zero when
+the translation buffer is flushed.  The default, 0, never stops caching.
+ETEXI
+
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        write a perf map of the translated code\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write the address, size and guest PC of every translated block to
+@file{/tmp/perf-@var{pid}.map}, so that @command{perf report} can show
+which guest code the samples inside the code buffer belong to.
+ETEXI
+
+DEF("tcg-thread", HAS_ARG, QEMU_OPTION_tcg_thread, \
+    "-tcg-thread single|multi\n" \
+    "                run all TCG vCPUs on one host thread (default)\n" \
+    "                or give every vCPU its own host thread\n", QEMU_ARCH_ALL)
+STEXI
+@item -tcg-thread single|multi
+@findex -tcg-thread
+Select how TCG vCPUs are mapped to host threads.  With @option{single}
+(the default) all vCPUs are scheduled round-robin on one host thread.
+With @option{multi} every vCPU runs guest code on its own host thread,
+so parallel guest workloads can use several host cores.  This mode cannot
+be combined with @option{-icount}.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming tcp:[host]:port[,to=maxport][,ipv4][,ipv6]\n" \
     "-incoming rdma:host:port[,ipv4][,ipv6]\n" \
@@ -3437,13 +3764,13 @@ config files on @var{sysconfdir}, but won't make it skip the QEMU-provided confi
 files from @var{datadir}.
 ETEXI
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
-    "-trace [events=<file>][,file=<file>]\n"
+    "-trace [events=<file>][,file=<file>][,mmap=on|off]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 STEXI
 HXCOMM This line is not accurate, as some sub-options are backend-specific but
 HXCOMM HX does not support conditional compilation of text.
-@item -trace [events=@var{file}][,file=@var{file}]
+@item -trace [events=@var{file}][,file=@var{file}][,mmap=on|off]
 @findex -trace
 
 Specify tracing options.
@@ -3460,6 +3787,13 @@ Log output traces to @var{file}.
 
 This option is only available if QEMU has been compiled with
 the @var{simple} tracing backend.
+@item mmap=on|off
+Write the trace file through a shared memory mapping instead of buffered
+I/O (default off).  The file grows in 4 MiB steps and is cut to its actual
+length when it is closed.
+
+This option is only available on POSIX hosts, if QEMU has been compiled with
+the @var{simple} tracing backend.
 @end table
 ETEXI
 
@@ -3505,6 +3839,20 @@ STEXI
 prepend a timestamp to each log message.(default:on)
 ETEXI
 
+DEF("startup-profile", 0, QEMU_OPTION_startup_profile,
+    "-startup-profile\n"
+    "                report the time spent in each startup phase\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -startup-profile
+@findex -startup-profile
+Print on standard error how long each phase of the startup took, from the
+command line parsing to the start of the main loop: creation of objects and
+character devices, accelerator setup, network and block backends, machine
+initialization, @option{-device} creation, displays, the machine done
+notifiers and the initial reset.
+ETEXI
+
 DEF("dump-vmstate", HAS_ARG, QEMU_OPTION_dump_vmstate,
     "-dump-vmstate <file>\n"
     "                Output vmstate information in JSON format to file.\n"
@@ -3546,11 +3894,37 @@ unique ID that will be used to reference this memory region
 when configuring the @option{-numa} argument. The @option{size}
 option provides the size of the memory region, and accepts
 common suffixes, eg @option{500M}. The @option{mem-path} provides
-the path to either a shared memory or huge page filesystem mount.
+the path to either a shared memory or huge page filesystem mount, in
+which a temporary file is created, or to a file that is kept, created
+if needed: this can be used to start VMs from a template, see
+@file{docs/vm-templating.txt}.
 The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
 
+With @option{prealloc=on}, the memory is preallocated by
+@option{prealloc-threads} threads, or by one thread per host CPU up to 16
+if it is 0 (the default).  When the memory is bound to host NUMA nodes
+with @option{host-nodes}, the threads run on those nodes.
+
+@item -object memory-backend-memfd,id=@var{id},size=@var{size},share=@var{on|off},hugetlb=@var{on|off},seal=@var{on|off}
+
+Creates an anonymous memory backend object on a memfd, a file that has
+no name and lives as long as it is mapped.  Like a memory-backend-file with
+@option{share=on}, which is also the default here, it can be mapped by
+vhost-user backends and passed to another QEMU by local migration (the
+x-local-shared-ram capability), but it needs no mounted file system.
+The @option{id}, @option{size} and @option{prealloc} options are the same as
+for memory-backend-file.
+
+The memory uses transparent huge pages if the host enables them for shared
+memory (@file{/sys/kernel/mm/transparent_hugepage/shmem_enabled} set to
+@code{advise} or @code{always}).  With @option{hugetlb=on} it is allocated
+from the host's default size of huge pages instead, which have to be
+reserved, and @option{size} must be a multiple of that size.
+@option{seal=on}, the default, seals the size of the memfd, so that the
+processes it is shared with cannot grow or shrink it.
+
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
 Creates a random number generator backend which obtains entropy from
@@ -3568,6 +3942,19 @@ the @option{virtio-rng} device. The @option{chardev} parameter is
 the unique ID of a character device backend that provides the connection
 to the RNG daemon.
 
+@item -object iothread,id=@var{id}[,numa-node=@var{node}][,pool-cpus=@var{cpus}][,pool-host-nodes=@var{nodes}]
+
+Creates an event loop thread that devices can use instead of the main
+loop.  Blocking I/O submitted from it, e.g. by @option{aio=threads}
+drives, runs in a pool of worker threads.  @option{pool-cpus} restricts
+the workers to the given host CPUs, and @option{pool-host-nodes} to the
+CPUs of the given host NUMA nodes; both accept ranges such as
+@option{0-3}.  By default the workers run wherever the I/O thread runs.
+@option{numa-node} runs the I/O thread, and its workers unless they are
+placed explicitly, on the host nodes of guest NUMA node @var{node}
+(see @option{-numa}), so that devices served by it stay local to the
+guest memory and vCPUs of that node.
+
 @end table
 
 ETEXI
@@ -24,6 +24,7 @@
 
 #include "qemu/main-loop.h"
 #include "qemu/timer.h"
+#include "sysemu/replay.h"
 
 #ifdef CONFIG_POSIX
 #include <pthread.h>
@@ -64,7 +65,11 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    /* binary min-heap ordered by timer_before(); the head is [0] */
+    QEMUTimer **active_timers;
+    size_t nb_active_timers;
+    size_t active_timers_size;
+    uint64_t next_seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -115,6 +120,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -171,7 +177,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return atomic_read(&timer_list->nb_active_timers) > 0;
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -185,11 +191,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -220,11 +226,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nb_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -349,43 +355,115 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+/*
+ * Pending timers are kept in a binary heap, so that arming and deleting
+ * a timer is O(log n) rather than a walk of a sorted list.  Timers that
+ * expire at the same time fire in the order they were armed, as they
+ * did with the list: the sequence number breaks the tie.
+ */
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    if (a->expire_time != b->expire_time) {
+        return a->expire_time < b->expire_time;
+    }
+    return a->seq < b->seq;
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timer_heap_set(QEMUTimerList *timer_list, size_t i,
+                                  QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUTimerList *timer_list, size_t i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timer_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_sift_down(QEMUTimerList *timer_list, size_t i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts = timer_list->active_timers[i];
+    size_t n = timer_list->nb_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        size_t child = 2 * i + 1;
+
+        if (child >= n) {
             break;
         }
-        pt = &t->next;
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1],
+                         timer_list->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(timer_list->active_timers[child], ts)) {
+            break;
+        }
+        timer_heap_set(timer_list, i, timer_list->active_timers[child]);
+        i = child;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    size_t i = ts->heap_index;
+    size_t last = timer_list->nb_active_timers - 1;
+
+    assert(i <= last && timer_list->active_timers[i] == ts);
+    atomic_set(&timer_list->nb_active_timers, last);
+    if (i == last) {
+        return;
+    }
+    timer_heap_set(timer_list, i, timer_list->active_timers[last]);
+    if (i > 0 && timer_before(timer_list->active_timers[i],
+                              timer_list->active_timers[(i - 1) / 2])) {
+        timer_heap_sift_up(timer_list, i);
+    } else {
+        timer_heap_sift_down(timer_list, i);
     }
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    if (ts->expire_time != -1) {
+        timer_heap_remove(timer_list, ts);
+        ts->expire_time = -1;
+    }
+}
+
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    size_t n = timer_list->nb_active_timers;
+
+    if (n == timer_list->active_timers_size) {
+        timer_list->active_timers_size = MAX(16, 2 * n);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->active_timers_size);
+    }
+
+    /* add the timer to the heap */
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->next_seq++;
+    timer_heap_set(timer_list, n, ts);
+    atomic_set(&timer_list->nb_active_timers, n + 1);
+    timer_heap_sift_up(timer_list, n);
 
-    return pt == &timer_list->active_timers;
+    return timer_list->active_timers[0] == ts;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -484,15 +562,15 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timer_list->nb_active_timers ? timer_list->active_timers[0]
+                                          : NULL;
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
-        /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(timer_list, ts);
         ts->expire_time = -1;
         cb = ts->cb;
         opaque = ts->opaque;
@@ -561,7 +639,7 @@ int64_t qemu_clock_get_ns(QEMUClockType type)
 
     switch (type) {
     case QEMU_CLOCK_REALTIME:
-        return get_clock();
+        return replay_clock(type, get_clock());
     default:
     case QEMU_CLOCK_VIRTUAL:
         if (use_icount) {
@@ -570,7 +648,7 @@ int64_t qemu_clock_get_ns(QEMUClockType type)
             return cpu_get_clock();
         }
     case QEMU_CLOCK_HOST:
-        now = get_clock_realtime();
+        now = replay_clock(type, get_clock_realtime());
         last = clock->last;
         clock->last = now;
         if (now < last || now > (last + get_max_clock_jump())) {
@@ -578,7 +656,7 @@ int64_t qemu_clock_get_ns(QEMUClockType type)
         }
         return now;
     case QEMU_CLOCK_VIRTUAL_RT:
-        return cpu_get_clock();
+        return replay_clock(type, cpu_get_clock());
     }
 }
 
@@ -618,6 +696,10 @@ bool qemu_clock_run_all_timers(void)
     QEMUClockType type;
 
     for (type = 0; type < QEMU_CLOCK_MAX; type++) {
+        /* Record/replay runs them at its checkpoints instead */
+        if (type == QEMU_CLOCK_VIRTUAL && replay_mode != REPLAY_MODE_NONE) {
+            continue;
+        }
         progress |= qemu_clock_run_timers(type);
     }
 
@@ -605,6 +605,41 @@ Example:
      "arguments": { "enable": true } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-xen-mapcache",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_xen_mapcache,
+    },
+
+SQMP
+query-xen-mapcache
+------------------
+
+Show the cache of guest memory mappings of a Xen HVM guest.
+
+Return a json-object with the following information:
+
+- "bucket-size": size in bytes of the guest memory mapped at once (json-int)
+- "max-size": bytes of guest memory that may be mapped before the least
+              recently used mappings are evicted (json-int)
+- "mapped-size": bytes of guest memory mapped (json-int)
+- "entries": number of mappings (json-int)
+- "locked": number of mappings in use by DMA (json-int)
+- "hits": number of lookups that found a mapping (json-int)
+- "remaps": number of lookups that had to map guest memory (json-int)
+- "evictions": number of mappings evicted to make room (json-int)
+- "invalidations": number of times the whole cache was invalidated (json-int)
+
+Example:
+
+-> { "execute": "query-xen-mapcache" }
+<- { "return": { "bucket-size": 16777216, "max-size": 34359738368,
+                 "mapped-size": 4328521728, "entries": 258, "locked": 2,
+                 "hits": 3164011, "remaps": 261, "evictions": 0,
+                 "invalidations": 1 } }
+
 EQMP
 
     {
@@ -1309,7 +1344,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
     },
 
@@ -1326,6 +1361,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image so that it is still there
+                when the image is opened again (json-bool, optional,
+                default false, since 2.5)
 
 Example:
 
@@ -1503,7 +1541,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
@@ -1545,6 +1583,9 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": when guest writes are copied to the target; "write-blocking"
+  copies them before they complete, so that the job always converges
+  (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1856,7 +1897,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?,weight:l?,iops_reserved:l?,tick_us:l?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1883,6 +1924,12 @@ Arguments:
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
 - "group": throttle group name (json-string)
+- "weight": share of the group's capacity, 1 to 1000 (json-int, optional)
+- "iops_reserved": I/O operations per second guaranteed to the device
+                   within its group (json-int, optional)
+- "tick_us": granularity of the group's timers in microseconds; waiting
+             requests are released in batches at multiples of it
+             (json-int, optional)
 
 Example:
 
@@ -1902,6 +1949,81 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "throttle-group-set-limits",
+        .args_type  = "group:s,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,tick_us:l?",
+        .mhandler.cmd_new = qmp_marshal_input_throttle_group_set_limits,
+    },
+
+SQMP
+throttle-group-set-limits
+-------------------------
+
+Change the I/O limits of a throttle group.  This is meant for groups that
+enclose other ones: the devices in group "host/tenant" are limited by both
+"host/tenant" and "host".
+
+Arguments:
+
+- "group": throttle group name (json-string)
+
+The other arguments are the same as for block_set_io_throttle, without
+"device", "group", "weight" and "iops_reserved".  "tick_us" also applies
+to the waits imposed by this group on the groups nested in it.
+
+Example:
+
+-> { "execute": "throttle-group-set-limits", "arguments": { "group": "host",
+                                                   "bps": 0,
+                                                   "bps_rd": 0,
+                                                   "bps_wr": 0,
+                                                   "iops": 20000,
+                                                   "iops_rd": 0,
+                                                   "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set, reset or remove the read, write and flush latency histograms of a
+block device.  The histograms are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries in nanoseconds for all three histograms
+                (json-array of json-int, optional)
+- "boundaries-read": bin boundaries of the read histogram, overriding
+                     "boundaries" (json-array of json-int, optional)
+- "boundaries-write": bin boundaries of the write histogram, overriding
+                      "boundaries" (json-array of json-int, optional)
+- "boundaries-flush": bin boundaries of the flush histogram, overriding
+                      "boundaries" (json-array of json-int, optional)
+
+A histogram with N boundaries has N + 1 bins.  The boundaries must be
+positive and strictly increasing.  Setting the boundaries zeroes the bins;
+a histogram without boundaries is removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [100000, 1000000, 10000000],
+                    "boundaries-flush": [1000000, 100000000] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2462,10 +2584,39 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "timed_stats": A json-array containing statistics collected in
+                     specific intervals, set with the stats-intervals
+                     -drive option.  Each element contains:
+        - "interval_length": interval used for calculating the
+                             statistics, in seconds (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns":
+          minimum, maximum and average latency of read operations in
+          the interval, in nanoseconds (json-int)
+        - "min_wr_latency_ns", "max_wr_latency_ns", "avg_wr_latency_ns":
+          the same for write operations (json-int)
+        - "min_flush_latency_ns", "max_flush_latency_ns",
+          "avg_flush_latency_ns": the same for flush operations (json-int)
+        - "avg_rd_queue_depth": average number of pending read
+                                operations in the interval (json-number)
+        - "avg_wr_queue_depth": average number of pending write
+                                operations in the interval (json-number)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms set with
+      block-latency-histogram-set (json-object, optional), containing:
+        - "boundaries": bin boundaries in nanoseconds (json-array)
+        - "bins": request count of each bin (json-array)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "driver-specific": Statistics of the image format, with a "type" member
+                     naming the format (json-object, optional).  For qcow2:
+    - "l2-cache-hits": L2 table lookups served by the cache (json-int)
+    - "l2-cache-misses": L2 tables loaded into the cache (json-int)
+    - "refcount-cache-hits": refcount block lookups served by the cache
+                             (json-int)
+    - "refcount-cache-misses": refcount blocks loaded into the cache
+                               (json-int)
 
 Example:
 
@@ -2486,7 +2637,8 @@ Example:
                   "flush_total_times_ns":49653
                   "flush_operations":61,
                   "rd_merged":0,
-                  "wr_merged":0
+                  "wr_merged":0,
+                  "timed_stats":[]
                }
             },
             "stats":{
@@ -2500,7 +2652,36 @@ Example:
                "rd_total_times_ns":3465673657
                "flush_total_times_ns":49653,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "timed_stats":[
+                  {
+                     "interval_length":60,
+                     "min_rd_latency_ns":61204,
+                     "max_rd_latency_ns":8302163,
+                     "avg_rd_latency_ns":94663,
+                     "min_wr_latency_ns":248715,
+                     "max_wr_latency_ns":2591920,
+                     "avg_wr_latency_ns":452656,
+                     "min_flush_latency_ns":811,
+                     "max_flush_latency_ns":1450,
+                     "avg_flush_latency_ns":973,
+                     "avg_rd_queue_depth":0.058,
+                     "avg_wr_queue_depth":0.005
+                  }
+               ],
+               "rd_latency_histogram":{
+                  "boundaries":[100000, 1000000, 10000000],
+                  "bins":[35102, 1443, 59, 0]
+               }
+            },
+            "driver-specific":{
+               "type":"qcow2",
+               "data":{
+                  "l2-cache-hits":36211,
+                  "l2-cache-misses":16,
+                  "refcount-cache-hits":611,
+                  "refcount-cache-misses":4
+               }
             }
          },
          {
@@ -2516,7 +2697,8 @@ Example:
                "rd_total_times_ns":0
                "flush_total_times_ns":0,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "timed_stats":[]
             }
          },
          {
@@ -2532,7 +2714,8 @@ Example:
                "rd_total_times_ns":0
                "flush_total_times_ns":0,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "timed_stats":[]
             }
          },
          {
@@ -2548,7 +2731,8 @@ Example:
                "rd_total_times_ns":0
                "flush_total_times_ns":0,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "timed_stats":[]
             }
          }
       ]
@@ -2613,6 +2797,50 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-tb-profile
+----------------
+
+Show the translated blocks that were executed most often, when TCG
+profiling is enabled with -tb-profile or the tb-profile HMP command.
+
+Arguments:
+
+- "count": maximum number of blocks to return, 0 for all, default 20
+           (json-int, optional)
+
+Return a json-object with:
+
+- "enabled": true if profiling is enabled (json-bool)
+- "translations": number of blocks translated (json-int)
+- "translation-time": nanoseconds spent translating (json-int)
+- "execution-time": nanoseconds spent executing guest code (json-int)
+- "blocks": a json-array of json-objects, most executed first, with:
+  - "pc": guest address of the block (json-int)
+  - "size": size of the guest code in bytes (json-int)
+  - "icount": number of guest instructions (json-int)
+  - "host-addr": host address of the generated code (json-int)
+  - "host-size": size of the generated code in bytes (json-int)
+  - "count": number of executions (json-int)
+
+Example:
+
+-> { "execute": "query-tb-profile", "arguments": { "count": 1 } }
+<- { "return": { "enabled": true, "translations": 13845,
+                 "translation-time": 412339251,
+                 "execution-time": 8403912844,
+                 "blocks": [ { "pc": 3221621219, "size": 12, "icount": 4,
+                               "host-addr": 140218873592832,
+                               "host-size": 96, "count": 2391561 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-tb-profile",
+        .args_type  = "count:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_tb_profile,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2627,6 +2855,12 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "coroutine-pool-hits": coroutines taken from the thread's coroutine pool
+  (json-int)
+- "coroutine-pool-misses": coroutines the thread had to allocate (json-int)
+- "coroutine-pool-size": coroutines in the thread's pool (json-int)
+- "coroutine-pool-max-size": coroutines the pool can hold, which grows with
+  the thread's peak concurrency (json-int)
 
 Example:
 
@@ -2635,11 +2869,19 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "coroutine-pool-hits":183520,
+            "coroutine-pool-misses":256,
+            "coroutine-pool-size":312,
+            "coroutine-pool-max-size":319
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "coroutine-pool-hits":0,
+            "coroutine-pool-misses":0,
+            "coroutine-pool-size":0,
+            "coroutine-pool-max-size":64
          }
       ]
    }
@@ -3011,6 +3253,9 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "encode-time": time spent encoding updates, in microseconds
+                 (json-int, optional)
+- "encoded-updates": number of updates encoded (json-int, optional)
 
 Example:
 
@@ -3063,6 +3308,7 @@ The main json-object contains the following:
 - "auth": authentication method (json-string)
          - Possible values: "none", "spice"
 - "channels": a json-array of all active channels clients
+- "displays": a json-array of the displays QEMU renders itself (optional)
 
 Channels are described by a json-object, each one contain the following:
 
@@ -3079,6 +3325,14 @@ Channels are described by a json-object, each one contain the following:
                 display channels in a multihead setup (json-int)
 - "tls": whether the channel is encrypted (json-bool)
 
+Displays are described by a json-object, each one contain the following:
+
+- "id": spice display id (json-int)
+- "frames": refreshes that sent at least one image (json-int)
+- "updates": images sent (json-int)
+- "fps": frames per second over the last second (json-number)
+- "update-time": time spent creating the images, in microseconds (json-int)
+
 Example:
 
 -> { "execute": "query-spice" }
@@ -3231,7 +3485,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+       "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3274,10 +3529,16 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-eviction": number of pages evicted from the XBZRLE
+           page cache to make room for other pages
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "x-cpu-throttle-percentage": percentage of time guest cpus are being
+  throttled during auto-converge.  Only present if auto-converge has
+  started throttling the guest (json-int)
 
 Examples:
 
@@ -3383,7 +3644,9 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":365323,
+            "cache-eviction":1024
          }
       }
    }
@@ -3407,6 +3670,14 @@ Enable/Disable migration capabilities
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
 - "events": generate events for each migration state change
+- "x-multifd": send RAM pages over several connections in parallel
+- "x-postcopy-ram": switch to postcopy after x-postcopy-rounds RAM passes
+- "x-dirty-bitmaps": migrate the dirty bitmaps of the block devices
+- "x-page-batch": send runs of RAM pages with a single header
+- "x-local-shared-ram": pass shared file-backed RAM to a local destination
+  instead of copying it
+- "x-ignore-shared": leave shared file-backed RAM in its file instead of
+  sending it
 
 Arguments:
 
@@ -3459,6 +3730,13 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "multifd-channels": set number of multifd connections (json-int)
+- "x-postcopy-rounds": set number of precopy passes before postcopy (json-int)
+- "x-cpu-throttle-initial": set initial percentage of time guest cpus are
+  throttled when migration auto-converge is activated (json-int)
+- "x-cpu-throttle-increment": set throttle percentage increase each time
+  auto-converge detects that migration is not making progress (json-int)
+- "x-rdma-qps": set number of queue pairs used by RDMA migration (json-int)
 
 Arguments:
 
@@ -3472,7 +3750,10 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "multifd-channels:i?,x-postcopy-rounds:i?,"
+            "x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,"
+            "x-rdma-qps:i?",
 	.mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
     },
 SQMP
@@ -3485,6 +3766,13 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "multifd-channels" : number of multifd connections (json-int)
+         - "x-postcopy-rounds" : precopy passes before postcopy (json-int)
+         - "x-cpu-throttle-initial" : initial cpu throttle percentage for
+           auto-converge (json-int)
+         - "x-cpu-throttle-increment" : cpu throttle percentage increment
+           for auto-converge (json-int)
+         - "x-rdma-qps" : number of RDMA queue pairs (json-int)
 
 Arguments:
 
@@ -3493,6 +3781,11 @@ Example:
 -> { "execute": "query-migrate-parameters" }
 <- {
       "return": {
+         "x-rdma-qps", 1,
+         "x-cpu-throttle-increment", 10,
+         "x-cpu-throttle-initial", 20,
+         "x-postcopy-rounds", 5,
+         "multifd-channels", 2,
          "decompress-threads", 2,
          "compress-threads", 8,
          "compress-level", 1
@@ -3507,6 +3800,135 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
     },
 
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring how fast the guest dirties its RAM, without migrating it.
+The command returns at once; the result is reported by query-dirty-rate.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 5 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the result of the last dirty rate measurement, and estimate how a
+precopy migration of the guest would go.
+
+Arguments:
+
+- "bandwidth": bandwidth to predict the migration for, in bytes per second.
+  Defaults to the migration speed limit (json-int, optional)
+- "downtime-limit": maximum downtime to predict the migration for, in
+  milliseconds.  Defaults to the migration downtime limit (json-int, optional)
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": start of the measurement in seconds since the epoch
+  (json-int, optional)
+- "calc-time": length of the measurement in seconds (json-int, optional)
+- "dirty-rate": bytes dirtied per second (json-int, optional)
+- "working-set": bytes dirtied at least once (json-int, optional)
+- "blocks": json-array with the "id", "size", "dirty-rate" and
+  "working-set" of each RAM block (optional)
+- "prediction": json-object with the following information (optional):
+         - "bandwidth": bandwidth in bytes per second (json-int)
+         - "downtime-limit": downtime limit in milliseconds (json-int)
+         - "converges": true if the migration would complete (json-bool)
+         - "iterations": number of RAM passes (json-int)
+         - "total-time": total migration time in milliseconds (json-int)
+         - "expected-downtime": downtime in milliseconds (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate",
+     "arguments": { "bandwidth": 134217728 } }
+<- { "return": {
+        "status": "measured",
+        "start-time": 1444405124,
+        "calc-time": 5,
+        "dirty-rate": 20971520,
+        "working-set": 41943040,
+        "blocks": [ { "id": "pc.ram", "size": 1073741824,
+                      "dirty-rate": 20971520, "working-set": 41943040 } ],
+        "prediction": { "bandwidth": 134217728, "downtime-limit": 300,
+                        "converges": true, "iterations": 3,
+                        "total-time": 9521, "expected-downtime": 186 }
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "bandwidth:i?,downtime-limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-stats
+-----------
+
+Return the counters of the subsystems of QEMU.  Each counter comes with its
+increase since the previous query-stats on the same monitor, so that a
+monitoring client can poll it without keeping state.
+
+Arguments:
+
+- "providers": json-array of the subsystems to report, among "block",
+  "virtio", "iothread", "tcg", "kvm", "net", "mmio" and "audio".  Defaults
+  to all of them (optional)
+
+Return a json-object with the following information:
+
+- "interval": nanoseconds since the previous query-stats on the same
+  monitor, 0 for the first one (json-int)
+- "instances": json-array of json-objects, one per subsystem instance:
+         - "provider": the subsystem (json-string)
+         - "id": name of the instance (json-string)
+         - "counters": json-array of json-objects with the "name" (json-string),
+           "value" (json-int) and "delta" (json-int) of each counter
+
+Example:
+
+-> { "execute": "query-stats", "arguments": { "providers": [ "block" ] } }
+<- { "return": {
+        "interval": 1000213456,
+        "instances": [
+           { "provider": "block", "id": "drive-virtio-disk0",
+             "counters": [ { "name": "rd-bytes", "value": 85004288,
+                             "delta": 4096 },
+                           { "name": "wr-bytes", "value": 10567680,
+                             "delta": 0 },
+                           ... ] } ]
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-stats",
+        .args_type  = "providers:q?",
+        .mhandler.cmd_new = qmp_marshal_input_query_stats,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -3810,6 +4232,72 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-vhost-net",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_query_vhost_net,
+    },
+
+SQMP
+query-vhost-net
+---------------
+
+Show the vhost state of each queue of the network backends.
+
+Returns a json-array with one entry per queue of all backends that use
+vhost (or of the given backend), returning an error if the given backend
+doesn't exist or doesn't use vhost.
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "queue": queue index (json-int)
+- "backend": "kernel" for vhost-net, "user" for vhost-user (json-string)
+- "started": vhost processes the rings of the queue (json-bool)
+- "poll-us": maximum busy polling time in microseconds, 0 if disabled
+             (json-int)
+
+Example:
+
+-> { "execute": "query-vhost-net", "arguments": { "name": "net0" } }
+<- { "return": [
+        { "name": "net0", "queue": 0, "backend": "kernel",
+          "started": true, "poll-us": 50 },
+        { "name": "net0", "queue": 1, "backend": "kernel",
+          "started": true, "poll-us": 50 }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "netdev-set-vhost-poll",
+        .args_type  = "name:s,queue:i?,poll-us:i",
+        .mhandler.cmd_new = qmp_marshal_input_netdev_set_vhost_poll,
+    },
+
+SQMP
+netdev-set-vhost-poll
+---------------------
+
+Set how long vhost busy polls the rings of a network backend before it
+waits for a notification.
+
+Arguments:
+
+- "name": net client name (json-string)
+- "queue": only change this queue, all of them by default (json-int, optional)
+- "poll-us": maximum busy polling time in microseconds, 0 disables it
+             (json-int)
+
+Example:
+
+-> { "execute": "netdev-set-vhost-poll",
+     "arguments": { "name": "net0", "queue": 1, "poll-us": 50 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -115,6 +115,10 @@ void cpu_exit(CPUState *cpu)
 {
     cpu->exit_request = 1;
     cpu->tcg_exit_req = 1;
+    /* icount TBs test this instead of tcg_exit_req, see gen_tb_start() */
+    if (use_icount) {
+        cpu->icount_decr.u16.high = 0xffff;
+    }
 }
 
 int cpu_write_elf32_qemunote(WriteCoreDumpFunction f, CPUState *cpu,
@@ -264,6 +264,8 @@ static void type_initialize(TypeImpl *ti)
         g_assert(parent->class_size <= ti->class_size);
         memcpy(ti->class, parent->class, parent->class_size);
         ti->class->interfaces = NULL;
+        memset(ti->class->cast_cache, 0, sizeof(ti->class->cast_cache));
+        ti->class->cast_cache_used = 0;
 
         for (e = parent->class->interfaces; e; e = e->next) {
             InterfaceClass *iface = e->data;
@@ -363,6 +365,7 @@ static void object_property_del_all(Object *obj)
         ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
 
         QTAILQ_REMOVE(&obj->properties, prop, node);
+        g_hash_table_remove(obj->property_table, prop->name);
 
         if (prop->release) {
             prop->release(obj, prop->name, prop->opaque);
@@ -373,6 +376,11 @@ static void object_property_del_all(Object *obj)
         g_free(prop->description);
         g_free(prop);
     }
+
+    if (obj->property_table) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
+    }
 }
 
 static void object_property_del_child(Object *obj, Object *child, Error **errp)
@@ -557,45 +565,6 @@ Object *object_dynamic_cast(Object *obj, const char *typename)
     return NULL;
 }
 
-Object *object_dynamic_cast_assert(Object *obj, const char *typename,
-                                   const char *file, int line, const char *func)
-{
-    trace_object_dynamic_cast_assert(obj ? obj->class->type->name : "(null)",
-                                     typename, file, line, func);
-
-#ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
-    Object *inst;
-
-    for (i = 0; obj && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (obj->class->object_cast_cache[i] == typename) {
-            goto out;
-        }
-    }
-
-    inst = object_dynamic_cast(obj, typename);
-
-    if (!inst && obj) {
-        fprintf(stderr, "%s:%d:%s: Object %p is not an instance of type %s\n",
-                file, line, func, obj, typename);
-        abort();
-    }
-
-    assert(obj == inst);
-
-    if (obj && obj == inst) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            obj->class->object_cast_cache[i - 1] =
-                    obj->class->object_cast_cache[i];
-        }
-        obj->class->object_cast_cache[i - 1] = typename;
-    }
-
-out:
-#endif
-    return obj;
-}
-
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
                                        const char *typename)
 {
@@ -644,6 +613,68 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
     return ret;
 }
 
+/*
+ * The cast cache of a class is keyed by the address of the type name, which
+ * is the same for every cast done by a given QOM cast macro; it must not be
+ * used for type names that could be freed.  The result of a cast never
+ * changes, because the ancestors and interfaces of a class are known once it
+ * is initialized.
+ *
+ * Entries are filled once and never replaced, so lookups need no lock: a
+ * thread claims an entry with cast_cache_used, fills it and publishes it by
+ * setting its type name last.
+ */
+static ObjectClass *object_class_dynamic_cast_cached(ObjectClass *class,
+                                                     const char *typename)
+{
+    ObjectClassCastEntry *e;
+    ObjectClass *ret;
+    int i, n;
+
+    if (!class) {
+        return NULL;
+    }
+
+    n = MIN(atomic_read(&class->cast_cache_used), OBJECT_CLASS_CAST_CACHE);
+    for (i = 0; i < n; i++) {
+        e = &class->cast_cache[i];
+        if (atomic_read(&e->typename) == typename) {
+            smp_rmb();
+            return e->klass;
+        }
+    }
+
+    ret = object_class_dynamic_cast(class, typename);
+
+    /* Check first, so that the counter stops growing once the cache is full */
+    if (atomic_read(&class->cast_cache_used) < OBJECT_CLASS_CAST_CACHE) {
+        i = atomic_fetch_inc(&class->cast_cache_used);
+        if (i < OBJECT_CLASS_CAST_CACHE) {
+            e = &class->cast_cache[i];
+            e->klass = ret;
+            smp_wmb();
+            atomic_set(&e->typename, typename);
+        }
+    }
+    return ret;
+}
+
+Object *object_dynamic_cast_assert(Object *obj, const char *typename,
+                                   const char *file, int line, const char *func)
+{
+    trace_object_dynamic_cast_assert(obj ? obj->class->type->name : "(null)",
+                                     typename, file, line, func);
+
+#ifdef CONFIG_QOM_CAST_DEBUG
+    if (obj && !object_class_dynamic_cast_cached(obj->class, typename)) {
+        fprintf(stderr, "%s:%d:%s: Object %p is not an instance of type %s\n",
+                file, line, func, obj, typename);
+        abort();
+    }
+#endif
+    return obj;
+}
+
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                               const char *typename,
                                               const char *file, int line,
@@ -654,37 +685,19 @@ ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
     trace_object_class_dynamic_cast_assert(class ? class->type->name : "(null)",
                                            typename, file, line, func);
 
-#ifdef CONFIG_QOM_CAST_DEBUG
-    int i;
-
-    for (i = 0; class && i < OBJECT_CLASS_CAST_CACHE; i++) {
-        if (class->class_cast_cache[i] == typename) {
-            ret = class;
-            goto out;
-        }
-    }
-#else
+#ifndef CONFIG_QOM_CAST_DEBUG
     if (!class || !class->interfaces) {
         return class;
     }
 #endif
 
-    ret = object_class_dynamic_cast(class, typename);
+    ret = object_class_dynamic_cast_cached(class, typename);
     if (!ret && class) {
         fprintf(stderr, "%s:%d:%s: Object %p is not an instance of type %s\n",
                 file, line, func, class, typename);
         abort();
     }
 
-#ifdef CONFIG_QOM_CAST_DEBUG
-    if (class && ret == class) {
-        for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
-            class->class_cast_cache[i - 1] = class->class_cast_cache[i];
-        }
-        class->class_cast_cache[i - 1] = typename;
-    }
-out:
-#endif
     return ret;
 }
 
@@ -860,13 +873,11 @@ object_property_add(Object *obj, const char *name, const char *type,
         return ret;
     }
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            error_setg(errp, "attempt to add duplicate property '%s'"
-                       " to object (type '%s')", name,
-                       object_get_typename(obj));
-            return NULL;
-        }
+    if (object_property_find(obj, name, NULL)) {
+        error_setg(errp, "attempt to add duplicate property '%s'"
+                   " to object (type '%s')", name,
+                   object_get_typename(obj));
+        return NULL;
     }
 
     prop = g_malloc0(sizeof(*prop));
@@ -880,18 +891,24 @@ object_property_add(Object *obj, const char *name, const char *type,
     prop->opaque = opaque;
 
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    /* The list keeps the order of the properties, the table finds them */
+    if (!obj->property_table) {
+        obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_insert(obj->property_table, prop->name, prop);
     return prop;
 }
 
 ObjectProperty *object_property_find(Object *obj, const char *name,
                                      Error **errp)
 {
-    ObjectProperty *prop;
+    ObjectProperty *prop = NULL;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            return prop;
-        }
+    if (obj->property_table) {
+        prop = g_hash_table_lookup(obj->property_table, name);
+    }
+    if (prop) {
+        return prop;
     }
 
     error_setg(errp, "Property '.%s' not found", name);
@@ -910,6 +927,7 @@ void object_property_del(Object *obj, const char *name, Error **errp)
     }
 
     QTAILQ_REMOVE(&obj->properties, prop, node);
+    g_hash_table_remove(obj->property_table, prop->name);
 
     g_free(prop->name);
     g_free(prop->type);
@@ -0,0 +1,596 @@
+/*
+ * Deterministic record/replay of TCG execution
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Under icount with a fixed shift, QEMU_CLOCK_VIRTUAL only advances with
+ * the instruction count, plus the bias it gains while the CPUs are idle.
+ * What is left to make a TCG guest nondeterministic is when its inputs
+ * arrive, so with rr=record they are funnelled through the TCG thread:
+ * the QEMU_CLOCK_VIRTUAL timers, character device input and block request
+ * completions do not run in the main loop but at checkpoints, between two
+ * rounds of TCG execution.  A checkpoint where anything happens is logged
+ * with the instruction count and the bias, followed by its events.  Clock
+ * reads by the TCG thread, and block requests it completes early to cancel
+ * them, are logged where they happen.
+ *
+ * With rr=replay, TCG execution stops at the instruction count of each
+ * logged checkpoint, where the bias is restored and the events run again;
+ * the live inputs are dropped.  The log is a header followed by records:
+ *
+ *   header      "QEMURR\0\0", be32 version, be32 icount shift
+ *   checkpoint  u8 kind, be64 icount, be64 bias
+ *   clock       u8 kind, u8 clock, be64 value
+ *   char        u8 kind, be16 label length, label, be32 length, data
+ *   block       u8 kind, be64 request id
+ *   block-sync  u8 kind, be64 request id
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qom/cpu.h"
+#include "sysemu/char.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/replay.h"
+
+#define REPLAY_MAGIC        "QEMURR\0\0"
+#define REPLAY_VERSION      1
+#define REPLAY_HEADER_SIZE  16
+#define REPLAY_BUF_SIZE     (1 << 20)
+
+enum {
+    REPLAY_EVENT_CHECKPOINT,
+    REPLAY_EVENT_CLOCK,
+    REPLAY_EVENT_CHAR,
+    REPLAY_EVENT_BLOCK,
+    REPLAY_EVENT_BLOCK_SYNC,
+};
+
+typedef struct ReplayEvent {
+    int kind;
+    int64_t value;              /* clock value or block request id */
+    QEMUClockType clock;
+    char *label;                /* character device input */
+    uint8_t *buf;
+    int len;
+    void (*cb)(void *opaque);   /* block request completion */
+    void *opaque;
+    QSIMPLEQ_ENTRY(ReplayEvent) next;
+} ReplayEvent;
+
+QSIMPLEQ_HEAD(ReplayEventQueue, ReplayEvent);
+
+ReplayMode replay_mode = REPLAY_MODE_NONE;
+
+/* Protected by the iothread lock */
+static struct {
+    FILE *file;
+    char *filename;
+    uint64_t block_id;
+    /* QEMU_CLOCK_VIRTUAL bias as of the last checkpoint (record) */
+    int64_t bias;
+    /*
+     * Record: events for the next checkpoint.
+     * Replay: events of the checkpoint being run.
+     */
+    struct ReplayEventQueue events;
+    /* Replay: logged clock reads and block-sync records, in order */
+    struct ReplayEventQueue inline_events;
+    /* Replay: block completions that the log has not reached yet */
+    struct ReplayEventQueue completions;
+    QemuCond completed;
+    /* Replay: the next checkpoint */
+    bool has_next;
+    int64_t next_icount;
+    int64_t next_bias;
+} replay;
+
+static __thread bool replay_in_tcg_thread;
+
+static void GCC_FMT_ATTR(1, 2) replay_fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    error_vreport(fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void replay_put_buf(const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, replay.file) != len) {
+        replay_fatal("replay: cannot write to %s: %s", replay.filename,
+                     strerror(errno));
+    }
+}
+
+static void replay_put_byte(uint8_t v)
+{
+    replay_put_buf(&v, 1);
+}
+
+static void replay_put_be16(uint16_t v)
+{
+    v = cpu_to_be16(v);
+    replay_put_buf(&v, sizeof(v));
+}
+
+static void replay_put_be32(uint32_t v)
+{
+    v = cpu_to_be32(v);
+    replay_put_buf(&v, sizeof(v));
+}
+
+static void replay_put_be64(uint64_t v)
+{
+    v = cpu_to_be64(v);
+    replay_put_buf(&v, sizeof(v));
+}
+
+static void replay_get_buf(void *buf, size_t len)
+{
+    if (fread(buf, 1, len, replay.file) != len) {
+        replay_fatal("replay: %s is truncated", replay.filename);
+    }
+}
+
+static uint8_t replay_get_byte(void)
+{
+    uint8_t v;
+
+    replay_get_buf(&v, 1);
+    return v;
+}
+
+static uint16_t replay_get_be16(void)
+{
+    uint16_t v;
+
+    replay_get_buf(&v, sizeof(v));
+    return be16_to_cpu(v);
+}
+
+static uint32_t replay_get_be32(void)
+{
+    uint32_t v;
+
+    replay_get_buf(&v, sizeof(v));
+    return be32_to_cpu(v);
+}
+
+static uint64_t replay_get_be64(void)
+{
+    uint64_t v;
+
+    replay_get_buf(&v, sizeof(v));
+    return be64_to_cpu(v);
+}
+
+static void replay_put_event(ReplayEvent *ev)
+{
+    size_t n;
+
+    replay_put_byte(ev->kind);
+    switch (ev->kind) {
+    case REPLAY_EVENT_CHAR:
+        n = strlen(ev->label);
+        replay_put_be16(n);
+        replay_put_buf(ev->label, n);
+        replay_put_be32(ev->len);
+        replay_put_buf(ev->buf, ev->len);
+        break;
+    case REPLAY_EVENT_BLOCK:
+    case REPLAY_EVENT_BLOCK_SYNC:
+        replay_put_be64(ev->value);
+        break;
+    default:
+        abort();
+    }
+}
+
+/* Read the records that follow a checkpoint, up to the next one */
+static void replay_fetch(void)
+{
+    ReplayEvent *ev;
+    int kind, n;
+
+    replay.has_next = false;
+    while ((kind = getc(replay.file)) != EOF) {
+        if (kind == REPLAY_EVENT_CHECKPOINT) {
+            replay.next_icount = replay_get_be64();
+            replay.next_bias = replay_get_be64();
+            replay.has_next = true;
+            return;
+        }
+
+        ev = g_new0(ReplayEvent, 1);
+        ev->kind = kind;
+        switch (kind) {
+        case REPLAY_EVENT_CLOCK:
+            ev->clock = replay_get_byte();
+            ev->value = replay_get_be64();
+            QSIMPLEQ_INSERT_TAIL(&replay.inline_events, ev, next);
+            break;
+        case REPLAY_EVENT_CHAR:
+            n = replay_get_be16();
+            ev->label = g_malloc(n + 1);
+            replay_get_buf(ev->label, n);
+            ev->label[n] = '\0';
+            ev->len = replay_get_be32();
+            ev->buf = g_malloc(ev->len);
+            replay_get_buf(ev->buf, ev->len);
+            QSIMPLEQ_INSERT_TAIL(&replay.events, ev, next);
+            break;
+        case REPLAY_EVENT_BLOCK:
+            ev->value = replay_get_be64();
+            QSIMPLEQ_INSERT_TAIL(&replay.events, ev, next);
+            break;
+        case REPLAY_EVENT_BLOCK_SYNC:
+            ev->value = replay_get_be64();
+            QSIMPLEQ_INSERT_TAIL(&replay.inline_events, ev, next);
+            break;
+        default:
+            replay_fatal("replay: %s is corrupt", replay.filename);
+        }
+    }
+}
+
+static void replay_free_event(ReplayEvent *ev)
+{
+    g_free(ev->label);
+    g_free(ev->buf);
+    g_free(ev);
+}
+
+static void replay_run_event(ReplayEvent *ev)
+{
+    CharDriverState *chr;
+
+    switch (ev->kind) {
+    case REPLAY_EVENT_CHAR:
+        /* The device may have been unplugged since */
+        chr = qemu_chr_find(ev->label);
+        if (chr) {
+            qemu_chr_be_write_impl(chr, ev->buf, ev->len);
+        }
+        break;
+    case REPLAY_EVENT_BLOCK:
+    case REPLAY_EVENT_BLOCK_SYNC:
+        ev->cb(ev->opaque);
+        break;
+    default:
+        abort();
+    }
+}
+
+/* Take the next inline record, which the execution expects to be @kind */
+static ReplayEvent *replay_take_inline(int kind)
+{
+    ReplayEvent *ev = QSIMPLEQ_FIRST(&replay.inline_events);
+
+    if (!ev || ev->kind != kind) {
+        replay_fatal("replay: execution diverged from %s", replay.filename);
+    }
+    QSIMPLEQ_REMOVE_HEAD(&replay.inline_events, next);
+    return ev;
+}
+
+/* Take the completion of block request @id out of @queue */
+static ReplayEvent *replay_take_block(struct ReplayEventQueue *queue,
+                                      uint64_t id)
+{
+    ReplayEvent *ev;
+
+    QSIMPLEQ_FOREACH(ev, queue, next) {
+        if (ev->kind == REPLAY_EVENT_BLOCK && ev->value == id) {
+            QSIMPLEQ_REMOVE(queue, ev, ReplayEvent, next);
+            return ev;
+        }
+    }
+    return NULL;
+}
+
+static void replay_queue_event(ReplayEvent *ev)
+{
+    QSIMPLEQ_INSERT_TAIL(&replay.events, ev, next);
+    /* Get the TCG thread to a checkpoint */
+    if (!replay_in_tcg_thread) {
+        qemu_cpu_kick(first_cpu);
+    }
+}
+
+/* The log is over: let the guest go on with live inputs */
+static void replay_end(void)
+{
+    ReplayEvent *ev;
+
+    error_report("replay: end of %s, switching to live execution",
+                 replay.filename);
+    replay_mode = REPLAY_MODE_NONE;
+    fclose(replay.file);
+    replay.file = NULL;
+
+    while ((ev = QSIMPLEQ_FIRST(&replay.inline_events))) {
+        QSIMPLEQ_REMOVE_HEAD(&replay.inline_events, next);
+        replay_free_event(ev);
+    }
+    while ((ev = QSIMPLEQ_FIRST(&replay.completions))) {
+        QSIMPLEQ_REMOVE_HEAD(&replay.completions, next);
+        replay_run_event(ev);
+        replay_free_event(ev);
+    }
+}
+
+static void replay_record_checkpoint(void)
+{
+    int64_t bias = cpu_get_icount_bias();
+    ReplayEvent *ev;
+
+    if (QSIMPLEQ_EMPTY(&replay.events) && bias == replay.bias &&
+        !qemu_clock_expired(QEMU_CLOCK_VIRTUAL)) {
+        return;
+    }
+
+    replay_put_byte(REPLAY_EVENT_CHECKPOINT);
+    replay_put_be64(cpu_get_icount_raw());
+    replay_put_be64(bias);
+    replay.bias = bias;
+
+    qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+    while ((ev = QSIMPLEQ_FIRST(&replay.events))) {
+        QSIMPLEQ_REMOVE_HEAD(&replay.events, next);
+        replay_put_event(ev);
+        replay_run_event(ev);
+        replay_free_event(ev);
+    }
+}
+
+static void replay_play_checkpoint(void)
+{
+    int64_t icount = cpu_get_icount_raw();
+    ReplayEvent *ev, *done;
+
+    while (replay.has_next && replay.next_icount <= icount) {
+        if (replay.next_icount < icount) {
+            replay_fatal("replay: execution went past the checkpoint at "
+                         "icount %" PRId64 " of %s", replay.next_icount,
+                         replay.filename);
+        }
+        cpu_set_icount_bias(replay.next_bias);
+        replay_fetch();
+
+        qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+        while ((ev = QSIMPLEQ_FIRST(&replay.events))) {
+            QSIMPLEQ_REMOVE_HEAD(&replay.events, next);
+            if (ev->kind == REPLAY_EVENT_BLOCK) {
+                /* Wait for the request to complete on the host, too */
+                while (!(done = replay_take_block(&replay.completions,
+                                                  ev->value))) {
+                    qemu_cond_wait_iothread(&replay.completed);
+                }
+                replay_free_event(ev);
+                ev = done;
+            }
+            replay_run_event(ev);
+            replay_free_event(ev);
+        }
+    }
+
+    if (!replay.has_next) {
+        replay_end();
+    }
+}
+
+void replay_checkpoint(void)
+{
+    /* Only the TCG thread gets here, before it executes any guest code */
+    replay_in_tcg_thread = true;
+
+    switch (replay_mode) {
+    case REPLAY_MODE_RECORD:
+        replay_record_checkpoint();
+        break;
+    case REPLAY_MODE_PLAY:
+        replay_play_checkpoint();
+        break;
+    default:
+        break;
+    }
+}
+
+bool replay_has_work(void)
+{
+    switch (replay_mode) {
+    case REPLAY_MODE_RECORD:
+        return !QSIMPLEQ_EMPTY(&replay.events) ||
+               qemu_clock_expired(QEMU_CLOCK_VIRTUAL);
+    case REPLAY_MODE_PLAY:
+        return !replay.has_next || replay.next_icount <= cpu_get_icount_raw();
+    default:
+        return false;
+    }
+}
+
+int64_t replay_icount_budget(int64_t icount, int64_t count)
+{
+    if (replay_mode == REPLAY_MODE_PLAY && replay.has_next) {
+        return MIN(count, MAX(replay.next_icount - icount, 0));
+    }
+    return count;
+}
+
+int64_t replay_read_clock(QEMUClockType type, int64_t now)
+{
+    ReplayEvent *ev;
+
+    /* What other threads do with the time does not reach the guest */
+    if (!replay_in_tcg_thread) {
+        return now;
+    }
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_put_byte(REPLAY_EVENT_CLOCK);
+        replay_put_byte(type);
+        replay_put_be64(now);
+        return now;
+    }
+
+    ev = replay_take_inline(REPLAY_EVENT_CLOCK);
+    if (ev->clock != type) {
+        replay_fatal("replay: execution diverged from %s", replay.filename);
+    }
+    now = ev->value;
+    replay_free_event(ev);
+    return now;
+}
+
+bool replay_char_write(CharDriverState *chr, const uint8_t *buf, int len)
+{
+    ReplayEvent *ev;
+
+    if (chr->no_replay || !chr->label) {
+        return false;
+    }
+    if (replay_mode == REPLAY_MODE_PLAY) {
+        return true;
+    }
+
+    ev = g_new0(ReplayEvent, 1);
+    ev->kind = REPLAY_EVENT_CHAR;
+    ev->label = g_strdup(chr->label);
+    ev->buf = g_memdup(buf, len);
+    ev->len = len;
+    replay_queue_event(ev);
+    return true;
+}
+
+uint64_t replay_block_id(void)
+{
+    return ++replay.block_id;
+}
+
+void replay_block_event(uint64_t id, void (*cb)(void *opaque), void *opaque)
+{
+    ReplayEvent *ev = g_new0(ReplayEvent, 1);
+
+    ev->kind = REPLAY_EVENT_BLOCK;
+    ev->value = id;
+    ev->cb = cb;
+    ev->opaque = opaque;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_queue_event(ev);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&replay.completions, ev, next);
+        qemu_cond_broadcast(&replay.completed);
+    }
+}
+
+bool replay_block_cancel(uint64_t id)
+{
+    ReplayEvent *ev, *logged;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        ev = replay_take_block(&replay.events, id);
+        if (!ev) {
+            return false;
+        }
+        if (replay_in_tcg_thread) {
+            ev->kind = REPLAY_EVENT_BLOCK_SYNC;
+            replay_put_event(ev);
+        }
+    } else if (replay_mode == REPLAY_MODE_PLAY) {
+        ev = replay_take_block(&replay.completions, id);
+        if (!ev) {
+            return false;
+        }
+        if (replay_in_tcg_thread) {
+            logged = replay_take_inline(REPLAY_EVENT_BLOCK_SYNC);
+            if (logged->value != id) {
+                replay_fatal("replay: execution diverged from %s",
+                             replay.filename);
+            }
+            replay_free_event(logged);
+        }
+    } else {
+        return false;
+    }
+
+    replay_run_event(ev);
+    replay_free_event(ev);
+    return true;
+}
+
+static void replay_finish(void)
+{
+    if (replay.file) {
+        fclose(replay.file);
+        replay.file = NULL;
+    }
+}
+
+void replay_configure(ReplayMode mode, const char *filename, int shift,
+                      Error **errp)
+{
+    uint8_t header[REPLAY_HEADER_SIZE];
+
+    if (smp_cpus > 1) {
+        error_setg(errp, "record/replay only supports a single CPU");
+        return;
+    }
+
+    replay.file = fopen(filename, mode == REPLAY_MODE_RECORD ? "wb" : "rb");
+    if (!replay.file) {
+        error_setg_errno(errp, errno, "Cannot open replay log '%s'",
+                         filename);
+        return;
+    }
+    setvbuf(replay.file, NULL, _IOFBF, REPLAY_BUF_SIZE);
+    replay.filename = g_strdup(filename);
+    QSIMPLEQ_INIT(&replay.events);
+    QSIMPLEQ_INIT(&replay.inline_events);
+    QSIMPLEQ_INIT(&replay.completions);
+    qemu_cond_init(&replay.completed);
+
+    if (mode == REPLAY_MODE_RECORD) {
+        memcpy(header, REPLAY_MAGIC, 8);
+        stl_be_p(header + 8, REPLAY_VERSION);
+        stl_be_p(header + 12, shift);
+        replay_put_buf(header, sizeof(header));
+    } else {
+        if (fread(header, 1, sizeof(header), replay.file) != sizeof(header) ||
+            memcmp(header, REPLAY_MAGIC, 8) ||
+            ldl_be_p(header + 8) != REPLAY_VERSION) {
+            error_setg(errp, "'%s' is not a replay log", filename);
+            goto fail;
+        }
+        if (ldl_be_p(header + 12) != shift) {
+            error_setg(errp, "'%s' was recorded with shift=%d", filename,
+                       ldl_be_p(header + 12));
+            goto fail;
+        }
+        /* Clock reads before the first checkpoint */
+        replay_fetch();
+    }
+
+    replay_mode = mode;
+    atexit(replay_finish);
+    return;
+
+fail:
+    fclose(replay.file);
+    replay.file = NULL;
+    g_free(replay.filename);
+    replay.filename = NULL;
+}
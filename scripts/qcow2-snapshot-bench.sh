@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Measure how long creating an internal qcow2 snapshot takes depending on
+# the size of the image.
+#
+# Usage: qcow2-snapshot-bench.sh [-c CLUSTER-SIZE] QEMU-IMG SIZE...
+#
+# For each SIZE (in qemu-img syntax, e.g. 64G or 1T), an image with all of
+# its metadata preallocated is created in $TMPDIR, so that every L2 entry
+# refers to a data cluster, and the time of "qemu-img snapshot -c" on it is
+# printed.  A second snapshot is timed too: it finds every cluster shared
+# already.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+cluster_size=65536
+if [ "$1" = "-c" ]; then
+    cluster_size=$2
+    shift 2
+fi
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 [-c CLUSTER-SIZE] QEMU-IMG SIZE..." >&2
+    exit 1
+fi
+
+qemu_img=$1
+shift
+
+img=${TMPDIR:-/tmp}/qcow2-snapshot-bench.$$.qcow2
+trap 'rm -f "$img"' EXIT
+
+# Print the time "$@" takes, in nanoseconds
+run_time() {
+    start=$(date +%s%N)
+    if ! "$@" >/dev/null 2>&1; then
+        echo "$0: '$*' failed" >&2
+        exit 1
+    fi
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+printf "%-10s %14s %14s\n" "size" "1st snapshot" "2nd snapshot"
+for size in "$@"; do
+    rm -f "$img"
+    if ! "$qemu_img" create -f qcow2 \
+            -o cluster_size=$cluster_size,preallocation=metadata \
+            "$img" "$size" >/dev/null; then
+        echo "$0: cannot create a $size image" >&2
+        exit 1
+    fi
+
+    t1=$(run_time "$qemu_img" snapshot -c snap1 "$img") || exit 1
+    t2=$(run_time "$qemu_img" snapshot -c snap2 "$img") || exit 1
+
+    awk -v s="$size" -v a=$t1 -v b=$t2 'BEGIN {
+        printf "%-10s %12.3f s %12.3f s\n", s, a / 1e9, b / 1e9
+    }'
+done
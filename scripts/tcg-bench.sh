@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Compare TCG front ends and back ends on a few guest kernels.
+#
+# Usage: tcg-bench.sh [-n ITERATIONS] QEMU BENCH [QEMU BENCH...]
+#
+# QEMU is a linux-user binary (e.g. arm-linux-user/qemu-arm) and BENCH the
+# tests/tcg/bench.c kernels built for its target ("make -C tests/tcg
+# bench-arm BENCH_CC_arm=arm-linux-gnueabi-gcc").  Every kernel of BENCH is
+# run under QEMU with -jit-stats, and the wall clock time, the number of
+# translated blocks, the time spent translating, the host code bytes per
+# guest instruction and the host/guest code size ratio are printed.  The
+# translation time and bytes per instruction need a QEMU configured with
+# --enable-profiler and show "-" otherwise.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+iterations=1000
+if [ "$1" = "-n" ]; then
+    iterations=$2
+    shift 2
+fi
+
+if [ $# -lt 2 ] || [ $(($# % 2)) -ne 0 ]; then
+    echo "Usage: $0 [-n ITERATIONS] QEMU BENCH [QEMU BENCH...]" >&2
+    exit 1
+fi
+
+stats=${TMPDIR:-/tmp}/tcg-bench.$$.stats
+trap 'rm -f "$stats"' EXIT
+
+printf "%-14s %-7s %10s %8s %10s %11s %9s\n" \
+    "target" "kernel" "exec" "TBs" "translate" "bytes/insn" "expansion"
+while [ $# -gt 0 ]; do
+    qemu=$1
+    bench=$2
+    shift 2
+
+    for kernel in int memcpy fp branch; do
+        start=$(date +%s%N)
+        if ! "$qemu" -jit-stats "$bench" $kernel $iterations \
+                >/dev/null 2>"$stats"; then
+            echo "$0: '$qemu $bench $kernel' failed" >&2
+            exit 1
+        fi
+        end=$(date +%s%N)
+
+        awk -v t="${qemu##*/}" -v k=$kernel -v ns=$((end - start)) '
+            /^TB count/           { split($3, a, "/"); tbs = a[1] }
+            /^TB avg host size/   { sub(/\)/, "", $NF); ratio = $NF }
+            /^JIT cycles/         { sub(/\(/, "", $4); jit = $4 " s" }
+            /^host bytes\/insn/   { bpi = $3 }
+            END {
+                printf "%-14s %-7s %8.3f s %8s %10s %11s %9s\n", t, k,
+                       ns / 1e9, tbs, jit ? jit : "-", bpi ? bpi : "-",
+                       ratio ? ratio : "-"
+            }' "$stats"
+    done
+done
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Compare the speed of two QEMU binaries running the same guest program,
+# for example a user mode emulator built with the old and the new TCG
+# interpreter (configure --enable-tcg-interpreter).
+#
+# Usage: tci-bench.sh [-n RUNS] QEMU-A QEMU-B PROGRAM [ARGS...]
+#
+# Each binary runs PROGRAM RUNS times (default 5).  The best wall clock
+# time of each is printed, together with the speedup of B over A.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+runs=5
+if [ "$1" = "-n" ]; then
+    runs=$2
+    shift 2
+fi
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 [-n RUNS] QEMU-A QEMU-B PROGRAM [ARGS...]" >&2
+    exit 1
+fi
+
+qemu_a=$1
+qemu_b=$2
+shift 2
+
+# Print the best time of $runs runs of "$@", in nanoseconds
+best_time() {
+    best=
+    i=0
+    while [ $i -lt $runs ]; do
+        start=$(date +%s%N)
+        if ! "$@" >/dev/null 2>&1; then
+            echo "$0: '$*' failed" >&2
+            exit 1
+        fi
+        end=$(date +%s%N)
+        t=$((end - start))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        i=$((i + 1))
+    done
+    echo $best
+}
+
+time_a=$(best_time "$qemu_a" "$@") || exit 1
+time_b=$(best_time "$qemu_b" "$@") || exit 1
+
+awk -v a=$time_a -v b=$time_b -v qa="$qemu_a" -v qb="$qemu_b" 'BEGIN {
+    printf "A: %-40s %8.3f s\n", qa, a / 1e9
+    printf "B: %-40s %8.3f s\n", qb, b / 1e9
+    printf "speedup of B over A: %.2fx\n", a / b
+}'
@@ -8,12 +8,16 @@ typedef struct Slirp Slirp;
 
 int get_dns_addr(struct in_addr *pdns_addr);
 
+/* Bounds for the TCP socket buffer sizes; 0 picks the default */
+#define SLIRP_TCP_BUF_MIN 4096
+#define SLIRP_TCP_BUF_MAX (16 * 1024 * 1024)
+
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   struct in_addr vnetmask, struct in_addr vhost,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, const char **vdnssearch,
-                  void *opaque);
+                  int tcp_sndbuf, int tcp_rcvbuf, void *opaque);
 void slirp_cleanup(Slirp *slirp);
 
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
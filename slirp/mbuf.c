@@ -30,6 +30,8 @@ m_init(Slirp *slirp)
 {
     slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+    /* Keep enough mbufs around to reassemble a whole receive window */
+    slirp->mbuf_thresh = MBUF_THRESH + slirp->tcp_rcvspace / IF_MTU;
 }
 
 void m_cleanup(Slirp *slirp)
@@ -73,7 +75,7 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
+		if (slirp->mbuf_alloced > slirp->mbuf_thresh)
 			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
@@ -202,13 +202,15 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, const char **vdnssearch,
-                  void *opaque)
+                  int tcp_sndbuf, int tcp_rcvbuf, void *opaque)
 {
     Slirp *slirp = g_malloc0(sizeof(Slirp));
 
     slirp_init_once();
 
     slirp->restricted = restricted;
+    slirp->tcp_sndspace = tcp_sndbuf ? tcp_sndbuf : TCP_SNDSPACE;
+    slirp->tcp_rcvspace = tcp_rcvbuf ? tcp_rcvbuf : TCP_RCVSPACE;
 
     if_init(slirp);
     ip_init(slirp);
@@ -220,9 +220,14 @@ struct Slirp {
     int restricted;
     struct ex_list *exec_list;
 
+    /* TCP socket buffer sizes */
+    int tcp_sndspace;
+    int tcp_rcvspace;
+
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    int mbuf_thresh;        /* mbufs kept on m_freelist when freed */
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
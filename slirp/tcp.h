@@ -38,8 +38,9 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/* Default socket buffer sizes; window scaling lets the guest use them all */
+#define TCP_SNDSPACE (128 * 1024)
+#define TCP_RCVSPACE (128 * 1024)
 
 /*
  * TCP header.
@@ -100,6 +100,7 @@
 static void tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt,
                           struct tcpiphdr *ti);
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt);
+static void tcp_set_scale(struct tcpcb *tp);
 
 static int
 tcp_reass(register struct tcpcb *tp, register struct tcpiphdr *ti,
@@ -371,8 +372,8 @@ findso:
 	    goto dropwithreset;
 	  }
 
-	  sbreserve(&so->so_snd, TCP_SNDSPACE);
-	  sbreserve(&so->so_rcv, TCP_RCVSPACE);
+	  sbreserve(&so->so_snd, slirp->tcp_sndspace);
+	  sbreserve(&so->so_rcv, slirp->tcp_rcvspace);
 
 	  so->so_laddr = ti->ti_src;
 	  so->so_lport = ti->ti_sport;
@@ -402,7 +403,10 @@ findso:
 	if (tp->t_state == TCPS_CLOSED)
 		goto drop;
 
+	/* The window in a SYN is never scaled */
 	tiwin = ti->ti_win;
+	if (!(tiflags & TH_SYN))
+		tiwin <<= tp->snd_scale;
 
 	/*
 	 * Segment received on connection.
@@ -688,6 +692,7 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+			tcp_set_scale(tp);
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -868,6 +873,8 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		tcp_set_scale(tp);
+		tiwin = ti->ti_win << tp->snd_scale;
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1323,11 +1330,33 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
 
 
+/*
+ * Scale the windows from now on if both sides asked for it in their SYN.
+ */
+static void
+tcp_set_scale(struct tcpcb *tp)
+{
+	if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+	    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+		tp->snd_scale = tp->requested_s_scale;
+		tp->rcv_scale = tp->request_r_scale;
+	}
+}
+
 /*
  * Pull out of band byte out of a segment so
  * it doesn't appear in the user's data queue.
@@ -1462,6 +1491,8 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
+	int sndspace = so->slirp->tcp_sndspace;
+	int rcvspace = so->slirp->tcp_rcvspace;
 	int mss;
 
 	DEBUG_CALL("tcp_mss");
@@ -1477,12 +1508,16 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) : 0));
+	sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) : 0));
+
+	/* Ask for the window scale that lets us advertise all of so_rcv */
+	tp->request_r_scale = 0;
+	while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+	       (TCP_MAXWIN << tp->request_r_scale) < so->so_rcv.sb_datalen)
+		tp->request_r_scale++;
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
@@ -271,6 +271,16 @@ send:
 			mss = htons((uint16_t) tcp_mss(tp, 0));
 			memcpy((caddr_t)(opt + 2), (caddr_t)&mss, sizeof(mss));
 			optlen = 4;
+
+			/* Only answer a SYN with scaling if it asked for it */
+			if ((tp->t_flags & TF_REQ_SCALE) &&
+			    ((flags & TH_ACK) == 0 ||
+			     (tp->t_flags & TF_RCVD_SCALE))) {
+				opt[optlen++] = TCPOPT_NOP;
+				opt[optlen++] = TCPOPT_WINDOW;
+				opt[optlen++] = TCPOLEN_WINDOW;
+				opt[optlen++] = tp->request_r_scale;
+			}
 		}
  	}
 
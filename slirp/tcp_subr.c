@@ -40,10 +40,6 @@
 
 #include <slirp.h>
 
-/* patchable/settable parameters for tcp */
-/* Don't do rfc1323 performance enhancements */
-#define TCP_DO_RFC1323 0
-
 /*
  * Tcp initialization
  */
@@ -191,7 +187,8 @@ tcp_newtcpcb(struct socket *so)
 	tp->seg_next = tp->seg_prev = (struct tcpiphdr*)tp;
 	tp->t_maxseg = TCP_MSS;
 
-	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
+	/* Timestamps are not implemented, only window scaling */
+	tp->t_flags = TF_REQ_SCALE;
 	tp->t_socket = so;
 
 	/*
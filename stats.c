@@ -0,0 +1,199 @@
+/*
+ * Subsystem counters for query-stats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Subsystems register providers, which report the current value of their
+ * counters when query-stats runs.  Nothing is sampled in between, so a
+ * counter costs nothing but its own increment.
+ *
+ * The values reported to each monitor are kept, so that the next
+ * query-stats on the same monitor can return the increase of every
+ * counter.  A counter that is not reported by a query of its provider is
+ * forgotten, e.g. after hot-unplugging its device.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+#include "qmp-commands.h"
+#include "monitor/monitor.h"
+#include "sysemu/stats.h"
+
+typedef struct StatsProviderEntry {
+    StatsProvider provider;
+    StatsProviderFunc *func;
+    void *opaque;
+    QTAILQ_ENTRY(StatsProviderEntry) next;
+} StatsProviderEntry;
+
+static QTAILQ_HEAD(, StatsProviderEntry) stats_providers =
+    QTAILQ_HEAD_INITIALIZER(stats_providers);
+
+/* What a monitor was last told */
+typedef struct StatsClient {
+    GHashTable *counters;   /* "provider/id/name" -> StatsBaseline */
+    int64_t last_ns;
+    uint64_t generation;
+} StatsClient;
+
+typedef struct StatsBaseline {
+    uint64_t value;
+    uint64_t generation;    /* of the last query that reported it */
+    StatsProvider provider;
+} StatsBaseline;
+
+/* Monitor * -> StatsClient */
+static GHashTable *stats_clients;
+
+struct StatsSink {
+    StatsClient *client;
+    StatsProvider provider;
+    StatsInstance *instance;
+    StatsInstanceList **instance_tail;
+    StatsCounterList **counter_tail;
+    bool queried[STATS_PROVIDER_MAX];
+};
+
+void stats_register_provider(StatsProvider provider, StatsProviderFunc *func,
+                             void *opaque)
+{
+    StatsProviderEntry *entry = g_new0(StatsProviderEntry, 1);
+
+    entry->provider = provider;
+    entry->func = func;
+    entry->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&stats_providers, entry, next);
+}
+
+void stats_unregister_provider(StatsProviderFunc *func, void *opaque)
+{
+    StatsProviderEntry *entry;
+
+    QTAILQ_FOREACH(entry, &stats_providers, next) {
+        if (entry->func == func && entry->opaque == opaque) {
+            QTAILQ_REMOVE(&stats_providers, entry, next);
+            g_free(entry);
+            return;
+        }
+    }
+}
+
+void stats_add_instance(StatsSink *sink, const char *fmt, ...)
+{
+    StatsInstanceList *entry = g_new0(StatsInstanceList, 1);
+    va_list ap;
+
+    va_start(ap, fmt);
+    sink->instance = g_new0(StatsInstance, 1);
+    sink->instance->provider = sink->provider;
+    sink->instance->id = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    entry->value = sink->instance;
+    *sink->instance_tail = entry;
+    sink->instance_tail = &entry->next;
+    sink->counter_tail = &sink->instance->counters;
+}
+
+void stats_add_counter(StatsSink *sink, const char *name, uint64_t value)
+{
+    StatsClient *client = sink->client;
+    StatsCounterList *entry;
+    StatsBaseline *baseline;
+    char *key;
+
+    assert(sink->instance);
+    key = g_strdup_printf("%s/%s/%s", StatsProvider_lookup[sink->provider],
+                          sink->instance->id, name);
+    baseline = g_hash_table_lookup(client->counters, key);
+    if (baseline) {
+        g_free(key);
+    } else {
+        baseline = g_new0(StatsBaseline, 1);
+        baseline->provider = sink->provider;
+        g_hash_table_insert(client->counters, key, baseline);
+    }
+
+    entry = g_new0(StatsCounterList, 1);
+    entry->value = g_new0(StatsCounter, 1);
+    entry->value->name = g_strdup(name);
+    entry->value->value = value;
+    entry->value->delta = value - baseline->value;
+    *sink->counter_tail = entry;
+    sink->counter_tail = &entry->next;
+
+    baseline->value = value;
+    baseline->generation = client->generation;
+}
+
+/* Drop the counters that the providers just queried did not report */
+static gboolean stats_baseline_stale(gpointer key, gpointer value,
+                                     gpointer opaque)
+{
+    StatsSink *sink = opaque;
+    StatsBaseline *baseline = value;
+
+    return sink->queried[baseline->provider] &&
+           baseline->generation != sink->client->generation;
+}
+
+static StatsClient *stats_get_client(void)
+{
+    StatsClient *client;
+
+    if (!stats_clients) {
+        stats_clients = g_hash_table_new(NULL, NULL);
+    }
+    client = g_hash_table_lookup(stats_clients, cur_mon);
+    if (!client) {
+        client = g_new0(StatsClient, 1);
+        client->counters = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+        g_hash_table_insert(stats_clients, cur_mon, client);
+    }
+    return client;
+}
+
+StatsInfo *qmp_query_stats(bool has_providers, StatsProviderList *providers,
+                           Error **errp)
+{
+    StatsInfo *info = g_new0(StatsInfo, 1);
+    StatsProviderEntry *entry;
+    StatsProviderList *p;
+    StatsSink sink = {
+        .instance_tail = &info->instances,
+    };
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (has_providers) {
+        for (p = providers; p; p = p->next) {
+            sink.queried[p->value] = true;
+        }
+    } else {
+        memset(sink.queried, true, sizeof(sink.queried));
+    }
+
+    sink.client = stats_get_client();
+    sink.client->generation++;
+    info->interval = sink.client->last_ns ? now - sink.client->last_ns : 0;
+    sink.client->last_ns = now;
+
+    QTAILQ_FOREACH(entry, &stats_providers, next) {
+        if (sink.queried[entry->provider]) {
+            sink.provider = entry->provider;
+            sink.instance = NULL;
+            entry->func(&sink, entry->opaque);
+        }
+    }
+
+    g_hash_table_foreach_remove(sink.client->counters, stats_baseline_stale,
+                                &sink);
+    return info;
+}
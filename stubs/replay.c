@@ -0,0 +1,28 @@
+#include "sysemu/replay.h"
+
+ReplayMode replay_mode;
+
+int64_t replay_read_clock(QEMUClockType type, int64_t now)
+{
+    return now;
+}
+
+uint64_t replay_block_id(void)
+{
+    return 0;
+}
+
+void replay_block_event(uint64_t id, void (*cb)(void *opaque), void *opaque)
+{
+    cb(opaque);
+}
+
+bool replay_block_cancel(uint64_t id)
+{
+    return false;
+}
+
+bool replay_char_write(CharDriverState *chr, const uint8_t *buf, int len)
+{
+    return false;
+}
@@ -1503,6 +1503,13 @@ bool write_cpustate_to_list(ARMCPU *cpu);
 #  define TARGET_VIRT_ADDR_SPACE_BITS 32
 #endif
 
+/* Exclusive stores and SWP are host atomic operations.  AArch64 store
+   exclusive of a pair of 64-bit registers is not yet, so only the 32-bit
+   target is safe for multi-threaded TCG.  */
+#ifndef TARGET_AARCH64
+#define TARGET_SUPPORTS_MTTCG
+#endif
+
 static inline bool arm_excp_unmasked(CPUState *cs, unsigned int excp_idx,
                                      unsigned int target_el)
 {
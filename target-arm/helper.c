@@ -362,13 +362,34 @@ static void contextidr_write(CPUARMState *env, const ARMCPRegInfo *ri,
     raw_write(env, ri, value);
 }
 
+/* The TLB maintenance operations for EL0/EL1 only affect the EL1&0
+ * translation regime of the current security state, so leave the TLBs
+ * of the other regimes alone.  ASIDs are not tracked in the TLB, so
+ * operations by ASID flush the whole regime.
+ */
+static uint16_t tlbi_el10_idxmap(CPUARMState *env)
+{
+    uint16_t idxmap;
+
+    if (arm_is_secure_below_el3(env)) {
+        idxmap = (1 << ARMMMUIdx_S1SE0) | (1 << ARMMMUIdx_S1SE1);
+        if (!arm_el_is_aa64(env, 3)) {
+            /* With a 32 bit EL3, Secure PL1 uses the EL3 mmu_idx */
+            idxmap |= 1 << ARMMMUIdx_S1E3;
+        }
+    } else {
+        idxmap = (1 << ARMMMUIdx_S12NSE0) | (1 << ARMMMUIdx_S12NSE1);
+    }
+    return idxmap;
+}
+
 static void tlbiall_write(CPUARMState *env, const ARMCPRegInfo *ri,
                           uint64_t value)
 {
     /* Invalidate all (TLBIALL) */
     ARMCPU *cpu = arm_env_get_cpu(env);
 
-    tlb_flush(CPU(cpu), 1);
+    tlb_flush_by_mmuidx(CPU(cpu), tlbi_el10_idxmap(env));
 }
 
 static void tlbimva_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -377,7 +398,8 @@ static void tlbimva_write(CPUARMState *env, const ARMCPRegInfo *ri,
     /* Invalidate single TLB entry by MVA and ASID (TLBIMVA) */
     ARMCPU *cpu = arm_env_get_cpu(env);
 
-    tlb_flush_page(CPU(cpu), value & TARGET_PAGE_MASK);
+    tlb_flush_page_by_mmuidx(CPU(cpu), value & TARGET_PAGE_MASK,
+                             tlbi_el10_idxmap(env));
 }
 
 static void tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -386,7 +408,7 @@ static void tlbiasid_write(CPUARMState *env, const ARMCPRegInfo *ri,
     /* Invalidate by ASID (TLBIASID) */
     ARMCPU *cpu = arm_env_get_cpu(env);
 
-    tlb_flush(CPU(cpu), value == 0);
+    tlb_flush_by_mmuidx(CPU(cpu), tlbi_el10_idxmap(env));
 }
 
 static void tlbimvaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -395,48 +417,37 @@ static void tlbimvaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
     /* Invalidate single entry by MVA, all ASIDs (TLBIMVAA) */
     ARMCPU *cpu = arm_env_get_cpu(env);
 
-    tlb_flush_page(CPU(cpu), value & TARGET_PAGE_MASK);
+    tlb_flush_page_by_mmuidx(CPU(cpu), value & TARGET_PAGE_MASK,
+                             tlbi_el10_idxmap(env));
 }
 
-/* IS variants of TLB operations must affect all cores */
+/* IS variants of TLB operations must affect all cores.  The other cores
+ * may do the flush after the operation has completed on this one.
+ */
 static void tlbiall_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
-    CPUState *other_cs;
-
-    CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, 1);
-    }
+    tlb_flush_by_mmuidx_all_cpus(tlbi_el10_idxmap(env));
 }
 
 static void tlbiasid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
-    CPUState *other_cs;
-
-    CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, value == 0);
-    }
+    tlb_flush_by_mmuidx_all_cpus(tlbi_el10_idxmap(env));
 }
 
 static void tlbimva_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
-    CPUState *other_cs;
-
-    CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, value & TARGET_PAGE_MASK);
-    }
+    tlb_flush_page_by_mmuidx_all_cpus(value & TARGET_PAGE_MASK,
+                                      tlbi_el10_idxmap(env));
 }
 
 static void tlbimvaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                              uint64_t value)
 {
-    CPUState *other_cs;
-
-    CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, value & TARGET_PAGE_MASK);
-    }
+    tlb_flush_page_by_mmuidx_all_cpus(value & TARGET_PAGE_MASK,
+                                      tlbi_el10_idxmap(env));
 }
 
 static const ARMCPRegInfo cp_reginfo[] = {
@@ -2247,7 +2258,7 @@ static void tlbi_aa64_va_write(CPUARMState *env, const ARMCPRegInfo *ri,
     ARMCPU *cpu = arm_env_get_cpu(env);
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
-    tlb_flush_page(CPU(cpu), pageaddr);
+    tlb_flush_page_by_mmuidx(CPU(cpu), pageaddr, tlbi_el10_idxmap(env));
 }
 
 static void tlbi_aa64_vaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -2257,7 +2268,7 @@ static void tlbi_aa64_vaa_write(CPUARMState *env, const ARMCPRegInfo *ri,
     ARMCPU *cpu = arm_env_get_cpu(env);
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
-    tlb_flush_page(CPU(cpu), pageaddr);
+    tlb_flush_page_by_mmuidx(CPU(cpu), pageaddr, tlbi_el10_idxmap(env));
 }
 
 static void tlbi_aa64_asid_write(CPUARMState *env, const ARMCPRegInfo *ri,
@@ -2265,41 +2276,76 @@ static void tlbi_aa64_asid_write(CPUARMState *env, const ARMCPRegInfo *ri,
 {
     /* Invalidate by ASID (AArch64 version) */
     ARMCPU *cpu = arm_env_get_cpu(env);
-    int asid = extract64(value, 48, 16);
-    tlb_flush(CPU(cpu), asid == 0);
+
+    tlb_flush_by_mmuidx(CPU(cpu), tlbi_el10_idxmap(env));
 }
 
 static void tlbi_aa64_va_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                   uint64_t value)
 {
-    CPUState *other_cs;
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
-    CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, pageaddr);
-    }
+    tlb_flush_page_by_mmuidx_all_cpus(pageaddr, tlbi_el10_idxmap(env));
 }
 
 static void tlbi_aa64_vaa_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                   uint64_t value)
 {
-    CPUState *other_cs;
     uint64_t pageaddr = sextract64(value << 12, 0, 56);
 
-    CPU_FOREACH(other_cs) {
-        tlb_flush_page(other_cs, pageaddr);
-    }
+    tlb_flush_page_by_mmuidx_all_cpus(pageaddr, tlbi_el10_idxmap(env));
 }
 
 static void tlbi_aa64_asid_is_write(CPUARMState *env, const ARMCPRegInfo *ri,
                                   uint64_t value)
 {
-    CPUState *other_cs;
-    int asid = extract64(value, 48, 16);
+    tlb_flush_by_mmuidx_all_cpus(tlbi_el10_idxmap(env));
+}
 
-    CPU_FOREACH(other_cs) {
-        tlb_flush(other_cs, asid == 0);
-    }
+/* The EL2 operations.  ALLE1 also drops the stage 2 translations of the
+ * Non-secure EL1&0 regime.
+ */
+#define TLBI_ALLE1_IDXMAP ((1 << ARMMMUIdx_S12NSE0) | \
+                           (1 << ARMMMUIdx_S12NSE1) | \
+                           (1 << ARMMMUIdx_S2NS))
+
+static void tlbi_aa64_alle1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                  uint64_t value)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+
+    tlb_flush_by_mmuidx(CPU(cpu), TLBI_ALLE1_IDXMAP);
+}
+
+static void tlbi_aa64_alle1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                    uint64_t value)
+{
+    tlb_flush_by_mmuidx_all_cpus(TLBI_ALLE1_IDXMAP);
+}
+
+static void tlbi_aa64_alle2_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                  uint64_t value)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+
+    tlb_flush_by_mmuidx(CPU(cpu), 1 << ARMMMUIdx_S1E2);
+}
+
+static void tlbi_aa64_vae2_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                 uint64_t value)
+{
+    ARMCPU *cpu = arm_env_get_cpu(env);
+    uint64_t pageaddr = sextract64(value << 12, 0, 56);
+
+    tlb_flush_page_by_mmuidx(CPU(cpu), pageaddr, 1 << ARMMMUIdx_S1E2);
+}
+
+static void tlbi_aa64_vae2is_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    uint64_t pageaddr = sextract64(value << 12, 0, 56);
+
+    tlb_flush_page_by_mmuidx_all_cpus(pageaddr, 1 << ARMMMUIdx_S1E2);
 }
 
 static CPAccessResult aa64_zva_access(CPUARMState *env, const ARMCPRegInfo *ri)
@@ -2437,11 +2483,11 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ALLE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 7, .opc2 = 4,
       .access = PL2_W, .type = ARM_CP_NO_RAW,
-      .writefn = tlbiall_write },
+      .writefn = tlbi_aa64_alle1_write },
     { .name = "TLBI_ALLE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 3, .opc2 = 4,
       .access = PL2_W, .type = ARM_CP_NO_RAW,
-      .writefn = tlbiall_is_write },
+      .writefn = tlbi_aa64_alle1is_write },
     { .name = "TLBI_VMALLE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 0,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
@@ -2715,15 +2761,15 @@ static const ARMCPRegInfo el2_cp_reginfo[] = {
     { .name = "TLBI_ALLE2", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 7, .opc2 = 0,
       .type = ARM_CP_NO_RAW, .access = PL2_W,
-      .writefn = tlbiall_write },
+      .writefn = tlbi_aa64_alle2_write },
     { .name = "TLBI_VAE2", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 7, .opc2 = 1,
       .type = ARM_CP_NO_RAW, .access = PL2_W,
-      .writefn = tlbi_aa64_vaa_write },
+      .writefn = tlbi_aa64_vae2_write },
     { .name = "TLBI_VAE2IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 4, .crn = 8, .crm = 3, .opc2 = 1,
       .type = ARM_CP_NO_RAW, .access = PL2_W,
-      .writefn = tlbi_aa64_vaa_write },
+      .writefn = tlbi_aa64_vae2is_write },
     REGINFO_SENTINEL
 };
 
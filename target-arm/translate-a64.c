@@ -24,6 +24,7 @@
 
 #include "cpu.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -420,6 +421,15 @@ static inline void assert_fp_access_checked(DisasContext *s)
 #endif
 }
 
+/* Return the offset into CPUARMState of the whole vector register Qn,
+ * for use with the generic vector operations.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
 /* Return the offset into CPUARMState of an element of specified
  * size, 'element' places in from the least significant end of
  * the FP/vector register Qn.
@@ -934,6 +944,25 @@ static void clear_vec_high(DisasContext *s, int rd)
     tcg_temp_free_i64(tcg_zero);
 }
 
+/* Expand a three operand vector operation Vd = Vn op Vm with the generic
+ * vector operations, clearing the high half of Vd unless is_q.
+ */
+static void gen_gvec_fn3(DisasContext *s, bool is_q, int rd, int rn, int rm,
+                         GVecGen3Fn *gvec_fn, int vece)
+{
+    gvec_fn(vece, cpu_env, vec_full_reg_offset(s, rd),
+            vec_full_reg_offset(s, rn), vec_full_reg_offset(s, rm),
+            is_q ? 16 : 8, 16);
+}
+
+static void gen_gvec_cmp3(DisasContext *s, bool is_q, int rd, int rn, int rm,
+                          TCGCond cond, int vece)
+{
+    tcg_gen_gvec_cmp(cond, vece, cpu_env, vec_full_reg_offset(s, rd),
+                     vec_full_reg_offset(s, rn), vec_full_reg_offset(s, rm),
+                     is_q ? 16 : 8, 16);
+}
+
 /* Store from vector register to memory */
 static void do_vec_st(DisasContext *s, int srcidx, int element,
                       TCGv_i64 tcg_addr, int size)
@@ -1606,7 +1635,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
             return;
         }
         gen_helper_exception_return(cpu_env);
-        s->is_jmp = DISAS_JUMP;
+        s->is_jmp = DISAS_EXIT;
         return;
     case 5: /* DRPS */
         if (rn != 0x1f) {
@@ -1663,9 +1692,12 @@ static void disas_b_exc_sys(DisasContext *s, uint32_t insn)
  * mandated semantics, but it works for typical guest code sequences
  * and avoids having to monitor regular stores.
  *
- * In system emulation mode only one CPU will be running at once, so
- * this sequence is effectively atomic.  In user emulation mode we
- * throw an exception and handle the atomic operation elsewhere.
+ * The store is a host compare-and-swap of the remembered value, which
+ * is atomic with respect to other vCPU threads.  Pairs of 64-bit
+ * registers are too wide for that: in system emulation mode they are
+ * only atomic as long as a single CPU runs at once, and in user
+ * emulation mode we throw an exception and handle the atomic operation
+ * elsewhere.
  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i64 addr, int size, bool is_pair)
@@ -1697,8 +1729,8 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
 }
 
 #ifdef CONFIG_USER_ONLY
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 addr, int size, int is_pair)
+static void gen_store_exclusive_pair(DisasContext *s, int rd, int rt, int rt2,
+                                     TCGv_i64 addr, int size, int is_pair)
 {
     tcg_gen_mov_i64(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
@@ -1706,8 +1738,8 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     gen_exception_internal_insn(s, 4, EXCP_STREX);
 }
 #else
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 inaddr, int size, int is_pair)
+static void gen_store_exclusive_pair(DisasContext *s, int rd, int rt, int rt2,
+                                     TCGv_i64 inaddr, int size, int is_pair)
 {
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]
      *     && (!is_pair || env->exclusive_high == [addr + datasize])) {
@@ -1772,6 +1804,75 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
 }
 #endif
 
+static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
+                                TCGv_i64 inaddr, int size, int is_pair)
+{
+    /* if (env->exclusive_addr == addr
+     *     && cmpxchg([addr], env->exclusive_val, {Rt}) succeeds) {
+     *     {Rd} = 0;
+     * } else {
+     *     {Rd} = 1;
+     * }
+     * env->exclusive_addr = -1;
+     *
+     * A pair of 32-bit registers is done as one 64-bit compare-and-swap.
+     */
+    TCGLabel *fail_label;
+    TCGLabel *done_label;
+    TCGv_i64 addr, tmp;
+
+    if (is_pair && size == 3) {
+        gen_store_exclusive_pair(s, rd, rt, rt2, inaddr, size, is_pair);
+        return;
+    }
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    addr = tcg_temp_local_new_i64();
+
+    /* Copy input into a local temp so it is not trashed when the
+     * basic block ends at the branch insn.
+     */
+    tcg_gen_mov_i64(addr, inaddr);
+    tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+
+    tmp = tcg_temp_new_i64();
+    if (is_pair) {
+        TCGv_i64 cmp = tcg_temp_new_i64();
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        /* exclusive_val is the word at addr, exclusive_high the one
+         * at addr + 4.
+         */
+        if (MO_TE == MO_BE) {
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt2), cpu_reg(s, rt));
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_high, cpu_exclusive_val);
+        } else {
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt), cpu_reg(s, rt2));
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_val, cpu_exclusive_high);
+        }
+        tcg_gen_atomic_cmpxchg_i64(tmp, addr, cmp, val, get_mem_index(s),
+                                   MO_TEQ);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cmp);
+        tcg_temp_free_i64(cmp);
+        tcg_temp_free_i64(val);
+    } else {
+        tcg_gen_atomic_cmpxchg_i64(tmp, addr, cpu_exclusive_val,
+                                   cpu_reg(s, rt), get_mem_index(s),
+                                   MO_TE + size);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cpu_exclusive_val);
+    }
+    tcg_gen_mov_i64(cpu_reg(s, rd), tmp);
+    tcg_temp_free_i64(tmp);
+    tcg_temp_free_i64(addr);
+    tcg_gen_br(done_label);
+
+    gen_set_label(fail_label);
+    tcg_gen_movi_i64(cpu_reg(s, rd), 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+}
+
 /* C3.3.6 Load/store exclusive
  *
  *  31 30 29         24  23  22   21  20  16  15  14   10 9    5 4    0
@@ -8786,6 +8887,24 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         return;
     }
 
+    switch (size + 4 * is_u) {
+    case 0: /* AND */
+        gen_gvec_fn3(s, is_q, rd, rn, rm, tcg_gen_gvec_and, 0);
+        return;
+    case 1: /* BIC */
+        gen_gvec_fn3(s, is_q, rd, rn, rm, tcg_gen_gvec_andc, 0);
+        return;
+    case 2: /* ORR */
+        gen_gvec_fn3(s, is_q, rd, rn, rm, tcg_gen_gvec_or, 0);
+        return;
+    case 3: /* ORN */
+        gen_gvec_fn3(s, is_q, rd, rn, rm, tcg_gen_gvec_orc, 0);
+        return;
+    case 4: /* EOR */
+        gen_gvec_fn3(s, is_q, rd, rn, rm, tcg_gen_gvec_xor, 0);
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -8795,47 +8914,25 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         read_vec_element(s, tcg_op1, rn, pass, MO_64);
         read_vec_element(s, tcg_op2, rm, pass, MO_64);
 
-        if (!is_u) {
-            switch (size) {
-            case 0: /* AND */
-                tcg_gen_and_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BIC */
-                tcg_gen_andc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 2: /* ORR */
-                tcg_gen_or_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 3: /* ORN */
-                tcg_gen_orc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            }
-        } else {
-            if (size != 0) {
-                /* B* ops need res loaded to operate on */
-                read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
-            }
+        /* B* ops need res loaded to operate on */
+        read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
 
-            switch (size) {
-            case 0: /* EOR */
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BSL bitwise select */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
-                break;
-            case 2: /* BIT, bitwise insert if true */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            case 3: /* BIF, bitwise insert if false */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            }
+        switch (size) {
+        case 1: /* BSL bitwise select */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
+            break;
+        case 2: /* BIT, bitwise insert if true */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
+        case 3: /* BIF, bitwise insert if false */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
         }
     }
 
@@ -9148,6 +9245,27 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    switch (opcode) {
+    case 0x6: /* CMGT, CMHI */
+        gen_gvec_cmp3(s, is_q, rd, rn, rm,
+                      u ? TCG_COND_GTU : TCG_COND_GT, size);
+        return;
+    case 0x7: /* CMGE, CMHS */
+        gen_gvec_cmp3(s, is_q, rd, rn, rm,
+                      u ? TCG_COND_GEU : TCG_COND_GE, size);
+        return;
+    case 0x10: /* ADD, SUB */
+        gen_gvec_fn3(s, is_q, rd, rn, rm,
+                     u ? tcg_gen_gvec_sub : tcg_gen_gvec_add, size);
+        return;
+    case 0x11: /* CMTST, CMEQ */
+        if (u) {
+            gen_gvec_cmp3(s, is_q, rd, rn, rm, TCG_COND_EQ, size);
+            return;
+        }
+        break;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -11080,7 +11198,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        if (dc->is_jmp != DISAS_JUMP && dc->is_jmp != DISAS_EXIT) {
             gen_a64_set_pc_im(dc->pc);
         }
         if (cs->singlestep_enabled) {
@@ -11097,10 +11215,14 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
         case DISAS_UPDATE:
             gen_a64_set_pc_im(dc->pc);
             /* fall through */
-        case DISAS_JUMP:
+        case DISAS_EXIT:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_JUMP:
+            /* look up the next TB without leaving the generated code */
+            tcg_gen_lookup_and_goto_ptr();
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
@@ -104,6 +104,10 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* The PC has been set but, unlike DISAS_JUMP, the CPU state was changed
+ * and we must return to the main loop (A64 exception return)
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
@@ -35,6 +35,10 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* the only host pointers in generated code are those of helpers and of
+   the TB itself, so linux-user can keep it in its translation cache */
+#define TARGET_HAS_TB_CACHE
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE     EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
@@ -1199,6 +1203,7 @@ uint64_t cpu_get_tsc(CPUX86State *env);
 #define MMU_KSMAP_IDX   0
 #define MMU_USER_IDX    1
 #define MMU_KNOSMAP_IDX 2
+#define X86_KERNEL_MMU_IDXMAP ((1 << MMU_KSMAP_IDX) | (1 << MMU_KNOSMAP_IDX))
 static inline int cpu_mmu_index(CPUX86State *env)
 {
     return (env->hflags & HF_CPL_MASK) == 3 ? MMU_USER_IDX :
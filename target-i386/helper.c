@@ -404,9 +404,12 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0)
     int pe_state;
 
     qemu_log_mask(CPU_LOG_MMU, "CR0 update: CR0=0x%08x\n", new_cr0);
-    if ((new_cr0 & (CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK)) !=
-        (env->cr[0] & (CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK))) {
+    if ((new_cr0 & (CR0_PG_MASK | CR0_PE_MASK)) !=
+        (env->cr[0] & (CR0_PG_MASK | CR0_PE_MASK))) {
         tlb_flush(CPU(cpu), 1);
+    } else if ((new_cr0 ^ env->cr[0]) & CR0_WP_MASK) {
+        /* WP only applies to supervisor accesses */
+        tlb_flush_by_mmuidx(CPU(cpu), X86_KERNEL_MMU_IDXMAP);
     }
 
 #ifdef TARGET_X86_64
@@ -460,9 +463,12 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4)
     printf("CR4 update: CR4=%08x\n", (uint32_t)env->cr[4]);
 #endif
     if ((new_cr4 ^ env->cr[4]) &
-        (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK |
-         CR4_SMEP_MASK | CR4_SMAP_MASK)) {
+        (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK)) {
         tlb_flush(CPU(cpu), 1);
+    } else if ((new_cr4 ^ env->cr[4]) & CR4_SMEP_MASK) {
+        /* SMEP only applies to supervisor fetches.  SMAP needs no flush
+           at all, since it only selects which kernel mmu_idx is used.  */
+        tlb_flush_by_mmuidx(CPU(cpu), X86_KERNEL_MMU_IDXMAP);
     }
     /* SSE handling */
     if (!(env->features[FEAT_1_EDX] & CPUID_SSE)) {
@@ -27,6 +27,7 @@
 #include "cpu.h"
 #include "disas/disas.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -2565,6 +2566,20 @@ static void gen_eob(DisasContext *s)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* jump to the computed address in dest.  When direct block chaining is
+   allowed, the next TB is looked up without going back to the main loop */
+static void gen_jr(DisasContext *s, TCGv dest)
+{
+    gen_op_jmp_v(dest);
+    if (s->jmp_opt && !(s->tb->flags & HF_RF_MASK)) {
+        gen_update_cc_op(s);
+        tcg_gen_lookup_and_goto_ptr();
+        s->is_jmp = DISAS_TB_JUMP;
+    } else {
+        gen_eob(s);
+    }
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2585,6 +2600,22 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* Direct jump or call to eip.  In a trace TB, a forward jump within the
+   first page of the TB is followed instead of ending the TB there; the
+   TB then covers the skipped bytes as well, which only makes
+   self-modifying code detection more conservative.  */
+static void gen_jmp_trace(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if ((s->tb->cflags & CF_TRACE) && s->jmp_opt && pc >= s->pc &&
+        (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        s->pc = pc;
+        return;
+    }
+    gen_jmp(s, eip);
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
@@ -2973,6 +3004,59 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Offset of the 128 bits of an XMM register within its XMMReg */
+#ifdef HOST_WORDS_BIGENDIAN
+#define XMM_VEC_OFS offsetof(XMMReg, XMM_Q(1))
+#else
+#define XMM_VEC_OFS offsetof(XMMReg, XMM_Q(0))
+#endif
+
+/* Expand the MMX and SSE2 integer operations that have a generic vector
+ * equivalent inline instead of calling their helper.  Return false if
+ * opcode b is not one of them.
+ */
+static bool gen_sse_gvec(int b, int op1_offset, int op2_offset, bool is_xmm)
+{
+    uint32_t sz = is_xmm ? 16 : 8;
+    uint32_t dofs = op1_offset + (is_xmm ? XMM_VEC_OFS : 0);
+    uint32_t aofs = op2_offset + (is_xmm ? XMM_VEC_OFS : 0);
+
+    switch (b) {
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(MO_64, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(MO_64, cpu_env, dofs, aofs, dofs, sz, sz);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(MO_64, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(MO_64, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_gvec_add(b - 0xfc, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_gvec_sub(b - 0xf8, cpu_env, dofs, dofs, aofs, sz, sz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, cpu_env,
+                         dofs, dofs, aofs, sz, sz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, cpu_env,
+                         dofs, dofs, aofs, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4389,6 +4473,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, op1_offset, op2_offset, is_xmm)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4943,8 +5030,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             next_eip = s->pc - s->cs_base;
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
-            gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s, cpu_T[0]);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -4970,8 +5056,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (dflag == MO_16) {
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
-            gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s, cpu_T[0]);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -6389,15 +6474,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         ot = gen_pop_T0(s);
         gen_stack_update(s, val + (1 << ot));
         /* Note that gen_pop_T0 uses a zero-extending load.  */
-        gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s, cpu_T[0]);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
-        gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s, cpu_T[0]);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -6465,7 +6548,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             tcg_gen_movi_tl(cpu_T[0], next_eip);
             gen_push_v(s, cpu_T[0]);
-            gen_jmp(s, tval);
+            gen_jmp_trace(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6494,7 +6577,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else if (!CODE64(s)) {
             tval &= 0xffffffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_trace(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6516,7 +6599,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_trace(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -27,6 +27,14 @@ static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
 };
 #endif /* NDEBUG */
 
+/* X18 is the platform register of the AAPCS64.  Linux, except for Android
+   and its shadow call stack, leaves it to applications as a temporary.  */
+#if defined(__linux__) && !defined(__ANDROID__)
+#define TCG_USE_X18 1
+#else
+#define TCG_USE_X18 0
+#endif
+
 static const int tcg_target_reg_alloc_order[] = {
     TCG_REG_X20, TCG_REG_X21, TCG_REG_X22, TCG_REG_X23,
     TCG_REG_X24, TCG_REG_X25, TCG_REG_X26, TCG_REG_X27,
@@ -35,11 +43,14 @@ static const int tcg_target_reg_alloc_order[] = {
     TCG_REG_X8, TCG_REG_X9, TCG_REG_X10, TCG_REG_X11,
     TCG_REG_X12, TCG_REG_X13, TCG_REG_X14, TCG_REG_X15,
     TCG_REG_X16, TCG_REG_X17,
+#if TCG_USE_X18
+    TCG_REG_X18,
+#endif
 
     TCG_REG_X0, TCG_REG_X1, TCG_REG_X2, TCG_REG_X3,
     TCG_REG_X4, TCG_REG_X5, TCG_REG_X6, TCG_REG_X7,
 
-    /* X18 reserved by system */
+    /* X18 reserved by system, except on Linux */
     /* X19 reserved for AREG0 */
     /* X29 reserved as fp */
     /* X30 reserved as temporary */
@@ -350,6 +361,8 @@ typedef enum {
     /* Data-processing (3 source) instructions.  */
     I3509_MADD      = 0x1b000000,
     I3509_MSUB      = 0x1b008000,
+    I3509_SMADDL    = 0x9b200000,
+    I3509_UMADDL    = 0x9ba00000,
 
     /* Logical shifted register instructions (without a shift).  */
     I3510_AND       = 0x0a000000,
@@ -993,6 +1006,54 @@ static inline void tcg_out_adr(TCGContext *s, TCGReg rd, void *target)
     tcg_out_insn(s, 3406, ADR, rd, offset);
 }
 
+/* Instead of having the register allocator spill all call-clobbered
+   registers before every qemu_ld/st, the slow paths save those that are
+   live across the op, except X0-X3 which the fast path clobbers anyway.
+   They go to the static call args area at the bottom of the frame, which
+   the helpers do not use since they take all their arguments in
+   registers.  */
+#define LDST_SAVE_FIRST  TCG_REG_X4
+#define LDST_SAVE_LAST   TCG_REG_X18
+
+QEMU_BUILD_BUG_ON((LDST_SAVE_LAST - LDST_SAVE_FIRST + 1) * 8 >
+                  TCG_STATIC_CALL_ARGS_SIZE);
+
+static TCGRegSet tcg_out_ldst_live_regs(TCGContext *s)
+{
+    TCGRegSet live;
+    int r;
+
+    tcg_regset_clear(live);
+    for (r = LDST_SAVE_FIRST; r <= LDST_SAVE_LAST; r++) {
+        if (tcg_regset_test_reg(tcg_target_call_clobber_regs, r) &&
+            s->reg_to_temp[r] >= 0) {
+            tcg_regset_set_reg(live, r);
+        }
+    }
+    return live;
+}
+
+static void tcg_out_ldst_save(TCGContext *s, TCGRegSet regs, bool restore)
+{
+    int r;
+
+    for (r = LDST_SAVE_FIRST; r <= LDST_SAVE_LAST; r++) {
+        int ofs = (r - LDST_SAVE_FIRST) * 8;
+
+        if (!tcg_regset_test_reg(regs, r)) {
+            continue;
+        }
+        if (r < LDST_SAVE_LAST && tcg_regset_test_reg(regs, r + 1)) {
+            tcg_out_insn_3314(s, restore ? I3314_LDP : I3314_STP,
+                              r, r + 1, TCG_REG_SP, ofs, 1, 0);
+            r++;
+        } else {
+            tcg_out_ldst(s, restore ? I3312_LDRX : I3312_STRX,
+                         r, TCG_REG_SP, ofs);
+        }
+    }
+}
+
 static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
 {
     TCGMemOpIdx oi = lb->oi;
@@ -1001,6 +1062,7 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
 
     reloc_pc19(lb->label_ptr[0], s->code_ptr);
 
+    tcg_out_ldst_save(s, lb->live_regs, false);
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0);
     tcg_out_mov(s, TARGET_LONG_BITS == 64, TCG_REG_X1, lb->addrlo_reg);
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X2, oi);
@@ -1011,6 +1073,7 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
     } else {
         tcg_out_mov(s, size == MO_64, lb->datalo_reg, TCG_REG_X0);
     }
+    tcg_out_ldst_save(s, lb->live_regs, true);
 
     tcg_out_goto(s, lb->raddr);
 }
@@ -1023,12 +1086,14 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *lb)
 
     reloc_pc19(lb->label_ptr[0], s->code_ptr);
 
+    tcg_out_ldst_save(s, lb->live_regs, false);
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_REG_X0, TCG_AREG0);
     tcg_out_mov(s, TARGET_LONG_BITS == 64, TCG_REG_X1, lb->addrlo_reg);
     tcg_out_mov(s, size == MO_64, TCG_REG_X2, lb->datalo_reg);
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X3, oi);
     tcg_out_adr(s, TCG_REG_X4, lb->raddr);
     tcg_out_call(s, qemu_st_helpers[opc & (MO_BSWAP | MO_SIZE)]);
+    tcg_out_ldst_save(s, lb->live_regs, true);
     tcg_out_goto(s, lb->raddr);
 }
 
@@ -1045,6 +1110,11 @@ static void add_qemu_ldst_label(TCGContext *s, bool is_ld, TCGMemOpIdx oi,
     label->addrlo_reg = addr_reg;
     label->raddr = raddr;
     label->label_ptr[0] = label_ptr;
+    /* the loaded value is not live before the op */
+    label->live_regs = tcg_out_ldst_live_regs(s);
+    if (is_ld) {
+        tcg_regset_reset_reg(label->live_regs, data_reg);
+    }
 }
 
 /* Load and compare a TLB entry, emitting the conditional jump to the
@@ -1282,6 +1352,10 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         s->tb_next_offset[a0] = tcg_current_code_size(s);
         break;
 
+    case INDEX_op_goto_ptr:
+        tcg_out_insn(s, 3207, BR, a0);
+        break;
+
     case INDEX_op_br:
         tcg_out_goto_label(s, arg_label(a0));
         break;
@@ -1602,6 +1676,20 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_insn(s, 3508, SMULH, TCG_TYPE_I64, a0, a1, a2);
         break;
 
+    case INDEX_op_mulu2_i32:
+        /* Using UMULL alias of UMADDL Xd, Wn, Wm, XZR */
+        tcg_out_insn(s, 3509, UMADDL, TCG_TYPE_I64, TCG_REG_TMP,
+                     a2, args[3], TCG_REG_XZR);
+        goto do_mul2_i32;
+    case INDEX_op_muls2_i32:
+        /* Using SMULL alias of SMADDL Xd, Wn, Wm, XZR */
+        tcg_out_insn(s, 3509, SMADDL, TCG_TYPE_I64, TCG_REG_TMP,
+                     a2, args[3], TCG_REG_XZR);
+    do_mul2_i32:
+        tcg_out_movr(s, TCG_TYPE_I32, a0, TCG_REG_TMP);
+        tcg_out_shr(s, TCG_TYPE_I64, a1, TCG_REG_TMP, 32);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -1617,6 +1705,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
 
     { INDEX_op_ld8u_i32, { "r", "r" } },
@@ -1721,6 +1810,8 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_sub2_i32, { "r", "r", "rZ", "rZ", "rA", "rMZ" } },
     { INDEX_op_sub2_i64, { "r", "r", "rZ", "rZ", "rA", "rMZ" } },
 
+    { INDEX_op_mulu2_i32, { "r", "r", "r", "r" } },
+    { INDEX_op_muls2_i32, { "r", "r", "r", "r" } },
     { INDEX_op_muluh_i64, { "r", "r", "r" } },
     { INDEX_op_mulsh_i64, { "r", "r", "r" } },
 
@@ -1748,7 +1839,17 @@ static void tcg_target_init(TCGContext *s)
     tcg_regset_set_reg(s->reserved_regs, TCG_REG_SP);
     tcg_regset_set_reg(s->reserved_regs, TCG_REG_FP);
     tcg_regset_set_reg(s->reserved_regs, TCG_REG_TMP);
+#if !TCG_USE_X18
     tcg_regset_set_reg(s->reserved_regs, TCG_REG_X18); /* platform register */
+#endif
+
+    /* The slow paths preserve the other call-clobbered registers */
+    tcg_regset_clear(tcg_target_ldst_clobber_regs);
+#ifdef CONFIG_SOFTMMU
+    tcg_regset_set32(tcg_target_ldst_clobber_regs, 0,
+                     (1 << TCG_REG_X0) | (1 << TCG_REG_X1) |
+                     (1 << TCG_REG_X2) | (1 << TCG_REG_X3));
+#endif
 
     tcg_add_target_add_op_defs(aarch64_op_defs);
 }
@@ -1804,6 +1905,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
     tcg_out_insn(s, 3207, BR, tcg_target_call_iarg_regs[1]);
 
+    /* Return path for goto_ptr.  Set return value to 0, a-la exit_tb,
+       and fall through to the rest of the epilogue.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_X0, 0);
+
     tb_ret_addr = s->code_ptr;
 
     /* Remove TCG locals stack space.  */
@@ -27,6 +27,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE 16
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 21
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 0
+#define TCG_TARGET_LDST_SAVES_REGS 0
 
 typedef struct {
     uint64_t lo __attribute__((aligned(16)));
@@ -145,6 +147,7 @@ typedef enum {
 #define TCG_TARGET_HAS_rot_i32          1
 #define TCG_TARGET_HAS_rot_i64          1
 #define TCG_TARGET_HAS_movcond_i32      1
+#define TCG_TARGET_HAS_goto_ptr         0
 #define TCG_TARGET_HAS_movcond_i64      1
 #define TCG_TARGET_HAS_deposit_i32      1
 #define TCG_TARGET_HAS_deposit_i64      1
@@ -573,6 +573,277 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* Known contents of env slots, and stores to env that may still turn out
+   to be dead, within a basic block.  */
+#define MAX_ENV_SLOTS 32
+
+typedef struct EnvSlot {
+    intptr_t ofs;
+    int size;
+    TCGOpcode ld_opc;   /* a load with this opcode would return VAL */
+    TCGArg val;
+} EnvSlot;
+
+typedef struct EnvStore {
+    intptr_t ofs;
+    int size;
+    TCGOp *op;
+} EnvStore;
+
+static EnvSlot env_slots[MAX_ENV_SLOTS];
+static EnvStore env_stores[MAX_ENV_SLOTS];
+static int nb_env_slots, nb_env_stores;
+
+/* Return the number of bytes accessed by a host load or store, 0 for
+   other ops.  */
+static int env_access_size(TCGOpcode op)
+{
+    switch (op) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static bool env_ranges_overlap(intptr_t ofs1, int size1,
+                               intptr_t ofs2, int size2)
+{
+    return ofs1 < ofs2 + size2 && ofs2 < ofs1 + size1;
+}
+
+static void env_slot_add(intptr_t ofs, int size, TCGOpcode ld_opc,
+                         TCGArg val)
+{
+    if (nb_env_slots == MAX_ENV_SLOTS) {
+        memmove(&env_slots[0], &env_slots[1],
+                (MAX_ENV_SLOTS - 1) * sizeof(EnvSlot));
+        nb_env_slots--;
+    }
+    env_slots[nb_env_slots++] = (EnvSlot) {
+        .ofs = ofs, .size = size, .ld_opc = ld_opc, .val = val
+    };
+}
+
+static EnvSlot *env_slot_find(intptr_t ofs, TCGOpcode ld_opc)
+{
+    int i;
+
+    for (i = 0; i < nb_env_slots; i++) {
+        if (env_slots[i].ofs == ofs && env_slots[i].ld_opc == ld_opc) {
+            return &env_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Forget the slots that overlap [OFS, OFS + SIZE) if SIZE is not zero,
+   else those whose value is held by temp VAL, or by any global if VAL is
+   -1, or by any temp that dies at the end of the basic block if VAL is
+   -2.  */
+static void env_slots_invalidate(TCGContext *s, intptr_t ofs, int size,
+                                 TCGArg val)
+{
+    int i, j;
+
+    for (i = j = 0; i < nb_env_slots; i++) {
+        EnvSlot *slot = &env_slots[i];
+        bool kill;
+
+        if (size) {
+            kill = env_ranges_overlap(ofs, size, slot->ofs, slot->size);
+        } else if (val == (TCGArg)-1) {
+            kill = slot->val < s->nb_globals;
+        } else if (val == (TCGArg)-2) {
+            kill = slot->val >= s->nb_globals
+                   && !s->temps[slot->val].temp_local;
+        } else {
+            kill = slot->val == val;
+        }
+        if (!kill) {
+            env_slots[j++] = *slot;
+        }
+    }
+    nb_env_slots = j;
+}
+
+/* Record an access to [OFS, OFS + SIZE): the pending stores that overlap
+   it can't be removed anymore.  If the access is a store, KILL is true and
+   the pending stores that it completely overwrites are dead.  */
+static void env_stores_access(TCGContext *s, intptr_t ofs, int size,
+                              bool kill)
+{
+    int i, j;
+
+    for (i = j = 0; i < nb_env_stores; i++) {
+        EnvStore *st = &env_stores[i];
+
+        if (!env_ranges_overlap(ofs, size, st->ofs, st->size)) {
+            env_stores[j++] = *st;
+        } else if (kill && st->ofs >= ofs
+                   && st->ofs + st->size <= ofs + size) {
+            tcg_op_remove(s, st->op);
+        }
+    }
+    nb_env_stores = j;
+}
+
+static void env_store_add(intptr_t ofs, int size, TCGOp *op)
+{
+    if (nb_env_stores == MAX_ENV_SLOTS) {
+        memmove(&env_stores[0], &env_stores[1],
+                (MAX_ENV_SLOTS - 1) * sizeof(EnvStore));
+        nb_env_stores--;
+    }
+    env_stores[nb_env_stores++] = (EnvStore) {
+        .ofs = ofs, .size = size, .op = op
+    };
+}
+
+/* Remove redundant loads from, and dead stores to, the CPU state.
+
+   Front ends often reload a field of env that they have just loaded or
+   stored, or store it several times in a row.  Within a basic block,
+   track which temps hold the contents of which env offsets: a load of a
+   known value becomes a move, and a store of the value the slot already
+   holds is removed, as is a store that is overwritten before anything
+   can read it.
+
+   The alias model is the one the register allocator uses for globals:
+   loads and stores through pointers other than env may access any part
+   of env, helpers may read and write all of it unless they are declared
+   TCG_CALL_NO_SIDE_EFFECTS (in which case they may only read it), and
+   the slow paths of guest memory accesses may read env but don't modify
+   anything that the translated code loads.  Pending stores are kept
+   only as long as nothing may read them: before a branch, a helper call
+   or any op with side effects they are committed.  */
+static void tcg_optimize_env(TCGContext *s)
+{
+    int oi, oi_next, i;
+    TCGArg env = GET_TCGV_PTR(s->tcg_env);
+
+    if (TCGV_IS_UNUSED_PTR(s->tcg_env)) {
+        return;
+    }
+
+    nb_env_slots = 0;
+    nb_env_stores = 0;
+
+    for (oi = s->gen_first_op_idx; oi >= 0; oi = oi_next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+        TCGOpcode opc = op->opc;
+        const TCGOpDef *def = &tcg_op_defs[opc];
+        int size = env_access_size(opc);
+        int nb_oargs, nb_iargs;
+
+        oi_next = op->next;
+
+        if (size && args[1] != env) {
+            /* Through an unknown pointer, which may point into env. */
+            nb_env_stores = 0;
+            if (def->nb_oargs) {
+                env_slots_invalidate(s, 0, 0, args[0]);
+            } else {
+                nb_env_slots = 0;
+            }
+        } else if (size && def->nb_oargs) {
+            intptr_t ofs = args[2];
+            EnvSlot *slot = env_slot_find(ofs, opc);
+
+            if (slot && slot->val == args[0]) {
+                tcg_op_remove(s, op);
+                continue;
+            }
+            if (slot) {
+                op->opc = op_to_mov(opc);
+                args[1] = slot->val;
+                env_slots_invalidate(s, 0, 0, args[0]);
+            } else {
+                env_slots_invalidate(s, 0, 0, args[0]);
+                env_stores_access(s, ofs, size, false);
+                env_slot_add(ofs, size, opc, args[0]);
+            }
+        } else if (size) {
+            intptr_t ofs = args[2];
+            TCGOpcode ld_opc = INDEX_op_ld_i32;
+
+            if (opc == INDEX_op_st_i64) {
+                ld_opc = INDEX_op_ld_i64;
+            } else if (opc != INDEX_op_st_i32) {
+                ld_opc = NB_OPS;
+            }
+            if (ld_opc != NB_OPS) {
+                EnvSlot *slot = env_slot_find(ofs, ld_opc);
+                if (slot && slot->val == args[0]) {
+                    tcg_op_remove(s, op);
+                    continue;
+                }
+            }
+            env_stores_access(s, ofs, size, true);
+            env_slots_invalidate(s, ofs, size, 0);
+            env_store_add(ofs, size, op);
+            if (ld_opc != NB_OPS) {
+                env_slot_add(ofs, size, ld_opc, args[0]);
+            }
+        } else if (opc == INDEX_op_call) {
+            int flags;
+
+            nb_oargs = op->callo;
+            nb_iargs = op->calli;
+            flags = args[nb_oargs + nb_iargs + 1];
+
+            nb_env_stores = 0;
+            if (!(flags & TCG_CALL_NO_SIDE_EFFECTS)) {
+                nb_env_slots = 0;
+            } else if (!(flags & (TCG_CALL_NO_READ_GLOBALS |
+                                  TCG_CALL_NO_WRITE_GLOBALS))) {
+                env_slots_invalidate(s, 0, 0, -1);
+            }
+            for (i = 0; i < nb_oargs; i++) {
+                env_slots_invalidate(s, 0, 0, args[i]);
+            }
+        } else if (def->flags & TCG_OPF_BB_END) {
+            nb_env_stores = 0;
+            if (def->flags & TCG_OPF_COND_BRANCH) {
+                /* Env is unchanged on the fall through path, but the
+                   values of the ordinary temps are lost.  */
+                env_slots_invalidate(s, 0, 0, -2);
+            } else {
+                nb_env_slots = 0;
+            }
+        } else {
+            if (def->flags & TCG_OPF_SIDE_EFFECTS) {
+                nb_env_stores = 0;
+            }
+            for (i = 0; i < def->nb_oargs; i++) {
+                env_slots_invalidate(s, 0, 0, args[i]);
+            }
+        }
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -1327,4 +1598,6 @@ void tcg_optimize(TCGContext *s)
             break;
         }
     }
+
+    tcg_optimize_env(s);
 }
@@ -32,6 +32,7 @@ typedef struct TCGLabelQemuLdst {
     TCGReg datahi_reg;      /* reg index for high word to be loaded or stored */
     tcg_insn_unit *raddr;   /* gen code addr of the next IR of qemu_ld/st IR */
     tcg_insn_unit *label_ptr[2]; /* label pointers to be updated */
+    TCGRegSet live_regs;    /* regs to preserve, TCG_TARGET_LDST_SAVES_REGS */
     struct TCGLabelQemuLdst *next;
 } TCGLabelQemuLdst;
 
@@ -0,0 +1,495 @@
+/*
+ * Generic vector operation expansion
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+/* Operations on one 64 bit chunk of the operands */
+typedef void GVecChunk2Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c);
+typedef void GVecChunk3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+static void check_size_align(uint32_t oprsz, uint32_t maxsz)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= maxsz);
+    tcg_debug_assert((oprsz | maxsz) % 8 == 0);
+}
+
+/* Replicate the low @vece bits of @c in all elements of 64 bits */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        tcg_abort();
+    }
+}
+
+static void expand_clr(TCGv_ptr base, uint32_t dofs, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    TCGv_i64 zero;
+    uint32_t i;
+
+    if (oprsz == maxsz) {
+        return;
+    }
+    zero = tcg_const_i64(0);
+    for (i = oprsz; i < maxsz; i += 8) {
+        tcg_gen_st_i64(zero, base, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+static void expand_2(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                     uint32_t aofs, int64_t c, uint32_t oprsz, uint32_t maxsz,
+                     GVecChunk2Fn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        fn(vece, t1, t0, c);
+        tcg_gen_st_i64(t1, base, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    expand_clr(base, dofs, oprsz, maxsz);
+}
+
+static void expand_3(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                     uint32_t maxsz, GVecChunk3Fn *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_ld_i64(t1, base, bofs + i);
+        fn(vece, t2, t0, t1);
+        tcg_gen_st_i64(t2, base, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    expand_clr(base, dofs, oprsz, maxsz);
+}
+
+static void gen_mov_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_mov_i64(d, a);
+}
+
+void tcg_gen_gvec_mov(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    if (dofs == aofs) {
+        check_size_align(oprsz, maxsz);
+        expand_clr(base, dofs, oprsz, maxsz);
+        return;
+    }
+    expand_2(vece, base, dofs, aofs, 0, oprsz, maxsz, gen_mov_chunk);
+}
+
+static void gen_not_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_not_i64(d, a);
+}
+
+void tcg_gen_gvec_not(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2(vece, base, dofs, aofs, 0, oprsz, maxsz, gen_not_chunk);
+}
+
+/* Add the elements of @a and @b, where the high bit of each element is
+ * set in @m.  The high bits are left out of the addition so that carries
+ * do not propagate into the next element, and computed separately.
+ */
+static void gen_addv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+/* Likewise for subtraction: setting the high bits of @a keeps borrows
+ * from propagating.
+ */
+static void gen_subv_mask(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_add_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+    } else {
+        gen_addv_mask(d, a, b, dup_const(vece, 1ull << ((8 << vece) - 1)));
+    }
+}
+
+static void gen_sub_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+    } else {
+        gen_subv_mask(d, a, b, dup_const(vece, 1ull << ((8 << vece) - 1)));
+    }
+}
+
+static void gen_neg_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    TCGv_i64 zero = tcg_const_i64(0);
+
+    gen_sub_chunk(vece, d, zero, a);
+    tcg_temp_free_i64(zero);
+}
+
+void tcg_gen_gvec_neg(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2(vece, base, dofs, aofs, 0, oprsz, maxsz, gen_neg_chunk);
+}
+
+void tcg_gen_gvec_add(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_add_chunk);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_sub_chunk);
+}
+
+static void gen_and_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_and(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_and_chunk);
+}
+
+void tcg_gen_gvec_or(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                     uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_or_chunk);
+}
+
+void tcg_gen_gvec_xor(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz)
+{
+    if (aofs == bofs) {
+        /* The usual idiom to clear a register */
+        tcg_gen_gvec_dup_imm(MO_64, base, dofs, oprsz, maxsz, 0);
+        return;
+    }
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_xor_chunk);
+}
+
+void tcg_gen_gvec_andc(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_andc_chunk);
+}
+
+void tcg_gen_gvec_orc(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz)
+{
+    expand_3(vece, base, dofs, aofs, bofs, oprsz, maxsz, gen_orc_chunk);
+}
+
+/* Shifts of the whole chunk, followed by clearing the bits that crossed
+ * into the neighbouring element.
+ */
+static void gen_shli_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shli_i64(d, a, c);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, dup_const(vece, (uint64_t)-1 << c));
+    }
+}
+
+static void gen_shri_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    tcg_gen_shri_i64(d, a, c);
+    if (vece != MO_64) {
+        uint64_t emask = (1ull << (8 << vece)) - 1;
+
+        tcg_gen_andi_i64(d, d, dup_const(vece, emask >> c));
+    }
+}
+
+static void gen_sari_chunk(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    unsigned bits = 8 << vece;
+    uint64_t s_mask, c_mask;
+    TCGv_i64 s;
+
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, c);
+        return;
+    }
+
+    s_mask = dup_const(vece, (1ull << (bits - 1)) >> c);
+    c_mask = dup_const(vece, ((1ull << bits) - 1) >> c);
+    s = tcg_temp_new_i64();
+
+    tcg_gen_shri_i64(d, a, c);
+    /* Isolate the shifted sign bits and replicate them upwards; the
+     * partial products do not overlap, so there is no carry between
+     * elements.
+     */
+    tcg_gen_andi_i64(s, d, s_mask);
+    tcg_gen_muli_i64(s, s, (2ull << c) - 2);
+    tcg_gen_andi_i64(d, d, c_mask);
+    tcg_gen_or_i64(d, d, s);
+
+    tcg_temp_free_i64(s);
+}
+
+void tcg_gen_gvec_shli(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    tcg_debug_assert(c >= 0 && c < (8 << vece));
+    if (c == 0) {
+        tcg_gen_gvec_mov(vece, base, dofs, aofs, oprsz, maxsz);
+        return;
+    }
+    expand_2(vece, base, dofs, aofs, c, oprsz, maxsz, gen_shli_chunk);
+}
+
+void tcg_gen_gvec_shri(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    tcg_debug_assert(c >= 0 && c < (8 << vece));
+    if (c == 0) {
+        tcg_gen_gvec_mov(vece, base, dofs, aofs, oprsz, maxsz);
+        return;
+    }
+    expand_2(vece, base, dofs, aofs, c, oprsz, maxsz, gen_shri_chunk);
+}
+
+void tcg_gen_gvec_sari(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz)
+{
+    tcg_debug_assert(c >= 0 && c < (8 << vece));
+    if (c == 0) {
+        tcg_gen_gvec_mov(vece, base, dofs, aofs, oprsz, maxsz);
+        return;
+    }
+    expand_2(vece, base, dofs, aofs, c, oprsz, maxsz, gen_sari_chunk);
+}
+
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, TCGv_ptr base,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    bool is_signed = !(is_unsigned_cond(cond) ||
+                       cond == TCG_COND_EQ || cond == TCG_COND_NE);
+    uint32_t esz = 1 << vece;
+    TCGv_i64 t0, t1;
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz);
+    t0 = tcg_temp_new_i64();
+    t1 = tcg_temp_new_i64();
+
+    /* Elements are loaded one by one, extended to 64 bits according to the
+     * signedness of the comparison.
+     */
+    for (i = 0; i < oprsz; i += esz) {
+        switch (vece | (is_signed ? MO_SIGN : 0)) {
+        case MO_8:
+            tcg_gen_ld8u_i64(t0, base, aofs + i);
+            tcg_gen_ld8u_i64(t1, base, bofs + i);
+            break;
+        case MO_8 | MO_SIGN:
+            tcg_gen_ld8s_i64(t0, base, aofs + i);
+            tcg_gen_ld8s_i64(t1, base, bofs + i);
+            break;
+        case MO_16:
+            tcg_gen_ld16u_i64(t0, base, aofs + i);
+            tcg_gen_ld16u_i64(t1, base, bofs + i);
+            break;
+        case MO_16 | MO_SIGN:
+            tcg_gen_ld16s_i64(t0, base, aofs + i);
+            tcg_gen_ld16s_i64(t1, base, bofs + i);
+            break;
+        case MO_32:
+            tcg_gen_ld32u_i64(t0, base, aofs + i);
+            tcg_gen_ld32u_i64(t1, base, bofs + i);
+            break;
+        case MO_32 | MO_SIGN:
+            tcg_gen_ld32s_i64(t0, base, aofs + i);
+            tcg_gen_ld32s_i64(t1, base, bofs + i);
+            break;
+        default:
+            tcg_gen_ld_i64(t0, base, aofs + i);
+            tcg_gen_ld_i64(t1, base, bofs + i);
+            break;
+        }
+
+        tcg_gen_setcond_i64(cond, t0, t0, t1);
+        tcg_gen_neg_i64(t0, t0);
+
+        switch (vece) {
+        case MO_8:
+            tcg_gen_st8_i64(t0, base, dofs + i);
+            break;
+        case MO_16:
+            tcg_gen_st16_i64(t0, base, dofs + i);
+            break;
+        case MO_32:
+            tcg_gen_st32_i64(t0, base, dofs + i);
+            break;
+        default:
+            tcg_gen_st_i64(t0, base, dofs + i);
+            break;
+        }
+    }
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+    expand_clr(base, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_i64(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz);
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(t, in);
+        tcg_gen_muli_i64(t, t, 0x0101010101010101ull);
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(t, in);
+        tcg_gen_muli_i64(t, t, 0x0001000100010001ull);
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(t, in, in, 32, 32);
+        break;
+    default:
+        tcg_gen_mov_i64(t, in);
+        break;
+    }
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t, base, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+    expand_clr(base, dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_imm(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, uint64_t c)
+{
+    TCGv_i64 t;
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz);
+    t = tcg_const_i64(dup_const(vece, c));
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t, base, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+    expand_clr(base, dofs, oprsz, maxsz);
+}
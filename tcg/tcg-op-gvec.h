@@ -0,0 +1,105 @@
+/*
+ * Generic vector operation expansion
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef TCG_OP_GVEC_H
+#define TCG_OP_GVEC_H
+
+#include "tcg.h"
+
+/*
+ * "Generic" vectors.  All operands are given as byte offsets from @base,
+ * normally cpu_env, of vector registers stored in host memory.  @oprsz
+ * bytes are operated on, and the bytes from @oprsz up to @maxsz of the
+ * destination are cleared.  Both sizes must be multiples of 8.
+ *
+ * @vece is the element size as a TCGMemOp (MO_8 ... MO_64).  Elements are
+ * processed independently of each other, so the order in which a target
+ * numbers the elements of its registers does not matter.
+ *
+ * The operations are expanded inline, 64 bits at a time, operating on all
+ * the elements of a 64 bit chunk at once where possible; no helpers are
+ * called.
+ */
+
+typedef void GVecGen2Fn(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                        uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+typedef void GVecGen2iFn(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                         uint32_t aofs, int64_t c, uint32_t oprsz,
+                         uint32_t maxsz);
+typedef void GVecGen3Fn(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                        uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                        uint32_t maxsz);
+
+void tcg_gen_gvec_mov(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_not(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+void tcg_gen_gvec_neg(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t oprsz, uint32_t maxsz);
+
+void tcg_gen_gvec_add(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz);
+void tcg_gen_gvec_sub(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz);
+void tcg_gen_gvec_and(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz);
+void tcg_gen_gvec_or(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                     uint32_t maxsz);
+void tcg_gen_gvec_xor(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz);
+void tcg_gen_gvec_andc(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                       uint32_t maxsz);
+void tcg_gen_gvec_orc(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                      uint32_t maxsz);
+
+/* Shifts of each element by the same immediate, 0 <= @c < element bits */
+void tcg_gen_gvec_shli(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz);
+void tcg_gen_gvec_shri(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz);
+void tcg_gen_gvec_sari(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                       uint32_t aofs, int64_t c, uint32_t oprsz,
+                       uint32_t maxsz);
+
+/* Set each element to all ones if @cond holds, to zero otherwise */
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, TCGv_ptr base,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz);
+
+/* Replicate the low element of @in, or the constant @c, in all elements */
+void tcg_gen_gvec_dup_i64(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, TCGv_i64 in);
+void tcg_gen_gvec_dup_imm(unsigned vece, TCGv_ptr base, uint32_t dofs,
+                          uint32_t oprsz, uint32_t maxsz, uint64_t c);
+
+#endif
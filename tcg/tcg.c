@@ -122,6 +122,7 @@ const size_t tcg_op_defs_max = ARRAY_SIZE(tcg_op_defs);
 
 static TCGRegSet tcg_target_available_regs[2];
 static TCGRegSet tcg_target_call_clobber_regs;
+static TCGRegSet tcg_target_ldst_clobber_regs;
 
 #if TCG_TARGET_INSN_UNIT_SIZE == 1
 static __attribute__((unused)) inline void tcg_out8(TCGContext *s, uint8_t v)
@@ -333,6 +334,7 @@ void tcg_context_init(TCGContext *s)
 
     memset(s, 0, sizeof(*s));
     s->nb_globals = 0;
+    TCGV_UNUSED_PTR(s->tcg_env);
     
     /* Count total number of arguments and allocate the corresponding
        space */
@@ -365,6 +367,9 @@ void tcg_context_init(TCGContext *s)
     }
 
     tcg_target_init(s);
+#if !TCG_TARGET_LDST_SAVES_REGS
+    tcg_target_ldst_clobber_regs = tcg_target_call_clobber_regs;
+#endif
 }
 
 void tcg_prologue_init(TCGContext *s)
@@ -445,6 +450,9 @@ static inline int tcg_global_reg_new_internal(TCGType type, int reg,
     ts->name = name;
     s->nb_globals++;
     tcg_regset_set_reg(s->reserved_regs, reg);
+    if (reg == TCG_AREG0) {
+        s->tcg_env = MAKE_TCGV_PTR(idx);
+    }
     return idx;
 }
 
@@ -1310,6 +1318,21 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch: temps are dead and local temps
+   in memory as at the end of a basic block, but globals only need to be
+   in memory, they stay live for the code that falls through. */
+static inline void tcg_la_cbranch(TCGContext *s, uint8_t *dead_temps,
+                                  uint8_t *mem_temps)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        dead_temps[i] = 1;
+        mem_temps[i] = s->temps[i].temp_local;
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1528,7 +1551,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_cbranch(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1661,6 +1686,21 @@ static void temp_allocate_frame(TCGContext *s, int temp)
     s->current_frame_offset += sizeof(tcg_target_long);
 }
 
+/* count the stores and loads between temporaries and their memory slot */
+static inline void tcg_profile_spill(TCGContext *s)
+{
+#ifdef CONFIG_PROFILER
+    s->spill_count++;
+#endif
+}
+
+static inline void tcg_profile_reload(TCGContext *s)
+{
+#ifdef CONFIG_PROFILER
+    s->reload_count++;
+#endif
+}
+
 /* sync register 'reg' by saving it to the corresponding temporary */
 static inline void tcg_reg_sync(TCGContext *s, int reg)
 {
@@ -1675,6 +1715,7 @@ static inline void tcg_reg_sync(TCGContext *s, int reg)
             temp_allocate_frame(s, temp);
         }
         tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+        tcg_profile_spill(s);
     }
     ts->mem_coherent = 1;
 }
@@ -1810,8 +1851,8 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
 }
 
 /* at the end of a basic block, we assume all temporaries are dead and
-   all globals are stored at their canonical location. */
-static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+   local temporaries are stored at their canonical location. */
+static void tcg_reg_alloc_temps_end(TCGContext *s, TCGRegSet allocated_regs)
 {
     TCGTemp *ts;
     int i;
@@ -1830,10 +1871,39 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
 #endif
         }
     }
+}
 
+/* at the end of a basic block, we assume all temporaries are dead and
+   all globals are stored at their canonical location. */
+static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
+{
+    tcg_reg_alloc_temps_end(s, allocated_regs);
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, the branch target finds globals at their
+   canonical location, but the code that falls through keeps using the
+   registers that hold them. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    tcg_reg_alloc_temps_end(s, allocated_regs);
+    sync_globals(s, allocated_regs);
+
+#ifdef CONFIG_PROFILER
+    {
+        int i;
+
+        for (i = 0; i < s->nb_globals; i++) {
+            TCGTemp *ts = &s->temps[i];
+
+            if (ts->val_type == TEMP_VAL_REG && !ts->fixed_reg) {
+                s->cbranch_kept_count++;
+            }
+        }
+    }
+#endif
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1891,6 +1961,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                                 allocated_regs);
         if (ts->val_type == TEMP_VAL_MEM) {
             tcg_out_ld(s, itype, ts->reg, ts->mem_reg, ts->mem_offset);
+            tcg_profile_reload(s);
             ts->mem_coherent = 1;
         } else if (ts->val_type == TEMP_VAL_CONST) {
             tcg_out_movi(s, itype, ts->reg, ts->val);
@@ -1910,6 +1981,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
             temp_allocate_frame(s, args[0]);
         }
         tcg_out_st(s, otype, ts->reg, ots->mem_reg, ots->mem_offset);
+        tcg_profile_spill(s);
         if (IS_DEAD_ARG(1)) {
             temp_dead(s, args[1]);
         }
@@ -1985,6 +2057,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
         if (ts->val_type == TEMP_VAL_MEM) {
             reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
             tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+            tcg_profile_reload(s);
             ts->val_type = TEMP_VAL_REG;
             ts->reg = reg;
             ts->mem_coherent = 1;
@@ -2054,13 +2127,16 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
-            /* XXX: permit generic clobber register list ? */ 
+            /* Calls go through tcg_reg_alloc_call(), so this is a qemu_ld
+               or qemu_st op, see TCG_TARGET_LDST_SAVES_REGS.  */
             for(reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
-                if (tcg_regset_test_reg(tcg_target_call_clobber_regs, reg)) {
+                if (tcg_regset_test_reg(tcg_target_ldst_clobber_regs, reg)) {
                     tcg_reg_free(s, reg);
                 }
             }
@@ -2179,6 +2255,7 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
                                     s->reserved_regs);
                 /* XXX: not correct if reading values from the stack */
                 tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_profile_reload(s);
                 tcg_out_st(s, ts->type, reg, TCG_REG_CALL_STACK, stack_offset);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
@@ -2209,6 +2286,7 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
                 }
             } else if (ts->val_type == TEMP_VAL_MEM) {
                 tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_profile_reload(s);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 /* XXX: sign extend ? */
                 tcg_out_movi(s, ts->type, reg, ts->val);
@@ -2455,6 +2533,14 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 s->tb_count1 ? (double)(s->tb_count1 - s->tb_count) / s->tb_count1 * 100.0 : 0);
     cpu_fprintf(f, "avg ops/TB          %0.1f max=%d\n", 
                 s->tb_count ? (double)s->op_count / s->tb_count : 0, s->op_count_max);
+    cpu_fprintf(f, "avg guest insns/TB  %0.1f\n",
+                s->tb_count ? (double)s->guest_insn_count / s->tb_count : 0);
+    cpu_fprintf(f, "ops/guest insn      %0.2f\n",
+                s->guest_insn_count ?
+                (double)s->op_count / s->guest_insn_count : 0);
+    cpu_fprintf(f, "host bytes/insn     %0.1f\n",
+                s->guest_insn_count ?
+                (double)s->code_out_len / s->guest_insn_count : 0);
     cpu_fprintf(f, "deleted ops/TB      %0.2f\n",
                 s->tb_count ? 
                 (double)s->del_op_count / s->tb_count : 0);
@@ -2480,6 +2566,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
+    cpu_fprintf(f, "spills/TB           %0.2f\n",
+                s->tb_count ? (double)s->spill_count / s->tb_count : 0);
+    cpu_fprintf(f, "reloads/TB          %0.2f\n",
+                s->tb_count ? (double)s->reload_count / s->tb_count : 0);
+    cpu_fprintf(f, "globals kept/brcond %0.2f/TB\n",
+                s->tb_count ? (double)s->cbranch_kept_count / s->tb_count : 0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
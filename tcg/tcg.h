@@ -496,6 +496,14 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* goto_ptr support: returns 0 to the main loop */
+    void *code_gen_epilogue;
+
+    /* position dependent parts of the generated code, recorded for the
+       linux-user translation cache if code_relocs != NULL */
+    struct TCGCodeReloc *code_relocs;
+    int nb_code_relocs;
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
@@ -509,6 +517,9 @@ struct TCGContext {
     intptr_t frame_end;
     int frame_reg;
 
+    /* the global for TCG_AREG0, once the front end has created it */
+    TCGv_ptr tcg_env;
+
     tcg_insn_unit *code_ptr;
 
     GHashTable *helpers;
@@ -524,12 +535,16 @@ struct TCGContext {
     int64_t del_op_count;
     int64_t code_in_len;
     int64_t code_out_len;
+    int64_t guest_insn_count;
     int64_t interm_time;
     int64_t code_time;
     int64_t la_time;
     int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
+    int64_t spill_count;  /* stores of temps to their memory slot */
+    int64_t reload_count; /* loads of temps from their memory slot */
+    int64_t cbranch_kept_count; /* globals kept in regs across a brcond */
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -576,6 +591,12 @@ struct TCGContext {
 
 extern TCGContext tcg_ctx;
 
+/* The profiling counters of @tb, see TBCounters.  */
+static inline TBCounters *tb_counters(TranslationBlock *tb)
+{
+    return &tcg_ctx.tb_ctx.tb_counters[tb - tcg_ctx.tb_ctx.tbs];
+}
+
 /* The number of opcodes emitted so far.  */
 static inline int tcg_op_buf_count(void)
 {
@@ -692,6 +713,10 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: the code after it is only
+       reached by falling through, so globals that are in sync with
+       memory can stay in their registers.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -841,6 +866,49 @@ static inline size_t tcg_current_code_size(TCGContext *s)
     return tcg_ptr_byte_diff(s->code_ptr, s->code_buf);
 }
 
+typedef enum TCGCodeRelocKind {
+    /* 32-bit displacement of a call or jump to the absolute address
+       'value', relative to the end of the displacement */
+    TCG_CODE_RELOC_PCREL32,
+    /* same, for the jump back to the epilogue */
+    TCG_CODE_RELOC_EPILOGUE,
+    /* host pointer of the TB plus the small integer 'value' */
+    TCG_CODE_RELOC_TB_PTR,
+} TCGCodeRelocKind;
+
+typedef struct TCGCodeReloc {
+    uint32_t offset;
+    uint32_t kind;
+    uint64_t value;
+} TCGCodeReloc;
+
+#define TCG_MAX_CODE_RELOCS 512
+
+/**
+ * tcg_record_code_reloc
+ * @s: the tcg context
+ * @kind: a TCGCodeRelocKind
+ * @value: the value that the code at the current position encodes
+ *
+ * Note that the code that is about to be emitted depends on where the
+ * translation block is placed.  Backends that call this define
+ * TCG_TARGET_HAS_CODE_RELOCS, and must then not emit any other
+ * position dependent code while s->code_relocs is set.
+ */
+static inline void tcg_record_code_reloc(TCGContext *s, TCGCodeRelocKind kind,
+                                         uint64_t value)
+{
+    if (s->nb_code_relocs >= 0 && s->nb_code_relocs < TCG_MAX_CODE_RELOCS) {
+        TCGCodeReloc *r = &s->code_relocs[s->nb_code_relocs++];
+
+        r->offset = tcg_current_code_size(s);
+        r->kind = kind;
+        r->value = value;
+    } else {
+        s->nb_code_relocs = -1;
+    }
+}
+
 /* Combine the TCGMemOp and mmu_idx parameters into a single value.  */
 typedef uint32_t TCGMemOpIdx;
 
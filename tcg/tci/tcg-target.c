@@ -70,50 +70,51 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_st16_i32, { R, R } },
     { INDEX_op_st_i32, { R, R } },
 
-    { INDEX_op_add_i32, { R, RI, RI } },
-    { INDEX_op_sub_i32, { R, RI, RI } },
-    { INDEX_op_mul_i32, { R, RI, RI } },
+    { INDEX_op_add_i32, { R, R, RI } },
+    { INDEX_op_sub_i32, { R, R, RI } },
+    { INDEX_op_mul_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_div_i32
-    { INDEX_op_div_i32, { R, R, R } },
-    { INDEX_op_divu_i32, { R, R, R } },
-    { INDEX_op_rem_i32, { R, R, R } },
-    { INDEX_op_remu_i32, { R, R, R } },
+    { INDEX_op_div_i32, { R, R, RI } },
+    { INDEX_op_divu_i32, { R, R, RI } },
+    { INDEX_op_rem_i32, { R, R, RI } },
+    { INDEX_op_remu_i32, { R, R, RI } },
 #elif TCG_TARGET_HAS_div2_i32
     { INDEX_op_div2_i32, { R, R, "0", "1", R } },
     { INDEX_op_divu2_i32, { R, R, "0", "1", R } },
 #endif
-    /* TODO: Does R, RI, RI result in faster code than R, R, RI?
-       If both operands are constants, we can optimize. */
-    { INDEX_op_and_i32, { R, RI, RI } },
+    /* Only the last input may be a constant: the bytecode has a single
+       constant field, and the optimizer moves constants there for the
+       commutative operations.  */
+    { INDEX_op_and_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_andc_i32
-    { INDEX_op_andc_i32, { R, RI, RI } },
+    { INDEX_op_andc_i32, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_eqv_i32
-    { INDEX_op_eqv_i32, { R, RI, RI } },
+    { INDEX_op_eqv_i32, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_nand_i32
-    { INDEX_op_nand_i32, { R, RI, RI } },
+    { INDEX_op_nand_i32, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_nor_i32
-    { INDEX_op_nor_i32, { R, RI, RI } },
+    { INDEX_op_nor_i32, { R, R, RI } },
 #endif
-    { INDEX_op_or_i32, { R, RI, RI } },
+    { INDEX_op_or_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_orc_i32
-    { INDEX_op_orc_i32, { R, RI, RI } },
+    { INDEX_op_orc_i32, { R, R, RI } },
 #endif
-    { INDEX_op_xor_i32, { R, RI, RI } },
-    { INDEX_op_shl_i32, { R, RI, RI } },
-    { INDEX_op_shr_i32, { R, RI, RI } },
-    { INDEX_op_sar_i32, { R, RI, RI } },
+    { INDEX_op_xor_i32, { R, R, RI } },
+    { INDEX_op_shl_i32, { R, R, RI } },
+    { INDEX_op_shr_i32, { R, R, RI } },
+    { INDEX_op_sar_i32, { R, R, RI } },
 #if TCG_TARGET_HAS_rot_i32
-    { INDEX_op_rotl_i32, { R, RI, RI } },
-    { INDEX_op_rotr_i32, { R, RI, RI } },
+    { INDEX_op_rotl_i32, { R, R, RI } },
+    { INDEX_op_rotr_i32, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_deposit_i32
-    { INDEX_op_deposit_i32, { R, "0", R } },
+    { INDEX_op_deposit_i32, { R, R, R } },
 #endif
 
-    { INDEX_op_brcond_i32, { R, RI } },
+    { INDEX_op_brcond_i32, { R, R } },
 
     { INDEX_op_setcond_i32, { R, R, RI } },
 #if TCG_TARGET_REG_BITS == 64
@@ -124,9 +125,9 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     /* TODO: Support R, R, R, R, RI, RI? Will it be faster? */
     { INDEX_op_add2_i32, { R, R, R, R, R, R } },
     { INDEX_op_sub2_i32, { R, R, R, R, R, R } },
-    { INDEX_op_brcond2_i32, { R, R, RI, RI } },
+    { INDEX_op_brcond2_i32, { R, R, R, R } },
     { INDEX_op_mulu2_i32, { R, R, R, R } },
-    { INDEX_op_setcond2_i32, { R, R, R, RI, RI } },
+    { INDEX_op_setcond2_i32, { R, R, R, R, R } },
 #endif
 
 #if TCG_TARGET_HAS_not_i32
@@ -150,47 +151,47 @@ static const TCGTargetOpDef tcg_target_op_defs[] = {
     { INDEX_op_st32_i64, { R, R } },
     { INDEX_op_st_i64, { R, R } },
 
-    { INDEX_op_add_i64, { R, RI, RI } },
-    { INDEX_op_sub_i64, { R, RI, RI } },
-    { INDEX_op_mul_i64, { R, RI, RI } },
+    { INDEX_op_add_i64, { R, R, RI } },
+    { INDEX_op_sub_i64, { R, R, RI } },
+    { INDEX_op_mul_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_div_i64
-    { INDEX_op_div_i64, { R, R, R } },
-    { INDEX_op_divu_i64, { R, R, R } },
-    { INDEX_op_rem_i64, { R, R, R } },
-    { INDEX_op_remu_i64, { R, R, R } },
+    { INDEX_op_div_i64, { R, R, RI } },
+    { INDEX_op_divu_i64, { R, R, RI } },
+    { INDEX_op_rem_i64, { R, R, RI } },
+    { INDEX_op_remu_i64, { R, R, RI } },
 #elif TCG_TARGET_HAS_div2_i64
     { INDEX_op_div2_i64, { R, R, "0", "1", R } },
     { INDEX_op_divu2_i64, { R, R, "0", "1", R } },
 #endif
-    { INDEX_op_and_i64, { R, RI, RI } },
+    { INDEX_op_and_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_andc_i64
-    { INDEX_op_andc_i64, { R, RI, RI } },
+    { INDEX_op_andc_i64, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_eqv_i64
-    { INDEX_op_eqv_i64, { R, RI, RI } },
+    { INDEX_op_eqv_i64, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_nand_i64
-    { INDEX_op_nand_i64, { R, RI, RI } },
+    { INDEX_op_nand_i64, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_nor_i64
-    { INDEX_op_nor_i64, { R, RI, RI } },
+    { INDEX_op_nor_i64, { R, R, RI } },
 #endif
-    { INDEX_op_or_i64, { R, RI, RI } },
+    { INDEX_op_or_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_orc_i64
-    { INDEX_op_orc_i64, { R, RI, RI } },
+    { INDEX_op_orc_i64, { R, R, RI } },
 #endif
-    { INDEX_op_xor_i64, { R, RI, RI } },
-    { INDEX_op_shl_i64, { R, RI, RI } },
-    { INDEX_op_shr_i64, { R, RI, RI } },
-    { INDEX_op_sar_i64, { R, RI, RI } },
+    { INDEX_op_xor_i64, { R, R, RI } },
+    { INDEX_op_shl_i64, { R, R, RI } },
+    { INDEX_op_shr_i64, { R, R, RI } },
+    { INDEX_op_sar_i64, { R, R, RI } },
 #if TCG_TARGET_HAS_rot_i64
-    { INDEX_op_rotl_i64, { R, RI, RI } },
-    { INDEX_op_rotr_i64, { R, RI, RI } },
+    { INDEX_op_rotl_i64, { R, R, RI } },
+    { INDEX_op_rotr_i64, { R, R, RI } },
 #endif
 #if TCG_TARGET_HAS_deposit_i64
-    { INDEX_op_deposit_i64, { R, "0", R } },
+    { INDEX_op_deposit_i64, { R, R, R } },
 #endif
-    { INDEX_op_brcond_i64, { R, RI } },
+    { INDEX_op_brcond_i64, { R, R } },
 
 #if TCG_TARGET_HAS_ext8s_i64
     { INDEX_op_ext8s_i64, { R, R } },
@@ -397,197 +398,132 @@ void tci_disas(uint8_t opc)
 }
 #endif
 
-/* Write value (native size). */
-static void tcg_out_i(TCGContext *s, tcg_target_ulong v)
+/* Append a bytecode instruction.  If label is not NULL, i is set to
+   the address of the label, now or when it gets resolved.  */
+static void tci_out_insn(TCGContext *s, const TCIInsn *insn, TCGLabel *label)
 {
-    if (TCG_TARGET_REG_BITS == 32) {
-        tcg_out32(s, v);
-    } else {
-        tcg_out64(s, v);
-    }
-}
-
-/* Write opcode. */
-static void tcg_out_op_t(TCGContext *s, TCGOpcode op)
-{
-    tcg_out8(s, op);
-    tcg_out8(s, 0);
-}
-
-/* Write register. */
-static void tcg_out_r(TCGContext *s, TCGArg t0)
-{
-    assert(t0 < TCG_TARGET_NB_REGS);
-    tcg_out8(s, t0);
-}
-
-/* Write register or constant (native size). */
-static void tcg_out_ri(TCGContext *s, int const_arg, TCGArg arg)
-{
-    if (const_arg) {
-        assert(const_arg == 1);
-        tcg_out8(s, TCG_CONST);
-        tcg_out_i(s, arg);
-    } else {
-        tcg_out_r(s, arg);
-    }
-}
-
-/* Write register or constant (32 bit). */
-static void tcg_out_ri32(TCGContext *s, int const_arg, TCGArg arg)
-{
-    if (const_arg) {
-        assert(const_arg == 1);
-        tcg_out8(s, TCG_CONST);
-        tcg_out32(s, arg);
-    } else {
-        tcg_out_r(s, arg);
-    }
-}
+    tcg_insn_unit *iptr = s->code_ptr + offsetof(TCIInsn, i);
 
-#if TCG_TARGET_REG_BITS == 64
-/* Write register or constant (64 bit). */
-static void tcg_out_ri64(TCGContext *s, int const_arg, TCGArg arg)
-{
-    if (const_arg) {
-        assert(const_arg == 1);
-        tcg_out8(s, TCG_CONST);
-        tcg_out64(s, arg);
-    } else {
-        tcg_out_r(s, arg);
-    }
-}
-#endif
-
-/* Write label. */
-static void tci_out_label(TCGContext *s, TCGLabel *label)
-{
-    if (label->has_value) {
-        tcg_out_i(s, label->u.value);
-        assert(label->u.value);
-    } else {
-        tcg_out_reloc(s, s->code_ptr, sizeof(tcg_target_ulong), label, 0);
-        s->code_ptr += sizeof(tcg_target_ulong);
+    memcpy(s->code_ptr, insn, sizeof(*insn));
+    s->code_ptr += sizeof(*insn);
+    if (label) {
+        tcg_out_reloc(s, iptr, sizeof(tcg_target_ulong), label, 0);
     }
 }
 
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        intptr_t arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    TCIInsn insn = { .r = { ret, arg1 }, .i = arg2 };
+
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_ld_i32);
-        tcg_out_r(s, ret);
-        tcg_out_r(s, arg1);
-        tcg_out32(s, arg2);
+        insn.opc = INDEX_op_ld_i32;
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_ld_i64);
-        tcg_out_r(s, ret);
-        tcg_out_r(s, arg1);
-        assert(arg2 == (int32_t)arg2);
-        tcg_out32(s, arg2);
+        insn.opc = INDEX_op_ld_i64;
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_insn(s, &insn, NULL);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    TCIInsn insn = { .r = { ret, arg } };
+
     assert(ret != arg);
 #if TCG_TARGET_REG_BITS == 32
-    tcg_out_op_t(s, INDEX_op_mov_i32);
+    insn.opc = INDEX_op_mov_i32;
 #else
-    tcg_out_op_t(s, INDEX_op_mov_i64);
+    insn.opc = INDEX_op_mov_i64;
 #endif
-    tcg_out_r(s, ret);
-    tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_insn(s, &insn, NULL);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
                          TCGReg t0, tcg_target_long arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
-    uint32_t arg32 = arg;
-    if (type == TCG_TYPE_I32 || arg == arg32) {
-        tcg_out_op_t(s, INDEX_op_movi_i32);
-        tcg_out_r(s, t0);
-        tcg_out32(s, arg32);
+    TCIInsn insn = { .r = { t0 } };
+
+    if (type == TCG_TYPE_I32) {
+        insn.opc = INDEX_op_movi_i32;
+        insn.i = (uint32_t)arg;
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_movi_i64);
-        tcg_out_r(s, t0);
-        tcg_out64(s, arg);
+        insn.opc = INDEX_op_movi_i64;
+        insn.i = arg;
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_insn(s, &insn, NULL);
 }
 
 static inline void tcg_out_call(TCGContext *s, tcg_insn_unit *arg)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
-    tcg_out_op_t(s, INDEX_op_call);
-    tcg_out_ri(s, 1, (uintptr_t)arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    TCIInsn insn = { .opc = INDEX_op_call, .i = (uintptr_t)arg };
+
+    tci_out_insn(s, &insn, NULL);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
                        const int *const_args)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
-
-    tcg_out_op_t(s, opc);
+    TCIInsn insn = { .opc = opc };
+    TCGLabel *label = NULL;
+    TCGMemOp memop;
+#if TCG_TARGET_REG_BITS == 32
+    int i;
+#endif
 
     switch (opc) {
     case INDEX_op_exit_tb:
-        tcg_out64(s, args[0]);
+        insn.i = args[0];
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* Direct jump method. */
+            /* Direct jump method.  The 32 bit offset at i is relative to
+               its end and initially points to the next instruction.  */
+            uintptr_t jmp = tcg_current_code_size(s) + offsetof(TCIInsn, i);
+
             assert(args[0] < ARRAY_SIZE(s->tb_jmp_offset));
-            s->tb_jmp_offset[args[0]] = tcg_current_code_size(s);
-            tcg_out32(s, 0);
+            s->tb_jmp_offset[args[0]] = jmp;
+            tci_out_insn(s, &insn, NULL);
+            tcg_patch32(s->code_buf + jmp,
+                        tcg_current_code_size(s) - (jmp + 4));
         } else {
             /* Indirect jump method. */
             TODO();
         }
         assert(args[0] < ARRAY_SIZE(s->tb_next_offset));
         s->tb_next_offset[args[0]] = tcg_current_code_size(s);
-        break;
+        return;
     case INDEX_op_br:
-        tci_out_label(s, arg_label(args[0]));
+        label = arg_label(args[0]);
         break;
     case INDEX_op_setcond_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_ri32(s, const_args[2], args[2]);
-        tcg_out8(s, args[3]);   /* condition */
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_setcond_i64:
+#endif
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        if (const_args[2]) {
+            insn.opc |= TCI_OPC_IMM;
+            insn.i = args[2];
+        } else {
+            insn.r[2] = args[2];
+        }
+        insn.r[3] = args[3];    /* condition */
         break;
 #if TCG_TARGET_REG_BITS == 32
     case INDEX_op_setcond2_i32:
-        /* setcond2_i32 cond, t0, t1_low, t1_high, t2_low, t2_high */
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_r(s, args[2]);
-        tcg_out_ri32(s, const_args[3], args[3]);
-        tcg_out_ri32(s, const_args[4], args[4]);
-        tcg_out8(s, args[5]);   /* condition */
-        break;
-#elif TCG_TARGET_REG_BITS == 64
-    case INDEX_op_setcond_i64:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_ri64(s, const_args[2], args[2]);
-        tcg_out8(s, args[3]);   /* condition */
+        /* setcond2_i32 t0, t1_low, t1_high, t2_low, t2_high, cond */
+        for (i = 0; i < 6; i++) {
+            insn.r[i] = args[i];
+        }
         break;
 #endif
     case INDEX_op_ld8u_i32:
@@ -609,87 +545,71 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     case INDEX_op_st16_i64:
     case INDEX_op_st32_i64:
     case INDEX_op_st_i64:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        assert(args[2] == (int32_t)args[2]);
-        tcg_out32(s, args[2]);
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        insn.i = args[2];
         break;
     case INDEX_op_add_i32:
     case INDEX_op_sub_i32:
     case INDEX_op_mul_i32:
+    case INDEX_op_div_i32:      /* Optional (TCG_TARGET_HAS_div_i32). */
+    case INDEX_op_divu_i32:     /* Optional (TCG_TARGET_HAS_div_i32). */
+    case INDEX_op_rem_i32:      /* Optional (TCG_TARGET_HAS_div_i32). */
+    case INDEX_op_remu_i32:     /* Optional (TCG_TARGET_HAS_div_i32). */
     case INDEX_op_and_i32:
-    case INDEX_op_andc_i32:     /* Optional (TCG_TARGET_HAS_andc_i32). */
-    case INDEX_op_eqv_i32:      /* Optional (TCG_TARGET_HAS_eqv_i32). */
-    case INDEX_op_nand_i32:     /* Optional (TCG_TARGET_HAS_nand_i32). */
-    case INDEX_op_nor_i32:      /* Optional (TCG_TARGET_HAS_nor_i32). */
     case INDEX_op_or_i32:
-    case INDEX_op_orc_i32:      /* Optional (TCG_TARGET_HAS_orc_i32). */
     case INDEX_op_xor_i32:
     case INDEX_op_shl_i32:
     case INDEX_op_shr_i32:
     case INDEX_op_sar_i32:
     case INDEX_op_rotl_i32:     /* Optional (TCG_TARGET_HAS_rot_i32). */
     case INDEX_op_rotr_i32:     /* Optional (TCG_TARGET_HAS_rot_i32). */
-        tcg_out_r(s, args[0]);
-        tcg_out_ri32(s, const_args[1], args[1]);
-        tcg_out_ri32(s, const_args[2], args[2]);
-        break;
-    case INDEX_op_deposit_i32:  /* Optional (TCG_TARGET_HAS_deposit_i32). */
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_r(s, args[2]);
-        assert(args[3] <= UINT8_MAX);
-        tcg_out8(s, args[3]);
-        assert(args[4] <= UINT8_MAX);
-        tcg_out8(s, args[4]);
-        break;
-
 #if TCG_TARGET_REG_BITS == 64
     case INDEX_op_add_i64:
     case INDEX_op_sub_i64:
     case INDEX_op_mul_i64:
     case INDEX_op_and_i64:
-    case INDEX_op_andc_i64:     /* Optional (TCG_TARGET_HAS_andc_i64). */
-    case INDEX_op_eqv_i64:      /* Optional (TCG_TARGET_HAS_eqv_i64). */
-    case INDEX_op_nand_i64:     /* Optional (TCG_TARGET_HAS_nand_i64). */
-    case INDEX_op_nor_i64:      /* Optional (TCG_TARGET_HAS_nor_i64). */
     case INDEX_op_or_i64:
-    case INDEX_op_orc_i64:      /* Optional (TCG_TARGET_HAS_orc_i64). */
     case INDEX_op_xor_i64:
     case INDEX_op_shl_i64:
     case INDEX_op_shr_i64:
     case INDEX_op_sar_i64:
     case INDEX_op_rotl_i64:     /* Optional (TCG_TARGET_HAS_rot_i64). */
     case INDEX_op_rotr_i64:     /* Optional (TCG_TARGET_HAS_rot_i64). */
-        tcg_out_r(s, args[0]);
-        tcg_out_ri64(s, const_args[1], args[1]);
-        tcg_out_ri64(s, const_args[2], args[2]);
-        break;
-    case INDEX_op_deposit_i64:  /* Optional (TCG_TARGET_HAS_deposit_i64). */
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_r(s, args[2]);
-        assert(args[3] <= UINT8_MAX);
-        tcg_out8(s, args[3]);
-        assert(args[4] <= UINT8_MAX);
-        tcg_out8(s, args[4]);
+#endif
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        if (const_args[2]) {
+            insn.opc |= TCI_OPC_IMM;
+            insn.i = args[2];
+        } else {
+            insn.r[2] = args[2];
+        }
         break;
-    case INDEX_op_div_i64:      /* Optional (TCG_TARGET_HAS_div_i64). */
-    case INDEX_op_divu_i64:     /* Optional (TCG_TARGET_HAS_div_i64). */
-    case INDEX_op_rem_i64:      /* Optional (TCG_TARGET_HAS_div_i64). */
-    case INDEX_op_remu_i64:     /* Optional (TCG_TARGET_HAS_div_i64). */
-        TODO();
+    case INDEX_op_deposit_i32:  /* Optional (TCG_TARGET_HAS_deposit_i32). */
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        insn.r[2] = args[2];
+        insn.r[3] = args[3];
+        insn.i = deposit32(0, args[3], args[4], -1);
         break;
-    case INDEX_op_div2_i64:     /* Optional (TCG_TARGET_HAS_div2_i64). */
-    case INDEX_op_divu2_i64:    /* Optional (TCG_TARGET_HAS_div2_i64). */
-        TODO();
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_deposit_i64:  /* Optional (TCG_TARGET_HAS_deposit_i64). */
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        insn.r[2] = args[2];
+        insn.r[3] = args[3];
+        insn.i = deposit64(0, args[3], args[4], -1);
         break;
     case INDEX_op_brcond_i64:
-        tcg_out_r(s, args[0]);
-        tcg_out_ri64(s, const_args[1], args[1]);
-        tcg_out8(s, args[2]);           /* condition */
-        tci_out_label(s, arg_label(args[3]));
+#endif
+    case INDEX_op_brcond_i32:
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
+        insn.r[2] = args[2];    /* condition */
+        label = arg_label(args[3]);
         break;
+#if TCG_TARGET_REG_BITS == 64
     case INDEX_op_bswap16_i64:  /* Optional (TCG_TARGET_HAS_bswap16_i64). */
     case INDEX_op_bswap32_i64:  /* Optional (TCG_TARGET_HAS_bswap32_i64). */
     case INDEX_op_bswap64_i64:  /* Optional (TCG_TARGET_HAS_bswap64_i64). */
@@ -710,89 +630,49 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     case INDEX_op_ext16u_i32:   /* Optional (TCG_TARGET_HAS_ext16u_i32). */
     case INDEX_op_bswap16_i32:  /* Optional (TCG_TARGET_HAS_bswap16_i32). */
     case INDEX_op_bswap32_i32:  /* Optional (TCG_TARGET_HAS_bswap32_i32). */
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        break;
-    case INDEX_op_div_i32:      /* Optional (TCG_TARGET_HAS_div_i32). */
-    case INDEX_op_divu_i32:     /* Optional (TCG_TARGET_HAS_div_i32). */
-    case INDEX_op_rem_i32:      /* Optional (TCG_TARGET_HAS_div_i32). */
-    case INDEX_op_remu_i32:     /* Optional (TCG_TARGET_HAS_div_i32). */
-        tcg_out_r(s, args[0]);
-        tcg_out_ri32(s, const_args[1], args[1]);
-        tcg_out_ri32(s, const_args[2], args[2]);
-        break;
-    case INDEX_op_div2_i32:     /* Optional (TCG_TARGET_HAS_div2_i32). */
-    case INDEX_op_divu2_i32:    /* Optional (TCG_TARGET_HAS_div2_i32). */
-        TODO();
+        insn.r[0] = args[0];
+        insn.r[1] = args[1];
         break;
 #if TCG_TARGET_REG_BITS == 32
     case INDEX_op_add2_i32:
     case INDEX_op_sub2_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_r(s, args[2]);
-        tcg_out_r(s, args[3]);
-        tcg_out_r(s, args[4]);
-        tcg_out_r(s, args[5]);
+        for (i = 0; i < 6; i++) {
+            insn.r[i] = args[i];
+        }
         break;
     case INDEX_op_brcond2_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_ri32(s, const_args[2], args[2]);
-        tcg_out_ri32(s, const_args[3], args[3]);
-        tcg_out8(s, args[4]);           /* condition */
-        tci_out_label(s, arg_label(args[5]));
+        for (i = 0; i < 5; i++) {
+            insn.r[i] = args[i];    /* 4 registers, condition */
+        }
+        label = arg_label(args[5]);
         break;
     case INDEX_op_mulu2_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_r(s, args[1]);
-        tcg_out_r(s, args[2]);
-        tcg_out_r(s, args[3]);
+        for (i = 0; i < 4; i++) {
+            insn.r[i] = args[i];
+        }
         break;
 #endif
-    case INDEX_op_brcond_i32:
-        tcg_out_r(s, args[0]);
-        tcg_out_ri32(s, const_args[1], args[1]);
-        tcg_out8(s, args[2]);           /* condition */
-        tci_out_label(s, arg_label(args[3]));
-        break;
     case INDEX_op_qemu_ld_i32:
-        tcg_out_r(s, *args++);
-        tcg_out_r(s, *args++);
-        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            tcg_out_r(s, *args++);
-        }
-        tcg_out_i(s, *args++);
-        break;
     case INDEX_op_qemu_ld_i64:
-        tcg_out_r(s, *args++);
-        if (TCG_TARGET_REG_BITS == 32) {
-            tcg_out_r(s, *args++);
-        }
-        tcg_out_r(s, *args++);
-        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            tcg_out_r(s, *args++);
-        }
-        tcg_out_i(s, *args++);
-        break;
     case INDEX_op_qemu_st_i32:
-        tcg_out_r(s, *args++);
-        tcg_out_r(s, *args++);
-        if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            tcg_out_r(s, *args++);
-        }
-        tcg_out_i(s, *args++);
-        break;
     case INDEX_op_qemu_st_i64:
-        tcg_out_r(s, *args++);
-        if (TCG_TARGET_REG_BITS == 32) {
-            tcg_out_r(s, *args++);
+        /* r[0], r[1]: data, r[2], r[3]: address, r[4]: memop, i: oi */
+        insn.r[0] = *args++;
+        if (TCG_TARGET_REG_BITS == 32 &&
+            (opc == INDEX_op_qemu_ld_i64 || opc == INDEX_op_qemu_st_i64)) {
+            insn.r[1] = *args++;
         }
-        tcg_out_r(s, *args++);
+        insn.r[2] = *args++;
         if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-            tcg_out_r(s, *args++);
+            insn.r[3] = *args++;
+        }
+        insn.i = *args;
+        memop = get_memop(*args);
+        if (opc == INDEX_op_qemu_ld_i32 || opc == INDEX_op_qemu_ld_i64) {
+            insn.r[4] = memop & (MO_BSWAP | MO_SSIZE);
+        } else {
+            insn.r[4] = memop & (MO_BSWAP | MO_SIZE);
         }
-        tcg_out_i(s, *args++);
         break;
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
@@ -802,30 +682,25 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
     default:
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_insn(s, &insn, label);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
                        intptr_t arg2)
 {
-    uint8_t *old_code_ptr = s->code_ptr;
+    TCIInsn insn = { .r = { arg, arg1 }, .i = arg2 };
+
     if (type == TCG_TYPE_I32) {
-        tcg_out_op_t(s, INDEX_op_st_i32);
-        tcg_out_r(s, arg);
-        tcg_out_r(s, arg1);
-        tcg_out32(s, arg2);
+        insn.opc = INDEX_op_st_i32;
     } else {
         assert(type == TCG_TYPE_I64);
 #if TCG_TARGET_REG_BITS == 64
-        tcg_out_op_t(s, INDEX_op_st_i64);
-        tcg_out_r(s, arg);
-        tcg_out_r(s, arg1);
-        tcg_out32(s, arg2);
+        insn.opc = INDEX_op_st_i64;
 #else
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_insn(s, &insn, NULL);
 }
 
 /* Test if a constant matches the constraint. */
@@ -845,8 +720,8 @@ static void tcg_target_init(TCGContext *s)
     }
 #endif
 
-    /* The current code uses uint8_t for tcg operations. */
-    assert(ARRAY_SIZE(tcg_op_defs) <= UINT8_MAX);
+    /* TCI_OPC_IMM is a flag above the TCG opcodes. */
+    assert(ARRAY_SIZE(tcg_op_defs) <= TCI_OPC_IMM);
 
     /* Registers available for 32 bit operations. */
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0,
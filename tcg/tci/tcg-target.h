@@ -45,6 +45,8 @@
 #define TCG_TARGET_INTERPRETER 1
 #define TCG_TARGET_INSN_UNIT_SIZE 1
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 32
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
+#define TCG_TARGET_LDST_SAVES_REGS 0
 
 #if UINTPTR_MAX == UINT32_MAX
 # define TCG_TARGET_REG_BITS 32
@@ -79,6 +81,7 @@
 #define TCG_TARGET_HAS_orc_i32          0
 #define TCG_TARGET_HAS_rot_i32          1
 #define TCG_TARGET_HAS_movcond_i32      0
+#define TCG_TARGET_HAS_goto_ptr         0
 #define TCG_TARGET_HAS_muls2_i32        0
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
@@ -163,8 +166,6 @@ typedef enum {
     TCG_REG_R31,
 #endif
 #endif
-    /* Special value UINT8_MAX is used by TCI to encode constant values. */
-    TCG_CONST = UINT8_MAX
 } TCGReg;
 
 #define TCG_AREG0                       (TCG_TARGET_NB_REGS - 2)
@@ -174,6 +175,18 @@ typedef enum {
 #define TCG_TARGET_CALL_STACK_OFFSET    0
 #define TCG_TARGET_STACK_ALIGN          16
 
+/* Bytecode instruction.  All instructions have the same size and the
+   operands are stored decoded, so the interpreter neither has to parse
+   them nor compute where the next instruction starts.  */
+typedef struct TCIInsn {
+    uint16_t opc;       /* TCGOpcode, possibly with TCI_OPC_IMM */
+    uint8_t r[6];       /* register numbers and small constants */
+    uintptr_t i;        /* constant, offset, label or helper address */
+} TCIInsn;
+
+/* The last input operand is the constant in i instead of a register. */
+#define TCI_OPC_IMM     0x100
+
 void tci_disas(uint8_t opc);
 
 #define HAVE_TCG_QEMU_TB_EXEC
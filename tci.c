@@ -53,99 +53,10 @@ typedef uint64_t (*helper_function)(tcg_target_ulong, tcg_target_ulong,
 #endif
 
 /* Targets which don't use GETPC also don't need tci_tb_ptr
-   which makes them a little faster. */
+   which makes them a little faster.  Each vCPU thread runs its own
+   bytecode, so the pointer is per thread with multi-threaded TCG. */
 #if defined(GETPC)
-uintptr_t tci_tb_ptr;
-#endif
-
-static tcg_target_ulong tci_reg[TCG_TARGET_NB_REGS];
-
-static tcg_target_ulong tci_read_reg(TCGReg index)
-{
-    assert(index < ARRAY_SIZE(tci_reg));
-    return tci_reg[index];
-}
-
-#if TCG_TARGET_HAS_ext8s_i32 || TCG_TARGET_HAS_ext8s_i64
-static int8_t tci_read_reg8s(TCGReg index)
-{
-    return (int8_t)tci_read_reg(index);
-}
-#endif
-
-#if TCG_TARGET_HAS_ext16s_i32 || TCG_TARGET_HAS_ext16s_i64
-static int16_t tci_read_reg16s(TCGReg index)
-{
-    return (int16_t)tci_read_reg(index);
-}
-#endif
-
-#if TCG_TARGET_REG_BITS == 64
-static int32_t tci_read_reg32s(TCGReg index)
-{
-    return (int32_t)tci_read_reg(index);
-}
-#endif
-
-static uint8_t tci_read_reg8(TCGReg index)
-{
-    return (uint8_t)tci_read_reg(index);
-}
-
-static uint16_t tci_read_reg16(TCGReg index)
-{
-    return (uint16_t)tci_read_reg(index);
-}
-
-static uint32_t tci_read_reg32(TCGReg index)
-{
-    return (uint32_t)tci_read_reg(index);
-}
-
-#if TCG_TARGET_REG_BITS == 64
-static uint64_t tci_read_reg64(TCGReg index)
-{
-    return tci_read_reg(index);
-}
-#endif
-
-static void tci_write_reg(TCGReg index, tcg_target_ulong value)
-{
-    assert(index < ARRAY_SIZE(tci_reg));
-    assert(index != TCG_AREG0);
-    assert(index != TCG_REG_CALL_STACK);
-    tci_reg[index] = value;
-}
-
-#if TCG_TARGET_REG_BITS == 64
-static void tci_write_reg32s(TCGReg index, int32_t value)
-{
-    tci_write_reg(index, value);
-}
-#endif
-
-static void tci_write_reg8(TCGReg index, uint8_t value)
-{
-    tci_write_reg(index, value);
-}
-
-static void tci_write_reg32(TCGReg index, uint32_t value)
-{
-    tci_write_reg(index, value);
-}
-
-#if TCG_TARGET_REG_BITS == 32
-static void tci_write_reg64(uint32_t high_index, uint32_t low_index,
-                            uint64_t value)
-{
-    tci_write_reg(low_index, value);
-    tci_write_reg(high_index, value >> 32);
-}
-#elif TCG_TARGET_REG_BITS == 64
-static void tci_write_reg64(TCGReg index, uint64_t value)
-{
-    tci_write_reg(index, value);
-}
+__thread uintptr_t tci_tb_ptr;
 #endif
 
 #if TCG_TARGET_REG_BITS == 32
@@ -156,185 +67,6 @@ static uint64_t tci_uint64(uint32_t high, uint32_t low)
 }
 #endif
 
-/* Read constant (native size) from bytecode. */
-static tcg_target_ulong tci_read_i(uint8_t **tb_ptr)
-{
-    tcg_target_ulong value = *(tcg_target_ulong *)(*tb_ptr);
-    *tb_ptr += sizeof(value);
-    return value;
-}
-
-/* Read unsigned constant (32 bit) from bytecode. */
-static uint32_t tci_read_i32(uint8_t **tb_ptr)
-{
-    uint32_t value = *(uint32_t *)(*tb_ptr);
-    *tb_ptr += sizeof(value);
-    return value;
-}
-
-/* Read signed constant (32 bit) from bytecode. */
-static int32_t tci_read_s32(uint8_t **tb_ptr)
-{
-    int32_t value = *(int32_t *)(*tb_ptr);
-    *tb_ptr += sizeof(value);
-    return value;
-}
-
-#if TCG_TARGET_REG_BITS == 64
-/* Read constant (64 bit) from bytecode. */
-static uint64_t tci_read_i64(uint8_t **tb_ptr)
-{
-    uint64_t value = *(uint64_t *)(*tb_ptr);
-    *tb_ptr += sizeof(value);
-    return value;
-}
-#endif
-
-/* Read indexed register (native size) from bytecode. */
-static tcg_target_ulong tci_read_r(uint8_t **tb_ptr)
-{
-    tcg_target_ulong value = tci_read_reg(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-
-/* Read indexed register (8 bit) from bytecode. */
-static uint8_t tci_read_r8(uint8_t **tb_ptr)
-{
-    uint8_t value = tci_read_reg8(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-
-#if TCG_TARGET_HAS_ext8s_i32 || TCG_TARGET_HAS_ext8s_i64
-/* Read indexed register (8 bit signed) from bytecode. */
-static int8_t tci_read_r8s(uint8_t **tb_ptr)
-{
-    int8_t value = tci_read_reg8s(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-#endif
-
-/* Read indexed register (16 bit) from bytecode. */
-static uint16_t tci_read_r16(uint8_t **tb_ptr)
-{
-    uint16_t value = tci_read_reg16(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-
-#if TCG_TARGET_HAS_ext16s_i32 || TCG_TARGET_HAS_ext16s_i64
-/* Read indexed register (16 bit signed) from bytecode. */
-static int16_t tci_read_r16s(uint8_t **tb_ptr)
-{
-    int16_t value = tci_read_reg16s(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-#endif
-
-/* Read indexed register (32 bit) from bytecode. */
-static uint32_t tci_read_r32(uint8_t **tb_ptr)
-{
-    uint32_t value = tci_read_reg32(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-
-#if TCG_TARGET_REG_BITS == 32
-/* Read two indexed registers (2 * 32 bit) from bytecode. */
-static uint64_t tci_read_r64(uint8_t **tb_ptr)
-{
-    uint32_t low = tci_read_r32(tb_ptr);
-    return tci_uint64(tci_read_r32(tb_ptr), low);
-}
-#elif TCG_TARGET_REG_BITS == 64
-/* Read indexed register (32 bit signed) from bytecode. */
-static int32_t tci_read_r32s(uint8_t **tb_ptr)
-{
-    int32_t value = tci_read_reg32s(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-
-/* Read indexed register (64 bit) from bytecode. */
-static uint64_t tci_read_r64(uint8_t **tb_ptr)
-{
-    uint64_t value = tci_read_reg64(**tb_ptr);
-    *tb_ptr += 1;
-    return value;
-}
-#endif
-
-/* Read indexed register(s) with target address from bytecode. */
-static target_ulong tci_read_ulong(uint8_t **tb_ptr)
-{
-    target_ulong taddr = tci_read_r(tb_ptr);
-#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-    taddr += (uint64_t)tci_read_r(tb_ptr) << 32;
-#endif
-    return taddr;
-}
-
-/* Read indexed register or constant (native size) from bytecode. */
-static tcg_target_ulong tci_read_ri(uint8_t **tb_ptr)
-{
-    tcg_target_ulong value;
-    TCGReg r = **tb_ptr;
-    *tb_ptr += 1;
-    if (r == TCG_CONST) {
-        value = tci_read_i(tb_ptr);
-    } else {
-        value = tci_read_reg(r);
-    }
-    return value;
-}
-
-/* Read indexed register or constant (32 bit) from bytecode. */
-static uint32_t tci_read_ri32(uint8_t **tb_ptr)
-{
-    uint32_t value;
-    TCGReg r = **tb_ptr;
-    *tb_ptr += 1;
-    if (r == TCG_CONST) {
-        value = tci_read_i32(tb_ptr);
-    } else {
-        value = tci_read_reg32(r);
-    }
-    return value;
-}
-
-#if TCG_TARGET_REG_BITS == 32
-/* Read two indexed registers or constants (2 * 32 bit) from bytecode. */
-static uint64_t tci_read_ri64(uint8_t **tb_ptr)
-{
-    uint32_t low = tci_read_ri32(tb_ptr);
-    return tci_uint64(tci_read_ri32(tb_ptr), low);
-}
-#elif TCG_TARGET_REG_BITS == 64
-/* Read indexed register or constant (64 bit) from bytecode. */
-static uint64_t tci_read_ri64(uint8_t **tb_ptr)
-{
-    uint64_t value;
-    TCGReg r = **tb_ptr;
-    *tb_ptr += 1;
-    if (r == TCG_CONST) {
-        value = tci_read_i64(tb_ptr);
-    } else {
-        value = tci_read_reg64(r);
-    }
-    return value;
-}
-#endif
-
-static tcg_target_ulong tci_read_label(uint8_t **tb_ptr)
-{
-    tcg_target_ulong label = tci_read_i(tb_ptr);
-    assert(label != 0);
-    return label;
-}
-
 static bool tci_compare32(uint32_t u0, uint32_t u1, TCGCond condition)
 {
     bool result = false;
@@ -421,33 +153,33 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 
 #ifdef CONFIG_SOFTMMU
 # define qemu_ld_ub \
-    helper_ret_ldub_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_ret_ldub_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_leuw \
-    helper_le_lduw_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_le_lduw_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_leul \
-    helper_le_ldul_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_le_ldul_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_leq \
-    helper_le_ldq_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_le_ldq_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_beuw \
-    helper_be_lduw_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_be_lduw_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_beul \
-    helper_be_ldul_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_be_ldul_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_ld_beq \
-    helper_be_ldq_mmu(env, taddr, oi, (uintptr_t)tb_ptr)
+    helper_be_ldq_mmu(env, taddr, insn->i, (uintptr_t)insn)
 # define qemu_st_b(X) \
-    helper_ret_stb_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_ret_stb_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_lew(X) \
-    helper_le_stw_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_le_stw_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_lel(X) \
-    helper_le_stl_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_le_stl_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_leq(X) \
-    helper_le_stq_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_le_stq_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_bew(X) \
-    helper_be_stw_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_be_stw_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_bel(X) \
-    helper_be_stl_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_be_stl_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 # define qemu_st_beq(X) \
-    helper_be_stq_mmu(env, taddr, X, oi, (uintptr_t)tb_ptr)
+    helper_be_stq_mmu(env, taddr, X, insn->i, (uintptr_t)insn)
 #else
 # define qemu_ld_ub      ldub_p(g2h(taddr))
 # define qemu_ld_leuw    lduw_le_p(g2h(taddr))
@@ -465,790 +197,507 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
 # define qemu_st_beq(X)  stq_be_p(g2h(taddr), X)
 #endif
 
+/* Register operand n of the current instruction. */
+#define REG(n)          regs[insn->r[n]]
+
+/* Guest address of qemu_ld/st, in r[2] (and r[3]). */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+# define TADDR()        tci_uint64(REG(3), REG(2))
+#else
+# define TADDR()        ((target_ulong)REG(2))
+#endif
+
+/* Each handler jumps directly to the next one (threaded code), so
+   every instruction has its own indirect branch, which the host branch
+   predictor can learn separately.  */
+#define DISPATCH()      goto *dispatch[insn->opc]
+#define NEXT()          do { insn++; DISPATCH(); } while (0)
+
+#define BINARY(NAME, TYPE, EXPR)            \
+    do_##NAME: {                            \
+        TYPE a = REG(1), b = REG(2);        \
+        REG(0) = (TYPE)(EXPR);              \
+        NEXT();                             \
+    }                                       \
+    do_##NAME##_imm: {                      \
+        TYPE a = REG(1), b = insn->i;       \
+        REG(0) = (TYPE)(EXPR);              \
+        NEXT();                             \
+    }
+
+#define UNARY(NAME, TYPE, EXPR)             \
+    do_##NAME: {                            \
+        TYPE a = REG(1);                    \
+        REG(0) = (TYPE)(EXPR);              \
+        NEXT();                             \
+    }
+
+#define SETCOND(NAME, CMP)                                  \
+    do_##NAME:                                              \
+        REG(0) = CMP(REG(1), REG(2), insn->r[3]);           \
+        NEXT();                                             \
+    do_##NAME##_imm:                                        \
+        REG(0) = CMP(REG(1), insn->i, insn->r[3]);          \
+        NEXT();
+
+#define BRCOND(NAME, CMP)                                   \
+    do_##NAME:                                              \
+        if (CMP(REG(0), REG(1), insn->r[2])) {              \
+            insn = (const TCIInsn *)insn->i;                \
+            DISPATCH();                                     \
+        }                                                   \
+        NEXT();
+
+/* r[3] is the position, i the mask of the deposited field. */
+#define DEPOSIT(NAME, TYPE)                                 \
+    do_##NAME:                                              \
+        REG(0) = (TYPE)((REG(1) & ~insn->i) |               \
+                        ((REG(2) << insn->r[3]) & insn->i)); \
+        NEXT();
+
+#define LOAD(NAME, TYPE, MTYPE)                                         \
+    do_##NAME:                                                          \
+        REG(0) = (TYPE)*(MTYPE *)(REG(1) + (tcg_target_long)insn->i);   \
+        NEXT();
+
+#define STORE(NAME, MTYPE)                                              \
+    do_##NAME:                                                          \
+        *(MTYPE *)(REG(1) + (tcg_target_long)insn->i) = REG(0);         \
+        NEXT();
+
+/* Dispatch table entries. */
+#define OP(NAME)        [INDEX_op_##NAME] = &&do_##NAME
+#define OP_IMM(NAME)    OP(NAME), \
+                        [INDEX_op_##NAME | TCI_OPC_IMM] = &&do_##NAME##_imm
+
 /* Interpret pseudo code in tb. */
 uintptr_t tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr)
 {
+    static const void *const dispatch[2 * TCI_OPC_IMM] = {
+        [0 ... 2 * TCI_OPC_IMM - 1] = &&do_illegal,
+        OP(call),
+        OP(br),
+        OP(exit_tb),
+        OP(goto_tb),
+        OP(mov_i32),
+        OP(movi_i32),
+        OP_IMM(setcond_i32),
+        OP(brcond_i32),
+        OP(ld8u_i32),
+        OP(ld8s_i32),
+        OP(ld16u_i32),
+        OP(ld16s_i32),
+        OP(ld_i32),
+        OP(st8_i32),
+        OP(st16_i32),
+        OP(st_i32),
+        OP_IMM(add_i32),
+        OP_IMM(sub_i32),
+        OP_IMM(mul_i32),
+        OP_IMM(div_i32),
+        OP_IMM(divu_i32),
+        OP_IMM(rem_i32),
+        OP_IMM(remu_i32),
+        OP_IMM(and_i32),
+        OP_IMM(or_i32),
+        OP_IMM(xor_i32),
+        OP_IMM(shl_i32),
+        OP_IMM(shr_i32),
+        OP_IMM(sar_i32),
+        OP_IMM(rotl_i32),
+        OP_IMM(rotr_i32),
+        OP(deposit_i32),
+        OP(ext8s_i32),
+        OP(ext16s_i32),
+        OP(ext8u_i32),
+        OP(ext16u_i32),
+        OP(bswap16_i32),
+        OP(bswap32_i32),
+        OP(not_i32),
+        OP(neg_i32),
+#if TCG_TARGET_REG_BITS == 32
+        OP(setcond2_i32),
+        OP(brcond2_i32),
+        OP(add2_i32),
+        OP(sub2_i32),
+        OP(mulu2_i32),
+#else
+        OP(mov_i64),
+        OP(movi_i64),
+        OP_IMM(setcond_i64),
+        OP(brcond_i64),
+        OP(ld8u_i64),
+        OP(ld8s_i64),
+        OP(ld16u_i64),
+        OP(ld16s_i64),
+        OP(ld32u_i64),
+        OP(ld32s_i64),
+        OP(ld_i64),
+        OP(st8_i64),
+        OP(st16_i64),
+        OP(st32_i64),
+        OP(st_i64),
+        OP_IMM(add_i64),
+        OP_IMM(sub_i64),
+        OP_IMM(mul_i64),
+        OP_IMM(and_i64),
+        OP_IMM(or_i64),
+        OP_IMM(xor_i64),
+        OP_IMM(shl_i64),
+        OP_IMM(shr_i64),
+        OP_IMM(sar_i64),
+        OP_IMM(rotl_i64),
+        OP_IMM(rotr_i64),
+        OP(deposit_i64),
+        OP(ext8s_i64),
+        OP(ext16s_i64),
+        OP(ext32s_i64),
+        OP(ext8u_i64),
+        OP(ext16u_i64),
+        OP(ext32u_i64),
+        OP(bswap16_i64),
+        OP(bswap32_i64),
+        OP(bswap64_i64),
+        OP(not_i64),
+        OP(neg_i64),
+#endif
+        OP(qemu_ld_i32),
+        OP(qemu_ld_i64),
+        OP(qemu_st_i32),
+        OP(qemu_st_i64),
+    };
     long tcg_temps[CPU_TEMP_BUF_NLONGS];
-    uintptr_t sp_value = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
-    uintptr_t next_tb = 0;
+    tcg_target_ulong regs[TCG_TARGET_NB_REGS];
+    const TCIInsn *insn = (const TCIInsn *)tb_ptr;
 
-    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
-    tci_reg[TCG_REG_CALL_STACK] = sp_value;
     assert(tb_ptr);
+    regs[TCG_AREG0] = (tcg_target_ulong)env;
+    regs[TCG_REG_CALL_STACK] = (uintptr_t)(tcg_temps + CPU_TEMP_BUF_NLONGS);
+    DISPATCH();
 
-    for (;;) {
-        TCGOpcode opc = tb_ptr[0];
-#if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
-#if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
-#endif
-        TCGMemOpIdx oi;
+do_call: {
+        helper_function func = (helper_function)insn->i;
+        uint64_t ret;
 
 #if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
+        tci_tb_ptr = (uintptr_t)insn;
 #endif
-
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
-
-        switch (opc) {
-        case INDEX_op_call:
-            t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
-            tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
-                                          tci_read_reg(TCG_REG_R1),
-                                          tci_read_reg(TCG_REG_R2),
-                                          tci_read_reg(TCG_REG_R3),
-                                          tci_read_reg(TCG_REG_R5),
-                                          tci_read_reg(TCG_REG_R6),
-                                          tci_read_reg(TCG_REG_R7),
-                                          tci_read_reg(TCG_REG_R8),
-                                          tci_read_reg(TCG_REG_R9),
-                                          tci_read_reg(TCG_REG_R10));
-            tci_write_reg(TCG_REG_R0, tmp64);
-            tci_write_reg(TCG_REG_R1, tmp64 >> 32);
+        ret = func(regs[TCG_REG_R0], regs[TCG_REG_R1], regs[TCG_REG_R2],
+                   regs[TCG_REG_R3], regs[TCG_REG_R5], regs[TCG_REG_R6],
+                   regs[TCG_REG_R7], regs[TCG_REG_R8], regs[TCG_REG_R9],
+                   regs[TCG_REG_R10]);
+        regs[TCG_REG_R0] = ret;
+        regs[TCG_REG_R1] = ret >> 32;
 #else
-            tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
-                                          tci_read_reg(TCG_REG_R1),
-                                          tci_read_reg(TCG_REG_R2),
-                                          tci_read_reg(TCG_REG_R3),
-                                          tci_read_reg(TCG_REG_R5));
-            tci_write_reg(TCG_REG_R0, tmp64);
-#endif
-            break;
-        case INDEX_op_br:
-            label = tci_read_label(&tb_ptr);
-            assert(tb_ptr == old_code_ptr + op_size);
-            tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
-#if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
-            t0 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            v64 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
-#elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+        ret = func(regs[TCG_REG_R0], regs[TCG_REG_R1], regs[TCG_REG_R2],
+                   regs[TCG_REG_R3], regs[TCG_REG_R5]);
+        regs[TCG_REG_R0] = ret;
 #endif
-        case INDEX_op_mov_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_i32(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
+        NEXT();
+    }
+do_br:
+    insn = (const TCIInsn *)insn->i;
+    DISPATCH();
+do_exit_tb:
+    return insn->i;
+do_goto_tb: {
+        /* The offset is relative to the end of the 32 bit field at i,
+           see tb_set_jmp_target1. */
+        const uint8_t *p = (const uint8_t *)&insn->i;
+        insn = (const TCIInsn *)(p + 4 + *(const int32_t *)p);
+        DISPATCH();
+    }
 
-            /* Load/store operations (32 bit). */
+    /* 32 bit operations. */
+
+do_mov_i32:
+    REG(0) = (uint32_t)REG(1);
+    NEXT();
+do_movi_i32:
+    REG(0) = (uint32_t)insn->i;
+    NEXT();
+    SETCOND(setcond_i32, tci_compare32)
+    BRCOND(brcond_i32, tci_compare32)
+
+    LOAD(ld8u_i32, uint32_t, uint8_t)
+    LOAD(ld8s_i32, uint32_t, int8_t)
+    LOAD(ld16u_i32, uint32_t, uint16_t)
+    LOAD(ld16s_i32, uint32_t, int16_t)
+    LOAD(ld_i32, uint32_t, uint32_t)
+    STORE(st8_i32, uint8_t)
+    STORE(st16_i32, uint16_t)
+    STORE(st_i32, uint32_t)
+
+    BINARY(add_i32, uint32_t, a + b)
+    BINARY(sub_i32, uint32_t, a - b)
+    BINARY(mul_i32, uint32_t, a * b)
+    BINARY(div_i32, uint32_t, (int32_t)a / (int32_t)b)
+    BINARY(divu_i32, uint32_t, a / b)
+    BINARY(rem_i32, uint32_t, (int32_t)a % (int32_t)b)
+    BINARY(remu_i32, uint32_t, a % b)
+    BINARY(and_i32, uint32_t, a & b)
+    BINARY(or_i32, uint32_t, a | b)
+    BINARY(xor_i32, uint32_t, a ^ b)
+    BINARY(shl_i32, uint32_t, a << (b & 31))
+    BINARY(shr_i32, uint32_t, a >> (b & 31))
+    BINARY(sar_i32, uint32_t, (int32_t)a >> (b & 31))
+    BINARY(rotl_i32, uint32_t, rol32(a, b & 31))
+    BINARY(rotr_i32, uint32_t, ror32(a, b & 31))
+    DEPOSIT(deposit_i32, uint32_t)
+
+    UNARY(ext8s_i32, uint32_t, (int8_t)a)
+    UNARY(ext16s_i32, uint32_t, (int16_t)a)
+    UNARY(ext8u_i32, uint32_t, (uint8_t)a)
+    UNARY(ext16u_i32, uint32_t, (uint16_t)a)
+    UNARY(bswap16_i32, uint32_t, bswap16(a))
+    UNARY(bswap32_i32, uint32_t, bswap32(a))
+    UNARY(not_i32, uint32_t, ~a)
+    UNARY(neg_i32, uint32_t, -a)
 
-        case INDEX_op_ld8u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
-            TODO();
-            break;
-        case INDEX_op_ld16s_i32:
-            TODO();
-            break;
-        case INDEX_op_ld_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            assert(t1 != sp_value || (int32_t)t2 < 0);
-            *(uint32_t *)(t1 + t2) = t0;
-            break;
+#if TCG_TARGET_REG_BITS == 32
+do_setcond2_i32:
+    REG(0) = tci_compare64(tci_uint64(REG(2), REG(1)),
+                           tci_uint64(REG(4), REG(3)), insn->r[5]);
+    NEXT();
+do_brcond2_i32:
+    if (tci_compare64(tci_uint64(REG(1), REG(0)),
+                      tci_uint64(REG(3), REG(2)), insn->r[4])) {
+        insn = (const TCIInsn *)insn->i;
+        DISPATCH();
+    }
+    NEXT();
+do_add2_i32: {
+        uint64_t t = tci_uint64(REG(3), REG(2)) + tci_uint64(REG(5), REG(4));
+        REG(0) = t;
+        REG(1) = t >> 32;
+        NEXT();
+    }
+do_sub2_i32: {
+        uint64_t t = tci_uint64(REG(3), REG(2)) - tci_uint64(REG(5), REG(4));
+        REG(0) = t;
+        REG(1) = t >> 32;
+        NEXT();
+    }
+do_mulu2_i32: {
+        uint64_t t = (uint64_t)REG(2) * REG(3);
+        REG(0) = t;
+        REG(1) = t >> 32;
+        NEXT();
+    }
+#else
 
-            /* Arithmetic operations (32 bit). */
+    /* 64 bit operations. */
+
+do_mov_i64:
+    REG(0) = REG(1);
+    NEXT();
+do_movi_i64:
+    REG(0) = insn->i;
+    NEXT();
+    SETCOND(setcond_i64, tci_compare64)
+    BRCOND(brcond_i64, tci_compare64)
+
+    LOAD(ld8u_i64, uint64_t, uint8_t)
+    LOAD(ld8s_i64, uint64_t, int8_t)
+    LOAD(ld16u_i64, uint64_t, uint16_t)
+    LOAD(ld16s_i64, uint64_t, int16_t)
+    LOAD(ld32u_i64, uint64_t, uint32_t)
+    LOAD(ld32s_i64, uint64_t, int32_t)
+    LOAD(ld_i64, uint64_t, uint64_t)
+    STORE(st8_i64, uint8_t)
+    STORE(st16_i64, uint16_t)
+    STORE(st32_i64, uint32_t)
+    STORE(st_i64, uint64_t)
+
+    BINARY(add_i64, uint64_t, a + b)
+    BINARY(sub_i64, uint64_t, a - b)
+    BINARY(mul_i64, uint64_t, a * b)
+    BINARY(and_i64, uint64_t, a & b)
+    BINARY(or_i64, uint64_t, a | b)
+    BINARY(xor_i64, uint64_t, a ^ b)
+    BINARY(shl_i64, uint64_t, a << (b & 63))
+    BINARY(shr_i64, uint64_t, a >> (b & 63))
+    BINARY(sar_i64, uint64_t, (int64_t)a >> (b & 63))
+    BINARY(rotl_i64, uint64_t, rol64(a, b & 63))
+    BINARY(rotr_i64, uint64_t, ror64(a, b & 63))
+    DEPOSIT(deposit_i64, uint64_t)
+
+    UNARY(ext8s_i64, uint64_t, (int8_t)a)
+    UNARY(ext16s_i64, uint64_t, (int16_t)a)
+    UNARY(ext32s_i64, uint64_t, (int32_t)a)
+    UNARY(ext8u_i64, uint64_t, (uint8_t)a)
+    UNARY(ext16u_i64, uint64_t, (uint16_t)a)
+    UNARY(ext32u_i64, uint64_t, (uint32_t)a)
+    UNARY(bswap16_i64, uint64_t, bswap16(a))
+    UNARY(bswap32_i64, uint64_t, bswap32(a))
+    UNARY(bswap64_i64, uint64_t, bswap64(a))
+    UNARY(not_i64, uint64_t, ~a)
+    UNARY(neg_i64, uint64_t, -a)
+#endif /* TCG_TARGET_REG_BITS == 32 */
 
-        case INDEX_op_add_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 * t2);
-            break;
-#if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 % t2);
-            break;
-#elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
-            TODO();
-            break;
-#endif
-        case INDEX_op_and_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 ^ t2);
-            break;
+    /* QEMU specific operations.  The memop of qemu_ld/st is in r[4],
+       the TCGMemOpIdx in i.  */
 
-            /* Shift/rotate operations (32 bit). */
+do_qemu_ld_i32: {
+        target_ulong taddr = TADDR();
+        uint32_t tmp32;
 
-        case INDEX_op_shl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 << (t2 & 31));
-            break;
-        case INDEX_op_shr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 >> (t2 & 31));
-            break;
-        case INDEX_op_sar_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, ((int32_t)t1 >> (t2 & 31)));
-            break;
-#if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, rol32(t1, t2 & 31));
-            break;
-        case INDEX_op_rotr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, ror32(t1, t2 & 31));
-            break;
-#endif
-#if TCG_TARGET_HAS_deposit_i32
-        case INDEX_op_deposit_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            t2 = tci_read_r32(&tb_ptr);
-            tmp16 = *tb_ptr++;
-            tmp8 = *tb_ptr++;
-            tmp32 = (((1 << tmp8) - 1) << tmp16);
-            tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
-            break;
-#endif
-        case INDEX_op_brcond_i32:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_ri32(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare32(t0, t1, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
-            break;
-#if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            tmp64 += tci_read_r64(&tb_ptr);
-            tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            tmp64 = tci_read_r64(&tb_ptr);
-            tmp64 -= tci_read_r64(&tb_ptr);
-            tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
-            tmp64 = tci_read_r64(&tb_ptr);
-            v64 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare64(tmp64, v64, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
-            break;
-        case INDEX_op_mulu2_i32:
-            t0 = *tb_ptr++;
-            t1 = *tb_ptr++;
-            t2 = tci_read_r32(&tb_ptr);
-            tmp64 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
-#endif /* TCG_TARGET_REG_BITS == 32 */
-#if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8s(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16s(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg32(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg32(t0, bswap16(t1));
-            break;
-#endif
-#if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, bswap32(t1));
-            break;
-#endif
-#if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, ~t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg32(t0, -t1);
-            break;
+#if defined(GETPC)
+        tci_tb_ptr = (uintptr_t)insn;
 #endif
-#if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_i64(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
-
-            /* Load/store operations (64 bit). */
-
-        case INDEX_op_ld8u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
+        switch (insn->r[4]) {
+        case MO_UB:
+            tmp32 = qemu_ld_ub;
             break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
-            TODO();
+        case MO_SB:
+            tmp32 = (int8_t)qemu_ld_ub;
             break;
-        case INDEX_op_ld32u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
+        case MO_LEUW:
+            tmp32 = qemu_ld_leuw;
             break;
-        case INDEX_op_ld32s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
+        case MO_LESW:
+            tmp32 = (int16_t)qemu_ld_leuw;
             break;
-        case INDEX_op_ld_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
+        case MO_LEUL:
+            tmp32 = qemu_ld_leul;
             break;
-        case INDEX_op_st8_i64:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
+        case MO_BEUW:
+            tmp32 = qemu_ld_beuw;
             break;
-        case INDEX_op_st16_i64:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
+        case MO_BESW:
+            tmp32 = (int16_t)qemu_ld_beuw;
             break;
-        case INDEX_op_st32_i64:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            *(uint32_t *)(t1 + t2) = t0;
+        case MO_BEUL:
+            tmp32 = qemu_ld_beul;
             break;
-        case INDEX_op_st_i64:
-            t0 = tci_read_r64(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_s32(&tb_ptr);
-            assert(t1 != sp_value || (int32_t)t2 < 0);
-            *(uint64_t *)(t1 + t2) = t0;
-            break;
-
-            /* Arithmetic operations (64 bit). */
+        default:
+            tcg_abort();
+        }
+        REG(0) = tmp32;
+        NEXT();
+    }
+do_qemu_ld_i64: {
+        target_ulong taddr = TADDR();
+        uint64_t tmp64;
 
-        case INDEX_op_add_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 * t2);
-            break;
-#if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
-            TODO();
-            break;
-#elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
-            TODO();
-            break;
+#if defined(GETPC)
+        tci_tb_ptr = (uintptr_t)insn;
 #endif
-        case INDEX_op_and_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 & t2);
+        switch (insn->r[4]) {
+        case MO_UB:
+            tmp64 = qemu_ld_ub;
             break;
-        case INDEX_op_or_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 | t2);
+        case MO_SB:
+            tmp64 = (int8_t)qemu_ld_ub;
             break;
-        case INDEX_op_xor_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 ^ t2);
+        case MO_LEUW:
+            tmp64 = qemu_ld_leuw;
             break;
-
-            /* Shift/rotate operations (64 bit). */
-
-        case INDEX_op_shl_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 << (t2 & 63));
+        case MO_LESW:
+            tmp64 = (int16_t)qemu_ld_leuw;
             break;
-        case INDEX_op_shr_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 >> (t2 & 63));
+        case MO_LEUL:
+            tmp64 = qemu_ld_leul;
             break;
-        case INDEX_op_sar_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, ((int64_t)t1 >> (t2 & 63)));
+        case MO_LESL:
+            tmp64 = (int32_t)qemu_ld_leul;
             break;
-#if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, rol64(t1, t2 & 63));
+        case MO_LEQ:
+            tmp64 = qemu_ld_leq;
             break;
-        case INDEX_op_rotr_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, ror64(t1, t2 & 63));
+        case MO_BEUW:
+            tmp64 = qemu_ld_beuw;
             break;
-#endif
-#if TCG_TARGET_HAS_deposit_i64
-        case INDEX_op_deposit_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            t2 = tci_read_r64(&tb_ptr);
-            tmp16 = *tb_ptr++;
-            tmp8 = *tb_ptr++;
-            tmp64 = (((1ULL << tmp8) - 1) << tmp16);
-            tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
+        case MO_BESW:
+            tmp64 = (int16_t)qemu_ld_beuw;
             break;
-#endif
-        case INDEX_op_brcond_i64:
-            t0 = tci_read_r64(&tb_ptr);
-            t1 = tci_read_ri64(&tb_ptr);
-            condition = *tb_ptr++;
-            label = tci_read_label(&tb_ptr);
-            if (tci_compare64(t0, t1, condition)) {
-                assert(tb_ptr == old_code_ptr + op_size);
-                tb_ptr = (uint8_t *)label;
-                continue;
-            }
+        case MO_BEUL:
+            tmp64 = qemu_ld_beul;
             break;
-#if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8(&tb_ptr);
-            tci_write_reg64(t0, t1);
+        case MO_BESL:
+            tmp64 = (int32_t)qemu_ld_beul;
             break;
-#endif
-#if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r8s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg64(t0, t1);
+        case MO_BEQ:
+            tmp64 = qemu_ld_beq;
             break;
+        default:
+            tcg_abort();
+        }
+        REG(0) = tmp64;
+#if TCG_TARGET_REG_BITS == 32
+        REG(1) = tmp64 >> 32;
 #endif
-#if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32s(&tb_ptr);
-            tci_write_reg64(t0, t1);
-            break;
+        NEXT();
+    }
+do_qemu_st_i32: {
+        target_ulong taddr = TADDR();
+        uint32_t tmp32 = REG(0);
+
+#if defined(GETPC)
+        tci_tb_ptr = (uintptr_t)insn;
 #endif
-#if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t0, t1);
+        switch (insn->r[4]) {
+        case MO_UB:
+            qemu_st_b(tmp32);
             break;
-#endif
-#if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
-            TODO();
-            t0 = *tb_ptr++;
-            t1 = tci_read_r16(&tb_ptr);
-            tci_write_reg64(t0, bswap16(t1));
+        case MO_LEUW:
+            qemu_st_lew(tmp32);
             break;
-#endif
-#if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r32(&tb_ptr);
-            tci_write_reg64(t0, bswap32(t1));
+        case MO_LEUL:
+            qemu_st_lel(tmp32);
             break;
-#endif
-#if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, bswap64(t1));
+        case MO_BEUW:
+            qemu_st_bew(tmp32);
             break;
-#endif
-#if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, ~t1);
-            break;
-#endif
-#if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r64(&tb_ptr);
-            tci_write_reg64(t0, -t1);
+        case MO_BEUL:
+            qemu_st_bel(tmp32);
             break;
+        default:
+            tcg_abort();
+        }
+        NEXT();
+    }
+do_qemu_st_i64: {
+        target_ulong taddr = TADDR();
+#if TCG_TARGET_REG_BITS == 32
+        uint64_t tmp64 = tci_uint64(REG(1), REG(0));
+#else
+        uint64_t tmp64 = REG(0);
 #endif
-#endif /* TCG_TARGET_REG_BITS == 64 */
-
-            /* QEMU specific operations. */
 
-#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
-            TODO();
+#if defined(GETPC)
+        tci_tb_ptr = (uintptr_t)insn;
+#endif
+        switch (insn->r[4]) {
+        case MO_UB:
+            qemu_st_b(tmp64);
             break;
-#else
-        case INDEX_op_debug_insn_start:
-            TODO();
+        case MO_LEUW:
+            qemu_st_lew(tmp64);
             break;
-#endif
-        case INDEX_op_exit_tb:
-            next_tb = *(uint64_t *)tb_ptr;
-            goto exit;
+        case MO_LEUL:
+            qemu_st_lel(tmp64);
             break;
-        case INDEX_op_goto_tb:
-            t0 = tci_read_i32(&tb_ptr);
-            assert(tb_ptr == old_code_ptr + op_size);
-            tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld_i32:
-            t0 = *tb_ptr++;
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
-            case MO_UB:
-                tmp32 = qemu_ld_ub;
-                break;
-            case MO_SB:
-                tmp32 = (int8_t)qemu_ld_ub;
-                break;
-            case MO_LEUW:
-                tmp32 = qemu_ld_leuw;
-                break;
-            case MO_LESW:
-                tmp32 = (int16_t)qemu_ld_leuw;
-                break;
-            case MO_LEUL:
-                tmp32 = qemu_ld_leul;
-                break;
-            case MO_BEUW:
-                tmp32 = qemu_ld_beuw;
-                break;
-            case MO_BESW:
-                tmp32 = (int16_t)qemu_ld_beuw;
-                break;
-            case MO_BEUL:
-                tmp32 = qemu_ld_beul;
-                break;
-            default:
-                tcg_abort();
-            }
-            tci_write_reg(t0, tmp32);
+        case MO_LEQ:
+            qemu_st_leq(tmp64);
             break;
-        case INDEX_op_qemu_ld_i64:
-            t0 = *tb_ptr++;
-            if (TCG_TARGET_REG_BITS == 32) {
-                t1 = *tb_ptr++;
-            }
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SSIZE)) {
-            case MO_UB:
-                tmp64 = qemu_ld_ub;
-                break;
-            case MO_SB:
-                tmp64 = (int8_t)qemu_ld_ub;
-                break;
-            case MO_LEUW:
-                tmp64 = qemu_ld_leuw;
-                break;
-            case MO_LESW:
-                tmp64 = (int16_t)qemu_ld_leuw;
-                break;
-            case MO_LEUL:
-                tmp64 = qemu_ld_leul;
-                break;
-            case MO_LESL:
-                tmp64 = (int32_t)qemu_ld_leul;
-                break;
-            case MO_LEQ:
-                tmp64 = qemu_ld_leq;
-                break;
-            case MO_BEUW:
-                tmp64 = qemu_ld_beuw;
-                break;
-            case MO_BESW:
-                tmp64 = (int16_t)qemu_ld_beuw;
-                break;
-            case MO_BEUL:
-                tmp64 = qemu_ld_beul;
-                break;
-            case MO_BESL:
-                tmp64 = (int32_t)qemu_ld_beul;
-                break;
-            case MO_BEQ:
-                tmp64 = qemu_ld_beq;
-                break;
-            default:
-                tcg_abort();
-            }
-            tci_write_reg(t0, tmp64);
-            if (TCG_TARGET_REG_BITS == 32) {
-                tci_write_reg(t1, tmp64 >> 32);
-            }
+        case MO_BEUW:
+            qemu_st_bew(tmp64);
             break;
-        case INDEX_op_qemu_st_i32:
-            t0 = tci_read_r(&tb_ptr);
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
-            case MO_UB:
-                qemu_st_b(t0);
-                break;
-            case MO_LEUW:
-                qemu_st_lew(t0);
-                break;
-            case MO_LEUL:
-                qemu_st_lel(t0);
-                break;
-            case MO_BEUW:
-                qemu_st_bew(t0);
-                break;
-            case MO_BEUL:
-                qemu_st_bel(t0);
-                break;
-            default:
-                tcg_abort();
-            }
+        case MO_BEUL:
+            qemu_st_bel(tmp64);
             break;
-        case INDEX_op_qemu_st_i64:
-            tmp64 = tci_read_r64(&tb_ptr);
-            taddr = tci_read_ulong(&tb_ptr);
-            oi = tci_read_i(&tb_ptr);
-            switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
-            case MO_UB:
-                qemu_st_b(tmp64);
-                break;
-            case MO_LEUW:
-                qemu_st_lew(tmp64);
-                break;
-            case MO_LEUL:
-                qemu_st_lel(tmp64);
-                break;
-            case MO_LEQ:
-                qemu_st_leq(tmp64);
-                break;
-            case MO_BEUW:
-                qemu_st_bew(tmp64);
-                break;
-            case MO_BEUL:
-                qemu_st_bel(tmp64);
-                break;
-            case MO_BEQ:
-                qemu_st_beq(tmp64);
-                break;
-            default:
-                tcg_abort();
-            }
+        case MO_BEQ:
+            qemu_st_beq(tmp64);
             break;
         default:
-            TODO();
-            break;
+            tcg_abort();
         }
-        assert(tb_ptr == old_code_ptr + op_size);
+        NEXT();
     }
-exit:
-    return next_tb;
+
+do_illegal:
+    TODO();
+    return 0;
 }
@@ -1442,6 +1442,149 @@ static void test_ncq_simple(void)
     ahci_shutdown(ahci);
 }
 
+/**
+ * Enable command completion coalescing on @port, raising the CCC interrupt
+ * every @cc completions or @tv milliseconds after the first one.
+ * Returns the IS bit of the CCC interrupt.
+ */
+static uint32_t ahci_ccc_enable(AHCIQState *ahci, uint8_t port,
+                                uint8_t cc, uint16_t tv)
+{
+    uint32_t reg;
+
+    g_assert(BITSET(ahci->cap, AHCI_CAP_CCCS));
+    ahci_wreg(ahci, AHCI_CCCPORTS, 1 << port);
+    ahci_wreg(ahci, AHCI_CCCCTL, (tv << ctzl(AHCI_CCCCTL_TV)) |
+              (cc << ctzl(AHCI_CCCCTL_CC)));
+    ahci_set(ahci, AHCI_CCCCTL, AHCI_CCCCTL_EN);
+
+    reg = ahci_rreg(ahci, AHCI_CCCCTL);
+    g_assert_cmphex(reg & AHCI_CCCCTL_CC, ==, cc << ctzl(AHCI_CCCCTL_CC));
+    g_assert_cmphex(reg & AHCI_CCCCTL_TV, ==, tv << ctzl(AHCI_CCCCTL_TV));
+
+    /* INT names the IS bit used for the CCC interrupt */
+    return 1 << ((reg >> 3) & 0x1f);
+}
+
+/* Run an NCQ read and return IS as seen before the command is checked. */
+static uint32_t ahci_ccc_io(AHCIQState *ahci, uint8_t port, uint64_t buffer)
+{
+    AHCICommand *cmd;
+    uint32_t is;
+
+    cmd = ahci_command_create(READ_FPDMA_QUEUED);
+    ahci_command_set_buffer(cmd, buffer);
+    ahci_command_set_size(cmd, AHCI_SECTOR_SIZE);
+    ahci_command_commit(ahci, cmd, port);
+    ahci_command_issue(ahci, cmd);
+    is = ahci_rreg(ahci, AHCI_IS);
+    ahci_command_verify(ahci, cmd);
+    ahci_command_free(cmd);
+
+    return is;
+}
+
+static void test_ccc(void)
+{
+    AHCIQState *ahci;
+    uint64_t ptr;
+    uint32_t ccc_bit;
+    uint8_t port;
+
+    ahci = ahci_boot_and_enable("-drive if=none,id=drive0,file=%s,"
+                                "cache=writeback,format=qcow2 "
+                                "-M q35 -device ide-hd,drive=drive0 "
+                                "-global ich9-ahci.ccc=on", tmp_path);
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, AHCI_SECTOR_SIZE);
+
+    ccc_bit = ahci_ccc_enable(ahci, port, 2, 1);
+    g_assert_cmphex(ccc_bit, ==, 1 << ((ahci->cap & AHCI_CAP_NP) + 1));
+
+    /* One completion: no interrupt, not even for the port itself */
+    g_assert_cmphex(ahci_ccc_io(ahci, port, ptr), ==, 0);
+
+    /* ...until the timeout expires */
+    clock_step(1000000);
+    g_assert_cmphex(ahci_rreg(ahci, AHCI_IS), ==, ccc_bit);
+    ahci_wreg(ahci, AHCI_IS, ccc_bit);
+    g_assert_cmphex(ahci_rreg(ahci, AHCI_IS), ==, 0);
+
+    /* Two completions raise it straight away */
+    g_assert_cmphex(ahci_ccc_io(ahci, port, ptr), ==, 0);
+    g_assert_cmphex(ahci_ccc_io(ahci, port, ptr), ==, ccc_bit);
+    ahci_wreg(ahci, AHCI_IS, ccc_bit);
+
+    /* Disabling coalescing brings back the port interrupt */
+    ahci_clr(ahci, AHCI_CCCCTL, AHCI_CCCCTL_EN);
+    g_assert_cmphex(ahci_ccc_io(ahci, port, ptr), ==, 1 << port);
+    g_assert_cmphex(ahci_rreg(ahci, AHCI_IS), ==, 0);
+
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
+#define PERF_NCQ_DEPTH 8
+#define PERF_NCQ_BATCHES 256
+
+/* Queue PERF_NCQ_DEPTH NCQ reads at a time, report commands per second. */
+static void ahci_perf_ncq(bool ccc)
+{
+    AHCIQState *ahci;
+    AHCICommand *cmds[PERF_NCQ_DEPTH];
+    uint64_t ptr;
+    uint8_t port;
+    double duration;
+    int i, j;
+
+    ahci = ahci_boot_and_enable("-drive if=none,id=drive0,file=%s,"
+                                "cache=writeback,format=qcow2 "
+                                "-M q35 -device ide-hd,drive=drive0 "
+                                "-global ich9-ahci.ccc=%s", tmp_path,
+                                ccc ? "on" : "off");
+    port = ahci_port_select(ahci);
+    ahci_port_clear(ahci, port);
+    ptr = ahci_alloc(ahci, PERF_NCQ_DEPTH * AHCI_SECTOR_SIZE);
+    if (ccc) {
+        ahci_ccc_enable(ahci, port, PERF_NCQ_DEPTH, 1);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_NCQ_BATCHES; i++) {
+        for (j = 0; j < PERF_NCQ_DEPTH; j++) {
+            cmds[j] = ahci_command_create(READ_FPDMA_QUEUED);
+            ahci_command_set_buffer(cmds[j], ptr + j * AHCI_SECTOR_SIZE);
+            ahci_command_set_size(cmds[j], AHCI_SECTOR_SIZE);
+            ahci_command_set_offset(cmds[j], j);
+            ahci_command_commit(ahci, cmds[j], port);
+        }
+        for (j = 0; j < PERF_NCQ_DEPTH; j++) {
+            ahci_command_issue_async(ahci, cmds[j]);
+        }
+        for (j = 0; j < PERF_NCQ_DEPTH; j++) {
+            ahci_command_wait(ahci, cmds[j]);
+            ahci_command_free(cmds[j]);
+        }
+        ahci_port_check_error(ahci, port);
+        ahci_px_wreg(ahci, port, AHCI_PX_IS, 0xFFFFFFFF);
+        ahci_wreg(ahci, AHCI_IS, 0xFFFFFFFF);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("ahci ncq (ccc=%s) %d commands: %f s, %f commands/s\n",
+                   ccc ? "on" : "off", PERF_NCQ_DEPTH * PERF_NCQ_BATCHES,
+                   duration, PERF_NCQ_DEPTH * PERF_NCQ_BATCHES / duration);
+
+    ahci_free(ahci, ptr);
+    ahci_shutdown(ahci);
+}
+
+static void perf_ncq(void)
+{
+    ahci_perf_ncq(false);
+    ahci_perf_ncq(true);
+}
+
 /******************************************************************************/
 /* AHCI I/O Test Matrix Definitions                                           */
 
@@ -1700,6 +1843,11 @@ int main(int argc, char **argv)
     qtest_add_func("/ahci/io/ncq/retry", test_halted_ncq);
     qtest_add_func("/ahci/migrate/ncq/halted", test_migrate_halted_ncq);
 
+    qtest_add_func("/ahci/ccc", test_ccc);
+    if (g_test_perf()) {
+        qtest_add_func("/ahci/perf/ncq", perf_ncq);
+    }
+
     ret = g_test_run();
 
     /* Cleanup */
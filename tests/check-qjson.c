@@ -1484,6 +1484,69 @@ static void unterminated_literal(void)
     g_assert(obj == NULL);
 }
 
+/* A response shaped like the one of query-blockstats with many devices */
+static QObject *large_response(int devices)
+{
+    static const char *const fields[] = {
+        "rd_bytes", "wr_bytes", "rd_operations", "wr_operations",
+        "flush_operations", "rd_total_time_ns", "wr_total_time_ns",
+        "flush_total_time_ns", "rd_merged", "wr_merged", "wr_highest_offset",
+    };
+    QList *list = qlist_new();
+    QDict *resp = qdict_new();
+    int i, j;
+
+    for (i = 0; i < devices; i++) {
+        QDict *dev = qdict_new();
+        QDict *stats = qdict_new();
+        char name[32];
+
+        for (j = 0; j < ARRAY_SIZE(fields); j++) {
+            qdict_put(stats, fields[j], qint_from_int((int64_t)i << j));
+        }
+        snprintf(name, sizeof(name), "drive-virtio-disk%d", i);
+        qdict_put(dev, "device", qstring_from_str(name));
+        qdict_put(dev, "node-name", qstring_from_str("#block123"));
+        qdict_put(dev, "stats", stats);
+        qlist_append(list, dev);
+    }
+    qdict_put(resp, "return", list);
+    return QOBJECT(resp);
+}
+
+static void perf_large_response(void)
+{
+    QObject *obj = large_response(1000);
+    QString *str = NULL;
+    double duration;
+    size_t len;
+    int i, n = 100;
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        QDECREF(str);
+        str = qobject_to_json(obj);
+    }
+    duration = g_test_timer_elapsed();
+    len = qstring_get_length(str);
+    g_test_message("Output %d x %zu bytes: %f s, %f MB/s\n", n, len,
+                   duration, n * len / duration / 1e6);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        QObject *parsed = qobject_from_json(qstring_get_str(str));
+
+        g_assert(parsed);
+        qobject_decref(parsed);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("Parse %d x %zu bytes: %f s, %f MB/s\n", n, len,
+                   duration, n * len / duration / 1e6);
+
+    QDECREF(str);
+    qobject_decref(obj);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1520,5 +1583,9 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/invalid_dict_comma", invalid_dict_comma);
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
 
+    if (g_test_perf()) {
+        g_test_add_func("/perf/large_response", perf_large_response);
+    }
+
     return g_test_run();
 }
@@ -279,3 +279,21 @@ void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
     /* vq->avail->used_event */
     writew(vq->avail + 4 + (2 * vq->size), idx);
 }
+
+/* Wait until vq->used->idx reaches @idx */
+void qvirtqueue_wait_used(QVirtQueue *vq, uint16_t idx, gint64 timeout_us)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vq->used + 2) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <= timeout_us);
+    }
+}
+
+/* Make all descriptors free again, once the device used every request */
+void qvirtqueue_reclaim(QVirtQueue *vq)
+{
+    vq->free_head = 0;
+    vq->num_free = vq->size;
+}
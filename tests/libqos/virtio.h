@@ -190,4 +190,6 @@ void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d, QVirtQueue *vq,
                                                             uint32_t free_head);
 
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx);
+void qvirtqueue_wait_used(QVirtQueue *vq, uint16_t idx, gint64 timeout_us);
+void qvirtqueue_reclaim(QVirtQueue *vq);
 #endif
@@ -10,22 +10,65 @@
 #include <glib.h>
 #include <string.h>
 #include "libqtest.h"
+#include "libqos/pci-pc.h"
 #include "qemu/osdep.h"
 
+#define NVME_PCI_SLOT       0x04
+#define NVME_REG_CSTS       0x1c
+#define NVME_SQ0_TAIL_DB    0x1000
+
+#define PERF_MMIO_ACCESSES  100000
+
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void nop(void)
 {
 }
 
+/*
+ * Alternate reads of a controller register with writes to the doorbell of
+ * the (disabled) admin queue, and report MMIO accesses per second.
+ */
+static void perf_mmio(void)
+{
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    void *bar;
+    double duration;
+    int i;
+
+    bus = qpci_init_pc();
+    dev = qpci_device_find(bus, QPCI_DEVFN(NVME_PCI_SLOT, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    bar = qpci_iomap(dev, 0, NULL);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_MMIO_ACCESSES / 2; i++) {
+        qpci_io_readl(dev, bar + NVME_REG_CSTS);
+        qpci_io_writel(dev, bar + NVME_SQ0_TAIL_DB, 0);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("nvme %d MMIO accesses: %f s, %f accesses/s\n",
+                   PERF_MMIO_ACCESSES, duration,
+                   PERF_MMIO_ACCESSES / duration);
+
+    qpci_iounmap(dev, bar);
+    g_free(dev);
+    qpci_free_pc(bus);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/nvme/nop", nop);
+    if (g_test_perf()) {
+        qtest_add_func("/nvme/perf/mmio", perf_mmio);
+    }
 
     qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
+                "-device nvme,drive=drv0,serial=foo,addr=04.0");
     ret = g_test_run();
 
     qtest_end();
@@ -0,0 +1,134 @@
+/*
+ * Guest kernels for TCG benchmarks (see scripts/tcg-bench.sh)
+ *
+ * Usage: bench KERNEL [ITERATIONS]
+ *
+ * Each kernel exercises one kind of guest code: "int" integer arithmetic,
+ * "memcpy" loads and stores, "fp" double precision arithmetic and "branch"
+ * data dependent branches.  The result is printed so that the compiler
+ * cannot drop the work.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define BUF_SIZE 65536
+
+static uint8_t src[BUF_SIZE], dst[BUF_SIZE];
+
+static uint32_t bench_int(long n)
+{
+    uint32_t a = 1, b = 2, c = 3;
+    long i;
+
+    for (i = 0; i < n * 1000; i++) {
+        a = a * 1103515245 + 12345;
+        b ^= a >> 7;
+        c += (b << 3) | (a >> 29);
+        b = b * 3 + c;
+    }
+    return a ^ b ^ c;
+}
+
+static uint32_t bench_memcpy(long n)
+{
+    uint32_t sum = 0;
+    long i;
+    int j;
+
+    for (j = 0; j < BUF_SIZE; j++) {
+        src[j] = j * 7;
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(dst, src, BUF_SIZE);
+        /* Byte-wise copy back, as simple compiled loops do */
+        for (j = 0; j < BUF_SIZE; j += 64) {
+            src[j] = dst[j] + 1;
+        }
+        sum += dst[i % BUF_SIZE];
+    }
+    return sum;
+}
+
+static uint32_t bench_fp(long n)
+{
+    double x = 1.0, y = 0.5, z = 0.0;
+    long i;
+
+    for (i = 0; i < n * 1000; i++) {
+        x = x * 1.000001 + y;
+        y = y / 1.0000003 - 0.0000001 * x;
+        z += x * y;
+        if (x > 1e6) {
+            x = 1.0;
+        }
+    }
+    return (uint32_t)(int64_t)z;
+}
+
+static uint32_t bench_branch(long n)
+{
+    uint32_t steps = 0;
+    long i;
+
+    /* Collatz sequences: the branches depend on the data */
+    for (i = 1; i <= n * 20; i++) {
+        uint64_t v = i;
+
+        while (v != 1) {
+            switch (v & 3) {
+            case 0:
+                v >>= 2;
+                steps += 2;
+                break;
+            case 2:
+                v >>= 1;
+                steps++;
+                break;
+            default:
+                v = 3 * v + 1;
+                steps++;
+                break;
+            }
+        }
+    }
+    return steps;
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*fn)(long n);
+} kernels[] = {
+    { "int",    bench_int },
+    { "memcpy", bench_memcpy },
+    { "fp",     bench_fp },
+    { "branch", bench_branch },
+};
+
+int main(int argc, char **argv)
+{
+    long n = 1000;
+    size_t i;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s KERNEL [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        n = atol(argv[2]);
+    }
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!strcmp(argv[1], kernels[i].name)) {
+            printf("%s: %08x\n", kernels[i].name, kernels[i].fn(n));
+            return 0;
+        }
+    }
+    fprintf(stderr, "%s: unknown kernel '%s'\n", argv[0], argv[1]);
+    return 1;
+}
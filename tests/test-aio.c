@@ -343,6 +343,99 @@ static void test_wait_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+static bool poll_ready;
+
+static bool event_poll_cb(void *opaque)
+{
+    return poll_ready;
+}
+
+static void event_poll_read_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    event_notifier_test_and_clear(e);
+    poll_ready = false;
+    data->n++;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0 };
+    Error *local_error = NULL;
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_poll_read_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000, 0, 0, &local_error);
+    g_assert(!local_error);
+    ctx->poll_ns = ctx->poll_max_ns;
+
+    /* Busy polling finds work without the notifier being set */
+    poll_ready = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* Non-blocking calls never poll */
+    poll_ready = true;
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    poll_ready = false;
+
+    /* When the poll function has nothing, the notifier still works */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &local_error);
+    g_assert(!local_error);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+
+    event_notifier_cleanup(&data.e);
+}
+
+/* Enough notifiers for aio_poll() to switch to epoll where available */
+static void test_wait_many_event_notifiers(void)
+{
+    EventNotifierTestData data[100];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    while (aio_poll(ctx, false)) {
+        /* flush the notifiers of previous tests */
+    }
+
+    event_notifier_set(&data[37].e);
+    event_notifier_set(&data[99].e);
+    g_assert(aio_poll(ctx, false));
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        g_assert_cmpint(data[i].n, ==, i == 37 || i == 99);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Removing half of them leaves the others working */
+    for (i = 0; i < ARRAY_SIZE(data); i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    event_notifier_set(&data[37].e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data[37].n, ==, 2);
+
+    for (i = 1; i < ARRAY_SIZE(data); i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    g_assert(!aio_poll(ctx, false));
+    for (i = 0; i < ARRAY_SIZE(data); i++) {
+        event_notifier_cleanup(&data[i].e);
+    }
+}
+
 static void test_flush_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
@@ -826,6 +919,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/wait/many",         test_wait_many_event_notifiers);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -175,6 +175,52 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that the pool grows to keep as many coroutines as were alive at once
+ */
+
+#define POOL_TEST_SIZE 500
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void create_and_finish(unsigned int n)
+{
+    Coroutine **co = g_new(Coroutine *, n);
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        co[i] = qemu_coroutine_create(yield_once);
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(co[i], NULL);
+    }
+    g_free(co);
+}
+
+static void test_pool(void)
+{
+    const CoroutinePoolStats *stats = qemu_coroutine_pool_stats();
+    uint64_t misses, hits;
+
+    if (!CONFIG_COROUTINE_POOL) {
+        return;
+    }
+
+    create_and_finish(POOL_TEST_SIZE);
+    g_assert_cmpint(stats->max_size, >=, POOL_TEST_SIZE - 128);
+
+    /* The second time around, every coroutine comes from the pool */
+    misses = stats->misses;
+    hits = stats->hits;
+    create_and_finish(POOL_TEST_SIZE);
+    g_assert_cmpint(stats->misses, ==, misses);
+    g_assert_cmpint(stats->hits, ==, hits + POOL_TEST_SIZE);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -375,6 +421,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+    g_test_add_func("/basic/pool", test_pool);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
@@ -0,0 +1,99 @@
+/*
+ * CRC32C unit tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+
+static const char *accel_names[] = { "table", "sse4.2", "armv8" };
+
+static void test_crc32c_check_value(void)
+{
+    const uint8_t *check = (const uint8_t *)"123456789";
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(accel_names); i++) {
+        if (!crc32c_set_accel(accel_names[i])) {
+            continue;
+        }
+        g_assert_cmphex(crc32c(0xffffffff, check, 9), ==, 0xe3069283);
+        /* a checksum can be computed in several parts */
+        g_assert_cmphex(crc32c(crc32c(0xffffffff, check, 4) ^ 0xffffffff,
+                               check + 4, 5), ==, 0xe3069283);
+    }
+    crc32c_set_accel("auto");
+}
+
+static void test_crc32c_accel(void)
+{
+    uint8_t *buf = g_malloc(4096 + 8);
+    unsigned int i, start, len;
+    uint32_t expected;
+    int j;
+
+    for (i = 0; i < 4096 + 8; i++) {
+        buf[i] = g_test_rand_int();
+    }
+
+    /* all alignments and lengths around the 8 byte words */
+    for (start = 0; start < 8; start++) {
+        for (len = 0; len <= 4096; len += (len < 64 ? 1 : 61)) {
+            crc32c_set_accel("table");
+            expected = crc32c(0xffffffff, buf + start, len);
+            for (j = 1; j < ARRAY_SIZE(accel_names); j++) {
+                if (!crc32c_set_accel(accel_names[j])) {
+                    continue;
+                }
+                g_assert_cmphex(crc32c(0xffffffff, buf + start, len), ==,
+                                expected);
+            }
+        }
+    }
+    crc32c_set_accel("auto");
+    g_free(buf);
+}
+
+static void perf_crc32c(void)
+{
+    unsigned int i, n, size = 64 * 1024, max = 16384;
+    uint8_t *buf = g_malloc0(size);
+    double duration;
+    int j;
+
+    for (j = 0; j < ARRAY_SIZE(accel_names); j++) {
+        if (!crc32c_set_accel(accel_names[j])) {
+            continue;
+        }
+        /* the table is much slower, don't wait for it */
+        n = strcmp(accel_names[j], "table") ? max : max / 16;
+        g_test_timer_start();
+        for (i = 0; i < n; i++) {
+            crc32c(0xffffffff, buf, size);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("crc32c (%s) %u x %u bytes: %f s, %f MB/s\n",
+                       accel_names[j], n, size, duration,
+                       n * (double)size / duration / 1e6);
+    }
+    crc32c_set_accel("auto");
+
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/check_value", test_crc32c_check_value);
+    g_test_add_func("/crc32c/accel", test_crc32c_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/crc32c/perf", perf_crc32c);
+    }
+
+    return g_test_run();
+}
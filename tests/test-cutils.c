@@ -226,6 +226,41 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    static const char *accels[] = { "vec", "avx2", "avx512f" };
+    size_t block = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE);
+    size_t size = 8192, len, pos, expected;
+    uint8_t *buf = g_malloc0(size);
+    int i;
+
+    for (len = 0; len <= size; len += block) {
+        for (pos = 0; pos <= len; pos += 7) {
+            if (pos < len) {
+                buf[pos] = 1;
+            }
+            if (pos < block) {
+                expected = MIN(pos & ~(sizeof(VECTYPE) - 1), len);
+            } else {
+                expected = MIN(pos & ~(block - 1), len);
+            }
+            for (i = 0; i < ARRAY_SIZE(accels); i++) {
+                if (!buffer_find_nonzero_offset_set_accel(accels[i])) {
+                    continue;
+                }
+                g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==,
+                                expected);
+            }
+            if (pos < len) {
+                buf[pos] = 0;
+            }
+        }
+    }
+
+    buffer_find_nonzero_offset_set_accel("auto");
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +281,8 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
 
     return g_test_run();
 }
@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <sys/types.h>
+#include <inttypes.h>
 #include "qemu/hbitmap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -639,6 +640,201 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    size_t size = L2 + 10;
+    size_t bytes = (size + 7) / 8;
+    uint8_t *buf = g_malloc0(bytes);
+    HBitmap *hb;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 3);
+    hbitmap_test_set(data, L2 - 5, 12);
+
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+    g_assert_cmpint(buf[0], ==, 1);
+    g_assert_cmpint(buf[bytes - 1] & ~3, ==, 0);
+
+    /* Load in two parts into a fresh bitmap, then compare.  */
+    hb = hbitmap_alloc(size, 0);
+    hbitmap_deserialize_part(hb, buf, 0, 64);
+    hbitmap_deserialize_part(hb, buf + 8, 64, size - 64);
+    hbitmap_deserialize_finish(hb);
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+    g_free(buf);
+}
+
+static void test_hbitmap_meta(TestHBitmapData *data,
+                              const void *unused)
+{
+    HBitmap *meta;
+
+    hbitmap_test_init(data, L3, 0);
+    meta = hbitmap_create_meta(data->hb, 10);
+    g_assert(hbitmap_empty(meta));
+
+    hbitmap_test_set(data, 5, 1);
+    g_assert(hbitmap_get(meta, 0));
+    g_assert_cmpint(hbitmap_count(meta), ==, 1 << 10);
+
+    /* Setting bits that are already set is not a change.  */
+    hbitmap_reset_all(meta);
+    hbitmap_test_set(data, 5, 1);
+    g_assert(hbitmap_empty(meta));
+
+    hbitmap_test_reset(data, L2, L1);
+    g_assert(hbitmap_empty(meta));
+    hbitmap_test_reset(data, 0, L1);
+    g_assert(hbitmap_get(meta, 0));
+
+    hbitmap_reset_all(meta);
+    hbitmap_test_set(data, L3 - 1, 1);
+    g_assert(hbitmap_get(meta, L3 - 1));
+    g_assert(!hbitmap_get(meta, 0));
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L3), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 1, 1), ==, L3 - 1);
+
+    hbitmap_test_set(data, 0, L2 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L3), ==, L2 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 3, L3), ==, L2 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 5), ==, -1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 6, 10), ==, L2 + 6);
+
+    hbitmap_test_set(data, L2 + 5, L3 - L2 - 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, UINT64_MAX), ==, -1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3, 1), ==, -1);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L2, 2);
+    hbitmap_set(data->hb, 8, 8);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 9, L2), ==, 16);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 17, L2), ==, 17);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 9, 7), ==, -1);
+}
+
+static void test_hbitmap_next_dirty_area(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L3, 0);
+    start = 0;
+    count = L3;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, 0);
+    g_assert_cmpint(count, ==, L3);
+
+    hbitmap_test_set(data, L1 + 1, L2);
+    hbitmap_test_set(data, L3 - 1, 1);
+
+    start = 0;
+    count = L3;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L1 + 1);
+    g_assert_cmpint(count, ==, L2);
+
+    /* The area is clipped to the range */
+    start = L1 + 5;
+    count = 10;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L1 + 5);
+    g_assert_cmpint(count, ==, 10);
+
+    start = L1 + L2 + 1;
+    count = L3 - start;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L3 - 1);
+    g_assert_cmpint(count, ==, 1);
+
+    start = L1 + L2 + 1;
+    count = L3 - start - 1;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, &count));
+}
+
+/* A 16 TB disk with 512 byte elements and 64 kB granularity */
+#define PERF_SIZE        (1ULL << 35)
+#define PERF_GRANULARITY 7
+#define PERF_CHUNK       (1ULL << 20)
+
+static void perf_hbitmap_fill(HBitmap *hb)
+{
+    uint64_t i;
+
+    /* A dense 1 GB chunk every 16 GB and a sparse granule every 1 GB */
+    for (i = 0; i < PERF_SIZE; i += 1ULL << 25) {
+        hbitmap_set(hb, i, 1ULL << 21);
+    }
+    for (i = 1ULL << 22; i < PERF_SIZE; i += 1ULL << 21) {
+        hbitmap_set(hb, i, 1);
+    }
+}
+
+static void perf_hbitmap(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    HBitmap *copy = hbitmap_alloc(PERF_SIZE, PERF_GRANULARITY);
+    uint64_t granules = PERF_SIZE >> PERF_GRANULARITY;
+    uint8_t *buf = g_malloc(PERF_CHUNK / 8);
+    uint64_t start, count, n;
+    HBitmapIter hbi;
+    double duration;
+
+    perf_hbitmap_fill(hb);
+
+    g_test_timer_start();
+    hbitmap_iter_init(&hbi, hb, 0);
+    for (n = 0; hbitmap_iter_next(&hbi) >= 0; n++) {
+        /* nothing */
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("iter_next: %" PRIu64 " bits in %f s\n", n, duration);
+
+    g_test_timer_start();
+    start = 0;
+    n = 0;
+    for (;;) {
+        count = PERF_SIZE - start;
+        if (!hbitmap_next_dirty_area(hb, &start, &count)) {
+            break;
+        }
+        start += count;
+        n++;
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("next_dirty_area: %" PRIu64 " areas in %f s\n",
+                   n, duration);
+
+    g_test_timer_start();
+    for (start = 0; start < granules; start += PERF_CHUNK) {
+        count = MIN(PERF_CHUNK, granules - start);
+        hbitmap_serialize_part(hb, buf, start, count);
+        hbitmap_deserialize_part(copy, buf, start, count);
+    }
+    hbitmap_deserialize_finish(copy);
+    duration = g_test_timer_elapsed();
+    g_test_message("serialize + deserialize: %" PRIu64 " bytes in %f s\n",
+                   granules / 8, duration);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(hb));
+
+    g_free(buf);
+    hbitmap_free(copy);
+    hbitmap_free(hb);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -688,6 +884,15 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/meta", test_hbitmap_meta);
+    hbitmap_test_add("/hbitmap/next_zero", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next_zero/granularity",
+                     test_hbitmap_next_zero_granularity);
+    hbitmap_test_add("/hbitmap/next_dirty_area", test_hbitmap_next_dirty_area);
+    if (g_test_perf()) {
+        g_test_add_func("/hbitmap/perf", perf_hbitmap);
+    }
     g_test_run();
 
     return 0;
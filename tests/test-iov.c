@@ -398,6 +398,58 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_qiov_local(void)
+{
+    QEMUIOVector qiov, dst;
+    char buf[16];
+    int i;
+
+    /* short vectors live in local_iov, longer ones move to the heap */
+    qemu_iovec_init(&qiov, 1);
+    g_assert(qiov.iov == qiov.local_iov);
+    for (i = 0; i < 8; i++) {
+        qemu_iovec_add(&qiov, buf + 2 * i, 2);
+        g_assert(qiov.iov[0].iov_base == buf);
+    }
+    g_assert(qiov.iov != qiov.local_iov);
+    g_assert(qiov.niov == 8 && qiov.size == sizeof(buf));
+
+    qemu_iovec_init(&dst, 0);
+    g_assert(qemu_iovec_concat_iov(&dst, qiov.iov, 1, 1, -1) == 1);
+    g_assert(qemu_iovec_concat_iov(&dst, qiov.iov, 8, 3, 6) == 6);
+    g_assert(dst.niov == 5 && dst.size == 7);
+    g_assert(dst.iov[0].iov_base == buf + 1 && dst.iov[0].iov_len == 1);
+    g_assert(dst.iov[1].iov_base == buf + 3 && dst.iov[1].iov_len == 1);
+    g_assert(dst.iov[4].iov_base == buf + 8 && dst.iov[4].iov_len == 1);
+
+    qemu_iovec_destroy(&dst);
+    qemu_iovec_destroy(&qiov);
+}
+
+static void test_qiov_is_zero(void)
+{
+    QEMUIOVector qiov;
+    size_t sz = 4096;
+    uint8_t *buf = g_malloc0(sz);
+    size_t offs, len, pos;
+
+    for (offs = 0; offs < 40; offs += 7) {
+        for (len = 0; offs + len <= sz; len = len * 3 + 1) {
+            qemu_iovec_init(&qiov, 2);
+            qemu_iovec_add(&qiov, buf + offs, len);
+            qemu_iovec_add(&qiov, buf, 5);
+            g_assert(qemu_iovec_is_zero(&qiov));
+            for (pos = 0; pos < len; pos += len / 4 + 1) {
+                buf[offs + pos] = 1;
+                g_assert(!qemu_iovec_is_zero(&qiov));
+                buf[offs + pos] = 0;
+            }
+            qemu_iovec_destroy(&qiov);
+        }
+    }
+    g_free(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +458,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/qiov-local", test_qiov_local);
+    g_test_add_func("/basic/iov/qiov-is-zero", test_qiov_is_zero);
     return g_test_run();
 }
@@ -0,0 +1,205 @@
+/*
+ * Internet checksum unit tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+static const char *accel_names[] = { "int64", "sse2", "avx2", "neon" };
+
+/* The byte at a time sum that net_checksum_add_cont() used to compute */
+static uint32_t checksum_ref(int len, const uint8_t *buf, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        if (i & 1) {
+            sum += (uint32_t)buf[i - seq];
+        } else {
+            sum += (uint32_t)buf[i - seq] << 8;
+        }
+    }
+    return sum;
+}
+
+static void test_checksum_rfc1071(void)
+{
+    /* The example of RFC 1071, section 3 */
+    uint8_t data[] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(accel_names); i++) {
+        if (!net_checksum_set_accel(accel_names[i])) {
+            continue;
+        }
+        g_assert_cmphex(net_checksum_add(sizeof(data), data), ==, 0xddf2);
+        g_assert_cmphex(net_raw_checksum(data, sizeof(data)), ==, 0x220d);
+    }
+    net_checksum_set_accel("auto");
+}
+
+static void test_checksum_accel(void)
+{
+    uint8_t *buf = g_malloc(65536 + 8);
+    unsigned int i, start, len, seq;
+    uint16_t expected;
+    int j;
+
+    for (i = 0; i < 65536 + 8; i++) {
+        buf[i] = g_test_rand_int();
+    }
+
+    /* all alignments, both parities, and lengths around the vector sizes */
+    for (start = 0; start < 8; start++) {
+        for (len = 0; len <= 65536; len += (len < 128 ? 1 : 4093)) {
+            for (seq = 0; seq < 2; seq++) {
+                expected = net_checksum_finish(
+                    checksum_ref(len, buf + start, seq));
+                for (j = 0; j < ARRAY_SIZE(accel_names); j++) {
+                    if (!net_checksum_set_accel(accel_names[j])) {
+                        continue;
+                    }
+                    g_assert_cmphex(net_checksum_finish(
+                        net_checksum_add_cont(len, buf + start, seq)),
+                        ==, expected);
+                }
+            }
+        }
+    }
+
+    /* all ones, the largest sum */
+    memset(buf, 0xff, 65536);
+    for (j = 0; j < ARRAY_SIZE(accel_names); j++) {
+        if (net_checksum_set_accel(accel_names[j])) {
+            g_assert_cmphex(net_checksum_add(65536, buf), ==, 0xffff);
+        }
+    }
+    net_checksum_set_accel("auto");
+    g_free(buf);
+}
+
+static void test_checksum_iov(void)
+{
+    uint8_t *buf = g_malloc(4096);
+    struct iovec iov[5];
+    unsigned int i, off;
+    uint16_t expected;
+
+    for (i = 0; i < 4096; i++) {
+        buf[i] = g_test_rand_int();
+    }
+
+    /* odd sized chunks at odd offsets */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = buf + 1;
+    iov[1].iov_len = 1000;
+    iov[2].iov_base = buf + 1001;
+    iov[2].iov_len = 0;
+    iov[3].iov_base = buf + 1001;
+    iov[3].iov_len = 2047;
+    iov[4].iov_base = buf + 3048;
+    iov[4].iov_len = 1048;
+
+    for (off = 0; off < 4096; off += 511) {
+        expected = net_checksum_finish(checksum_ref(4096 - off, buf + off, 0));
+        g_assert_cmphex(net_checksum_finish(
+            net_checksum_add_iov(iov, ARRAY_SIZE(iov), off, 4096 - off)),
+            ==, expected);
+    }
+    g_free(buf);
+}
+
+/* The verification suite of the Microsoft RSS specification */
+static void test_toeplitz(void)
+{
+    static const uint8_t key[40] = {
+        0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+        0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+        0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+        0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+        0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+    };
+    /* source address, destination address, source port, destination port */
+    static const uint8_t ip4[][12] = {
+        { 66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6 },
+        { 199, 92, 111, 2, 65, 69, 140, 83, 0x37, 0x96, 0x12, 0x83 },
+    };
+    static const uint32_t ip4_hash[][2] = {
+        { 0x323e8fc2, 0x51ccc178 },
+        { 0xd718262a, 0xc626b0ea },
+    };
+    static const uint8_t ip6[36] = {
+        0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07,
+        0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+        0x0a, 0xea, 0x06, 0xe6,
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ip4); i++) {
+        g_assert_cmphex(net_toeplitz_hash(key, ip4[i], 8), ==, ip4_hash[i][0]);
+        g_assert_cmphex(net_toeplitz_hash(key, ip4[i], 12), ==,
+                        ip4_hash[i][1]);
+    }
+    g_assert_cmphex(net_toeplitz_hash(key, ip6, 32), ==, 0x2cc18cd5);
+    g_assert_cmphex(net_toeplitz_hash(key, ip6, 36), ==, 0x40207d3d);
+}
+
+static void perf_checksum(void)
+{
+    unsigned int i, n = 16384, size = 64 * 1024;
+    uint8_t *buf = g_malloc(size);
+    double duration;
+    uint64_t sum;
+    int j;
+
+    memset(buf, 0x5a, size);
+    for (j = -1; j < (int)ARRAY_SIZE(accel_names); j++) {
+        const char *name = j < 0 ? "bytes" : accel_names[j];
+
+        if (j >= 0 && !net_checksum_set_accel(name)) {
+            continue;
+        }
+        sum = 0;
+        g_test_timer_start();
+        for (i = 0; i < n; i++) {
+            if (j < 0) {
+                sum += checksum_ref(size, buf, 0);
+            } else {
+                sum += net_checksum_add(size, buf);
+            }
+        }
+        duration = g_test_timer_elapsed();
+        g_assert(sum != 0);
+        g_test_message("checksum (%s) %u x %u bytes: %f s, %f MB/s\n",
+                       name, n, size, duration,
+                       n * (double)size / duration / 1e6);
+    }
+    net_checksum_set_accel("auto");
+
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/rfc1071", test_checksum_rfc1071);
+    g_test_add_func("/net/checksum/accel", test_checksum_accel);
+    g_test_add_func("/net/checksum/iov", test_checksum_iov);
+    g_test_add_func("/net/toeplitz", test_toeplitz);
+    if (g_test_perf()) {
+        g_test_add_func("/net/checksum/perf", perf_checksum);
+    }
+
+    return g_test_run();
+}
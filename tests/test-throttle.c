@@ -94,6 +94,35 @@ static void test_compute_wait(void)
     g_assert(wait == result);
 }
 
+static void test_compute_timer_tick(void)
+{
+    ThrottleState state;
+    int64_t now = 12345678, next;
+    int64_t wait = (int64_t) NANOSECONDS_PER_SECOND / 150 / 2;
+
+    /* half an operation above max, as in test_compute_wait() */
+    throttle_init(&state);
+    state.previous_leak = now;
+    state.cfg.buckets[THROTTLE_OPS_TOTAL].avg = 150;
+    state.cfg.buckets[THROTTLE_OPS_TOTAL].max = 15;
+    state.cfg.buckets[THROTTLE_OPS_TOTAL].level = 15.5;
+
+    g_assert(throttle_compute_timer(&state, false, now, &next));
+    g_assert_cmpint(next, ==, now + wait);
+
+    /* with a tick the timer is rounded up to a multiple of it */
+    state.cfg.tick = 1000000;
+    g_assert(throttle_compute_timer(&state, false, now, &next));
+    g_assert_cmpint(next, >=, now + wait);
+    g_assert_cmpint(next, <, now + wait + state.cfg.tick);
+    g_assert_cmpint(next % state.cfg.tick, ==, 0);
+
+    /* requests that don't have to wait are not delayed */
+    state.cfg.buckets[THROTTLE_OPS_TOTAL].level = 0;
+    g_assert(!throttle_compute_timer(&state, false, now, &next));
+    g_assert_cmpint(next, ==, now);
+}
+
 /* functions to test ThrottleState initialization/destroy methods */
 static void read_timer_cb(void *opaque)
 {
@@ -559,6 +588,48 @@ static void test_groups(void)
     g_assert(bdrv3->throttle_state == NULL);
 }
 
+static void test_group_shares(void)
+{
+    ThrottleConfig cfg1, cfg2;
+    BlockDriverState *bdrv1, *bdrv2;
+
+    bdrv1 = bdrv_new();
+    bdrv2 = bdrv_new();
+
+    /* The enclosing group is created along with the nested one */
+    throttle_group_register_bs(bdrv1, "host/tenant");
+    throttle_group_register_bs(bdrv2, "host/tenant");
+    g_assert(!strcmp(throttle_group_get_name(bdrv1), "host/tenant"));
+
+    memset(&cfg1, 0, sizeof(cfg1));
+    cfg1.buckets[THROTTLE_OPS_TOTAL].avg = 1000;
+    g_assert(throttle_group_config_by_name("host", &cfg1));
+    g_assert(!throttle_group_config_by_name("nonexistent", &cfg1));
+
+    /* The weight and the reservation only apply to the member given */
+    cfg1.weight = 300;
+    cfg1.iops_reserved = 50;
+    throttle_group_config(bdrv1, &cfg1);
+
+    throttle_group_get_config(bdrv1, &cfg1);
+    throttle_group_get_config(bdrv2, &cfg2);
+    g_assert_cmpint(cfg1.weight, ==, 300);
+    g_assert(double_cmp(cfg1.iops_reserved, 50));
+    g_assert_cmpint(cfg2.weight, ==, THROTTLE_WEIGHT_DEFAULT);
+    g_assert(double_cmp(cfg2.iops_reserved, 0));
+    g_assert(!memcmp(cfg1.buckets, cfg2.buckets, sizeof(cfg1.buckets)));
+
+    /* A weight that is out of range is invalid */
+    cfg1.weight = THROTTLE_WEIGHT_MAX + 1;
+    g_assert(!throttle_is_valid(&cfg1));
+
+    throttle_group_unregister_bs(bdrv1);
+    throttle_group_unregister_bs(bdrv2);
+
+    /* The enclosing group goes away with the last nested one */
+    g_assert(!throttle_group_config_by_name("host", &cfg2));
+}
+
 int main(int argc, char **argv)
 {
     Error *local_error = NULL;
@@ -584,6 +655,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
     g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/compute_timer_tick", test_compute_timer_tick);
     g_test_add_func("/throttle/init",               test_init);
     g_test_add_func("/throttle/destroy",            test_destroy);
     g_test_add_func("/throttle/have_timer",         test_have_timer);
@@ -594,6 +666,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/group_shares",       test_group_shares);
     return g_test_run();
 }
 
@@ -0,0 +1,111 @@
+/*
+ * Timed average computation tests
+ *
+ * Copyright (c) 2015 QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <unistd.h>
+
+#include "qemu/timed-average.h"
+
+/* This is the clock for QEMU_CLOCK_VIRTUAL */
+static int64_t my_clock_value;
+
+int64_t cpu_get_clock(void)
+{
+    return my_clock_value;
+}
+
+static void account(TimedAverage *ta)
+{
+    timed_average_account(ta, 1);
+    timed_average_account(ta, 5);
+    timed_average_account(ta, 2);
+    timed_average_account(ta, 4);
+    timed_average_account(ta, 3);
+}
+
+static void test_average(void)
+{
+    TimedAverage ta;
+    uint64_t result;
+    int i;
+
+    /* we will compute some average on a period of 1 second */
+    timed_average_init(&ta, QEMU_CLOCK_VIRTUAL, NANOSECONDS_PER_SECOND);
+
+    result = timed_average_min(&ta);
+    g_assert(result == 0);
+    result = timed_average_avg(&ta);
+    g_assert(result == 0);
+    result = timed_average_max(&ta);
+    g_assert(result == 0);
+
+    for (i = 0; i < 100; i++) {
+        account(&ta);
+        result = timed_average_min(&ta);
+        g_assert(result == 1);
+        result = timed_average_avg(&ta);
+        g_assert(result == 3);
+        result = timed_average_max(&ta);
+        g_assert(result == 5);
+        my_clock_value += NANOSECONDS_PER_SECOND / 10;
+    }
+
+    my_clock_value += NANOSECONDS_PER_SECOND * 100;
+
+    result = timed_average_min(&ta);
+    g_assert(result == 0);
+    result = timed_average_avg(&ta);
+    g_assert(result == 0);
+    result = timed_average_max(&ta);
+    g_assert(result == 0);
+
+    for (i = 0; i < 100; i++) {
+        account(&ta);
+        result = timed_average_min(&ta);
+        g_assert(result == 1);
+        result = timed_average_avg(&ta);
+        g_assert(result == 3);
+        result = timed_average_max(&ta);
+        g_assert(result == 5);
+        my_clock_value += NANOSECONDS_PER_SECOND / 10;
+    }
+}
+
+static void test_window(void)
+{
+    TimedAverage ta;
+    uint64_t sum, elapsed;
+
+    timed_average_init(&ta, QEMU_CLOCK_VIRTUAL, NANOSECONDS_PER_SECOND);
+
+    /* An old value drops out once both windows have expired after it */
+    timed_average_account(&ta, 100);
+    my_clock_value += NANOSECONDS_PER_SECOND * 8 / 10;
+    timed_average_account(&ta, 10);
+    g_assert_cmpint(timed_average_max(&ta), ==, 100);
+
+    my_clock_value += NANOSECONDS_PER_SECOND * 6 / 10;
+    timed_average_account(&ta, 20);
+    g_assert_cmpint(timed_average_max(&ta), ==, 20);
+    g_assert_cmpint(timed_average_min(&ta), ==, 10);
+
+    /* The reported window never covers more than 4/3 of the period */
+    sum = timed_average_sum(&ta, &elapsed);
+    g_assert_cmpint(sum, ==, 30);
+    g_assert_cmpint(elapsed, >, 0);
+    g_assert_cmpint(elapsed, <=, NANOSECONDS_PER_SECOND * 4 / 3);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timed-average/average", test_average);
+    g_test_add_func("/timed-average/window", test_window);
+    return g_test_run();
+}
@@ -482,6 +482,130 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+/* Arrays and buffers that are saved and loaded as one step */
+typedef struct TestArrays {
+    uint8_t  buf[5];
+    uint8_t  u8;
+    uint16_t u16[3];
+    uint32_t u32[2];
+    int32_t  i32;
+    uint64_t u64[2];
+} TestArrays;
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "test/arrays",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER(buf, TestArrays),
+        VMSTATE_UINT8(u8, TestArrays),
+        VMSTATE_UINT16_ARRAY(u16, TestArrays, 3),
+        VMSTATE_UINT32_ARRAY(u32, TestArrays, 2),
+        VMSTATE_INT32(i32, TestArrays),
+        VMSTATE_UINT64_ARRAY(u64, TestArrays, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+TestArrays obj_arrays = {
+    .buf = { 1, 2, 3, 4, 5 },
+    .u8 = 6,
+    .u16 = { 0x0708, 0x090a, 0x0b0c },
+    .u32 = { 0x0d0e0f10, 0x11121314 },
+    .i32 = -2,
+    .u64 = { 0x15161718191a1b1cULL, 0x1d1e1f2021222324ULL },
+};
+
+uint8_t wire_arrays[] = {
+    /* buf */  0x01, 0x02, 0x03, 0x04, 0x05,
+    /* u8 */   0x06,
+    /* u16 */  0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c,
+    /* u32 */  0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14,
+    /* i32 */  0xff, 0xff, 0xff, 0xfe,
+    /* u64 */  0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c,
+               0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_arrays_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArrays));
+}
+
+static void test_arrays(void)
+{
+    TestArrays obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_arrays, &obj_arrays);
+
+    compare_vmstate(wire_arrays, sizeof(wire_arrays));
+
+    SUCCESS(load_vmstate(&vmstate_arrays, &obj, &obj_clone,
+                         obj_arrays_copy, 1, wire_arrays,
+                         sizeof(wire_arrays)));
+    SUCCESS(memcmp(&obj, &obj_arrays, sizeof(obj)));
+}
+
+/* Device state in the shape of a PCI device with a handful of registers */
+typedef struct TestDevice {
+    uint8_t  config[256];
+    uint32_t regs[64];
+    uint16_t queue_size[8];
+    uint64_t queue_addr[8];
+    uint8_t  isr;
+    bool     enabled;
+} TestDevice;
+
+static const VMStateDescription vmstate_device = {
+    .name = "test/device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER(config, TestDevice),
+        VMSTATE_UINT32_ARRAY(regs, TestDevice, 64),
+        VMSTATE_UINT16_ARRAY(queue_size, TestDevice, 8),
+        VMSTATE_UINT64_ARRAY(queue_addr, TestDevice, 8),
+        VMSTATE_UINT8(isr, TestDevice),
+        VMSTATE_BOOL(enabled, TestDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_perf_device(void)
+{
+    TestDevice dev = { .isr = 1, .enabled = true };
+    QEMUSizedBuffer *qsb;
+    QEMUFile *f;
+    const int iterations = 100000;
+    double save_time, load_time;
+    int i;
+
+    qsb = qsb_create(NULL, 0);
+    f = qemu_bufopen("w", qsb);
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        vmstate_save_state(f, &vmstate_device, &dev, NULL);
+    }
+    qemu_fflush(f);
+    save_time = g_test_timer_elapsed();
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    f = qemu_bufopen("r", qsb);
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        SUCCESS(vmstate_load_state(f, &vmstate_device, &dev, 1));
+    }
+    load_time = g_test_timer_elapsed();
+    qemu_fclose(f);
+    g_assert_cmpint(dev.isr, ==, 1);
+
+    g_test_message("%d device states: save %.3f s, load %.3f s",
+                   iterations, save_time, load_time);
+    qsb_free(qsb);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -494,6 +618,10 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/batched/arrays", test_arrays);
+    if (g_test_perf()) {
+        g_test_add_func("/vmstate/perf/device", test_perf_device);
+    }
     g_test_run();
 
     close(temp_fd);
@@ -179,6 +179,104 @@ static void test_encode_decode(void)
     }
 }
 
+static const char *accel_names[] = { "long", "sse2", "neon", "avx2" };
+
+/* Change random runs of bytes, of random length, in a copy of a page */
+static void fill_random_runs(uint8_t *old, uint8_t *new, int runs)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGE_SIZE);
+
+    for (i = 0; i < runs; i++) {
+        int pos = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, 100);
+
+        while (len-- && pos < PAGE_SIZE) {
+            new[pos++] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/* All the run search implementations must give the same encoding */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, ref_len, dlen;
+
+    for (i = 0; i < 10000; i++) {
+        fill_random_runs(old, new, g_test_rand_int_range(0, 64));
+
+        g_assert(xbzrle_set_accel("long"));
+        ref_len = xbzrle_encode_buffer(old, new, PAGE_SIZE, ref, PAGE_SIZE);
+
+        for (j = 1; j < ARRAY_SIZE(accel_names); j++) {
+            if (!xbzrle_set_accel(accel_names[j])) {
+                continue;
+            }
+            dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            g_assert_cmpint(dlen, ==, ref_len);
+            if (dlen > 0) {
+                g_assert(memcmp(compressed, ref, dlen) == 0);
+            }
+        }
+    }
+    g_assert(xbzrle_set_accel("auto"));
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
+static void perf_encode_decode(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    unsigned int i, j, max = 100000;
+    int dlen = 0;
+    double duration;
+
+    fill_random_runs(old, new, 32);
+
+    for (j = 0; j < ARRAY_SIZE(accel_names); j++) {
+        if (!xbzrle_set_accel(accel_names[j])) {
+            continue;
+        }
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            dlen = xbzrle_encode_buffer(old, new, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+        }
+        duration = g_test_timer_elapsed();
+        g_test_message("Encode (%s) %u pages: %f s, %f MB/s\n",
+                       accel_names[j], max, duration,
+                       max * (double)PAGE_SIZE / duration / 1e6);
+    }
+    xbzrle_set_accel("auto");
+
+    g_assert(dlen > 0);
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        xbzrle_decode_buffer(compressed, dlen, old, PAGE_SIZE);
+    }
+    duration = g_test_timer_elapsed();
+    g_test_message("Decode %u pages: %f s, %f MB/s\n", max, duration,
+                   max * (double)PAGE_SIZE / duration / 1e6);
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +289,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode_decode", perf_encode_decode);
+    }
 
     return g_test_run();
 }
@@ -724,6 +724,101 @@ static void pci_hotplug(void)
     test_end();
 }
 
+#define PERF_DEPTH          16
+#define PERF_REQUESTS       4096
+#define PERF_CHAIN_SEGS     32
+
+/*
+ * Send PERF_REQUESTS reads of 512 bytes, PERF_DEPTH at a time with one kick
+ * each, and report requests per second.  With @segs > 1, the data buffer of
+ * every request is split into that many descriptors to stress the walk of
+ * descriptor chains.  Every access goes through qtest, so the numbers are
+ * only comparable between runs on the same host.
+ */
+static void pci_perf(int segs)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QVirtQueue *vq;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t req_addr[PERF_DEPTH];
+    uint32_t features, free_head;
+    uint16_t used_idx = 0;
+    int depth, done, i, j;
+    double duration;
+
+    bus = pci_test_start();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+    vq = &vqpci->vq;
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX | QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Each request takes a header, @segs data and a status descriptor */
+    depth = MIN(PERF_DEPTH, vq->size / (segs + 2));
+    g_assert_cmpint(512 % segs, ==, 0);
+
+    for (i = 0; i < depth; i++) {
+        req.type = QVIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+        g_free(req.data);
+    }
+
+    g_test_timer_start();
+    for (done = 0; done < PERF_REQUESTS; done += depth) {
+        for (i = 0; i < depth; i++) {
+            free_head = qvirtqueue_add(vq, req_addr[i], 16, false, true);
+            for (j = 0; j < segs; j++) {
+                qvirtqueue_add(vq, req_addr[i] + 16 + j * (512 / segs),
+                               512 / segs, true, true);
+            }
+            qvirtqueue_add(vq, req_addr[i] + 528, 1, true, false);
+            qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+        }
+        used_idx += depth;
+        qvirtqueue_wait_used(vq, used_idx, QVIRTIO_BLK_TIMEOUT_US);
+        qvirtqueue_reclaim(vq);
+    }
+    duration = g_test_timer_elapsed();
+
+    for (i = 0; i < depth; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+    g_test_message("virtio-blk %d reads, %d data descriptors each, %d in "
+                   "flight: %f s, %f requests/s\n", done, segs, depth,
+                   duration, done / duration);
+
+    guest_free(alloc, vq->desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+static void pci_perf_kick(void)
+{
+    pci_perf(1);
+}
+
+static void pci_perf_chain(void)
+{
+    pci_perf(PERF_CHAIN_SEGS);
+}
+
 static void mmio_basic(void)
 {
     QVirtioMMIODevice *dev;
@@ -779,6 +874,10 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        if (g_test_perf()) {
+            qtest_add_func("/virtio/blk/pci/perf/kick", pci_perf_kick);
+            qtest_add_func("/virtio/blk/pci/perf/chain", pci_perf_chain);
+        }
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
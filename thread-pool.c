@@ -18,6 +18,7 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "block/coroutine.h"
 #include "trace.h"
 #include "block/thread-pool.h"
@@ -26,6 +27,9 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
+
+#define THREAD_POOL_MAX_THREADS 64
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,68 +43,195 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* The queue the request was submitted to.  */
+    ThreadPoolQueue *queue;
+
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Pushed atomically when the request completes or is canceled.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/* Each worker owns a queue, so that submitting and dequeuing requests
+ * do not all serialize on one lock.  A worker whose queue is empty
+ * steals from the others.
+ */
+struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) reqs;
+    bool owned;          /* protected by the pool lock */
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
+    QemuSemaphore sem;   /* counts the queued requests */
     int max_threads;
     QEMUBH *new_thread_bh;
 
+    ThreadPoolQueue queues[THREAD_POOL_MAX_THREADS];
+
+    /* Completed requests, pushed by the workers.  Only the push that
+     * finds the list empty schedules completion_bh, so a burst of
+     * completions costs a single notification.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+    unsigned next_queue;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    /* The following variables are protected by lock.  Submitters and
+     * idle workers also read cur_threads, idle_threads and stopping
+     * without it.
+     */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
+    unsigned long *host_cpus;  /* worker affinity, NULL to inherit */
+    unsigned long nb_host_cpus;
+    unsigned affinity_gen;
 };
 
+/* Runs with lock taken.  */
+static void thread_pool_apply_affinity(ThreadPool *pool, unsigned *gen)
+{
+    QemuThread self;
+    int ret;
+
+    *gen = pool->affinity_gen;
+    if (!pool->host_cpus) {
+        return;
+    }
+
+    qemu_thread_get_self(&self);
+    ret = qemu_thread_set_affinity(&self, pool->host_cpus,
+                                   pool->nb_host_cpus);
+    if (ret < 0) {
+        trace_thread_pool_affinity_failed(pool, ret);
+    }
+}
+
+/* Runs with lock taken.  */
+static bool thread_pool_has_queued(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        if (atomic_read(&pool->queues[i].reqs.tqh_first)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Take a request off our own queue, or else off the queue of another
+ * worker.  The caller consumed a semaphore count, so a request is
+ * queued somewhere; another worker may get it first, but then that
+ * worker's count belongs to one more request that we will find.
+ */
+static ThreadPoolElement *thread_pool_get_request(ThreadPool *pool,
+                                                  int self)
+{
+    ThreadPoolElement *req;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+            ThreadPoolQueue *q =
+                &pool->queues[(self + i) % THREAD_POOL_MAX_THREADS];
+
+            if (!atomic_read(&q->reqs.tqh_first)) {
+                continue;
+            }
+            qemu_mutex_lock(&q->lock);
+            req = QTAILQ_FIRST(&q->reqs);
+            if (req) {
+                QTAILQ_REMOVE(&q->reqs, req, reqs);
+                req->state = THREAD_ACTIVE;
+            }
+            qemu_mutex_unlock(&q->lock);
+            if (req) {
+                if (i) {
+                    trace_thread_pool_steal(pool, req, self);
+                }
+                return req;
+            }
+        }
+    }
+}
+
+static void thread_pool_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, req, done);
+    if (!QSLIST_NEXT(req, done)) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned gen;
+    int self;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
 
-    while (!pool->stopping) {
+    /* cur_threads <= THREAD_POOL_MAX_THREADS, so a queue is free */
+    self = 0;
+    while (pool->queues[self].owned) {
+        self++;
+    }
+    pool->queues[self].owned = true;
+    thread_pool_apply_affinity(pool, &gen);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+        atomic_inc(&pool->idle_threads);
+        ret = qemu_sem_timedwait(&pool->sem, 10000);
+        /* Full barrier: a submitter that does not see us idle anymore
+         * queued its request before we look at the queues below.
+         */
+        atomic_dec(&pool->idle_threads);
+
+        if (ret == -1 || atomic_read(&pool->stopping) ||
+            atomic_read(&pool->affinity_gen) != gen) {
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (pool->stopping ||
+                (ret == -1 && !thread_pool_has_queued(pool))) {
+                break;
+            }
+            if (gen != pool->affinity_gen) {
+                thread_pool_apply_affinity(pool, &gen);
+            }
+            qemu_mutex_unlock(&pool->lock);
+            if (ret == -1) {
+                continue;
+            }
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        req = thread_pool_get_request(pool, self);
 
         ret = req->func(req->arg);
 
@@ -109,11 +240,10 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
+        thread_pool_done(pool, req);
     }
 
+    pool->queues[self].owned = false;
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -163,33 +293,36 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    ThreadPoolElement *elem;
+
+    for (;;) {
+        if (QSLIST_EMPTY(&pool->completed)) {
+            /* Full barrier: read ret after the worker wrote it.  */
+            QSLIST_MOVE_ATOMIC(&pool->completed, &pool->done_list);
+            if (QSLIST_EMPTY(&pool->completed)) {
+                break;
+            }
         }
+        elem = QSLIST_FIRST(&pool->completed);
+        QSLIST_REMOVE_HEAD(&pool->completed, done);
+        assert(elem->state == THREAD_DONE);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
-             * wait for another request that completed at the same time.
+             * wait for another request of the batch.  Requests completed
+             * later schedule us themselves.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSLIST_EMPTY(&pool->completed)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
@@ -197,10 +330,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&q->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -208,14 +342,14 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        QTAILQ_REMOVE(&q->reqs, elem, reqs);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_done(pool, elem);
     }
 
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_unlock(&q->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -236,6 +370,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolQueue *q;
+    int nb_queues;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -247,12 +383,28 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Spread the requests over the queues of the running workers */
+    nb_queues = MIN(MAX(atomic_read(&pool->cur_threads), 1),
+                    THREAD_POOL_MAX_THREADS);
+    q = &pool->queues[pool->next_queue++ % nb_queues];
+    req->queue = q;
+
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->reqs, req, reqs);
+    qemu_mutex_unlock(&q->lock);
+
+    /* Pairs with the barrier in worker_thread(): either an idle worker
+     * sees the request, or we see that no worker is idle.
+     */
+    smp_mb();
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        atomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -287,6 +439,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -297,11 +451,14 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    pool->max_threads = THREAD_POOL_MAX_THREADS;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        qemu_mutex_init(&pool->queues[i].lock);
+        QTAILQ_INIT(&pool->queues[i].reqs);
+    }
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +470,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -336,8 +495,28 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
+    for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->host_cpus);
     g_free(pool);
 }
+
+void thread_pool_set_affinity(ThreadPool *pool, const unsigned long *host_cpus,
+                              unsigned long nbits)
+{
+    qemu_mutex_lock(&pool->lock);
+    g_free(pool->host_cpus);
+    pool->host_cpus = NULL;
+    pool->nb_host_cpus = 0;
+    if (host_cpus && !bitmap_empty(host_cpus, nbits)) {
+        pool->host_cpus = bitmap_new(nbits);
+        bitmap_copy(pool->host_cpus, host_cpus, nbits);
+        pool->nb_host_cpus = nbits;
+    }
+    atomic_inc(&pool->affinity_gen);
+    qemu_mutex_unlock(&pool->lock);
+}
@@ -142,10 +142,11 @@ static void trace_init_events(const char *fname)
     loc_pop(&loc);
 }
 
-bool trace_init_backends(const char *events, const char *file)
+bool trace_init_backends(const char *events, const char *file,
+                         bool file_mmap)
 {
 #ifdef CONFIG_TRACE_SIMPLE
-    if (!st_init(file)) {
+    if (!st_init(file, file_mmap)) {
         fprintf(stderr, "failed to initialize simple tracing backend.\n");
         return false;
     }
@@ -155,6 +156,11 @@ bool trace_init_backends(const char *events, const char *file)
                 "option not supported by the selected tracing backends\n");
         return false;
     }
+    if (file_mmap) {
+        fprintf(stderr, "error: -trace mmap=...: "
+                "option not supported by the selected tracing backends\n");
+        return false;
+    }
 #endif
 
 #ifdef CONFIG_TRACE_FTRACE
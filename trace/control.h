@@ -154,12 +154,15 @@ static void trace_event_set_state_dynamic(TraceEvent *ev, bool state);
  *          Corresponds to commandline option "-trace events=...".
  * @file:   Name of trace output file; may be NULL.
  *          Corresponds to commandline option "-trace file=...".
+ * @file_mmap: Whether to write the trace file through a shared mapping.
+ *          Corresponds to commandline option "-trace mmap=on".
  *
  * Initialize the tracing backend.
  *
  * Returns: Whether the backends could be successfully initialized.
  */
-bool trace_init_backends(const char *events, const char *file);
+bool trace_init_backends(const char *events, const char *file,
+                         bool file_mmap);
 
 
 #include "trace/control-internal.h"
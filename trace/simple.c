@@ -11,12 +11,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #ifndef _WIN32
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -33,9 +38,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -48,18 +50,52 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 64,      /* per thread, must be a power of 2 */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_MMAP_CHUNK = 4096 * 1024, /* the mapped trace file grows by this */
+};
+
+/*
+ * Each thread that traces gets a buffer of its own, so that recording an
+ * event takes no lock and no atomic operation: the thread is the only
+ * producer and the writeout thread the only consumer.  head and tail are
+ * free-running byte counts.
+ *
+ * Buffers are never freed.  When a thread exits, its buffer is handed over
+ * to the next thread that starts tracing.
+ */
+typedef struct TraceBuffer TraceBuffer;
+struct TraceBuffer {
+    uint8_t *data;              /* TRACE_BUF_LEN bytes */
+    unsigned int head;          /* written by the owner only */
+    unsigned int tail;          /* written by the writeout thread only */
+    unsigned int writeout_head; /* head seen by the writeout thread */
+    bool in_use;                /* owned by a thread */
+    bool busy;                  /* the owner is filling in a record */
+    bool kicked;                /* writeout thread woken up for this buffer */
+    TraceBuffer *next;
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+static TraceBuffer *trace_buffers;
+static __thread TraceBuffer *trace_thread_buf;
+
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
 
+/*
+ * With -trace file=...,mmap=on, the writeout thread copies the records into
+ * a shared mapping of the trace file instead of going through stdio.  The
+ * file is extended TRACE_MMAP_CHUNK bytes at a time, and cut down to what
+ * was written when it is closed.
+ */
+static bool trace_file_mmap;
+static int trace_fd = -1;
+static uint8_t *trace_map;
+static off_t trace_map_off;     /* file offset of trace_map */
+static size_t trace_map_used;   /* bytes written to trace_map */
+
 /* * Trace buffer entry */
 typedef struct {
     uint64_t event; /*   TraceEventID */
@@ -76,54 +112,216 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+#ifndef _WIN32
+static pthread_key_t trace_buffer_key;
+static pthread_once_t trace_buffer_key_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: let the next new thread take the buffer over */
+static void trace_buffer_release(void *opaque)
+{
+    TraceBuffer *buf = opaque;
+
+    trace_thread_buf = NULL;
+    atomic_mb_set(&buf->in_use, false);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void trace_buffer_key_init(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
+    pthread_key_create(&trace_buffer_key, trace_buffer_release);
+}
+#endif
+
+static TraceBuffer *trace_buffer_new(void)
+{
+    TraceBuffer *buf, *old;
+    void *data;
+
+    /* dont use g_malloc, can deadlock when traced */
+#ifdef _WIN32
+    data = malloc(TRACE_BUF_LEN);
+#else
+    data = mmap(NULL, TRACE_BUF_LEN, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        data = NULL;
+    }
+#endif
+    if (!data) {
+        return NULL;
+    }
+    buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+#ifdef _WIN32
+        free(data);
+#else
+        munmap(data, TRACE_BUF_LEN);
+#endif
+        return NULL;
+    }
+    buf->data = data;
+    buf->in_use = true;
+
+    do {
+        old = atomic_read(&trace_buffers);
+        buf->next = old;
+    } while (atomic_cmpxchg(&trace_buffers, old, buf) != old);
+    return buf;
+}
+
+/* Return the buffer of the calling thread, or NULL if none can be had */
+static TraceBuffer *trace_buffer_get(void)
+{
+    TraceBuffer *buf = trace_thread_buf;
+
+    if (likely(buf)) {
+        return buf;
+    }
+
+    for (buf = atomic_read(&trace_buffers); buf; buf = buf->next) {
+        if (!atomic_read(&buf->in_use) && !atomic_xchg(&buf->in_use, true)) {
+            break;
+        }
+    }
+    if (!buf) {
+        buf = trace_buffer_new();
+        if (!buf) {
+            return NULL;
         }
-        trace_buf[idx++] = 0;
-        num++;
     }
+
+#ifndef _WIN32
+    pthread_once(&trace_buffer_key_once, trace_buffer_key_init);
+    pthread_setspecific(trace_buffer_key, buf);
+#endif
+    trace_thread_buf = buf;
+    return buf;
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+
+static void read_from_buffer(TraceBuffer *buf, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t len = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, buf->data + off, len);
+    memcpy((uint8_t *)dataptr + len, buf->data, size - len);
+}
+
+static unsigned int write_to_buffer(TraceBuffer *buf, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t len = MIN(size, TRACE_BUF_LEN - off);
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
+    memcpy(buf->data + off, dataptr, len);
+    memcpy(buf->data, (const uint8_t *)dataptr + len, size - len);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
+#ifndef _WIN32
+/* Extend the trace file and map the chunk at @off */
+static bool trace_mmap_chunk(off_t off)
+{
+    void *map;
+
+    if (trace_map) {
+        munmap(trace_map, TRACE_MMAP_CHUNK);
+        trace_map = NULL;
+    }
+    /* On failure, the next write retries the same chunk */
+    trace_map_off = off;
+    trace_map_used = 0;
+    if (ftruncate(trace_fd, off + TRACE_MMAP_CHUNK) < 0) {
+        return false;
+    }
+    map = mmap(NULL, TRACE_MMAP_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED,
+               trace_fd, off);
+    if (map == MAP_FAILED) {
         return false;
     }
+    trace_map = map;
+    return true;
+}
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
+static bool trace_mmap_write(const void *dataptr, size_t size)
+{
+    const uint8_t *data_ptr = dataptr;
+    size_t len;
+
+    while (size) {
+        if (!trace_map) {
+            if (!trace_mmap_chunk(trace_map_off)) {
+                return false;
+            }
+        } else if (trace_map_used == TRACE_MMAP_CHUNK) {
+            if (!trace_mmap_chunk(trace_map_off + TRACE_MMAP_CHUNK)) {
+                return false;
+            }
+        }
+        len = MIN(size, TRACE_MMAP_CHUNK - trace_map_used);
+        memcpy(trace_map + trace_map_used, data_ptr, len);
+        trace_map_used += len;
+        data_ptr += len;
+        size -= len;
+    }
     return true;
 }
+#endif
+
+static bool trace_file_is_open(void)
+{
+    return trace_fp || trace_fd >= 0;
+}
+
+static bool trace_file_open(const char *name)
+{
+#ifndef _WIN32
+    if (trace_file_mmap) {
+        trace_fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (trace_fd < 0) {
+            return false;
+        }
+        if (!trace_mmap_chunk(0)) {
+            close(trace_fd);
+            trace_fd = -1;
+            return false;
+        }
+        return true;
+    }
+#endif
+    trace_fp = fopen(name, "wb");
+    return trace_fp != NULL;
+}
+
+static void trace_file_close(void)
+{
+#ifndef _WIN32
+    if (trace_fd >= 0) {
+        int unused __attribute__ ((unused));
+
+        if (trace_map) {
+            munmap(trace_map, TRACE_MMAP_CHUNK);
+            trace_map = NULL;
+        }
+        unused = ftruncate(trace_fd, trace_map_off + trace_map_used);
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+#endif
+    fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+static bool trace_file_write(const void *dataptr, size_t size)
+{
+#ifndef _WIN32
+    if (trace_fd >= 0) {
+        return trace_mmap_write(dataptr, size);
+    }
+#endif
+    return fwrite(dataptr, size, 1, trace_fp) == 1;
+}
 
 /**
  * Kick writeout thread
@@ -154,16 +352,58 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
+/*
+ * Write out the records published so far by all threads, oldest first so
+ * that the file stays sorted by timestamp.
+ */
+static void writeout_buffers(void)
+{
+    TraceBuffer *buffers = atomic_read(&trace_buffers);
+    TraceBuffer *buf, *oldest;
+    TraceRecord record, oldest_record;
+    unsigned int off;
+    size_t len;
+
+    for (buf = buffers; buf; buf = buf->next) {
+        atomic_set(&buf->kicked, false);
+        buf->writeout_head = atomic_read(&buf->head);
+    }
+    smp_rmb(); /* read memory barrier before accessing records */
+
+    for (;;) {
+        oldest = NULL;
+        for (buf = buffers; buf; buf = buf->next) {
+            if (buf->tail == buf->writeout_head) {
+                continue;
+            }
+            read_from_buffer(buf, buf->tail, &record, sizeof(record));
+            if (!oldest || record.timestamp_ns < oldest_record.timestamp_ns) {
+                oldest = buf;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+
+        off = oldest->tail % TRACE_BUF_LEN;
+        len = MIN(oldest_record.length, TRACE_BUF_LEN - off);
+        trace_file_write(oldest->data + off, len);
+        if (len < oldest_record.length) {
+            trace_file_write(oldest->data, oldest_record.length - len);
+        }
+        smp_mb(); /* done with the record before the owner reuses it */
+        atomic_set(&oldest->tail, oldest->tail + oldest_record.length);
+    }
+}
+
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
-    size_t unused __attribute__ ((unused));
 
     for (;;) {
         wait_for_trace_records_available();
@@ -178,108 +418,83 @@ static gpointer writeout_thread(gpointer opaque)
             } while (!g_atomic_int_compare_and_exchange(&dropped_events,
                                                         dropped_count, 0));
             dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+            trace_file_write(&dropped.rec, dropped.rec.length);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
-        }
+        writeout_buffers();
 
-        fflush(trace_fp);
+        if (trace_fp) {
+            fflush(trace_fp);
+        }
     }
     return NULL;
 }
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->buf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    TraceBuffer *buf = trace_buffer_get();
+    TraceRecord record = {
+        .event = event,
+        .timestamp_ns = get_clock(),
+        .length = sizeof(TraceRecord) + datasize,
+        .pid = trace_pid,
+    };
+
+    /* An event from a signal handler can interrupt the thread's own */
+    if (!buf || buf->busy) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
+    }
+    buf->busy = true;
+    barrier();
+
+    if (buf->head + record.length - atomic_read(&buf->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        buf->busy = false;
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
+    }
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->buf = buf;
+    rec->tbuf_idx = buf->head;
+    rec->rec_off = write_to_buffer(buf, buf->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+void trace_record_finish(TraceBufferRecord *rec)
 {
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
+    TraceBuffer *buf = rec->buf;
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&buf->head, rec->rec_off);
+    barrier();
+    buf->busy = false;
 
-void trace_record_finish(TraceBufferRecord *rec)
-{
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (rec->rec_off - atomic_read(&buf->tail) > TRACE_BUF_FLUSH_THRESHOLD &&
+        !atomic_read(&buf->kicked)) {
+        atomic_set(&buf->kicked, true);
         flush_trace_file(false);
     }
 }
 
 void st_set_trace_file_enabled(bool enable)
 {
-    if (enable == !!trace_fp) {
+    if (enable == trace_file_is_open()) {
         return; /* no change */
     }
 
@@ -296,14 +511,12 @@ void st_set_trace_file_enabled(bool enable)
             .header_version = HEADER_VERSION,
         };
 
-        trace_fp = fopen(trace_file_name, "wb");
-        if (!trace_fp) {
+        if (!trace_file_open(trace_file_name)) {
             return;
         }
 
-        if (fwrite(&header, sizeof header, 1, trace_fp) != 1) {
-            fclose(trace_fp);
-            trace_fp = NULL;
+        if (!trace_file_write(&header, sizeof header)) {
+            trace_file_close();
             return;
         }
 
@@ -311,8 +524,7 @@ void st_set_trace_file_enabled(bool enable)
         trace_writeout_enabled = true;
         flush_trace_file(false);
     } else {
-        fclose(trace_fp);
-        trace_fp = NULL;
+        trace_file_close();
     }
 }
 
@@ -340,8 +552,9 @@ bool st_set_trace_file(const char *file)
 
 void st_print_trace_file_status(FILE *stream, int (*stream_printf)(FILE *stream, const char *fmt, ...))
 {
-    stream_printf(stream, "Trace file \"%s\" %s.\n",
-                  trace_file_name, trace_fp ? "on" : "off");
+    stream_printf(stream, "Trace file \"%s\" %s%s.\n",
+                  trace_file_name, trace_file_is_open() ? "on" : "off",
+                  trace_file_mmap ? " (mapped)" : "");
 }
 
 void st_flush_trace_buffer(void)
@@ -349,6 +562,12 @@ void st_flush_trace_buffer(void)
     flush_trace_file(true);
 }
 
+/* Write out what is left and close the file, which cuts a mapped one down */
+static void st_exit(void)
+{
+    st_set_trace_file_enabled(false);
+}
+
 /* Helper function to create a thread with signals blocked.  Use glib's
  * portable threads since QEMU abstractions cannot be used due to reentrancy in
  * the tracer.  Also note the signal masking on POSIX hosts so that the thread
@@ -373,10 +592,18 @@ static GThread *trace_thread_create(GThreadFunc fn)
     return thread;
 }
 
-bool st_init(const char *file)
+bool st_init(const char *file, bool file_mmap)
 {
     GThread *thread;
 
+#ifdef _WIN32
+    if (file_mmap) {
+        fprintf(stderr, "error: -trace mmap=on: "
+                "not supported on this host\n");
+        return false;
+    }
+#endif
+    trace_file_mmap = file_mmap;
     trace_pid = getpid();
 
     thread = trace_thread_create(writeout_thread);
@@ -385,7 +612,7 @@ bool st_init(const char *file)
         return false;
     }
 
-    atexit(st_flush_trace_buffer);
+    atexit(st_exit);
     st_set_trace_file(file);
     return true;
 }
@@ -21,10 +21,11 @@
 void st_print_trace_file_status(FILE *stream, fprintf_function stream_printf);
 void st_set_trace_file_enabled(bool enable);
 bool st_set_trace_file(const char *file);
-bool st_init(const char *file);
+bool st_init(const char *file, bool file_mmap);
 void st_flush_trace_buffer(void);
 
 typedef struct {
+    struct TraceBuffer *buf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
@@ -55,6 +55,7 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "sysemu/stats.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -62,6 +63,14 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
+
+unsigned int tb_trace_threshold;
+bool tb_profile_enabled;
+unsigned int tb_smc_limit;
+
+/* perf map file, /tmp/perf-<pid>.map, see perfmap_init() */
+static FILE *perfmap;
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -73,14 +82,14 @@
 #undef DEBUG_TB_CHECK
 #endif
 
-#define SMC_BITMAP_USE_THRESHOLD 10
-
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
-    /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
+    /* number of guest writes that invalidated code in this page since
+       the last tb_flush(), see tb_smc_limit */
     unsigned int code_write_count;
+    /* the bytes of the page that hold code, built by the first write to
+       a page with TBs so that writes to the data around them are cheap */
     unsigned long *code_bitmap;
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
@@ -129,8 +138,36 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
-static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
-                         tb_page_addr_t phys_page2);
+/* Nesting depth of tb_lock() in the current thread.  The TB lock may be
+   taken recursively, e.g. tb_flush() can be called both by tb_gen_code()
+   and by code that runs outside the translator.  */
+static __thread int have_tb_lock;
+
+void tb_lock(void)
+{
+    if (have_tb_lock++ == 0) {
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+void tb_unlock(void)
+{
+    assert(have_tb_lock > 0);
+    if (--have_tb_lock == 0) {
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+/* Drop the TB lock if it is held by the current thread.  Used after a
+   longjmp out of code that may have taken it.  */
+void tb_lock_reset(void)
+{
+    if (have_tb_lock) {
+        have_tb_lock = 0;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void cpu_gen_init(void)
@@ -188,6 +225,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     s->code_time += profile_getclock();
     s->code_in_len += tb->size;
     s->code_out_len += gen_code_size;
+    s->guest_insn_count += tb->icount;
 #endif
 
 #ifdef DEBUG_DISAS
@@ -387,6 +425,10 @@ static void page_init(void)
 #endif
 }
 
+/* Look up the page descriptor for @index, allocating the missing levels
+   of the map if @alloc is set.  This does not need any lock: levels are
+   never freed, and a new level is published with a compare-and-swap so
+   that concurrent allocations of the same level agree on the winner.  */
 static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 {
     PageDesc *pd;
@@ -398,26 +440,38 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 
     /* Level 2..N-1.  */
     for (i = V_L1_SHIFT / V_L2_BITS - 1; i > 0; i--) {
-        void **p = *lp;
+        void **p = atomic_rcu_read(lp);
 
         if (p == NULL) {
+            void *existing;
+
             if (!alloc) {
                 return NULL;
             }
             p = g_new0(void *, V_L2_SIZE);
-            *lp = p;
+            existing = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                g_free(p);
+                p = existing;
+            }
         }
 
         lp = p + ((index >> (i * V_L2_BITS)) & (V_L2_SIZE - 1));
     }
 
-    pd = *lp;
+    pd = atomic_rcu_read(lp);
     if (pd == NULL) {
+        void *existing;
+
         if (!alloc) {
             return NULL;
         }
         pd = g_new0(PageDesc, V_L2_SIZE);
-        *lp = pd;
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            g_free(pd);
+            pd = existing;
+        }
     }
 
     return pd + (index & (V_L2_SIZE - 1));
@@ -648,6 +702,97 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+static TBPhysHash *tb_phys_hash_new(unsigned int bits, unsigned int link)
+{
+    TBPhysHash *table;
+
+    table = g_malloc0(sizeof(*table) + (sizeof(table->buckets[0]) << bits));
+    table->bits = bits;
+    table->link = link;
+    return table;
+}
+
+static uint64_t tb_hash(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc;
+
+    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    return tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+}
+
+static void tb_phys_hash_free(TBPhysHash *table)
+{
+    g_free(table);
+    atomic_set(&tcg_ctx.tb_ctx.tb_phys_hash_resizing, false);
+}
+
+/* Double the size of the physical hash table.  Readers may still be
+   walking the old table, so the TBs are chained into the new one through
+   the other link and the old table is only freed after a grace period.
+   The next resize reuses the old table's link, so it has to wait until
+   then.  Called with tb_lock held.  */
+static void tb_phys_hash_grow(void)
+{
+    TBPhysHash *old = tcg_ctx.tb_ctx.tb_phys_hash;
+    TBPhysHash *new;
+    TranslationBlock *tb, **ptb;
+    size_t i;
+
+    new = tb_phys_hash_new(old->bits + 1, !old->link);
+    for (i = 0; i < ((size_t)1 << old->bits); i++) {
+        for (tb = old->buckets[i]; tb; tb = tb->phys_hash_next[old->link]) {
+            ptb = tb_phys_hash_bucket(new, tb_hash(tb));
+            tb->phys_hash_next[new->link] = *ptb;
+            *ptb = tb;
+        }
+    }
+    tcg_ctx.tb_ctx.tb_phys_hash_resizing = true;
+    atomic_rcu_set(&tcg_ctx.tb_ctx.tb_phys_hash, new);
+    call_rcu(old, tb_phys_hash_free, rcu);
+}
+
+/* Split the translation buffer and the TB array into regions.  Each
+   region keeps room at its end for the largest possible TB, so that no
+   code spills over into the next one.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t n;
+    int i;
+
+    n = tcg_ctx.code_gen_buffer_size / CODE_GEN_MIN_REGION_SIZE;
+    ctx->nb_regions = n > CODE_GEN_MAX_REGIONS ? CODE_GEN_MAX_REGIONS :
+                      n < 1 ? 1 : n;
+    ctx->region_size = (tcg_ctx.code_gen_buffer_size / ctx->nb_regions) &
+        ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / ctx->nb_regions;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->code_start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->code_end = r->code_start;
+        if (i == ctx->nb_regions - 1) {
+            r->code_max = tcg_ctx.code_gen_buffer +
+                tcg_ctx.code_gen_buffer_max_size;
+        } else {
+            r->code_max = r->code_start + ctx->region_size -
+                (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+        }
+        r->first_tb = i * ctx->region_max_tbs;
+        r->nb_tbs = 0;
+    }
+    ctx->cur_region = 0;
+}
+
+static void *tb_region_code_end(TBRegion *r)
+{
+    if (r == &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region]) {
+        return tcg_ctx.code_gen_ptr;
+    }
+    return r->code_end;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -671,18 +816,49 @@ static inline void code_gen_alloc(size_t tb_size)
 
     tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    /* Provide slots for TBs of half the average size, so that a region of
+       small TBs does not run out of slots long before it runs out of code.
+       The arrays are large enough to be mmap-ed by the allocator, and only
+       the pages of the slots that are used get backed by memory.  */
+    QEMU_BUILD_BUG_ON(offsetof(TranslationBlock, tc_ptr) > TB_ALIGN);
     tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
-            CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs =
-            g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+            (CODE_GEN_AVG_BLOCK_SIZE / 2);
+    tcg_ctx.tb_ctx.tbs = qemu_memalign(TB_ALIGN, tcg_ctx.code_gen_max_blocks *
+                                                 sizeof(TranslationBlock));
+    tcg_ctx.tb_ctx.tb_counters = g_new0(TBCounters,
+                                        tcg_ctx.code_gen_max_blocks);
+    tb_regions_init();
+    tcg_ctx.tb_ctx.tb_phys_hash_max_bits =
+        MIN(MAX(64 - clz64(tcg_ctx.code_gen_max_blocks - 1),
+                CODE_GEN_PHYS_HASH_MIN_BITS),
+            CODE_GEN_PHYS_HASH_MAX_BITS);
+    tcg_ctx.tb_ctx.tb_phys_hash =
+        tb_phys_hash_new(CODE_GEN_PHYS_HASH_MIN_BITS, 0);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
+#if !defined(CONFIG_USER_ONLY)
+static void tcg_stats_query(StatsSink *sink, void *opaque)
+{
+    tb_lock();
+    stats_add_instance(sink, "tcg");
+    stats_add_counter(sink, "tbs", tcg_ctx.tb_ctx.nb_tbs);
+    stats_add_counter(sink, "tb-flushes", tcg_ctx.tb_ctx.tb_flush_count);
+    stats_add_counter(sink, "tb-region-evictions",
+                      tcg_ctx.tb_ctx.tb_evict_count);
+    stats_add_counter(sink, "tb-invalidations",
+                      tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    stats_add_counter(sink, "tlb-flushes", tlb_flush_count);
+    tb_unlock();
+}
+#endif
+
 void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
     code_gen_alloc(tb_size);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
@@ -692,6 +868,9 @@ void tcg_exec_init(unsigned long tb_size)
        initialize the prologue now.  */
     tcg_prologue_init(&tcg_ctx);
 #endif
+#if !defined(CONFIG_USER_ONLY)
+    stats_register_provider(STATS_PROVIDER_TCG, tcg_stats_query, NULL);
+#endif
 }
 
 bool tcg_enabled(void)
@@ -699,31 +878,38 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
-static TranslationBlock *tb_alloc(target_ulong pc)
+/* Allocate a new translation block in the current region.  Returns NULL
+   if the region has too many translation blocks or too much generated
+   code, in which case the next region must be evicted.  */
+TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tcg_ctx.tb_ctx.region_max_tbs ||
+        tcg_ctx.code_gen_ptr >= r->code_max) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tcg_ctx.tb_ctx.tbs[r->first_tb + r->nb_tbs++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    memset(tb_counters(tb), 0, sizeof(TBCounters));
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 &&
+            tb == &tcg_ctx.tb_ctx.tbs[r->first_tb + r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -734,7 +920,6 @@ static inline void invalidate_page_bitmap(PageDesc *p)
         g_free(p->code_bitmap);
         p->code_bitmap = NULL;
     }
-    p->code_write_count = 0;
 }
 
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
@@ -750,6 +935,7 @@ static void page_flush_tb_1(int level, void **lp)
 
         for (i = 0; i < V_L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
+            pd[i].code_write_count = 0;
             invalidate_page_bitmap(pd + i);
         }
     } else {
@@ -771,9 +957,9 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(CPUState *cpu)
 {
+    tb_lock();
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -786,30 +972,144 @@ void tb_flush(CPUState *cpu)
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_regions_init();
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    memset(tcg_ctx.tb_ctx.tb_phys_hash->buckets, 0,
+           sizeof(TranslationBlock *) << tcg_ctx.tb_ctx.tb_phys_hash->bits);
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tb_unlock();
+}
+
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_flush_safe(void *data)
+{
+    int flush_count = GPOINTER_TO_INT(data);
+
+    /* Several vCPUs may have run out of space at the same time; only
+       the first of the queued requests needs to do anything.  */
+    if (tcg_ctx.tb_ctx.tb_flush_count == flush_count) {
+        do_tb_flush(first_cpu);
+    }
+}
+#endif
+
+/* In multi-threaded TCG mode other vCPUs may be executing code from the
+   buffer, so the flush is deferred until all of them are out of the way.
+   Callers that are in the middle of translating must then leave the
+   execution loop, see tb_gen_code().  */
+void tb_flush(CPUState *cpu)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        int flush_count = tcg_ctx.tb_ctx.tb_flush_count;
+
+        async_safe_run_on_cpu(cpu, do_tb_flush_safe,
+                              GINT_TO_POINTER(flush_count));
+        return;
+    }
+#endif
+    do_tb_flush(cpu);
+}
+
+/* Translate a hot TB again as a trace.  The target translator may then
+   continue through direct jumps instead of ending the block there, so
+   that the TCG optimizer works on the longer sequence.  */
+TranslationBlock *tb_gen_trace(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc, cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+    int cflags = tb->cflags & ~CF_USE_ICOUNT;
+
+    tb_lock();
+    /* another vCPU may have beaten us to it */
+    if (!tb->invalid) {
+        tb_phys_invalidate(tb, -1);
+        tb = tb_gen_code(cpu, pc, cs_base, flags, cflags | CF_TRACE);
+        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+        tcg_ctx.tb_ctx.tb_trace_count++;
+    }
+    tb_unlock();
+    return tb;
+}
+
+/* Make the region after the current one empty and start filling it.
+   Since regions are filled in turn, this is the one that was filled the
+   longest time ago; its TBs are invalidated one by one, so code in the
+   other regions stays valid.  */
+static void do_tb_evict(CPUState *cpu)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int i;
+
+    tb_lock();
+    ctx->regions[ctx->cur_region].code_end = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &ctx->tbs[r->first_tb + i];
+
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->code_end = r->code_start;
+    tcg_ctx.code_gen_ptr = r->code_start;
+    ctx->tb_evict_count++;
+    tb_unlock();
+}
+
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_evict_safe(void *data)
+{
+    int evict_count = GPOINTER_TO_INT(data);
+
+    if (tcg_ctx.tb_ctx.tb_evict_count == evict_count) {
+        do_tb_evict(first_cpu);
+    }
+}
+#endif
+
+/* Called when the current region is full.  Like tb_flush(), the eviction
+   is deferred in multi-threaded TCG mode. */
+static void tb_evict(CPUState *cpu)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        int evict_count = tcg_ctx.tb_ctx.tb_evict_count;
+
+        async_safe_run_on_cpu(cpu, do_tb_evict_safe,
+                              GINT_TO_POINTER(evict_count));
+        return;
+    }
+#endif
+    do_tb_evict(cpu);
 }
 
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
 {
+    TBPhysHash *table = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
-    int i;
+    size_t i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < ((size_t)1 << table->bits); i++) {
+        for (tb = table->buckets[i]; tb != NULL;
+                tb = tb->phys_hash_next[table->link]) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -823,12 +1123,14 @@ static void tb_invalidate_check(target_ulong address)
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
+    TBPhysHash *table = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb;
-    int i, flags1, flags2;
+    int flags1, flags2;
+    size_t i;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
+    for (i = 0; i < ((size_t)1 << table->bits); i++) {
+        for (tb = table->buckets[i]; tb != NULL;
+                tb = tb->phys_hash_next[table->link]) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -841,17 +1143,20 @@ static void tb_page_check(void)
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb,
+                                  unsigned int link)
 {
     TranslationBlock *tb1;
 
     for (;;) {
         tb1 = *ptb;
         if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
+            /* concurrent readers may still be looking at tb, so leave
+               its own link alone */
+            atomic_set(ptb, tb1->phys_hash_next[link]);
             break;
         }
-        ptb = &tb1->phys_hash_next;
+        ptb = &tb1->phys_hash_next[link];
     }
 }
 
@@ -914,24 +1219,23 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
+    TBPhysHash *table = tcg_ctx.tb_ctx.tb_phys_hash;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    /* remove the TB from the hash list; lock-free lookups that already
+       reached it skip it because of the invalid flag */
+    atomic_set(&tb->invalid, true);
+    tb_hash_remove(tb_phys_hash_bucket(table, tb_hash(tb)), tb, table->link);
 
-    /* remove the TB from the page list */
+    /* remove the TB from the page list; the code bitmap of the page keeps
+       its bytes until it is rebuilt */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
@@ -939,8 +1243,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -966,35 +1270,73 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
+/* Mark the bytes of @tb that are in its page @n in the code bitmap */
+static void tb_set_page_bitmap(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
+/*
+ * The code bitmap of a page tells writes to it which bytes hold guest
+ * code, so that the others do not walk the TB list.  New TBs add their
+ * bytes to it, while invalidated TBs leave theirs set: a superset is
+ * still correct, and the bitmap is rebuilt by the next write that has to
+ * walk the list anyway.
+ */
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    if (p->code_bitmap) {
+        bitmap_zero(p->code_bitmap, TARGET_PAGE_SIZE);
+    } else {
+        p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        tb_set_page_bitmap(p, tb, n);
         tb = tb->page_next[n];
     }
 }
 
+/* Whether the code in the page at @page_addr was rewritten too often to
+   be worth caching, see cpu_exec() for how CF_SMC_SLOW TBs are run.  */
+static bool tb_page_smc_slow(tb_page_addr_t page_addr)
+{
+    PageDesc *p = page_find(page_addr >> TARGET_PAGE_BITS);
+
+    return p && p->code_write_count >= tb_smc_limit;
+}
+
+/* Write a line for @tb to the perf map, so that "perf report" can
+   attribute samples in the code buffer to guest code.  */
+static void tb_perfmap_add(TranslationBlock *tb)
+{
+    if (perfmap) {
+        fprintf(perfmap, "%" PRIxPTR " %" PRIx32 " tb-" TARGET_FMT_lx "\n",
+                (uintptr_t)tb->tc_ptr, tb->tc_size, tb->pc);
+    }
+}
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1004,15 +1346,47 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t ti = 0;
 
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (unlikely(tb_smc_limit) && !(cflags & CF_NOCACHE) &&
+        tb_page_smc_slow(phys_pc)) {
+        /* one instruction at a time, thrown away after it ran */
+        cflags = (cflags & ~(CF_COUNT_MASK | CF_TRACE)) | CF_SMC_SLOW | 1;
+        tcg_ctx.tb_ctx.tb_smc_slow_count++;
+    }
+#ifdef CONFIG_USER_ONLY
+    /* the cached code has no execution counter */
+    if (tcg_ctx.code_relocs && !tb_profile_enabled) {
+        tb = tb_cache_lookup(pc, cs_base, flags, cflags);
+        if (tb) {
+            tb_perfmap_add(tb);
+            return tb;
+        }
+    }
+#endif
+    if (tb_profile_enabled) {
+        ti = get_clock();
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(cpu);
+#if !defined(CONFIG_USER_ONLY)
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction only happens once every vCPU has left the
+               execution loop, so make this one leave as well.  Queueing
+               it needs the global mutex, which must never be taken while
+               holding the TB lock.  */
+            tb_lock_reset();
+            tb_evict(cpu);
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
+        /* make room in the next region */
+        tb_evict(cpu);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1022,7 +1396,15 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tcg_ctx.nb_code_relocs = 0;
     cpu_gen_code(env, tb, &code_gen_size);
+    tb->tc_size = code_gen_size;
+#ifdef CONFIG_USER_ONLY
+    if (tcg_ctx.code_relocs && !tb_profile_enabled) {
+        tb_cache_record(tb, code_gen_size);
+    }
+#endif
+    tb_perfmap_add(tb);
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1033,6 +1415,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+
+    if (tb_profile_enabled) {
+        tcg_ctx.tb_ctx.prof_translate_count++;
+        tcg_ctx.tb_ctx.prof_translate_time += get_clock() - ti;
+    }
     return tb;
 }
 
@@ -1171,6 +1558,8 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
     PageDesc *p;
+    unsigned int nr;
+    unsigned long b;
 
 #if 0
     if (1) {
@@ -1185,23 +1574,23 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
-    if (!p->code_bitmap &&
-        ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
-        /* build code bitmap */
+    if (!p->first_tb) {
+        /* the code is gone, let the page be written at full speed */
+        tb_invalidate_phys_page_range(start, start + len, 1);
+        return;
+    }
+    if (!p->code_bitmap) {
         build_page_bitmap(p);
     }
-    if (p->code_bitmap) {
-        unsigned int nr;
-        unsigned long b;
-
-        nr = start & ~TARGET_PAGE_MASK;
-        b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
-        }
-    } else {
-    do_invalidate:
+    nr = start & ~TARGET_PAGE_MASK;
+    b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
+    if (b & ((1 << len) - 1)) {
+        p->code_write_count++;
         tb_invalidate_phys_page_range(start, start + len, 1);
+        /* Drop the bytes of the TBs invalidated so far */
+        if (p->code_bitmap) {
+            build_page_bitmap(p);
+        }
     }
 }
 
@@ -1229,6 +1618,9 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         return;
     }
     tb = p->first_tb;
+    if (tb) {
+        p->code_write_count++;
+    }
 #ifdef TARGET_HAS_PRECISE_SMC
     if (tb && pc != 0) {
         current_tb = tb_find_pc(pc);
@@ -1291,7 +1683,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        tb_set_page_bitmap(p, tb, n);
+    }
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1311,7 +1705,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
                 continue;
             }
             prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
+            atomic_set(&p2->flags, p2->flags & ~PAGE_WRITE);
           }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
@@ -1332,20 +1726,15 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
-static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
-                         tb_page_addr_t phys_page2)
+void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
+                  tb_page_addr_t phys_page2)
 {
-    unsigned int h;
+    TBPhysHash *table;
     TranslationBlock **ptb;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1367,6 +1756,19 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the physical hash table, last because lookups do not take
+       tb_lock and the TB must be complete when they see it */
+    table = tcg_ctx.tb_ctx.tb_phys_hash;
+    ptb = tb_phys_hash_bucket(table, tb_hash(tb));
+    tb->phys_hash_next[table->link] = *ptb;
+    atomic_rcu_set(ptb, tb);
+
+    if (tcg_ctx.tb_ctx.nb_tbs > (2 << table->bits) &&
+        table->bits < tcg_ctx.tb_ctx.tb_phys_hash_max_bits &&
+        !atomic_read(&tcg_ctx.tb_ctx.tb_phys_hash_resizing)) {
+        tb_phys_hash_grow();
+    }
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1380,17 +1782,25 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
+    size_t i;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* TBs are sorted by tc_ptr within a region */
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+        tcg_ctx.tb_ctx.region_size;
+    if (i >= tcg_ctx.tb_ctx.nb_regions) {
+        i = tcg_ctx.tb_ctx.nb_regions - 1;
+    }
+    r = &tcg_ctx.tb_ctx.regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_code_end(r)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
         tb = &tcg_ctx.tb_ctx.tbs[m];
@@ -1422,7 +1832,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1450,6 +1862,93 @@ void tb_check_watchpoint(CPUState *cpu)
     }
 }
 
+void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    int i, target_code_size, max_target_code_size;
+    int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t host_code_size;
+    TranslationBlock *tb;
+
+    tb_lock();
+
+    target_code_size = 0;
+    max_target_code_size = 0;
+    cross_page = 0;
+    direct_jmp_count = 0;
+    direct_jmp2_count = 0;
+    host_code_size = 0;
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions * tcg_ctx.tb_ctx.region_max_tbs;
+         i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i /
+                                              tcg_ctx.tb_ctx.region_max_tbs];
+
+        if (i == r->first_tb) {
+            host_code_size += tb_region_code_end(r) - r->code_start;
+        }
+        if (i - r->first_tb >= r->nb_tbs) {
+            continue;
+        }
+        tb = &tcg_ctx.tb_ctx.tbs[i];
+        target_code_size += tb->size;
+        if (tb->size > max_target_code_size) {
+            max_target_code_size = tb->size;
+        }
+        if (tb->page_addr[1] != -1) {
+            cross_page++;
+        }
+        if (tb->tb_next_offset[0] != 0xffff) {
+            direct_jmp_count++;
+            if (tb->tb_next_offset[1] != 0xffff) {
+                direct_jmp2_count++;
+            }
+        }
+    }
+    /* XXX: avoid using doubles ? */
+    cpu_fprintf(f, "Translation buffer state:\n");
+    cpu_fprintf(f, "gen code size       %td/%zd\n",
+                host_code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "TB count            %d/%d\n",
+            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+    cpu_fprintf(f, "TB hash buckets     %u (max %u)\n",
+            1u << tcg_ctx.tb_ctx.tb_phys_hash->bits,
+            1u << tcg_ctx.tb_ctx.tb_phys_hash_max_bits);
+    cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
+            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
+                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            max_target_code_size);
+    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? host_code_size /
+                                     tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) host_code_size /
+                                             target_code_size : 0);
+    cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
+            tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
+                direct_jmp_count,
+                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
+                        tcg_ctx.tb_ctx.nb_tbs : 0,
+                direct_jmp2_count,
+                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
+                        tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "\nStatistics:\n");
+    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB trace count      %d\n", tcg_ctx.tb_ctx.tb_trace_count);
+    cpu_fprintf(f, "TB region evictions %d (%d regions of %zd bytes)\n",
+            tcg_ctx.tb_ctx.tb_evict_count, tcg_ctx.tb_ctx.nb_regions,
+            tcg_ctx.tb_ctx.region_size);
+    cpu_fprintf(f, "TB invalidate count %d\n",
+            tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB SMC slow count   %d\n",
+            tcg_ctx.tb_ctx.tb_smc_slow_count);
+#ifndef CONFIG_USER_ONLY
+    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#endif
+    tcg_dump_info(f, cpu_fprintf);
+
+    tb_unlock();
+}
+
 #ifndef CONFIG_USER_ONLY
 /* mask must never be zero, except for A20 change call */
 static void tcg_handle_interrupt(CPUState *cpu, int mask)
@@ -1559,67 +2058,170 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
-void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
+
+/* Enabling or disabling TB profiling retranslates all code, so that the
+   execution counters are added to or removed from it.  */
+void tb_profile_set(bool enable)
 {
-    int i, target_code_size, max_target_code_size;
-    int direct_jmp_count, direct_jmp2_count, cross_page;
-    TranslationBlock *tb;
+    CPUState *cpu;
 
-    target_code_size = 0;
-    max_target_code_size = 0;
-    cross_page = 0;
-    direct_jmp_count = 0;
-    direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
+    if (enable == tb_profile_enabled) {
+        return;
+    }
+    tb_profile_enabled = enable;
+    if (enable) {
+        tb_profile_reset();
+    }
+    cpu = first_cpu;
+    if (cpu) {
+        tb_flush(cpu);
+    }
+}
+
+void tb_profile_reset(void)
+{
+    CPUState *cpu;
+    int i, j;
+
+    tb_lock();
+    /* only the slots in use, the others may not even be backed by memory */
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions; i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            tcg_ctx.tb_ctx.tb_counters[r->first_tb + j].prof_count = 0;
         }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
-            }
+    }
+    tcg_ctx.tb_ctx.prof_translate_count = 0;
+    tcg_ctx.tb_ctx.prof_translate_time = 0;
+    tb_unlock();
+
+    CPU_FOREACH(cpu) {
+        cpu->tb_profile_exec_time = 0;
+    }
+}
+
+void tb_profile_get_stats(TBProfileStats *stats)
+{
+    CPUState *cpu;
+
+    tb_lock();
+    stats->translate_count = tcg_ctx.tb_ctx.prof_translate_count;
+    stats->translate_time = tcg_ctx.tb_ctx.prof_translate_time;
+    tb_unlock();
+
+    stats->exec_time = 0;
+    CPU_FOREACH(cpu) {
+        stats->exec_time += cpu->tb_profile_exec_time;
+    }
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TBProfileEntry *ea = a;
+    const TBProfileEntry *eb = b;
+
+    if (ea->exec_count != eb->exec_count) {
+        return ea->exec_count > eb->exec_count ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Return in *entries the TBs that were executed at least once, most
+   executed first.  At most @max entries are returned if @max > 0.  The
+   caller frees *entries with g_free().  */
+int tb_profile_get_hot(TBProfileEntry **entries, int max)
+{
+    TBProfileEntry *e;
+    int i, n = 0;
+
+    tb_lock();
+    e = g_new(TBProfileEntry, tcg_ctx.tb_ctx.nb_tbs + 1);
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_regions * tcg_ctx.tb_ctx.region_max_tbs;
+         i++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[i /
+                                              tcg_ctx.tb_ctx.region_max_tbs];
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+
+        if (i - r->first_tb >= r->nb_tbs || tb->invalid ||
+            !tb_counters(tb)->prof_count || n >= tcg_ctx.tb_ctx.nb_tbs) {
+            continue;
         }
+        e[n].pc = tb->pc;
+        e[n].tc_ptr = tb->tc_ptr;
+        e[n].tc_size = tb->tc_size;
+        e[n].size = tb->size;
+        e[n].icount = tb->icount;
+        e[n].exec_count = tb_counters(tb)->prof_count;
+        n++;
+    }
+    tb_unlock();
+
+    qsort(e, n, sizeof(*e), tb_profile_cmp);
+    if (max > 0 && n > max) {
+        n = max;
+    }
+    *entries = e;
+    return n;
+}
+
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TBProfileStats stats;
+    TBProfileEntry *e;
+    uint64_t total = 0;
+    int i, n;
+
+    if (!tb_profile_enabled) {
+        cpu_fprintf(f, "TB profiling is disabled\n");
+        return;
     }
-    /* XXX: avoid using doubles ? */
-    cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
-    cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
-    cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
-            tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
-                    tcg_ctx.tb_ctx.nb_tbs : 0,
-            max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
-    cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
-            tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
-                                    tcg_ctx.tb_ctx.nb_tbs : 0);
-    cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
-                direct_jmp_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0,
-                direct_jmp2_count,
-                tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
-                        tcg_ctx.tb_ctx.nb_tbs : 0);
-    cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
-    cpu_fprintf(f, "TB invalidate count %d\n",
-            tcg_ctx.tb_ctx.tb_phys_invalidate_count);
-    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
-    tcg_dump_info(f, cpu_fprintf);
+
+    tb_profile_get_stats(&stats);
+    cpu_fprintf(f, "translated TBs      %" PRIu64 "\n",
+                stats.translate_count);
+    cpu_fprintf(f, "translation time    %0.3f s\n",
+                stats.translate_time / 1e9);
+    cpu_fprintf(f, "execution time      %0.3f s (including helpers)\n",
+                (stats.exec_time - stats.translate_time) / 1e9);
+
+    n = tb_profile_get_hot(&e, 0);
+    for (i = 0; i < n; i++) {
+        total += e[i].exec_count;
+    }
+    if (max > 0 && n > max) {
+        n = max;
+    }
+    cpu_fprintf(f, "\n%20s %7s  %-*s %5s %6s  %s\n",
+                "executions", "", TARGET_LONG_BITS / 4 + 2, "guest pc",
+                "insns", "host", "host code");
+    for (i = 0; i < n; i++) {
+        cpu_fprintf(f, "%20" PRIu64 " %6.2f%%  0x" TARGET_FMT_lx
+                    " %5u %6" PRIu32 "  %p\n",
+                    e[i].exec_count, e[i].exec_count * 100.0 / total,
+                    e[i].pc, e[i].icount, e[i].tc_size, e[i].tc_ptr);
+    }
+    g_free(e);
+}
+
+/* Open /tmp/perf-<pid>.map, where "perf report" looks for symbols of
+   JIT code.  Lines are only ever appended: once the buffer is flushed or
+   a region evicted, the map still has the old lines for the reused
+   addresses, and samples there may be attributed to an older TB.  */
+int perfmap_init(void)
+{
+    char name[64];
+    int ret;
+
+    snprintf(name, sizeof(name), "/tmp/perf-%d.map", getpid());
+    perfmap = fopen(name, "w");
+    if (!perfmap) {
+        ret = -errno;
+        error_report("Could not open %s: %s", name, strerror(-ret));
+        return ret;
+    }
+    setvbuf(perfmap, NULL, _IOLBF, 0);
+    return 0;
 }
 
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
@@ -1755,12 +2357,13 @@ int page_get_flags(target_ulong address)
     if (!p) {
         return 0;
     }
-    return p->flags;
+    return atomic_read(&p->flags);
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
    The flag PAGE_WRITE_ORG is positioned automatically depending
-   on PAGE_WRITE.  The mmap_lock should already be held.  */
+   on PAGE_WRITE.  The mmap_lock should already be held; readers such
+   as page_get_flags() do not take it.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
     target_ulong addr, len;
@@ -1792,7 +2395,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
             p->first_tb) {
             tb_invalidate_phys_page(addr, 0, NULL, false);
         }
-        p->flags = flags;
+        atomic_set(&p->flags, flags);
     }
 }
 
@@ -1801,6 +2404,7 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     PageDesc *p;
     target_ulong end;
     target_ulong addr;
+    int page_flags;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1828,20 +2432,21 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
         if (!p) {
             return -1;
         }
-        if (!(p->flags & PAGE_VALID)) {
+        page_flags = atomic_read(&p->flags);
+        if (!(page_flags & PAGE_VALID)) {
             return -1;
         }
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
+        if ((flags & PAGE_READ) && !(page_flags & PAGE_READ)) {
             return -1;
         }
         if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if (!(page_flags & PAGE_WRITE_ORG)) {
                 return -1;
             }
             /* unprotect the page if it was put read-only because it
                contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
+            if (!(page_flags & PAGE_WRITE)) {
                 if (!page_unprotect(addr, 0, NULL)) {
                     return -1;
                 }
@@ -1859,27 +2464,35 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
     PageDesc *p;
     target_ulong host_start, host_end, addr;
 
+    /* Faults on pages that were never writable are genuine and need
+       no lock; the page table can be walked without it.  */
+    p = page_find(address >> TARGET_PAGE_BITS);
+    if (!p || !(atomic_read(&p->flags) & PAGE_WRITE_ORG)) {
+        return 0;
+    }
+
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p) {
+    /* Several threads writing to the same page fault together; the
+       first one unprotects it and the others just retry the access.  */
+    if (p->flags & PAGE_WRITE) {
         mmap_unlock();
-        return 0;
+        return 1;
     }
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if (p->flags & PAGE_WRITE_ORG) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
+            atomic_set(&p->flags, p->flags | PAGE_WRITE);
             prot |= p->flags;
 
             /* and since the content will be modified, we must invalidate
@@ -493,6 +493,9 @@ static QemuOptsList qemu_spice_opts = {
         }, {
             .name = "seamless-migration",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "update-threads",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -551,6 +554,9 @@ SpiceInfo *qmp_query_spice(Error **errp)
     info->has_channels = true;
     info->channels = qmp_query_spice_channels();
 
+    info->displays = qemu_spice_query_displays();
+    info->has_displays = info->displays != NULL;
+
     return info;
 }
 
@@ -791,6 +797,8 @@ void qemu_spice_init(void)
 
     seamless_migration = qemu_opt_get_bool(opts, "seamless-migration", 0);
     spice_server_set_seamless_migration(spice_server, seamless_migration);
+    qemu_spice_display_set_update_threads(
+        qemu_opt_get_number(opts, "update-threads", 1));
     if (spice_server_init(spice_server, &core_interface) != 0) {
         error_report("failed to initialize spice server");
         exit(1);
@@ -125,16 +125,53 @@ void qemu_spice_wakeup(SimpleSpiceDisplay *ssd)
     spice_qxl_wakeup(&ssd->qxl);
 }
 
+/*
+ * Updates are created by the iothread and up to SPICE_UPDATE_MAX_THREADS
+ * - 1 helper threads, each one taking a band of the dirty rectangle.
+ * The iothread waits for all of them, so the bands only ever read the
+ * display surface while it cannot change.  They share no pixman image:
+ * pixman validates images lazily, which is not thread safe.
+ */
+#define SPICE_UPDATE_MAX_THREADS 16
+/* rows of a band, fewer are not worth a thread */
+#define SPICE_UPDATE_BAND_HEIGHT 64
+
+typedef struct SpiceUpdateBand {
+    SimpleSpiceDisplay *ssd;
+    int top, bottom;
+    QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
+} SpiceUpdateBand;
+
+static struct {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    SpiceUpdateBand *bands;
+    int nr_bands;
+    int next_band;
+    int bands_done;
+    int nr_threads;
+    bool started;
+} update_pool = {
+    .nr_threads = 1,
+};
+
+static QTAILQ_HEAD(, SimpleSpiceDisplay) spice_displays =
+    QTAILQ_HEAD_INITIALIZER(spice_displays);
+
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
+                                         SpiceUpdateBand *band,
                                          QXLRect *rect)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
     QXLImage *image;
     QXLCommand *cmd;
-    int bw, bh;
+    int bw, bh, y, bpp;
     struct timespec time_space;
-    pixman_image_t *dest;
+    pixman_image_t *src, *dest;
+    uint8_t *guest, *mirror;
+    int guest_stride, mirror_stride;
 
     trace_qemu_spice_create_update(
            rect->left, rect->right,
@@ -167,7 +204,7 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     drawable->u.copy.src_area.right  = bw;
     drawable->u.copy.src_area.bottom = bh;
 
-    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
+    /* the image id is set by qemu_spice_create_update() */
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
     image->bitmap.stride     = bw * 4;
@@ -177,42 +214,51 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
+    /* surface and mirror have the same format */
+    bpp = surface_bytes_per_pixel(ssd->ds);
+    guest = (uint8_t *)pixman_image_get_data(ssd->surface);
+    guest_stride = pixman_image_get_stride(ssd->surface);
+    mirror = (uint8_t *)pixman_image_get_data(ssd->mirror);
+    mirror_stride = pixman_image_get_stride(ssd->mirror);
+    guest += rect->top * guest_stride + rect->left * bpp;
+    mirror += rect->top * mirror_stride + rect->left * bpp;
+    for (y = 0; y < bh; y++) {
+        memcpy(mirror + y * mirror_stride, guest + y * guest_stride, bw * bpp);
+    }
+
+    src = pixman_image_create_bits(ssd->ds->format, bw, bh,
+                                   (void *)mirror, mirror_stride);
     dest = pixman_image_create_bits(PIXMAN_LE_x8r8g8b8, bw, bh,
                                     (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
-                           rect->left, rect->top, 0, 0,
-                           0, 0, bw, bh);
+    pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dest,
+                           0, 0, 0, 0, 0, 0, bw, bh);
+    pixman_image_unref(src);
     pixman_image_unref(dest);
 
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
 
-    QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
+    QTAILQ_INSERT_TAIL(&band->updates, update, next);
 }
 
-static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
+/* Compare the rows [band->top, band->bottom) of the dirty rectangle */
+static void qemu_spice_create_band_updates(SpiceUpdateBand *band)
 {
     static const int blksize = 32;
+    SimpleSpiceDisplay *ssd = band->ssd;
     int blocks = (surface_width(ssd->ds) + blksize - 1) / blksize;
     int dirty_top[blocks];
     int y, yoff1, yoff2, x, xoff, blk, bw;
     int bpp = surface_bytes_per_pixel(ssd->ds);
     uint8_t *guest, *mirror;
 
-    if (qemu_spice_rect_is_empty(&ssd->dirty)) {
-        return;
-    };
-
     for (blk = 0; blk < blocks; blk++) {
         dirty_top[blk] = -1;
     }
 
     guest = surface_data(ssd->ds);
     mirror = (void *)pixman_image_get_data(ssd->mirror);
-    for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
+    for (y = band->top; y < band->bottom; y++) {
         yoff1 = y * surface_stride(ssd->ds);
         yoff2 = y * pixman_image_get_stride(ssd->mirror);
         for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
@@ -229,7 +275,7 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
                         .left   = x,
                         .right  = x + bw,
                     };
-                    qemu_spice_create_one_update(ssd, &update);
+                    qemu_spice_create_one_update(ssd, band, &update);
                     dirty_top[blk] = -1;
                 }
             } else {
@@ -246,14 +292,140 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
         if (dirty_top[blk] != -1) {
             QXLRect update = {
                 .top    = dirty_top[blk],
-                .bottom = ssd->dirty.bottom,
+                .bottom = band->bottom,
                 .left   = x,
                 .right  = x + bw,
             };
-            qemu_spice_create_one_update(ssd, &update);
+            qemu_spice_create_one_update(ssd, band, &update);
             dirty_top[blk] = -1;
         }
     }
+}
+
+static void *qemu_spice_update_thread(void *opaque)
+{
+    SpiceUpdateBand *band;
+
+    qemu_mutex_lock(&update_pool.lock);
+    for (;;) {
+        while (update_pool.next_band >= update_pool.nr_bands) {
+            qemu_cond_wait(&update_pool.work_cond, &update_pool.lock);
+        }
+        band = &update_pool.bands[update_pool.next_band++];
+        qemu_mutex_unlock(&update_pool.lock);
+
+        qemu_spice_create_band_updates(band);
+
+        qemu_mutex_lock(&update_pool.lock);
+        if (++update_pool.bands_done == update_pool.nr_bands) {
+            qemu_cond_signal(&update_pool.done_cond);
+        }
+    }
+    return NULL;
+}
+
+void qemu_spice_display_set_update_threads(int nr_threads)
+{
+    assert(!update_pool.started);
+    update_pool.nr_threads = MAX(1, MIN(nr_threads, SPICE_UPDATE_MAX_THREADS));
+}
+
+static void qemu_spice_update_pool_start(void)
+{
+    QemuThread thread;
+    int i;
+
+    qemu_mutex_init(&update_pool.lock);
+    qemu_cond_init(&update_pool.work_cond);
+    qemu_cond_init(&update_pool.done_cond);
+    for (i = 1; i < update_pool.nr_threads; i++) {
+        qemu_thread_create(&thread, "spice-update", qemu_spice_update_thread,
+                           NULL, QEMU_THREAD_DETACHED);
+    }
+    update_pool.started = true;
+}
+
+/* Process all bands, with the help of the pool, and wait for them */
+static void qemu_spice_run_bands(SpiceUpdateBand *bands, int nr_bands)
+{
+    SpiceUpdateBand *band;
+
+    if (!update_pool.started) {
+        qemu_spice_update_pool_start();
+    }
+
+    qemu_mutex_lock(&update_pool.lock);
+    update_pool.bands = bands;
+    update_pool.nr_bands = nr_bands;
+    update_pool.next_band = 0;
+    update_pool.bands_done = 0;
+    qemu_cond_broadcast(&update_pool.work_cond);
+
+    while (update_pool.next_band < update_pool.nr_bands) {
+        band = &update_pool.bands[update_pool.next_band++];
+        qemu_mutex_unlock(&update_pool.lock);
+        qemu_spice_create_band_updates(band);
+        qemu_mutex_lock(&update_pool.lock);
+        update_pool.bands_done++;
+    }
+    while (update_pool.bands_done < update_pool.nr_bands) {
+        qemu_cond_wait(&update_pool.done_cond, &update_pool.lock);
+    }
+
+    update_pool.bands = NULL;
+    update_pool.nr_bands = 0;
+    update_pool.next_band = 0;
+    qemu_mutex_unlock(&update_pool.lock);
+}
+
+/* Called with ssd->lock held */
+static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
+{
+    SpiceUpdateBand bands[SPICE_UPDATE_MAX_THREADS];
+    SimpleSpiceUpdate *update;
+    int64_t start;
+    int i, nr_bands, rows, height;
+    bool frame = false;
+
+    if (qemu_spice_rect_is_empty(&ssd->dirty)) {
+        return;
+    };
+
+    start = get_clock();
+    rows = ssd->dirty.bottom - ssd->dirty.top;
+    nr_bands = MIN(update_pool.nr_threads,
+                   DIV_ROUND_UP(rows, SPICE_UPDATE_BAND_HEIGHT));
+    height = DIV_ROUND_UP(rows, nr_bands);
+    for (i = 0; i < nr_bands; i++) {
+        bands[i].ssd = ssd;
+        bands[i].top = ssd->dirty.top + i * height;
+        bands[i].bottom = MIN(bands[i].top + height, ssd->dirty.bottom);
+        QTAILQ_INIT(&bands[i].updates);
+    }
+
+    if (nr_bands == 1) {
+        qemu_spice_create_band_updates(&bands[0]);
+    } else {
+        qemu_spice_run_bands(bands, nr_bands);
+    }
+
+    /* hand the updates to spice in order, numbering their images */
+    for (i = 0; i < nr_bands; i++) {
+        while ((update = QTAILQ_FIRST(&bands[i].updates)) != NULL) {
+            QTAILQ_REMOVE(&bands[i].updates, update, next);
+            QXL_SET_IMAGE_ID(&update->image, QXL_IMAGE_GROUP_DEVICE,
+                             ssd->unique++);
+            QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
+            ssd->nr_updates++;
+            frame = true;
+        }
+    }
+
+    if (frame) {
+        ssd->frames++;
+        ssd->fps_frames++;
+    }
+    ssd->update_time += get_clock() - start;
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
@@ -373,6 +545,8 @@ void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
 {
     qemu_mutex_init(&ssd->lock);
     QTAILQ_INIT(&ssd->updates);
+    QTAILQ_INSERT_TAIL(&spice_displays, ssd, link);
+    ssd->fps_start = get_clock();
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
     if (ssd->num_surfaces == 0) {
@@ -485,10 +659,44 @@ void qemu_spice_cursor_refresh_bh(void *opaque)
     qemu_mutex_unlock(&ssd->lock);
 }
 
+static void qemu_spice_update_fps(SimpleSpiceDisplay *ssd)
+{
+    int64_t now = get_clock();
+
+    if (now - ssd->fps_start < NANOSECONDS_PER_SECOND) {
+        return;
+    }
+    ssd->fps = (double)ssd->fps_frames * NANOSECONDS_PER_SECOND /
+               (now - ssd->fps_start);
+    ssd->fps_frames = 0;
+    ssd->fps_start = now;
+}
+
+SpiceDisplayInfoList *qemu_spice_query_displays(void)
+{
+    SpiceDisplayInfoList *head = NULL, **tail = &head;
+    SimpleSpiceDisplay *ssd;
+
+    QTAILQ_FOREACH(ssd, &spice_displays, link) {
+        SpiceDisplayInfoList *entry = g_new0(SpiceDisplayInfoList, 1);
+
+        entry->value = g_new0(SpiceDisplayInfo, 1);
+        entry->value->id = ssd->qxl.id;
+        entry->value->frames = ssd->frames;
+        entry->value->updates = ssd->nr_updates;
+        entry->value->fps = ssd->fps;
+        entry->value->update_time = ssd->update_time / 1000;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
 {
     dprint(3, "%s/%d:\n", __func__, ssd->qxl.id);
     graphic_hw_update(ssd->dcl.con);
+    qemu_spice_update_fps(ssd);
 
     qemu_mutex_lock(&ssd->lock);
     if (QTAILQ_EMPTY(&ssd->updates) && ssd->ds) {
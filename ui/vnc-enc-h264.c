@@ -0,0 +1,310 @@
+/*
+ * QEMU VNC display driver: Open H.264 encoding
+ *
+ * Copyright (C) 2015 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The video area of a client (see vnc_update_client()) is sent as one
+ * Open H.264 rectangle per update, each one a frame of a single stream.
+ * The client keeps a decoder context per rectangle, so the stream is
+ * started over, with the ResetAllContexts flag, whenever the area moves.
+ *
+ * Frames are encoded with libavcodec, in software or, when the display
+ * was opened with vaapi=on, by the GPU through VAAPI.  If the encoder
+ * fails, the rectangle is sent with the still image encoding instead.
+ */
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+
+#include "vnc.h"
+#include "qemu/error-report.h"
+
+#define VNC_H264_FLAG_RESET_CONTEXT       1
+#define VNC_H264_FLAG_RESET_ALL_CONTEXTS  2
+
+#define VNC_H264_FPS      30
+#define VNC_H264_GOP      (10 * VNC_H264_FPS)
+
+/* Constant quality (x264 CRF or VAAPI QP) for a tight quality level */
+static int vnc_h264_quality(VncState *vs)
+{
+    static const int qp[10] = { 40, 37, 34, 31, 28, 26, 24, 22, 20, 18 };
+
+    if (vs->tight.quality > 9) {
+        return 26;
+    }
+    return qp[vs->tight.quality];
+}
+
+static void vnc_h264_close(VncH264 *h264)
+{
+    avcodec_free_context(&h264->ctx);
+    av_frame_free(&h264->frame);
+    av_frame_free(&h264->hw_frame);
+    av_packet_free(&h264->pkt);
+}
+
+static int vnc_h264_open(VncState *vs, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    AVBufferRef *device = vs->vd->h264_device;
+    const AVCodec *codec;
+    AVCodecContext *ctx;
+    int qp = vnc_h264_quality(vs);
+
+    if (device) {
+        codec = avcodec_find_encoder_by_name("h264_vaapi");
+    } else {
+        codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    }
+    if (!codec) {
+        return -1;
+    }
+
+    ctx = h264->ctx = avcodec_alloc_context3(codec);
+    h264->frame = av_frame_alloc();
+    h264->pkt = av_packet_alloc();
+    if (!ctx || !h264->frame || !h264->pkt) {
+        goto fail;
+    }
+
+    ctx->width = w;
+    ctx->height = h;
+    ctx->time_base = (AVRational){ 1, VNC_H264_FPS };
+    ctx->framerate = (AVRational){ VNC_H264_FPS, 1 };
+    ctx->gop_size = VNC_H264_GOP;
+    ctx->max_b_frames = 0;
+
+    h264->frame->width = w;
+    h264->frame->height = h;
+
+    if (device) {
+        AVBufferRef *frames = av_hwframe_ctx_alloc(device);
+        AVHWFramesContext *fc;
+
+        if (!frames) {
+            goto fail;
+        }
+        fc = (AVHWFramesContext *)frames->data;
+        fc->format = AV_PIX_FMT_VAAPI;
+        fc->sw_format = AV_PIX_FMT_NV12;
+        fc->width = w;
+        fc->height = h;
+        fc->initial_pool_size = 4;
+        if (av_hwframe_ctx_init(frames) < 0) {
+            av_buffer_unref(&frames);
+            goto fail;
+        }
+        ctx->hw_frames_ctx = frames;
+        ctx->pix_fmt = AV_PIX_FMT_VAAPI;
+        ctx->global_quality = qp;
+        /* Get each packet back before the next frame is sent */
+        av_opt_set_int(ctx->priv_data, "async_depth", 1, 0);
+
+        h264->hw_frame = av_frame_alloc();
+        if (!h264->hw_frame) {
+            goto fail;
+        }
+        h264->frame->format = AV_PIX_FMT_NV12;
+    } else {
+        ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+        av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+        av_opt_set_int(ctx->priv_data, "crf", qp, 0);
+
+        h264->frame->format = AV_PIX_FMT_YUV420P;
+    }
+
+    if (avcodec_open2(ctx, codec, NULL) < 0 ||
+        av_frame_get_buffer(h264->frame, 0) < 0) {
+        goto fail;
+    }
+    h264->pts = 0;
+    return 0;
+
+fail:
+    vnc_h264_close(h264);
+    return -1;
+}
+
+/*
+ * Convert a rectangle of the server surface to BT.601 YUV 4:2:0, with
+ * planar (YUV420P) or interleaved (NV12) chroma.  @w and @h are even.
+ */
+static void vnc_h264_fill_frame(VncState *vs, AVFrame *frame,
+                                int x, int y, int w, int h)
+{
+    int stride = vnc_server_fb_stride(vs->vd);
+    bool nv12 = frame->format == AV_PIX_FMT_NV12;
+    int i, j;
+
+    for (j = 0; j < h; j += 2) {
+        uint32_t *row0 = vnc_server_fb_ptr(vs->vd, x, y + j);
+        uint32_t *row1 = (uint32_t *)((uint8_t *)row0 + stride);
+        uint8_t *y0 = frame->data[0] + j * frame->linesize[0];
+        uint8_t *y1 = y0 + frame->linesize[0];
+        uint8_t *u = frame->data[1] + j / 2 * frame->linesize[1];
+        uint8_t *v = nv12 ? u + 1 : frame->data[2] + j / 2 * frame->linesize[2];
+
+        for (i = 0; i < w; i += 2) {
+            uint32_t px[4] = { row0[i], row0[i + 1], row1[i], row1[i + 1] };
+            int r = 0, g = 0, b = 0, k;
+
+            for (k = 0; k < 4; k++) {
+                int pr = (px[k] >> 16) & 0xff;
+                int pg = (px[k] >> 8) & 0xff;
+                int pb = px[k] & 0xff;
+                uint8_t luma = ((66 * pr + 129 * pg + 25 * pb + 128) >> 8) + 16;
+
+                if (k < 2) {
+                    y0[i + k] = luma;
+                } else {
+                    y1[i + k - 2] = luma;
+                }
+                r += pr;
+                g += pg;
+                b += pb;
+            }
+            r /= 4;
+            g /= 4;
+            b /= 4;
+            *u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            *v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+            u += nv12 ? 2 : 1;
+            v += nv12 ? 2 : 1;
+        }
+    }
+}
+
+static int vnc_h264_encode(VncState *vs, int x, int y, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    AVFrame *frame = h264->frame;
+    int ret;
+
+    if (av_frame_make_writable(frame) < 0) {
+        return -1;
+    }
+    vnc_h264_fill_frame(vs, frame, x, y, w, h);
+    frame->pts = h264->pts++;
+
+    if (h264->hw_frame) {
+        av_frame_unref(h264->hw_frame);
+        if (av_hwframe_get_buffer(h264->ctx->hw_frames_ctx,
+                                  h264->hw_frame, 0) < 0 ||
+            av_hwframe_transfer_data(h264->hw_frame, frame, 0) < 0) {
+            return -1;
+        }
+        h264->hw_frame->pts = frame->pts;
+        frame = h264->hw_frame;
+    }
+
+    if (avcodec_send_frame(h264->ctx, frame) < 0) {
+        return -1;
+    }
+
+    buffer_reset(&h264->h264);
+    while ((ret = avcodec_receive_packet(h264->ctx, h264->pkt)) == 0) {
+        buffer_reserve(&h264->h264, h264->pkt->size);
+        buffer_append(&h264->h264, h264->pkt->data, h264->pkt->size);
+        av_packet_unref(h264->pkt);
+    }
+    if (ret != AVERROR(EAGAIN)) {
+        return -1;
+    }
+
+    /*
+     * A frame held back by the encoder would be sent with the next
+     * update, on top of newer still image rectangles.
+     */
+    return h264->h264.offset ? 0 : -1;
+}
+
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    uint32_t flags = 0;
+
+    if (h264->ctx && (h264->x != x || h264->y != y ||
+                      h264->w != w || h264->h != h)) {
+        vnc_h264_close(h264);
+    }
+    if (!h264->ctx) {
+        if (vnc_h264_open(vs, w, h) < 0) {
+            goto fallback;
+        }
+        h264->x = x;
+        h264->y = y;
+        h264->w = w;
+        h264->h = h;
+        flags = VNC_H264_FLAG_RESET_ALL_CONTEXTS;
+    }
+
+    if (vnc_h264_encode(vs, x, y, w, h) < 0) {
+        /* Start over with a new stream, the client's context is stale */
+        vnc_h264_close(h264);
+        goto fallback;
+    }
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_OPEN_H264);
+    vnc_write_u32(vs, h264->h264.offset);
+    vnc_write_u32(vs, flags);
+    vnc_write(vs, h264->h264.buffer, h264->h264.offset);
+    return 1;
+
+fallback:
+    return vnc_send_framebuffer_update(vs, x, y, w, h);
+}
+
+void vnc_h264_clear(VncState *vs)
+{
+    vnc_h264_close(&vs->h264);
+    buffer_free(&vs->h264.h264);
+}
+
+int vnc_h264_display_init(VncDisplay *vd, bool vaapi, Error **errp)
+{
+    int ret;
+
+    if (!vaapi) {
+        return 0;
+    }
+    ret = av_hwdevice_ctx_create(&vd->h264_device, AV_HWDEVICE_TYPE_VAAPI,
+                                 NULL, NULL, 0);
+    if (ret < 0) {
+        error_setg(errp, "Cannot open the VAAPI device: %s", av_err2str(ret));
+        return -1;
+    }
+    if (!avcodec_find_encoder_by_name("h264_vaapi")) {
+        error_setg(errp, "libavcodec has no VAAPI H.264 encoder");
+        av_buffer_unref(&vd->h264_device);
+        return -1;
+    }
+    return 0;
+}
+
+void vnc_h264_display_cleanup(VncDisplay *vd)
+{
+    av_buffer_unref(&vd->h264_device);
+}
@@ -38,14 +38,19 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ *                      while a worker is doing something.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * Several worker threads encode at the same time, for different clients.
+ * The jobs of one client are encoded one after the other, in the order they
+ * were pushed: the zlib streams of the tight, zlib and zrle encodings carry
+ * state from one update to the next, and the client decodes them in order.
+ *
+ * While a VNC worker thread is working, it counts itself in the encoders of
+ * the VncDisplay (see vnc_lock_display_shared()), so that vnc_refresh()
+ * does not update the server surface under it, but the output lock is not held
+ * because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
  */
@@ -53,8 +58,7 @@
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    int nr_threads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -62,8 +66,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -103,6 +106,17 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+#ifdef CONFIG_VNC_H264
+int vnc_job_add_video_rect(VncJob *job, int x, int y, int w, int h)
+{
+    int n = vnc_job_add_rect(job, x, y, w, h);
+
+    /* vnc_job_add_rect() inserts at the head, and nobody else sees it */
+    QLIST_FIRST(&job->rectangles)->video = true;
+    return n;
+}
+#endif
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
@@ -143,7 +157,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* A job being encoded is removed by its worker */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -180,7 +195,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *buffer)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -193,37 +209,85 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+#ifdef CONFIG_VNC_H264
+    local->h264 = orig->h264;
+#endif
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *buffer)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
+#ifdef CONFIG_VNC_H264
+    orig->h264 = local->h264;
+#endif
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *buffer = local->output;
+}
+
+/*
+ * The first job of the queue whose client is not being encoded already.
+ * Earlier jobs of the same client, running or not, go first.
+ */
+static VncJob *vnc_queue_pick_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_job_send_rect(VncState *vs, VncRectEntry *entry)
+{
+#ifdef CONFIG_VNC_H264
+    if (entry->video) {
+        return vnc_h264_send_framebuffer_update(vs, entry->rect.x,
+                                                entry->rect.y, entry->rect.w,
+                                                entry->rect.h);
+    }
+#endif
+    return vnc_send_framebuffer_update(vs, entry->rect.x, entry->rect.y,
+                                       entry->rect.w, entry->rect.h);
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncJobQueue *queue, Buffer *buffer)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
     int n_rectangles;
     int saved_offset;
+    int64_t start;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_queue_pick_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
     /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
+    if (job) {
+        job->running = true;
+    }
     vnc_unlock_queue(queue);
 
     if (queue->exit) {
@@ -237,8 +301,10 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
     vnc_unlock_output(job->vs);
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, buffer);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -247,43 +313,44 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
+            vnc_async_encoding_end(job->vs, &vs, buffer);
             goto disconnected;
         }
 
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
+        n = vnc_job_send_rect(&vs, entry);
 
         if (n >= 0) {
             n_rectangles += n;
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
     vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
 
     vnc_lock_output(job->vs);
+    job->vs->encode_time += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    job->vs->encoded_updates++;
     if (job->vs->csock != -1) {
         buffer_reserve(&job->vs->jobs_buffer, vs.output.offset);
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, buffer);
 
 	qemu_bh_schedule(job->vs->bh);
     }  else {
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(job->vs, &vs, buffer);
     }
     vnc_unlock_output(job->vs);
 
@@ -291,6 +358,7 @@ disconnected:
     vnc_lock_queue(queue);
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
+    /* Wakes up joiners, and workers waiting for the client's next job */
     qemu_cond_broadcast(&queue->cond);
     g_free(job);
     return 0;
@@ -310,7 +378,6 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
@@ -318,11 +385,20 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    Buffer buffer = { 0 };
+    bool last;
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(queue, &buffer)) {
+        continue;
+    }
+    buffer_free(&buffer);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = !--queue->nr_threads;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -331,6 +407,17 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
+static void vnc_add_worker_threads_locked(VncJobQueue *q, int n)
+{
+    QemuThread thread;
+
+    while (q->nr_threads < n) {
+        q->nr_threads++;
+        qemu_thread_create(&thread, "vnc_worker", vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -339,7 +426,20 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    vnc_lock_queue(q);
+    vnc_add_worker_threads_locked(q, 1);
+    vnc_unlock_queue(q);
     queue = q; /* Set global queue */
 }
+
+/*
+ * The pool is shared by all displays, it grows to the largest number of
+ * workers that one of them asks for.
+ */
+void vnc_set_worker_threads(int n)
+{
+    vnc_start_worker_thread();
+    vnc_lock_queue(queue);
+    vnc_add_worker_threads_locked(queue, MIN(n, VNC_MAX_WORKER_THREADS));
+    vnc_unlock_queue(queue);
+}
@@ -30,9 +30,14 @@
 #ifndef VNC_JOBS_H
 #define VNC_JOBS_H
 
+#define VNC_MAX_WORKER_THREADS 16
+
 /* Jobs */
 VncJob *vnc_job_new(VncState *vs);
 int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h);
+#ifdef CONFIG_VNC_H264
+int vnc_job_add_video_rect(VncJob *job, int x, int y, int w, int h);
+#endif
 void vnc_job_push(VncJob *job);
 bool vnc_has_job(VncState *vs);
 void vnc_jobs_clear(VncState *vs);
@@ -40,11 +45,19 @@ void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
+void vnc_set_worker_threads(int n);
 
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -EBUSY;
+    }
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -EBUSY;
+    }
+    return 0;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -57,6 +70,24 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/*
+ * Shared lock of the worker threads: several of them can encode from the
+ * display at the same time, vnc_trylock_display() fails while they do.
+ */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
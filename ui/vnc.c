@@ -45,6 +45,11 @@
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
+/* Spend at most 1/VNC_REFRESH_COST_FACTOR of the time refreshing */
+#define VNC_REFRESH_COST_FACTOR   4
+/* Areas updated this often (Hz) are sent as a video stream */
+#define VNC_VIDEO_FREQ            16
+#define VNC_VIDEO_MIN_AREA        (128 * 128)
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
@@ -397,6 +402,14 @@ static VncClientInfoList *qmp_query_client_list(VncDisplay *vd)
     QTAILQ_FOREACH(client, &vd->clients, next) {
         cinfo = g_new0(VncClientInfoList, 1);
         cinfo->value = qmp_query_vnc_client(client);
+        if (cinfo->value) {
+            vnc_lock_output(client);
+            cinfo->value->has_encode_time = true;
+            cinfo->value->encode_time = client->encode_time / 1000;
+            cinfo->value->has_encoded_updates = true;
+            cinfo->value->encoded_updates = client->encoded_updates;
+            vnc_unlock_output(client);
+        }
         cinfo->next = prev;
         prev = cinfo;
     }
@@ -610,6 +623,9 @@ static void framebuffer_update_request(VncState *vs, int incremental,
                                        int w, int h);
 static void vnc_refresh(DisplayChangeListener *dcl);
 static int vnc_refresh_server_surface(VncDisplay *vd);
+#ifdef CONFIG_VNC_H264
+static int vnc_add_video_rect(VncState *vs, VncJob *job);
+#endif
 
 static void vnc_set_area_dirty(DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
                                VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT),
@@ -1088,6 +1104,10 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         height = pixman_image_get_height(vd->server);
         width = pixman_image_get_width(vd->server);
 
+#ifdef CONFIG_VNC_H264
+        n += vnc_add_video_rect(vs, job);
+#endif
+
         y = 0;
         for (;;) {
             int x, h;
@@ -1236,6 +1256,9 @@ void vnc_disconnect_finish(VncState *vs)
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
     vnc_zrle_clear(vs);
+#ifdef CONFIG_VNC_H264
+    vnc_h264_clear(vs);
+#endif
 
 #ifdef CONFIG_VNC_TLS
     vnc_tls_client_cleanup(vs);
@@ -2103,6 +2126,12 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_TIGHT_PNG_MASK;
             vs->vnc_encoding = enc;
             break;
+#endif
+#ifdef CONFIG_VNC_H264
+        case VNC_ENCODING_OPEN_H264:
+            /* Only used for the video area, next to vnc_encoding */
+            vs->features |= VNC_FEATURE_OPEN_H264_MASK;
+            break;
 #endif
         case VNC_ENCODING_ZLIB:
             vs->features |= VNC_FEATURE_ZLIB_MASK;
@@ -2853,6 +2882,81 @@ double vnc_update_freq(VncState *vs, int x, int y, int w, int h)
     }
 }
 
+#ifdef CONFIG_VNC_H264
+/*
+ * The video area is the bounding box of the stat rectangles updated at
+ * VNC_VIDEO_FREQ or more, if it is large enough to be worth a stream.
+ */
+static void vnc_update_video_rect(VncState *vs)
+{
+    VncDisplay *vd = vs->vd;
+    VncRect *r = &vs->video_rect;
+    int width = pixman_image_get_width(vd->server);
+    int height = pixman_image_get_height(vd->server);
+    int x, y, x1 = width, y1 = height, x2 = 0, y2 = 0;
+
+    r->w = r->h = 0;
+    if (!vnc_has_feature(vs, VNC_FEATURE_OPEN_H264) || vd->non_adaptive) {
+        return;
+    }
+
+    for (y = 0; y < height; y += VNC_STAT_RECT) {
+        for (x = 0; x < width; x += VNC_STAT_RECT) {
+            if (vnc_stat_rect(vd, x, y)->freq >= VNC_VIDEO_FREQ) {
+                x1 = MIN(x1, x);
+                y1 = MIN(y1, y);
+                x2 = MAX(x2, x + VNC_STAT_RECT);
+                y2 = MAX(y2, y + VNC_STAT_RECT);
+            }
+        }
+    }
+    if (x2 <= x1) {
+        return;
+    }
+
+    /* YUV 4:2:0 frames have even dimensions */
+    x2 = MIN(x2, width);
+    y2 = MIN(y2, height);
+    if ((x2 - x1) * (y2 - y1) < VNC_VIDEO_MIN_AREA) {
+        return;
+    }
+    r->x = x1;
+    r->y = y1;
+    r->w = (x2 - x1) & ~1;
+    r->h = (y2 - y1) & ~1;
+}
+
+/*
+ * Queue the video area as a single H.264 rectangle if anything in it is
+ * dirty, and take it out of the dirty map.  Chunks that straddle its
+ * right edge are left to the still image encoding.
+ */
+static int vnc_add_video_rect(VncState *vs, VncJob *job)
+{
+    VncRect *r = &vs->video_rect;
+    int x, n, y;
+    bool dirty = false;
+
+    vnc_update_video_rect(vs);
+    if (!r->w) {
+        return 0;
+    }
+
+    x = r->x / VNC_DIRTY_PIXELS_PER_BIT;
+    n = r->w / VNC_DIRTY_PIXELS_PER_BIT;
+    for (y = r->y; y < r->y + r->h; y++) {
+        if (find_next_bit(vs->dirty[y], x + n, x) < x + n) {
+            bitmap_clear(vs->dirty[y], x, n);
+            dirty = true;
+        }
+    }
+    if (!dirty) {
+        return 0;
+    }
+    return vnc_job_add_video_rect(job, r->x, r->y, r->w, r->h);
+}
+#endif
+
 static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
 {
     VncRectStat *rect;
@@ -2866,6 +2970,36 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy @len bytes from @src to @dst if they differ, and tell whether they
+ * did.  Everything before the first difference is equal already, so the
+ * copy starts there.
+ */
+static bool vnc_cmp_copy(uint8_t *dst, const uint8_t *src, int len)
+{
+    if (len % (4 * sizeof(VECTYPE)) == 0 &&
+        ((uintptr_t)dst | (uintptr_t)src) % sizeof(VECTYPE) == 0) {
+        VECTYPE *d = (VECTYPE *)dst;
+        const VECTYPE *s = (const VECTYPE *)src;
+        int i, n = len / sizeof(VECTYPE);
+
+        for (i = 0; i < n; i += 4) {
+            if (!ALL_EQ(d[i], s[i]) || !ALL_EQ(d[i + 1], s[i + 1]) ||
+                !ALL_EQ(d[i + 2], s[i + 2]) || !ALL_EQ(d[i + 3], s[i + 3])) {
+                memcpy(d + i, s + i, (n - i) * sizeof(VECTYPE));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if (memcmp(dst, src, len) == 0) {
+        return false;
+    }
+    memcpy(dst, src, len);
+    return true;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2873,6 +3007,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
     int cmp_bytes, server_stride, min_stride, guest_stride, y = 0;
+    int bits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
     int has_dirty = 0;
@@ -2919,14 +3054,18 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
-            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
+            /* Only convert the span of the line that is flagged dirty */
+            int last = find_last_bit(vd->guest.dirty[y], bits);
+            int x0 = x * VNC_DIRTY_PIXELS_PER_BIT;
+            int x1 = MIN((last + 1) * VNC_DIRTY_PIXELS_PER_BIT, width);
+
+            qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, x1 - x0, x0, y);
             guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
-            guest_ptr = guest_row0 + y * guest_stride;
+            guest_ptr = guest_row0 + y * guest_stride + x * cmp_bytes;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        for (; x < bits;
              x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
             int _cmp_bytes = cmp_bytes;
             if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
@@ -2935,10 +3074,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             if ((x + 1) * cmp_bytes > min_stride) {
                 _cmp_bytes = min_stride - x * cmp_bytes;
             }
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!vnc_cmp_copy(server_ptr, guest_ptr, _cmp_bytes)) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -2960,6 +3098,7 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     VncState *vs, *vn;
     int has_dirty, rects = 0;
+    int64_t start, interval_min;
 
     if (QTAILQ_EMPTY(&vd->clients)) {
         update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
@@ -2973,9 +3112,20 @@ static void vnc_refresh(DisplayChangeListener *dcl)
         return;
     }
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     has_dirty = vnc_refresh_server_surface(vd);
     vnc_unlock_display(vd);
 
+    /*
+     * Large framebuffers take long to compare; do not refresh so often
+     * that comparing them eats the CPU.
+     */
+    vd->refresh_cost = (vd->refresh_cost * 7 +
+                        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 8;
+    interval_min = vd->refresh_cost * VNC_REFRESH_COST_FACTOR / SCALE_MS;
+    interval_min = MIN(MAX(interval_min, VNC_REFRESH_INTERVAL_BASE),
+                       VNC_REFRESH_INTERVAL_MAX);
+
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         rects += vnc_update_client(vs, has_dirty, false);
         /* vs might be free()ed here */
@@ -2983,15 +3133,15 @@ static void vnc_refresh(DisplayChangeListener *dcl)
 
     if (has_dirty && rects) {
         vd->dcl.update_interval /= 2;
-        if (vd->dcl.update_interval < VNC_REFRESH_INTERVAL_BASE) {
-            vd->dcl.update_interval = VNC_REFRESH_INTERVAL_BASE;
-        }
     } else {
         vd->dcl.update_interval += VNC_REFRESH_INTERVAL_INC;
         if (vd->dcl.update_interval > VNC_REFRESH_INTERVAL_MAX) {
             vd->dcl.update_interval = VNC_REFRESH_INTERVAL_MAX;
         }
     }
+    if (vd->dcl.update_interval < interval_min) {
+        vd->dcl.update_interval = interval_min;
+    }
 }
 
 static void vnc_connect(VncDisplay *vd, int csock,
@@ -3192,6 +3342,9 @@ static void vnc_display_close(VncDisplay *vs)
 #ifdef CONFIG_VNC_TLS
     vs->tls.x509verify = 0;
 #endif
+#ifdef CONFIG_VNC_H264
+    vnc_h264_display_cleanup(vs);
+#endif
 }
 
 int vnc_display_password(const char *id, const char *password)
@@ -3295,6 +3448,12 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "non-adaptive",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "workers",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "vaapi",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -3455,6 +3614,7 @@ void vnc_display_open(const char *id, Error **errp)
     int acl = 0;
 #endif
     int lock_key_sync = 1;
+    int64_t workers;
 
     if (!vs) {
         error_setg(errp, "VNC display not active");
@@ -3578,6 +3738,14 @@ void vnc_display_open(const char *id, Error **errp)
     }
     vs->connections_limit = qemu_opt_get_number(opts, "connections", 32);
 
+    workers = qemu_opt_get_number(opts, "workers", 1);
+    if (workers < 1 || workers > VNC_MAX_WORKER_THREADS) {
+        error_setg(errp, "vnc workers= must be between 1 and %d",
+                   VNC_MAX_WORKER_THREADS);
+        goto fail;
+    }
+    vnc_set_worker_threads(workers);
+
     websocket = qemu_opt_get(opts, "websocket");
     if (websocket) {
         vs->ws_enabled = true;
@@ -3588,7 +3756,7 @@ void vnc_display_open(const char *id, Error **errp)
         }
     }
 
-#ifdef CONFIG_VNC_JPEG
+#if defined(CONFIG_VNC_JPEG) || defined(CONFIG_VNC_H264)
     vs->lossy = qemu_opt_get_bool(opts, "lossy", false);
 #endif
     vs->non_adaptive = qemu_opt_get_bool(opts, "non-adaptive", false);
@@ -3599,6 +3767,18 @@ void vnc_display_open(const char *id, Error **errp)
         vs->non_adaptive = true;
     }
 
+#ifdef CONFIG_VNC_H264
+    if (vnc_h264_display_init(vs, qemu_opt_get_bool(opts, "vaapi", false),
+                              errp) < 0) {
+        goto fail;
+    }
+#else
+    if (qemu_opt_get_bool(opts, "vaapi", false)) {
+        error_setg(errp, "VNC H.264 support is not available");
+        goto fail;
+    }
+#endif
+
 #ifdef CONFIG_VNC_TLS
     if (acl && x509 && vs->tls.x509verify) {
         char *aclname;
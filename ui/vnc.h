@@ -161,6 +161,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders;               /* worker threads encoding, under mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -181,6 +182,10 @@ struct VncDisplay
     bool ws_tls; /* Used by websockets */
     bool lossy;
     bool non_adaptive;
+    int64_t refresh_cost;       /* ns per vnc_refresh, moving average */
+#ifdef CONFIG_VNC_H264
+    struct AVBufferRef *h264_device;    /* VAAPI device, or NULL */
+#endif
 #ifdef CONFIG_VNC_TLS
     VncDisplayTLS tls;
 #endif
@@ -233,6 +238,18 @@ typedef struct VncZywrle {
     int buf[VNC_ZRLE_TILE_WIDTH * VNC_ZRLE_TILE_HEIGHT];
 } VncZywrle;
 
+#ifdef CONFIG_VNC_H264
+typedef struct VncH264 {
+    struct AVCodecContext *ctx;
+    struct AVFrame *frame;
+    struct AVFrame *hw_frame;   /* VAAPI surface, or NULL */
+    struct AVPacket *pkt;
+    int64_t pts;
+    int x, y, w, h;             /* rectangle of the stream */
+    Buffer h264;
+} VncH264;
+#endif
+
 struct VncRect
 {
     int x;
@@ -244,6 +261,7 @@ struct VncRect
 struct VncRectEntry
 {
     struct VncRect rect;
+    bool video;                 /* part of the video area */
     QLIST_ENTRY(VncRectEntry) next;
 };
 
@@ -252,6 +270,7 @@ struct VncJob
     VncState *vs;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
+    bool running;
     QTAILQ_ENTRY(VncJob) next;
 };
 
@@ -321,6 +340,8 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    uint64_t encode_time;       /* ns spent encoding, under output_mutex */
+    uint64_t encoded_updates;
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -330,6 +351,10 @@ struct VncState
     VncHextile hextile;
     VncZrle zrle;
     VncZywrle zywrle;
+#ifdef CONFIG_VNC_H264
+    VncH264 h264;
+    VncRect video_rect;         /* video area, w == 0 if none */
+#endif
 
     Notifier mouse_mode_notifier;
 
@@ -386,6 +411,7 @@ enum {
 #define VNC_ENCODING_TRLE                 0x0000000f
 #define VNC_ENCODING_ZRLE                 0x00000010
 #define VNC_ENCODING_ZYWRLE               0x00000011
+#define VNC_ENCODING_OPEN_H264            0x00000032
 #define VNC_ENCODING_COMPRESSLEVEL0       0xFFFFFF00 /* -256 */
 #define VNC_ENCODING_QUALITYLEVEL0        0xFFFFFFE0 /* -32  */
 #define VNC_ENCODING_XCURSOR              0xFFFFFF10 /* -240 */
@@ -437,6 +463,7 @@ enum {
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
 #define VNC_FEATURE_LED_STATE               11
+#define VNC_FEATURE_OPEN_H264               12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -450,6 +477,7 @@ enum {
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
 #define VNC_FEATURE_LED_STATE_MASK           (1 << VNC_FEATURE_LED_STATE)
+#define VNC_FEATURE_OPEN_H264_MASK           (1 << VNC_FEATURE_OPEN_H264)
 
 
 /* Client -> Server message IDs */
@@ -595,4 +623,11 @@ int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 void vnc_zrle_clear(VncState *vs);
 
+#ifdef CONFIG_VNC_H264
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_h264_clear(VncState *vs);
+int vnc_h264_display_init(VncDisplay *vd, bool vaapi, Error **errp);
+void vnc_h264_display_cleanup(VncDisplay *vd);
+#endif
+
 #endif /* __QEMU_VNC_H */
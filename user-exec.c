@@ -22,6 +22,8 @@
 #include "tcg.h"
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
+#include "qemu/atomic.h"
 #include "translate-all.h"
 
 #undef EAX
@@ -676,3 +678,23 @@ int cpu_signal_handler(int host_signum, void *pinfo,
 #error host CPU specific signal handler needed
 
 #endif
+
+/* Guest memory is mapped in the host, so every atomic operation can use
+   host atomics.  Faults are handled by the signal handler above.  */
+#define ATOMIC_MMU_DECLS
+#define ATOMIC_MMU_LOOKUP   g2h(addr)
+#define ATOMIC_MMU_CLEANUP  do { } while (0)
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#ifdef CONFIG_ATOMIC64
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#endif
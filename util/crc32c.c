@@ -28,6 +28,17 @@
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
 
+#ifdef CONFIG_SSE42_OPT
+#include <cpuid.h>
+#endif
+#ifdef CONFIG_ARMV8_CRC_OPT
+#include "elf.h"
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
 /*
  * This is the CRC-32C table
  * Generated with:
@@ -105,11 +116,138 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+/*
+ * The implementations below update @crc with @length bytes of @data,
+ * without the final inversion.
+ */
+typedef uint32_t (*Crc32cFunc)(uint32_t crc, const uint8_t *data,
+                               unsigned int length);
+
+static uint32_t crc32c_bytes(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#ifdef CONFIG_SSE42_OPT
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <nmmintrin.h>
+
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+#ifdef __x86_64__
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = _mm_crc32_u64(crc, *(const uint64_t *)data);
+    }
+#else
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t *)data);
+    }
+#endif
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#pragma GCC pop_options
+
+static bool can_use_sse42(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, 0) < 1) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    return (c & bit_SSE4_2) != 0;
+}
+#endif
+
+#ifdef CONFIG_ARMV8_CRC_OPT
+#pragma GCC push_options
+#pragma GCC target("+crc")
+#include <arm_acle.h>
+
+static uint32_t crc32c_armv8(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    while (length && ((uintptr_t)data & 7)) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = __crc32cd(crc, *(const uint64_t *)data);
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#pragma GCC pop_options
+
+static bool can_use_armv8_crc(void)
+{
+    return (qemu_getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static Crc32cFunc crc32c_update = crc32c_bytes;
+
+#if defined(CONFIG_SSE42_OPT) || defined(CONFIG_ARMV8_CRC_OPT)
+static void __attribute__((constructor)) crc32c_init_accel(void)
+{
+#ifdef CONFIG_SSE42_OPT
+    if (can_use_sse42()) {
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+#ifdef CONFIG_ARMV8_CRC_OPT
+    if (can_use_armv8_crc()) {
+        crc32c_update = crc32c_armv8;
+    }
+#endif
+}
+#endif
+
+bool crc32c_set_accel(const char *name)
+{
+    if (!strcmp(name, "table")) {
+        crc32c_update = crc32c_bytes;
+        return true;
+    }
+#ifdef CONFIG_SSE42_OPT
+    if (!strcmp(name, "sse4.2") && can_use_sse42()) {
+        crc32c_update = crc32c_sse42;
+        return true;
+    }
+#endif
+#ifdef CONFIG_ARMV8_CRC_OPT
+    if (!strcmp(name, "armv8") && can_use_armv8_crc()) {
+        crc32c_update = crc32c_armv8;
+        return true;
+    }
+#endif
+    if (!strcmp(name, "auto")) {
+        crc32c_update = crc32c_bytes;
+#if defined(CONFIG_SSE42_OPT) || defined(CONFIG_ARMV8_CRC_OPT)
+        crc32c_init_accel();
+#endif
+        return true;
+    }
+    return false;
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_update(crc, data, length) ^ 0xffffffff;
 }
 
@@ -31,6 +31,17 @@
 #include "qemu/iov.h"
 #include "net/net.h"
 
+/* The AVX versions of buffer_find_nonzero_offset() need 128 byte blocks */
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#define BUFFER_FIND_NONZERO_AVX2
+#endif
+#if defined(CONFIG_AVX512F_OPT) && defined(__SSE2__)
+#define BUFFER_FIND_NONZERO_AVX512F
+#endif
+#if defined(BUFFER_FIND_NONZERO_AVX2) || defined(BUFFER_FIND_NONZERO_AVX512F)
+#include "qemu/host-cpuid.h"
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -166,6 +177,165 @@ int qemu_fdatasync(int fd)
 #endif
 }
 
+/*
+ * The loops below check BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+ * sizeof(VECTYPE) bytes at a time, starting at offset @i, and return the
+ * offset of the first block that isn't all zero.
+ */
+typedef size_t (*BufferFindNonzeroFunc)(const void *buf, size_t i,
+                                        size_t len);
+
+static size_t buffer_find_nonzero_offset_vec(const void *buf, size_t i,
+                                             size_t len)
+{
+    const VECTYPE *p = buf;
+    const VECTYPE zero = (VECTYPE){0};
+
+    for (i /= sizeof(VECTYPE); i < len / sizeof(VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        VECTYPE tmp0 = VEC_OR(p[i + 0], p[i + 1]);
+        VECTYPE tmp1 = VEC_OR(p[i + 2], p[i + 3]);
+        VECTYPE tmp2 = VEC_OR(p[i + 4], p[i + 5]);
+        VECTYPE tmp3 = VEC_OR(p[i + 6], p[i + 7]);
+        VECTYPE tmp01 = VEC_OR(tmp0, tmp1);
+        VECTYPE tmp23 = VEC_OR(tmp2, tmp3);
+        if (!ALL_EQ(VEC_OR(tmp01, tmp23), zero)) {
+            break;
+        }
+    }
+
+    return i * sizeof(VECTYPE);
+}
+
+#define BUFFER_FIND_NONZERO_BLOCK \
+    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE))
+
+#ifdef BUFFER_FIND_NONZERO_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* The block size is a multiple of 128 bytes, i.e. four AVX2 registers */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t i,
+                                              size_t len)
+{
+    const uint8_t *p = buf;
+
+    QEMU_BUILD_BUG_ON(BUFFER_FIND_NONZERO_BLOCK % 128);
+
+    for (; i < len; i += 128) {
+        __m256i tmp0 = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i *)(p + i)),
+            _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+        __m256i tmp1 = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i *)(p + i + 64)),
+            _mm256_loadu_si256((const __m256i *)(p + i + 96)));
+        __m256i tmp = _mm256_or_si256(tmp0, tmp1);
+
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef BUFFER_FIND_NONZERO_AVX512F
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+/*
+ * Checks 256 bytes per iteration, and the last 128 bytes, if any, with
+ * the same two registers.
+ */
+static size_t buffer_find_nonzero_offset_avx512f(const void *buf, size_t i,
+                                                 size_t len)
+{
+    const uint8_t *p = buf;
+
+    QEMU_BUILD_BUG_ON(BUFFER_FIND_NONZERO_BLOCK % 128);
+
+    for (; i + 256 <= len; i += 256) {
+        __m512i tmp0 = _mm512_or_si512(
+            _mm512_loadu_si512(p + i), _mm512_loadu_si512(p + i + 64));
+        __m512i tmp1 = _mm512_or_si512(
+            _mm512_loadu_si512(p + i + 128), _mm512_loadu_si512(p + i + 192));
+        __m512i tmp = _mm512_or_si512(tmp0, tmp1);
+
+        if (_mm512_test_epi64_mask(tmp, tmp)) {
+            break;
+        }
+    }
+
+    for (; i < len; i += 128) {
+        __m512i tmp = _mm512_or_si512(
+            _mm512_loadu_si512(p + i), _mm512_loadu_si512(p + i + 64));
+
+        if (_mm512_test_epi64_mask(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i;
+}
+#pragma GCC pop_options
+#endif
+
+static BufferFindNonzeroFunc buffer_find_nonzero =
+    buffer_find_nonzero_offset_vec;
+
+#if defined(BUFFER_FIND_NONZERO_AVX2) || defined(BUFFER_FIND_NONZERO_AVX512F)
+static void __attribute__((constructor)) init_buffer_find_nonzero(void)
+{
+#ifdef BUFFER_FIND_NONZERO_AVX2
+    if (host_cpuid_has_avx2()) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_avx2;
+    }
+#endif
+#ifdef BUFFER_FIND_NONZERO_AVX512F
+    if (host_cpuid_has_avx512f()) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_avx512f;
+    }
+#endif
+}
+#endif
+
+/*
+ * Select the implementation used by buffer_find_nonzero_offset(); for the
+ * unit test, which checks that they all give the same results.  Returns
+ * false if @name is not available on this host.
+ */
+bool buffer_find_nonzero_offset_set_accel(const char *name)
+{
+    if (!strcmp(name, "vec")) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_vec;
+        return true;
+    }
+#ifdef BUFFER_FIND_NONZERO_AVX2
+    if (!strcmp(name, "avx2") && host_cpuid_has_avx2()) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_avx2;
+        return true;
+    }
+#endif
+#ifdef BUFFER_FIND_NONZERO_AVX512F
+    if (!strcmp(name, "avx512f") && host_cpuid_has_avx512f()) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_avx512f;
+        return true;
+    }
+#endif
+    if (!strcmp(name, "auto")) {
+        buffer_find_nonzero = buffer_find_nonzero_offset_vec;
+#if defined(BUFFER_FIND_NONZERO_AVX2) || defined(BUFFER_FIND_NONZERO_AVX512F)
+        init_buffer_find_nonzero();
+#endif
+        return true;
+    }
+    return false;
+}
+
 /*
  * Searches for an area with non-zero content in a buffer
  *
@@ -184,6 +354,9 @@ int qemu_fdatasync(int fd)
  * afterwards.
  *
  * If the buffer is all zero the return value is equal to len.
+ *
+ * The rest of the buffer is scanned with AVX2 or AVX-512 instructions if
+ * the host supports them.
  */
 
 size_t buffer_find_nonzero_offset(const void *buf, size_t len)
@@ -204,21 +377,7 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         }
     }
 
-    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
-         i < len / sizeof(VECTYPE);
-         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
-        VECTYPE tmp0 = VEC_OR(p[i + 0], p[i + 1]);
-        VECTYPE tmp1 = VEC_OR(p[i + 2], p[i + 3]);
-        VECTYPE tmp2 = VEC_OR(p[i + 4], p[i + 5]);
-        VECTYPE tmp3 = VEC_OR(p[i + 6], p[i + 7]);
-        VECTYPE tmp01 = VEC_OR(tmp0, tmp1);
-        VECTYPE tmp23 = VEC_OR(tmp2, tmp3);
-        if (!ALL_EQ(VEC_OR(tmp01, tmp23), zero)) {
-            break;
-        }
-    }
-
-    return i * sizeof(VECTYPE);
+    return buffer_find_nonzero(buf, BUFFER_FIND_NONZERO_BLOCK, len);
 }
 
 /*
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -93,6 +94,9 @@ struct HBitmap {
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* If not NULL, the chunks of granules that changed.  */
+    HBitmap *meta;
 };
 
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
@@ -264,6 +268,7 @@ static void hb_set_between(HBitmap *hb, int level, uint64_t start, uint64_t last
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
+    uint64_t first_count;
     uint64_t last = start + count - 1;
 
     trace_hbitmap_set(hb, start, count,
@@ -273,8 +278,13 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     count = last - start + 1;
 
-    hb->count += count - hb_count_between(hb, start, last);
+    first_count = hb_count_between(hb, start, last);
+    hb->count += count - first_count;
     hb_set_between(hb, HBITMAP_LEVELS - 1, start, last);
+
+    if (hb->meta && first_count != count) {
+        hbitmap_set(hb->meta, start, count);
+    }
 }
 
 /* Resetting works the other way round: propagate up if the new
@@ -344,6 +354,7 @@ static void hb_reset_between(HBitmap *hb, int level, uint64_t start, uint64_t la
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
+    uint64_t first_count;
     uint64_t last = start + count - 1;
 
     trace_hbitmap_reset(hb, start, count,
@@ -352,8 +363,13 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     start >>= hb->granularity;
     last >>= hb->granularity;
 
-    hb->count -= hb_count_between(hb, start, last);
+    first_count = hb_count_between(hb, start, last);
+    hb->count -= first_count;
     hb_reset_between(hb, HBITMAP_LEVELS - 1, start, last);
+
+    if (hb->meta && first_count) {
+        hbitmap_set(hb->meta, start, last - start + 1);
+    }
 }
 
 void hbitmap_reset_all(HBitmap *hb)
@@ -366,6 +382,9 @@ void hbitmap_reset_all(HBitmap *hb)
     }
 
     hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
+    if (hb->meta && hb->count) {
+        hbitmap_set(hb->meta, 0, hb->size);
+    }
     hb->count = 0;
 }
 
@@ -378,9 +397,161 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t first = start >> hb->granularity;
+    uint64_t last, pos, end_pos, res;
+    unsigned long cur;
+
+    if (!count || first >= hb->size) {
+        return -1;
+    }
+    last = count > UINT64_MAX - start ? UINT64_MAX : start + count - 1;
+    last = MIN(last >> hb->granularity, hb->size - 1);
+
+    /* Bits before @first count as set.  Whole words of set bits are
+     * skipped; the upper levels do not help here, because they only
+     * record which words are nonzero.
+     */
+    pos = first >> BITS_PER_LEVEL;
+    end_pos = last >> BITS_PER_LEVEL;
+    cur = last_lev[pos] | ((1UL << (first & (BITS_PER_LONG - 1))) - 1);
+    while (cur == ~0UL) {
+        if (++pos > end_pos) {
+            return -1;
+        }
+        cur = last_lev[pos];
+    }
+
+    res = (pos << BITS_PER_LEVEL) + ctol(cur);
+    if (res > last) {
+        return -1;
+    }
+    return MAX(res << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    HBitmapIter hbi;
+    uint64_t end;
+    int64_t first_dirty, first_zero;
+
+    if (!*count || (*start >> hb->granularity) >= hb->size) {
+        return false;
+    }
+    end = *count > UINT64_MAX - *start ? UINT64_MAX : *start + *count;
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    first_dirty = hbitmap_iter_next(&hbi);
+    if (first_dirty < 0 || first_dirty >= end) {
+        return false;
+    }
+    first_dirty = MAX(first_dirty, *start);
+
+    first_zero = hbitmap_next_zero(hb, first_dirty, end - first_dirty);
+    *start = first_dirty;
+    *count = (first_zero < 0 ? end : first_zero) - first_dirty;
+    return true;
+}
+
+uint64_t hbitmap_size(const HBitmap *hb)
+{
+    return hb->size;
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    const unsigned long *cur = &hb->levels[HBITMAP_LEVELS - 1][start /
+                                                              BITS_PER_LONG];
+    uint64_t bytes = DIV_ROUND_UP(count, 8);
+    unsigned long el;
+
+    assert(!(start & 63) && start + count <= hb->size);
+    while (bytes) {
+        size_t n = MIN(bytes, sizeof(el));
+
+        el = BITS_PER_LONG == 64 ? cpu_to_le64(*cur) : cpu_to_le32(*cur);
+        memcpy(buf, &el, n);
+        buf += n;
+        bytes -= n;
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count)
+{
+    unsigned long *cur = &hb->levels[HBITMAP_LEVELS - 1][start /
+                                                        BITS_PER_LONG];
+    uint64_t bytes = DIV_ROUND_UP(count, 8);
+    unsigned long el;
+
+    assert(!(start & 63) && start + count <= hb->size);
+    while (bytes) {
+        size_t n = MIN(bytes, sizeof(el));
+
+        el = 0;
+        memcpy(&el, buf, n);
+        *cur++ = BITS_PER_LONG == 64 ? le64_to_cpu(el) : le32_to_cpu(el);
+        buf += n;
+        bytes -= n;
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    unsigned long *last = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t j;
+    int i;
+
+    /* Bits past the end of the bitmap may have been loaded; drop them.  */
+    if (hb->size & (BITS_PER_LONG - 1)) {
+        last[hb->size / BITS_PER_LONG] &=
+            (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+    }
+
+    hb->count = 0;
+    for (j = 0; j < hb->sizes[HBITMAP_LEVELS - 1]; j++) {
+        hb->count += ctpopl(last[j]);
+    }
+
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        for (j = 0; j < hb->sizes[i + 1]; j++) {
+            if (hb->levels[i + 1][j]) {
+                hb->levels[i][j / BITS_PER_LONG] |=
+                    1UL << (j & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    /* Restore the sentinel, see hbitmap_alloc.  */
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
+HBitmap *hbitmap_create_meta(HBitmap *hb, int chunk_bits)
+{
+    assert(!hb->meta);
+    hb->meta = hbitmap_alloc(hb->size, chunk_bits);
+    return hb->meta;
+}
+
+void hbitmap_free_meta(HBitmap *hb)
+{
+    if (hb->meta) {
+        hbitmap_free(hb->meta);
+        hb->meta = NULL;
+    }
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+
+    hbitmap_free_meta(hb);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
@@ -458,6 +629,9 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
                    (size - old) * sizeof(*hb->levels[i]));
         }
     }
+    if (hb->meta) {
+        hbitmap_truncate(hb->meta, hb->size);
+    }
 }
 
 
@@ -485,6 +659,19 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
      */
+    if (a->meta) {
+        const unsigned long *la = a->levels[HBITMAP_LEVELS - 1];
+        const unsigned long *lb = b->levels[HBITMAP_LEVELS - 1];
+
+        for (j = 0; j < a->sizes[HBITMAP_LEVELS - 1]; j++) {
+            if (lb[j] & ~la[j]) {
+                uint64_t start = j * BITS_PER_LONG;
+                hbitmap_set(a->meta, start,
+                            MIN(BITS_PER_LONG, a->size - start));
+            }
+        }
+    }
+
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
@@ -0,0 +1,67 @@
+/*
+ * Runtime detection of the host's x86 vector extensions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/host-cpuid.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <stdint.h>
+#include <cpuid.h>
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+
+static bool probed, has_avx2, has_avx512f;
+
+static void host_cpuid_probe(void)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0, xcr0_hi;
+
+    probed = true;
+    if (__get_cpuid_max(0, 0) < 7) {
+        return;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return;
+    }
+    /* The OS has to save the YMM registers, and for AVX-512 the ZMM ones */
+    asm("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0 & 6) != 6) {
+        return;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    has_avx2 = (b & bit_AVX2) != 0;
+    has_avx512f = (b & bit_AVX512F) && (xcr0 & 0xe0) == 0xe0;
+}
+
+bool host_cpuid_has_avx2(void)
+{
+    if (!probed) {
+        host_cpuid_probe();
+    }
+    return has_avx2;
+}
+
+bool host_cpuid_has_avx512f(void)
+{
+    if (!probed) {
+        host_cpuid_probe();
+    }
+    return has_avx512f;
+}
+#endif
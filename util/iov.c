@@ -19,8 +19,8 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 
-size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
-                    size_t offset, const void *buf, size_t bytes)
+size_t iov_from_buf_full(const struct iovec *iov, unsigned int iov_cnt,
+                         size_t offset, const void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -38,8 +38,8 @@ size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
     return done;
 }
 
-size_t iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
-                  size_t offset, void *buf, size_t bytes)
+size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
+                       size_t offset, void *buf, size_t bytes)
 {
     size_t done;
     unsigned int i;
@@ -265,12 +265,29 @@ unsigned iov_copy(struct iovec *dst_iov, unsigned int dst_iov_cnt,
 
 void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
 {
-    qiov->iov = g_new(struct iovec, alloc_hint);
+    if (alloc_hint <= QEMU_IOVEC_LOCAL_NIOV) {
+        qiov->iov = qiov->local_iov;
+        qiov->nalloc = QEMU_IOVEC_LOCAL_NIOV;
+    } else {
+        qiov->iov = g_new(struct iovec, alloc_hint);
+        qiov->nalloc = alloc_hint;
+    }
     qiov->niov = 0;
-    qiov->nalloc = alloc_hint;
     qiov->size = 0;
 }
 
+/* Make room for @nalloc elements, moving them off local_iov if needed */
+static void qemu_iovec_reserve(QEMUIOVector *qiov, int nalloc)
+{
+    if (qiov->iov == qiov->local_iov) {
+        qiov->iov = g_new(struct iovec, nalloc);
+        memcpy(qiov->iov, qiov->local_iov, qiov->niov * sizeof(*qiov->iov));
+    } else {
+        qiov->iov = g_renew(struct iovec, qiov->iov, nalloc);
+    }
+    qiov->nalloc = nalloc;
+}
+
 void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov)
 {
     int i;
@@ -288,8 +305,7 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
     assert(qiov->nalloc != -1);
 
     if (qiov->niov == qiov->nalloc) {
-        qiov->nalloc = 2 * qiov->nalloc + 1;
-        qiov->iov = g_renew(struct iovec, qiov->iov, qiov->nalloc);
+        qemu_iovec_reserve(qiov, 2 * qiov->nalloc + 1);
     }
     qiov->iov[qiov->niov].iov_base = base;
     qiov->iov[qiov->niov].iov_len = len;
@@ -318,6 +334,18 @@ size_t qemu_iovec_concat_iov(QEMUIOVector *dst,
         return 0;
     }
     assert(dst->nalloc != -1);
+    if (src_cnt == 1) {
+        assert(soffset <= src_iov[0].iov_len); /* offset beyond end of src */
+        done = MIN(src_iov[0].iov_len - soffset, sbytes);
+        if (done) {
+            qemu_iovec_add(dst, src_iov[0].iov_base + soffset, done);
+        }
+        return done;
+    }
+    /* grow once rather than once per doubling */
+    if (dst->niov + src_cnt > dst->nalloc) {
+        qemu_iovec_reserve(dst, dst->niov + src_cnt);
+    }
     for (i = 0, done = 0; done < sbytes && i < src_cnt; i++) {
         if (soffset < src_iov[i].iov_len) {
             size_t len = MIN(src_iov[i].iov_len - soffset, sbytes - done);
@@ -349,6 +377,38 @@ void qemu_iovec_concat(QEMUIOVector *dst,
     qemu_iovec_concat_iov(dst, src->iov, src->niov, soffset, sbytes);
 }
 
+/*
+ * Check if @len bytes at @p are all zero, whatever their alignment.  The
+ * aligned middle goes through the vectorized buffer_find_nonzero_offset().
+ */
+static bool iov_buffer_is_zero(const uint8_t *p, size_t len)
+{
+    const size_t block = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                         sizeof(VECTYPE);
+    size_t head = -(uintptr_t)p & (sizeof(VECTYPE) - 1);
+    size_t body;
+
+    if (len >= head + block) {
+        for (; head; head--, len--) {
+            if (*p++) {
+                return false;
+            }
+        }
+        body = QEMU_ALIGN_DOWN(len, block);
+        if (buffer_find_nonzero_offset(p, body) != body) {
+            return false;
+        }
+        p += body;
+        len -= body;
+    }
+    for (; len; len--) {
+        if (*p++) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*
  * Check if the contents of the iovecs are all zero
  */
@@ -356,16 +416,9 @@ bool qemu_iovec_is_zero(QEMUIOVector *qiov)
 {
     int i;
     for (i = 0; i < qiov->niov; i++) {
-        size_t offs = QEMU_ALIGN_DOWN(qiov->iov[i].iov_len, 4 * sizeof(long));
-        uint8_t *ptr = qiov->iov[i].iov_base;
-        if (offs && !buffer_is_zero(qiov->iov[i].iov_base, offs)) {
+        if (!iov_buffer_is_zero(qiov->iov[i].iov_base, qiov->iov[i].iov_len)) {
             return false;
         }
-        for (; offs < qiov->iov[i].iov_len; offs++) {
-            if (ptr[offs]) {
-                return false;
-            }
-        }
     }
     return true;
 }
@@ -375,7 +428,9 @@ void qemu_iovec_destroy(QEMUIOVector *qiov)
     assert(qiov->nalloc != -1);
 
     qemu_iovec_reset(qiov);
-    g_free(qiov->iov);
+    if (qiov->iov != qiov->local_iov) {
+        g_free(qiov->iov);
+    }
     qiov->nalloc = 0;
     qiov->iov = NULL;
 }
@@ -0,0 +1,59 @@
+/*
+ * Anonymous shared memory backed by a file descriptor
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/memfd.h"
+
+#ifdef CONFIG_MEMFD
+#include <sys/memfd.h>
+#else
+#include <sys/syscall.h>
+
+static int memfd_create(const char *name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+    return syscall(__NR_memfd_create, name, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+int qemu_memfd_create(const char *name, size_t size, bool hugetlb,
+                      unsigned int seals, Error **errp)
+{
+    unsigned int flags = MFD_CLOEXEC;
+    int fd;
+
+    if (seals) {
+        flags |= MFD_ALLOW_SEALING;
+    }
+    if (hugetlb) {
+        flags |= MFD_HUGETLB;
+    }
+
+    fd = memfd_create(name, flags);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create memfd%s",
+                         hugetlb ? " on hugetlbfs" : "");
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        error_setg_errno(errp, errno, "cannot resize memfd to %zu bytes",
+                         size);
+        goto fail;
+    }
+    if (seals && fcntl(fd, F_ADD_SEALS, seals) < 0) {
+        error_setg_errno(errp, errno, "cannot seal memfd");
+        goto fail;
+    }
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
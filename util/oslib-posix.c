@@ -58,6 +58,8 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -168,6 +170,34 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     }
 }
 
+/*
+ * Coroutine stacks are mapped rather than malloc'ed, so that only the pages
+ * a coroutine touches are backed by memory, and a PROT_NONE page at the
+ * bottom turns a stack overflow into a segfault instead of corrupting the
+ * neighbouring heap.  *@sz grows by the size of that page.
+ */
+void *qemu_alloc_stack(size_t *sz)
+{
+    size_t pagesz = getpagesize();
+    void *ptr;
+
+    *sz = ROUND_UP(*sz, pagesz) + pagesz;
+    ptr = mmap(NULL, *sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        abort();
+    }
+    if (mprotect(ptr, pagesz, PROT_NONE) != 0) {
+        abort();
+    }
+    return ptr;
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    munmap(stack, sz);
+}
+
 void qemu_set_block(int fd)
 {
     int f;
@@ -345,11 +375,56 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+#define MAX_MEM_PREALLOC_THREADS 16
+
+typedef struct MemsetThread {
+    QemuThread thread;
+    sigjmp_buf env;
+    int index;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    MemPreallocThreadInit *thread_init;
+    void *opaque;
+} MemsetThread;
+
+static bool memset_thread_failed;
+static __thread sigjmp_buf *sigbus_env;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    /* The fault is synchronous, it is delivered to the faulting thread */
+    if (sigbus_env) {
+        siglongjmp(*sigbus_env, 1);
+    }
+    abort();
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *t = arg;
+    sigset_t set;
+    size_t i;
+
+    if (t->thread_init) {
+        t->thread_init(t->index, t->opaque);
+    }
+
+    /* qemu_thread_create() blocks all signals, SIGBUS must get through */
+    sigbus_env = &t->env;
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(t->env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < t->numpages; i++) {
+            memset(t->addr + t->hpagesize * i, 0, 1);
+        }
+    }
+    return NULL;
 }
 
 static size_t fd_getpagesize(int fd)
@@ -372,11 +447,28 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+/*
+ * Fault in every page of @area from @nr_threads threads, or from as many
+ * threads as there are host CPUs up to MAX_MEM_PREALLOC_THREADS if it is
+ * zero.  Each thread touches a contiguous share of the pages, after
+ * calling @thread_init with its index if it is not NULL.
+ */
+void os_mem_prealloc(int fd, char *area, size_t memory, int nr_threads,
+                     MemPreallocThreadInit *thread_init, void *opaque)
 {
-    int ret;
+    int ret, i;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    size_t pages_per_thread, left;
+    char *addr = area;
+    MemsetThread *memset_thread;
+
+    if (nr_threads <= 0) {
+        nr_threads = MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                         MAX_MEM_PREALLOC_THREADS);
+    }
+    nr_threads = MAX(1, MIN(nr_threads, numpages));
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -388,32 +480,41 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    memset_thread = g_new0(MemsetThread, nr_threads);
+    memset_thread_failed = false;
+    pages_per_thread = numpages / nr_threads;
+    left = numpages % nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        MemsetThread *t = &memset_thread[i];
+
+        t->index = i;
+        t->addr = addr;
+        t->numpages = pages_per_thread + (i < left);
+        t->hpagesize = hpagesize;
+        t->thread_init = thread_init;
+        t->opaque = opaque;
+        addr += t->numpages * hpagesize;
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&memset_thread[i].thread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&memset_thread[i].thread);
+    }
+    g_free(memset_thread);
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (memset_thread_failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
 
@@ -27,6 +27,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitmap.h"
 
 static bool name_threads;
 
@@ -491,6 +492,69 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t *set = CPU_ALLOC(nbits);
+    size_t size = CPU_ALLOC_SIZE(nbits);
+    unsigned long cpu;
+    int err;
+
+    if (!set) {
+        return -ENOMEM;
+    }
+    CPU_ZERO_S(size, set);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        CPU_SET_S(cpu, size, set);
+    }
+    err = pthread_setaffinity_np(thread->thread, size, set);
+    CPU_FREE(set);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/* Add the CPUs of a host NUMA node, as listed by sysfs ("0-3,8-11") */
+int qemu_host_node_get_cpus(unsigned long node, unsigned long *host_cpus,
+                            unsigned long nbits)
+{
+#ifdef CONFIG_LINUX
+    char *path, *contents, *p;
+    bool ok;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist", node);
+    ok = g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    if (!ok) {
+        return -ENOENT;
+    }
+
+    p = contents;
+    while (g_ascii_isdigit(*p)) {
+        unsigned long first, last;
+
+        first = last = strtoul(p, &p, 10);
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < nbits; first++) {
+            set_bit(first, host_cpus);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    g_free(contents);
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
@@ -419,3 +419,16 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+    return -ENOSYS;
+}
+
+int qemu_host_node_get_cpus(unsigned long node, unsigned long *host_cpus,
+                            unsigned long nbits)
+{
+    return -ENOSYS;
+}
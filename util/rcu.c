@@ -36,6 +36,8 @@
 #include "qemu/atomic.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 /*
  * Global grace period counter.  Bit 0 is always one in rcu_gp_ctr.
@@ -124,11 +126,17 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
+/* Protected by rcu_gp_lock.  */
+static RCUStats rcu_stats;
+
 void synchronize_rcu(void)
 {
     qemu_mutex_lock(&rcu_gp_lock);
 
     if (!QLIST_EMPTY(&registry)) {
+        int64_t start = get_clock();
+        uint64_t ns;
+
         /* In either case, the atomic_mb_set below blocks stores that free
          * old RCU-protected pointers.
          */
@@ -147,6 +155,13 @@ void synchronize_rcu(void)
         }
 
         wait_for_readers();
+
+        ns = get_clock() - start;
+        rcu_stats.grace_periods++;
+        rcu_stats.gp_time_last_ns = ns;
+        rcu_stats.gp_time_max_ns = MAX(rcu_stats.gp_time_max_ns, ns);
+        rcu_stats.gp_time_total_ns += ns;
+        trace_rcu_synchronize(ns);
     }
 
     qemu_mutex_unlock(&rcu_gp_lock);
@@ -155,24 +170,46 @@ void synchronize_rcu(void)
 
 #define RCU_CALL_MIN_SIZE        30
 
-/* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
- * from liburcu.  Note that head is only used by the consumer.
+/* A thread with this many callbacks waiting expedites the grace period.  */
+#define RCU_CALL_EXPEDITE_SIZE   1000
+
+/* Queue for the callbacks of threads that are not registered.  Each
+ * registered thread queues its callbacks in rcu_reader.cbs, so that
+ * call_rcu1 does not bounce a global cache line between threads.
  */
-static struct rcu_head dummy;
-static struct rcu_head *head = &dummy, **tail = &dummy.next;
+static struct rcu_call_queue rcu_call_queue = {
+    .head = &rcu_call_queue.dummy,
+    .tail = &rcu_call_queue.dummy.next,
+};
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
-static void enqueue(struct rcu_head *node)
+static bool rcu_call_expedited;
+static QemuSemaphore rcu_call_expedite_sem;
+
+/* Protected by rcu_gp_lock.  */
+static int rcu_call_batch;
+
+/* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
+ * from liburcu.  Note that head is only used by the consumer.
+ */
+static void call_queue_init(struct rcu_call_queue *q)
+{
+    q->dummy.next = NULL;
+    q->head = &q->dummy;
+    q->tail = &q->dummy.next;
+}
+
+static void enqueue(struct rcu_call_queue *q, struct rcu_head *node)
 {
     struct rcu_head **old_tail;
 
     node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
+    old_tail = atomic_xchg(&q->tail, &node->next);
     atomic_mb_set(old_tail, node);
 }
 
-static struct rcu_head *try_dequeue(void)
+static struct rcu_head *try_dequeue(struct rcu_call_queue *q)
 {
     struct rcu_head *node, *next;
 
@@ -183,15 +220,15 @@ retry:
      * The tail, because it is the first step in the enqueuing.
      * It is only the next pointers that might be inconsistent.
      */
-    if (head == &dummy && atomic_mb_read(&tail) == &dummy.next) {
+    if (q->head == &q->dummy && atomic_mb_read(&q->tail) == &q->dummy.next) {
         abort();
     }
 
     /* If the head node has NULL in its next pointer, the value is
      * wrong and we need to wait until its enqueuer finishes the update.
      */
-    node = head;
-    next = atomic_mb_read(&head->next);
+    node = q->head;
+    next = atomic_mb_read(&q->head->next);
     if (!next) {
         return NULL;
     }
@@ -201,60 +238,138 @@ retry:
      * dummy node, and the one being removed.  So we do not need to update
      * the tail pointer.
      */
-    head = next;
+    q->head = next;
 
     /* If we dequeued the dummy node, add it back at the end and retry.  */
-    if (node == &dummy) {
-        enqueue(node);
+    if (node == &q->dummy) {
+        enqueue(q, node);
         goto retry;
     }
 
     return node;
 }
 
-static void *call_rcu_thread(void *opaque)
+/* Dequeue a node that is known to be there, waiting for its enqueuer
+ * to finish linking it if needed.
+ */
+static struct rcu_head *dequeue(struct rcu_call_queue *q)
 {
     struct rcu_head *node;
 
+    node = try_dequeue(q);
+    while (!node) {
+        qemu_event_reset(&rcu_call_ready_event);
+        node = try_dequeue(q);
+        if (!node) {
+            qemu_event_wait(&rcu_call_ready_event);
+            node = try_dequeue(q);
+        }
+    }
+    return node;
+}
+
+/* Count the callbacks that are waiting for a grace period.  With
+ * @snapshot, also record how many of them the next batch will run:
+ * only those that were queued before synchronize_rcu() starts.
+ */
+static unsigned long rcu_call_pending(bool snapshot)
+{
+    struct rcu_reader_data *index;
+    unsigned long n;
+
+    qemu_mutex_lock(&rcu_gp_lock);
+    n = atomic_read(&rcu_call_count);
+    if (snapshot) {
+        rcu_call_batch = n;
+    }
+    QLIST_FOREACH(index, &registry, node) {
+        unsigned long pending = atomic_read(&index->cb_queued) -
+                                index->cb_taken;
+        if (snapshot) {
+            index->cb_batch = pending;
+        }
+        n += pending;
+    }
+    qemu_mutex_unlock(&rcu_gp_lock);
+    return n;
+}
+
+/* Take the callbacks recorded by rcu_call_pending(true) off the queues,
+ * and return them as a list linked through their next pointers.  Threads
+ * that unregistered in the meanwhile have moved their callbacks to
+ * rcu_call_queue; those run in the next batch.
+ */
+static struct rcu_head *rcu_call_collect(bool expedited, unsigned long *count)
+{
+    struct rcu_reader_data *index;
+    struct rcu_head *list = NULL, **list_tail = &list, *node;
+    unsigned long n = 0;
+
+    qemu_mutex_lock(&rcu_gp_lock);
+    atomic_sub(&rcu_call_count, rcu_call_batch);
+    for (; rcu_call_batch > 0; rcu_call_batch--) {
+        node = dequeue(&rcu_call_queue);
+        *list_tail = node;
+        list_tail = &node->next;
+        n++;
+    }
+    QLIST_FOREACH(index, &registry, node) {
+        for (; index->cb_batch > 0; index->cb_batch--) {
+            node = dequeue(&index->cbs);
+            *list_tail = node;
+            list_tail = &node->next;
+            atomic_set(&index->cb_taken, index->cb_taken + 1);
+            n++;
+        }
+    }
+    *list_tail = NULL;
+
+    rcu_stats.batches++;
+    rcu_stats.expedited_batches += expedited;
+    rcu_stats.callbacks += n;
+    rcu_stats.max_batch = MAX(rcu_stats.max_batch, n);
+    qemu_mutex_unlock(&rcu_gp_lock);
+
+    *count = n;
+    return list;
+}
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *node, *next;
+
     rcu_register_thread();
 
     for (;;) {
         int tries = 0;
-        int n = atomic_read(&rcu_call_count);
+        unsigned long n = rcu_call_pending(false);
+        bool expedited;
 
-        /* Heuristically wait for a decent number of callbacks to pile up.
-         * Fetch rcu_call_count now, we only must process elements that were
-         * added before synchronize_rcu() starts.
+        /* Heuristically wait for a decent number of callbacks to pile up,
+         * unless somebody asked for them to be run quickly.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
-            g_usleep(10000);
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5 &&
+                          !atomic_read(&rcu_call_expedited))) {
+            qemu_sem_timedwait(&rcu_call_expedite_sem, 10);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
-                n = atomic_read(&rcu_call_count);
+                n = rcu_call_pending(false);
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
             }
-            n = atomic_read(&rcu_call_count);
+            n = rcu_call_pending(false);
         }
 
-        atomic_sub(&rcu_call_count, n);
+        expedited = atomic_xchg(&rcu_call_expedited, false);
+        rcu_call_pending(true);
         synchronize_rcu();
-        qemu_mutex_lock_iothread();
-        while (n > 0) {
-            node = try_dequeue();
-            while (!node) {
-                qemu_mutex_unlock_iothread();
-                qemu_event_reset(&rcu_call_ready_event);
-                node = try_dequeue();
-                if (!node) {
-                    qemu_event_wait(&rcu_call_ready_event);
-                    node = try_dequeue();
-                }
-                qemu_mutex_lock_iothread();
-            }
+        node = rcu_call_collect(expedited, &n);
+        trace_rcu_call_batch(n, expedited);
 
-            n--;
+        qemu_mutex_lock_iothread();
+        for (; node; node = next) {
+            next = node->next;
             node->func(node);
         }
         qemu_mutex_unlock_iothread();
@@ -264,24 +379,76 @@ static void *call_rcu_thread(void *opaque)
 
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+
     node->func = func;
-    enqueue(node);
-    atomic_inc(&rcu_call_count);
+    if (p_rcu_reader->registered) {
+        unsigned long queued = p_rcu_reader->cb_queued + 1;
+
+        enqueue(&p_rcu_reader->cbs, node);
+        atomic_set(&p_rcu_reader->cb_queued, queued);
+        if (queued - atomic_read(&p_rcu_reader->cb_taken) >=
+            RCU_CALL_EXPEDITE_SIZE) {
+            call_rcu_expedite();
+        }
+    } else {
+        enqueue(&rcu_call_queue, node);
+        atomic_inc(&rcu_call_count);
+    }
     qemu_event_set(&rcu_call_ready_event);
 }
 
+void call_rcu_expedite(void)
+{
+    if (!atomic_read(&rcu_call_expedited) &&
+        !atomic_xchg(&rcu_call_expedited, true)) {
+        qemu_sem_post(&rcu_call_expedite_sem);
+    }
+}
+
+void rcu_get_stats(RCUStats *stats)
+{
+    unsigned long pending = rcu_call_pending(false);
+
+    qemu_mutex_lock(&rcu_gp_lock);
+    *stats = rcu_stats;
+    qemu_mutex_unlock(&rcu_gp_lock);
+    stats->pending = pending;
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
+    if (!rcu_reader.cbs.tail) {
+        call_queue_init(&rcu_reader.cbs);
+    }
     qemu_mutex_lock(&rcu_gp_lock);
+    rcu_reader.cb_batch = 0;
+    rcu_reader.registered = true;
     QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
     qemu_mutex_unlock(&rcu_gp_lock);
 }
 
 void rcu_unregister_thread(void)
 {
+    unsigned long n;
+
     qemu_mutex_lock(&rcu_gp_lock);
     QLIST_REMOVE(&rcu_reader, node);
+    rcu_reader.registered = false;
+
+    /* The call_rcu thread cannot reach our queue anymore, hand the
+     * callbacks that it did not take to the global queue.
+     */
+    n = rcu_reader.cb_queued - rcu_reader.cb_taken;
+    rcu_reader.cb_taken = rcu_reader.cb_queued;
+    if (n) {
+        atomic_add(&rcu_call_count, n);
+        while (n--) {
+            enqueue(&rcu_call_queue, dequeue(&rcu_reader.cbs));
+        }
+        qemu_event_set(&rcu_call_ready_event);
+    }
     qemu_mutex_unlock(&rcu_gp_lock);
 }
 
@@ -293,6 +460,7 @@ static void rcu_init_complete(void)
     qemu_event_init(&rcu_gp_event, true);
 
     qemu_event_init(&rcu_call_ready_event, false);
+    qemu_sem_init(&rcu_call_expedite_sem, 0);
 
     /* The caller is assumed to have iothread lock, so the call_rcu thread
      * must have been quiescent even after forking, just recreate it.
@@ -152,6 +152,14 @@ bool throttle_compute_timer(ThrottleState *ts,
     /* if the code must wait compute when the next timer should fire */
     if (wait) {
         *next_timestamp = now + wait;
+        if (ts->cfg.tick) {
+            /* Round up to a multiple of the tick: the timers of all the
+             * drives that use the same tick then expire together, and
+             * the requests that they release in one go are those that
+             * the buckets allow during the whole tick */
+            *next_timestamp += ts->cfg.tick - 1;
+            *next_timestamp -= *next_timestamp % ts->cfg.tick;
+        }
         return true;
     }
 
@@ -297,6 +305,14 @@ bool throttle_is_valid(ThrottleConfig *cfg)
         }
     }
 
+    if (cfg->weight > THROTTLE_WEIGHT_MAX || cfg->iops_reserved < 0) {
+        invalid = true;
+    }
+
+    if (cfg->tick > THROTTLE_TICK_MAX) {
+        invalid = true;
+    }
+
     return !invalid;
 }
 
@@ -330,6 +346,28 @@ static void throttle_cancel_timer(QEMUTimer *timer)
     timer_del(timer);
 }
 
+/* Configure the throttle without touching any timer, for a ThrottleState
+ * that has none of its own
+ *
+ * @ts:         the throttle state we are working on
+ * @clock_type: the clock used to leak the buckets
+ * @cfg:        the config to set
+ */
+void throttle_config_buckets(ThrottleState *ts,
+                             QEMUClockType clock_type,
+                             ThrottleConfig *cfg)
+{
+    int i;
+
+    ts->cfg = *cfg;
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        throttle_fix_bucket(&ts->cfg.buckets[i]);
+    }
+
+    ts->previous_leak = qemu_clock_get_ns(clock_type);
+}
+
 /* Used to configure the throttle
  *
  * @ts: the throttle state we are working on
@@ -342,13 +380,7 @@ void throttle_config(ThrottleState *ts,
 {
     int i;
 
-    ts->cfg = *cfg;
-
-    for (i = 0; i < BUCKETS_COUNT; i++) {
-        throttle_fix_bucket(&ts->cfg.buckets[i]);
-    }
-
-    ts->previous_leak = qemu_clock_get_ns(tt->clock_type);
+    throttle_config_buckets(ts, tt->clock_type, cfg);
 
     for (i = 0; i < 2; i++) {
         throttle_cancel_timer(tt->timers[i]);
@@ -98,6 +98,7 @@ int main(int argc, char **argv)
 #include "qemu-options.h"
 #include "qmp-commands.h"
 #include "qemu/main-loop.h"
+#include "block/coroutine.h"
 #ifdef CONFIG_VIRTFS
 #include "fsdev/qemu-fsdev.h"
 #endif
@@ -152,6 +153,8 @@ int no_quit = 0;
 #ifdef CONFIG_GTK
 static bool grab_on_hover;
 #endif
+static bool startup_profile;
+static int64_t startup_time, startup_phase_time;
 CharDriverState *serial_hds[MAX_SERIAL_PORTS];
 CharDriverState *parallel_hds[MAX_PARALLEL_PORTS];
 CharDriverState *virtcon_hds[MAX_VIRTIO_CONSOLES];
@@ -278,6 +281,9 @@ static QemuOptsList qemu_trace_opts = {
         },{
             .name = "file",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "mmap",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -474,6 +480,12 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "sleep",
             .type = QEMU_OPT_BOOL,
+        }, {
+            .name = "rr",
+            .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrfile",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -1130,11 +1142,57 @@ static int cleanup_add_fd(void *opaque, QemuOpts *opts, Error **errp)
 #define MTD_OPTS ""
 #define SD_OPTS ""
 
+typedef struct DriveInitState {
+    BlockInterfaceType block_default_type;
+    int pending;
+    bool failed;
+} DriveInitState;
+
+typedef struct DriveInitCo {
+    DriveInitState *s;
+    QemuOpts *opts;
+} DriveInitCo;
+
+static void coroutine_fn drive_init_co(void *opaque)
+{
+    DriveInitCo *d = opaque;
+
+    if (!drive_new(d->opts, d->s->block_default_type)) {
+        d->s->failed = true;
+    }
+    d->s->pending--;
+    g_free(d);
+}
+
+/*
+ * Every -drive is set up in a coroutine of its own.  Image I/O, such as
+ * format probing and reading the metadata of the image and its backing
+ * chain, goes through the thread pool and makes the coroutine yield, so
+ * the next drive is set up in the meantime.  Everything up to the first
+ * I/O, including the bus and unit assignment, happens in command line
+ * order.  drive_init_wait() joins the drives.
+ */
 static int drive_init_func(void *opaque, QemuOpts *opts, Error **errp)
 {
-    BlockInterfaceType *block_default_type = opaque;
+    DriveInitCo *d = g_new(DriveInitCo, 1);
+    Coroutine *co;
 
-    return drive_new(opts, *block_default_type) == NULL;
+    d->s = opaque;
+    d->opts = opts;
+    d->s->pending++;
+    co = qemu_coroutine_create(drive_init_co);
+    qemu_coroutine_enter(co, d);
+    return 0;
+}
+
+static void drive_init_wait(DriveInitState *s)
+{
+    while (s->pending) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    if (s->failed) {
+        exit(1);
+    }
 }
 
 static int drive_enable_snapshot(void *opaque, QemuOpts *opts, Error **errp)
@@ -1842,6 +1900,20 @@ void qemu_system_debug_request(void)
     qemu_notify_event();
 }
 
+/* With -startup-profile, report the time spent since the previous phase */
+static void startup_phase_done(const char *phase)
+{
+    int64_t now;
+
+    if (!startup_profile) {
+        return;
+    }
+    now = get_clock();
+    fprintf(stderr, "qemu: startup: %-14s %9.3f ms\n", phase,
+            (now - startup_phase_time) / 1e6);
+    startup_phase_time = now;
+}
+
 static bool main_loop_should_exit(void)
 {
     RunState r;
@@ -2973,12 +3045,16 @@ int main(int argc, char **argv, char **envp)
     };
     const char *trace_events = NULL;
     const char *trace_file = NULL;
+    bool trace_file_mmap = false;
     ram_addr_t maxram_size;
     uint64_t ram_slots = 0;
     FILE *vmstate_dump_file = NULL;
     Error *main_loop_err = NULL;
+    DriveInitState drive_init = { 0 };
     Error *err = NULL;
 
+    startup_time = startup_phase_time = get_clock();
+
     qemu_init_cpu_loop();
     qemu_mutex_lock_iothread();
 
@@ -3464,7 +3540,7 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_virtfs: {
                 QemuOpts *fsdev;
                 QemuOpts *device;
-                const char *writeout, *sock_fd, *socket;
+                const char *writeout, *sock_fd, *socket, *stat_cache;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3515,6 +3591,16 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd, &error_abort);
                 }
+                stat_cache = qemu_opt_get(opts, "stat_cache_ttl");
+                if (stat_cache) {
+                    qemu_opt_set(fsdev, "stat_cache_ttl", stat_cache,
+                                 &error_abort);
+                }
+                stat_cache = qemu_opt_get(opts, "stat_cache_size");
+                if (stat_cache) {
+                    qemu_opt_set(fsdev, "stat_cache_size", stat_cache,
+                                 &error_abort);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                   qemu_opt_get_bool(opts, "readonly", 0),
@@ -3854,6 +3940,40 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_trace:
+                tb_trace_threshold = strtoul(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_tb_profile:
+                tb_profile_enabled = true;
+                break;
+            case QEMU_OPTION_qcow2_cache_budget:
+                {
+                    int64_t value;
+                    char *end;
+
+                    value = strtosz(optarg, &end);
+                    if (value < 0 || *end) {
+                        error_report("invalid qcow2 cache budget: %s", optarg);
+                        exit(1);
+                    }
+                    qcow2_cache_budget = value;
+                    break;
+                }
+            case QEMU_OPTION_tb_smc_limit:
+                tb_smc_limit = strtoul(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_perfmap:
+                if (perfmap_init() < 0) {
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_tcg_thread:
+                qemu_tcg_configure(optarg, &err);
+                if (err) {
+                    error_report_err(err);
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -3900,6 +4020,7 @@ int main(int argc, char **argv, char **envp)
                 }
                 trace_events = qemu_opt_get(opts, "events");
                 trace_file = qemu_opt_get(opts, "file");
+                trace_file_mmap = qemu_opt_get_bool(opts, "mmap", false);
                 break;
             }
             case QEMU_OPTION_readconfig:
@@ -3991,6 +4112,9 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_msg(opts);
                 break;
+            case QEMU_OPTION_startup_profile:
+                startup_profile = true;
+                break;
             case QEMU_OPTION_dump_vmstate:
                 if (vmstate_dump_file) {
                     fprintf(stderr, "qemu: only one '-dump-vmstate' "
@@ -4024,6 +4148,7 @@ int main(int argc, char **argv, char **envp)
     set_memory_options(&ram_slots, &maxram_size, machine_class);
 
     loc_set_none();
+    startup_phase_done("options");
 
     os_daemonize();
 
@@ -4096,7 +4221,8 @@ int main(int argc, char **argv, char **envp)
     }
 
     if (!is_daemonized()) {
-        if (!trace_init_backends(trace_events, trace_file)) {
+        if (!trace_init_backends(trace_events, trace_file,
+                                 trace_file_mmap)) {
             exit(1);
         }
     }
@@ -4307,6 +4433,7 @@ int main(int argc, char **argv, char **envp)
                           object_create_delayed, NULL)) {
         exit(1);
     }
+    startup_phase_done("objects");
 
     machine_opts = qemu_get_machine_opts();
     if (qemu_opt_foreach(machine_opts, machine_set_property, current_machine,
@@ -4316,6 +4443,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     configure_accelerator(current_machine);
+    startup_phase_done("accelerator");
 
     if (qtest_chrdev) {
         Error *local_err = NULL;
@@ -4402,7 +4530,15 @@ int main(int argc, char **argv, char **envp)
             fprintf(stderr, "-icount is not allowed with kvm or xen\n");
             exit(1);
         }
-        configure_icount(icount_opts, &error_abort);
+        if (qemu_tcg_mttcg_enabled()) {
+            fprintf(stderr, "-icount is not allowed with -tcg-thread multi\n");
+            exit(1);
+        }
+        configure_icount(icount_opts, &err);
+        if (err) {
+            error_report_err(err);
+            exit(1);
+        }
         qemu_opts_del(icount_opts);
     }
 
@@ -4432,7 +4568,9 @@ int main(int argc, char **argv, char **envp)
     }
 
     blk_mig_init();
+    dirty_bitmap_mig_init();
     ram_mig_init();
+    blockdev_stats_init();
 
     /* If the currently selected machine wishes to override the units-per-bus
      * property of its default HBA interface type, do so now. */
@@ -4445,15 +4583,16 @@ int main(int argc, char **argv, char **envp)
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"),
                           drive_enable_snapshot, NULL, NULL);
-    if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func,
-                          &machine_class->block_default_type, NULL)) {
-        exit(1);
-    }
+    drive_init.block_default_type = machine_class->block_default_type;
+    qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func,
+                      &drive_init, NULL);
+    drive_init_wait(&drive_init);
 
     default_drive(default_cdrom, snapshot, machine_class->block_default_type, 2,
                   CDROM_OPTS);
     default_drive(default_floppy, snapshot, IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, IF_SD, 0, SD_OPTS);
+    startup_phase_done("netdevs-drives");
 
     parse_numa_opts(machine_class);
 
@@ -4508,6 +4647,7 @@ int main(int argc, char **argv, char **envp)
     current_machine->cpu_model = cpu_model;
 
     machine_class->init(current_machine);
+    startup_phase_done("machine");
 
     realtime_init();
 
@@ -4533,6 +4673,7 @@ int main(int argc, char **argv, char **envp)
                           device_init_func, NULL, NULL)) {
         exit(1);
     }
+    startup_phase_done("devices");
 
     /* Did we create any drives that we failed to create a device for? */
     drive_check_orphaned();
@@ -4601,6 +4742,7 @@ int main(int argc, char **argv, char **envp)
     if (foreach_device_config(DEV_GDB, gdbserver_start) < 0) {
         exit(1);
     }
+    startup_phase_done("displays");
 
     qdev_machine_creation_done();
 
@@ -4613,6 +4755,7 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "rom check and register reset failed\n");
         exit(1);
     }
+    startup_phase_done("machine-done");
 
     qemu_system_reset(VMRESET_SILENT);
     register_global_state();
@@ -4621,6 +4764,7 @@ int main(int argc, char **argv, char **envp)
             autostart = 0;
         }
     }
+    startup_phase_done("reset");
 
     qdev_prop_check_globals();
     if (vmstate_dump_file) {
@@ -4645,10 +4789,16 @@ int main(int argc, char **argv, char **envp)
     os_setup_post();
 
     if (is_daemonized()) {
-        if (!trace_init_backends(trace_events, trace_file)) {
+        if (!trace_init_backends(trace_events, trace_file,
+                                 trace_file_mmap)) {
             exit(1);
         }
     }
+    startup_phase_done("start");
+    if (startup_profile) {
+        fprintf(stderr, "qemu: startup: %-14s %9.3f ms\n", "total",
+                (get_clock() - startup_time) / 1e6);
+    }
 
     main_loop();
     bdrv_close_all();
@@ -56,3 +56,9 @@ int xen_hvm_init(ram_addr_t *below_4g_mem_size, ram_addr_t *above_4g_mem_size,
 void qmp_xen_set_global_dirty_log(bool enable, Error **errp)
 {
 }
+
+XenMapCacheInfo *qmp_query_xen_mapcache(Error **errp)
+{
+    error_setg(errp, "The Xen mapcache is not in use");
+    return NULL;
+}
@@ -20,6 +20,7 @@
 #include <sys/mman.h>
 
 #include "sysemu/xen-mapcache.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 
@@ -35,12 +36,14 @@
 
 #if HOST_LONG_BITS == 32
 #  define MCACHE_BUCKET_SHIFT 16
+#  define MCACHE_MAX_BUCKET_SHIFT 18
 #  define MCACHE_MAX_SIZE     (1UL<<31) /* 2GB Cap */
 #else
 #  define MCACHE_BUCKET_SHIFT 20
+#  define MCACHE_MAX_BUCKET_SHIFT 24
 #  define MCACHE_MAX_SIZE     (1UL<<35) /* 32GB Cap */
 #endif
-#define MCACHE_BUCKET_SIZE (1UL << MCACHE_BUCKET_SHIFT)
+#define MCACHE_BUCKET_SIZE (1UL << mapcache->mcache_bucket_shift)
 
 /* This is the size of the virtual address space reserve to QEMU that will not
  * be use by MapCache.
@@ -56,6 +59,7 @@ typedef struct MapCacheEntry {
     uint8_t lock;
     hwaddr size;
     struct MapCacheEntry *next;
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
@@ -70,6 +74,21 @@ typedef struct MapCache {
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
 
+    /*
+     * All mapped entries, most recently used first.  Once max_mcache_size
+     * bytes are mapped, the least recently used unlocked entries are
+     * unmapped to make room for new ones.
+     */
+    QTAILQ_HEAD(map_cache_lru, MapCacheEntry) lru;
+    uint64_t mapped_size;
+    uint64_t nr_mapped;
+    uint64_t nr_locked;
+
+    uint64_t hits;
+    uint64_t remaps;
+    uint64_t evictions;
+    uint64_t invalidations;
+
     /* For most cases (>99.9%), the page address is the same. */
     MapCacheEntry *last_entry;
     unsigned long max_mcache_size;
@@ -113,6 +132,7 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->lru);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -136,18 +156,68 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     setrlimit(RLIMIT_AS, &rlimit_as);
 
+    /*
+     * When all of the guest RAM fits in the cache with room to spare,
+     * nothing is ever evicted and larger buckets take fewer hypercalls
+     * to map it.  Otherwise small buckets waste less of the cache.
+     */
+    mapcache->mcache_bucket_shift = MCACHE_BUCKET_SHIFT;
+    if (ram_size <= mapcache->max_mcache_size / 2) {
+        mapcache->mcache_bucket_shift = MCACHE_MAX_BUCKET_SHIFT;
+    }
+
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
-          (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
-         (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT));
+          (1UL << (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) - 1) >>
+         (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT));
 
     size = mapcache->nr_buckets * sizeof (MapCacheEntry);
     size = (size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
-    DPRINTF("%s, nr_buckets = %lx size %lu\n", __func__,
-            mapcache->nr_buckets, size);
+    DPRINTF("%s, nr_buckets = %lx size %lu bucket size %lu\n", __func__,
+            mapcache->nr_buckets, size, MCACHE_BUCKET_SIZE);
     mapcache->entry = g_malloc0(size);
 }
 
+static void xen_map_cache_unmap_entry(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    mapcache->mapped_size -= entry->size;
+    mapcache->nr_mapped--;
+    if (mapcache->last_entry == entry) {
+        mapcache->last_entry = NULL;
+    }
+
+    entry->paddr_index = 0;
+    entry->vaddr_base = NULL;
+    entry->size = 0;
+    g_free(entry->valid_mapping);
+    entry->valid_mapping = NULL;
+}
+
+/*
+ * Unmap the least recently used unlocked entries until @size more bytes
+ * fit in the cache.  The entries stay in their bucket, free for reuse.
+ */
+static void xen_map_cache_evict(hwaddr size)
+{
+    MapCacheEntry *entry, *prev;
+
+    entry = QTAILQ_LAST(&mapcache->lru, map_cache_lru);
+    while (entry && mapcache->mapped_size + size > mapcache->max_mcache_size) {
+        prev = QTAILQ_PREV(entry, map_cache_lru, lru);
+        if (!entry->lock) {
+            trace_xen_map_cache_evict(entry->paddr_index, entry->size);
+            xen_map_cache_unmap_entry(entry);
+            mapcache->evictions++;
+        }
+        entry = prev;
+    }
+}
+
 static void xen_remap_bucket(MapCacheEntry *entry,
                              hwaddr size,
                              hwaddr address_index)
@@ -157,6 +227,7 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     int *err;
     unsigned int i;
     hwaddr nb_pfn = size >> XC_PAGE_SHIFT;
+    unsigned int shift = mapcache->mcache_bucket_shift - XC_PAGE_SHIFT;
 
     trace_xen_remap_bucket(address_index);
 
@@ -164,18 +235,12 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     err = g_malloc0(nb_pfn * sizeof (int));
 
     if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    if (entry->valid_mapping != NULL) {
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_map_cache_unmap_entry(entry);
     }
+    xen_map_cache_evict(size);
 
     for (i = 0; i < nb_pfn; i++) {
-        pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
+        pfns[i] = (address_index << shift) + i;
     }
 
     vaddr_base = xc_map_foreign_bulk(xen_xc, xen_domid, PROT_READ|PROT_WRITE,
@@ -198,6 +263,11 @@ static void xen_remap_bucket(MapCacheEntry *entry,
         }
     }
 
+    QTAILQ_INSERT_HEAD(&mapcache->lru, entry, lru);
+    mapcache->mapped_size += size;
+    mapcache->nr_mapped++;
+    mapcache->remaps++;
+
     g_free(pfns);
     g_free(err);
 }
@@ -205,7 +275,7 @@ static void xen_remap_bucket(MapCacheEntry *entry,
 static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
                                        uint8_t lock)
 {
-    MapCacheEntry *entry, *pentry = NULL;
+    MapCacheEntry *entry, *free_entry, *pentry = NULL;
     hwaddr address_index;
     hwaddr address_offset;
     hwaddr cache_size = size;
@@ -213,7 +283,7 @@ static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
     bool translated = false;
 
 tryagain:
-    address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
+    address_index  = phys_addr >> mapcache->mcache_bucket_shift;
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
     trace_xen_map_cache(phys_addr);
@@ -235,6 +305,7 @@ tryagain:
         test_bits(address_offset >> XC_PAGE_SHIFT,
                   test_bit_size >> XC_PAGE_SHIFT,
                   mapcache->last_entry->valid_mapping)) {
+        mapcache->hits++;
         trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
         return mapcache->last_entry->vaddr_base + address_offset;
     }
@@ -249,28 +320,42 @@ tryagain:
         cache_size = MCACHE_BUCKET_SIZE;
     }
 
+    /*
+     * Look for a mapping of the bucket in the chain.  Failing that, map it
+     * in an unused entry or in a stale mapping of the same bucket, and
+     * only add an entry to the chain if there is neither: mappings of
+     * other buckets that hash alike are left alone, eviction takes care
+     * of the cache size.
+     */
     entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != cache_size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT,
-                 test_bit_size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
+    free_entry = NULL;
+    while (entry) {
+        if (entry->vaddr_base && entry->paddr_index == address_index &&
+            entry->size == cache_size &&
+            test_bits(address_offset >> XC_PAGE_SHIFT,
+                      test_bit_size >> XC_PAGE_SHIFT,
+                      entry->valid_mapping)) {
+            break;
+        }
+        if (!free_entry && !entry->lock &&
+            (!entry->vaddr_base || (entry->paddr_index == address_index &&
+                                    entry->size == cache_size))) {
+            free_entry = entry;
+        }
         pentry = entry;
         entry = entry->next;
     }
-    if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
-        xen_remap_bucket(entry, cache_size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != cache_size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT,
-                    test_bit_size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, cache_size, address_index);
+    if (entry) {
+        mapcache->hits++;
+        QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+        QTAILQ_INSERT_HEAD(&mapcache->lru, entry, lru);
+    } else {
+        entry = free_entry;
+        if (!entry) {
+            entry = g_malloc0(sizeof(MapCacheEntry));
+            pentry->next = entry;
         }
+        xen_remap_bucket(entry, cache_size, address_index);
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT,
@@ -294,6 +379,7 @@ tryagain:
         reventry->paddr_index = mapcache->last_entry->paddr_index;
         reventry->size = entry->size;
         QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
+        mapcache->nr_locked++;
     }
 
     trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
@@ -340,14 +426,15 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
+    while (entry && (!entry->lock || entry->paddr_index != paddr_index ||
+                     entry->size != size)) {
         entry = entry->next;
     }
     if (!entry) {
         DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
         raddr = 0;
     } else {
-        raddr = (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
+        raddr = (reventry->paddr_index << mapcache->mcache_bucket_shift) +
              ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
     }
     mapcache_unlock();
@@ -356,7 +443,7 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 
 static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
 {
-    MapCacheEntry *entry = NULL, *pentry = NULL;
+    MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
@@ -379,6 +466,7 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     }
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
     g_free(reventry);
+    mapcache->nr_locked--;
 
     if (mapcache->last_entry != NULL &&
         mapcache->last_entry->paddr_index == paddr_index) {
@@ -386,26 +474,16 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        pentry = entry;
+    while (entry && (!entry->lock || entry->paddr_index != paddr_index ||
+                     entry->size != size)) {
         entry = entry->next;
     }
     if (!entry) {
         DPRINTF("Trying to unmap address %p that is not in the mapcache!\n", buffer);
         return;
     }
+    /* The mapping stays cached until it is evicted */
     entry->lock--;
-    if (entry->lock > 0 || pentry == NULL) {
-        return;
-    }
-
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
-    }
-    g_free(entry->valid_mapping);
-    g_free(entry);
 }
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
@@ -417,7 +495,7 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
 
 void xen_invalidate_map_cache(void)
 {
-    unsigned long i;
+    MapCacheEntry *entry, *next;
     MapCacheRev *reventry;
 
     /* Flush pending AIO before destroying the mapcache */
@@ -431,29 +509,40 @@ void xen_invalidate_map_cache(void)
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
-    for (i = 0; i < mapcache->nr_buckets; i++) {
-        MapCacheEntry *entry = &mapcache->entry[i];
-
-        if (entry->vaddr_base == NULL) {
-            continue;
-        }
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, next) {
         if (entry->lock > 0) {
             continue;
         }
-
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+        xen_map_cache_unmap_entry(entry);
     }
 
     mapcache->last_entry = NULL;
+    mapcache->invalidations++;
+    trace_xen_invalidate_map_cache(mapcache->mapped_size);
+
+    mapcache_unlock();
+}
+
+XenMapCacheInfo *qmp_query_xen_mapcache(Error **errp)
+{
+    XenMapCacheInfo *info;
 
+    if (!mapcache) {
+        error_setg(errp, "The Xen mapcache is not in use");
+        return NULL;
+    }
+
+    info = g_new0(XenMapCacheInfo, 1);
+    mapcache_lock();
+    info->bucket_size = MCACHE_BUCKET_SIZE;
+    info->max_size = mapcache->max_mcache_size;
+    info->mapped_size = mapcache->mapped_size;
+    info->entries = mapcache->nr_mapped;
+    info->locked = mapcache->nr_locked;
+    info->hits = mapcache->hits;
+    info->remaps = mapcache->remaps;
+    info->evictions = mapcache->evictions;
+    info->invalidations = mapcache->invalidations;
     mapcache_unlock();
+    return info;
 }